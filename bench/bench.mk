@@ -1,8 +1,18 @@
 bench_BIN := \
-	bench_lru
+	bench_array \
+	bench_cache \
+	bench_core \
+	bench_lru \
+	bench_resolve \
+	bench_trie \
+	bench_validate
+
+ifeq ($(ENABLE_COOKIES),yes)
+bench_BIN += bench_cookies
+endif
 
 # Dependencies
-bench_DEPEND := $(libkres)
+bench_DEPEND := $(libkres) $(contrib)
 bench_LIBS :=  $(libkres_TARGET) $(libkres_LIBS)
 
 # Platform-specific library injection
@@ -14,22 +24,77 @@ endif
 
 # Make bench binaries
 define make_bench
-$(1)_CFLAGS := -fPIE
-$(1)_SOURCES := bench/$(1).c
-$(1)_LIBS := $(bench_LIBS)
+$(1)_CFLAGS := -fPIE $($(1)_EXTRA_CFLAGS)
+$(1)_SOURCES := bench/$(1).c $($(1)_EXTRA_SOURCES)
+$(1)_LIBS := $(bench_LIBS) $($(1)_EXTRA_LIBS)
 $(1)_DEPEND := $(bench_DEPEND)
 $(call make_bin,$(1),bench)
 endef
 
+# The mock authoritative parses zones and needs the request mempools
+bench_resolve_EXTRA_LIBS := $(contrib_TARGET) $(libzscanner_LIBS)
+
+# The corpus of recorded records is in master files
+bench_validate_EXTRA_LIBS := $(contrib_TARGET) $(libzscanner_LIBS)
+
+# The cache backends of the modules are built in, when available
+bench_cache_EXTRA_LIBS := $(contrib_TARGET)
+ifeq ($(HAS_libmemcached),yes)
+bench_cache_EXTRA_SOURCES += modules/memcached/cdb_memcached.c
+bench_cache_EXTRA_CFLAGS += -DENABLE_MEMCACHED
+bench_cache_EXTRA_LIBS += $(libmemcached_LIBS)
+endif
+ifeq ($(HAS_hiredis),yes)
+bench_cache_EXTRA_SOURCES += modules/redis/cdb_redis.c
+bench_cache_EXTRA_CFLAGS += -DENABLE_REDIS
+bench_cache_EXTRA_LIBS += $(hiredis_LIBS) $(libuv_LIBS)
+endif
+
 $(foreach bench,$(bench_BIN),$(eval $(call make_bench,$(bench))))
 
 # Targets
-.PHONY: bench bench-clean
+.PHONY: bench bench-adversarial bench-clean bench-daemon
 bench-clean: $(foreach bench,$(bench_BIN),$(bench)-clean)
 bench: $(foreach bench,$(bench_BIN),bench/$(bench))
+	@echo "Allocations filling short arrays, array_t versus array_small_t" >&2
+	@./bench/bench_array 1000000 6
+	@./bench/bench_array 1000000 20
+	@echo "The cache layer on LMDB with 100000 names, unbatched and in batches of 64" >&2
+	@./bench/bench_cache 100000 1000000
+	@./bench/bench_cache -B 64 100000 1000000
+	@echo "Core data structures on 100000 names, the same ones for each run" >&2
+	@./bench/bench_core 100000
 	@echo "Test LRU with increasing overfill, misses should increase ~ linearly" >&2
 	@./bench/bench_lru 23 bench/bench_lru_set1.tsv - 65536 # fill ~ 1
 	@./bench/bench_lru 23 bench/bench_lru_set1.tsv - 32768 # fill ~ 2
 	@./bench/bench_lru 23 bench/bench_lru_set1.tsv - 16384 # fill ~ 4
 	@./bench/bench_lru 23 bench/bench_lru_set1.tsv - 8192  # fill ~ 8
 	@./bench/bench_lru 23 bench/bench_lru_set1.tsv - 4096  # fill ~ 16
+	@echo "Test the shared LRU with increasing contention, throughput should scale" >&2
+	@./bench/bench_lru 22 bench/bench_lru_set1.tsv - 65536 1
+	@./bench/bench_lru 22 bench/bench_lru_set1.tsv - 65536 2
+	@./bench/bench_lru 22 bench/bench_lru_set1.tsv - 65536 4
+	@echo "Lookups of socket addresses, map_t versus the trie, with 1000 and 100000 peers" >&2
+	@./bench/bench_trie 4000000 1000
+	@./bench/bench_trie 4000000 100000
+	@echo "Whole resolution against an in-process authoritative, per query mix" >&2
+	@./bench/bench_resolve 20000
+ifneq ($(VALIDATE_CORPUS),)
+	@echo "DNSSEC validation of the recorded records in $(VALIDATE_CORPUS), per algorithm" >&2
+	@./bench/bench_validate $(VALIDATE_CORPUS)
+endif
+ifeq ($(ENABLE_COOKIES),yes)
+	@echo "Cost of DNS cookies per query, with 1000 servers" >&2
+	@./bench/bench_cookies 1000000 1000
+endif
+
+# Worst-case inputs against the budgets of bench/bench_resolve.c, fails when over one
+bench-adversarial: bench/bench_resolve
+	@echo "Adversarial mixes: wide referrals, long CNAME chains, deep names, random subdomains" >&2
+	@./bench/bench_resolve 2000 wide longchain deep flood
+
+# Load test of the installed daemon with a replayed capture, see bench/bench_daemon.py
+#   make bench-daemon CAPTURE=queries.pcap [BENCH_DAEMON_ARGS='--speed 1 -t udp']
+bench-daemon: check-install-precond
+	$(if $(CAPTURE),,$(error CAPTURE=<pcap or dnstap file> is required))
+	@$(preload_syms) python3 bench/bench_daemon.py --kresd $(abspath $(SBINDIR)/kresd) $(BENCH_DAEMON_ARGS) $(CAPTURE)
@@ -0,0 +1,129 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Filling short arrays, as kr_request::answ_selected or the rplan lists:
+ *  - array: array_t, allocating on the first push
+ *  - small: array_small_t with room for 8 elements inside
+ * The lengths are random, below the given maximum.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/generic/array.h"
+
+/** Inline room of the small arrays, as in ranked_rr_array_t. */
+#define INLINE_COUNT 8
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static size_t alloc_count = 0;
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// array_std_reserve(), counting the allocations
+static int counting_reserve(void *baton, char **mem, size_t elm_size, size_t want, size_t *have)
+{
+	if (*have < want)
+		++alloc_count;
+	return array_std_reserve(baton, mem, elm_size, want, have);
+}
+
+static void result_print(const char *what, uint64_t start, size_t array_count)
+{
+	double ns = (double)(time_ns() - start) / array_count;
+	double allocs = (double)alloc_count / array_count;
+	p_err("%-8s allocs per array, ns per array: ", what);
+	p_out("%s,%.2f,%.1f\n", what, allocs, ns);
+	alloc_count = 0;
+}
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s <array_count> <max_len>\n", progname);
+	p_err("Standard output contains csv-formatted lines: case,allocs per array,ns per array.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		usage(argv[0]);
+	const size_t array_count = atol(argv[1]);
+	const size_t max_len = atol(argv[2]);
+	if (array_count == 0 || max_len == 0)
+		usage(argv[0]);
+	srandom(time(NULL));
+
+	unsigned *lens = malloc(sizeof(*lens) * array_count);
+	if (!lens)
+		die("malloc");
+	for (size_t i = 0; i < array_count; ++i)
+		lens[i] = random() % max_len;
+	uintptr_t sum = 0; /* keep the results alive */
+
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < array_count; ++i) {
+		array_t(void *) arr;
+		array_init(arr);
+		for (uintptr_t j = 0; j < lens[i]; ++j) {
+			if (array_push_mm(arr, (void *)j, counting_reserve, NULL) < 0)
+				die("array_push_mm");
+		}
+		sum += arr.len ? (uintptr_t)array_tail(arr) : 0;
+		array_clear(arr);
+	}
+	result_print("array", start, array_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < array_count; ++i) {
+		array_small_t(void *, INLINE_COUNT) arr;
+		array_small_init(arr);
+		for (uintptr_t j = 0; j < lens[i]; ++j) {
+			if (array_small_push_mm(arr, (void *)j, counting_reserve, NULL) < 0)
+				die("array_small_push_mm");
+		}
+		sum += arr.len ? (uintptr_t)array_tail(arr) : 0;
+		array_small_clear_mm(arr, array_std_free, NULL);
+	}
+	result_print("small", start, array_count);
+
+	p_err("(checksum %zu)\n", (size_t)sum);
+	free(lens);
+	return 0;
+}
@@ -0,0 +1,625 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * The cache layer (cache_stash and cache_peek) on a storage backend,
+ * with the records of a signed zone of the given number of names:
+ *  - stash: positive answers, A with RRSIG
+ *  - stash nsec: NXDOMAIN answers, SOA and two NSEC with RRSIGs
+ *  - peek hit: Zipf-distributed queries for the names, exact hits
+ *  - peek nsec: Zipf-distributed queries for names in the NSEC ranges,
+ *    answered by the aggressive use of NSEC
+ *  - gc: one slice of kr_cache_gc() through the whole cache, a pause of the daemon
+ *  - clear: kr_cache_clear() of the filled cache
+ *
+ * The calls to the backend go through a proxy kr_cdb_api, which counts them.
+ * A transaction is counted on a sync after writes (a commit), or after
+ * reads only (a read transaction).  The signatures are not valid, the cache
+ * doesn't check them.
+ *
+ * Standard output contains csv-formatted lines:
+ *  case,operations,ns,reads,writes,bytes written,commits,read transactions
+ * all but the operations per operation.  The peeks that found no answer
+ * are reported on the standard error.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libknot/descriptor.h>
+#include <libknot/rrset.h>
+#include <ucw/mempool.h>
+
+#include "lib/cache/api.h"
+#include "lib/cache/cdb_lmdb.h"
+#include "lib/dnssec/ta.h"
+#include "lib/module.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+#ifdef ENABLE_MEMCACHED
+const struct kr_cdb_api *cdb_memcached(void);
+#endif
+#ifdef ENABLE_REDIS
+#include <uv.h>
+const struct kr_cdb_api *cdb_redis(void);
+#endif
+
+#define TTL 3600
+#define RANK (KR_RANK_SECURE | KR_RANK_AUTH)
+/** The fake signatures, as long as ECDSA P-256 ones. */
+#define SIG_LEN 64
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static const knot_dname_t zone_name[] = "\5bench";
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The counting proxy of the backend.
+ */
+
+struct io_stats {
+	uint64_t reads, writes, bytes, commits, read_txns;
+};
+
+static struct {
+	const struct kr_cdb_api *real;
+	struct io_stats st;
+	bool pending_read, pending_write; /**< Since the last sync */
+} io;
+
+static int io_open(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *mm)
+{
+	return io.real->open(db, opts, mm);
+}
+
+static void io_close(knot_db_t *db)
+{
+	io.real->close(db);
+}
+
+static int io_count(knot_db_t *db)
+{
+	io.pending_read = true;
+	return io.real->count(db);
+}
+
+static int io_clear(knot_db_t *db)
+{
+	io.pending_write = true;
+	return io.real->clear(db);
+}
+
+static int io_sync(knot_db_t *db)
+{
+	if (io.pending_write) {
+		io.st.commits += 1;
+	} else if (io.pending_read) {
+		io.st.read_txns += 1;
+	}
+	io.pending_read = io.pending_write = false;
+	int ret = io.real->sync(db);
+#ifdef ENABLE_REDIS
+	/* The writes to redis are asynchronous, on the loop. */
+	uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+#endif
+	return ret;
+}
+
+static int io_read(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val, int maxcount)
+{
+	io.st.reads += maxcount;
+	io.pending_read = true;
+	return io.real->read(db, key, val, maxcount);
+}
+
+static int io_write(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val, int maxcount)
+{
+	io.st.writes += maxcount;
+	for (int i = 0; i < maxcount; ++i)
+		io.st.bytes += key[i].len + val[i].len;
+	io.pending_write = true;
+	return io.real->write(db, key, val, maxcount);
+}
+
+static int io_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
+{
+	io.st.writes += maxcount;
+	io.pending_write = true;
+	return io.real->remove(db, key, maxcount);
+}
+
+static int io_match(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val, int maxcount)
+{
+	io.st.reads += 1;
+	io.pending_read = true;
+	return io.real->match(db, key, val, maxcount);
+}
+
+static int io_prune(knot_db_t *db, int maxcount)
+{
+	io.pending_write = true;
+	return io.real->prune(db, maxcount);
+}
+
+static int io_read_leq(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val)
+{
+	io.st.reads += 1;
+	io.pending_read = true;
+	return io.real->read_leq(db, key, val);
+}
+
+static int io_walk(knot_db_t *db, knot_db_val_t *key, int maxcount,
+		   kr_cdb_visit_f visit, void *baton)
+{
+	io.st.reads += 1;
+	io.pending_read = true;
+	int ret = io.real->walk(db, key, maxcount, visit, baton);
+	if (ret > 0) {
+		io.st.writes += ret;
+		io.pending_write = true;
+	}
+	return ret;
+}
+
+static double io_usage_percent(knot_db_t *db)
+{
+	return io.real->usage_percent(db);
+}
+
+static const struct kr_cdb_api *io_wrap(const struct kr_cdb_api *real)
+{
+	static struct kr_cdb_api api;
+	io.real = real;
+	api = (struct kr_cdb_api){
+		.name = real->name,
+		.open = io_open, .close = io_close, .count = io_count,
+		.clear = io_clear, .sync = io_sync,
+		.read = io_read, .write = io_write, .remove = io_remove,
+		.match = real->match ? io_match : NULL,
+		.prune = real->prune ? io_prune : NULL,
+		.read_leq = real->read_leq ? io_read_leq : NULL,
+		.walk = real->walk ? io_walk : NULL,
+		.usage_percent = real->usage_percent ? io_usage_percent : NULL,
+	};
+	return &api;
+}
+
+static void result_print(const char *what, uint64_t start, size_t op_count, size_t found)
+{
+	const double ops = op_count;
+	const double ns = (double)(time_ns() - start) / ops;
+	p_err("%-10s %8zu ops ", what, op_count);
+	if (found != op_count)
+		p_err("(%zu not found) ", op_count - found);
+	p_out("%s,%zu,%.1f,%.2f,%.2f,%.1f,%.3f,%.3f\n", what, op_count, ns,
+	      io.st.reads / ops, io.st.writes / ops, io.st.bytes / ops,
+	      io.st.commits / ops, io.st.read_txns / ops);
+	memset(&io.st, 0, sizeof(io.st));
+}
+
+/*
+ * The zone and the requests.
+ */
+
+struct bench {
+	struct kr_context ctx;
+	struct kr_module module;     /**< The cache layer */
+	size_t count;                /**< Number of names in the zone */
+	knot_dname_t (*names)[KNOT_DNAME_MAXLEN]; /**< In the canonical order */
+	knot_dname_t (*nxnames)[KNOT_DNAME_MAXLEN]; /**< Right after each name */
+	double *zipf;                /**< Cumulative distribution of the ranks */
+	unsigned *order;             /**< Rank -> name, a random permutation */
+	struct mempool *mp;          /**< For the requests, flushed after each */
+	knot_mm_t pool;
+	knot_mm_t mm;
+	unsigned batch;              /**< Stashes per kr_cache_batch_begin() */
+	char cache_path[32];
+};
+
+struct lf_sort {
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	unsigned i;
+};
+
+static int lf_cmp(const void *a, const void *b)
+{
+	const uint8_t *x = ((const struct lf_sort *)a)->lf, *y = ((const struct lf_sort *)b)->lf;
+	int ret = memcmp(x + 1, y + 1, MIN(x[0], y[0]));
+	return ret ? ret : (int)x[0] - (int)y[0];
+}
+
+/** The names h<i>.bench. in the canonical order; h<i>-.bench. sorts right after each. */
+static void names_init(struct bench *b)
+{
+	struct lf_sort *sorted = calloc(b->count, sizeof(*sorted));
+	b->names = calloc(b->count, sizeof(b->names[0]));
+	b->nxnames = calloc(b->count, sizeof(b->nxnames[0]));
+	if (!sorted || !b->names || !b->nxnames)
+		die("calloc");
+	for (unsigned i = 0; i < b->count; ++i) {
+		char str[32];
+		sprintf(str, "h%u.bench.", i);
+		if (!knot_dname_from_str(b->names[i], str, KNOT_DNAME_MAXLEN)
+		    || kr_dname_lf(sorted[i].lf, b->names[i], false) != 0)
+			die("name");
+		sorted[i].i = i;
+	}
+	qsort(sorted, b->count, sizeof(*sorted), lf_cmp);
+	for (unsigned i = 0; i < b->count; ++i) {
+		char str[32];
+		sprintf(str, "h%u.bench.", sorted[i].i);
+		knot_dname_from_str(b->names[i], str, KNOT_DNAME_MAXLEN);
+		sprintf(str, "h%u-.bench.", sorted[i].i);
+		knot_dname_from_str(b->nxnames[i], str, KNOT_DNAME_MAXLEN);
+	}
+	free(sorted);
+}
+
+static void zipf_init(struct bench *b, double exponent)
+{
+	b->zipf = calloc(b->count, sizeof(b->zipf[0]));
+	b->order = calloc(b->count, sizeof(b->order[0]));
+	if (!b->zipf || !b->order)
+		die("calloc");
+	double sum = 0;
+	for (size_t i = 0; i < b->count; ++i) {
+		sum += 1 / pow(i + 1, exponent);
+		b->zipf[i] = sum;
+		b->order[i] = i;
+	}
+	for (size_t i = 0; i < b->count; ++i)
+		b->zipf[i] /= sum;
+	for (size_t i = b->count - 1; i > 0; --i) {
+		size_t j = random() % (i + 1);
+		unsigned tmp = b->order[i];
+		b->order[i] = b->order[j];
+		b->order[j] = tmp;
+	}
+}
+
+/** Index of a name, Zipf-distributed. */
+static unsigned zipf_next(const struct bench *b)
+{
+	const double u = (double)random() / RAND_MAX;
+	size_t lo = 0, hi = b->count - 1;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (b->zipf[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return b->order[lo];
+}
+
+/** Start a request for the query, as the iterator has it in the layers. */
+static knot_pkt_t *request_begin(struct bench *b, struct kr_request *req, kr_layer_t *layer,
+				 const knot_dname_t *qname, uint16_t qtype)
+{
+	mp_flush(b->mp);
+	memset(req, 0, sizeof(*req));
+	req->pool = b->pool;
+	knot_pkt_t *answer = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &req->pool);
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &req->pool);
+	if (!answer || !pkt || knot_pkt_put_question(pkt, qname, KNOT_CLASS_IN, qtype) != 0)
+		die("knot_pkt_new");
+	kr_resolve_begin(req, &b->ctx, answer);
+	struct kr_query *qry = kr_rplan_push(&req->rplan, NULL, qname, KNOT_CLASS_IN, qtype);
+	if (!qry)
+		die("kr_rplan_push");
+	qry->flags.DNSSEC_WANT = true;
+	req->current_query = qry;
+	layer->state = KR_STATE_CONSUME;
+	layer->req = req;
+	layer->api = b->module.layer(&b->module);
+	return pkt;
+}
+
+static void add_rr(struct kr_request *req, ranked_rr_array_t *arr, const knot_dname_t *owner,
+		   uint16_t type, const uint8_t *rdata, uint16_t rdlen)
+{
+	knot_rrset_t *rr = knot_rrset_new(owner, type, KNOT_CLASS_IN, &req->pool);
+	if (!rr || knot_rrset_add_rdata(rr, rdata, rdlen, TTL, &req->pool) != 0
+	    || kr_ranked_rrarray_add(arr, rr, RANK, true, req->current_query->uid,
+				     &req->pool) != 0)
+		die("add_rr");
+}
+
+/** Add the record and its RRSIG by the zone. */
+static void add_signed(struct kr_request *req, ranked_rr_array_t *arr,
+		       const knot_dname_t *owner, uint16_t type,
+		       const uint8_t *rdata, uint16_t rdlen)
+{
+	add_rr(req, arr, owner, type, rdata, rdlen);
+	uint8_t sig[18 + sizeof(zone_name) + SIG_LEN] = { 0 };
+	const uint32_t now = time(NULL);
+	uint8_t *p = sig;
+	knot_wire_write_u16(p, type);
+	p[2] = 13; /* ECDSAP256SHA256 */
+	p[3] = knot_dname_labels(owner, NULL);
+	knot_wire_write_u32(p + 4, TTL);
+	knot_wire_write_u32(p + 8, now + 30 * 86400);  /* expiration */
+	knot_wire_write_u32(p + 12, now - 86400);      /* inception */
+	knot_wire_write_u16(p + 16, 12345);            /* key tag */
+	memcpy(p + 18, zone_name, sizeof(zone_name));
+	add_rr(req, arr, owner, KNOT_RRTYPE_RRSIG, sig, sizeof(sig));
+}
+
+/** Add the NSEC of the owner, pointing to the next name; with the types of a name or of the apex. */
+static void add_nsec(struct kr_request *req, const knot_dname_t *owner, const knot_dname_t *next)
+{
+	/* A RRSIG NSEC, or NS SOA RRSIG NSEC DNSKEY. */
+	static const uint8_t bitmap_name[] = { 0, 6, 0x40, 0, 0, 0, 0, 0x03 };
+	static const uint8_t bitmap_apex[] = { 0, 7, 0x22, 0, 0, 0, 0, 0x03, 0x80 };
+	const bool apex = knot_dname_is_equal(owner, zone_name);
+	const uint8_t *bitmap = apex ? bitmap_apex : bitmap_name;
+	const int bitmap_len = apex ? sizeof(bitmap_apex) : sizeof(bitmap_name);
+	uint8_t rdata[KNOT_DNAME_MAXLEN + sizeof(bitmap_apex)];
+	const int next_len = knot_dname_size(next);
+	memcpy(rdata, next, next_len);
+	memcpy(rdata + next_len, bitmap, bitmap_len);
+	add_signed(req, &req->auth_selected, owner, KNOT_RRTYPE_NSEC, rdata, next_len + bitmap_len);
+}
+
+static void add_soa(struct kr_request *req, ranked_rr_array_t *arr)
+{
+	uint8_t rdata[64];
+	const knot_dname_t *mname = (const uint8_t *)"\2ns\5bench", *rname = (const uint8_t *)"\4host\5bench";
+	int len = knot_dname_size(mname);
+	memcpy(rdata, mname, len);
+	memcpy(rdata + len, rname, knot_dname_size(rname));
+	len += knot_dname_size(rname);
+	const uint32_t fields[] = { 1, 3600, 600, 86400, TTL };
+	for (int i = 0; i < 5; ++i, len += 4)
+		knot_wire_write_u32(rdata + len, fields[i]);
+	add_signed(req, arr, zone_name, KNOT_RRTYPE_SOA, rdata, len);
+}
+
+/** The apex records: SOA, NS and the apex NSEC. */
+static void stash_apex(struct bench *b)
+{
+	struct kr_request req;
+	kr_layer_t layer;
+	knot_pkt_t *pkt = request_begin(b, &req, &layer, zone_name, KNOT_RRTYPE_SOA);
+	knot_wire_set_aa(pkt->wire);
+	add_soa(&req, &req.answ_selected);
+	const knot_dname_t *ns = (const uint8_t *)"\2ns\5bench";
+	add_signed(&req, &req.auth_selected, zone_name, KNOT_RRTYPE_NS, ns, knot_dname_size(ns));
+	add_nsec(&req, zone_name, b->names[0]);
+	layer.api->consume(&layer, pkt);
+}
+
+static void stash_name(struct bench *b, size_t i)
+{
+	struct kr_request req;
+	kr_layer_t layer;
+	knot_pkt_t *pkt = request_begin(b, &req, &layer, b->names[i], KNOT_RRTYPE_A);
+	knot_wire_set_aa(pkt->wire);
+	const uint8_t addr[4] = { 192, 0, 2, i % 256 };
+	add_signed(&req, &req.answ_selected, b->names[i], KNOT_RRTYPE_A, addr, sizeof(addr));
+	layer.api->consume(&layer, pkt);
+}
+
+/** NXDOMAIN for the name after the i-th one, the proof as from an authoritative. */
+static void stash_nxdomain(struct bench *b, size_t i)
+{
+	struct kr_request req;
+	kr_layer_t layer;
+	knot_pkt_t *pkt = request_begin(b, &req, &layer, b->nxnames[i], KNOT_RRTYPE_A);
+	knot_wire_set_aa(pkt->wire);
+	knot_wire_set_rcode(pkt->wire, KNOT_RCODE_NXDOMAIN);
+	add_soa(&req, &req.auth_selected);
+	add_nsec(&req, b->names[i], i + 1 < b->count ? b->names[i + 1] : zone_name);
+	add_nsec(&req, zone_name, b->names[0]); /* no wildcard */
+	layer.api->consume(&layer, pkt);
+}
+
+static bool peek(struct bench *b, const knot_dname_t *qname)
+{
+	struct kr_request req;
+	kr_layer_t layer;
+	knot_pkt_t *pkt = request_begin(b, &req, &layer, qname, KNOT_RRTYPE_A);
+	layer.state = KR_STATE_PRODUCE;
+	return layer.api->produce(&layer, pkt) == KR_STATE_DONE;
+}
+
+static void bench_init(struct bench *b, const char *backend, const char *conf, size_t mbytes)
+{
+	const struct kr_cdb_api *api = NULL;
+	if (strcmp(backend, "lmdb") == 0) {
+		api = kr_cdb_lmdb();
+#ifdef ENABLE_MEMCACHED
+	} else if (strcmp(backend, "memcached") == 0) {
+		api = cdb_memcached();
+#endif
+#ifdef ENABLE_REDIS
+	} else if (strcmp(backend, "redis") == 0) {
+		api = cdb_redis();
+#endif
+	} else {
+		errno = ENOTSUP;
+		die(backend);
+	}
+	if (!conf) {
+		strcpy(b->cache_path, "/tmp/bench_cache.XXXXXX");
+		if (api == kr_cdb_lmdb() && !mkdtemp(b->cache_path))
+			die("mkdtemp");
+		conf = b->cache_path;
+	}
+
+	mm_ctx_init(&b->mm);
+	struct kr_context *ctx = &b->ctx;
+	ctx->pool = &b->mm;
+	ctx->trust_anchors = map_make(NULL);
+	ctx->negative_anchors = map_make(NULL);
+	struct kr_cdb_opts opts = { conf, mbytes * 1024 * 1024 };
+	if (kr_cache_open(&ctx->cache, io_wrap(api), &opts, &b->mm) != 0)
+		die("kr_cache_open");
+	if (kr_module_load(&b->module, "cache", NULL) != 0)
+		die("kr_module_load");
+	b->mp = mp_new(16 * 1024);
+	b->pool.ctx = b->mp;
+	b->pool.alloc = (knot_mm_alloc_t) mp_alloc;
+}
+
+static void bench_deinit(struct bench *b)
+{
+	kr_module_unload(&b->module);
+	kr_cache_close(&b->ctx.cache);
+	if (io.real == kr_cdb_lmdb() && b->cache_path[0]) {
+		char file[sizeof(b->cache_path) + 16];
+		snprintf(file, sizeof(file), "%s/data.mdb", b->cache_path);
+		unlink(file);
+		snprintf(file, sizeof(file), "%s/lock.mdb", b->cache_path);
+		unlink(file);
+		rmdir(b->cache_path);
+	}
+	kr_ta_clear(&b->ctx.trust_anchors);
+	kr_ta_clear(&b->ctx.negative_anchors);
+	mp_delete(b->mp);
+	free(b->order);
+	free(b->zipf);
+	free(b->nxnames);
+	free(b->names);
+}
+
+/** Run the stashes, in batches of kr_cache_batch_begin() if asked to. */
+static void run_stash(struct bench *b, void (*stash)(struct bench *, size_t), const char *what)
+{
+	memset(&io.st, 0, sizeof(io.st));
+	const uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		if (i % b->batch == 0)
+			kr_cache_batch_begin(&b->ctx.cache);
+		stash(b, i);
+		if (i % b->batch == b->batch - 1 || i + 1 == b->count)
+			kr_cache_batch_end(&b->ctx.cache);
+	}
+	result_print(what, start, b->count, b->count);
+}
+
+static void run_peek(struct bench *b, size_t peek_count, bool nx, const char *what)
+{
+	memset(&io.st, 0, sizeof(io.st));
+	size_t found = 0;
+	const uint64_t start = time_ns();
+	for (size_t i = 0; i < peek_count; ++i) {
+		const unsigned j = zipf_next(b);
+		found += peek(b, nx ? b->nxnames[j] : b->names[j]);
+	}
+	result_print(what, start, peek_count, found);
+}
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s [-b backend] [-c config] [-s MB] [-B batch] [-z exponent]"
+	      " <name_count> <peek_count>\n", progname);
+	p_err("Backends: lmdb"
+#ifdef ENABLE_MEMCACHED
+	      " memcached"
+#endif
+#ifdef ENABLE_REDIS
+	      " redis"
+#endif
+	      "; the config is as for cache.open(), a temporary directory for lmdb.\n");
+	p_err("Standard output contains csv-formatted lines, per operation:\n"
+	      "case,operations,ns,reads,writes,bytes written,commits,read transactions\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *backend = "lmdb", *conf = NULL;
+	size_t mbytes = 1024;
+	unsigned batch = 1;
+	double exponent = 1.0;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:s:B:z:")) != -1) {
+		switch (opt) {
+		case 'b': backend = optarg; break;
+		case 'c': conf = optarg; break;
+		case 's': mbytes = atol(optarg); break;
+		case 'B': batch = atoi(optarg); break;
+		case 'z': exponent = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || batch == 0 || mbytes == 0)
+		usage(argv[0]);
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	b.count = atol(argv[optind]);
+	const size_t peek_count = atol(argv[optind + 1]);
+	if (b.count == 0 || peek_count == 0)
+		usage(argv[0]);
+	b.batch = batch;
+	srandom(1);
+
+	names_init(&b);
+	zipf_init(&b, exponent);
+	bench_init(&b, backend, conf, mbytes);
+	p_err("%s, %zu names, batches of %u, Zipf exponent %.2f\n",
+	      io.real->name, b.count, b.batch, exponent);
+
+	stash_apex(&b);
+	run_stash(&b, stash_name, "stash");
+	run_stash(&b, stash_nxdomain, "stash nsec");
+	run_peek(&b, peek_count, false, "peek hit");
+	run_peek(&b, peek_count, true, "peek nsec");
+
+	uint64_t start = time_ns();
+	int ret = kr_cache_gc(&b.ctx.cache, 4 * b.count);
+	if (ret >= 0) {
+		result_print("gc", start, 1, 1);
+	} else {
+		p_err("gc         not supported by %s\n", io.real->name);
+	}
+	start = time_ns();
+	if (kr_cache_clear(&b.ctx.cache) != 0)
+		die("kr_cache_clear");
+	result_print("clear", start, 1, 1);
+
+	bench_deinit(&b);
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*  Copyright (C) 2016-2017 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * CPU cost of the DNS cookies per query, for each algorithm:
+ *  - off: the same loop without any cookie work
+ *  - client: the client cookie computed for every query
+ *  - client cached: the client cookie from the cookie cache, see kr_cookie_cc_get()
+ *  - server: the server cookie of an answer, computed for every query
+ */
+
+#include <assert.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "daemon/engine.h"
+#include "lib/cookies/alg_containers.h"
+#include "lib/cookies/helper.h"
+#include "lib/cookies/lru_cache.h"
+#include "lib/cookies/nonce.h"
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void time_print(const char *alg, const char *what, uint64_t start, size_t op_count)
+{
+	double ns = (double)(time_ns() - start) / op_count;
+	p_err("%-16s %-14s ", alg, what);
+	p_out("%s,%s,%.1f\n", alg, what, ns);
+}
+
+/// random IPv4 and IPv6 addresses, half of each
+static struct sockaddr_storage *make_addrs(size_t count)
+{
+	struct sockaddr_storage *addrs = calloc(count, sizeof(*addrs));
+	if (!addrs)
+		die("calloc");
+	for (size_t i = 0; i < count; ++i) {
+		if (i % 2) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addrs[i];
+			sin6->sin6_family = AF_INET6;
+			for (int j = 0; j < 16; ++j)
+				sin6->sin6_addr.s6_addr[j] = random();
+		} else {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[i];
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = random();
+		}
+	}
+	return addrs;
+}
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s <query_count> <server_count>\n", progname);
+	p_err("Standard output contains csv-formatted lines: algorithm,case,ns per query.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		usage(argv[0]);
+	const size_t run_count = atol(argv[1]);
+	const size_t addr_count = atol(argv[2]);
+	if (run_count == 0 || addr_count == 0)
+		usage(argv[0]);
+	srandom(time(NULL));
+
+	struct sockaddr_storage *addrs = make_addrs(addr_count);
+	/* The order of the queries, not to measure just the prefetcher. */
+	unsigned *order = malloc(sizeof(*order) * run_count);
+	if (!order)
+		die("malloc");
+	for (size_t i = 0; i < run_count; ++i)
+		order[i] = random() % addr_count;
+
+	struct kr_cookie_secret *secret = malloc(sizeof(*secret) + 16);
+	if (!secret)
+		die("malloc");
+	secret->size = 16;
+	for (int i = 0; i < 16; ++i)
+		secret->data[i] = random();
+
+	kr_cookie_lru_t *lru;
+	lru_create(&lru, LRU_COOKIES_SIZE, NULL, NULL);
+	if (!lru)
+		die("lru_create");
+
+	uint8_t cc[KNOT_OPT_COOKIE_CLNT], sc[KNOT_OPT_COOKIE_SRVR_MAX];
+	uint8_t sum = 0; /* keep the results alive */
+
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < run_count; ++i)
+		sum += ((const uint8_t *)&addrs[order[i]])[4];
+	time_print("-", "off", start, run_count);
+
+	for (const knot_lookup_t *alg = kr_cc_alg_names; alg->name; ++alg) {
+		struct kr_cookie_comp comp = { .secr = secret, .alg_id = alg->id, .gen = 1 };
+
+		start = time_ns();
+		for (size_t i = 0; i < run_count; ++i) {
+			const struct sockaddr *sa = (const struct sockaddr *)&addrs[order[i]];
+			if (kr_cookie_cc_get(&comp, NULL, NULL, sa, cc) != 0)
+				die("client cookie");
+			sum += cc[0];
+		}
+		time_print(alg->name, "client", start, run_count);
+
+		lru_reset(lru);
+		start = time_ns();
+		for (size_t i = 0; i < run_count; ++i) {
+			const struct sockaddr *sa = (const struct sockaddr *)&addrs[order[i]];
+			if (kr_cookie_cc_get(&comp, lru, NULL, sa, cc) != 0)
+				die("client cookie");
+			sum += cc[0];
+		}
+		time_print(alg->name, "client cached", start, run_count);
+	}
+
+	for (const knot_lookup_t *alg = kr_sc_alg_names; alg->name; ++alg) {
+		const struct knot_sc_alg *sc_alg = kr_sc_alg_get(alg->id);
+		assert(sc_alg);
+		struct kr_nonce_input nonce = { .rand = random(), .time = time(NULL) };
+		uint8_t nonce_wire[KR_NONCE_LEN];
+		kr_nonce_write_wire(nonce_wire, sizeof(nonce_wire), &nonce);
+
+		start = time_ns();
+		for (size_t i = 0; i < run_count; ++i) {
+			struct knot_sc_private srvr_data = {
+				.clnt_sockaddr = (const struct sockaddr *)&addrs[order[i]],
+				.secret_data = secret->data,
+				.secret_len = secret->size
+			};
+			struct knot_sc_input sc_input = {
+				.cc = cc,
+				.cc_len = sizeof(cc),
+				.nonce = nonce_wire,
+				.nonce_len = sizeof(nonce_wire),
+				.srvr_data = &srvr_data
+			};
+			if (sc_alg->hash_func(&sc_input, sc, sc_alg->hash_size) == 0)
+				die("server cookie");
+			sum += sc[0];
+		}
+		time_print(alg->name, "server", start, run_count);
+	}
+
+	p_err("(checksum %u)\n", sum);
+	lru_free(lru);
+	free(secret);
+	free(order);
+	free(addrs);
+	return 0;
+}
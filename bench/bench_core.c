@@ -0,0 +1,412 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Microbenchmarks of the core data structures, on the same set of names:
+ *  - trie_t insert, get and get_leq on the lookup format of the names
+ *  - map_t set and get on the wire format (it's a C string)
+ *  - pack_t and array_t filled as in zone cuts and kr_request
+ *  - kr_rrkey() and kr_dname_lf() conversions
+ *  - kr_ranked_rrarray_add(), as the iterator selects records, and on a huge
+ *    response (512 owners with two records each, as in big NS or NSEC3 sets)
+ *  - the cache entries: kr_cache_insert_rr() splices NS into the entry
+ *    (entry_h_splice) and kr_cache_peek_exact() seeks it (entry_h_seek)
+ *
+ * The names come from random() with a fixed seed, so runs are comparable.
+ * Standard output contains csv-formatted lines: case,operations,ns per operation.
+ * The cases to run can be selected by (prefixes of) their names.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libknot/descriptor.h>
+#include <libknot/rrset.h>
+
+#include "lib/cache/api.h"
+#include "lib/cache/cdb_lmdb.h"
+#include "lib/generic/array.h"
+#include "lib/generic/map.h"
+#include "lib/generic/pack.h"
+#include "lib/generic/trie.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+/** The data shared by all the cases. */
+struct bench {
+	size_t count;          /**< Number of names */
+	knot_dname_t (*names)[KNOT_DNAME_MAXLEN];
+	uint8_t (*lfs)[KNOT_DNAME_MAXLEN + 1]; /**< kr_dname_lf() of the names */
+	unsigned *order;       /**< Random permutation for the lookups */
+	knot_mm_t mm;
+	uintptr_t sum;         /**< Keep the results alive */
+};
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void time_print(const char *what, uint64_t start, size_t op_count)
+{
+	double ns = (double)(time_ns() - start) / op_count;
+	p_err("%-20s %10zu ops ", what, op_count);
+	p_out("%s,%zu,%.1f\n", what, op_count, ns);
+}
+
+/// random name of 2-4 labels under a few TLDs, lower-case
+static void make_name(knot_dname_t *dst)
+{
+	static const char *tlds[] = { "\3com", "\3net", "\3org", "\2cz" };
+	const int labels = 1 + random() % 3;
+	for (int i = 0; i < labels; ++i) {
+		const int len = 3 + random() % 10;
+		*dst++ = len;
+		for (int j = 0; j < len; ++j)
+			*dst++ = 'a' + random() % 26;
+	}
+	strcpy((char *)dst, tlds[random() % 4]);
+}
+
+static void bench_init(struct bench *b, size_t count)
+{
+	memset(b, 0, sizeof(*b));
+	b->count = count;
+	b->names = calloc(count, sizeof(b->names[0]));
+	b->lfs = calloc(count, sizeof(b->lfs[0]));
+	b->order = calloc(count, sizeof(b->order[0]));
+	if (!b->names || !b->lfs || !b->order)
+		die("calloc");
+	for (size_t i = 0; i < count; ++i) {
+		make_name(b->names[i]);
+		if (kr_dname_lf(b->lfs[i], b->names[i], false) != 0)
+			die("kr_dname_lf");
+		b->order[i] = i;
+	}
+	for (size_t i = count - 1; i > 0; --i) {
+		size_t j = random() % (i + 1);
+		unsigned tmp = b->order[i];
+		b->order[i] = b->order[j];
+		b->order[j] = tmp;
+	}
+	mm_ctx_init(&b->mm);
+}
+
+static void bench_deinit(struct bench *b)
+{
+	p_err("(checksum %zu)\n", (size_t)b->sum);
+	free(b->order);
+	free(b->lfs);
+	free(b->names);
+}
+
+#define LF_KEY(b, i) (const char *)(b)->lfs[i] + 1, (b)->lfs[i][0]
+
+static void case_trie(struct bench *b)
+{
+	trie_t *trie = trie_create(NULL);
+	if (!trie)
+		die("trie_create");
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		trie_val_t *val = trie_get_ins(trie, LF_KEY(b, i));
+		if (!val)
+			die("trie_get_ins");
+		*val = (void *)(uintptr_t)(i + 1);
+	}
+	time_print("trie_insert", start, b->count);
+
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		trie_val_t *val = trie_get_try(trie, LF_KEY(b, b->order[i]));
+		b->sum += (uintptr_t)*val;
+	}
+	time_print("trie_get", start, b->count);
+
+	/* Longer keys than the inserted ones, as closest-zone searches. */
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		const uint8_t *lf = b->lfs[b->order[i]];
+		char key[KNOT_DNAME_MAXLEN + 4];
+		memcpy(key, lf + 1, lf[0]);
+		memcpy(key + lf[0], "www", 3);
+		trie_val_t *val;
+		const int ret = trie_get_leq(trie, key, lf[0] + 3, &val);
+		if (ret < 0 && ret != KNOT_ENOENT)
+			die("trie_get_leq");
+		b->sum += val ? (uintptr_t)*val : 0;
+	}
+	time_print("trie_get_leq", start, b->count);
+	trie_free(trie);
+}
+
+static void case_map(struct bench *b)
+{
+	map_t map = map_make(NULL);
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		if (map_set(&map, (const char *)b->names[i], (void *)(uintptr_t)(i + 1)) != 0)
+			die("map_set");
+	}
+	time_print("map_set", start, b->count);
+
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i)
+		b->sum += (uintptr_t)map_get(&map, (const char *)b->names[b->order[i]]);
+	time_print("map_get", start, b->count);
+	map_clear(&map);
+}
+
+/** Address sets of 2 IPv4 and 2 IPv6 addresses, as in zone cuts. */
+static void case_pack(struct bench *b)
+{
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		const uint8_t *addr = b->lfs[i] + 1; /* any bytes do */
+		pack_t pack;
+		pack_init(pack);
+		for (int j = 0; j < 4; ++j) {
+			const int len = j % 2 ? 16 : 4;
+			if (pack_reserve_mm(pack, 1, len, kr_memreserve, &b->mm) != 0
+			    || pack_obj_push(&pack, addr + j, len) != 0)
+				die("pack_obj_push");
+		}
+		b->sum += (uintptr_t)pack_obj_find(&pack, addr + 3, 16);
+		pack_clear_mm(pack, mm_free, &b->mm);
+	}
+	time_print("pack_push_find", start, b->count);
+}
+
+/** Arrays of 6 entries, as kr_request::answ_selected in most requests. */
+static void case_array(struct bench *b)
+{
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		array_t(void *) arr;
+		array_init(arr);
+		for (size_t j = 0; j < 6; ++j) {
+			if (array_push_mm(arr, b->names[i], kr_memreserve, &b->mm) < 0)
+				die("array_push_mm");
+		}
+		b->sum += arr.len;
+		array_clear_mm(arr, mm_free, &b->mm);
+	}
+	time_print("array_push", start, b->count);
+
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		array_small_t(void *, 8) arr;
+		array_small_init(arr);
+		for (size_t j = 0; j < 6; ++j) {
+			if (array_small_push_mm(arr, b->names[i], kr_memreserve, &b->mm) < 0)
+				die("array_small_push_mm");
+		}
+		b->sum += arr.len;
+		array_small_clear_mm(arr, mm_free, &b->mm);
+	}
+	time_print("array_small_push", start, b->count);
+}
+
+static void case_convert(struct bench *b)
+{
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		char key[KR_RRKEY_LEN];
+		int ret = kr_rrkey(key, KNOT_CLASS_IN, b->names[b->order[i]], KNOT_RRTYPE_A, 0);
+		if (ret <= 0)
+			die("kr_rrkey");
+		b->sum += ret;
+	}
+	time_print("kr_rrkey", start, b->count);
+
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+		if (kr_dname_lf(lf, b->names[b->order[i]], false) != 0)
+			die("kr_dname_lf");
+		b->sum += lf[0];
+	}
+	time_print("dname_lf", start, b->count);
+}
+
+/** Select 6 records per request: 4 owners, one of them with 3 records to merge. */
+static void case_ranked(struct bench *b)
+{
+	uint8_t addr[4] = { 192, 0, 2, 1 };
+	uint64_t start = time_ns();
+	for (size_t i = 0; i + 4 <= b->count; i += 4) {
+		ranked_rr_array_t arr;
+		kr_ranked_rrarray_init(arr);
+		for (int j = 0; j < 6; ++j) {
+			knot_rrset_t rr;
+			knot_rrset_init(&rr, b->names[i + MIN(j, 3)], KNOT_RRTYPE_A, KNOT_CLASS_IN);
+			addr[3] = j;
+			if (knot_rrset_add_rdata(&rr, addr, sizeof(addr), 300, &b->mm) != 0
+			    || kr_ranked_rrarray_add(&arr, &rr, KR_RANK_INITIAL, true, 1, &b->mm) != 0)
+				die("kr_ranked_rrarray_add");
+			knot_rdataset_clear(&rr.rrs, &b->mm);
+		}
+		b->sum += arr.len;
+		for (size_t j = 0; j < arr.len; ++j) {
+			knot_rrset_free(&arr.at[j]->rr, &b->mm);
+			mm_free(&b->mm, arr.at[j]);
+		}
+		array_small_clear_mm(arr, mm_free, &b->mm);
+	}
+	time_print("ranked_rrarray_add", start, b->count / 4 * 6);
+
+	/* The huge responses, the records come one by one and alternate owners. */
+	enum { OWNERS = 512 };
+	start = time_ns();
+	size_t ops = 0;
+	for (size_t i = 0; i + OWNERS <= b->count; i += OWNERS) {
+		ranked_rr_array_t arr;
+		kr_ranked_rrarray_init(arr);
+		for (int j = 0; j < 2 * OWNERS; ++j) {
+			knot_rrset_t rr;
+			knot_rrset_init(&rr, b->names[i + j % OWNERS], KNOT_RRTYPE_A, KNOT_CLASS_IN);
+			addr[3] = j / OWNERS;
+			if (knot_rrset_add_rdata(&rr, addr, sizeof(addr), 300, &b->mm) != 0
+			    || kr_ranked_rrarray_add(&arr, &rr, KR_RANK_INITIAL, true, 1, &b->mm) != 0)
+				die("kr_ranked_rrarray_add");
+			knot_rdataset_clear(&rr.rrs, &b->mm);
+		}
+		b->sum += arr.len;
+		ops += 2 * OWNERS;
+		for (size_t j = 0; j < arr.len; ++j) {
+			knot_rrset_free(&arr.at[j]->rr, &b->mm);
+			mm_free(&b->mm, arr.at[j]);
+		}
+		mm_free(&b->mm, arr.index);
+		array_small_clear_mm(arr, mm_free, &b->mm);
+	}
+	if (ops > 0)
+		time_print("ranked_rrarray_add_huge", start, ops);
+}
+
+/** NS records into a scratch LMDB cache and back. */
+static void case_cache(struct bench *b)
+{
+	char path[] = "/tmp/bench_core.XXXXXX";
+	if (!mkdtemp(path))
+		die("mkdtemp");
+	struct kr_cache cache;
+	memset(&cache, 0, sizeof(cache));
+	struct kr_cdb_opts opts = { path, 512 * 1024 * 1024 };
+	if (kr_cache_open(&cache, kr_cdb_lmdb(), &opts, &b->mm) != 0)
+		die("kr_cache_open");
+	const uint32_t now = time(NULL);
+
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		knot_rrset_t rr;
+		knot_rrset_init(&rr, b->names[i], KNOT_RRTYPE_NS, KNOT_CLASS_IN);
+		/* NS to itself, the rdata is just a (non-compressed) name */
+		if (knot_rrset_add_rdata(&rr, b->names[i], knot_dname_size(b->names[i]),
+					 3600, &b->mm) != 0
+		    || kr_cache_insert_rr(&cache, &rr, NULL, KR_RANK_AUTH, now) != 0)
+			die("kr_cache_insert_rr");
+		knot_rdataset_clear(&rr.rrs, &b->mm);
+		if (i % 1000 == 999)
+			kr_cache_sync(&cache);
+	}
+	kr_cache_sync(&cache);
+	time_print("cache_insert_ns", start, b->count);
+
+	start = time_ns();
+	for (size_t i = 0; i < b->count; ++i) {
+		struct kr_cache_p peek;
+		if (kr_cache_peek_exact(&cache, b->names[b->order[i]], KNOT_RRTYPE_NS, &peek) != 0)
+			die("kr_cache_peek_exact");
+		b->sum += peek.rank;
+	}
+	kr_cache_sync(&cache);
+	time_print("cache_peek_ns", start, b->count);
+
+	kr_cache_close(&cache);
+	char file[sizeof(path) + 16];
+	snprintf(file, sizeof(file), "%s/data.mdb", path);
+	unlink(file);
+	snprintf(file, sizeof(file), "%s/lock.mdb", path);
+	unlink(file);
+	rmdir(path);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(struct bench *b);
+} cases[] = {
+	{ "trie", case_trie },
+	{ "map", case_map },
+	{ "pack", case_pack },
+	{ "array", case_array },
+	{ "convert", case_convert },
+	{ "ranked", case_ranked },
+	{ "cache", case_cache },
+};
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s <name_count> [seed] [case...]\n", progname);
+	p_err("Cases:");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+		p_err(" %s", cases[i].name);
+	p_err("\nStandard output contains csv-formatted lines: case,operations,ns per operation.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+	const size_t count = atol(argv[1]);
+	if (count < 4)
+		usage(argv[0]);
+	srandom(argc > 2 ? atol(argv[2]) : 1);
+
+	struct bench b;
+	bench_init(&b, count);
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		bool selected = argc <= 3;
+		for (int j = 3; j < argc && !selected; ++j)
+			selected = strncmp(cases[i].name, argv[j], strlen(argv[j])) == 0;
+		if (selected)
+			cases[i].run(&b);
+	}
+	bench_deinit(&b);
+	return 0;
+}
@@ -0,0 +1,529 @@
+#!/usr/bin/env python3
+"""
+Replay the DNS queries from a capture against kresd over UDP, TCP or TLS.
+
+The capture is a pcap or pcapng file (queries to port 53 over UDP or over TCP)
+or a dnstap Frame Streams file (CLIENT_QUERY messages).  The queries are sent
+as captured, only with new message IDs, by a window of concurrent senders:
+as fast as the resolver answers, or paced by the capture timestamps (--speed).
+
+With --kresd, a scratch instance of the daemon is started in a temporary
+run directory; otherwise a running one is the target (--server) and its
+control socket may be given with --control.  The deltas of worker.stats()
+and cache.stats() over the run are read through the control socket.
+
+Standard output contains csv-formatted lines:
+ transport,queries,answered,timeouts,qps,p50 ms,p90 ms,p99 ms,max ms
+followed by "stats,<name>,<delta>" lines.  Only the Python standard library
+is used.
+"""
+
+import argparse
+import asyncio
+import collections
+import json
+import os
+import shutil
+import signal
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+DNS_PORT = 53
+HEADER_LEN = 12
+
+
+def log(*args, **kwargs):
+    print(*args, file=sys.stderr, **kwargs)
+
+
+# Captures
+
+def ip_payload(packet):
+    """Return (protocol, destination port, payload) of an IPv4/IPv6 packet."""
+    if len(packet) < 20:
+        return None
+    version = packet[0] >> 4
+    if version == 4:
+        ihl = (packet[0] & 0x0f) * 4
+        proto = packet[9]
+        total = struct.unpack('!H', packet[2:4])[0]
+        l4 = packet[ihl:total] if total >= ihl else packet[ihl:]
+        if struct.unpack('!H', packet[6:8])[0] & 0x1fff:
+            return None  # a non-first fragment
+    elif version == 6 and len(packet) >= 40:
+        proto = packet[6]
+        l4 = packet[40:]
+    else:
+        return None
+    if proto == socket.IPPROTO_UDP and len(l4) >= 8:
+        return 'udp', struct.unpack('!H', l4[2:4])[0], l4[8:]
+    if proto == socket.IPPROTO_TCP and len(l4) >= 20:
+        offset = (l4[12] >> 4) * 4
+        return 'tcp', struct.unpack('!H', l4[2:4])[0], l4[offset:]
+    return None
+
+
+def link_payload(linktype, frame):
+    """Strip the link layer header, return the IP packet or None."""
+    if linktype == 1:  # Ethernet, with 802.1Q tags
+        offset, ethertype = 14, struct.unpack('!H', frame[12:14])[0]
+        while ethertype in (0x8100, 0x88a8) and len(frame) >= offset + 4:
+            ethertype = struct.unpack('!H', frame[offset + 2:offset + 4])[0]
+            offset += 4
+        return frame[offset:] if ethertype in (0x0800, 0x86dd) else None
+    if linktype in (101, 228, 229):  # raw IP
+        return frame
+    if linktype == 113:  # Linux cooked
+        return frame[16:]
+    if linktype == 276:  # Linux cooked v2
+        return frame[20:]
+    if linktype in (0, 108):  # BSD loopback
+        return frame[4:]
+    return None
+
+
+def dns_queries(linktype, frame, port):
+    """Yield the queries in the frame sent to the port."""
+    packet = link_payload(linktype, frame)
+    parsed = ip_payload(packet) if packet else None
+    if not parsed or parsed[1] != port:
+        return
+    proto, _, payload = parsed
+    messages = []
+    if proto == 'udp':
+        messages.append(payload)
+    else:
+        # Only whole messages within a segment, as the usual clients send them.
+        while len(payload) >= 2:
+            length = struct.unpack('!H', payload[:2])[0]
+            if length == 0 or len(payload) < 2 + length:
+                break
+            messages.append(payload[2:2 + length])
+            payload = payload[2 + length:]
+    for msg in messages:
+        if len(msg) >= HEADER_LEN and not msg[2] & 0x80:  # QR = 0
+            yield bytes(msg)
+
+
+def read_pcap(data, port):
+    magic = data[:4]
+    if magic in (b'\xd4\xc3\xb2\xa1', b'\x4d\x3c\xb2\xa1'):
+        endian = '<'
+    elif magic in (b'\xa1\xb2\xc3\xd4', b'\xa1\xb2\x3c\x4d'):
+        endian = '>'
+    else:
+        raise ValueError('not a pcap file')
+    nano = magic in (b'\x4d\x3c\xb2\xa1', b'\xa1\xb2\x3c\x4d')
+    linktype = struct.unpack(endian + 'I', data[20:24])[0] & 0x0fffffff
+    offset = 24
+    while offset + 16 <= len(data):
+        sec, frac, caplen, _ = struct.unpack(endian + 'IIII', data[offset:offset + 16])
+        frame = data[offset + 16:offset + 16 + caplen]
+        offset += 16 + caplen
+        ts = sec + frac / (1e9 if nano else 1e6)
+        for msg in dns_queries(linktype, frame, port):
+            yield ts, msg
+
+
+def read_pcapng(data, port):
+    endian = '<'
+    interfaces = []  # (linktype, timestamp units per second)
+    offset = 0
+    while offset + 12 <= len(data):
+        btype = struct.unpack(endian + 'I', data[offset:offset + 4])[0]
+        if btype == 0x0a0d0d0a:  # section header, sets the byte order
+            endian = '<' if data[offset + 8:offset + 12] == b'\x4d\x3c\x2b\x1a' else '>'
+            interfaces = []
+        blen = struct.unpack(endian + 'I', data[offset + 4:offset + 8])[0]
+        if blen < 12:
+            break
+        body = data[offset + 8:offset + blen - 4]
+        offset += blen
+        if btype == 1:  # interface description
+            linktype = struct.unpack(endian + 'H', body[:2])[0]
+            resolution = 1e6
+            opts = body[8:]
+            while len(opts) >= 4:
+                code, olen = struct.unpack(endian + 'HH', opts[:4])
+                if code == 0:
+                    break
+                if code == 9 and olen >= 1:  # if_tsresol
+                    value = opts[4]
+                    resolution = 2 ** (value & 0x7f) if value & 0x80 else 10 ** value
+                opts = opts[4 + (olen + 3) // 4 * 4:]
+            interfaces.append((linktype, resolution))
+        elif btype == 6 and len(body) >= 20:  # enhanced packet
+            ifid, ts_high, ts_low, caplen = struct.unpack(endian + 'IIII', body[:16])
+            if ifid >= len(interfaces):
+                continue
+            linktype, resolution = interfaces[ifid]
+            ts = ((ts_high << 32) | ts_low) / resolution
+            for msg in dns_queries(linktype, body[20:20 + caplen], port):
+                yield ts, msg
+        elif btype == 3 and interfaces:  # simple packet, without a timestamp
+            for msg in dns_queries(interfaces[0][0], body[4:], port):
+                yield 0.0, msg
+
+
+def protobuf_fields(buf):
+    """Yield (field number, value) of a protobuf message, values as int or bytes."""
+    offset = 0
+
+    def varint():
+        nonlocal offset
+        result, shift = 0, 0
+        while True:
+            byte = buf[offset]
+            offset += 1
+            result |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                return result
+
+    while offset < len(buf):
+        key = varint()
+        wire = key & 7
+        if wire == 0:
+            value = varint()
+        elif wire == 1:
+            value, offset = buf[offset:offset + 8], offset + 8
+        elif wire == 2:
+            length = varint()
+            value, offset = buf[offset:offset + length], offset + length
+        elif wire == 5:
+            value, offset = buf[offset:offset + 4], offset + 4
+        else:
+            raise ValueError('unsupported protobuf wire type %d' % wire)
+        yield key >> 3, value
+
+
+def read_dnstap(data, port):
+    """Frame Streams of dnstap.Dnstap; the queries of CLIENT_QUERY messages."""
+    del port  # the messages are not packets
+    client_query = 5
+    offset = 0
+    while offset + 4 <= len(data):
+        length = struct.unpack('!I', data[offset:offset + 4])[0]
+        offset += 4
+        if length == 0:  # a control frame
+            length = struct.unpack('!I', data[offset:offset + 4])[0]
+            offset += 4 + length
+            continue
+        frame = data[offset:offset + length]
+        offset += length
+        for number, value in protobuf_fields(frame):
+            if number != 14:  # Dnstap.message
+                continue
+            fields = dict(protobuf_fields(value))
+            if fields.get(1) != client_query or 10 not in fields:
+                continue
+            ts = fields.get(8, 0) + fields.get(9, 0) / 1e9
+            if len(fields[10]) >= HEADER_LEN:
+                yield ts, bytes(fields[10])
+
+
+def read_capture(path, port):
+    with open(path, 'rb') as capture:
+        data = capture.read()
+    if data[:4] == b'\x0a\x0d\x0d\x0a':
+        reader = read_pcapng
+    elif data[:4] == b'\x00\x00\x00\x00':
+        reader = read_dnstap
+    else:
+        reader = read_pcap
+    queries = list(reader(data, port))
+    if not queries:
+        raise ValueError('no queries to port %d in %s' % (port, path))
+    start = min(ts for ts, _ in queries)
+    return [(ts - start, msg) for ts, msg in queries]
+
+
+# Transports
+
+class Channel:
+    """Outstanding queries of one socket, matched to the answers by message ID."""
+
+    def __init__(self, loop, timeout):
+        self.loop = loop
+        self.timeout = timeout
+        self.pending = {}
+        # FIFO, so that a late answer hardly meets a new query with its ID.
+        self.free_ids = collections.deque(range(65536))
+        self.rcodes = collections.Counter()
+
+    def send_wire(self, wire):
+        raise NotImplementedError
+
+    async def query(self, wire):
+        """Return the latency in seconds, or None on a timeout."""
+        msgid = self.free_ids.popleft()
+        future = self.loop.create_future()
+        self.pending[msgid] = (time.monotonic(), future)
+        self.send_wire(struct.pack('!H', msgid) + wire[2:])
+        try:
+            return await asyncio.wait_for(future, self.timeout)
+        except asyncio.TimeoutError:
+            return None
+        finally:
+            self.pending.pop(msgid, None)
+            self.free_ids.append(msgid)
+
+    def answer(self, wire):
+        if len(wire) < HEADER_LEN:
+            return
+        entry = self.pending.pop(struct.unpack('!H', wire[:2])[0], None)
+        if entry and not entry[1].done():
+            self.rcodes[wire[3] & 0x0f] += 1
+            entry[1].set_result(time.monotonic() - entry[0])
+
+
+class UdpChannel(Channel, asyncio.DatagramProtocol):
+    def __init__(self, loop, timeout):
+        Channel.__init__(self, loop, timeout)
+        self.transport = None
+
+    def send_wire(self, wire):
+        self.transport.sendto(wire)
+
+    def datagram_received(self, data, addr):
+        self.answer(data)
+
+    async def connect(self, server):
+        self.transport, _ = await self.loop.create_datagram_endpoint(
+            lambda: self, remote_addr=server)
+
+
+class StreamChannel(Channel):
+    def __init__(self, loop, timeout, tls):
+        Channel.__init__(self, loop, timeout)
+        self.tls = tls
+        self.writer = None
+        self.reader_task = None
+
+    def send_wire(self, wire):
+        self.writer.write(struct.pack('!H', len(wire)) + wire)
+
+    async def read_answers(self, reader):
+        try:
+            while True:
+                length = struct.unpack('!H', await reader.readexactly(2))[0]
+                self.answer(await reader.readexactly(length))
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+
+    async def connect(self, server):
+        context = None
+        if self.tls:
+            # The daemon makes up a self-signed certificate when none is configured.
+            context = ssl.create_default_context()
+            context.check_hostname = False
+            context.verify_mode = ssl.CERT_NONE
+        reader, self.writer = await asyncio.open_connection(
+            server[0], server[1], ssl=context)
+        self.reader_task = self.loop.create_task(self.read_answers(reader))
+
+    def close(self):
+        self.writer.close()
+        self.reader_task.cancel()
+
+
+async def replay(loop, args, transport, server, queries):
+    """Send all the queries, return (latencies, timeouts, rcodes, seconds)."""
+    channels = []
+    for _ in range(1 if transport == 'udp' else args.connections):
+        channel = (UdpChannel(loop, args.timeout) if transport == 'udp'
+                   else StreamChannel(loop, args.timeout, transport == 'tls'))
+        await channel.connect(server)
+        channels.append(channel)
+    latencies = []
+    timeouts = 0
+    source = iter(queries)
+    start = time.monotonic()
+
+    async def sender(channel):
+        nonlocal timeouts
+        for ts, wire in source:
+            if args.speed:
+                delay = start + ts / args.speed - time.monotonic()
+                if delay > 0:
+                    await asyncio.sleep(delay)
+            latency = await channel.query(wire)
+            if latency is None:
+                timeouts += 1
+            else:
+                latencies.append(latency)
+
+    senders = [sender(channels[i % len(channels)]) for i in range(args.inflight)]
+    await asyncio.gather(*senders)
+    elapsed = time.monotonic() - start
+    rcodes = collections.Counter()
+    for channel in channels:
+        rcodes.update(channel.rcodes)
+        if transport != 'udp':
+            channel.close()
+        else:
+            channel.transport.close()
+    return latencies, timeouts, rcodes, elapsed
+
+
+# The daemon
+
+class Control:
+    """The control socket of kresd, in its binary mode."""
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.sock.sendall(b'__binary\n')
+
+    def eval(self, expr):
+        self.sock.sendall(expr.encode() + b'\n')
+        length = struct.unpack('!I', self.recv(4))[0]
+        return self.recv(length).decode()
+
+    def recv(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.sock.recv(length - len(data))
+            if not chunk:
+                raise ConnectionError('control socket closed')
+            data += chunk
+        return data
+
+    def stats(self):
+        result = {}
+        for table in ('worker', 'cache'):
+            try:
+                values = json.loads(self.eval('tojson(%s.stats())' % table))
+            except ValueError:
+                continue
+            for key, value in values.items():
+                if isinstance(value, (int, float)):
+                    result['%s.%s' % (table, key)] = value
+        return result
+
+
+def free_port():
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        return sock.getsockname()[1]
+
+
+def start_kresd(args, rundir):
+    """Start the daemon, return (process, {transport: address}, control path)."""
+    udp_port, tls_port = free_port(), free_port()
+    with open(os.path.join(rundir, 'config'), 'w') as config:
+        config.write("net.listen('127.0.0.1', %d)\n" % udp_port)
+        config.write("net.listen('127.0.0.1', %d, { tls = true })\n" % tls_port)
+        config.write("cache.size = %d * MB\n" % args.cache_size)
+        if args.config:
+            with open(args.config) as extra:
+                config.write(extra.read())
+    log('starting %s on ports %d and %d (TLS)' % (args.kresd, udp_port, tls_port))
+    process = subprocess.Popen(
+        [args.kresd, '-f', '1', '-q', '-c', 'config', rundir],
+        cwd=rundir, stdin=subprocess.DEVNULL)
+    control = os.path.join(rundir, 'tty', str(process.pid))
+    for _ in range(100):
+        if os.path.exists(control) or process.poll() is not None:
+            break
+        time.sleep(0.1)
+    if not os.path.exists(control):
+        process.kill()
+        raise RuntimeError('kresd did not start')
+    servers = {
+        'udp': ('127.0.0.1', udp_port),
+        'tcp': ('127.0.0.1', udp_port),
+        'tls': ('127.0.0.1', tls_port),
+    }
+    return process, servers, control
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[(len(sorted_values) - 1) * pct // 100] * 1000
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Replay a pcap or dnstap capture against kresd.')
+    parser.add_argument('capture', help='pcap, pcapng or dnstap file')
+    parser.add_argument('-t', '--transport', action='append', choices=('udp', 'tcp', 'tls'),
+                        help='transports to test, one after another (default: all)')
+    parser.add_argument('--kresd', help='start this kresd binary for the test')
+    parser.add_argument('--config', help='extra configuration for the started kresd')
+    parser.add_argument('--cache-size', type=int, default=100, help='cache size in MB')
+    parser.add_argument('--server', default='127.0.0.1', help='address of a running kresd')
+    parser.add_argument('--port', type=int, default=DNS_PORT,
+                        help='its port for UDP and TCP')
+    parser.add_argument('--tls-port', type=int, default=853, help='its port for TLS')
+    parser.add_argument('--control', help='its control socket, rundir/tty/<pid>')
+    parser.add_argument('--capture-port', type=int, default=DNS_PORT,
+                        help='destination port of the queries in the capture')
+    parser.add_argument('--inflight', type=int, default=100,
+                        help='concurrently outstanding queries')
+    parser.add_argument('--connections', type=int, default=10,
+                        help='connections for TCP and TLS')
+    parser.add_argument('--speed', type=float, default=0,
+                        help='pace by the capture timestamps, times faster (default: no pacing)')
+    parser.add_argument('--timeout', type=float, default=2.0, help='seconds per query')
+    parser.add_argument('--limit', type=int, default=0, help='replay at most this many queries')
+    args = parser.parse_args()
+    if args.inflight < 1 or args.connections < 1:
+        parser.error('--inflight and --connections must be positive')
+
+    queries = read_capture(args.capture, args.capture_port)
+    if args.limit:
+        queries = queries[:args.limit]
+    log('%d queries over %.1f s of the capture' % (len(queries), queries[-1][0]))
+
+    process, rundir = None, None
+    if args.kresd:
+        rundir = tempfile.mkdtemp(prefix='bench_daemon.')
+        process, servers, control_path = start_kresd(args, rundir)
+    else:
+        servers = {
+            'udp': (args.server, args.port),
+            'tcp': (args.server, args.port),
+            'tls': (args.server, args.tls_port),
+        }
+        control_path = args.control
+    loop = asyncio.new_event_loop()
+    asyncio.set_event_loop(loop)
+    try:
+        control = Control(control_path) if control_path else None
+        before = control.stats() if control else {}
+        for transport in args.transport or ('udp', 'tcp', 'tls'):
+            latencies, timeouts, rcodes, elapsed = loop.run_until_complete(
+                replay(loop, args, transport, servers[transport], queries))
+            latencies.sort()
+            log('%-4s answered, timeouts, qps, p50 p90 p99 max ms: ' % transport, end='')
+            print('%s,%d,%d,%d,%.0f,%.2f,%.2f,%.2f,%.2f' % (
+                transport, len(queries), len(latencies), timeouts,
+                len(latencies) / elapsed, percentile(latencies, 50),
+                percentile(latencies, 90), percentile(latencies, 99),
+                percentile(latencies, 100)), flush=True)
+            log('     rcodes: %s' % ', '.join(
+                '%d: %d' % item for item in sorted(rcodes.items())))
+        if control:
+            after = control.stats()
+            for name in sorted(after):
+                print('stats,%s,%g' % (name, after[name] - before.get(name, 0)))
+    finally:
+        loop.close()
+        if process:
+            process.send_signal(signal.SIGTERM)
+            process.wait()
+        if rundir:
+            shutil.rmtree(rundir, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
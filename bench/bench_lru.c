@@ -18,11 +18,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "contrib/ucw/lib.h"
 #include "daemon/engine.h"
+#include "lib/generic/shlru.h"
 #include "lib/nsrep.h"
 
 typedef kr_nsrep_lru_t lru_bench_t;
@@ -159,16 +162,99 @@ static struct key * read_lines(const char *fname, size_t *count, char **pfree)
 
 static void usage(const char *progname)
 {
-	p_err("usage: %s <log_count> <input> <seed> [lru_size]\n", progname);
+	p_err("usage: %s <log_count> <input> <seed> [lru_size [forks]]\n", progname);
 	p_err("The seed must be at least 12 characters or \"-\".\n"
+		"With forks, the shared LRU is used by that many processes at once.\n"
 		"Standard output contains csv-formatted lines.\n");
 	exit(1);
 }
 
 
+/// counters of one process using the shared LRU
+struct shared_result {
+	size_t miss, busy, accum;
+} CACHE_ALIGNED;
+
+static void shared_run(shlru_t *lru, struct key *keys, size_t key_count,
+			size_t run_count, size_t start, struct shared_result *res)
+{
+	// all the processes go over the same keys, each process from elsewhere
+	for (size_t i = 0, ki = start; i < run_count; ++i, --ki) {
+		unsigned r = 0;
+		int ret = shlru_get(lru, keys[ki].chars, keys[ki].len, &r);
+		if (ret != 0) {
+			r = 1;
+			ret = shlru_set(lru, keys[ki].chars, keys[ki].len, &r);
+			res->miss += 1;
+		}
+		if (ret == kr_error(EAGAIN))
+			res->busy += 1;
+		res->accum += r;
+		if (unlikely(ki == 0))
+			ki = key_count;
+	}
+}
+
+/// run the lookups and insertions from several processes at once
+static int bench_shared(struct key *keys, size_t key_count, size_t run_count,
+			int lru_size, int forks)
+{
+	uint16_t key_maxlen = 1;
+	for (size_t i = 0; i < key_count; ++i)
+		if (keys[i].len > key_maxlen)
+			key_maxlen = MIN(keys[i].len, UINT16_MAX);
+	size_t map_len = shlru_mem_size(lru_size, key_maxlen, sizeof(unsigned));
+	size_t res_len = sizeof(struct shared_result) * forks;
+	void *map = mmap(NULL, map_len + res_len, PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (!map_len || map == MAP_FAILED)
+		die("mmap");
+	// the results follow the LRU, cache-line aligned
+	shlru_t *lru = shlru_init(map, map_len, lru_size, key_maxlen, sizeof(unsigned));
+	struct shared_result *res = (void *)((char *)map + map_len);
+	if (!lru)
+		die("shlru_init");
+	p_err("\nLRU capacity:\t");
+	p_out("%d,", shlru_capacity(lru));
+	p_err("\nprocesses:\t");
+	p_out("%d,", forks);
+
+	struct timeval time;
+	p_err("\nget or set everything:\t");
+	time_get(&time);
+	for (int f = 0; f < forks; ++f) {
+		pid_t pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid == 0) {
+			size_t start = key_count - 1 - (key_count / forks) * f;
+			shared_run(lru, keys, key_count, run_count, start, &res[f]);
+			_exit(0);
+		}
+	}
+	for (int f = 0; f < forks; ++f)
+		if (wait(NULL) < 0)
+			die("wait");
+	time_print_diff(&time, run_count * forks);
+
+	size_t miss = 0, busy = 0, accum = 0;
+	for (int f = 0; f < forks; ++f) {
+		miss += res[f].miss;
+		busy += res[f].busy;
+		accum += res[f].accum;
+	}
+	p_err("LRU misses [%%]:\t");
+	p_out("%zd,", (miss * 100 + 50) / (run_count * forks));
+	p_err("\ncontended [%%]:\t");
+	p_out("%zd,", (busy * 100 + 50) / (run_count * forks));
+	p_err("\nignore: %zu\n", accum);
+	munmap(map, map_len + res_len);
+	return 0;
+}
+
 int main(int argc, char ** argv)
 {
-	if (argc != 4 && argc != 5)
+	if (argc < 4 || argc > 6)
 		usage(argv[0]);
 	if (ssrandom(argv[3]) < 0)
 		usage(argv[0]);
@@ -188,6 +274,12 @@ int main(int argc, char ** argv)
 
 	struct timeval time;
 	const int lru_size = argc > 4 ? atoi(argv[4]) : LRU_RTT_SIZE;
+	if (argc > 5) {
+		int ret = bench_shared(keys, key_count, run_count, lru_size, atoi(argv[5]));
+		free(keys);
+		free(data_to_free);
+		return ret;
+	}
 
 	lru_bench_t *lru;
 	#ifdef lru_create
@@ -0,0 +1,797 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Whole resolution of queries: kr_resolve_begin/consume/produce/finish
+ * with the iterator, validator and cache layers, as the daemon drives them,
+ * but the upstream queries are answered in-process by a mock authoritative.
+ * There are no sockets, so it measures just the library.
+ *
+ * The mock serves a single zone - the root - from records in memory.
+ * It follows the zone like an authoritative would: referrals, CNAMEs, NODATA and
+ * NXDOMAIN with the SOA, wildcard expansion, and NSEC proofs with RRSIGs
+ * when asked with DO.  The built-in zone is generated (see -p), another one
+ * can be loaded with -z; if it is signed, the SEP DNSKEYs of its apex
+ * become the trust anchors and all the answers are validated.
+ * A delegation is answered by the mock as well: at MOCK_ADDR it gives the
+ * referral, at any other address it answers as the child zone, with the SOA
+ * of the cut in the negative answers.
+ *
+ * The query mixes, each with an empty cache:
+ *  - hit: a set of names, queried once before, so all are answered from cache
+ *  - miss: unique names, synthesized from a wildcard upstream
+ *  - nxdomain: unique non-existent names
+ *  - cname: unique chains of CHAIN_DEPTH CNAMEs ending with an A
+ * and the adversarial ones, run only when named, each with a budget:
+ *  - wide: unique names in a zone delegated to WIDE_NS name servers with glue
+ *  - longchain: unique chains of KR_CNAME_CHAIN_LIMIT CNAMEs, all in one answer
+ *  - deep: unique names of the maximum length, with one-character labels
+ *  - flood: random non-existent names in the wide zone
+ *
+ * Standard output contains csv-formatted lines:
+ *  mix,queries,failed,qps,allocations per query,p50 us,p90 us,p99 us,max us,
+ *  cpu us per query,KiB per request,max KiB per request,budget
+ * The allocations and KiB are those from the request mempools; the budget is
+ * "ok", "over" or "-" for the mixes without one.  The exit status is 2 if any
+ * mix is over its budget.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libknot/descriptor.h>
+#include <libknot/rrset.h>
+#include <libknot/rrtype/opt.h>
+#include <libknot/rrtype/rdname.h>
+#include <libknot/rrtype/rrsig.h>
+#include <zscanner/scanner.h>
+#include <ucw/mempool.h>
+
+#include "lib/cache/api.h"
+#include "lib/cache/cdb_lmdb.h"
+#include "lib/dnssec/ta.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "lib/module.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+/** Names queried over and over in the "hit" mix. */
+#define HIT_NAMES 1000
+/** CNAMEs before the A in the "cname" mix. */
+#define CHAIN_DEPTH 8
+/** Name servers of the zone in the "wide" mix. */
+#define WIDE_NS 500
+/** Queries between commits of the cache, as the daemon batches them. */
+#define CACHE_BATCH 64
+/** The address of the mock authoritative; it answers for any name server. */
+#define MOCK_ADDR "192.0.2.53"
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+enum mix {
+	MIX_HIT, MIX_MISS, MIX_NXDOMAIN, MIX_CNAME,
+	MIX_WIDE, MIX_LONGCHAIN, MIX_DEEP, MIX_FLOOD, /* adversarial */
+	MIX_COUNT
+};
+static const char *mix_names[] = {
+	"hit", "miss", "nxdomain", "cname",
+	"wide", "longchain", "deep", "flood",
+};
+#define MIX_BIT(mix) (1u << (mix))
+#define MIX_DEFAULT (MIX_BIT(MIX_HIT) | MIX_BIT(MIX_MISS) | MIX_BIT(MIX_NXDOMAIN) \
+		     | MIX_BIT(MIX_CNAME))
+
+/** Budgets of the adversarial mixes, far above the usual values: they're
+ * to catch a worse complexity, not a few percent.  Zero is no budget. */
+static const struct {
+	double cpu_us;  /**< CPU per query */
+	double kib;     /**< Mempool per request, the largest one */
+} mix_budgets[] = {
+	[MIX_WIDE]      = { 5000, 4096 },
+	[MIX_LONGCHAIN] = { 5000, 4096 },
+	[MIX_DEEP]      = { 20000, 8192 },
+	[MIX_FLOOD]     = { 2000, 2048 },
+};
+
+/*
+ * The mock authoritative.
+ */
+
+/** Records of one owner; RRSIGs are kept in one set per type covered. */
+struct node {
+	knot_dname_t *owner;
+	array_t(knot_rrset_t *) sets;
+};
+
+struct zone {
+	trie_t *nodes;      /**< LF of owner -> struct node, including empty non-terminals */
+	trie_t *nsecs;      /**< The nodes with NSEC, for the covering ones */
+	const struct node *apex;
+	knot_mm_t mm;
+	size_t rr_count;
+	bool failed;
+	bool chase;         /**< Put the whole CNAME chain in the answer */
+};
+
+static struct node *zone_node(struct zone *z, const knot_dname_t *name, bool create)
+{
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	if (kr_dname_lf(lf, name, false) != 0)
+		return NULL;
+	if (!create) {
+		trie_val_t *val = trie_get_try(z->nodes, (const char *)lf + 1, lf[0]);
+		return val ? *val : NULL;
+	}
+	trie_val_t *val = trie_get_ins(z->nodes, (const char *)lf + 1, lf[0]);
+	if (!val)
+		return NULL;
+	if (!*val) {
+		struct node *node = mm_alloc(&z->mm, sizeof(*node));
+		if (!node)
+			return NULL;
+		node->owner = knot_dname_copy(name, &z->mm);
+		array_init(node->sets);
+		*val = node;
+	}
+	return *val;
+}
+
+static knot_rrset_t *node_rrset(const struct node *node, uint16_t type, uint16_t covered)
+{
+	for (size_t i = 0; node && i < node->sets.len; ++i) {
+		knot_rrset_t *rr = node->sets.at[i];
+		if (rr->type == type && (type != KNOT_RRTYPE_RRSIG
+					 || knot_rrsig_type_covered(&rr->rrs, 0) == covered))
+			return rr;
+	}
+	return NULL;
+}
+
+/** Add a record with a lower-case owner. */
+static int zone_add(struct zone *z, const knot_dname_t *owner, uint16_t type,
+		    uint32_t ttl, const uint8_t *rdata, uint16_t rdlen)
+{
+	struct node *node = zone_node(z, owner, true);
+	if (!node)
+		return kr_error(ENOMEM);
+	/* The empty non-terminals exist, too. */
+	for (const knot_dname_t *up = owner; up[0] != '\0'; ) {
+		up = knot_wire_next_label(up, NULL);
+		if (!zone_node(z, up, true))
+			return kr_error(ENOMEM);
+	}
+	uint16_t covered = 0;
+	if (type == KNOT_RRTYPE_RRSIG && rdlen >= 2)
+		covered = (rdata[0] << 8) | rdata[1];
+	knot_rrset_t *rr = node_rrset(node, type, covered);
+	if (!rr) {
+		rr = knot_rrset_new(owner, type, KNOT_CLASS_IN, &z->mm);
+		if (!rr || array_push(node->sets, rr) < 0)
+			return kr_error(ENOMEM);
+	}
+	if (type == KNOT_RRTYPE_NSEC) {
+		uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+		kr_dname_lf(lf, owner, false);
+		trie_val_t *val = trie_get_ins(z->nsecs, (const char *)lf + 1, lf[0]);
+		if (!val)
+			return kr_error(ENOMEM);
+		*val = node;
+	}
+	z->rr_count += 1;
+	return knot_rrset_add_rdata(rr, rdata, rdlen, ttl, &z->mm);
+}
+
+static void zone_scan_record(zs_scanner_t *s)
+{
+	struct zone *z = s->process.data;
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	memcpy(owner, s->r_owner, s->r_owner_length);
+	knot_dname_to_lower(owner);
+	if (zone_add(z, owner, s->r_type, s->r_ttl, s->r_data, s->r_data_length) != 0)
+		z->failed = true;
+}
+
+static void zone_scan_error(zs_scanner_t *s)
+{
+	struct zone *z = s->process.data;
+	p_err("zone, line %"PRIu64": %s\n", s->line_counter, zs_strerror(s->error.code));
+	z->failed = true;
+}
+
+/** Load the zone from the file, or from the text if path is NULL. */
+static void zone_load(struct zone *z, const char *path, const char *text)
+{
+	memset(z, 0, sizeof(*z));
+	mm_ctx_init(&z->mm);
+	z->nodes = trie_create(NULL);
+	z->nsecs = trie_create(NULL);
+	zs_scanner_t *zs = malloc(sizeof(*zs));
+	if (!z->nodes || !z->nsecs || !zs || zs_init(zs, ".", KNOT_CLASS_IN, 3600) != 0)
+		die("zone init");
+	zs_set_processing(zs, zone_scan_record, zone_scan_error, z);
+	int ret = path ? zs_set_input_file(zs, path) : zs_set_input_string(zs, text, strlen(text));
+	if (ret != 0 || zs_parse_all(zs) != 0 || z->failed)
+		die("zone load");
+	zs_deinit(zs);
+	free(zs);
+	z->apex = zone_node(z, (const uint8_t *)"", false);
+	if (!node_rrset(z->apex, KNOT_RRTYPE_SOA, 0))
+		die("zone without the root SOA");
+}
+
+/** The node with the NSEC covering (or matching) the name. */
+static const struct node *zone_covering(const struct zone *z, const knot_dname_t *name)
+{
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	trie_val_t *val = NULL;
+	if (kr_dname_lf(lf, name, false) != 0
+	    || trie_get_leq(z->nsecs, (const char *)lf + 1, lf[0], &val) < 0)
+		return NULL;
+	return val ? *val : NULL;
+}
+
+/** The deepest delegation at or above the name, except the apex. */
+static const struct node *zone_cut(const struct zone *z, const knot_dname_t *name)
+{
+	for (const knot_dname_t *up = name; up[0] != '\0'; up = knot_wire_next_label(up, NULL)) {
+		const struct node *node = zone_node((struct zone *)z, up, false);
+		if (node_rrset(node, KNOT_RRTYPE_NS, 0))
+			return node;
+	}
+	return NULL;
+}
+
+/** Put the set of the type with its signatures, owned by `owner` (if set). */
+static void put_set(knot_pkt_t *pkt, const struct node *node, uint16_t type,
+		    const knot_dname_t *owner, bool dnssec)
+{
+	const knot_rrset_t *sets[2] = {
+		node_rrset(node, type, 0),
+		dnssec ? node_rrset(node, KNOT_RRTYPE_RRSIG, type) : NULL,
+	};
+	for (int i = 0; i < 2; ++i) {
+		if (!sets[i])
+			continue;
+		knot_rrset_t rr = *sets[i];
+		if (owner)
+			rr.owner = (knot_dname_t *)owner;
+		knot_pkt_put(pkt, KNOT_COMPR_HINT_NONE, &rr, 0);
+	}
+}
+
+static void put_opt(const knot_pkt_t *query, knot_pkt_t *resp, bool dnssec)
+{
+	if (!knot_pkt_has_edns(query))
+		return;
+	knot_rrset_t opt;
+	if (knot_edns_init(&opt, KNOT_EDNS_MAX_UDP_PAYLOAD, 0, KNOT_EDNS_VERSION,
+			   &resp->mm) == 0) {
+		if (dnssec)
+			knot_edns_set_do(&opt);
+		knot_pkt_begin(resp, KNOT_ADDITIONAL);
+		knot_pkt_put(resp, KNOT_COMPR_HINT_NONE, &opt, KNOT_PF_FREE);
+	}
+}
+
+/** Answer the query as the authoritative of the zone, or of the child zones. */
+static void mock_answer(const struct zone *z, const knot_pkt_t *query, knot_pkt_t *resp,
+			bool child)
+{
+	const uint16_t qtype = knot_pkt_qtype(query);
+	const bool dnssec = knot_pkt_has_dnssec(query);
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	knot_dname_to_wire(name, knot_pkt_qname(query), sizeof(name));
+	knot_dname_to_lower(name);
+	knot_pkt_init_response(resp, query);
+	knot_wire_set_aa(resp->wire);
+
+	const struct node *cut = zone_cut(z, name);
+	if (cut && !child && !(qtype == KNOT_RRTYPE_DS && knot_dname_is_equal(cut->owner, name))) {
+		knot_wire_clear_aa(resp->wire);
+		knot_pkt_begin(resp, KNOT_AUTHORITY);
+		put_set(resp, cut, KNOT_RRTYPE_NS, NULL, false);
+		knot_pkt_begin(resp, KNOT_ADDITIONAL);
+		const knot_rrset_t *ns = node_rrset(cut, KNOT_RRTYPE_NS, 0);
+		for (uint16_t i = 0; i < ns->rrs.rr_count; ++i) {
+			const struct node *glue = zone_node((struct zone *)z,
+							    knot_ns_name(&ns->rrs, i), false);
+			put_set(resp, glue, KNOT_RRTYPE_A, NULL, false);
+		}
+		put_opt(query, resp, dnssec);
+		return;
+	}
+
+	const struct node *node = zone_node((struct zone *)z, name, false);
+	const struct node *wild = NULL, *cover = NULL, *wild_cover = NULL;
+	uint16_t rcode = KNOT_RCODE_NOERROR;
+	if (!node) {
+		/* The closest encloser exists, the apex at least. */
+		const knot_dname_t *ce = name;
+		do {
+			ce = knot_wire_next_label(ce, NULL);
+		} while (ce[0] != '\0' && !zone_node((struct zone *)z, ce, false));
+		knot_dname_t wname[KNOT_DNAME_MAXLEN + 2] = { 1, '*' };
+		const int ce_len = knot_dname_size(ce);
+		if (ce_len + 2 <= KNOT_DNAME_MAXLEN) {
+			memcpy(wname + 2, ce, ce_len);
+			wild = zone_node((struct zone *)z, wname, false);
+		}
+		cover = dnssec ? zone_covering(z, name) : NULL;
+		if (!wild) {
+			rcode = KNOT_RCODE_NXDOMAIN;
+			wild_cover = dnssec ? zone_covering(z, wname) : NULL;
+		}
+	}
+
+	const struct node *src = node ? node : wild;
+	uint16_t type = 0;
+	if (node_rrset(src, qtype, 0)) {
+		type = qtype;
+	} else if (node_rrset(src, KNOT_RRTYPE_CNAME, 0)) {
+		type = KNOT_RRTYPE_CNAME;
+	}
+	knot_pkt_begin(resp, KNOT_ANSWER);
+	if (type) {
+		put_set(resp, src, type, node ? NULL : name, dnssec);
+	}
+	const struct node *link = src;
+	uint16_t link_type = type;
+	for (int i = 0; z->chase && link_type == KNOT_RRTYPE_CNAME && qtype != KNOT_RRTYPE_CNAME
+			&& i < KR_CNAME_CHAIN_LIMIT; ++i) {
+		const knot_rrset_t *cname = node_rrset(link, KNOT_RRTYPE_CNAME, 0);
+		link = zone_node((struct zone *)z, knot_cname_name(&cname->rrs), false);
+		link_type = node_rrset(link, qtype, 0) ? qtype
+			: node_rrset(link, KNOT_RRTYPE_CNAME, 0) ? KNOT_RRTYPE_CNAME : 0;
+		if (link_type)
+			put_set(resp, link, link_type, NULL, dnssec);
+	}
+	knot_pkt_begin(resp, KNOT_AUTHORITY);
+	if (!type) {
+		put_set(resp, child && cut ? cut : z->apex, KNOT_RRTYPE_SOA, NULL, dnssec);
+	}
+	if (dnssec) {
+		/* For NODATA the NSEC of the name (or of the wildcard) is the proof. */
+		if (!type && src) {
+			const struct node *nsec = node_rrset(src, KNOT_RRTYPE_NSEC, 0)
+				? src : zone_covering(z, src->owner);
+			put_set(resp, nsec, KNOT_RRTYPE_NSEC, NULL, true);
+		}
+		if (cover && cover != src) {
+			put_set(resp, cover, KNOT_RRTYPE_NSEC, NULL, true);
+		}
+		if (wild_cover && wild_cover != cover) {
+			put_set(resp, wild_cover, KNOT_RRTYPE_NSEC, NULL, true);
+		}
+	}
+	knot_wire_set_rcode(resp->wire, rcode);
+	put_opt(query, resp, dnssec);
+}
+
+/** The text of the built-in zone for the given query count and mixes. */
+static char *zone_text(size_t queries, unsigned mixes)
+{
+	size_t len = 0;
+	char *text = NULL;
+	FILE *f = open_memstream(&text, &len);
+	if (!f)
+		die("open_memstream");
+	fprintf(f, ". 86400 SOA ns. hostmaster. 1 3600 600 86400 3600\n"
+		   ". 86400 NS ns.\n"
+		   "ns. 86400 A " MOCK_ADDR "\n"
+		   "*.syn. 3600 A 192.0.2.1\n"
+		   "nx. 86400 TXT \"nothing below\"\n");
+	for (unsigned i = 0; i < HIT_NAMES; ++i)
+		fprintf(f, "h%u.hit. 3600 A 192.0.2.%u\n", i, i % 256);
+	for (unsigned i = 0; i < queries; ++i) {
+		for (unsigned k = CHAIN_DEPTH; k > 0; --k)
+			fprintf(f, "c%u-%u.chain. 3600 CNAME c%u-%u.chain.\n", k, i, k - 1, i);
+		fprintf(f, "c0-%u.chain. 3600 A 192.0.2.%u\n", i, i % 256);
+	}
+	if (mixes & (MIX_BIT(MIX_WIDE) | MIX_BIT(MIX_FLOOD))) {
+		fprintf(f, "wide. 86400 SOA ns0.wide. hostmaster.wide. 1 3600 600 86400 3600\n"
+			   "*.wide. 3600 A 192.0.2.1\n"
+			   "nx.wide. 86400 TXT \"nothing below\"\n");
+		for (unsigned i = 0; i < WIDE_NS; ++i)
+			fprintf(f, "wide. 86400 NS ns%u.wide.\n"
+				   "ns%u.wide. 86400 A 198.18.%u.%u\n", i, i, i / 256, i % 256);
+	}
+	if (mixes & MIX_BIT(MIX_LONGCHAIN)) {
+		for (unsigned i = 0; i < queries; ++i) {
+			for (unsigned k = KR_CNAME_CHAIN_LIMIT; k > 0; --k)
+				fprintf(f, "l%u-%u.long. 3600 CNAME l%u-%u.long.\n", k, i, k - 1, i);
+			fprintf(f, "l0-%u.long. 3600 A 192.0.2.%u\n", i, i % 256);
+		}
+	}
+	if (mixes & MIX_BIT(MIX_DEEP))
+		fprintf(f, "*.deep. 3600 A 192.0.2.1\n");
+	if (fclose(f) != 0)
+		die("zone text");
+	return text;
+}
+
+/*
+ * The resolver.
+ */
+
+struct bench {
+	struct kr_context ctx;
+	module_array_t modules;
+	struct zone zone;
+	struct mempool *mp;     /**< For the requests, flushed after each */
+	knot_mm_t req_pool;     /**< Counting allocations from mp */
+	knot_mm_t mm;           /**< Packets of the mock */
+	char cache_path[32];
+	uint16_t next_id;
+};
+
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+static void *counting_alloc(void *ctx, size_t size)
+{
+	++alloc_count;
+	alloc_bytes += size;
+	return mp_alloc(ctx, size);
+}
+
+static void resolver_init(struct bench *b)
+{
+	struct kr_context *ctx = &b->ctx;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->pool = &b->mm;
+	ctx->trust_anchors = map_make(NULL);
+	ctx->negative_anchors = map_make(NULL);
+	ctx->cache_rtt_tout_retry_interval = KR_NS_TIMEOUT_RETRY_INTERVAL;
+	ctx->tls_padding = -1;
+	ctx->opt_rr = mm_alloc(&b->mm, sizeof(knot_rrset_t));
+	if (!ctx->opt_rr || knot_edns_init(ctx->opt_rr, KR_EDNS_PAYLOAD, 0,
+					   KR_EDNS_VERSION, &b->mm) != 0)
+		die("opt_rr");
+	lru_create(&ctx->cache_rtt, 65536, &b->mm, NULL);
+	lru_create(&ctx->cache_rep, 16384, &b->mm, NULL);
+	if (!ctx->cache_rtt || !ctx->cache_rep)
+		die("lru_create");
+
+	/* Root hints: the name servers of the apex, all at the mock. */
+	if (kr_zonecut_init(&ctx->root_hints, (const uint8_t *)"", &b->mm) != 0)
+		die("kr_zonecut_init");
+	const knot_rrset_t *ns = node_rrset(b->zone.apex, KNOT_RRTYPE_NS, 0);
+	uint8_t addr[4];
+	knot_rdata_t rdata[RDATA_ARR_MAX];
+	inet_pton(AF_INET, MOCK_ADDR, addr);
+	knot_rdata_init(rdata, sizeof(addr), addr, 0);
+	for (uint16_t i = 0; ns && i < ns->rrs.rr_count; ++i) {
+		if (kr_zonecut_add(&ctx->root_hints, knot_ns_name(&ns->rrs, i), rdata) != 0)
+			die("kr_zonecut_add");
+	}
+	/* Trust anchors: the SEP keys of a signed zone. */
+	const knot_rrset_t *keys = node_rrset(b->zone.apex, KNOT_RRTYPE_DNSKEY, 0);
+	for (uint16_t i = 0; keys && i < keys->rrs.rr_count; ++i) {
+		const knot_rdata_t *rd = knot_rdataset_at(&keys->rrs, i);
+		const uint8_t *key = knot_rdata_data(rd);
+		if (knot_rdata_rdlen(rd) < 4 || !(key[1] & 0x01))
+			continue;
+		if (kr_ta_add(&ctx->trust_anchors, (const uint8_t *)"", KNOT_RRTYPE_DNSKEY,
+			      knot_rdata_ttl(rd), key, knot_rdata_rdlen(rd)) != 0)
+			die("kr_ta_add");
+	}
+
+	strcpy(b->cache_path, "/tmp/bench_resolve.XXXXXX");
+	if (!mkdtemp(b->cache_path))
+		die("mkdtemp");
+	struct kr_cdb_opts opts = { b->cache_path, 512 * 1024 * 1024 };
+	if (kr_cache_open(&ctx->cache, kr_cdb_lmdb(), &opts, &b->mm) != 0)
+		die("kr_cache_open");
+
+	/* The layers, in the order of the daemon. */
+	static const char *layers[] = { "iterate", "validate", "cache" };
+	array_init(b->modules);
+	for (size_t i = 0; i < sizeof(layers) / sizeof(layers[0]); ++i) {
+		struct kr_module *module = calloc(1, sizeof(*module));
+		if (!module || kr_module_load(module, layers[i], NULL) != 0
+		    || array_push(b->modules, module) < 0)
+			die("kr_module_load");
+	}
+	ctx->modules = &b->modules;
+
+	b->mp = mp_new(16 * 1024);
+	b->req_pool.ctx = b->mp;
+	b->req_pool.alloc = counting_alloc;
+	b->req_pool.free = NULL;
+}
+
+static void resolver_deinit(struct bench *b)
+{
+	for (size_t i = 0; i < b->modules.len; ++i) {
+		kr_module_unload(b->modules.at[i]);
+		free(b->modules.at[i]);
+	}
+	array_clear(b->modules);
+	kr_cache_close(&b->ctx.cache);
+	char file[sizeof(b->cache_path) + 16];
+	snprintf(file, sizeof(file), "%s/data.mdb", b->cache_path);
+	unlink(file);
+	snprintf(file, sizeof(file), "%s/lock.mdb", b->cache_path);
+	unlink(file);
+	rmdir(b->cache_path);
+	kr_zonecut_deinit(&b->ctx.root_hints);
+	kr_ta_clear(&b->ctx.trust_anchors);
+	kr_ta_clear(&b->ctx.negative_anchors);
+	lru_free(b->ctx.cache_rtt);
+	lru_free(b->ctx.cache_rep);
+	mp_delete(b->mp);
+}
+
+/** Send the outbound query to the mock and let the request consume its answer. */
+static int upstream(struct bench *b, struct kr_request *req, struct sockaddr *addr,
+		    int sock_type, knot_pkt_t *pktbuf)
+{
+	if (kr_resolve_checkout(req, NULL, addr, sock_type, pktbuf) != 0)
+		return KR_STATE_PRODUCE; /* as when sending fails */
+	knot_pkt_t *resp = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &b->mm);
+	if (!resp)
+		die("knot_pkt_new");
+	/* Any other address than the mock's is of a child zone. */
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	struct in_addr mock_addr;
+	inet_pton(AF_INET, MOCK_ADDR, &mock_addr);
+	const bool child = addr->sa_family != AF_INET
+		|| sin->sin_addr.s_addr != mock_addr.s_addr;
+	mock_answer(&b->zone, pktbuf, resp, child);
+	/* The request gets it parsed from the wire, as if received. */
+	knot_pkt_t *rx = knot_pkt_new(resp->wire, resp->size, &b->mm);
+	if (!rx || knot_pkt_parse(rx, 0) != 0)
+		die("knot_pkt_parse");
+	int state = kr_resolve_consume(req, addr, rx);
+	knot_pkt_free(&rx);
+	knot_pkt_free(&resp);
+	return state;
+}
+
+/** Resolve the name; return the latency in ns, or 0 for a failure. */
+static uint64_t resolve(struct bench *b, const knot_dname_t *qname, uint16_t qtype)
+{
+	const uint64_t start = time_ns();
+	mp_flush(b->mp);
+	struct kr_request req;
+	memset(&req, 0, sizeof(req));
+	req.pool = b->req_pool;
+	knot_pkt_t *query = knot_pkt_new(NULL, KNOT_EDNS_MAX_UDP_PAYLOAD, &req.pool);
+	knot_pkt_t *answer = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &req.pool);
+	knot_pkt_t *pktbuf = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &req.pool);
+	if (!query || !answer || !pktbuf
+	    || knot_pkt_put_question(query, qname, KNOT_CLASS_IN, qtype) != 0)
+		die("query");
+	knot_wire_set_id(query->wire, ++b->next_id);
+	knot_wire_set_rd(query->wire);
+	knot_wire_set_ad(query->wire); /* validate when there's a trust anchor */
+
+	kr_resolve_begin(&req, &b->ctx, answer);
+	int state = kr_resolve_consume(&req, NULL, query);
+	for (int iter = 0; state == KR_STATE_PRODUCE; ++iter) {
+		if (iter > KR_ITER_LIMIT) {
+			state = KR_STATE_FAIL;
+			break;
+		}
+		struct sockaddr *addrs = NULL;
+		int sock_type = -1;
+		state = kr_resolve_produce(&req, &addrs, &sock_type, pktbuf);
+		if (state != KR_STATE_CONSUME) {
+			continue;
+		}
+		state = addrs && sock_type >= 0
+			? upstream(b, &req, addrs, sock_type, pktbuf)
+			: kr_resolve_consume(&req, NULL, NULL);
+	}
+	kr_resolve_finish(&req, state);
+	const bool ok = state == KR_STATE_DONE
+		&& knot_wire_get_rcode(answer->wire) != KNOT_RCODE_SERVFAIL;
+	const uint64_t lat = time_ns() - start;
+	return ok ? (lat ? lat : 1) : 0;
+}
+
+/*
+ * The mixes.
+ */
+
+static void mix_name(knot_dname_t *dst, enum mix mix, size_t i)
+{
+	char str[KNOT_DNAME_TXT_MAXLEN + 1];
+	switch (mix) {
+	case MIX_HIT:      sprintf(str, "h%zu.hit.", i % HIT_NAMES); break;
+	case MIX_MISS:     sprintf(str, "q%zu.syn.", i); break;
+	case MIX_NXDOMAIN: sprintf(str, "q%zu.nx.", i); break;
+	case MIX_CNAME:    sprintf(str, "c%d-%zu.chain.", CHAIN_DEPTH, i); break;
+	case MIX_WIDE:     sprintf(str, "q%zu.wide.", i); break;
+	case MIX_LONGCHAIN: sprintf(str, "l%d-%zu.long.", KR_CNAME_CHAIN_LIMIT, i); break;
+	case MIX_DEEP: {
+		/* Single-character labels up to the maximum of 255 octets. */
+		int len = sprintf(str, "q%zu.", i);
+		for (int labels = (KNOT_DNAME_MAXLEN - 7 - (len - 1)) / 2; labels > 0; --labels)
+			len += sprintf(str + len, "x.");
+		strcpy(str + len, "deep.");
+		break;
+	}
+	case MIX_FLOOD:
+		sprintf(str, "%08lx%08lx.nx.wide.", random() & 0xffffffffL, random() & 0xffffffffL);
+		break;
+	default: break;
+	}
+	if (!knot_dname_from_str(dst, str, KNOT_DNAME_MAXLEN))
+		die("knot_dname_from_str");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Run the mix, return false if it's over its budget. */
+static bool run_mix(struct bench *b, enum mix mix, size_t queries)
+{
+	b->zone.chase = mix == MIX_LONGCHAIN;
+	if (kr_cache_clear(&b->ctx.cache) != 0)
+		die("kr_cache_clear");
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	if (mix == MIX_HIT) {
+		for (size_t i = 0; i < HIT_NAMES; ++i) {
+			mix_name(name, mix, i);
+			resolve(b, name, KNOT_RRTYPE_A);
+		}
+		kr_cache_sync(&b->ctx.cache);
+	}
+	uint64_t *lat = calloc(queries, sizeof(*lat));
+	if (!lat)
+		die("calloc");
+	size_t failed = 0, max_bytes = 0;
+	alloc_count = 0;
+	alloc_bytes = 0;
+	const uint64_t start = time_ns(), cpu_start = cpu_ns();
+	for (size_t i = 0; i < queries; ++i) {
+		if (i % CACHE_BATCH == 0)
+			kr_cache_batch_begin(&b->ctx.cache);
+		mix_name(name, mix, i);
+		const size_t bytes = alloc_bytes;
+		lat[i] = resolve(b, name, KNOT_RRTYPE_A);
+		failed += lat[i] == 0;
+		if (alloc_bytes - bytes > max_bytes)
+			max_bytes = alloc_bytes - bytes;
+		if (i % CACHE_BATCH == CACHE_BATCH - 1 || i + 1 == queries)
+			kr_cache_batch_end(&b->ctx.cache);
+	}
+	const double secs = (double)(time_ns() - start) / 1e9;
+	const double cpu_us = (double)(cpu_ns() - cpu_start) / 1000 / queries;
+	const double max_kib = max_bytes / 1024.0;
+	const bool budgeted = mix_budgets[mix].cpu_us > 0;
+	const bool over = budgeted
+		&& (cpu_us > mix_budgets[mix].cpu_us || max_kib > mix_budgets[mix].kib);
+	qsort(lat, queries, sizeof(*lat), cmp_u64);
+	const uint64_t *ok = lat + failed; /* the failures sorted first */
+	const size_t ok_count = queries - failed;
+	#define PCT(p) (ok_count ? ok[(ok_count - 1) * (p) / 100] / 1000.0 : 0.0)
+	p_err("%-9s %6zu failed, qps, allocs/query, p50 p90 p99 max us, cpu us, KiB, max KiB: ",
+	      mix_names[mix], failed);
+	p_out("%s,%zu,%zu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%s\n",
+	      mix_names[mix], queries, failed,
+	      queries / secs, (double)alloc_count / queries,
+	      PCT(50), PCT(90), PCT(99), PCT(100),
+	      cpu_us, alloc_bytes / 1024.0 / queries, max_kib,
+	      budgeted ? (over ? "over" : "ok") : "-");
+	#undef PCT
+	if (over)
+		p_err("%s: over the budget of %.0f us CPU per query and %.0f KiB per request\n",
+		      mix_names[mix], mix_budgets[mix].cpu_us, mix_budgets[mix].kib);
+	free(lat);
+	return !over;
+}
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s [-z zonefile] <query_count> [mix...]\n", progname);
+	p_err("       %s -p <query_count>   (print the built-in zone)\n", progname);
+	p_err("Mixes: hit miss nxdomain cname (the default), wide longchain deep flood\n");
+	p_err("Standard output contains csv-formatted lines:\n"
+	      "mix,queries,failed,qps,allocations per query,p50 us,p90 us,p99 us,max us,\n"
+	      "cpu us per query,KiB per request,max KiB per request,budget\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *zone_path = NULL;
+	bool print_zone = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "z:p")) != -1) {
+		switch (opt) {
+		case 'z': zone_path = optarg; break;
+		case 'p': print_zone = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+	const size_t queries = atol(argv[optind]);
+	if (queries == 0)
+		usage(argv[0]);
+	unsigned mixes = optind + 1 >= argc ? MIX_DEFAULT : 0;
+	for (int j = optind + 1; j < argc; ++j) {
+		int mix = 0;
+		while (mix < MIX_COUNT && strcmp(argv[j], mix_names[mix]) != 0)
+			++mix;
+		if (mix == MIX_COUNT)
+			usage(argv[0]);
+		mixes |= MIX_BIT(mix);
+	}
+	char *text = zone_path ? NULL : zone_text(queries, mixes);
+	if (print_zone) {
+		fputs(text, stdout);
+		free(text);
+		return 0;
+	}
+
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	mm_ctx_init(&b.mm);
+	zone_load(&b.zone, zone_path, text);
+	free(text);
+	resolver_init(&b);
+	p_err("zone: %zu records, %s\n", b.zone.rr_count,
+	      b.ctx.trust_anchors.root ? "validated" : "unsigned");
+
+	bool within = true;
+	for (int mix = 0; mix < MIX_COUNT; ++mix) {
+		if (mixes & MIX_BIT(mix))
+			within = run_mix(&b, mix, queries) && within;
+	}
+	resolver_deinit(&b);
+	return within ? 0 : 2;
+}
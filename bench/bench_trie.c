@@ -0,0 +1,226 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Lookups of socket addresses, as in the tables of TCP sessions:
+ *  - map: crit-bit map_t keyed by kr_straddr(), as the daemon used to do
+ *  - trie: qp-trie keyed by kr_sockaddr_key()
+ *  - trie batch: sorted batches of kr_sockaddr_key() with trie_get_many()
+ *  - arena, frozen: the same keys in trie_create_arena() and trie_freeze()
+ * The "keys ready" cases measure just the structures, without making the keys.
+ */
+
+#include <assert.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/generic/map.h"
+#include "lib/generic/trie.h"
+#include "lib/utils.h"
+
+/** Keys per trie_get_many() call. */
+#define BATCH 16
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void time_print(const char *what, uint64_t start, size_t op_count)
+{
+	double ns = (double)(time_ns() - start) / op_count;
+	p_err("%-22s ", what);
+	p_out("%s,%.1f\n", what, ns);
+}
+
+/// random IPv4 and IPv6 addresses with ports, half of each
+static struct sockaddr_storage *make_addrs(size_t count)
+{
+	struct sockaddr_storage *addrs = calloc(count, sizeof(*addrs));
+	if (!addrs)
+		die("calloc");
+	for (size_t i = 0; i < count; ++i) {
+		if (i % 2) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addrs[i];
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = random();
+			for (int j = 0; j < 16; ++j)
+				sin6->sin6_addr.s6_addr[j] = random();
+		} else {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[i];
+			sin->sin_family = AF_INET;
+			sin->sin_port = random();
+			sin->sin_addr.s_addr = random();
+		}
+	}
+	return addrs;
+}
+
+struct key {
+	uint32_t len;
+	char chars[KR_SOCKADDR_KEY_MAXLEN];
+};
+
+static int key_cmp(const void *a, const void *b)
+{
+	const struct key *k1 = *(const struct key **)a, *k2 = *(const struct key **)b;
+	int ret = memcmp(k1->chars, k2->chars, MIN(k1->len, k2->len));
+	return ret ? ret : (int)k1->len - (int)k2->len;
+}
+
+static void usage(const char *progname)
+{
+	p_err("usage: %s <lookup_count> <address_count>\n", progname);
+	p_err("Standard output contains csv-formatted lines: case,ns per lookup.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		usage(argv[0]);
+	const size_t run_count = atol(argv[1]) / BATCH * BATCH;
+	const size_t addr_count = atol(argv[2]);
+	if (run_count == 0 || addr_count == 0)
+		usage(argv[0]);
+	srandom(time(NULL));
+
+	struct sockaddr_storage *addrs = make_addrs(addr_count);
+	/* The order of the lookups, not to measure just the prefetcher. */
+	unsigned *order = malloc(sizeof(*order) * run_count);
+	char (*strs)[INET6_ADDRSTRLEN + 6] = calloc(addr_count, sizeof(*strs));
+	struct key *keys = calloc(addr_count, sizeof(*keys));
+	map_t map = map_make(NULL);
+	trie_t *trie = trie_create(NULL), *arena = trie_create_arena(NULL);
+	if (!order || !strs || !keys || !trie || !arena)
+		die("malloc");
+	for (size_t i = 0; i < run_count; ++i)
+		order[i] = random() % addr_count;
+	for (size_t i = 0; i < addr_count; ++i) {
+		const struct sockaddr *sa = (const struct sockaddr *)&addrs[i];
+		void *val = (void *)(uintptr_t)(i + 1);
+		strcpy(strs[i], kr_straddr(sa));
+		keys[i].len = kr_sockaddr_key(keys[i].chars, sa);
+		trie_val_t *tval = trie_get_ins(trie, keys[i].chars, keys[i].len);
+		trie_val_t *aval = trie_get_ins(arena, keys[i].chars, keys[i].len);
+		if (map_set(&map, strs[i], val) != 0 || !tval || !aval)
+			die("insert");
+		*tval = *aval = val;
+	}
+	const size_t frozen_len = trie_freeze_size(trie);
+	void *frozen_mem = malloc(frozen_len);
+	const trie_frozen_t *frozen = frozen_mem ? trie_freeze(trie, frozen_mem, frozen_len) : NULL;
+	if (!frozen)
+		die("trie_freeze");
+	uintptr_t sum = 0; /* keep the results alive */
+
+	uint64_t start = time_ns();
+	for (size_t i = 0; i < run_count; ++i)
+		sum += (uintptr_t)map_get(&map, strs[order[i]]);
+	time_print("map (keys ready)", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; ++i) {
+		const struct key *k = &keys[order[i]];
+		sum += (uintptr_t)*trie_get_try(trie, k->chars, k->len);
+	}
+	time_print("trie (keys ready)", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; ++i) {
+		const struct key *k = &keys[order[i]];
+		sum += (uintptr_t)*trie_get_try(arena, k->chars, k->len);
+	}
+	time_print("arena (keys ready)", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; ++i) {
+		const struct key *k = &keys[order[i]];
+		sum += (uintptr_t)*trie_frozen_get_try(frozen, k->chars, k->len);
+	}
+	time_print("frozen (keys ready)", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; ++i) {
+		const struct sockaddr *sa = (const struct sockaddr *)&addrs[order[i]];
+		sum += (uintptr_t)map_get(&map, kr_straddr(sa));
+	}
+	time_print("map", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; ++i) {
+		const struct sockaddr *sa = (const struct sockaddr *)&addrs[order[i]];
+		char key[KR_SOCKADDR_KEY_MAXLEN];
+		int len = kr_sockaddr_key(key, sa);
+		sum += (uintptr_t)*trie_get_try(trie, key, len);
+	}
+	time_print("trie", start, run_count);
+
+	start = time_ns();
+	for (size_t i = 0; i < run_count; i += BATCH) {
+		struct key batch[BATCH];
+		const struct key *sorted[BATCH];
+		const char *chars[BATCH];
+		uint32_t lens[BATCH];
+		trie_val_t *vals[BATCH];
+		for (int j = 0; j < BATCH; ++j) {
+			const struct sockaddr *sa = (const struct sockaddr *)&addrs[order[i + j]];
+			batch[j].len = kr_sockaddr_key(batch[j].chars, sa);
+			sorted[j] = &batch[j];
+		}
+		qsort(sorted, BATCH, sizeof(sorted[0]), key_cmp);
+		for (int j = 0; j < BATCH; ++j) {
+			chars[j] = sorted[j]->chars;
+			lens[j] = sorted[j]->len;
+		}
+		if (trie_get_many(trie, chars, lens, BATCH, vals) != BATCH)
+			die("trie_get_many");
+		for (int j = 0; j < BATCH; ++j)
+			sum += (uintptr_t)*vals[j];
+	}
+	time_print("trie batch", start, run_count);
+
+	p_err("(checksum %zu)\n", (size_t)sum);
+	map_clear(&map);
+	trie_free(trie);
+	trie_free(arena);
+	free(frozen_mem);
+	free(keys);
+	free(strs);
+	free(order);
+	free(addrs);
+	return 0;
+}
@@ -0,0 +1,495 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Microbenchmarks of DNSSEC validation on recorded records, per algorithm
+ * and key size of the signer (e.g. "8-2048" is RSA/SHA-256 with 2048 bits):
+ *  - verify: kr_rrset_validate() of each signed RRset with the signature cache
+ *    off, i.e. the key lookup, the canonical wire, its digest and the public-key
+ *    verification
+ *  - cached: the same with the signatures verified before, i.e. all but the
+ *    public-key operation; verify minus cached is the cost of the crypto
+ *  - wire: knot_rrset_to_wire() of the RRsets, the bulk of canonicalization
+ *  - dnskey: kr_dnskeys_trusted() of the DNSKEY sets with their DS in the corpus,
+ *    i.e. the DS digest of the key and its signature over the set
+ * and per zone with NSEC or NSEC3 in the corpus, for unique random names:
+ *  - nsec3hash: kr_nsec3_hash_name() with the parameters of the zone
+ *  - nsec3nx, nsecnx: kr_nsec3_name_error_response_check() and
+ *    kr_nsec_name_error_response_check() with all the NSEC(3) of the zone
+ *    in the authority section; the names are usually not covered, so most
+ *    of them fail, after the same work as a proof
+ *
+ * The corpus is one or more master files of recorded records: signed zones,
+ * or the output of e.g. `kdig +dnssec +nocomments` for DNSKEY, DS and other
+ * queries to the zones of interest.  The RRSIGs are checked at the middle
+ * of their validity, so old recordings keep validating.
+ * Standard output contains csv-formatted lines:
+ *  case,operations,failed,ns per operation
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dnssec/binary.h>
+#include <dnssec/nsec.h>
+#include <libknot/descriptor.h>
+#include <libknot/packet/pkt.h>
+#include <libknot/rrset.h>
+#include <libknot/rrtype/dnskey.h>
+#include <libknot/rrtype/nsec3.h>
+#include <libknot/rrtype/rrsig.h>
+#include <zscanner/scanner.h>
+
+#include "contrib/cleanup.h"
+#include "lib/dnssec.h"
+#include "lib/dnssec/nsec.h"
+#include "lib/dnssec/nsec3.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+/** Default operations in each case. */
+#define OPERATIONS 10000
+
+#define p_out(...) do { \
+	printf(__VA_ARGS__); \
+	fflush(stdout); \
+	} while (0)
+#define p_err(...) fprintf(stderr, __VA_ARGS__)
+
+static int die(const char *cause)
+{
+	fprintf(stderr, "%s: %s\n", cause, strerror(errno));
+	exit(1);
+}
+
+static uint64_t time_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		die("clock_gettime");
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void report(const char *name, size_t ops, size_t failed, uint64_t since)
+{
+	p_out("%s,%zu,%zu,%.1f\n", name, ops, failed, (double)(time_ns() - since) / ops);
+}
+
+/*
+ * The corpus.
+ */
+
+/** A signed RRset with the keys of its signer. */
+struct item {
+	const knot_rrset_t *covered;
+	const knot_rrset_t *keys;
+	const knot_rrset_t *ds;     /**< Of the DNSKEY set, if it's the covered one */
+	const knot_dname_t *signer;
+	ranked_rr_array_t rrsigs;   /**< As the validator gets them */
+	uint32_t timestamp;
+	char label[16];             /**< algorithm-bits of the signature */
+};
+
+/** NSEC or NSEC3 records of a zone. */
+struct denial {
+	const knot_dname_t *zone;
+	array_t(const knot_rrset_t *) nsec;
+	array_t(const knot_rrset_t *) nsec3;
+};
+
+struct corpus {
+	trie_t *sets;    /**< owner, type and type covered -> knot_rrset_t */
+	trie_t *zones;   /**< signer -> struct denial */
+	array_t(struct item) items;
+	knot_mm_t mm;
+	size_t rr_count;
+	bool failed;
+};
+
+/** The key of the RRset in corpus::sets, return its length. */
+static size_t set_key(uint8_t *key, const knot_dname_t *owner, uint16_t type, uint16_t covered)
+{
+	const size_t len = knot_dname_size(owner);
+	memcpy(key, owner, len);
+	memcpy(key + len, &type, sizeof(type));
+	memcpy(key + len + sizeof(type), &covered, sizeof(covered));
+	return len + sizeof(type) + sizeof(covered);
+}
+
+static knot_rrset_t *corpus_get(const struct corpus *c, const knot_dname_t *owner,
+				uint16_t type, uint16_t covered)
+{
+	uint8_t key[KNOT_DNAME_MAXLEN + 4];
+	trie_val_t *val = trie_get_try(c->sets, (const char *)key,
+				       set_key(key, owner, type, covered));
+	return val ? *val : NULL;
+}
+
+static void corpus_scan_record(zs_scanner_t *s)
+{
+	struct corpus *c = s->process.data;
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	memcpy(owner, s->r_owner, s->r_owner_length);
+	knot_dname_to_lower(owner);
+	uint16_t covered = 0;
+	if (s->r_type == KNOT_RRTYPE_RRSIG && s->r_data_length >= 2)
+		covered = (s->r_data[0] << 8) | s->r_data[1];
+	uint8_t key[KNOT_DNAME_MAXLEN + 4];
+	trie_val_t *val = trie_get_ins(c->sets, (const char *)key,
+				       set_key(key, owner, s->r_type, covered));
+	if (val && !*val)
+		*val = knot_rrset_new(owner, s->r_type, KNOT_CLASS_IN, &c->mm);
+	/* Recordings of several answers repeat the records. */
+	if (!val || !*val || knot_rrset_add_rdata(*val, s->r_data, s->r_data_length,
+						  s->r_ttl, &c->mm) != 0)
+		c->failed = true;
+	c->rr_count += 1;
+}
+
+static void corpus_scan_error(zs_scanner_t *s)
+{
+	struct corpus *c = s->process.data;
+	p_err("corpus, line %"PRIu64": %s\n", s->line_counter, zs_strerror(s->error.code));
+	c->failed = true;
+}
+
+static void corpus_load(struct corpus *c, const char *path)
+{
+	zs_scanner_t *zs = malloc(sizeof(*zs));
+	if (!zs || zs_init(zs, ".", KNOT_CLASS_IN, 3600) != 0)
+		die("corpus init");
+	zs_set_processing(zs, corpus_scan_record, corpus_scan_error, c);
+	if (zs_set_input_file(zs, path) != 0 || zs_parse_all(zs) != 0 || c->failed)
+		die(path);
+	zs_deinit(zs);
+	free(zs);
+}
+
+/** Bits of the public key in the DNSKEY RDATA. */
+static unsigned key_bits(const uint8_t *rdata, uint16_t rdlen)
+{
+	if (rdlen < 5)
+		return 0;
+	const uint8_t alg = rdata[3];
+	const uint8_t *key = rdata + 4;
+	size_t len = rdlen - 4;
+	switch (alg) {
+	case 5: case 7: case 8: case 10: { /* RSA: exponent length, exponent, modulus */
+		size_t exp_len = key[0], skip = 1;
+		if (exp_len == 0 && len >= 3) {
+			exp_len = (key[1] << 8) | key[2];
+			skip = 3;
+		}
+		return len > skip + exp_len ? (len - skip - exp_len) * 8 : 0;
+	}
+	default: /* ECDSA has both coordinates, EdDSA just one */
+		return alg == 13 || alg == 14 ? len * 4 : len * 8;
+	}
+}
+
+/** Describe the signature as algorithm-bits of the key it's made with. */
+static void item_label(struct item *it, const knot_rrset_t *rrsigs)
+{
+	const uint16_t tag = knot_rrsig_key_tag(&rrsigs->rrs, 0);
+	const uint8_t alg = knot_rrsig_algorithm(&rrsigs->rrs, 0);
+	unsigned bits = 0;
+	for (uint16_t i = 0; i < it->keys->rrs.rr_count; ++i) {
+		const knot_rdata_t *rd = knot_rdataset_at(&it->keys->rrs, i);
+		if (kr_dnssec_key_tag(KNOT_RRTYPE_DNSKEY, knot_rdata_data(rd),
+				      knot_rdata_rdlen(rd)) == tag) {
+			bits = key_bits(knot_rdata_data(rd), knot_rdata_rdlen(rd));
+			break;
+		}
+	}
+	snprintf(it->label, sizeof(it->label), "%u-%u", alg, bits);
+}
+
+static struct denial *corpus_zone(struct corpus *c, const knot_dname_t *zone)
+{
+	trie_val_t *val = trie_get_ins(c->zones, (const char *)zone, knot_dname_size(zone));
+	if (!val)
+		die("trie_get_ins");
+	if (!*val) {
+		struct denial *d = mm_alloc(&c->mm, sizeof(*d));
+		if (!d)
+			die("mm_alloc");
+		memset(d, 0, sizeof(*d));
+		d->zone = zone;
+		*val = d;
+	}
+	return *val;
+}
+
+/** Pair the RRsets with their signatures and the keys of the signers. */
+static void corpus_index(struct corpus *c)
+{
+	trie_it_t *it;
+	for (it = trie_it_begin(c->sets); !trie_it_finished(it); trie_it_next(it)) {
+		const knot_rrset_t *rr = *trie_it_val(it);
+		if (rr->type == KNOT_RRTYPE_RRSIG)
+			continue;
+		const knot_rrset_t *rrsigs = corpus_get(c, rr->owner, KNOT_RRTYPE_RRSIG, rr->type);
+		if (!rrsigs)
+			continue;
+		const knot_dname_t *signer = knot_rrsig_signer_name(&rrsigs->rrs, 0);
+		if (rr->type == KNOT_RRTYPE_NSEC)
+			array_push(corpus_zone(c, signer)->nsec, rr);
+		if (rr->type == KNOT_RRTYPE_NSEC3)
+			array_push(corpus_zone(c, signer)->nsec3, rr);
+		struct item item = {
+			.covered = rr,
+			.keys = corpus_get(c, signer, KNOT_RRTYPE_DNSKEY, 0),
+			.signer = signer,
+		};
+		if (!item.keys)
+			continue;
+		if (rr->type == KNOT_RRTYPE_DNSKEY)
+			item.ds = corpus_get(c, rr->owner, KNOT_RRTYPE_DS, 0);
+		const uint32_t inception = knot_rrsig_sig_inception(&rrsigs->rrs, 0);
+		item.timestamp = inception
+			+ (knot_rrsig_sig_expiration(&rrsigs->rrs, 0) - inception) / 2;
+		item_label(&item, rrsigs);
+		kr_ranked_rrarray_init(item.rrsigs);
+		if (kr_ranked_rrarray_add(&item.rrsigs, rrsigs, KR_RANK_INITIAL, false, 1,
+					  &c->mm) < 0 || array_push(c->items, item) < 0)
+			die("kr_ranked_rrarray_add");
+	}
+	trie_it_free(it);
+}
+
+/*
+ * The cases.
+ */
+
+static int validate(const struct item *it, knot_pkt_t *pkt, bool dnskey)
+{
+	kr_rrset_validation_ctx_t vctx = {
+		.pkt = pkt,
+		.rrs = (ranked_rr_array_t *)&it->rrsigs,
+		.section_id = KNOT_ANSWER,
+		.keys = dnskey ? it->covered : it->keys,
+		.zone_name = it->signer,
+		.timestamp = it->timestamp,
+		.qry_uid = 1,
+		.limit_crypto_remains = INT_MAX,
+	};
+	return dnskey ? kr_dnskeys_trusted(&vctx, it->ds) : kr_rrset_validate(&vctx, it->covered);
+}
+
+/** Run the signature cases on the items with the label. */
+static void bench_signatures(struct corpus *c, const char *label, size_t ops, knot_pkt_t *pkt)
+{
+	array_t(const struct item *) items;
+	array_t(const struct item *) dnskeys;
+	array_init(items);
+	array_init(dnskeys);
+	for (size_t i = 0; i < c->items.len; ++i) {
+		const struct item *it = &c->items.at[i];
+		if (strcmp(it->label, label) != 0)
+			continue;
+		array_push(items, it);
+		if (it->ds)
+			array_push(dnskeys, it);
+	}
+	p_err("%s: %zu signed RRsets, %zu DNSKEY sets with DS\n", label, items.len, dnskeys.len);
+	char name[64];
+
+	kr_dnssec_sig_cache(false);
+	size_t failed = 0;
+	uint64_t since = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+		failed += validate(items.at[i % items.len], pkt, false) != 0;
+	snprintf(name, sizeof(name), "verify.%s", label);
+	report(name, ops, failed, since);
+
+	if (dnskeys.len) {
+		failed = 0;
+		since = time_ns();
+		for (size_t i = 0; i < ops; ++i)
+			failed += validate(dnskeys.at[i % dnskeys.len], pkt, true) != 0;
+		snprintf(name, sizeof(name), "dnskey.%s", label);
+		report(name, ops, failed, since);
+	}
+
+	kr_dnssec_sig_cache(true);
+	for (size_t i = 0; i < items.len; ++i)
+		validate(items.at[i], pkt, false);
+	failed = 0;
+	since = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+		failed += validate(items.at[i % items.len], pkt, false) != 0;
+	snprintf(name, sizeof(name), "cached.%s", label);
+	report(name, ops, failed, since);
+
+	static uint8_t wire[UINT16_MAX];
+	failed = 0;
+	since = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+		failed += knot_rrset_to_wire(items.at[i % items.len]->covered,
+					     wire, sizeof(wire), NULL) <= 0;
+	snprintf(name, sizeof(name), "wire.%s", label);
+	report(name, ops, failed, since);
+
+	array_clear(items);
+	array_clear(dnskeys);
+}
+
+/** A unique name below the zone, or the zone if it doesn't fit. */
+static const knot_dname_t *random_name(knot_dname_t *buf, const knot_dname_t *zone)
+{
+	const size_t zone_len = knot_dname_size(zone);
+	if (zone_len + 10 > KNOT_DNAME_MAXLEN)
+		return zone;
+	buf[0] = 9;
+	snprintf((char *)buf + 1, 10, "%09lx", random() & 0xfffffffffL);
+	memcpy(buf + 10, zone, zone_len);
+	return buf;
+}
+
+/** Run the denial cases on the NSEC(3) of a zone. */
+static void bench_denial(const struct denial *d, size_t ops, knot_mm_t *mm)
+{
+	const bool is_nsec3 = d->nsec3.len > 0;
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, mm);
+	if (!pkt)
+		die("knot_pkt_new");
+	knot_pkt_begin(pkt, KNOT_AUTHORITY);
+	const size_t count = is_nsec3 ? d->nsec3.len : d->nsec.len;
+	size_t put = 0;
+	for (; put < count; ++put) {
+		const knot_rrset_t *rr = is_nsec3 ? d->nsec3.at[put] : d->nsec.at[put];
+		if (knot_pkt_put(pkt, KNOT_COMPR_HINT_NONE, rr, 0) != 0)
+			break;
+	}
+	auto_free char *zone_str = kr_dname_text(d->zone);
+	char name[64 + KNOT_DNAME_TXT_MAXLEN];
+	knot_dname_t buf[KNOT_DNAME_MAXLEN];
+	size_t failed = 0;
+	uint64_t since;
+
+	if (is_nsec3) {
+		const knot_rrset_t *nsec3 = d->nsec3.at[0];
+		const knot_rdata_t *rd = knot_rdataset_at(&nsec3->rrs, 0);
+		dnssec_binary_t rdata = {
+			.size = 5 + knot_nsec3_salt_length(&nsec3->rrs, 0),
+			.data = knot_rdata_data(rd),
+		};
+		dnssec_nsec3_params_t params = { 0 };
+		if (rdata.size > knot_rdata_rdlen(rd)
+		    || dnssec_nsec3_params_from_rdata(&params, &rdata) != 0) {
+			p_err("%s: bad NSEC3 parameters\n", zone_str);
+			knot_pkt_free(&pkt);
+			return;
+		}
+		p_err("%s: %zu of %zu NSEC3, %u iterations\n", zone_str, put, count,
+		      params.iterations);
+		since = time_ns();
+		for (size_t i = 0; i < ops; ++i) {
+			dnssec_binary_t hash = { 0 };
+			failed += kr_nsec3_hash_name(&hash, &params, random_name(buf, d->zone)) != 0;
+			dnssec_binary_free(&hash);
+		}
+		snprintf(name, sizeof(name), "nsec3hash.%u.%s", params.iterations, zone_str);
+		report(name, ops, failed, since);
+		dnssec_nsec3_params_free(&params);
+
+		failed = 0;
+		since = time_ns();
+		for (size_t i = 0; i < ops; ++i)
+			failed += kr_nsec3_name_error_response_check(pkt, KNOT_AUTHORITY,
+						random_name(buf, d->zone)) != 0;
+		snprintf(name, sizeof(name), "nsec3nx.%u.%s", params.iterations, zone_str);
+		report(name, ops, failed, since);
+	} else {
+		p_err("%s: %zu of %zu NSEC\n", zone_str, put, count);
+		since = time_ns();
+		for (size_t i = 0; i < ops; ++i)
+			failed += kr_nsec_name_error_response_check(pkt, KNOT_AUTHORITY,
+						random_name(buf, d->zone)) != 0;
+		snprintf(name, sizeof(name), "nsecnx.%s", zone_str);
+		report(name, ops, failed, since);
+	}
+	knot_pkt_free(&pkt);
+}
+
+static void usage(const char *prog)
+{
+	p_err("usage: %s [-n operations] corpus...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t ops = OPERATIONS;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || ops == 0)
+		usage(argv[0]);
+
+	kr_crypto_init();
+	struct corpus c;
+	memset(&c, 0, sizeof(c));
+	mm_ctx_init(&c.mm);
+	c.sets = trie_create(NULL);
+	c.zones = trie_create(NULL);
+	if (!c.sets || !c.zones)
+		die("trie_create");
+	for (int i = optind; i < argc; ++i)
+		corpus_load(&c, argv[i]);
+	corpus_index(&c);
+	p_err("corpus: %zu records, %zu signed RRsets with keys\n", c.rr_count, c.items.len);
+	srandom(1);
+
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &c.mm);
+	if (!pkt)
+		die("knot_pkt_new");
+	p_out("case,operations,failed,ns per operation\n");
+	/* Each label once, in the order of the first item with it. */
+	for (size_t i = 0; i < c.items.len; ++i) {
+		size_t j = 0;
+		while (j < i && strcmp(c.items.at[j].label, c.items.at[i].label) != 0)
+			++j;
+		if (j == i)
+			bench_signatures(&c, c.items.at[i].label, ops, pkt);
+	}
+	trie_it_t *it;
+	for (it = trie_it_begin(c.zones); !trie_it_finished(it); trie_it_next(it))
+		bench_denial(*trie_it_val(it), ops, &c.mm);
+	trie_it_free(it);
+
+	knot_pkt_free(&pkt);
+	kr_crypto_cleanup();
+	return 0;
+}
@@ -33,6 +33,10 @@
 #define HISTORY_FILE "kresc_history"
 #define PROGRAM_NAME "kresc"
 
+// Header of the result chunks in the batch mode, see tty_batch_input() in daemon/main.c.
+#define CHUNK_MORE 0x80000000u
+#define CHUNK_ERROR 0x40000000u
+
 FILE *g_tty = NULL;		//!< connection to the daemon
 
 static char *run_cmd(const char *cmd, size_t * out_len);
@@ -295,7 +299,7 @@ complete_exit:
 }
 
 //! Initialize connection to the daemon; return 0 on success.
-static int init_tty(const char *path)
+static int init_tty(const char *path, bool batch)
 {
 	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd < 0)
@@ -322,6 +326,24 @@ static int init_tty(const char *path)
 		return 1;
 	}
 
+	if (batch) {
+		// Switch to batch mode, acknowledged by an empty chunk,
+		// possibly after the text "> " (not with `kresd -q`).
+		uint8_t ack[4];
+		if (fprintf(g_tty, "__batch\n") < 0 || fflush(g_tty)
+		    || !fread(ack, 2, 1, g_tty)
+		    || (ack[0] == '>' && !fread(ack, 2, 1, g_tty))
+		    || !fread(ack + 2, 2, 1, g_tty)
+		    || memcmp(ack, "\0\0\0\0", 4) != 0) {
+			fprintf(stderr, "While initializing batch mode: %s\n",
+				ferror(g_tty) ? strerror(errno) : "unexpected answer");
+			fclose(g_tty);
+			g_tty = NULL;
+			return 1;
+		}
+		return 0;
+	}
+
 	// Switch to binary mode and consume the text "> ".
 	if (fprintf(g_tty, "__binary\n") < 0 || !fread(&addr, 2, 1, g_tty)
 	    || fflush(g_tty)) {
@@ -359,6 +381,68 @@ static char *run_cmd(const char *cmd, size_t * out_len)
 	return msg;
 }
 
+//! Copy a chunk of the result from the daemon to the stream; return 0 on success.
+static int copy_chunk(FILE *out, size_t len, char *last)
+{
+	char buf[4096];
+	while (len > 0) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if (!fread(buf, n, 1, g_tty))
+			return 1;
+		fwrite(buf, n, 1, out);
+		*last = buf[n - 1];
+		len -= n;
+	}
+	return 0;
+}
+
+//! Run the commands from stdin, one per line, printing their results; return 1 if any failed.
+static int run_batch()
+{
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	int res = 0;
+	while ((len = getline(&line, &line_cap, stdin)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		uint32_t len_n = htonl(len);
+		if (!fwrite(&len_n, sizeof(len_n), 1, g_tty)
+		    || !fwrite(line, len, 1, g_tty) || fflush(g_tty)) {
+			perror("While communication with daemon");
+			free(line);
+			return 1;
+		}
+		// The result comes in chunks, errors go to stderr.
+		uint32_t header = CHUNK_MORE;
+		char last = '\n';
+		FILE *out = stdout;
+		while (header & CHUNK_MORE) {
+			if (!fread(&header, sizeof(header), 1, g_tty)) {
+				perror("While communication with daemon");
+				free(line);
+				return 1;
+			}
+			header = ntohl(header);
+			if (header & CHUNK_ERROR) {
+				out = stderr;
+				res = 1;
+			}
+			if (copy_chunk(out, header & ~(CHUNK_MORE | CHUNK_ERROR), &last)) {
+				perror("While communication with daemon");
+				free(line);
+				return 1;
+			}
+		}
+		if (last != '\n')
+			fputc('\n', out);
+	}
+	free(line);
+	return res;
+}
+
 static int interact()
 {
 	EditLine *el;
@@ -453,17 +537,21 @@ static int interact()
 
 int main(int argc, char **argv)
 {
-	fprintf(stderr, "Warning! %s is highly experimental, use at own risk.\n", argv[0]);
-	fprintf(stderr, "Please tell authors what features you expect from client utility.\n");
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s tty/xxxxx\n", argv[0]);
+	const bool batch = argc == 3 && strcmp(argv[1], "-b") == 0;
+	if (argc != 2 && !batch) {
+		fprintf(stderr, "Usage: %s [-b] tty/xxxxx\n", argv[0]);
+		fprintf(stderr, "  -b  batch mode: run the commands from stdin, one per line\n");
 		return 1;
 	}
+	if (!batch) {
+		fprintf(stderr, "Warning! %s is highly experimental, use at own risk.\n", argv[0]);
+		fprintf(stderr, "Please tell authors what features you expect from client utility.\n");
+	}
 
-	int res = init_tty(argv[1]);
+	int res = init_tty(argv[argc - 1], batch);
 
 	if (!res)
-		res = interact();
+		res = batch ? run_batch() : interact();
 
 	if (g_tty)
 		fclose(g_tty);
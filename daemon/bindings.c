@@ -14,18 +14,26 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <uv.h>
 #include <contrib/cleanup.h>
 #include <libknot/descriptor.h>
 
 #include "lib/cache/api.h"
 #include "lib/cache/cdb_api.h"
+#include "lib/cache/cdb_mem.h"
 #include "lib/utils.h"
 #include "daemon/bindings.h"
 #include "daemon/worker.h"
+#include "daemon/ffimodule.h"
+#include "daemon/prefetch.h"
 #include "daemon/tls.h"
+#include "daemon/xdp.h"
 #include "daemon/zimport.h"
 
 #define xstr(s) str(s)
@@ -131,12 +139,36 @@ static int mod_unload(lua_State *L)
 	return 1;
 }
 
+/** Cost of the layers of Lua modules. */
+static int mod_layer_stats(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	lua_newtable(L);
+	for (unsigned i = 0; i < engine->modules.len; ++i) {
+		struct kr_module *module = engine->modules.at[i];
+		struct ffimodule_stats stats;
+		if (!ffimodule_layer_stats(module, &stats)) {
+			continue;
+		}
+		lua_newtable(L);
+		lua_pushnumber(L, stats.calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushnumber(L, stats.skipped);
+		lua_setfield(L, -2, "skipped");
+		lua_pushnumber(L, stats.time_us);
+		lua_setfield(L, -2, "time_us");
+		lua_setfield(L, -2, module->name);
+	}
+	return 1;
+}
+
 int lib_modules(lua_State *L)
 {
 	static const luaL_Reg lib[] = {
 		{ "list",   mod_list },
 		{ "load",   mod_load },
 		{ "unload", mod_unload },
+		{ "layer_stats", mod_layer_stats },
 		{ NULL, NULL }
 	};
 
@@ -145,10 +177,17 @@ int lib_modules(lua_State *L)
 }
 
 /** Append 'addr = {port = int, udp = bool, tcp = bool}' */
-static int net_list_add(const char *key, void *val, void *ext)
+static void net_list_add(lua_State *L, const char *key, size_t key_len,
+			 endpoint_array_t *ep_array)
 {
-	lua_State *L = (lua_State *)ext;
-	endpoint_array_t *ep_array = val;
+	/* The endpoints are keyed by the binary address and port. */
+	struct sockaddr_storage ss;
+	char addr_str[INET6_ADDRSTRLEN];
+	if (kr_sockaddr_from_key(&ss, key, key_len) != 0
+	    || !inet_ntop(ss.ss_family, kr_inaddr((struct sockaddr *)&ss), addr_str, sizeof(addr_str))) {
+		return;
+	}
+	lua_pushstring(L, addr_str);
 	lua_newtable(L);
 	for (size_t i = ep_array->len; i--;) {
 		struct endpoint *ep = ep_array->at[i];
@@ -160,9 +199,22 @@ static int net_list_add(const char *key, void *val, void *ext)
 		lua_setfield(L, -2, "tcp");
 		lua_pushboolean(L, ep->flags & NET_TLS);
 		lua_setfield(L, -2, "tls");
+		lua_pushboolean(L, ep->flags & NET_HTTPS);
+		lua_setfield(L, -2, "doh");
+		lua_pushboolean(L, ep->flags & NET_STEER);
+		lua_setfield(L, -2, "steer");
+		const char *ifname = NULL;
+		uint32_t queue = 0;
+		if (ep->xdp && xdp_info(ep->xdp, &ifname, &queue) == 0) {
+			lua_pushstring(L, ifname);
+			lua_setfield(L, -2, "interface");
+			lua_pushinteger(L, queue);
+			lua_setfield(L, -2, "queue");
+		}
+		lua_pushboolean(L, ep->flags & NET_XDP);
+		lua_setfield(L, -2, "xdp");
 	}
-	lua_setfield(L, -2, key);
-	return kr_ok();
+	lua_settable(L, -3);
 }
 
 /** List active endpoints. */
@@ -170,12 +222,27 @@ static int net_list(lua_State *L)
 {
 	struct engine *engine = engine_luaget(L);
 	lua_newtable(L);
-	map_walk(&engine->net.endpoints, net_list_add, L);
+	trie_it_t *it;
+	for (it = trie_it_begin(engine->net.endpoints); it && !trie_it_finished(it);
+	     trie_it_next(it)) {
+		size_t key_len = 0;
+		const char *key = trie_it_key(it, &key_len);
+		net_list_add(L, key, key_len, *trie_it_val(it));
+	}
+	trie_it_free(it);
 	return 1;
 }
 
+/** Where net_listen_addrs() binds the addresses. */
+struct listen_opts {
+	int port;
+	int flags;
+	const char *ifname; /**< Only for AF_XDP */
+	uint32_t queue;
+};
+
 /** Listen on an address list represented by the top of lua stack. */
-static int net_listen_addrs(lua_State *L, int port, int flags)
+static int net_listen_addrs(lua_State *L, const struct listen_opts *opts)
 {
 	/* Case: table with 'addr' field; only follow that field directly. */
 	lua_getfield(L, -1, "addr");
@@ -189,10 +256,16 @@ static int net_listen_addrs(lua_State *L, int port, int flags)
 	const char *str = lua_tostring(L, -1);
 	if (str != NULL) {
 		struct engine *engine = engine_luaget(L);
-		int ret = network_listen(&engine->net, str, port, flags);
+		int ret = 0;
+		if (opts->flags & NET_XDP) {
+			ret = network_listen_xdp(&engine->net, str, opts->port,
+						 opts->ifname, opts->queue);
+		} else {
+			ret = network_listen(&engine->net, str, opts->port, opts->flags);
+		}
 		if (ret != 0) {
 			kr_log_info("[system] bind to '%s@%d' %s\n",
-					str, port, kr_strerror(ret));
+					str, opts->port, kr_strerror(ret));
 		}
 		return ret == 0;
 	}
@@ -205,7 +278,7 @@ static int net_listen_addrs(lua_State *L, int port, int flags)
 	}
 	lua_pushnil(L);
 	while (lua_next(L, -2)) {
-		if (net_listen_addrs(L, port, flags) == 0)
+		if (net_listen_addrs(L, opts) == 0)
 			return 0;
 		lua_pop(L, 1);
 	}
@@ -234,20 +307,58 @@ static int net_listen(lua_State *L)
 		lua_error(L);
 	}
 
-	int port = KR_DNS_PORT;
+	struct listen_opts opts = { .port = KR_DNS_PORT };
 	if (n > 1 && lua_isnumber(L, 2)) {
-		port = lua_tointeger(L, 2);
+		opts.port = lua_tointeger(L, 2);
 	}
 
-	bool tls = (port == KR_DNS_TLS_PORT);
+	bool tls = (opts.port == KR_DNS_TLS_PORT);
+	const char *kind = NULL;
 	if (n > 2 && lua_istable(L, 3)) {
 		tls = table_get_flag(L, 3, "tls", tls);
+		lua_getfield(L, 3, "kind");
+		kind = lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	opts.flags = tls ? (NET_TCP|NET_TLS) : (NET_TCP|NET_UDP);
+	if (kind && strcmp(kind, "xdp") == 0) {
+		/* The strings stay referenced by the table until the end. */
+		lua_getfield(L, 3, "interface");
+		opts.ifname = lua_tostring(L, -1);
+		lua_getfield(L, 3, "queue");
+		opts.queue = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+		lua_pop(L, 1);
+		if (!opts.ifname) {
+			format_error(L, "net.listen() with kind = 'xdp' needs an interface");
+			lua_error(L);
+		}
+		opts.flags = NET_UDP|NET_XDP;
+	} else if (kind && strcmp(kind, "tls") == 0) {
+		opts.flags = NET_TCP|NET_TLS;
+	} else if (kind && strcmp(kind, "doh") == 0) {
+		opts.flags = NET_TCP|NET_TLS|NET_HTTPS;
+	} else if (kind && strcmp(kind, "dns") != 0) {
+		format_error(L, "net.listen() kind is one of 'dns', 'tls', 'doh' or 'xdp'");
+		lua_error(L);
 	}
-	int flags = tls ? (NET_TCP|NET_TLS) : (NET_TCP|NET_UDP);
-	
+	/* steer = true for a socket per fork, or the number of sockets bound by other means */
+	if (n > 2 && lua_istable(L, 3) && !(opts.flags & NET_XDP)) {
+		lua_getfield(L, 3, "steer");
+		if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+			engine_luaget(L)->net.steer_group = lua_tointeger(L, -1);
+			opts.flags |= NET_STEER;
+		} else if (lua_toboolean(L, -1)) {
+			opts.flags |= NET_STEER;
+		}
+		lua_pop(L, 1);
+		if (table_get_flag(L, 3, "freebind", false)) {
+			opts.flags |= NET_FREEBIND;
+		}
+	}
+
 	/* Now focus on the first argument. */
-	lua_pop(L, n - 1);
-	int res = net_listen_addrs(L, port, flags);
+	lua_pushvalue(L, 1);
+	int res = net_listen_addrs(L, &opts);
 	lua_pushboolean(L, res);
 	return res;
 }
@@ -400,15 +511,17 @@ static int net_tls(lua_State *L)
 	return 1;
 }
 
-static int print_tls_param(const char *key, void *val, void *data)
+static void print_tls_param(lua_State *L, const char *key, size_t key_len,
+			    struct tls_client_paramlist_entry *entry)
 {
-	if (!val) {
-		return 0;
+	struct sockaddr_storage ss;
+	const char *addr_str = NULL;
+	if (kr_sockaddr_from_key(&ss, key, key_len) == 0) {
+		addr_str = kr_straddr((struct sockaddr *)&ss);
+	}
+	if (!entry || !addr_str) {
+		return;
 	}
-
-	struct tls_client_paramlist_entry *entry = (struct tls_client_paramlist_entry *)val;
-
-	lua_State *L = (lua_State *)data;
 
 	lua_createtable(L, 0, 3);
 
@@ -436,9 +549,7 @@ static int print_tls_param(const char *key, void *val, void *data)
 	}
 	lua_setfield(L, -2, "hostnames");
 
-	lua_setfield(L, -2, key);
-
-	return 0;
+	lua_setfield(L, -2, addr_str);
 }
 
 static int print_tls_client_params(lua_State *L)
@@ -451,11 +562,18 @@ static int print_tls_client_params(lua_State *L)
 	if (!net) {
 		return 0;
 	}
-	if (net->tls_client_params.root == 0 ) {
+	if (!net->tls_client_params || trie_weight(net->tls_client_params) == 0) {
 		return 0;
 	}
 	lua_newtable(L);
-	map_walk(&net->tls_client_params, print_tls_param, (void *)L);
+	trie_it_t *it;
+	for (it = trie_it_begin(net->tls_client_params); it && !trie_it_finished(it);
+	     trie_it_next(it)) {
+		size_t key_len = 0;
+		const char *key = trie_it_key(it, &key_len);
+		print_tls_param(L, key, key_len, *trie_it_val(it));
+	}
+	trie_it_free(it);
 	return 1;
 }
 
@@ -509,7 +627,7 @@ static int net_tls_client(lua_State *L)
 	}
 
 	if (!pin_exists && !ca_file_exists) {
-		int r = tls_client_params_set(&net->tls_client_params,
+		int r = tls_client_params_set(net->tls_client_params,
 					      addr, port, NULL, NULL, NULL);
 		if (r != 0) {
 			lua_pushstring(L, kr_strerror(r));
@@ -527,7 +645,7 @@ static int net_tls_client(lua_State *L)
 		while (lua_next(L, 2)) {  /* pin table is in stack at index 2 */
 			/* pin now at index -1, key at index -2*/
 			const char *pin = lua_tostring(L, -1);
-			int r = tls_client_params_set(&net->tls_client_params,
+			int r = tls_client_params_set(net->tls_client_params,
 						      addr, port, NULL, NULL, pin);
 			if (r != 0) {
 				lua_pushstring(L, kr_strerror(r));
@@ -553,7 +671,7 @@ static int net_tls_client(lua_State *L)
 	lua_pushnil(L);
 	while (lua_next(L, ca_table_index)) {
 		const char *ca_file = lua_tostring(L, -1);
-		int r = tls_client_params_set(&net->tls_client_params,
+		int r = tls_client_params_set(net->tls_client_params,
 					      addr, port, ca_file, NULL, NULL);
 		if (r != 0) {
 			lua_pushstring(L, kr_strerror(r));
@@ -567,7 +685,7 @@ static int net_tls_client(lua_State *L)
 	lua_pushnil(L);
 	while (lua_next(L, hostname_table_index)) {
 		const char *hostname = lua_tostring(L, -1);
-		int r = tls_client_params_set(&net->tls_client_params,
+		int r = tls_client_params_set(net->tls_client_params,
 					      addr, port, NULL, hostname, NULL);
 		if (r != 0) {
 			lua_pushstring(L, kr_strerror(r));
@@ -624,6 +742,111 @@ static int net_tls_padding(lua_State *L)
 	return 1;
 }
 
+static int net_tls_ktls(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	if (lua_gettop(L) > 1 || (lua_gettop(L) == 1 && !lua_isboolean(L, 1))) {
+		format_error(L, "net.tls_ktls takes one boolean parameter");
+		lua_error(L);
+	}
+	if (lua_gettop(L) == 1) {
+		engine->net.tls_ktls = lua_toboolean(L, 1);
+	}
+	lua_pushboolean(L, engine->net.tls_ktls);
+	return 1;
+}
+
+/** Get/set a limit in engine->net, see net.tls_handshake_*(), net.doh_*() and net.tcp_*() */
+static int net_tls_hs_uint(lua_State *L, uint32_t *limit, const char *name)
+{
+	if (!lua_isnumber(L, 1)) {
+		lua_pushnumber(L, *limit);
+		return 1;
+	}
+	lua_Number val = lua_tonumber(L, 1);
+	if (val < 0 || val > UINT32_MAX) {
+		format_error(L, name);
+		lua_error(L);
+	}
+	*limit = val;
+	lua_pushnumber(L, *limit);
+	return 1;
+}
+
+static int net_tls_handshake_offload(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tls_hs_offload,
+		"net.tls_handshake_offload takes a non-negative number of handshakes");
+}
+
+static int net_tls_handshake_limit(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tls_hs_limit,
+		"net.tls_handshake_limit takes a non-negative number of handshakes per second");
+}
+
+static int net_doh_streams(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	const char *usage = "net.doh_streams takes a positive number of streams";
+	if (lua_isnumber(L, 1) && lua_tonumber(L, 1) < 1) {
+		format_error(L, usage);
+		lua_error(L);
+	}
+	return net_tls_hs_uint(L, &engine->net.doh_streams_max, usage);
+}
+
+static int net_doh_connections(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.doh_conns_max,
+		"net.doh_connections takes a non-negative number of connections");
+}
+
+static int net_tcp_connections(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tcp_conns_max,
+		"net.tcp_connections takes a non-negative number of connections");
+}
+
+static int net_tcp_connections_client(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tcp_conns_client,
+		"net.tcp_connections_client takes a non-negative number of connections");
+}
+
+static int net_tcp_fastopen(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tcp_fastopen,
+		"net.tcp_fastopen takes a non-negative queue length");
+}
+
+static int net_tcp_defer_accept(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	return net_tls_hs_uint(L, &engine->net.tcp_defer_accept,
+		"net.tcp_defer_accept takes a non-negative number of seconds");
+}
+
+static int net_tcp_fastopen_upstream(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	if (lua_gettop(L) > 1 || (lua_gettop(L) == 1 && !lua_isboolean(L, 1))) {
+		format_error(L, "net.tcp_fastopen_upstream takes one boolean parameter");
+		lua_error(L);
+	}
+	if (lua_gettop(L) == 1) {
+		engine->net.tcp_fastopen_out = lua_toboolean(L, 1);
+	}
+	lua_pushboolean(L, engine->net.tcp_fastopen_out);
+	return 1;
+}
+
 static int net_outgoing(lua_State *L, int family)
 {
 	struct worker_ctx *worker = wrk_luaget(L);
@@ -681,6 +904,89 @@ static int net_outgoing(lua_State *L, int family)
 static int net_outgoing_v4(lua_State *L) { return net_outgoing(L, AF_INET); }
 static int net_outgoing_v6(lua_State *L) { return net_outgoing(L, AF_INET6); }
 
+/** Get/set the zones to send the client subnet to, see kr_context::ecs. */
+static int net_ecs(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_ecs_conf *ecs = &engine->resolver.ecs;
+	if (lua_gettop(L) > 1 || (lua_gettop(L) == 1 && !lua_istable(L, 1))) {
+		format_error(L, "net.ecs takes one table parameter");
+		lua_error(L);
+	}
+	if (lua_gettop(L) == 1) {
+		static const char *names[] = { "source4", "source6", "scopes" };
+		const lua_Number max[] = { 32, 128, UINT16_MAX };
+		lua_Number vals[] = { ecs->source4, ecs->source6, ecs->scopes_max };
+		for (int i = 0; i < 3; ++i) {
+			lua_getfield(L, 1, names[i]);
+			if (lua_isnumber(L, -1)) {
+				vals[i] = lua_tonumber(L, -1);
+				if (vals[i] < 0 || vals[i] > max[i]) {
+					format_error(L, "net.ecs: source4 must be within <0, 32>, "
+						"source6 within <0, 128> and scopes within <0, "
+						xstr(UINT16_MAX) ">");
+					lua_error(L);
+				}
+			}
+			lua_pop(L, 1);
+		}
+		/* The zones are replaced as a whole. */
+		lua_getfield(L, 1, "zones");
+		if (lua_istable(L, -1)) {
+			trie_t *zones = trie_create(NULL);
+			if (!zones) {
+				format_error(L, kr_strerror(kr_error(ENOMEM)));
+				lua_error(L);
+			}
+			for (int i = 1; ; ++i) {
+				lua_rawgeti(L, -1, i);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				uint8_t zone[KNOT_DNAME_MAXLEN];
+				if (!lua_isstring(L, -1)
+				    || !knot_dname_from_str(zone, lua_tostring(L, -1), sizeof(zone))) {
+					trie_free(zones);
+					format_error(L, "net.ecs: zones must be a list of domain names");
+					lua_error(L);
+				}
+				knot_dname_to_lower(zone);
+				trie_get_ins(zones, (const char *)zone, knot_dname_size(zone));
+				lua_pop(L, 1);
+			}
+			trie_free(ecs->zones);
+			ecs->zones = zones;
+		}
+		lua_pop(L, 1);
+		ecs->source4 = vals[0];
+		ecs->source6 = vals[1];
+		ecs->scopes_max = vals[2];
+	}
+	lua_newtable(L);
+	lua_newtable(L);
+	int i = 1;
+	trie_it_t *it;
+	for (it = ecs->zones ? trie_it_begin(ecs->zones) : NULL; it && !trie_it_finished(it);
+										trie_it_next(it)) {
+		char zone[KNOT_DNAME_MAXLEN];
+		const knot_dname_t *name = (const knot_dname_t *)trie_it_key(it, NULL);
+		if (knot_dname_to_str(zone, name, sizeof(zone))) {
+			lua_pushstring(L, zone);
+			lua_rawseti(L, -2, i++);
+		}
+	}
+	trie_it_free(it);
+	lua_setfield(L, -2, "zones");
+	lua_pushnumber(L, ecs->source4);
+	lua_setfield(L, -2, "source4");
+	lua_pushnumber(L, ecs->source6);
+	lua_setfield(L, -2, "source6");
+	lua_pushnumber(L, ecs->scopes_max);
+	lua_setfield(L, -2, "scopes");
+	return 1;
+}
+
 int lib_net(lua_State *L)
 {
 	static const luaL_Reg lib[] = {
@@ -690,12 +996,23 @@ int lib_net(lua_State *L)
 		{ "interfaces",   net_interfaces },
 		{ "bufsize",      net_bufsize },
 		{ "tcp_pipeline", net_pipeline },
+		{ "tcp_fastopen", net_tcp_fastopen },
+		{ "tcp_defer_accept",      net_tcp_defer_accept },
+		{ "tcp_fastopen_upstream", net_tcp_fastopen_upstream },
 		{ "tls",          net_tls },
 		{ "tls_server",   net_tls },
 		{ "tls_client",   net_tls_client },
 		{ "tls_padding",  net_tls_padding },
+		{ "tls_ktls",     net_tls_ktls },
+		{ "tls_handshake_offload", net_tls_handshake_offload },
+		{ "tls_handshake_limit",   net_tls_handshake_limit },
+		{ "doh_streams",           net_doh_streams },
+		{ "doh_connections",       net_doh_connections },
+		{ "tcp_connections",       net_tcp_connections },
+		{ "tcp_connections_client", net_tcp_connections_client },
 		{ "outgoing_v4",  net_outgoing_v4 },
 		{ "outgoing_v6",  net_outgoing_v6 },
+		{ "ecs",          net_ecs },
 		{ NULL, NULL }
 	};
 	register_lib(L, "net", lib);
@@ -723,6 +1040,7 @@ static int cache_count(lua_State *L)
 	const struct kr_cdb_api *api = engine->resolver.cache.api;
 
 	struct kr_cache *cache = &engine->resolver.cache;
+	(void) kr_cache_read_renew(cache);
 	int count = api->count(cache->db);
 	if (kr_cache_is_open(cache) && count >= 0) {
 		/* First key is a version counter, omit it if nonempty. */
@@ -773,6 +1091,105 @@ static int cache_stats(lua_State *L)
 	lua_setfield(L, -2, "insert");
 	lua_pushnumber(L, cache->stats.delete);
 	lua_setfield(L, -2, "delete");
+	lua_pushnumber(L, cache->batch.commits);
+	lua_setfield(L, -2, "batch_commits");
+	lua_pushnumber(L, cache->batch.saved);
+	lua_setfield(L, -2, "batch_saved");
+	lua_pushnumber(L, cache->l1_stats.hit);
+	lua_setfield(L, -2, "l1_hit");
+	lua_pushnumber(L, cache->l1_stats.miss);
+	lua_setfield(L, -2, "l1_miss");
+	lua_pushnumber(L, cache->l1_stats.size);
+	lua_setfield(L, -2, "l1_size");
+	lua_pushnumber(L, cache->gc.usage);
+	lua_setfield(L, -2, "usage_percent");
+	lua_pushnumber(L, cache->gc.passes);
+	lua_setfield(L, -2, "gc_passes");
+	lua_pushnumber(L, cache->gc.scanned);
+	lua_setfield(L, -2, "gc_scanned");
+	lua_pushnumber(L, cache->gc.freed);
+	lua_setfield(L, -2, "gc_freed");
+	lua_pushnumber(L, cache->gc.freed_bytes);
+	lua_setfield(L, -2, "gc_freed_bytes");
+	lua_pushnumber(L, cache->gc.kept_hot);
+	lua_setfield(L, -2, "gc_kept_hot");
+	lua_pushnumber(L, cache->gc.grown);
+	lua_setfield(L, -2, "gc_grown");
+	lua_pushnumber(L, cache->remote_stats.hit);
+	lua_setfield(L, -2, "remote_hit");
+	lua_pushnumber(L, cache->remote_stats.miss);
+	lua_setfield(L, -2, "remote_miss");
+	lua_pushnumber(L, cache->remote_stats.promoted);
+	lua_setfield(L, -2, "remote_promoted");
+	lua_pushnumber(L, cache->remote_stats.replicated);
+	lua_setfield(L, -2, "remote_replicated");
+	lua_pushnumber(L, cache->remote_stats.dropped);
+	lua_setfield(L, -2, "remote_dropped");
+	struct kr_cdb_writer_stats writer = { 0 };
+	if (kr_cache_writer_stats(cache, &writer) == 0) {
+		lua_pushnumber(L, writer.queued);
+		lua_setfield(L, -2, "writer_queued");
+		lua_pushnumber(L, writer.written);
+		lua_setfield(L, -2, "writer_written");
+		lua_pushnumber(L, writer.dropped);
+		lua_setfield(L, -2, "writer_dropped");
+		lua_pushnumber(L, writer.lag_ms);
+		lua_setfield(L, -2, "writer_lag_ms");
+	}
+	struct kr_cdb_read_stats read = { 0 };
+	if (kr_cache_read_stats(cache, &read) == 0) {
+		lua_pushnumber(L, read.renewed);
+		lua_setfield(L, -2, "read_renewed");
+		lua_pushnumber(L, read.reused);
+		lua_setfield(L, -2, "read_reused");
+		lua_pushnumber(L, read.age_ms);
+		lua_setfield(L, -2, "read_age_ms");
+		lua_pushnumber(L, read.readers);
+		lua_setfield(L, -2, "readers");
+		lua_pushnumber(L, read.readers_max);
+		lua_setfield(L, -2, "readers_max");
+		lua_pushnumber(L, read.reaped);
+		lua_setfield(L, -2, "readers_reaped");
+		lua_pushnumber(L, read.oldest_ms);
+		lua_setfield(L, -2, "readers_oldest_ms");
+		lua_pushnumber(L, read.oldest_lag);
+		lua_setfield(L, -2, "readers_oldest_lag");
+	}
+	return 1;
+}
+
+/** Return the counters per entry kind, class of RR type and rank bucket. */
+static int cache_kstats(lua_State *L)
+{
+	static const char *kinds[KR_CACHE_KINDS] =
+		{ "rr", "pkt", "nsec1", "nsec3", "wild", "ns" };
+	static const char *tclasses[KR_CACHE_TCLASSES] = { "addr", "infra", "other" };
+	static const char *rclasses[KR_CACHE_RCLASSES] = { "secure", "insecure", "other" };
+	static const char *events[KR_CACHE_EVENTS] = { "hit", "miss", "stale", "stash" };
+	struct engine *engine = engine_luaget(L);
+	const struct kr_cache_kstats *ks = engine->resolver.cache.kstats;
+	lua_newtable(L);
+	if (!ks) {
+		return 1;
+	}
+	for (int k = 0; k < KR_CACHE_KINDS; ++k) {
+		lua_newtable(L);
+		for (int t = 0; t < KR_CACHE_TCLASSES; ++t) {
+			lua_newtable(L);
+			for (int r = 0; r < KR_CACHE_RCLASSES; ++r) {
+				lua_newtable(L);
+				for (int e = 0; e < KR_CACHE_EVENTS; ++e) {
+					lua_pushnumber(L, ks->count[k][t][r][e]);
+					lua_setfield(L, -2, events[e]);
+				}
+				lua_pushnumber(L, ks->bytes[k][t][r]);
+				lua_setfield(L, -2, "bytes");
+				lua_setfield(L, -2, rclasses[r]);
+			}
+			lua_setfield(L, -2, tclasses[t]);
+		}
+		lua_setfield(L, -2, kinds[k]);
+	}
 	return 1;
 }
 
@@ -848,7 +1265,7 @@ static int cache_open(lua_State *L)
 	/* Check parameters */
 	int n = lua_gettop(L);
 	if (n < 1 || !lua_isnumber(L, 1)) {
-		format_error(L, "expected 'open(number max_size, string config = \"\")'");
+		format_error(L, "expected 'open(number max_size, string config = \"\", number hard_max_size = 0, number shards = 1, boolean hugepages = false)'");
 		lua_error(L);
 	}
 
@@ -870,13 +1287,64 @@ static int cache_open(lua_State *L)
 		lua_error(L);
 	}
 
+	/* The limit to grow to, the shards and huge pages are kept unless given,
+	 * see cache.max_size, cache.shards and cache.hugepages. */
+	lua_getglobal(L, "cache");
+	lua_pushstring(L, "current_max_size");
+	lua_rawget(L, -2);
+	lua_pushstring(L, "current_shards");
+	lua_rawget(L, -3);
+	lua_pushstring(L, "current_hugepages");
+	lua_rawget(L, -4);
+	lua_Number hsize_lua = lua_isnumber(L, 3) ? lua_tonumber(L, 3) : lua_tonumber(L, -3);
+	lua_Number shards_lua = lua_isnumber(L, 4) ? lua_tonumber(L, 4) : lua_tonumber(L, -2);
+	const bool hugepages = lua_isboolean(L, 5) ? lua_toboolean(L, 5) : lua_toboolean(L, -1);
+	lua_pop(L, 4);
+	if (!(hsize_lua == 0 || (hsize_lua >= cache_size && hsize_lua < SIZE_MAX))) {
+		format_error(L, "invalid hard cache size specified, it must be 0 or at least max_size");
+		lua_error(L);
+	}
+	size_t cache_size_hard = hsize_lua;
+	if (!(shards_lua >= 0 && shards_lua <= 64)) {
+		format_error(L, "invalid number of cache shards, it must be in range <1, 64>");
+		lua_error(L);
+	}
+	unsigned shards = shards_lua > 1 ? shards_lua : 1;
+
+	/* The same cache again, e.g. on reload(); keep it open and warm. */
+	lua_getglobal(L, "cache");
+	lua_pushstring(L, "current_size");
+	lua_rawget(L, -2);
+	lua_pushstring(L, "current_storage");
+	lua_rawget(L, -3);
+	lua_pushstring(L, "current_max_size");
+	lua_rawget(L, -4);
+	lua_pushstring(L, "current_shards");
+	lua_rawget(L, -5);
+	lua_pushstring(L, "current_hugepages");
+	lua_rawget(L, -6);
+	const bool same = kr_cache_is_open(&engine->resolver.cache)
+		&& lua_tonumber(L, -5) == cache_size
+		&& lua_tonumber(L, -3) == cache_size_hard
+		&& lua_tonumber(L, -2) == shards
+		&& lua_toboolean(L, -1) == hugepages
+		&& strcmp(lua_isstring(L, -4) ? lua_tostring(L, -4) : "", uri ? uri : "") == 0;
+	lua_pop(L, 6);
+	if (same) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
 	/* Close if already open */
 	kr_cache_close(&engine->resolver.cache);
 
 	/* Reopen cache */
 	struct kr_cdb_opts opts = {
 		(conf && strlen(conf)) ? conf : ".",
-		cache_size
+		cache_size,
+		cache_size_hard,
+		shards,
+		hugepages
 	};
 	int ret = kr_cache_open(&engine->resolver.cache, api, &opts, engine->pool);
 	if (ret != 0) {
@@ -896,8 +1364,144 @@ static int cache_open(lua_State *L)
 	lua_pushstring(L, "current_storage");
 	lua_pushstring(L, uri);
 	lua_rawset(L, -3);
+	lua_pushstring(L, "current_max_size");
+	lua_pushnumber(L, cache_size_hard);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "current_shards");
+	lua_pushnumber(L, shards);
+	lua_rawset(L, -3);
+	lua_pushstring(L, "current_hugepages");
+	lua_pushboolean(L, hugepages);
+	lua_rawset(L, -3);
+	/* Keep writing in the background, see cache_writer(). */
+	lua_pushstring(L, "current_writer");
+	lua_rawget(L, -2);
+	const bool writer = lua_toboolean(L, -1);
 	lua_pop(L, 1);
+	/* Keep reusing the read snapshots, see cache_read_reuse(). */
+	lua_pushstring(L, "current_read_reuse");
+	lua_rawget(L, -2);
+	lua_pushstring(L, "current_read_reuse_ops");
+	lua_rawget(L, -3);
+	const unsigned reuse_ms = lua_tonumber(L, -2), reuse_ops = lua_tonumber(L, -1);
+	lua_pop(L, 3);
+	if (writer && kr_cache_writer(&engine->resolver.cache, true) != 0) {
+		kr_log_error("[cache] can't start the background writer\n");
+	}
+	if (reuse_ms && kr_cache_read_reuse(&engine->resolver.cache, reuse_ms, reuse_ops) != 0) {
+		kr_log_error("[cache] can't reuse the read snapshots\n");
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/** Write into the storage in the background, or stop it with false. */
+static int cache_writer(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_cache *cache = &engine->resolver.cache;
+	int n = lua_gettop(L);
+	if (n > 0) {
+		if (!lua_isboolean(L, 1)) {
+			format_error(L, "expected 'writer(boolean enable)'");
+			lua_error(L);
+		}
+		const bool enable = lua_toboolean(L, 1);
+		if (kr_cache_is_open(cache)) {
+			int ret = kr_cache_writer(cache, enable);
+			if (ret != 0) {
+				return luaL_error(L, "can't %s the background writer: %s",
+						  enable ? "start" : "stop", kr_strerror(ret));
+			}
+		}
+		lua_getglobal(L, "cache");
+		lua_pushstring(L, "current_writer");
+		lua_pushboolean(L, enable);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	lua_getglobal(L, "cache");
+	lua_pushstring(L, "current_writer");
+	lua_rawget(L, -2);
+	lua_pushboolean(L, lua_toboolean(L, -1));
+	return 1;
+}
+
+/** Keep the read snapshot for up to max_ms (and max_ops reads), 0 to renew it always. */
+static int cache_read_reuse(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_cache *cache = &engine->resolver.cache;
+	int n = lua_gettop(L);
+	if (n > 0) {
+		if (!lua_isnumber(L, 1) || (n > 1 && !lua_isnumber(L, 2))) {
+			format_error(L, "expected 'read_reuse(number max_ms, number max_ops = 0)'");
+			lua_error(L);
+		}
+		lua_Number max_ms = lua_tonumber(L, 1);
+		lua_Number max_ops = n > 1 ? lua_tonumber(L, 2) : 0;
+		if (!(max_ms >= 0 && max_ms <= UINT32_MAX && max_ops >= 0 && max_ops <= UINT32_MAX)) {
+			format_error(L, "read_reuse limits must be in range <0, " xstr(UINT32_MAX) ">");
+			lua_error(L);
+		}
+		if (kr_cache_is_open(cache)) {
+			int ret = kr_cache_read_reuse(cache, max_ms, max_ops);
+			if (ret != 0) {
+				return luaL_error(L, "can't reuse the read snapshots: %s", kr_strerror(ret));
+			}
+		}
+		lua_getglobal(L, "cache");
+		lua_pushstring(L, "current_read_reuse");
+		lua_pushnumber(L, max_ms);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "current_read_reuse_ops");
+		lua_pushnumber(L, max_ops);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	lua_getglobal(L, "cache");
+	lua_pushstring(L, "current_read_reuse");
+	lua_rawget(L, -2);
+	lua_pushnumber(L, lua_tonumber(L, -1));
+	return 1;
+}
 
+/** Put a shared storage behind the cache, or remove it with false. */
+static int cache_remote(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_cache *cache = &engine->resolver.cache;
+	int n = lua_gettop(L);
+	if (n == 0) {
+		const struct kr_cdb_api *api = kr_cache_remote_api(cache);
+		lua_pushstring(L, api ? api->name : "");
+		return 1;
+	}
+	if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+		kr_cache_remote_close(cache);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	const char *conf = lua_tostring(L, 1);
+	if (!conf || !strstr(conf, "://")) {
+		format_error(L, "expected 'remote(string config_uri)' or 'remote(false)'");
+		lua_error(L);
+	}
+	const struct kr_cdb_api *api = cache_select(engine, &conf);
+	if (!api || api == engine->backends.at[0] || api == kr_cdb_mem()) {
+		format_error(L, "unsupported remote cache backend, load its module first");
+		lua_error(L);
+	}
+	if (!kr_cache_is_open(cache)) {
+		format_error(L, "cache is not open");
+		lua_error(L);
+	}
+	struct kr_cdb_opts opts = { conf, 0 };
+	int ret = kr_cache_remote_open(cache, api, &opts, engine->pool);
+	if (ret != 0) {
+		return luaL_error(L, "can't open remote cache '%s': %s", conf, kr_strerror(ret));
+	}
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -992,11 +1596,7 @@ static int cache_prune(lua_State *L)
 		prune_max = lua_tointeger(L, 1);
 	}
 
-	/* Check if API supports pruning. */
-	int ret = kr_error(ENOSYS);
-	if (cache->api->prune) {
-		ret = cache->api->prune(cache->db, prune_max);
-	}
+	int ret = kr_cache_gc(cache, prune_max);
 	/* Commit and format result. */
 	if (ret < 0) {
 		format_error(L, kr_strerror(ret));
@@ -1021,15 +1621,25 @@ static int cache_clear(lua_State *L)
 	if (n >= 1 && lua_isstring(L, 1)) {
 		args = lua_tostring(L, 1);
 	}
+	const bool lazy = n >= 2 && lua_toboolean(L, 2);
+	/* The subtree is meant either way, e.g. '*.bad.cz' as 'bad.cz'. */
+	if (args && strncmp(args, "*.", 2) == 0) {
+		args += 2;
+	}
 
 	/* Clear a sub-tree in cache. */
-	if (args && strlen(args) > 0) {
-		int ret = kr_error(ENOSYS); // FIXME cache_remove_prefix(cache, args);
+	if (args && strlen(args) > 0 && strcmp(args, ".") != 0) {
+		knot_dname_t name[KNOT_DNAME_MAXLEN];
+		int ret = knot_dname_from_str(name, args, sizeof(name))
+			? kr_cache_remove_subtree(cache, name, lazy) : kr_error(EINVAL);
+		if (ret == 0 && !lazy) {
+			ret = worker_cache_flush(wrk_luaget(L));
+		}
 		if (ret < 0) {
 			format_error(L, kr_strerror(ret));
 			lua_error(L);
 		}
-		lua_pushinteger(L, ret);
+		lua_pushboolean(L, true);
 		return 1;
 	}
 
@@ -1043,34 +1653,22 @@ static int cache_clear(lua_State *L)
 	/* Clear reputation tables */
 	lru_reset(engine->resolver.cache_rtt);
 	lru_reset(engine->resolver.cache_rep);
+	lru_reset(engine->resolver.cache_lame);
+	lru_reset(engine->resolver.cache_edns);
+	lru_reset(engine->resolver.cache_depth);
 	lru_reset(engine->resolver.cache_cookie);
+	kr_nsrep_share_clear();
 	lua_pushboolean(L, true);
 	return 1;
 }
 
-/** @internal Dump cache key into table on Lua stack. */
-static void cache_dump_key(lua_State *L, knot_db_val_t *key)
-{
-	char buf[KNOT_DNAME_MAXLEN];
-	/* Extract type */
-	uint16_t type = 0;
-	const char *endp = (const char *)key->data + key->len - sizeof(uint16_t);
-	memcpy(&type, endp, sizeof(uint16_t));
-	endp -= 1;
-	/* Extract domain name */
-	char *dst = buf;
-	const char *scan = endp - 1;
-	while (scan > (const char *)key->data) {
-		if (*scan == '\0') {
-			const size_t lblen = endp - scan - 1;
-			memcpy(dst, scan + 1, lblen);
-			dst += lblen;
-			*dst++ = '.';
-			endp = scan;
-		}
-		--scan;
-	}
-	memcpy(dst, scan + 1, endp - scan);
+/** @internal Add the entry into the name -> typemap table on top of Lua stack. */
+static void cache_dump_entry(lua_State *L, const struct kr_cache_iter_entry *e)
+{
+	char buf[KNOT_DNAME_TXT_MAXLEN];
+	if (!knot_dname_to_str(buf, e->owner, sizeof(buf))) {
+		return;
+	}
 	/* If name typemap doesn't exist yet, create it */
 	lua_getfield(L, -1, buf);
 	if (lua_isnil(L, -1)) {
@@ -1079,13 +1677,30 @@ static void cache_dump_key(lua_State *L, knot_db_val_t *key)
 	}
 	/* Append to typemap */
 	char type_buf[16] = { '\0' };
-	knot_rrtype_to_string(type, type_buf, sizeof(type_buf));
+	knot_rrtype_to_string(e->type, type_buf, sizeof(type_buf));
 	lua_pushboolean(L, true);
 	lua_setfield(L, -2, type_buf);
 	/* Set name typemap */
 	lua_setfield(L, -2, buf);
 }
 
+/** @internal Start listing the entries under the name from Lua, or fail with a Lua error. */
+static struct kr_cache_iter *cache_iter_begin(lua_State *L, struct kr_cache *cache, const char *args)
+{
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	if (!knot_dname_from_str(name, args, sizeof(name))) {
+		format_error(L, "invalid domain name");
+		lua_error(L);
+	}
+	knot_dname_to_lower(name);
+	struct kr_cache_iter *it = kr_cache_iter_begin(cache, name);
+	if (!it) {
+		format_error(L, "the cache can't be listed");
+		lua_error(L);
+	}
+	return it;
+}
+
 /** Query cached records. */
 static int cache_get(lua_State *L)
 {
@@ -1094,6 +1709,8 @@ static int cache_get(lua_State *L)
 	if (!kr_cache_is_open(cache)) {
 		return 0;
 	}
+	/* Show the latest data, not a kept snapshot. */
+	(void) kr_cache_read_renew(cache);
 
 	/* Check parameters */
 	int n = lua_gettop(L);
@@ -1101,20 +1718,289 @@ static int cache_get(lua_State *L)
 		format_error(L, "expected 'cache.get(string key)'");
 		lua_error(L);
 	}
-
-	/* Retrieve set of keys */
-	//const char *args = lua_tostring(L, 1);
-	static knot_db_val_t result_set[100];
-	int ret = kr_error(ENOSYS); // FIXME cache_prefixed(cache, args, result_set, 100);
-	if (ret < 0) {
-		format_error(L, kr_strerror(ret));
+	/* The wildcard matches the subtree, otherwise only the name itself. */
+	const char *args = lua_tostring(L, 1);
+	const bool subtree = strncmp(args, "*.", 2) == 0;
+	if (subtree) {
+		args += 2;
+	}
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	if (!knot_dname_from_str(name, args, sizeof(name))) {
+		format_error(L, "invalid domain name");
+		lua_error(L);
+	}
+	knot_dname_to_lower(name);
+	struct kr_cache_iter *it = kr_cache_iter_begin(cache, name);
+	if (!it) {
+		format_error(L, "the cache can't be listed");
 		lua_error(L);
 	}
+
 	/* Format output */
 	lua_newtable(L);
-	for (int i = 0; i < ret; ++i) {
-		cache_dump_key(L, &result_set[i]);
+	static struct kr_cache_iter_entry entries[100];
+	while (!kr_cache_iter_done(it)) {
+		int ret = kr_cache_iter_step(it, entries, sizeof(entries) / sizeof(entries[0]));
+		if (ret < 0) {
+			kr_cache_iter_free(it);
+			format_error(L, kr_strerror(ret));
+			lua_error(L);
+		}
+		for (int i = 0; i < ret; ++i) {
+			if (subtree || knot_dname_is_equal(entries[i].owner, name)) {
+				cache_dump_entry(L, &entries[i]);
+			}
+		}
+	}
+	kr_cache_iter_free(it);
+	return 1;
+}
+
+#define CACHE_ITER_META "kr_cache_iter"
+#define CACHE_ITER_CHUNK 100
+
+/** @internal State of cache.iter(), a full userdata kept by the iterator function. */
+struct cache_iter_ud {
+	struct kr_cache_iter *it;
+	int pos, count, max;
+	struct kr_cache_iter_entry entries[];
+};
+
+static int cache_iter_gc(lua_State *L)
+{
+	struct cache_iter_ud *ud = luaL_checkudata(L, 1, CACHE_ITER_META);
+	kr_cache_iter_free(ud->it);
+	ud->it = NULL;
+	return 0;
+}
+
+/** @internal Push the entry as a table. */
+static void cache_push_entry(lua_State *L, const struct kr_cache_iter_entry *e)
+{
+	char buf[KNOT_DNAME_TXT_MAXLEN] = ".";
+	knot_dname_to_str(buf, e->owner, sizeof(buf));
+	char type_buf[16] = { '\0' };
+	knot_rrtype_to_string(e->type, type_buf, sizeof(type_buf));
+	lua_createtable(L, 0, 7);
+	lua_pushstring(L, buf);
+	lua_setfield(L, -2, "owner");
+	lua_pushstring(L, type_buf);
+	lua_setfield(L, -2, "type");
+	lua_pushinteger(L, e->ttl);
+	lua_setfield(L, -2, "ttl");
+	lua_pushinteger(L, e->rank);
+	lua_setfield(L, -2, "rank");
+	lua_pushinteger(L, e->ns);
+	lua_setfield(L, -2, "ns");
+	lua_pushboolean(L, e->packet);
+	lua_setfield(L, -2, "packet");
+	lua_pushinteger(L, e->size);
+	lua_setfield(L, -2, "size");
+}
+
+/** @internal The iterator function, the next entry or nil at the end. */
+static int cache_iter_next(lua_State *L)
+{
+	struct cache_iter_ud *ud = lua_touserdata(L, lua_upvalueindex(1));
+	/* Each chunk is a read transaction of its own; between them the loop runs. */
+	while (ud->pos >= ud->count && !kr_cache_iter_done(ud->it)) {
+		int ret = kr_cache_iter_step(ud->it, ud->entries, ud->max);
+		if (ret < 0) {
+			format_error(L, kr_strerror(ret));
+			lua_error(L);
+		}
+		ud->pos = 0;
+		ud->count = ret;
+	}
+	if (ud->pos >= ud->count) {
+		return 0;
+	}
+	cache_push_entry(L, &ud->entries[ud->pos++]);
+	return 1;
+}
+
+/** Iterate over the entries at and below the name, by chunks. */
+static int cache_iter(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_cache *cache = &engine->resolver.cache;
+	if (!kr_cache_is_open(cache)) {
+		format_error(L, "cache isn't open");
+		lua_error(L);
+	}
+	int n = lua_gettop(L);
+	const char *args = (n >= 1 && lua_isstring(L, 1)) ? lua_tostring(L, 1) : ".";
+	if (strncmp(args, "*.", 2) == 0) {
+		args += 2;
+	}
+	int chunk = CACHE_ITER_CHUNK;
+	if (n >= 2 && lua_isnumber(L, 2)) {
+		chunk = lua_tointeger(L, 2);
+	}
+	if (chunk < 1 || chunk > UINT16_MAX) {
+		format_error(L, "expected 'cache.iter([string name], [number chunk])'");
+		lua_error(L);
+	}
+	(void) kr_cache_read_renew(cache);
+	struct cache_iter_ud *ud = lua_newuserdata(L,
+			sizeof(*ud) + chunk * sizeof(ud->entries[0]));
+	memset(ud, 0, sizeof(*ud));
+	ud->max = chunk;
+	if (luaL_newmetatable(L, CACHE_ITER_META)) {
+		lua_pushcfunction(L, cache_iter_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	ud->it = cache_iter_begin(L, cache, args);
+	lua_pushcclosure(L, cache_iter_next, 1);
+	return 1;
+}
+
+/** @internal State of cache.export(); only one runs at a time. */
+static struct cache_export {
+	uv_work_t work;
+	struct kr_cache *cache;
+	struct kr_cache_iter *it;
+	FILE *file;
+	char *path, *path_tmp;
+	int count;      /**< Entries in the chunk being written */
+	int ret;        /**< Error of the writing */
+	size_t total;
+	bool running;
+	struct kr_cache_iter_entry entries[CACHE_ITER_CHUNK];
+} cache_export_state;
+
+/** @internal Write the chunk as JSON lines; in the thread pool, the cache isn't touched here. */
+static void cache_export_work(uv_work_t *req)
+{
+	struct cache_export *ex = req->data;
+	for (int i = 0; i < ex->count && ex->ret == 0; ++i) {
+		const struct kr_cache_iter_entry *e = &ex->entries[i];
+		char owner[KNOT_DNAME_TXT_MAXLEN] = ".";
+		knot_dname_to_str(owner, e->owner, sizeof(owner));
+		char type_buf[16] = { '\0' };
+		knot_rrtype_to_string(e->type, type_buf, sizeof(type_buf));
+		fputs("{\"owner\":\"", ex->file);
+		/* The names may hold any bytes, escaped as \DDD except these. */
+		for (const char *c = owner; *c; ++c) {
+			if (*c == '"' || *c == '\\') {
+				fputc('\\', ex->file);
+			}
+			fputc(*c, ex->file);
+		}
+		if (fprintf(ex->file, "\",\"type\":\"%s\",\"ttl\":%"PRId32",\"rank\":%u,"
+			    "\"ns\":%u,\"packet\":%s,\"size\":%"PRIu32"}\n",
+			    type_buf, e->ttl, e->rank, e->ns,
+			    e->packet ? "true" : "false", e->size) < 0) {
+			ex->ret = kr_error(errno);
+		}
+	}
+	ex->total += ex->count;
+}
+
+static void cache_export_finish(struct cache_export *ex, int ret)
+{
+	if (ex->file && fclose(ex->file) != 0 && ret == 0) {
+		ret = kr_error(errno);
+	}
+	if (ret == 0 && rename(ex->path_tmp, ex->path) != 0) {
+		ret = kr_error(errno);
+	}
+	if (ret == 0) {
+		kr_log_info("[cache] exported %zu entries to '%s'\n", ex->total, ex->path);
+	} else {
+		unlink(ex->path_tmp);
+		kr_log_error("[cache] export to '%s' failed: %s\n", ex->path, kr_strerror(ret));
+	}
+	kr_cache_iter_free(ex->it);
+	free(ex->path);
+	free(ex->path_tmp);
+	memset(ex, 0, sizeof(*ex));
+}
+
+static void cache_export_done(uv_work_t *req, int status);
+
+/** @internal Walk the next chunk on the loop and hand it over to the thread pool. */
+static void cache_export_next(struct cache_export *ex)
+{
+	int ret = 0;
+	ex->count = 0;
+	while (ex->count == 0 && !kr_cache_iter_done(ex->it)) {
+		ret = kr_cache_iter_step(ex->it, ex->entries, CACHE_ITER_CHUNK);
+		if (ret < 0) {
+			break;
+		}
+		ex->count = ret;
+		ret = 0;
+	}
+	if (ret == 0 && ex->count > 0) {
+		ex->work.data = ex;
+		ret = uv_queue_work(uv_default_loop(), &ex->work,
+				    cache_export_work, cache_export_done);
+		if (ret == 0) {
+			return;
+		}
+		ret = kr_error(ret);
+	}
+	cache_export_finish(ex, ret);
+}
+
+static void cache_export_done(uv_work_t *req, int status)
+{
+	struct cache_export *ex = req->data;
+	if (status != 0 || ex->ret != 0) {
+		cache_export_finish(ex, status != 0 ? kr_error(ECANCELED) : ex->ret);
+		return;
+	}
+	if (!kr_cache_is_open(ex->cache)) {
+		cache_export_finish(ex, kr_error(ENOENT));
+		return;
+	}
+	cache_export_next(ex);
+}
+
+/** Export the entries at and below the name into a file, in the background. */
+static int cache_export(lua_State *L)
+{
+	struct engine *engine = engine_luaget(L);
+	struct kr_cache *cache = &engine->resolver.cache;
+	struct cache_export *ex = &cache_export_state;
+	int n = lua_gettop(L);
+	if (n < 1 || !lua_isstring(L, 1)) {
+		format_error(L, "expected 'cache.export(string path, [string name])'");
+		lua_error(L);
+	}
+	if (!kr_cache_is_open(cache)) {
+		format_error(L, "cache isn't open");
+		lua_error(L);
+	}
+	if (ex->running) {
+		format_error(L, "export already running");
+		lua_error(L);
+	}
+	const char *args = (n >= 2 && lua_isstring(L, 2)) ? lua_tostring(L, 2) : ".";
+	if (strncmp(args, "*.", 2) == 0) {
+		args += 2;
+	}
+	(void) kr_cache_read_renew(cache);
+	ex->it = cache_iter_begin(L, cache, args);
+	ex->cache = cache;
+	ex->path = strdup(lua_tostring(L, 1));
+	ex->path_tmp = kr_strcatdup(2, lua_tostring(L, 1), ".tmp");
+	if (ex->path && ex->path_tmp) {
+		ex->file = fopen(ex->path_tmp, "w");
+	}
+	if (!ex->file) {
+		kr_cache_iter_free(ex->it);
+		free(ex->path);
+		free(ex->path_tmp);
+		memset(ex, 0, sizeof(*ex));
+		format_error(L, "can't open the file");
+		lua_error(L);
 	}
+	ex->running = true;
+	cache_export_next(ex);
+	lua_pushboolean(L, true);
 	return 1;
 }
 
@@ -1217,11 +2103,11 @@ static int cache_zone_import(lua_State *L)
 
 	lua_newtable(L);
 	if (ret == 0) {
-		strncpy(msg, "zone file successfully parsed, import started", sizeof(msg));
+		strncpy(msg, "zone file parsing started", sizeof(msg));
 	} else if (ret == 1) {
 		strncpy(msg, "TA not found", sizeof(msg));
 	} else {
-		strncpy(msg, "error parsing zone file", sizeof(msg));
+		strncpy(msg, "error opening zone file", sizeof(msg));
 	}
 
 finish:
@@ -1241,12 +2127,18 @@ int lib_cache(lua_State *L)
 		{ "backends", cache_backends },
 		{ "count",  cache_count },
 		{ "stats",  cache_stats },
+		{ "kstats", cache_kstats },
 		{ "checkpoint", cache_checkpoint },
 		{ "open",   cache_open },
 		{ "close",  cache_close },
+		{ "remote", cache_remote },
+		{ "writer", cache_writer },
+		{ "read_reuse", cache_read_reuse },
 		{ "prune",  cache_prune },
 		{ "clear",  cache_clear },
 		{ "get",    cache_get },
+		{ "iter",   cache_iter },
+		{ "export", cache_export },
 		{ "max_ttl", cache_max_ttl },
 		{ "min_ttl", cache_min_ttl },
 		{ "ns_tout", cache_ns_tout },
@@ -1278,16 +2170,32 @@ static int execute_callback(lua_State *L, int argc)
 	return ret;
 }
 
+/** Where the function on top of the stack is defined, for the profiler logs. */
+static const char *event_where(lua_State *L, char *buf, size_t len)
+{
+	lua_Debug ar;
+	lua_pushvalue(L, -1);
+	if (!lua_getinfo(L, ">S", &ar)) {
+		return NULL;
+	}
+	snprintf(buf, len, "%s:%d", ar.short_src, ar.linedefined);
+	return buf;
+}
+
 static void event_callback(uv_timer_t *timer)
 {
 	struct worker_ctx *worker = timer->loop->data;
 	lua_State *L = worker->engine->L;
+	const uint64_t prof_since = worker_prof_begin(worker);
+	char where[LUA_IDSIZE + 16];
 
 	/* Retrieve callback and execute */
 	lua_rawgeti(L, LUA_REGISTRYINDEX, (intptr_t) timer->data);
 	lua_rawgeti(L, -1, 1);
+	const char *name = prof_since ? event_where(L, where, sizeof(where)) : NULL;
 	lua_pushinteger(L, (intptr_t) timer->data);
 	int ret = execute_callback(L, 1);
+	worker_prof_end(worker, PROF_EVENT, prof_since, name);
 	/* Free callback if not recurrent or an error */
 	if (ret != 0 || (uv_timer_get_repeat(timer) == 0 && uv_is_active((uv_handle_t *)timer) == 0)) {
 		if (!uv_is_closing((uv_handle_t *)timer)) {
@@ -1301,13 +2209,18 @@ static void event_fdcallback(uv_poll_t* handle, int status, int events)
 	struct worker_ctx *worker = handle->loop->data;
 	lua_State *L = worker->engine->L;
 
+	const uint64_t prof_since = worker_prof_begin(worker);
+	char where[LUA_IDSIZE + 16];
+
 	/* Retrieve callback and execute */
 	lua_rawgeti(L, LUA_REGISTRYINDEX, (intptr_t) handle->data);
 	lua_rawgeti(L, -1, 1);
+	const char *name = prof_since ? event_where(L, where, sizeof(where)) : NULL;
 	lua_pushinteger(L, (intptr_t) handle->data);
 	lua_pushinteger(L, status);
 	lua_pushinteger(L, events);
 	int ret = execute_callback(L, 3);
+	worker_prof_end(worker, PROF_EVENT, prof_since, name);
 	/* Free callback if not recurrent or an error */
 	if (ret != 0) {
 		if (!uv_is_closing((uv_handle_t *)handle)) {
@@ -1579,11 +2492,112 @@ static int wrk_resolve(lua_State *L)
 	return 1;
 }
 
+/** @internal Call the Lua callback of the batch with its counters. */
+static void resolve_many_done(const struct prefetch_batch_stats *stats, void *baton)
+{
+	struct worker_ctx *worker = uv_default_loop()->data;
+	lua_State *L = worker->engine->L;
+	const int ref = (intptr_t)baton;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, ref);
+	if (!lua_isfunction(L, -1)) {
+		lua_settop(L, 0);
+		return;
+	}
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, stats->total);
+	lua_setfield(L, -2, "total");
+	lua_pushinteger(L, stats->done);
+	lua_setfield(L, -2, "done");
+	lua_pushinteger(L, stats->failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushinteger(L, stats->duplicate);
+	lua_setfield(L, -2, "duplicate");
+	(void) execute_callback(L, 1);
+}
+
+/** Resolve a list of {name, type[, class]} in the background, see prefetch_batch_new(). */
+static int wrk_resolve_many(lua_State *L)
+{
+	if (!lua_istable(L, 1)) {
+		lua_pushstring(L, "expected 'resolve_many({ {name, type}, ... }, [options], [window], [callback])'");
+		lua_error(L);
+	}
+	const struct kr_qflags *options = lua_topointer(L, 2);
+	if (!options) { /* but we rely on the lua wrapper when dereferencing non-NULL */
+		lua_pushstring(L, "invalid options");
+		lua_error(L);
+	}
+	const int window = lua_isnumber(L, 3) ? lua_tointeger(L, 3) : 0;
+	if (window < 0) {
+		lua_pushstring(L, "invalid window");
+		lua_error(L);
+	}
+	/* The callback is referenced until the batch is done. */
+	int ref = LUA_NOREF;
+	if (lua_isfunction(L, 4)) {
+		lua_pushvalue(L, 4);
+		ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	struct prefetch_batch *batch = prefetch_batch_new(*options, window,
+				resolve_many_done, (void *)(intptr_t)ref);
+	if (!batch) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		lua_pushstring(L, "couldn't create a batch of requests");
+		lua_error(L);
+	}
+
+	uint8_t dname[KNOT_DNAME_MAXLEN];
+	const size_t count = lua_rawlen(L, 1);
+	for (size_t i = 1; i <= count; ++i) {
+		lua_rawgeti(L, 1, i);
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		lua_rawgeti(L, -3, 3);
+		const char *name = lua_tostring(L, -3);
+		uint16_t rrtype = KNOT_RRTYPE_A;
+		uint16_t rrclass = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : KNOT_CLASS_IN;
+		bool ok = name && knot_dname_from_str(dname, name, sizeof(dname));
+		if (lua_isnumber(L, -2)) {
+			rrtype = lua_tointeger(L, -2);
+		} else if (lua_isstring(L, -2)) {
+			ok = ok && knot_rrtype_from_string(lua_tostring(L, -2), &rrtype) == 0;
+		}
+		lua_pop(L, 4);
+		/* The bad ones are counted as failed. */
+		(void) prefetch_batch_add(batch, ok ? dname : NULL, rrtype, rrclass);
+	}
+
+	int ret = prefetch_batch_start(batch);
+	if (ret != 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		format_error(L, kr_strerror(ret));
+		lua_error(L);
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
 static inline double getseconds(uv_timeval_t *tv)
 {
 	return (double)tv->tv_sec + 0.000001*((double)tv->tv_usec);
 }
 
+/** Push the counters of the profiler as prof_<name>, prof_<name>_us and prof_<name>_max_us. */
+static void wrk_stats_prof(lua_State *L, const char *name, const struct worker_prof_stat *stat)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "prof_%s", name);
+	lua_pushnumber(L, stat->count);
+	lua_setfield(L, -2, key);
+	snprintf(key, sizeof(key), "prof_%s_us", name);
+	lua_pushnumber(L, stat->total_us);
+	lua_setfield(L, -2, key);
+	snprintf(key, sizeof(key), "prof_%s_max_us", name);
+	lua_pushnumber(L, stat->max_us);
+	lua_setfield(L, -2, key);
+}
+
 /** Return worker statistics. */
 static int wrk_stats(lua_State *L)
 {
@@ -1608,8 +2622,165 @@ static int wrk_stats(lua_State *L)
 	lua_setfield(L, -2, "queries");
 	lua_pushnumber(L, worker->stats.dropped);
 	lua_setfield(L, -2, "dropped");
+	lua_pushnumber(L, worker->stats.truncated);
+	lua_setfield(L, -2, "truncated");
 	lua_pushnumber(L, worker->stats.timeout);
 	lua_setfield(L, -2, "timeout");
+	lua_pushnumber(L, worker->stats.udp_batches);
+	lua_setfield(L, -2, "udp_batches");
+	lua_pushnumber(L, worker->stats.udp_batched);
+	lua_setfield(L, -2, "udp_batched");
+	lua_pushnumber(L, worker->stats.tcp_batches);
+	lua_setfield(L, -2, "tcp_batches");
+	lua_pushnumber(L, worker->stats.tcp_batched);
+	lua_setfield(L, -2, "tcp_batched");
+	lua_pushnumber(L, worker->stats.shared_waits);
+	lua_setfield(L, -2, "shared_waits");
+	lua_pushnumber(L, worker->stats.udp_reused);
+	lua_setfield(L, -2, "udp_reused");
+	lua_pushnumber(L, worker->stats.tcp_reused);
+	lua_setfield(L, -2, "tcp_reused");
+	lua_pushnumber(L, worker->stats.tls_resumed);
+	lua_setfield(L, -2, "tls_resumed");
+	lua_pushnumber(L, worker->stats.tls_hs_offloaded);
+	lua_setfield(L, -2, "tls_hs_offloaded");
+	lua_pushnumber(L, worker->stats.tls_hs_queue);
+	lua_setfield(L, -2, "tls_hs_queue");
+	lua_pushnumber(L, worker->stats.tls_hs_refused);
+	lua_setfield(L, -2, "tls_hs_refused");
+	lua_pushnumber(L, worker->stats.tls_conns);
+	lua_setfield(L, -2, "tls_conns");
+	lua_pushnumber(L, worker->stats.doh);
+	lua_setfield(L, -2, "doh");
+	lua_pushnumber(L, worker->stats.doh_conns);
+	lua_setfield(L, -2, "doh_conns");
+	lua_pushnumber(L, worker->stats.tfo_in);
+	lua_setfield(L, -2, "tfo_in");
+	lua_pushnumber(L, worker->stats.tfo_out);
+	lua_setfield(L, -2, "tfo_out");
+	lua_pushnumber(L, worker->stats.tfo_out_fallback);
+	lua_setfield(L, -2, "tfo_out_fallback");
+	lua_pushnumber(L, worker->stats.hedges);
+	lua_setfield(L, -2, "hedges");
+	lua_pushnumber(L, worker->stats.hedges_won);
+	lua_setfield(L, -2, "hedges_won");
+	lua_pushnumber(L, worker->stats.xdp_rx);
+	lua_setfield(L, -2, "xdp_rx");
+	lua_pushnumber(L, worker->stats.xdp_tx);
+	lua_setfield(L, -2, "xdp_tx");
+	lua_pushnumber(L, worker->stats.xdp_dropped);
+	lua_setfield(L, -2, "xdp_dropped");
+	lua_pushnumber(L, worker->stats.uring_enters);
+	lua_setfield(L, -2, "uring_enters");
+	lua_pushnumber(L, worker->stats.uring_sqes);
+	lua_setfield(L, -2, "uring_sqes");
+	lua_pushnumber(L, worker->stats.uring_cqes);
+	lua_setfield(L, -2, "uring_cqes");
+	lua_pushnumber(L, worker->stats.uring_nobufs);
+	lua_setfield(L, -2, "uring_nobufs");
+	lua_pushnumber(L, worker->stats.wire_ring_full);
+	lua_setfield(L, -2, "wire_ring_full");
+	lua_pushnumber(L, worker->stats.udp_waves);
+	lua_setfield(L, -2, "udp_waves");
+	lua_pushnumber(L, worker->stats.udp_wave_queries);
+	lua_setfield(L, -2, "udp_wave_queries");
+	lua_pushnumber(L, worker->stats.udp_wave_dups);
+	lua_setfield(L, -2, "udp_wave_dups");
+	lua_pushnumber(L, worker->stats.udp_gso);
+	lua_setfield(L, -2, "udp_gso");
+	lua_pushnumber(L, worker->stats.udp_gso_segments);
+	lua_setfield(L, -2, "udp_gso_segments");
+	lua_pushnumber(L, worker->stats.fast_path);
+	lua_setfield(L, -2, "fast_path");
+	worker->stats.socket_drops = network_socket_drops(&worker->engine->net);
+	lua_pushnumber(L, worker->stats.socket_drops);
+	lua_setfield(L, -2, "socket_drops");
+	lua_pushnumber(L, worker->stats.budget_exceeded);
+	lua_setfield(L, -2, "budget_exceeded");
+	lua_pushnumber(L, worker->stats.overload_shed);
+	lua_setfield(L, -2, "overload_shed");
+	lua_pushnumber(L, worker->stats.retransmits);
+	lua_setfield(L, -2, "retransmits");
+	lua_pushnumber(L, worker->stats.tcp_in_conns);
+	lua_setfield(L, -2, "tcp_in_conns");
+	lua_pushnumber(L, worker->stats.tcp_in_evicted);
+	lua_setfield(L, -2, "tcp_in_evicted");
+	lua_pushnumber(L, worker->stats.tcp_in_refused);
+	lua_setfield(L, -2, "tcp_in_refused");
+	lua_pushnumber(L, worker->stats.loop_lag);
+	lua_setfield(L, -2, "loop_lag");
+	const int64_t tlb_misses = worker_tlb_misses(worker);
+	if (tlb_misses >= 0) {
+		lua_pushnumber(L, tlb_misses);
+		lua_setfield(L, -2, "tlb_misses");
+	}
+	lua_pushnumber(L, worker->stats.lua_gc_steps);
+	lua_setfield(L, -2, "lua_gc_steps");
+	lua_pushnumber(L, worker->stats.lua_gc_cycles);
+	lua_setfield(L, -2, "lua_gc_cycles");
+	lua_pushnumber(L, worker->stats.lua_gc_us);
+	lua_setfield(L, -2, "lua_gc_us");
+	lua_pushnumber(L, worker->stats.lua_gc_max_us);
+	lua_setfield(L, -2, "lua_gc_max_us");
+	lua_pushnumber(L, lua_gc(L, LUA_GCCOUNT, 0));
+	lua_setfield(L, -2, "lua_mem_kb");
+	worker_mem_update(worker);
+	lua_pushnumber(L, worker->mem.lua);
+	lua_setfield(L, -2, "mem_lua");
+	lua_pushnumber(L, worker->mem.mempools);
+	lua_setfield(L, -2, "mem_mempools");
+	lua_pushnumber(L, worker->mem.freelists);
+	lua_setfield(L, -2, "mem_freelists");
+	char mem_key[32];
+	for (int i = 0; i < KR_MEM_TAG_COUNT; ++i) {
+		snprintf(mem_key, sizeof(mem_key), "mem_%s", kr_mem_tag_names[i]);
+		lua_pushnumber(L, worker->mem.tagged[i]);
+		lua_setfield(L, -2, mem_key);
+	}
+	if (worker->prof.enabled) {
+		wrk_stats_prof(L, "loop", &worker->prof.loop);
+		for (int i = 0; i < PROF_COUNT; ++i) {
+			wrk_stats_prof(L, worker_prof_names[i], &worker->prof.cb[i]);
+		}
+		lua_pushnumber(L, worker->prof.slow);
+		lua_setfield(L, -2, "prof_slow");
+	}
+	uint64_t timers_expired = 0, timers_cancelled = 0;
+	for (int i = 0; i < TW_BUCKETS; ++i) {
+		timers_expired += worker->timers.expired[i];
+		timers_cancelled += worker->timers.cancelled[i];
+	}
+	lua_pushnumber(L, worker->timers.count);
+	lua_setfield(L, -2, "timers");
+	lua_pushnumber(L, timers_expired);
+	lua_setfield(L, -2, "timers_expired");
+	lua_pushnumber(L, timers_cancelled);
+	lua_setfield(L, -2, "timers_cancelled");
+	/* Object caches, flat so that stats merging just sums them up. */
+#define push_obj_cache(name) \
+	lua_pushnumber(L, worker->name.hit); \
+	lua_setfield(L, -2, #name "_hit"); \
+	lua_pushnumber(L, worker->name.miss); \
+	lua_setfield(L, -2, #name "_miss"); \
+	lua_pushnumber(L, worker->name.drop); \
+	lua_setfield(L, -2, #name "_drop"); \
+	lua_pushnumber(L, worker->name.free.len); \
+	lua_setfield(L, -2, #name "_cached")
+	push_obj_cache(pool_mp);
+	push_obj_cache(pool_ioreqs);
+	push_obj_cache(pool_iohandles);
+	push_obj_cache(pool_sessions);
+	push_obj_cache(pool_tls);
+	push_obj_cache(pool_pkts);
+#undef push_obj_cache
+	lua_pushnumber(L, worker->pool_mp_usage.alloc);
+	lua_setfield(L, -2, "pool_mp_alloc_bytes");
+	lua_pushnumber(L, worker->pool_mp_usage.reused);
+	lua_setfield(L, -2, "pool_mp_reused_bytes");
+	lua_pushnumber(L, worker->pool_mp_usage.freed);
+	lua_setfield(L, -2, "pool_mp_freed_bytes");
+	lua_pushnumber(L, worker->pool_mp_usage.target);
+	lua_setfield(L, -2, "pool_mp_target_bytes");
 	/* Add subset of rusage that represents counters. */
 	uv_rusage_t rusage;
 	if (uv_getrusage(&rusage) == 0) {
@@ -1633,11 +2804,328 @@ static int wrk_stats(lua_State *L)
 	return 1;
 }
 
+/** Return the counters of all forks from the shared memory, summed up; or nil. */
+static int wrk_shared_stats(lua_State *L)
+{
+	trie_t *sums = worker_shstats_sum();
+	if (!sums) {
+		return 0;
+	}
+	lua_newtable(L);
+	trie_it_t *it;
+	for (it = trie_it_begin(sums); it && !trie_it_finished(it); trie_it_next(it)) {
+		lua_pushnumber(L, (uintptr_t)*trie_it_val(it));
+		lua_setfield(L, -2, trie_it_key(it, NULL));
+	}
+	trie_it_free(it);
+	trie_free(sums);
+	return 1;
+}
+
+/** Get/set the early retransmit to other addresses. */
+static int wrk_hedge(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	if (lua_isnumber(L, 1)) {
+		int rtt_pct = lua_tointeger(L, 1);
+		if (rtt_pct < 0 || rtt_pct > UINT16_MAX) {
+			format_error(L, "rtt_pct must be within <0, " xstr(UINT16_MAX) ">");
+			lua_error(L);
+		}
+		worker->hedge.rtt_pct = rtt_pct;
+	}
+	if (lua_isnumber(L, 2)) {
+		int budget_pct = lua_tointeger(L, 2);
+		if (budget_pct < 0 || budget_pct > 100) {
+			format_error(L, "budget_pct must be within <0, 100>");
+			lua_error(L);
+		}
+		worker->hedge.budget_pct = budget_pct;
+	}
+	lua_pushnumber(L, worker->hedge.rtt_pct);
+	lua_pushnumber(L, worker->hedge.budget_pct);
+	return 2;
+}
+
+/** Get/set the I/O backend of the UDP listeners. */
+static int wrk_io_backend(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	if (lua_isstring(L, 1)) {
+		const char *name = lua_tostring(L, 1);
+		bool enable = strcmp(name, "io_uring") == 0;
+		if (!enable && strcmp(name, "libuv") != 0) {
+			format_error(L, "expected 'libuv' or 'io_uring'");
+			lua_error(L);
+		}
+		int ret = worker_io_uring(worker, enable);
+		if (ret != 0) {
+			format_error(L, kr_strerror(ret));
+			lua_error(L);
+		}
+	}
+	lua_pushstring(L, worker->io_uring ? "io_uring" : "libuv");
+	return 1;
+}
+
+/** Get/set the limits of the work on one request. */
+static int wrk_budget(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	struct kr_budget *budget = &worker->engine->resolver.budget;
+	if (lua_istable(L, 1)) {
+		static const char *names[] = { "upstream", "queries", "cpu", "signatures" };
+		uint32_t *limits[] = { &budget->upstream, &budget->queries, &budget->cpu_ms,
+				       &budget->signatures };
+		for (int i = 0; i < 4; ++i) {
+			lua_getfield(L, 1, names[i]);
+			if (lua_isnumber(L, -1)) {
+				lua_Number val = lua_tonumber(L, -1);
+				if (val < 0 || val > UINT32_MAX) {
+					format_error(L, "budget limits must be within <0, " xstr(UINT32_MAX) ">");
+					lua_error(L);
+				}
+				*limits[i] = val;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_newtable(L);
+	lua_pushnumber(L, budget->upstream);
+	lua_setfield(L, -2, "upstream");
+	lua_pushnumber(L, budget->queries);
+	lua_setfield(L, -2, "queries");
+	lua_pushnumber(L, budget->cpu_ms);
+	lua_setfield(L, -2, "cpu");
+	lua_pushnumber(L, budget->signatures);
+	lua_setfield(L, -2, "signatures");
+	return 1;
+}
+
+/** Turn the profiler on/off, see worker_prof_enable(). */
+static int wrk_profile(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	int n = lua_gettop(L);
+	if (n > 0) {
+		lua_Number slow = n > 1 ? lua_tonumber(L, 2) : 0;
+		if (!lua_isboolean(L, 1) || (n > 1 && !lua_isnumber(L, 2))
+		    || slow < 0 || slow > UINT32_MAX) {
+			format_error(L, "expected 'profile(boolean enable, [number slow_ms])'");
+			lua_error(L);
+		}
+		int ret = worker_prof_enable(worker, lua_toboolean(L, 1), slow);
+		if (ret != 0) {
+			format_error(L, kr_strerror(ret));
+			lua_error(L);
+		}
+	}
+	lua_newtable(L);
+	lua_pushboolean(L, worker->prof.enabled);
+	lua_setfield(L, -2, "enabled");
+	lua_pushnumber(L, worker->prof.slow_ms);
+	lua_setfield(L, -2, "slow");
+	return 1;
+}
+
+/** Set/get the thresholds for shedding new requests, see worker_ctx::overload. */
+static int wrk_overload(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	if (lua_istable(L, 1)) {
+		static const char *names[] = { "requests", "lag" };
+		uint32_t *limits[] = { &worker->overload.requests, &worker->overload.lag };
+		for (int i = 0; i < 2; ++i) {
+			lua_getfield(L, 1, names[i]);
+			if (lua_isnumber(L, -1)) {
+				lua_Number val = lua_tonumber(L, -1);
+				if (val < 0 || val > UINT32_MAX) {
+					format_error(L, "overload thresholds must be within <0, 4294967295>");
+					lua_error(L);
+				}
+				*limits[i] = val;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_newtable(L);
+	lua_pushnumber(L, worker->overload.requests);
+	lua_setfield(L, -2, "requests");
+	lua_pushnumber(L, worker->overload.lag);
+	lua_setfield(L, -2, "lag");
+	return 1;
+}
+
+/** Set/get when to record the traces of requests and print them, see kr_context::trace. */
+static int wrk_trace(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	struct kr_trace_conf *conf = &worker->engine->resolver.trace;
+	if (lua_istable(L, 1)) {
+		static const char *names[] = { "sample", "size", "slow" };
+		uint32_t *values[] = { &conf->sample, &conf->size, &conf->slow_ms };
+		for (int i = 0; i < 3; ++i) {
+			lua_getfield(L, 1, names[i]);
+			if (lua_isnumber(L, -1)) {
+				lua_Number val = lua_tonumber(L, -1);
+				if (val < 0 || val > UINT32_MAX) {
+					format_error(L, "trace parameters must be within <0, 4294967295>");
+					lua_error(L);
+				}
+				if (i == 1 && val < 1024) {
+					format_error(L, "trace size must be at least 1024 bytes");
+					lua_error(L);
+				}
+				*values[i] = val;
+			}
+			lua_pop(L, 1);
+		}
+		lua_getfield(L, 1, "servfail");
+		if (lua_isboolean(L, -1)) {
+			conf->servfail = lua_toboolean(L, -1);
+		}
+		lua_getfield(L, 1, "all");
+		if (lua_isboolean(L, -1)) {
+			conf->all = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 2);
+		conf->counter = 0;
+	}
+	lua_newtable(L);
+	lua_pushnumber(L, conf->sample);
+	lua_setfield(L, -2, "sample");
+	lua_pushnumber(L, conf->size);
+	lua_setfield(L, -2, "size");
+	lua_pushboolean(L, conf->servfail);
+	lua_setfield(L, -2, "servfail");
+	lua_pushnumber(L, conf->slow_ms);
+	lua_setfield(L, -2, "slow");
+	lua_pushboolean(L, conf->all);
+	lua_setfield(L, -2, "all");
+	lua_pushnumber(L, conf->recorded);
+	lua_setfield(L, -2, "recorded");
+	lua_pushnumber(L, conf->printed);
+	lua_setfield(L, -2, "printed");
+	return 1;
+}
+
+/** Set/get the steps of the Lua collector, see worker_ctx::lua_gc. */
+static int wrk_lua_gc(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	if (lua_istable(L, 1)) {
+		static const char *names[] = { "step", "budget", "pause" };
+		uint32_t *values[] = { &worker->lua_gc.step_kb, &worker->lua_gc.budget_us,
+					&worker->lua_gc.pause };
+		for (int i = 0; i < 3; ++i) {
+			lua_getfield(L, 1, names[i]);
+			if (lua_isnumber(L, -1)) {
+				lua_Number val = lua_tonumber(L, -1);
+				if (val < 0 || val > UINT32_MAX) {
+					format_error(L, "lua_gc parameters must be within <0, 4294967295>");
+					lua_error(L);
+				}
+				*values[i] = val;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_newtable(L);
+	lua_pushnumber(L, worker->lua_gc.step_kb);
+	lua_setfield(L, -2, "step");
+	lua_pushnumber(L, worker->lua_gc.budget_us);
+	lua_setfield(L, -2, "budget");
+	lua_pushnumber(L, worker->lua_gc.pause);
+	lua_setfield(L, -2, "pause");
+	return 1;
+}
+
+/** Return the counts of the requests over budget, by zone. */
+static int wrk_budget_zones(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	lua_newtable(L);
+	if (!worker->budget_zones) {
+		return 1;
+	}
+	trie_it_t *it;
+	for (it = trie_it_begin(worker->budget_zones); it && !trie_it_finished(it);
+								trie_it_next(it)) {
+		char zone[KNOT_DNAME_MAXLEN];
+		const knot_dname_t *name = (const knot_dname_t *)trie_it_key(it, NULL);
+		if (knot_dname_to_str(zone, name, sizeof(zone))) {
+			lua_pushnumber(L, (uintptr_t)*trie_it_val(it));
+			lua_setfield(L, -2, zone);
+		}
+	}
+	trie_it_free(it);
+	return 1;
+}
+
+/** Return the counts of the session timers that fired or were stopped, by the timeout. */
+static int wrk_timers(lua_State *L)
+{
+	struct worker_ctx *worker = wrk_luaget(L);
+	if (!worker) {
+		return 0;
+	}
+	const struct timer_wheel *wheel = &worker->timers;
+	lua_newtable(L);
+	for (int i = 0; i < TW_BUCKETS; ++i) {
+		if (wheel->expired[i] == 0 && wheel->cancelled[i] == 0) {
+			continue;
+		}
+		/* Keyed by the power of two the timeouts are under. */
+		lua_newtable(L);
+		lua_pushnumber(L, wheel->expired[i]);
+		lua_setfield(L, -2, "expired");
+		lua_pushnumber(L, wheel->cancelled[i]);
+		lua_setfield(L, -2, "cancelled");
+		lua_rawseti(L, -2, 1 << i);
+	}
+	return 1;
+}
+
 int lib_worker(lua_State *L)
 {
 	static const luaL_Reg lib[] = {
 		{ "resolve_unwrapped",  wrk_resolve },
+		{ "resolve_many_unwrapped", wrk_resolve_many },
 		{ "stats",    wrk_stats },
+		{ "shared_stats", wrk_shared_stats },
+		{ "hedge",    wrk_hedge },
+		{ "io_backend", wrk_io_backend },
+		{ "budget",   wrk_budget },
+		{ "budget_zones", wrk_budget_zones },
+		{ "overload", wrk_overload },
+		{ "profile", wrk_profile },
+		{ "trace",    wrk_trace },
+		{ "lua_gc",   wrk_lua_gc },
+		{ "timers",   wrk_timers },
 		{ NULL, NULL }
 	};
 	register_lib(L, "worker", lib);
@@ -6,8 +6,14 @@ kresd_SOURCES := \
 	daemon/bindings.c    \
 	daemon/ffimodule.c   \
 	daemon/tls.c         \
+	daemon/http.c        \
 	daemon/tls_ephemeral_credentials.c \
 	daemon/zimport.c     \
+	daemon/rpz.c         \
+	daemon/prefetch.c    \
+	daemon/handoff.c     \
+	daemon/xdp.c         \
+	daemon/uring.c       \
 	daemon/main.c
 
 kresd_DIST := daemon/lua/kres.lua daemon/lua/kres-gen.lua \
@@ -47,6 +53,24 @@ kresd_CFLAGS += -DHAS_SYSTEMD
 kresd_LIBS += $(libsystemd_LIBS)
 endif
 
+# Enable AF_XDP listeners
+ifeq ($(HAS_libbpf), yes)
+kresd_CFLAGS += -DENABLE_XDP $(libbpf_CFLAGS)
+kresd_LIBS += $(libbpf_LIBS)
+endif
+
+# Enable io_uring backend
+ifeq ($(HAS_liburing), yes)
+kresd_CFLAGS += -DENABLE_URING $(liburing_CFLAGS)
+kresd_LIBS += $(liburing_LIBS)
+endif
+
+# Enable DNS-over-HTTPS listeners
+ifeq ($(HAS_libnghttp2), yes)
+kresd_CFLAGS += -DENABLE_DOH $(libnghttp2_CFLAGS)
+kresd_LIBS += $(libnghttp2_LIBS)
+endif
+
 # Make binary
 $(eval $(call make_sbin,kresd,daemon,yes))
 
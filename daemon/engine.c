@@ -31,6 +31,7 @@
 #include "lib/cache/api.h"
 #include "lib/defines.h"
 #include "lib/cache/cdb_lmdb.h"
+#include "lib/cache/cdb_mem.h"
 #include "lib/dnssec/ta.h"
 
 /** @internal Compatibility wrapper for Lua < 5.2 */
@@ -145,6 +146,18 @@ static int l_quit(lua_State *L)
 	return 0;
 }
 
+/** Re-evaluate the config of this instance. */
+static int l_reload(lua_State *L)
+{
+	int ret = engine_reload(engine_luaget(L));
+	if (ret != 0) {
+		lua_pushstring(L, kr_strerror(ret));
+		lua_error(L);
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
 /** Toggle verbose mode. */
 static int l_verbose(lua_State *L)
 {
@@ -270,7 +283,7 @@ static int l_moduledir(lua_State *L)
 /** @internal for l_trustanchor: */
 static void ta_add(zs_scanner_t *zs)
 {
-	map_t *ta = zs->process.data;
+	trie_t *ta = zs->process.data;
 	if (!ta)
 		return;
 	if (kr_ta_add(ta, zs->r_owner, zs->r_type, zs->r_ttl, zs->r_data, zs->r_data_length))
@@ -292,7 +305,7 @@ static int l_trustanchor(lua_State *L)
 			lua_pushstring(L, "invalid trust anchor owner");
 			lua_error(L);
 		}
-		lua_pushboolean(L, kr_ta_del(&engine->resolver.trust_anchors, owner) == 0);
+		lua_pushboolean(L, kr_ta_del(engine->resolver.trust_anchors, owner) == 0);
 		free(owner);
 		return 1;
 	}
@@ -304,7 +317,7 @@ static int l_trustanchor(lua_State *L)
 		lua_pushstring(L, "not enough memory");
 		lua_error(L);
 	}
-	zs_set_processing(zs, ta_add, NULL, &engine->resolver.trust_anchors);
+	zs_set_processing(zs, ta_add, NULL, engine->resolver.trust_anchors);
 	bool ok = zs_set_input_string(zs, anchor, strlen(anchor)) == 0
 		&& zs_parse_all(zs) == 0;
 	ok = ok && zs->process.data; /* reset to NULL on error in ta_add */
@@ -601,8 +614,11 @@ static int l_trampoline(lua_State *L)
 static int init_resolver(struct engine *engine)
 {
 	/* Open resolution context */
-	engine->resolver.trust_anchors = map_make(NULL);
-	engine->resolver.negative_anchors = map_make(NULL);
+	engine->resolver.trust_anchors = trie_create(NULL);
+	engine->resolver.negative_anchors = trie_create(NULL);
+	if (!engine->resolver.trust_anchors || !engine->resolver.negative_anchors) {
+		return kr_error(ENOMEM);
+	}
 	engine->resolver.pool = engine->pool;
 	engine->resolver.modules = &engine->modules;
 	engine->resolver.cache_rtt_tout_retry_interval = KR_NS_TIMEOUT_RETRY_INTERVAL;
@@ -614,19 +630,39 @@ static int init_resolver(struct engine *engine)
 	knot_edns_init(engine->resolver.opt_rr, KR_EDNS_PAYLOAD, 0, KR_EDNS_VERSION, engine->pool);
 	/* Use default TLS padding */
 	engine->resolver.tls_padding = -1;
+	/* Request traces aren't recorded until worker.trace() */
+	engine->resolver.trace.size = KR_TRACE_SIZE;
+	/* No zones get the client subnet until net.ecs() */
+	engine->resolver.ecs.source4 = KR_ECS_SOURCE4;
+	engine->resolver.ecs.source6 = KR_ECS_SOURCE6;
+	engine->resolver.ecs.scopes_max = KR_ECS_SCOPES_MAX;
+	/* Only the signature checks are limited until worker.budget() */
+	engine->resolver.budget.signatures = KR_VALIDATE_LIMIT_CRYPTO;
 	/* Empty init; filled via ./lua/config.lua */
 	kr_zonecut_init(&engine->resolver.root_hints, (const uint8_t *)"", engine->pool);
 	/* Open NS rtt + reputation cache */
-	lru_create(&engine->resolver.cache_rtt, LRU_RTT_SIZE, engine->pool, NULL);
-	lru_create(&engine->resolver.cache_rep, LRU_REP_SIZE, engine->pool, NULL);
-	lru_create(&engine->resolver.cache_cookie, LRU_COOKIES_SIZE, engine->pool, NULL);
+	/* The tables aren't in the mempool, so that they may get huge pages (--hugepages). */
+	/* The entries are counted by subsystem, see worker_mem_update(). */
+	knot_mm_t *mm_nsrep = kr_mm_tagged(KR_MEM_NSREP);
+	lru_create(&engine->resolver.cache_rtt, LRU_RTT_SIZE, NULL, mm_nsrep);
+	lru_create(&engine->resolver.cache_rep, LRU_REP_SIZE, NULL, mm_nsrep);
+	lru_create(&engine->resolver.cache_lame, LRU_LAME_SIZE, NULL, mm_nsrep);
+	lru_create(&engine->resolver.cache_edns, LRU_EDNS_SIZE, NULL, mm_nsrep);
+	lru_create(&engine->resolver.cache_depth, LRU_DEPTH_SIZE, NULL, mm_nsrep);
+	lru_create(&engine->resolver.cache_cookie, LRU_COOKIES_SIZE, NULL,
+		   kr_mm_tagged(KR_MEM_COOKIES));
 
 	/* Load basic modules */
 	engine_register(engine, "iterate", NULL, NULL);
 	engine_register(engine, "validate", NULL, NULL);
 	engine_register(engine, "cache", NULL, NULL);
 
-	return array_push(engine->backends, kr_cdb_lmdb());
+	/* The first one is the default. */
+	if (array_push(engine->backends, kr_cdb_lmdb()) < 0
+	    || array_push(engine->backends, kr_cdb_mem()) < 0) {
+		return kr_error(ENOMEM);
+	}
+	return kr_ok();
 }
 
 static int init_state(struct engine *engine)
@@ -644,6 +680,8 @@ static int init_state(struct engine *engine)
 	lua_setglobal(engine->L, "help");
 	lua_pushcfunction(engine->L, l_quit);
 	lua_setglobal(engine->L, "quit");
+	lua_pushcfunction(engine->L, l_reload);
+	lua_setglobal(engine->L, "reload");
 	lua_pushcfunction(engine->L, l_hostname);
 	lua_setglobal(engine->L, "hostname");
 	lua_pushcfunction(engine->L, l_moduledir);
@@ -755,6 +793,9 @@ void engine_deinit(struct engine *engine)
 	/* The lru keys are currently malloc-ated and need to be freed. */
 	lru_free(engine->resolver.cache_rtt);
 	lru_free(engine->resolver.cache_rep);
+	lru_free(engine->resolver.cache_lame);
+	lru_free(engine->resolver.cache_edns);
+	lru_free(engine->resolver.cache_depth);
 	lru_free(engine->resolver.cache_cookie);
 
 	/* Clear IPC pipes */
@@ -774,10 +815,14 @@ void engine_deinit(struct engine *engine)
 	array_clear(engine->modules);
 	array_clear(engine->backends);
 	array_clear(engine->ipc_set);
-	kr_ta_clear(&engine->resolver.trust_anchors);
-	kr_ta_clear(&engine->resolver.negative_anchors);
+	kr_ta_clear(engine->resolver.trust_anchors);
+	kr_ta_clear(engine->resolver.negative_anchors);
+	trie_free(engine->resolver.trust_anchors);
+	trie_free(engine->resolver.negative_anchors);
+	trie_free(engine->resolver.ecs.zones);
 	free(engine->hostname);
 	free(engine->moduledir);
+	free(engine->config_path);
 }
 
 int engine_pcall(lua_State *L, int argc)
@@ -837,6 +882,11 @@ int engine_load_sandbox(struct engine *engine)
 int engine_loadconf(struct engine *engine, const char *config_path)
 {
 	assert(config_path != NULL);
+	/* Remember it for engine_reload(). */
+	if (config_path != engine->config_path) {
+		free(engine->config_path);
+		engine->config_path = strdup(config_path);
+	}
 	int ret = l_dosandboxfile(engine->L, config_path);
 	if (ret != 0) {
 		fprintf(stderr, "%s\n", lua_tostring(engine->L, -1));
@@ -859,6 +909,52 @@ int engine_load_defaults(struct engine *engine)
 	return ret;
 }
 
+static void update_fast_path(struct engine *engine);
+
+int engine_reload(struct engine *engine)
+{
+	if (!engine->config_path) {
+		return kr_error(ENOENT);
+	}
+	lua_State *L = engine->L;
+	/* Don't tear anything down for a config that doesn't even compile. */
+	if (luaL_loadfile(L, engine->config_path) != 0) {
+		kr_log_error("[system] reload: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return kr_error(ENOEXEC);
+	}
+	lua_pop(L, 1);
+	/* The modules start afresh, the sandbox and the config load them again.
+	 * Lua modules are required anew, so that they don't keep the old rules. */
+	while (engine->modules.len > 0) {
+		struct kr_module *module = engine->modules.at[engine->modules.len - 1];
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "loaded");
+		lua_pushnil(L);
+		lua_setfield(L, -2, module->name);
+		lua_pop(L, 2);
+		engine_unload(engine, module);
+		array_pop(engine->modules);
+	}
+	update_fast_path(engine);
+	lua_getglobal(L, "modules_load_embedded");
+	if (engine_pcall(L, 0) != 0) {
+		kr_log_error("[system] reload: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return kr_error(ENOEXEC);
+	}
+	/* Listening sockets, the cache and the resolver state stay as they are. */
+	int ret = engine_loadconf(engine, engine->config_path);
+	if (ret == 0) {
+		ret = engine_load_defaults(engine);
+	}
+	if (ret != 0) {
+		return kr_error(ENOEXEC);
+	}
+	kr_log_info("[system] reloaded config '%s'\n", engine->config_path);
+	return kr_ok();
+}
+
 int engine_start(struct engine *engine)
 {
 	/* Clean up stack and restart GC */
@@ -908,6 +1004,20 @@ static int register_properties(struct engine *engine, struct kr_module *module)
 	return kr_ok();
 }
 
+/** @internal Check whether plain cache hits may skip the layers, see kr_layer_api::skip_hits. */
+static void update_fast_path(struct engine *engine)
+{
+	engine->fast_path = true;
+	for (size_t i = 0; i < engine->modules.len; ++i) {
+		struct kr_module *mod = engine->modules.at[i];
+		const kr_layer_api_t *api = mod->layer ? mod->layer(mod) : NULL;
+		if (api && !api->skip_hits) {
+			engine->fast_path = false;
+			return;
+		}
+	}
+}
+
 /** @internal Find matching module */
 static size_t module_find(module_array_t *mod_list, const char *name)
 {
@@ -977,6 +1087,7 @@ int engine_register(struct engine *engine, const char *name, const char *precede
 			arr[emplacement] = module;
 		}
 	}
+	update_fast_path(engine);
 
 	return register_properties(engine, module);
 }
@@ -988,6 +1099,7 @@ int engine_unregister(struct engine *engine, const char *name)
 	if (found < mod_list->len) {
 		engine_unload(engine, mod_list->at[found]);
 		array_del(*mod_list, found);
+		update_fast_path(engine);
 		return kr_ok();
 	}
 
@@ -23,6 +23,15 @@
 #ifndef LRU_REP_SIZE
 #define LRU_REP_SIZE (LRU_RTT_SIZE / 4) /**< NS reputation cache size */
 #endif
+#ifndef LRU_LAME_SIZE
+#define LRU_LAME_SIZE (LRU_RTT_SIZE / 4) /**< Failing (zone, NS) pairs cache size */
+#endif
+#ifndef LRU_EDNS_SIZE
+#define LRU_EDNS_SIZE (LRU_RTT_SIZE / 4) /**< EDNS payload fallbacks cache size */
+#endif
+#ifndef LRU_DEPTH_SIZE
+#define LRU_DEPTH_SIZE (LRU_RTT_SIZE / 4) /**< Zone cut depth hints cache size */
+#endif
 #ifndef LRU_COOKIES_SIZE
 #define LRU_COOKIES_SIZE LRU_RTT_SIZE /**< DNS cookies cache size. */
 #endif
@@ -36,6 +45,39 @@
 #ifndef RECVMMSG_BATCH
 #define RECVMMSG_BATCH 4
 #endif
+#ifndef WIRE_RING_SLOTS
+#define WIRE_RING_SLOTS 256 /**< Receive buffers of the listening UDP sockets, 64 KiB each, see worker_wire_getbuf() */
+#endif
+#ifndef UDP_WAVE_MAX
+#define UDP_WAVE_MAX 64 /**< Maximum number of UDP queries received before they're processed together */
+#endif
+#ifndef SENDMMSG_BATCH
+#define SENDMMSG_BATCH 16 /**< Maximum number of UDP answers flushed in one sendmmsg() */
+#endif
+#ifndef TCP_WRITE_BATCH
+#define TCP_WRITE_BATCH 16 /**< Maximum number of TCP/TLS answers coalesced into one write */
+#endif
+#ifndef CACHE_GC_INTERVAL
+#define CACHE_GC_INTERVAL 1000 /**< Interval between cache garbage collection slices, ms */
+#endif
+#ifndef CACHE_GC_BATCH
+#define CACHE_GC_BATCH 1000 /**< Number of cache entries visited in one slice */
+#endif
+#ifndef CACHE_FLUSH_INTERVAL
+#define CACHE_FLUSH_INTERVAL 10 /**< Interval between chunks of removing flushed names, ms */
+#endif
+#ifndef CACHE_FLUSH_BATCH
+#define CACHE_FLUSH_BATCH 256 /**< Number of cache entries removed in one chunk */
+#endif
+#ifndef LUA_GC_STEP_KB
+#define LUA_GC_STEP_KB 16 /**< Size of one step of the Lua collector before an I/O poll, KiB */
+#endif
+#ifndef LUA_GC_BUDGET_US
+#define LUA_GC_BUDGET_US 200 /**< Time the steps of the Lua collector may take per loop iteration, us */
+#endif
+#ifndef LUA_GC_PAUSE
+#define LUA_GC_PAUSE 200 /**< Heap growth in percent that starts a cycle by the steps (the automatic one uses 400) */
+#endif
 #ifndef QUERY_RATE_THRESHOLD
 #define QUERY_RATE_THRESHOLD (2 * MP_FREELIST_SIZE) /**< Nr of parallel queries considered as high rate */
 #endif
@@ -65,6 +107,8 @@ struct engine {
     char *hostname;
     struct lua_State *L;
     char *moduledir;
+    bool fast_path; /**< All layers skip cache hits (kr_layer_api::skip_hits) */
+    char *config_path; /**< The config loaded by engine_loadconf(), for engine_reload() */
 };
 
 int engine_init(struct engine *engine, knot_mm_t *pool);
@@ -87,6 +131,12 @@ int engine_load_sandbox(struct engine *engine);
 int engine_loadconf(struct engine *engine, const char *config_path);
 int engine_load_defaults(struct engine *engine);
 
+/** Evaluate the config again, without a restart: all modules are unloaded,
+ * the embedded ones and the config load them anew.  The listening sockets,
+ * the cache and the resolver state (e.g. RTT of upstreams) are kept.
+ * Fails with ENOEXEC without a change if the config doesn't compile. */
+int engine_reload(struct engine *engine);
+
 /** Start the lua engine and execute the config. */
 int engine_start(struct engine *engine);
 void engine_stop(struct engine *engine);
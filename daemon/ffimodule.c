@@ -39,7 +39,6 @@ enum {
 	SLOT_checkout,
 	SLOT_count
 };
-#define SLOT_size sizeof(int)
 
 /** @internal Helper for retrieving the right function entrypoint. */
 static inline lua_State *l_ffi_preface(struct kr_module *module, const char *call) {
@@ -106,12 +105,30 @@ static int l_ffi_init(struct kr_module *module)
 	return l_ffi_call(L, 1);
 }
 
-/** @internal Unregister layer callback reference from registry. */
-#define LAYER_UNREGISTER(L, api, name) do { \
-	int *cb_slot = (int *)((char *)api + sizeof(kr_layer_api_t)); \
-	if (cb_slot[SLOT_ ## name] > 0) \
-		luaL_unref(L, LUA_REGISTRYINDEX, cb_slot[SLOT_ ## name]); \
-} while(0)
+/** @internal Layer API wrapping the Lua functions of a module. */
+struct l_ffi_layer {
+	kr_layer_api_t api;           /**< Must be first, module->data points here. */
+	int cb[SLOT_count];           /**< Lua references of the callbacks, 0 if not set */
+	uint8_t interest[SLOT_count]; /**< Conditions for the callbacks, bitmap of INTEREST_* */
+	struct ffimodule_stats stats;
+};
+
+/** @internal Conditions checked before entering Lua, see layer.interest. */
+enum {
+	INTEREST_live     = 1 << 0, /**< state is neither DONE nor FAIL */
+	INTEREST_done     = 1 << 1, /**< state is DONE */
+	INTEREST_top      = 1 << 2, /**< the current query isn't a sub-query */
+	INTEREST_noerror  = 1 << 3, /**< the packet has RCODE NOERROR */
+	INTEREST_upstream = 1 << 4, /**< the current query wasn't answered from cache */
+};
+
+static const struct {
+	const char *name;
+	uint8_t flag;
+} l_ffi_interests[] = {
+	{ "live", INTEREST_live }, { "done", INTEREST_done }, { "top", INTEREST_top },
+	{ "noerror", INTEREST_noerror }, { "upstream", INTEREST_upstream },
+};
 
 static int l_ffi_deinit(struct kr_module *module)
 {
@@ -121,54 +138,90 @@ static int l_ffi_deinit(struct kr_module *module)
 	if (l_ffi_preface(module, "deinit")) {
 		ret = l_ffi_call(L, 1);
 	}
-	/* Free the layer API wrapper (unconst it) */
-	kr_layer_api_t* api = module->data;
-	if (api) {
-		LAYER_UNREGISTER(L, api, begin);
-		LAYER_UNREGISTER(L, api, finish);
-		LAYER_UNREGISTER(L, api, consume);
-		LAYER_UNREGISTER(L, api, produce);
-		LAYER_UNREGISTER(L, api, checkout);
-		LAYER_UNREGISTER(L, api, reset);
-		free(api);
+	/* Free the layer API wrapper */
+	struct l_ffi_layer *layer = module->data;
+	if (layer) {
+		for (int i = 0; i < SLOT_count; ++i) {
+			if (layer->cb[i] > 0) {
+				luaL_unref(L, LUA_REGISTRYINDEX, layer->cb[i]);
+			}
+		}
+		free(layer);
 	}
 	module->lib = NULL;
 	return ret;
 }
-#undef LAYER_UNREGISTER
 
-/** @internal Helper for retrieving layer Lua function by name. */
-#define LAYER_FFI_CALL(ctx, slot) \
-	int *cb_slot = (int *)((char *)(ctx)->api + sizeof(kr_layer_api_t)); \
-	if (cb_slot[SLOT_ ## slot] <= 0) { \
+/** @internal Check the conditions the module declared for the callback. */
+static bool l_ffi_interested(const kr_layer_t *ctx, uint8_t interest, const knot_pkt_t *pkt)
+{
+	const struct kr_query *qry = ctx->req->current_query;
+	if ((interest & INTEREST_live) && (ctx->state & (KR_STATE_DONE | KR_STATE_FAIL))) {
+		return false;
+	}
+	if ((interest & INTEREST_done) && !(ctx->state & KR_STATE_DONE)) {
+		return false;
+	}
+	if ((interest & INTEREST_top) && qry && qry->parent) {
+		return false;
+	}
+	if ((interest & INTEREST_noerror) && pkt && knot_wire_get_rcode(pkt->wire) != KNOT_RCODE_NOERROR) {
+		return false;
+	}
+	if ((interest & INTEREST_upstream) && qry && qry->flags.CACHED) {
+		return false;
+	}
+	return true;
+}
+
+/** @internal Call the Lua callback, accounting its cost to the layer. */
+static int l_ffi_layer_call(struct l_ffi_layer *layer, lua_State *L, int argc)
+{
+	const uint64_t start = kr_now_us();
+	int state = l_ffi_call(L, argc);
+	layer->stats.calls += 1;
+	layer->stats.time_us += kr_now_us() - start;
+	return state;
+}
+
+/** @internal Helper for retrieving layer Lua function by name.
+ * The callback isn't entered at all if the module isn't interested. */
+#define LAYER_FFI_CALL(ctx, slot, pkt) \
+	struct l_ffi_layer *layer = (struct l_ffi_layer *)(ctx)->api; \
+	if (layer->cb[SLOT_ ## slot] <= 0) { \
+		return ctx->state; \
+	} \
+	if (layer->interest[SLOT_ ## slot] \
+	    && !l_ffi_interested((ctx), layer->interest[SLOT_ ## slot], (pkt))) { \
+		layer->stats.skipped += 1; \
 		return ctx->state; \
 	} \
-	struct kr_module *module = (ctx)->api->data; \
+	struct kr_module *module = layer->api.data; \
 	lua_State *L = module->lib; \
-	lua_rawgeti(L, LUA_REGISTRYINDEX, cb_slot[SLOT_ ## slot]); \
+	lua_rawgeti(L, LUA_REGISTRYINDEX, layer->cb[SLOT_ ## slot]); \
 	lua_pushnumber(L, ctx->state)
 
 static int l_ffi_layer_begin(kr_layer_t *ctx)
 {
-	LAYER_FFI_CALL(ctx, begin);
+	LAYER_FFI_CALL(ctx, begin, NULL);
 	lua_pushlightuserdata(L, ctx->req);
-	return l_ffi_call(L, 2);
+	return l_ffi_layer_call(layer, L, 2);
 }
 
 static int l_ffi_layer_reset(kr_layer_t *ctx)
 {
-	LAYER_FFI_CALL(ctx, reset);
+	LAYER_FFI_CALL(ctx, reset, NULL);
 	lua_pushlightuserdata(L, ctx->req);
-	return l_ffi_call(L, 2);
+	return l_ffi_layer_call(layer, L, 2);
 }
 
 static int l_ffi_layer_finish(kr_layer_t *ctx)
 {
 	struct kr_request *req = ctx->req;
-	LAYER_FFI_CALL(ctx, finish);
+	LAYER_FFI_CALL(ctx, finish, req->answer);
 	lua_pushlightuserdata(L, req);
 	lua_pushlightuserdata(L, req->answer);
-	return l_ffi_call(L, 3);
+	return l_ffi_layer_call(layer, L, 3);
 }
 
 static int l_ffi_layer_consume(kr_layer_t *ctx, knot_pkt_t *pkt)
@@ -176,10 +229,10 @@ static int l_ffi_layer_consume(kr_layer_t *ctx, knot_pkt_t *pkt)
 	if (ctx->state & KR_STATE_FAIL) {
 		return ctx->state; /* Already failed, skip */
 	}
-	LAYER_FFI_CALL(ctx, consume);
+	LAYER_FFI_CALL(ctx, consume, pkt);
 	lua_pushlightuserdata(L, ctx->req);
 	lua_pushlightuserdata(L, pkt);
-	return l_ffi_call(L, 3);
+	return l_ffi_layer_call(layer, L, 3);
 }
 
 static int l_ffi_layer_produce(kr_layer_t *ctx, knot_pkt_t *pkt)
@@ -187,10 +240,10 @@ static int l_ffi_layer_produce(kr_layer_t *ctx, knot_pkt_t *pkt)
 	if (ctx->state & (KR_STATE_FAIL)) {
 		return ctx->state; /* Already failed or done, skip */
 	}
-	LAYER_FFI_CALL(ctx, produce);
+	LAYER_FFI_CALL(ctx, produce, pkt);
 	lua_pushlightuserdata(L, ctx->req);
 	lua_pushlightuserdata(L, pkt);
-	return l_ffi_call(L, 3);
+	return l_ffi_layer_call(layer, L, 3);
 }
 
 static int l_ffi_layer_checkout(kr_layer_t *ctx, knot_pkt_t *pkt, struct sockaddr *dst, int type)
@@ -198,48 +251,79 @@ static int l_ffi_layer_checkout(kr_layer_t *ctx, knot_pkt_t *pkt, struct sockadd
 	if (ctx->state & (KR_STATE_FAIL)) {
 		return ctx->state; /* Already failed or done, skip */
 	}
-	LAYER_FFI_CALL(ctx, checkout);
+	LAYER_FFI_CALL(ctx, checkout, pkt);
 	lua_pushlightuserdata(L, ctx->req);
 	lua_pushlightuserdata(L, pkt);
 	lua_pushlightuserdata(L, dst);
 	lua_pushboolean(L, type == SOCK_STREAM);
-	return l_ffi_call(L, 5);
+	return l_ffi_layer_call(layer, L, 5);
 }
 #undef LAYER_FFI_CALL
 
+/** @internal Parse the conditions of a callback, e.g. interest = { finish = {'done', 'top'} }.
+  * @warning Expects 'module.layer' to be on top of Lua stack. */
+static uint8_t l_ffi_interest_parse(lua_State *L, struct kr_module *module, const char *name)
+{
+	uint8_t interest = 0;
+	lua_getfield(L, -1, "interest");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, name);
+		const int n = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+		for (int i = 1; i <= n; ++i) {
+			lua_rawgeti(L, -1, i);
+			const char *word = lua_tostring(L, -1);
+			size_t j = 0;
+			for (; word && j < sizeof(l_ffi_interests) / sizeof(l_ffi_interests[0]); ++j) {
+				if (strcmp(word, l_ffi_interests[j].name) == 0) {
+					interest |= l_ffi_interests[j].flag;
+					break;
+				}
+			}
+			if (!word || j == sizeof(l_ffi_interests) / sizeof(l_ffi_interests[0])) {
+				/* Calling it more often is safe. */
+				kr_log_error("[ffi] module %s: unknown interest '%s' for %s, ignored\n",
+					     module->name, word ? word : "?", name);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return interest;
+}
+
 /** @internal Conditionally register layer trampoline
   * @warning Expects 'module.layer' to be on top of Lua stack. */
-#define LAYER_REGISTER(L, api, name) do { \
-	int *cb_slot = (int *)((char *)api + sizeof(kr_layer_api_t)); \
+#define LAYER_REGISTER(L, layer, name) do { \
 	lua_getfield((L), -1, #name); \
 	if (!lua_isnil((L), -1)) { \
-		(api)->name = l_ffi_layer_ ## name; \
-		cb_slot[SLOT_ ## name] = luaL_ref((L), LUA_REGISTRYINDEX); \
+		(layer)->api.name = l_ffi_layer_ ## name; \
+		(layer)->cb[SLOT_ ## name] = luaL_ref((L), LUA_REGISTRYINDEX); \
+		(layer)->interest[SLOT_ ## name] = l_ffi_interest_parse((L), module, #name); \
 	} else { \
 		lua_pop((L), 1); \
 	} \
 } while(0)
 
 /** @internal Create C layer api wrapper. */
-static kr_layer_api_t *l_ffi_layer_create(lua_State *L, struct kr_module *module)
+static struct l_ffi_layer *l_ffi_layer_create(lua_State *L, struct kr_module *module)
 {
-	/* Fabricate layer API wrapping the Lua functions
-	 * reserve slots after it for references to Lua callbacks. */
-	const size_t api_length = sizeof(kr_layer_api_t) + (SLOT_count * SLOT_size);
-	kr_layer_api_t *api = malloc(api_length);
-	if (api) {
-		memset(api, 0, api_length);
-		LAYER_REGISTER(L, api, begin);
-		LAYER_REGISTER(L, api, finish);
-		LAYER_REGISTER(L, api, consume);
-		LAYER_REGISTER(L, api, produce);
-		LAYER_REGISTER(L, api, checkout);
-		LAYER_REGISTER(L, api, reset);
-		/* Begin is always set, as it initializes layer baton. */
-		api->begin = l_ffi_layer_begin;
-		api->data = module;
+	/* Fabricate layer API wrapping the Lua functions,
+	 * only the callbacks the module has are set, so the others cost nothing. */
+	struct l_ffi_layer *layer = calloc(1, sizeof(*layer));
+	if (layer) {
+		LAYER_REGISTER(L, layer, begin);
+		LAYER_REGISTER(L, layer, finish);
+		LAYER_REGISTER(L, layer, consume);
+		LAYER_REGISTER(L, layer, produce);
+		LAYER_REGISTER(L, layer, checkout);
+		LAYER_REGISTER(L, layer, reset);
+		layer->api.data = module;
+		lua_getfield(L, -1, "skip_hits");
+		layer->api.skip_hits = lua_toboolean(L, -1);
+		lua_pop(L, 1);
 	}
-	return api;
+	return layer;
 }
 
 /** @internal Retrieve C layer api wrapper. */
@@ -252,6 +336,15 @@ static const kr_layer_api_t *l_ffi_layer(struct kr_module *module)
 }
 #undef LAYER_REGISTER
 
+bool ffimodule_layer_stats(const struct kr_module *module, struct ffimodule_stats *stats)
+{
+	if (!module || module->layer != &l_ffi_layer || !module->data) {
+		return false;
+	}
+	*stats = ((const struct l_ffi_layer *)module->data)->stats;
+	return true;
+}
+
 int ffimodule_register_lua(struct engine *engine, struct kr_module *module, const char *name)
 {
 	/* Register module in Lua */
@@ -16,6 +16,12 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+struct engine;
+struct kr_module;
+
 /**
  * Register Lua module as a FFI module.
  * This fabricates a standard module interface,
@@ -31,3 +37,16 @@
  * @return        0 or an error
  */
 int ffimodule_register_lua(struct engine *engine, struct kr_module *module, const char *name);
+
+/** Cost of the layer of a Lua module. */
+struct ffimodule_stats {
+	uint64_t calls;   /**< number of callbacks entered */
+	uint64_t skipped; /**< number of callbacks not entered, as the module wasn't interested */
+	uint64_t time_us; /**< time spent in the callbacks */
+};
+
+/**
+ * Get the cost of the layer of a Lua module.
+ * @return false if the module isn't written in Lua or has no layer
+ */
+bool ffimodule_layer_stats(const struct kr_module *module, struct ffimodule_stats *stats);
@@ -0,0 +1,530 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <uv.h>
+#include <contrib/cleanup.h>
+
+#include "lib/nsrep.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+#include "daemon/engine.h"
+#include "daemon/handoff.h"
+#include "daemon/network.h"
+#include "daemon/worker.h"
+
+#define HANDOFF_MAGIC "KRho"
+#define HANDOFF_VERSION 1
+/** Period of the checks for the requests in flight (ms). */
+#define HANDOFF_DRAIN_TICK 100
+
+/** The handoff offered by this instance. */
+static struct {
+	struct worker_ctx *worker;
+	char *path;
+	uv_poll_t *listener;   /**< On the UNIX socket at the path */
+	uv_poll_t *conn;       /**< New instance waiting to confirm */
+	uv_timer_t *drain;     /**< After the handoff */
+	uint64_t drain_start;
+	bool handed;           /**< The path belongs to the new instance */
+} the_handoff;
+
+struct handoff_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t count;
+};
+
+static void set_timeouts(int fd)
+{
+	const struct timeval tv = {
+		.tv_sec = HANDOFF_TIMEOUT / 1000,
+		.tv_usec = (HANDOFF_TIMEOUT % 1000) * 1000,
+	};
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int address(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		return kr_error(ENAMETOOLONG);
+	}
+	strcpy(sun->sun_path, path);
+	return kr_ok();
+}
+
+static int write_data(FILE *file, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, file) == len ? kr_ok() : kr_error(EIO);
+}
+
+static int read_data(FILE *file, void *data, size_t len)
+{
+	return fread(data, 1, len, file) == len ? kr_ok() : kr_error(EIO);
+}
+
+/*
+ * The old instance.
+ */
+
+static int send_fds(int sock, const network_fd_array_t *fds)
+{
+	struct {
+		struct handoff_header hdr;
+		uint8_t tls[HANDOFF_FDS_MAX];
+	} msg;
+	memcpy(msg.hdr.magic, HANDOFF_MAGIC, sizeof(msg.hdr.magic));
+	msg.hdr.version = HANDOFF_VERSION;
+	msg.hdr.count = fds->len;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg.hdr) + fds->len,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * fds->len),
+	};
+	if (fds->len == 0) {
+		mh.msg_control = NULL;
+		mh.msg_controllen = 0;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	for (size_t i = 0; i < fds->len; ++i) {
+		msg.tls[i] = fds->at[i].tls;
+	}
+	if (cmsg) {
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds->len);
+		for (size_t i = 0; i < fds->len; ++i) {
+			memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &fds->at[i].fd, sizeof(int));
+		}
+	}
+	ssize_t sent;
+	do {
+		sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+	if (sent < 0) {
+		return kr_error(errno);
+	}
+	return sent == iov.iov_len ? kr_ok() : kr_error(EIO);
+}
+
+static enum lru_apply_do rtt_dump(const char *key, uint len,
+				  kr_nsrep_rtt_lru_entry_t *val, void *baton)
+{
+	FILE *file = baton;
+	/* The time-outs are retried soon anyway, see kr_nsrep_elect(). */
+	if (ferror(file) || len > UINT8_MAX || val->score >= KR_NS_TIMEOUT) {
+		return LRU_APPLY_DO_NOTHING;
+	}
+	const uint8_t key_len = len;
+	const uint32_t rtt[3] = { val->score, val->srtt, val->rttvar };
+	if (write_data(file, &key_len, sizeof(key_len)) == 0
+	    && write_data(file, key, len) == 0) {
+		(void) write_data(file, rtt, sizeof(rtt));
+	}
+	return LRU_APPLY_DO_NOTHING;
+}
+
+static enum lru_apply_do rep_dump(const char *key, uint len, unsigned *val, void *baton)
+{
+	FILE *file = baton;
+	if (ferror(file) || len > UINT8_MAX) {
+		return LRU_APPLY_DO_NOTHING;
+	}
+	const uint8_t key_len = len;
+	const uint32_t rep = *val;
+	if (write_data(file, &key_len, sizeof(key_len)) == 0
+	    && write_data(file, key, len) == 0) {
+		(void) write_data(file, &rep, sizeof(rep));
+	}
+	return LRU_APPLY_DO_NOTHING;
+}
+
+static int send_state(int sock, struct kr_context *ctx)
+{
+	int fd = dup(sock);
+	FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!file) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return kr_error(errno);
+	}
+	const uint8_t end = 0;
+	if (ctx->cache_rtt) {
+		lru_apply(ctx->cache_rtt, rtt_dump, file);
+	}
+	(void) write_data(file, &end, sizeof(end));
+	if (ctx->cache_rep) {
+		lru_apply(ctx->cache_rep, rep_dump, file);
+	}
+	(void) write_data(file, &end, sizeof(end));
+	int ret = ferror(file) ? kr_error(EIO) : kr_ok();
+	if (fclose(file) != 0 && ret == 0) {
+		ret = kr_error(errno);
+	}
+	return ret;
+}
+
+static void drain_tick(uv_timer_t *timer)
+{
+	struct worker_ctx *worker = the_handoff.worker;
+	const uint64_t elapsed = uv_now(timer->loop) - the_handoff.drain_start;
+	if (worker->stats.concurrent > 0 && elapsed < HANDOFF_DRAIN_MAX) {
+		return;
+	}
+	if (worker->stats.concurrent > 0) {
+		kr_log_error("[handoff] giving up on %zu requests in flight\n",
+			     worker->stats.concurrent);
+	} else {
+		kr_log_info("[handoff] drained in %" PRIu64 " ms, exiting\n", elapsed);
+	}
+	uv_timer_stop(timer);
+	uv_stop(timer->loop);
+}
+
+static void close_poll(uv_poll_t **poll)
+{
+	if (*poll) {
+		uv_os_fd_t fd = -1;
+		(void) uv_fileno((uv_handle_t *)*poll, &fd);
+		uv_poll_stop(*poll);
+		uv_close((uv_handle_t *)*poll, (uv_close_cb)free);
+		if (fd >= 0) {
+			close(fd);
+		}
+		*poll = NULL;
+	}
+}
+
+/** The new instance confirmed (or failed, then keep serving). */
+static void on_confirm(uv_poll_t *handle, int status, int events)
+{
+	uv_os_fd_t fd = -1;
+	(void) uv_fileno((uv_handle_t *)handle, &fd);
+	uint8_t ack = 0;
+	ssize_t len;
+	do {
+		len = read(fd, &ack, sizeof(ack));
+	} while (len < 0 && errno == EINTR);
+	close_poll(&the_handoff.conn);
+	if (status != 0 || len != sizeof(ack) || ack != 1) {
+		kr_log_error("[handoff] the new instance didn't start, still serving\n");
+		return;
+	}
+	/* The new instance took the path over, stop offering. */
+	the_handoff.handed = true;
+	close_poll(&the_handoff.listener);
+	struct worker_ctx *worker = the_handoff.worker;
+	network_quiesce(&worker->engine->net);
+	kr_log_info("[handoff] handed over to the new instance, draining %zu requests\n",
+		    worker->stats.concurrent);
+	the_handoff.drain = malloc(sizeof(*the_handoff.drain));
+	if (!the_handoff.drain) {
+		uv_stop(worker->loop);
+		return;
+	}
+	uv_timer_init(worker->loop, the_handoff.drain);
+	the_handoff.drain_start = uv_now(worker->loop);
+	uv_timer_start(the_handoff.drain, drain_tick, 0, HANDOFF_DRAIN_TICK);
+}
+
+/** A new instance connected; it's sent everything at once, it's reading. */
+static void on_offer(uv_poll_t *handle, int status, int events)
+{
+	uv_os_fd_t lfd = -1;
+	if (status != 0 || uv_fileno((uv_handle_t *)handle, &lfd) != 0) {
+		return;
+	}
+	int sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		return;
+	}
+	if (the_handoff.conn) {
+		close(sock); /* one at a time */
+		return;
+	}
+	set_timeouts(sock);
+	struct engine *engine = the_handoff.worker->engine;
+	network_fd_array_t fds;
+	array_init(fds);
+	int ret = network_listen_fds(&engine->net, &fds);
+	if (ret == 0 && fds.len > HANDOFF_FDS_MAX) {
+		ret = kr_error(E2BIG);
+	}
+	if (ret == 0) {
+		ret = send_fds(sock, &fds);
+	}
+	if (ret == 0) {
+		ret = send_state(sock, &engine->resolver);
+	}
+	array_clear(fds);
+	if (ret == 0) {
+		the_handoff.conn = malloc(sizeof(*the_handoff.conn));
+		if (!the_handoff.conn) {
+			ret = kr_error(ENOMEM);
+		} else if ((ret = uv_poll_init(handle->loop, the_handoff.conn, sock)) != 0) {
+			free(the_handoff.conn);
+			the_handoff.conn = NULL;
+		} else {
+			uv_poll_start(the_handoff.conn, UV_READABLE, on_confirm);
+		}
+	}
+	if (ret != 0) {
+		kr_log_error("[handoff] can't hand over: %s\n", kr_strerror(ret));
+		close(sock);
+		return;
+	}
+	kr_log_info("[handoff] sent the listeners to a new instance\n");
+}
+
+/*
+ * The new instance.
+ */
+
+static int recv_fds(int sock, struct network *net)
+{
+	struct {
+		struct handoff_header hdr;
+		uint8_t tls[HANDOFF_FDS_MAX];
+	} msg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg.hdr) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	/* Only the header, the flags follow in the stream. */
+	ssize_t len;
+	do {
+		len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		return kr_error(errno);
+	}
+	int fds[HANDOFF_FDS_MAX];
+	size_t count = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < n && count < HANDOFF_FDS_MAX; ++i) {
+			memcpy(&fds[count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+		}
+	}
+	int ret = kr_ok();
+	if (len != sizeof(msg.hdr) || (mh.msg_flags & MSG_CTRUNC)
+	    || memcmp(msg.hdr.magic, HANDOFF_MAGIC, sizeof(msg.hdr.magic)) != 0
+	    || msg.hdr.version != HANDOFF_VERSION || msg.hdr.count != count) {
+		ret = kr_error(EILSEQ);
+	}
+	if (ret == 0) {
+		do {
+			len = recv(sock, msg.tls, count, MSG_WAITALL);
+		} while (len < 0 && errno == EINTR);
+		if (len != count) {
+			ret = kr_error(EIO);
+		}
+	}
+	size_t i = 0;
+	for (; ret == 0 && i < count; ++i) {
+		ret = network_listen_fd(net, fds[i], msg.tls[i]);
+		if (ret != 0) {
+			kr_log_error("[handoff] %slisten on the fd from the old instance: %s\n",
+				     msg.tls[i] ? "TLS " : "", kr_strerror(ret));
+		}
+	}
+	/* Those not taken over; the instance exits on the failure anyway. */
+	for (; i < count; ++i) {
+		close(fds[i]);
+	}
+	return ret;
+}
+
+static int recv_state(int sock, struct kr_context *ctx)
+{
+	int fd = dup(sock);
+	auto_fclose FILE *file = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (!file) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return kr_error(errno);
+	}
+	char key[UINT8_MAX];
+	size_t rtts = 0, reps = 0;
+	for (int part = 0; part < 2; ) {
+		uint8_t len = 0;
+		uint32_t val[3];
+		const size_t val_len = part == 0 ? sizeof(val) : sizeof(val[0]);
+		int ret = read_data(file, &len, sizeof(len));
+		if (ret) {
+			return ret;
+		}
+		if (len == 0) {
+			part += 1;
+			continue;
+		}
+		ret = read_data(file, key, len);
+		if (!ret) ret = read_data(file, val, val_len);
+		if (ret) {
+			return ret;
+		}
+		bool is_new = false;
+		if (part == 0 && ctx->cache_rtt) {
+			kr_nsrep_rtt_lru_entry_t *e =
+				lru_get_new(ctx->cache_rtt, key, len, &is_new);
+			if (e && is_new) {
+				e->score = val[0];
+				e->srtt = val[1];
+				e->rttvar = val[2];
+				e->tout_timestamp = 0;
+				e->updated = kr_now();
+				rtts += 1;
+			}
+		} else if (part == 1 && ctx->cache_rep) {
+			unsigned *rep = lru_get_new(ctx->cache_rep, key, len, &is_new);
+			if (rep && is_new) {
+				*rep = val[0];
+				reps += 1;
+			}
+		}
+	}
+	kr_log_info("[handoff] took over %zu upstream RTTs and %zu reputations\n", rtts, reps);
+	return kr_ok();
+}
+
+int handoff_receive(const char *path, struct network *net, struct kr_context *ctx, int *conn)
+{
+	*conn = -1;
+	struct sockaddr_un sun;
+	int ret = address(&sun, path);
+	if (ret != 0) {
+		return ret;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return kr_error(errno);
+	}
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		ret = errno;
+		close(sock);
+		if (ret == ENOENT || ret == ECONNREFUSED) {
+			kr_log_info("[handoff] no instance at '%s', starting afresh\n", path);
+			return kr_ok();
+		}
+		return kr_error(ret);
+	}
+	set_timeouts(sock);
+	ret = recv_fds(sock, net);
+	if (ret == 0) {
+		ret = recv_state(sock, ctx);
+	}
+	if (ret != 0) {
+		close(sock);
+		return ret;
+	}
+	*conn = sock;
+	return kr_ok();
+}
+
+int handoff_start(struct worker_ctx *worker, const char *path, int conn)
+{
+	the_handoff.worker = worker;
+	if (conn >= 0) {
+		const uint8_t ack = 1;
+		if (send(conn, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+			kr_log_error("[handoff] can't confirm to the old instance: %s\n",
+				     strerror(errno));
+		}
+		close(conn);
+	}
+	struct sockaddr_un sun;
+	int ret = address(&sun, path);
+	if (ret != 0) {
+		return ret;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return kr_error(errno);
+	}
+	/* A leftover or the old instance's; the old one doesn't need it anymore. */
+	(void) unlink(path);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(sock, 1) != 0) {
+		ret = kr_error(errno);
+		close(sock);
+		return ret;
+	}
+	the_handoff.listener = malloc(sizeof(*the_handoff.listener));
+	if (!the_handoff.listener) {
+		close(sock);
+		return kr_error(ENOMEM);
+	}
+	ret = uv_poll_init(worker->loop, the_handoff.listener, sock);
+	if (ret == 0) {
+		ret = uv_poll_start(the_handoff.listener, UV_READABLE, on_offer);
+	}
+	if (ret != 0) {
+		free(the_handoff.listener);
+		the_handoff.listener = NULL;
+		close(sock);
+		return ret;
+	}
+	the_handoff.path = strdup(path);
+	return kr_ok();
+}
+
+void handoff_stop(void)
+{
+	close_poll(&the_handoff.conn);
+	close_poll(&the_handoff.listener);
+	if (the_handoff.drain) {
+		uv_timer_stop(the_handoff.drain);
+		uv_close((uv_handle_t *)the_handoff.drain, (uv_close_cb)free);
+		the_handoff.drain = NULL;
+	}
+	if (the_handoff.path && !the_handoff.handed) {
+		(void) unlink(the_handoff.path);
+	}
+	free(the_handoff.path);
+	the_handoff.path = NULL;
+}
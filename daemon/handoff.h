@@ -0,0 +1,68 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file handoff.h
+ * @brief Restarts without a gap: the running instance hands its listeners
+ *        and what it knows about the upstreams over to the new one.
+ *
+ * Each instance started with --handoff=<path> offers the handoff on the UNIX
+ * socket at the path.  A new instance started with the same option connects
+ * to it first (handoff_receive()) and gets the listening sockets (SCM_RIGHTS),
+ * the upstream RTTs and the reputations of the nameservers.  The old instance
+ * keeps serving until the new one has loaded its config and confirms
+ * (handoff_start()), then it stops receiving, finishes the requests in flight
+ * and exits.  The clients see neither a bind gap nor cold RTTs.
+ *
+ * The stream after connecting, in the native byte order (same machine):
+ *  - "KRho", u16 version, u16 count of sockets and a u8 TLS flag of each,
+ *    with the sockets attached
+ *  - RTTs: { u8 address length, address, u32 score, srtt, rttvar }..., u8 0
+ *  - reputations: { u8 name length, name, u32 reputation }..., u8 0
+ *  - back from the new instance when it's ready: u8 1
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct network;
+struct kr_context;
+struct worker_ctx;
+
+/** Most listening sockets handed over. */
+#define HANDOFF_FDS_MAX 64
+/** Timeout of the exchange (ms), so that a stuck peer doesn't stop the other. */
+#define HANDOFF_TIMEOUT 5000
+/** Longest wait for the requests in flight after the handoff (ms). */
+#define HANDOFF_DRAIN_MAX 10000
+
+/**
+ * Take over the listeners and the upstream state of the instance at the path.
+ * @param conn set to the connection to confirm in handoff_start(),
+ *        or -1 if no instance offers the handoff at the path
+ * @return 0 (also without an instance) or an error code
+ */
+int handoff_receive(const char *path, struct network *net, struct kr_context *ctx, int *conn);
+
+/**
+ * Confirm the handoff to the old instance (if conn isn't -1)
+ * and offer the handoff at the path for the next one.
+ */
+int handoff_start(struct worker_ctx *worker, const char *path, int conn);
+
+/** Stop offering the handoff; the path is removed unless a new instance took it. */
+void handoff_stop(void);
@@ -0,0 +1,470 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon/http.h"
+#include "daemon/io.h"
+#include "daemon/tls.h"
+#include "daemon/worker.h"
+
+#ifdef ENABLE_DOH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nghttp2/nghttp2.h>
+#include "contrib/base64.h"
+
+/** Largest query accepted, in the body or in the path as base64url. */
+#define HTTP_MSG_MAX KNOT_WIRE_MAX_PKTSIZE
+#define HTTP_B64_MAX ((HTTP_MSG_MAX + 2) / 3 * 4)
+
+#define HTTP_NV(name, value) { (uint8_t *)(name), (uint8_t *)(value), \
+	strlen(name), strlen(value), NGHTTP2_NV_FLAG_NONE }
+
+struct http_stream {
+	struct http_stream *prev, *next; /**< In http_ctx::streams */
+	uint8_t *buf;      /**< The query */
+	size_t len;
+	uint8_t *out;      /**< The answer being sent */
+	size_t out_len, out_pos;
+	uint16_t status;   /**< Of a refused query, 0 if fine so far */
+	bool get, post;
+	bool in_path;      /**< The query is from the `dns` parameter */
+	bool dns_type;     /**< The body is application/dns-message */
+};
+
+struct http_ctx {
+	nghttp2_session *h2;
+	struct session *session;
+	struct worker_ctx *worker;
+	struct http_stream *streams; /**< Open ones, to free them with the context */
+	int submitted; /**< Queries started in the current http_process() */
+	bool in_recv;  /**< In nghttp2_session_mem_recv(), which mustn't be reentered */
+};
+
+static bool str_is(const uint8_t *s, size_t len, const char *what)
+{
+	return len == strlen(what) && memcmp(s, what, len) == 0;
+}
+
+static int stream_reserve(uint8_t **buf, size_t len)
+{
+	uint8_t *mem = realloc(*buf, len);
+	if (!mem) {
+		return kr_error(ENOMEM);
+	}
+	*buf = mem;
+	return kr_ok();
+}
+
+static void stream_free(struct http_ctx *ctx, struct http_stream *s)
+{
+	if (s->prev) {
+		s->prev->next = s->next;
+	} else {
+		ctx->streams = s->next;
+	}
+	if (s->next) {
+		s->next->prev = s->prev;
+	}
+	free(s->buf);
+	free(s->out);
+	free(s);
+}
+
+/** Decode the base64url query of GET, without padding per RFC 8484. */
+static uint16_t path_query_decode(struct http_stream *s, const uint8_t *in, size_t len)
+{
+	if (len == 0 || len > HTTP_B64_MAX) {
+		return 400;
+	}
+	/* base64_decode() wants the usual alphabet and the padding. */
+	uint8_t *b64 = malloc(len + 4);
+	if (!b64) {
+		return 500;
+	}
+	size_t n = 0;
+	for (; n < len; ++n) {
+		b64[n] = in[n] == '-' ? '+' : in[n] == '_' ? '/' : in[n];
+	}
+	while (n % 4) {
+		b64[n++] = '=';
+	}
+	if (stream_reserve(&s->buf, n / 4 * 3) != 0) {
+		free(b64);
+		return 500;
+	}
+	int32_t ret = base64_decode(b64, n, s->buf, n / 4 * 3);
+	free(b64);
+	if (ret < 0) {
+		return 400;
+	}
+	s->len = ret;
+	s->in_path = true;
+	return 0;
+}
+
+/** Check the path and take the query from its `dns` parameter, if there's one. */
+static uint16_t path_query(struct http_stream *s, const uint8_t *path, size_t len)
+{
+	const size_t plen = strlen(HTTP_PATH);
+	if (len < plen || memcmp(path, HTTP_PATH, plen) != 0
+	    || (len > plen && path[plen] != '?')) {
+		return 404;
+	}
+	const uint8_t *p = path + plen, *end = path + len;
+	while (p < end) {
+		++p; /* '?' or '&' */
+		const uint8_t *amp = memchr(p, '&', end - p);
+		const uint8_t *param_end = amp ? amp : end;
+		if (param_end - p >= 4 && memcmp(p, "dns=", 4) == 0) {
+			return path_query_decode(s, p + 4, param_end - p - 4);
+		}
+		p = param_end;
+	}
+	return 0;
+}
+
+static int on_begin_headers(nghttp2_session *h2, const nghttp2_frame *frame, void *user_data)
+{
+	struct http_ctx *ctx = user_data;
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+		return 0;
+	}
+	struct http_stream *s = calloc(1, sizeof(*s));
+	if (!s) {
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+	}
+	s->next = ctx->streams;
+	if (s->next) {
+		s->next->prev = s;
+	}
+	ctx->streams = s;
+	nghttp2_session_set_stream_user_data(h2, frame->hd.stream_id, s);
+	return 0;
+}
+
+static int on_header(nghttp2_session *h2, const nghttp2_frame *frame,
+		     const uint8_t *name, size_t namelen,
+		     const uint8_t *value, size_t valuelen,
+		     uint8_t flags, void *user_data)
+{
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+		return 0;
+	}
+	struct http_stream *s = nghttp2_session_get_stream_user_data(h2, frame->hd.stream_id);
+	if (!s || s->status) {
+		return 0;
+	}
+	if (str_is(name, namelen, ":method")) {
+		s->get = str_is(value, valuelen, "GET");
+		s->post = str_is(value, valuelen, "POST");
+		if (!s->get && !s->post) {
+			s->status = 405;
+		}
+	} else if (str_is(name, namelen, ":path")) {
+		s->status = path_query(s, value, valuelen);
+	} else if (str_is(name, namelen, "content-type")) {
+		s->dns_type = str_is(value, valuelen, "application/dns-message");
+	}
+	return 0;
+}
+
+static int on_data_chunk(nghttp2_session *h2, uint8_t flags, int32_t stream_id,
+			 const uint8_t *data, size_t len, void *user_data)
+{
+	struct http_stream *s = nghttp2_session_get_stream_user_data(h2, stream_id);
+	if (!s || s->status) {
+		return 0;
+	}
+	if (s->in_path) { /* POST has the query in the body */
+		s->len = 0;
+		s->in_path = false;
+	}
+	if (s->len + len > HTTP_MSG_MAX) {
+		s->status = 413;
+		return 0;
+	}
+	if (stream_reserve(&s->buf, s->len + len) != 0) {
+		s->status = 500;
+		return 0;
+	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return 0;
+}
+
+static int stream_status(struct http_ctx *ctx, int32_t stream_id, uint16_t status)
+{
+	char code[8];
+	snprintf(code, sizeof(code), "%u", status);
+	const nghttp2_nv hdrs[] = { HTTP_NV(":status", code) };
+	int ret = nghttp2_submit_response(ctx->h2, stream_id, hdrs, 1, NULL);
+	return ret == 0 ? 0 : NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+/** The request is complete, start the query or refuse it. */
+static int on_frame_recv(nghttp2_session *h2, const nghttp2_frame *frame, void *user_data)
+{
+	struct http_ctx *ctx = user_data;
+	if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+	    || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+		return 0;
+	}
+	const int32_t id = frame->hd.stream_id;
+	struct http_stream *s = nghttp2_session_get_stream_user_data(h2, id);
+	if (!s) {
+		return 0;
+	}
+	if (!s->status && s->post && !s->dns_type) {
+		s->status = 415;
+	}
+	if (!s->status && (!(s->get || s->post) || s->len < KNOT_WIRE_HEADER_SIZE)) {
+		s->status = 400;
+	}
+	if (!s->status) {
+		int ret = worker_submit_http(ctx->worker, (uv_stream_t *)ctx->session->handle,
+					     s->buf, s->len, id);
+		if (ret > 0) {
+			ctx->submitted += 1;
+			return 0;
+		}
+		s->status = ret == kr_error(ENOMEM) ? 503 : 400;
+	}
+	return stream_status(ctx, id, s->status);
+}
+
+static int on_stream_close(nghttp2_session *h2, int32_t stream_id, uint32_t error_code,
+			   void *user_data)
+{
+	struct http_stream *s = nghttp2_session_get_stream_user_data(h2, stream_id);
+	if (s) {
+		/* An answer coming later finds no stream, see http_send(). */
+		nghttp2_session_set_stream_user_data(h2, stream_id, NULL);
+		stream_free(user_data, s);
+	}
+	return 0;
+}
+
+static ssize_t stream_read(nghttp2_session *h2, int32_t stream_id, uint8_t *buf, size_t length,
+			   uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+	struct http_stream *s = source->ptr;
+	const size_t len = MIN(length, s->out_len - s->out_pos);
+	memcpy(buf, s->out + s->out_pos, len);
+	s->out_pos += len;
+	if (s->out_pos == s->out_len) {
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+	}
+	return len;
+}
+
+/** Encrypt and send what nghttp2 has for the client. */
+static int http_flush(struct http_ctx *ctx)
+{
+	uv_handle_t *handle = ctx->session->handle;
+	for (;;) {
+		const uint8_t *data = NULL;
+		ssize_t len = nghttp2_session_mem_send(ctx->h2, &data);
+		if (len < 0) {
+			kr_log_verbose("[doh] nghttp2_session_mem_send: %s\n", nghttp2_strerror(len));
+			return kr_error(EIO);
+		}
+		if (len == 0) {
+			return kr_ok();
+		}
+		/* The data is valid until the next call, tls_write() doesn't keep it. */
+		const uv_buf_t buf = uv_buf_init((char *)data, len);
+		int ret = tls_write(handle, &buf, 1);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+}
+
+struct http_ctx *http_new(struct session *session, uint32_t streams_max)
+{
+	if (!session || !session->tls_ctx || !session->handle) {
+		return NULL;
+	}
+	struct http_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return NULL;
+	}
+	ctx->session = session;
+	ctx->worker = session->handle->loop->data;
+
+	nghttp2_session_callbacks *cbs = NULL;
+	if (nghttp2_session_callbacks_new(&cbs) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	nghttp2_session_callbacks_set_on_begin_headers_callback(cbs, on_begin_headers);
+	nghttp2_session_callbacks_set_on_header_callback(cbs, on_header);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, on_data_chunk);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, on_frame_recv);
+	nghttp2_session_callbacks_set_on_stream_close_callback(cbs, on_stream_close);
+	int ret = nghttp2_session_server_new(&ctx->h2, cbs, ctx);
+	nghttp2_session_callbacks_del(cbs);
+	if (ret != 0) {
+		free(ctx);
+		return NULL;
+	}
+	/* The window fits a query; the streams over the limit are refused by nghttp2. */
+	const nghttp2_settings_entry settings[] = {
+		{ NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, streams_max },
+		{ NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, HTTP_MSG_MAX },
+	};
+	ret = nghttp2_submit_settings(ctx->h2, NGHTTP2_FLAG_NONE, settings,
+				      sizeof(settings) / sizeof(settings[0]));
+	/* Only HTTP/2 is spoken, clients without ALPN need prior knowledge. */
+	const gnutls_datum_t alpn = { (unsigned char *)"h2", 2 };
+	if (ret == 0) {
+		ret = gnutls_alpn_set_protocols(session->tls_ctx->c.tls_session, &alpn, 1, 0);
+	}
+	if (ret != 0) {
+		nghttp2_session_del(ctx->h2);
+		free(ctx);
+		return NULL;
+	}
+	ctx->worker->stats.doh_conns += 1;
+	return ctx;
+}
+
+void http_free(struct http_ctx *ctx)
+{
+	if (!ctx) {
+		return;
+	}
+	nghttp2_session_del(ctx->h2); /* doesn't close the streams */
+	while (ctx->streams) {
+		stream_free(ctx, ctx->streams);
+	}
+	ctx->worker->stats.doh_conns -= 1;
+	free(ctx);
+}
+
+int http_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *buf, ssize_t len)
+{
+	struct session *session = handle->data;
+	struct http_ctx *ctx = session->http_ctx;
+	if (!ctx || len < 0) {
+		return kr_error(EINVAL);
+	}
+	ctx->submitted = 0;
+	ctx->in_recv = true;
+	ssize_t ret = nghttp2_session_mem_recv(ctx->h2, buf, len);
+	ctx->in_recv = false;
+	if (ret < 0) {
+		kr_log_verbose("[doh] nghttp2_session_mem_recv: %s\n", nghttp2_strerror(ret));
+		return kr_error(EIO);
+	}
+	/* The settings, the refusals and the answers straight from cache. */
+	if (http_flush(ctx) != 0) {
+		return kr_error(EIO);
+	}
+	if (!nghttp2_session_want_read(ctx->h2) && !nghttp2_session_want_write(ctx->h2)) {
+		return kr_error(ECONNRESET); /* after GOAWAY */
+	}
+	return ctx->submitted;
+}
+
+/** Time the answer may be cached for, the least TTL in it. */
+static uint32_t answer_max_age(const knot_pkt_t *answer)
+{
+	uint32_t ttl = UINT32_MAX;
+	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
+		const knot_pktsection_t *sec = knot_pkt_section(answer, i);
+		for (unsigned k = 0; k < sec->count; ++k) {
+			const knot_rrset_t *rr = knot_pkt_rr(sec, k);
+			if (!knot_rrtype_is_metatype(rr->type)) {
+				ttl = MIN(ttl, knot_rrset_ttl(rr));
+			}
+		}
+	}
+	return ttl == UINT32_MAX ? 0 : ttl;
+}
+
+int http_send(struct http_ctx *ctx, int32_t stream, const knot_pkt_t *answer)
+{
+	if (!ctx || ctx->session->closing) {
+		return kr_error(EINVAL);
+	}
+	struct http_stream *s = nghttp2_session_get_stream_user_data(ctx->h2, stream);
+	if (!s) {
+		return kr_error(ENOENT); /* reset by the client meanwhile */
+	}
+	int ret = 0;
+	if (!answer) {
+		ret = nghttp2_submit_rst_stream(ctx->h2, NGHTTP2_FLAG_NONE, stream,
+						NGHTTP2_INTERNAL_ERROR);
+	} else {
+		if (stream_reserve(&s->out, answer->size) != 0) {
+			return kr_error(ENOMEM);
+		}
+		memcpy(s->out, answer->wire, answer->size);
+		s->out_len = answer->size;
+		s->out_pos = 0;
+		/* GET is cacheable by the HTTP caches, for as long as the answer (RFC 8484 5.1). */
+		char length[8], cache[32];
+		snprintf(length, sizeof(length), "%zu", answer->size);
+		const uint8_t rcode = knot_wire_get_rcode(answer->wire);
+		if (rcode == KNOT_RCODE_SERVFAIL || rcode == KNOT_RCODE_REFUSED) {
+			snprintf(cache, sizeof(cache), "no-store");
+		} else {
+			snprintf(cache, sizeof(cache), "max-age=%u", answer_max_age(answer));
+		}
+		const nghttp2_nv hdrs[] = {
+			HTTP_NV(":status", "200"),
+			HTTP_NV("content-type", "application/dns-message"),
+			HTTP_NV("content-length", length),
+			HTTP_NV("cache-control", cache),
+		};
+		const nghttp2_data_provider body = {
+			.source.ptr = s,
+			.read_callback = stream_read,
+		};
+		ret = nghttp2_submit_response(ctx->h2, stream, hdrs, s->get ? 4 : 3, &body);
+	}
+	if (ret != 0) {
+		return kr_error(EIO);
+	}
+	/* Sent after the whole read when answering from within it. */
+	return ctx->in_recv ? kr_ok() : http_flush(ctx);
+}
+
+#else /* ENABLE_DOH */
+
+struct http_ctx *http_new(struct session *session, uint32_t streams_max)
+{
+	return NULL;
+}
+
+void http_free(struct http_ctx *ctx)
+{
+}
+
+int http_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *buf, ssize_t len)
+{
+	return kr_error(ENOTSUP);
+}
+
+int http_send(struct http_ctx *ctx, int32_t stream, const knot_pkt_t *answer)
+{
+	return kr_error(ENOTSUP);
+}
+
+#endif /* ENABLE_DOH */
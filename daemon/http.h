@@ -0,0 +1,58 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file http.h
+ *
+ * DNS over HTTPS (RFC 8484) over HTTP/2, by nghttp2 on top of the TLS sessions of tls.c.
+ *
+ * The connection is a usual TLS session from a client (session->has_tls) with
+ * session->http_ctx; the decrypted data go to http_process() instead of
+ * worker_process_tcp().  Each query comes in a stream, by GET with `?dns=` or
+ * by POST of `application/dns-message` to HTTP_PATH; it's started by
+ * worker_submit_http() and the answer is sent to the stream by http_send().
+ * nghttp2 takes care of the flow control and of the limit of the streams.
+ * Without ENABLE_DOH the functions fail with ENOTSUP.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+#include <libknot/packet/pkt.h>
+
+struct session;
+struct worker_ctx;
+struct http_ctx;
+
+/** The path of the queries. */
+#define HTTP_PATH "/dns-query"
+/** Default of the concurrent streams of a connection, see net.doh_streams(). */
+#define HTTP_STREAMS_MAX 100
+
+/** Start HTTP/2 on the TLS session of the session accepted from a client; "h2" by ALPN.
+ * @param streams_max	concurrent streams the client may open
+ * @return NULL on error */
+struct http_ctx *http_new(struct session *session, uint32_t streams_max);
+
+void http_free(struct http_ctx *ctx);
+
+/** Process the data decrypted from the connection.
+ * @return the number of newly started queries (>=0) or an error to close the connection */
+int http_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *buf, ssize_t len);
+
+/** Send the answer to the stream of its query, or reset the stream if it's NULL.
+ * The answer is copied, it isn't referenced after return. */
+int http_send(struct http_ctx *ctx, int32_t stream, const knot_pkt_t *answer);
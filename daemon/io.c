@@ -15,15 +15,28 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
 #include <libknot/errcode.h>
 #include <contrib/ucw/lib.h>
 #include <contrib/ucw/mempool.h>
 #include <assert.h>
 
+#include "daemon/http.h"
 #include "daemon/io.h"
 #include "daemon/network.h"
 #include "daemon/worker.h"
 #include "daemon/tls.h"
+#include "daemon/uring.h"
+
+#if __linux__
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+#ifndef TCPI_OPT_SYN_DATA
+#define TCPI_OPT_SYN_DATA 32
+#endif
+#endif
 
 #define negotiate_bufsize(func, handle, bufsize_want) do { \
     int bufsize = 0; func(handle, &bufsize); \
@@ -53,8 +66,15 @@ static void session_clear(struct session *s)
 	assert(s->tasks.len == 0 && s->waiting.len == 0);
 	array_clear(s->tasks);
 	array_clear(s->waiting);
+	if (s->ids) {
+		free(s->ids->slots);
+		free(s->ids->id);
+		free(s->ids);
+	}
+	http_free(s->http_ctx);
 	tls_free(s->tls_ctx);
 	tls_client_ctx_free(s->tls_client_ctx);
+	tw_stop(&s->timer);
 	memset(s, 0, sizeof(*s));
 }
 
@@ -72,17 +92,29 @@ struct session *session_new(void)
 	return calloc(1, sizeof(struct session));
 }
 
-static struct session *session_borrow(struct worker_ctx *worker)
+int session_timer_start(struct session *s, tw_cb cb, uint64_t timeout, uint64_t repeat)
 {
-	struct session *s = NULL;
-	if (worker->pool_sessions.len > 0) {
-		s = array_tail(worker->pool_sessions);
-		array_pop(worker->pool_sessions);
-		kr_asan_unpoison(s, sizeof(*s));
-	} else {
-		s = session_new();
+	if (!s->handle || !s->handle->loop->data) {
+		return kr_error(EINVAL);
 	}
-	return s;
+	struct worker_ctx *worker = s->handle->loop->data;
+	s->timer.data = s;
+	tw_start(&worker->timers, &s->timer, cb, uv_now(worker->loop), timeout, repeat);
+	return kr_ok();
+}
+
+int session_timer_again(struct session *s)
+{
+	if (!s->handle || !s->handle->loop->data) {
+		return kr_error(EINVAL);
+	}
+	struct worker_ctx *worker = s->handle->loop->data;
+	return tw_again(&s->timer, uv_now(worker->loop));
+}
+
+static struct session *session_borrow(struct worker_ctx *worker)
+{
+	return obj_cache_borrow(&worker->pool_sessions);
 }
 
 static void session_release(struct worker_ctx *worker, uv_handle_t *handle)
@@ -99,13 +131,8 @@ static void session_release(struct worker_ctx *worker, uv_handle_t *handle)
 	if (!s->outgoing && handle->type == UV_TCP) {
 		worker_end_tcp(worker, handle); /* to free the buffering task */
 	}
-	if (worker->pool_sessions.len < MP_FREELIST_SIZE) {
-		session_clear(s);
-		array_push(worker->pool_sessions, s);
-		kr_asan_poison(s, sizeof(*s));
-	} else {
-		session_free(s);
-	}
+	session_clear(s);
+	obj_cache_release(&worker->pool_sessions, s);
 }
 
 static uv_stream_t *handle_borrow(uv_loop_t *loop)
@@ -121,14 +148,18 @@ static uv_stream_t *handle_borrow(uv_loop_t *loop)
 
 static void handle_getbuf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
 {
-	/* Worker has single buffer which is reused for all incoming
-	 * datagrams / stream reads, the content of the buffer is
-	 * guaranteed to be unchanged only for the duration of
+	/* Listening UDP sockets read into the receive ring, where the requests
+	 * keep their queries.  Everything else shares a single buffer which is
+	 * reused for all incoming datagrams / stream reads, the content of the
+	 * buffer is guaranteed to be unchanged only for the duration of
 	 * udp_read() and tcp_read().
 	 */
 	struct session *session = handle->data;
 	uv_loop_t *loop = handle->loop;
 	struct worker_ctx *worker = loop->data;
+	if (handle->type == UV_UDP && !session->outgoing && worker_wire_getbuf(worker, buf)) {
+		return;
+	}
 	buf->base = (char *)worker->wire_buf;
 	/* Limit TCP stream buffer size to 4K for granularity in batches of incoming queries. */
 	if (handle->type == UV_TCP) {
@@ -160,12 +191,19 @@ void udp_recv(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
 	if (addr->sa_family == AF_UNSPEC) {
 		return;
 	}
+	/* Queries in the receive ring are processed together at the end of the loop iteration. */
+	if (!s->outgoing && worker_udp_wave_push(worker, handle, (const uint8_t *)buf->base,
+						 nread, addr) == 0) {
+		return;
+	}
+	const uint64_t prof_since = worker_prof_begin(worker);
 	knot_pkt_t *query = knot_pkt_new(buf->base, nread, &worker->pkt_pool);
 	if (query) {
 		query->max_size = KNOT_WIRE_MAX_PKTSIZE;
 		worker_submit(worker, (uv_handle_t *)handle, query, addr);
 	}
 	mp_flush(worker->pkt_pool.ctx);
+	worker_prof_end(worker, PROF_UDP, prof_since, NULL);
 }
 
 static int udp_bind_finalize(uv_handle_t *handle)
@@ -206,20 +244,167 @@ int udp_bindfd(uv_udp_t *handle, int fd)
 	return udp_bind_finalize((uv_handle_t *)handle);
 }
 
-static void tcp_timeout_trigger(uv_timer_t *timer)
+uint64_t io_client_prefix(const struct sockaddr *addr)
+{
+	uint64_t prefix = (uint64_t)addr->sa_family << 56;
+	if (addr->sa_family == AF_INET) {
+		const uint8_t *a = (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+		prefix |= (uint32_t)a[0] << 16 | (uint32_t)a[1] << 8 | a[2];
+	} else if (addr->sa_family == AF_INET6) {
+		const uint8_t *a = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		for (int i = 0; i < 7; ++i) {
+			prefix |= (uint64_t)a[i] << (8 * (6 - i));
+		}
+	}
+	return prefix;
+}
+
+/** How many of the least recently active connections tcp_in_evict() looks at. */
+#define TCP_IN_EVICT_SCAN 64
+
+static void tcp_in_link(struct worker_ctx *worker, struct session *s)
+{
+	s->in_prev = worker->tcp_in.tail;
+	s->in_next = NULL;
+	if (s->in_prev) {
+		s->in_prev->in_next = s;
+	} else {
+		worker->tcp_in.head = s;
+	}
+	worker->tcp_in.tail = s;
+}
+
+static void tcp_in_unlink(struct worker_ctx *worker, struct session *s)
+{
+	if (s->in_prev) {
+		s->in_prev->in_next = s->in_next;
+	} else {
+		worker->tcp_in.head = s->in_next;
+	}
+	if (s->in_next) {
+		s->in_next->in_prev = s->in_prev;
+	} else {
+		worker->tcp_in.tail = s->in_prev;
+	}
+	s->in_prev = s->in_next = NULL;
+}
+
+void io_tcp_in_del(struct session *s)
+{
+	if (!s->in_listed) {
+		return;
+	}
+	struct worker_ctx *worker = s->handle->loop->data;
+	tcp_in_unlink(worker, s);
+	s->in_listed = false;
+	worker->stats.tcp_in_conns -= 1;
+	const char *key = (const char *)&s->in_prefix;
+	trie_val_t *val = trie_get_try(worker->tcp_in.prefixes, key, sizeof(s->in_prefix));
+	if (val && (uintptr_t)*val > 1) {
+		*val = (void *)((uintptr_t)*val - 1);
+	} else if (val) {
+		trie_del(worker->tcp_in.prefixes, key, sizeof(s->in_prefix), NULL);
+	}
+}
+
+/** Close the least recently active connection without a query in progress,
+ * out of the first TCP_IN_EVICT_SCAN ones.
+ * @return whether one was closed */
+static bool tcp_in_evict(struct worker_ctx *worker)
+{
+	struct session *s = worker->tcp_in.head;
+	for (unsigned i = 0; s && i < TCP_IN_EVICT_SCAN; ++i, s = s->in_next) {
+		if (s->tasks.len == 0 && !s->buffering && !s->closing) {
+			worker->stats.tcp_in_evicted += 1;
+			worker_session_close(s);
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Count the new connection in worker->tcp_in, unless it's over the limits
+ * of net.tcp_connections() and net.tcp_connections_client().  At the global
+ * limit, or when the fork runs out of descriptors, an idle one makes room. */
+static bool tcp_in_admit(struct worker_ctx *worker, struct session *s)
+{
+	const struct network *net = &worker->engine->net;
+	const bool full = net->tcp_conns_max && worker->stats.tcp_in_conns >= net->tcp_conns_max;
+	if ((full || worker->too_many_open) && !tcp_in_evict(worker) && full) {
+		worker->stats.tcp_in_refused += 1;
+		return false;
+	}
+	s->in_prefix = io_client_prefix(&s->peer.ip);
+	const char *key = (const char *)&s->in_prefix;
+	if (net->tcp_conns_client) {
+		trie_val_t *val = trie_get_try(worker->tcp_in.prefixes, key, sizeof(s->in_prefix));
+		if (val && (uintptr_t)*val >= net->tcp_conns_client) {
+			worker->stats.tcp_in_refused += 1;
+			return false;
+		}
+	}
+	trie_val_t *val = trie_get_ins(worker->tcp_in.prefixes, key, sizeof(s->in_prefix));
+	if (!val) {
+		return false;
+	}
+	*val = (void *)((uintptr_t)*val + 1);
+	s->in_listed = true;
+	tcp_in_link(worker, s);
+	worker->stats.tcp_in_conns += 1;
+	return true;
+}
+
+/** Idle timeout of a connection from a client.  It shrinks to a quarter as the connections
+ * fill the second half of net.tcp_connections(), or right away when out of descriptors. */
+static uint64_t tcp_in_timeout(struct worker_ctx *worker, bool tls)
+{
+	uint64_t timeout = KR_CONN_RTT_MAX / 2;
+	if (tls) {
+		timeout += KR_CONN_RTT_MAX * 3;
+	}
+	if (worker->too_many_open) {
+		return timeout / 4;
+	}
+	const size_t max = worker->engine->net.tcp_conns_max;
+	const size_t count = worker->stats.tcp_in_conns;
+	if (max && count > max / 2) {
+		const size_t room = count < max ? max - count : 0;
+		timeout = MAX(timeout / 4, timeout * room / (max - max / 2));
+	}
+	return timeout;
+}
+
+static void tcp_timeout_trigger(struct tw_timer *timer)
 {
 	struct session *session = timer->data;
 
 	assert(session->outgoing == false);
 	if (session->tasks.len > 0) {
-		uv_timer_again(timer);
+		session_timer_again(session);
 	} else if (!session->closing) {
-		uv_timer_stop(timer);
+		tw_stop(timer);
 		worker_session_close(session);
 	}
 }
 
-static void tcp_recv(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
+/** Whether the data in the SYN of the connection was acknowledged, i.e. TCP Fast Open worked. */
+static bool tcp_syn_data(uv_handle_t *handle)
+{
+#if __linux__
+	uv_os_fd_t fd = 0;
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (uv_fileno(handle, &fd) != 0
+	    || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+		return false;
+	}
+	return info.tcpi_options & TCPI_OPT_SYN_DATA;
+#else
+	return false;
+#endif
+}
+
+void tcp_recv(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
 {
 	uv_loop_t *loop = handle->loop;
 	struct session *s = handle->data;
@@ -235,6 +420,16 @@ static void tcp_recv(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
 		nread = 0;
 	}
 	struct worker_ctx *worker = loop->data;
+	/* The handshake is over with the first answer of the upstream. */
+	if (s->tfo && nread > 0) {
+		s->tfo = false;
+		if (tcp_syn_data((uv_handle_t *)handle)) {
+			worker->stats.tfo_out += 1;
+		} else {
+			worker->stats.tfo_out_fallback += 1;
+		}
+	}
+	const uint64_t prof_since = worker_prof_begin(worker);
 	/* TCP pipelining is rather complicated and requires cooperation from the worker
 	 * so the whole message reassembly and demuxing logic is inside worker */
 	int ret = 0;
@@ -248,25 +443,35 @@ static void tcp_recv(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
 		/* Exceeded per-connection quota for outstanding requests
 		 * stop reading from stream and close after last message is processed. */
 		if (!s->outgoing && !uv_is_closing((uv_handle_t *)&s->timeout)) {
-			uv_timer_stop(&s->timeout);
+			tw_stop(&s->timer);
 			if (s->tasks.len == 0) {
 				worker_session_close(s);
 			} else { /* If there are tasks running, defer until they finish. */
-				uv_timer_start(&s->timeout, tcp_timeout_trigger,
-					       MAX_TCP_INACTIVITY, MAX_TCP_INACTIVITY);
+				session_timer_start(s, tcp_timeout_trigger,
+						    MAX_TCP_INACTIVITY, MAX_TCP_INACTIVITY);
 			}
 		}
 	/* Connection spawned at least one request, reset its deadline for next query.
 	 * https://tools.ietf.org/html/rfc7766#section-6.2.3 */
 	} else if (ret > 0 && !s->outgoing && !s->closing) {
-		uv_timer_again(&s->timeout);
+		if (s->in_listed) {
+			tcp_in_unlink(worker, s);
+			tcp_in_link(worker, s);
+		}
+		const uint64_t timeout = tcp_in_timeout(worker, s->has_tls);
+		session_timer_start(s, tcp_timeout_trigger, timeout, timeout);
 	}
 	mp_flush(worker->pkt_pool.ctx);
+	worker_prof_end(worker, PROF_TCP, prof_since, NULL);
 }
 
-static void _tcp_accept(uv_stream_t *master, int status, bool tls)
+static void _tcp_accept(uv_stream_t *master, int status, bool tls, bool http)
 {
 	if (status != 0) {
+		/* Out of descriptors, make room for the next one. */
+		if (status == UV_EMFILE || status == UV_ENFILE) {
+			tcp_in_evict(master->loop->data);
+		}
 		return;
 	}
 
@@ -295,29 +500,61 @@ static void _tcp_accept(uv_stream_t *master, int status, bool tls)
 		return;
 	}
 
-	uint64_t timeout = KR_CONN_RTT_MAX / 2;
+	struct worker_ctx *worker = master->loop->data;
+	if (tcp_syn_data((uv_handle_t *)client)) {
+		worker->stats.tfo_in += 1;
+	}
+	if (!tcp_in_admit(worker, session)) {
+		worker_session_close(session);
+		return;
+	}
+
+	const uint64_t timeout = tcp_in_timeout(worker, tls);
 	session->has_tls = tls;
 	if (tls) {
-		timeout += KR_CONN_RTT_MAX * 3;
+		if (!tls_handshake_admit(master->loop->data, addr)) {
+			worker_session_close(session);
+			return;
+		}
 		if (!session->tls_ctx) {
 			session->tls_ctx = tls_new(master->loop->data);
+			if (!session->tls_ctx) {
+				worker_session_close(session);
+				return;
+			}
 			session->tls_ctx->c.session = session;
 			session->tls_ctx->c.handshake_state = TLS_HS_IN_PROGRESS;
 		}
 	}
-	uv_timer_t *timer = &session->timeout;
-	uv_timer_start(timer, tcp_timeout_trigger, timeout, timeout);
+	if (http) {
+		const struct network *net = &worker->engine->net;
+		if (net->doh_conns_max && worker->stats.doh_conns >= net->doh_conns_max) {
+			worker_session_close(session);
+			return;
+		}
+		session->http_ctx = http_new(session, net->doh_streams_max);
+		if (!session->http_ctx) {
+			worker_session_close(session);
+			return;
+		}
+	}
+	session_timer_start(session, tcp_timeout_trigger, timeout, timeout);
 	io_start_read((uv_handle_t *)client);
 }
 
 static void tcp_accept(uv_stream_t *master, int status)
 {
-	_tcp_accept(master, status, false);
+	_tcp_accept(master, status, false, false);
 }
 
 static void tls_accept(uv_stream_t *master, int status)
 {
-	_tcp_accept(master, status, true);
+	_tcp_accept(master, status, true, false);
+}
+
+static void https_accept(uv_stream_t *master, int status)
+{
+	_tcp_accept(master, status, true, true);
 }
 
 static int set_tcp_option(uv_handle_t *handle, int option, int val)
@@ -331,13 +568,25 @@ static int set_tcp_option(uv_handle_t *handle, int option, int val)
 
 static int tcp_bind_finalize(uv_handle_t *handle)
 {
+	/* The listeners from the command line are opened before the worker. */
+	struct worker_ctx *worker = handle->loop->data;
+	const uint32_t tfo = worker ? worker->engine->net.tcp_fastopen : NET_TCP_FASTOPEN_QUEUE;
+	const uint32_t defer = worker ? worker->engine->net.tcp_defer_accept : KR_CONN_RTT_MAX/1000;
 	/* TCP_FASTOPEN enables 1 RTT connection resumptions. */
 #ifdef TCP_FASTOPEN
+	if (tfo) {
 # ifdef __linux__
-	(void) set_tcp_option(handle, TCP_FASTOPEN, 16); /* Accepts queue length hint */
+		(void) set_tcp_option(handle, TCP_FASTOPEN, tfo); /* Accepts queue length hint */
 # else
-	(void) set_tcp_option(handle, TCP_FASTOPEN, 1);  /* Accepts on/off */
+		(void) set_tcp_option(handle, TCP_FASTOPEN, 1);  /* Accepts on/off */
 # endif
+	}
+#endif
+	/* TCP_DEFER_ACCEPT delays accepting connections until there is readable data. */
+#ifdef TCP_DEFER_ACCEPT
+	if (set_tcp_option(handle, TCP_DEFER_ACCEPT, defer) != 0) {
+		kr_log_info("[ io ] tcp_bind (defer_accept): %s\n", strerror(errno));
+	}
 #endif
 
 	handle->data = NULL;
@@ -356,13 +605,6 @@ static int _tcp_bind(uv_tcp_t *handle, struct sockaddr *addr, uv_connection_cb c
 		return ret;
 	}
 
-	/* TCP_DEFER_ACCEPT delays accepting connections until there is readable data. */
-#ifdef TCP_DEFER_ACCEPT
-	if (set_tcp_option((uv_handle_t *)handle, TCP_DEFER_ACCEPT, KR_CONN_RTT_MAX/1000) != 0) {
-		kr_log_info("[ io ] tcp_bind (defer_accept): %s\n", strerror(errno));
-	}
-#endif
-
 	ret = uv_listen((uv_stream_t *)handle, 16, connection);
 	if (ret != 0) {
 		return ret;
@@ -381,6 +623,11 @@ int tcp_bind_tls(uv_tcp_t *handle, struct sockaddr *addr)
 	return _tcp_bind(handle, addr, tls_accept);
 }
 
+int tcp_bind_https(uv_tcp_t *handle, struct sockaddr *addr)
+{
+	return _tcp_bind(handle, addr, https_accept);
+}
+
 static int _tcp_bindfd(uv_tcp_t *handle, int fd, uv_connection_cb connection)
 {
 	if (!handle) {
@@ -409,6 +656,62 @@ int tcp_bindfd_tls(uv_tcp_t *handle, int fd)
 	return _tcp_bindfd(handle, fd, tls_accept);
 }
 
+int io_tcp_fastopen(uv_tcp_t *handle, int family)
+{
+#if __linux__
+	int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return kr_error(errno);
+	}
+	int on = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) != 0) {
+		int ret = kr_error(errno);
+		close(fd);
+		return ret;
+	}
+	int ret = uv_tcp_open(handle, (uv_os_sock_t) fd);
+	if (ret != 0) {
+		close(fd);
+		return ret;
+	}
+	struct session *session = handle->data;
+	session->tfo = true;
+	session->tfo_unsent = true;
+	return kr_ok();
+#else
+	return kr_error(ENOTSUP);
+#endif
+}
+
+int io_tcp_fastopen_write(uv_handle_t *handle, uv_buf_t *bufs, int nbufs)
+{
+	struct session *session = handle->data;
+	if (!session->tfo_unsent) {
+		return nbufs;
+	}
+	session->tfo_unsent = false;
+	int ret = uv_try_write((uv_stream_t *)handle, bufs, nbufs);
+	/* Without a cookie the kernel has sent a plain SYN, the data wait for the
+	 * handshake; uv_write() gets EAGAIN till then and polls. */
+	if (ret == UV_EINPROGRESS || ret == UV_EAGAIN) {
+		return nbufs;
+	} else if (ret < 0) {
+		return ret;
+	}
+	size_t written = ret;
+	int i = 0;
+	while (i < nbufs && written >= bufs[i].len) {
+		written -= bufs[i].len;
+		i += 1;
+	}
+	if (i < nbufs) {
+		bufs[i].base += written;
+		bufs[i].len -= written;
+	}
+	memmove(bufs, bufs + i, (nbufs - i) * sizeof(*bufs));
+	return nbufs - i;
+}
+
 void io_create(uv_loop_t *loop, uv_handle_t *handle, int type)
 {
 	int ret = -1;
@@ -466,10 +769,18 @@ void io_release(uv_handle_t *handle)
 int io_start_read(uv_handle_t *handle)
 {
 	switch (handle->type) {
-	case UV_UDP:
+	case UV_UDP: {
+		struct worker_ctx *worker = handle->loop->data;
+		struct session *session = handle->data;
+		if (worker->io_uring && session && !session->outgoing) {
+			return uring_recv_start(worker->uring, (uv_udp_t *)handle);
+		}
 		return uv_udp_recv_start((uv_udp_t *)handle, &handle_getbuf, &udp_recv);
+	}
 	case UV_TCP:
 		return uv_read_start((uv_stream_t *)handle, &handle_getbuf, &tcp_recv);
+	case UV_POLL:
+		return kr_ok(); /* XDP sockets are polled while open, see xdp_bind() */
 	default:
 		assert(!EINVAL);
 		return kr_error(EINVAL);
@@ -479,6 +790,12 @@ int io_start_read(uv_handle_t *handle)
 int io_stop_read(uv_handle_t *handle)
 {
 	if (handle->type == UV_UDP) {
+		struct session *session = handle->data;
+		if (session && session->uring) {
+			struct worker_ctx *worker = handle->loop->data;
+			uring_recv_stop(worker->uring, (uv_udp_t *)handle);
+			return kr_ok();
+		}
 		return uv_udp_recv_stop((uv_udp_t *)handle);
 	} else {
 		return uv_read_stop((uv_stream_t *)handle);
@@ -20,10 +20,23 @@
 #include <libknot/packet/pkt.h>
 #include <gnutls/gnutls.h>
 #include "lib/generic/array.h"
+#include "lib/generic/timer_wheel.h"
 #include "daemon/worker.h"
 
 struct tls_ctx_t;
 struct tls_client_ctx_t;
+struct http_ctx;
+struct tcp_out;
+struct uring_listen;
+
+/** Outgoing TCP sessions: `tasks` by the message ID of their queries, see session_add_tasks(). */
+struct session_ids {
+	uint64_t used[(UINT16_MAX + 1) / 64]; /**< Bit of each message ID in the table */
+	uint32_t mask;   /**< Number of `slots` minus one, a power of two */
+	uint32_t *slots; /**< Position in `tasks` plus one, 0 if empty; linear probing by the ID */
+	uint16_t *id;    /**< Message ID of each of `tasks`, by the position */
+	size_t id_cap;
+};
 
 /* Per-session (TCP or UDP) persistent structure,
  * that exists between remote counterpart and a local socket.
@@ -36,29 +49,68 @@ struct session {
 	bool closing;
 	union inaddr peer;
 	uv_handle_t *handle;
-	uv_timer_t timeout;
+	uv_timer_t timeout;  /**< Not run, closed ahead of the handle, see session_close() */
+	struct tw_timer timer; /**< In worker->timers, see session_timer_start() */
 	struct qr_task *buffering; /**< Worker buffers the incomplete TCP query here. */
 	struct tls_ctx_t *tls_ctx;
 	struct tls_client_ctx_t *tls_client_ctx;
+	struct http_ctx *http_ctx; /**< DoH over the TLS session, see http.h; or NULL */
 
 	uint8_t msg_hdr[4];  /**< Buffer for DNS message header. */
 	ssize_t msg_hdr_idx; /**< The number of bytes in msg_hdr filled so far. */
 
 	qr_tasklist_t tasks;
 	qr_tasklist_t waiting;
+	struct session_ids *ids; /**< Index of `tasks` of outgoing TCP, or NULL. */
 	ssize_t bytes_to_skip;
+	struct tcp_out *out; /**< Answers queued for a single write, or NULL. */
+	uint16_t udp_uses;   /**< Outgoing UDP: number of tasks the socket was used for. */
+	bool udp_stray;      /**< Outgoing UDP: got an unexpected datagram, don't reuse it. */
+	bool tfo;            /**< Outgoing TCP: by TCP Fast Open, not counted in the stats yet. */
+	bool tfo_unsent;     /**< Outgoing TCP: by TCP Fast Open, nothing written yet. */
+	struct uring_listen *uring; /**< Listening UDP: received through io_uring, or NULL. */
+	/** Incoming TCP: neighbours in worker->tcp_in, from the least recently active. */
+	struct session *in_prev, *in_next;
+	bool in_listed;      /**< Incoming TCP: in worker->tcp_in and counted. */
+	uint64_t in_prefix;  /**< Incoming TCP: io_client_prefix() of the peer. */
 };
 
 void session_free(struct session *s);
 struct session *session_new(void);
 
+/** (Re)start the timer of the session in the wheel of its worker, `timer->data` is the session. */
+int session_timer_start(struct session *s, tw_cb cb, uint64_t timeout, uint64_t repeat);
+/** Restart the repeating timer of the session, as uv_timer_again(). */
+int session_timer_again(struct session *s);
+
+/** The network of a client, IPv4 /24 or IPv6 /56, with the family in the top byte. */
+uint64_t io_client_prefix(const struct sockaddr *addr);
+/** Take the connection from a client out of worker->tcp_in, when it's closed. */
+void io_tcp_in_del(struct session *s);
+
+/** Process the received datagram, the uv_udp_recv_cb of listening sockets. */
+void udp_recv(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+	const struct sockaddr *addr, unsigned flags);
+/** Process the received stream data, the uv_read_cb of TCP connections. */
+void tcp_recv(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
 int udp_bind(uv_udp_t *handle, struct sockaddr *addr);
 int udp_bindfd(uv_udp_t *handle, int fd);
 int tcp_bind(uv_tcp_t *handle, struct sockaddr *addr);
 int tcp_bind_tls(uv_tcp_t *handle, struct sockaddr *addr);
+/** Listen for DNS over HTTPS, see http.h. */
+int tcp_bind_https(uv_tcp_t *handle, struct sockaddr *addr);
 int tcp_bindfd(uv_tcp_t *handle, int fd);
 int tcp_bindfd_tls(uv_tcp_t *handle, int fd);
 
+/** Open the socket of an upstream TCP handle for TCP Fast Open (Linux 4.11+), before the connect.
+ * The connect is done at once and the first write goes in the SYN, if the kernel
+ * has a cookie from the server; see io_tcp_fastopen_write().  On error the handle is unchanged. */
+int io_tcp_fastopen(uv_tcp_t *handle, int family);
+/** Do the first write of a connection by io_tcp_fastopen(), other connections are left alone.
+ * The buffers are moved past what's been written, the rest is for uv_write().
+ * @return the number of buffers left (0: all written) or an error */
+int io_tcp_fastopen_write(uv_handle_t *handle, uv_buf_t *bufs, int nbufs);
+
 /** Initialize the handle, incl. ->data = struct session * instance. type = SOCK_* */
 void io_create(uv_loop_t *loop, uv_handle_t *handle, int type);
 void io_deinit(uv_handle_t *handle);
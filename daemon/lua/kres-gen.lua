@@ -97,6 +97,11 @@ struct kr_qflags {
 	_Bool DNS64_MARK : 1;
 	_Bool CACHE_TRIED : 1;
 	_Bool NO_NS_FOUND : 1;
+	_Bool NO_SHED : 1;
+	_Bool MINIMAL_RESPONSES : 1;
+	_Bool CNAME_CHAIN : 1;
+	_Bool DNSKEY_AHEAD : 1;
+	_Bool DNSKEY_PENDING : 1;
 };
 typedef struct {
 	knot_rrset_t **at;
@@ -118,8 +123,17 @@ typedef struct {
 	ranked_rr_array_entry_t **at;
 	size_t len;
 	size_t cap;
+	ranked_rr_array_entry_t *inl[8];
+	struct kr_ranked_index *index;
 } ranked_rr_array_t;
 typedef struct trie trie_t;
+struct kr_lf_name {
+	const knot_dname_t *name;
+	uint8_t lf[256];
+	uint8_t suffix_len[128];
+	uint8_t labels;
+	_Bool has_zero;
+};
 struct kr_zonecut {
 	knot_dname_t *name;
 	knot_rrset_t *key;
@@ -127,11 +141,13 @@ struct kr_zonecut {
 	struct kr_zonecut *parent;
 	trie_t *nsset;
 	knot_mm_t *pool;
+	uint32_t *nsset_refs;
 };
 typedef struct {
 	struct kr_query **at;
 	size_t len;
 	size_t cap;
+	struct kr_query *inl[4];
 } kr_qarray_t;
 struct kr_rplan {
 	kr_qarray_t pending;
@@ -170,8 +186,10 @@ struct kr_request {
 	trace_log_f trace_log;
 	trace_callback_f trace_finish;
 	knot_mm_t pool;
+	uint8_t cache_ns;
 };
 enum kr_rank {KR_RANK_INITIAL, KR_RANK_OMIT, KR_RANK_TRY, KR_RANK_INDET = 4, KR_RANK_BOGUS, KR_RANK_MISMATCH, KR_RANK_MISSING, KR_RANK_INSECURE, KR_RANK_AUTH = 16, KR_RANK_SECURE = 32};
+enum kr_filter_op {KR_FILTER_QNAME, KR_FILTER_SRC, KR_FILTER_DST, KR_FILTER_QTYPE, KR_FILTER_CALLBACK, KR_FILTER_AND, KR_FILTER_OR, KR_FILTER_NOT};
 struct kr_cache {
 	knot_db_t *db;
 	const struct kr_cdb_api *api;
@@ -185,10 +203,56 @@ struct kr_cache {
 	uint32_t ttl_max;
 	struct timeval checkpoint_walltime;
 	uint64_t checkpoint_monotime;
+	struct {
+		uint32_t depth;
+		uint32_t deferred;
+		uint32_t commits;
+		uint32_t saved;
+	} batch;
+	struct kr_cache_l1 *l1;
+	struct {
+		uint32_t hit;
+		uint32_t miss;
+		uint64_t size;
+	} l1_stats;
+	struct {
+		uint8_t next[384];
+		uint16_t next_len;
+		uint8_t target;
+		double usage;
+		uint32_t passes;
+		uint32_t scanned;
+		uint32_t freed;
+		uint64_t freed_bytes;
+		uint32_t kept_hot;
+		uint32_t grown;
+	} gc;
+	uint32_t ns_gen;
+	struct kr_cache_remote *remote;
+	struct {
+		uint32_t hit;
+		uint32_t miss;
+		uint32_t promoted;
+		uint32_t replicated;
+		uint32_t dropped;
+	} remote_stats;
+	struct kr_cache_kstats *kstats;
+	struct kr_cache_flush *flush;
+};
+struct kr_fwd_stats {
+	uint64_t selected;
+	uint64_t answers;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t trips;
+	uint32_t srtt_ms;
+	uint16_t weight;
+	_Bool up;
 };
 
 typedef int32_t (*kr_stale_cb)(int32_t ttl, const knot_dname_t *owner, uint16_t type,
 				const struct kr_query *qry);
+typedef _Bool (*kr_filter_cb)(struct kr_request *req, struct kr_query *qry, uint32_t arg);
 struct knot_rrset {
 	knot_dname_t *_owner;
 	uint16_t type;
@@ -223,13 +287,14 @@ struct kr_query {
 	struct kr_query *cname_parent;
 	struct kr_request *request;
 	kr_stale_cb stale_cb;
+	struct kr_lf_name sname_lf;
 	struct kr_nsrep ns;
 };
 struct kr_context {
 	struct kr_qflags options;
 	knot_rrset_t *opt_rr;
-	map_t trust_anchors;
-	map_t negative_anchors;
+	trie_t *trust_anchors;
+	trie_t *negative_anchors;
 	struct kr_zonecut root_hints;
 	struct kr_cache cache;
 	char _stub[];
@@ -287,6 +352,10 @@ uint16_t kr_inaddr_port(const struct sockaddr *);
 int kr_straddr_family(const char *);
 int kr_straddr_subnet(void *, const char *);
 int kr_bitcmp(const char *, const char *, int);
+_Bool kr_dname_eq(const knot_dname_t *, const knot_dname_t *);
+_Bool kr_dname_in(const knot_dname_t *, const knot_dname_t *);
+_Bool kr_rdata_eq(const knot_rdata_t *, const void *, int);
+_Bool kr_rdata_prefix(const knot_rdata_t *, const void *, int);
 int kr_family_len(int);
 struct sockaddr *kr_straddr_socket(const char *, int);
 int kr_ranked_rrarray_add(ranked_rr_array_t *, const knot_rrset_t *, uint8_t, _Bool, uint32_t, knot_mm_t *);
@@ -297,10 +366,41 @@ _Bool kr_zonecut_is_empty(struct kr_zonecut *);
 void kr_zonecut_set(struct kr_zonecut *, const knot_dname_t *);
 const knot_dname_t *kr_zonecut_find_nsname(struct kr_zonecut *);
 uint64_t kr_now();
-knot_rrset_t *kr_ta_get(map_t *, const knot_dname_t *);
-int kr_ta_add(map_t *, const knot_dname_t *, uint16_t, uint32_t, const uint8_t *, uint16_t);
-int kr_ta_del(map_t *, const knot_dname_t *);
-void kr_ta_clear(map_t *);
+trie_t *kr_suffixes_create(void);
+void kr_suffixes_free(trie_t *);
+int kr_suffixes_add(trie_t *, const knot_dname_t *, uint32_t);
+void kr_suffixes_del(trie_t *, uint32_t);
+int kr_suffixes_match(trie_t *, const knot_dname_t *, uint32_t *, int);
+int kr_suffixes_match_lf(trie_t *, const struct kr_lf_name *, uint32_t *, int);
+const struct kr_lf_name *kr_query_sname_lf(struct kr_query *);
+struct kr_subnets *kr_subnets_create(void);
+void kr_subnets_free(struct kr_subnets *);
+int kr_subnets_add(struct kr_subnets *, const char *, uint32_t);
+int kr_subnets_match(const struct kr_subnets *, const struct sockaddr *, uint32_t *);
+struct kr_name_memo *kr_name_memo_create(uint32_t);
+void kr_name_memo_free(struct kr_name_memo *);
+int32_t kr_name_memo_get(struct kr_name_memo *, uint32_t, uint32_t, const knot_dname_t *);
+void kr_name_memo_set(struct kr_name_memo *, uint32_t, uint32_t, const knot_dname_t *, int32_t);
+void kr_name_memo_stats(const struct kr_name_memo *, uint64_t *, uint64_t *);
+struct kr_filter *kr_filter_create(kr_filter_cb);
+void kr_filter_free(struct kr_filter *);
+int kr_filter_add(struct kr_filter *, uint32_t);
+int kr_filter_push(struct kr_filter *, uint32_t, int, const void *, uint32_t);
+int kr_filter_del(struct kr_filter *, uint32_t);
+int kr_filter_set_active(struct kr_filter *, uint32_t, _Bool);
+int64_t kr_filter_count(const struct kr_filter *, uint32_t);
+int kr_filter_match(struct kr_filter *, struct kr_request *, struct kr_query *, uint32_t *);
+int kr_filter_next(struct kr_filter *, struct kr_request *, struct kr_query *, uint32_t *);
+int kr_localzone_find(const knot_dname_t *);
+int kr_localzone_answer(knot_pkt_t *, const knot_dname_t *, uint16_t);
+struct kr_fwd_pool *kr_fwd_pool_create(uint16_t, uint32_t, _Bool);
+int kr_fwd_pool_add(struct kr_fwd_pool *, const struct sockaddr *, uint16_t);
+int kr_fwd_pool_use(struct kr_request *, struct kr_fwd_pool *, uint16_t);
+int kr_fwd_pool_stats(const struct kr_fwd_pool *, unsigned int, struct kr_fwd_stats *);
+knot_rrset_t *kr_ta_get(trie_t *, const knot_dname_t *);
+int kr_ta_add(trie_t *, const knot_dname_t *, uint16_t, uint32_t, const uint8_t *, uint16_t);
+int kr_ta_del(trie_t *, const knot_dname_t *);
+void kr_ta_clear(trie_t *);
 _Bool kr_dnssec_key_ksk(const uint8_t *);
 _Bool kr_dnssec_key_revoked(const uint8_t *);
 int kr_dnssec_key_tag(uint16_t, const uint8_t *, size_t);
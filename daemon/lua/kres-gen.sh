@@ -58,17 +58,21 @@ typedef void (*trace_callback_f)(struct kr_request *);
 	ranked_rr_array_entry_t
 	ranked_rr_array_t
 	trie_t
+	struct kr_lf_name
 	struct kr_zonecut
 	kr_qarray_t
 	struct kr_rplan
 	struct kr_request
 	enum kr_rank
+	enum kr_filter_op
 	struct kr_cache
+	struct kr_fwd_stats
 EOF
 
 printf "
 typedef int32_t (*kr_stale_cb)(int32_t ttl, const knot_dname_t *owner, uint16_t type,
 				const struct kr_query *qry);
+typedef _Bool (*kr_filter_cb)(struct kr_request *req, struct kr_query *qry, uint32_t arg);
 "
 
 genResType() {
@@ -155,6 +159,10 @@ EOF
 	kr_straddr_family
 	kr_straddr_subnet
 	kr_bitcmp
+	kr_dname_eq
+	kr_dname_in
+	kr_rdata_eq
+	kr_rdata_prefix
 	kr_family_len
 	kr_straddr_socket
 	kr_ranked_rrarray_add
@@ -165,6 +173,37 @@ EOF
 	kr_zonecut_set
 	kr_zonecut_find_nsname
 	kr_now
+	kr_suffixes_create
+	kr_suffixes_free
+	kr_suffixes_add
+	kr_suffixes_del
+	kr_suffixes_match
+	kr_suffixes_match_lf
+	kr_query_sname_lf
+	kr_subnets_create
+	kr_subnets_free
+	kr_subnets_add
+	kr_subnets_match
+	kr_name_memo_create
+	kr_name_memo_free
+	kr_name_memo_get
+	kr_name_memo_set
+	kr_name_memo_stats
+	kr_filter_create
+	kr_filter_free
+	kr_filter_add
+	kr_filter_push
+	kr_filter_del
+	kr_filter_set_active
+	kr_filter_count
+	kr_filter_match
+	kr_filter_next
+	kr_localzone_find
+	kr_localzone_answer
+	kr_fwd_pool_create
+	kr_fwd_pool_add
+	kr_fwd_pool_use
+	kr_fwd_pool_stats
 # Trust anchors
 	kr_ta_get
 	kr_ta_add
@@ -312,6 +312,27 @@ ffi.metatype( knot_rrset_t, {
 			local rdata = knot.knot_rdataset_at(rr.rrs, i)
 			return ffi.string(knot.knot_rdata_data(rdata), knot.knot_rdata_rdlen(rdata))
 		end,
+		-- Zero-copy variants, valid as long as the RR set; no Lua strings are made.
+		owner_ptr = function(rr)
+			assert(ffi.istype(knot_rrset_t, rr))
+			return rr._owner
+		end,
+		-- Return the pointer to the RDATA and its length
+		rdata_ptr = function(rr, i)
+			assert(ffi.istype(knot_rrset_t, rr))
+			local rdata = knot.knot_rdataset_at(rr.rrs, i)
+			return knot.knot_rdata_data(rdata), knot.knot_rdata_rdlen(rdata)
+		end,
+		-- Compare the RDATA with a string (or a pointer and length)
+		rdata_eq = function(rr, i, data, len)
+			assert(ffi.istype(knot_rrset_t, rr))
+			return C.kr_rdata_eq(knot.knot_rdataset_at(rr.rrs, i), data, len or #data)
+		end,
+		-- Whether the RDATA start with the bits, e.g. an address with a prefix from kres.str2ip()
+		rdata_prefix = function(rr, i, prefix, bits)
+			assert(ffi.istype(knot_rrset_t, rr))
+			return C.kr_rdata_prefix(knot.knot_rdataset_at(rr.rrs, i), prefix, bits or 8 * #prefix)
+		end,
 		get = function(rr, i)
 			assert(ffi.istype(knot_rrset_t, rr))
 			return {owner = rr:owner(),
@@ -454,7 +475,7 @@ local function packet_tostring(pkt)
 	-- Zone transfer answers may omit question
 	if pkt:qdcount() > 0 then
 		data = data..string.format(';; QUESTION\n;; %s\t%s\t%s\n',
-			dname2str(pkt:qname()), const_type_str[pkt:qtype()], const_class_str[pkt:qclass()])
+			dname2str(knot.knot_pkt_qname(pkt)), const_type_str[pkt:qtype()], const_class_str[pkt:qclass()])
 	end
 	local data_sec = {}
 	for i = const_section.ANSWER, const_section.ADDITIONAL do
@@ -525,6 +546,11 @@ ffi.metatype( knot_pkt_t, {
 			local qname = knot.knot_pkt_qname(pkt)
 			return dname2wire(qname)
 		end,
+		-- Zero-copy variant, a pointer into the packet
+		qname_ptr = function(pkt)
+			assert(ffi.istype(knot_pkt_t, pkt))
+			return knot.knot_pkt_qname(pkt)
+		end,
 		qclass = function(pkt)
 			assert(ffi.istype(knot_pkt_t, pkt))
 			return knot.knot_pkt_qclass(pkt)
@@ -811,6 +837,10 @@ kres = {
 	end,
 	dname2str = dname2str,
 	dname2wire = dname2wire,
+	-- Compare names ignoring case, either wire strings or pointers (e.g. from qname_ptr())
+	dname_eq = function (a, b) return C.kr_dname_eq(a, b) end,
+	-- Whether the name is equal to the zone or below it
+	dname_in = function (name, zone) return C.kr_dname_in(name, zone) end,
 	rr2str = rr2str,
 	str2ip = function (ip)
 		local family = C.kr_straddr_family(ip)
@@ -65,6 +65,14 @@ end
 
 resolve = worker.resolve
 
+-- Resolve many names in the background, a window of them at a time
+-- worker.resolve_many({ {'a.cz', kres.type.A}, {'b.cz', 'AAAA'} }, {window = 8}, function (stats) ... end)
+worker.resolve_many = function (list, opts, finish)
+	opts = opts or {}
+	return worker.resolve_many_unwrapped(list, kres.mk_qflags(opts.options),
+		opts.window, finish)
+end
+
 -- Shorthand for aggregated per-worker information
 worker.info = function ()
 	local t = worker.stats()
@@ -90,6 +98,16 @@ function reorder_RR(val)
 	return option('REORDER_RR', val)
 end
 
+-- Get/set MINIMAL_RESPONSES option
+function minimal_responses(val)
+	return option('MINIMAL_RESPONSES', val)
+end
+
+-- Get/set DNSKEY_AHEAD option
+function dnskey_ahead(val)
+	return option('DNSKEY_AHEAD', val)
+end
+
 -- Get/set resolver options via name (string)
 function option(name, val)
 	local flags = kres.context().options;
@@ -159,7 +177,7 @@ setmetatable(modules, {
 
 -- Syntactic sugar for cache
 -- `cache[x] -> cache.get(x)`
--- `cache.{size|storage} = value`
+-- `cache.{size|storage|max_size|shards|hugepages} = value`
 setmetatable(cache, {
 	__index = function (t, k)
 		local res = rawget(t, k)
@@ -177,7 +195,10 @@ setmetatable(cache, {
 		if not size then size = 10*MB end
 		-- Declarative interface for cache
 		if     k == 'size'    then t.open(v, storage)
-		elseif k == 'storage' then t.open(size, v) end
+		elseif k == 'storage' then t.open(size, v)
+		elseif k == 'max_size' then t.open(size, storage, v)
+		elseif k == 'shards'  then t.open(size, storage, nil, v)
+		elseif k == 'hugepages' then t.open(size, storage, nil, nil, v) end
 	end
 })
 
@@ -232,14 +253,17 @@ else -- Lua 5.2+
 	_SANDBOX = make_sandbox(_ENV)
 end
 
--- Load embedded modules
+-- Load embedded modules, again on reload()
 trust_anchors = require('trust_anchors')
-modules.load('ta_signal_query')
-modules.load('policy')
-modules.load('priming')
-modules.load('detect_time_skew')
-modules.load('detect_time_jump')
-modules.load('ta_sentinel')
+function modules_load_embedded()
+	modules.load('ta_signal_query')
+	modules.load('policy')
+	modules.load('priming')
+	modules.load('detect_time_skew')
+	modules.load('detect_time_jump')
+	modules.load('ta_sentinel')
+end
+modules_load_embedded()
 
 -- Interactive command evaluation
 function eval_cmd(line, raw)
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <sched.h>
 #include <uv.h>
 #include <assert.h>
 #include <contrib/cleanup.h>
@@ -35,7 +36,9 @@
 #include "lib/dnssec.h"
 #include "daemon/network.h"
 #include "daemon/worker.h"
+#include "daemon/prefetch.h"
 #include "daemon/engine.h"
+#include "daemon/handoff.h"
 #include "daemon/bindings.h"
 #include "daemon/tls.h"
 #include "lib/dnssec/ta.h"
@@ -60,6 +63,9 @@ struct args {
 	const char *config;
 	int control_fd;
 	const char *rundir;
+	const char *cpu_affinity;
+	const char *handoff;
+	bool fork_late;
 	bool interactive;
 	bool quiet;
 	bool tty_binary_output;
@@ -75,6 +81,168 @@ static inline char *lua_strerror(int lua_err) {
 	}
 }
 
+/*
+ * TTY control in the batch mode, switched to by the "__batch" pseudo-command.
+ *
+ * Each command is a frame: uint32_t length in network order and the expression;
+ * several may come in one read, or one in several.  The result is sent back in chunks,
+ * each with a uint32_t header in network order: the length of the data and the
+ * TTY_CHUNK_* flags.  The chunks are queued by uv_write(), so a client reading slowly
+ * doesn't hold up the loop; the evaluation itself is Lua on the loop, as any other.
+ */
+
+/** Header flag: more chunks of the result follow. */
+#define TTY_CHUNK_MORE 0x80000000u
+/** Header flag: the command failed, the result is the error message. */
+#define TTY_CHUNK_ERROR 0x40000000u
+/** Largest data of a chunk. */
+#define TTY_CHUNK_MAX (64 * 1024)
+/** Largest command accepted. */
+#define TTY_BATCH_CMD_MAX (16 * 1024 * 1024)
+/** Output queued for a client, over it the connection is closed. */
+#define TTY_BATCH_QUEUE_MAX (64 * 1024 * 1024)
+
+/** Control connection in the batch mode. */
+struct tty_batch {
+	uint8_t *buf; /**< Incomplete command */
+	size_t len;
+	size_t cap;
+};
+
+struct tty_chunk {
+	uv_write_t req;
+	uint8_t data[]; /**< Header and the data */
+};
+
+static void tty_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+
+static void tty_batch_close(uv_handle_t *handle)
+{
+	struct tty_batch *batch = handle->data;
+	free(batch->buf);
+	free(batch);
+	free(handle);
+}
+
+static void tty_chunk_written(uv_write_t *req, int status)
+{
+	free(req);
+}
+
+/** Queue the result in chunks; an empty one is sent too. */
+static int tty_batch_write(uv_stream_t *stream, const char *data, size_t len, bool error)
+{
+	do {
+		const size_t chunk_len = MIN(len, TTY_CHUNK_MAX);
+		uint32_t header = chunk_len | (error ? TTY_CHUNK_ERROR : 0);
+		if (chunk_len < len) {
+			header |= TTY_CHUNK_MORE;
+		}
+		struct tty_chunk *chunk = malloc(sizeof(*chunk) + sizeof(header) + chunk_len);
+		if (!chunk) {
+			return kr_error(ENOMEM);
+		}
+		header = htonl(header);
+		memcpy(chunk->data, &header, sizeof(header));
+		memcpy(chunk->data + sizeof(header), data, chunk_len);
+		uv_buf_t buf = { (char *)chunk->data, sizeof(header) + chunk_len };
+		int ret = uv_write(&chunk->req, stream, &buf, 1, tty_chunk_written);
+		if (ret != 0) {
+			free(chunk);
+			return ret;
+		}
+		data += chunk_len;
+		len -= chunk_len;
+	} while (len > 0);
+	return kr_ok();
+}
+
+static int tty_batch_eval(uv_stream_t *stream, const uint8_t *cmd, size_t len)
+{
+	auto_free char *expr = strndup((const char *)cmd, len);
+	if (!expr) {
+		return kr_error(ENOMEM);
+	}
+	struct engine *engine = ((struct worker_ctx *)stream->loop->data)->engine;
+	lua_State *L = engine->L;
+	int ret = engine_cmd(L, expr, false);
+	size_t message_len = 0;
+	const char *message = NULL;
+	if (lua_gettop(L) > 0) {
+		message = lua_tolstring(L, -1, &message_len);
+	}
+	ret = tty_batch_write(stream, message ? message : "", message ? message_len : 0, ret != 0);
+	lua_settop(L, 0);
+	if (ret == 0 && stream->write_queue_size > TTY_BATCH_QUEUE_MAX) {
+		ret = kr_error(ENOBUFS);
+	}
+	return ret;
+}
+
+static void tty_batch_input(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	struct tty_batch *batch = stream->data;
+	if (nread < 0) {
+		free(buf->base);
+		uv_close((uv_handle_t *)stream, tty_batch_close);
+		return;
+	}
+	if (batch->len + nread > batch->cap) {
+		size_t cap = MAX(batch->len + nread, 2 * batch->cap);
+		uint8_t *grown = realloc(batch->buf, cap);
+		if (!grown) {
+			free(buf->base);
+			uv_close((uv_handle_t *)stream, tty_batch_close);
+			return;
+		}
+		batch->buf = grown;
+		batch->cap = cap;
+	}
+	memcpy(batch->buf + batch->len, buf->base, nread);
+	batch->len += nread;
+	free(buf->base);
+
+	size_t pos = 0;
+	while (batch->len - pos >= sizeof(uint32_t)) {
+		uint32_t len;
+		memcpy(&len, batch->buf + pos, sizeof(len));
+		len = ntohl(len);
+		if (len > TTY_BATCH_CMD_MAX) {
+			uv_close((uv_handle_t *)stream, tty_batch_close);
+			return;
+		}
+		if (batch->len - pos - sizeof(len) < len) {
+			break;
+		}
+		if (tty_batch_eval(stream, batch->buf + pos + sizeof(len), len) != 0) {
+			uv_close((uv_handle_t *)stream, tty_batch_close);
+			return;
+		}
+		pos += sizeof(len) + len;
+	}
+	memmove(batch->buf, batch->buf + pos, batch->len - pos);
+	batch->len -= pos;
+}
+
+/** Switch the connection to the batch mode, acknowledged by an empty chunk. */
+static int tty_batch_start(uv_stream_t *stream)
+{
+	struct tty_batch *batch = calloc(1, sizeof(*batch));
+	if (!batch) {
+		return kr_error(ENOMEM);
+	}
+	uv_read_stop(stream);
+	stream->data = batch;
+	int ret = uv_read_start(stream, tty_alloc, tty_batch_input);
+	if (ret == 0) {
+		ret = tty_batch_write(stream, "", 0, false);
+	}
+	if (ret != 0) {
+		uv_close((uv_handle_t *)stream, tty_batch_close);
+	}
+	return ret;
+}
+
 /**
  * TTY control: process input and free() the buffer.
  *
@@ -130,6 +298,11 @@ static void tty_process_input(uv_stream_t *stream, ssize_t nread, const uv_buf_t
 			args->tty_binary_output = true;
 			goto finish;
 		}
+		/* Pseudo-command for switching to the batch mode, see tty_batch_input(). */
+		if (strcmp(cmd, "__batch") == 0 && stream_fd != STDIN_FILENO) {
+			(void) tty_batch_start(stream);
+			goto finish;
+		}
 
 		struct engine *engine = ((struct worker_ctx *)stream->loop->data)->engine;
 		lua_State *L = engine->L;
@@ -300,6 +473,16 @@ static void signal_handler(uv_signal_t *handle, int signum)
 	uv_signal_stop(handle);
 }
 
+/** Reload the config on SIGHUP; the leader reloads all forks, see reload(). */
+static void sighup_handler(uv_signal_t *handle, int signum)
+{
+	struct engine *engine = handle->data;
+	if (engine) {
+		engine_cmd(engine->L, "map('reload()')", false);
+		lua_settop(engine->L, 0);
+	}
+}
+
 /** Split away port from the address. */
 static const char *set_addr(char *addr, int *port)
 {
@@ -351,6 +534,133 @@ static int fork_workers(fd_array_t *ipc_set, int forks)
 	return 0;
 }
 
+#if __linux__
+/** Parse the CPUs of the fork from --cpu-affinity.
+ *
+ * The list is like "0-3,8-11" and each fork gets one of its CPUs in turn;
+ * the sets separated by '/' like "0-7/8-15" are given to the forks in turn instead. */
+static int cpu_affinity_parse(const char *list, int fork_id, cpu_set_t *cpus)
+{
+	int sets = 1;
+	for (const char *c = list; *c; ++c) {
+		sets += (*c == '/');
+	}
+	const char *c = list;
+	for (int i = 0; i < fork_id % sets; ++i) {
+		c = strchr(c, '/') + 1;
+	}
+	CPU_ZERO(cpus);
+	int count = 0;
+	while (*c && *c != '/') {
+		char *end = NULL;
+		long first = strtol(c, &end, 10), last = first;
+		if (end == c) {
+			return kr_error(EINVAL);
+		}
+		if (*end == '-') {
+			c = end + 1;
+			last = strtol(c, &end, 10);
+			if (end == c) {
+				return kr_error(EINVAL);
+			}
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			return kr_error(EINVAL);
+		}
+		for (long cpu = first; cpu <= last; ++cpu) {
+			count += !CPU_ISSET(cpu, cpus);
+			CPU_SET(cpu, cpus);
+		}
+		c = end;
+		if (*c == ',') {
+			++c;
+		} else if (*c && *c != '/') {
+			return kr_error(EINVAL);
+		}
+	}
+	if (count == 0) {
+		return kr_error(EINVAL);
+	}
+	if (sets > 1) {
+		return kr_ok();
+	}
+	/* Just the one CPU of the fork. */
+	int nth = fork_id % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, cpus) && nth-- == 0) {
+			CPU_ZERO(cpus);
+			CPU_SET(cpu, cpus);
+			break;
+		}
+	}
+	return kr_ok();
+}
+#endif
+
+/** Pin the fork to its CPUs by --cpu-affinity.  It's done before the fork allocates
+ * anything, so that its memory comes from the NUMA node of the CPUs: the default policy
+ * allocates on the node where the memory is first touched.
+ * @return the only CPU of the fork, -1 if it has more, or an error */
+static int cpu_affinity_set(const char *list, int fork_id)
+{
+#if __linux__
+	cpu_set_t cpus;
+	int ret = cpu_affinity_parse(list, fork_id, &cpus);
+	if (ret != 0) {
+		return ret;
+	}
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+		return kr_error(errno);
+	}
+	if (CPU_COUNT(&cpus) != 1) {
+		return -1;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &cpus)) {
+			return cpu;
+		}
+	}
+	return -1;
+#else
+	return kr_error(ENOTSUP);
+#endif
+}
+
+/** Fork after the leader loaded the config (--fork-late), so that the forks share
+ * the pages of what it loaded (modules, policies, hints, trust anchors) copy-on-write.
+ * Each fork then makes the worker its own and opens its listeners and the cache.
+ * @return the ID of the fork or an error */
+static int fork_late(struct engine *engine, struct worker_ctx *worker,
+		     fd_array_t *ipc_set, struct args *args)
+{
+	/* The cache threads and file locks don't survive fork(), each fork opens it again. */
+	kr_cache_close(&engine->resolver.cache);
+	int fork_id = fork_workers(ipc_set, args->forks);
+	if (fork_id < 0) {
+		return fork_id;
+	}
+	if (fork_id > 0) {
+		if (args->cpu_affinity) {
+			int cpu = cpu_affinity_set(args->cpu_affinity, fork_id);
+			engine->net.incoming_cpu = cpu >= 0 ? cpu : -1;
+		}
+		int ret = worker_forked(worker, fork_id);
+		if (ret != 0) {
+			kr_log_error("[system] fork %d failed to take over the worker: %s\n",
+					fork_id, kr_strerror(ret));
+			return ret;
+		}
+	}
+	int ret = engine_cmd(engine->L, "if cache.current_size then"
+			" cache.open(cache.current_size, cache.current_storage) end", false);
+	if (ret != 0) {
+		kr_log_error("[system] fork %d failed to open the cache: %s\n", fork_id,
+				lua_gettop(engine->L) > 0 ? lua_tostring(engine->L, -1) : "");
+	}
+	lua_settop(engine->L, 0);
+	return fork_id;
+}
+
 static void help(int argc, char *argv[])
 {
 	printf("Usage: %s [parameters] [rundir]\n", argv[0]);
@@ -364,6 +674,10 @@ static void help(int argc, char *argv[])
 	       " -K, --keyfile-ro=[path] File with read-only root domain trust anchors, for use with an external updater.\n"
 	       " -m, --moduledir=[path] Override the default module path (" MODULEDIR ").\n"
 	       " -f, --forks=N          Start N forks sharing the configuration.\n"
+	       "     --hugepages        Put the large tables into huge pages.\n"
+	       "     --cpu-affinity=[list] Pin the forks to the CPUs, one each (e.g. 0-3,8-11) or a set each (0-7/8-15).\n"
+	       "     --fork-late        Fork after loading the config, sharing what it loaded.\n"
+	       "     --handoff=[path]   Take the listeners over from the instance at the UNIX socket, then offer them there.\n"
 	       " -q, --quiet            No command prompt in interactive mode.\n"
 	       " -v, --verbose          Run in verbose mode."
 #ifdef NOVERBOSELOG
@@ -492,6 +806,10 @@ static int parse_args(int argc, char **argv, struct args *args)
 		{"keyfile-ro", required_argument, 0, 'K'},
 		{"forks",      required_argument, 0, 'f'},
 		{"moduledir",  required_argument, 0, 'm'},
+		{"hugepages",        no_argument, 0, 'H'},
+		{"cpu-affinity", required_argument, 0, 'A'},
+		{"fork-late",        no_argument, 0, 'L'},
+		{"handoff",    required_argument, 0, 'O'},
 		{"verbose",          no_argument, 0, 'v'},
 		{"quiet",            no_argument, 0, 'q'},
 		{"version",          no_argument, 0, 'V'},
@@ -546,6 +864,27 @@ static int parse_args(int argc, char **argv, struct args *args)
 		case 'q':
 			args->quiet = true;
 			break;
+		case 'H': /* only --hugepages */
+			kr_hugepages = true;
+			break;
+		case 'A': { /* only --cpu-affinity */
+#if __linux__
+			cpu_set_t cpus;
+			if (cpu_affinity_parse(optarg, 0, &cpus) != 0) {
+				kr_log_error("[system] error '--cpu-affinity' requires a list of CPUs"
+						" like 0-3,8-11 or 0-7/8-15, not '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+#endif
+			args->cpu_affinity = optarg;
+			break;
+		}
+		case 'L': /* only --fork-late */
+			args->fork_late = true;
+			break;
+		case 'O': /* only --handoff */
+			args->handoff = optarg;
+			break;
 		case 'V':
 			kr_log_info("%s, version %s\n", "Knot DNS Resolver", PACKAGE_VERSION);
 			return EXIT_SUCCESS;
@@ -649,6 +988,12 @@ int main(int argc, char **argv)
 		args.config = "config";
 	}
 
+	if (args.handoff && args.forks != 1) {
+		kr_log_error("[system] the handoff is for a single process only (bad: --forks=%d)\n",
+			     args.forks);
+		return EXIT_FAILURE;
+	}
+
 #ifndef CAN_FORK_EARLY
 	/* Forking is currently broken with libuv. We need libuv to bind to
 	 * sockets etc. before forking, but at the same time can't touch it before
@@ -660,14 +1005,44 @@ int main(int argc, char **argv)
 	 }
 #endif
 
+	/* All forks must accept the TLS session tickets issued by any of them. */
+	if (tls_session_ticket_init() != 0) {
+		kr_log_error("[tls] failed to initialize session tickets, DoT clients won't resume\n");
+	}
+	/* All forks present the same ephemeral key, unless a certificate is configured. */
+	if (tls_ephemeral_key_init() != 0) {
+		kr_log_error("[tls] failed to prepare the ephemeral private key\n");
+	}
+	/* Count cache lookups of all forks, for the cache GC (even with one fork). */
+	kr_cache_share_sketch(cmsketch_create(KR_CACHE_SKETCH_WIDTH));
+	/* Let forks share what they learn about upstream servers
+	 * and which subrequests they're currently asking. */
+	shtable_t *subreq_shared = NULL;
+	if (args.forks > 1) {
+		kr_nsrep_share(shtable_create(LRU_RTT_SIZE, sizeof(kr_nsrep_rtt_lru_entry_t)),
+			       shtable_create(LRU_REP_SIZE, sizeof(unsigned)));
+		subreq_shared = shtable_create(SUBREQ_SHARED_SIZE,
+					       sizeof(struct subreq_shared_entry));
+	}
+	/* Counters of all forks, so that reading them needs no IPC. */
+	shcounters_t *shstats = shcounters_create(args.forks, SHSTATS_SLOTS);
+
 	/* Connect forks with local socket */
 	fd_array_t ipc_set;
 	array_init(ipc_set);
-	/* Fork subprocesses if requested */
-	int fork_id = fork_workers(&ipc_set, args.forks);
+	/* Fork subprocesses if requested; with --fork-late the leader forks after the config. */
+	int fork_id = args.fork_late ? 0 : fork_workers(&ipc_set, args.forks);
 	if (fork_id < 0) {
 		return EXIT_FAILURE;
 	}
+	int fork_cpu = -1;
+	if (args.cpu_affinity) {
+		fork_cpu = cpu_affinity_set(args.cpu_affinity, fork_id);
+		if (fork_cpu < -1) {
+			kr_log_error("[system] can't set the CPU affinity: %s\n", kr_strerror(fork_cpu));
+			fork_cpu = -1;
+		}
+	}
 
 	kr_crypto_init();
 
@@ -688,8 +1063,22 @@ int main(int argc, char **argv)
 		kr_log_error("[system] not enough memory\n");
 		return EXIT_FAILURE;
 	}
+	worker->subreq_shared = subreq_shared;
+	/* The listeners prefer the packets processed on the CPU of the fork. */
+	engine.net.incoming_cpu = fork_cpu;
 
 	uv_loop_t *loop = NULL;
+	/* Take over the listeners of the running instance; the same addresses
+	 * below and in the config are then found listening already. */
+	int handoff_conn = -1;
+	if (args.handoff) {
+		ret = handoff_receive(args.handoff, &engine.net, &engine.resolver, &handoff_conn);
+		if (ret != 0) {
+			kr_log_error("[system] handoff from '%s': %s\n", args.handoff, kr_strerror(ret));
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
 	/* Bind to passed fds and sockets*/
 	if (bind_fds(&engine.net, &args.fd_set, false) != 0 ||
 	    bind_fds(&engine.net, &args.tls_fd_set, true) != 0 ||
@@ -716,14 +1105,33 @@ int main(int argc, char **argv)
 	
 	/* Block signals. */
 	loop = uv_default_loop();
-	uv_signal_t sigint, sigterm;
+	uv_signal_t sigint, sigterm, sighup;
 	uv_signal_init(loop, &sigint);
 	uv_signal_init(loop, &sigterm);
+	uv_signal_init(loop, &sighup);
 	uv_signal_start(&sigint, signal_handler, SIGINT);
 	uv_signal_start(&sigterm, signal_handler, SIGTERM);
+	/* The other forks ignore it, the leader tells them. */
+	sighup.data = fork_id == 0 ? &engine : NULL;
+	uv_signal_start(&sighup, sighup_handler, SIGHUP);
 	/* Start the scripting engine */
 	worker->loop = loop;
 	loop->data = worker;
+	if (worker_timers_start(worker) != 0) {
+		kr_log_error("[system] failed to start the session timers\n");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	/* Before the config, so that modules can register their counters. */
+	if (worker_shstats_start(worker, shstats) != 0) {
+		kr_log_error("[system] failed to share worker statistics\n");
+	}
+	if (worker_lag_start(worker) != 0) {
+		kr_log_error("[system] failed to start measuring the loop lag\n");
+	}
+	if (prefetch_init(worker) != 0) {
+		kr_log_error("[system] failed to initialize prefetching\n");
+	}
 
 	if (engine_load_sandbox(&engine) != 0) {
 		ret = EXIT_FAILURE;
@@ -750,6 +1158,32 @@ int main(int argc, char **argv)
 		ret = EXIT_FAILURE;
 		goto cleanup;
 	}
+	if (args.fork_late && args.forks > 1) {
+		ret = fork_late(&engine, worker, &ipc_set, &args);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		fork_id = ret;
+		ret = 0;
+		sighup.data = fork_id == 0 ? &engine : NULL;
+	}
+	if (worker_cache_gc_start(worker) != 0) {
+		kr_log_error("[system] failed to start cache garbage collection\n");
+	}
+	if (worker_lua_gc_start(worker) != 0) {
+		kr_log_error("[system] failed to start stepping the Lua collector\n");
+	}
+
+	/* Only now the old instance stops serving, see daemon/handoff.h */
+	if (args.handoff) {
+		int hret = handoff_start(worker, args.handoff, handoff_conn);
+		handoff_conn = -1;
+		if (hret != 0) {
+			kr_log_error("[system] can't offer the handoff at '%s': %s\n",
+				     args.handoff, kr_strerror(hret));
+		}
+	}
 
 	/* Run the event loop */
 	ret = run_worker(loop, &engine, &ipc_set, fork_id == 0, &args);
@@ -760,6 +1194,10 @@ int main(int argc, char **argv)
 	}
 
 cleanup:/* Cleanup. */
+	if (handoff_conn >= 0) {
+		close(handoff_conn);
+	}
+	handoff_stop();
 	engine_deinit(&engine);
 	worker_reclaim(worker);
 	if (loop != NULL) {
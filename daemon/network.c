@@ -17,9 +17,25 @@
 #include <unistd.h>
 #include <assert.h>
 #include "daemon/network.h"
+#include "daemon/http.h"
 #include "daemon/worker.h"
 #include "daemon/io.h"
 #include "daemon/tls.h"
+#include "daemon/xdp.h"
+
+#if __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#endif
 
 /* libuv 1.7.0+ is able to support SO_REUSEPORT for loadbalancing */
 #if defined(UV_VERSION_HEX)
@@ -50,8 +66,12 @@ void network_init(struct network *net, uv_loop_t *loop)
 {
 	if (net != NULL) {
 		net->loop = loop;
-		net->endpoints = map_make(NULL);
-		net->tls_client_params = map_make(NULL);
+		net->endpoints = trie_create(NULL);
+		net->tls_client_params = trie_create(NULL);
+		net->doh_streams_max = HTTP_STREAMS_MAX;
+		net->tcp_fastopen = NET_TCP_FASTOPEN_QUEUE;
+		net->tcp_defer_accept = KR_CONN_RTT_MAX / 1000;
+		net->incoming_cpu = -1;
 	}
 }
 
@@ -72,29 +92,33 @@ static void close_handle(uv_handle_t *handle, bool force)
 static int close_endpoint(struct endpoint *ep, bool force)
 {
 	if (ep->udp) {
+		io_stop_read((uv_handle_t *)ep->udp); /* cancels the io_uring receive */
 		close_handle((uv_handle_t *)ep->udp, force);
 	}
 	if (ep->tcp) {
 		close_handle((uv_handle_t *)ep->tcp, force);
 	}
+	if (ep->xdp) {
+		xdp_close(ep->xdp, force);
+	}
 
 	free(ep);
 	return kr_ok();
 }
 
-/** Endpoint visitor (see @file map.h) */
-static int close_key(const char *key, void *val, void *ext)
+/** Endpoint visitor (see @file trie.h) */
+static int close_key(trie_val_t *val, void *ext)
 {
-	endpoint_array_t *ep_array = val;
+	endpoint_array_t *ep_array = *val;
 	for (size_t i = ep_array->len; i--;) {
 		close_endpoint(ep_array->at[i], true);
 	}
 	return 0;
 }
 
-static int free_key(const char *key, void *val, void *ext)
+static int free_key(trie_val_t *val, void *ext)
 {
-	endpoint_array_t *ep_array = val;
+	endpoint_array_t *ep_array = *val;
 	array_clear(*ep_array);
 	free(ep_array);
 	return kr_ok();
@@ -103,30 +127,56 @@ static int free_key(const char *key, void *val, void *ext)
 void network_deinit(struct network *net)
 {
 	if (net != NULL) {
-		map_walk(&net->endpoints, close_key, 0);
-		map_walk(&net->endpoints, free_key, 0);
-		map_clear(&net->endpoints);
+		trie_apply(net->endpoints, close_key, 0);
+		trie_apply(net->endpoints, free_key, 0);
+		trie_free(net->endpoints);
+		net->endpoints = NULL;
 		tls_credentials_free(net->tls_credentials);
-		tls_client_params_free(&net->tls_client_params);
+		tls_client_params_free(net->tls_client_params);
+		net->tls_client_params = NULL;
 		net->tls_credentials = NULL;
 	}
 }
 
 /** Fetch or create endpoint array and insert endpoint. */
-static int insert_endpoint(struct network *net, const char *addr, struct endpoint *ep)
+/** Key of the endpoints in net->endpoints: the binary address and port, see kr_sockaddr_key().
+ * Each spelling of an address maps to the same key and the lookups don't format anything. */
+struct endpoint_key {
+	char buf[KR_SOCKADDR_KEY_MAXLEN];
+	int len;
+};
+
+static int parse_addr(const char *addr, uint16_t port, struct sockaddr_storage *sa)
 {
-	/* Fetch or insert address into map */
-	endpoint_array_t *ep_array = map_get(&net->endpoints, addr);
+	if (strchr(addr, ':') != NULL) {
+		return uv_ip6_addr(addr, port, (struct sockaddr_in6 *)sa);
+	} else {
+		return uv_ip4_addr(addr, port, (struct sockaddr_in *)sa);
+	}
+}
+
+static int endpoint_key(struct endpoint_key *key, const struct sockaddr *sa)
+{
+	key->len = kr_sockaddr_key(key->buf, sa);
+	return key->len < 0 ? key->len : kr_ok();
+}
+
+static int insert_endpoint(struct network *net, const struct endpoint_key *key, struct endpoint *ep)
+{
+	/* Fetch or insert address into the trie */
+	trie_val_t *val = trie_get_ins(net->endpoints, key->buf, key->len);
+	if (val == NULL) {
+		return kr_error(ENOMEM);
+	}
+	endpoint_array_t *ep_array = *val;
 	if (ep_array == NULL) {
 		ep_array = malloc(sizeof(*ep_array));
 		if (ep_array == NULL) {
-			return kr_error(ENOMEM);
-		}
-		if (map_set(&net->endpoints, addr, ep_array) != 0) {
-			free(ep_array);
+			trie_del(net->endpoints, key->buf, key->len, NULL);
 			return kr_error(ENOMEM);
 		}
 		array_init(*ep_array);
+		*val = ep_array;
 	}
 
 	if (array_push(*ep_array, ep) < 0) {
@@ -136,6 +186,85 @@ static int insert_endpoint(struct network *net, const char *addr, struct endpoin
 }
 
 /** Open endpoint protocols. */
+/** Steer the clients to the sockets of the reuseport group by their /24 resp. /48 network,
+ * so that each fork keeps seeing the same clients, e.g. for per-fork RRL and cookies.
+ * The program is shared by the group, each fork attaches the same one. */
+static int steer_attach(struct network *net, uv_handle_t *handle, int family)
+{
+#if __linux__
+	struct worker_ctx *worker = net->loop->data;
+	const unsigned group = net->steer_group ? net->steer_group : (worker ? worker->count : 1);
+	uv_os_fd_t fd = -1;
+	if (group < 2 || uv_fileno(handle, &fd) != 0) {
+		return kr_ok();
+	}
+	/* The classic BPF sees the payload, the addresses are before it. */
+	struct sock_filter v4[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12), /* source address */
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffffff00),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, group),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_filter v6[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8), /* source address */
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 12), /* up to /48 */
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, group),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { sizeof(v4) / sizeof(v4[0]), v4 };
+	if (family == AF_INET6) {
+		prog = (struct sock_fprog){ sizeof(v6) / sizeof(v6[0]), v6 };
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+		return kr_error(errno);
+	}
+	return kr_ok();
+#else
+	return kr_error(ENOTSUP);
+#endif
+}
+
+/** Allow binding an address the host doesn't have (yet), see NET_FREEBIND. */
+static int set_freebind(uv_handle_t *handle)
+{
+#if defined(IP_FREEBIND)
+	uv_os_fd_t fd = -1;
+	int on = 1;
+	if (uv_fileno(handle, &fd) != 0
+	    || setsockopt(fd, IPPROTO_IP, IP_FREEBIND, &on, sizeof(on)) != 0) {
+		return kr_error(errno);
+	}
+	return kr_ok();
+#else
+	return kr_error(ENOTSUP);
+#endif
+}
+
+/** Prefer the socket of the reuseport group for the packets processed on the CPU
+ * of this fork (Linux 6.2+ without a steering program; before, it's just a hint for the
+ * connections).  Not fatal, the sockets only get spread by the hash then. */
+static void set_incoming_cpu(struct network *net, uv_handle_t *handle)
+{
+#if __linux__
+	uv_os_fd_t fd = -1;
+	if (net->incoming_cpu < 0 || uv_fileno(handle, &fd) != 0) {
+		return;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+			&net->incoming_cpu, sizeof(net->incoming_cpu)) != 0) {
+		kr_log_verbose("[network] SO_INCOMING_CPU %d: %s\n",
+				net->incoming_cpu, strerror(errno));
+	}
+#endif
+}
+
 static int open_endpoint(struct network *net, struct endpoint *ep, struct sockaddr *sa, uint32_t flags)
 {
 	int ret = 0;
@@ -146,7 +275,17 @@ static int open_endpoint(struct network *net, struct endpoint *ep, struct sockad
 		}
 		memset(ep->udp, 0, sizeof(*ep->udp));
 		handle_init(udp, net->loop, ep->udp, sa->sa_family); /* can return! */
+		set_incoming_cpu(net, (uv_handle_t *)ep->udp);
+		if (flags & NET_FREEBIND) {
+			ret = set_freebind((uv_handle_t *)ep->udp);
+			if (ret != 0) {
+				return ret;
+			}
+		}
 		ret = udp_bind(ep->udp, sa);
+		if (ret == 0 && (flags & NET_STEER)) {
+			ret = steer_attach(net, (uv_handle_t *)ep->udp, sa->sa_family);
+		}
 		if (ret != 0) {
 			return ret;
 		}
@@ -159,17 +298,31 @@ static int open_endpoint(struct network *net, struct endpoint *ep, struct sockad
 		}
 		memset(ep->tcp, 0, sizeof(*ep->tcp));
 		handle_init(tcp, net->loop, ep->tcp, sa->sa_family); /* can return! */
-		if (flags & NET_TLS) {
+		set_incoming_cpu(net, (uv_handle_t *)ep->tcp);
+		if (flags & NET_FREEBIND) {
+			ret = set_freebind((uv_handle_t *)ep->tcp);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+		if (flags & NET_HTTPS) {
+			ret = tcp_bind_https(ep->tcp, sa);
+			ep->flags |= NET_TLS | NET_HTTPS;
+		} else if (flags & NET_TLS) {
 			ret = tcp_bind_tls(ep->tcp, sa);
 			ep->flags |= NET_TLS;
 		} else {
 			ret = tcp_bind(ep->tcp, sa);
 		}
+		if (ret == 0 && (flags & NET_STEER)) {
+			ret = steer_attach(net, (uv_handle_t *)ep->tcp, sa->sa_family);
+		}
 		if (ret != 0) {
 			return ret;
 		}
 		ep->flags |= NET_TCP;
 	}
+	ep->flags |= flags & (NET_STEER | NET_FREEBIND);
 	return ret;
 }
 
@@ -222,14 +375,17 @@ static int open_endpoint_fd(struct network *net, struct endpoint *ep, int fd, in
 	return kr_error(EINVAL);
 }
 
-/** @internal Fetch endpoint array and offset of the address/port query. */
-static endpoint_array_t *network_get(struct network *net, const char *addr, uint16_t port, size_t *index)
+/** @internal Fetch endpoint array and offset of the address/port query.
+ * The XDP endpoints are separate, as the kernel serves TCP on the same address/port. */
+static endpoint_array_t *network_get(struct network *net, const struct endpoint_key *key,
+				     uint32_t xdp, size_t *index)
 {
-	endpoint_array_t *ep_array = map_get(&net->endpoints, addr);
+	trie_val_t *val = trie_get_try(net->endpoints, key->buf, key->len);
+	endpoint_array_t *ep_array = val ? *val : NULL;
 	if (ep_array) {
 		for (size_t i = ep_array->len; i--;) {
 			struct endpoint *ep = ep_array->at[i];
-			if (ep->port == port) {
+			if ((ep->flags & NET_XDP) == xdp) {
 				*index = i;
 				return ep_array;
 			}
@@ -254,15 +410,8 @@ int network_listen_fd(struct network *net, int fd, bool use_tls)
 	if (ret != 0) {
 		return kr_error(EBADF);
 	}
-	int port = 0;
-	char addr_str[INET6_ADDRSTRLEN]; /* https://tools.ietf.org/html/rfc4291 */
-	if (ss.ss_family == AF_INET) {
-		uv_ip4_name((const struct sockaddr_in*)&ss, addr_str, sizeof(addr_str));
-		port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
-	} else if (ss.ss_family == AF_INET6) {
-		uv_ip6_name((const struct sockaddr_in6*)&ss, addr_str, sizeof(addr_str));
-		port = ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
-	} else {
+	struct endpoint_key key;
+	if (endpoint_key(&key, (struct sockaddr *)&ss) != 0) {
 		return kr_error(EAFNOSUPPORT);
 	}
 
@@ -271,8 +420,8 @@ int network_listen_fd(struct network *net, int fd, bool use_tls)
 	struct endpoint *ep = malloc(sizeof(*ep));
 	memset(ep, 0, sizeof(*ep));
 	ep->flags = NET_DOWN;
-	ep->port = port;
-	ret = insert_endpoint(net, addr_str, ep);
+	ep->port = kr_inaddr_port((struct sockaddr *)&ss);
+	ret = insert_endpoint(net, &key, ep);
 	if (ret != 0) {
 		return ret;
 	}
@@ -286,44 +435,92 @@ int network_listen(struct network *net, const char *addr, uint16_t port, uint32_
 		return kr_error(EINVAL);
 	}
 
+	/* Parse address. */
+	struct sockaddr_storage sa;
+	struct endpoint_key key;
+	int ret = parse_addr(addr, port, &sa);
+	if (ret == 0) {
+		ret = endpoint_key(&key, (struct sockaddr *)&sa);
+	}
+	if (ret != 0) {
+		return ret;
+	}
+
 	/* Already listening */
 	size_t index = 0;
-	if (network_get(net, addr, port, &index)) {
+	if (network_get(net, &key, NET_DOWN, &index)) {
 		return kr_ok();
 	}
 
-	/* Parse address. */
-	int ret = 0;
+	/* Bind interfaces */
+	struct endpoint *ep = malloc(sizeof(*ep));
+	memset(ep, 0, sizeof(*ep));
+	ep->flags = NET_DOWN;
+	ep->port = port;
+	ret = open_endpoint(net, ep, (struct sockaddr *)&sa, flags);
+	if (ret == 0) {
+		ret = insert_endpoint(net, &key, ep);
+	}
+	if (ret != 0) {
+		close_endpoint(ep, false);
+	}
+
+	return ret;
+}
+
+int network_listen_xdp(struct network *net, const char *addr, uint16_t port,
+		       const char *ifname, uint32_t queue)
+{
+	if (net == NULL || addr == 0 || port == 0 || ifname == NULL) {
+		return kr_error(EINVAL);
+	}
+
 	struct sockaddr_storage sa;
-	if (strchr(addr, ':') != NULL) {
-		ret = uv_ip6_addr(addr, port, (struct sockaddr_in6 *)&sa);
-	} else {
-		ret = uv_ip4_addr(addr, port, (struct sockaddr_in *)&sa);
+	struct endpoint_key key;
+	int ret = parse_addr(addr, port, &sa);
+	if (ret == 0) {
+		ret = endpoint_key(&key, (struct sockaddr *)&sa);
 	}
 	if (ret != 0) {
 		return ret;
 	}
 
-	/* Bind interfaces */
+	/* Already listening */
+	size_t index = 0;
+	if (network_get(net, &key, NET_XDP, &index)) {
+		return kr_ok();
+	}
+
 	struct endpoint *ep = malloc(sizeof(*ep));
+	if (!ep) {
+		return kr_error(ENOMEM);
+	}
 	memset(ep, 0, sizeof(*ep));
 	ep->flags = NET_DOWN;
 	ep->port = port;
-	ret = open_endpoint(net, ep, (struct sockaddr *)&sa, flags);
+	ret = xdp_bind(net->loop, &ep->xdp, (struct sockaddr *)&sa, ifname, queue);
 	if (ret == 0) {
-		ret = insert_endpoint(net, addr, ep);
+		ep->flags |= NET_UDP | NET_XDP;
+		ret = insert_endpoint(net, &key, ep);
 	}
 	if (ret != 0) {
 		close_endpoint(ep, false);
 	}
-
 	return ret;
 }
 
 int network_close(struct network *net, const char *addr, uint16_t port)
 {
+	struct sockaddr_storage sa;
+	struct endpoint_key key;
+	if (parse_addr(addr, port, &sa) != 0 || endpoint_key(&key, (struct sockaddr *)&sa) != 0) {
+		return kr_error(EINVAL);
+	}
 	size_t index = 0;
-	endpoint_array_t *ep_array = network_get(net, addr, port, &index);
+	endpoint_array_t *ep_array = network_get(net, &key, NET_DOWN, &index);
+	if (!ep_array) {
+		ep_array = network_get(net, &key, NET_XDP, &index);
+	}
 	if (!ep_array) {
 		return kr_error(ENOENT);
 	}
@@ -335,12 +532,171 @@ int network_close(struct network *net, const char *addr, uint16_t port)
 	/* Collapse key if it has no endpoint. */
 	if (ep_array->len == 0) {
 		free(ep_array);
-		map_del(&net->endpoints, addr);
+		trie_del(net->endpoints, key.buf, key.len, NULL);
 	}
 
 	return kr_ok();
 }
 
+/** Endpoint visitor, see network_udp_restart() */
+static int restart_key(trie_val_t *val, void *ext)
+{
+	endpoint_array_t *ep_array = *val;
+	for (size_t i = 0; i < ep_array->len; ++i) {
+		uv_handle_t *handle = (uv_handle_t *)ep_array->at[i]->udp;
+		if (handle && !uv_is_closing(handle)) {
+			io_stop_read(handle);
+			int ret = io_start_read(handle);
+			if (ret != 0) {
+				kr_log_error("[network] can't restart receiving: %s\n", kr_strerror(ret));
+			}
+		}
+	}
+	return 0;
+}
+
+void network_udp_restart(struct network *net)
+{
+	trie_apply(net->endpoints, restart_key, NULL);
+}
+
+/** Endpoint visitor, see network_reopen() */
+static int reopen_key(trie_val_t *val, void *ext)
+{
+	struct network *net = ext;
+	endpoint_array_t *ep_array = *val;
+	for (size_t i = 0; i < ep_array->len; ++i) {
+		struct endpoint *ep = ep_array->at[i];
+		if (ep->flags & NET_XDP) {
+			continue;
+		}
+		struct sockaddr_storage ss;
+		int len = sizeof(ss);
+		int ret = kr_error(EINVAL);
+		if (ep->udp) {
+			ret = uv_udp_getsockname(ep->udp, (struct sockaddr *)&ss, &len);
+		} else if (ep->tcp) {
+			ret = uv_tcp_getsockname(ep->tcp, (struct sockaddr *)&ss, &len);
+		}
+		struct endpoint *fresh = ret == 0 ? malloc(sizeof(*fresh)) : NULL;
+		if (!fresh) {
+			continue;
+		}
+		memset(fresh, 0, sizeof(*fresh));
+		fresh->flags = NET_DOWN;
+		fresh->port = ep->port;
+		ret = open_endpoint(net, fresh, (struct sockaddr *)&ss, ep->flags);
+		if (ret != 0) {
+			/* E.g. a socket from the supervisor without SO_REUSEPORT; keep sharing it. */
+			kr_log_error("[network] can't reopen the listener on port %d, shared with the other forks: %s\n",
+					ep->port, kr_strerror(ret));
+			close_endpoint(fresh, false);
+			continue;
+		}
+		ep_array->at[i] = fresh;
+		close_endpoint(ep, false);
+	}
+	return 0;
+}
+
+void network_reopen(struct network *net)
+{
+	trie_apply(net->endpoints, reopen_key, net);
+}
+
+/** Endpoint visitor, see network_listen_fds() */
+static int fds_key(trie_val_t *val, void *ext)
+{
+	endpoint_array_t *ep_array = *val;
+	network_fd_array_t *fds = ext;
+	for (size_t i = 0; i < ep_array->len; ++i) {
+		struct endpoint *ep = ep_array->at[i];
+		if (ep->flags & (NET_XDP | NET_HTTPS)) {
+			continue;
+		}
+		uv_os_fd_t fd = -1;
+		if (ep->udp && !uv_is_closing((uv_handle_t *)ep->udp)
+		    && uv_fileno((uv_handle_t *)ep->udp, &fd) == 0) {
+			struct network_fd nfd = { .fd = fd, .tls = false };
+			if (array_push(*fds, nfd) < 0) {
+				return kr_error(ENOMEM);
+			}
+		}
+		if (ep->tcp && !uv_is_closing((uv_handle_t *)ep->tcp)
+		    && uv_fileno((uv_handle_t *)ep->tcp, &fd) == 0) {
+			struct network_fd nfd = { .fd = fd, .tls = ep->flags & NET_TLS };
+			if (array_push(*fds, nfd) < 0) {
+				return kr_error(ENOMEM);
+			}
+		}
+	}
+	return 0;
+}
+
+int network_listen_fds(struct network *net, network_fd_array_t *fds)
+{
+	return trie_apply(net->endpoints, fds_key, fds);
+}
+
+/** Endpoint visitor, see network_quiesce() */
+static int quiesce_key(trie_val_t *val, void *ext)
+{
+	endpoint_array_t *ep_array = *val;
+	for (size_t i = 0; i < ep_array->len; ++i) {
+		struct endpoint *ep = ep_array->at[i];
+		if (ep->flags & NET_XDP) {
+			continue;
+		}
+		if (ep->udp && !uv_is_closing((uv_handle_t *)ep->udp)) {
+			io_stop_read((uv_handle_t *)ep->udp);
+		}
+		if (ep->tcp) {
+			close_handle((uv_handle_t *)ep->tcp, false);
+			ep->tcp = NULL;
+		}
+	}
+	return 0;
+}
+
+void network_quiesce(struct network *net)
+{
+	trie_apply(net->endpoints, quiesce_key, NULL);
+}
+
+static size_t socket_drops(uv_handle_t *handle)
+{
+#if __linux__
+	uv_os_fd_t fd = -1;
+	uint32_t meminfo[SK_MEMINFO_VARS] = { 0 };
+	socklen_t len = sizeof(meminfo);
+	if (handle && !uv_is_closing(handle) && uv_fileno(handle, &fd) == 0
+	    && getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0
+	    && len > SK_MEMINFO_DROPS * sizeof(meminfo[0])) {
+		return meminfo[SK_MEMINFO_DROPS];
+	}
+#endif
+	return 0;
+}
+
+/** Endpoint visitor, see network_socket_drops() */
+static int drops_key(trie_val_t *val, void *ext)
+{
+	endpoint_array_t *ep_array = *val;
+	size_t *drops = ext;
+	for (size_t i = 0; i < ep_array->len; ++i) {
+		*drops += socket_drops((uv_handle_t *)ep_array->at[i]->udp);
+		*drops += socket_drops((uv_handle_t *)ep_array->at[i]->tcp);
+	}
+	return 0;
+}
+
+size_t network_socket_drops(struct network *net)
+{
+	size_t drops = 0;
+	trie_apply(net->endpoints, drops_key, &drops);
+	return drops;
+}
+
 void network_new_hostname(struct network *net, struct engine *engine)
 {
 	if (net->tls_credentials &&
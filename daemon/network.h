@@ -20,7 +20,7 @@
 #include <stdbool.h>
 
 #include "lib/generic/array.h"
-#include "lib/generic/map.h"
+#include "lib/generic/trie.h"
 
 struct engine;
 
@@ -29,11 +29,16 @@ enum endpoint_flag {
     NET_UDP  = 1 << 0,
     NET_TCP  = 1 << 1,
     NET_TLS  = 1 << 2,
+    NET_XDP  = 1 << 3,
+    NET_STEER = 1 << 4, /**< Steer clients to the forks by their network, see network_listen() */
+    NET_FREEBIND = 1 << 5, /**< Bind even if the address isn't configured (yet), e.g. for anycast */
+    NET_HTTPS = 1 << 6, /**< DNS over HTTPS, with NET_TLS; see daemon/http.h */
 };
 
 struct endpoint {
     uv_udp_t *udp;
     uv_tcp_t *tcp;
+    uv_poll_t *xdp; /**< AF_XDP socket, see daemon/xdp.h */
     uint16_t port;
     uint16_t flags;
 };
@@ -44,16 +49,54 @@ typedef array_t(struct endpoint*) endpoint_array_t;
 
 struct network {
 	uv_loop_t *loop;
-	map_t endpoints;
+	trie_t *endpoints; /**< endpoint_array_t* by address string */
 	struct tls_credentials *tls_credentials;
-	map_t tls_client_params;
+	trie_t *tls_client_params; /**< by kr_sockaddr_key() */
+	unsigned steer_group; /**< Sockets of the NET_STEER endpoints; 0 means one per fork */
+	int incoming_cpu; /**< SO_INCOMING_CPU of the listeners, the CPU of the fork by --cpu-affinity; -1: none */
+	bool tls_ktls; /**< Hand the encryption of sent TLS records to the kernel, see tls.c */
+	uint32_t tls_hs_offload; /**< Max. handshakes queued in the thread pool per fork; 0: in the loop */
+	uint32_t tls_hs_limit;   /**< Max. handshakes per second from a client prefix; 0: unlimited */
+	uint32_t doh_streams_max; /**< Concurrent streams of a DoH connection */
+	uint32_t doh_conns_max;   /**< DoH connections from clients per fork; 0: unlimited */
+	uint32_t tcp_conns_max;    /**< TCP/TLS connections from clients per fork; 0: unlimited */
+	uint32_t tcp_conns_client; /**< ... of them from a client prefix, see io_client_prefix(); 0: unlimited */
+	uint32_t tcp_fastopen;     /**< TFO queue of the TCP listeners; 0: off */
+	uint32_t tcp_defer_accept; /**< Seconds to wait for the data of a connection before accepting it; 0: off */
+	bool tcp_fastopen_out;     /**< TCP Fast Open to the upstreams, see io_tcp_fastopen() */
 };
 
+/** Default TFO queue of the listeners, see net.tcp_fastopen(). */
+#define NET_TCP_FASTOPEN_QUEUE 16
+
 void network_init(struct network *net, uv_loop_t *loop);
 void network_deinit(struct network *net);
 int network_listen_fd(struct network *net, int fd, bool use_tls);
+/** Listen on the address; with NET_STEER the kernel steers the clients among the sockets
+ * bound to it by SO_REUSEPORT (one per fork) by their /24 resp. /48 network (Linux 4.5+). */
 int network_listen(struct network *net, const char *addr, uint16_t port, uint32_t flags);
+int network_listen_xdp(struct network *net, const char *addr, uint16_t port,
+		       const char *ifname, uint32_t queue);
 int network_close(struct network *net, const char *addr, uint16_t port);
+/** Stop and start receiving on the UDP endpoints, to switch the I/O backend. */
+void network_udp_restart(struct network *net);
+/** Replace the listening sockets inherited from the parent by own ones of this fork,
+ * bound to the same addresses by SO_REUSEPORT; the XDP ones are kept, see --fork-late. */
+void network_reopen(struct network *net);
+/** Listening socket passed on to a new instance, see daemon/handoff.h */
+struct network_fd {
+	int fd;
+	bool tls;
+};
+typedef array_t(struct network_fd) network_fd_array_t;
+/** Collect the listening sockets that network_listen_fd() can take over,
+ * i.e. the plain and TLS ones; not the XDP and DoH ones. */
+int network_listen_fds(struct network *net, network_fd_array_t *fds);
+/** Stop receiving on the listeners, for the new instance to get the clients.
+ * The TCP listeners are closed, the UDP ones are kept for the answers in flight. */
+void network_quiesce(struct network *net);
+/** Datagrams and connections the kernel dropped on the listening sockets (Linux 4.12+). */
+size_t network_socket_drops(struct network *net);
 int network_set_tls_cert(struct network *net, const char *cert);
 int network_set_tls_key(struct network *net, const char *key);
 void network_new_hostname(struct network *net, struct engine *engine);
@@ -0,0 +1,522 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <contrib/ucw/lib.h>
+#include <contrib/wire.h>
+#include <libknot/packet/pkt.h>
+
+#include "lib/cache/api.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+#include "lib/zonecut.h"
+#include "daemon/engine.h"
+#include "daemon/prefetch.h"
+#include "daemon/worker.h"
+
+/* Defaults, until prefetch_config() */
+#define PREFETCH_RATE 100
+#define PREFETCH_QUEUE 1024
+
+/* Requests of a batch started on one loop iteration at most, and the check
+ * for the requests taking too long; see batch_tick(). */
+#define BATCH_START_MAX 64
+#define BATCH_CHECK_MS 1000
+
+/** Key of a refresh: QTYPE and QCLASS (network order), then the lowercased QNAME. */
+#define KEY_MAXLEN (2 * sizeof(uint16_t) + KNOT_DNAME_MAXLEN)
+
+/** Value in the pending trie of the queued refreshes; others have the deadline. */
+#define PENDING_QUEUED ((trie_val_t)UINTPTR_MAX)
+
+struct prefetch_item {
+	uint16_t len;
+	bool no_cache;  /**< A refresh, not a lookup by prefetch_resolve() */
+	uint8_t key[KEY_MAXLEN];
+};
+
+/** @internal A name of a batch. */
+struct batch_item {
+	struct prefetch_batch *batch;
+	uint64_t deadline;  /**< Given up then, while being resolved */
+	uint16_t len;
+	uint8_t key[KEY_MAXLEN];
+};
+
+struct prefetch_batch {
+	uv_timer_t timer;
+	struct kr_qflags options;
+	prefetch_batch_cb cb;
+	void *baton;
+	array_t(struct batch_item) items;
+	uint32_t next;         /**< The item to start next */
+	uint32_t window;
+	uint32_t *running;     /**< Indices of the items being resolved */
+	uint32_t running_len;
+	struct prefetch_batch_stats stats;
+};
+
+/** @internal The engine of this process; there's one worker per process. */
+static struct {
+	struct worker_ctx *worker;
+	uv_timer_t timer;
+	trie_t *pending;             /**< Keys of the queued and running refreshes */
+	trie_t *batch_pending;       /**< Keys of the batch items being resolved */
+	struct prefetch_item *queue; /**< Ring of queue_max items */
+	uint32_t queue_max, head;
+	unsigned interval;           /**< Of the timer, in milliseconds */
+	unsigned batch;              /**< Refreshes started on each tick */
+	unsigned infra_rate;         /**< Refreshes of the hot zone cuts queued per second */
+	unsigned infra_count;        /**< ... queued in infra_second */
+	uint64_t infra_second;
+	struct prefetch_stats stats;
+} the_prefetch;
+
+static inline const knot_dname_t *key_name(const uint8_t *key)
+{
+	return key + 2 * sizeof(uint16_t);
+}
+
+static int key_make(uint8_t *key, const knot_dname_t *name, uint16_t type, uint16_t class)
+{
+	int name_len = knot_dname_size(name);
+	if (name_len <= 0 || name_len > KNOT_DNAME_MAXLEN) {
+		return kr_error(EINVAL);
+	}
+	wire_write_u16(key, type);
+	wire_write_u16(key + sizeof(uint16_t), class);
+	memcpy(key + 2 * sizeof(uint16_t), name, name_len);
+	knot_dname_to_lower(key + 2 * sizeof(uint16_t));
+	return 2 * sizeof(uint16_t) + name_len;
+}
+
+/** The refresh is done (or given up by the resolver): allow the next one. */
+static void on_refresh_finish(struct kr_request *req)
+{
+	const knot_pkt_t *answer = req->answer;
+	uint8_t key[KEY_MAXLEN];
+	int len = answer && knot_pkt_qname(answer)
+		? key_make(key, knot_pkt_qname(answer), knot_pkt_qtype(answer),
+			   knot_pkt_qclass(answer))
+		: kr_error(EINVAL);
+	if (len > 0 && the_prefetch.pending) {
+		trie_del(the_prefetch.pending, (const char *)key, len, NULL);
+	}
+}
+
+static int request_start(const uint8_t *key, struct kr_qflags options,
+			 trace_callback_f on_finish)
+{
+	struct worker_ctx *worker = the_prefetch.worker;
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_EDNS_MAX_UDP_PAYLOAD, NULL);
+	if (!pkt) {
+		return kr_error(ENOMEM);
+	}
+	knot_pkt_put_question(pkt, key_name(key), wire_read_u16(key + sizeof(uint16_t)),
+			      wire_read_u16(key));
+	knot_wire_set_rd(pkt->wire);
+	int ret = kr_error(ENOMEM);
+	pkt->opt_rr = knot_rrset_copy(worker->engine->resolver.opt_rr, NULL);
+	if (pkt->opt_rr) {
+		if (options.DNSSEC_WANT) {
+			knot_edns_set_do(pkt->opt_rr);
+		}
+		if (options.DNSSEC_CD) {
+			knot_wire_set_cd(pkt->wire);
+		}
+		struct qr_task *task = worker_resolve_start(worker, pkt, options);
+		if (task) {
+			worker_task_request(task)->trace_finish = on_finish;
+			ret = worker_resolve_exec(task, pkt);
+		}
+	}
+	knot_rrset_free(&pkt->opt_rr, NULL);
+	knot_pkt_free(&pkt);
+	return ret;
+}
+
+static int refresh_start(const uint8_t *key, bool no_cache)
+{
+	struct kr_qflags options;
+	memset(&options, 0, sizeof(options));
+	options.NO_CACHE = no_cache;
+	return request_start(key, options, on_refresh_finish);
+}
+
+static void on_tick(uv_timer_t *timer)
+{
+	for (unsigned i = 0; i < the_prefetch.batch; ++i) {
+		if (the_prefetch.stats.queued == 0) {
+			uv_timer_stop(timer);
+			return;
+		}
+		/* A copy, the slot may be reused while starting the refresh. */
+		const struct prefetch_item item = the_prefetch.queue[the_prefetch.head];
+		the_prefetch.head = (the_prefetch.head + 1) % the_prefetch.queue_max;
+		the_prefetch.stats.queued -= 1;
+		/* Until it's finished, or it's taking too long; see prefetch_hit(). */
+		trie_val_t *val = trie_get_ins(the_prefetch.pending, (const char *)item.key, item.len);
+		if (!val) {
+			the_prefetch.stats.failed += 1;
+			continue;
+		}
+		*val = (trie_val_t)(uintptr_t)(kr_now() + KR_RESOLVE_TIME_LIMIT);
+		/* The request may finish synchronously, so don't touch *val anymore. */
+		if (refresh_start(item.key, item.no_cache) == 0) {
+			the_prefetch.stats.started += 1;
+		} else {
+			the_prefetch.stats.failed += 1;
+			trie_del(the_prefetch.pending, (const char *)item.key, item.len, NULL);
+		}
+	}
+}
+
+/** Whether the value in the pending trie is of a queued or running refresh. */
+static inline bool refresh_pending(const trie_val_t *val)
+{
+	return val && (*val == PENDING_QUEUED
+		       || (intptr_t)((uintptr_t)*val - (uintptr_t)kr_now()) > 0);
+}
+
+/** Queue a refresh unless it's already pending; the urgent ones go first. */
+static int queue_push(const uint8_t *key, int len, bool urgent)
+{
+	if (!the_prefetch.queue) {
+		return kr_error(ENOSYS);
+	}
+	trie_val_t *val = trie_get_try(the_prefetch.pending, (const char *)key, len);
+	if (refresh_pending(val)) {
+		the_prefetch.stats.duplicate += 1;
+		return kr_error(EEXIST);
+	}
+	if (the_prefetch.stats.queued >= the_prefetch.queue_max) {
+		the_prefetch.stats.dropped += 1;
+		return kr_error(ENOSPC);
+	}
+	if (!val) {
+		val = trie_get_ins(the_prefetch.pending, (const char *)key, len);
+		if (!val) {
+			the_prefetch.stats.dropped += 1;
+			return kr_error(ENOMEM);
+		}
+	}
+	*val = PENDING_QUEUED;
+	uint32_t slot;
+	if (urgent) {
+		the_prefetch.head = (the_prefetch.head + the_prefetch.queue_max - 1)
+					% the_prefetch.queue_max;
+		slot = the_prefetch.head;
+		the_prefetch.stats.resolved += 1;
+	} else {
+		slot = (the_prefetch.head + the_prefetch.stats.queued) % the_prefetch.queue_max;
+		the_prefetch.stats.scheduled += 1;
+	}
+	struct prefetch_item *it = &the_prefetch.queue[slot];
+	it->len = len;
+	it->no_cache = !urgent;
+	memcpy(it->key, key, len);
+	the_prefetch.stats.queued += 1;
+	if (urgent || !uv_is_active((uv_handle_t *)&the_prefetch.timer)) {
+		/* The urgent ones are started on the next loop iteration. */
+		uv_timer_start(&the_prefetch.timer, on_tick,
+			       urgent ? 0 : the_prefetch.interval, the_prefetch.interval);
+	}
+	return kr_ok();
+}
+
+/** Cache callback for the expiring hot records. */
+static void prefetch_hit(const struct kr_request *req, const struct kr_query *qry)
+{
+	(void) prefetch_schedule(qry->sname, qry->stype, qry->sclass);
+}
+
+int prefetch_schedule(const knot_dname_t *name, uint16_t type, uint16_t class)
+{
+	uint8_t key[KEY_MAXLEN];
+	int len = name ? key_make(key, name, type, class) : kr_error(EINVAL);
+	return len > 0 ? queue_push(key, len, false) : len;
+}
+
+/** Zone cut callback for the expiring records of the hot cuts. */
+static void infra_refresh(const knot_dname_t *name, uint16_t type)
+{
+	const uint64_t second = kr_now() / 1000;
+	if (second != the_prefetch.infra_second) {
+		the_prefetch.infra_second = second;
+		the_prefetch.infra_count = 0;
+	}
+	if (the_prefetch.infra_count >= the_prefetch.infra_rate) {
+		the_prefetch.stats.infra_limited += 1;
+		return;
+	}
+	if (prefetch_schedule(name, type, KNOT_CLASS_IN) == 0) {
+		the_prefetch.infra_count += 1;
+		the_prefetch.stats.infra += 1;
+	}
+}
+
+int prefetch_resolve(const knot_dname_t *name, uint16_t type, uint16_t class)
+{
+	uint8_t key[KEY_MAXLEN];
+	int len = name ? key_make(key, name, type, class) : kr_error(EINVAL);
+	return len > 0 ? queue_push(key, len, true) : len;
+}
+
+static void batch_tick(uv_timer_t *timer);
+
+/** @internal The item is no longer being resolved. */
+static void batch_item_done(struct batch_item *it, bool ok)
+{
+	struct prefetch_batch *batch = it->batch;
+	const uint32_t idx = it - batch->items.at;
+	for (uint32_t i = 0; i < batch->running_len; ++i) {
+		if (batch->running[i] == idx) {
+			batch->running[i] = batch->running[--batch->running_len];
+			break;
+		}
+	}
+	if (ok) {
+		batch->stats.done += 1;
+	} else {
+		batch->stats.failed += 1;
+	}
+	/* Refill the window on the next loop iteration, not within the request. */
+	uv_timer_start(&batch->timer, batch_tick, 0, BATCH_CHECK_MS);
+}
+
+static void on_batch_finish(struct kr_request *req)
+{
+	const knot_pkt_t *answer = req->answer;
+	uint8_t key[KEY_MAXLEN];
+	int len = answer && knot_pkt_qname(answer)
+		? key_make(key, knot_pkt_qname(answer), knot_pkt_qtype(answer),
+			   knot_pkt_qclass(answer))
+		: kr_error(EINVAL);
+	if (len <= 0 || !the_prefetch.batch_pending) {
+		return;
+	}
+	trie_val_t it = NULL;
+	/* Not there if it's been given up already. */
+	if (trie_del(the_prefetch.batch_pending, (const char *)key, len, &it) == KNOT_EOK) {
+		batch_item_done(it, req->state == KR_STATE_DONE);
+	}
+}
+
+static void batch_free(uv_handle_t *handle)
+{
+	struct prefetch_batch *batch = handle->data;
+	array_clear(batch->items);
+	free(batch->running);
+	free(batch);
+}
+
+/** @internal Start the next requests of the batch, up to the window. */
+static void batch_tick(uv_timer_t *timer)
+{
+	struct prefetch_batch *batch = timer->data;
+	trie_t *pending = the_prefetch.batch_pending;
+	const uint64_t now = kr_now();
+	/* Give up on the ones taking too long, e.g. dropped without finishing. */
+	for (uint32_t i = 0; i < batch->running_len; ) {
+		struct batch_item *it = &batch->items.at[batch->running[i]];
+		if (it->deadline > now) {
+			++i;
+			continue;
+		}
+		trie_del(pending, (const char *)it->key, it->len, NULL);
+		batch->running[i] = batch->running[--batch->running_len];
+		batch->stats.failed += 1;
+	}
+	unsigned started = 0;
+	while (batch->running_len < batch->window && batch->next < batch->items.len
+	       && started < BATCH_START_MAX) {
+		struct batch_item *it = &batch->items.at[batch->next++];
+		const char *key = (const char *)it->key;
+		if (trie_get_try(pending, key, it->len)
+		    || refresh_pending(trie_get_try(the_prefetch.pending, key, it->len))) {
+			batch->stats.duplicate += 1;
+			continue;
+		}
+		trie_val_t *val = trie_get_ins(pending, key, it->len);
+		if (!val) {
+			batch->stats.failed += 1;
+			continue;
+		}
+		*val = it;
+		it->deadline = now + KR_RESOLVE_TIME_LIMIT;
+		batch->running[batch->running_len++] = it - batch->items.at;
+		started += 1;
+		/* The request may finish synchronously, then it's done already. */
+		if (request_start(it->key, batch->options, on_batch_finish) != 0
+		    && trie_del(pending, key, it->len, NULL) == KNOT_EOK) {
+			batch_item_done(it, false);
+		}
+	}
+	if (batch->running_len == 0 && batch->next >= batch->items.len) {
+		uv_timer_stop(timer);
+		if (batch->cb) {
+			batch->cb(&batch->stats, batch->baton);
+		}
+		uv_close((uv_handle_t *)timer, batch_free);
+	} else if (batch->running_len < batch->window && batch->next < batch->items.len) {
+		uv_timer_start(timer, batch_tick, 0, BATCH_CHECK_MS);
+	}
+}
+
+struct prefetch_batch *prefetch_batch_new(struct kr_qflags options, unsigned window,
+					  prefetch_batch_cb cb, void *baton)
+{
+	if (!the_prefetch.worker) {
+		return NULL;
+	}
+	if (window == 0) {
+		window = PREFETCH_BATCH_WINDOW;
+	}
+	struct prefetch_batch *batch = calloc(1, sizeof(*batch));
+	if (!batch) {
+		return NULL;
+	}
+	batch->running = calloc(window, sizeof(*batch->running));
+	if (!batch->running) {
+		free(batch);
+		return NULL;
+	}
+	batch->options = options;
+	batch->window = window;
+	batch->cb = cb;
+	batch->baton = baton;
+	array_init(batch->items);
+	return batch;
+}
+
+int prefetch_batch_add(struct prefetch_batch *batch, const knot_dname_t *name,
+		       uint16_t type, uint16_t class)
+{
+	if (!batch || batch->timer.data) {
+		return kr_error(EINVAL);
+	}
+	batch->stats.total += 1;
+	struct batch_item it = { .batch = batch };
+	int len = name ? key_make(it.key, name, type, class) : kr_error(EINVAL);
+	if (len > 0) {
+		it.len = len;
+		len = array_push(batch->items, it) < 0 ? kr_error(ENOMEM) : kr_ok();
+	}
+	if (len < 0) {
+		batch->stats.failed += 1;
+		return len;
+	}
+	return kr_ok();
+}
+
+int prefetch_batch_start(struct prefetch_batch *batch)
+{
+	if (!batch || batch->timer.data) {
+		return kr_error(EINVAL);
+	}
+	int ret = uv_timer_init(the_prefetch.worker->loop, &batch->timer);
+	if (ret != 0) {
+		array_clear(batch->items);
+		free(batch->running);
+		free(batch);
+		return kr_error(ret);
+	}
+	batch->timer.data = batch;
+	ret = uv_timer_start(&batch->timer, batch_tick, 0, BATCH_CHECK_MS);
+	if (ret != 0) {
+		uv_close((uv_handle_t *)&batch->timer, batch_free);
+		return kr_error(ret);
+	}
+	/* Don't keep the loop alive just for this. */
+	uv_unref((uv_handle_t *)&batch->timer);
+	return kr_ok();
+}
+
+/** Empty the queue and set it up anew. */
+static int queue_setup(unsigned rate, unsigned queue_max)
+{
+	uv_timer_stop(&the_prefetch.timer);
+	trie_clear(the_prefetch.pending);
+	free(the_prefetch.queue);
+	the_prefetch.queue = malloc(sizeof(*the_prefetch.queue) * queue_max);
+	the_prefetch.queue_max = the_prefetch.queue ? queue_max : 0;
+	the_prefetch.head = 0;
+	the_prefetch.stats.queued = 0;
+	the_prefetch.interval = MAX(1000 / rate, 1);
+	the_prefetch.batch = MAX(rate / 1000, 1);
+	return the_prefetch.queue ? kr_ok() : kr_error(ENOMEM);
+}
+
+int prefetch_init(struct worker_ctx *worker)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	memset(&the_prefetch, 0, sizeof(the_prefetch));
+	the_prefetch.pending = trie_create(NULL);
+	the_prefetch.batch_pending = trie_create(NULL);
+	int ret = the_prefetch.pending && the_prefetch.batch_pending
+		? uv_timer_init(worker->loop, &the_prefetch.timer) : kr_error(ENOMEM);
+	if (ret != 0) {
+		trie_free(the_prefetch.pending);
+		the_prefetch.pending = NULL;
+		trie_free(the_prefetch.batch_pending);
+		the_prefetch.batch_pending = NULL;
+		return ret;
+	}
+	/* Don't keep the loop alive just for this. */
+	uv_unref((uv_handle_t *)&the_prefetch.timer);
+	the_prefetch.worker = worker;
+	worker->engine->resolver.side_query = prefetch_resolve;
+	return queue_setup(PREFETCH_RATE, PREFETCH_QUEUE);
+}
+
+int prefetch_config(unsigned percent, unsigned hot, unsigned rate, unsigned queue_max)
+{
+	if (!the_prefetch.worker) {
+		return kr_error(ENOSYS);
+	}
+	kr_cache_set_prefetch(NULL, percent, hot);
+	if (rate == 0 || queue_max == 0) {
+		/* Keep serving prefetch_schedule(). */
+		return queue_setup(PREFETCH_RATE, PREFETCH_QUEUE);
+	}
+	int ret = queue_setup(rate, queue_max);
+	if (ret == 0) {
+		kr_cache_set_prefetch(prefetch_hit, percent, hot);
+	}
+	return ret;
+}
+
+int prefetch_infra_config(unsigned hot, unsigned rate)
+{
+	if (!the_prefetch.worker) {
+		return kr_error(ENOSYS);
+	}
+	the_prefetch.infra_rate = rate;
+	kr_zonecut_set_refresh(rate ? infra_refresh : NULL, hot);
+	return kr_ok();
+}
+
+const struct prefetch_stats *prefetch_stats(void)
+{
+	return &the_prefetch.stats;
+}
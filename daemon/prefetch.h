@@ -0,0 +1,150 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file prefetch.h
+ * @brief Background refreshes of the hot records that are about to expire.
+ *
+ * The cache reports the expiring hits of the names that are looked up often
+ * (see kr_cache_set_prefetch()), each of them is queued once and the queue is
+ * drained by a timer at a limited rate, so the refreshes are spread over time
+ * instead of coming in bursts.  A name that's queued or being refreshed isn't
+ * queued again.  The refreshes are resolved like any other request,
+ * with the NO_CACHE flag.
+ *
+ * The infrastructure records of the zone cuts used often (NS, DS, DNSKEY and
+ * the nameserver addresses) are refreshed through the same queue, when the
+ * resolver finds them expiring (see kr_zonecut_set_refresh()); their rate
+ * is limited on its own, so that they don't take the whole queue.
+ *
+ * The same queue starts the lookups of the nameserver addresses for the
+ * resolver (kr_context::side_query), ahead of the refreshes and using the cache.
+ *
+ * Batches (prefetch_batch_new()) resolve many names for the background jobs,
+ * e.g. warming the cache; only a window of each batch is resolved at a time
+ * and the names being resolved by another batch or refreshed are skipped.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <libknot/dname.h>
+
+#include "lib/defines.h"
+#include "lib/rplan.h"
+
+struct worker_ctx;
+struct prefetch_batch;
+
+/** Counters of the refreshes (in this process). */
+struct prefetch_stats {
+	uint64_t scheduled;  /**< Queued for a refresh */
+	uint64_t duplicate;  /**< Not queued, queued or being refreshed already */
+	uint64_t dropped;    /**< Not queued, the queue was full */
+	uint64_t started;    /**< Refreshes started */
+	uint64_t failed;     /**< Refreshes that couldn't be started */
+	uint64_t queued;     /**< Refreshes waiting in the queue now */
+	uint64_t resolved;   /**< Queued by prefetch_resolve() */
+	uint64_t infra;      /**< Queued refreshes of the records of hot zone cuts */
+	uint64_t infra_limited; /**< Not queued, over the rate of those */
+};
+
+/**
+ * Prepare the engine for the worker.
+ * The expiring records aren't refreshed until prefetch_config(),
+ * the queue serves only prefetch_schedule() with the default limits.
+ */
+int prefetch_init(struct worker_ctx *worker);
+
+/**
+ * (Re)configure the refreshes of the expiring records, start or stop them.
+ *
+ * The queue is emptied on each call.
+ * @param percent of the original TTL below which records are expiring
+ * @param hot the minimum count of lookups to refresh a record
+ * @param rate refreshes started per second at most, 0 to stop refreshing
+ *        the expiring records (and use the default limits)
+ * @param queue_max the limit of the queued refreshes
+ * @return 0 or an error code
+ */
+KR_EXPORT
+int prefetch_config(unsigned percent, unsigned hot, unsigned rate, unsigned queue_max);
+
+/**
+ * (Re)configure the refreshes of the infrastructure records of the hot zone cuts.
+ * @param hot the minimum count of lookups through the cut, see kr_zonecut_set_refresh()
+ * @param rate refreshes queued per second at most, 0 to stop them
+ * @return 0 or an error code
+ */
+KR_EXPORT
+int prefetch_infra_config(unsigned hot, unsigned rate);
+
+/**
+ * Queue a refresh of the record, e.g. of a stale one.
+ * @return 0, kr_error(EEXIST) if it's queued or being refreshed,
+ *         kr_error(ENOSPC) if the queue is full, or another error code
+ */
+KR_EXPORT
+int prefetch_schedule(const knot_dname_t *name, uint16_t type, uint16_t class);
+
+/**
+ * Queue a lookup of the record ahead of the refreshes, it's started
+ * on the next loop iteration (not within the caller's resolution).
+ * @return the same as prefetch_schedule()
+ */
+KR_EXPORT
+int prefetch_resolve(const knot_dname_t *name, uint16_t type, uint16_t class);
+
+/** Return the counters. */
+KR_EXPORT
+const struct prefetch_stats *prefetch_stats(void);
+
+/** Default of the requests of a batch resolved at a time. */
+#define PREFETCH_BATCH_WINDOW 16
+
+/** Counters of a batch, as passed to its callback. */
+struct prefetch_batch_stats {
+	uint32_t total;      /**< Names added */
+	uint32_t done;       /**< Resolved, with any answer */
+	uint32_t failed;     /**< Failed to resolve, not started or given up */
+	uint32_t duplicate;  /**< Skipped, being resolved already */
+};
+
+/** Called once all the names of the batch are resolved; the batch is freed then. */
+typedef void (*prefetch_batch_cb)(const struct prefetch_batch_stats *stats, void *baton);
+
+/**
+ * Create a batch of requests.
+ * @param options flags of the requests
+ * @param window the requests resolved at a time, 0 for the default
+ * @return the batch or NULL; it's started by prefetch_batch_start()
+ */
+KR_EXPORT
+struct prefetch_batch *prefetch_batch_new(struct kr_qflags options, unsigned window,
+					  prefetch_batch_cb cb, void *baton);
+
+/** Add a name to the batch, before it's started; the invalid ones are counted as failed. */
+KR_EXPORT
+int prefetch_batch_add(struct prefetch_batch *batch, const knot_dname_t *name,
+		       uint16_t type, uint16_t class);
+
+/**
+ * Start resolving the batch, the first requests on the next loop iteration.
+ * The callback is called even if the batch is empty, and the batch is freed
+ * after it; on error the batch is freed right away without the callback.
+ */
+KR_EXPORT
+int prefetch_batch_start(struct prefetch_batch *batch);
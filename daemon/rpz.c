@@ -0,0 +1,771 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Index file layout, all in host byte order (it's never moved between hosts):
+ *
+ *   struct rpz_header
+ *   uint32_t name_off[names]       -- offsets of the name records, sorted by key
+ *   struct rpz_addr addrs[addrs]   -- sorted by (family, prefix, address)
+ *   struct rpz_name records        -- names_len bytes
+ *
+ * The sections start at 8-byte boundaries.  Name keys are kr_dname_lf()
+ * of the lowercased owner relative to the zone apex, so a wildcard
+ * trigger is the key of its parent followed by "*\0".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uv.h>
+#include <contrib/ucw/lib.h>
+#include <libknot/descriptor.h>
+#include <libknot/rrset.h>
+#include <zscanner/scanner.h>
+
+#include "lib/utils.h"
+#include "lib/generic/array.h"
+#include "daemon/rpz.h"
+
+#define RPZ_MAGIC "KRRPZ\0\0\1"
+#define RPZ_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+struct rpz_header {
+	char magic[8];
+	int64_t zone_mtime;  /**< Of the zone file that was compiled */
+	int64_t zone_size;
+	uint32_t names;      /**< Number of name triggers */
+	uint32_t addrs;      /**< Number of response IP triggers */
+	uint64_t names_len;  /**< Length of the name records */
+	uint8_t prefixes[2][129]; /**< Whether any trigger has [v6][prefix length] */
+};
+
+struct rpz_name {
+	uint8_t action;
+	uint8_t len;
+	uint8_t key[];
+};
+
+struct rpz_addr {
+	uint8_t v6;
+	uint8_t prefix;
+	uint8_t action;
+	uint8_t pad;
+	uint8_t addr[16];  /**< Masked to the prefix length */
+};
+
+struct rpz {
+	void *map;
+	size_t map_len;
+	const struct rpz_header *hdr;
+	const uint32_t *name_off;
+	const struct rpz_addr *addrs;
+	const uint8_t *names;
+};
+
+struct rpz_job {
+	uv_work_t work;
+	char *zone_path;
+	char *index_path;
+	int ret;
+	bool done;
+};
+
+/** State of a compilation. */
+struct rpz_build {
+	const char *path;
+	knot_dname_t apex[KNOT_DNAME_MAXLEN];
+	int apex_labels;     /**< -1 until the first record is seen */
+	uint8_t *names;      /**< struct rpz_name records in zone order */
+	size_t names_len, names_cap;
+	uint32_t names_count;
+	array_t(struct rpz_addr) addrs;
+	unsigned skipped;
+};
+
+static size_t sections(const struct rpz_header *hdr, size_t *addrs_at, size_t *names_at)
+{
+	size_t name_off_at = RPZ_ALIGN(sizeof(*hdr));
+	*addrs_at = RPZ_ALIGN(name_off_at + sizeof(uint32_t) * hdr->names);
+	*names_at = *addrs_at + sizeof(struct rpz_addr) * hdr->addrs;
+	return name_off_at;
+}
+
+static int key_cmp(const uint8_t *a, uint8_t a_len, const uint8_t *b, uint8_t b_len)
+{
+	int ret = memcmp(a, b, MIN(a_len, b_len));
+	return ret ? ret : (int)a_len - (int)b_len;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	const struct rpz_name *na = *(const struct rpz_name **)a;
+	const struct rpz_name *nb = *(const struct rpz_name **)b;
+	int ret = key_cmp(na->key, na->len, nb->key, nb->len);
+	if (ret == 0) { /* the records point into one buffer in zone order */
+		ret = (na > nb) - (na < nb);
+	}
+	return ret;
+}
+
+static int addr_cmp(const void *a, const void *b)
+{
+	const struct rpz_addr *aa = a, *ab = b;
+	if (aa->v6 != ab->v6) {
+		return (int)aa->v6 - (int)ab->v6;
+	}
+	if (aa->prefix != ab->prefix) {
+		return (int)aa->prefix - (int)ab->prefix;
+	}
+	return memcmp(aa->addr, ab->addr, sizeof(aa->addr));
+}
+
+static void addr_mask(uint8_t *addr, int prefix)
+{
+	for (int i = 0; i < 16; ++i) {
+		int bits = prefix - 8 * i;
+		if (bits <= 0) {
+			addr[i] = 0;
+		} else if (bits < 8) {
+			addr[i] &= 0xff << (8 - bits);
+		}
+	}
+}
+
+/** Return the action of a CNAME target, RPZ_NONE if unsupported. */
+static int rdata_action(const uint8_t *rdata, uint32_t len)
+{
+	static const struct {
+		const char *target;
+		uint32_t len;
+		int action;
+	} targets[] = {
+		{ "", 1, RPZ_NXDOMAIN },
+		{ "\x01*", 3, RPZ_NODATA },
+		{ "\x0c" "rpz-passthru", 14, RPZ_PASSTHRU },
+		{ "\x08" "rpz-drop", 10, RPZ_DROP },
+		{ "\x0c" "rpz-tcp-only", 14, RPZ_TCP_ONLY },
+	};
+	if (len > KNOT_DNAME_MAXLEN) {
+		return RPZ_NONE;
+	}
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	memcpy(lower, rdata, len);
+	knot_dname_to_lower(lower);
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i) {
+		if (len == targets[i].len && memcmp(lower, targets[i].target, len) == 0) {
+			return targets[i].action;
+		}
+	}
+	return RPZ_NONE;
+}
+
+static bool label_is(const uint8_t *label, const char *str)
+{
+	return *label == strlen(str) && memcmp(label + 1, str, *label) == 0;
+}
+
+static bool label_num(const uint8_t *label, int base, int max, int *val)
+{
+	char buf[8];
+	if (*label == 0 || *label >= sizeof(buf)) {
+		return false;
+	}
+	memcpy(buf, label + 1, *label);
+	buf[*label] = '\0';
+	char *end = NULL;
+	long num = strtol(buf, &end, base);
+	if (*end != '\0' || buf[0] == '-' || buf[0] == '+' || num > max) {
+		return false;
+	}
+	*val = num;
+	return true;
+}
+
+/** Parse the owner of an rpz-ip trigger: the prefix length, the reversed address, "rpz-ip".
+ * IPv6 groups are in hex, "zz" stands for the "::". */
+static int ip_trigger(const uint8_t **labels, int nlabels, struct rpz_addr *trigger)
+{
+	int n = nlabels - 2; /* labels of the address */
+	int prefix = 0;
+	if (n < 1 || !label_num(labels[0], 10, 128, &prefix)) {
+		return kr_error(EINVAL);
+	}
+	memset(trigger, 0, sizeof(*trigger));
+	trigger->prefix = prefix;
+	int octet = 0;
+	if (n == 4 && prefix <= 32 && label_num(labels[4], 10, 255, &octet)) {
+		for (int i = 0; i < 4; ++i) {
+			if (!label_num(labels[n - i], 10, 255, &octet)) {
+				return kr_error(EINVAL);
+			}
+			trigger->addr[i] = octet;
+		}
+		addr_mask(trigger->addr, prefix);
+		return kr_ok();
+	}
+	trigger->v6 = 1;
+	int groups = 0;
+	bool zz = false;
+	for (int i = n; i >= 1; --i) {
+		int group = 0;
+		if (label_is(labels[i], "zz")) {
+			int fill = 8 - (n - 1);
+			if (zz || fill < 1) {
+				return kr_error(EINVAL);
+			}
+			zz = true;
+			groups += fill; /* zeroed already */
+			continue;
+		}
+		if (groups >= 8 || *labels[i] > 4 || !label_num(labels[i], 16, 0xffff, &group)) {
+			return kr_error(EINVAL);
+		}
+		trigger->addr[2 * groups] = group >> 8;
+		trigger->addr[2 * groups + 1] = group & 0xff;
+		groups += 1;
+	}
+	if (groups != 8) {
+		return kr_error(EINVAL);
+	}
+	addr_mask(trigger->addr, prefix);
+	return kr_ok();
+}
+
+static int build_name(struct rpz_build *b, const knot_dname_t *rel, int action)
+{
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	int ret = kr_dname_lf(lf, rel, false);
+	if (ret != 0) {
+		return ret;
+	}
+	size_t rec_len = sizeof(struct rpz_name) + lf[0];
+	if (b->names_len + rec_len > b->names_cap) {
+		size_t cap = MAX(2 * b->names_cap, 4096);
+		uint8_t *names = realloc(b->names, cap);
+		if (!names) {
+			return kr_error(ENOMEM);
+		}
+		b->names = names;
+		b->names_cap = cap;
+	}
+	struct rpz_name *rec = (struct rpz_name *)(b->names + b->names_len);
+	rec->action = action;
+	rec->len = lf[0];
+	memcpy(rec->key, lf + 1, lf[0]);
+	b->names_len += rec_len;
+	b->names_count += 1;
+	return kr_ok();
+}
+
+static int build_record(struct rpz_build *b, const zs_scanner_t *s)
+{
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	memcpy(owner, s->r_owner, s->r_owner_length);
+	knot_dname_to_lower(owner);
+	int labels = knot_dname_labels(owner, NULL);
+	/* Triggers are relative to the apex, the owner of the SOA;
+	 * without the SOA first the names are taken as absolute. */
+	if (b->apex_labels < 0) {
+		b->apex_labels = 0;
+		if (s->r_type == KNOT_RRTYPE_SOA) {
+			memcpy(b->apex, owner, s->r_owner_length);
+			b->apex_labels = labels;
+			return kr_ok();
+		}
+	}
+	if (b->apex_labels > 0) {
+		if (knot_dname_is_equal(owner, b->apex)) {
+			return kr_ok(); /* NS etc. of the zone itself */
+		}
+		if (!knot_dname_in(b->apex, owner)) {
+			kr_log_error("[ rpz ] %s:%lu: owner outside of the zone, skipped\n",
+				     b->path, s->line_counter);
+			b->skipped += 1;
+			return kr_ok();
+		}
+	}
+	/* Cut the apex off, remembering where the labels start. */
+	const uint8_t *label_at[KNOT_DNAME_MAXLABELS];
+	int nlabels = labels - b->apex_labels;
+	uint8_t *label = owner;
+	for (int i = 0; i < nlabels; ++i) {
+		label_at[i] = label;
+		label += *label + 1;
+	}
+	*label = '\0';
+
+	int action = RPZ_NONE;
+	if (s->r_type == KNOT_RRTYPE_CNAME) {
+		action = rdata_action(s->r_data, s->r_data_length);
+	}
+	if (action == RPZ_NONE) {
+		kr_log_error("[ rpz ] %s:%lu: unsupported policy action, skipped\n",
+			     b->path, s->line_counter);
+		b->skipped += 1;
+		return kr_ok();
+	}
+	const uint8_t *last = nlabels > 0 ? label_at[nlabels - 1] : NULL;
+	if (last && label_is(last, "rpz-ip")) {
+		struct rpz_addr trigger;
+		if (ip_trigger(label_at, nlabels, &trigger) != 0) {
+			kr_log_error("[ rpz ] %s:%lu: invalid rpz-ip trigger, skipped\n",
+				     b->path, s->line_counter);
+			b->skipped += 1;
+			return kr_ok();
+		}
+		trigger.action = action;
+		return array_push(b->addrs, trigger) < 0 ? kr_error(ENOMEM) : kr_ok();
+	}
+	if (last && (label_is(last, "rpz-nsdname") || label_is(last, "rpz-nsip")
+		     || label_is(last, "rpz-client-ip"))) {
+		kr_log_error("[ rpz ] %s:%lu: unsupported policy trigger, skipped\n",
+			     b->path, s->line_counter);
+		b->skipped += 1;
+		return kr_ok();
+	}
+	return build_name(b, owner, action);
+}
+
+static int build_parse(struct rpz_build *b, zs_scanner_t *s)
+{
+	while (zs_parse_record(s) == 0) {
+		switch (s->state) {
+		case ZS_STATE_DATA: {
+			int ret = build_record(b, s);
+			if (ret != 0) {
+				return ret;
+			}
+			break;
+		}
+		case ZS_STATE_ERROR:
+			kr_log_error("[ rpz ] %s:%lu: parse error; code: %i ('%s')\n",
+				     b->path, s->line_counter, s->error.code,
+				     zs_strerror(s->error.code));
+			if (s->error.fatal) {
+				return kr_error(EINVAL);
+			}
+			b->skipped += 1;
+			break;
+		case ZS_STATE_INCLUDE:
+			kr_log_error("[ rpz ] %s:%lu: INCLUDE is not supported\n",
+				     b->path, s->line_counter);
+			return kr_error(ENOTSUP);
+		case ZS_STATE_EOF:
+		case ZS_STATE_STOP:
+			return kr_ok();
+		default:
+			return kr_error(EINVAL);
+		}
+	}
+	return s->state == ZS_STATE_EOF ? kr_ok() : kr_error(EINVAL);
+}
+
+/** Sort the triggers and write them; duplicates keep the first one in the zone. */
+static int build_write(struct rpz_build *b, const struct stat *zone_st, FILE *f)
+{
+	const struct rpz_name **sorted = malloc(sizeof(*sorted) * MAX(b->names_count, 1));
+	if (!sorted) {
+		return kr_error(ENOMEM);
+	}
+	size_t n = 0;
+	for (size_t at = 0; at < b->names_len; ++n) {
+		sorted[n] = (const struct rpz_name *)(b->names + at);
+		at += sizeof(struct rpz_name) + sorted[n]->len;
+	}
+	qsort(sorted, n, sizeof(*sorted), name_cmp);
+	qsort(b->addrs.at, b->addrs.len, sizeof(b->addrs.at[0]), addr_cmp);
+
+	struct rpz_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RPZ_MAGIC, sizeof(hdr.magic));
+	hdr.zone_mtime = zone_st->st_mtime;
+	hdr.zone_size = zone_st->st_size;
+	for (size_t i = 0; i < n; ++i) {
+		if (i > 0 && key_cmp(sorted[i]->key, sorted[i]->len,
+				     sorted[hdr.names - 1]->key, sorted[hdr.names - 1]->len) == 0) {
+			continue;
+		}
+		sorted[hdr.names++] = sorted[i];
+		hdr.names_len += sizeof(struct rpz_name) + sorted[i]->len;
+	}
+	for (size_t i = 0; i < b->addrs.len; ++i) {
+		if (i > 0 && addr_cmp(&b->addrs.at[i], &b->addrs.at[hdr.addrs - 1]) == 0) {
+			continue;
+		}
+		b->addrs.at[hdr.addrs] = b->addrs.at[i];
+		hdr.prefixes[b->addrs.at[i].v6][b->addrs.at[i].prefix] = 1;
+		hdr.addrs += 1;
+	}
+	if (hdr.names_len > UINT32_MAX) {
+		free(sorted);
+		return kr_error(EFBIG);
+	}
+
+	static const uint8_t zeros[8];
+	size_t addrs_at, names_at;
+	size_t at = sections(&hdr, &addrs_at, &names_at);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(zeros, at - sizeof(hdr), 1, f);
+	uint32_t off = 0;
+	for (size_t i = 0; i < hdr.names; ++i) {
+		fwrite(&off, sizeof(off), 1, f);
+		off += sizeof(struct rpz_name) + sorted[i]->len;
+	}
+	at += sizeof(off) * hdr.names;
+	fwrite(zeros, addrs_at - at, 1, f);
+	fwrite(b->addrs.at, sizeof(b->addrs.at[0]), hdr.addrs, f);
+	for (size_t i = 0; i < hdr.names; ++i) {
+		fwrite(sorted[i], sizeof(struct rpz_name) + sorted[i]->len, 1, f);
+	}
+	free(sorted);
+	kr_log_info("[ rpz ] %s: %u names, %u addresses, %u records skipped\n",
+		    b->path, hdr.names, hdr.addrs, b->skipped);
+	return ferror(f) ? kr_error(EIO) : kr_ok();
+}
+
+static int compile_locked(const char *zone_path, const char *index_path)
+{
+	/* Stat before parsing, so that changes made meanwhile get compiled later. */
+	struct stat zone_st;
+	if (stat(zone_path, &zone_st) != 0) {
+		kr_log_error("[ rpz ] %s: %s\n", zone_path, strerror(errno));
+		return kr_error(errno);
+	}
+	zs_scanner_t *s = malloc(sizeof(*s));
+	if (!s) {
+		return kr_error(ENOMEM);
+	}
+	if (zs_init(s, ".", KNOT_CLASS_IN, 3600) != 0) {
+		free(s);
+		return kr_error(ENOMEM);
+	}
+	if (zs_set_input_file(s, zone_path) != 0 ||
+	    zs_set_processing(s, NULL, NULL, NULL) != 0) {
+		kr_log_error("[ rpz ] %s: %s\n", zone_path, zs_strerror(s->error.code));
+		zs_deinit(s);
+		free(s);
+		return kr_error(EINVAL);
+	}
+	struct rpz_build b = { .path = zone_path, .apex_labels = -1 };
+	array_init(b.addrs);
+	int ret = build_parse(&b, s);
+	zs_deinit(s);
+	free(s);
+
+	char tmp_path[PATH_MAX];
+	if (ret == 0 && snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", index_path,
+				 (int)getpid()) >= sizeof(tmp_path)) {
+		ret = kr_error(ENAMETOOLONG);
+	}
+	FILE *f = NULL;
+	if (ret == 0 && !(f = fopen(tmp_path, "w"))) {
+		ret = kr_error(errno);
+	}
+	if (f) {
+		ret = build_write(&b, &zone_st, f);
+		if (fclose(f) != 0 && ret == 0) {
+			ret = kr_error(errno);
+		}
+		if (ret == 0 && rename(tmp_path, index_path) != 0) {
+			ret = kr_error(errno);
+		}
+		if (ret != 0) {
+			unlink(tmp_path);
+		}
+	}
+	if (ret != 0) {
+		kr_log_error("[ rpz ] %s: compilation failed: %s\n", zone_path, kr_strerror(ret));
+	}
+	free(b.names);
+	array_clear(b.addrs);
+	return ret;
+}
+
+/** Return true if the header isn't of an index compiled from the current zone file. */
+static bool header_stale(const struct rpz_header *hdr, const char *zone_path)
+{
+	struct stat zone_st;
+	if (stat(zone_path, &zone_st) != 0) {
+		return true;
+	}
+	return memcmp(hdr->magic, RPZ_MAGIC, sizeof(hdr->magic)) != 0
+		|| hdr->zone_mtime != zone_st.st_mtime || hdr->zone_size != zone_st.st_size;
+}
+
+static bool index_stale(const char *zone_path, const char *index_path)
+{
+	struct rpz_header hdr;
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return true;
+	}
+	ssize_t len = pread(fd, &hdr, sizeof(hdr), 0);
+	close(fd);
+	return len != sizeof(hdr) || header_stale(&hdr, zone_path);
+}
+
+bool rpz_outdated(const struct rpz *rpz, const char *zone_path)
+{
+	return !rpz || !zone_path || header_stale(rpz->hdr, zone_path);
+}
+
+int rpz_compile(const char *zone_path, const char *index_path)
+{
+	if (!zone_path || !index_path) {
+		return kr_error(EINVAL);
+	}
+	char lock_path[PATH_MAX];
+	if (snprintf(lock_path, sizeof(lock_path), "%s.lock", index_path) >= sizeof(lock_path)) {
+		return kr_error(ENAMETOOLONG);
+	}
+	int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock < 0) {
+		kr_log_error("[ rpz ] %s: %s\n", lock_path, strerror(errno));
+		return kr_error(errno);
+	}
+	/* The others wait here and then find the index fresh. */
+	int ret = flock(lock, LOCK_EX) == 0 ? kr_ok() : kr_error(errno);
+	if (ret == 0 && index_stale(zone_path, index_path)) {
+		ret = compile_locked(zone_path, index_path);
+	}
+	close(lock);
+	return ret;
+}
+
+static void job_work(uv_work_t *req)
+{
+	struct rpz_job *job = req->data;
+	job->ret = rpz_compile(job->zone_path, job->index_path);
+}
+
+static void job_done(uv_work_t *req, int status)
+{
+	struct rpz_job *job = req->data;
+	if (status != 0) {
+		job->ret = kr_error(ECANCELED);
+	}
+	job->done = true;
+}
+
+struct rpz_job *rpz_compile_async(const char *zone_path, const char *index_path)
+{
+	if (!zone_path || !index_path) {
+		return NULL;
+	}
+	struct rpz_job *job = calloc(1, sizeof(*job));
+	if (!job) {
+		return NULL;
+	}
+	job->zone_path = strdup(zone_path);
+	job->index_path = strdup(index_path);
+	job->work.data = job;
+	if (!job->zone_path || !job->index_path ||
+	    uv_queue_work(uv_default_loop(), &job->work, job_work, job_done) != 0) {
+		free(job->zone_path);
+		free(job->index_path);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+int rpz_job_poll(struct rpz_job *job)
+{
+	if (!job) {
+		return kr_error(EINVAL);
+	}
+	if (!job->done) {
+		return 1;
+	}
+	int ret = job->ret;
+	free(job->zone_path);
+	free(job->index_path);
+	free(job);
+	return ret;
+}
+
+struct rpz *rpz_open(const char *index_path)
+{
+	if (!index_path) {
+		return NULL;
+	}
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		kr_log_error("[ rpz ] %s: %s\n", index_path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	struct rpz *rpz = calloc(1, sizeof(*rpz));
+	void *map = MAP_FAILED;
+	if (rpz && fstat(fd, &st) == 0 && st.st_size >= sizeof(struct rpz_header)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd); /* the mapping stays, even after a rename over the file */
+	if (map == MAP_FAILED) {
+		kr_log_error("[ rpz ] %s: can't map the index\n", index_path);
+		free(rpz);
+		return NULL;
+	}
+	rpz->map = map;
+	rpz->map_len = st.st_size;
+	rpz->hdr = map;
+	size_t addrs_at, names_at;
+	size_t name_off_at = sections(rpz->hdr, &addrs_at, &names_at);
+	if (memcmp(rpz->hdr->magic, RPZ_MAGIC, sizeof(rpz->hdr->magic)) != 0 ||
+	    names_at > rpz->map_len || rpz->hdr->names_len != rpz->map_len - names_at) {
+		kr_log_error("[ rpz ] %s: not a valid index\n", index_path);
+		rpz_close(rpz);
+		return NULL;
+	}
+	rpz->name_off = (const uint32_t *)((const uint8_t *)map + name_off_at);
+	rpz->addrs = (const struct rpz_addr *)((const uint8_t *)map + addrs_at);
+	rpz->names = (const uint8_t *)map + names_at;
+	return rpz;
+}
+
+void rpz_close(struct rpz *rpz)
+{
+	if (rpz) {
+		munmap(rpz->map, rpz->map_len);
+		free(rpz);
+	}
+}
+
+uint32_t rpz_count(const struct rpz *rpz, bool addrs)
+{
+	if (!rpz) {
+		return 0;
+	}
+	return addrs ? rpz->hdr->addrs : rpz->hdr->names;
+}
+
+static int find_name(const struct rpz *rpz, const uint8_t *key, uint8_t len)
+{
+	uint32_t lo = 0, hi = rpz->hdr->names;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct rpz_name *rec = (const void *)(rpz->names + rpz->name_off[mid]);
+		int cmp = key_cmp(rec->key, rec->len, key, len);
+		if (cmp == 0) {
+			return rec->action;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return RPZ_NONE;
+}
+
+int rpz_match_name(const struct rpz *rpz, const knot_dname_t *name)
+{
+	if (!rpz || !name || rpz->hdr->names == 0) {
+		return RPZ_NONE;
+	}
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	memcpy(lower, name, knot_dname_size(name));
+	knot_dname_to_lower(lower);
+	if (kr_dname_lf(lf, lower, false) != 0) {
+		return RPZ_NONE;
+	}
+	int action = find_name(rpz, lf + 1, lf[0]);
+	if (action != RPZ_NONE) {
+		return action;
+	}
+	/* Wildcards of the ancestors, the closest first; the label lengths
+	 * tell where they end in the lookup format. */
+	uint8_t labels[KNOT_DNAME_MAXLABELS];
+	int nlabels = 0;
+	for (const uint8_t *label = lower; *label; label += *label + 1) {
+		labels[nlabels++] = *label;
+	}
+	uint8_t key_len = lf[0];
+	uint8_t key[KNOT_DNAME_MAXLEN + 2];
+	for (int k = 0; k < nlabels; ++k) {
+		key_len -= labels[k] + 1;
+		memcpy(key, lf + 1, key_len);
+		key[key_len] = '*';
+		key[key_len + 1] = '\0';
+		action = find_name(rpz, key, key_len + 2);
+		if (action != RPZ_NONE) {
+			return action;
+		}
+	}
+	return RPZ_NONE;
+}
+
+int rpz_match_addr(const struct rpz *rpz, int family, const uint8_t *addr)
+{
+	if (!rpz || !addr || rpz->hdr->addrs == 0) {
+		return RPZ_NONE;
+	}
+	struct rpz_addr key;
+	memset(&key, 0, sizeof(key));
+	key.v6 = family == AF_INET6;
+	const int max_prefix = key.v6 ? 128 : 32;
+	for (int prefix = max_prefix; prefix >= 0; --prefix) {
+		if (!rpz->hdr->prefixes[key.v6][prefix]) {
+			continue;
+		}
+		key.prefix = prefix;
+		memcpy(key.addr, addr, max_prefix / 8);
+		addr_mask(key.addr, prefix);
+		const struct rpz_addr *found = bsearch(&key, rpz->addrs, rpz->hdr->addrs,
+						       sizeof(key), addr_cmp);
+		if (found) {
+			return found->action;
+		}
+	}
+	return RPZ_NONE;
+}
+
+int rpz_match_answer(const struct rpz *rpz, const knot_pkt_t *pkt)
+{
+	if (!rpz || !pkt || rpz->hdr->addrs == 0) {
+		return RPZ_NONE;
+	}
+	const knot_pktsection_t *an = knot_pkt_section(pkt, KNOT_ANSWER);
+	for (uint16_t i = 0; i < an->count; ++i) {
+		const knot_rrset_t *rr = knot_pkt_rr(an, i);
+		int family = rr->type == KNOT_RRTYPE_A ? AF_INET
+			   : rr->type == KNOT_RRTYPE_AAAA ? AF_INET6 : AF_UNSPEC;
+		if (family == AF_UNSPEC) {
+			continue;
+		}
+		for (uint16_t j = 0; j < rr->rrs.rr_count; ++j) {
+			const knot_rdata_t *rdata = knot_rdataset_at(&rr->rrs, j);
+			if (knot_rdata_rdlen(rdata) != (family == AF_INET ? 4 : 16)) {
+				continue;
+			}
+			int action = rpz_match_addr(rpz, family, knot_rdata_data(rdata));
+			if (action != RPZ_NONE) {
+				return action;
+			}
+		}
+	}
+	return RPZ_NONE;
+}
@@ -0,0 +1,118 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file rpz.h
+ * @brief Response policy zones compiled into an index file.
+ *
+ * The zone is parsed once into a file of sorted triggers, which is then
+ * mmap()ed read-only, so all the forks share the same pages and a lookup
+ * is a binary search.  An opened index never changes; a reload compiles
+ * a new file (renamed over the old one) and opens it, while the queries
+ * in flight keep using the old mapping until it's closed.
+ *
+ * Supported triggers are QNAME (including wildcards) and response IP
+ * (``rpz-ip``), the actions are the CNAME ones: ``.``, ``*.``,
+ * ``rpz-passthru.``, ``rpz-drop.`` and ``rpz-tcp-only.``.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <libknot/packet/pkt.h>
+
+#include "lib/defines.h"
+
+/** Action of a matched trigger; zero means no match. */
+enum rpz_action {
+	RPZ_NONE = 0,
+	RPZ_NXDOMAIN,   /**< CNAME . */
+	RPZ_NODATA,     /**< CNAME *. */
+	RPZ_PASSTHRU,   /**< CNAME rpz-passthru. */
+	RPZ_DROP,       /**< CNAME rpz-drop. */
+	RPZ_TCP_ONLY,   /**< CNAME rpz-tcp-only. */
+};
+
+/** Opened index (opaque). */
+struct rpz;
+/** Compilation running in the thread pool (opaque). */
+struct rpz_job;
+
+/**
+ * Compile the zone into the index file, unless it's up to date already.
+ *
+ * The file is written aside and renamed, so the opened indexes are never
+ * affected.  Concurrent compilations of the same index (e.g. by several
+ * forks) are serialized through a lock file and only the first one works.
+ * @param zone_path RPZ in zone file format
+ * @param index_path index file to create
+ * @return 0 or an error code; records with unsupported triggers
+ *         or actions are skipped with a warning
+ */
+KR_EXPORT
+int rpz_compile(const char *zone_path, const char *index_path);
+
+/** Return true if the opened index isn't compiled from the current zone file. */
+KR_EXPORT
+bool rpz_outdated(const struct rpz *rpz, const char *zone_path);
+
+/**
+ * Start rpz_compile() in the thread pool of the default loop.
+ * @return job to rpz_job_poll() or NULL
+ */
+KR_EXPORT
+struct rpz_job *rpz_compile_async(const char *zone_path, const char *index_path);
+
+/**
+ * Check the job, free it when it's done.
+ * @return 1 while it's running, otherwise the rpz_compile() result
+ */
+KR_EXPORT
+int rpz_job_poll(struct rpz_job *job);
+
+/** Map the index file, return NULL on error (logged). */
+KR_EXPORT
+struct rpz *rpz_open(const char *index_path);
+
+/** Unmap the index. */
+KR_EXPORT
+void rpz_close(struct rpz *rpz);
+
+/** Return the number of name and response IP triggers. */
+KR_EXPORT
+uint32_t rpz_count(const struct rpz *rpz, bool addrs);
+
+/**
+ * Match the name against the QNAME triggers.
+ * An exact trigger wins, then the wildcard of the closest ancestor.
+ * @return enum rpz_action
+ */
+KR_EXPORT
+int rpz_match_name(const struct rpz *rpz, const knot_dname_t *name);
+
+/**
+ * Match an address against the response IP triggers, the longest prefix wins.
+ * @param family AF_INET or AF_INET6
+ * @param addr 4 or 16 bytes in network order
+ * @return enum rpz_action
+ */
+KR_EXPORT
+int rpz_match_addr(const struct rpz *rpz, int family, const uint8_t *addr);
+
+/** Match the A and AAAA records in the answer section, the first hit wins.
+ * @return enum rpz_action */
+KR_EXPORT
+int rpz_match_answer(const struct rpz *rpz, const knot_pkt_t *pkt);
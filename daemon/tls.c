@@ -33,8 +33,29 @@
 #include "contrib/base64.h"
 #include "daemon/worker.h"
 #include "daemon/tls.h"
+#include "daemon/http.h"
 #include "daemon/io.h"
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#endif
+/* Kernel TLS needs Linux 4.13+ headers (AES-256 5.1+) and gnutls_record_get_state(). */
+#if defined(TLS_TX) && defined(TLS_CIPHER_AES_GCM_256) && GNUTLS_VERSION_NUMBER >= 0x030600
+#define ENABLE_KTLS 1
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#else
+#define ENABLE_KTLS 0
+#endif
+
 #define EPHEMERAL_CERT_EXPIRATION_SECONDS_RENEW_BEFORE 60*60*24*7
 #define GNUTLS_PIN_MIN_VERSION  0x030400
 
@@ -50,6 +71,83 @@ static char const client_logstring[] = "tls_client";
 
 static int client_verify_certificate(gnutls_session_t tls_session);
 
+/** Server session tickets (RFC 5077).  The keys are derived from a random
+ * secret and the current period, so all forks (which inherit the secret)
+ * issue and accept the same tickets, without any communication. */
+#define TICKET_SECRET_LEN 32
+static struct {
+	bool ready;
+	uint8_t secret[TICKET_SECRET_LEN];
+	uint64_t period;     /**< Period the key was derived for. */
+	gnutls_datum_t key;  /**< Its size follows the gnutls version. */
+} ticket;
+
+int tls_session_ticket_init(void)
+{
+	int err = gnutls_rnd(GNUTLS_RND_KEY, ticket.secret, sizeof(ticket.secret));
+	ticket.ready = (err == GNUTLS_E_SUCCESS);
+	return ticket.ready ? kr_ok() : kr_error(EIO);
+}
+
+/** Get the ticket key for now, or NULL if tickets aren't available. */
+static const gnutls_datum_t *ticket_key_get(void)
+{
+	if (!ticket.ready) {
+		return NULL;
+	}
+	const uint64_t period = time(NULL) / TLS_SESSION_TICKET_ROTATE;
+	if (ticket.key.data && ticket.period == period) {
+		return &ticket.key;
+	}
+	if (!ticket.key.data && gnutls_session_ticket_key_generate(&ticket.key) < 0) {
+		ticket.ready = false;
+		return NULL;
+	}
+	/* key = SHA-512(secret | period | counter) | ..., as long as needed */
+	for (size_t off = 0, counter = 0; off < ticket.key.size; ++counter) {
+		uint8_t in[TICKET_SECRET_LEN + 2 * sizeof(uint64_t)];
+		const uint64_t c = counter;
+		memcpy(in, ticket.secret, TICKET_SECRET_LEN);
+		memcpy(in + TICKET_SECRET_LEN, &period, sizeof(period));
+		memcpy(in + TICKET_SECRET_LEN + sizeof(period), &c, sizeof(c));
+		uint8_t out[64];
+		if (gnutls_hash_fast(GNUTLS_DIG_SHA512, in, sizeof(in), out) < 0) {
+			ticket.ready = false;
+			return NULL;
+		}
+		const size_t len = MIN(sizeof(out), ticket.key.size - off);
+		memcpy(ticket.key.data + off, out, len);
+		off += len;
+	}
+	ticket.period = period;
+	return &ticket.key;
+}
+
+/** Remember the session the handshake established, for the next connection
+ * to the same upstream; see tls_client_connect_start(). */
+static void client_session_save(struct tls_client_ctx_t *ctx)
+{
+	struct worker_ctx *worker = ctx->c.worker;
+	if (gnutls_session_is_resumed(ctx->c.tls_session)) {
+		if (worker) {
+			worker->stats.tls_resumed += 1;
+		}
+	}
+	/* The entry is shared by all connections to the upstream;
+	 * nothing but the session data is ever changed through it. */
+	struct tls_client_paramlist_entry *entry =
+		(struct tls_client_paramlist_entry *)ctx->params;
+	gnutls_datum_t data = { NULL, 0 };
+	if (!entry || gnutls_session_get_data2(ctx->c.tls_session, &data) < 0) {
+		return;
+	}
+	gnutls_free(entry->session_data.data);
+	entry->session_data = data;
+}
+
+/** Priorities shared by all the sessions, parsed on first use. */
+static gnutls_priority_t priority_cache;
+
 /**
  * Set mandatory security settings from
  * https://tools.ietf.org/html/draft-ietf-dprive-dtls-and-tls-profiles-11#section-9
@@ -60,13 +158,17 @@ static int kres_gnutls_set_priority(gnutls_session_t session) {
 		"NORMAL:" /* GnuTLS defaults */
 		"-VERS-TLS1.0:-VERS-TLS1.1:" /* TLS 1.2 and higher */
 		"-COMP-ALL:+COMP-NULL"; /* no compression*/
-	const char *errpos = NULL;
-	int err = gnutls_priority_set_direct(session, priorities, &errpos);
-	if (err != GNUTLS_E_SUCCESS) {
-		kr_log_error("[tls] setting priority '%s' failed at character %zd (...'%s') with %s (%d)\n",
-			     priorities, errpos - priorities, errpos, gnutls_strerror_name(err), err);
+	if (!priority_cache) {
+		const char *errpos = NULL;
+		int err = gnutls_priority_init(&priority_cache, priorities, &errpos);
+		if (err != GNUTLS_E_SUCCESS) {
+			kr_log_error("[tls] setting priority '%s' failed at character %zd (...'%s') with %s (%d)\n",
+				     priorities, errpos - priorities, errpos, gnutls_strerror_name(err), err);
+			priority_cache = NULL;
+			return err;
+		}
 	}
-	return err;
+	return gnutls_priority_set(session, priority_cache);
 }
 
 static ssize_t kres_gnutls_pull(gnutls_transport_ptr_t h, void *buf, size_t len)
@@ -127,11 +229,14 @@ struct tls_ctx_t *tls_new(struct worker_ctx *worker)
 		}
 	}
 
-	struct tls_ctx_t *tls = calloc(1, sizeof(struct tls_ctx_t));
+	struct tls_ctx_t *tls = obj_cache_borrow(&worker->pool_tls);
 	if (tls == NULL) {
 		kr_log_error("[tls] failed to allocate TLS context\n");
 		return NULL;
 	}
+	memset(tls, 0, sizeof(*tls));
+	tls->c.worker = worker;
+	worker->stats.tls_conns += 1;
 
 	int err = gnutls_init(&tls->c.tls_session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
 	if (err != GNUTLS_E_SUCCESS) {
@@ -151,8 +256,16 @@ struct tls_ctx_t *tls_new(struct worker_ctx *worker)
 		tls_free(tls);
 		return NULL;
 	}
+	const gnutls_datum_t *ticket_key = ticket_key_get();
+	if (ticket_key) {
+		err = gnutls_session_ticket_enable_server(tls->c.tls_session, ticket_key);
+		if (err != GNUTLS_E_SUCCESS) {
+			/* Not fatal, the clients just can't resume. */
+			kr_log_verbose("[tls] gnutls_session_ticket_enable_server(): %s (%d)\n",
+				       gnutls_strerror_name(err), err);
+		}
+	}
 
-	tls->c.worker = worker;
 	tls->c.client_side = false;
 
 	gnutls_transport_set_pull_function(tls->c.tls_session, kres_gnutls_pull);
@@ -161,6 +274,83 @@ struct tls_ctx_t *tls_new(struct worker_ctx *worker)
 	return tls;
 }
 
+static struct tls_common_ctx *session_tls_ctx(uv_handle_t *handle)
+{
+	struct session *session = handle->data;
+	struct tls_common_ctx *tls_ctx = session->outgoing ? &session->tls_client_ctx->c :
+							     &session->tls_ctx->c;
+	assert (tls_ctx);
+	assert (session->outgoing == tls_ctx->client_side);
+	return tls_ctx;
+}
+
+#if ENABLE_KTLS
+/** Fill the kernel's crypto_info of an AES-GCM cipher from the GnuTLS write state. */
+#define KTLS_INFO_FILL(ci, NAME, version, key, iv, seq) do { \
+	(ci).info.version = (version) == GNUTLS_TLS1_2 ? TLS_1_2_VERSION : TLS_1_3_VERSION; \
+	(ci).info.cipher_type = NAME; \
+	ok = (key).size == NAME##_KEY_SIZE && (iv).size >= NAME##_SALT_SIZE \
+		&& ((version) == GNUTLS_TLS1_2 \
+		    || (iv).size == NAME##_SALT_SIZE + NAME##_IV_SIZE); \
+	if (ok) { \
+		memcpy((ci).key, (key).data, NAME##_KEY_SIZE); \
+		memcpy((ci).salt, (iv).data, NAME##_SALT_SIZE); \
+		/* The explicit nonce of TLS 1.2 is the sequence number. */ \
+		memcpy((ci).iv, (version) == GNUTLS_TLS1_2 ? (seq) \
+			: (iv).data + NAME##_SALT_SIZE, NAME##_IV_SIZE); \
+		memcpy((ci).rec_seq, (seq), NAME##_REC_SEQ_SIZE); \
+	} \
+	} while (false)
+#endif
+
+/** Let the kernel encrypt the records sent from now on, see net.tls_ktls().
+ * Only the sending side is handed over; GnuTLS keeps decrypting what's received,
+ * as the reads of libuv can't take the non-data records (TLS 1.3 tickets, key updates).
+ * @return true if the records are now encrypted by the kernel (or by the NIC) */
+static bool ktls_tx_start(struct tls_common_ctx *ctx)
+{
+#if ENABLE_KTLS
+	gnutls_session_t tls_session = ctx->tls_session;
+	const gnutls_protocol_t version = gnutls_protocol_get_version(tls_session);
+	const gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(tls_session);
+	if (version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3) {
+		return false;
+	}
+	gnutls_datum_t key, iv;
+	unsigned char seq[8];
+	if (gnutls_record_get_state(tls_session, 0, NULL, &iv, &key, seq) != GNUTLS_E_SUCCESS) {
+		return false;
+	}
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+	} ci;
+	memset(&ci, 0, sizeof(ci));
+	socklen_t ci_len = 0;
+	bool ok = false;
+	if (cipher == GNUTLS_CIPHER_AES_128_GCM) {
+		KTLS_INFO_FILL(ci.aes128, TLS_CIPHER_AES_GCM_128, version, key, iv, seq);
+		ci_len = sizeof(ci.aes128);
+	} else if (cipher == GNUTLS_CIPHER_AES_256_GCM) {
+		KTLS_INFO_FILL(ci.aes256, TLS_CIPHER_AES_GCM_256, version, key, iv, seq);
+		ci_len = sizeof(ci.aes256);
+	}
+	uv_os_fd_t fd = -1;
+	ok = ok && uv_fileno(ctx->session->handle, &fd) == 0
+		&& setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0
+		&& setsockopt(fd, SOL_TLS, TLS_TX, &ci, ci_len) == 0;
+	gnutls_memset(&ci, 0, sizeof(ci));
+	return ok;
+#else
+	return false;
+#endif
+}
+
+bool tls_kernel_tx(uv_handle_t *handle)
+{
+	return session_tls_ctx(handle)->kernel_tx;
+}
+
 void tls_close(struct tls_common_ctx *ctx)
 {
 	if (ctx == NULL || ctx->tls_session == NULL) {
@@ -174,7 +364,10 @@ void tls_close(struct tls_common_ctx *ctx)
 			       ctx->client_side ? "tls_client" : "tls",
 			       kr_straddr(&ctx->session->peer.ip));
 		ctx->handshake_state = TLS_HS_CLOSING;
-		gnutls_bye(ctx->tls_session, GNUTLS_SHUT_RDWR);
+		/* GnuTLS can't send anymore when the kernel encrypts the records. */
+		if (!ctx->kernel_tx) {
+			gnutls_bye(ctx->tls_session, GNUTLS_SHUT_RDWR);
+		}
 	}
 }
 
@@ -183,6 +376,16 @@ void tls_free(struct tls_ctx_t *tls)
 	if (!tls) {
 		return;
 	}
+	struct tls_hs_offload *hs = tls->c.hs_offload;
+	if (hs && hs->busy) {
+		/* The thread still uses the session, finish in hs_offload_done(). */
+		hs->orphan = true;
+		return;
+	}
+	if (hs) {
+		hs_offload_free(hs);
+		tls->c.hs_offload = NULL;
+	}
 
 	if (tls->c.tls_session) {
 		/* Don't terminate TLS connection, just tear it down */
@@ -191,39 +394,17 @@ void tls_free(struct tls_ctx_t *tls)
 	}
 
 	tls_credentials_release(tls->credentials);
-	free(tls);
+	struct worker_ctx *worker = tls->c.worker;
+	worker->stats.tls_conns -= 1;
+	obj_cache_release(&worker->pool_tls, tls);
 }
 
-int tls_push(struct qr_task *task, uv_handle_t *handle, knot_pkt_t *pkt)
+/** Send the corked data as one record. */
+static int tls_uncork(struct tls_common_ctx *tls_ctx, ssize_t total)
 {
-	if (!pkt || !handle || !handle->data) {
-		return kr_error(EINVAL);
-	}
-
-	struct session *session = handle->data;
-	struct tls_common_ctx *tls_ctx = session->outgoing ? &session->tls_client_ctx->c :
-							     &session->tls_ctx->c;
-
-	assert (tls_ctx);
-	assert (session->outgoing == tls_ctx->client_side);
-
-	const uint16_t pkt_size = htons(pkt->size);
 	const char *logstring = tls_ctx->client_side ? client_logstring : server_logstring;
 	gnutls_session_t tls_session = tls_ctx->tls_session;
-
-	tls_ctx->task = task;
-
-	assert(gnutls_record_check_corked(tls_session) == 0);
-
-	gnutls_record_cork(tls_session);
 	ssize_t count = 0;
-	if ((count = gnutls_record_send(tls_session, &pkt_size, sizeof(pkt_size)) < 0) ||
-	    (count = gnutls_record_send(tls_session, pkt->wire, pkt->size) < 0)) {
-		kr_log_error("[%s] gnutls_record_send failed: %s (%zd)\n",
-			     logstring, gnutls_strerror_name(count), count);
-		return kr_error(EIO);
-	}
-
 	ssize_t submitted = 0;
 	ssize_t retries = 0;
 	do {
@@ -248,16 +429,371 @@ int tls_push(struct qr_task *task, uv_handle_t *handle, knot_pkt_t *pkt)
 				             logstring, retries);
 				return kr_error(EIO);
 			}
-		} else if (submitted != sizeof(pkt_size) + pkt->size) {
+		} else if (submitted != total) {
 			kr_log_error("[%s] gnutls_record_uncork didn't send all data(%zd of %zd)\n",
-			             logstring, submitted, sizeof(pkt_size) + pkt->size);
+			             logstring, submitted, total);
 			return kr_error(EIO);
 		}
-	} while (submitted != sizeof(pkt_size) + pkt->size);
+	} while (submitted != total);
+
+	return kr_ok();
+}
+
+/** Size of the next records sent: the first ones and those after an idle
+ * period fit into one TCP segment, so that each can be decrypted as soon
+ * as it arrives; later ones are full-size, with less overhead. */
+static size_t tls_record_size(struct tls_common_ctx *tls_ctx)
+{
+	const uint64_t now = uv_now(tls_ctx->worker->loop);
+	if (now - tls_ctx->record_time > TLS_RECORD_IDLE) {
+		tls_ctx->record_small = 0;
+	}
+	tls_ctx->record_time = now;
+	return tls_ctx->record_small < TLS_RECORD_SMALL_COUNT
+		? TLS_RECORD_SMALL : TLS_RECORD_MAX;
+}
+
+/** Send the buffers corked, i.e. in as few TLS records as possible. */
+static int tls_send_corked(struct tls_common_ctx *tls_ctx, const uv_buf_t *buf, size_t nbufs)
+{
+	const char *logstring = tls_ctx->client_side ? client_logstring : server_logstring;
+	gnutls_session_t tls_session = tls_ctx->tls_session;
+
+	assert(gnutls_record_check_corked(tls_session) == 0);
+
+	size_t record_size = tls_record_size(tls_ctx);
+	size_t corked = 0;
+	for (size_t i = 0; i < nbufs; ++i) {
+		for (size_t pos = 0; pos < buf[i].len; ) {
+			if (corked == 0) {
+				gnutls_record_cork(tls_session);
+			}
+			const size_t len = MIN(buf[i].len - pos, record_size - corked);
+			ssize_t count = gnutls_record_send(tls_session, buf[i].base + pos, len);
+			if (count < 0) {
+				kr_log_error("[%s] gnutls_record_send failed: %s (%zd)\n",
+					     logstring, gnutls_strerror_name(count), count);
+				return kr_error(EIO);
+			}
+			pos += len;
+			corked += len;
+			if (corked == record_size) {
+				int ret = tls_uncork(tls_ctx, corked);
+				if (ret) {
+					return ret;
+				}
+				tls_ctx->record_small += (record_size == TLS_RECORD_SMALL);
+				record_size = tls_record_size(tls_ctx);
+				corked = 0;
+			}
+		}
+	}
+	if (corked) {
+		tls_ctx->record_small += (record_size == TLS_RECORD_SMALL);
+		return tls_uncork(tls_ctx, corked);
+	}
+	return kr_ok();
+}
+
+int tls_push(struct qr_task *task, uv_handle_t *handle, knot_pkt_t *pkt)
+{
+	if (!pkt || !handle || !handle->data) {
+		return kr_error(EINVAL);
+	}
+
+	struct tls_common_ctx *tls_ctx = session_tls_ctx(handle);
+	const uint16_t pkt_size = htons(pkt->size);
+	const uv_buf_t buf[2] = {
+		{ (char *)&pkt_size, sizeof(pkt_size) },
+		{ (char *)pkt->wire, pkt->size }
+	};
+
+	tls_ctx->task = task;
+	return tls_send_corked(tls_ctx, buf, 2);
+}
+
+int tls_write(uv_handle_t *handle, const uv_buf_t *buf, size_t nbufs)
+{
+	if (!buf || !handle || !handle->data) {
+		return kr_error(EINVAL);
+	}
+
+	struct tls_common_ctx *tls_ctx = session_tls_ctx(handle);
+	/* The writes aren't tied to any task. */
+	tls_ctx->task = NULL;
+	return tls_send_corked(tls_ctx, buf, nbufs);
+}
+
+static void handshake_done(struct tls_common_ctx *ctx)
+{
+	struct session *session = ctx->session;
+	const char *logstring = ctx->client_side ? client_logstring : server_logstring;
+	ctx->handshake_state = TLS_HS_DONE;
+	kr_log_verbose("[%s] TLS handshake with %s has completed\n",
+		       logstring, kr_straddr(&session->peer.ip));
+	if (ctx->client_side) {
+		client_session_save((struct tls_client_ctx_t *)ctx);
+	}
+	/* DoH sends through nghttp2 and tls_write(), see http.c. */
+	if (ctx->worker->engine->net.tls_ktls && !session->http_ctx && ktls_tx_start(ctx)) {
+		ctx->kernel_tx = true;
+		kr_log_verbose("[%s] records to %s are encrypted by the kernel\n",
+			       logstring, kr_straddr(&session->peer.ip));
+	}
+	if (ctx->handshake_cb) {
+		ctx->handshake_cb(session, 0);
+	}
+}
+
+/* Server handshakes in the libuv thread pool, see net.tls_handshake_offload().
+ *
+ * Each step runs gnutls_handshake() in a thread until it needs more data
+ * from the client; meanwhile only that thread touches the GnuTLS session,
+ * it reads the data from `in` and writes the records into `out`, which
+ * are sent when the step is done.  What's read from the client during
+ * the step waits in `next` for the following one.  After the handshake
+ * the rest of the data, e.g. the first queries, is processed as if it
+ * was just read from the connection.
+ */
+
+/** Largest handshake flight accepted from a client or produced by GnuTLS. */
+#define TLS_HS_BUF_MAX (64 * 1024)
+
+struct tls_hs_buf {
+	uint8_t *data;
+	size_t len, pos, cap;
+};
+
+struct tls_hs_offload {
+	uv_work_t work;
+	struct tls_common_ctx *ctx;
+	int ret;      /**< of the last gnutls_handshake() */
+	bool busy;    /**< A step is queued or running */
+	bool orphan;  /**< tls_free() waits for the step */
+	struct tls_hs_buf in, next, out;
+};
+
+static int hs_buf_append(struct tls_hs_buf *b, const void *data, size_t len)
+{
+	if (b->len + len > TLS_HS_BUF_MAX) {
+		return kr_error(EMSGSIZE);
+	}
+	if (b->len + len > b->cap) {
+		size_t cap = MIN(MAX(b->len + len, 2 * b->cap), TLS_HS_BUF_MAX);
+		uint8_t *grown = realloc(b->data, cap);
+		if (!grown) {
+			return kr_error(ENOMEM);
+		}
+		b->data = grown;
+		b->cap = cap;
+	}
+	if (len) {
+		memcpy(b->data + b->len, data, len);
+		b->len += len;
+	}
+	return kr_ok();
+}
+
+static void hs_offload_free(struct tls_hs_offload *hs)
+{
+	free(hs->in.data);
+	free(hs->next.data);
+	free(hs->out.data);
+	free(hs);
+}
+
+static ssize_t hs_offload_pull(gnutls_transport_ptr_t h, void *buf, size_t len)
+{
+	struct tls_hs_buf *in = &((struct tls_common_ctx *)h)->hs_offload->in;
+	if (in->pos >= in->len) {
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t transfer = MIN(in->len - in->pos, len);
+	memcpy(buf, in->data + in->pos, transfer);
+	in->pos += transfer;
+	return transfer;
+}
+
+static ssize_t hs_offload_push(gnutls_transport_ptr_t h, const void *buf, size_t len)
+{
+	struct tls_hs_buf *out = &((struct tls_common_ctx *)h)->hs_offload->out;
+	if (hs_buf_append(out, buf, len) != 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return len;
+}
+
+static void hs_offload_work(uv_work_t *req)
+{
+	struct tls_hs_offload *hs = req->data;
+	do {
+		hs->ret = gnutls_handshake(hs->ctx->tls_session);
+	} while (hs->ret != GNUTLS_E_SUCCESS && hs->ret != GNUTLS_E_AGAIN
+		 && !gnutls_error_is_fatal(hs->ret));
+}
+
+static void hs_offload_done(uv_work_t *req, int status);
 
+static int hs_offload_step(struct tls_common_ctx *ctx)
+{
+	struct tls_hs_offload *hs = ctx->hs_offload;
+	struct tls_hs_buf *in = &hs->in;
+	if (in->pos > 0) {
+		memmove(in->data, in->data + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+	int ret = hs_buf_append(in, hs->next.data, hs->next.len);
+	if (ret) {
+		return ret;
+	}
+	hs->next.len = 0;
+	gnutls_transport_set_pull_function(ctx->tls_session, hs_offload_pull);
+	gnutls_transport_set_push_function(ctx->tls_session, hs_offload_push);
+	hs->work.data = hs;
+	ret = uv_queue_work(ctx->worker->loop, &hs->work, hs_offload_work, hs_offload_done);
+	if (ret) {
+		gnutls_transport_set_pull_function(ctx->tls_session, kres_gnutls_pull);
+		gnutls_transport_set_push_function(ctx->tls_session, worker_gnutls_push);
+		return ret;
+	}
+	hs->busy = true;
+	ctx->worker->stats.tls_hs_queue += 1;
+	return kr_ok();
+}
+
+static void hs_offload_written(uv_write_t *req, int status)
+{
+	free(req->data);
+	free(req);
+}
+
+/** Send the records of the step; the buffer is freed when written. */
+static int hs_offload_send(struct tls_common_ctx *ctx)
+{
+	struct tls_hs_buf *out = &ctx->hs_offload->out;
+	if (out->len == 0) {
+		return kr_ok();
+	}
+	uv_write_t *req = malloc(sizeof(*req));
+	if (!req) {
+		return kr_error(ENOMEM);
+	}
+	uv_buf_t buf = { (char *)out->data, out->len };
+	req->data = out->data;
+	int ret = uv_write(req, (uv_stream_t *)ctx->session->handle, &buf, 1, hs_offload_written);
+	if (ret) {
+		free(req);
+		return ret;
+	}
+	memset(out, 0, sizeof(*out));
 	return kr_ok();
 }
 
+static void hs_offload_done(uv_work_t *req, int status)
+{
+	struct tls_hs_offload *hs = req->data;
+	struct tls_common_ctx *ctx = hs->ctx;
+	struct worker_ctx *worker = ctx->worker;
+	hs->busy = false;
+	worker->stats.tls_hs_queue -= 1;
+	gnutls_transport_set_pull_function(ctx->tls_session, kres_gnutls_pull);
+	gnutls_transport_set_push_function(ctx->tls_session, worker_gnutls_push);
+	if (hs->orphan) {
+		tls_free((struct tls_ctx_t *)ctx);
+		return;
+	}
+	struct session *session = ctx->session;
+	if (session->closing) {
+		return;
+	}
+	int ret = status ? GNUTLS_E_INTERNAL_ERROR : hs->ret;
+	if (hs_offload_send(ctx) != 0) {
+		ret = GNUTLS_E_PUSH_ERROR;
+	}
+	if (ret == GNUTLS_E_AGAIN) {
+		if (hs->next.len == 0 || hs_offload_step(ctx) == 0) {
+			return;
+		}
+		ret = GNUTLS_E_INTERNAL_ERROR;
+	}
+	if (ret != GNUTLS_E_SUCCESS) {
+		kr_log_verbose("[%s] gnutls_handshake failed: %s (%d)\n",
+			       server_logstring, gnutls_strerror_name(ret), ret);
+		worker_session_close(session);
+		return;
+	}
+	worker->stats.tls_hs_offloaded += 1;
+	ctx->hs_offload = NULL;
+	handshake_done(ctx);
+	/* The rest of the data, as if it was read now. */
+	struct tls_hs_buf *in = &hs->in;
+	if (hs_buf_append(in, hs->next.data, hs->next.len) == 0 && in->len > in->pos) {
+		uv_buf_t buf = { (char *)in->data + in->pos, in->len - in->pos };
+		tcp_recv((uv_stream_t *)session->handle, buf.len, &buf);
+	}
+	hs_offload_free(hs);
+}
+
+/** Queue the data read during a server handshake for its next step. */
+static int hs_offload_input(struct tls_common_ctx *ctx, const uint8_t *buf, ssize_t nread)
+{
+	/* End of the stream, the handshake can't finish. */
+	if (nread == 0) {
+		return kr_error(ECONNRESET);
+	}
+	if (!ctx->hs_offload) {
+		ctx->hs_offload = calloc(1, sizeof(*ctx->hs_offload));
+		if (!ctx->hs_offload) {
+			return kr_error(ENOMEM);
+		}
+		ctx->hs_offload->ctx = ctx;
+	}
+	struct tls_hs_offload *hs = ctx->hs_offload;
+	int ret = hs_buf_append(&hs->next, buf, nread);
+	if (ret || hs->busy) {
+		return ret;
+	}
+	return hs_offload_step(ctx);
+}
+
+/** Handshakes from a client prefix (IPv4 /24, IPv6 /56) in the current second,
+ * direct-mapped; a colliding prefix starts its count anew. */
+#define TLS_HS_LIMIT_SLOTS 1024
+static struct {
+	uint64_t prefix;
+	uint64_t second;
+	uint32_t count;
+} hs_limit[TLS_HS_LIMIT_SLOTS];
+
+bool tls_handshake_admit(struct worker_ctx *worker, const struct sockaddr *addr)
+{
+	const struct network *net = &worker->engine->net;
+	if (net->tls_hs_offload && worker->stats.tls_hs_queue >= net->tls_hs_offload) {
+		worker->stats.tls_hs_refused += 1;
+		return false;
+	}
+	if (!net->tls_hs_limit) {
+		return true;
+	}
+	const uint64_t prefix = io_client_prefix(addr);
+	const uint64_t second = uv_now(worker->loop) / 1000;
+	size_t i = ((prefix * 11400714819323198485ull) >> 32) % TLS_HS_LIMIT_SLOTS;
+	if (hs_limit[i].prefix != prefix || hs_limit[i].second != second) {
+		hs_limit[i].prefix = prefix;
+		hs_limit[i].second = second;
+		hs_limit[i].count = 0;
+	}
+	if (hs_limit[i].count >= net->tls_hs_limit) {
+		worker->stats.tls_hs_refused += 1;
+		return false;
+	}
+	hs_limit[i].count += 1;
+	return true;
+}
+
 int tls_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *buf, ssize_t nread)
 {
 	struct session *session = handle->data;
@@ -276,15 +812,14 @@ int tls_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *b
 	tls_p->consumed = 0;
 
 	/* Ensure TLS handshake is performed before receiving data. */
+	if (tls_p->handshake_state == TLS_HS_IN_PROGRESS && !tls_p->client_side
+	    && (tls_p->hs_offload || worker->engine->net.tls_hs_offload)) {
+		return hs_offload_input(tls_p, buf, tls_p->nread);
+	}
 	while (tls_p->handshake_state == TLS_HS_IN_PROGRESS) {
 		int err = gnutls_handshake(tls_p->tls_session);
 		if (err == GNUTLS_E_SUCCESS) {
-			tls_p->handshake_state = TLS_HS_DONE;
-			kr_log_verbose("[%s] TLS handshake with %s has completed\n",
-				       logstring,  kr_straddr(&session->peer.ip));
-			if (tls_p->handshake_cb) {
-				tls_p->handshake_cb(tls_p->session, 0);
-			}
+			handshake_done(tls_p);
 		} else if (err == GNUTLS_E_AGAIN) {
 			return 0;
 		} else if (gnutls_error_is_fatal(err)) {
@@ -300,7 +835,10 @@ int tls_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *b
 
 	int submitted = 0;
 	while (true) {
-		ssize_t count = gnutls_record_recv(tls_p->tls_session, tls_p->recv_buf, sizeof(tls_p->recv_buf));
+		/* Decrypt into the worker buffer, worker_process_tcp() doesn't keep
+		 * any reference to it, so idle sessions don't need their own. */
+		ssize_t count = gnutls_record_recv(tls_p->tls_session, worker->tls_recv_buf,
+						   sizeof(worker->tls_recv_buf));
 		if (count == GNUTLS_E_AGAIN) {
 			break;    /* No data available */
 		} else if (count == GNUTLS_E_INTERRUPTED) {
@@ -311,7 +849,9 @@ int tls_process(struct worker_ctx *worker, uv_stream_t *handle, const uint8_t *b
 			return kr_error(EIO);
 		}
 		DEBUG_MSG("[%s] submitting %zd data to worker\n", logstring, count);
-		int ret = worker_process_tcp(worker, handle, tls_p->recv_buf, count);
+		int ret = session->http_ctx && count > 0
+			? http_process(worker, handle, worker->tls_recv_buf, count)
+			: worker_process_tcp(worker, handle, worker->tls_recv_buf, count);
 		if (ret < 0) {
 			return ret;
 		}
@@ -543,9 +1083,11 @@ void tls_credentials_free(struct tls_credentials *tls_credentials) {
 	free(tls_credentials);
 }
 
-static int client_paramlist_entry_clear(const char *k, void *v, void *baton)
+static int client_paramlist_entry_clear(trie_val_t *v, void *baton)
 {
-	struct tls_client_paramlist_entry *entry = (struct tls_client_paramlist_entry *)v;
+	struct tls_client_paramlist_entry *entry = *v;
+
+	gnutls_free(entry->session_data.data);
 
 	while (entry->ca_files.len > 0) {
 		if (entry->ca_files.at[0] != NULL) {
@@ -581,7 +1123,19 @@ static int client_paramlist_entry_clear(const char *k, void *v, void *baton)
 	return 0;
 }
 
-int tls_client_params_set(map_t *tls_client_paramlist,
+struct tls_client_paramlist_entry *tls_client_params_get(trie_t *tls_client_paramlist,
+							const struct sockaddr *addr)
+{
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int keylen = kr_sockaddr_key(key, addr);
+	if (!tls_client_paramlist || keylen < 0) {
+		return NULL;
+	}
+	trie_val_t *val = trie_get_try(tls_client_paramlist, key, keylen);
+	return val ? *val : NULL;
+}
+
+int tls_client_params_set(trie_t *tls_client_paramlist,
 			  const char *addr, uint16_t port,
 			  const char *ca_file, const char *hostname, const char *pin)
 {
@@ -589,15 +1143,21 @@ int tls_client_params_set(map_t *tls_client_paramlist,
 		return kr_error(EINVAL);
 	}
 
-	char key[INET6_ADDRSTRLEN + 6];
-	size_t keylen = sizeof(key);
-	if (kr_straddr_join(addr, port, key, &keylen) != kr_ok()) {
+	struct sockaddr *sa = kr_straddr_socket(addr, port);
+	if (!sa) {
 		kr_log_error("[tls_client] warning: '%s' is not a valid ip address, ignoring\n", addr);
 		return kr_ok();
 	}
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int keylen = kr_sockaddr_key(key, sa);
+	free(sa);
+	if (keylen < 0) {
+		return keylen;
+	}
 
 	bool is_first_entry = false;
-	struct tls_client_paramlist_entry *entry = map_get(tls_client_paramlist, key);
+	trie_val_t *val = trie_get_try(tls_client_paramlist, key, keylen);
+	struct tls_client_paramlist_entry *entry = val ? *val : NULL;
 	if (entry == NULL) {
 		entry = calloc(1, sizeof(struct tls_client_paramlist_entry));
 		if (entry == NULL) {
@@ -619,7 +1179,7 @@ int tls_client_params_set(map_t *tls_client_paramlist,
 		bool already_exists = false;
 		for (size_t i = 0; i < entry->ca_files.len; ++i) {
 			if (strcmp(entry->ca_files.at[i], ca_file) == 0) {
-				kr_log_error("[tls_client] error: ca file '%s'for address '%s' already was set, ignoring\n", ca_file, key);
+				kr_log_error("[tls_client] error: ca file '%s'for address '%s#%d' already was set, ignoring\n", ca_file, addr, port);
 				already_exists = true;
 				break;
 			}
@@ -652,7 +1212,7 @@ int tls_client_params_set(map_t *tls_client_paramlist,
 		bool already_exists = false;
 		for (size_t i = 0; i < entry->hostnames.len; ++i) {
 			if (strcmp(entry->hostnames.at[i], hostname) == 0) {
-				kr_log_error("[tls_client] error: hostname '%s' for address '%s' already was set, ignoring\n", hostname, key);
+				kr_log_error("[tls_client] error: hostname '%s' for address '%s#%d' already was set, ignoring\n", hostname, addr, port);
 				already_exists = true;
 				break;
 			}
@@ -671,7 +1231,7 @@ int tls_client_params_set(map_t *tls_client_paramlist,
 	if ((ret == kr_ok()) && pin && pin[0] != 0) {
 		for (size_t i = 0; i < entry->pins.len; ++i) {
 			if (strcmp(entry->pins.at[i], pin) == 0) {
-				kr_log_error("[tls_client] warning: pin '%s' for address '%s' already was set, ignoring\n", pin, key);
+				kr_log_error("[tls_client] warning: pin '%s' for address '%s#%d' already was set, ignoring\n", pin, addr, port);
 				return kr_ok();
 			}
 		}
@@ -685,27 +1245,30 @@ int tls_client_params_set(map_t *tls_client_paramlist,
 	}
 
 	if ((ret == kr_ok()) && is_first_entry) {
-		bool fail = (map_set(tls_client_paramlist, key, entry) != 0);
-		if (fail) {
+		val = trie_get_ins(tls_client_paramlist, key, keylen);
+		if (val) {
+			*val = entry;
+		} else {
 			ret = kr_error(ENOMEM);
 		}
 	}
 
 	if ((ret != kr_ok()) && is_first_entry) {
-		client_paramlist_entry_clear(NULL, (void *)entry, NULL);
+		trie_val_t v = entry;
+		client_paramlist_entry_clear(&v, NULL);
 	}
 
 	return ret;
 }
 
-int tls_client_params_free(map_t *tls_client_paramlist)
+int tls_client_params_free(trie_t *tls_client_paramlist)
 {
 	if (!tls_client_paramlist) {
 		return kr_error(EINVAL);
 	}
 
-	map_walk(tls_client_paramlist, client_paramlist_entry_clear, NULL);
-	map_clear(tls_client_paramlist);
+	trie_apply(tls_client_paramlist, client_paramlist_entry_clear, NULL);
+	trie_free(tls_client_paramlist);
 
 	return kr_ok();
 }
@@ -896,8 +1459,15 @@ int tls_client_connect_start(struct tls_client_ctx_t *client_ctx,
 	ctx->handshake_state = TLS_HS_IN_PROGRESS;
 	ctx->session = session;
 
+	/* Resume the last session with this upstream, saving a round trip. */
+	const gnutls_datum_t *sd = &client_ctx->params->session_data;
+	if (sd->data && gnutls_session_set_data(ctx->tls_session, sd->data, sd->size) < 0) {
+		kr_log_verbose("[tls_client] stale session data, doing a full handshake\n");
+	}
+
 	int ret = gnutls_handshake(ctx->tls_session);
 	if (ret == GNUTLS_E_SUCCESS) {
+		client_session_save(client_ctx);
 		return kr_ok();
 	} else if (gnutls_error_is_fatal(ret) != 0) {
 		kr_log_verbose("[tls_client] handshake failed (%s)\n", gnutls_strerror(ret));
@@ -21,13 +21,22 @@
 #include <libknot/packet/pkt.h>
 #include "lib/defines.h"
 #include "lib/generic/array.h"
-#include "lib/generic/map.h"
+#include "lib/generic/trie.h"
 
 #define MAX_TLS_PADDING KR_EDNS_PAYLOAD
 #define TLS_MAX_UNCORK_RETRIES 100
+/** Dynamic record sizing, see tls_send_corked(): the plaintext of the small records,
+ * which fit into a TCP segment over IPv6 with timestamps, */
+#define TLS_RECORD_SMALL 1369
+/** the number of them at the start of a connection, */
+#define TLS_RECORD_SMALL_COUNT 40
+/** and the idle time after which small ones are sent again, in milliseconds. */
+#define TLS_RECORD_IDLE 1000
+#define TLS_RECORD_MAX 16384
 
 struct tls_ctx_t;
 struct tls_client_ctx_t;
+struct tls_hs_offload;
 struct tls_credentials {
 	int count;
 	char *tls_cert;
@@ -42,6 +51,7 @@ struct tls_client_paramlist_entry {
 	array_t(const char *) hostnames;
 	array_t(const char *) pins;
 	gnutls_certificate_credentials_t credentials;
+	gnutls_datum_t session_data; /**< Last session with the upstream, for resumption. */
 };
 
 struct worker_ctx;
@@ -66,10 +76,13 @@ struct tls_common_ctx {
 	const uint8_t *buf;
 	ssize_t nread;
 	ssize_t consumed;
-	uint8_t recv_buf[4096];
 	tls_handshake_cb handshake_cb;
 	struct worker_ctx *worker;
 	struct qr_task *task;
+	bool kernel_tx; /**< The kernel encrypts the records sent, see tls_kernel_tx() */
+	struct tls_hs_offload *hs_offload; /**< The handshake runs in the thread pool, or NULL */
+	uint64_t record_time;  /**< uv_now() of the last send, see TLS_RECORD_IDLE */
+	uint32_t record_small; /**< Number of small records sent since then */
 };
 
 struct tls_ctx_t {
@@ -92,6 +105,17 @@ struct tls_client_ctx_t {
 	const struct tls_client_paramlist_entry *params;
 };
 
+/** Period of rotating the server session ticket keys, seconds. */
+#define TLS_SESSION_TICKET_ROTATE (6 * 3600)
+
+/*! Initialize the secret for server session tickets; call before forking,
+ * so that all the forks share it.  Without it no tickets are issued. */
+int tls_session_ticket_init(void);
+
+/*! Whether to accept a TLS connection from the address, or refuse it
+ * over net.tls_handshake_limit() or with the handshake queue full. */
+bool tls_handshake_admit(struct worker_ctx *worker, const struct sockaddr *addr);
+
 /*! Create an empty TLS context in query context */
 struct tls_ctx_t* tls_new(struct worker_ctx *worker);
 
@@ -104,6 +128,15 @@ void tls_free(struct tls_ctx_t* tls);
 /*! Push new data to TLS context for sending */
 int tls_push(struct qr_task *task, uv_handle_t* handle, knot_pkt_t * pkt);
 
+/*! Encrypt and send the buffers right away, in as few TLS records as possible;
+ * the data isn't referenced after return. */
+int tls_write(uv_handle_t *handle, const uv_buf_t *buf, size_t nbufs);
+
+/*! Whether the kernel encrypts what's sent over the TLS session of the handle
+ * (net.tls_ktls() after the handshake); the plain DNS messages are written
+ * to the TCP handle then, and tls_push() or tls_write() mustn't be used. */
+bool tls_kernel_tx(uv_handle_t *handle);
+
 /*! Unwrap incoming data from a TLS stream and pass them to TCP session.
  * @return the number of newly-completed requests (>=0) or an error code
  */
@@ -125,6 +158,10 @@ void tls_credentials_free(struct tls_credentials *tls_credentials);
  * https://tools.ietf.org/html/rfc7858#appendix-A */
 void tls_credentials_log_pins(struct tls_credentials *tls_credentials);
 
+/*! Load the ephemeral private key, or generate it; call before forking,
+ * so that all the forks use the same one. */
+int tls_ephemeral_key_init(void);
+
 /*! Generate new ephemeral TLS credentials. */
 struct tls_credentials * tls_get_ephemeral_credentials(struct engine *engine);
 
@@ -134,13 +171,17 @@ tls_hs_state_t tls_get_hs_state(const struct tls_common_ctx *ctx);
 /*! Set TLS handshake state. */
 int tls_set_hs_state(struct tls_common_ctx *ctx, tls_hs_state_t state);
 
+/*! Get TLS authentication parameters for given address, or NULL. */
+struct tls_client_paramlist_entry *tls_client_params_get(trie_t *tls_client_paramlist,
+							const struct sockaddr *addr);
+
 /*! Set TLS authentication parameters for given address. */
-int tls_client_params_set(map_t *tls_client_paramlist,
+int tls_client_params_set(trie_t *tls_client_paramlist,
 			  const char *addr, uint16_t port,
 			  const char *ca_file, const char *hostname, const char *pin);
 
-/*! Free TLS authentication parameters. */
-int tls_client_params_free(map_t *tls_client_paramlist);
+/*! Free TLS authentication parameters, including the trie. */
+int tls_client_params_free(trie_t *tls_client_paramlist);
 
 /*! Allocate new client TLS context */
 struct tls_client_ctx_t *tls_client_ctx_new(const struct tls_client_paramlist_entry *entry,
@@ -18,7 +18,10 @@
  * this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
@@ -31,132 +34,145 @@
 #define INVALID_HOSTNAME "dns-over-tls.invalid"
 #define EPHEMERAL_CERT_EXPIRATION_SECONDS 60*60*24*90
 
-/* This is an attempt to grab an exclusive, advisory, non-blocking
- * lock based on a filename.  At the moment it's POSIX-only, but it
- * should be abstract enough of an interface to make an implementation
- * for non-posix systems if anyone cares. */
-typedef int lock;
-static bool _lock_is_invalid(lock lock)
-{
-	return lock == -1;
-}
-/* a blocking lock on a given filename */
-static lock _lock_filename(const char *fname)
-{
-	lock lockfd = open(fname, O_RDONLY|O_CREAT, 0400);
-	if (lockfd == -1)
-		return lockfd;
-	/* this should be a non-blocking lock */
-	if (flock(lockfd, LOCK_EX | LOCK_NB) != 0) {
-		close(lockfd);
-		return -1;
-	}
-	return lockfd; /* for cleanup later */
-}
-static void _lock_unlock(lock *lock, const char *fname)
-{
-	if (lock && !_lock_is_invalid(*lock)) {
-		flock(*lock, LOCK_UN);
-		close(*lock);
-		*lock = -1;
-		unlink(fname); /* ignore errors */
-	}
-}
+/* The key is loaded or generated once before forking, by tls_ephemeral_key_init(),
+ * so all the forks present the same one without coordinating; it's stored
+ * for the next start when first used. */
+static struct {
+	gnutls_x509_privkey_t key;
+	bool stored;  /**< EPHEMERAL_PRIVKEY_FILENAME has the key */
+} ephemeral;
 
-static gnutls_x509_privkey_t get_ephemeral_privkey ()
+/* Read the key from the cache file (we assume that we've chdir'ed
+ * already, so we're just looking for the file in the cachedir). */
+static gnutls_x509_privkey_t load_ephemeral_privkey(void)
 {
 	gnutls_x509_privkey_t privkey = NULL;
-	int err;
 	gnutls_datum_t data = { .data = NULL, .size = 0 };
-	lock lock;
-	int datafd = -1;
-
-	/* Take a lock to ensure that two daemons started concurrently
-	 * with a shared cache don't both create the same privkey: */
-	lock = _lock_filename(EPHEMERAL_PRIVKEY_FILENAME ".lock");
-	if (_lock_is_invalid(lock)) {
-		kr_log_error("[tls] unable to lock lockfile " EPHEMERAL_PRIVKEY_FILENAME ".lock\n");
+	int err;
+	int datafd = open(EPHEMERAL_PRIVKEY_FILENAME, O_RDONLY);
+	if (datafd == -1) {
+		return NULL;
+	}
+	struct stat stat;
+	if (fstat(datafd, &stat)) {
+		kr_log_error("[tls] unable to stat ephemeral private key " EPHEMERAL_PRIVKEY_FILENAME "\n");
+		goto done;
+	}
+	data.data = gnutls_malloc(stat.st_size);
+	if (data.data == NULL) {
+		kr_log_error("[tls] unable to allocate memory for reading ephemeral private key\n");
+		goto done;
+	}
+	data.size = stat.st_size;
+	if (read(datafd, data.data, stat.st_size) != stat.st_size) {
+		kr_log_error("[tls] unable to read ephemeral private key\n");
 		goto done;
 	}
-	
-	if ((err = gnutls_x509_privkey_init (&privkey)) < 0) {
+	if ((err = gnutls_x509_privkey_init(&privkey)) < 0) {
 		kr_log_error("[tls] gnutls_x509_privkey_init() failed: %d (%s)\n",
 			     err, gnutls_strerror_name(err));
 		goto done;
 	}
+	if ((err = gnutls_x509_privkey_import(privkey, &data, GNUTLS_X509_FMT_PEM)) < 0) {
+		kr_log_error("[tls] gnutls_x509_privkey_import() failed: %d (%s)\n",
+			     err, gnutls_strerror_name(err));
+		gnutls_x509_privkey_deinit(privkey);
+		privkey = NULL;
+	}
+ done:
+	close(datafd);
+	gnutls_free(data.data);
+	return privkey;
+}
 
-	/* read from cache file (we assume that we've chdir'ed
-	 * already, so we're just looking for the file in the
-	 * cachedir. */
-	datafd = open(EPHEMERAL_PRIVKEY_FILENAME, O_RDONLY);
-	if (datafd != -1) {
-		struct stat stat;
-		ssize_t bytes_read;
-		if (fstat(datafd, &stat)) {
-			kr_log_error("[tls] unable to stat ephemeral private key " EPHEMERAL_PRIVKEY_FILENAME "\n");
-			goto bad_data;
-		}
-		data.data = gnutls_malloc(stat.st_size);
-		if (data.data == NULL) {
-			kr_log_error("[tls] unable to allocate memory for reading ephemeral private key\n");
-			goto bad_data;
-		}
-		data.size = stat.st_size;
-		bytes_read = read(datafd, data.data, stat.st_size);
-		if (bytes_read != stat.st_size) {
-			kr_log_error("[tls] unable to read ephemeral private key\n");
-			goto bad_data;
-		}
-		if ((err = gnutls_x509_privkey_import (privkey, &data, GNUTLS_X509_FMT_PEM)) < 0) {
-			kr_log_error("[tls] gnutls_x509_privkey_import() failed: %d (%s)\n",
-				     err, gnutls_strerror_name(err));
-			/* goto bad_data; */
-		bad_data:
-			close(datafd);
-			datafd = -1;
-		}
-		if (data.data != NULL) {
-			gnutls_free(data.data);
-			data.data = NULL;
-		}
+static gnutls_x509_privkey_t generate_ephemeral_privkey(void)
+{
+	gnutls_x509_privkey_t privkey = NULL;
+	int err;
+	if ((err = gnutls_x509_privkey_init(&privkey)) < 0) {
+		kr_log_error("[tls] gnutls_x509_privkey_init() failed: %d (%s)\n",
+			     err, gnutls_strerror_name(err));
+		return NULL;
 	}
-	if (datafd == -1) {
-		/* if loading failed, then generate ... */
 #if GNUTLS_VERSION_NUMBER >= 0x030500
-		if ((err = gnutls_x509_privkey_generate(privkey, GNUTLS_PK_ECDSA, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0)) < 0) {
+	if ((err = gnutls_x509_privkey_generate(privkey, GNUTLS_PK_ECDSA, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0)) < 0) {
 #else
-		if ((err = gnutls_x509_privkey_generate(privkey, GNUTLS_PK_RSA, gnutls_sec_param_to_pk_bits(GNUTLS_PK_RSA, GNUTLS_SEC_PARAM_MEDIUM), 0)) < 0) {
+	if ((err = gnutls_x509_privkey_generate(privkey, GNUTLS_PK_RSA, gnutls_sec_param_to_pk_bits(GNUTLS_PK_RSA, GNUTLS_SEC_PARAM_MEDIUM), 0)) < 0) {
 #endif
-			kr_log_error("[tls] gnutls_x509_privkey_init() failed: %d (%s)\n",
-				     err, gnutls_strerror_name(err));
-			gnutls_x509_privkey_deinit(privkey);
-			goto done;
-		}
-		/* ... and save */
-		kr_log_info("[tls] Stashing ephemeral private key in " EPHEMERAL_PRIVKEY_FILENAME "\n");
-		if ((err = gnutls_x509_privkey_export2(privkey, GNUTLS_X509_FMT_PEM, &data)) < 0) {
-			kr_log_error("[tls] gnutls_x509_privkey_export2() failed: %d (%s), not storing\n",
-				     err, gnutls_strerror_name(err));
-		} else {
-			datafd = open(EPHEMERAL_PRIVKEY_FILENAME, O_WRONLY|O_CREAT, 0600);
-			if (datafd == -1) {
-				kr_log_error("[tls] failed to open " EPHEMERAL_PRIVKEY_FILENAME " to store the ephemeral key\n");
-			} else {
-				ssize_t bytes_written;
-				bytes_written = write(datafd, data.data, data.size);
-				if (bytes_written != data.size)
-					kr_log_error("[tls] failed to write %d octets to " EPHEMERAL_PRIVKEY_FILENAME " (%ld written)\n",
-						     data.size, bytes_written);
-			}
-		}
+		kr_log_error("[tls] gnutls_x509_privkey_generate() failed: %d (%s)\n",
+			     err, gnutls_strerror_name(err));
+		gnutls_x509_privkey_deinit(privkey);
+		return NULL;
 	}
- done:
-	_lock_unlock(&lock, EPHEMERAL_PRIVKEY_FILENAME ".lock");
-	if (datafd != -1) {
-		close(datafd);
+	return privkey;
+}
+
+/* Write the key into a temporary file and link it into place, so that
+ * the file is complete whenever it exists and an existing one is kept. */
+static void store_ephemeral_privkey(gnutls_x509_privkey_t privkey)
+{
+	gnutls_datum_t data = { .data = NULL, .size = 0 };
+	int err;
+	if ((err = gnutls_x509_privkey_export2(privkey, GNUTLS_X509_FMT_PEM, &data)) < 0) {
+		kr_log_error("[tls] gnutls_x509_privkey_export2() failed: %d (%s), not storing\n",
+			     err, gnutls_strerror_name(err));
+		return;
 	}
-	if (data.data != NULL) {
+	char tmpname[sizeof(EPHEMERAL_PRIVKEY_FILENAME) + 16];
+	snprintf(tmpname, sizeof(tmpname), EPHEMERAL_PRIVKEY_FILENAME ".%d", (int)getpid());
+	int datafd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (datafd == -1) {
+		kr_log_error("[tls] failed to open %s to store the ephemeral key\n", tmpname);
 		gnutls_free(data.data);
+		return;
+	}
+	ssize_t bytes_written = write(datafd, data.data, data.size);
+	close(datafd);
+	if (bytes_written != data.size) {
+		kr_log_error("[tls] failed to write %d octets to %s (%zd written)\n",
+			     data.size, tmpname, bytes_written);
+	} else if (link(tmpname, EPHEMERAL_PRIVKEY_FILENAME) == 0) {
+		kr_log_info("[tls] Stashing ephemeral private key in " EPHEMERAL_PRIVKEY_FILENAME "\n");
+	} else if (errno != EEXIST) {
+		kr_log_error("[tls] failed to store the ephemeral key in " EPHEMERAL_PRIVKEY_FILENAME ": %s\n",
+			     strerror(errno));
+	}
+	unlink(tmpname);
+	gnutls_free(data.data);
+}
+
+int tls_ephemeral_key_init(void)
+{
+	if (ephemeral.key) {
+		return kr_ok();
+	}
+	ephemeral.key = load_ephemeral_privkey();
+	ephemeral.stored = (ephemeral.key != NULL);
+	if (!ephemeral.key) {
+		ephemeral.key = generate_ephemeral_privkey();
+	}
+	return ephemeral.key ? kr_ok() : kr_error(EIO);
+}
+
+/* A copy of the key, stored in EPHEMERAL_PRIVKEY_FILENAME on first use. */
+static gnutls_x509_privkey_t get_ephemeral_privkey(void)
+{
+	if (tls_ephemeral_key_init() != 0) {
+		return NULL;
+	}
+	if (!ephemeral.stored) {
+		/* Other forks may have stored it already, the file is kept then. */
+		store_ephemeral_privkey(ephemeral.key);
+		ephemeral.stored = true;
+	}
+	gnutls_x509_privkey_t privkey = NULL;
+	int err;
+	if ((err = gnutls_x509_privkey_init(&privkey)) < 0
+	    || (err = gnutls_x509_privkey_cpy(privkey, ephemeral.key)) < 0) {
+		kr_log_error("[tls] copying the ephemeral private key failed: %d (%s)\n",
+			     err, gnutls_strerror_name(err));
+		gnutls_x509_privkey_deinit(privkey);
+		return NULL;
 	}
 	return privkey;
 }
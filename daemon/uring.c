@@ -0,0 +1,379 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon/uring.h"
+#include "daemon/io.h"
+#include "daemon/worker.h"
+
+#ifdef ENABLE_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <liburing.h>
+
+#define URING_ENTRIES 1024
+/** Provided receive buffers, a power of two. */
+#define URING_BUFS 1024
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+/** Answers in flight at most, the rest is sent by sendmmsg(). */
+#define URING_SENDS 512
+
+/* The operation is in the low bits of user_data, the rest points to its struct. */
+enum {
+	OP_RECV = 1,
+	OP_SEND = 2,
+	OP_CANCEL = 3,
+	OP_MASK = 3,
+};
+
+/** A listening socket received through the ring. */
+struct uring_listen {
+	uv_udp_t *handle;  /**< NULL after uring_recv_stop() */
+	struct msghdr msg; /**< Layout of the datagrams in the buffers */
+	int fd;
+	unsigned refs;     /**< The armed recvmsg and the sends in flight */
+	bool armed;
+};
+
+struct uring_send {
+	struct msghdr msg;
+	struct iovec iov;
+	struct qr_task *task;
+	struct uring_listen *l;
+	struct uring_send *next_free;
+};
+
+struct uring_ctx {
+	uv_poll_t poll;    /**< On the ring, must be the first */
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+	struct worker_ctx *worker;
+	unsigned pending;  /**< Operations not submitted yet */
+	struct uring_send *send_free;
+	struct uring_send sends[URING_SENDS];
+};
+
+static void listen_unref(struct uring_listen *l)
+{
+	assert(l->refs > 0);
+	if (--l->refs == 0) {
+		assert(l->handle == NULL);
+		free(l);
+	}
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_ctx *ctx)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+	if (!sqe) { /* The queue is full, make room. */
+		uring_flush(ctx);
+		sqe = io_uring_get_sqe(&ctx->ring);
+	}
+	if (sqe) {
+		ctx->pending += 1;
+	}
+	return sqe;
+}
+
+static int listen_arm(struct uring_ctx *ctx, struct uring_listen *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(ctx);
+	if (!sqe) {
+		return kr_error(EBUSY);
+	}
+	io_uring_prep_recvmsg_multishot(sqe, l->fd, &l->msg, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data64(sqe, (uintptr_t)l | OP_RECV);
+	l->armed = true;
+	l->refs += 1;
+	return kr_ok();
+}
+
+static void buf_recycle(struct uring_ctx *ctx, unsigned bid)
+{
+	io_uring_buf_ring_add(ctx->br, ctx->bufs + (size_t)bid * URING_BUF_SIZE, URING_BUF_SIZE,
+			      bid, io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(ctx->br, 1);
+}
+
+static void on_recv(struct uring_ctx *ctx, struct uring_listen *l, const struct io_uring_cqe *cqe)
+{
+	struct worker_ctx *worker = ctx->worker;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint8_t *buf = ctx->bufs + (size_t)bid * URING_BUF_SIZE;
+		struct io_uring_recvmsg_out *out = NULL;
+		if (cqe->res > 0 && l->handle) {
+			out = io_uring_recvmsg_validate(buf, cqe->res, &l->msg);
+		}
+		if (out && (out->flags & MSG_TRUNC)) {
+			worker->stats.dropped += 1;
+		} else if (out && out->namelen > 0) {
+			/* The buffer is processed as libuv would do it, and reused right after. */
+			uv_buf_t ubuf = {
+				.base = io_uring_recvmsg_payload(out, &l->msg),
+				.len = io_uring_recvmsg_payload_length(out, cqe->res, &l->msg),
+			};
+			udp_recv(l->handle, ubuf.len, &ubuf, io_uring_recvmsg_name(out), 0);
+		}
+		buf_recycle(ctx, bid);
+	} else if (cqe->res == -ENOBUFS) {
+		worker->stats.uring_nobufs += 1;
+	}
+	/* Multishot ends on errors and on running out of buffers. */
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		l->armed = false;
+		if (l->handle && listen_arm(ctx, l) != 0) {
+			kr_log_error("[uring] can't receive on a listening socket anymore\n");
+		}
+		listen_unref(l);
+	}
+}
+
+static void on_sent(struct uring_ctx *ctx, struct uring_send *send, const struct io_uring_cqe *cqe)
+{
+	struct uring_listen *l = send->l;
+	worker_uring_sent(send->task, (uv_handle_t *)l->handle, cqe->res < 0 ? cqe->res : 0);
+	send->next_free = ctx->send_free;
+	ctx->send_free = send;
+	listen_unref(l);
+}
+
+static void on_ring(uv_poll_t *handle, int status, int events)
+{
+	struct uring_ctx *ctx = (struct uring_ctx *)handle;
+	if (status != 0) {
+		return;
+	}
+	struct io_uring_cqe *cqe = NULL;
+	unsigned head = 0, count = 0;
+	io_uring_for_each_cqe(&ctx->ring, head, cqe) {
+		void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+		switch (cqe->user_data & OP_MASK) {
+		case OP_RECV:
+			on_recv(ctx, ptr, cqe);
+			break;
+		case OP_SEND:
+			on_sent(ctx, ptr, cqe);
+			break;
+		default: /* cancellations */
+			break;
+		}
+		++count;
+	}
+	io_uring_cq_advance(&ctx->ring, count);
+	ctx->worker->stats.uring_cqes += count;
+}
+
+int uring_init(struct worker_ctx *worker)
+{
+	if (worker->uring) {
+		return kr_ok();
+	}
+	struct uring_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return kr_error(ENOMEM);
+	}
+	ctx->worker = worker;
+	/* Don't stop submitting at the first failed operation. */
+	struct io_uring_params params = {
+		.flags = IORING_SETUP_SUBMIT_ALL,
+	};
+	int ret = io_uring_queue_init_params(URING_ENTRIES, &ctx->ring, &params);
+	if (ret == -EINVAL) { /* older kernel */
+		memset(&params, 0, sizeof(params));
+		ret = io_uring_queue_init_params(URING_ENTRIES, &ctx->ring, &params);
+	}
+	if (ret < 0) {
+		free(ctx);
+		return ret;
+	}
+	if (posix_memalign((void **)&ctx->bufs, getpagesize(), (size_t)URING_BUFS * URING_BUF_SIZE) != 0) {
+		ctx->bufs = NULL;
+		ret = kr_error(ENOMEM);
+		goto fail;
+	}
+	ctx->br = io_uring_setup_buf_ring(&ctx->ring, URING_BUFS, URING_BGID, 0, &ret);
+	if (!ctx->br) {
+		goto fail;
+	}
+	for (unsigned i = 0; i < URING_BUFS; ++i) {
+		io_uring_buf_ring_add(ctx->br, ctx->bufs + (size_t)i * URING_BUF_SIZE, URING_BUF_SIZE,
+				      i, io_uring_buf_ring_mask(URING_BUFS), i);
+	}
+	io_uring_buf_ring_advance(ctx->br, URING_BUFS);
+	for (unsigned i = 0; i < URING_SENDS; ++i) {
+		ctx->sends[i].next_free = ctx->send_free;
+		ctx->send_free = &ctx->sends[i];
+	}
+	ret = uv_poll_init(worker->loop, &ctx->poll, ctx->ring.ring_fd);
+	if (ret != 0) {
+		goto fail;
+	}
+	uv_poll_start(&ctx->poll, UV_READABLE, on_ring);
+	worker->uring = ctx;
+	return kr_ok();
+fail:
+	if (ctx->br) {
+		io_uring_free_buf_ring(&ctx->ring, ctx->br, URING_BUFS, URING_BGID);
+	}
+	io_uring_queue_exit(&ctx->ring);
+	free(ctx->bufs);
+	free(ctx);
+	return ret;
+}
+
+void uring_deinit(struct worker_ctx *worker)
+{
+	struct uring_ctx *ctx = worker->uring;
+	if (!ctx) {
+		return;
+	}
+	/* The loop isn't running anymore, see network_deinit(). */
+	uv_poll_stop(&ctx->poll);
+	io_uring_free_buf_ring(&ctx->ring, ctx->br, URING_BUFS, URING_BGID);
+	io_uring_queue_exit(&ctx->ring);
+	free(ctx->bufs);
+	free(ctx);
+	worker->uring = NULL;
+}
+
+int uring_recv_start(struct uring_ctx *ctx, uv_udp_t *handle)
+{
+	struct session *session = handle->data;
+	if (!ctx || !session || session->outgoing) {
+		return kr_error(EINVAL);
+	}
+	if (session->uring) {
+		return kr_ok();
+	}
+	uv_os_fd_t fd = -1;
+	if (uv_fileno((uv_handle_t *)handle, &fd) != 0) {
+		return kr_error(EBADF);
+	}
+	struct uring_listen *l = calloc(1, sizeof(*l));
+	if (!l) {
+		return kr_error(ENOMEM);
+	}
+	l->handle = handle;
+	l->fd = fd;
+	l->msg.msg_namelen = sizeof(struct sockaddr_in6);
+	int ret = listen_arm(ctx, l);
+	if (ret != 0) {
+		free(l);
+		return ret;
+	}
+	session->uring = l;
+	return kr_ok();
+}
+
+void uring_recv_stop(struct uring_ctx *ctx, uv_udp_t *handle)
+{
+	struct session *session = handle->data;
+	struct uring_listen *l = session ? session->uring : NULL;
+	if (!ctx || !l) {
+		return;
+	}
+	session->uring = NULL;
+	l->handle = NULL;
+	if (l->armed) {
+		struct io_uring_sqe *sqe = get_sqe(ctx);
+		if (sqe) {
+			io_uring_prep_cancel64(sqe, (uintptr_t)l | OP_RECV, 0);
+			io_uring_sqe_set_data64(sqe, OP_CANCEL);
+		}
+		/* Before libuv closes the socket. */
+		uring_flush(ctx);
+	} else if (l->refs == 0) {
+		free(l);
+	}
+}
+
+int uring_send(struct uring_ctx *ctx, uv_udp_t *handle, const struct msghdr *msg,
+	       struct qr_task *task)
+{
+	struct session *session = handle->data;
+	struct uring_listen *l = session ? session->uring : NULL;
+	if (!ctx || !l || !ctx->send_free || msg->msg_iovlen != 1) {
+		return kr_error(ENOBUFS);
+	}
+	struct io_uring_sqe *sqe = get_sqe(ctx);
+	if (!sqe) {
+		return kr_error(ENOBUFS);
+	}
+	struct uring_send *send = ctx->send_free;
+	ctx->send_free = send->next_free;
+	send->msg = *msg;
+	send->iov = msg->msg_iov[0];
+	send->msg.msg_iov = &send->iov;
+	send->task = task;
+	send->l = l;
+	l->refs += 1;
+	io_uring_prep_sendmsg(sqe, l->fd, &send->msg, 0);
+	io_uring_sqe_set_data64(sqe, (uintptr_t)send | OP_SEND);
+	return kr_ok();
+}
+
+void uring_flush(struct uring_ctx *ctx)
+{
+	if (!ctx || ctx->pending == 0) {
+		return;
+	}
+	ctx->pending = 0;
+	int ret = io_uring_submit(&ctx->ring);
+	ctx->worker->stats.uring_enters += 1;
+	if (ret > 0) {
+		ctx->worker->stats.uring_sqes += ret;
+	}
+}
+
+#else /* ENABLE_URING */
+
+int uring_init(struct worker_ctx *worker)
+{
+	return kr_error(ENOTSUP);
+}
+
+void uring_deinit(struct worker_ctx *worker)
+{
+}
+
+int uring_recv_start(struct uring_ctx *ctx, uv_udp_t *handle)
+{
+	return kr_error(ENOTSUP);
+}
+
+void uring_recv_stop(struct uring_ctx *ctx, uv_udp_t *handle)
+{
+}
+
+int uring_send(struct uring_ctx *ctx, uv_udp_t *handle, const struct msghdr *msg,
+	       struct qr_task *task)
+{
+	return kr_error(ENOTSUP);
+}
+
+void uring_flush(struct uring_ctx *ctx)
+{
+}
+
+#endif /* ENABLE_URING */
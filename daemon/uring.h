@@ -0,0 +1,53 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file uring.h
+ *
+ * io_uring backend for the UDP listeners, selected by worker.io_backend().
+ *
+ * The listening uv_udp_t stays as it is, only libuv doesn't read it: a multishot
+ * recvmsg takes the datagrams into a ring of provided buffers, and the answers
+ * batched in worker->udp_out are submitted as one sendmsg per answer at the end
+ * of the loop turn.  The ring is polled by the libuv loop, timers, TCP and the
+ * outbound sockets stay on libuv.  Without ENABLE_URING uring_init() fails with ENOTSUP.
+ * The syscalls and operations are counted in worker->stats.uring_*.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <uv.h>
+
+struct worker_ctx;
+struct qr_task;
+struct uring_ctx;
+
+/** Create the ring of the worker, polled by its loop. */
+int uring_init(struct worker_ctx *worker);
+void uring_deinit(struct worker_ctx *worker);
+
+/** Start resp. stop receiving on a listening UDP socket. */
+int uring_recv_start(struct uring_ctx *ctx, uv_udp_t *handle);
+void uring_recv_stop(struct uring_ctx *ctx, uv_udp_t *handle);
+
+/** Queue the answer; msg is copied, what it points to must live until the completion.
+ * worker_uring_sent() is called then, with the task reference passed to it. */
+int uring_send(struct uring_ctx *ctx, uv_udp_t *handle, const struct msghdr *msg,
+	       struct qr_task *task);
+
+/** Submit the queued operations, at the end of the loop turn. */
+void uring_flush(struct uring_ctx *ctx);
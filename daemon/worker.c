@@ -18,6 +18,7 @@
 #include <lua.h>
 #include <libknot/packet/pkt.h>
 #include <libknot/descriptor.h>
+#include <ccan/json/json.h>
 #include <contrib/ucw/lib.h>
 #include <contrib/ucw/mempool.h>
 #include <contrib/wire.h>
@@ -25,16 +26,24 @@
 #include <malloc.h>
 #endif
 #include <assert.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include <gnutls/gnutls.h>
 #include "lib/utils.h"
 #include "lib/layer.h"
 #include "daemon/worker.h"
 #include "daemon/bindings.h"
 #include "daemon/engine.h"
+#include "daemon/http.h"
 #include "daemon/io.h"
 #include "daemon/tls.h"
+#include "daemon/uring.h"
+#include "daemon/xdp.h"
 #include "daemon/zimport.h"
 
 #define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "wrkr", fmt)
@@ -46,6 +55,8 @@ struct request_ctx
 	struct {
 		union inaddr addr;
 		union inaddr dst_addr;
+		struct xdp_eth eth; /**< Only for the requests over AF_XDP */
+		int32_t stream; /**< HTTP/2 stream of the query over DoH, see http_send() */
 		/* uv_handle_t *handle; */
 
 		/** NULL if the request didn't come over network. */
@@ -53,6 +64,10 @@ struct request_ctx
 	} source;
 	struct worker_ctx *worker;
 	qr_tasklist_t tasks;
+	size_t pool_size; /**< mp_total_size() of the mempool when borrowed */
+	const uint8_t *wire; /**< The query in a held slot of the receive ring, or NULL */
+	char *inflight_key; /**< Key in worker->inflight or NULL, see inflight_key() */
+	uint16_t inflight_len;
 };
 
 /** Query resolution task. */
@@ -60,6 +75,7 @@ struct qr_task
 {
 	struct request_ctx *ctx;
 	knot_pkt_t *pktbuf;
+	knot_pkt_t *pktbuf_pooled; /**< From worker->pool_pkts, pktbuf unless grown for TCP */
 	qr_tasklist_t waiting;
 	uv_handle_t *pending[MAX_PENDING];
 	uint16_t pending_count;
@@ -69,9 +85,13 @@ struct qr_task
 	uint16_t iter_count;
 	uint16_t bytes_remaining;
 	struct sockaddr *addrlist;
+	uint64_t sent_at; /**< kr_now() of the first UDP transmission */
 	uint32_t refs;
 	bool finished : 1;
 	bool leading  : 1;
+	bool hedge    : 1; /**< The first retransmit is early, see hedge_timeout() */
+	bool hedged   : 1; /**< ... and it was sent */
+	bool stale_tried : 1; /**< Stopped waiting at the stale deadline, see stale_step() */
 };
 
 
@@ -83,16 +103,15 @@ struct qr_task
 #define qr_valid_handle(task, checked) \
 	(!uv_is_closing((checked)) || (task)->ctx->source.session->handle == (checked))
 
-/** @internal get key for tcp session
- *  @note kr_straddr() return pointer to static string
- */
-#define tcpsess_key(addr) kr_straddr(addr)
-
 /* Forward decls */
 static void qr_task_free(struct qr_task *task);
 static int qr_task_step(struct qr_task *task,
 			const struct sockaddr *packet_source,
 			knot_pkt_t *packet);
+static bool stale_step(struct qr_task *task);
+static int qr_task_produce(struct qr_task *task, int state,
+			   const struct sockaddr *packet_source, knot_pkt_t *packet);
+static void udp_wave_flush(struct worker_ctx *worker);
 static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
 			struct sockaddr *addr, knot_pkt_t *pkt);
 static int qr_task_finalize(struct qr_task *task, int state);
@@ -116,11 +135,10 @@ static int session_del_waiting(struct session *session, struct qr_task *task);
 static int session_add_tasks(struct session *session, struct qr_task *task);
 static int session_del_tasks(struct session *session, struct qr_task *task);
 static void session_close(struct session *session);
-static void on_session_idle_timeout(uv_timer_t *timer);
-static int timer_start(struct session *session, uv_timer_cb cb,
-		       uint64_t timeout, uint64_t repeat);
-static void on_tcp_connect_timeout(uv_timer_t *timer);
-static void on_tcp_watchdog_timeout(uv_timer_t *timer);
+static void tcp_out_flush_early(struct worker_ctx *worker, struct session *session);
+static void on_session_idle_timeout(struct tw_timer *timer);
+static void on_tcp_connect_timeout(struct tw_timer *timer);
+static void on_tcp_watchdog_timeout(struct tw_timer *timer);
 
 /** @internal Get singleton worker. */
 static inline struct worker_ctx *get_worker(void)
@@ -130,30 +148,13 @@ static inline struct worker_ctx *get_worker(void)
 
 static inline void *iohandle_borrow(struct worker_ctx *worker)
 {
-	void *h = NULL;
-
-	const size_t size = sizeof(uv_handles_t);
-	if (worker->pool_iohandles.len > 0) {
-		h = array_tail(worker->pool_iohandles);
-		array_pop(worker->pool_iohandles);
-		kr_asan_unpoison(h, size);
-	} else {
-		h = malloc(size);
-	}
-
-	return h;
+	return obj_cache_borrow(&worker->pool_iohandles);
 }
 
 static inline void iohandle_release(struct worker_ctx *worker, void *h)
 {
 	assert(h);
-
-	if (worker->pool_iohandles.len < MP_FREELIST_SIZE) {
-		array_push(worker->pool_iohandles, h);
-		kr_asan_poison(h, sizeof(uv_handles_t));
-	} else {
-		free(h);
-	}
+	obj_cache_release(&worker->pool_iohandles, h);
 }
 
 void *worker_iohandle_borrow(struct worker_ctx *worker)
@@ -168,32 +169,56 @@ void worker_iohandle_release(struct worker_ctx *worker, void *h)
 
 static inline void *iorequest_borrow(struct worker_ctx *worker)
 {
-	void *r = NULL;
-
-	const size_t size = sizeof(uv_reqs_t);
-	if (worker->pool_ioreqs.len > 0) {
-		r = array_tail(worker->pool_ioreqs);
-		array_pop(worker->pool_ioreqs);
-		kr_asan_unpoison(r, size);
-	} else {
-		r = malloc(size);
-	}
-
-	return r;
+	return obj_cache_borrow(&worker->pool_ioreqs);
 }
 
 static inline void iorequest_release(struct worker_ctx *worker, void *r)
 {
 	assert(r);
+	obj_cache_release(&worker->pool_ioreqs, r);
+}
 
-	if (worker->pool_ioreqs.len < MP_FREELIST_SIZE) {
-		array_push(worker->pool_ioreqs, r);
-		kr_asan_poison(r, sizeof(uv_reqs_t));
-	} else {
-		free(r);
+
+/*! @internal Take an idle outgoing UDP socket, picked at random for port entropy.
+ *  @return handle or NULL if the pool is empty */
+static uv_handle_t *udp_pool_take(struct worker_ctx *worker, sa_family_t family)
+{
+	__typeof__(worker->udp_pool[0]) *pool = &worker->udp_pool[family == AF_INET6];
+	while (pool->len > 0) {
+		const uint32_t i = kr_rand_uint(pool->len);
+		uv_handle_t *handle = pool->at[i];
+		array_del(*pool, i); /* moves the last one to i */
+		struct session *session = handle->data;
+		if (!session->closing && !session->udp_stray) {
+			return handle;
+		}
+		if (!session->closing) {
+			session_close(session);
+		}
 	}
+	return NULL;
 }
 
+/*! @internal Return an outgoing UDP socket with no tasks to the pool.
+ *  @return true if pooled, false if the caller should close it */
+static bool udp_pool_put(struct worker_ctx *worker, struct session *session)
+{
+	uv_handle_t *handle = session->handle;
+	if (session->udp_stray || session->udp_uses >= UDP_REUSE_MAX) {
+		return false;
+	}
+	struct sockaddr_storage ss;
+	int addr_len = sizeof(ss);
+	if (uv_udp_getsockname((uv_udp_t *)handle, (struct sockaddr *)&ss, &addr_len) != 0) {
+		return false; /* not even bound, no use keeping it */
+	}
+	__typeof__(worker->udp_pool[0]) *pool = &worker->udp_pool[ss.ss_family == AF_INET6];
+	if (pool->len >= UDP_POOL_SIZE) {
+		return false;
+	}
+	/* Keep reading, so that late answers get dropped by now. */
+	return array_push(*pool, handle) >= 0;
+}
 
 /*! @internal Create a UDP/TCP handle for an outgoing AF_INET* connection.
  *  socktype is SOCK_* */
@@ -212,12 +237,30 @@ static uv_handle_t *ioreq_spawn(struct qr_task *task, int socktype, sa_family_t
 	}
 	/* Create connection for iterative query */
 	struct worker_ctx *worker = task->ctx->worker;
+	if (socktype == SOCK_DGRAM) {
+		uv_handle_t *handle = udp_pool_take(worker, family);
+		struct session *session = handle ? handle->data : NULL;
+		if (session && session_add_tasks(session, task) >= 0) {
+			session->udp_uses += 1;
+			worker->stats.udp_reused += 1;
+			task->pending[task->pending_count] = handle;
+			task->pending_count += 1;
+			return handle;
+		} else if (session) {
+			session_close(session);
+		}
+	}
 	void *h = iohandle_borrow(worker);
 	uv_handle_t *handle = (uv_handle_t *)h;
 	if (!handle) {
 		return NULL;
 	}
 	io_create(worker->loop, handle, socktype);
+	/* Without TFO the socket is made by the connect. */
+	if (socktype == SOCK_STREAM && worker->engine->net.tcp_fastopen_out &&
+	    io_tcp_fastopen((uv_tcp_t *)handle, family) != 0) {
+		kr_log_verbose("[work] TCP Fast Open unavailable, connecting without it\n");
+	}
 
 	/* Bind to outgoing address, according to IP v4/v6. */
 	union inaddr *addr;
@@ -242,6 +285,7 @@ static uv_handle_t *ioreq_spawn(struct qr_task *task, int socktype, sa_family_t
 	struct session *session = handle->data;
 	if (ret == 0) {
 		session->outgoing = true;
+		session->udp_uses = 1;
 		ret = session_add_tasks(session, task);
 	}
 	if (ret < 0) {
@@ -285,10 +329,12 @@ static void ioreq_kill_udp(uv_handle_t *req, struct qr_task *task)
 	if (session->closing) {
 		return;
 	}
-	uv_timer_stop(&session->timeout);
+	tw_stop(&session->timer);
 	session_del_tasks(session, task);
 	assert(session->tasks.len == 0);
-	session_close(session);
+	if (!udp_pool_put(get_worker(), session)) {
+		session_close(session);
+	}
 }
 
 static void ioreq_kill_tcp(uv_handle_t *req, struct qr_task *task)
@@ -313,11 +359,8 @@ static void ioreq_kill_tcp(uv_handle_t *req, struct qr_task *task)
 		if (session->connected) {
 			/* This is outbound TCP connection which can be reused.
 			* Close it after timeout */
-			uv_timer_t *timer = &session->timeout;
-			timer->data = session;
-			uv_timer_stop(timer);
-			res = uv_timer_start(timer, on_session_idle_timeout,
-					     KR_CONN_RTT_MAX, 0);
+			res = session_timer_start(session, on_session_idle_timeout,
+						  session->has_tls ? MAX_TLS_OUT_IDLE : KR_CONN_RTT_MAX, 0);
 		}
 	}
 
@@ -353,10 +396,14 @@ static void session_close(struct session *session)
 		qr_task_complete(session->buffering);
 	}
 	session->buffering = NULL;
+	tcp_out_flush_early(get_worker(), session);
 
 	uv_handle_t *handle = session->handle;
 	io_stop_read(handle);
 	session->closing = true;
+	if (!session->outgoing) {
+		io_tcp_in_del(session);
+	}
 	if (session->outgoing &&
 	    session->peer.ip.sa_family != AF_UNSPEC) {
 		struct worker_ctx *worker = get_worker();
@@ -366,7 +413,7 @@ static void session_close(struct session *session)
 	}
 
 	if (!uv_is_closing((uv_handle_t *)&session->timeout)) {
-		uv_timer_stop(&session->timeout);
+		tw_stop(&session->timer);
 		if (session->tls_client_ctx) {
 			tls_close(&session->tls_client_ctx->c);
 		}
@@ -407,8 +454,141 @@ static int session_del_waiting(struct session *session, struct qr_task *task)
 	return ret;
 }
 
+static inline bool ids_used(const struct session_ids *ids, uint16_t id)
+{
+	return ids->used[id / 64] & (1ull << (id % 64));
+}
+
+/** @internal Slot of the message ID in the index, or NULL. */
+static uint32_t *ids_slot(const struct session_ids *ids, uint16_t id)
+{
+	if (!ids_used(ids, id)) {
+		return NULL;
+	}
+	for (uint32_t i = id & ids->mask; ids->slots[i]; i = (i + 1) & ids->mask) {
+		if (ids->id[ids->slots[i] - 1] == id) {
+			return &ids->slots[i];
+		}
+	}
+	assert(false);
+	return NULL;
+}
+
+/** @internal Make room for `len` tasks, the table is kept at most half full. */
+static int ids_reserve(struct session_ids *ids, size_t len)
+{
+	if (len > ids->id_cap) {
+		const size_t cap = MAX(2 * ids->id_cap, 16);
+		uint16_t *id = realloc(ids->id, cap * sizeof(*id));
+		if (!id) {
+			return kr_error(ENOMEM);
+		}
+		ids->id = id;
+		ids->id_cap = cap;
+	}
+	if (ids->slots && 2 * len <= ids->mask + 1) {
+		return kr_ok();
+	}
+	const uint32_t size = ids->slots ? 2 * (ids->mask + 1) : 32;
+	uint32_t *slots = calloc(size, sizeof(*slots));
+	if (!slots) {
+		return kr_error(ENOMEM);
+	}
+	for (uint32_t i = 0; ids->slots && i <= ids->mask; ++i) {
+		if (ids->slots[i]) {
+			uint32_t j = ids->id[ids->slots[i] - 1] & (size - 1);
+			while (slots[j]) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = ids->slots[i];
+		}
+	}
+	free(ids->slots);
+	ids->slots = slots;
+	ids->mask = size - 1;
+	return kr_ok();
+}
+
+static void ids_insert(struct session_ids *ids, uint16_t id, uint32_t pos)
+{
+	ids->id[pos] = id;
+	uint32_t i = id & ids->mask;
+	while (ids->slots[i]) {
+		i = (i + 1) & ids->mask;
+	}
+	ids->slots[i] = pos + 1;
+	ids->used[id / 64] |= 1ull << (id % 64);
+}
+
+static void ids_remove(struct session_ids *ids, uint32_t *slot)
+{
+	const uint16_t id = ids->id[*slot - 1];
+	ids->used[id / 64] &= ~(1ull << (id % 64));
+	/* Shift back the entries that probed over the slot. */
+	uint32_t i = slot - ids->slots;
+	for (uint32_t j = (i + 1) & ids->mask; ids->slots[j]; j = (j + 1) & ids->mask) {
+		const uint32_t home = ids->id[ids->slots[j] - 1] & ids->mask;
+		if (((j - home) & ids->mask) >= ((j - i) & ids->mask)) {
+			ids->slots[i] = ids->slots[j];
+			i = j;
+		}
+	}
+	ids->slots[i] = 0;
+}
+
+/** @internal Random message ID not used by the other tasks. */
+static uint16_t ids_unique(const struct session_ids *ids)
+{
+	for (;;) {
+		const uint32_t rnd = kr_rand_uint(0);
+		const uint16_t id = rnd ^ (rnd >> 16);
+		if (!ids_used(ids, id)) {
+			return id;
+		}
+	}
+}
+
+/** @internal Add the task to outgoing TCP, indexed by its message ID;
+ * if another one uses the ID already, the query gets a new one. */
+static int session_add_tasks_indexed(struct session *session, struct qr_task *task)
+{
+	struct session_ids *ids = session->ids;
+	if (!ids) {
+		ids = session->ids = calloc(1, sizeof(*ids));
+		if (!ids) {
+			return kr_error(ENOMEM);
+		}
+	}
+	uint16_t id = knot_wire_get_id(task->pktbuf->wire);
+	const uint32_t *slot = ids_slot(ids, id);
+	if (slot && session->tasks.at[*slot - 1] == task) {
+		return *slot - 1;
+	}
+	if (session->tasks.len >= UINT16_MAX / 2 ||
+	    ids_reserve(ids, session->tasks.len + 1) != 0) {
+		return kr_error(ENOMEM);
+	}
+	if (slot) {
+		id = ids_unique(ids);
+		knot_wire_set_id(task->pktbuf->wire, id);
+		struct kr_rplan *rplan = &task->ctx->req.rplan;
+		if (rplan->pending.len > 0) {
+			array_tail(rplan->pending)->id = id;
+		}
+	}
+	int ret = array_push(session->tasks, task);
+	if (ret >= 0) {
+		ids_insert(ids, id, ret);
+		qr_task_ref(task);
+	}
+	return ret;
+}
+
 static int session_add_tasks(struct session *session, struct qr_task *task)
 {
+	if (session->outgoing && session->handle->type == UV_TCP) {
+		return session_add_tasks_indexed(session, task);
+	}
 	for (int i = 0; i < session->tasks.len; ++i) {
 		if (session->tasks.at[i] == task) {
 			return i;
@@ -421,18 +601,42 @@ static int session_add_tasks(struct session *session, struct qr_task *task)
 	return ret;
 }
 
+/** @internal Remove the i-th task of the session, keeping its reference. */
+static void session_del_tasks_at(struct session *session, size_t i)
+{
+	struct session_ids *ids = session->ids;
+	if (ids) {
+		ids_remove(ids, ids_slot(ids, ids->id[i]));
+		const size_t last = session->tasks.len - 1;
+		if (i != last) { /* array_del() moves the last one here */
+			*ids_slot(ids, ids->id[last]) = i + 1;
+			ids->id[i] = ids->id[last];
+		}
+	}
+	array_del(session->tasks, i);
+}
+
 static int session_del_tasks(struct session *session, struct qr_task *task)
 {
-	int ret = kr_error(ENOENT);
-	for (int i = 0; i < session->tasks.len; ++i) {
+	int pos = -1;
+	if (session->ids) {
+		const uint32_t *slot = ids_slot(session->ids, knot_wire_get_id(task->pktbuf->wire));
+		if (slot && session->tasks.at[*slot - 1] == task) {
+			pos = *slot - 1;
+		}
+	}
+	/* The task may have moved on to another query meanwhile. */
+	for (int i = 0; pos < 0 && i < session->tasks.len; ++i) {
 		if (session->tasks.at[i] == task) {
-			array_del(session->tasks, i);
-			qr_task_unref(task);
-			ret = kr_ok();
-			break;
+			pos = i;
 		}
 	}
-	return ret;
+	if (pos < 0) {
+		return kr_error(ENOENT);
+	}
+	session_del_tasks_at(session, pos);
+	qr_task_unref(task);
+	return kr_ok();
 }
 
 /** @cond This memory layout is internal to mempool.c, use only for debugging. */
@@ -462,26 +666,125 @@ static void mp_poison(struct mempool *mp, bool poison)
 /** Get a mempool.  (Recycle if possible.)  */
 static inline struct mempool *pool_borrow(struct worker_ctx *worker)
 {
-	struct mempool *mp = NULL;
-	if (worker->pool_mp.len > 0) {
-		mp = array_tail(worker->pool_mp);
-		array_pop(worker->pool_mp);
+	const bool cached = worker->pool_mp.free.len > 0;
+	struct mempool *mp = obj_cache_borrow(&worker->pool_mp);
+	if (cached) {
 		mp_poison(mp, 0);
-	} else { /* No mempool on the freelist, create new one */
-		mp = mp_new (4 * CPU_PAGE_SIZE);
+		worker->pool_mp_usage.reused += mp_total_size(mp);
+	} else if (mp) {
+		worker->pool_mp_usage.alloc += mp_total_size(mp);
 	}
 	return mp;
 }
 
-/** Return a mempool.  (Cache them up to some count.) */
-static inline void pool_release(struct worker_ctx *worker, struct mempool *mp)
+/** Allocate a packet buffer for worker->pool_pkts, outside of any mempool. */
+static knot_pkt_t *pktbuf_alloc(size_t max_size)
+{
+	uint8_t *wire = malloc(max_size);
+	knot_pkt_t *pkt = wire ? knot_pkt_new(wire, max_size, NULL) : NULL;
+	if (!pkt) {
+		free(wire);
+	}
+	return pkt;
+}
+
+static void pktbuf_free(void *obj)
+{
+	knot_pkt_t *pkt = obj;
+	free(pkt->wire);
+	free(pkt);
+}
+
+/** Get a packet buffer of at least max_size for the outgoing queries of a task.  (Recycle if possible.)
+ *
+ * The buffer is reset in place, the data parsed from it go to the pool, as with knot_pkt_new().
+ */
+static knot_pkt_t *pktbuf_borrow(struct worker_ctx *worker, size_t max_size, knot_mm_t *pool)
+{
+	obj_cache_t *cache = &worker->pool_pkts;
+	knot_pkt_t *pkt = NULL;
+	if (cache->free.len > 0) {
+		pkt = obj_cache_borrow(cache);
+		/* Too small since the EDNS payload was raised by net.bufsize() */
+		if (pkt->max_size < max_size) {
+			cache->drop += 1;
+			pktbuf_free(pkt);
+			pkt = NULL;
+		}
+	}
+	if (!pkt) {
+		cache->miss += 1;
+		pkt = pktbuf_alloc(max_size);
+		if (!pkt) {
+			return NULL;
+		}
+	}
+	pkt->mm = *pool;
+	pkt->size = 0;
+	return pkt;
+}
+
+/** Return a packet buffer of a task, before its request's mempool is released. */
+static void pktbuf_release(struct worker_ctx *worker, knot_pkt_t *pkt)
 {
-	if (worker->pool_mp.len < MP_FREELIST_SIZE) {
-		mp_flush(mp);
-		array_push(worker->pool_mp, mp);
+	/* Drop the parsed data and the arrays, which live in the request's mempool. */
+	knot_pkt_clear(pkt);
+	pkt->rr = NULL;
+	pkt->rr_info = NULL;
+	pkt->rrset_allocd = 0;
+	obj_cache_release(&worker->pool_pkts, pkt);
+}
+
+/** Account the memory a request needed and recompute the target once in a while. */
+static void pool_usage_add(struct worker_ctx *worker, size_t used)
+{
+	struct pool_mp_usage *usage = &worker->pool_mp_usage;
+	int i = 0;
+	while (i < MP_USAGE_BUCKETS - 1 && ((size_t)CPU_PAGE_SIZE << i) < used) {
+		++i;
+	}
+	usage->hist[i] += 1;
+	if (++usage->count < MP_USAGE_WINDOW) {
+		return;
+	}
+	/* Find the percentile and age the histogram. */
+	const uint32_t rank = (uint64_t)usage->count * MP_USAGE_PERCENTILE / 100;
+	uint32_t seen = 0;
+	usage->target = 0;
+	usage->count = 0;
+	for (i = 0; i < MP_USAGE_BUCKETS; ++i) {
+		seen += usage->hist[i];
+		if (!usage->target && seen >= rank) {
+			usage->target = (size_t)CPU_PAGE_SIZE << i;
+		}
+		usage->hist[i] /= 2;
+		usage->count += usage->hist[i];
+	}
+}
+
+/** Return a mempool.  (Cache them up to some count.)
+ * @param size mp_total_size() when it was borrowed */
+static inline void pool_release(struct worker_ctx *worker, struct mempool *mp, size_t size)
+{
+	struct pool_mp_usage *usage = &worker->pool_mp_usage;
+	struct mempool_stats st;
+	mp_stats(mp, &st);
+	/* Chunks in use, i.e. without the unused ones of a recycled pool. */
+	pool_usage_add(worker, st.chain_size[0] + st.chain_size[1]);
+	if (st.total_size > size) {
+		usage->alloc += st.total_size - size;
+	}
+	mp_flush(mp);
+	/* Keep memory for most requests, but not for the few biggest ones. */
+	if (usage->target) {
+		mp_shrink(mp, usage->target);
+	}
+	const size_t kept = mp_total_size(mp);
+	if (obj_cache_release(&worker->pool_mp, mp)) {
 		mp_poison(mp, 1);
+		usage->freed += st.total_size - kept;
 	} else {
-		mp_delete(mp);
+		usage->freed += st.total_size;
 	}
 }
 
@@ -510,15 +813,20 @@ static struct request_ctx *request_create(struct worker_ctx *worker,
 		.ctx = pool_borrow(worker),
 		.alloc = (knot_mm_alloc_t) mp_alloc
 	};
+	if (!pool.ctx) {
+		return NULL;
+	}
+	const size_t pool_size = mp_total_size(pool.ctx);
 
 	/* Create request context */
 	struct request_ctx *ctx = mm_alloc(&pool, sizeof(*ctx));
 	if (!ctx) {
-		pool_release(worker, pool.ctx);
+		pool_release(worker, pool.ctx, pool_size);
 		return NULL;
 	}
 
 	memset(ctx, 0, sizeof(*ctx));
+	ctx->pool_size = pool_size;
 
 	/* TODO Relocate pool to struct request */
 	ctx->worker = worker;
@@ -563,6 +871,12 @@ static struct request_ctx *request_create(struct worker_ctx *worker,
 			req->qsource.dst_addr = dst_addr;
 		}
 		req->qsource.tcp = true;
+	} else if (handle->type == UV_POLL) {
+		if (xdp_frame_addrs((uv_poll_t *)handle, &ctx->source.dst_addr,
+				    &ctx->source.eth) == 0) {
+			req->qsource.dst_addr = dst_addr;
+		}
+		req->qsource.tcp = false;
 	}
 
 	return ctx;
@@ -583,7 +897,16 @@ static int request_start(struct request_ctx *ctx, knot_pkt_t *query)
 		answer_max = MAX(knot_edns_get_payload(query->opt_rr),
 				 KNOT_WIRE_MIN_PKTSIZE);
 	}
+	/* AF_XDP answers are never fragmented. */
+	if (ctx->source.session && ctx->source.session->handle->type == UV_POLL) {
+		answer_max = MIN(answer_max, xdp_payload_max((uv_poll_t *)ctx->source.session->handle,
+							     &ctx->source.addr.ip));
+	}
 	req->qsource.size = query->size;
+	/* The query stays in its receive buffer until the request is finished. */
+	if (worker_wire_hold(ctx->worker, query->wire)) {
+		ctx->wire = query->wire;
+	}
 
 	req->answer = knot_pkt_new(NULL, answer_max, &req->pool);
 	if (!req->answer) {
@@ -611,16 +934,80 @@ static int request_start(struct request_ctx *ctx, knot_pkt_t *query)
 	return kr_ok();
 }
 
+/** Max. length of inflight_key() */
+#define INFLIGHT_KEY_MAXLEN (sizeof(void *) + KR_SOCKADDR_KEY_MAXLEN \
+			     + 3 * sizeof(uint16_t) + KNOT_DNAME_MAXLEN)
+
+/** Make the key of a client query in worker->inflight: the socket, the client,
+ * the message ID and the question, as they are in the query.
+ * @return key length or an error */
+static int inflight_key(char *key, const uv_handle_t *handle,
+			const struct sockaddr *addr, const knot_pkt_t *query)
+{
+	const uint8_t *qname = knot_pkt_qname(query);
+	if (!qname) {
+		return kr_error(EINVAL);
+	}
+	memcpy(key, &handle, sizeof(handle));
+	int len = kr_sockaddr_key(key + sizeof(handle), addr);
+	if (len < 0) {
+		return len;
+	}
+	char *pos = key + sizeof(handle) + len;
+	const uint16_t head[3] = {
+		knot_wire_get_id(query->wire), knot_pkt_qtype(query), knot_pkt_qclass(query)
+	};
+	memcpy(pos, head, sizeof(head));
+	pos += sizeof(head);
+	const size_t qname_len = knot_dname_size(qname);
+	memcpy(pos, qname, qname_len);
+	return pos + qname_len - key;
+}
+
+static void inflight_add(struct request_ctx *ctx, const char *key, int len)
+{
+	struct worker_ctx *worker = ctx->worker;
+	ctx->inflight_key = mm_alloc(&ctx->req.pool, len);
+	if (!ctx->inflight_key) {
+		return;
+	}
+	memcpy(ctx->inflight_key, key, len);
+	ctx->inflight_len = len;
+	trie_val_t *val = trie_get_ins(worker->inflight, key, len);
+	if (!val) {
+		ctx->inflight_key = NULL;
+		return;
+	}
+	*val = ctx;
+}
+
+/** Take the request out of worker->inflight; the retransmits start a new one then. */
+static void inflight_del(struct request_ctx *ctx)
+{
+	if (!ctx->inflight_key) {
+		return;
+	}
+	trie_del(ctx->worker->inflight, ctx->inflight_key, ctx->inflight_len, NULL);
+	ctx->inflight_key = NULL;
+}
+
 static void request_free(struct request_ctx *ctx)
 {
 	struct worker_ctx *worker = ctx->worker;
+	inflight_del(ctx);
+	worker_wire_release(worker, ctx->wire);
 	/* Return mempool to ring or free it if it's full */
-	pool_release(worker, ctx->req.pool.ctx);
+	pool_release(worker, ctx->req.pool.ctx, ctx->pool_size);
 	/* @note The 'task' is invalidated from now on. */
 	/* Decommit memory every once in a while */
 	static int mp_delete_count = 0;
 	if (++mp_delete_count == 100000) {
-		lua_gc(worker->engine->L, LUA_GCCOLLECT, 0);
+		/* The steps of worker->lua_gc keep up without the long pause. */
+		if (!worker->lua_gc.step_kb) {
+			const uint64_t prof_since = worker_prof_begin(worker);
+			lua_gc(worker->engine->L, LUA_GCCOLLECT, 0);
+			worker_prof_end(worker, PROF_LUA_GC, prof_since, NULL);
+		}
 #if defined(__GLIBC__) && defined(_GNU_SOURCE)
 		malloc_trim(0);
 #endif
@@ -676,21 +1063,21 @@ static struct qr_task *qr_task_create(struct request_ctx *ctx)
 	memset(task, 0, sizeof(*task)); /* avoid accidentally unitialized fields */
 
 	/* Create packet buffers for answer and subrequests */
-	knot_pkt_t *pktbuf = knot_pkt_new(NULL, pktbuf_max, &ctx->req.pool);
+	knot_pkt_t *pktbuf = pktbuf_borrow(ctx->worker, pktbuf_max, &ctx->req.pool);
 	if (!pktbuf) {
 		mm_free(&ctx->req.pool, task);
 		return NULL;
 	}
-	pktbuf->size = 0;
 
 	task->ctx = ctx;
 	task->pktbuf = pktbuf;
+	task->pktbuf_pooled = pktbuf;
 	array_init(task->waiting);
 	task->refs = 0;
 	int ret = request_add_tasks(ctx, task);
 	if (ret < 0) {
+		pktbuf_release(ctx->worker, pktbuf);
 		mm_free(&ctx->req.pool, task);
-		mm_free(&ctx->req.pool, pktbuf);
 		return NULL;
 	}
 	ctx->worker->stats.concurrent += 1;
@@ -708,6 +1095,8 @@ static void qr_task_free(struct qr_task *task)
 	struct session *source_session = ctx->source.session;
 	struct worker_ctx *worker = ctx->worker;
 
+	pktbuf_release(worker, task->pktbuf_pooled);
+
 	/* Process source session. */
 	if (source_session &&
 	    source_session->tasks.len < worker->tcp_pipeline_max/2 &&
@@ -897,7 +1286,7 @@ static void on_nontask_write(uv_write_t *req, int status)
 ssize_t worker_gnutls_push(gnutls_transport_ptr_t h, const void *buf, size_t len)
 {
 	struct tls_common_ctx *t = (struct tls_common_ctx *)h;
-	const uv_buf_t uv_buf[1] = {
+	uv_buf_t uv_buf[1] = {
 		{ (char *)buf, len }
 	};
 
@@ -905,6 +1294,11 @@ ssize_t worker_gnutls_push(gnutls_transport_ptr_t h, const void *buf, size_t len
 		errno = EFAULT;
 		return -1;
 	}
+	/* E.g. a TLS 1.3 key update; the kernel would encrypt the record again. */
+	if (t->kernel_tx) {
+		errno = EIO;
+		return -1;
+	}
 
 	assert(t->session && t->session->handle &&
 	       t->session->handle->type == UV_TCP);
@@ -915,7 +1309,16 @@ ssize_t worker_gnutls_push(gnutls_transport_ptr_t h, const void *buf, size_t len
 	struct worker_ctx *worker = t->worker;
 	assert(worker);
 
-	void *ioreq = worker_iohandle_borrow(worker);
+	/* The ClientHello of a TLS upstream by TCP Fast Open. */
+	int nbufs = io_tcp_fastopen_write(t->session->handle, uv_buf, 1);
+	if (nbufs < 0) {
+		errno = EIO;
+		return -1;
+	} else if (nbufs == 0) {
+		return len;
+	}
+
+	void *ioreq = iorequest_borrow(worker);
 	if (!ioreq) {
 		errno = EFAULT;
 		return -1;
@@ -923,19 +1326,14 @@ ssize_t worker_gnutls_push(gnutls_transport_ptr_t h, const void *buf, size_t len
 
 	uv_write_t *write_req = (uv_write_t *)ioreq;
 
-	struct qr_task *task = t->task;
-	uv_write_cb write_cb = on_task_write;
-	if (t->handshake_state == TLS_HS_DONE) {
-		assert(task);
-	} else {
-		task = NULL;
-		write_cb = on_nontask_write;
-	}
+	/* No task for handshakes and for coalesced answers, see tls_write(). */
+	struct qr_task *task = t->handshake_state == TLS_HS_DONE ? t->task : NULL;
+	uv_write_cb write_cb = task ? on_task_write : on_nontask_write;
 
 	write_req->data = task;
 
 	ssize_t ret = -1;
-	int res = uv_write(write_req, (uv_stream_t *)t->session->handle, uv_buf, 1, write_cb);
+	int res = uv_write(write_req, (uv_stream_t *)t->session->handle, uv_buf, nbufs, write_cb);
 	if (res == 0) {
 		if (task) {
 			qr_task_ref(task); /* Pending ioreq on current task */
@@ -965,64 +1363,556 @@ ssize_t worker_gnutls_push(gnutls_transport_ptr_t h, const void *buf, size_t len
 	return ret;
 }
 
-static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
-			struct sockaddr *addr, knot_pkt_t *pkt)
+#if __linux__
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+/** Largest answer sent as a GSO segment; the kernel refuses segments over the path MTU. */
+#define GSO_SEGMENT_MAX 1232
+/** Largest train of segments, the UDP payload limit over IPv4. */
+#define GSO_BYTES_MAX 65507
+
+/** A control message with UDP_SEGMENT. */
+union gso_ctrl {
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+};
+
+static bool same_peer(const struct sockaddr *a, const struct sockaddr *b)
 {
-	if (!handle) {
-		return qr_task_on_send(task, handle, kr_error(EIO));
+	const int len = kr_sockaddr_len(a);
+	return len > 0 && len == kr_sockaddr_len(b) && memcmp(a, b, len) == 0;
+}
+
+/**
+ * Fill the sendmmsg() vector with the queued answers, merging runs of answers
+ * to the same client into one message with UDP_SEGMENT (GSO): all segments
+ * but the last one have the same size, the kernel splits them into datagrams.
+ * @return the number of messages in vec; vec[k] carries answers first[k] up to first[k + 1]
+ */
+static unsigned udp_out_gso(struct worker_ctx *worker, int fd, unsigned len, struct mmsghdr *vec,
+			    unsigned *first, union gso_ctrl *ctrl)
+{
+	const struct mmsghdr *msg = worker->udp_out.msgvec;
+	if (worker->udp_gso == 0) { /* Linux 4.18+ */
+		int val = 0;
+		socklen_t val_len = sizeof(val);
+		worker->udp_gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, &val_len) == 0 ? 1 : -1;
+	}
+	unsigned n = 0;
+	for (unsigned i = 0; i < len; ++n) {
+		const size_t seg = msg[i].msg_hdr.msg_iov->iov_len;
+		size_t total = seg;
+		unsigned j = i + 1;
+		while (worker->udp_gso > 0 && seg <= GSO_SEGMENT_MAX && j < len
+		       && same_peer(msg[j].msg_hdr.msg_name, msg[i].msg_hdr.msg_name)) {
+			const size_t next = msg[j].msg_hdr.msg_iov->iov_len;
+			if (next > seg || total + next > GSO_BYTES_MAX) {
+				break;
+			}
+			total += next;
+			++j;
+			if (next < seg) {
+				break; /* Only the last segment may be shorter. */
+			}
+		}
+		vec[n] = msg[i];
+		if (j - i > 1) {
+			/* The answers have their iovecs next to each other. */
+			vec[n].msg_hdr.msg_iovlen = j - i;
+			vec[n].msg_hdr.msg_control = ctrl[n].buf;
+			vec[n].msg_hdr.msg_controllen = sizeof(ctrl[n].buf);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&vec[n].msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			const uint16_t gso_size = seg;
+			memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+			worker->stats.udp_gso += 1;
+			worker->stats.udp_gso_segments += j - i;
+		}
+		first[n] = i;
+		i = j;
 	}
+	first[n] = len;
+	return n;
+}
 
-	/* Synchronous push to TLS context, bypassing event loop. */
+/** Flush UDP answers gathered in worker->udp_out, using as few sendmmsg() calls as possible. */
+static void udp_out_flush(struct worker_ctx *worker)
+{
+	unsigned len = worker->udp_out.len;
+	if (len == 0) {
+		return;
+	}
+	uv_handle_t *handle = (uv_handle_t *)worker->udp_out.handle;
+	worker->udp_out.len = 0;
+	worker->udp_out.handle = NULL;
+
+	uv_os_fd_t fd = -1;
+	int status = kr_ok();
+	if (uv_is_closing(handle) || uv_fileno(handle, &fd) != 0) {
+		status = kr_error(EBADF);
+	}
+	/* Listening through io_uring, the answers go to the ring; what doesn't fit is sent here. */
 	struct session *session = handle->data;
-	assert(session->closing == false);
-	if (session->has_tls) {
-		struct kr_request *req = &task->ctx->req;
-		if (session->outgoing) {
-			int ret = kr_resolve_checkout(req, NULL, addr,
-						      SOCK_STREAM, pkt);
-			if (ret != kr_ok()) {
-				return ret;
+	if (status == 0 && session && session->uring) {
+		unsigned kept = 0;
+		for (unsigned i = 0; i < len; ++i) {
+			struct qr_task *task = worker->udp_out.task[i];
+			if (task && uring_send(worker->uring, (uv_udp_t *)handle,
+					       &worker->udp_out.msgvec[i].msg_hdr, task) == 0) {
+				continue; /* Task reference is passed to the ring. */
+			}
+			worker->udp_out.task[kept] = task;
+			worker->udp_out.iov[kept] = worker->udp_out.iov[i];
+			worker->udp_out.peer[kept] = worker->udp_out.peer[i];
+			worker->udp_out.msgvec[kept] = worker->udp_out.msgvec[i];
+			worker->udp_out.msgvec[kept].msg_hdr.msg_iov = &worker->udp_out.iov[kept];
+			if (!task) {
+				worker->udp_out.msgvec[kept].msg_hdr.msg_name = &worker->udp_out.peer[kept];
 			}
+			++kept;
 		}
-		return tls_push(task, handle, pkt);
+		len = kept;
 	}
-
-	int ret = 0;
-	struct request_ctx *ctx = task->ctx;
-	struct worker_ctx *worker = ctx->worker;
-	struct kr_request *req = &ctx->req;
-	void *ioreq = iorequest_borrow(worker);
-	if (!ioreq) {
-		return qr_task_on_send(task, handle, kr_error(ENOMEM));
+	struct mmsghdr vec[SENDMMSG_BATCH];
+	unsigned first[SENDMMSG_BATCH + 1] = { 0 };
+	union gso_ctrl ctrl[SENDMMSG_BATCH];
+	const unsigned vec_len = status == 0 ? udp_out_gso(worker, fd, len, vec, first, ctrl) : 0;
+	unsigned vec_sent = 0;
+	while (status == 0 && vec_sent < vec_len) {
+		int ret = sendmmsg(fd, vec + vec_sent, vec_len - vec_sent, 0);
+		if (ret > 0) {
+			worker->stats.udp_batches += 1;
+			worker->stats.udp_batched += first[vec_sent + ret] - first[vec_sent];
+			vec_sent += ret;
+		} else if (ret == 0) {
+			status = kr_error(EIO);
+		} else if (errno != EINTR) {
+			status = kr_error(errno);
+		}
 	}
-	if (knot_wire_get_qr(pkt->wire) == 0) {
-		/*
-		 * Query must be finalised using destination address before
-		 * sending.
-		 *
-		 * Libuv does not offer a convenient way how to obtain a source
-		 * IP address from a UDP handle that has been initialised using
-		 * uv_udp_init(). The uv_udp_getsockname() fails because of the
-		 * lazy socket initialisation.
-		 *
-		 * @note -- A solution might be opening a separate socket and
-		 * trying to obtain the IP address from it.
-		 */
-		ret = kr_resolve_checkout(req, NULL, addr,
-		                          handle->type == UV_UDP ? SOCK_DGRAM : SOCK_STREAM,
-		                          pkt);
-		if (ret != 0) {
-			iorequest_release(worker, ioreq);
-			return ret;
+	const unsigned sent = first[vec_sent];
+	/* The device can't segment after all; stop using GSO, send the rest one by one. */
+	const bool gso_failed = status != 0 && vec_sent < vec_len && vec[vec_sent].msg_hdr.msg_iovlen > 1
+		&& (status == kr_error(EIO) || status == kr_error(EINVAL) || status == kr_error(EOPNOTSUPP));
+	if (gso_failed) {
+		kr_log_verbose("[worker] UDP GSO failed, disabling it: %s\n", kr_strerror(status));
+		worker->udp_gso = -1;
+	}
+
+	for (unsigned i = 0; i < len; ++i) {
+		struct qr_task *task = worker->udp_out.task[i];
+		if (!task) { /* Answered by the fast path, the client retries if it's lost. */
+			if (i >= sent) {
+				worker->stats.dropped += 1;
+			}
+			worker_wire_release(worker, worker->udp_out.iov[i].iov_base);
+			continue;
+		}
+		/* Socket buffer is full, let libuv queue the rest until it's writable. */
+		if (i >= sent && (gso_failed || status == kr_error(EAGAIN) || status == kr_error(ENOBUFS))) {
+			uv_udp_send_t *send_req = iorequest_borrow(worker);
+			if (send_req) {
+				struct msghdr *hdr = &worker->udp_out.msgvec[i].msg_hdr;
+				uv_buf_t buf = { hdr->msg_iov->iov_base, hdr->msg_iov->iov_len };
+				send_req->data = task;
+				if (uv_udp_send(send_req, (uv_udp_t *)handle, &buf, 1,
+						hdr->msg_name, &on_send) == 0) {
+					continue; /* Task reference is passed to send_req. */
+				}
+				iorequest_release(worker, send_req);
+			}
 		}
+		qr_task_on_send(task, handle, i < sent ? 0 : status);
+		qr_task_unref(task);
 	}
-	/* Send using given protocol */
-	if (handle->type == UV_UDP) {
-		uv_udp_send_t *send_req = (uv_udp_send_t *)ioreq;
-		uv_buf_t buf = { (char *)pkt->wire, pkt->size };
-		send_req->data = task;
-		ret = uv_udp_send(send_req, (uv_udp_t *)handle, &buf, 1, addr, &on_send);
-	} else if (handle->type == UV_TCP) {
+}
+
+#endif
+
+void worker_uring_sent(struct qr_task *task, uv_handle_t *handle, int status)
+{
+	qr_task_on_send(task, handle, handle ? status : kr_error(EBADF));
+	qr_task_unref(task);
+}
+
+/** Answers to a TCP/TLS client, coalesced into a single write. */
+struct tcp_out {
+	uv_write_t req;
+	unsigned len;
+	uint16_t pkt_size[TCP_WRITE_BATCH]; /**< in network byte order */
+	struct qr_task *task[TCP_WRITE_BATCH];
+};
+
+static void tcp_out_done(struct worker_ctx *worker, struct tcp_out *out,
+			 uv_handle_t *handle, int status)
+{
+	for (unsigned i = 0; i < out->len; ++i) {
+		qr_task_on_send(out->task[i], handle, status);
+		qr_task_unref(out->task[i]);
+	}
+	worker->stats.tcp_batches += 1;
+	worker->stats.tcp_batched += out->len;
+	free(out);
+}
+
+static void on_tcp_out_write(uv_write_t *req, int status)
+{
+	uv_handle_t *handle = (uv_handle_t *)(req->handle);
+	struct worker_ctx *worker = handle->loop->data;
+	assert(worker == get_worker());
+	tcp_out_done(worker, req->data, handle, status);
+}
+
+/** Write all answers queued in `session->out`. */
+static void tcp_out_flush_session(struct worker_ctx *worker, struct session *session)
+{
+	struct tcp_out *out = session->out;
+	if (!out) {
+		return;
+	}
+	session->out = NULL;
+	uv_handle_t *handle = session->handle;
+	uv_buf_t buf[2 * TCP_WRITE_BATCH];
+	for (unsigned i = 0; i < out->len; ++i) {
+		knot_pkt_t *pkt = out->task[i]->ctx->req.answer;
+		buf[2 * i] = uv_buf_init((char *)&out->pkt_size[i], sizeof(out->pkt_size[i]));
+		buf[2 * i + 1] = uv_buf_init((char *)pkt->wire, pkt->size);
+	}
+	int ret = kr_ok();
+	if (session->closing || uv_is_closing(handle)) {
+		ret = kr_error(EIO);
+	} else if (session->has_tls && !tls_kernel_tx(handle)) {
+		/* The answers are encrypted (and copied) right away,
+		 * in as few TLS records as their size allows. */
+		ret = tls_write(handle, buf, 2 * out->len);
+	} else {
+		out->req.data = out;
+		ret = uv_write(&out->req, (uv_stream_t *)handle, buf, 2 * out->len,
+			       on_tcp_out_write);
+		if (ret == 0) {
+			return;
+		}
+	}
+	tcp_out_done(worker, out, handle, ret);
+}
+
+static void tcp_out_flush(struct worker_ctx *worker)
+{
+	/* Flushing may lead to new answers being queued, so go by one. */
+	while (worker->tcp_out.len > 0) {
+		struct session *session = array_tail(worker->tcp_out);
+		array_pop(worker->tcp_out);
+		tcp_out_flush_session(worker, session);
+	}
+}
+
+/** Flush `session->out` outside of the loop phases, e.g. before closing the session. */
+static void tcp_out_flush_early(struct worker_ctx *worker, struct session *session)
+{
+	if (!session->out) {
+		return;
+	}
+	for (size_t i = 0; i < worker->tcp_out.len; ++i) {
+		if (worker->tcp_out.at[i] == session) {
+			array_del(worker->tcp_out, i);
+			break;
+		}
+	}
+	tcp_out_flush_session(worker, session);
+}
+
+static void out_flush(struct worker_ctx *worker)
+{
+	udp_wave_flush(worker);
+	if (worker->out_flush.cache_batch) {
+		worker->out_flush.cache_batch = false;
+		kr_cache_batch_end(&worker->engine->resolver.cache);
+	}
+#if __linux__
+	udp_out_flush(worker);
+#endif
+	tcp_out_flush(worker);
+	uring_flush(worker->uring);
+}
+
+/** @internal Account the time, log it if it's over worker->prof.slow_ms. */
+static void prof_add(struct worker_ctx *worker, struct worker_prof_stat *stat,
+		     const char *what, uint64_t us, const char *name)
+{
+	stat->count += 1;
+	stat->total_us += us;
+	if (us > stat->max_us) {
+		stat->max_us = us;
+	}
+	if (worker->prof.slow_ms && us >= (uint64_t)worker->prof.slow_ms * 1000) {
+		worker->prof.slow += 1;
+		kr_log_info("[profile] slow %s: %.1f ms%s%s\n", what, us / 1000.0,
+			    name ? ", in " : "", name ? name : "");
+	}
+}
+
+/** @internal Flush, with the time in the loop iteration if profiling, see worker->prof. */
+static void out_flush_prof(struct worker_ctx *worker)
+{
+	struct worker_prof *prof = &worker->prof;
+	if (!prof->enabled) {
+		out_flush(worker);
+		return;
+	}
+	const uint64_t since = kr_now_us();
+	prof->depth += 1; /* the callbacks within are counted here */
+	out_flush(worker);
+	prof->depth -= 1;
+	if (prof->in_poll) {
+		prof->iter_us += kr_now_us() - since;
+	}
+}
+
+static void on_out_prepare(uv_prepare_t *handle)
+{
+	struct worker_ctx *worker = handle->loop->data;
+	struct worker_prof *prof = &worker->prof;
+	if (prof->enabled) {
+		/* The iteration so far: timers and closing since the last check. */
+		prof->iter_us = prof->check_at ? kr_now_us() - prof->check_at : 0;
+		prof->in_poll = true;
+	}
+	out_flush_prof(worker);
+}
+
+static void on_out_check(uv_check_t *handle)
+{
+	struct worker_ctx *worker = handle->loop->data;
+	struct worker_prof *prof = &worker->prof;
+	out_flush_prof(worker);
+	if (prof->enabled && prof->in_poll) {
+		if (prof->check_at) {
+			prof_add(worker, &prof->loop, "loop iteration", prof->iter_us, NULL);
+		}
+		prof->in_poll = false;
+		prof->check_at = kr_now_us();
+	}
+}
+
+/** Start flushing the queued answers before and after every I/O poll. */
+static int out_flush_start(struct worker_ctx *worker)
+{
+	if (worker->out_flush.active) {
+		return kr_ok();
+	}
+	if (!worker->loop) {
+		return kr_error(EINVAL);
+	}
+	int ret = uv_prepare_init(worker->loop, &worker->out_flush.prepare);
+	if (ret == 0) {
+		ret = uv_check_init(worker->loop, &worker->out_flush.check);
+	}
+	if (ret == 0) {
+		uv_prepare_start(&worker->out_flush.prepare, on_out_prepare);
+		uv_check_start(&worker->out_flush.check, on_out_check);
+		/* Don't keep the loop alive just for these. */
+		uv_unref((uv_handle_t *)&worker->out_flush.prepare);
+		uv_unref((uv_handle_t *)&worker->out_flush.check);
+		worker->out_flush.active = true;
+	}
+	return ret;
+}
+
+/** Make the cache writes done until the next flush share one transaction. */
+static void cache_batch_start(struct worker_ctx *worker)
+{
+	if (worker->out_flush.cache_batch || out_flush_start(worker) != 0) {
+		return;
+	}
+	worker->out_flush.cache_batch = true;
+	kr_cache_batch_begin(&worker->engine->resolver.cache);
+}
+
+/** Queue an answer to a TCP/TLS client; it's sent later in tcp_out_flush(). */
+static int tcp_out_push(struct worker_ctx *worker, struct qr_task *task,
+			struct session *session, knot_pkt_t *pkt)
+{
+	/* The answer is taken from the request when flushing. */
+	if (pkt != task->ctx->req.answer || out_flush_start(worker) != 0) {
+		return kr_error(ENOTSUP);
+	}
+	struct tcp_out *out = session->out;
+	if (!out) {
+		if (array_reserve(worker->tcp_out, worker->tcp_out.len + 1) != 0) {
+			return kr_error(ENOMEM);
+		}
+		out = malloc(sizeof(*out));
+		if (!out) {
+			return kr_error(ENOMEM);
+		}
+		out->len = 0;
+		session->out = out;
+		array_push(worker->tcp_out, session);
+	}
+	out->pkt_size[out->len] = htons(pkt->size);
+	out->task[out->len] = task;
+	out->len += 1;
+	qr_task_ref(task); /* Pending answer in session->out */
+	if (out->len == TCP_WRITE_BATCH) {
+		tcp_out_flush_early(worker, session);
+	}
+	return kr_ok();
+}
+
+#if __linux__
+/** Queue an answer to a UDP client; it's sent later in udp_out_flush().
+ * Without a task, the answer is in a slot of the receive ring (see fast_path()). */
+static int udp_out_push(struct worker_ctx *worker, struct qr_task *task, uv_udp_t *handle,
+			const struct sockaddr *addr, uint8_t *wire, size_t size)
+{
+	if (out_flush_start(worker) != 0) {
+		return kr_error(ENOTSUP);
+	}
+	/* Batches are per-socket, so flush the answers for the previous one. */
+	if (worker->udp_out.handle != handle) {
+		udp_out_flush(worker);
+		worker->udp_out.handle = handle;
+	}
+	const unsigned i = worker->udp_out.len;
+	if (!task) {
+		if (!worker_wire_hold(worker, wire)) {
+			return kr_error(EINVAL);
+		}
+		memcpy(&worker->udp_out.peer[i], addr, kr_sockaddr_len(addr));
+		addr = &worker->udp_out.peer[i].ip;
+	}
+	worker->udp_out.iov[i] = (struct iovec){ wire, size };
+	worker->udp_out.msgvec[i] = (struct mmsghdr){
+		.msg_hdr = {
+			.msg_name = (void *)addr,
+			.msg_namelen = kr_sockaddr_len(addr),
+			.msg_iov = &worker->udp_out.iov[i],
+			.msg_iovlen = 1,
+		},
+	};
+	worker->udp_out.task[i] = task;
+	worker->udp_out.len = i + 1;
+	if (task) {
+		qr_task_ref(task); /* Pending answer in worker->udp_out */
+	}
+	if (worker->udp_out.len == SENDMMSG_BATCH) {
+		udp_out_flush(worker);
+	}
+	return kr_ok();
+}
+#endif
+
+int worker_io_uring(struct worker_ctx *worker, bool enable)
+{
+	if (worker->io_uring == enable) {
+		return kr_ok();
+	}
+	/* The ring is submitted together with the flush of the answers. */
+	int ret = enable ? out_flush_start(worker) : kr_ok();
+	if (ret == 0 && enable) {
+		ret = uring_init(worker);
+	}
+	if (ret != 0) {
+		return ret;
+	}
+	out_flush(worker);
+	worker->io_uring = enable;
+	network_udp_restart(&worker->engine->net);
+	return kr_ok();
+}
+
+static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
+			struct sockaddr *addr, knot_pkt_t *pkt)
+{
+	if (!handle) {
+		return qr_task_on_send(task, handle, kr_error(EIO));
+	}
+
+	struct session *session = handle->data;
+	assert(session->closing == false);
+	/* Answers over DoH go to the streams of their queries. */
+	if (session->http_ctx && !session->outgoing && knot_wire_get_qr(pkt->wire)) {
+		return qr_task_on_send(task, handle,
+				       http_send(session->http_ctx, task->ctx->source.stream, pkt));
+	}
+	/* Answers to TCP/TLS clients are coalesced, see tcp_out_flush(). */
+	if (handle->type == UV_TCP && !session->outgoing &&
+	    knot_wire_get_qr(pkt->wire) &&
+	    tcp_out_push(task->ctx->worker, task, session, pkt) == 0) {
+		return kr_ok();
+	}
+
+	/* Synchronous push to TLS context, bypassing event loop;
+	 * with the kernel encrypting the records it's a plain TCP write. */
+	if (session->has_tls && !tls_kernel_tx(handle)) {
+		struct kr_request *req = &task->ctx->req;
+		if (session->outgoing) {
+			int ret = kr_resolve_checkout(req, NULL, addr,
+						      SOCK_STREAM, pkt);
+			if (ret != kr_ok()) {
+				return ret;
+			}
+		}
+		return tls_push(task, handle, pkt);
+	}
+
+	int ret = 0;
+	struct request_ctx *ctx = task->ctx;
+	struct worker_ctx *worker = ctx->worker;
+	struct kr_request *req = &ctx->req;
+	uv_write_t *tfo_done = NULL; /* Written by TFO, completed at the end. */
+	/* Answers to AF_XDP clients are copied to the transmit ring right away. */
+	if (handle->type == UV_POLL) {
+		ret = xdp_send((uv_poll_t *)handle, &ctx->source.dst_addr.ip, addr,
+			       &ctx->source.eth, pkt);
+		return ret == 0 ? qr_task_on_send(task, handle, 0) : ret;
+	}
+#if __linux__
+	/* Answers to UDP clients are batched, see udp_out_flush(). */
+	if (handle->type == UV_UDP && !session->outgoing &&
+	    knot_wire_get_qr(pkt->wire) &&
+	    udp_out_push(worker, task, (uv_udp_t *)handle, addr, pkt->wire, pkt->size) == 0) {
+		return kr_ok();
+	}
+#endif
+	void *ioreq = iorequest_borrow(worker);
+	if (!ioreq) {
+		return qr_task_on_send(task, handle, kr_error(ENOMEM));
+	}
+	if (knot_wire_get_qr(pkt->wire) == 0) {
+		/*
+		 * Query must be finalised using destination address before
+		 * sending.
+		 *
+		 * Libuv does not offer a convenient way how to obtain a source
+		 * IP address from a UDP handle that has been initialised using
+		 * uv_udp_init(). The uv_udp_getsockname() fails because of the
+		 * lazy socket initialisation.
+		 *
+		 * @note -- A solution might be opening a separate socket and
+		 * trying to obtain the IP address from it.
+		 */
+		ret = kr_resolve_checkout(req, NULL, addr,
+		                          handle->type == UV_UDP ? SOCK_DGRAM : SOCK_STREAM,
+		                          pkt);
+		if (ret != 0) {
+			iorequest_release(worker, ioreq);
+			return ret;
+		}
+	}
+	/* Send using given protocol */
+	if (handle->type == UV_UDP) {
+		uv_udp_send_t *send_req = (uv_udp_send_t *)ioreq;
+		uv_buf_t buf = { (char *)pkt->wire, pkt->size };
+		send_req->data = task;
+		ret = uv_udp_send(send_req, (uv_udp_t *)handle, &buf, 1, addr, &on_send);
+	} else if (handle->type == UV_TCP) {
 		uv_write_t *write_req = (uv_write_t *)ioreq;
 		uint16_t pkt_size = htons(pkt->size);
 		uv_buf_t buf[2] = {
@@ -1030,7 +1920,16 @@ static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
 			{ (char *)pkt->wire, pkt->size }
 		};
 		write_req->data = task;
-		ret = uv_write(write_req, (uv_stream_t *)handle, buf, 2, &on_task_write);
+		/* The query may have gone with the SYN already, see ioreq_spawn(). */
+		int nbufs = io_tcp_fastopen_write(handle, buf, 2);
+		if (nbufs > 0) {
+			ret = uv_write(write_req, (uv_stream_t *)handle, buf, nbufs, &on_task_write);
+		} else if (nbufs == 0) {
+			write_req->handle = (uv_stream_t *)handle;
+			tfo_done = write_req;
+		} else {
+			ret = nbufs;
+		}
 	} else {
 		assert(false);
 	}
@@ -1056,6 +1955,8 @@ static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
 	    addr) {
 		if (handle->type == UV_UDP)
 			worker->stats.udp += 1;
+		else if (session->has_tls)
+			worker->stats.tls += 1;
 		else
 			worker->stats.tcp += 1;
 		if (addr->sa_family == AF_INET6)
@@ -1063,6 +1964,9 @@ static int qr_task_send(struct qr_task *task, uv_handle_t *handle,
 		else if (addr->sa_family == AF_INET)
 			worker->stats.ipv4 += 1;
 	}
+	if (tfo_done) {
+		on_task_write(tfo_done, 0);
+	}
 	return ret;
 }
 
@@ -1113,9 +2017,7 @@ static int session_tls_hs_cb(struct session *session, int status)
 		assert(session->tasks.len == 0);
 		session_close(session);
 	} else {
-		uv_timer_stop(&session->timeout);
-		session->timeout.data = session;
-		timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
+		session_timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
 	}
 	return kr_ok();
 }
@@ -1155,7 +2057,7 @@ static void on_connect(uv_connect_t *req, int status)
 		return;
 	}
 
-	uv_timer_stop(&session->timeout);
+	tw_stop(&session->timer);
 
 	if (status != 0) {
 		worker_del_tcp_waiting(worker, &peer->ip);
@@ -1213,7 +2115,7 @@ static void on_connect(uv_connect_t *req, int status)
 		if (ret == kr_error(EAGAIN)) {
 			iorequest_release(worker, req);
 			io_start_read(session->handle);
-			timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
+			session_timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
 			return;
 		}
 	}
@@ -1221,7 +2123,7 @@ static void on_connect(uv_connect_t *req, int status)
 	if (ret == kr_ok()) {
 		ret = session_next_waiting_send(session);
 		if (ret == kr_ok()) {
-			timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
+			session_timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
 			worker_add_tcp_connected(worker, &session->peer.ip, session);
 			iorequest_release(worker, req);
 			return;
@@ -1244,11 +2146,21 @@ static void on_connect(uv_connect_t *req, int status)
 	session_close(session);
 }
 
-static void on_tcp_connect_timeout(uv_timer_t *timer)
+/** Tell kr_context::upstream_timeout that the addr didn't answer the task in time. */
+static void report_timeout(struct worker_ctx *worker, struct qr_task *task,
+			   const struct sockaddr *addr)
+{
+	struct kr_context *rctx = &worker->engine->resolver;
+	if (rctx->upstream_timeout && task->ctx) {
+		rctx->upstream_timeout(&task->ctx->req, addr, rctx->upstream_timeout_baton);
+	}
+}
+
+static void on_tcp_connect_timeout(struct tw_timer *timer)
 {
 	struct session *session = timer->data;
 
-	uv_timer_stop(timer);
+	tw_stop(timer);
 	struct worker_ctx *worker = get_worker();
 
 	assert (session->waiting.len == session->tasks.len);
@@ -1271,6 +2183,7 @@ static void on_tcp_connect_timeout(uv_timer_t *timer)
 		struct qr_task *task = session->waiting.at[0];
 		struct request_ctx *ctx = task->ctx;
 		assert(ctx);
+		report_timeout(worker, task, &peer->ip);
 		task->timeouts += 1;
 		worker->stats.timeout += 1;
 		session_del_tasks(session, task);
@@ -1284,12 +2197,12 @@ static void on_tcp_connect_timeout(uv_timer_t *timer)
 	session_close(session);
 }
 
-static void on_tcp_watchdog_timeout(uv_timer_t *timer)
+static void on_tcp_watchdog_timeout(struct tw_timer *timer)
 {
 	struct session *session = timer->data;
 
 	assert(session->outgoing);
-	uv_timer_stop(timer);
+	tw_stop(timer);
 	struct worker_ctx *worker = get_worker();
 	if (session->outgoing) {
 		if (session->has_tls) {
@@ -1299,6 +2212,7 @@ static void on_tcp_watchdog_timeout(uv_timer_t *timer)
 
 		while (session->waiting.len > 0) {
 			struct qr_task *task = session->waiting.at[0];
+			report_timeout(worker, task, &session->peer.ip);
 			task->timeouts += 1;
 			worker->stats.timeout += 1;
 			array_del(session->waiting, 0);
@@ -1312,10 +2226,13 @@ static void on_tcp_watchdog_timeout(uv_timer_t *timer)
 
 	while (session->tasks.len > 0) {
 		struct qr_task *task = session->tasks.at[0];
+		if (session->outgoing) {
+			report_timeout(worker, task, &session->peer.ip);
+		}
 		task->timeouts += 1;
 		worker->stats.timeout += 1;
 		assert(task->refs > 1);
-		array_del(session->tasks, 0);
+		session_del_tasks_at(session, 0);
 		ioreq_kill_pending(task);
 		assert(task->pending_count == 0);
 		qr_task_finalize(task, KR_STATE_FAIL);
@@ -1326,19 +2243,22 @@ static void on_tcp_watchdog_timeout(uv_timer_t *timer)
 }
 
 /* This is called when I/O timeouts */
-static void on_udp_timeout(uv_timer_t *timer)
+static void on_udp_timeout(struct tw_timer *timer)
 {
 	struct session *session = timer->data;
 
 	uv_handle_t *handle = session->handle;
 	assert(handle->data == session);
 
-	uv_timer_stop(timer);
+	tw_stop(timer);
 	assert(session->tasks.len == 1);
 	assert(session->waiting.len == 0);
 
-	/* Penalize all tried nameservers with a timeout. */
 	struct qr_task *task = session->tasks.at[0];
+	if (stale_step(task)) {
+		return;
+	}
+	/* Penalize all tried nameservers with a timeout. */
 	struct worker_ctx *worker = task->ctx->worker;
 	if (task->leading && task->pending_count > 0) {
 		struct kr_query *qry = array_tail(task->ctx->req.rplan.pending);
@@ -1353,6 +2273,8 @@ static void on_udp_timeout(uv_timer_t *timer)
 			kr_nsrep_update_rtt(&qry->ns, choice, KR_NS_DEAD,
 					    worker->engine->resolver.cache_rtt,
 					    KR_NS_UPDATE_NORESET);
+			kr_fwd_pool_report(task->ctx->req.fwd_pool, choice, kr_error(ETIMEDOUT));
+			report_timeout(worker, task, choice);
 		}
 	}
 	task->timeouts += 1;
@@ -1360,11 +2282,11 @@ static void on_udp_timeout(uv_timer_t *timer)
 	qr_task_step(task, NULL, NULL);
 }
 
-static void on_session_idle_timeout(uv_timer_t *timer)
+static void on_session_idle_timeout(struct tw_timer *timer)
 {
 	struct session *s = timer->data;
 	assert(s);
-	uv_timer_stop(timer);
+	tw_stop(timer);
 	if (s->closing) {
 		return;
 	}
@@ -1394,55 +2316,206 @@ static uv_handle_t *retransmit(struct qr_task *task)
 	return ret;
 }
 
-static void on_retransmit(uv_timer_t *req)
+/** Return how long to wait for an answer from the address before trying the next one.
+ * @param pct percent of the smoothed RTT to wait, 0 for the default interval */
+static uint64_t retry_interval(struct worker_ctx *worker, const struct sockaddr *addr,
+			       unsigned pct)
 {
-	struct session *session = req->data;
+	unsigned srtt = 0, rttvar = 0;
+	if (pct == 0 || kr_nsrep_rtt_estimate(worker->engine->resolver.cache_rtt, addr,
+					      &srtt, &rttvar) != 0) {
+		return KR_CONN_RETRY;
+	}
+	/* Like TCP RTO, allow for the variance in RTT; at least +10ms. */
+	uint64_t timeout = (uint64_t)srtt * pct / 100 + MAX(4 * rttvar, 10);
+	return MIN(MAX(timeout, KR_CONN_RETRY_MIN), KR_CONN_RETRY);
+}
+
+/** Return the delay of the first retransmit, earlier than KR_CONN_RETRY
+ * when the server is expected to answer sooner (and the budget allows). */
+static uint64_t hedge_timeout(struct qr_task *task, const struct kr_query *qry)
+{
+	struct worker_ctx *worker = task->ctx->worker;
+	task->hedge = false;
+	task->hedged = false;
+	/* If the server is glued, use the default rate. */
+	if (qry->ns.score <= KR_NS_GLUED) {
+		return KR_CONN_RETRY;
+	}
+	const uint64_t timeout = retry_interval(worker, task->addrlist, worker->hedge.rtt_pct);
+	if (timeout >= KR_CONN_RETRY) {
+		return KR_CONN_RETRY;
+	}
+	if (task->addrlist_count < 2) {
+		return timeout; /* The same server again, not a hedge. */
+	}
+	/* Cap the extra traffic; beyond it just retry at the usual interval. */
+	if (worker->stats.hedges * 100 >= worker->stats.udp * worker->hedge.budget_pct) {
+		return KR_CONN_RETRY;
+	}
+	task->hedge = true;
+	return timeout;
+}
+
+/** Shorten the wait for upstream to the stale deadline of the request, if it's sooner. */
+static uint64_t stale_wait(const struct qr_task *task, uint64_t timeout)
+{
+	const uint64_t deadline = task->ctx->req.stale_deadline;
+	if (!deadline || task->stale_tried) {
+		return timeout;
+	}
+	const uint64_t now = kr_now();
+	return deadline > now ? MIN(timeout, deadline - now) : 0;
+}
+
+/**
+ * Stop waiting for upstream at the stale deadline of the request, so that
+ * the next step may answer from stale data (if there's any).
+ * Unlike a timeout, it doesn't penalize the servers.
+ * @return true if it stepped the task
+ */
+static bool stale_step(struct qr_task *task)
+{
+	const uint64_t deadline = task->ctx->req.stale_deadline;
+	if (!deadline || task->stale_tried || kr_now() < deadline) {
+		return false;
+	}
+	task->stale_tried = true;
+	qr_task_step(task, NULL, NULL);
+	return true;
+}
+
+static void on_retransmit(struct tw_timer *timer)
+{
+	struct session *session = timer->data;
 	assert(session->tasks.len == 1);
 
-	uv_timer_stop(req);
+	tw_stop(timer);
 	struct qr_task *task = session->tasks.at[0];
-	if (retransmit(task) == NULL) {
+	if (stale_step(task)) {
+		return;
+	}
+	struct worker_ctx *worker = task->ctx->worker;
+	const bool hedging = task->hedge && !task->hedged && task->pending_count == 1;
+	const struct sockaddr *choice = task->addrlist_count > 0
+		? (struct sockaddr *)&((struct sockaddr_in6 *)task->addrlist)[task->addrlist_turn]
+		: NULL;
+	uv_handle_t *handle = retransmit(task);
+	if (hedging && handle) {
+		task->hedged = true;
+		worker->stats.hedges += 1;
+	}
+	if (handle == NULL) {
 		/* Not possible to spawn request, start timeout timer with remaining deadline. */
-		uint64_t timeout = KR_CONN_RTT_MAX - task->pending_count * KR_CONN_RETRY;
-		uv_timer_start(req, on_udp_timeout, timeout, 0);
+		const uint64_t elapsed = kr_now() - task->sent_at;
+		uint64_t timeout = elapsed < KR_CONN_RTT_MAX ? KR_CONN_RTT_MAX - elapsed : 0;
+		session_timer_start(session, on_udp_timeout,
+				    stale_wait(task, MAX(timeout, KR_CONN_RETRY_MIN)), 0);
 	} else {
-		uv_timer_start(req, on_retransmit, KR_CONN_RETRY, 0);
+		/* Wait as long as the server just asked usually needs. */
+		session_timer_start(session, on_retransmit,
+				    stale_wait(task, retry_interval(worker, choice, 100)), 0);
 	}
 }
 
-static int timer_start(struct session *session, uv_timer_cb cb,
-		       uint64_t timeout, uint64_t repeat)
+static void subreq_finalize(struct qr_task *task, const struct sockaddr *packet_source, knot_pkt_t *pkt);
+
+/** @internal Return true if another fork is leading the subrequest with given key. */
+static bool subreq_shared_busy(struct worker_ctx *worker, const char *key, int klen)
 {
-	uv_timer_t *timer = &session->timeout;
-	assert(timer->data == session);
-	int ret = uv_timer_start(timer, cb, timeout, repeat);
-	if (ret != 0) {
-		uv_timer_stop(timer);
-		return kr_error(ENOMEM);
+	struct subreq_shared_entry entry;
+	if (!worker->subreq_shared || klen <= 0 ||
+	    shtable_get(worker->subreq_shared, key, klen, &entry) != 0) {
+		return false;
 	}
-	return 0;
+	return entry.leader != worker->id && entry.deadline > kr_now();
 }
 
-static void subreq_finalize(struct qr_task *task, const struct sockaddr *packet_source, knot_pkt_t *pkt)
+/** @internal Clear our lead of the subrequest in the shared registry. */
+static void subreq_shared_release(struct worker_ctx *worker, const char *key, int klen)
 {
-	/* Close pending timer */
-	ioreq_kill_pending(task);
-	/* Clear from outgoing table. */
-	if (!task->leading)
+	struct subreq_shared_entry entry;
+	if (!worker->subreq_shared ||
+	    shtable_get(worker->subreq_shared, key, klen, &entry) != 0 ||
+	    entry.leader != worker->id) {
 		return;
+	}
+	entry.deadline = 0;
+	(void) shtable_set(worker->subreq_shared, key, klen, &entry);
+}
+
+static void on_subreq_shared_wait(struct tw_timer *timer)
+{
+	struct session *session = timer->data;
+	assert(session->tasks.len == 1);
+	struct qr_task *task = session->tasks.at[0];
 	char key[SUBREQ_KEY_LEN];
 	const int klen = subreq_key(key, task->pktbuf);
-	if (klen > 0) {
-		void *val_deleted;
-		int ret = trie_del(task->ctx->worker->subreq_out, key, klen, &val_deleted);
-		assert(ret == KNOT_EOK && val_deleted == task);
+	if (subreq_shared_busy(task->ctx->worker, key, klen)) {
+		return; /* Keep waiting. */
 	}
-	/* Notify waiting tasks. */
-	struct kr_query *leader_qry = array_tail(task->ctx->req.rplan.pending);
-	for (size_t i = task->waiting.len; i > 0; i--) {
-		struct qr_task *follower = task->waiting.at[i - 1];
-		/* Reuse MSGID and 0x20 secret */
-		if (follower->ctx->req.rplan.pending.len > 0) {
+	tw_stop(timer);
+	/* The other fork has finished (or given up), so retry from the cache;
+	 * if the answer isn't there, we'll just ask ourselves. */
+	subreq_finalize(task, NULL, NULL);
+	struct kr_query *qry = array_tail(task->ctx->req.rplan.pending);
+	qry->flags.CACHE_TRIED = false;
+	task->addrlist = NULL;
+	task->addrlist_count = 0;
+	task->addrlist_turn = 0;
+	qr_task_produce(task, KR_STATE_PRODUCE, NULL, NULL);
+}
+
+/** Wait for another fork leading the same subrequest, instead of sending it.
+ * @return true if the task is waiting */
+static bool subreq_shared_follow(struct qr_task *task)
+{
+	struct worker_ctx *worker = task->ctx->worker;
+	struct kr_query *qry = array_tail(task->ctx->req.rplan.pending);
+	if (!worker->subreq_shared || !qry || qry->flags.NO_CACHE) {
+		return false; /* Cache wouldn't help us anyway. */
+	}
+	char key[SUBREQ_KEY_LEN];
+	const int klen = subreq_key(key, task->pktbuf);
+	if (!subreq_shared_busy(worker, key, klen)) {
+		return false;
+	}
+	/* Spawned handle is only used for its timer, nothing is sent. */
+	uv_handle_t *handle = ioreq_spawn(task, SOCK_DGRAM, task->addrlist->sa_family);
+	if (!handle) {
+		return false;
+	}
+	struct session *session = handle->data;
+	if (session_timer_start(session, on_subreq_shared_wait,
+				SUBREQ_SHARED_POLL, SUBREQ_SHARED_POLL) != 0) {
+		ioreq_kill_pending(task);
+		return false;
+	}
+	worker->stats.shared_waits += 1;
+	return true;
+}
+
+static void subreq_finalize(struct qr_task *task, const struct sockaddr *packet_source, knot_pkt_t *pkt)
+{
+	/* Close pending timer */
+	ioreq_kill_pending(task);
+	/* Clear from outgoing table. */
+	if (!task->leading)
+		return;
+	char key[SUBREQ_KEY_LEN];
+	const int klen = subreq_key(key, task->pktbuf);
+	if (klen > 0) {
+		void *val_deleted;
+		int ret = trie_del(task->ctx->worker->subreq_out, key, klen, &val_deleted);
+		assert(ret == KNOT_EOK && val_deleted == task);
+		subreq_shared_release(task->ctx->worker, key, klen);
+	}
+	/* Notify waiting tasks. */
+	struct kr_query *leader_qry = array_tail(task->ctx->req.rplan.pending);
+	for (size_t i = task->waiting.len; i > 0; i--) {
+		struct qr_task *follower = task->waiting.at[i - 1];
+		/* Reuse MSGID and 0x20 secret */
+		if (follower->ctx->req.rplan.pending.len > 0) {
 			struct kr_query *qry = array_tail(follower->ctx->req.rplan.pending);
 			qry->id = leader_qry->id;
 			qry->secret = leader_qry->secret;
@@ -1472,6 +2545,15 @@ static void subreq_lead(struct qr_task *task)
 	}
 	*tvp = task;
 	task->leading = true;
+	/* Announce the lead to other forks as well. */
+	struct worker_ctx *worker = task->ctx->worker;
+	if (worker->subreq_shared) {
+		const struct subreq_shared_entry entry = {
+			.leader = worker->id,
+			.deadline = kr_now() + KR_CONN_RTT_MAX,
+		};
+		(void) shtable_set(worker->subreq_shared, key, klen, &entry);
+	}
 }
 
 static bool subreq_enqueue(struct qr_task *task)
@@ -1502,9 +2584,14 @@ static int qr_task_finalize(struct qr_task *task, int state)
 		return 0;
 	}
 	struct request_ctx *ctx = task->ctx;
+	inflight_del(ctx);
 	kr_resolve_finish(&ctx->req, state);
 	task->finished = true;
-	if (ctx->source.session == NULL) {
+	if (ctx->source.session == NULL || ctx->req.answer_dropped) {
+		/* The DoH client isn't left waiting on the stream. */
+		if (ctx->source.session && ctx->source.session->http_ctx) {
+			(void) http_send(ctx->source.session->http_ctx, ctx->source.stream, NULL);
+		}
 		(void) qr_task_on_send(task, NULL, kr_error(EIO));
 		return state == KR_STATE_DONE ? 0 : kr_error(EIO);
 	}
@@ -1515,6 +2602,9 @@ static int qr_task_finalize(struct qr_task *task, int state)
 	assert(source_session->closing == false);
 	assert(handle && handle->data == ctx->source.session);
 	assert(ctx->source.addr.ip.sa_family != AF_UNSPEC);
+	if (knot_wire_get_tc(ctx->req.answer->wire)) {
+		ctx->worker->stats.truncated += 1;
+	}
 	int res = qr_task_send(task, handle,
 			       (struct sockaddr *)&ctx->source.addr,
 			        ctx->req.answer);
@@ -1523,20 +2613,15 @@ static int qr_task_finalize(struct qr_task *task, int state)
 	} else if (handle->type == UV_TCP) {
 		/* Don't try to close source session at least
 		 * retry_interval_for_timeout_timer milliseconds */
-		uv_timer_again(&ctx->source.session->timeout);
+		session_timer_again(ctx->source.session);
 	}
 
 	return state == KR_STATE_DONE ? 0 : kr_error(EIO);
 }
 
-static int qr_task_step(struct qr_task *task,
-			const struct sockaddr *packet_source, knot_pkt_t *packet)
+static int task_step(struct qr_task *task,
+		     const struct sockaddr *packet_source, knot_pkt_t *packet)
 {
-	/* No more steps after we're finished. */
-	if (!task || task->finished) {
-		return kr_error(ESTALE);
-	}
-
 	/* Close pending I/O requests */
 	subreq_finalize(task, packet_source, packet);
 	/* Consume input and produce next query */
@@ -1544,11 +2629,11 @@ static int qr_task_step(struct qr_task *task,
 	assert(ctx);
 	struct kr_request *req = &ctx->req;
 	struct worker_ctx *worker = ctx->worker;
-	int sock_type = -1;
 	task->addrlist = NULL;
 	task->addrlist_count = 0;
 	task->addrlist_turn = 0;
 	req->has_tls = (ctx->source.session && ctx->source.session->has_tls);
+	cache_batch_start(worker);
 
 	if (worker->too_many_open) {
 		struct kr_rplan *rplan = &req->rplan;
@@ -1563,6 +2648,62 @@ static int qr_task_step(struct qr_task *task,
 	}
 
 	int state = kr_resolve_consume(req, packet_source, packet);
+	return qr_task_produce(task, state, packet_source, packet);
+}
+
+static int qr_task_step(struct qr_task *task,
+			const struct sockaddr *packet_source, knot_pkt_t *packet)
+{
+	/* No more steps after we're finished. */
+	if (!task || task->finished) {
+		return kr_error(ESTALE);
+	}
+	struct worker_ctx *worker = task->ctx->worker;
+	const uint64_t prof_since = worker_prof_begin(worker);
+	if (!prof_since) {
+		return task_step(task, packet_source, packet);
+	}
+	/* The task may be freed by the step, the slowest layer is kept in the context. */
+	struct kr_context *ctx = &worker->engine->resolver;
+	ctx->slow_layer.module = NULL;
+	ctx->slow_layer.us = 0;
+	ctx->slow_layer.on = true;
+	int ret = task_step(task, packet_source, packet);
+	ctx->slow_layer.on = false;
+	const struct kr_module *mod = ctx->slow_layer.module;
+	worker_prof_end(worker, PROF_TASK, prof_since, mod ? mod->name : NULL);
+	return ret;
+}
+
+/** @internal Shed the request rather than asking upstream for it, see worker->overload.
+ * Only the requests just going for their first upstream query are shed; those from
+ * TCP clients (not spoofed) and those flagged NO_SHED (e.g. by a view) never are. */
+static bool overload_shed(struct worker_ctx *worker, const struct request_ctx *ctx)
+{
+	const bool overloaded =
+		(worker->overload.requests && worker->stats.rconcurrent > worker->overload.requests) ||
+		(worker->overload.lag && worker->stats.loop_lag > worker->overload.lag);
+	const struct kr_request *req = &ctx->req;
+	if (!overloaded || req->upstream_count != 1 || req->options.NO_SHED) {
+		return false;
+	}
+	const struct kr_query *first = req->rplan.pending.len > 0 ? req->rplan.pending.at[0] : NULL;
+	if (first && first->flags.NO_SHED) {
+		return false;
+	}
+	const struct session *session = ctx->source.session;
+	return !session || session->handle->type != UV_TCP;
+}
+
+/** Produce next queries until there's something to send or the resolution ends;
+ * this is the second part of qr_task_step(). */
+static int qr_task_produce(struct qr_task *task, int state,
+			   const struct sockaddr *packet_source, knot_pkt_t *packet)
+{
+	struct request_ctx *ctx = task->ctx;
+	struct kr_request *req = &ctx->req;
+	struct worker_ctx *worker = ctx->worker;
+	int sock_type = -1;
 	while (state == KR_STATE_PRODUCE) {
 		state = kr_resolve_produce(req, &task->addrlist,
 					   &sock_type, task->pktbuf);
@@ -1578,6 +2719,10 @@ static int qr_task_step(struct qr_task *task,
 	} else if (!task->addrlist || sock_type < 0) {
 		return qr_task_step(task, NULL, NULL);
 	}
+	if (overload_shed(worker, ctx)) {
+		worker->stats.overload_shed += 1;
+		return qr_task_finalize(task, KR_STATE_FAIL);
+	}
 
 	/* Count available address choices */
 	struct sockaddr_in6 *choice = (struct sockaddr_in6 *)task->addrlist;
@@ -1593,30 +2738,33 @@ static int qr_task_step(struct qr_task *task,
 		if (subreq_enqueue(task)) {
 			return kr_ok(); /* Will be notified when outgoing query finishes. */
 		}
+		/* Another fork may be asking the same, wait for its answer in cache. */
+		if (subreq_shared_follow(task)) {
+			return kr_ok();
+		}
 		/* Start transmitting */
+		task->sent_at = kr_now();
 		uv_handle_t *handle = retransmit(task);
 		if (handle == NULL) {
 			return qr_task_step(task, NULL, NULL);
 		}
+		/* The pool may race the first two forwarders, see kr_fwd_pool_create(). */
+		if (kr_fwd_pool_race(req->fwd_pool) && task->addrlist_count > 1) {
+			(void) retransmit(task);
+		}
 		/* Check current query NSLIST */
 		struct kr_query *qry = array_tail(req->rplan.pending);
 		assert(qry != NULL);
-		/* Retransmit at default interval, or more frequently if the mean
-		 * RTT of the server is better. If the server is glued, use default rate. */
-		size_t timeout = qry->ns.score;
-		if (timeout > KR_NS_GLUED) {
-			/* We don't have information about variance in RTT, expect +10ms */
-			timeout = MIN(qry->ns.score + 10, KR_CONN_RETRY);
-		} else {
-			timeout = KR_CONN_RETRY;
-		}
+		/* Retransmit at default interval, or sooner if the mean
+		 * RTT of the server is better. */
+		uint64_t timeout = stale_wait(task, hedge_timeout(task, qry));
 		/* Announce and start subrequest.
 		 * @note Only UDP can lead I/O as it doesn't touch 'task->pktbuf' for reassembly.
 		 */
 		subreq_lead(task);
 		struct session *session = handle->data;
 		assert(session->handle->type == UV_UDP);
-		ret = timer_start(session, on_retransmit, timeout, 0);
+		ret = session_timer_start(session, on_retransmit, timeout, 0);
 		/* Start next step with timeout, fatal if can't start a timer. */
 		if (ret != 0) {
 			subreq_finalize(task, packet_source, packet);
@@ -1677,6 +2825,7 @@ static int qr_task_step(struct qr_task *task,
 				subreq_finalize(task, packet_source, packet);
 				return qr_task_finalize(task, KR_STATE_FAIL);
 			}
+			worker->stats.tcp_reused += 1;
 			ret = session_add_tasks(session, task);
 			if (ret < 0) {
 				session_del_waiting(session, task);
@@ -1700,9 +2849,8 @@ static int qr_task_step(struct qr_task *task,
 					return qr_task_finalize(task, KR_STATE_FAIL);
 				}
 				if (session->tasks.len == 1) {
-					uv_timer_stop(&session->timeout);
-					ret = timer_start(session, on_tcp_watchdog_timeout,
-							  MAX_TCP_INACTIVITY, 0);
+					ret = session_timer_start(session, on_tcp_watchdog_timeout,
+								  MAX_TCP_INACTIVITY, 0);
 				}
 				if (ret < 0) {
 					session_del_waiting(session, task);
@@ -1754,8 +2902,8 @@ static int qr_task_step(struct qr_task *task,
 			/* Check if there must be TLS */
 			struct engine *engine = ctx->worker->engine;
 			struct network *net = &engine->net;
-			const char *key = tcpsess_key(addr);
-			struct tls_client_paramlist_entry *entry = map_get(&net->tls_client_params, key);
+			struct tls_client_paramlist_entry *entry =
+				tls_client_params_get(net->tls_client_params, addr);
 			if (entry) {
 				assert(session->tls_client_ctx == NULL);
 				struct tls_client_ctx_t *tls_ctx = tls_client_ctx_new(entry, worker);
@@ -1775,8 +2923,8 @@ static int qr_task_step(struct qr_task *task,
 			conn->data = session;
 			memcpy(&session->peer, addr, sizeof(session->peer));
 
-			ret = timer_start(session, on_tcp_connect_timeout,
-					  KR_CONN_RTT_MAX, 0);
+			ret = session_timer_start(session, on_tcp_connect_timeout,
+						  KR_CONN_RTT_MAX, 0);
 			if (ret != 0) {
 				session_del_tasks(session, task);
 				session_del_waiting(session, task);
@@ -1795,7 +2943,7 @@ static int qr_task_step(struct qr_task *task,
 
 			if (uv_tcp_connect(conn, (uv_tcp_t *)client,
 					   addr , on_connect) != 0) {
-				uv_timer_stop(&session->timeout);
+				tw_stop(&session->timer);
 				session_del_tasks(session, task);
 				session_del_waiting(session, task);
 				worker_del_tcp_waiting(ctx->worker, addr);
@@ -1828,8 +2976,86 @@ static int parse_packet(knot_pkt_t *query)
 	return kr_ok();
 }
 
+/** Parse a client query in stages: the header and the question, and the OPT
+ * only checked in place if it's all the rest, so that the dropped queries,
+ * the retransmits and the fast-path answers don't parse and allocate the records.
+ * The rest is left to parse_query_rest(); the other queries are parsed whole. */
+static int parse_query(knot_pkt_t *query)
+{
+	if (!query) {
+		return kr_error(EINVAL);
+	}
+	const uint8_t *wire = query->wire;
+	if (query->size < KNOT_WIRE_HEADER_SIZE || knot_wire_get_qdcount(wire) != 1
+	    || knot_wire_get_ancount(wire) != 0 || knot_wire_get_nscount(wire) != 0
+	    || knot_wire_get_arcount(wire) > 1) {
+		return parse_packet(query);
+	}
+	if (knot_pkt_parse_question(query) != KNOT_EOK) {
+		return kr_error(EPROTO);
+	}
+	const size_t rest = query->size - query->parsed;
+	if (knot_wire_get_arcount(wire) == 0) {
+		return rest == 0 ? kr_ok() : kr_error(EMSGSIZE);
+	}
+	/* Root owner, type OPT and the RDATA up to the end of the message. */
+	const uint8_t *opt = wire + query->parsed;
+	if (rest < KNOT_EDNS_MIN_SIZE || opt[0] != '\0'
+	    || knot_wire_read_u16(opt + 1) != KNOT_RRTYPE_OPT
+	    || knot_wire_read_u16(opt + 9) != rest - KNOT_EDNS_MIN_SIZE) {
+		return parse_packet(query);
+	}
+	return kr_ok();
+}
+
+/** Parse the records that parse_query() left behind the question, if any. */
+static int parse_query_rest(knot_pkt_t *query)
+{
+	if (query->parsed == query->size) {
+		return kr_ok();
+	}
+	return parse_packet(query);
+}
+
+/** EDNS of a client query, from its OPT or in place from the wire. */
+struct query_edns {
+	uint16_t payload;
+	uint8_t version;
+	bool dnssec;
+	uint16_t rdlen;
+};
+
+/** @return true if the query has the OPT, see parse_query() */
+static bool query_edns(const knot_pkt_t *query, struct query_edns *edns)
+{
+	if (query->parsed < query->size) {
+		/* Root owner, type, payload, ext. rcode, version, flags, rdlen. */
+		const uint8_t *opt = query->wire + query->parsed;
+		edns->payload = knot_wire_read_u16(opt + 3);
+		edns->version = opt[6];
+		edns->dnssec = knot_wire_read_u16(opt + 7) & KNOT_EDNS_DO_MASK;
+		edns->rdlen = knot_wire_read_u16(opt + 9);
+		return true;
+	}
+	const knot_rrset_t *opt = query->opt_rr;
+	if (!opt) {
+		return false;
+	}
+	edns->payload = knot_edns_get_payload(opt);
+	edns->version = knot_edns_get_version(opt);
+	edns->dnssec = knot_edns_do(opt);
+	edns->rdlen = knot_rdata_rdlen(knot_rdataset_at(&opt->rrs, 0));
+	return true;
+}
+
 static struct qr_task* find_task(const struct session *session, uint16_t msg_id)
 {
+	if (session->ids) {
+		const uint32_t *slot = ids_slot(session->ids, msg_id);
+		struct qr_task *task = slot ? session->tasks.at[*slot - 1] : NULL;
+		/* Not if it has moved on to another query meanwhile. */
+		return task && knot_wire_get_id(task->pktbuf->wire) == msg_id ? task : NULL;
+	}
 	struct qr_task *ret = NULL;
 	const qr_tasklist_t *tasklist = &session->tasks;
 	for (size_t i = 0; i < tasklist->len; ++i) {
@@ -1844,6 +3070,52 @@ static struct qr_task* find_task(const struct session *session, uint16_t msg_id)
 }
 
 
+/** Start resolving a parsed query from a client. */
+static int submit_query(struct worker_ctx *worker, uv_handle_t *handle,
+			knot_pkt_t *query, const struct sockaddr *addr)
+{
+	/* A retransmit of a query in progress just waits for its answer,
+	 * it goes to the same client and port with the same ID. */
+	char key[INFLIGHT_KEY_MAXLEN];
+	int key_len = -1;
+	if (handle->type == UV_UDP || handle->type == UV_POLL) {
+		key_len = inflight_key(key, handle, addr, query);
+		if (key_len > 0 && trie_get_try(worker->inflight, key, key_len)) {
+			worker->stats.retransmits += 1;
+			return kr_ok();
+		}
+	}
+	if (parse_query_rest(query) != 0) {
+		worker->stats.dropped += 1;
+		return kr_error(EILSEQ);
+	}
+
+	struct request_ctx *ctx = request_create(worker, handle, addr);
+	if (!ctx) {
+		return kr_error(ENOMEM);
+	}
+
+	int ret = request_start(ctx, query);
+	if (ret != 0) {
+		request_free(ctx);
+		return kr_error(ENOMEM);
+	}
+	kr_probe(query_recv, &ctx->req, knot_pkt_qname(query), knot_pkt_qtype(query), addr);
+
+	struct qr_task *task = qr_task_create(ctx);
+	if (!task) {
+		request_free(ctx);
+		return kr_error(ENOMEM);
+	}
+	if (key_len > 0) {
+		inflight_add(ctx, key, key_len);
+	}
+	assert(uv_is_closing(handle) == false);
+
+	/* Consume input and produce next message */
+	return qr_task_step(task, NULL, query);
+}
+
 int worker_submit(struct worker_ctx *worker, uv_handle_t *handle,
 		  knot_pkt_t *query, const struct sockaddr* addr)
 {
@@ -1855,8 +3127,8 @@ int worker_submit(struct worker_ctx *worker, uv_handle_t *handle,
 
 	struct session *session = handle->data;
 
-	/* Parse packet */
-	int ret = parse_packet(query);
+	/* Parse packet, a query only in part, see parse_query() */
+	int ret = session->outgoing ? parse_packet(query) : parse_query(query);
 
 	/* Start new task on listening sockets,
 	 * or resume if this is subrequest */
@@ -1867,29 +3139,22 @@ int worker_submit(struct worker_ctx *worker, uv_handle_t *handle,
 			if (query) worker->stats.dropped += 1;
 			return kr_error(EILSEQ);
 		}
-		struct request_ctx *ctx = request_create(worker, handle, addr);
-		if (!ctx) {
-			return kr_error(ENOMEM);
-		}
-
-		ret = request_start(ctx, query);
-		if (ret != 0) {
-			request_free(ctx);
-			return kr_error(ENOMEM);
-		}
-
-		task = qr_task_create(ctx);
-		if (!task) {
-			request_free(ctx);
-			return kr_error(ENOMEM);
-		}
-		addr = NULL;
+		return submit_query(worker, handle, query, addr);
 	} else if (query) { /* response from upstream */
 		task = find_task(session, knot_wire_get_id(query->wire));
 		if (task == NULL) {
+			if (handle->type == UV_UDP) {
+				/* Maybe just late, maybe spoofing attempts; retire the port. */
+				session->udp_stray = true;
+			}
 			return kr_error(ENOENT);
 		}
 		assert(session->closing == false);
+		kr_probe(upstream_recv, &task->ctx->req, addr, query->size);
+		if (task->hedged && task->pending_count > 1 && handle != task->pending[0]) {
+			worker->stats.hedges_won += 1;
+			task->hedged = false; /* count once */
+		}
 	}
 	assert(uv_is_closing(session->handle) == false);
 
@@ -1897,61 +3162,261 @@ int worker_submit(struct worker_ctx *worker, uv_handle_t *handle,
 	return qr_task_step(task, addr, query);
 }
 
-static int map_add_tcp_session(map_t *map, const struct sockaddr* addr,
-			       struct session *session)
+/** Key to put the same questions of a wave next to each other. */
+static uint32_t question_hash(const knot_pkt_t *pkt)
 {
-	assert(map && addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	assert(map_contains(map, key) == 0);
-	int ret = map_set(map, key, session);
-	return ret ? kr_error(EINVAL) : kr_ok();
+	const uint8_t *qname = knot_pkt_qname(pkt);
+	uint32_t h = 2166136261u; /* FNV-1a */
+	for (size_t i = 0, len = qname ? knot_dname_size(qname) : 0; i < len; ++i) {
+		h = (h ^ qname[i]) * 16777619u;
+	}
+	return (h ^ knot_pkt_qtype(pkt)) * 16777619u;
 }
 
-static int map_del_tcp_session(map_t *map, const struct sockaddr* addr)
+static bool question_equal(const knot_pkt_t *a, const knot_pkt_t *b)
 {
-	assert(map && addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	int ret = map_del(map, key);
-	return ret ? kr_error(ENOENT) : kr_ok();
+	const uint8_t *qa = knot_pkt_qname(a), *qb = knot_pkt_qname(b);
+	return qa && qb && knot_pkt_qtype(a) == knot_pkt_qtype(b)
+		&& knot_pkt_qclass(a) == knot_pkt_qclass(b)
+		&& knot_dname_size(qa) == knot_dname_size(qb)
+		&& memcmp(qa, qb, knot_dname_size(qa)) == 0;
 }
 
-static struct session* map_find_tcp_session(map_t *map,
-					    const struct sockaddr *addr)
+#if __linux__
+/** Answer a plain A/AAAA query straight from cache, without a request, if all
+ * layers allow it (engine->fast_path).  The answer is built in the receive-ring
+ * slot of the query, right behind it, and sent with the batch in worker->udp_out.
+ * @return 0 if answered, an error if the query needs the full resolution */
+static int fast_path(struct worker_ctx *worker, uv_udp_t *handle,
+		     const knot_pkt_t *query, const struct sockaddr *peer)
 {
-	assert(map && addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	struct session* ret = map_get(map, key);
+	struct engine *engine = worker->engine;
+	const uint8_t *qwire = query->wire;
+	const uint8_t *mem = worker->wire_ring.mem;
+	const uint16_t qtype = knot_pkt_qtype(query);
+	if (!engine->fast_path || !mem || qwire < mem
+	    || qwire >= mem + (size_t)WIRE_RING_SLOTS * WIRE_SLOT_SIZE
+	    || knot_wire_get_opcode(qwire) != KNOT_OPCODE_QUERY
+	    || !knot_wire_get_rd(qwire) || knot_wire_get_cd(qwire)
+	    || knot_wire_get_ad(qwire) || knot_wire_get_tc(qwire)
+	    || knot_wire_get_qdcount(qwire) != 1 || knot_wire_get_ancount(qwire) != 0
+	    || knot_wire_get_nscount(qwire) != 0 || query->tsig_rr
+	    || knot_pkt_qclass(query) != KNOT_CLASS_IN
+	    || (qtype != KNOT_RRTYPE_A && qtype != KNOT_RRTYPE_AAAA)) {
+		return kr_error(ENOTSUP);
+	}
+	/* The cached answer is for any client, not tailored to its subnet, see net.ecs(). */
+	if (kr_ecs_covers(&engine->resolver.ecs, peer, knot_pkt_qname(query))) {
+		return kr_error(ENOTSUP);
+	}
+	/* EDNS is fine as long as there's nothing to it but the payload size. */
+	struct query_edns opt;
+	const bool edns = query_edns(query, &opt);
+	if (knot_wire_get_arcount(qwire) != (edns ? 1 : 0)
+	    || (edns && (opt.version != 0 || opt.dnssec || opt.rdlen != 0))) {
+		return kr_error(ENOTSUP);
+	}
+	const knot_rrset_t *our_opt = engine->resolver.opt_rr;
+	if (edns && !our_opt) {
+		return kr_error(ENOTSUP);
+	}
+	size_t answer_max = KNOT_WIRE_MIN_PKTSIZE;
+	if (edns) {
+		answer_max = MAX(opt.payload, KNOT_WIRE_MIN_PKTSIZE);
+		answer_max = MIN(answer_max, knot_edns_get_payload(our_opt));
+	}
+	/* The rest of the slot; the query fits in it, see worker_wire_getbuf(). */
+	const size_t offset = (qwire - mem) % WIRE_SLOT_SIZE;
+	answer_max = MIN(answer_max, WIRE_SLOT_SIZE - offset - query->size);
+
+	const size_t opt_size = edns ? KNOT_EDNS_MIN_SIZE : 0;
+	const size_t head_size = KNOT_WIRE_HEADER_SIZE + knot_pkt_qname_size(query) + 2 * sizeof(uint16_t);
+	if (head_size + opt_size > answer_max) {
+		return kr_error(ENOSPC);
+	}
+	uint8_t *wire = (uint8_t *)qwire + query->size;
+	size_t written = 0;
+	int ret = kr_cache_answer_exact(&engine->resolver.cache, knot_pkt_qname(query), qtype,
+					kr_time(), wire + head_size,
+					answer_max - head_size - opt_size, &written);
+	if (ret <= 0) {
+		return ret < 0 ? ret : kr_error(ENOENT);
+	}
+	memcpy(wire, qwire, head_size);
+	knot_wire_set_qr(wire);
+	knot_wire_set_ra(wire);
+	knot_wire_clear_aa(wire);
+	knot_wire_set_rcode(wire, KNOT_RCODE_NOERROR);
+	knot_wire_set_ancount(wire, ret);
+	knot_wire_set_arcount(wire, edns ? 1 : 0);
+	size_t size = head_size + written;
+	if (edns) { /* Root owner, then type, payload, ext. rcode, version, flags, rdlen. */
+		uint8_t *rr = wire + size;
+		rr[0] = 0;
+		knot_wire_write_u16(rr + 1, KNOT_RRTYPE_OPT);
+		knot_wire_write_u16(rr + 3, knot_edns_get_payload(our_opt));
+		knot_wire_write_u32(rr + 5, 0);
+		knot_wire_write_u16(rr + 9, 0);
+		size += KNOT_EDNS_MIN_SIZE;
+	}
+	ret = udp_out_push(worker, NULL, handle, peer, wire, size);
+	if (ret == 0) {
+		worker->stats.queries += 1;
+		worker->stats.fast_path += 1;
+	}
 	return ret;
 }
+#endif
+
+/** Process the queries received during the loop iteration: parse them all first,
+ * then resolve them with the same questions next to each other, so that the
+ * repeated ones are answered from hot cache pages.  The lookups of the wave
+ * share one cache transaction, see cache_batch_start(). */
+static void udp_wave_flush(struct worker_ctx *worker)
+{
+	const unsigned len = worker->udp_wave.len;
+	if (len == 0) {
+		return;
+	}
+	worker->udp_wave.len = 0;
+	const uint64_t prof_since = worker_prof_begin(worker);
+	cache_batch_start(worker);
+	knot_pkt_t *pkt[UDP_WAVE_MAX];
+	uint32_t key[UDP_WAVE_MAX];
+	unsigned order[UDP_WAVE_MAX];
+	unsigned count = 0;
+	for (unsigned i = 0; i < len; ++i) {
+		struct udp_wave_query *q = &worker->udp_wave.at[i];
+		struct session *session = q->handle->data;
+		pkt[i] = NULL;
+		if (uv_is_closing((uv_handle_t *)q->handle) || !session || session->closing) {
+			continue;
+		}
+		pkt[i] = knot_pkt_new((uint8_t *)q->wire, q->size, &worker->pkt_pool);
+		if (!pkt[i]) {
+			continue;
+		}
+		pkt[i]->max_size = KNOT_WIRE_MAX_PKTSIZE;
+		if (parse_query(pkt[i]) != 0 || knot_wire_get_qr(pkt[i]->wire)) {
+			worker->stats.dropped += 1;
+			pkt[i] = NULL;
+			continue;
+		}
+		/* Insertion sort, stable and the wave is short. */
+		key[i] = question_hash(pkt[i]);
+		unsigned j = count++;
+		for (; j > 0 && key[order[j - 1]] > key[i]; --j) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	for (unsigned k = 0; k < count; ++k) {
+		const unsigned i = order[k];
+		if (k > 0 && key[order[k - 1]] == key[i] && question_equal(pkt[order[k - 1]], pkt[i])) {
+			worker->stats.udp_wave_dups += 1;
+		}
+		struct udp_wave_query *q = &worker->udp_wave.at[i];
+#if __linux__
+		if (fast_path(worker, q->handle, pkt[i], &q->addr.ip) == 0) {
+			continue;
+		}
+#endif
+		submit_query(worker, (uv_handle_t *)q->handle, pkt[i], &q->addr.ip);
+	}
+	/* The requests hold the slots they need. */
+	for (unsigned i = 0; i < len; ++i) {
+		worker_wire_release(worker, worker->udp_wave.at[i].wire);
+	}
+	mp_flush(worker->pkt_pool.ctx);
+	worker->stats.udp_waves += 1;
+	worker->stats.udp_wave_queries += len;
+	worker_prof_end(worker, PROF_UDP, prof_since, NULL);
+}
+
+int worker_udp_wave_push(struct worker_ctx *worker, uv_udp_t *handle,
+			 const uint8_t *wire, size_t size, const struct sockaddr *addr)
+{
+	const int addr_len = kr_sockaddr_len(addr);
+	if (addr_len <= 0 || (size_t)addr_len > sizeof(union inaddr) || size > UINT16_MAX
+	    || out_flush_start(worker) != 0) {
+		return kr_error(ENOTSUP);
+	}
+	if (worker->udp_wave.len == UDP_WAVE_MAX) {
+		udp_wave_flush(worker);
+	}
+	if (!worker_wire_hold(worker, wire)) {
+		return kr_error(ENOTSUP);
+	}
+	struct udp_wave_query *q = &worker->udp_wave.at[worker->udp_wave.len++];
+	q->handle = handle;
+	q->wire = wire;
+	q->size = size;
+	memcpy(&q->addr, addr, addr_len);
+	return kr_ok();
+}
+
+static int trie_add_tcp_session(trie_t *tbl, const struct sockaddr* addr,
+				struct session *session)
+{
+	assert(tbl && addr);
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int len = kr_sockaddr_key(key, addr);
+	if (len < 0) {
+		return len;
+	}
+	trie_val_t *val = trie_get_ins(tbl, key, len);
+	if (!val) {
+		return kr_error(ENOMEM);
+	}
+	assert(*val == NULL);
+	*val = session;
+	return kr_ok();
+}
+
+static int trie_del_tcp_session(trie_t *tbl, const struct sockaddr* addr)
+{
+	assert(tbl && addr);
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int len = kr_sockaddr_key(key, addr);
+	if (len < 0) {
+		return len;
+	}
+	int ret = trie_del(tbl, key, len, NULL);
+	return ret ? kr_error(ENOENT) : kr_ok();
+}
+
+static struct session* trie_find_tcp_session(trie_t *tbl,
+					     const struct sockaddr *addr)
+{
+	assert(tbl && addr);
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int len = kr_sockaddr_key(key, addr);
+	if (len < 0) {
+		return NULL;
+	}
+	trie_val_t *val = trie_get_try(tbl, key, len);
+	return val ? *val : NULL;
+}
 
 static int worker_add_tcp_connected(struct worker_ctx *worker,
 				    const struct sockaddr* addr,
 				    struct session *session)
 {
 	assert(addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	assert(map_contains(&worker->tcp_connected, key) == 0);
-	return map_add_tcp_session(&worker->tcp_connected, addr, session);
+	return trie_add_tcp_session(worker->tcp_connected, addr, session);
 }
 
 static int worker_del_tcp_connected(struct worker_ctx *worker,
 				    const struct sockaddr* addr)
 {
 	assert(addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	int ret = map_del_tcp_session(&worker->tcp_connected, addr);
-	return ret;
+	return trie_del_tcp_session(worker->tcp_connected, addr);
 }
 
 static struct session* worker_find_tcp_connected(struct worker_ctx *worker,
 						 const struct sockaddr* addr)
 {
-	return map_find_tcp_session(&worker->tcp_connected, addr);
+	return trie_find_tcp_session(worker->tcp_connected, addr);
 }
 
 static int worker_add_tcp_waiting(struct worker_ctx *worker,
@@ -1959,27 +3424,20 @@ static int worker_add_tcp_waiting(struct worker_ctx *worker,
 				  struct session *session)
 {
 	assert(addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	assert(map_contains(&worker->tcp_waiting, key) == 0);
-	int ret = map_add_tcp_session(&worker->tcp_waiting, addr, session);
-	return ret;
+	return trie_add_tcp_session(worker->tcp_waiting, addr, session);
 }
 
 static int worker_del_tcp_waiting(struct worker_ctx *worker,
 				  const struct sockaddr* addr)
 {
 	assert(addr);
-	const char *key = tcpsess_key(addr);
-	assert(key);
-	int ret = map_del_tcp_session(&worker->tcp_waiting, addr);
-	return ret;
+	return trie_del_tcp_session(worker->tcp_waiting, addr);
 }
 
 static struct session* worker_find_tcp_waiting(struct worker_ctx *worker,
 					       const struct sockaddr* addr)
 {
-	return map_find_tcp_session(&worker->tcp_waiting, addr);
+	return trie_find_tcp_session(worker->tcp_waiting, addr);
 }
 
 /* Return DNS/TCP message size. */
@@ -2015,6 +3473,98 @@ int worker_end_tcp(struct worker_ctx *worker, uv_handle_t *handle)
 	return 0;
 }
 
+/** Start a query received over a connection from a client.
+ * @param stream	HTTP/2 stream of the query over DoH, or 0
+ * @return 1 if started, or an error */
+static int stream_query_start(struct worker_ctx *worker, uv_stream_t *handle,
+			      knot_pkt_t *pkt, int32_t stream)
+{
+	struct session *session = handle->data;
+	struct sockaddr *addr = &(session->peer.ip);
+	assert(addr->sa_family != AF_UNSPEC);
+	struct request_ctx *ctx = request_create(worker, (uv_handle_t *)handle, addr);
+	if (!ctx) {
+		return kr_error(ENOMEM);
+	}
+	ctx->source.stream = stream;
+	struct qr_task *task = qr_task_create(ctx);
+	if (!task) {
+		request_free(ctx);
+		return kr_error(ENOMEM);
+	}
+	int ret = request_start(ctx, pkt);
+	if (ret == 0) {
+		ret = qr_task_register(task, session);
+	}
+	if (ret != 0) {
+		qr_task_free(task);
+		return ret;
+	}
+	qr_task_step(task, NULL, pkt);
+	return 1;
+}
+
+/** Process a DNS/TCP message that was received whole, without copying it;
+ * @return 1 if a new query was started, 0 if not, or an error */
+static int process_tcp_msg(struct worker_ctx *worker, uv_stream_t *handle,
+			   const uint8_t *msg, uint16_t msg_size)
+{
+	struct session *session = handle->data;
+	/* The packet is parsed right from the read buffer, it's only valid
+	 * until the read callback returns; pkt_pool is flushed there. */
+	knot_pkt_t *pkt = knot_pkt_new((uint8_t *)msg, msg_size, &worker->pkt_pool);
+	if (!pkt) {
+		return kr_error(ENOMEM);
+	}
+	int ret = parse_packet(pkt);
+	struct qr_task *task = NULL;
+	if (!session->outgoing) {
+		/* Ignore badly formed queries, the stream is still in sync. */
+		if (ret != 0 || knot_wire_get_qr(pkt->wire)) {
+			worker->stats.dropped += 1;
+			return 0;
+		}
+		return stream_query_start(worker, handle, pkt, 0);
+	}
+
+	/* Response from upstream, same as in the buffered case. */
+	task = find_task(session, knot_wire_get_id(msg));
+	if (!task) {
+		return 0;
+	}
+	assert(task->leading == false);
+	assert((task->pending_count == 1) && (task->pending[0] == session->handle));
+	task->pending_count = 0;
+	session_del_tasks(session, task);
+	if (ret == 0) {
+		if (session->tasks.len > 0 || session->waiting.len > 0) {
+			session_timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
+		}
+		qr_task_step(task, &session->peer.ip, pkt);
+	}
+	return 0;
+}
+
+int worker_submit_http(struct worker_ctx *worker, uv_stream_t *handle,
+		       const uint8_t *msg, uint16_t len, int32_t stream)
+{
+	struct session *session = handle->data;
+	if (!worker || !session || session->outgoing || session->closing) {
+		return kr_error(EINVAL);
+	}
+	/* Parsed from the buffer of the stream, request_start() copies what it needs. */
+	knot_pkt_t *pkt = knot_pkt_new((uint8_t *)msg, len, &worker->pkt_pool);
+	if (!pkt) {
+		return kr_error(ENOMEM);
+	}
+	if (parse_packet(pkt) != 0 || knot_wire_get_qr(pkt->wire)) {
+		worker->stats.dropped += 1;
+		return kr_error(EILSEQ);
+	}
+	worker->stats.doh += 1;
+	return stream_query_start(worker, handle, pkt, stream);
+}
+
 int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 		       const uint8_t *msg, ssize_t len)
 
@@ -2041,8 +3591,7 @@ int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 				  addr_str, sizeof(addr_str));
 			VERBOSE_MSG(qry, "=> connection to '%s' closed by peer\n", addr_str);
 		}
-		uv_timer_t *timer = &session->timeout;
-		uv_timer_stop(timer);
+		tw_stop(&session->timer);
 		struct sockaddr *peer = &session->peer.ip;
 		worker_del_tcp_connected(worker, peer);
 		session->connected = false;
@@ -2124,9 +3673,31 @@ int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 		assert(session->bytes_to_skip == 0);
 	}
 
+	/* Messages contained in this read as a whole are processed in place,
+	 * only those straddling two reads are copied into the task buffer. */
 	int submitted = 0;
-	struct qr_task *task = session->buffering;
-	knot_pkt_t *pkt_buf = NULL;
+	while (!session->buffering && session->msg_hdr_idx == 0 && len >= 2) {
+		const uint16_t msg_size = get_msg_size(msg);
+		if (msg_size < KNOT_WIRE_HEADER_SIZE || msg_size > len - 2) {
+			break;
+		}
+		int ret = process_tcp_msg(worker, handle, msg + 2, msg_size);
+		if (ret < 0) {
+			return ret;
+		}
+		submitted += ret;
+		msg += msg_size + 2;
+		len -= msg_size + 2;
+		if (session->closing) {
+			return submitted;
+		}
+	}
+	if (len == 0) {
+		return submitted;
+	}
+
+	struct qr_task *task = session->buffering;
+	knot_pkt_t *pkt_buf = NULL;
 	if (task) {
 		pkt_buf = task->pktbuf;
 	} else {
@@ -2152,8 +3723,7 @@ int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 		uint16_t msg_id = knot_wire_get_id(session->msg_hdr + 2);
 		if (msg_size < KNOT_WIRE_HEADER_SIZE) {
 			/* better kill the connection; we would probably get out of sync */
-			uv_timer_t *timer = &session->timeout;
-			uv_timer_stop(timer);
+			tw_stop(&session->timer);
 			while (session->waiting.len > 0) {
 				struct qr_task *task = session->waiting.at[0];
 				if (session->outgoing) {
@@ -2207,7 +3777,7 @@ int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 			 * that we will get multiple matches sooner or later (!) */
 			if (task) {
 				/* Make sure we can process maximum packet sizes over TCP for outbound queries.
-				 * Previous packet is allocated with mempool, so there's no need to free it manually. */
+				 * The larger one is allocated with mempool, the pooled one is released with the task. */
 				if (task->pktbuf->max_size < KNOT_WIRE_MAX_PKTSIZE) {
 						knot_mm_t *pool = &task->pktbuf->mm;
 						pkt_buf = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, pool);
@@ -2302,8 +3872,7 @@ int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 				/* To prevent slow lorris attack restart watchdog only after
 				* the whole message was successfully assembled and parsed */
 				if (session->tasks.len > 0 || session->waiting.len > 0) {
-					uv_timer_stop(&session->timeout);
-					timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
+					session_timer_start(session, on_tcp_watchdog_timeout, MAX_TCP_INACTIVITY, 0);
 				}
 			} else {
 				/* Start only new queries,
@@ -2399,30 +3968,710 @@ void worker_session_close(struct session *session)
 	session_close(session);
 }
 
+static void *mempool_alloc(size_t size)
+{
+	(void) size;
+	return mp_new (4 * CPU_PAGE_SIZE);
+}
+
+static void *session_alloc(size_t size)
+{
+	(void) size;
+	return session_new();
+}
+
+static void session_dtor(void *s)
+{
+	session_free(s);
+}
+
+/** Initialize an object cache, reserve its freelist. */
+static int obj_cache_init(obj_cache_t *cache, size_t obj_size, size_t ring_maxlen,
+			  void *(*alloc)(size_t), void (*dtor)(void *))
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->obj_size = obj_size;
+	cache->alloc = alloc;
+	cache->dtor = dtor;
+	return array_reserve(cache->free, ring_maxlen);
+}
+
+static unsigned wire_slot(const struct worker_ctx *worker, const uint8_t *wire)
+{
+	const uint8_t *mem = worker->wire_ring.mem;
+	if (!mem || !wire || wire < mem || wire >= mem + WIRE_RING_SLOTS * WIRE_SLOT_SIZE) {
+		return WIRE_RING_SLOTS;
+	}
+	return (wire - mem) / WIRE_SLOT_SIZE;
+}
+
+bool worker_wire_getbuf(struct worker_ctx *worker, uv_buf_t *buf)
+{
+	uint8_t *refs = worker->wire_ring.refs;
+	if (!worker->wire_ring.mem) {
+		return false;
+	}
+	/* The slots are reused in order from the head, they stay cache-hot as long
+	 * as the queries are answered right away. */
+	unsigned i = worker->wire_ring.head;
+	for (unsigned scanned = 0; refs[i] != 0; i = (i + 1) % WIRE_RING_SLOTS) {
+		if (++scanned == WIRE_RING_SLOTS) {
+			worker->stats.wire_ring_full += 1;
+			return false;
+		}
+	}
+	unsigned n = 1;
+	while (n < RECVMMSG_BATCH && i + n < WIRE_RING_SLOTS && refs[i + n] == 0) {
+		++n;
+	}
+	worker->wire_ring.head = i;
+	buf->base = (char *)worker->wire_ring.mem + (size_t)i * WIRE_SLOT_SIZE;
+	buf->len = n * WIRE_SLOT_SIZE;
+	return true;
+}
+
+bool worker_wire_hold(struct worker_ctx *worker, const uint8_t *wire)
+{
+	const unsigned i = wire_slot(worker, wire);
+	if (i == WIRE_RING_SLOTS) {
+		return false;
+	}
+	assert(worker->wire_ring.refs[i] < UINT8_MAX);
+	worker->wire_ring.refs[i] += 1;
+	/* The next read goes past the slot. */
+	if (i == worker->wire_ring.head) {
+		worker->wire_ring.head = (i + 1) % WIRE_RING_SLOTS;
+	}
+	return true;
+}
+
+void worker_wire_release(struct worker_ctx *worker, const uint8_t *wire)
+{
+	const unsigned i = wire_slot(worker, wire);
+	if (i == WIRE_RING_SLOTS) {
+		return;
+	}
+	assert(worker->wire_ring.refs[i] > 0);
+	worker->wire_ring.refs[i] -= 1;
+}
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/** Map the receive ring; only the pages touched by the datagrams take memory. */
+static int wire_ring_init(struct worker_ctx *worker)
+{
+	worker->wire_ring.mem = NULL;
+	void *mem = mmap(NULL, (size_t)WIRE_RING_SLOTS * WIRE_SLOT_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return kr_error(errno);
+	}
+#ifdef MADV_HUGEPAGE
+	/* All the ring gets resident then, but the reads of the slots don't miss the TLB. */
+	if (kr_hugepages) {
+		(void) madvise(mem, (size_t)WIRE_RING_SLOTS * WIRE_SLOT_SIZE, MADV_HUGEPAGE);
+	}
+#endif
+	worker->wire_ring.mem = mem;
+	worker->wire_ring.head = 0;
+	memset(worker->wire_ring.refs, 0, sizeof(worker->wire_ring.refs));
+	return kr_ok();
+}
+
+/** Count a request over kr_context::budget, also by the zone. */
+static void on_budget_exceeded(const struct kr_request *req, const knot_dname_t *zone)
+{
+	struct worker_ctx *worker = get_worker();
+	if (!worker) {
+		return;
+	}
+	worker->stats.budget_exceeded += 1;
+	knot_dname_t key[KNOT_DNAME_MAXLEN];
+	int len = zone ? knot_dname_to_wire(key, zone, sizeof(key)) : kr_error(EINVAL);
+	if (len <= 0 || !worker->budget_zones) {
+		return;
+	}
+	knot_dname_to_lower(key);
+	trie_val_t *val = trie_get_try(worker->budget_zones, (const char *)key, len);
+	if (!val && trie_weight(worker->budget_zones) < BUDGET_ZONES_MAX) {
+		val = trie_get_ins(worker->budget_zones, (const char *)key, len);
+	}
+	if (val) {
+		*val = (trie_val_t)((uintptr_t)*val + 1);
+	}
+}
+
 /** Reserve worker buffers */
 static int worker_reserve(struct worker_ctx *worker, size_t ring_maxlen)
 {
-	array_init(worker->pool_mp);
-	array_init(worker->pool_ioreqs);
-	array_init(worker->pool_iohandles);
-	array_init(worker->pool_sessions);
-	if (array_reserve(worker->pool_mp, ring_maxlen) ||
-		array_reserve(worker->pool_ioreqs, ring_maxlen) ||
-		array_reserve(worker->pool_iohandles, ring_maxlen) ||
-		array_reserve(worker->pool_sessions, ring_maxlen)) {
+	/* Mempools are poisoned by mp_poison(), hence zero obj_size. */
+	if (obj_cache_init(&worker->pool_mp, 0, ring_maxlen,
+			   mempool_alloc, (void (*)(void *))mp_delete) ||
+	    obj_cache_init(&worker->pool_ioreqs, sizeof(uv_reqs_t), ring_maxlen,
+			   malloc, free) ||
+	    obj_cache_init(&worker->pool_iohandles, sizeof(uv_handles_t), ring_maxlen,
+			   malloc, free) ||
+	    obj_cache_init(&worker->pool_sessions, sizeof(struct session), ring_maxlen,
+			   session_alloc, session_dtor) ||
+	    obj_cache_init(&worker->pool_tls, sizeof(struct tls_ctx_t), ring_maxlen,
+			   malloc, free) ||
+	    /* Allocated by pktbuf_borrow(), as their size varies. */
+	    obj_cache_init(&worker->pool_pkts, sizeof(knot_pkt_t), ring_maxlen,
+			   NULL, pktbuf_free)) {
 		return kr_error(ENOMEM);
 	}
+	if (wire_ring_init(worker) != 0) {
+		/* Not fatal, the reads just go to the shared worker->wire_buf. */
+		kr_log_error("[worker] can't map the receive ring, using the shared buffer\n");
+	}
 	memset(&worker->pkt_pool, 0, sizeof(worker->pkt_pool));
 	worker->pkt_pool.ctx = mp_new (4 * sizeof(knot_pkt_t));
 	worker->pkt_pool.alloc = (knot_mm_alloc_t) mp_alloc;
-	worker->subreq_out = trie_create(NULL);
-	worker->tcp_connected = map_make(NULL);
-	worker->tcp_waiting = map_make(NULL);
+	worker->subreq_out = trie_create(kr_mm_tagged(KR_MEM_SUBREQ));
+	worker->budget_zones = trie_create(NULL);
+	worker->tcp_connected = trie_create(NULL);
+	worker->tcp_waiting = trie_create(NULL);
+	worker->inflight = trie_create(NULL);
+	worker->tcp_in.prefixes = trie_create(NULL);
 	worker->tcp_pipeline_max = MAX_PIPELINED;
+	worker->tlb_fd = tlb_counter_open();
+	worker->hedge.rtt_pct = HEDGE_RTT_PCT;
+	worker->hedge.budget_pct = HEDGE_BUDGET_PCT;
 	memset(&worker->stats, 0, sizeof(worker->stats));
 	return kr_ok();
 }
 
+static void on_cache_gc(uv_timer_t *timer)
+{
+	struct worker_ctx *worker = timer->data;
+	struct kr_cache *cache = &worker->engine->resolver.cache;
+	if (!kr_cache_is_open(cache)) {
+		return;
+	}
+	int ret = kr_cache_gc(cache, CACHE_GC_BATCH);
+	if (ret < 0) {
+		if (ret == kr_error(ENOSYS)) {
+			uv_timer_stop(timer);
+		}
+		return;
+	}
+	/* Catch up quickly when over the target fill. */
+	const bool hurry = cache->gc.usage > cache->gc.target;
+	uv_timer_set_repeat(timer, hurry ? CACHE_GC_INTERVAL / 100 : CACHE_GC_INTERVAL);
+}
+
+static void on_cache_flush(uv_timer_t *timer)
+{
+	struct worker_ctx *worker = timer->data;
+	struct kr_cache *cache = &worker->engine->resolver.cache;
+	int ret = kr_cache_is_open(cache)
+		? kr_cache_remove_step(cache, CACHE_FLUSH_BATCH) : kr_error(ENOENT);
+	if (ret < 0) {
+		if (ret != kr_error(ENOENT)) {
+			kr_log_error("[cache] removing flushed names failed: %s\n",
+				     kr_strerror(ret));
+		}
+		uv_timer_stop(timer);
+	}
+}
+
+int worker_cache_flush(struct worker_ctx *worker)
+{
+	if (!worker || !worker->cache_flush.data) {
+		return kr_error(EINVAL);
+	}
+	if (uv_is_active((uv_handle_t *)&worker->cache_flush)) {
+		return kr_ok();
+	}
+	return uv_timer_start(&worker->cache_flush, on_cache_flush, 0, CACHE_FLUSH_INTERVAL);
+}
+
+static void on_timers_tick(uv_timer_t *timer)
+{
+	struct worker_ctx *worker = timer->data;
+	tw_run(&worker->timers, uv_now(worker->loop));
+}
+
+static void timers_arm(struct timer_wheel *wheel, uint64_t at)
+{
+	struct worker_ctx *worker = wheel->baton;
+	if (at == UINT64_MAX) {
+		uv_timer_stop(&worker->timers_tick);
+		return;
+	}
+	const uint64_t now = uv_now(worker->loop);
+	uv_timer_start(&worker->timers_tick, on_timers_tick, at > now ? at - now : 0, 0);
+}
+
+int worker_timers_start(struct worker_ctx *worker)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	tw_init(&worker->timers, uv_now(worker->loop), timers_arm, worker);
+	worker->timers_tick.data = worker;
+	return uv_timer_init(worker->loop, &worker->timers_tick);
+}
+
+static void on_lag_timer(uv_timer_t *timer)
+{
+	struct worker_ctx *worker = timer->data;
+	const uint64_t now = uv_now(worker->loop);
+	worker->stats.loop_lag = now > worker->lag_due ? now - worker->lag_due : 0;
+	worker->lag_due = now + LOOP_LAG_INTERVAL;
+}
+
+int worker_lag_start(struct worker_ctx *worker)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	int ret = uv_timer_init(worker->loop, &worker->lag_timer);
+	if (ret == 0) {
+		worker->lag_timer.data = worker;
+		worker->lag_due = uv_now(worker->loop) + LOOP_LAG_INTERVAL;
+		ret = uv_timer_start(&worker->lag_timer, on_lag_timer,
+				     LOOP_LAG_INTERVAL, LOOP_LAG_INTERVAL);
+	}
+	if (ret == 0) {
+		/* Don't keep the loop alive just for this. */
+		uv_unref((uv_handle_t *)&worker->lag_timer);
+	}
+	return ret;
+}
+
+/** Open a perf event counting the dTLB load misses of this thread, in user space;
+ * that's allowed for own processes up to perf_event_paranoid=2. */
+static int tlb_counter_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		kr_log_verbose("[worker] can't count the TLB misses: %s\n", strerror(errno));
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+int64_t worker_tlb_misses(struct worker_ctx *worker)
+{
+	uint64_t count = 0;
+	if (!worker || worker->tlb_fd < 0
+	    || read(worker->tlb_fd, &count, sizeof(count)) != sizeof(count)) {
+		return -1;
+	}
+	return count;
+}
+
+void worker_mem_update(struct worker_ctx *worker)
+{
+	lua_State *L = worker->engine->L;
+	worker->mem.lua = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+	const struct pool_mp_usage *usage = &worker->pool_mp_usage;
+	worker->mem.mempools = usage->alloc > usage->freed ? usage->alloc - usage->freed : 0;
+	size_t freelists = 0;
+	const obj_cache_t *caches[] = {
+		&worker->pool_ioreqs, &worker->pool_iohandles, &worker->pool_sessions, &worker->pool_tls,
+	};
+	for (unsigned i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i) {
+		freelists += caches[i]->free.len * caches[i]->obj_size;
+	}
+	for (size_t i = 0; i < worker->pool_pkts.free.len; ++i) {
+		const knot_pkt_t *pkt = worker->pool_pkts.free.at[i];
+		freelists += sizeof(*pkt) + pkt->max_size;
+	}
+	worker->mem.freelists = freelists;
+	memcpy(worker->mem.tagged, kr_mem_usage, sizeof(worker->mem.tagged));
+}
+
+int worker_forked(struct worker_ctx *worker, int worker_id)
+{
+	if (!worker || !worker->loop || worker_id <= 0) {
+		return kr_error(EINVAL);
+	}
+	int ret = uv_loop_fork(worker->loop);
+	if (ret != 0) {
+		return ret;
+	}
+	worker->id = worker_id;
+	/* The same state in all forks would give the same query IDs and ports. */
+	kr_rand_reseed();
+	/* The perf event counts the process that opened it. */
+	if (worker->tlb_fd >= 0) {
+		close(worker->tlb_fd);
+	}
+	worker->tlb_fd = tlb_counter_open();
+	/* Own counters, registered in the order of the leader's (incl. those of the modules),
+	 * so that the indices kept by the config are valid here too. */
+	shcounters_t *sc = worker->shstats;
+	const uint32_t count = sc ? shcounters_count(sc, 0) : 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (shcounters_register(sc, worker_id, shcounters_name(sc, 0, i)) != (int)i) {
+			kr_log_error("[worker] can't share the statistics of fork %d\n", worker_id);
+			worker->shstats = NULL;
+			break;
+		}
+	}
+	lua_State *L = worker->engine->L;
+	lua_getglobal(L, "worker");
+	lua_pushnumber(L, worker_id);
+	lua_setfield(L, -2, "id");
+	lua_pushnumber(L, getpid());
+	lua_setfield(L, -2, "pid");
+	lua_pop(L, 1);
+	/* The ring of the leader isn't ours to use either. */
+	const bool uring = worker->io_uring;
+	if (uring) {
+		(void) worker_io_uring(worker, false);
+	}
+	network_reopen(&worker->engine->net);
+	if (uring && worker_io_uring(worker, true) != 0) {
+		kr_log_error("[worker] can't set up io_uring in fork %d\n", worker_id);
+	}
+	return kr_ok();
+}
+
+const char *const worker_prof_names[PROF_COUNT] = {
+	[PROF_UDP] = "udp",
+	[PROF_TCP] = "tcp",
+	[PROF_TASK] = "task",
+	[PROF_EVENT] = "event",
+	[PROF_ZIMPORT] = "zimport",
+	[PROF_LUA_GC] = "lua_gc",
+};
+
+int worker_prof_enable(struct worker_ctx *worker, bool enable, uint32_t slow_ms)
+{
+	if (!worker) {
+		return kr_error(EINVAL);
+	}
+	if (enable && !worker->prof.enabled) {
+		/* The loop iterations are measured in the flush handles. */
+		int ret = out_flush_start(worker);
+		if (ret != 0) {
+			return ret;
+		}
+		const unsigned depth = worker->prof.depth;
+		memset(&worker->prof, 0, sizeof(worker->prof));
+		worker->prof.depth = depth;
+	}
+	worker->prof.enabled = enable;
+	worker->prof.slow_ms = slow_ms;
+	return kr_ok();
+}
+
+void worker_prof_end(struct worker_ctx *worker, enum worker_prof_cb cb,
+		     uint64_t since, const char *name)
+{
+	if (!since) {
+		return;
+	}
+	struct worker_prof *prof = &worker->prof;
+	prof->depth -= 1;
+	if (!prof->enabled) {
+		return; /* turned off by the callback */
+	}
+	const uint64_t us = kr_now_us() - since;
+	/* Nested ones are in the time of the outer one already. */
+	if (prof->depth == 0 && prof->in_poll) {
+		prof->iter_us += us;
+	}
+	prof_add(worker, &prof->cb[cb], worker_prof_names[cb], us, name);
+}
+
+int worker_cache_gc_start(struct worker_ctx *worker)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	/* Each worker removes the names flushed in it. */
+	int ret = uv_timer_init(worker->loop, &worker->cache_flush);
+	if (ret != 0) {
+		return ret;
+	}
+	worker->cache_flush.data = worker;
+	uv_unref((uv_handle_t *)&worker->cache_flush);
+	if (worker->id != 0) {
+		return kr_ok(); /* the cache is shared, one collector is enough */
+	}
+	ret = uv_timer_init(worker->loop, &worker->cache_gc);
+	if (ret == 0) {
+		worker->cache_gc.data = worker;
+		ret = uv_timer_start(&worker->cache_gc, on_cache_gc,
+				     CACHE_GC_INTERVAL, CACHE_GC_INTERVAL);
+	}
+	if (ret == 0) {
+		/* Don't keep the loop alive just for this. */
+		uv_unref((uv_handle_t *)&worker->cache_gc);
+	}
+	return ret;
+}
+
+static void on_lua_gc(uv_prepare_t *handle)
+{
+	struct worker_ctx *worker = handle->data;
+	lua_State *L = worker->engine->L;
+	if (!worker->lua_gc.step_kb) {
+		return;
+	}
+	/* Until the heap grows enough, or while the cycle started goes on. */
+	if (!worker->lua_gc.running) {
+		const uint64_t kb = lua_gc(L, LUA_GCCOUNT, 0);
+		if (kb * 100 < (uint64_t)worker->lua_gc.base_kb * worker->lua_gc.pause) {
+			return;
+		}
+		worker->lua_gc.running = true;
+	}
+	const uint64_t since = kr_now_us();
+	const uint64_t prof_since = worker_prof_begin(worker);
+	uint64_t elapsed = 0;
+	do {
+		worker->stats.lua_gc_steps += 1;
+		if (lua_gc(L, LUA_GCSTEP, worker->lua_gc.step_kb)) {
+			worker->lua_gc.running = false;
+			worker->lua_gc.base_kb = lua_gc(L, LUA_GCCOUNT, 0);
+			worker->stats.lua_gc_cycles += 1;
+			elapsed = kr_now_us() - since;
+			break;
+		}
+		elapsed = kr_now_us() - since;
+	} while (elapsed < worker->lua_gc.budget_us);
+	worker_prof_end(worker, PROF_LUA_GC, prof_since, NULL);
+	worker->stats.lua_gc_us += elapsed;
+	worker->stats.lua_gc_max_us = MAX(worker->stats.lua_gc_max_us, elapsed);
+}
+
+int worker_lua_gc_start(struct worker_ctx *worker)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	if (worker->lua_gc.active) {
+		return kr_ok();
+	}
+	worker->lua_gc.step_kb = LUA_GC_STEP_KB;
+	worker->lua_gc.budget_us = LUA_GC_BUDGET_US;
+	worker->lua_gc.pause = LUA_GC_PAUSE;
+	worker->lua_gc.base_kb = lua_gc(worker->engine->L, LUA_GCCOUNT, 0);
+	int ret = uv_prepare_init(worker->loop, &worker->lua_gc.prepare);
+	if (ret == 0) {
+		worker->lua_gc.prepare.data = worker;
+		ret = uv_prepare_start(&worker->lua_gc.prepare, on_lua_gc);
+	}
+	if (ret == 0) {
+		/* Don't keep the loop alive just for this. */
+		uv_unref((uv_handle_t *)&worker->lua_gc.prepare);
+		worker->lua_gc.active = true;
+	}
+	return ret;
+}
+
+/** @internal Worker and cache counters in the shared memory, as "worker.<name>" and "cache.<name>". */
+#define SHSTATS_WORKER(X) \
+	X(concurrent, stats.concurrent) X(udp, stats.udp) X(tcp, stats.tcp) X(tls, stats.tls) \
+	X(ipv6, stats.ipv6) X(ipv4, stats.ipv4) X(queries, stats.queries) \
+	X(dropped, stats.dropped) X(truncated, stats.truncated) X(timeout, stats.timeout) \
+	X(udp_batches, stats.udp_batches) X(udp_batched, stats.udp_batched) \
+	X(tcp_batches, stats.tcp_batches) X(tcp_batched, stats.tcp_batched) \
+	X(shared_waits, stats.shared_waits) X(udp_reused, stats.udp_reused) \
+	X(tcp_reused, stats.tcp_reused) X(tls_resumed, stats.tls_resumed) \
+	X(tls_hs_offloaded, stats.tls_hs_offloaded) X(tls_hs_queue, stats.tls_hs_queue) \
+	X(tls_hs_refused, stats.tls_hs_refused) X(tls_conns, stats.tls_conns) \
+	X(doh, stats.doh) X(doh_conns, stats.doh_conns) \
+	X(tfo_in, stats.tfo_in) X(tfo_out, stats.tfo_out) \
+	X(tfo_out_fallback, stats.tfo_out_fallback) \
+	X(hedges, stats.hedges) X(hedges_won, stats.hedges_won) \
+	X(xdp_rx, stats.xdp_rx) X(xdp_tx, stats.xdp_tx) X(xdp_dropped, stats.xdp_dropped) \
+	X(uring_enters, stats.uring_enters) X(uring_sqes, stats.uring_sqes) \
+	X(uring_cqes, stats.uring_cqes) X(uring_nobufs, stats.uring_nobufs) \
+	X(wire_ring_full, stats.wire_ring_full) X(udp_waves, stats.udp_waves) \
+	X(udp_wave_queries, stats.udp_wave_queries) X(udp_wave_dups, stats.udp_wave_dups) \
+	X(udp_gso, stats.udp_gso) X(udp_gso_segments, stats.udp_gso_segments) \
+	X(fast_path, stats.fast_path) X(socket_drops, stats.socket_drops) \
+	X(budget_exceeded, stats.budget_exceeded) X(overload_shed, stats.overload_shed) \
+	X(retransmits, stats.retransmits) X(tcp_in_conns, stats.tcp_in_conns) \
+	X(tcp_in_evicted, stats.tcp_in_evicted) X(tcp_in_refused, stats.tcp_in_refused) \
+	X(mem_lua, mem.lua) X(mem_mempools, mem.mempools) X(mem_freelists, mem.freelists) \
+	X(mem_nsrep, mem.tagged[KR_MEM_NSREP]) X(mem_cookies, mem.tagged[KR_MEM_COOKIES]) \
+	X(mem_subreq, mem.tagged[KR_MEM_SUBREQ]) X(mem_hints, mem.tagged[KR_MEM_HINTS]) \
+	X(loop_lag, stats.loop_lag) X(lua_gc_steps, stats.lua_gc_steps) \
+	X(lua_gc_cycles, stats.lua_gc_cycles) X(lua_gc_us, stats.lua_gc_us) \
+	X(lua_gc_max_us, stats.lua_gc_max_us) \
+	X(pool_mp_alloc_bytes, pool_mp_usage.alloc) X(pool_mp_reused_bytes, pool_mp_usage.reused) \
+	X(pool_mp_freed_bytes, pool_mp_usage.freed) X(pool_mp_target_bytes, pool_mp_usage.target)
+#define SHSTATS_CACHE(X) \
+	X(hit, stats.hit) X(miss, stats.miss) X(insert, stats.insert) X(delete, stats.delete) \
+	X(batch_commits, batch.commits) X(batch_saved, batch.saved) \
+	X(l1_hit, l1_stats.hit) X(l1_miss, l1_stats.miss) X(l1_size, l1_stats.size) \
+	X(usage_percent, gc.usage) X(gc_passes, gc.passes) X(gc_scanned, gc.scanned) \
+	X(gc_freed, gc.freed) X(gc_freed_bytes, gc.freed_bytes) X(gc_kept_hot, gc.kept_hot)
+
+static const char *shstats_names[] = {
+	#define X(name, field) "worker." #name,
+	SHSTATS_WORKER(X)
+	#undef X
+	#define X(name, field) "cache." #name,
+	SHSTATS_CACHE(X)
+	#undef X
+	"worker.rss",
+};
+
+void worker_shstats_publish(struct worker_ctx *worker)
+{
+	if (!worker || !worker->shstats) {
+		return;
+	}
+	shcounters_t *sc = worker->shstats;
+	const struct kr_cache *cache = &worker->engine->resolver.cache;
+	int i = worker->shstats_base;
+	worker->stats.socket_drops = network_socket_drops(&worker->engine->net);
+	worker_mem_update(worker);
+	#define X(name, field) shcounters_set(sc, worker->id, i++, worker->field);
+	SHSTATS_WORKER(X)
+	#undef X
+	#define X(name, field) shcounters_set(sc, worker->id, i++, cache->field);
+	SHSTATS_CACHE(X)
+	#undef X
+	size_t rss = 0;
+	(void) uv_resident_set_memory(&rss);
+	shcounters_set(sc, worker->id, i++, rss);
+}
+
+static void on_shstats(uv_timer_t *timer)
+{
+	worker_shstats_publish(timer->data);
+}
+
+int worker_shstats_start(struct worker_ctx *worker, shcounters_t *sc)
+{
+	if (!worker || !worker->loop) {
+		return kr_error(EINVAL);
+	}
+	if (!sc) {
+		return kr_ok(); /* not shared, worker.stats() is all there is */
+	}
+	/* The worker counters take consecutive slots, see worker_shstats_publish(). */
+	const int count = sizeof(shstats_names) / sizeof(shstats_names[0]);
+	const int base = shcounters_register(sc, worker->id, shstats_names[0]);
+	for (int i = 1; base >= 0 && i < count; ++i) {
+		if (shcounters_register(sc, worker->id, shstats_names[i]) != base + i) {
+			return kr_error(EEXIST);
+		}
+	}
+	if (base < 0) {
+		return base;
+	}
+	worker->shstats = sc;
+	worker->shstats_base = base;
+	int ret = uv_timer_init(worker->loop, &worker->shstats_timer);
+	if (ret == 0) {
+		worker->shstats_timer.data = worker;
+		ret = uv_timer_start(&worker->shstats_timer, on_shstats,
+				     SHSTATS_INTERVAL, SHSTATS_INTERVAL);
+	}
+	if (ret == 0) {
+		/* Don't keep the loop alive just for this. */
+		uv_unref((uv_handle_t *)&worker->shstats_timer);
+	}
+	return ret;
+}
+
+int worker_shstats_register(const char *name)
+{
+	struct worker_ctx *worker = get_worker();
+	if (!worker || !worker->shstats) {
+		return kr_error(ENOENT);
+	}
+	return shcounters_register(worker->shstats, worker->id, name);
+}
+
+void worker_shstats_set(int idx, uint64_t val)
+{
+	struct worker_ctx *worker = get_worker();
+	if (worker) {
+		shcounters_set(worker->shstats, worker->id, idx, val);
+	}
+}
+
+void worker_counters_register(const char * const names[], int shared[], unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		shared[i] = worker_shstats_register(names[i]);
+		worker_shstats_set(shared[i], 0);
+	}
+}
+
+void worker_counter_inc(uint64_t counters[], const int shared[], unsigned c)
+{
+	counters[c] += 1;
+	worker_shstats_set(shared[c], counters[c]);
+}
+
+bool worker_config_number(const char *module, JsonNode *root, const char *name,
+			  double max, uint32_t *val)
+{
+	JsonNode *node = json_find_member(root, name);
+	if (!node) {
+		return true;
+	}
+	if (node->tag != JSON_NUMBER || node->number_ < 0 || node->number_ > max) {
+		kr_log_error("[     ][%s] invalid '%s', expected 0 to %.0f\n", module, name, max);
+		return false;
+	}
+	*val = node->number_;
+	return true;
+}
+
+trie_t *worker_shstats_sum(void)
+{
+	struct worker_ctx *worker = get_worker();
+	if (!worker || !worker->shstats) {
+		return NULL;
+	}
+	/* Our own values would be up to SHSTATS_INTERVAL old otherwise. */
+	worker_shstats_publish(worker);
+	const shcounters_t *sc = worker->shstats;
+	trie_t *sums = trie_create(NULL);
+	for (uint32_t p = 0; sums && p < shcounters_procs(sc); ++p) {
+		const uint32_t count = shcounters_count(sc, p);
+		for (uint32_t i = 0; i < count; ++i) {
+			const char *name = shcounters_name(sc, p, i);
+			trie_val_t *val = trie_get_ins(sums, name, strlen(name) + 1);
+			if (!val) {
+				trie_free(sums);
+				return NULL;
+			}
+			*val = (void *)((uintptr_t)*val + shcounters_get(sc, p, i));
+		}
+	}
+	return sums;
+}
+
+const shcounters_t *worker_shstats_shared(int *fork_id)
+{
+	struct worker_ctx *worker = get_worker();
+	if (!worker || !worker->shstats) {
+		return NULL;
+	}
+	if (fork_id) {
+		*fork_id = worker->id;
+	}
+	return worker->shstats;
+}
+
 #define reclaim_freelist(list, type, cb) \
 	for (unsigned i = 0; i < list.len; ++i) { \
 		void *elm = list.at[i]; \
@@ -2433,16 +4682,40 @@ static int worker_reserve(struct worker_ctx *worker, size_t ring_maxlen)
 
 void worker_reclaim(struct worker_ctx *worker)
 {
-	reclaim_freelist(worker->pool_mp, struct mempool, mp_delete);
-	reclaim_freelist(worker->pool_ioreqs, uv_reqs_t, free);
-	reclaim_freelist(worker->pool_iohandles, uv_handles_t, free);
-	reclaim_freelist(worker->pool_sessions, struct session, session_free);
+	reclaim_freelist(worker->pool_mp.free, struct mempool, mp_delete);
+	reclaim_freelist(worker->pool_ioreqs.free, uv_reqs_t, free);
+	reclaim_freelist(worker->pool_iohandles.free, uv_handles_t, free);
+	reclaim_freelist(worker->pool_sessions.free, struct session, session_free);
+	/* After the sessions, which release their TLS contexts here. */
+	reclaim_freelist(worker->pool_tls.free, struct tls_ctx_t, free);
+	reclaim_freelist(worker->pool_pkts.free, knot_pkt_t, pktbuf_free);
 	mp_delete(worker->pkt_pool.ctx);
 	worker->pkt_pool.ctx = NULL;
 	trie_free(worker->subreq_out);
 	worker->subreq_out = NULL;
-	map_clear(&worker->tcp_connected);
-	map_clear(&worker->tcp_waiting);
+	trie_free(worker->budget_zones);
+	worker->budget_zones = NULL;
+	trie_free(worker->tcp_connected);
+	worker->tcp_connected = NULL;
+	trie_free(worker->tcp_waiting);
+	worker->tcp_waiting = NULL;
+	trie_free(worker->inflight);
+	worker->inflight = NULL;
+	trie_free(worker->tcp_in.prefixes);
+	worker->tcp_in.prefixes = NULL;
+	array_clear(worker->tcp_out);
+	/* The loop isn't running anymore, so the pooled sockets just go with it. */
+	array_clear(worker->udp_pool[0]);
+	array_clear(worker->udp_pool[1]);
+	uring_deinit(worker);
+	if (worker->tlb_fd >= 0) {
+		close(worker->tlb_fd);
+		worker->tlb_fd = -1;
+	}
+	if (worker->wire_ring.mem) {
+		munmap(worker->wire_ring.mem, (size_t)WIRE_RING_SLOTS * WIRE_SLOT_SIZE);
+		worker->wire_ring.mem = NULL;
+	}
 	if (worker->z_import != NULL) {
 		zi_free(worker->z_import);
 		worker->z_import = NULL;
@@ -2469,6 +4742,7 @@ struct worker_ctx *worker_create(struct engine *engine, knot_mm_t *pool,
 	worker->count = worker_count;
 	worker->engine = engine;
 	worker_reserve(worker, MP_FREELIST_SIZE);
+	engine->resolver.budget_exceeded = on_budget_exceeded;
 	worker->out_addr4.sin_family = AF_UNSPEC;
 	worker->out_addr6.sin6_family = AF_UNSPEC;
 	/* Register worker in Lua thread */
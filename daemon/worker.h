@@ -20,9 +20,15 @@
 
 #include "daemon/engine.h"
 #include "lib/generic/array.h"
-#include "lib/generic/map.h"
+#include "lib/generic/shcounters.h"
+#include "lib/generic/shtable.h"
+#include "lib/generic/timer_wheel.h"
+#include "lib/generic/trie.h"
 
 
+/** Slot of the receive ring; libuv splits recvmmsg() buffers by this (UV__UDP_DGRAM_MAXSIZE). */
+#define WIRE_SLOT_SIZE (64 * 1024)
+
 /** Query resolution task (opaque). */
 struct qr_task;
 /** Worker state (opaque). */
@@ -31,6 +37,10 @@ struct worker_ctx;
 struct session;
 /** Zone import context (opaque). */
 struct zone_import_ctx;
+/** io_uring of the worker (opaque), see uring.h */
+struct uring_ctx;
+/** Configuration of a module, see ccan/json/json.h */
+struct JsonNode;
 
 /** Create and initialize the worker. */
 struct worker_ctx *worker_create(struct engine *engine, knot_mm_t *pool,
@@ -58,6 +68,15 @@ int worker_submit(struct worker_ctx *worker, uv_handle_t *handle, knot_pkt_t *qu
 int worker_process_tcp(struct worker_ctx *worker, uv_stream_t *handle,
 		const uint8_t *msg, ssize_t len);
 
+/**
+ * Start the query received in the HTTP/2 stream of a DoH connection, see http.h.
+ *
+ * The message is parsed in place, it needn't outlive the call.
+ * @return 1 if the query was started, kr_error(EILSEQ) if it's malformed, or another error
+ */
+int worker_submit_http(struct worker_ctx *worker, uv_stream_t *handle,
+		const uint8_t *msg, uint16_t len, int32_t stream);
+
 /**
  * End current DNS/TCP session, this disassociates pending tasks from this session
  * which may be freely closed afterwards.
@@ -85,6 +104,135 @@ struct kr_request *worker_task_request(struct qr_task *task);
 /** Collect worker mempools */
 void worker_reclaim(struct worker_ctx *worker);
 
+/** Get a run of free slots of the receive ring for a listening UDP socket.
+ * @return false if all slots are held, the shared worker->wire_buf is to be used then */
+bool worker_wire_getbuf(struct worker_ctx *worker, uv_buf_t *buf);
+
+/** Hold the slot of the receive ring containing `wire`, so that it isn't reused.
+ * @return false if `wire` isn't in the ring */
+bool worker_wire_hold(struct worker_ctx *worker, const uint8_t *wire);
+
+/** Release the slot held by worker_wire_hold(); no-op if `wire` isn't in the ring. */
+void worker_wire_release(struct worker_ctx *worker, const uint8_t *wire);
+
+/** Defer the query in a slot of the receive ring, to be processed with the rest
+ * received during this loop iteration.
+ * @return 0 or an error if it has to be processed right away, see worker_submit() */
+int worker_udp_wave_push(struct worker_ctx *worker, uv_udp_t *handle,
+			 const uint8_t *wire, size_t size, const struct sockaddr *addr);
+
+/** Switch the UDP listeners between libuv and io_uring, see uring.h. */
+int worker_io_uring(struct worker_ctx *worker, bool enable);
+
+/** An answer submitted by uring_send() completed; handle is NULL if it was stopped meanwhile. */
+void worker_uring_sent(struct qr_task *task, uv_handle_t *handle, int status);
+
+/** Set up the wheel of the session timers, run by a single timer of the loop. */
+int worker_timers_start(struct worker_ctx *worker);
+
+/** Measure the lag of the event loop periodically, see worker->overload. */
+int worker_lag_start(struct worker_ctx *worker);
+
+/** Make the worker of the leader, forked after loading the config, one of fork `worker_id`:
+ * its loop, random generator, counters and listeners become its own.  See --fork-late. */
+int worker_forked(struct worker_ctx *worker, int worker_id);
+
+/** Number of the dTLB load misses (the page walks) of the worker since it started,
+ * counted by a perf event; -1 if that isn't available.  See --hugepages. */
+int64_t worker_tlb_misses(struct worker_ctx *worker);
+
+/** Recompute worker->mem, the memory of the fork by subsystem. */
+void worker_mem_update(struct worker_ctx *worker);
+
+/** Callbacks measured by the profiler, see worker_prof_enable(). */
+enum worker_prof_cb {
+	PROF_UDP = 0,  /**< udp_recv() and the waves of UDP queries */
+	PROF_TCP,      /**< tcp_recv() */
+	PROF_TASK,     /**< qr_task_step(), included in the above */
+	PROF_EVENT,    /**< Lua callbacks of event.after() and the like */
+	PROF_ZIMPORT,  /**< chunks of the zone import */
+	PROF_LUA_GC,   /**< full collections and steps of the Lua collector */
+	PROF_COUNT
+};
+
+/** Names of enum worker_prof_cb, e.g. for the stats. */
+extern const char *const worker_prof_names[PROF_COUNT];
+
+/**
+ * Turn the profiler of the loop iterations and callbacks on or off.
+ * The counters are reset when it's turned on.
+ * @param slow_ms log the callbacks and iterations over it, 0 to not log
+ */
+int worker_prof_enable(struct worker_ctx *worker, bool enable, uint32_t slow_ms);
+
+/** Account the callback started at `since` (from worker_prof_begin()),
+ * and log it if it's slow; `name` of the module or layer may be NULL. */
+void worker_prof_end(struct worker_ctx *worker, enum worker_prof_cb cb,
+		     uint64_t since, const char *name);
+
+/** Start the incremental cache garbage collection; only the first worker does it. */
+int worker_cache_gc_start(struct worker_ctx *worker);
+
+/** Start stepping the Lua collector before each I/O poll, see worker->lua_gc. */
+int worker_lua_gc_start(struct worker_ctx *worker);
+
+/** Remove the names flushed from the cache in chunks, see kr_cache_remove_subtree(). */
+int worker_cache_flush(struct worker_ctx *worker);
+
+/** Publish the worker counters to the shared `sc` periodically, see worker_shstats_publish(). */
+int worker_shstats_start(struct worker_ctx *worker, shcounters_t *sc);
+
+/** Copy the worker and cache counters of this fork to the shared memory now. */
+void worker_shstats_publish(struct worker_ctx *worker);
+
+/**
+ * Register a counter shared with the other forks (e.g. by a module).
+ * @return index for worker_shstats_set() or an error code
+ */
+KR_EXPORT
+int worker_shstats_register(const char *name);
+
+/** Set a counter of this fork registered by worker_shstats_register(). */
+KR_EXPORT
+void worker_shstats_set(int idx, uint64_t val);
+
+/**
+ * Register the counters of a module with worker_shstats_register(), starting at zero.
+ * @param shared set to the indices for worker_counter_inc(), or errors if not shared
+ */
+KR_EXPORT
+void worker_counters_register(const char * const names[], int shared[], unsigned count);
+
+/** Count an event in the counter `c` of a module and share the new value. */
+KR_EXPORT
+void worker_counter_inc(uint64_t counters[], const int shared[], unsigned c);
+
+/**
+ * Read a number member of the JSON configuration of a module, from 0 to `max`.
+ * The value is kept if the member is missing, an invalid one is logged.
+ * @return false if the member is invalid
+ */
+KR_EXPORT
+bool worker_config_number(const char *module, struct JsonNode *root, const char *name,
+			  double max, uint32_t *val);
+
+/**
+ * Sum up the shared counters of all forks by name.
+ * @return trie of the zero-terminated names, with the sums as (uintptr_t) values;
+ *         free it by trie_free(); or NULL if not shared
+ */
+KR_EXPORT
+trie_t *worker_shstats_sum(void);
+
+/**
+ * Return the counters of all forks for reading, e.g. from another thread.
+ * The values of this fork are up to SHSTATS_INTERVAL old there.
+ * @param fork_id set to the id of this fork, if not NULL
+ * @return the counters or NULL if not shared
+ */
+KR_EXPORT
+const shcounters_t *worker_shstats_shared(int *fork_id);
+
 /** Closes given session */
 void worker_session_close(struct session *session);
 
@@ -107,9 +255,65 @@ int worker_task_finalize(struct qr_task *task, int state);
 /** Maximum response time from TCP upstream, milliseconds */
 #define MAX_TCP_INACTIVITY (KR_RESOLVE_TIME_LIMIT + KR_CONN_RTT_MAX)
 
+/** Idle time before closing an outgoing TLS connection, milliseconds;
+ * longer than for plain TCP, as the handshake is much more expensive. */
+#define MAX_TLS_OUT_IDLE 10000
+
+/** Idle outgoing UDP sockets kept per address family (worker->udp_pool) */
+#define UDP_POOL_SIZE 32
+/** Queries sent over one outgoing UDP socket before it's closed.
+ * Kept low, as a reused port is no secret to the previous upstreams. */
+#define UDP_REUSE_MAX 8
+
+/** Buckets of the request mempool sizes (worker->pool_mp_usage), powers of two from CPU_PAGE_SIZE */
+#define MP_USAGE_BUCKETS 12
+/** Requests after which the histogram is halved and the target recomputed */
+#define MP_USAGE_WINDOW 4096
+/** Percentile of the request mempool sizes that recycled pools keep memory for */
+#define MP_USAGE_PERCENTILE 95
+
+/** Default worker->hedge.rtt_pct, i.e. the early retransmit at the expected RTT */
+#define HEDGE_RTT_PCT 100
+/** Default worker->hedge.budget_pct */
+#define HEDGE_BUDGET_PCT 20
+
+/** Interval for measuring the lag of the event loop (worker->stats.loop_lag), milliseconds */
+#define LOOP_LAG_INTERVAL 100
+
+/** Zones counted in worker->budget_zones, the requests for other ones are only in the stats */
+#define BUDGET_ZONES_MAX 1024
+
+/** Counters each fork may share (worker->shstats) */
+#define SHSTATS_SLOTS 256
+/** Interval for publishing the worker counters to the shared memory, milliseconds */
+#define SHSTATS_INTERVAL 1000
+
+/** Interval for checking subrequests led by other forks, milliseconds */
+#define SUBREQ_SHARED_POLL 10
+/** Number of slots in the registry of subrequests shared by forks */
+#define SUBREQ_SHARED_SIZE 16384
+
+/** Entry in the registry of subrequests in flight shared by forks (worker->subreq_shared). */
+struct subreq_shared_entry {
+	int32_t leader;    /**< worker->id of the fork asking upstream */
+	uint64_t deadline; /**< kr_now() until which the lead is valid, 0 if finished */
+};
+
 /** Freelist of available mempools. */
 typedef array_t(void *) mp_freelist_t;
 
+/** Cache of free objects of one size class, with usage counters. */
+struct obj_cache {
+	mp_freelist_t free;       /**< Objects ready for reuse, at most MP_FREELIST_SIZE. */
+	size_t obj_size;          /**< Size of the objects, or 0 to skip ASAN poisoning. */
+	void *(*alloc)(size_t);   /**< Allocator on cache miss. */
+	void (*dtor)(void *);     /**< Destructor of objects that don't fit into cache. */
+	size_t hit;               /**< Number of objects reused from the cache. */
+	size_t miss;              /**< Number of objects allocated anew. */
+	size_t drop;              /**< Number of released objects destroyed (cache full). */
+};
+typedef struct obj_cache obj_cache_t;
+
 /** List of query resolution tasks. */
 typedef array_t(struct qr_task *) qr_tasklist_t;
 
@@ -123,6 +327,16 @@ struct worker_ctx {
 	int id;
 	int count;
 	unsigned tcp_pipeline_max;
+	/** Sending the query to the next address before the usual retry interval. */
+	struct {
+		uint16_t rtt_pct;    /**< When, in percent of the expected RTT; 0 disables it */
+		uint16_t budget_pct; /**< Max. hedges in percent of the outbound UDP queries */
+	} hedge;
+	/** Shedding new requests that need the upstreams, see worker_overloaded(); 0 disables a limit. */
+	struct {
+		uint32_t requests; /**< Over this many requests in progress */
+		uint32_t lag;      /**< Over this lag of the event loop, milliseconds */
+	} overload;
 
 	/** Addresses to bind for outgoing connections or AF_UNSPEC. */
 	struct sockaddr_in out_addr4;
@@ -133,6 +347,26 @@ struct worker_ctx {
 #else
 	uint8_t wire_buf[KNOT_WIRE_MAX_PKTSIZE];
 #endif
+	/** Receive buffers of the listening UDP sockets; a request holds the slot
+	 * of its query until it's finished, see worker_wire_getbuf(). */
+	struct {
+		uint8_t *mem;   /**< WIRE_RING_SLOTS slots of WIRE_SLOT_SIZE, or NULL */
+		unsigned head;  /**< The first slot to try */
+		uint8_t refs[WIRE_RING_SLOTS];
+	} wire_ring;
+	/** Queries from the listening UDP sockets received during the current loop
+	 * iteration, in held slots of the receive ring; see worker_udp_wave_push(). */
+	struct {
+		unsigned len;
+		struct udp_wave_query {
+			uv_udp_t *handle;
+			const uint8_t *wire;
+			uint16_t size;
+			union inaddr addr;
+		} at[UDP_WAVE_MAX];
+	} udp_wave;
+	/** Decrypted TLS data, shared by all TLS sessions; one record at most. */
+	uint8_t tls_recv_buf[16 * 1024];
 	struct {
 		size_t concurrent;
 		size_t rconcurrent;
@@ -143,23 +377,169 @@ struct worker_ctx {
 		size_t ipv6;
 		size_t queries;
 		size_t dropped;
+		size_t truncated; /**< number of answers with TC, see minimal_responses() */
 		size_t timeout;
+		size_t udp_batches; /**< number of sendmmsg() calls for UDP answers */
+		size_t udp_batched; /**< number of UDP answers sent through sendmmsg() */
+		size_t shared_waits; /**< number of subrequests waited for in other forks */
+		size_t tcp_batches; /**< number of coalesced writes of TCP/TLS answers */
+		size_t tcp_batched; /**< number of TCP/TLS answers sent in coalesced writes */
+		size_t udp_reused; /**< number of outbound UDP queries over a pooled socket */
+		size_t tcp_reused; /**< number of outbound TCP/TLS queries over an open connection */
+		size_t tls_resumed; /**< number of outbound TLS handshakes that resumed a session */
+		size_t tls_hs_offloaded; /**< number of inbound TLS handshakes completed in the thread pool */
+		size_t tls_hs_queue; /**< number of inbound TLS handshake steps queued in the thread pool now */
+		size_t tls_hs_refused; /**< number of TLS connections refused by tls_handshake_admit() */
+		size_t tls_conns; /**< number of TLS connections from clients open now */
+		size_t doh; /**< number of queries over DNS-over-HTTPS */
+		size_t doh_conns; /**< number of DoH connections from clients open now, see http_new() */
+		size_t tfo_in; /**< number of client connections with data in the SYN (TCP Fast Open) */
+		size_t tfo_out; /**< number of upstream connections with the query in the SYN */
+		size_t tfo_out_fallback; /**< number of upstream connections by TFO with a plain handshake */
+		size_t hedges; /**< number of early retransmits to another address */
+		size_t hedges_won; /**< number of them where the hedge answered first */
+		size_t xdp_rx; /**< number of queries received over AF_XDP */
+		size_t xdp_tx; /**< number of answers sent over AF_XDP */
+		size_t xdp_dropped; /**< number of AF_XDP frames dropped: not DNS to us, or the tx ring full */
+		size_t uring_enters; /**< number of io_uring_enter() calls submitting operations */
+		size_t uring_sqes; /**< number of io_uring operations submitted */
+		size_t uring_cqes; /**< number of io_uring completions reaped */
+		size_t uring_nobufs; /**< number of times io_uring ran out of receive buffers */
+		size_t wire_ring_full; /**< number of UDP reads into worker->wire_buf as all ring slots were held */
+		size_t udp_waves; /**< number of waves of UDP queries processed together */
+		size_t udp_wave_queries; /**< number of UDP queries in them */
+		size_t udp_wave_dups; /**< number of them repeating the question of another one in the wave */
+		size_t udp_gso; /**< number of messages carrying several UDP answers by GSO */
+		size_t udp_gso_segments; /**< number of UDP answers in them */
+		size_t fast_path; /**< number of queries answered from cache without a request */
+		size_t socket_drops; /**< drops on the listening sockets, see network_socket_drops() */
+		size_t budget_exceeded; /**< number of requests failed over kr_context::budget */
+		size_t overload_shed; /**< number of requests failed over worker->overload */
+		size_t retransmits; /**< number of client retransmits of a request in progress, see worker->inflight */
+		size_t tcp_in_conns; /**< number of connections from clients open now, see worker->tcp_in */
+		size_t tcp_in_evicted; /**< number of idle ones closed to make room for others */
+		size_t tcp_in_refused; /**< number of new ones refused over net.tcp_connections*() */
+		size_t loop_lag; /**< last lag of the event loop, milliseconds; see LOOP_LAG_INTERVAL */
+		size_t lua_gc_steps; /**< number of the steps of the Lua collector, see worker->lua_gc */
+		size_t lua_gc_cycles; /**< number of the collection cycles the steps finished */
+		size_t lua_gc_us; /**< time spent in the steps, microseconds */
+		size_t lua_gc_max_us; /**< longest of the steps of one loop iteration, microseconds */
 	} stats;
 
+	/** Bytes of memory by subsystem, see worker_mem_update(). */
+	struct {
+		size_t lua;       /**< Lua heap */
+		size_t mempools;  /**< Request mempools, in use and cached */
+		size_t freelists; /**< Cached objects of the other pools, incl. the packet buffers */
+		size_t tagged[KR_MEM_TAG_COUNT]; /**< kr_mem_usage */
+	} mem;
+
+	/** Profiler of the loop iterations and callbacks, see worker_prof_enable(). */
+	struct worker_prof {
+		bool enabled;
+		uint32_t slow_ms;   /**< Log the callbacks over it, 0 if not */
+		unsigned depth;     /**< Callbacks measured now, they nest */
+		bool in_poll;       /**< Between the prepare and check phases of the loop */
+		uint64_t check_at;  /**< kr_now_us() when the last iteration ended, 0 if not yet */
+		uint64_t iter_us;   /**< Time spent in the current iteration so far */
+		uint64_t slow;      /**< Number of the slow callbacks and iterations */
+		struct worker_prof_stat {
+			uint64_t count;
+			uint64_t total_us;
+			uint64_t max_us;
+		} loop, cb[PROF_COUNT];
+	} prof;
+
 	struct zone_import_ctx* z_import;
 	bool too_many_open;
 	size_t rconcurrent_highwatermark;
-	/** List of active outbound TCP sessions */
-	map_t tcp_connected;
-	/** List of outbound TCP sessions waiting to be accepted */
-	map_t tcp_waiting;
+	/** Active outbound TCP sessions, by kr_sockaddr_key() of the peer */
+	trie_t *tcp_connected;
+	/** Outbound TCP sessions waiting to be accepted, same keys */
+	trie_t *tcp_waiting;
+	/** Connections from the clients over TCP, TLS and DoH, see net.tcp_connections(). */
+	struct {
+		struct session *head, *tail; /**< From the least recently active one */
+		trie_t *prefixes; /**< Counts of the connections (as uintptr_t) by io_client_prefix() */
+	} tcp_in;
+	/** Requests in progress from the clients over UDP, by the socket, client,
+	 * message ID and question; the retransmits wait for their answer. */
+	trie_t *inflight;
+	/** Counts of the requests over budget (as uintptr_t), by the lowercased zone
+	 * in wire format; at most BUDGET_ZONES_MAX zones. */
+	trie_t *budget_zones;
 	/** Subrequest leaders (struct qr_task*), indexed by qname+qtype+qclass. */
 	trie_t *subreq_out;
-	mp_freelist_t pool_mp;
-	mp_freelist_t pool_ioreqs;
-	mp_freelist_t pool_sessions;
-	mp_freelist_t pool_iohandles;
+	/** Subrequests in flight in all forks, same keys as subreq_out; or NULL. */
+	shtable_t *subreq_shared;
+	obj_cache_t pool_mp;
+	/** Memory used by the request mempools, see pool_release() */
+	struct pool_mp_usage {
+		uint32_t hist[MP_USAGE_BUCKETS]; /**< Chunks needed by requests, bucket i up to CPU_PAGE_SIZE << i */
+		uint32_t count;  /**< Number of requests in the histogram */
+		size_t target;   /**< Memory recycled pools keep, 0 if not known yet */
+		size_t alloc;    /**< Bytes of chunks allocated for requests */
+		size_t reused;   /**< Bytes of chunks reused from recycled pools */
+		size_t freed;    /**< Bytes of chunks freed */
+	} pool_mp_usage;
+	obj_cache_t pool_ioreqs;
+	obj_cache_t pool_sessions;
+	obj_cache_t pool_iohandles;
+	obj_cache_t pool_tls;      /**< struct tls_ctx_t of the clients, see tls_new() */
+	obj_cache_t pool_pkts;     /**< Packet buffers of the tasks, see pktbuf_borrow() */
 	knot_mm_t pkt_pool;
+	/** Handles flushing the queued answers before and after every I/O poll. */
+	struct {
+		bool active;
+		bool cache_batch; /**< kr_cache_batch_begin() is open until the flush */
+		uv_prepare_t prepare;
+		uv_check_t check;
+	} out_flush;
+	/** Counters of all forks in shared memory, or NULL; see worker_shstats_start(). */
+	shcounters_t *shstats;
+	int shstats_base; /**< index of the first worker counter */
+	uv_timer_t shstats_timer;
+	/** Ring for the UDP listeners while io_uring is the backend, or NULL. */
+	struct uring_ctx *uring;
+	bool io_uring; /**< The UDP listeners receive through `uring`. */
+	/** Timeouts of the sessions and their queries, see session_timer_start(). */
+	struct timer_wheel timers;
+	uv_timer_t timers_tick; /**< Runs `timers` when they need it, see worker_timers_start(). */
+	uv_timer_t lag_timer;   /**< Measures stats.loop_lag */
+	uint64_t lag_due;       /**< uv_now() when lag_timer should fire */
+	int tlb_fd;             /**< perf event counting the dTLB load misses, or -1 */
+	/** Steps of the Lua collector in the loop, so that its work is done before I/O polls
+	 * rather than while processing the queries; see worker_lua_gc_start(). */
+	struct {
+		uv_prepare_t prepare;
+		bool active;
+		bool running;       /**< A cycle started by the steps is in progress */
+		uint32_t step_kb;   /**< Size of a step, KiB; 0 leaves it to the automatic collector */
+		uint32_t budget_us; /**< Time the steps may take per loop iteration */
+		uint32_t pause;     /**< Start a cycle when the heap is this many percent of `base_kb` */
+		uint32_t base_kb;   /**< Heap left by the last cycle */
+	} lua_gc;
+	/** Runs kr_cache_gc() slices, see worker_cache_gc_start(). */
+	uv_timer_t cache_gc;
+	/** Runs kr_cache_remove_step() chunks, see worker_cache_flush(). */
+	uv_timer_t cache_flush;
+	/** Idle outgoing UDP sockets for reuse by ioreq_spawn(); [0] IPv4, [1] IPv6. */
+	array_t(uv_handle_t *) udp_pool[2];
+	/** Client TCP/TLS sessions with answers queued in `session->out`. */
+	array_t(struct session *) tcp_out;
+#if __linux__
+	int8_t udp_gso; /**< UDP_SEGMENT works: 1, doesn't: -1, not known yet: 0 */
+	/** UDP answers finished during the current loop iteration,
+	 * waiting to be flushed to `handle` by a single sendmmsg(). */
+	struct {
+		uv_udp_t *handle;
+		unsigned len;
+		struct qr_task *task[SENDMMSG_BATCH];
+		struct iovec iov[SENDMMSG_BATCH];
+		struct mmsghdr msgvec[SENDMMSG_BATCH];
+		union inaddr peer[SENDMMSG_BATCH]; /**< Clients of the answers without a task */
+	} udp_out;
+#endif
 };
 
 /* @internal Union of some libuv handles for freelist.
@@ -186,5 +566,42 @@ union uv_reqs {
 };
 typedef union uv_reqs uv_reqs_t;
 
+/** Get an object from the cache, or allocate a new one. */
+static inline void *obj_cache_borrow(obj_cache_t *cache)
+{
+	if (cache->free.len > 0) {
+		void *obj = array_tail(cache->free);
+		array_pop(cache->free);
+		kr_asan_unpoison(obj, cache->obj_size);
+		cache->hit += 1;
+		return obj;
+	}
+	cache->miss += 1;
+	return cache->alloc(cache->obj_size);
+}
+
+/** Return an object to the cache.
+ * @return true if it was cached, false if it was destroyed */
+static inline bool obj_cache_release(obj_cache_t *cache, void *obj)
+{
+	if (cache->free.len < MP_FREELIST_SIZE && array_push(cache->free, obj) >= 0) {
+		kr_asan_poison(obj, cache->obj_size);
+		return true;
+	}
+	cache->drop += 1;
+	cache->dtor(obj);
+	return false;
+}
+
+/** Start measuring a callback, see worker_prof_end(); 0 if the profiler is off. */
+static inline uint64_t worker_prof_begin(struct worker_ctx *worker)
+{
+	if (!worker->prof.enabled) {
+		return 0;
+	}
+	worker->prof.depth += 1;
+	return kr_now_us();
+}
+
 /** @endcond */
 
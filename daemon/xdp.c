@@ -0,0 +1,688 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemon/xdp.h"
+
+#ifdef ENABLE_XDP
+
+#include <assert.h>
+#include <errno.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <bpf/xsk.h>
+#include <contrib/ucw/mempool.h>
+#include <contrib/wire.h>
+
+#include "daemon/io.h"
+#include "daemon/worker.h"
+
+/* Frames of the UMEM, the first half is for receiving and the rest for sending. */
+#define XDP_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+#define XDP_FRAMES 4096
+#define XDP_RX_FRAMES (XDP_FRAMES / 2)
+#define XDP_TX_FRAMES (XDP_FRAMES - XDP_RX_FRAMES)
+/** Frames taken from the receive ring at once. */
+#define XDP_BATCH 64
+/** Entries of the socket map, i.e. the highest receive queue + 1. */
+#define XDP_QUEUES_MAX 256
+
+#define ETH_HLEN_ 14
+#define IP4_HLEN 20
+#define IP6_HLEN 40
+#define UDP_HLEN 8
+
+struct xdp_sock {
+	uv_poll_t poll;         /**< On the socket, must be the first; poll.data is the session */
+	struct xsk_socket *xsk;
+	struct xsk_umem *umem;
+	struct xsk_ring_prod fq, tx;
+	struct xsk_ring_cons cq, rx;
+	void *umem_area;
+	uint64_t tx_free[XDP_TX_FRAMES]; /**< Addresses of frames not on the tx ring */
+	unsigned tx_free_len;
+	int map_fd;             /**< The socket map of the XDP program */
+	uint32_t queue;
+	unsigned mtu;
+	char ifname[IF_NAMESIZE];
+	union inaddr addr;      /**< Listening address, maybe a wildcard */
+	bool in_recv;           /**< Within xdp_recv(), the tx ring is kicked at its end */
+	bool tx_pending;        /**< Frames put on the tx ring since the last kick */
+	/** The frame being submitted, see xdp_frame_addrs(). */
+	const union inaddr *cur_dst;
+	const uint8_t *cur_eth;
+};
+
+/*
+ * The XDP program, as eBPF instructions so that the build needs no BPF toolchain:
+ *
+ *	if (an UDP datagram to the port, over IPv4 without options or fragments, or IPv6
+ *	    without extension headers)
+ *		return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ *	return XDP_PASS;
+ *
+ * The fallback action in the flags of bpf_redirect_map() passes the frames of the queues
+ * without a socket to the kernel; it needs Linux 5.3 or newer.
+ */
+#define INSN(code_, dst_, src_, off_, imm_) \
+	((struct bpf_insn){ .code = (code_), .dst_reg = (dst_), .src_reg = (src_), \
+			    .off = (off_), .imm = (imm_) })
+#define MOV64_REG(dst, src)       INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define MOV64_IMM(dst, imm)       INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define ALU64_IMM(op, dst, imm)   INSN(BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define LDX_MEM(size, dst, src, off) INSN(BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define JMP_REG(op, dst, src, off) INSN(BPF_JMP | (op) | BPF_X, dst, src, off, 0)
+#define JMP_IMM(op, dst, imm, off) INSN(BPF_JMP | (op) | BPF_K, dst, 0, off, imm)
+#define JMP_A(off)                INSN(BPF_JMP | BPF_JA, 0, 0, off, 0)
+#define LD_MAP_FD(dst, fd) \
+	INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(func)                INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define EXIT()                    INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int prog_load(int map_fd, uint16_t port)
+{
+	/* The packet loads are in the byte order of the wire, hence the htons(). */
+	const struct bpf_insn prog[] = {
+		/*  0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+		/*  1 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)),
+		/*  2 */ LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)),
+		/*  3 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+		/*  4 */ ALU64_IMM(BPF_ADD, BPF_REG_4, ETH_HLEN_ + IP4_HLEN + UDP_HLEN),
+		/*  5 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 24),         /* pass */
+		/*  6 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),           /* ethertype */
+		/*  7 */ JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IP), 7),     /* ipv4 */
+		/*  8 */ JMP_IMM(BPF_JNE, BPF_REG_5, htons(ETH_P_IPV6), 21), /* pass */
+		/*  9 */ ALU64_IMM(BPF_ADD, BPF_REG_4, IP6_HLEN - IP4_HLEN),
+		/* 10 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 19),         /* pass */
+		/* 11 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN_ + 6),  /* next header */
+		/* 12 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, 17),       /* pass */
+		/* 13 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN_ + IP6_HLEN + 2),
+		/* 14 */ JMP_A(8),                                            /* port */
+		/* ipv4: */
+		/* 15 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN_),    /* version, IHL */
+		/* 16 */ JMP_IMM(BPF_JNE, BPF_REG_5, 0x45, 13),              /* pass */
+		/* 17 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN_ + 9), /* protocol */
+		/* 18 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, 11),       /* pass */
+		/* 19 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN_ + 6), /* flags, fragment */
+		/* 20 */ ALU64_IMM(BPF_AND, BPF_REG_5, htons(0x3fff)),
+		/* 21 */ JMP_IMM(BPF_JNE, BPF_REG_5, 0, 8),                  /* pass */
+		/* 22 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN_ + IP4_HLEN + 2),
+		/* port: */
+		/* 23 */ JMP_IMM(BPF_JNE, BPF_REG_5, htons(port), 6),        /* pass */
+		/* 24 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)),
+		/* 25 */ LD_MAP_FD(BPF_REG_1, map_fd),
+		/* 27 */ MOV64_IMM(BPF_REG_3, XDP_PASS),
+		/* 28 */ CALL(BPF_FUNC_redirect_map),
+		/* 29 */ EXIT(),
+		/* pass: */
+		/* 30 */ MOV64_IMM(BPF_REG_0, XDP_PASS),
+		/* 31 */ EXIT(),
+	};
+	char log[1024] = "";
+	int fd = bpf_load_program(BPF_PROG_TYPE_XDP, prog, sizeof(prog) / sizeof(prog[0]),
+				  "GPL", 0, log, sizeof(log));
+	if (fd < 0) {
+		kr_log_error("[xdp] program rejected: %s\n%s", strerror(errno), log);
+		return kr_error(errno);
+	}
+	return fd;
+}
+
+/** Name of the socket map, which identifies the program and its port. */
+static void map_name(char *dst, uint16_t port)
+{
+	snprintf(dst, BPF_OBJ_NAME_LEN, "kresd_%u", (unsigned)port);
+}
+
+/** Find the socket map of the program attached to the interface, or 0 if there's none. */
+static int prog_find_map(int ifindex, uint16_t port)
+{
+	uint32_t prog_id = 0;
+	int ret = bpf_get_link_xdp_id(ifindex, &prog_id, 0);
+	if (ret != 0) {
+		return kr_error(-ret);
+	}
+	if (prog_id == 0) {
+		return 0;
+	}
+	int prog_fd = bpf_prog_get_fd_by_id(prog_id);
+	if (prog_fd < 0) {
+		return kr_error(errno);
+	}
+	uint32_t map_id = 0;
+	struct bpf_prog_info prog_info = {
+		.nr_map_ids = 1,
+		.map_ids = (uint64_t)(uintptr_t)&map_id,
+	};
+	uint32_t info_len = sizeof(prog_info);
+	ret = bpf_obj_get_info_by_fd(prog_fd, &prog_info, &info_len);
+	close(prog_fd);
+	if (ret != 0 || map_id == 0) {
+		return kr_error(EBUSY); /* not ours */
+	}
+	int map_fd = bpf_map_get_fd_by_id(map_id);
+	if (map_fd < 0) {
+		return kr_error(errno);
+	}
+	struct bpf_map_info map_info;
+	memset(&map_info, 0, sizeof(map_info));
+	info_len = sizeof(map_info);
+	char name[BPF_OBJ_NAME_LEN];
+	map_name(name, port);
+	if (bpf_obj_get_info_by_fd(map_fd, &map_info, &info_len) != 0
+	    || map_info.type != BPF_MAP_TYPE_XSKMAP || strcmp(map_info.name, name) != 0) {
+		close(map_fd);
+		return kr_error(EBUSY); /* not ours, or for another port */
+	}
+	return map_fd;
+}
+
+/** Get the socket map of our program on the interface, attaching it if needed. */
+static int prog_attach(int ifindex, uint16_t port)
+{
+	/* Forks race for attaching the program, the loser uses the winner's. */
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		int map_fd = prog_find_map(ifindex, port);
+		if (map_fd != 0) {
+			return map_fd;
+		}
+		char name[BPF_OBJ_NAME_LEN];
+		map_name(name, port);
+		map_fd = bpf_create_map_name(BPF_MAP_TYPE_XSKMAP, name, sizeof(int), sizeof(int),
+					     XDP_QUEUES_MAX, 0);
+		if (map_fd < 0) {
+			return kr_error(errno);
+		}
+		int prog_fd = prog_load(map_fd, port);
+		if (prog_fd < 0) {
+			close(map_fd);
+			return prog_fd;
+		}
+		int ret = bpf_set_link_xdp_fd(ifindex, prog_fd, XDP_FLAGS_UPDATE_IF_NOEXIST);
+		close(prog_fd); /* the interface holds it */
+		if (ret == 0) {
+			return map_fd;
+		}
+		close(map_fd);
+		if (ret != -EBUSY && ret != -EEXIST) {
+			return kr_error(-ret);
+		}
+	}
+	return kr_error(EBUSY);
+}
+
+static void xdp_sock_free(struct xdp_sock *xs)
+{
+	if (xs->xsk) {
+		(void) bpf_map_delete_elem(xs->map_fd, &xs->queue);
+		xsk_socket__delete(xs->xsk);
+	}
+	if (xs->umem) {
+		xsk_umem__delete(xs->umem);
+	}
+	if (xs->map_fd > 0) {
+		close(xs->map_fd);
+	}
+	free(xs->umem_area);
+	xs->xsk = NULL;
+	xs->umem = NULL;
+	xs->umem_area = NULL;
+	xs->map_fd = -1;
+}
+
+static void tx_kick(struct xdp_sock *xs)
+{
+	xs->tx_pending = false;
+	if (xsk_ring_prod__needs_wakeup(&xs->tx)) {
+		(void) sendto(xsk_socket__fd(xs->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+	}
+}
+
+/** Take the sent frames back from the completion ring. */
+static void tx_reclaim(struct xdp_sock *xs)
+{
+	uint32_t idx = 0;
+	const unsigned done = xsk_ring_cons__peek(&xs->cq, XDP_TX_FRAMES, &idx);
+	for (unsigned i = 0; i < done; ++i) {
+		assert(xs->tx_free_len < XDP_TX_FRAMES);
+		xs->tx_free[xs->tx_free_len++] = *xsk_ring_cons__comp_addr(&xs->cq, idx + i);
+	}
+	xsk_ring_cons__release(&xs->cq, done);
+}
+
+/** Parse Ethernet, IP and UDP headers of a frame to us.
+ * @return the DNS message length, or 0 if it isn't one */
+static size_t frame_parse(const struct xdp_sock *xs, const uint8_t *frame, size_t len,
+			  union inaddr *src, union inaddr *dst, const uint8_t **msg)
+{
+	if (len < ETH_HLEN_ + IP4_HLEN + UDP_HLEN) {
+		return 0;
+	}
+	const uint8_t *ip = frame + ETH_HLEN_;
+	const uint8_t *udp = NULL;
+	memset(src, 0, sizeof(*src));
+	memset(dst, 0, sizeof(*dst));
+	switch (wire_read_u16(frame + 12)) {
+	case ETH_P_IP:
+		if (ip[0] != 0x45 || ip[9] != IPPROTO_UDP
+		    || wire_read_u16(ip + 2) > len - ETH_HLEN_) {
+			return 0;
+		}
+		src->ip4.sin_family = dst->ip4.sin_family = AF_INET;
+		memcpy(&src->ip4.sin_addr, ip + 12, 4);
+		memcpy(&dst->ip4.sin_addr, ip + 16, 4);
+		udp = ip + IP4_HLEN;
+		break;
+	case ETH_P_IPV6:
+		if (len < ETH_HLEN_ + IP6_HLEN + UDP_HLEN || ip[6] != IPPROTO_UDP
+		    || wire_read_u16(ip + 4) > len - ETH_HLEN_ - IP6_HLEN) {
+			return 0;
+		}
+		src->ip6.sin6_family = dst->ip6.sin6_family = AF_INET6;
+		memcpy(&src->ip6.sin6_addr, ip + 8, 16);
+		memcpy(&dst->ip6.sin6_addr, ip + 24, 16);
+		udp = ip + IP6_HLEN;
+		break;
+	default:
+		return 0;
+	}
+	const size_t udp_len = wire_read_u16(udp + 4);
+	if (udp_len < UDP_HLEN + KNOT_WIRE_HEADER_SIZE || udp + udp_len > frame + len) {
+		return 0;
+	}
+	/* The ports are in network byte order in both. */
+	memcpy(&src->ip4.sin_port, udp, 2);
+	memcpy(&dst->ip4.sin_port, udp + 2, 2);
+	if (dst->ip4.sin_port != xs->addr.ip4.sin_port) {
+		return 0;
+	}
+	/* Only for our address, unless listening on a wildcard. */
+	if (dst->ip.sa_family != xs->addr.ip.sa_family) {
+		return 0;
+	}
+	if (dst->ip.sa_family == AF_INET && xs->addr.ip4.sin_addr.s_addr != INADDR_ANY
+	    && xs->addr.ip4.sin_addr.s_addr != dst->ip4.sin_addr.s_addr) {
+		return 0;
+	}
+	if (dst->ip.sa_family == AF_INET6 && !IN6_IS_ADDR_UNSPECIFIED(&xs->addr.ip6.sin6_addr)
+	    && !IN6_ARE_ADDR_EQUAL(&xs->addr.ip6.sin6_addr, &dst->ip6.sin6_addr)) {
+		return 0;
+	}
+	*msg = udp + UDP_HLEN;
+	return udp_len - UDP_HLEN;
+}
+
+static void xdp_recv(uv_poll_t *handle, int status, int events)
+{
+	struct xdp_sock *xs = (struct xdp_sock *)handle;
+	struct session *s = handle->data;
+	struct worker_ctx *worker = handle->loop->data;
+	if (status != 0 || s->closing) {
+		return;
+	}
+	uint32_t idx_rx = 0;
+	const unsigned rcvd = xsk_ring_cons__peek(&xs->rx, XDP_BATCH, &idx_rx);
+	uint64_t frames[XDP_BATCH];
+	xs->in_recv = true;
+	for (unsigned i = 0; i < rcvd; ++i) {
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xs->rx, idx_rx + i);
+		frames[i] = desc->addr;
+		const uint8_t *frame = xsk_umem__get_data(xs->umem_area, desc->addr);
+		union inaddr src, dst;
+		const uint8_t *msg = NULL;
+		const size_t msg_len = frame_parse(xs, frame, desc->len, &src, &dst, &msg);
+		if (msg_len == 0) {
+			worker->stats.xdp_dropped += 1;
+			continue;
+		}
+		worker->stats.xdp_rx += 1;
+		/* The query is parsed in place, the frame is ours until the next refill. */
+		knot_pkt_t *query = knot_pkt_new((uint8_t *)msg, msg_len, &worker->pkt_pool);
+		if (query) {
+			query->max_size = KNOT_WIRE_MAX_PKTSIZE;
+			xs->cur_dst = &dst;
+			xs->cur_eth = frame;
+			worker_submit(worker, (uv_handle_t *)handle, query, &src.ip);
+			xs->cur_dst = NULL;
+			xs->cur_eth = NULL;
+		}
+		mp_flush(worker->pkt_pool.ctx);
+	}
+	xs->in_recv = false;
+	xsk_ring_cons__release(&xs->rx, rcvd);
+
+	/* Give the frames back for receiving; the fill ring has room for all of them. */
+	uint32_t idx_fq = 0;
+	if (rcvd > 0 && xsk_ring_prod__reserve(&xs->fq, rcvd, &idx_fq) == rcvd) {
+		for (unsigned i = 0; i < rcvd; ++i) {
+			*xsk_ring_prod__fill_addr(&xs->fq, idx_fq + i) = frames[i];
+		}
+		xsk_ring_prod__submit(&xs->fq, rcvd);
+	} else {
+		assert(rcvd == 0);
+	}
+	if (xs->tx_pending) {
+		tx_kick(xs);
+	}
+}
+
+int xdp_bind(uv_loop_t *loop, uv_poll_t **handle, const struct sockaddr *addr,
+	     const char *ifname, uint32_t queue)
+{
+	if (!loop || !handle || !addr || !ifname || queue >= XDP_QUEUES_MAX
+	    || strlen(ifname) >= IF_NAMESIZE
+	    || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+		return kr_error(EINVAL);
+	}
+	const int ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		return kr_error(errno);
+	}
+	struct xdp_sock *xs = calloc(1, sizeof(*xs));
+	if (!xs) {
+		return kr_error(ENOMEM);
+	}
+	strcpy(xs->ifname, ifname);
+	xs->queue = queue;
+	memcpy(&xs->addr, addr, kr_sockaddr_len(addr));
+
+	/* The MTU limits the answers, they are never fragmented. */
+	xs->mtu = 1500;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock >= 0) {
+		struct ifreq ifr;
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, ifname);
+		if (ioctl(sock, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu > 0) {
+			xs->mtu = ifr.ifr_mtu;
+		}
+		close(sock);
+	}
+
+	int ret = prog_attach(ifindex, kr_inaddr_port(addr));
+	if (ret < 0) {
+		free(xs);
+		return ret;
+	}
+	xs->map_fd = ret;
+
+	const size_t umem_size = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+	if (posix_memalign(&xs->umem_area, getpagesize(), umem_size) != 0) {
+		xs->umem_area = NULL;
+		ret = kr_error(ENOMEM);
+		goto fail;
+	}
+	const struct xsk_umem_config umem_cfg = {
+		.fill_size = XDP_RX_FRAMES,
+		.comp_size = XDP_TX_FRAMES,
+		.frame_size = XDP_FRAME_SIZE,
+		.frame_headroom = 0,
+	};
+	ret = xsk_umem__create(&xs->umem, xs->umem_area, umem_size, &xs->fq, &xs->cq, &umem_cfg);
+	if (ret != 0) {
+		xs->umem = NULL;
+		goto fail;
+	}
+	const struct xsk_socket_config sock_cfg = {
+		.rx_size = XDP_RX_FRAMES,
+		.tx_size = XDP_TX_FRAMES,
+		.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+		.bind_flags = XDP_USE_NEED_WAKEUP,
+	};
+	ret = xsk_socket__create(&xs->xsk, ifname, queue, xs->umem, &xs->rx, &xs->tx, &sock_cfg);
+	if (ret != 0) {
+		xs->xsk = NULL;
+		goto fail;
+	}
+	const int fd = xsk_socket__fd(xs->xsk);
+	if (bpf_map_update_elem(xs->map_fd, &queue, &fd, 0) != 0) {
+		ret = kr_error(errno);
+		goto fail;
+	}
+
+	/* All the receive frames go to the fill ring, the rest waits for sending. */
+	uint32_t idx = 0;
+	if (xsk_ring_prod__reserve(&xs->fq, XDP_RX_FRAMES, &idx) != XDP_RX_FRAMES) {
+		ret = kr_error(ENOMEM);
+		goto fail;
+	}
+	for (unsigned i = 0; i < XDP_RX_FRAMES; ++i) {
+		*xsk_ring_prod__fill_addr(&xs->fq, idx + i) = (uint64_t)i * XDP_FRAME_SIZE;
+	}
+	xsk_ring_prod__submit(&xs->fq, XDP_RX_FRAMES);
+	for (unsigned i = 0; i < XDP_TX_FRAMES; ++i) {
+		xs->tx_free[i] = (uint64_t)(XDP_RX_FRAMES + i) * XDP_FRAME_SIZE;
+	}
+	xs->tx_free_len = XDP_TX_FRAMES;
+
+	struct session *session = session_new();
+	if (!session) {
+		ret = kr_error(ENOMEM);
+		goto fail;
+	}
+	ret = uv_poll_init(loop, &xs->poll, fd);
+	if (ret != 0) {
+		session_free(session);
+		goto fail;
+	}
+	session->outgoing = false;
+	session->handle = (uv_handle_t *)&xs->poll;
+	xs->poll.data = session;
+	ret = uv_poll_start(&xs->poll, UV_READABLE, xdp_recv);
+	if (ret != 0) {
+		xdp_close(&xs->poll, false);
+		return ret;
+	}
+	*handle = &xs->poll;
+	kr_log_verbose("[xdp] listening on %s queue %u, MTU %u\n", ifname, queue, xs->mtu);
+	return kr_ok();
+fail:
+	kr_log_error("[xdp] %s queue %u: %s\n", ifname, queue, kr_strerror(ret));
+	xdp_sock_free(xs);
+	free(xs);
+	return ret;
+}
+
+void xdp_close(uv_poll_t *handle, bool force)
+{
+	if (!handle) {
+		return;
+	}
+	struct xdp_sock *xs = (struct xdp_sock *)handle;
+	/* The poll must not watch the descriptor when it's closed. */
+	if (!force) {
+		uv_poll_stop(handle);
+	}
+	xdp_sock_free(xs);
+	if (force) {
+		handle->loop = NULL;
+		io_free((uv_handle_t *)handle);
+	} else if (!uv_is_closing((uv_handle_t *)handle)) {
+		uv_close((uv_handle_t *)handle, io_free);
+	}
+}
+
+int xdp_frame_addrs(uv_poll_t *handle, union inaddr *dst, struct xdp_eth *eth)
+{
+	struct xdp_sock *xs = (struct xdp_sock *)handle;
+	if (!xs->cur_dst) {
+		return kr_error(EINVAL);
+	}
+	memcpy(dst, xs->cur_dst, sizeof(*dst));
+	memcpy(eth->local, xs->cur_eth, sizeof(eth->local));
+	memcpy(eth->peer, xs->cur_eth + 6, sizeof(eth->peer));
+	return kr_ok();
+}
+
+size_t xdp_payload_max(uv_poll_t *handle, const struct sockaddr *peer)
+{
+	const struct xdp_sock *xs = (const struct xdp_sock *)handle;
+	const size_t ip_max = MIN(xs->mtu, XDP_FRAME_SIZE - ETH_HLEN_);
+	return ip_max - UDP_HLEN - (peer->sa_family == AF_INET6 ? IP6_HLEN : IP4_HLEN);
+}
+
+/** Internet checksum (RFC 1071) of the data, added to a partial sum. */
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		sum += wire_read_u16(data + i);
+	}
+	if (len % 2) {
+		sum += (uint32_t)data[len - 1] << 8;
+	}
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+int xdp_send(uv_poll_t *handle, const struct sockaddr *src, const struct sockaddr *dst,
+	     const struct xdp_eth *eth, const knot_pkt_t *pkt)
+{
+	struct xdp_sock *xs = (struct xdp_sock *)handle;
+	struct worker_ctx *worker = handle->loop->data;
+	if (!xs->xsk || src->sa_family != dst->sa_family) {
+		return kr_error(EINVAL);
+	}
+	if (pkt->size > xdp_payload_max(handle, dst)) {
+		return kr_error(EMSGSIZE);
+	}
+	tx_reclaim(xs);
+	uint32_t idx = 0;
+	if (xs->tx_free_len == 0 || xsk_ring_prod__reserve(&xs->tx, 1, &idx) != 1) {
+		worker->stats.xdp_dropped += 1;
+		return kr_error(ENOBUFS);
+	}
+	const uint64_t addr = xs->tx_free[--xs->tx_free_len];
+	uint8_t *frame = xsk_umem__get_data(xs->umem_area, addr);
+
+	const bool ip6 = dst->sa_family == AF_INET6;
+	const size_t ip_hlen = ip6 ? IP6_HLEN : IP4_HLEN;
+	const size_t udp_len = UDP_HLEN + pkt->size;
+	memcpy(frame, eth->peer, 6);
+	memcpy(frame + 6, eth->local, 6);
+	wire_write_u16(frame + 12, ip6 ? ETH_P_IPV6 : ETH_P_IP);
+	uint8_t *ip = frame + ETH_HLEN_;
+	uint8_t *udp = ip + ip_hlen;
+	memcpy(udp + UDP_HLEN, pkt->wire, pkt->size);
+
+	/* The UDP checksum covers a pseudo-header with the addresses, length and protocol. */
+	uint32_t sum = udp_len + IPPROTO_UDP;
+	if (ip6) {
+		const struct sockaddr_in6 *s6 = (const struct sockaddr_in6 *)src;
+		const struct sockaddr_in6 *d6 = (const struct sockaddr_in6 *)dst;
+		wire_write_u32(ip, 0x60000000);
+		wire_write_u16(ip + 4, udp_len);
+		ip[6] = IPPROTO_UDP;
+		ip[7] = 64; /* hop limit */
+		memcpy(ip + 8, &s6->sin6_addr, 16);
+		memcpy(ip + 24, &d6->sin6_addr, 16);
+		sum = csum_add(sum, ip + 8, 32);
+		memcpy(udp, &s6->sin6_port, 2);
+		memcpy(udp + 2, &d6->sin6_port, 2);
+	} else {
+		const struct sockaddr_in *s4 = (const struct sockaddr_in *)src;
+		const struct sockaddr_in *d4 = (const struct sockaddr_in *)dst;
+		ip[0] = 0x45;
+		ip[1] = 0;
+		wire_write_u16(ip + 2, IP4_HLEN + udp_len);
+		wire_write_u16(ip + 4, 0);      /* identification */
+		wire_write_u16(ip + 6, 0x4000); /* don't fragment */
+		ip[8] = 64; /* TTL */
+		ip[9] = IPPROTO_UDP;
+		wire_write_u16(ip + 10, 0);
+		memcpy(ip + 12, &s4->sin_addr, 4);
+		memcpy(ip + 16, &d4->sin_addr, 4);
+		wire_write_u16(ip + 10, csum_fold(csum_add(0, ip, IP4_HLEN)));
+		sum = csum_add(sum, ip + 12, 8);
+		memcpy(udp, &s4->sin_port, 2);
+		memcpy(udp + 2, &d4->sin_port, 2);
+	}
+	wire_write_u16(udp + 4, udp_len);
+	wire_write_u16(udp + 6, 0);
+	uint16_t udp_sum = csum_fold(csum_add(sum, udp, udp_len));
+	wire_write_u16(udp + 6, udp_sum ? udp_sum : 0xffff);
+
+	struct xdp_desc *desc = xsk_ring_prod__tx_desc(&xs->tx, idx);
+	desc->addr = addr;
+	desc->len = ETH_HLEN_ + ip_hlen + udp_len;
+	xsk_ring_prod__submit(&xs->tx, 1);
+	worker->stats.xdp_tx += 1;
+	xs->tx_pending = true;
+	if (!xs->in_recv) {
+		tx_kick(xs);
+	}
+	return kr_ok();
+}
+
+int xdp_info(uv_poll_t *handle, const char **ifname, uint32_t *queue)
+{
+	const struct xdp_sock *xs = (const struct xdp_sock *)handle;
+	*ifname = xs->ifname;
+	*queue = xs->queue;
+	return kr_ok();
+}
+
+#else /* ENABLE_XDP */
+
+int xdp_bind(uv_loop_t *loop, uv_poll_t **handle, const struct sockaddr *addr,
+	     const char *ifname, uint32_t queue)
+{
+	return kr_error(ENOTSUP);
+}
+
+void xdp_close(uv_poll_t *handle, bool force)
+{
+}
+
+int xdp_frame_addrs(uv_poll_t *handle, union inaddr *dst, struct xdp_eth *eth)
+{
+	return kr_error(ENOTSUP);
+}
+
+size_t xdp_payload_max(uv_poll_t *handle, const struct sockaddr *peer)
+{
+	return 0;
+}
+
+int xdp_send(uv_poll_t *handle, const struct sockaddr *src, const struct sockaddr *dst,
+	     const struct xdp_eth *eth, const knot_pkt_t *pkt)
+{
+	return kr_error(ENOTSUP);
+}
+
+int xdp_info(uv_poll_t *handle, const char **ifname, uint32_t *queue)
+{
+	return kr_error(ENOTSUP);
+}
+
+#endif /* ENABLE_XDP */
@@ -0,0 +1,63 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file xdp.h
+ *
+ * DNS over UDP through an AF_XDP socket, bypassing the kernel network stack.
+ *
+ * The endpoint is a uv_poll_t on the socket (handle->type == UV_POLL), with
+ * a session in handle->data like the UDP listeners have.  A small XDP program
+ * on the interface redirects the UDP datagrams to the port into the socket
+ * of the receive queue; everything else, incl. TCP, passes to the kernel.
+ * Without ENABLE_XDP the functions fail with ENOTSUP.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+#include <libknot/packet/pkt.h>
+#include "lib/utils.h"
+
+/** Ethernet source and destination of a received frame, to answer it. */
+struct xdp_eth {
+	uint8_t peer[6];  /**< The client, or the router in front of us */
+	uint8_t local[6];
+};
+
+/** Start listening on the queue of the interface; the handle is allocated.
+ * @param addr the local address and port, answered only for the port if it's a wildcard */
+int xdp_bind(uv_loop_t *loop, uv_poll_t **handle, const struct sockaddr *addr,
+	     const char *ifname, uint32_t queue);
+
+/** Stop listening and free the handle, at once if force (the loop isn't running). */
+void xdp_close(uv_poll_t *handle, bool force);
+
+/** Get the addresses of the frame being submitted to the worker, see request_create().
+ * @return 0 or an error if not called from within the receive callback */
+int xdp_frame_addrs(uv_poll_t *handle, union inaddr *dst, struct xdp_eth *eth);
+
+/** The largest answer that fits into one frame for the peer. */
+size_t xdp_payload_max(uv_poll_t *handle, const struct sockaddr *peer);
+
+/** Copy the answer into a frame on the transmit ring.
+ * The ring is kicked after the receive wave, or right away outside of it. */
+int xdp_send(uv_poll_t *handle, const struct sockaddr *src, const struct sockaddr *dst,
+	     const struct xdp_eth *eth, const knot_pkt_t *pkt);
+
+/** Interface name and queue of the endpoint. */
+int xdp_info(uv_poll_t *handle, const char **ifname, uint32_t *queue);
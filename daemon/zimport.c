@@ -23,21 +23,17 @@
  * 1) Zone file parsing.
  * 2) Import of parsed entries into the cache.
  *
- * These stages are implemented as two separate functions
- * (zi_zone_import and zi_zone_process) which runs sequentially with the
- * pause between them. This is done because resolver is a single-threaded
- * application, so it can't process user's requests during the whole import
- * process. Separation into two stages allows to reduce the
- * continuous time interval when resolver can't serve user requests.
- * Since root zone isn't large it is imported as single
- * chunk. If it would be considered as necessary, import stage can be
- * split into shorter stages.
+ * The resolver is single-threaded, so neither stage may block the event loop
+ * for long: parsing runs in the libuv threadpool and the import is split
+ * into chunks of ZONE_IMPORT_CHUNK rrsets, with the loop serving requests
+ * between them.
  *
- * zi_zone_import() uses libzscanner to parse zone file.
- * Parsed records are stored to internal storage from where they are imported to
- * cache during the second stage.
+ * zi_zone_import() opens the zone file and queues zi_parse_work(),
+ * which uses libzscanner to parse it.  Parsed records are stored
+ * to internal storage from where they are imported to cache during the second stage.
+ * The worker thread owns the context until zi_parse_done() runs.
  *
- * zi_zone_process() imports parsed resource records to cache.
+ * zi_zone_process() imports parsed resource records to cache on a timer.
  * It imports rrset by creating request that will never be sent to upstream.
  * After request creation resolver creates pseudo-answer which must contain
  * all necessary data for validation. Then resolver process answer as if he had
@@ -51,7 +47,10 @@
 #include <zscanner/scanner.h>
 
 #include "lib/utils.h"
+#include "lib/cache/api.h"
 #include "lib/dnssec/ta.h"
+#include "lib/generic/hash.h"
+#include "lib/generic/trie.h"
 #include "daemon/worker.h"
 #include "daemon/zimport.h"
 #include "lib/generic/map.h"
@@ -62,21 +61,50 @@
 /* Pause between parse and import stages, milliseconds.
  * See comment in zi_zone_import() */
 #define ZONE_IMPORT_PAUSE 100
+/* Number of rrsets imported in one timer tick and pause between the ticks. */
+#define ZONE_IMPORT_CHUNK 64
+#define ZONE_IMPORT_CHUNK_PAUSE 1
+/* Number of rrsets skipped as unchanged in one timer tick, see zi_rrset_unchanged(). */
+#define ZONE_IMPORT_CHUNK_SKIP 1024
+
+/* Import stages, see zi_zone_process() */
+enum zi_stage {
+	ZI_STAGE_KEY = 0, /* DNSKEY of the origin */
+	ZI_STAGE_NS,      /* delegations with DS, NSEC* and glue */
+	ZI_STAGE_OTHER,   /* the rest */
+};
 
 typedef array_t(knot_rrset_t *) qr_rrsetlist_t;
 
 struct zone_import_ctx {
 	struct worker_ctx *worker;
 	bool started;
+	bool parsing;  /* zi_parse_work() is queued or running */
+	bool freeing;  /* zi_free() was called during parsing */
 	knot_dname_t *origin;
 	knot_rrset_t *ta;
 	knot_rrset_t *key;
 	uint64_t start_timestamp;
+	enum zi_stage stage;
 	size_t rrset_idx;
+	size_t failed;
+	size_t ns_imported;
+	size_t other_imported;
+	size_t unchanged;
+	/* Digests of the pseudo answers imported last time, by kr_rrkey() of the rrset;
+	 * they're kept across the imports, unlike the pools. */
+	trie_t *digests;
+	trie_t *digests_new;
+	uint64_t last_timestamp; /* start of the import that made `digests` */
+	uint8_t digest_key[KR_SIPHASH_KEY_SIZE];
 	uv_timer_t timer;
+	uv_work_t work;
+	zs_scanner_t *scanner;
+	int parse_ret;
 	map_t rrset_indexed;
 	qr_rrsetlist_t rrset_sorted;
 	knot_mm_t pool;
+	knot_mm_t tmp_pool; /* pseudo packets, flushed after each rrset */
 	zi_callback cb;
 	void *cb_param;
 };
@@ -107,10 +135,18 @@ static void zi_ctx_free(zone_import_ctx_t *z_import)
 static int zi_reset(struct zone_import_ctx *z_import, size_t rrset_sorted_list_size)
 {
 	mp_flush(z_import->pool.ctx);
+	mp_flush(z_import->tmp_pool.ctx);
 
 	z_import->started = false;
 	z_import->start_timestamp = 0;
+	z_import->stage = ZI_STAGE_KEY;
 	z_import->rrset_idx = 0;
+	z_import->failed = 0;
+	z_import->ns_imported = 0;
+	z_import->other_imported = 0;
+	z_import->unchanged = 0;
+	z_import->origin = NULL;
+	z_import->key = NULL;
 	z_import->pool.alloc = (knot_mm_alloc_t) mp_alloc;
 	z_import->rrset_indexed = map_make(&z_import->pool);
 
@@ -146,19 +182,29 @@ zone_import_ctx_t *zi_allocate(struct worker_ctx *worker,
 		return NULL;
 	}
 	void *mp = mp_new (8192);
-	if (!mp) {
+	void *tmp_mp = mp_new (16384);
+	if (!mp || !tmp_mp) {
+		if (mp) mp_delete(mp);
+		if (tmp_mp) mp_delete(tmp_mp);
 		zi_ctx_free(z_import);
 		return NULL;
 	}
 	memset(z_import, 0, sizeof(*z_import));
 	z_import->pool.ctx = mp;
+	z_import->tmp_pool.ctx = tmp_mp;
+	z_import->tmp_pool.alloc = (knot_mm_alloc_t) mp_alloc;
 	z_import->worker = worker;
 	int ret = zi_reset(z_import, 0);
 	if (ret < 0) {
 		mp_delete(mp);
+		mp_delete(tmp_mp);
 		zi_ctx_free(z_import);
 		return NULL;
 	}
+	for (int i = 0; i < KR_SIPHASH_KEY_SIZE; i += 4) {
+		const uint32_t r = kr_rand_uint(0);
+		memcpy(z_import->digest_key + i, &r, sizeof(r));
+	}
 	uv_timer_init(z_import->worker->loop, &z_import->timer);
 	z_import->timer.data = z_import;
 	z_import->cb = cb;
@@ -168,12 +214,25 @@ zone_import_ctx_t *zi_allocate(struct worker_ctx *worker,
 
 void zi_free(zone_import_ctx_t *z_import)
 {
+	if (z_import->parsing) {
+		/* The threadpool still uses it, finish in zi_parse_done(). */
+		z_import->freeing = true;
+		return;
+	}
+	uv_timer_stop(&z_import->timer);
 	z_import->started = false;
 	z_import->start_timestamp = 0;
 	z_import->rrset_idx = 0;
 	mp_delete(z_import->pool.ctx);
 	z_import->pool.ctx = NULL;
 	z_import->pool.alloc = NULL;
+	mp_delete(z_import->tmp_pool.ctx);
+	z_import->tmp_pool.ctx = NULL;
+	z_import->tmp_pool.alloc = NULL;
+	trie_free(z_import->digests);
+	z_import->digests = NULL;
+	trie_free(z_import->digests_new);
+	z_import->digests_new = NULL;
 	z_import->worker = NULL;
 	z_import->cb = NULL;
 	z_import->cb_param = NULL;
@@ -309,7 +368,7 @@ static int zi_put_glue(zone_import_ctx_t *z_import, knot_pkt_t *pkt,
 /** @internal Create query. */
 static knot_pkt_t *zi_query_create(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 {
-	knot_mm_t *pool = &z_import->pool;
+	knot_mm_t *pool = &z_import->tmp_pool;
 
 	uint32_t msgid = kr_rand_uint(0);
 
@@ -331,21 +390,77 @@ static knot_pkt_t *zi_query_create(zone_import_ctx_t *z_import, knot_rrset_t *rr
 	return query;
 }
 
+/** @internal Check the cached rrset, it must outlive the time since the last import,
+ * i.e. likely last until the next one. */
+static bool zi_cached_fresh(zone_import_ctx_t *z_import, const knot_dname_t *owner,
+			    uint16_t type, bool secure)
+{
+	struct kr_cache *cache = &z_import->worker->engine->resolver.cache;
+	uint8_t rank = 0;
+	int32_t ttl = 0;
+	if (kr_cache_peek_rr(cache, owner, type, &rank, &ttl) != 0) {
+		return false;
+	}
+	const uint64_t interval = (z_import->start_timestamp - z_import->last_timestamp) / 1000;
+	return (!secure || kr_rank_test(rank, KR_RANK_SECURE))
+		&& ttl > 0 && (uint64_t)ttl > interval;
+}
+
+/** @internal Check whether the rrset needn't be imported again: its pseudo answer
+ * is the same as the last time and the cached data are still good. */
+static bool zi_rrset_unchanged(zone_import_ctx_t *z_import, const knot_rrset_t *rr,
+			       const char *key, int key_len, uint64_t digest, bool is_referral)
+{
+	trie_val_t *val = z_import->digests
+		? trie_get_try(z_import->digests, key, key_len) : NULL;
+	if (!val || (uintptr_t)*val != (uintptr_t)digest) {
+		return false;
+	}
+	if (!is_referral) {
+		return zi_cached_fresh(z_import, rr->owner, rr->type, true);
+	}
+	/* The delegation NS isn't signed, the DS is; if there is one. */
+	if (!zi_cached_fresh(z_import, rr->owner, KNOT_RRTYPE_NS, false)) {
+		return false;
+	}
+	char ds_key[KR_RRKEY_LEN];
+	int ret = kr_rrkey(ds_key, rr->rclass, rr->owner, KNOT_RRTYPE_DS, KNOT_RRTYPE_DS);
+	return ret > 0 && (!map_contains(&z_import->rrset_indexed, ds_key)
+			   || zi_cached_fresh(z_import, rr->owner, KNOT_RRTYPE_DS, true));
+}
+
+/** @internal Remember the digest for the next import. */
+static void zi_rrset_digest_save(zone_import_ctx_t *z_import, const char *key, int key_len,
+				 uint64_t digest)
+{
+	if (!z_import->digests_new) {
+		z_import->digests_new = trie_create_arena(NULL);
+	}
+	trie_val_t *val = z_import->digests_new
+		? trie_get_ins(z_import->digests_new, key, key_len) : NULL;
+	if (val) {
+		*val = (trie_val_t)(uintptr_t)digest;
+	}
+}
+
 /** @internal Import given rrset to cache.
- * @return -1 if failed; 0 if success */
+ * @return -1 if failed; 0 if success; 1 if skipped as unchanged */
 static int zi_rrset_import(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 {
 	struct worker_ctx *worker = z_import->worker;
 
 	assert(worker);
 
+	/* Drop the pseudo packets of the previous rrset. */
+	mp_flush(z_import->tmp_pool.ctx);
+
 	/* Create "pseudo query" which asks for given rrset. */
 	knot_pkt_t *query = zi_query_create(z_import, rr);
 	if (!query) {
 		return -1;
 	}
 
-	knot_mm_t *pool = &z_import->pool;
+	knot_mm_t *pool = &z_import->tmp_pool;
 	uint8_t *dname = rr->owner;
 	uint16_t rrtype = rr->type;
 	uint16_t rrclass = rr->rclass;
@@ -359,42 +474,15 @@ static int zi_rrset_import(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 	knot_pkt_put_question(answer, dname, rrclass, rrtype);
 	knot_pkt_begin(answer, KNOT_ANSWER);
 
-	struct kr_qflags options;
-	memset(&options, 0, sizeof(options));
-	options.DNSSEC_WANT = true;
-	options.NO_MINIMIZE = true;
-
-	/* This call creates internal structures which necessary for
-	 * resolving - qr_task & request_ctx. */
-	struct qr_task *task = worker_resolve_start(worker, query, options);
-	if (!task) {
-		knot_pkt_free(&query);
-		knot_pkt_free(&answer);
-		return -1;
-	}
-
-	/* Push query to the request resolve plan.
-	 * Actually query will never been sent to upstream. */
-	struct kr_request *request = worker_task_request(task);
-	struct kr_rplan *rplan = &request->rplan;
-	struct kr_query *qry = kr_rplan_push(rplan, NULL, dname, rrclass, rrtype);
+	struct qr_task *task = NULL;
+	char rrkey[KR_RRKEY_LEN];
+	int rrkey_len = 0;
+	uint64_t digest = 0;
 	int state = KR_STATE_FAIL;
 	bool origin_is_owner = knot_dname_is_equal(rr->owner, z_import->origin);
 	bool is_referral = (rrtype == KNOT_RRTYPE_NS && !origin_is_owner);
 	uint32_t msgid = knot_wire_get_id(query->wire);
 
-	qry->id = msgid;
-
-	/* Prepare zonecut. It must have all the necessary requisites for
-	 * successful validation - matched zone name & keys & trust-anchors. */
-	kr_zonecut_init(&qry->zone_cut, z_import->origin, pool);
-	qry->zone_cut.key = z_import->key;
-	qry->zone_cut.trust_anchor = z_import->ta;
-
-	if (knot_pkt_init_response(request->answer, query) != 0) {
-		goto cleanup;
-	}
-
 	/* Since "pseudo" query asks for NS for subzone,
 	 * "pseudo" answer must simulate referral. */
 	if (is_referral) {
@@ -428,6 +516,20 @@ static int zi_rrset_import(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 		}
 	}
 
+	/* The pseudo answer holds all that the rrset brings into cache;
+	 * if it's the same as the last time, validating it again is a waste. */
+	rrkey_len = kr_rrkey(rrkey, rrclass, dname, rrtype, rrtype);
+	if (rrkey_len > 0) {
+		digest = kr_siphash24(z_import->digest_key, answer->wire + KNOT_WIRE_HEADER_SIZE,
+				      answer->size - KNOT_WIRE_HEADER_SIZE);
+		if (zi_rrset_unchanged(z_import, rr, rrkey, rrkey_len, digest, is_referral)) {
+			zi_rrset_digest_save(z_import, rrkey, rrkey_len, digest);
+			knot_pkt_free(&query);
+			knot_pkt_free(&answer);
+			return 1;
+		}
+	}
+
 	knot_wire_set_id(answer->wire, msgid);
 	answer->parsed = answer->size;
 	err = knot_pkt_parse(answer, 0);
@@ -435,6 +537,36 @@ static int zi_rrset_import(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 		goto cleanup;
 	}
 
+	struct kr_qflags options;
+	memset(&options, 0, sizeof(options));
+	options.DNSSEC_WANT = true;
+	options.NO_MINIMIZE = true;
+
+	/* This call creates internal structures which necessary for
+	 * resolving - qr_task & request_ctx. */
+	task = worker_resolve_start(worker, query, options);
+	if (!task) {
+		goto cleanup;
+	}
+
+	/* Push query to the request resolve plan.
+	 * Actually query will never been sent to upstream. */
+	struct kr_request *request = worker_task_request(task);
+	struct kr_rplan *rplan = &request->rplan;
+	struct kr_query *qry = kr_rplan_push(rplan, NULL, dname, rrclass, rrtype);
+
+	qry->id = msgid;
+
+	/* Prepare zonecut. It must have all the necessary requisites for
+	 * successful validation - matched zone name & keys & trust-anchors. */
+	kr_zonecut_init(&qry->zone_cut, z_import->origin, pool);
+	qry->zone_cut.key = z_import->key;
+	qry->zone_cut.trust_anchor = z_import->ta;
+
+	if (knot_pkt_init_response(request->answer, query) != 0) {
+		goto cleanup;
+	}
+
 	/* Importing doesn't imply communication with upstream at all.
 	 * "answer" contains pseudo-answer from upstream and must be successfully
 	 * validated in CONSUME stage. If not, something gone wrong. */
@@ -444,8 +576,16 @@ cleanup:
 
 	knot_pkt_free(&query);
 	knot_pkt_free(&answer);
-	worker_task_finalize(task, state);
-	return state == (is_referral ? KR_STATE_PRODUCE : KR_STATE_DONE) ? 0 : -1;
+	if (task) {
+		worker_task_finalize(task, state);
+	}
+	if (state != (is_referral ? KR_STATE_PRODUCE : KR_STATE_DONE)) {
+		return -1;
+	}
+	if (rrkey_len > 0) {
+		zi_rrset_digest_save(z_import, rrkey, rrkey_len, digest);
+	}
+	return 0;
 }
 
 /** @internal Create element in qr_rrsetlist_t rrset_list for
@@ -459,32 +599,42 @@ static int zi_mapwalk_preprocess(const char *k, void *v, void *baton)
 	return (ret < 0);
 }
 
-/** @internal Iterate over parsed rrsets and try to import each of them. */
-static void zi_zone_process(uv_timer_t* handle)
+/** @internal Import single rrset, with logging.
+ * @return -1 if failed; 0 if success; 1 if skipped as unchanged */
+static int zi_rrset_import_verbose(zone_import_ctx_t *z_import, knot_rrset_t *rr)
 {
-	zone_import_ctx_t *z_import = (zone_import_ctx_t *)handle->data;
-
-	assert(z_import->worker);
-
-	size_t failed = 0;
-	size_t ns_imported = 0;
-	size_t other_imported = 0;
+	char qname_str[KNOT_DNAME_MAXLEN], type_str[16];
+	knot_dname_to_str(qname_str, rr->owner, sizeof(qname_str));
+	knot_rrtype_to_string(rr->type, type_str, sizeof(type_str));
+	VERBOSE_MSG(NULL, "importing: qname: '%s' type: '%s'\n",
+		    qname_str, type_str);
+	int res = zi_rrset_import(z_import, rr);
+	if (res > 0) {
+		VERBOSE_MSG(NULL, "unchanged: qname: '%s' type: '%s'\n",
+			    qname_str, type_str);
+	} else if (res != 0) {
+		VERBOSE_MSG(NULL, "import failed: qname: '%s' type: '%s'\n",
+			    qname_str, type_str);
+	}
+	return res;
+}
 
+/** @internal Check the parsed zone and import its DNSKEY.
+ * @return -1 if failed; 0 if success; 1 if there is nothing to import */
+static int zi_zone_begin(zone_import_ctx_t *z_import, const char *zone_name_str)
+{
 	/* At the moment import of root zone only is supported.
 	 * Check the name of the parsed zone.
 	 * TODO - implement importing of arbitrary zone. */
-	char zone_name_str[KNOT_DNAME_MAXLEN];
-	knot_dname_to_str(zone_name_str, z_import->origin, sizeof(zone_name_str));
 	if (strcmp(".", zone_name_str) != 0) {
 		kr_log_error("[zimport] unexpected zone name `%s` (root zone expected), fail\n",
 			     zone_name_str);
-		failed = 1;
-		goto finish;
+		return -1;
 	}
 
 	if (z_import->rrset_sorted.len <= 0) {
 		VERBOSE_MSG(NULL, "zone is empty\n");
-		goto finish;
+		return 1;
 	}
 
 	/* TA have been found, zone is secured.
@@ -494,16 +644,14 @@ static void zi_zone_process(uv_timer_t* handle)
 	int err = kr_rrkey(key, KNOT_CLASS_IN, z_import->origin,
 			   KNOT_RRTYPE_DNSKEY, KNOT_RRTYPE_DNSKEY);
 	if (err <= 0) {
-		failed = 1;
-		goto finish;
+		return -1;
 	}
 
 	knot_rrset_t *rr = map_get(&z_import->rrset_indexed, key);
 	if (!rr) {
 		/* DNSKEY MUST be here. If not found - fail. */
 		kr_log_error("[zimport] DNSKEY not found for `%s`, fail\n", zone_name_str);
-		failed = 1;
-		goto finish;
+		return -1;
 	}
 	z_import->key = rr;
 
@@ -513,79 +661,99 @@ static void zi_zone_process(uv_timer_t* handle)
 
 	/* Import DNSKEY at first step. If any validation problems will appear,
 	 * cancel import of whole zone. */
-	char qname_str[KNOT_DNAME_MAXLEN], type_str[16];
-	knot_dname_to_str(qname_str, rr->owner, sizeof(qname_str));
-	knot_rrtype_to_string(rr->type, type_str, sizeof(type_str));
-	VERBOSE_MSG(NULL, "importing: qname: '%s' type: '%s'\n",
-		    qname_str, type_str);
-
-	int res = zi_rrset_import(z_import, rr);
-	if (res != 0) {
-		VERBOSE_MSG(NULL, "import failed: qname: '%s' type: '%s'\n",
-			    qname_str, type_str);
-		failed = 1;
-		goto finish;
+	int ret = zi_rrset_import_verbose(z_import, rr);
+	if (ret > 0) {
+		++z_import->unchanged;
 	}
+	return ret < 0 ? -1 : 0;
+}
 
-	/* Import all NS records */
-	for (size_t i = 0; i < z_import->rrset_sorted.len; ++i) {
-		knot_rrset_t *rr = z_import->rrset_sorted.at[i];
+static void zi_zone_process(uv_timer_t* handle);
 
-		if (rr->type != KNOT_RRTYPE_NS) {
-			continue;
-		}
+/** @internal Iterate over parsed rrsets and try to import each of them,
+ * at most ZONE_IMPORT_CHUNK of them per call. */
+static void zi_zone_chunk(zone_import_ctx_t *z_import)
+{
+	assert(z_import->worker);
 
-		knot_dname_to_str(qname_str, rr->owner, sizeof(qname_str));
-		knot_rrtype_to_string(rr->type, type_str, sizeof(type_str));
-		VERBOSE_MSG(NULL, "importing: qname: '%s' type: '%s'\n",
-			    qname_str, type_str);
-		int res = zi_rrset_import(z_import, rr);
-		if (res == 0) {
-			++ns_imported;
-		} else {
-			VERBOSE_MSG(NULL, "import failed: qname: '%s' type: '%s'\n",
-				    qname_str, type_str);
-			++failed;
+	char zone_name_str[KNOT_DNAME_MAXLEN];
+	knot_dname_to_str(zone_name_str, z_import->origin, sizeof(zone_name_str));
+
+	if (z_import->stage == ZI_STAGE_KEY) {
+		int ret = zi_zone_begin(z_import, zone_name_str);
+		if (ret != 0) {
+			z_import->failed = (ret < 0);
+			goto finish;
 		}
-		z_import->rrset_sorted.at[i] = NULL;
+		z_import->stage = ZI_STAGE_NS;
+		z_import->rrset_idx = 0;
+		uv_timer_start(&z_import->timer, zi_zone_process,
+			       ZONE_IMPORT_CHUNK_PAUSE, ZONE_IMPORT_CHUNK_PAUSE);
+		return;
 	}
 
-	/* NS records have been imported as well as relative DS, NSEC* and glue.
-	 * Now import what's left. */
-	for (size_t i = 0; i < z_import->rrset_sorted.len; ++i) {
-
+	/* Whole chunk is written in a single transaction. */
+	struct kr_cache *cache = &z_import->worker->engine->resolver.cache;
+	kr_cache_batch_begin(cache);
+	size_t budget = ZONE_IMPORT_CHUNK;
+	size_t skip_budget = ZONE_IMPORT_CHUNK_SKIP;
+	while (budget > 0 && skip_budget > 0
+	       && z_import->rrset_idx < z_import->rrset_sorted.len) {
+		const size_t i = z_import->rrset_idx++;
 		knot_rrset_t *rr = z_import->rrset_sorted.at[i];
-		if (rr == NULL) {
-			continue;
-		}
-
-		if (zi_rrset_is_marked_as_imported(rr)) {
-			continue;
-		}
-
-		if (rr->type == KNOT_RRTYPE_DNSKEY || rr->type == KNOT_RRTYPE_RRSIG) {
-			continue;
-		}
-
-		knot_dname_to_str(qname_str, rr->owner, sizeof(qname_str));
-		knot_rrtype_to_string(rr->type, type_str, sizeof(type_str));
-		VERBOSE_MSG(NULL, "importing: qname: '%s' type: '%s'\n",
-			    qname_str, type_str);
-		res = zi_rrset_import(z_import, rr);
-		if (res == 0) {
-			++other_imported;
+		if (z_import->stage == ZI_STAGE_NS) {
+			/* Import all NS records */
+			if (rr->type != KNOT_RRTYPE_NS) {
+				continue;
+			}
+			int ret = zi_rrset_import_verbose(z_import, rr);
+			z_import->rrset_sorted.at[i] = NULL;
+			if (ret > 0) {
+				++z_import->unchanged;
+				--skip_budget;
+				continue;
+			} else if (ret == 0) {
+				++z_import->ns_imported;
+			} else {
+				++z_import->failed;
+			}
 		} else {
-			VERBOSE_MSG(NULL, "import failed: qname: '%s' type: '%s'\n",
-				    qname_str, type_str);
-			++failed;
+			/* NS records have been imported as well as relative DS, NSEC* and glue.
+			 * Now import what's left. */
+			if (rr == NULL || zi_rrset_is_marked_as_imported(rr) ||
+			    rr->type == KNOT_RRTYPE_DNSKEY || rr->type == KNOT_RRTYPE_RRSIG) {
+				continue;
+			}
+			int ret = zi_rrset_import_verbose(z_import, rr);
+			if (ret > 0) {
+				++z_import->unchanged;
+				--skip_budget;
+				continue;
+			} else if (ret == 0) {
+				++z_import->other_imported;
+			} else {
+				++z_import->failed;
+			}
 		}
+		--budget;
+	}
+	kr_cache_batch_end(cache);
+	if (z_import->rrset_idx < z_import->rrset_sorted.len) {
+		return; /* continue on the next tick */
+	}
+	if (z_import->stage == ZI_STAGE_NS) {
+		z_import->stage = ZI_STAGE_OTHER;
+		z_import->rrset_idx = 0;
+		return;
 	}
 
 	uint64_t elapsed = kr_now() - z_import->start_timestamp;
 	elapsed = elapsed > UINT_MAX ? UINT_MAX : elapsed;
 
-	VERBOSE_MSG(NULL, "finished in %lu ms; zone: `%s`; ns: %zd; other: %zd; failed: %zd\n",
-		    elapsed, zone_name_str, ns_imported, other_imported, failed);
+	VERBOSE_MSG(NULL, "finished in %lu ms; zone: `%s`; ns: %zd; other: %zd; "
+		    "unchanged: %zd; failed: %zd\n",
+		    elapsed, zone_name_str, z_import->ns_imported,
+		    z_import->other_imported, z_import->unchanged, z_import->failed);
 
 finish:
 
@@ -594,8 +762,9 @@ finish:
 
 	int import_state = 0;
 
-	if (failed != 0) {
-		if (ns_imported == 0 && other_imported == 0) {
+	if (z_import->failed != 0) {
+		if (z_import->ns_imported == 0 && z_import->other_imported == 0
+		    && z_import->unchanged == 0) {
 			import_state = -1;
 			VERBOSE_MSG(NULL, "import failed; zone `%s` \n", zone_name_str);
 		} else {
@@ -605,11 +774,32 @@ finish:
 		import_state = 0;
 	}
 
+	/* The next import compares with this one; the failed rrsets aren't in it. */
+	if (import_state >= 0 && z_import->digests_new) {
+		trie_free(z_import->digests);
+		z_import->digests = z_import->digests_new;
+		z_import->last_timestamp = z_import->start_timestamp;
+	} else {
+		trie_free(z_import->digests_new);
+	}
+	z_import->digests_new = NULL;
+
 	if (z_import->cb != NULL) {
 		z_import->cb(import_state, z_import->cb_param);
 	}
 }
 
+/** @internal The timer of the import, measured by the profiler (see worker_prof_enable()). */
+static void zi_zone_process(uv_timer_t* handle)
+{
+	zone_import_ctx_t *z_import = (zone_import_ctx_t *)handle->data;
+	/* The callback at the end may free the context. */
+	struct worker_ctx *worker = z_import->worker;
+	const uint64_t prof_since = worker_prof_begin(worker);
+	zi_zone_chunk(z_import);
+	worker_prof_end(worker, PROF_ZIMPORT, prof_since, NULL);
+}
+
 /** @internal Store rrset that has been imported to zone import context memory pool.
  * @return -1 if failed; 0 if success. */
 static int zi_record_store(zs_scanner_t *s)
@@ -708,6 +898,63 @@ static int zi_state_parsing(zs_scanner_t *s)
 	return -1;
 }
 
+/** @internal Parse the zone file, in the threadpool.
+ * @note Only the parser and the context's pool are touched here. */
+static void zi_parse_work(uv_work_t *req)
+{
+	zone_import_ctx_t *z_import = (zone_import_ctx_t *)req->data;
+	z_import->parse_ret = zi_state_parsing(z_import->scanner);
+	if (z_import->parse_ret == 0) {
+		map_walk(&z_import->rrset_indexed, zi_mapwalk_preprocess, z_import);
+	}
+}
+
+/** @internal Parsing has finished, start the import; in the event loop. */
+static void zi_parse_done(uv_work_t *req, int status)
+{
+	zone_import_ctx_t *z_import = (zone_import_ctx_t *)req->data;
+	zs_scanner_t *s = z_import->scanner;
+	z_import->scanner = NULL;
+	z_import->parsing = false;
+	uint64_t elapsed = kr_now() - z_import->start_timestamp;
+	elapsed = elapsed > UINT_MAX ? UINT_MAX : elapsed;
+
+	int ret = (status == 0) ? z_import->parse_ret : -1;
+	if (ret != 0) {
+		kr_log_error("[zscanner] error parsing zone file `%s`\n", s->file.name);
+	}
+	zs_deinit(s);
+	free(s);
+	if (z_import->freeing) {
+		zi_free(z_import);
+		return;
+	}
+
+	if (ret == 0) {
+		VERBOSE_MSG(NULL, "[zscanner] finished in %lu ms\n", elapsed);
+		/* Find TA for the parsed origin. */
+		trie_t *trust_anchors = z_import->worker->engine->resolver.trust_anchors;
+		z_import->ta = z_import->origin ? kr_ta_get(trust_anchors, z_import->origin) : NULL;
+		if (!z_import->ta) {
+			/* For now - fail.
+			 * TODO - query DS and continue after answer had been obtained. */
+			kr_log_error("[zimport] no TA found for the parsed zone, fail\n");
+			ret = -1;
+		}
+	}
+	if (ret != 0) {
+		z_import->started = false;
+		if (z_import->cb != NULL) {
+			z_import->cb(-1, z_import->cb_param);
+		}
+		return;
+	}
+
+	/* Zone have been parsed already, so start the import. */
+	uv_timer_start(&z_import->timer, zi_zone_process,
+		       ZONE_IMPORT_PAUSE, ZONE_IMPORT_PAUSE);
+}
+
 int zi_zone_import(struct zone_import_ctx *z_import,
 		   const char *zone_file, const char *origin,
 		   uint16_t rclass, uint32_t ttl)
@@ -716,6 +963,14 @@ int zi_zone_import(struct zone_import_ctx *z_import,
 	assert (z_import->worker != NULL && "[zimport] invalid <z_import> parameter\n");
 	assert (zone_file != NULL && "[zimport] empty <zone_file> parameter\n");
 
+	/* Only the root zone is supported, so check its TA right away.
+	 * TODO - query DS and continue after answer had been obtained. */
+	trie_t *trust_anchors = z_import->worker->engine->resolver.trust_anchors;
+	if (!kr_ta_get(trust_anchors, (const knot_dname_t *)"")) {
+		kr_log_error("[zimport] no TA found for `.`, fail\n");
+		return 1;
+	}
+
 	zs_scanner_t *s = malloc(sizeof(zs_scanner_t));
 	if (s == NULL) {
 		kr_log_error("[zscanner] error creating instance of zone scanner (malloc() fails)\n");
@@ -753,47 +1008,28 @@ int zi_zone_import(struct zone_import_ctx *z_import,
 		return -1;
 	}
 
-	uint64_t elapsed = 0;
 	int ret = zi_reset(z_import, 4096);
 	if (ret == 0) {
 		z_import->started = true;
+		z_import->parsing = true;
 		z_import->start_timestamp = kr_now();
+		z_import->scanner = s;
+		z_import->work.data = z_import;
 		VERBOSE_MSG(NULL, "[zscanner] started; zone file `%s`\n",
 			    zone_file);
-		ret = zi_state_parsing(s);
-		/* Try to find TA for worker->z_import.origin. */
-		map_t *trust_anchors = &z_import->worker->engine->resolver.trust_anchors;
-		knot_rrset_t *rr = kr_ta_get(trust_anchors, z_import->origin);
-		if (rr) {
-			z_import->ta = rr;
-		} else {
-			/* For now - fail.
-			 * TODO - query DS and continue after answer had been obtained. */
-			char zone_name_str[KNOT_DNAME_MAXLEN];
-			knot_dname_to_str(zone_name_str, z_import->origin, sizeof(zone_name_str));
-			kr_log_error("[zimport] no TA found for `%s`, fail\n", zone_name_str);
-			ret = 1;
-		}
-		elapsed = kr_now() - z_import->start_timestamp;
-		elapsed = elapsed > UINT_MAX ? UINT_MAX : elapsed;
+		ret = uv_queue_work(z_import->worker->loop, &z_import->work,
+				    zi_parse_work, zi_parse_done);
 	}
-	zs_deinit(s);
-	free(s);
-
 	if (ret != 0) {
 		kr_log_error("[zscanner] error parsing zone file `%s`\n", zone_file);
 		z_import->started = false;
-		return ret;
+		z_import->parsing = false;
+		z_import->scanner = NULL;
+		zs_deinit(s);
+		free(s);
+		return -1;
 	}
 
-	VERBOSE_MSG(NULL, "[zscanner] finished in %lu ms; zone file `%s`\n",
-			    elapsed, zone_file);
-	map_walk(&z_import->rrset_indexed, zi_mapwalk_preprocess, z_import);
-
-	/* Zone have been parsed already, so start the import. */
-	uv_timer_start(&z_import->timer, zi_zone_process,
-		       ZONE_IMPORT_PAUSE, ZONE_IMPORT_PAUSE);
-
 	return 0;
 }
 
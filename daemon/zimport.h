@@ -47,13 +47,16 @@ void zi_free(struct zone_import_ctx *z_import);
 /**
  * Import zone from file.
  *
+ * The file is parsed in the libuv threadpool and imported in chunks later,
+ * the callback passed to zi_allocate() is called when the import finishes.
+ *
  * @note only root zone import is supported; origin must be NULL or "."
  * @param z_import pointer to zone import context
  * @param zone_file zone file name
  * @param origin default origin
  * @param rclass default class
  * @param ttl    default ttl
- * @return 0 or an error code
+ * @return 0 if parsing started, 1 if there's no TA for the root, -1 on error
  */
 int zi_zone_import(struct zone_import_ctx *z_import,
 		   const char *zone_file, const char *origin,
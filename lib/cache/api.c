@@ -24,6 +24,7 @@
 
 #include <libknot/errcode.h>
 #include <libknot/descriptor.h>
+#include <libknot/packet/wire.h>
 #include <libknot/dname.h>
 #include <libknot/rrtype/rrsig.h>
 
@@ -58,9 +59,11 @@ static const uint16_t CACHE_VERSION = 3;
 
 
 /** @internal Forward declarations of the implementation details */
-static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, const knot_rrset_t *rr, const knot_rrset_t *rr_sigs, uint32_t timestamp, uint8_t rank);
+static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, const knot_rrset_t *rr, const knot_rrset_t *rr_sigs, uint32_t timestamp, uint8_t rank,
+			   const knot_edns_client_subnet_t *ecs);
 /** Preliminary checks before stash_rrset().  Don't call if returns <= 0. */
 static int stash_rrset_precond(const knot_rrset_t *rr, const struct kr_query *qry/*logs*/);
+static knot_db_val_t key_exact_type(struct key *k, uint16_t type);
 
 /** @internal Removes all records from cache. */
 static inline int cache_clear(struct kr_cache *cache)
@@ -118,12 +121,25 @@ int kr_cache_open(struct kr_cache *cache, const struct kr_cdb_api *api, struct k
 	if (!api) {
 		api = kr_cdb_lmdb();
 	}
+	if (api == kr_cdb_lmdb() && opts && opts->shards > 1) {
+		api = kr_cdb_lmdb_shards();
+	}
 	cache->api = api;
 	int ret = cache->api->open(&cache->db, opts, mm);
 	if (ret != 0) {
 		return ret;
 	}
 	memset(&cache->stats, 0, sizeof(cache->stats));
+	memset(&cache->batch, 0, sizeof(cache->batch));
+	memset(&cache->l1_stats, 0, sizeof(cache->l1_stats));
+	memset(&cache->gc, 0, sizeof(cache->gc));
+	cache->gc.target = KR_CACHE_GC_TARGET;
+	cache->l1 = NULL;
+	if (l1_create(cache, KR_CACHE_L1_SIZE, opts ? opts->path : NULL) != 0) {
+		kr_log_info("[cache] can't allocate the in-process copy of hot entries\n");
+	}
+	/* Counting is skipped without them. */
+	cache->kstats = calloc(1, sizeof(*cache->kstats));
 	cache->ttl_min = KR_CACHE_DEFAULT_TTL_MIN;
 	cache->ttl_max = KR_CACHE_DEFAULT_TTL_MAX;
 	/* Check cache ABI version */
@@ -141,6 +157,13 @@ void kr_cache_close(struct kr_cache *cache)
 		cache_op(cache, close);
 		cache->db = NULL;
 	}
+	if (cache) {
+		l1_free(cache);
+		kr_cache_remote_close(cache);
+		free(cache->kstats);
+		cache->kstats = NULL;
+		flush_clear(cache);
+	}
 }
 
 int kr_cache_sync(struct kr_cache *cache)
@@ -148,19 +171,101 @@ int kr_cache_sync(struct kr_cache *cache)
 	if (!cache_isvalid(cache)) {
 		return kr_error(EINVAL);
 	}
+	if (cache->batch.depth) {
+		cache->batch.deferred += 1;
+		return kr_ok();
+	}
+	remote_sync(cache);
 	if (cache->api->sync) {
 		return cache_op(cache, sync);
 	}
 	return kr_ok();
 }
 
+void kr_cache_batch_begin(struct kr_cache *cache)
+{
+	if (cache_isvalid(cache)) {
+		cache->batch.depth += 1;
+	}
+}
+
+int kr_cache_batch_end(struct kr_cache *cache)
+{
+	if (!cache || cache->batch.depth == 0) {
+		return kr_error(EINVAL);
+	}
+	if (--cache->batch.depth > 0 || cache->batch.deferred == 0) {
+		return kr_ok();
+	}
+	cache->batch.commits += 1;
+	cache->batch.saved += cache->batch.deferred - 1;
+	cache->batch.deferred = 0;
+	return kr_cache_sync(cache);
+}
+
+int kr_cache_writer(struct kr_cache *cache, bool enable)
+{
+	if (!cache_isvalid(cache)) {
+		return kr_error(EINVAL);
+	}
+	if (!cache->api->writer) {
+		return enable ? kr_error(ENOTSUP) : kr_ok();
+	}
+	/* Don't leave the writes of a batch behind. */
+	if (cache->batch.depth) {
+		return kr_error(EBUSY);
+	}
+	return cache_op(cache, writer, enable);
+}
+
+int kr_cache_writer_stats(struct kr_cache *cache, struct kr_cdb_writer_stats *stats)
+{
+	if (!cache_isvalid(cache) || !stats) {
+		return kr_error(EINVAL);
+	}
+	if (!cache->api->writer_stats) {
+		return kr_error(ENOENT);
+	}
+	return cache_op(cache, writer_stats, stats);
+}
+
+int kr_cache_read_reuse(struct kr_cache *cache, unsigned max_age_ms, unsigned max_ops)
+{
+	if (!cache_isvalid(cache)) {
+		return kr_error(EINVAL);
+	}
+	if (!cache->api->read_reuse) {
+		return max_age_ms ? kr_error(ENOTSUP) : kr_ok();
+	}
+	return cache_op(cache, read_reuse, max_age_ms, max_ops);
+}
+
+int kr_cache_read_renew(struct kr_cache *cache)
+{
+	if (!cache_isvalid(cache)) {
+		return kr_error(EINVAL);
+	}
+	return cache->api->read_renew ? cache_op(cache, read_renew) : kr_ok();
+}
+
+int kr_cache_read_stats(struct kr_cache *cache, struct kr_cdb_read_stats *stats)
+{
+	if (!cache_isvalid(cache) || !stats) {
+		return kr_error(EINVAL);
+	}
+	if (!cache->api->read_stats) {
+		return kr_error(ENOENT);
+	}
+	return cache_op(cache, read_stats, stats);
+}
+
 int kr_cache_insert_rr(struct kr_cache *cache, const knot_rrset_t *rr, const knot_rrset_t *rrsig, uint8_t rank, uint32_t timestamp)
 {
 	int err = stash_rrset_precond(rr, NULL);
 	if (err <= 0) {
 		return kr_ok();
 	}
-	ssize_t written = stash_rrset(cache, NULL, rr, rrsig, timestamp, rank);
+	ssize_t written = stash_rrset(cache, NULL, rr, rrsig, timestamp, rank, NULL);
 	if (written >= 0) {
 		return kr_ok();
 	}
@@ -168,11 +273,275 @@ int kr_cache_insert_rr(struct kr_cache *cache, const knot_rrset_t *rr, const kno
 	return (int) written;
 }
 
+int kr_cache_peek_rr(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+		     uint8_t *rank, int32_t *ttl)
+{
+	if (!cache || !kr_cache_is_open(cache) || !name || !rank
+	    || type == KNOT_RRTYPE_NSEC || type == KNOT_RRTYPE_NSEC3
+	    || type == KNOT_RRTYPE_RRSIG) {
+		return kr_error(EINVAL);
+	}
+	struct key k_storage, *k = &k_storage;
+	memset(k, 0, sizeof(*k));
+	int ret = kr_dname_lf(k->buf, name, false);
+	if (ret) {
+		return kr_error(ret);
+	}
+	knot_db_val_t key = key_exact_type(k, type);
+	knot_db_val_t val = { NULL, 0 };
+	ret = cache_read(cache, &key, &val);
+	if (!ret) {
+		ret = entry_h_seek(&val, type);
+	}
+	const struct entry_h *eh = ret ? NULL : entry_h_consistent(val, type);
+	if (!eh || eh->is_packet) {
+		return kr_error(ENOENT);
+	}
+	*rank = eh->rank;
+	if (ttl) {
+		*ttl = (int64_t)eh->time + eh->ttl - kr_time();
+	}
+	return kr_ok();
+}
+
+/** @internal Lookup frequency of cache keys, shared with other processes. */
+static cmsketch_t *shared_sketch = NULL;
+
+void kr_cache_share_sketch(cmsketch_t *sketch)
+{
+	shared_sketch = sketch;
+}
+
+void entry_count_use(knot_db_val_t key)
+{
+	cmsketch_add(shared_sketch, key.data, key.len);
+}
+
+unsigned entry_lookups(knot_db_val_t key)
+{
+	return shared_sketch ? cmsketch_estimate(shared_sketch, key.data, key.len) : 0;
+}
+
+uint16_t cache_version(void)
+{
+	return CACHE_VERSION;
+}
+
+uint8_t cache_expiring_pct = 1;
+
+/** @internal Refreshing of the expiring entries, see kr_cache_set_prefetch(). */
+static struct {
+	kr_cache_prefetch_cb cb;
+	unsigned hot;
+} prefetch = { NULL, 0 };
+
+void kr_cache_set_prefetch(kr_cache_prefetch_cb cb, unsigned percent, unsigned hot)
+{
+	prefetch.cb = cb;
+	prefetch.hot = hot;
+	cache_expiring_pct = MIN(percent, 100);
+}
+
+/** @internal Ask for a refresh of the expiring exact hit if it's read often. */
+bool kr_cache_expiring(const struct kr_cache_p *peek, int32_t new_ttl)
+{
+	return new_ttl >= 0 && is_expiring(peek->ttl, new_ttl);
+}
+
+static void prefetch_hit(const struct kr_request *req, const struct kr_query *qry,
+			 knot_db_val_t key)
+{
+	if (!prefetch.cb || !qry->flags.EXPIRING) {
+		return;
+	}
+	/* The lookup has been counted already, so a new name has one. */
+	if (!shared_sketch || prefetch.hot <= 1
+	    || cmsketch_estimate(shared_sketch, key.data, key.len) >= prefetch.hot) {
+		prefetch.cb(req, qry);
+	}
+}
+
+static enum kr_cache_tclass kstats_tclass(uint16_t type)
+{
+	switch (type) {
+	case KNOT_RRTYPE_A:
+	case KNOT_RRTYPE_AAAA:
+		return KR_CACHE_TCLASS_ADDR;
+	case KNOT_RRTYPE_NS:
+	case KNOT_RRTYPE_SOA:
+	case KNOT_RRTYPE_DS:
+	case KNOT_RRTYPE_DNSKEY:
+	case KNOT_RRTYPE_NSEC:
+	case KNOT_RRTYPE_NSEC3:
+		return KR_CACHE_TCLASS_INFRA;
+	default:
+		return KR_CACHE_TCLASS_OTHER;
+	}
+}
+
+static enum kr_cache_rclass kstats_rclass(uint8_t rank)
+{
+	if (kr_rank_test(rank, KR_RANK_SECURE)) {
+		return KR_CACHE_RCLASS_SECURE;
+	} else if (kr_rank_test(rank, KR_RANK_INSECURE)) {
+		return KR_CACHE_RCLASS_INSECURE;
+	}
+	return KR_CACHE_RCLASS_OTHER;
+}
+
+void kstats_count(struct kr_cache *cache, enum kr_cache_kind kind, uint16_t type,
+		  uint8_t rank, enum kr_cache_event event)
+{
+	if (cache->kstats) {
+		cache->kstats->count[kind][kstats_tclass(type)][kstats_rclass(rank)][event] += 1;
+	}
+}
+
+/** @internal Add the entry to the bytes stored, see kr_cache_kstats. */
+static void kstats_sample(struct kr_cache *cache, const knot_db_val_t *key,
+			  const struct entry_h *eh, size_t size)
+{
+	if (!cache->kstats) {
+		return;
+	}
+	/* CACHE_KEY_DEF: exact entries end with '\0' 'E' RRTYPE,
+	 * NSEC3 ones with '\0' '3' chain identifier (top bit set) and the hash. */
+	const uint8_t *k = key->data;
+	const size_t nsec3_tail = 2 + NSEC3_P_LEN + NSEC3_HASH_LEN;
+	enum kr_cache_kind kind;
+	uint16_t type;
+	if (key->len >= 4 && k[key->len - 4] == 0 && k[key->len - 3] == 'E') {
+		memcpy(&type, k + key->len - 2, sizeof(type));
+		kind = eh->is_packet ? KR_CACHE_KIND_PKT : kstats_kind(type);
+	} else if (key->len >= nsec3_tail && k[key->len - nsec3_tail] == 0
+		   && k[key->len - nsec3_tail + 1] == '3'
+		   && (k[key->len - nsec3_tail + 2] & 0x80)) {
+		type = KNOT_RRTYPE_NSEC3;
+		kind = KR_CACHE_KIND_NSEC3;
+	} else {
+		type = KNOT_RRTYPE_NSEC;
+		kind = KR_CACHE_KIND_NSEC1;
+	}
+	cache->kstats->bytes_pass[kind][kstats_tclass(type)][kstats_rclass(eh->rank)] += size;
+}
+
+struct gc_baton {
+	struct kr_cache *cache;
+	uint32_t now;
+	bool over_target;
+};
+
+/** @internal Decide whether to remove an entry, see kr_cache_gc(). */
+static int gc_visit(const knot_db_val_t *key, const knot_db_val_t *val, void *baton)
+{
+	struct gc_baton *gc = baton;
+	gc->cache->gc.scanned += 1;
+	/* The version key: "\0\0V\0"; CACHE_KEY_DEF */
+	if (key->len == 4 && memcmp(key->data, "\x00\x00V", 3) == 0) {
+		return 0;
+	}
+	bool remove;
+	if (val->len < sizeof(struct entry_h)) {
+		remove = true; /* can't be valid */
+	} else if (flush_hides(gc->cache, *key, *val)) {
+		remove = true; /* see kr_cache_remove_subtree() */
+	} else {
+		/* The first entry decides for NS chains, too. */
+		const struct entry_h *eh = val->data;
+		const int64_t expired = (int64_t)gc->now - eh->time - eh->ttl;
+		if (!gc->over_target) {
+			remove = expired > KR_CACHE_GC_STALE;
+		} else {
+			/* CACHE_KEY_DEF: exact entries end with '\0' 'E' RRTYPE */
+			const uint8_t *k = key->data;
+			uint16_t ktype = 0;
+			if (key->len >= 4 && k[key->len - 4] == 0 && k[key->len - 3] == 'E') {
+				memcpy(&ktype, k + key->len - 2, sizeof(ktype));
+			}
+			/* Delegations and keys are needed for many lookups, keep them. */
+			const bool infra = ktype == KNOT_RRTYPE_NS || ktype == KNOT_RRTYPE_DNSKEY;
+			const bool auth = kr_rank_test(eh->rank, KR_RANK_AUTH);
+			if (expired > 0 || infra) {
+				remove = expired > 0;
+			} else if (!shared_sketch) {
+				remove = !auth;
+			} else {
+				/* The first lookup of a name is counted, too (as a miss),
+				 * so names asked for just once (e.g. random subdomains)
+				 * go even if authoritative; others only if not read often. */
+				const unsigned freq = cmsketch_estimate(shared_sketch,
+									key->data, key->len);
+				remove = freq < (auth ? 2 : KR_CACHE_GC_HOT);
+				if (!remove && !auth) {
+					gc->cache->gc.kept_hot += 1;
+				}
+			}
+		}
+	}
+	if (remove) {
+		gc->cache->gc.freed += 1;
+		gc->cache->gc.freed_bytes += key->len + val->len;
+	} else {
+		kstats_sample(gc->cache, key, val->data, key->len + val->len);
+	}
+	return remove;
+}
+
+int kr_cache_gc(struct kr_cache *cache, int max_entries)
+{
+	if (!cache_isvalid(cache) || max_entries <= 0) {
+		return kr_error(EINVAL);
+	}
+	if (!cache->api->walk || !cache->api->usage_percent) {
+		return kr_error(ENOSYS);
+	}
+	double usage = cache_op(cache, usage_percent);
+	/* Rather grow the storage, if it may, than evict anything. */
+	if (usage > cache->gc.target && cache->api->grow && cache_op(cache, grow) == 0) {
+		cache->gc.grown += 1;
+		usage = cache_op(cache, usage_percent);
+	}
+	if (usage >= 0) {
+		cache->gc.usage = usage;
+	}
+	struct gc_baton baton = {
+		.cache = cache,
+		.now = kr_time(), /* entry_h::time is wall-clock */
+		.over_target = cache->gc.usage > cache->gc.target,
+	};
+	knot_db_val_t key = { cache->gc.next, cache->gc.next_len };
+	int ret = cache_op(cache, walk, &key, max_entries, gc_visit, &baton);
+	if (ret >= 0) {
+		if (key.len == 0) {
+			cache->gc.passes += 1;
+			if (cache->kstats) {
+				struct kr_cache_kstats *ks = cache->kstats;
+				memcpy(ks->bytes, ks->bytes_pass, sizeof(ks->bytes));
+				memset(ks->bytes_pass, 0, sizeof(ks->bytes_pass));
+			}
+			flush_gc_pass(cache);
+			/* Age the counts, so that the next pass sees recent lookups. */
+			cmsketch_halve(shared_sketch);
+		}
+		/* Continue after an overlong key as if from the beginning; it's rare. */
+		cache->gc.next_len = key.len <= sizeof(cache->gc.next) ? key.len : 0;
+		if (cache->gc.next_len) {
+			memcpy(cache->gc.next, key.data, key.len);
+		}
+	}
+	kr_cache_sync(cache);
+	return ret;
+}
+
 int kr_cache_clear(struct kr_cache *cache)
 {
 	if (!cache_isvalid(cache)) {
 		return kr_error(EINVAL);
 	}
+	l1_clear(cache);
+	remote_clear(cache);
+	flush_clear(cache);
+	cache->ns_gen += 1;
 	int ret = cache_clear(cache);
 	if (ret == 0) {
 		kr_cache_make_checkpoint(cache);
@@ -216,6 +585,8 @@ struct entry_h * entry_h_consistent(knot_db_val_t data, uint16_t type)
 	ok = ok && (!kr_rank_test(eh->rank, KR_RANK_BOGUS)
 		    || eh->is_packet);
 	ok = ok && (eh->is_packet || !eh->has_optout);
+	ok = ok && (eh->is_packet || !eh->is_chain);
+	ok = ok && (eh->is_packet || !eh->is_nxdomain);
 
 	/* doesn't hold, because of temporary NSEC3 packet caching
 	if (eh->is_packet)
@@ -296,12 +667,21 @@ knot_db_val_t key_exact_type_maypkt(struct key *k, uint16_t type)
 	}
 
 	int name_len = k->buf[0];
-	k->buf[name_len + 1] = 0; /* make sure different names can never match */
-	k->buf[name_len + 2] = 'E'; /* tag for exact name+type matches */
-	memcpy(k->buf + name_len + 3, &type, 2);
+	uint8_t *p = k->buf + 1 + name_len;
+	if (k->ns) {
+		/* CACHE_KEY_DEF: namespaced ones are prefixed by '\0' + 'N' + namespace;
+		 * the tail stays the same, e.g. for the garbage collection. */
+		*p++ = 0;
+		*p++ = 'N'; /* tag for the exact matches within a namespace */
+		*p++ = k->ns;
+	}
+	*p++ = 0; /* make sure different names can never match */
+	*p++ = 'E'; /* tag for exact name+type matches */
+	memcpy(p, &type, 2);
+	p += 2;
 	k->type = type;
 	/* CACHE_KEY_DEF: key == dname_lf + '\0' + 'E' + RRTYPE */
-	return (knot_db_val_t){ k->buf + 1, name_len + 4 };
+	return (knot_db_val_t){ k->buf + 1, p - (k->buf + 1) };
 }
 
 /** Like key_exact_type_maypkt but with extra checks if used for RRs only. */
@@ -321,12 +701,18 @@ static knot_db_val_t key_exact_type(struct key *k, uint16_t type)
 
 /* Forwards for larger chunks of code.  All just for cache_peek. */
 static uint8_t get_lowest_rank(const struct kr_request *req, const struct kr_query *qry);
+static bool want_rrsigs(const struct kr_request *req, const struct kr_query *qry);
 static int found_exact_hit(kr_layer_t *ctx, knot_pkt_t *pkt, knot_db_val_t val,
 			   uint8_t lowest_rank);
-static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k);
+static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k, uint8_t lowest_rank,
+				knot_db_val_t *val_nx);
 static int answer_simple_hit(kr_layer_t *ctx, knot_pkt_t *pkt, uint16_t type,
 		const struct entry_h *eh, const void *eh_bound, uint32_t new_ttl);
 static int cache_peek_real(kr_layer_t *ctx, knot_pkt_t *pkt);
+static int peek_ecs(kr_layer_t *ctx, knot_pkt_t *pkt, struct key *k,
+		    const knot_edns_client_subnet_t *ecs, uint8_t lowest_rank);
+static int peek_ns_cname(kr_layer_t *ctx, knot_pkt_t *pkt, struct key *k,
+			 const struct kr_lf_name *sname_lf);
 static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clencl_name,
 		    uint16_t type, uint8_t lowest_rank,
 		    const struct kr_query *qry, struct kr_cache *cache);
@@ -345,6 +731,7 @@ int cache_peek(kr_layer_t *ctx, knot_pkt_t *pkt)
 	}
 	int ret = cache_peek_real(ctx, pkt);
 	kr_cache_sync(&req->ctx->cache);
+	kr_probe(cache_peek, req, qry->sname, qry->stype, ret == KR_STATE_DONE);
 	return ret;
 }
 
@@ -364,45 +751,94 @@ static int cache_peek_real(kr_layer_t *ctx, knot_pkt_t *pkt)
 	qry->flags.CACHE_TRIED = true;
 
 	struct key k_storage, *k = &k_storage;
+	k->ns = cache_ns(qry);
 	if (qry->stype == KNOT_RRTYPE_NSEC) {
 		VERBOSE_MSG(qry, "=> skipping stype NSEC\n");
 		return ctx->state;
 	}
-	if (!check_dname_for_lf(qry->sname, qry)) {
-		return ctx->state;
-	}
-	int ret = kr_dname_lf(k->buf, qry->sname, false);
-	if (ret) {
+	/* The LF is computed once per query, also for the policy and zone cuts. */
+	const struct kr_lf_name *sname_lf = kr_query_sname_lf(qry);
+	if (!sname_lf || (sname_lf->has_zero && !check_dname_for_lf(qry->sname, qry))) {
 		return ctx->state;
 	}
+	memcpy(k->buf, sname_lf->lf, sname_lf->lf[0] + 1);
+	int ret;
 
 	const uint8_t lowest_rank = get_lowest_rank(req, qry);
 
+	/** 0. answers tailored to the client's subnet, longest scope first */
+	knot_edns_client_subnet_t ecs;
+	if (!k->ns && qry->stype != KNOT_RRTYPE_NS && qry->stype != KNOT_RRTYPE_CNAME
+	    && kr_ecs_get(qry, qry->sname, &ecs)) {
+		ret = peek_ecs(ctx, pkt, k, &ecs, lowest_rank);
+		if (!ret) {
+			return KR_STATE_DONE;
+		}
+		memcpy(k->buf, sname_lf->lf, sname_lf->lf[0] + 1);
+	}
+
 	/** 1. find the name or the closest (available) zone, not considering wildcards
 	 *  1a. exact name+type match (can be negative answer in insecure zones)
 	 */
 	knot_db_val_t key = key_exact_type_maypkt(k, qry->stype);
 	knot_db_val_t val = { NULL, 0 };
-	ret = cache_op(cache, read, &key, &val, 1);
+	/* Count the lookup for the garbage collection, even if it misses. */
+	cmsketch_add(shared_sketch, key.data, key.len);
+	/* Hot entries are copied in-process; the copy may be stale
+	 * while the backend has a fresher one from another process. */
+	ret = l1_peek(cache, key, &val);
 	if (!ret) {
-		/* found an entry: test conditions, materialize into pkt, etc. */
 		ret = found_exact_hit(ctx, pkt, val, lowest_rank);
 	}
+	if (ret == -abs(ENOENT)) {
+		ret = cache_read(cache, &key, &val);
+		if (ret == -abs(ENOENT)) {
+			ret = remote_peek(cache, key, &val);
+		}
+		if (!ret) {
+			/* found an entry: test conditions, materialize into pkt, etc. */
+			ret = found_exact_hit(ctx, pkt, val, lowest_rank);
+			if (!ret) {
+				l1_store(cache, key, val);
+			}
+		}
+	}
 	if (ret && ret != -abs(ENOENT)) {
 		VERBOSE_MSG(qry, "=> exact hit error: %d %s\n",
 				ret, strerror(abs(ret)));
 		assert(false);
 		return ctx->state;
 	} else if (!ret) {
+		prefetch_hit(req, qry, key);
 		return KR_STATE_DONE;
 	}
+	kstats_count(cache, kstats_kind(k->type), qry->stype, 0, KR_CACHE_EV_MISS);
+	if (k->ns) {
+		/* Only the exact entries are in namespaces, incl. CNAMEs. */
+		return peek_ns_cname(ctx, pkt, k, sname_lf) == 0 ? KR_STATE_DONE : ctx->state;
+	}
 
 	/** 1b. otherwise, find the longest prefix NS/xNAME (with OK time+rank). [...] */
 	k->zname = qry->sname;
-	kr_dname_lf(k->buf, k->zname, false); /* LATER(optim.): probably remove */
-	const knot_db_val_t val_cut = closest_NS(ctx, k);
+	memcpy(k->buf, sname_lf->lf, sname_lf->lf[0] + 1);
+	knot_db_val_t val_nx = { NULL, 0 };
+	const knot_db_val_t val_cut = closest_NS(ctx, k, lowest_rank, &val_nx);
+	if (val_nx.data) {
+		/* The sname is at or below a name that doesn't exist (RFC 8020). */
+		const struct entry_h *eh_nx = val_nx.data;
+		int32_t new_ttl = get_new_ttl(eh_nx, qry, qry->sname, qry->stype,
+					      qry->timestamp.tv_sec);
+		kstats_count(cache, KR_CACHE_KIND_PKT, qry->stype, eh_nx->rank,
+			     KR_CACHE_EV_HIT);
+		ret = answer_from_nxdomain(ctx, pkt, eh_nx, new_ttl);
+		return ret == kr_ok() ? KR_STATE_DONE : ctx->state;
+	}
 	if (!val_cut.data) {
 		VERBOSE_MSG(qry, "=> not even root NS in cache, but let's try NSEC\n");
+		kstats_count(cache, KR_CACHE_KIND_NS, KNOT_RRTYPE_NS, 0, KR_CACHE_EV_MISS);
+	} else {
+		const struct entry_h *eh_cut = val_cut.data;
+		kstats_count(cache, KR_CACHE_KIND_NS, k->type, eh_cut->rank, KR_CACHE_EV_HIT);
 	}
 	switch (k->type) {
 	case KNOT_RRTYPE_NS:
@@ -460,6 +896,7 @@ static int cache_peek_real(kr_layer_t *ctx, knot_pkt_t *pkt)
 	struct answer ans;
 	memset(&ans, 0, sizeof(ans));
 	ans.mm = &pkt->mm;
+	ans.skip_rrsigs = !want_rrsigs(req, qry);
 
 	/** Start of NSEC* covering the sname;
 	 * it's part of key - the one within zone (read only) */
@@ -476,27 +913,25 @@ static int cache_peek_real(kr_layer_t *ctx, knot_pkt_t *pkt)
 	 */
 	int clencl_labels = -1;
 	const int sname_labels = knot_dname_labels(qry->sname, NULL);
-	//while (true) { //for (int i_nsecp = 0; i
-	// TODO(NSEC3): better signalling when to "continue;" and when to "break;"
-	// incl. clearing partial answers in `ans`
-		//assert(eh->nsec1_pos <= 1);
-		int nsec = 1;
-		switch (nsec) {
-		case 1:
-			ans.nsec_v = 1;
-			ret = nsec1_encloser(k, &ans, sname_labels, &clencl_labels,
-					     &cover_low_kwz, &cover_hi_kwz, qry, cache);
-			if (ret < 0) return ctx->state;
-			//if (ret > 0) continue; // NSEC3
-			break;
-		case 3: //TODO NSEC3
-		default:
-			assert(false);
+	ans.nsec_v = 1;
+	ret = nsec1_encloser(k, &ans, sname_labels, &clencl_labels,
+			     &cover_low_kwz, &cover_hi_kwz, qry, cache);
+	if (ret < 0) return ctx->state;
+	if (ret > 0) {
+		/* No NSEC proof; drop what we may have gathered and try NSEC3. */
+		for (int i = 0; i < sizeof(ans.rrsets) / sizeof(ans.rrsets[0]); ++i) {
+			answer_rrset_clear(&ans, i);
 		}
-	//}
+		ans.rcode = 0;
+		ans.nsec_v = 3;
+		ret = nsec3_encloser(k, &ans, sname_labels, &clencl_labels, qry, cache);
+		if (ret < 0) return ctx->state;
+	}
 
 	if (ans.rcode != PKT_NODATA && ans.rcode != PKT_NXDOMAIN) {
 		assert(ans.rcode == 0); /* Nothing suitable found. */
+		kstats_count(cache, ans.nsec_v == 1 ? KR_CACHE_KIND_NSEC1 : KR_CACHE_KIND_NSEC3,
+			     qry->stype, 0, KR_CACHE_EV_MISS);
 		return ctx->state;
 	}
 	/* At this point, sname was either covered or matched. */
@@ -514,18 +949,15 @@ static int cache_peek_real(kr_layer_t *ctx, knot_pkt_t *pkt)
 	 */
 	if (!sname_covered) {
 		/* No wildcard checks needed, as we proved that sname exists. */
-		assert(ans.nsec_v == 1); // for now
 
-	} else if (ans.nsec_v == 1 && sname_covered) {
-		int ret = nsec1_src_synth(k, &ans, clencl_name,
-					  cover_low_kwz, cover_hi_kwz, qry, cache);
+	} else {
+		int ret = ans.nsec_v == 1
+			? nsec1_src_synth(k, &ans, clencl_name,
+					  cover_low_kwz, cover_hi_kwz, qry, cache)
+			: nsec3_src_synth(k, &ans, clencl_name, qry, cache);
 		if (ret < 0) return ctx->state;
 		if (ret == AR_SOA) goto do_soa; /* SS was covered or matched for NODATA */
 		assert(ret == 0);
-
-	} else {
-		//TODO NSEC3
-		assert(false);
 	}
 
 
@@ -564,7 +996,7 @@ do_soa:
 		k->buf[0] = k->zlf_len;
 		key = key_exact_type(k, KNOT_RRTYPE_SOA);
 		knot_db_val_t val = { NULL, 0 };
-		ret = cache_op(cache, read, &key, &val, 1);
+		ret = cache_read(cache, &key, &val);
 		const struct entry_h *eh;
 		if (ret || !(eh = entry_h_consistent(val, KNOT_RRTYPE_SOA))) {
 			assert(ret); /* only want to catch `eh` failures */
@@ -615,11 +1047,13 @@ do_soa:
 
 
 	bool expiring = false; // TODO
+	uint8_t rank_min = KR_RANK_SECURE | KR_RANK_AUTH;
 	VERBOSE_MSG(qry, "=> writing RRsets: ");
 	for (int i = 0; i < sizeof(ans.rrsets) / sizeof(ans.rrsets[0]); ++i) {
 		if (i == 1) knot_pkt_begin(pkt, KNOT_AUTHORITY);
 		if (!ans.rrsets[i].set.rr) continue;
 		expiring = expiring || ans.rrsets[i].set.expiring;
+		rank_min = MIN(rank_min, ans.rrsets[i].set.rank);
 		ret = pkt_append(pkt, &ans.rrsets[i], ans.rrsets[i].set.rank);
 		if (ret) {
 			assert(false);
@@ -629,6 +1063,11 @@ do_soa:
 				? "+" : "-");
 	}
 	kr_log_verbose("\n");
+	/* A wildcard expansion was counted by try_wild(). */
+	if (ans.rcode != PKT_NOERROR) {
+		kstats_count(cache, ans.nsec_v == 1 ? KR_CACHE_KIND_NSEC1 : KR_CACHE_KIND_NSEC3,
+			     qry->stype, rank_min, KR_CACHE_EV_HIT);
+	}
 	/* Finishing touches. */
 	qry->flags.EXPIRING = expiring;
 	qry->flags.CACHED = true;
@@ -640,7 +1079,7 @@ do_soa:
 /** It's simply inside of cycle taken out to decrease indentation.  \return error code. */
 static int stash_rrarray_entry(ranked_rr_array_t *arr, int arr_i,
 			const struct kr_query *qry, struct kr_cache *cache,
-			int *unauth_cnt);
+			int *unauth_cnt, const knot_edns_client_subnet_t *ecs);
 
 int cache_stash(kr_layer_t *ctx, knot_pkt_t *pkt)
 {
@@ -658,6 +1097,18 @@ int cache_stash(kr_layer_t *ctx, knot_pkt_t *pkt)
 	if (knot_wire_get_tc(pkt->wire)) {
 		return ctx->state;
 	}
+	/* An answer tailored to the client's subnet is only cached under its scope,
+	 * and only the records asked for (see lib/ecs.h). */
+	knot_edns_client_subnet_t ecs;
+	int ecs_scope = 0;
+	if (kr_ecs_get(qry, qry->sname, &ecs)) {
+		ecs_scope = kr_ecs_scope(pkt, &ecs);
+		ecs.scope_len = MAX(ecs_scope, 0);
+		/* Scoped keys aren't in namespaces; these answers aren't cached. */
+		if (ecs_scope > 0 && cache_ns(qry)) {
+			ecs_scope = kr_error(ENOTSUP);
+		}
+	}
 	/* Stash individual records. */
 	ranked_rr_array_t *selected[] = kr_request_selected(req);
 	int ret = 0;
@@ -671,7 +1122,16 @@ int cache_stash(kr_layer_t *ctx, knot_pkt_t *pkt)
 				continue;
 				/* TODO: probably safe to break but maybe not worth it */
 			}
-			ret = stash_rrarray_entry(arr, i, qry, cache, &unauth_cnt);
+			if (ecs_scope != 0 && psec != KNOT_AUTHORITY
+			    && !(ecs_scope > 0 && psec == KNOT_ANSWER
+				 && entry->rr->type == qry->stype
+				 && entry->rr->type != KNOT_RRTYPE_NS
+				 && entry->rr->type != KNOT_RRTYPE_CNAME
+				 && knot_dname_is_equal(entry->rr->owner, qry->sname))) {
+				continue;
+			}
+			ret = stash_rrarray_entry(arr, i, qry, cache, &unauth_cnt,
+						  ecs_scope > 0 && psec == KNOT_ANSWER ? &ecs : NULL);
 			if (ret) {
 				VERBOSE_MSG(qry, "=> stashing RRs errored out\n");
 				goto finally;
@@ -681,7 +1141,10 @@ int cache_stash(kr_layer_t *ctx, knot_pkt_t *pkt)
 		}
 	}
 
-	stash_pkt(pkt, qry, req);
+	if (ecs_scope == 0) {
+		stash_pkt(pkt, qry, req);
+		stash_chain(qry, req);
+	}
 
 finally:
 	if (unauth_cnt) {
@@ -698,8 +1161,7 @@ static int stash_rrset_precond(const knot_rrset_t *rr, const struct kr_query *qr
 		assert(!EINVAL);
 		return kr_error(EINVAL);
 	}
-	if (!check_rrtype(rr->type, qry)
-	    || rr->type == KNOT_RRTYPE_NSEC3 /*for now; LATER NSEC3*/) {
+	if (!check_rrtype(rr->type, qry)) {
 		return kr_ok();
 	}
 	if (!check_dname_for_lf(rr->owner, qry)) {
@@ -714,7 +1176,8 @@ static int stash_rrset_precond(const knot_rrset_t *rr, const struct kr_query *qr
 }
 
 static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, const knot_rrset_t *rr,
-	                       const knot_rrset_t *rr_sigs, uint32_t timestamp, uint8_t rank)
+	                       const knot_rrset_t *rr_sigs, uint32_t timestamp, uint8_t rank,
+			       const knot_edns_client_subnet_t *ecs)
 {
 	assert(stash_rrset_precond(rr, qry) > 0);
 	if (!cache) {
@@ -725,7 +1188,7 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 	const int wild_labels = rr_sigs == NULL ? 0 :
 	       knot_dname_labels(rr->owner, NULL) - knot_rrsig_labels(&rr_sigs->rrs, 0);
 	//kr_log_verbose("wild_labels = %d\n", wild_labels);
-	if (wild_labels < 0) {
+	if (wild_labels < 0 || (ecs && wild_labels > 0)) {
 		return kr_ok();
 	}
 	const knot_dname_t *encloser = rr->owner;
@@ -736,19 +1199,31 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 	int ret = 0;
 	/* Construct the key under which RRs will be stored. */
 	struct key k_storage, *k = &k_storage;
+	k->ns = cache_ns(qry);
 	knot_db_val_t key;
 	switch (rr->type) {
 	case KNOT_RRTYPE_NSEC:
-		if (!kr_rank_test(rank, KR_RANK_SECURE)) {
-			/* Skip any NSECs that aren't validated. */
+	case KNOT_RRTYPE_NSEC3:
+		/* The aggressive use of NSEC* isn't within namespaces. */
+		if (k->ns || !kr_rank_test(rank, KR_RANK_SECURE)) {
+			/* Skip any NSEC*s that aren't validated. */
 			return kr_ok();
 		}
 		if (!rr_sigs || !rr_sigs->rrs.rr_count || !rr_sigs->rrs.data) {
 			assert(!EINVAL);
 			return kr_error(EINVAL);
 		}
-		k->zlf_len = knot_dname_size(knot_rrsig_signer_name(&rr_sigs->rrs, 0)) - 1;
-		key = key_NSEC1(k, encloser, wild_labels);
+		const knot_dname_t *signer = knot_rrsig_signer_name(&rr_sigs->rrs, 0);
+		if (rr->type == KNOT_RRTYPE_NSEC) {
+			k->zlf_len = knot_dname_size(signer) - 1;
+			key = key_NSEC1(k, encloser, wild_labels);
+			break;
+		}
+		/* NSEC3 owners are never wildcard-expanded. */
+		key = wild_labels ? (knot_db_val_t){ NULL, 0 } : key_NSEC3_rr(k, rr, signer);
+		if (!key.data) {
+			return kr_ok();
+		}
 		break;
 	default:
 		ret = kr_dname_lf(k->buf, encloser, wild_labels);
@@ -756,7 +1231,8 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 			assert(!ret);
 			return kr_error(ret);
 		}
-		key = key_exact_type(k, rr->type);
+		/* The key of a tailored answer follows its index, see below. */
+		key = ecs ? (knot_db_val_t){ NULL, 0 } : key_exact_type(k, rr->type);
 	}
 
 	/* Compute materialized sizes of the new data. */
@@ -768,12 +1244,6 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 			+ rdataset_dematerialize_size(rds_sigs),
 	};
 
-	/* Prepare raw memory for the new entry. */
-	ret = entry_h_splice(&val_new_entry, rank, key, k->type, rr->type,
-				rr->owner, qry, cache, timestamp);
-	if (ret) return kr_ok(); /* some aren't really errors */
-	assert(val_new_entry.data);
-
 	/* Compute TTL, just in case they weren't equal. */
 	uint32_t ttl = -1;
 	const knot_rdataset_t *rdatasets[] = { &rr->rrs, rds_sigs, NULL };
@@ -786,10 +1256,30 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 		}
 	} /* TODO: consider expirations of RRSIGs as well, just in case. */
 
+	ttl = MAX(MIN(ttl, cache->ttl_max), cache->ttl_min);
+
+	/* The tailored answers of a name and type are counted in their index. */
+	if (ecs) {
+		ret = ecs_index_add(cache, k, rr->type, ecs, ttl, rank, timestamp,
+				    qry->request->ctx->ecs.scopes_max);
+		if (ret) {
+			VERBOSE_MSG(qry, "=> not stashing the subnet scope /%d: %s\n",
+					ecs->scope_len, strerror(abs(ret)));
+			return kr_ok();
+		}
+		key = key_ecs(k, rr->type, ecs, ecs->scope_len);
+	}
+
+	/* Prepare raw memory for the new entry. */
+	ret = entry_h_splice(&val_new_entry, rank, key, k->type, rr->type,
+				rr->owner, qry, cache, timestamp);
+	if (ret) return kr_ok(); /* some aren't really errors */
+	assert(val_new_entry.data);
+
 	/* Write the entry itself. */
 	struct entry_h *eh = val_new_entry.data;
 	eh->time = timestamp;
-	eh->ttl  = MAX(MIN(ttl, cache->ttl_max), cache->ttl_min);
+	eh->ttl  = ttl;
 	eh->rank = rank;
 	if (rdataset_dematerialize(&rr->rrs, eh->data)
 	    || rdataset_dematerialize(rds_sigs, eh->data + rr_ssize)) {
@@ -802,6 +1292,7 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 
 	/* Update metrics */
 	cache->stats.insert += 1;
+	kstats_count(cache, kstats_kind(k->type), rr->type, rank, KR_CACHE_EV_STASH);
 
 	WITH_VERBOSE(qry) {
 		/* Reduce verbosity. */
@@ -823,7 +1314,7 @@ static ssize_t stash_rrset(struct kr_cache *cache, const struct kr_query *qry, c
 
 static int stash_rrarray_entry(ranked_rr_array_t *arr, int arr_i,
 			const struct kr_query *qry, struct kr_cache *cache,
-			int *unauth_cnt)
+			int *unauth_cnt, const knot_edns_client_subnet_t *ecs)
 {
 	ranked_rr_array_entry_t *entry = arr->at[arr_i];
 	if (entry->cached) {
@@ -852,7 +1343,8 @@ static int stash_rrarray_entry(ranked_rr_array_t *arr, int arr_i,
 		break;
 	}
 
-	ssize_t written = stash_rrset(cache, qry, rr, rr_sigs, qry->timestamp.tv_sec, entry->rank);
+	ssize_t written = stash_rrset(cache, qry, rr, rr_sigs, qry->timestamp.tv_sec, entry->rank,
+				      ecs);
 	if (written < 0) {
 		return (int) written;
 	}
@@ -888,6 +1380,7 @@ static int answer_simple_hit(kr_layer_t *ctx, knot_pkt_t *pkt, uint16_t type,
 	struct answer ans;
 	memset(&ans, 0, sizeof(ans));
 	ans.mm = &pkt->mm;
+	ans.skip_rrsigs = !want_rrsigs(req, qry);
 	ret = entry2answer(&ans, AR_ANSWER, eh, eh_bound,
 			   qry->sname, type, new_ttl);
 	CHECK_RET(ret);
@@ -937,6 +1430,10 @@ static int found_exact_hit(kr_layer_t *ctx, knot_pkt_t *pkt, knot_db_val_t val,
 		return kr_error(ENOENT);
 	}
 
+	const bool stale = (int64_t)qry->timestamp.tv_sec - eh->time > eh->ttl;
+	kstats_count(&req->ctx->cache, eh->is_packet ? KR_CACHE_KIND_PKT : KR_CACHE_KIND_RR,
+		     qry->stype, eh->rank, stale ? KR_CACHE_EV_STALE : KR_CACHE_EV_HIT);
+
 	const void *eh_bound = val.data + val.len;
 	if (eh->is_packet) {
 		/* Note: we answer here immediately, even if it's (theoretically)
@@ -949,6 +1446,57 @@ static int found_exact_hit(kr_layer_t *ctx, knot_pkt_t *pkt, knot_db_val_t val,
 }
 
 
+/** Try the answers tailored to the client's subnet.  See the single call site. */
+static int peek_ecs(kr_layer_t *ctx, knot_pkt_t *pkt, struct key *k,
+		    const knot_edns_client_subnet_t *ecs, uint8_t lowest_rank)
+{
+	struct kr_query *qry = ctx->req->current_query;
+	struct kr_cache *cache = &ctx->req->ctx->cache;
+	uint8_t scopes[128];
+	const int count = ecs_scopes(cache, k, qry->stype, ecs,
+				     qry->timestamp.tv_sec, scopes);
+	for (int i = 0; i < count; ++i) {
+		knot_db_val_t key = key_ecs(k, qry->stype, ecs, scopes[i]), val;
+		int ret = cache_read(cache, &key, &val);
+		if (!ret) {
+			ret = found_exact_hit(ctx, pkt, val, lowest_rank);
+		}
+		if (!ret) {
+			VERBOSE_MSG(qry, "=> satisfied by the subnet scope /%d\n", scopes[i]);
+			return kr_ok();
+		}
+	}
+	return kr_error(ENOENT);
+}
+
+
+/** Try a CNAME of the name within the namespace of k.  See the single call site. */
+static int peek_ns_cname(kr_layer_t *ctx, knot_pkt_t *pkt, struct key *k,
+			 const struct kr_lf_name *sname_lf)
+{
+	struct kr_query *qry = ctx->req->current_query;
+	if (qry->stype == KNOT_RRTYPE_CNAME) {
+		return kr_error(ENOENT);
+	}
+	memcpy(k->buf, sname_lf->lf, sname_lf->lf[0] + 1);
+	knot_db_val_t key = key_exact_type(k, KNOT_RRTYPE_CNAME), val;
+	int ret = cache_read(&ctx->req->ctx->cache, &key, &val);
+	if (!ret) {
+		ret = entry_h_seek(&val, KNOT_RRTYPE_CNAME);
+	}
+	const struct entry_h *eh = ret ? NULL : entry_h_consistent(val, KNOT_RRTYPE_CNAME);
+	if (!eh || eh->is_packet) {
+		return kr_error(ENOENT);
+	}
+	int32_t new_ttl = get_new_ttl(eh, qry, qry->sname, KNOT_RRTYPE_CNAME,
+				      qry->timestamp.tv_sec);
+	if (new_ttl < 0 || eh->rank < get_lowest_rank(ctx->req, qry)) {
+		return kr_error(ENOENT);
+	}
+	return answer_simple_hit(ctx, pkt, KNOT_RRTYPE_CNAME, eh, val.data + val.len, new_ttl);
+}
+
+
 /** Try to satisfy via wildcard.  See the single call site. */
 static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clencl_name,
 		    const uint16_t type, const uint8_t lowest_rank,
@@ -957,7 +1505,7 @@ static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clenc
 	knot_db_val_t key = key_exact_type(k, type);
 	/* Find the record. */
 	knot_db_val_t val = { NULL, 0 };
-	int ret = cache_op(cache, read, &key, &val, 1);
+	int ret = cache_read(cache, &key, &val);
 	if (!ret) {
 		ret = entry_h_seek(&val, type);
 	}
@@ -973,6 +1521,7 @@ static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clenc
 			VERBOSE_MSG(qry, "=> wildcard: not found: *.%s %s\n",
 					clencl_str, type_str);
 		}
+		kstats_count(cache, KR_CACHE_KIND_WILD, type, 0, KR_CACHE_EV_MISS);
 		return ret;
 	}
 	/* Check if the record is OK. */
@@ -988,8 +1537,12 @@ static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clenc
 		/* Wildcard record with stale TTL, bad rank or packet.  */
 		VERBOSE_MSG(qry, "=> wildcard: skipping %s, rank 0%.2o, new TTL %d\n",
 				eh->is_packet ? "packet" : "RR", eh->rank, new_ttl);
+		kstats_count(cache, KR_CACHE_KIND_WILD, type, eh->rank, KR_CACHE_EV_MISS);
 		return -ABS(ESTALE);
 	}
+	const bool stale = (int64_t)qry->timestamp.tv_sec - eh->time > eh->ttl;
+	kstats_count(cache, KR_CACHE_KIND_WILD, type, eh->rank,
+		     stale ? KR_CACHE_EV_STALE : KR_CACHE_EV_HIT);
 	/* Add the RR into the answer. */
 	const void *eh_bound = val.data + val.len;
 	ret = entry2answer(ans, AR_ANSWER, eh, eh_bound, qry->sname, type, new_ttl);
@@ -1001,20 +1554,16 @@ static int try_wild(struct key *k, struct answer *ans, const knot_dname_t *clenc
 }
 
 
-static int peek_exact_real(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+/** Peek for the name in k->buf, see kr_cache_peek_exact(). */
+static int peek_exact_key(struct kr_cache *cache, struct key *k, uint16_t type,
 			struct kr_cache_p *peek)
 {
-	if (!check_rrtype(type, NULL) || !check_dname_for_lf(name, NULL)) {
-		return kr_error(ENOTSUP);
-	}
-	struct key k_storage, *k = &k_storage;
-
-	int ret = kr_dname_lf(k->buf, name, false);
-	if (ret) return kr_error(ret);
-
 	knot_db_val_t key = key_exact_type(k, type);
 	knot_db_val_t val = { NULL, 0 };
-	ret = cache_op(cache, read, &key, &val, 1);
+	/* e.g. NS addresses are read this way, and they are in the working set */
+	cmsketch_add(shared_sketch, key.data, key.len);
+	ret = cache_read(cache, &key, &val);
+	if (ret == -abs(ENOENT)) ret = remote_peek(cache, key, &val);
 	if (!ret) ret = entry_h_seek(&val, type);
 	if (ret) return kr_error(ret);
 
@@ -1032,6 +1581,35 @@ static int peek_exact_real(struct kr_cache *cache, const knot_dname_t *name, uin
 	};
 	return kr_ok();
 }
+static int peek_exact_real(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+			struct kr_cache_p *peek)
+{
+	if (!check_rrtype(type, NULL) || !check_dname_for_lf(name, NULL)) {
+		return kr_error(ENOTSUP);
+	}
+	struct key k_storage, *k = &k_storage;
+	k->ns = 0;
+
+	int ret = kr_dname_lf(k->buf, name, false);
+	if (ret) return kr_error(ret);
+	return peek_exact_key(cache, k, type, peek);
+}
+int kr_cache_peek_exact_lf(struct kr_cache *cache, const struct kr_lf_name *name,
+			   int labels, uint16_t type, struct kr_cache_p *peek)
+{
+	if (!name || labels < 0 || labels > name->labels) {
+		return kr_error(EINVAL);
+	}
+	if (!check_rrtype(type, NULL) || name->has_zero) {
+		return kr_error(ENOTSUP);
+	}
+	struct key k_storage, *k = &k_storage;
+	k->ns = 0;
+	/* The LF of the suffix is a prefix of the LF of the name. */
+	k->buf[0] = name->suffix_len[labels];
+	memcpy(k->buf + 1, name->lf + 1, k->buf[0]);
+	return peek_exact_key(cache, k, type, peek);
+}
 int kr_cache_peek_exact(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
 			struct kr_cache_p *peek)
 {	/* Just wrap with extra verbose logging. */
@@ -1047,6 +1625,98 @@ int kr_cache_peek_exact(struct kr_cache *cache, const knot_dname_t *name, uint16
 	return ret;
 }
 
+int kr_cache_answer_exact(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+			  uint32_t now, uint8_t *wire, size_t max, size_t *written)
+{
+	struct kr_cache_p peek;
+	int ret = peek_exact_real(cache, name, type, &peek);
+	if (ret) return ret;
+	const struct entry_h *eh = peek.raw_data;
+	if (eh->is_packet || (!kr_rank_test(eh->rank, KR_RANK_SECURE)
+			      && !kr_rank_test(eh->rank, KR_RANK_INSECURE))) {
+		return kr_error(ENOENT);
+	}
+	/* Neither stale nor expiring, the full resolution serves resp. refreshes those. */
+	const int32_t new_ttl = get_new_ttl(eh, NULL, NULL, type, now);
+	if (new_ttl < 0 || is_expiring(eh->ttl, new_ttl)) {
+		return kr_error(ENOENT);
+	}
+	/* Walk the rdataset, see rdataset_dematerialize(). */
+	const uint8_t *d = eh->data, *bound = peek.raw_bound;
+	uint16_t rr_count;
+	if (d + sizeof(rr_count) > bound) return kr_error(EILSEQ);
+	memcpy(&rr_count, d, sizeof(rr_count));
+	d += sizeof(rr_count);
+	if (rr_count == 0) return kr_error(ENOENT);
+	size_t pos = 0;
+	for (int i = 0; i < rr_count; ++i) {
+		uint16_t len;
+		if (d + sizeof(len) > bound) return kr_error(EILSEQ);
+		memcpy(&len, d, sizeof(len));
+		d += sizeof(len);
+		if (d + len > bound) return kr_error(EILSEQ);
+		/* owner pointer, type, class, TTL, rdlength */
+		if (pos + 12 + len > max) return kr_error(ENOSPC);
+		knot_wire_write_u16(wire + pos, 0xC000 | KNOT_WIRE_HEADER_SIZE);
+		knot_wire_write_u16(wire + pos + 2, type);
+		knot_wire_write_u16(wire + pos + 4, KNOT_CLASS_IN);
+		knot_wire_write_u32(wire + pos + 6, new_ttl);
+		knot_wire_write_u16(wire + pos + 10, len);
+		memcpy(wire + pos + 12, d, len);
+		pos += 12 + len;
+		d += len;
+	}
+	*written = pos;
+	return rr_count;
+}
+
+/** The NS/xNAME entries of the name and of this many closest ancestors are read at once. */
+#define NS_BATCH_MAX 4
+
+struct ns_batch {
+	int count;
+	knot_db_val_t key[NS_BATCH_MAX], val[NS_BATCH_MAX];
+	uint8_t buf[NS_BATCH_MAX][KNOT_DNAME_MAXLEN + 4];
+};
+
+/** Read the NS keys of k->zname and of its ancestors, shortening it by one more label
+ * for each next one, if the storage supports it (see kr_cdb_api::read_many).
+ * The entries not found or hidden have val[i].data == NULL. */
+static void ns_batch_read(struct kr_cache *cache, const struct key *k, struct ns_batch *b)
+{
+	b->count = 0;
+	if (!cache->api->read_many) {
+		return;
+	}
+	const knot_dname_t *zname = k->zname;
+	int zlf_len = k->buf[0];
+	const uint16_t type = KNOT_RRTYPE_NS;
+	do {
+		/* The same as key_exact_type() would make in closest_NS(). */
+		uint8_t *buf = b->buf[b->count];
+		memcpy(buf, k->buf + 1, zlf_len);
+		buf[zlf_len] = 0;
+		buf[zlf_len + 1] = 'E';
+		memcpy(buf + zlf_len + 2, &type, 2);
+		b->key[b->count++] = (knot_db_val_t){ buf, zlf_len + 4 };
+		if (zname[0] == 0) {
+			break;
+		}
+		zlf_len -= zname[0] + 1;
+		zname += zname[0] + 1;
+	} while (b->count < NS_BATCH_MAX);
+
+	if (cache_op(cache, read_many, b->key, b->val, b->count) < 0) {
+		b->count = 0; /* read them one by one */
+		return;
+	}
+	for (int i = 0; i < b->count; ++i) {
+		if (b->val[i].data && flush_hides(cache, b->key[i], b->val[i])) {
+			b->val[i] = (knot_db_val_t){ NULL, 0 };
+		}
+	}
+}
+
 /** Find the longest prefix NS/xNAME (with OK time+rank), starting at k->*.
  * We store xNAME at NS type to lower the number of searches.
  * CNAME is only considered for equal name, of course.
@@ -1054,8 +1724,11 @@ int kr_cache_peek_exact(struct kr_cache *cache, const knot_dname_t *name, uint16
  * Found type is returned via k->type.
  *
  * \param exact_match Whether exact match is considered special.
+ * \param val_nx set to the NXDOMAIN packet of a name on the way (see
+ *	entry_h::is_nxdomain) if it's fit, and then nothing is returned.
  */
-static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k)
+static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k, uint8_t lowest_rank,
+				knot_db_val_t *val_nx)
 {
 	static const knot_db_val_t VAL_EMPTY = { NULL, 0 };
 	struct kr_request *req = ctx->req;
@@ -1067,12 +1740,24 @@ static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k)
 	uint8_t rank_min = KR_RANK_INSECURE | KR_RANK_AUTH;
 	// LATER(optim): if stype is NS, we check the same value again
 	bool exact_match = true;
+	struct ns_batch batch;
+	ns_batch_read(cache, k, &batch);
+	int depth = 0;
 	/* Inspect the NS/xNAME entries, shortening by a label on each iteration. */
 	do {
 		k->buf[0] = zlf_len;
 		knot_db_val_t key = key_exact_type(k, KNOT_RRTYPE_NS);
 		knot_db_val_t val = VAL_EMPTY;
-		int ret = cache_op(cache, read, &key, &val, 1);
+		int ret;
+		if (depth < batch.count) {
+			val = batch.val[depth];
+			ret = val.data ? kr_ok() : kr_error(ENOENT);
+		} else {
+			ret = cache_read(cache, &key, &val);
+		}
+		if (ret == -abs(ENOENT)) {
+			ret = remote_peek(cache, key, &val);
+		}
 		if (ret == -abs(ENOENT)) goto next_label;
 		if (ret) {
 			assert(!ret);
@@ -1127,6 +1812,12 @@ static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k)
 				goto next_label;
 			}
 			int32_t new_ttl = get_new_ttl(eh, qry, k->zname, type, qry->timestamp.tv_sec);
+			if (type == KNOT_RRTYPE_NS && eh->is_packet && eh->is_nxdomain
+			    && new_ttl >= 0 && eh->rank >= lowest_rank) {
+				*val_nx = val;
+				k->zlf_len = zlf_len;
+				return VAL_EMPTY;
+			}
 			if (new_ttl < 0
 			    /* Not interested in negative or bogus. */
 			    || eh->is_packet
@@ -1155,6 +1846,7 @@ static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k)
 	next_label:
 		/* remove one more label */
 		exact_match = false;
+		++depth;
 		if (k->zname[0] == 0) {
 			/* We miss root NS in cache, but let's at least assume it exists. */
 			k->type = KNOT_RRTYPE_NS;
@@ -1169,6 +1861,17 @@ static knot_db_val_t closest_NS(kr_layer_t *ctx, struct key *k)
 }
 
 
+/** Whether the RRSIGs of cached records are of any use for the query.
+ *
+ * Cached records aren't validated again, so only a DNSSEC-aware client needs
+ * the signatures; their materialization is the bulk of work for signed zones.
+ * Sub-queries and DNSSEC types are left alone, as the validator looks at those. */
+static bool want_rrsigs(const struct kr_request *req, const struct kr_query *qry)
+{
+	return knot_pkt_has_dnssec(req->answer) || knot_wire_get_cd(req->answer->wire)
+		|| qry->parent || knot_rrtype_is_dnssec(qry->stype);
+}
+
 static uint8_t get_lowest_rank(const struct kr_request *req, const struct kr_query *qry)
 {
 	/* TODO: move rank handling into the iterator (DNSSEC_* flags)? */
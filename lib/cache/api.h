@@ -21,6 +21,7 @@
 #include <sys/time.h>
 #include "lib/cache/cdb_api.h"
 #include "lib/defines.h"
+#include "lib/generic/cmsketch.h"
 #include "contrib/ucw/config.h" /*uint*/
 
 /** When knot_pkt is passed from cache without ->wire, this is the ->size. */
@@ -33,6 +34,54 @@ int cache_peek(kr_layer_t *ctx, knot_pkt_t *pkt);
 int cache_stash(kr_layer_t *ctx, knot_pkt_t *pkt);
 
 
+/** Longest key the garbage collection can continue from. */
+#define KR_CACHE_GC_KEY_MAXLEN 384
+
+/** Kinds of entries and of the ways they answer, see kr_cache_kstats. */
+enum kr_cache_kind {
+	KR_CACHE_KIND_RR = 0, /**< Exact RRset */
+	KR_CACHE_KIND_PKT,    /**< Packet, e.g. a negative answer from an insecure zone */
+	KR_CACHE_KIND_NSEC1,  /**< Proof synthesized from NSEC records */
+	KR_CACHE_KIND_NSEC3,  /**< Proof synthesized from NSEC3 records */
+	KR_CACHE_KIND_WILD,   /**< Wildcard expansion */
+	KR_CACHE_KIND_NS,     /**< Closest zone cut (the NS and xNAME entries) */
+	KR_CACHE_KINDS
+};
+
+/** Classes of RR types, see kr_cache_kstats. */
+enum kr_cache_tclass {
+	KR_CACHE_TCLASS_ADDR = 0, /**< A and AAAA */
+	KR_CACHE_TCLASS_INFRA,    /**< NS, SOA, DS, DNSKEY, NSEC and NSEC3 */
+	KR_CACHE_TCLASS_OTHER,
+	KR_CACHE_TCLASSES
+};
+
+/** Buckets of ranks, see kr_cache_kstats. */
+enum kr_cache_rclass {
+	KR_CACHE_RCLASS_SECURE = 0,
+	KR_CACHE_RCLASS_INSECURE,
+	KR_CACHE_RCLASS_OTHER,    /**< Not validated, and the misses without an entry */
+	KR_CACHE_RCLASSES
+};
+
+/** Events counted in kr_cache_kstats. */
+enum kr_cache_event {
+	KR_CACHE_EV_HIT = 0,
+	KR_CACHE_EV_MISS,
+	KR_CACHE_EV_STALE,        /**< A hit past its TTL, see kr_query::stale_cb */
+	KR_CACHE_EV_STASH,
+	KR_CACHE_EVENTS
+};
+
+/** Counters per entry kind, class of RR type and rank bucket. */
+struct kr_cache_kstats {
+	uint32_t count[KR_CACHE_KINDS][KR_CACHE_TCLASSES][KR_CACHE_RCLASSES][KR_CACHE_EVENTS];
+	/** Bytes stored, as of the last finished pass of kr_cache_gc(). */
+	uint64_t bytes[KR_CACHE_KINDS][KR_CACHE_TCLASSES][KR_CACHE_RCLASSES];
+	/** Bytes seen by the current pass. */
+	uint64_t bytes_pass[KR_CACHE_KINDS][KR_CACHE_TCLASSES][KR_CACHE_RCLASSES];
+};
+
 /**
  * Cache structure, keeps API, instance and metadata.
  */
@@ -52,19 +101,82 @@ struct kr_cache
 	/* A pair of stamps for detection of real-time shifts during runtime. */
 	struct timeval checkpoint_walltime; /**< Wall time on the last check-point. */
 	uint64_t checkpoint_monotime; /**< Monotonic milliseconds on the last check-point. */
+
+	/** Write batching, see kr_cache_batch_begin(). */
+	struct {
+		uint32_t depth;       /**< Nesting level of the open batch, 0 if none */
+		uint32_t deferred;    /**< Syncs deferred in the open batch */
+		uint32_t commits;     /**< Number of batches synced */
+		uint32_t saved;       /**< Number of syncs saved by batching */
+	} batch;
+
+	struct kr_cache_l1 *l1; /**< In-process copies of hot entries, see ./l1.c */
+	struct {
+		uint32_t hit;         /**< Exact hits answered from the copies */
+		uint32_t miss;        /**< Exact lookups that went to the backend */
+		uint64_t size;        /**< Bytes taken by the copies when full */
+	} l1_stats;
+
+	/** Incremental garbage collection, see kr_cache_gc(). */
+	struct {
+		uint8_t next[KR_CACHE_GC_KEY_MAXLEN]; /**< Key to continue from */
+		uint16_t next_len;    /**< 0 to start from the beginning */
+		uint8_t target;       /**< Fill in percent to maintain */
+		double usage;         /**< Fill in percent, as of the last slice */
+		uint32_t passes;      /**< Number of finished walks through the cache */
+		uint32_t scanned;     /**< Number of visited entries */
+		uint32_t freed;       /**< Number of removed entries */
+		uint64_t freed_bytes; /**< Size of the removed entries */
+		uint32_t kept_hot;    /**< Entries kept only for being read often */
+		uint32_t grown;       /**< Times the storage was enlarged instead */
+	} gc;
+
+	uint32_t ns_gen; /**< Bumped on writing NS entries in this process and on clearing. */
+
+	struct kr_cache_remote *remote; /**< Shared tier behind the storage, see ./remote.c */
+	struct {
+		uint32_t hit;         /**< Storage misses found remotely */
+		uint32_t miss;        /**< Storage misses not found remotely either */
+		uint32_t promoted;    /**< Remote entries written into the storage */
+		uint32_t replicated;  /**< Storage writes sent remotely */
+		uint32_t dropped;     /**< Either of those given up, e.g. for a full queue */
+	} remote_stats;
+
+	struct kr_cache_kstats *kstats; /**< Counters per entry kind; NULL if not allocated */
+	struct kr_cache_flush *flush; /**< Names being removed, see ./flush.c; NULL if none */
 };
 
 /**
  * Open/create cache with provided storage options.
  * @param cache cache structure to be initialized
  * @param api   storage engine API
- * @param opts  storage-specific options (may be NULL for default)
+ * @param opts  storage-specific options (may be NULL for default);
+ *              LMDB is split by kr_cdb_opts::shards, see kr_cdb_lmdb_shards()
  * @param mm    memory context.
  * @return 0 or an error code
  */
 KR_EXPORT
 int kr_cache_open(struct kr_cache *cache, const struct kr_cdb_api *api, struct kr_cdb_opts *opts, knot_mm_t *mm);
 
+/**
+ * Put a shared storage behind the cache, e.g. redis behind LMDB, replacing the previous one.
+ * Exact lookups missing in the cache storage are tried there (and promoted);
+ * the entries written into the cache storage are replicated there on kr_cache_sync().
+ * It's closed together with the cache, see kr_cache_close().
+ * @return 0 or an error code
+ */
+KR_EXPORT
+int kr_cache_remote_open(struct kr_cache *cache, const struct kr_cdb_api *api,
+			 struct kr_cdb_opts *opts, knot_mm_t *mm);
+
+/** Close the shared storage behind the cache, if any. */
+KR_EXPORT
+void kr_cache_remote_close(struct kr_cache *cache);
+
+/** Return the engine of the shared storage behind the cache, or NULL. */
+KR_EXPORT
+const struct kr_cdb_api *kr_cache_remote_api(const struct kr_cache *cache);
+
 /**
  * Close persistent cache.
  * @note This doesn't clear the data, just closes the connection to the database.
@@ -73,10 +185,110 @@ int kr_cache_open(struct kr_cache *cache, const struct kr_cdb_api *api, struct k
 KR_EXPORT
 void kr_cache_close(struct kr_cache *cache);
 
-/** Run after a row of operations to release transaction/lock if needed. */
+/** Run after a row of operations to release transaction/lock if needed.
+ * @note Inside a batch this only records that a sync is due. */
 KR_EXPORT
 int kr_cache_sync(struct kr_cache *cache);
 
+/**
+ * Open a write batch: kr_cache_sync() is deferred until kr_cache_batch_end(),
+ * so all operations in between share a single transaction.
+ * @note Batches nest.  Keep them short, other processes can't write meanwhile.
+ */
+KR_EXPORT
+void kr_cache_batch_begin(struct kr_cache *cache);
+
+/** Close the write batch, syncing if it was the outermost one and a sync is due. */
+KR_EXPORT
+int kr_cache_batch_end(struct kr_cache *cache);
+
+/**
+ * Start or stop writing into the storage by a thread of this process,
+ * so the waits for the storage write lock don't block the caller.
+ * @return 0, kr_error(ENOTSUP) if the storage can't, or another error code
+ */
+KR_EXPORT
+int kr_cache_writer(struct kr_cache *cache, bool enable);
+
+/** Fill the counters of the background writer, see kr_cache_writer(). */
+KR_EXPORT
+int kr_cache_writer_stats(struct kr_cache *cache, struct kr_cdb_writer_stats *stats);
+
+/**
+ * Keep reading from one snapshot of the storage for up to max_age_ms
+ * and max_ops reads, instead of taking a new one after each sync;
+ * max_age_ms == 0 restores the default.  The writes of the other processes
+ * are seen with up to that delay.
+ * @return 0, kr_error(ENOTSUP) if the storage can't, or another error code
+ */
+KR_EXPORT
+int kr_cache_read_reuse(struct kr_cache *cache, unsigned max_age_ms, unsigned max_ops);
+
+/** Read the latest data from now on, e.g. when a stale answer won't do. */
+KR_EXPORT
+int kr_cache_read_renew(struct kr_cache *cache);
+
+/** Fill the counters of the read snapshots, see kr_cache_read_reuse(). */
+KR_EXPORT
+int kr_cache_read_stats(struct kr_cache *cache, struct kr_cdb_read_stats *stats);
+
+/**
+ * Remove the name and all the names under it, e.g. a zone, from the cache.
+ *
+ * It's O(1): this process ignores the entries stored so far right away (as if missing),
+ * they're removed in chunks by kr_cache_remove_step(), or with lazy
+ * by the garbage collection, see kr_cache_gc().  The root name clears the cache.
+ * @note Other processes sharing the storage keep reading the entries until they're removed.
+ * @return 0, kr_error(ENOSYS) if the storage can't remove by prefix, or another error code
+ */
+KR_EXPORT
+int kr_cache_remove_subtree(struct kr_cache *cache, const knot_dname_t *name, bool lazy);
+
+/**
+ * Remove up to maxcount entries of the names given to kr_cache_remove_subtree(),
+ * in a transaction of its own.
+ * @return the number removed, kr_error(ENOENT) if there's nothing left, or an error code
+ */
+KR_EXPORT
+int kr_cache_remove_step(struct kr_cache *cache, int maxcount);
+
+/** Cursor over the cache entries under a name, see kr_cache_iter_begin(). */
+struct kr_cache_iter;
+
+/** An exact entry of the cache (an RRset or a packet), as listed by kr_cache_iter_step(). */
+struct kr_cache_iter_entry {
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	uint16_t type;  /**< Type of the key; CNAME and DNAME are kept with NS */
+	uint8_t rank;   /**< See enum kr_rank */
+	uint8_t ns;     /**< Cache namespace, 0 for the shared one */
+	bool packet;    /**< A stored negative answer */
+	int32_t ttl;    /**< Remaining TTL, negative if expired */
+	uint32_t size;  /**< Bytes of the key and the value */
+};
+
+/**
+ * Start listing the entries of the name and of all the names under it ("." for all).
+ * @return cursor or NULL, e.g. if the storage can't walk; free by kr_cache_iter_free()
+ */
+KR_EXPORT
+struct kr_cache_iter *kr_cache_iter_begin(struct kr_cache *cache, const knot_dname_t *name);
+
+/**
+ * Walk up to `max_entries` further keys, in a read transaction of its own,
+ * and fill the exact entries among them; the NSEC* chains are skipped.
+ * @return the number of the entries filled (0 if just skipped keys), or an error code
+ */
+KR_EXPORT
+int kr_cache_iter_step(struct kr_cache_iter *it, struct kr_cache_iter_entry *entries,
+		       int max_entries);
+
+/** Whether the listing has reached its end. */
+KR_EXPORT
+bool kr_cache_iter_done(const struct kr_cache_iter *it);
+
+KR_EXPORT
+void kr_cache_iter_free(struct kr_cache_iter *it);
+
 /**
  * Return true if cache is open and enabled.
  */
@@ -89,7 +301,7 @@ static inline bool kr_cache_is_open(struct kr_cache *cache)
 static inline void kr_cache_make_checkpoint(struct kr_cache *cache)
 {
 	cache->checkpoint_monotime = kr_now();
-	gettimeofday(&cache->checkpoint_walltime, NULL);
+	kr_now_wall(&cache->checkpoint_walltime);
 }
 
 /**
@@ -104,6 +316,62 @@ static inline void kr_cache_make_checkpoint(struct kr_cache *cache)
 KR_EXPORT
 int kr_cache_insert_rr(struct kr_cache *cache, const knot_rrset_t *rr, const knot_rrset_t *rrsig, uint8_t rank, uint32_t timestamp);
 
+/**
+ * Look up the cached RRset of the name and type, in the shared namespace.
+ * @param rank set to the rank of the RRset, see enum kr_rank
+ * @param ttl set to the remaining TTL, negative if expired (optional)
+ * @return 0 or an errcode, kr_error(ENOENT) if not cached
+ */
+KR_EXPORT
+int kr_cache_peek_rr(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+		     uint8_t *rank, int32_t *ttl);
+
+/**
+ * Do a slice of the incremental garbage collection.
+ *
+ * Each call continues the walk through the cache where the previous one stopped.
+ * Records expired for more than KR_CACHE_GC_STALE are removed;
+ * if the cache is filled over cache->gc.target percent, all expired records
+ * and the rarely read ones are removed, too (see kr_cache_share_sketch()),
+ * except for NS and DNSKEY records which are needed for many lookups.
+ * @param cache cache structure
+ * @param max_entries number of entries to visit
+ * @return number of removed entries or an errcode
+ */
+KR_EXPORT
+int kr_cache_gc(struct kr_cache *cache, int max_entries);
+
+/**
+ * Set the sketch counting how often each cache key is looked up.
+ *
+ * The garbage collection uses the counts to keep the working set,
+ * i.e. to prefer removing the names asked for only once.
+ * Without a sketch it removes all the non-authoritative records instead.
+ * @note the sketch has to be created before forking, see cmsketch_create()
+ */
+KR_EXPORT
+void kr_cache_share_sketch(cmsketch_t *sketch);
+
+struct kr_request;
+
+/** Called for an expiring hit, see kr_cache_set_prefetch(). */
+typedef void (*kr_cache_prefetch_cb)(const struct kr_request *req, const struct kr_query *qry);
+
+/**
+ * Ask for refreshes of the entries that are read often and about to expire.
+ *
+ * An exact hit is expiring (qry->flags.EXPIRING) if it has less than `percent`
+ * of its original TTL left, or less than 5 seconds.  If it's also been looked up
+ * at least `hot` times according to the sketch (see kr_cache_share_sketch()),
+ * the callback is called right from the cache lookup, so it should only
+ * schedule the refresh and return.
+ * @param cb callback or NULL to stop
+ * @param percent of the original TTL, the default is 1
+ * @param hot the minimum count of lookups, 0 or 1 for all the hits
+ */
+KR_EXPORT
+void kr_cache_set_prefetch(kr_cache_prefetch_cb cb, unsigned percent, unsigned hot);
+
 /**
  * Clear all items from the cache.
  * @param cache cache structure
@@ -112,6 +380,43 @@ int kr_cache_insert_rr(struct kr_cache *cache, const knot_rrset_t *rr, const kno
 KR_EXPORT
 int kr_cache_clear(struct kr_cache *cache);
 
+struct kr_context;
+/** Snapshot being written, see kr_cache_snapshot_begin(). */
+struct kr_cache_snapshot;
+
+/**
+ * Start writing a snapshot of the hottest cache entries and of the RTTs of upstreams.
+ * The RTTs are written at once; the entries by kr_cache_snapshot_step(), in two walks
+ * of the cache: the first estimates how often the entries are read (see
+ * kr_cache_share_sketch()), the second writes up to `max_entries` of the hottest.
+ * The file appears at `path` once complete.
+ * @return snapshot or NULL
+ */
+KR_EXPORT
+struct kr_cache_snapshot *kr_cache_snapshot_begin(struct kr_context *ctx, const char *path,
+						  uint32_t max_entries);
+
+/**
+ * Walk up to `max_entries` further entries for the snapshot.
+ * @return 1 if not done yet; 0 if done, or an error code; the snapshot is freed in both cases
+ */
+KR_EXPORT
+int kr_cache_snapshot_step(struct kr_cache_snapshot *snap, int max_entries);
+
+/** Stop writing the snapshot and free it; the previous complete one stays. */
+KR_EXPORT
+void kr_cache_snapshot_abort(struct kr_cache_snapshot *snap);
+
+/**
+ * Load a snapshot written by kr_cache_snapshot_begin(), in a single write transaction.
+ * Entries that are already in the cache or expired are skipped, and so are the RTTs
+ * already known.
+ * @param entries load the cache entries (the cache is shared, one process is enough)
+ * @return number of the entries loaded or an error code
+ */
+KR_EXPORT
+int kr_cache_snapshot_load(struct kr_context *ctx, const char *path, bool entries);
+
 
 /* ** This interface is temporary. ** */
 
@@ -124,9 +429,32 @@ struct kr_cache_p {
 		void *raw_data, *raw_bound;
 	};
 };
+/** Whether the peeked entry with new_ttl left is expiring, see kr_cache_set_prefetch().
+ * The cache replaces the expiring entries even with ones of the same rank. */
+KR_EXPORT
+bool kr_cache_expiring(const struct kr_cache_p *peek, int32_t new_ttl);
 KR_EXPORT
 int kr_cache_peek_exact(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
 			struct kr_cache_p *peek);
+/** Like kr_cache_peek_exact(), for the suffix with `labels` labels of a name in LF.
+ * E.g. the parent zones of a name are looked up without converting each one. */
+KR_EXPORT
+int kr_cache_peek_exact_lf(struct kr_cache *cache, const struct kr_lf_name *name,
+			   int labels, uint16_t type, struct kr_cache_p *peek);
+/**
+ * Write the records of an exact cache hit in wire format, without a request;
+ * for the queries the daemon answers wholly from cache.
+ *
+ * Only a positive RRset ranked secure or insecure qualifies, and only while
+ * it's neither stale nor expiring.  The owner is written as a compression
+ * pointer to the question name right after the DNS header.
+ * @param now current time, as in struct kr_query::timestamp
+ * @param written the number of bytes written to wire
+ * @return the number of records or an error; ENOENT and ENOSPC mean the full resolution is needed
+ */
+KR_EXPORT
+int kr_cache_answer_exact(struct kr_cache *cache, const knot_dname_t *name, uint16_t type,
+			  uint32_t now, uint8_t *wire, size_t max, size_t *written);
 /* Parameters (qry, name, type) are used for timestamp and stale-serving decisions. */
 KR_EXPORT
 int32_t kr_cache_ttl(const struct kr_cache_p *peek, const struct kr_query *qry,
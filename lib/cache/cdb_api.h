@@ -16,12 +16,42 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <libknot/db/db.h>
 
 /* Cache options. */
 struct kr_cdb_opts {
 	const char *path; /*!< Cache URI path. */
 	size_t maxsize;   /*!< Suggested cache size in bytes. */
+	size_t maxsize_hard; /*!< The size may grow up to this, if larger. */
+	unsigned shards;  /*!< Split the storage into this many, if supported (if > 1). */
+	bool hugepages;   /*!< Advise huge pages for the mapping of the storage, if supported. */
+};
+
+/*! Callback for kr_cdb_api::walk.
+ * return: > 0 to remove the entry, 0 to keep it, < 0 to stop the walk */
+typedef int (*kr_cdb_visit_f)(const knot_db_val_t *key, const knot_db_val_t *val, void *baton);
+
+/*! Counters of kr_cdb_api::read_stats. */
+struct kr_cdb_read_stats {
+	uint64_t renewed; /*!< Read snapshots taken */
+	uint64_t reused;  /*!< Syncs that kept the snapshot */
+	uint64_t age_ms;  /*!< Age of the current snapshot, 0 if none */
+	/* The reader table shared by all the processes, if there's one: */
+	uint64_t readers;     /*!< Slots in use */
+	uint64_t readers_max; /*!< Slots in the table */
+	uint64_t reaped;      /*!< Slots of dead processes cleared by this one */
+	uint64_t oldest_ms;   /*!< Since the oldest snapshot of any process is held (roughly) */
+	uint64_t oldest_lag;  /*!< Commits since the oldest snapshot */
+};
+
+/*! Counters of kr_cdb_api::writer_stats. */
+struct kr_cdb_writer_stats {
+	uint64_t queued;  /*!< Writes waiting now */
+	uint64_t written; /*!< Writes stored */
+	uint64_t dropped; /*!< Writes not stored, the queue was full or the storage failed */
+	uint64_t lag_ms;  /*!< Delay of the last stored batch, since handed over */
 };
 
 /*! Cache database API.
@@ -58,4 +88,52 @@ struct kr_cdb_api {
 	 * On successful return, key->data and val->data point to DB-owned data.
 	 * return: 0 for equality, > 0 for less, < 0 kr_error */
 	int (*read_leq)(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val);
+
+	/** Visit up to maxcount entries in key order, starting at *key
+	 * (at the first entry if key->len == 0), removing those chosen by visit().
+	 * On return, *key points to DB-owned next key (until sync),
+	 * or key->len == 0 if the end was reached.
+	 * return: number of removed entries or kr_error */
+	int (*walk)(knot_db_t *db, knot_db_val_t *key, int maxcount,
+			kr_cdb_visit_f visit, void *baton);
+
+	/** Approximate fill of the storage, in percent, or < 0 on error. */
+	double (*usage_percent)(knot_db_t *db);
+
+	/* Optional operations, NULL if not supported */
+
+	/** Start or stop writing in the background, by a thread of this process.
+	 * Written values are visible to read() of this process right away,
+	 * not to the other processes until stored.
+	 * return: 0 or kr_error */
+	int (*writer)(knot_db_t *db, bool enable);
+
+	/** Fill the counters of the background writer.
+	 * return: 0 or kr_error(ENOENT) if it's not running */
+	int (*writer_stats)(knot_db_t *db, struct kr_cdb_writer_stats *stats);
+
+	/** Enlarge the storage by a step, towards kr_cdb_opts::maxsize_hard.
+	 * Values read before become invalid, as after sync().
+	 * return: 0 if grown, kr_error(ENOSPC) at the limit, or kr_error */
+	int (*grow)(knot_db_t *db);
+
+	/** Keep reading from one snapshot across sync() for up to max_age_ms
+	 * and max_ops reads; max_age_ms == 0 renews it on each sync (the default).
+	 * return: 0 or kr_error */
+	int (*read_reuse)(knot_db_t *db, unsigned max_age_ms, unsigned max_ops);
+
+	/** Drop the kept snapshot, so that the next read sees the latest data.
+	 * return: 0 or kr_error */
+	int (*read_renew)(knot_db_t *db);
+
+	/** Fill the counters of the read snapshots.
+	 * return: 0 or kr_error */
+	int (*read_stats)(knot_db_t *db, struct kr_cdb_read_stats *stats);
+
+	/** Read several entries at once, e.g. with fewer lookups for nearby keys.
+	 * Unlike read(), it goes on after a missing key; its val[i] is { NULL, 0 }.
+	 * The values are DB-owned, as with read().
+	 * return: the number of entries found, or kr_error */
+	int (*read_many)(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+			int count);
 };
@@ -15,10 +15,16 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -27,6 +33,7 @@
 #include "contrib/cleanup.h"
 #include "lib/cache/cdb_lmdb.h"
 #include "lib/cache/api.h"
+#include "lib/generic/trie.h"
 #include "lib/utils.h"
 
 
@@ -34,9 +41,27 @@
 #define LMDB_DIR_MODE   0770
 #define LMDB_FILE_MODE  0660
 
+/** The map grows by this fraction of the initial size, see env_grow(). */
+#define LMDB_GROW_DIV   4
+
+/** Writes queued for the background writer at most, see writer_start(). */
+#define WRITER_MAXQUEUE 4096
+
+/** Keys sorted at once by cdb_read_many(). */
+#define READ_MANY_CHUNK 32
+
+/** Period of checking the reader table, see reader_check(). */
+#define READER_CHECK_MS 10000
+/** A snapshot held longer than this is reported, see reader_check(). */
+#define READER_WARN_MS 60000
+
+struct lmdb_writer;
+
 struct lmdb_env
 {
-	size_t mapsize;
+	size_t mapsize;     /**< Initial size of the map (the soft limit) */
+	size_t mapsize_max; /**< The map may grow up to this size (the hard limit) */
+	bool hugepages;     /**< Advise huge pages for the map, see map_advise() */
 	MDB_dbi dbi;
 	MDB_env *env;
 
@@ -50,7 +75,28 @@ struct lmdb_env
 		bool ro_active, ro_curs_active;
 		MDB_txn *ro, *rw;
 		MDB_cursor *ro_curs;
+		uint64_t ro_since; /**< kr_now() when .ro got its snapshot */
+		uint32_t ro_ops;   /**< Reads from the snapshot of .ro */
 	} txn;
+
+	/** Keeping the snapshot of .ro across syncs, see cdb_read_reuse() */
+	struct {
+		uint32_t max_age_ms, max_ops; /**< 0 to renew on each sync */
+		uint64_t renewed, reused;
+	} ro_reuse;
+
+	/** The reader table as of the last reader_check() */
+	struct {
+		uint64_t checked;      /**< kr_now() of the check */
+		uint64_t reaped;       /**< Slots of dead processes cleared */
+		uint32_t readers, readers_max;
+		size_t oldest_txnid;   /**< Of the oldest snapshot, 0 if none */
+		uint64_t oldest_since; /**< kr_now() when it was first seen */
+		size_t oldest_lag;     /**< Commits since it */
+		bool warned;           /**< About the oldest snapshot */
+	} readers;
+
+	struct lmdb_writer *writer; /**< Background writer, if started */
 };
 
 /** @brief Convert LMDB error code. */
@@ -109,6 +155,87 @@ static int set_mapsize(MDB_env *env, size_t map_size)
 	return 0;
 }
 
+/** Advise huge pages for the map, after it's (re)mapped; see kr_cdb_opts::hugepages.
+ *
+ * LMDB doesn't tell the address of the map, so it's found in /proc/self/maps.
+ * The kernel only backs the map by huge pages on tmpfs (with shmem_enabled=advise),
+ * elsewhere the advice has no effect.  The map is shared, so the whole
+ * huge pages are written back on msync(); that's the same on tmpfs. */
+static void map_advise(struct lmdb_env *env)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	const char *path = NULL;
+	if (!env->hugepages || mdb_env_get_path(env->env, &path) != MDB_SUCCESS) {
+		return;
+	}
+	auto_free char *dir = realpath(path, NULL);
+	auto_free char *data = dir ? kr_strcatdup(2, dir, "/data.mdb") : NULL;
+	FILE *maps = data ? fopen("/proc/self/maps", "r") : NULL;
+	if (!maps) {
+		return;
+	}
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), maps)) {
+		unsigned long start, end;
+		int pos = 0;
+		if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &pos) < 2 || !pos) {
+			continue;
+		}
+		char *name = line + pos;
+		name[strcspn(name, "\n")] = '\0';
+		if (strcmp(name, data) != 0) {
+			continue;
+		}
+		if (madvise((void *)start, end - start, MADV_HUGEPAGE) != 0) {
+			kr_log_verbose("[cache] huge pages not advised for the map: %s\n",
+					strerror(errno));
+		}
+	}
+	fclose(maps);
+#endif
+}
+
+static void writer_idle_lock(struct lmdb_env *env);
+static void writer_idle_unlock(struct lmdb_env *env);
+
+/** @internal Enlarge the map by a step, up to the hard limit.
+ *
+ * The other processes notice the new size once a write is committed with it,
+ * see txn_get_noresize().  The values read before become invalid, like after a sync.
+ * \return 0 if grown, kr_error(ENOSPC) at the limit, or another error
+ */
+static int env_grow(struct lmdb_env *env)
+{
+	if (env->txn.rw) {
+		return kr_error(EBUSY);
+	}
+	MDB_envinfo info;
+	int ret = mdb_env_info(env->env, &info);
+	if (ret != MDB_SUCCESS) {
+		return lmdb_error(ret);
+	}
+	const size_t step = MAX(env->mapsize / LMDB_GROW_DIV, (size_t)1 << 20);
+	if (info.me_mapsize + step / 2 > env->mapsize_max) {
+		return kr_error(ENOSPC);
+	}
+	const size_t size = MIN(info.me_mapsize + step, env->mapsize_max);
+	/* No transaction of this process may use the map meanwhile. */
+	if (env->txn.ro && env->txn.ro_active) {
+		mdb_txn_reset(env->txn.ro);
+		env->txn.ro_active = false;
+		env->txn.ro_curs_active = false;
+	}
+	writer_idle_lock(env);
+	ret = set_mapsize(env->env, size);
+	writer_idle_unlock(env);
+	if (ret == 0) {
+		map_advise(env);
+		kr_log_info("[cache] overfull, grown to %zu MiB (limit %zu MiB)\n",
+			    size >> 20, env->mapsize_max >> 20);
+	}
+	return ret;
+}
+
 #define FLAG_RENEW (2*MDB_RDONLY)
 /** mdb_txn_begin or _renew + handle MDB_MAP_RESIZED.
  *
@@ -131,10 +258,13 @@ static int txn_get_noresize(struct lmdb_env *env, unsigned int flag, MDB_txn **t
 	//:unlikely
 	/* Another process increased the size; let's try to recover. */
 	kr_log_info("[cache] detected size increased by another process\n");
+	writer_idle_lock(env);
 	ret = mdb_env_set_mapsize(env->env, 0);
+	writer_idle_unlock(env);
 	if (ret != MDB_SUCCESS) {
 		return ret;
 	}
+	map_advise(env);
 	if (flag == FLAG_RENEW) {
 		ret = mdb_txn_renew(*txn);
 	} else {
@@ -143,6 +273,74 @@ static int txn_get_noresize(struct lmdb_env *env, unsigned int flag, MDB_txn **t
 	return ret;
 }
 
+/** @internal The oldest snapshot in the reader table, see reader_line(). */
+struct reader_scan {
+	uint32_t readers;
+	size_t oldest_txnid;
+	int oldest_pid;
+};
+
+/** Callback of mdb_reader_list(), for a line "pid thread txnid" or "pid thread -". */
+static int reader_line(const char *msg, void *ctx)
+{
+	struct reader_scan *scan = ctx;
+	int pid;
+	size_t thread, txnid;
+	const int n = sscanf(msg, "%d %zx %zu", &pid, &thread, &txnid);
+	if (n < 2) {
+		return 0; /* the header */
+	}
+	scan->readers += 1;
+	if (n == 3 && (!scan->oldest_txnid || txnid < scan->oldest_txnid)) {
+		scan->oldest_txnid = txnid;
+		scan->oldest_pid = pid;
+	}
+	return 0;
+}
+
+/** @internal Clear the reader slots of dead processes and look at the oldest snapshot.
+ *
+ * A process that crashed or got killed leaves its slot in the shared reader
+ * table, and LMDB can't reuse the pages freed since its snapshot, so the map
+ * fills up long before the data would.  A live process holding a snapshot
+ * too long does the same, so it's reported.  Unless `force`, this is done
+ * once in READER_CHECK_MS. */
+static void reader_check(struct lmdb_env *env, bool force)
+{
+	const uint64_t now = kr_now();
+	if (!force && now - env->readers.checked < READER_CHECK_MS) {
+		return;
+	}
+	env->readers.checked = now;
+	int dead = 0;
+	if (mdb_reader_check(env->env, &dead) == MDB_SUCCESS && dead > 0) {
+		env->readers.reaped += dead;
+		kr_log_info("[cache] cleared %d reader slot(s) left by dead processes\n", dead);
+	}
+	struct reader_scan scan = { 0, 0, 0 };
+	MDB_envinfo info;
+	if (mdb_reader_list(env->env, reader_line, &scan) < 0
+	    || mdb_env_info(env->env, &info) != MDB_SUCCESS) {
+		return;
+	}
+	env->readers.readers = scan.readers;
+	env->readers.readers_max = info.me_maxreaders;
+	if (scan.oldest_txnid != env->readers.oldest_txnid) {
+		env->readers.oldest_txnid = scan.oldest_txnid;
+		env->readers.oldest_since = now;
+		env->readers.warned = false;
+	}
+	env->readers.oldest_lag = scan.oldest_txnid && info.me_last_txnid > scan.oldest_txnid
+		? info.me_last_txnid - scan.oldest_txnid : 0;
+	if (scan.oldest_txnid && !env->readers.warned && env->readers.oldest_lag > 0
+	    && now - env->readers.oldest_since >= READER_WARN_MS) {
+		env->readers.warned = true;
+		kr_log_info("[cache] process %d has held a read snapshot for over %d s, "
+			    "%zu commits behind; the pages freed since can't be reused\n",
+			    scan.oldest_pid, READER_WARN_MS / 1000, env->readers.oldest_lag);
+	}
+}
+
 /** Obtain a transaction.  (they're cached in env->txn) */
 static int txn_get(struct lmdb_env *env, MDB_txn **txn, bool rdonly)
 {
@@ -180,12 +378,408 @@ static int txn_get(struct lmdb_env *env, MDB_txn **txn, bool rdonly)
 	if (ret != MDB_SUCCESS) {
 		return lmdb_error(ret);
 	}
+	if (!env->txn.ro_active) {
+		env->txn.ro_since = kr_now();
+		env->txn.ro_ops = 0;
+		env->ro_reuse.renewed += 1;
+	}
+	env->txn.ro_ops += 1;
 	env->txn.ro_active = true;
 	*txn = env->txn.ro;
 	assert(*txn);
 	return kr_ok();
 }
 
+/**
+ * @internal Background writer.
+ *
+ * LMDB has a single write lock for all the processes, so with many forks
+ * a RW transaction may wait for it a while, and the whole event loop with it.
+ * When started, the writes go into a queue instead and a thread of the
+ * process stores them; the loop only ever holds read transactions.
+ * The deletions of the maintenance (remove, GC walk) and the clear are
+ * queued the same way; only a clear after a failed drop waits for the queue
+ * and does the work itself, see cdb_clear().
+ *
+ * Each write is a copy of the key and the value; the value is filled in
+ * by the caller like the space reserved by LMDB (until the next sync).
+ * The writes are handed to the thread on sync, in a batch per transaction.
+ * Until written, they're found by reads through the pending trie
+ * (only the loop thread touches it), a deletion as a missing key,
+ * and a queued drop makes all the stored entries missing.
+ * Range reads don't see the single writes and deletions.
+ */
+enum lmdb_write_op {
+	WRITE_PUT,
+	WRITE_DEL,   /**< Remove the key, if it's there */
+	WRITE_DROP,  /**< Remove all the entries */
+};
+
+struct lmdb_write {
+	struct lmdb_write *next;
+	uint64_t queued;            /**< kr_now_us() when handed over */
+	uint8_t op;                 /**< enum lmdb_write_op */
+	knot_db_val_t key, val;     /**< Both in data[] */
+	uint8_t data[];
+};
+
+struct lmdb_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;       /**< Signalled on new work and after each batch */
+	/* Under the lock: */
+	struct lmdb_write *todo, **todo_tail; /**< Handed over, not written yet */
+	struct lmdb_write *done;   /**< Written (or given up), to be freed */
+	bool busy, stop, resized;
+	bool drop_failed;          /**< A batch with a drop wasn't written */
+	int error;                 /**< kr_error(ENOSPC) if the map got full */
+	struct kr_cdb_writer_stats stats;
+	/* Only used by the loop thread: */
+	struct lmdb_write *local, **local_tail; /**< Written since the last sync */
+	uint32_t local_len;
+	uint64_t local_queued;     /**< stats.queued as of the last sync */
+	int local_error;           /**< error reported by the next write */
+	uint32_t local_drops;      /**< Queued drops that aren't freed yet */
+	bool local_drop_failed;    /**< The next cdb_clear() can't queue a drop */
+	trie_t *pending;           /**< key -> the latest write that isn't freed yet */
+};
+
+/** @internal Do a queued write in the transaction; MDB_* code. */
+static int writer_apply(struct lmdb_env *env, MDB_txn *txn, const struct lmdb_write *w)
+{
+	MDB_val key = val_knot2mdb(w->key);
+	MDB_val val = val_knot2mdb(w->val);
+	switch (w->op) {
+	case WRITE_DEL: {
+		const int ret = mdb_del(txn, env->dbi, &key, NULL);
+		return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+	}
+	case WRITE_DROP:
+		return mdb_drop(txn, env->dbi, 0);
+	default:
+		return mdb_put(txn, env->dbi, &key, &val, 0);
+	}
+}
+
+/** @internal Store a batch in one transaction (or more if it's too big). */
+static int writer_commit(struct lmdb_env *env, struct lmdb_write *batch, bool *resized)
+{
+	MDB_txn *txn = NULL;
+	int ret = mdb_txn_begin(env->env, NULL, 0, &txn);
+	if (ret == MDB_MAP_RESIZED) {
+		/* Only the loop thread may adjust the map, see writer_collect(). */
+		*resized = true;
+		return lmdb_error(ret);
+	}
+	for (struct lmdb_write *w = batch; ret == MDB_SUCCESS && w; w = w->next) {
+		ret = writer_apply(env, txn, w);
+		if (ret == MDB_TXN_FULL) {
+			ret = mdb_txn_commit(txn);
+			txn = NULL;
+			if (ret == MDB_SUCCESS) {
+				ret = mdb_txn_begin(env->env, NULL, 0, &txn);
+			}
+			if (ret == MDB_SUCCESS) {
+				ret = writer_apply(env, txn, w);
+			}
+		}
+	}
+	if (ret == MDB_SUCCESS) {
+		ret = mdb_txn_commit(txn);
+	} else if (txn) {
+		mdb_txn_abort(txn);
+	}
+	return lmdb_error(ret);
+}
+
+static void *writer_run(void *arg)
+{
+	struct lmdb_env *env = arg;
+	struct lmdb_writer *wr = env->writer;
+	pthread_mutex_lock(&wr->lock);
+	for (;;) {
+		while (!wr->todo && !wr->stop) {
+			pthread_cond_wait(&wr->cond, &wr->lock);
+		}
+		if (!wr->todo) {
+			break; /* stopped, and all is written */
+		}
+		struct lmdb_write *batch = wr->todo;
+		wr->todo = NULL;
+		wr->todo_tail = &wr->todo;
+		wr->busy = true;
+		pthread_mutex_unlock(&wr->lock);
+
+		bool resized = false;
+		const int ret = writer_commit(env, batch, &resized);
+		uint32_t count = 0;
+		bool drop = false;
+		struct lmdb_write *last = batch;
+		for (struct lmdb_write *w = batch; w; w = w->next) {
+			last = w;
+			++count;
+			drop = drop || w->op == WRITE_DROP;
+		}
+		const uint64_t lag = kr_now_us() - batch->queued;
+
+		pthread_mutex_lock(&wr->lock);
+		wr->busy = false;
+		wr->stats.queued -= count;
+		if (ret == 0) {
+			wr->stats.written += count;
+			wr->stats.lag_ms = lag / 1000;
+		} else {
+			wr->stats.dropped += count;
+			if (ret == kr_error(ENOSPC)) {
+				wr->error = ret;
+			}
+			wr->resized = wr->resized || resized;
+			wr->drop_failed = wr->drop_failed || drop;
+		}
+		last->next = wr->done;
+		wr->done = batch;
+		pthread_cond_broadcast(&wr->cond);
+	}
+	pthread_mutex_unlock(&wr->lock);
+	return NULL;
+}
+
+/** @internal Hand over the local writes and free those already written. */
+static void writer_collect(struct lmdb_env *env)
+{
+	struct lmdb_writer *wr = env->writer;
+	pthread_mutex_lock(&wr->lock);
+	if (wr->local) {
+		const uint64_t now = kr_now_us();
+		for (struct lmdb_write *w = wr->local; w; w = w->next) {
+			w->queued = now;
+		}
+		*wr->todo_tail = wr->local;
+		wr->todo_tail = wr->local_tail;
+		wr->stats.queued += wr->local_len;
+		wr->local = NULL;
+		wr->local_tail = &wr->local;
+		wr->local_len = 0;
+		pthread_cond_signal(&wr->cond);
+	}
+	wr->local_queued = wr->stats.queued;
+	struct lmdb_write *done = wr->done;
+	wr->done = NULL;
+	const int error = wr->error;
+	wr->error = 0;
+	wr->local_drop_failed = wr->local_drop_failed || wr->drop_failed;
+	wr->drop_failed = false;
+	if (wr->resized && !wr->busy && !(env->txn.ro && env->txn.ro_active)) {
+		/* Another process increased the size.  The thread needs the lock
+		 * to start a transaction, so none is active in this process. */
+		kr_log_info("[cache] detected size increased by another process\n");
+		if (mdb_env_set_mapsize(env->env, 0) == MDB_SUCCESS) {
+			map_advise(env);
+		}
+		wr->resized = false;
+	}
+	pthread_mutex_unlock(&wr->lock);
+
+	/* The batch is lost, but the next ones may fit. */
+	if (error == kr_error(ENOSPC) && env_grow(env) != 0) {
+		wr->local_error = error;
+	}
+	/* A kept snapshot may not have the entries that aren't pending anymore. */
+	if (done && env->txn.ro && env->txn.ro_active && !env->txn.rw) {
+		mdb_txn_reset(env->txn.ro);
+		env->txn.ro_active = false;
+		env->txn.ro_curs_active = false;
+	}
+	while (done) {
+		struct lmdb_write *next = done->next;
+		if (done->op == WRITE_DROP) {
+			wr->local_drops -= 1;
+		}
+		trie_val_t *val = trie_get_try(wr->pending, done->key.data, done->key.len);
+		if (val && *val == done) {
+			trie_del(wr->pending, done->key.data, done->key.len, NULL);
+		}
+		free(done);
+		done = next;
+	}
+}
+
+/** @internal Wait until all the writes are stored and freed. */
+static void writer_drain(struct lmdb_env *env)
+{
+	struct lmdb_writer *wr = env->writer;
+	writer_collect(env);
+	pthread_mutex_lock(&wr->lock);
+	while (wr->todo || wr->busy) {
+		pthread_cond_wait(&wr->cond, &wr->lock);
+	}
+	pthread_mutex_unlock(&wr->lock);
+	writer_collect(env);
+	assert(trie_weight(wr->pending) == 0);
+}
+
+/** @internal Keep the thread out of transactions, e.g. to resize the map. */
+static void writer_idle_lock(struct lmdb_env *env)
+{
+	struct lmdb_writer *wr = env->writer;
+	if (!wr) {
+		return;
+	}
+	pthread_mutex_lock(&wr->lock);
+	while (wr->busy) {
+		pthread_cond_wait(&wr->cond, &wr->lock);
+	}
+	wr->resized = false;
+}
+
+static void writer_idle_unlock(struct lmdb_env *env)
+{
+	if (env->writer) {
+		pthread_mutex_unlock(&env->writer->lock);
+	}
+}
+
+/** @internal Whether the queue is full, see WRITER_MAXQUEUE. */
+static bool writer_full(const struct lmdb_writer *wr)
+{
+	return wr->local_len + wr->local_queued >= WRITER_MAXQUEUE;
+}
+
+/**
+ * @internal Queue a write, the value of a put is to be filled by the caller.
+ * A deletion has no value, a drop neither a key.
+ */
+static int writer_queue(struct lmdb_env *env, enum lmdb_write_op op,
+			const knot_db_val_t *key, knot_db_val_t *val)
+{
+	struct lmdb_writer *wr = env->writer;
+	if (op == WRITE_PUT && wr->local_error) {
+		/* Let the caller make room, as if its own write failed. */
+		const int ret = wr->local_error;
+		wr->local_error = 0;
+		return ret;
+	}
+	/* A clear is never refused. */
+	if (op != WRITE_DROP && writer_full(wr)) {
+		pthread_mutex_lock(&wr->lock);
+		wr->stats.dropped += 1;
+		pthread_mutex_unlock(&wr->lock);
+		return kr_error(EAGAIN);
+	}
+	const size_t key_len = key ? key->len : 0, val_len = val ? val->len : 0;
+	struct lmdb_write *w = malloc(sizeof(*w) + key_len + val_len);
+	if (!w) {
+		return kr_error(ENOMEM);
+	}
+	w->next = NULL;
+	w->op = op;
+	w->key = (knot_db_val_t){ w->data, key_len };
+	w->val = (knot_db_val_t){ w->data + key_len, val_len };
+	if (key_len) {
+		memcpy(w->key.data, key->data, key_len);
+	}
+	if (val && val->data) {
+		memcpy(w->val.data, val->data, val_len);
+	}
+	if (op == WRITE_DROP) {
+		/* The earlier writes are dropped, the later ones are found. */
+		trie_clear(wr->pending);
+		wr->local_drops += 1;
+	} else {
+		trie_val_t *tval = trie_get_ins(wr->pending, key->data, key->len);
+		if (!tval) {
+			free(w);
+			return kr_error(ENOMEM);
+		}
+		*tval = w;
+	}
+	*wr->local_tail = w;
+	wr->local_tail = &w->next;
+	wr->local_len += 1;
+	if (val) {
+		*val = w->val;
+	}
+	return kr_ok();
+}
+
+/** @internal Find a queued write of the key. */
+static struct lmdb_write *writer_find(struct lmdb_env *env, const knot_db_val_t *key)
+{
+	if (!env->writer || trie_weight(env->writer->pending) == 0) {
+		return NULL;
+	}
+	trie_val_t *val = trie_get_try(env->writer->pending, key->data, key->len);
+	return val ? *val : NULL;
+}
+
+/** @internal Whether a queued drop hides all the stored entries. */
+static bool writer_dropping(const struct lmdb_env *env)
+{
+	return env->writer && env->writer->local_drops > 0;
+}
+
+static int writer_start(struct lmdb_env *env)
+{
+	if (env->writer) {
+		return kr_ok();
+	}
+	struct lmdb_writer *wr = calloc(1, sizeof(*wr));
+	if (!wr) {
+		return kr_error(ENOMEM);
+	}
+	wr->todo_tail = &wr->todo;
+	wr->local_tail = &wr->local;
+	wr->pending = trie_create(NULL);
+	if (!wr->pending) {
+		free(wr);
+		return kr_error(ENOMEM);
+	}
+	pthread_mutex_init(&wr->lock, NULL);
+	pthread_cond_init(&wr->cond, NULL);
+	env->writer = wr;
+	int ret = pthread_create(&wr->thread, NULL, writer_run, env);
+	if (ret != 0) {
+		env->writer = NULL;
+		pthread_cond_destroy(&wr->cond);
+		pthread_mutex_destroy(&wr->lock);
+		trie_free(wr->pending);
+		free(wr);
+		return kr_error(ret);
+	}
+	return kr_ok();
+}
+
+static void writer_stop(struct lmdb_env *env)
+{
+	struct lmdb_writer *wr = env->writer;
+	if (!wr) {
+		return;
+	}
+	writer_drain(env);
+	pthread_mutex_lock(&wr->lock);
+	wr->stop = true;
+	pthread_cond_signal(&wr->cond);
+	pthread_mutex_unlock(&wr->lock);
+	pthread_join(wr->thread, NULL);
+	env->writer = NULL;
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->lock);
+	trie_free(wr->pending);
+	free(wr);
+}
+
+/** @internal Whether to keep the read snapshot on sync, see cdb_read_reuse(). */
+static bool ro_keep(struct lmdb_env *env)
+{
+	if (!env->ro_reuse.max_age_ms) {
+		return false;
+	}
+	if (env->ro_reuse.max_ops && env->txn.ro_ops >= env->ro_reuse.max_ops) {
+		return false;
+	}
+	return kr_now() - env->txn.ro_since < env->ro_reuse.max_age_ms;
+}
+
 static int cdb_sync(knot_db_t *db)
 {
 	struct lmdb_env *env = db;
@@ -193,11 +787,17 @@ static int cdb_sync(knot_db_t *db)
 	if (env->txn.rw) {
 		ret = lmdb_error(mdb_txn_commit(env->txn.rw));
 		env->txn.rw = NULL; /* the transaction got freed even in case of errors */
+	} else if (env->txn.ro && env->txn.ro_active && ro_keep(env)) {
+		env->ro_reuse.reused += 1;
 	} else if (env->txn.ro && env->txn.ro_active) {
 		mdb_txn_reset(env->txn.ro);
 		env->txn.ro_active = false;
 		env->txn.ro_curs_active = false;
 	}
+	if (env->writer) {
+		writer_collect(env);
+	}
+	reader_check(env, false);
 	return ret;
 }
 
@@ -250,6 +850,7 @@ static void cdb_close_env(struct lmdb_env *env)
 	assert(env && env->env);
 
 	/* Get rid of any transactions. */
+	writer_stop(env);
 	cdb_sync(env);
 	free_txn_ro(env);
 
@@ -354,6 +955,10 @@ static int cdb_init(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *pool)
 		free(env);
 		return ret;
 	}
+	env->mapsize_max = MAX(opts->maxsize, opts->maxsize_hard);
+	env->hugepages = opts->hugepages;
+	map_advise(env);
+	reader_check(env, true);
 
 	*db = env;
 	return 0;
@@ -369,6 +974,9 @@ static void cdb_deinit(knot_db_t *db)
 static int cdb_count(knot_db_t *db)
 {
 	struct lmdb_env *env = db;
+	if (writer_dropping(env)) {
+		return 0;
+	}
 	MDB_txn *txn = NULL;
 	int ret = txn_get(env, &txn, true);
 	if (ret != 0) {
@@ -384,6 +992,19 @@ static int cdb_count(knot_db_t *db)
 static int cdb_clear(knot_db_t *db)
 {
 	struct lmdb_env *env = db;
+	if (env->writer && !env->writer->local_drop_failed) {
+		/* Hand it over right away, the reads see an empty cache meanwhile. */
+		int ret = writer_queue(env, WRITE_DROP, NULL, NULL);
+		if (ret == 0) {
+			writer_collect(env);
+		}
+		return ret;
+	}
+	if (env->writer) {
+		/* The thread couldn't drop it, e.g. with the map full. */
+		writer_drain(env);
+		env->writer->local_drop_failed = false;
+	}
 	/* First try mdb_drop() to clear the DB; this may fail with ENOSPC. */
 	/* If we didn't do this, explicit cache.clear() ran on an instance
 	 * would lead to the instance detaching from the cache of others,
@@ -460,9 +1081,18 @@ static int cdb_clear(knot_db_t *db)
 		kr_log_verbose("[cache] clear: not identical files, reopening\n");
 	/* Keep copy as it points to current handle internals. */
 	auto_free char *path_copy = strdup(path);
-	size_t mapsize = env->mapsize;
+	size_t mapsize = env->mapsize, mapsize_max = env->mapsize_max;
+	const bool had_writer = env->writer != NULL, hugepages = env->hugepages;
 	cdb_close_env(env);
 	ret = cdb_open(env, path_copy, mapsize);
+	env->mapsize_max = mapsize_max;
+	env->hugepages = hugepages;
+	if (ret == 0) {
+		map_advise(env);
+	}
+	if (ret == 0 && had_writer) {
+		ret = writer_start(env);
+	}
 	/* Environment updated, release lockfile. */
 	unlink(lockfile);
 	return ret;
@@ -479,6 +1109,18 @@ static int cdb_readv(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val
 	}
 
 	for (int i = 0; i < maxcount; ++i) {
+		/* Not stored yet by the background writer. */
+		const struct lmdb_write *queued = writer_find(env, &key[i]);
+		if (queued && queued->op == WRITE_DEL) {
+			return kr_error(ENOENT);
+		}
+		if (queued) {
+			val[i] = queued->val;
+			continue;
+		}
+		if (writer_dropping(env)) {
+			return kr_error(ENOENT);
+		}
 		/* Convert key structs */
 		MDB_val _key = val_knot2mdb(key[i]);
 		MDB_val _val = val_knot2mdb(val[i]);
@@ -529,6 +1171,13 @@ static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *va
 			int maxcount)
 {
 	struct lmdb_env *env = db;
+	if (env->writer) {
+		int ret = kr_ok();
+		for (int i = 0; ret == kr_ok() && i < maxcount; ++i) {
+			ret = writer_queue(env, WRITE_PUT, &key[i], &val[i]);
+		}
+		return ret;
+	}
 	MDB_txn *txn = NULL;
 	int ret = txn_get(env, &txn, false);
 
@@ -544,6 +1193,17 @@ static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *va
 		}
 		ret = cdb_write(env, &txn, &key[i], &val[i], mdb_flags);
 	}
+	if (ret == kr_error(ENOSPC)) {
+		/* The transaction is unusable now; retrying is up to the caller,
+		 * so that it doesn't evict anything while the map can grow. */
+		if (env->txn.rw) {
+			mdb_txn_abort(env->txn.rw);
+			env->txn.rw = NULL;
+		}
+		if (env_grow(env) == 0) {
+			ret = kr_error(EAGAIN);
+		}
+	}
 
 	return ret;
 }
@@ -551,6 +1211,13 @@ static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *va
 static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
 {
 	struct lmdb_env *env = db;
+	if (env->writer) {
+		int ret = kr_ok();
+		for (int i = 0; ret == kr_ok() && i < maxcount; ++i) {
+			ret = writer_queue(env, WRITE_DEL, &key[i], NULL);
+		}
+		return ret;
+	}
 	MDB_txn *txn = NULL;
 	int ret = txn_get(env, &txn, false);
 
@@ -566,6 +1233,9 @@ static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
 static int cdb_match(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val, int maxcount)
 {
 	struct lmdb_env *env = db;
+	if (writer_dropping(env)) {
+		return 0;
+	}
 	MDB_txn *txn = NULL;
 	int ret = txn_get(env, &txn, true);
 	if (ret != 0) {
@@ -643,7 +1313,7 @@ static int cdb_prune(knot_db_t *db, int limit)
 
 	int results = 0;
 	struct timeval now;
-	gettimeofday(&now, NULL);
+	kr_now_wall(&now);
 	while (ret == 0 && results < limit) {
 		/* Ignore special namespaces. */
 		if (cur_key.mv_size < 2 || ((const char *)cur_key.mv_data)[0] == 'V') {
@@ -670,6 +1340,9 @@ static int cdb_prune(knot_db_t *db, int limit)
 static int cdb_read_leq(knot_db_t *env, knot_db_val_t *key, knot_db_val_t *val)
 {
 	assert(env && key && key->data && val);
+	if (writer_dropping(env)) {
+		return kr_error(ENOENT);
+	}
 	MDB_cursor *curs = NULL;
 	int ret = txn_curs_get(env, &curs);
 	if (ret) return ret;
@@ -695,6 +1368,232 @@ success:
 	return ret;
 }
 
+static int cdb_walk(knot_db_t *db, knot_db_val_t *key, int maxcount,
+		    kr_cdb_visit_f visit, void *baton)
+{
+	assert(db && key && visit);
+	struct lmdb_env *env = db;
+	if (writer_dropping(env)) {
+		return 0;
+	}
+	/* With the writer, the removals are queued and the walk only reads. */
+	MDB_txn *txn = NULL;
+	int ret = txn_get(env, &txn, env->writer != NULL);
+	if (ret != 0) {
+		return ret;
+	}
+
+	MDB_cursor *cur = NULL;
+	ret = mdb_cursor_open(txn, env->dbi, &cur);
+	if (ret != 0) {
+		return lmdb_error(ret);
+	}
+
+	MDB_val cur_key = val_knot2mdb(*key);
+	MDB_val cur_val = { 0, NULL };
+	ret = mdb_cursor_get(cur, &cur_key, &cur_val, key->len ? MDB_SET_RANGE : MDB_FIRST);
+	int removed = 0;
+	for (int i = 0; ret == MDB_SUCCESS && i < maxcount; ++i) {
+		if (env->writer && writer_full(env->writer)) {
+			break; /* continue from this entry once the thread catches up */
+		}
+		const knot_db_val_t k = val_mdb2knot(cur_key);
+		const knot_db_val_t v = val_mdb2knot(cur_val);
+		/* A queued write or removal of the entry is newer than the snapshot. */
+		const int res = env->writer && writer_find(env, &k) ? 0 : visit(&k, &v, baton);
+		if (res < 0) {
+			break;
+		}
+		if (res > 0 && env->writer) {
+			const int err = writer_queue(env, WRITE_DEL, &k, NULL);
+			if (err) {
+				mdb_cursor_close(cur);
+				return err;
+			}
+			++removed;
+		} else if (res > 0) {
+			ret = mdb_cursor_del(cur, 0);
+			if (ret != MDB_SUCCESS) {
+				break;
+			}
+			++removed;
+		}
+		/* Note: after a deletion this moves to the entry that followed it. */
+		ret = mdb_cursor_get(cur, &cur_key, &cur_val, MDB_NEXT);
+	}
+	mdb_cursor_close(cur);
+
+	if (ret == MDB_SUCCESS) {
+		*key = val_mdb2knot(cur_key);
+	} else if (ret == MDB_NOTFOUND) {
+		*key = (knot_db_val_t){ NULL, 0 };
+	} else {
+		return lmdb_error(ret);
+	}
+	return removed;
+}
+
+static double cdb_usage_percent(knot_db_t *db)
+{
+	struct lmdb_env *env = db;
+	MDB_txn *txn = NULL;
+	int ret = txn_get(env, &txn, true);
+	if (ret != 0) {
+		return ret;
+	}
+	/* Pages in the free list don't count. */
+	MDB_stat st;
+	ret = mdb_stat(txn, env->dbi, &st);
+	if (ret != MDB_SUCCESS) {
+		return lmdb_error(ret);
+	}
+	MDB_envinfo info;
+	ret = mdb_env_info(env->env, &info);
+	if (ret != MDB_SUCCESS || !info.me_mapsize) {
+		return kr_error(EINVAL);
+	}
+	size_t pages = st.ms_branch_pages + st.ms_leaf_pages + st.ms_overflow_pages;
+	return 100.0 * pages * st.ms_psize / info.me_mapsize;
+}
+
+static int cdb_writer(knot_db_t *db, bool enable)
+{
+	struct lmdb_env *env = db;
+	if (!enable) {
+		writer_stop(env);
+		return kr_ok();
+	}
+	/* The thread starts with its own transactions. */
+	(void) cdb_sync(env);
+	return writer_start(env);
+}
+
+static int cdb_writer_stats(knot_db_t *db, struct kr_cdb_writer_stats *stats)
+{
+	struct lmdb_env *env = db;
+	struct lmdb_writer *wr = env->writer;
+	if (!wr) {
+		return kr_error(ENOENT);
+	}
+	pthread_mutex_lock(&wr->lock);
+	*stats = wr->stats;
+	pthread_mutex_unlock(&wr->lock);
+	stats->queued += wr->local_len;
+	return kr_ok();
+}
+
+/**
+ * Keep the read snapshot across syncs, for up to max_age_ms and max_ops reads.
+ *
+ * Renewing the snapshot takes the lock of the reader table and reads the meta page,
+ * which adds up at high rates; meanwhile the writes of the other processes
+ * aren't seen, and the pages they free can't be reused.
+ */
+static int cdb_read_reuse(knot_db_t *db, unsigned max_age_ms, unsigned max_ops)
+{
+	struct lmdb_env *env = db;
+	env->ro_reuse.max_age_ms = max_age_ms;
+	env->ro_reuse.max_ops = max_ops;
+	return kr_ok();
+}
+
+static int cdb_read_renew(knot_db_t *db)
+{
+	struct lmdb_env *env = db;
+	if (!env->txn.rw && env->txn.ro && env->txn.ro_active) {
+		mdb_txn_reset(env->txn.ro);
+		env->txn.ro_active = false;
+		env->txn.ro_curs_active = false;
+	}
+	return kr_ok();
+}
+
+static int cdb_read_stats(knot_db_t *db, struct kr_cdb_read_stats *stats)
+{
+	struct lmdb_env *env = db;
+	stats->renewed = env->ro_reuse.renewed;
+	stats->reused = env->ro_reuse.reused;
+	stats->age_ms = env->txn.ro_active ? kr_now() - env->txn.ro_since : 0;
+	reader_check(env, false);
+	stats->readers = env->readers.readers;
+	stats->readers_max = env->readers.readers_max;
+	stats->reaped = env->readers.reaped;
+	stats->oldest_ms = env->readers.oldest_txnid ? kr_now() - env->readers.oldest_since : 0;
+	stats->oldest_lag = env->readers.oldest_lag;
+	return kr_ok();
+}
+
+/** Order of the keys in LMDB (the default comparison). */
+static int val_cmp(const knot_db_val_t *a, const knot_db_val_t *b)
+{
+	int ret = memcmp(a->data, b->data, MIN(a->len, b->len));
+	return ret ? ret : (a->len > b->len) - (a->len < b->len);
+}
+
+static int cdb_read_many(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+			 int count)
+{
+	struct lmdb_env *env = db;
+	MDB_cursor *curs = NULL;
+	int ret = txn_curs_get(env, &curs);
+	if (ret) {
+		return ret;
+	}
+	int found = 0;
+	for (int done = 0; done < count; done += READ_MANY_CHUNK) {
+		/* In the key order, so that one cursor walks the tree forward;
+		 * LMDB doesn't descend again for a key on the page of the previous one. */
+		const int n = MIN(count - done, READ_MANY_CHUNK);
+		int order[READ_MANY_CHUNK];
+		for (int i = 0; i < n; ++i) {
+			int j = i;
+			for (; j > 0 && val_cmp(&key[done + i], &key[done + order[j - 1]]) < 0; --j) {
+				order[j] = order[j - 1];
+			}
+			order[j] = i;
+		}
+		for (int i = 0; i < n; ++i) {
+			const int at = done + order[i];
+			/* Not stored yet by the background writer. */
+			const struct lmdb_write *queued = writer_find(env, &key[at]);
+			if (queued && queued->op == WRITE_DEL) {
+				val[at] = (knot_db_val_t){ NULL, 0 };
+				continue;
+			}
+			if (queued) {
+				val[at] = queued->val;
+				++found;
+				continue;
+			}
+			if (writer_dropping(env)) {
+				val[at] = (knot_db_val_t){ NULL, 0 };
+				continue;
+			}
+			MDB_val _key = val_knot2mdb(key[at]);
+			MDB_val _val = { 0, NULL };
+			ret = mdb_cursor_get(curs, &_key, &_val, MDB_SET_KEY);
+			if (ret == MDB_SUCCESS) {
+				val[at] = val_mdb2knot(_val);
+				++found;
+			} else if (ret == MDB_NOTFOUND) {
+				val[at] = (knot_db_val_t){ NULL, 0 };
+			} else {
+				return lmdb_error(ret);
+			}
+		}
+	}
+	return found;
+}
+
+static int cdb_grow(knot_db_t *db)
+{
+	struct lmdb_env *env = db;
+	/* Commit what's pending; the queue of the writer may stay. */
+	int ret = cdb_sync(env);
+	/* Pages pinned by the slots of dead processes don't need a larger map. */
+	reader_check(env, true);
+	return ret ? ret : env_grow(env);
+}
 
 const struct kr_cdb_api *kr_cdb_lmdb(void)
 {
@@ -703,7 +1602,10 @@ const struct kr_cdb_api *kr_cdb_lmdb(void)
 		cdb_init, cdb_deinit, cdb_count, cdb_clear, cdb_sync,
 		cdb_readv, cdb_writev, cdb_remove,
 		cdb_match, cdb_prune,
-		cdb_read_leq
+		cdb_read_leq, cdb_walk, cdb_usage_percent,
+		cdb_writer, cdb_writer_stats, cdb_grow,
+		cdb_read_reuse, cdb_read_renew, cdb_read_stats,
+		cdb_read_many
 	};
 
 	return &api;
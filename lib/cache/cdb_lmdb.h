@@ -21,3 +21,8 @@
 
 KR_EXPORT KR_CONST
 const struct kr_cdb_api *kr_cdb_lmdb(void);
+
+/** LMDB split into kr_cdb_opts::shards environments, in subdirectories of the path.
+ * See ./cdb_shards.c */
+KR_EXPORT KR_CONST
+const struct kr_cdb_api *kr_cdb_lmdb_shards(void);
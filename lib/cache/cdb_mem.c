@@ -0,0 +1,425 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/** @file
+ * Cache storage in the memory of this process, for nodes that don't need
+ * the cache to survive restarts or to be shared by several processes.
+ *
+ * The entries are kept in a qp-trie, ordered by the key as in LMDB, so that
+ * read_leq() works for the NSEC* ranges.  When a write would exceed
+ * kr_cdb_opts::maxsize, the entries are removed in the key order from the
+ * last removed one on (like a clock hand), except those read since the hand
+ * passed them last time; the count of their reads is halved instead.
+ *
+ * The values stay valid until sync(), even if replaced or removed meanwhile,
+ * as the cache expects from LMDB (e.g. entry_h_splice()).
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/cache/cdb_mem.h"
+#include "lib/cache/api.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "lib/utils.h"
+
+/** Longer keys aren't stored; the cache ones are shorter, see KR_CACHE_KEY_MAXLEN. */
+#define MEM_KEY_MAXLEN 512
+/** Approximate memory used by an entry besides the key and value (trie, malloc). */
+#define MEM_ENTRY_OVERHEAD 48
+/** Reads counted at most for an entry. */
+#define MEM_FREQ_MAX 255
+/** Entries passed at most by the hand while making room for one write. */
+#define MEM_EVICT_STEPS 4096
+
+struct mem_val {
+	uint32_t len;
+	uint32_t freq;    /**< Reads, halved by each pass of the hand, see mem_evict() */
+	uint8_t data[];
+};
+
+struct mem_db {
+	trie_t *trie;     /**< struct mem_val * by the key */
+	size_t size;      /**< Approximate memory used by the entries */
+	size_t maxsize;
+	array_t(struct mem_val *) dead; /**< Replaced and removed values, until sync */
+	uint32_t hand_len;
+	uint8_t hand[MEM_KEY_MAXLEN];   /**< The eviction continues from this key */
+};
+
+static inline size_t entry_size(size_t key_len, size_t val_len)
+{
+	return key_len + sizeof(struct mem_val) + val_len + MEM_ENTRY_OVERHEAD;
+}
+
+/** Remove the entry; its value stays valid until sync.
+ * return: 0, kr_error(ENOENT) if it's not there, or kr_error(ENOMEM) */
+static int entry_del(struct mem_db *mdb, const void *key, uint32_t key_len)
+{
+	if (array_reserve(mdb->dead, mdb->dead.len + 1) < 0) {
+		return kr_error(ENOMEM);
+	}
+	trie_val_t val = NULL;
+	if (trie_del(mdb->trie, key, key_len, &val) != KNOT_EOK) {
+		return kr_error(ENOENT);
+	}
+	struct mem_val *v = val;
+	mdb->size -= entry_size(key_len, v->len);
+	array_push(mdb->dead, v);
+	return kr_ok();
+}
+
+/** Remove entries until there's room for need more bytes.
+ * return: 0, kr_error(ENOSPC) if the hand went too far, or kr_error */
+static int mem_evict(struct mem_db *mdb, size_t need)
+{
+	int steps = MEM_EVICT_STEPS;
+	int ret = kr_ok();
+	trie_it_t *it = NULL;
+	while (mdb->size + need > mdb->maxsize) {
+		if (!it) {
+			it = trie_it_begin_geq(mdb->trie, (const char *)mdb->hand, mdb->hand_len);
+			if (!it) {
+				return kr_error(ENOMEM);
+			}
+		}
+		if (trie_it_finished(it)) {
+			trie_it_free(it);
+			it = NULL;
+			if (trie_weight(mdb->trie) == 0) {
+				return kr_error(ENOSPC); /* nothing left to remove */
+			}
+			mdb->hand_len = 0; /* wrap around */
+			continue;
+		}
+		if (steps-- <= 0) {
+			ret = kr_error(ENOSPC);
+			break;
+		}
+		size_t key_len;
+		const char *key = trie_it_key(it, &key_len);
+		struct mem_val *v = *trie_it_val(it);
+		if (v->freq > 0) {
+			v->freq /= 2;
+			trie_it_next(it);
+			continue;
+		}
+		/* The iterator doesn't survive the removal; the hand goes on after the key. */
+		assert(key_len <= sizeof(mdb->hand));
+		memcpy(mdb->hand, key, key_len);
+		mdb->hand_len = key_len;
+		trie_it_free(it);
+		it = NULL;
+		ret = entry_del(mdb, mdb->hand, mdb->hand_len);
+		if (ret) {
+			return ret;
+		}
+	}
+	if (it && !trie_it_finished(it)) {
+		size_t key_len;
+		const char *key = trie_it_key(it, &key_len);
+		memcpy(mdb->hand, key, key_len);
+		mdb->hand_len = key_len;
+	}
+	trie_it_free(it);
+	return ret;
+}
+
+static int val_free(trie_val_t *val, void *baton)
+{
+	free(*val);
+	return 0;
+}
+
+static int cdb_sync(knot_db_t *db)
+{
+	struct mem_db *mdb = db;
+	for (size_t i = 0; i < mdb->dead.len; ++i) {
+		free(mdb->dead.at[i]);
+	}
+	mdb->dead.len = 0;
+	return kr_ok();
+}
+
+static int cdb_init(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *pool)
+{
+	if (!db || !opts) {
+		return kr_error(EINVAL);
+	}
+	struct mem_db *mdb = calloc(1, sizeof(*mdb));
+	if (!mdb) {
+		return kr_error(ENOMEM);
+	}
+	mdb->trie = trie_create(NULL);
+	if (!mdb->trie) {
+		free(mdb);
+		return kr_error(ENOMEM);
+	}
+	array_init(mdb->dead);
+	mdb->maxsize = opts->maxsize;
+	*db = mdb;
+	return kr_ok();
+}
+
+static int cdb_clear(knot_db_t *db)
+{
+	struct mem_db *mdb = db;
+	(void) cdb_sync(db);
+	trie_apply(mdb->trie, val_free, NULL);
+	trie_clear(mdb->trie);
+	mdb->size = 0;
+	mdb->hand_len = 0;
+	return kr_ok();
+}
+
+static void cdb_deinit(knot_db_t *db)
+{
+	struct mem_db *mdb = db;
+	(void) cdb_clear(db);
+	trie_free(mdb->trie);
+	array_clear(mdb->dead);
+	free(mdb);
+}
+
+static int cdb_count(knot_db_t *db)
+{
+	struct mem_db *mdb = db;
+	return trie_weight(mdb->trie);
+}
+
+static int cdb_readv(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+		     int maxcount)
+{
+	struct mem_db *mdb = db;
+	for (int i = 0; i < maxcount; ++i) {
+		trie_val_t *tval = trie_get_try(mdb->trie, key[i].data, key[i].len);
+		if (!tval) {
+			return kr_error(ENOENT);
+		}
+		struct mem_val *v = *tval;
+		if (v->freq < MEM_FREQ_MAX) {
+			v->freq += 1;
+		}
+		val[i] = (knot_db_val_t){ v->data, v->len };
+	}
+	return kr_ok();
+}
+
+static int cdb_read_many(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+			 int count)
+{
+	int found = 0;
+	for (int i = 0; i < count; ++i) {
+		if (cdb_readv(db, &key[i], &val[i], 1) == 0) {
+			++found;
+		} else {
+			val[i] = (knot_db_val_t){ NULL, 0 };
+		}
+	}
+	return found;
+}
+
+static int cdb_write(struct mem_db *mdb, const knot_db_val_t *key, knot_db_val_t *val)
+{
+	if (key->len > MEM_KEY_MAXLEN || val->len > UINT32_MAX) {
+		return kr_error(EINVAL);
+	}
+	const size_t size = entry_size(key->len, val->len);
+	if (size > mdb->maxsize) {
+		return kr_error(ENOSPC);
+	}
+	int ret = entry_del(mdb, key->data, key->len);
+	if (ret == 0 || ret == kr_error(ENOENT)) {
+		ret = mem_evict(mdb, size);
+	}
+	if (ret) {
+		return ret;
+	}
+	struct mem_val *v = malloc(sizeof(*v) + val->len);
+	if (!v) {
+		return kr_error(ENOMEM);
+	}
+	trie_val_t *tval = trie_get_ins(mdb->trie, key->data, key->len);
+	if (!tval) {
+		free(v);
+		return kr_error(ENOMEM);
+	}
+	*tval = v;
+	mdb->size += size;
+	v->len = val->len;
+	v->freq = 1; /* survive the first pass of the hand */
+	/* NULL data only reserves the space, as with MDB_RESERVE. */
+	if (val->data) {
+		memcpy(v->data, val->data, val->len);
+	} else {
+		val->data = v->data;
+	}
+	return kr_ok();
+}
+
+static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+			int maxcount)
+{
+	struct mem_db *mdb = db;
+	int ret = kr_ok();
+	for (int i = 0; ret == kr_ok() && i < maxcount; ++i) {
+		ret = cdb_write(mdb, &key[i], &val[i]);
+	}
+	return ret;
+}
+
+static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
+{
+	struct mem_db *mdb = db;
+	int ret = kr_ok();
+	for (int i = 0; ret == kr_ok() && i < maxcount; ++i) {
+		ret = entry_del(mdb, key[i].data, key[i].len);
+	}
+	return ret;
+}
+
+static int cdb_match(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val, int maxcount)
+{
+	struct mem_db *mdb = db;
+	/* Turn wildcard into prefix scan. */
+	if (key->len > 2) {
+		const uint8_t *endp = (const uint8_t *)key->data + (key->len - 2);
+		if (endp[0] == '*' && endp[1] == '\0') {
+			key->len -= 2; /* Skip '*' label */
+		}
+	}
+
+	trie_it_t *it = trie_it_begin_geq(mdb->trie, key->data, key->len);
+	if (!it) {
+		return kr_error(ENOMEM);
+	}
+	if (trie_it_finished(it)) {
+		trie_it_free(it);
+		return kr_error(ENOENT);
+	}
+	int results = 0;
+	for (; !trie_it_finished(it) && results < maxcount; trie_it_next(it)) {
+		size_t cur_len;
+		const char *cur = trie_it_key(it, &cur_len);
+		if (cur_len < key->len || memcmp(cur, key->data, key->len) != 0) {
+			break;
+		}
+		val[results++] = (knot_db_val_t){ (void *)cur, cur_len };
+	}
+	trie_it_free(it);
+	return results;
+}
+
+static int cdb_read_leq(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val)
+{
+	assert(db && key && key->data && val);
+	struct mem_db *mdb = db;
+	trie_it_t *it = trie_it_begin_leq(mdb->trie, key->data, key->len);
+	if (!it) {
+		return kr_error(ENOMEM);
+	}
+	int ret = kr_error(ENOENT);
+	if (!trie_it_finished(it)) {
+		size_t cur_len;
+		const char *cur = trie_it_key(it, &cur_len);
+		ret = (cur_len == key->len && memcmp(cur, key->data, cur_len) == 0) ? 0 : 1;
+		struct mem_val *v = *trie_it_val(it);
+		if (v->freq < MEM_FREQ_MAX) {
+			v->freq += 1;
+		}
+		*key = (knot_db_val_t){ (void *)cur, cur_len };
+		*val = (knot_db_val_t){ v->data, v->len };
+	}
+	trie_it_free(it);
+	return ret;
+}
+
+static int cdb_walk(knot_db_t *db, knot_db_val_t *key, int maxcount,
+		    kr_cdb_visit_f visit, void *baton)
+{
+	assert(db && key && visit);
+	struct mem_db *mdb = db;
+	trie_it_t *it = key->len
+		? trie_it_begin_geq(mdb->trie, key->data, key->len)
+		: trie_it_begin(mdb->trie);
+	int removed = 0;
+	for (int i = 0; it && !trie_it_finished(it) && i < maxcount; ++i) {
+		size_t cur_len;
+		const char *cur = trie_it_key(it, &cur_len);
+		const struct mem_val *v = *trie_it_val(it);
+		const knot_db_val_t k = { (void *)cur, cur_len };
+		const knot_db_val_t val = { (void *)v->data, v->len };
+		const int res = visit(&k, &val, baton);
+		if (res < 0) {
+			break;
+		}
+		if (res == 0) {
+			trie_it_next(it);
+			continue;
+		}
+		/* The iterator doesn't survive the removal; go on after the key. */
+		uint8_t buf[MEM_KEY_MAXLEN];
+		memcpy(buf, cur, cur_len);
+		trie_it_free(it);
+		it = NULL;
+		int ret = entry_del(mdb, buf, cur_len);
+		if (ret) {
+			return ret;
+		}
+		++removed;
+		it = trie_it_begin_geq(mdb->trie, (const char *)buf, cur_len);
+	}
+	if (!it) {
+		return kr_error(ENOMEM);
+	}
+
+	if (trie_it_finished(it)) {
+		*key = (knot_db_val_t){ NULL, 0 };
+	} else {
+		size_t cur_len;
+		key->data = (void *)trie_it_key(it, &cur_len);
+		key->len = cur_len;
+	}
+	trie_it_free(it);
+	return removed;
+}
+
+static double cdb_usage_percent(knot_db_t *db)
+{
+	struct mem_db *mdb = db;
+	if (!mdb->maxsize) {
+		return kr_error(EINVAL);
+	}
+	return 100.0 * mdb->size / mdb->maxsize;
+}
+
+const struct kr_cdb_api *kr_cdb_mem(void)
+{
+	static const struct kr_cdb_api api = {
+		"mem",
+		cdb_init, cdb_deinit, cdb_count, cdb_clear, cdb_sync,
+		cdb_readv, cdb_writev, cdb_remove,
+		cdb_match, NULL /* prune */,
+		cdb_read_leq, cdb_walk, cdb_usage_percent,
+		/* These aren't needed without a shared storage. */
+		NULL, NULL, NULL, NULL, NULL, NULL,
+		cdb_read_many
+	};
+
+	return &api;
+}
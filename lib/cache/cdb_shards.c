@@ -0,0 +1,417 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/** @file
+ * The cache storage split over several LMDB environments.
+ *
+ * Each environment has its own write lock (and background writer, if any),
+ * so the processes writing different names don't wait for each other,
+ * and a long read transaction only pins the pages of one of them.
+ *
+ * A key goes to the shard chosen by the hash of its beginning up to the second
+ * zero byte, i.e. the last two labels of the name in the lookup format,
+ * so the entries of a domain mostly stay together.  The hash is fixed,
+ * it has to be the same in all the processes and after restarts.
+ * The NSEC* range reads and the prefix matches ask all the shards.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "contrib/ucw/lib.h"
+#include "lib/cache/cdb_lmdb.h"
+#include "lib/generic/hash.h"
+#include "lib/utils.h"
+
+#define SHARDS_MAX 64
+#define SHARDS_SEED 0x6b6e6f7473686172ULL
+/** Longest LMDB key (the default), plus the shard number for cdb_walk(). */
+#define WALK_KEY_MAXLEN (1 + 511)
+
+struct shards {
+	const struct kr_cdb_api *api;
+	unsigned count;
+	uint8_t walk_key[WALK_KEY_MAXLEN];
+	knot_db_t *db[];
+};
+
+static unsigned shard_index(const struct shards *sh, const knot_db_val_t *key)
+{
+	const uint8_t *k = key->data;
+	size_t len = 0;
+	for (int zeros = 0; len < key->len; ++len) {
+		if (k[len] == 0 && ++zeros == 2) {
+			break;
+		}
+	}
+	return kr_hash_short(k, len, SHARDS_SEED) % sh->count;
+}
+
+static void cdb_deinit(knot_db_t *db)
+{
+	struct shards *sh = db;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		if (sh->db[i]) {
+			sh->api->close(sh->db[i]);
+		}
+	}
+	free(sh);
+}
+
+static int cdb_init(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *pool)
+{
+	if (!db || !opts || opts->shards < 2 || opts->shards > SHARDS_MAX) {
+		return kr_error(EINVAL);
+	}
+	if (mkdir(opts->path, 0770) != 0 && errno != EEXIST) {
+		return kr_error(errno);
+	}
+	const unsigned count = opts->shards;
+	struct shards *sh = calloc(1, sizeof(*sh) + count * sizeof(sh->db[0]));
+	if (!sh) {
+		return kr_error(ENOMEM);
+	}
+	sh->api = kr_cdb_lmdb();
+	sh->count = count;
+	for (unsigned i = 0; i < count; ++i) {
+		/* With another count the keys would be in other shards. */
+		char path[PATH_MAX];
+		int ret = snprintf(path, sizeof(path), "%s/shard-%u-of-%u", opts->path, i, count);
+		if (ret < 0 || ret >= (int)sizeof(path)) {
+			ret = kr_error(ENAMETOOLONG);
+		} else {
+			struct kr_cdb_opts shard_opts = {
+				path,
+				opts->maxsize / count,
+				opts->maxsize_hard / count,
+				0,
+				opts->hugepages
+			};
+			ret = sh->api->open(&sh->db[i], &shard_opts, pool);
+		}
+		if (ret != 0) {
+			sh->db[i] = NULL;
+			cdb_deinit(sh);
+			return ret;
+		}
+	}
+	*db = sh;
+	return 0;
+}
+
+static int cdb_count(knot_db_t *db)
+{
+	struct shards *sh = db;
+	int sum = 0;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int ret = sh->api->count(sh->db[i]);
+		if (ret < 0) {
+			return ret;
+		}
+		sum += ret;
+	}
+	return sum;
+}
+
+static int cdb_clear(knot_db_t *db)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int err = sh->api->clear(sh->db[i]);
+		ret = ret ? ret : err;
+	}
+	return ret;
+}
+
+static int cdb_sync(knot_db_t *db)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int err = sh->api->sync(sh->db[i]);
+		ret = ret ? ret : err;
+	}
+	return ret;
+}
+
+static int cdb_readv(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+		     int maxcount)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (int i = 0; ret == 0 && i < maxcount; ++i) {
+		ret = sh->api->read(sh->db[shard_index(sh, &key[i])], &key[i], &val[i], 1);
+	}
+	return ret;
+}
+
+static int cdb_read_many(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+			 int count)
+{
+	struct shards *sh = db;
+	int found = 0;
+	for (int i = 0; i < count; ++i) {
+		int ret = sh->api->read_many(sh->db[shard_index(sh, &key[i])], &key[i], &val[i], 1);
+		if (ret < 0) {
+			return ret;
+		}
+		found += ret;
+	}
+	return found;
+}
+
+static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
+		      int maxcount)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (int i = 0; ret == 0 && i < maxcount; ++i) {
+		ret = sh->api->write(sh->db[shard_index(sh, &key[i])], &key[i], &val[i], 1);
+	}
+	return ret;
+}
+
+static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (int i = 0; ret == 0 && i < maxcount; ++i) {
+		ret = sh->api->remove(sh->db[shard_index(sh, &key[i])], &key[i], 1);
+	}
+	return ret;
+}
+
+static int cdb_match(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val, int maxcount)
+{
+	struct shards *sh = db;
+	int results = 0, ret = kr_error(ENOENT);
+	for (unsigned i = 0; i < sh->count && results < maxcount; ++i) {
+		ret = sh->api->match(sh->db[i], key, val + results, maxcount - results);
+		if (ret > 0) {
+			results += ret;
+		}
+	}
+	return results > 0 ? results : ret;
+}
+
+static int cdb_prune(knot_db_t *db, int limit)
+{
+	struct shards *sh = db;
+	int pruned = 0;
+	for (unsigned i = 0; i < sh->count && pruned < limit; ++i) {
+		int ret = sh->api->prune(sh->db[i], limit - pruned);
+		if (ret < 0) {
+			return ret;
+		}
+		pruned += ret;
+	}
+	return pruned;
+}
+
+/** The greatest key not greater than the given one, of all the shards. */
+static int cdb_read_leq(knot_db_t *db, knot_db_val_t *key, knot_db_val_t *val)
+{
+	struct shards *sh = db;
+	int ret = kr_error(ENOENT);
+	knot_db_val_t best_key = { NULL, 0 }, best_val = { NULL, 0 };
+	for (unsigned i = 0; i < sh->count; ++i) {
+		knot_db_val_t k = *key, v = { NULL, 0 };
+		int err = sh->api->read_leq(sh->db[i], &k, &v);
+		if (err == 0) {
+			*key = k;
+			*val = v;
+			return 0;
+		}
+		if (err < 0) {
+			ret = ret == kr_error(ENOENT) ? err : ret;
+			continue;
+		}
+		const int cmp = best_key.data
+			? memcmp(k.data, best_key.data, MIN(k.len, best_key.len)) : 1;
+		if (cmp > 0 || (cmp == 0 && k.len > best_key.len)) {
+			best_key = k;
+			best_val = v;
+		}
+	}
+	if (!best_key.data) {
+		return ret;
+	}
+	*key = best_key;
+	*val = best_val;
+	return 1;
+}
+
+/** Walk the shards one by one; the shard number is the first byte of the key. */
+static int cdb_walk(knot_db_t *db, knot_db_val_t *key, int maxcount,
+		    kr_cdb_visit_f visit, void *baton)
+{
+	struct shards *sh = db;
+	unsigned i = key->len ? ((const uint8_t *)key->data)[0] : 0;
+	if (i >= sh->count) {
+		i = 0;
+	}
+	knot_db_val_t k = { NULL, 0 };
+	if (key->len > 1) {
+		k = (knot_db_val_t){ (uint8_t *)key->data + 1, key->len - 1 };
+	}
+	int ret = sh->api->walk(sh->db[i], &k, maxcount, visit, baton);
+	if (ret < 0) {
+		return ret;
+	}
+	if (k.len == 0) {
+		/* This shard is done, continue with the next one (if any). */
+		if (++i == sh->count) {
+			key->len = 0;
+			return ret;
+		}
+	} else if (k.len >= WALK_KEY_MAXLEN) {
+		assert(false);
+		k.len = 0;
+	}
+	sh->walk_key[0] = i;
+	memcpy(sh->walk_key + 1, k.data, k.len);
+	*key = (knot_db_val_t){ sh->walk_key, 1 + k.len };
+	return ret;
+}
+
+/** The fill of the fullest shard. */
+static double cdb_usage_percent(knot_db_t *db)
+{
+	struct shards *sh = db;
+	double usage = 0;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		double ret = sh->api->usage_percent(sh->db[i]);
+		if (ret < 0) {
+			return ret;
+		}
+		usage = MAX(usage, ret);
+	}
+	return usage;
+}
+
+static int cdb_writer(knot_db_t *db, bool enable)
+{
+	struct shards *sh = db;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int ret = sh->api->writer(sh->db[i], enable);
+		if (ret != 0) {
+			/* All or none. */
+			while (enable && i-- > 0) {
+				(void) sh->api->writer(sh->db[i], false);
+			}
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int cdb_writer_stats(knot_db_t *db, struct kr_cdb_writer_stats *stats)
+{
+	struct shards *sh = db;
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned i = 0; i < sh->count; ++i) {
+		struct kr_cdb_writer_stats s;
+		int ret = sh->api->writer_stats(sh->db[i], &s);
+		if (ret != 0) {
+			return ret;
+		}
+		stats->queued += s.queued;
+		stats->written += s.written;
+		stats->dropped += s.dropped;
+		stats->lag_ms = MAX(stats->lag_ms, s.lag_ms);
+	}
+	return 0;
+}
+
+/** Grow all the shards, as they fill up evenly. */
+static int cdb_grow(knot_db_t *db)
+{
+	struct shards *sh = db;
+	int ret = kr_error(ENOSPC);
+	for (unsigned i = 0; i < sh->count; ++i) {
+		if (sh->api->grow(sh->db[i]) == 0) {
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+static int cdb_read_reuse(knot_db_t *db, unsigned max_age_ms, unsigned max_ops)
+{
+	struct shards *sh = db;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int ret = sh->api->read_reuse(sh->db[i], max_age_ms, max_ops);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int cdb_read_renew(knot_db_t *db)
+{
+	struct shards *sh = db;
+	int ret = 0;
+	for (unsigned i = 0; i < sh->count; ++i) {
+		int err = sh->api->read_renew(sh->db[i]);
+		ret = ret ? ret : err;
+	}
+	return ret;
+}
+
+static int cdb_read_stats(knot_db_t *db, struct kr_cdb_read_stats *stats)
+{
+	struct shards *sh = db;
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned i = 0; i < sh->count; ++i) {
+		struct kr_cdb_read_stats s;
+		int ret = sh->api->read_stats(sh->db[i], &s);
+		if (ret != 0) {
+			return ret;
+		}
+		stats->renewed += s.renewed;
+		stats->reused += s.reused;
+		stats->age_ms = MAX(stats->age_ms, s.age_ms);
+		stats->readers += s.readers;
+		stats->readers_max += s.readers_max;
+		stats->reaped += s.reaped;
+		stats->oldest_ms = MAX(stats->oldest_ms, s.oldest_ms);
+		stats->oldest_lag = MAX(stats->oldest_lag, s.oldest_lag);
+	}
+	return 0;
+}
+
+const struct kr_cdb_api *kr_cdb_lmdb_shards(void)
+{
+	static const struct kr_cdb_api api = {
+		"lmdb",
+		cdb_init, cdb_deinit, cdb_count, cdb_clear, cdb_sync,
+		cdb_readv, cdb_writev, cdb_remove,
+		cdb_match, cdb_prune,
+		cdb_read_leq, cdb_walk, cdb_usage_percent,
+		cdb_writer, cdb_writer_stats, cdb_grow,
+		cdb_read_reuse, cdb_read_renew, cdb_read_stats,
+		cdb_read_many
+	};
+
+	return &api;
+}
@@ -0,0 +1,127 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Keys of the answers tailored to a client subnet (EDNS Client Subnet, see lib/ecs.h)
+ * and the index of their scopes, so that a lookup only tries the prefix lengths stored.
+ */
+
+#include <string.h>
+
+#include "lib/cache/impl.h"
+
+/** The value of an index key after struct entry_h. */
+struct ecs_index {
+	uint16_t count;     /**< Tailored entries of the name and type */
+	uint8_t lens[16];   /**< Bit (len - 1) is set if there's an entry with that scope */
+};
+
+knot_db_val_t key_ecs(struct key *k, uint16_t type, const knot_edns_client_subnet_t *ecs,
+		      int scope)
+{
+	/* CACHE_KEY_DEF: key == dname_lf + '\0' + 'S' + RRTYPE + family
+	 *	+ scope prefix length + the prefix of the address (in whole bytes);
+	 * the index of a name and type ends after the family. */
+	const int name_len = k->buf[0];
+	uint8_t *begin = k->buf + 1, *p = begin + name_len;
+	*p++ = 0; /* make sure different names can never match */
+	*p++ = 'S'; /* tag for answers tailored to a subnet */
+	memcpy(p, &type, sizeof(type));
+	p += sizeof(type);
+	*p++ = ecs->family;
+	if (scope >= 0) {
+		*p++ = scope;
+		const int bytes = (scope + 7) / 8;
+		memcpy(p, ecs->address, bytes);
+		if (scope % 8) {
+			p[bytes - 1] &= 0xff << (8 - scope % 8);
+		}
+		p += bytes;
+	}
+	k->type = type;
+	return (knot_db_val_t){ begin, p - begin };
+}
+
+/** Read the index of the name and type in k->buf; zeroed if there's none valid. */
+static void ecs_index_read(struct kr_cache *cache, struct key *k, uint16_t type,
+			   const knot_edns_client_subnet_t *ecs, uint32_t now,
+			   struct entry_h *eh, struct ecs_index *idx)
+{
+	memset(eh, 0, sizeof(*eh));
+	memset(idx, 0, sizeof(*idx));
+	knot_db_val_t key = key_ecs(k, type, ecs, -1), val;
+	if (cache_read(cache, &key, &val) != 0
+	    || val.len != sizeof(*eh) + sizeof(*idx)) {
+		return;
+	}
+	const struct entry_h *eh_idx = val.data;
+	/* All the entries have expired with the index. */
+	if ((int64_t)now - eh_idx->time > eh_idx->ttl) {
+		return;
+	}
+	memcpy(eh, val.data, sizeof(*eh));
+	memcpy(idx, (const uint8_t *)val.data + sizeof(*eh), sizeof(*idx));
+}
+
+int ecs_index_add(struct kr_cache *cache, struct key *k, uint16_t type,
+		  const knot_edns_client_subnet_t *ecs, uint32_t ttl, uint8_t rank,
+		  uint32_t now, uint16_t scopes_max)
+{
+	const int scope = ecs->scope_len;
+	assert(scope > 0 && scope <= 128);
+	/* Replacing an entry doesn't add one. */
+	knot_db_val_t key = key_ecs(k, type, ecs, scope), val;
+	const bool exists = cache_read(cache, &key, &val) == 0;
+
+	struct entry_h eh;
+	struct ecs_index idx;
+	ecs_index_read(cache, k, type, ecs, now, &eh, &idx);
+	if (!exists && idx.count >= scopes_max) {
+		return kr_error(ENOSPC);
+	}
+	idx.count += !exists;
+	idx.lens[(scope - 1) / 8] |= 1 << ((scope - 1) % 8);
+	/* The index lives as long as the longest entry. */
+	const uint32_t left = eh.time + eh.ttl > now ? eh.time + eh.ttl - now : 0;
+	eh.time = now;
+	eh.ttl = MAX(ttl, left);
+	eh.rank = MAX(eh.rank, rank);
+
+	key = key_ecs(k, type, ecs, -1);
+	val = (knot_db_val_t){ NULL, sizeof(eh) + sizeof(idx) };
+	int ret = cache_op(cache, write, &key, &val, 1);
+	if (ret || !val.data) {
+		return ret ? ret : kr_error(ENOSPC);
+	}
+	memcpy(val.data, &eh, sizeof(eh));
+	memcpy((uint8_t *)val.data + sizeof(eh), &idx, sizeof(idx));
+	return kr_ok();
+}
+
+int ecs_scopes(struct kr_cache *cache, struct key *k, uint16_t type,
+	       const knot_edns_client_subnet_t *ecs, uint32_t now, uint8_t *scopes)
+{
+	struct entry_h eh;
+	struct ecs_index idx;
+	ecs_index_read(cache, k, type, ecs, now, &eh, &idx);
+	int count = 0;
+	for (int len = ecs->source_len; len > 0; --len) {
+		if (idx.lens[(len - 1) / 8] & (1 << ((len - 1) % 8))) {
+			scopes[count++] = len;
+		}
+	}
+	return count;
+}
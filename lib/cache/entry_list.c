@@ -102,7 +102,8 @@ int entry_h_seek(knot_db_val_t *val, uint16_t type)
 	case KNOT_RRTYPE_NS:
 		break;
 	}
-	/* advance `val` and `eh` */
+	/* advance `val` and `eh`; entry_h_splice() keeps a single entry ATM,
+	 * so nothing is skipped in practice and the seek doesn't walk any data */
 	while (to_skip-- > 0) {
 		int len = entry_h_len(*val);
 		if (len < 0 || len > val->len) {
@@ -130,11 +131,13 @@ int entry_h_splice(
 		return kr_error(EINVAL);
 	}
 
-	/* Find the whole entry-set and the particular entry within. */
+	/* Find the whole entry-set and the particular entry within.
+	 * Only needed for the rank check below, as the other entries
+	 * of the set aren't kept yet (see LATER below). */
 	knot_db_val_t val_orig_all = VAL_EMPTY, val_orig_entry = VAL_EMPTY;
 	const struct entry_h *eh_orig = NULL;
-	if (!kr_rank_test(rank, KR_RANK_SECURE) || ktype == KNOT_RRTYPE_NS) {
-		int ret = cache_op(cache, read, &key, &val_orig_all, 1);
+	if (!kr_rank_test(rank, KR_RANK_SECURE)) {
+		int ret = cache_read(cache, &key, &val_orig_all);
 		if (ret) val_orig_all = VAL_EMPTY;
 		val_orig_entry = val_orig_all;
 		switch (entry_h_seek(&val_orig_entry, type)) {
@@ -188,11 +191,22 @@ int entry_h_splice(
 				+ val_new_entry->len;
 	assert(storage_size > 0);
 	knot_db_val_t val = { .len = storage_size, .data = NULL };
+	l1_drop(cache, key);
+	if (ktype == KNOT_RRTYPE_NS) {
+		cache->ns_gen += 1; /* a zone cut may appear, see kr_zonecut_find_cached() */
+	}
 	int ret = cache_op(cache, write, &key, &val, 1);
 	if (ret || !val.data || !val.len) {
-		/* Clear cache if overfull.  It's nontrivial to do better with LMDB.
-		 * LATER: some garbage-collection mechanism. */
+		/* Try to make room incrementally.  Clear cache if that doesn't help;
+		 * the garbage collection should prevent getting here, normally. */
 		if (ret == kr_error(ENOSPC)) {
+			/* The failed transaction is unusable now, even within a batch. */
+			(void) cache_op(cache, sync);
+			ret = kr_cache_gc(cache, KR_CACHE_GC_URGENT);
+			if (ret > 0) {
+				kr_log_info("[cache] overfull, removed %d entries\n", ret);
+				return kr_error(ENOSPC);
+			}
 			ret = kr_cache_clear(cache);
 			const char *msg = "[cache] clearing because overfull, ret = %d\n";
 			if (ret) {
@@ -207,6 +221,7 @@ int entry_h_splice(
 		VERBOSE_MSG(qry, "=> failed backend write, ret = %d\n", ret);
 		return kr_error(ret ? ret : ENOSPC);
 	}
+	remote_note_write(cache, key);
 
 	/* Write original data before entry, if any. */
 	const ssize_t len_before = val_orig_entry.data - val_orig_all.data;
@@ -17,7 +17,9 @@
 /** @file
  * Implementation of packet-caching.  Prototypes in ./impl.h
  *
- * The packet is stashed in entry_h::data as uint16_t length + full packet wire format.
+ * The packet is stashed in entry_h::data as uint16_t length + full packet wire format,
+ * with the names compressed (see pkt_compress()).  A resolved CNAME chain is stashed
+ * the same way, as the answer it makes, see stash_chain().
  */
 
 #include "lib/utils.h"
@@ -61,6 +63,75 @@ static uint32_t packet_ttl(const knot_pkt_t *pkt, bool is_negative)
 }
 
 
+/** Write the packet anew with the names compressed, as some servers don't compress
+ * (or not all the names).  The records stay the same, so the reader doesn't care.
+ * @return the new packet if it's smaller, or NULL (the original is to be stashed) */
+static knot_pkt_t *pkt_compress(const knot_pkt_t *pkt)
+{
+	if (pkt->tsig_rr || knot_wire_get_qdcount(pkt->wire) != 1) {
+		return NULL;
+	}
+	knot_pkt_t *c = knot_pkt_new(NULL, pkt->size, NULL);
+	if (!c) {
+		return NULL;
+	}
+	int ret = knot_pkt_put_question(c, knot_pkt_qname(pkt), knot_pkt_qclass(pkt),
+					knot_pkt_qtype(pkt));
+	for (knot_section_t i = KNOT_ANSWER; ret == KNOT_EOK && i <= KNOT_ADDITIONAL; ++i) {
+		ret = knot_pkt_begin(c, i);
+		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
+		for (unsigned k = 0; ret == KNOT_EOK && k < sec->count; ++k) {
+			ret = knot_pkt_put(c, KNOT_COMPR_HINT_NONE, knot_pkt_rr(sec, k), 0);
+		}
+	}
+	if (ret != KNOT_EOK || c->size >= pkt->size) {
+		knot_pkt_free(&c);
+		return NULL;
+	}
+	/* ID and flags as they came; the counts are written by knot_pkt_put(). */
+	memcpy(c->wire, pkt->wire, KNOT_WIRE_OFFSET_QDCOUNT);
+	return c;
+}
+
+/** Write the packet as the entry of the name and type, see the callers.
+ * @return the entry for the finishing touches, or NULL */
+static struct entry_h *pkt_entry_write(const uint8_t *pkt_wire, uint16_t pkt_size,
+		const knot_dname_t *owner, uint16_t pkt_type, uint8_t ns, uint8_t rank,
+		uint32_t ttl, const struct kr_query *qry, struct kr_cache *cache)
+{
+	/* Construct the key under which the pkt will be stored. */
+	struct key k_storage, *k = &k_storage;
+	k->ns = ns;
+	knot_db_val_t key;
+	int ret = kr_dname_lf(k->buf, owner, false);
+	if (ret) {
+		/* A server might (incorrectly) reply with QDCOUNT=0. */
+		assert(owner == NULL);
+		return NULL;
+	}
+	key = key_exact_type_maypkt(k, pkt_type);
+
+	knot_db_val_t val_new_entry = {
+		.data = NULL,
+		.len = offsetof(struct entry_h, data) + sizeof(pkt_size) + pkt_size,
+	};
+	/* Prepare raw memory for the new entry and fill it. */
+	ret = entry_h_splice(&val_new_entry, rank, key, k->type, pkt_type,
+				owner, qry, cache, qry->timestamp.tv_sec);
+	if (ret) { /* some aren't really errors */
+		return NULL;
+	}
+	assert(val_new_entry.data);
+	struct entry_h *eh = val_new_entry.data;
+	eh->time = qry->timestamp.tv_sec;
+	eh->ttl  = MAX(MIN(ttl, cache->ttl_max), cache->ttl_min);
+	eh->rank = rank;
+	eh->is_packet = true;
+	memcpy(eh->data, &pkt_size, sizeof(pkt_size));
+	memcpy(eh->data + sizeof(pkt_size), pkt_wire, pkt_size);
+	kstats_count(cache, KR_CACHE_KIND_PKT, pkt_type, rank, KR_CACHE_EV_STASH);
+	return eh;
+}
 
 void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 		const struct kr_request *req)
@@ -68,8 +139,10 @@ void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 	/* In some cases, stash also the packet. */
 	const bool is_negative = kr_response_classify(pkt)
 				& (PKT_NODATA|PKT_NXDOMAIN);
+	/* Within a cache namespace, negative answers are only cached as packets. */
+	const uint8_t ns = cache_ns(qry);
 	const bool want_pkt = qry->flags.DNSSEC_BOGUS
-		|| (is_negative && (qry->flags.DNSSEC_INSECURE || !qry->flags.DNSSEC_WANT));
+		|| (is_negative && (qry->flags.DNSSEC_INSECURE || !qry->flags.DNSSEC_WANT || ns));
 
 	/* Also stash packets that contain an NSEC3.
 	 * LATER(NSEC3): remove when aggressive NSEC3 works. */
@@ -108,7 +181,7 @@ void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 			kr_rank_set(&rank, KR_RANK_INSECURE);
 		} else if (!qry->flags.DNSSEC_WANT) {
 			/* no TAs at all, leave _RANK_AUTH */
-		} else if (with_nsec3) {
+		} else if (with_nsec3 || ns) {
 			/* All bad cases should be filtered above,
 			 * at least the same way as pktcache in kresd 1.5.x. */
 			kr_rank_set(&rank, KR_RANK_SECURE);
@@ -118,54 +191,190 @@ void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 	const uint16_t pkt_type = knot_pkt_qtype(pkt);
 	const knot_dname_t *owner = knot_pkt_qname(pkt); /* qname can't be compressed */
 
-	// LATER: nothing exists under NXDOMAIN.  Implement that (optionally)?
-#if 0
-	if (knot_wire_get_rcode(pkt->wire) == KNOT_RCODE_NXDOMAIN
-	 /* && !qry->flags.DNSSEC_INSECURE */ ) {
-		pkt_type = KNOT_RRTYPE_NS;
-	}
-#endif
-
-	/* Construct the key under which the pkt will be stored. */
-	struct key k_storage, *k = &k_storage;
-	knot_db_val_t key;
-	int ret = kr_dname_lf(k->buf, owner, false);
-	if (ret) {
-		/* A server might (incorrectly) reply with QDCOUNT=0. */
-		assert(owner == NULL);
+	/* The full packet as it came from upstream, unless it compresses better. */
+	knot_pkt_t *compressed = pkt_compress(pkt);
+	const uint8_t *pkt_wire = compressed ? compressed->wire : pkt->wire;
+	const uint16_t pkt_size = compressed ? compressed->size : pkt->size;
+	struct entry_h *eh = pkt_entry_write(pkt_wire, pkt_size, owner, pkt_type, ns, rank,
+					     packet_ttl(pkt, is_negative), qry, &req->ctx->cache);
+	if (!eh) {
+		knot_pkt_free(&compressed);
 		return;
 	}
-	key = key_exact_type_maypkt(k, pkt_type);
-
-	/* For now we stash the full packet byte-exactly as it came from upstream. */
-	const uint16_t pkt_size = pkt->size;
-	knot_db_val_t val_new_entry = {
-		.data = NULL,
-		.len = offsetof(struct entry_h, data) + sizeof(pkt_size) + pkt->size,
-	};
-	/* Prepare raw memory for the new entry and fill it. */
-	struct kr_cache *cache = &req->ctx->cache;
-	ret = entry_h_splice(&val_new_entry, rank, key, k->type, pkt_type,
-				owner, qry, cache, qry->timestamp.tv_sec);
-	if (ret) return; /* some aren't really errors */
-	assert(val_new_entry.data);
-	struct entry_h *eh = val_new_entry.data;
-	eh->time = qry->timestamp.tv_sec;
-	eh->ttl  = MAX(MIN(packet_ttl(pkt, is_negative), cache->ttl_max), cache->ttl_min);
-	eh->rank = rank;
-	eh->is_packet = true;
 	eh->has_optout = qry->flags.DNSSEC_OPTOUT;
-	memcpy(eh->data, &pkt_size, sizeof(pkt_size));
-	memcpy(eh->data + sizeof(pkt_size), pkt->wire, pkt_size);
 
 	WITH_VERBOSE(qry) {
 		auto_free char *type_str = kr_rrtype_text(pkt_type),
 			*owner_str = kr_dname_text(owner);
 		VERBOSE_MSG(qry, "=> stashed packet: rank 0%.2o, TTL %d, "
-				"%s %s (%d B)\n",
+				"%s %s (%d B, packet %d B of %d B)\n",
 				eh->rank, eh->ttl,
-				type_str, owner_str, (int)val_new_entry.len);
+				type_str, owner_str,
+				(int)(offsetof(struct entry_h, data) + sizeof(pkt_size) + pkt_size),
+				(int)pkt_size, (int)pkt->size);
+	}
+
+	/* Nothing exists under NXDOMAIN (RFC 8020); closest_NS() finds it on the way
+	 * to the zone cut, at the NS key.  Not through a CNAME, it'd be of the target. */
+	if (knot_wire_get_rcode(pkt->wire) == KNOT_RCODE_NXDOMAIN
+	    && knot_wire_get_ancount(pkt->wire) == 0 && !ns
+	    && !kr_rank_test(rank, KR_RANK_BOGUS) && !kr_rank_test(rank, KR_RANK_OMIT)) {
+		if (pkt_type != KNOT_RRTYPE_NS) {
+			eh = pkt_entry_write(pkt_wire, pkt_size, owner, KNOT_RRTYPE_NS, ns, rank,
+					     packet_ttl(pkt, is_negative), qry, &req->ctx->cache);
+		}
+		if (eh) {
+			eh->is_nxdomain = true;
+		}
+	}
+	knot_pkt_free(&compressed);
+}
+
+int answer_from_nxdomain(kr_layer_t *ctx, knot_pkt_t *pkt, const struct entry_h *eh,
+			 uint32_t new_ttl)
+{
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+
+	/* Parse the stored answer aside, its question is of the ancestor. */
+	uint16_t pkt_len;
+	memcpy(&pkt_len, eh->data, sizeof(pkt_len));
+	knot_pkt_t *nx = knot_pkt_new(NULL, pkt_len, &pkt->mm);
+	if (!nx) {
+		return kr_error(ENOMEM);
+	}
+	memcpy(nx->wire, eh->data + sizeof(pkt_len), pkt_len);
+	nx->size = pkt_len;
+	if (knot_pkt_parse(nx, 0) != KNOT_EOK) {
+		return kr_error(ENOENT);
+	}
+
+	int ret = pkt_renew(pkt, qry->sname, qry->stype);
+	if (ret == 0) {
+		ret = knot_pkt_begin(pkt, KNOT_AUTHORITY);
+	}
+	if (ret) {
+		return kr_error(ret);
+	}
+	knot_wire_set_rcode(pkt->wire, KNOT_RCODE_NXDOMAIN);
+	/* The whole authority section: the NSEC* proving the stored name doesn't
+	 * exist prove it for the names below as well, with the same closest
+	 * encloser and wildcard, so a secure answer keeps its proof. */
+	const uint32_t drift = eh->ttl - new_ttl;
+	const knot_pktsection_t *auth = knot_pkt_section(nx, KNOT_AUTHORITY);
+	for (unsigned i = 0; i < auth->count; ++i) {
+		knot_rrset_t *rr = (knot_rrset_t *)knot_pkt_rr(auth, i);
+		knot_rdata_t *rd = rr->rrs.data;
+		for (uint16_t j = 0; j < rr->rrs.rr_count; ++j) {
+			knot_rdata_set_ttl(rd, knot_rdata_ttl(rd) - drift);
+			rd = kr_rdataset_next(rd);
+		}
+		const struct answer_rrset arrset = { .set = { .rr = rr } };
+		ret = pkt_append(pkt, &arrset, eh->rank);
+		if (ret) {
+			return kr_error(ret);
+		}
+	}
+
+	/* Finishing touches, as in answer_from_pkt(). */
+	qry->flags.EXPIRING = is_expiring(eh->ttl, new_ttl);
+	qry->flags.CACHED = true;
+	qry->flags.NO_MINIMIZE = true;
+	qry->flags.DNSSEC_INSECURE = kr_rank_test(eh->rank, KR_RANK_INSECURE);
+	if (qry->flags.DNSSEC_INSECURE) {
+		qry->flags.DNSSEC_WANT = false;
 	}
+	qry->flags.DNSSEC_OPTOUT = eh->has_optout;
+	WITH_VERBOSE(qry) {
+		auto_free char *owner_str = kr_dname_text(knot_pkt_qname(nx));
+		VERBOSE_MSG(qry, "=> satisfied by NXDOMAIN of %s: rank 0%.2o, new TTL %d\n",
+				owner_str, eh->rank, new_ttl);
+	}
+	return kr_ok();
+}
+
+void stash_chain(const struct kr_query *qry, const struct kr_request *req)
+{
+	/* The last query of a chain, with the answer of its type.  The chains with
+	 * wildcards or opt-out aren't worth the proofs they'd need in the packet. */
+	if (qry->parent || !qry->flags.RESOLVED || qry->flags.STUB || qry->flags.STRICT
+	    || qry->flags.DNSSEC_BOGUS || cache_ns(qry)
+	    || knot_wire_get_cd(req->answer->wire)) {
+		return;
+	}
+	const struct kr_query *origin = qry;
+	for (const struct kr_query *q = qry; q != NULL; q = q->cname_parent) {
+		if (q->flags.DNSSEC_WEXPAND || q->flags.DNSSEC_OPTOUT) {
+			return;
+		}
+		origin = q;
+	}
+	/* The answer is the CNAMEs and the final records, with their RRSIGs;
+	 * either all validated (secure or insecure) or none of them. */
+	const ranked_rr_array_t *arr = &req->answ_selected;
+	bool has_cname = false, has_final = false, has_omit = false, has_valid = false;
+	uint8_t rank_min = KR_RANK_SECURE;
+	for (size_t i = 0; i < arr->len; ++i) {
+		const ranked_rr_array_entry_t *entry = arr->at[i];
+		if (!entry->to_wire) {
+			continue;
+		}
+		const uint16_t type = kr_rrset_type_maysig(entry->rr);
+		if (type == KNOT_RRTYPE_CNAME) {
+			has_cname = true;
+		} else if (type == qry->stype && knot_dname_is_equal(entry->rr->owner, qry->sname)) {
+			has_final = true;
+		} else {
+			return;
+		}
+		const uint8_t rank = entry->rank & ~KR_RANK_AUTH;
+		if (!(entry->rank & KR_RANK_AUTH) || (rank != KR_RANK_OMIT
+		    && rank != KR_RANK_INSECURE && rank != KR_RANK_SECURE)) {
+			return;
+		}
+		has_omit = has_omit || rank == KR_RANK_OMIT;
+		has_valid = has_valid || rank != KR_RANK_OMIT;
+		rank_min = MIN(rank_min, rank);
+	}
+	if (!has_cname || !has_final || (has_omit && has_valid)) {
+		return;
+	}
+
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, NULL);
+	if (!pkt) {
+		return;
+	}
+	int ret = knot_pkt_put_question(pkt, origin->sname, KNOT_CLASS_IN, qry->stype);
+	if (ret == KNOT_EOK) {
+		ret = knot_pkt_begin(pkt, KNOT_ANSWER);
+	}
+	for (size_t i = 0; ret == KNOT_EOK && i < arr->len; ++i) {
+		if (arr->at[i]->to_wire) {
+			ret = knot_pkt_put(pkt, KNOT_COMPR_HINT_NONE, arr->at[i]->rr, 0);
+		}
+	}
+	if (ret != KNOT_EOK) {
+		knot_pkt_free(&pkt);
+		return;
+	}
+	knot_wire_set_qr(pkt->wire);
+	knot_wire_set_aa(pkt->wire);
+
+	const uint8_t rank = KR_RANK_AUTH | rank_min;
+	struct entry_h *eh = pkt_entry_write(pkt->wire, pkt->size, origin->sname, qry->stype,
+					     0, rank, packet_ttl(pkt, false), qry, &req->ctx->cache);
+	if (eh) {
+		eh->is_chain = true;
+		WITH_VERBOSE(qry) {
+			auto_free char *type_str = kr_rrtype_text(qry->stype),
+				*owner_str = kr_dname_text(origin->sname);
+			VERBOSE_MSG(qry, "=> stashed CNAME chain: rank 0%.2o, TTL %d, "
+					"%s %s (%d records, packet %d B)\n",
+					eh->rank, eh->ttl, type_str, owner_str,
+					(int)knot_wire_get_ancount(pkt->wire), (int)pkt->size);
+		}
+	}
+	knot_pkt_free(&pkt);
 }
 
 
@@ -196,6 +405,10 @@ int answer_from_pkt(kr_layer_t *ctx, knot_pkt_t *pkt, uint16_t type,
 		return kr_error(ret);
 	}
 	knot_wire_set_id(pkt->wire, msgid);
+	/* The NXDOMAIN copy at the NS key answers the other types, too. */
+	if (eh->is_nxdomain && knot_pkt_qtype(pkt) != qry->stype) {
+		return answer_from_nxdomain(ctx, pkt, eh, new_ttl);
+	}
 
 	/* Add rank into the additional field. */
 	for (size_t i = 0; i < pkt->rrset_count; ++i) {
@@ -232,8 +445,9 @@ int answer_from_pkt(kr_layer_t *ctx, knot_pkt_t *pkt, uint16_t type,
 		qry->flags.DNSSEC_WANT = false;
 	}
 	qry->flags.DNSSEC_OPTOUT = eh->has_optout;
-	VERBOSE_MSG(qry, "=> satisfied by exact packet: rank 0%.2o, new TTL %d\n",
-			eh->rank, new_ttl);
+	qry->flags.CNAME_CHAIN = eh->is_chain;
+	VERBOSE_MSG(qry, "=> satisfied by exact %s: rank 0%.2o, new TTL %d\n",
+			eh->is_chain ? "CNAME chain" : "packet", eh->rank, new_ttl);
 	return kr_ok();
 }
 
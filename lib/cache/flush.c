@@ -0,0 +1,241 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Removal of subtrees from the cache.  Prototypes in ./impl.h
+ *
+ * The LF of a name is a prefix of the keys of all the names under it,
+ * including the NSEC* chains of the zone (CACHE_KEY_DEF), so a subtree
+ * is a contiguous range of keys.  The flushed names are kept by their LF,
+ * with the time of the flush; the entries stored before it are hidden
+ * by flush_hides() until they're removed, in chunks by kr_cache_remove_step()
+ * or (the lazy ones) by the garbage collection.
+ *
+ * \note Other processes sharing the storage don't hide the entries,
+ * they see them until they're removed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/cache/impl.h"
+#include "lib/generic/trie.h"
+
+/** Limit of the keys removed by one kr_cache_remove_step(). */
+#define FLUSH_CHUNK_MAX 256
+
+struct flush_zone {
+	uint32_t time;    /**< Entries stored up to this wall-clock second are hidden */
+	uint32_t until;   /**< All of them have expired then, see kr_cache::ttl_max */
+	uint32_t passes;  /**< kr_cache::gc.passes at the time of the flush */
+	bool lazy;        /**< Left to the garbage collection */
+	uint8_t lf_len;
+	uint8_t lf[KNOT_DNAME_MAXLEN];
+};
+
+struct kr_cache_flush {
+	trie_t *zones;    /**< struct flush_zone * by the LF */
+};
+
+static int zone_free(trie_val_t *val, void *baton)
+{
+	free(*val);
+	return 0;
+}
+
+static void flush_free(struct kr_cache *cache)
+{
+	trie_apply(cache->flush->zones, zone_free, NULL);
+	trie_free(cache->flush->zones);
+	free(cache->flush);
+	cache->flush = NULL;
+}
+
+static void zone_del(struct kr_cache *cache, struct flush_zone *z)
+{
+	trie_del(cache->flush->zones, (const char *)z->lf, z->lf_len, NULL);
+	free(z);
+	if (trie_weight(cache->flush->zones) == 0) {
+		flush_free(cache);
+	}
+}
+
+void flush_clear(struct kr_cache *cache)
+{
+	if (cache->flush) {
+		flush_free(cache);
+	}
+}
+
+bool flush_hides_real(const struct kr_cache *cache, knot_db_val_t key, const struct entry_h *eh)
+{
+	const uint8_t *k = key.data;
+	const size_t lf_max = MIN(key.len, KNOT_DNAME_MAXLEN);
+	/* The LF of each ancestor ends with a zero byte. */
+	for (size_t i = 0; i < lf_max; ++i) {
+		if (k[i] != 0) {
+			continue;
+		}
+		trie_val_t *val = trie_get_try(cache->flush->zones, (const char *)k, i + 1);
+		if (!val) {
+			continue;
+		}
+		const struct flush_zone *z = *val;
+		if (eh->time <= z->time && (uint32_t)kr_time() < z->until) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int kr_cache_remove_subtree(struct kr_cache *cache, const knot_dname_t *name, bool lazy)
+{
+	if (!cache || !cache->db || !name) {
+		return kr_error(EINVAL);
+	}
+	if (name[0] == 0) {
+		return kr_cache_clear(cache);
+	}
+	/* A wildcard would be taken as the whole parent, see kr_cdb_api::match. */
+	if (knot_dname_is_wildcard(name)) {
+		return kr_error(EINVAL);
+	}
+	if (!lazy && (!cache->api->match || !cache->api->remove)) {
+		return kr_error(ENOSYS);
+	}
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	int ret = kr_dname_lf(lf, name, false);
+	if (ret) {
+		return kr_error(ret);
+	}
+	if (!cache->flush) {
+		cache->flush = calloc(1, sizeof(*cache->flush));
+		if (!cache->flush) {
+			return kr_error(ENOMEM);
+		}
+		cache->flush->zones = trie_create(NULL);
+		if (!cache->flush->zones) {
+			free(cache->flush);
+			cache->flush = NULL;
+			return kr_error(ENOMEM);
+		}
+	}
+	trie_val_t *val = trie_get_ins(cache->flush->zones, (const char *)lf + 1, lf[0]);
+	if (val && !*val) {
+		*val = calloc(1, sizeof(struct flush_zone));
+		if (!*val) {
+			trie_del(cache->flush->zones, (const char *)lf + 1, lf[0], NULL);
+		}
+	}
+	if (!val || !*val) {
+		if (trie_weight(cache->flush->zones) == 0) {
+			flush_free(cache);
+		}
+		return kr_error(ENOMEM);
+	}
+	struct flush_zone *z = *val;
+	z->time = kr_time();
+	z->until = z->time + cache->ttl_max + 1;
+	z->passes = cache->gc.passes;
+	z->lazy = lazy;
+	z->lf_len = lf[0];
+	memcpy(z->lf, lf + 1, lf[0]);
+	/* The copies aren't checked, see l1_peek(). */
+	l1_clear(cache);
+	return kr_ok();
+}
+
+struct flush_pick {
+	struct flush_zone *walk;     /**< The first zone to remove by chunks */
+	struct flush_zone *done;     /**< A zone that doesn't need hiding anymore */
+	uint32_t now, passes;
+};
+
+static int zone_pick(trie_val_t *val, void *baton)
+{
+	struct flush_pick *p = baton;
+	struct flush_zone *z = *val;
+	/* A full pass of the garbage collection after the flush has removed them. */
+	if (p->now >= z->until || (z->lazy && p->passes >= z->passes + 2)) {
+		p->done = z;
+	} else if (!z->lazy && !p->walk) {
+		p->walk = z;
+	}
+	return 0;
+}
+
+void flush_gc_pass(struct kr_cache *cache)
+{
+	while (cache->flush) {
+		struct flush_pick pick = { NULL, NULL, kr_time(), cache->gc.passes };
+		trie_apply(cache->flush->zones, zone_pick, &pick);
+		if (!pick.done) {
+			break;
+		}
+		zone_del(cache, pick.done);
+	}
+}
+
+int kr_cache_remove_step(struct kr_cache *cache, int maxcount)
+{
+	if (!cache || !cache->db || maxcount <= 0) {
+		return kr_error(EINVAL);
+	}
+	flush_gc_pass(cache);
+	struct flush_pick pick = { NULL, NULL, kr_time(), cache->gc.passes };
+	if (cache->flush) {
+		trie_apply(cache->flush->zones, zone_pick, &pick);
+	}
+	struct flush_zone *z = pick.walk;
+	if (!z) {
+		return kr_error(ENOENT);
+	}
+	/* The keys are matched in a fresh snapshot, so they're gone after the removal. */
+	if (cache->api->read_renew) {
+		cache_op(cache, read_renew);
+	}
+	knot_db_val_t prefix = { z->lf, z->lf_len };
+	knot_db_val_t keys[FLUSH_CHUNK_MAX];
+	int count = cache_op(cache, match, &prefix, keys, MIN(maxcount, FLUSH_CHUNK_MAX));
+	if (count <= 0) {
+		kr_cache_sync(cache);
+		if (count == 0 || count == kr_error(ENOENT)) {
+			zone_del(cache, z);
+			return 0;
+		}
+		return count;
+	}
+	/* The matched keys belong to the read snapshot, which the removal ends. */
+	size_t size = 0;
+	for (int i = 0; i < count; ++i) {
+		size += keys[i].len;
+	}
+	uint8_t *buf = malloc(size);
+	if (!buf) {
+		kr_cache_sync(cache);
+		return kr_error(ENOMEM);
+	}
+	for (int i = 0, pos = 0; i < count; pos += keys[i].len, ++i) {
+		memcpy(buf + pos, keys[i].data, keys[i].len);
+		keys[i].data = buf + pos;
+	}
+	int ret = cache_op(cache, remove, keys, count);
+	free(buf);
+	kr_cache_sync(cache);
+	/* Some may have been removed meanwhile, e.g. by another process. */
+	return (ret < 0 && ret != kr_error(ENOENT)) ? ret : count;
+}
@@ -22,6 +22,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <libknot/consts.h>
 #include <libknot/db/db.h>
@@ -41,6 +42,9 @@
  * '1' entry (NSEC1)
  *	- contents is the same as for exact hit for NSEC
  *	- flags don't make sense there
+ * '3' entry (NSEC3)
+ *	- contents is the same as for exact hit for NSEC3
+ *	- flags don't make sense there
  * */
 struct entry_h {
 	uint32_t time;	/**< The time of inception. */
@@ -55,6 +59,9 @@ struct entry_h {
 	bool has_cname : 1;	/**< Only used for NS ktype. */
 	bool has_dname : 1;	/**< Only used for NS ktype. */
 	bool has_optout : 1;	/**< Only for packets with NSEC3. */
+	bool is_chain : 1;	/**< Only for packets: a whole CNAME chain, see stash_chain(). */
+	bool is_nxdomain : 1;	/**< Only for packets at NS ktype: nothing exists at or below
+				 *   the name (RFC 8020), see answer_from_nxdomain(). */
 	/* ENTRY_H_FLAGS */
 
 	uint8_t data[];
@@ -70,6 +77,11 @@ struct entry_h * entry_h_consistent(knot_db_val_t data, uint16_t type);
 // TODO
 #define KR_CACHE_KEY_MAXLEN (KNOT_DNAME_MAXLEN + 100)
 
+/** Size of the hash part of NSEC3 keys; only SHA-1 is defined for NSEC3. */
+#define NSEC3_HASH_LEN 20
+/** Size of the chain identifier in NSEC3 keys, see nsec_p_key() in ./nsec3.c */
+#define NSEC3_P_LEN 4
+
 struct key {
 	const knot_dname_t *zname; /**< current zone name (points within qry->sname) */
 	uint8_t zlf_len; /**< length of current zone's lookup format */
@@ -77,6 +89,8 @@ struct key {
 	/** Corresponding key type; e.g. NS for CNAME.
 	 * Note: NSEC type is ambiguous (exact and range key). */
 	uint16_t type;
+	/** Namespace of the exact keys, 0 for the shared one; see cache_ns(). */
+	uint8_t ns;
 	/** The key data start at buf+1, and buf[0] contains some length.
 	 * For details see key_exact* and key_NSEC* functions. */
 	uint8_t buf[KR_CACHE_KEY_MAXLEN];
@@ -93,6 +107,33 @@ static inline size_t key_nwz_off(const struct key *k)
  */
 knot_db_val_t key_exact_type_maypkt(struct key *k, uint16_t type);
 
+/** The cache namespace of the query, see kr_request::cache_ns.
+ * Only the forwarded queries use it; the others share the cache. */
+static inline uint8_t cache_ns(const struct kr_query *qry)
+{
+	return qry && (qry->flags.FORWARD || qry->flags.STUB) ? qry->request->cache_ns : 0;
+}
+
+/** Count a use of the entry for the garbage collection, see kr_cache_share_sketch(). */
+void entry_count_use(knot_db_val_t key);
+/** Estimate the recent lookups of the entry, 0 without the shared sketch. */
+unsigned entry_lookups(knot_db_val_t key);
+/** Return the version of the entry format, see also kr_cache_snapshot_begin(). */
+uint16_t cache_version(void);
+/** Count an event in kr_cache::kstats, if allocated. */
+void kstats_count(struct kr_cache *cache, enum kr_cache_kind kind, uint16_t type,
+		  uint8_t rank, enum kr_cache_event event);
+/** Kind of the stored entry by its key type, see key_exact_type_maypkt(). */
+static inline enum kr_cache_kind kstats_kind(uint16_t ktype)
+{
+	switch (ktype) {
+	case KNOT_RRTYPE_NSEC:	return KR_CACHE_KIND_NSEC1;
+	case KNOT_RRTYPE_NSEC3:	return KR_CACHE_KIND_NSEC3;
+	case KNOT_RRTYPE_NS:	return KR_CACHE_KIND_NS;
+	default:		return KR_CACHE_KIND_RR;
+	}
+}
+
 
 /* entry_h chaining; implementation in ./entry_list.c */
 
@@ -129,6 +170,11 @@ int entry_h_splice(
 void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 		const struct kr_request *req);
 
+/** Stash the answer of a resolved CNAME chain as a packet under its first name,
+ * so that it's answered with one lookup instead of one query per hop.
+ * The TTL is the lowest in the chain, the rank the lowest of its records. */
+void stash_chain(const struct kr_query *qry, const struct kr_request *req);
+
 /** Try answering from packet cache, given an entry_h.
  *
  * This assumes the TTL is OK and entry_h_consistent, but it may still return error.
@@ -137,12 +183,25 @@ void stash_pkt(const knot_pkt_t *pkt, const struct kr_query *qry,
 int answer_from_pkt(kr_layer_t *ctx, knot_pkt_t *pkt, uint16_t type,
 		const struct entry_h *eh, const void *eh_bound, uint32_t new_ttl);
 
+/** Answer NXDOMAIN for qry->sname at or below the name of the entry (RFC 8020),
+ * with the authority section of the stored answer, incl. its NSEC* proofs;
+ * see entry_h::is_nxdomain.
+ *
+ * This assumes the TTL and rank are OK and entry_h_consistent, but it may still return error.
+ * On success it handles all the rest, incl. qry->flags.
+ */
+int answer_from_nxdomain(kr_layer_t *ctx, knot_pkt_t *pkt, const struct entry_h *eh,
+			 uint32_t new_ttl);
 
-/** Record is expiring if it has less than 1% TTL (or less than 5s) */
+
+/** Percent of the original TTL below which records are expiring, see kr_cache_set_prefetch(). */
+extern uint8_t cache_expiring_pct;
+
+/** Record is expiring if it has less than cache_expiring_pct of TTL (or less than 5s) */
 static inline bool is_expiring(uint32_t orig_ttl, uint32_t new_ttl)
 {
 	int64_t nttl = new_ttl; /* avoid potential over/under-flow */
-	return 100 * (nttl - 5) < orig_ttl;
+	return 100 * (nttl - 5) < (int64_t)orig_ttl * cache_expiring_pct;
 }
 
 /** Returns signed result so you can inspect how much stale the RR is.
@@ -175,6 +234,7 @@ struct answer {
 	int rcode;	/**< PKT_NODATA, etc. */
 	uint8_t nsec_v;	/**< 1 or 3 */
 	knot_mm_t *mm;	/**< Allocator for rrsets */
+	bool skip_rrsigs; /**< Don't materialize RRSIGs, see want_rrsigs() in ./api.c */
 	struct answer_rrset {
 		ranked_rr_array_entry_t set;	/**< set+rank for the main data */
 		knot_rdataset_t sig_rds;	/**< RRSIG data, if any */
@@ -188,6 +248,17 @@ enum {
 	AR_CPE, 	/**< NSEC3 matching the closest provable encloser. */
 };
 
+/** Free ans->rrsets[id] (if any), so that it can be filled again. */
+static inline void answer_rrset_clear(struct answer *ans, int id)
+{
+	struct answer_rrset *ar = &ans->rrsets[id];
+	if (ar->set.rr) {
+		knot_rrset_free(&ar->set.rr, ans->mm);
+	}
+	knot_rdataset_clear(&ar->sig_rds, ans->mm);
+	memset(ar, 0, sizeof(*ar));
+}
+
 /** Materialize RRset + RRSIGs into ans->rrsets[id].
  * LATER(optim.): it's slightly wasteful that we allocate knot_rrset_t for the packet
  *
@@ -237,6 +308,47 @@ int nsec1_src_synth(struct key *k, struct answer *ans, const knot_dname_t *clenc
 		    const struct kr_query *qry, struct kr_cache *cache);
 
 
+/* NSEC3 stuff.  Implementation in ./nsec3.c */
+
+/** Construct the string key for an NSEC3 record of a zone.
+ * \return the key, or NULL .data if the record isn't suitable for caching.
+ * \note k->zlf_len is set */
+knot_db_val_t key_NSEC3_rr(struct key *k, const knot_rrset_t *rr, const knot_dname_t *zname);
+
+/** Closest encloser check for NSEC3; see nsec1_encloser() for the interface.
+ * \param k	space to store key + input: zname and zlf_len
+ * \return 0: success;  >0: nothing suitable in cache;  <0: exit cache immediately. */
+int nsec3_encloser(struct key *k, struct answer *ans,
+		   const int sname_labels, int *clencl_labels,
+		   const struct kr_query *qry, struct kr_cache *cache);
+
+/** Source of synthesis (SS) check for NSEC3; see nsec1_src_synth() for the interface.
+ * \return 0: continue; <0: exit cache immediately;
+ * 	AR_SOA: skip to adding SOA (SS was covered or matched for NODATA). */
+int nsec3_src_synth(struct key *k, struct answer *ans, const knot_dname_t *clencl_name,
+		    const struct kr_query *qry, struct kr_cache *cache);
+
+
+/* EDNS Client Subnet stuff.  Implementation in ./ecs.c */
+
+/** Construct the key of an answer tailored to the subnet, or of their index if scope < 0.
+ * It's assumed that kr_dname_lf(k->buf, owner, *) had been ran. */
+knot_db_val_t key_ecs(struct key *k, uint16_t type, const knot_edns_client_subnet_t *ecs,
+		      int scope);
+
+/** Count an entry with ecs->scope_len in the index of the name and type.
+ * \return kr_error(ENOSPC) if there are scopes_max of them already */
+int ecs_index_add(struct kr_cache *cache, struct key *k, uint16_t type,
+		  const knot_edns_client_subnet_t *ecs, uint32_t ttl, uint8_t rank,
+		  uint32_t now, uint16_t scopes_max);
+
+/** Fill the scopes with an entry for the name and type, longest first.
+ * \param scopes	space for ecs->source_len items
+ * \return the number of them */
+int ecs_scopes(struct kr_cache *cache, struct key *k, uint16_t type,
+	       const knot_edns_client_subnet_t *ecs, uint32_t now, uint8_t *scopes);
+
+
 #define VERBOSE_MSG(qry, fmt...) QRVERBOSE((qry), "cach",  fmt)
 
 
@@ -244,3 +356,63 @@ int nsec1_src_synth(struct key *k, struct answer *ans, const knot_dname_t *clenc
 /** Shorthand for operations on cache backend */
 #define cache_op(cache, op, ...) (cache)->api->op((cache)->db, ## __VA_ARGS__)
 
+
+/* Prototypes for ./flush.c */
+
+bool flush_hides_real(const struct kr_cache *cache, knot_db_val_t key, const struct entry_h *eh);
+/** Check whether the entry is hidden by kr_cache_remove_subtree(). */
+static inline bool flush_hides(const struct kr_cache *cache, knot_db_val_t key, knot_db_val_t val)
+{
+	return cache->flush && val.len >= offsetof(struct entry_h, data)
+		&& flush_hides_real(cache, key, val.data);
+}
+/** Forget the flushed names, e.g. when the storage is cleared. */
+void flush_clear(struct kr_cache *cache);
+/** Stop hiding what the garbage collection has removed; after each of its passes. */
+void flush_gc_pass(struct kr_cache *cache);
+
+/** Read an entry from the storage, unless it's hidden by kr_cache_remove_subtree(). */
+static inline int cache_read(struct kr_cache *cache, knot_db_val_t *key, knot_db_val_t *val)
+{
+	int ret = cache_op(cache, read, key, val, 1);
+	return (ret == 0 && flush_hides(cache, *key, *val)) ? kr_error(ENOENT) : ret;
+}
+
+/** Like kr_cdb_api::read_leq, unless the entry found is hidden by kr_cache_remove_subtree(). */
+static inline int cache_read_leq(struct kr_cache *cache, knot_db_val_t *key, knot_db_val_t *val)
+{
+	int ret = cache_op(cache, read_leq, key, val);
+	return (ret >= 0 && flush_hides(cache, *key, *val)) ? kr_error(ENOENT) : ret;
+}
+
+
+/* Prototypes for ./l1.c */
+
+/** Create the in-process copy of hot entries for the cache;
+ * its generations are shared through a file in the cache directory `path` (may be NULL). */
+int l1_create(struct kr_cache *cache, uint32_t max_slots, const char *path);
+void l1_free(struct kr_cache *cache);
+/** Invalidate all the copies, in all the processes. */
+void l1_clear(struct kr_cache *cache);
+/** Find a copy of the (exact) entry; val points into the copy, until l1_store().
+ * \return 0 or kr_error(ENOENT) */
+int l1_peek(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t *val);
+/** Copy the value read from the backend, if it's small enough and frequent. */
+void l1_store(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t val);
+/** Drop the copy of a key that's being rewritten, in all the processes. */
+void l1_drop(struct kr_cache *cache, knot_db_val_t key);
+
+
+/* Prototypes for ./remote.c */
+
+/** Find the (exact) entry remotely, after the storage missed; it's promoted on remote_sync().
+ * val points into the remote backend's buffers, until remote_sync().
+ * \return 0 or kr_error(ENOENT) */
+int remote_peek(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t *val);
+/** Note a key written into the storage, to replicate it on remote_sync(). */
+void remote_note_write(struct kr_cache *cache, knot_db_val_t key);
+/** Do the queued replications and promotions; before the storage sync. */
+void remote_sync(struct kr_cache *cache);
+/** Drop the queues, e.g. when the storage is cleared. */
+void remote_clear(struct kr_cache *cache);
+
@@ -0,0 +1,153 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Listing of the cache entries under a name, in slices.
+ *
+ * The LF of the name is a prefix of the keys of all the names under it (see flush.c),
+ * so the walk starts at it and stops at the first key without it.  Between the slices
+ * the read transaction is released, only the key to continue from is kept.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/cache/impl.h"
+
+struct kr_cache_iter {
+	struct kr_cache *cache;
+	uint32_t now;             /**< Wall-clock, like entry_h::time */
+	bool done;
+	uint8_t lf_len;
+	uint8_t lf[KNOT_DNAME_MAXLEN];
+	uint8_t next[KR_CACHE_GC_KEY_MAXLEN]; /**< Key to continue the walk from */
+	uint16_t next_len;
+	/* The slice being filled. */
+	struct kr_cache_iter_entry *entries;
+	int count;
+};
+
+struct kr_cache_iter *kr_cache_iter_begin(struct kr_cache *cache, const knot_dname_t *name)
+{
+	if (!cache || !kr_cache_is_open(cache) || !name || !cache->api->walk) {
+		return NULL;
+	}
+	struct kr_cache_iter *it = calloc(1, sizeof(*it));
+	if (!it) {
+		return NULL;
+	}
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	if (kr_dname_lf(lf, name, false) != 0) {
+		free(it);
+		return NULL;
+	}
+	it->cache = cache;
+	it->lf_len = lf[0];
+	memcpy(it->lf, lf + 1, lf[0]);
+	/* Start at the name itself, all the keys under it follow. */
+	memcpy(it->next, it->lf, it->lf_len);
+	it->next_len = it->lf_len;
+	return it;
+}
+
+/** @internal Decode an exact entry (CACHE_KEY_DEF); false for the others, e.g. NSEC* chains. */
+static bool iter_entry(struct kr_cache_iter *it, const knot_db_val_t *key,
+		       const knot_db_val_t *val, struct kr_cache_iter_entry *e)
+{
+	const uint8_t *k = key->data;
+	/* Exact entries end with '\0' 'E' RRTYPE. */
+	if (key->len < 4 || k[key->len - 4] != 0 || k[key->len - 3] != 'E'
+	    || val->len < sizeof(struct entry_h)) {
+		return false;
+	}
+	size_t lf_len = key->len - 4;
+	e->ns = 0;
+	/* Namespaced ones have '\0' 'N' namespace before, the LF itself ends with '\0'. */
+	if (lf_len >= 3 && k[lf_len - 1] != 0 && k[lf_len - 2] == 'N' && k[lf_len - 3] == 0) {
+		e->ns = k[lf_len - 1];
+		lf_len -= 3;
+	}
+	if (lf_len > KNOT_DNAME_MAXLEN
+	    || knot_dname_lf2wire(e->owner, lf_len, k) < 0) {
+		return false;
+	}
+	const struct entry_h *eh = val->data;
+	memcpy(&e->type, k + key->len - 2, sizeof(e->type));
+	e->rank = eh->rank;
+	e->packet = eh->is_packet;
+	e->ttl = (int64_t)eh->time + eh->ttl - it->now;
+	e->size = key->len + val->len;
+	return true;
+}
+
+/** @internal Collect the entries, see kr_cdb_visit_f; only reads. */
+static int iter_visit(const knot_db_val_t *key, const knot_db_val_t *val, void *baton)
+{
+	struct kr_cache_iter *it = baton;
+	if (key->len < it->lf_len || memcmp(key->data, it->lf, it->lf_len) != 0) {
+		it->done = true;
+		return -1;
+	}
+	if (flush_hides(it->cache, *key, *val)) {
+		return 0; /* see kr_cache_remove_subtree() */
+	}
+	if (iter_entry(it, key, val, &it->entries[it->count])) {
+		it->count += 1;
+	}
+	return 0;
+}
+
+int kr_cache_iter_step(struct kr_cache_iter *it, struct kr_cache_iter_entry *entries,
+		       int max_entries)
+{
+	if (!it || !entries || max_entries <= 0) {
+		return kr_error(EINVAL);
+	}
+	struct kr_cache *cache = it->cache;
+	if (it->done) {
+		return 0;
+	}
+	if (!kr_cache_is_open(cache)) {
+		return kr_error(ENOENT);
+	}
+	it->now = kr_time();
+	it->entries = entries;
+	it->count = 0;
+	knot_db_val_t key = { it->next, it->next_len };
+	int ret = cache_op(cache, walk, &key, max_entries, iter_visit, it);
+	if (ret >= 0 && !it->done) {
+		/* An overlong key can't be continued from; it's rare. */
+		it->done = key.len == 0 || key.len > sizeof(it->next);
+		if (!it->done) {
+			memcpy(it->next, key.data, key.len);
+			it->next_len = key.len;
+		}
+	}
+	/* Release the read transaction between the slices. */
+	kr_cache_sync(cache);
+	it->entries = NULL;
+	return ret < 0 ? ret : it->count;
+}
+
+bool kr_cache_iter_done(const struct kr_cache_iter *it)
+{
+	return !it || it->done;
+}
+
+void kr_cache_iter_free(struct kr_cache_iter *it)
+{
+	free(it);
+}
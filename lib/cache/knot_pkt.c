@@ -89,8 +89,8 @@ int pkt_append(knot_pkt_t *pkt, const struct answer_rrset *rrset, uint8_t rank)
 		} else {
 		/* append the RR array */
 			pkt->rr[pkt->rrset_count] = (knot_rrset_t){
-				.owner = knot_dname_copy(rrset->set.rr->owner, &pkt->mm),
-					/* ^^ well, another copy isn't really needed */
+				/* Shared with the data; pkt doesn't free the RRs. */
+				.owner = rrset->set.rr->owner,
 				.type = KNOT_RRTYPE_RRSIG,
 				.rclass = KNOT_CLASS_IN,
 				.rrs = *rdss[i],
@@ -0,0 +1,208 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * In-process copies of frequently read exact-hit entries.  Prototypes in ./impl.h
+ *
+ * The copies are kept in a lossy LRU, so only the hot names stay.
+ * They are byte-for-byte the values from the backend, so all the usual
+ * TTL and rank checks apply to them unchanged.  A copy is dropped when
+ * the same key is written, all of them when the cache is cleared.
+ *
+ * The copies are valid while the generation of their key's slot is unchanged.
+ * The generations are in a small file of the cache directory mapped by all the
+ * processes using the cache, so a write or a clear in one of them drops
+ * the copies in the others too.  Without the file they're in-process only.
+ *
+ * \note A copy of a value read just before another process wrote the key
+ * may stay in use until it expires, as the read itself might have.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <contrib/cleanup.h>
+
+#include "lib/cache/impl.h"
+#include "lib/generic/lru.h"
+
+/** Entries longer than this are not copied. */
+#define L1_ENTRY_MAXLEN 472
+/** Slots of the generations, by the hash of the key; one page of them. */
+#define L1_GENS 1024
+#define L1_GENS_FILE "/l1gen"
+#define L1_GENS_MODE 0660
+
+struct l1_entry {
+	uint32_t gen;  /**< The generation of the key's slot at the time of the copy */
+	uint16_t len;  /**< Length of data, 0 if dropped */
+	uint8_t data[L1_ENTRY_MAXLEN];
+};
+
+typedef lru_t(struct l1_entry) l1_lru_t;
+
+struct kr_cache_l1 {
+	l1_lru_t *lru;
+	uint32_t *gens;     /**< [L1_GENS]; bumped to invalidate the copies of the slot */
+	bool gens_shared;   /**< gens are the mapped file, else allocated */
+	uint32_t miss_slot; /**< The slot of the last l1_peek() miss ... */
+	uint32_t miss_gen;  /**< ... and its generation then, before the backend's read */
+};
+
+/** The slot of the key; the same in all the processes (FNV-1a). */
+static uint32_t gen_slot(knot_db_val_t key)
+{
+	const uint8_t *k = key.data;
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < key.len; ++i) {
+		h = (h ^ k[i]) * 16777619u;
+	}
+	return h % L1_GENS;
+}
+
+static inline uint32_t gen_get(const struct kr_cache_l1 *l1, uint32_t slot)
+{
+	return __atomic_load_n(&l1->gens[slot], __ATOMIC_ACQUIRE);
+}
+
+static inline void gen_bump(struct kr_cache_l1 *l1, uint32_t slot)
+{
+	__atomic_add_fetch(&l1->gens[slot], 1, __ATOMIC_RELEASE);
+}
+
+/** Map the generations shared by the processes of the cache in `path`. */
+static uint32_t *gens_map(const char *path)
+{
+	const size_t len = L1_GENS * sizeof(uint32_t);
+	auto_free char *fname = path ? kr_strcatdup(2, path, L1_GENS_FILE) : NULL;
+	int fd = fname ? open(fname, O_RDWR | O_CREAT | O_CLOEXEC, L1_GENS_MODE) : -1;
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	void *gens = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && ((size_t)st.st_size >= len || ftruncate(fd, len) == 0)) {
+		gens = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	return gens != MAP_FAILED ? gens : NULL;
+}
+
+int l1_create(struct kr_cache *cache, uint32_t max_slots, const char *path)
+{
+	struct kr_cache_l1 *l1 = calloc(1, sizeof(*l1));
+	if (!l1) {
+		return kr_error(ENOMEM);
+	}
+	lru_create_hash(&l1->lru, max_slots, NULL, NULL, LRU_HASH_SIPHASH);
+	l1->gens = gens_map(path);
+	l1->gens_shared = (l1->gens != NULL);
+	if (!l1->gens) {
+		l1->gens = calloc(L1_GENS, sizeof(uint32_t));
+	}
+	if (!l1->lru || !l1->gens) {
+		cache->l1 = l1;
+		l1_free(cache);
+		return kr_error(ENOMEM);
+	}
+	cache->l1 = l1;
+	/* Upper bound when full; the keys (i.e. names) come on top of it. */
+	cache->l1_stats.size = (uint64_t)lru_capacity(l1->lru) * sizeof(struct l1_entry);
+	return kr_ok();
+}
+
+void l1_free(struct kr_cache *cache)
+{
+	struct kr_cache_l1 *l1 = cache->l1;
+	if (l1) {
+		lru_free(l1->lru);
+		if (l1->gens_shared) {
+			munmap(l1->gens, L1_GENS * sizeof(uint32_t));
+		} else {
+			free(l1->gens);
+		}
+		free(l1);
+		cache->l1 = NULL;
+	}
+	cache->l1_stats.size = 0;
+}
+
+void l1_clear(struct kr_cache *cache)
+{
+	struct kr_cache_l1 *l1 = cache->l1;
+	if (!l1) {
+		return;
+	}
+	for (uint32_t slot = 0; slot < L1_GENS; ++slot) {
+		gen_bump(l1, slot);
+	}
+}
+
+int l1_peek(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t *val)
+{
+	struct kr_cache_l1 *l1 = cache->l1;
+	if (!l1) {
+		return kr_error(ENOENT);
+	}
+	const uint32_t slot = gen_slot(key);
+	const uint32_t gen = gen_get(l1, slot);
+	struct l1_entry *e = lru_get_try(l1->lru, key.data, key.len);
+	if (!e || !e->len || e->gen != gen) {
+		cache->l1_stats.miss += 1;
+		l1->miss_slot = slot;
+		l1->miss_gen = gen;
+		return kr_error(ENOENT);
+	}
+	cache->l1_stats.hit += 1;
+	val->data = e->data;
+	val->len = e->len;
+	return kr_ok();
+}
+
+void l1_store(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t val)
+{
+	struct kr_cache_l1 *l1 = cache->l1;
+	if (!l1 || val.len > L1_ENTRY_MAXLEN) {
+		return;
+	}
+	/* The generation from before the read, if it's of the last miss; a write
+	 * of another process meanwhile then leaves the copy invalid at once. */
+	const uint32_t slot = gen_slot(key);
+	const uint32_t gen = slot == l1->miss_slot ? l1->miss_gen : gen_get(l1, slot);
+	struct l1_entry *e = lru_get_new(l1->lru, key.data, key.len, NULL);
+	if (e) {
+		memcpy(e->data, val.data, val.len);
+		e->len = val.len;
+		e->gen = gen;
+	}
+}
+
+void l1_drop(struct kr_cache *cache, knot_db_val_t key)
+{
+	struct kr_cache_l1 *l1 = cache->l1;
+	if (!l1) {
+		return;
+	}
+	gen_bump(l1, gen_slot(key));
+	struct l1_entry *e = lru_get_try(l1->lru, key.data, key.len);
+	if (e) {
+		e->len = 0;
+	}
+}
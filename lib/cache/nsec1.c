@@ -162,7 +162,7 @@ static const char * find_leq_NSEC1(struct kr_cache *cache, const struct kr_query
 	}
 	knot_db_val_t key_nsec = key;
 	knot_db_val_t val = { NULL, 0 };
-	int ret = cache_op(cache, read_leq, &key_nsec, &val);
+	int ret = cache_read_leq(cache, &key_nsec, &val);
 	if (ret < 0) {
 		if (ret == kr_error(ENOENT)) {
 			return "range search miss";
@@ -196,6 +196,7 @@ static const char * find_leq_NSEC1(struct kr_cache *cache, const struct kr_query
 	if (new_ttl) {
 		*new_ttl = new_ttl_;
 	}
+	entry_count_use(key_nsec);
 	if (kwz_low) {
 		*kwz_low = (knot_db_val_t){
 			.data = key_nsec.data + nwz_off,
@@ -0,0 +1,479 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Implementation of NSEC3 handling.  Prototypes in ./impl.h
+ *
+ * The records are stored under their binary hash, so the predecessor search
+ * works just like for NSEC (1), only the searched names are hashed first.
+ * The parameters of the chain (algorithm, iterations, salt) are read
+ * from the records themselves; the zone's chain is found by searching
+ * past the end of its NSEC3 keys.
+ */
+
+#include <libknot/rrtype/nsec3.h>
+
+#include "contrib/base32hex.h"
+#include "contrib/murmurhash3/murmurhash3.h"
+#include "lib/cache/impl.h"
+#include "lib/dnssec/nsec.h"
+#include "lib/dnssec/nsec3.h"
+#include "lib/layer/iterate.h"
+
+/** Length of the base32hex-encoded hash, i.e. of the first label of NSEC3 owners. */
+#define NSEC3_HASH_TXTLEN 32
+/** The only flag defined by RFC 5155 3.1.2. */
+#define NSEC3_OPT_OUT 0x01
+
+/** Parameters of an NSEC3 chain, as found in cache. */
+struct nsec3_chain {
+	dnssec_nsec3_params_t params; /**< .salt points into salt_buf */
+	uint8_t salt_buf[UINT8_MAX];
+	uint8_t p_key[NSEC3_P_LEN];
+};
+
+/** Find the first RDATA of an NSEC3 entry and check it's usable (SHA-1, known flags).
+ * \return pointer to the RDATA within val or NULL. */
+static const uint8_t * nsec3_rdata(knot_db_val_t val)
+{
+	const struct entry_h *eh = entry_h_consistent(val, KNOT_RRTYPE_NSEC3);
+	if (!eh || eh->is_packet || eh->has_ns || eh->has_cname || eh->has_dname
+	    || eh->has_optout) {
+		return NULL;
+	}
+	const uint8_t *d = eh->data, *data_bound = (const uint8_t *)val.data + val.len;
+	uint16_t rr_count, rdlen;
+	if (d + KR_CACHE_RR_COUNT_SIZE + sizeof(rdlen) > data_bound) {
+		return NULL;
+	}
+	memcpy(&rr_count, d, sizeof(rr_count));
+	memcpy(&rdlen, d + KR_CACHE_RR_COUNT_SIZE, sizeof(rdlen));
+	const uint8_t *rdata = d + KR_CACHE_RR_COUNT_SIZE + sizeof(rdlen);
+	/* RFC 5155 3.2: Alg, Flags, Iterations (2), Salt Length, Salt, Hash Length, Hash, ... */
+	const bool ok = rr_count > 0 && rdlen >= 5 && rdata + rdlen <= data_bound
+		&& rdata[0] == 1 /* SHA-1 */ && !(rdata[1] & ~NSEC3_OPT_OUT)
+		&& rdlen >= 5 + rdata[4] + 1 + NSEC3_HASH_LEN
+		&& rdata[5 + rdata[4]] == NSEC3_HASH_LEN;
+	return ok ? rdata : NULL;
+}
+
+/** Compute the chain identifier from NSEC3 RDATA.
+ *
+ * It's a hash of the parameters, but not of the flags (opt-out differs among records).
+ * The highest bit is set, so that the NSEC3 keys sort after the exact keys
+ * of (LDH) names starting with the '3' character.
+ */
+static void nsec_p_key(uint8_t p_key[NSEC3_P_LEN], const uint8_t *rdata)
+{
+	const uint8_t salt_len = rdata[4];
+	char buf[4 + UINT8_MAX];
+	buf[0] = rdata[0];
+	memcpy(buf + 1, rdata + 2, 2 + 1 + salt_len); /* iterations, salt length, salt */
+	const uint32_t h = hash(buf, 4 + salt_len);
+	p_key[0] = (h >> 24) | 0x80;
+	p_key[1] = h >> 16;
+	p_key[2] = h >> 8;
+	p_key[3] = h;
+}
+
+/** Construct a string key for NSEC3 predecessor-search.
+ * \param p_key chain identifier
+ * \param hash binary NSEC3 hash; NULL means past all hashes of the chain */
+static knot_db_val_t key_NSEC3(struct key *k, const knot_dname_t *zname,
+				const uint8_t p_key[NSEC3_P_LEN], const uint8_t *hash)
+{
+	int ret = kr_dname_lf(k->buf, zname, false);
+	if (ret || k->buf[0] != k->zlf_len) {
+		assert(false);
+		return (knot_db_val_t){ NULL, 0 };
+	}
+	/* CACHE_KEY_DEF: key == zone's dname_lf + '\0' + '3' + chain identifier
+	 * + binary NSEC3 hash of the owner. */
+	uint8_t *begin = k->buf + 1 + k->zlf_len;
+	begin[0] = 0;
+	begin[1] = '3'; /* tag for NSEC3 */
+	memcpy(begin + 2, p_key, NSEC3_P_LEN);
+	if (hash) {
+		memcpy(begin + 2 + NSEC3_P_LEN, hash, NSEC3_HASH_LEN);
+	} else {
+		memset(begin + 2 + NSEC3_P_LEN, 0xff, NSEC3_HASH_LEN);
+	}
+	k->type = KNOT_RRTYPE_NSEC3;
+	return (knot_db_val_t){ k->buf + 1, k->zlf_len + 2 + NSEC3_P_LEN + NSEC3_HASH_LEN };
+}
+
+knot_db_val_t key_NSEC3_rr(struct key *k, const knot_rrset_t *rr, const knot_dname_t *zname)
+{
+	static const knot_db_val_t VAL_EMPTY = { NULL, 0 };
+	if (!k || !rr || !zname || !rr->rrs.rr_count || rr->owner[0] != NSEC3_HASH_TXTLEN
+	    || !knot_dname_is_equal(knot_wire_next_label(rr->owner, NULL), zname)) {
+		return VAL_EMPTY;
+	}
+	uint8_t hash[NSEC3_HASH_LEN];
+	if (base32hex_decode(rr->owner + 1, rr->owner[0], hash, sizeof(hash))
+	    != NSEC3_HASH_LEN) {
+		return VAL_EMPTY;
+	}
+	const knot_rdata_t *rd = knot_rdataset_at(&rr->rrs, 0);
+	const uint8_t *rdata = knot_rdata_data(rd);
+	const uint16_t rdlen = knot_rdata_rdlen(rd);
+	const bool ok = rdlen >= 5 && rdata[0] == 1 /* SHA-1 */
+		&& !(rdata[1] & ~NSEC3_OPT_OUT)
+		&& rdlen >= 5 + rdata[4] + 1 + NSEC3_HASH_LEN
+		&& rdata[5 + rdata[4]] == NSEC3_HASH_LEN;
+	if (!ok) {
+		return VAL_EMPTY;
+	}
+	uint8_t p_key[NSEC3_P_LEN];
+	nsec_p_key(p_key, rdata);
+	k->zlf_len = knot_dname_size(zname) - 1;
+	return key_NSEC3(k, zname, p_key, hash);
+}
+
+/** Find the parameters of the zone's NSEC3 chain (any record of it will do).
+ * \note The TTL isn't checked here; it is for each record when using it.
+ * \return Error message or NULL. */
+static const char * nsec3_chain_find(struct kr_cache *cache, struct key *k,
+				     struct nsec3_chain *chain)
+{
+	static const uint8_t P_KEY_LAST[NSEC3_P_LEN] = { 0xff, 0xff, 0xff, 0xff };
+	const knot_db_val_t key = key_NSEC3(k, k->zname, P_KEY_LAST, NULL);
+	if (!key.data) {
+		return "ERROR";
+	}
+	knot_db_val_t key_found = key;
+	knot_db_val_t val = { NULL, 0 };
+	int ret = cache_read_leq(cache, &key_found, &val);
+	if (ret < 0) {
+		return ret == kr_error(ENOENT) ? "no chain" : "chain search ERROR";
+	}
+	/* CACHE_KEY_DEF */
+	const size_t p_off = k->zlf_len + 2;
+	const uint8_t *kf = key_found.data;
+	if (key_found.len != key.len || memcmp(kf, key.data, p_off) != 0
+	    || !(kf[p_off] & 0x80)) {
+		return "no chain";
+	}
+	const uint8_t *rdata = nsec3_rdata(val);
+	if (!rdata) {
+		return "chain search found inconsistent entry";
+	}
+	nsec_p_key(chain->p_key, rdata);
+	if (memcmp(chain->p_key, kf + p_off, NSEC3_P_LEN) != 0) {
+		return "chain search found inconsistent entry";
+	}
+	/* The value is in the backend's memory, so copy what we need. */
+	chain->params.algorithm = rdata[0];
+	chain->params.flags = 0;
+	chain->params.iterations = ((uint16_t)rdata[2] << 8) | rdata[3];
+	chain->params.salt.size = rdata[4];
+	chain->params.salt.data = chain->salt_buf;
+	memcpy(chain->salt_buf, rdata + 5, rdata[4]);
+	if (chain->params.iterations > KR_NSEC3_MAX_ITERATIONS) {
+		return "chain has too many iterations";
+	}
+	return NULL;
+}
+
+/** Reconstruct the owner of an NSEC3 record (assuming buffer of KNOT_DNAME_MAXLEN). */
+static int nsec3_owner(knot_dname_t *buf, const uint8_t hash[NSEC3_HASH_LEN],
+			const knot_dname_t *zname)
+{
+	buf[0] = NSEC3_HASH_TXTLEN;
+	if (base32hex_encode(hash, NSEC3_HASH_LEN, buf + 1, NSEC3_HASH_TXTLEN)
+	    != NSEC3_HASH_TXTLEN) {
+		assert(false);
+		return kr_error(EINVAL);
+	}
+	int ret = knot_dname_to_wire(buf + 1 + NSEC3_HASH_TXTLEN, zname,
+				     KNOT_DNAME_MAXLEN - 1 - NSEC3_HASH_TXTLEN);
+	if (ret < 0) {
+		return kr_error(ENAMETOOLONG);
+	}
+	ret = knot_dname_to_lower(buf);
+	return ret ? kr_error(ret) : kr_ok();
+}
+
+/** NSEC3 range search for the hash of a name.
+ *
+ * \param value[out] The raw data of the NSEC3 cache record (consistency checked).
+ * \param exact_match[out] Whether the hash was matched exactly or just covered.
+ * \param hash_low[out] The hash of the record's owner.
+ * \param new_ttl[out] New TTL of the NSEC3.
+ * \return Error message or NULL.
+ * \note The function itself does *no* bitmap checks.
+ */
+static const char * find_leq_NSEC3(struct kr_cache *cache, const struct kr_query *qry,
+			struct key *k, const struct nsec3_chain *chain,
+			const knot_dname_t *name, knot_db_val_t *value, bool *exact_match,
+			uint8_t hash_low[NSEC3_HASH_LEN], uint32_t *new_ttl)
+{
+	/* Hash the name and do the cache operation. */
+	uint8_t target[NSEC3_HASH_LEN];
+	dnssec_binary_t name_hash = { 0, NULL };
+	int ret = kr_nsec3_hash_name(&name_hash, &chain->params, name);
+	const bool hash_ok = !ret && name_hash.size == NSEC3_HASH_LEN;
+	if (hash_ok) {
+		memcpy(target, name_hash.data, NSEC3_HASH_LEN);
+	}
+	dnssec_binary_free(&name_hash);
+	if (!hash_ok) {
+		return "hashing ERROR";
+	}
+	const knot_db_val_t key = key_NSEC3(k, k->zname, chain->p_key, target);
+	if (!key.data) {
+		return "ERROR";
+	}
+	knot_db_val_t key_found = key;
+	knot_db_val_t val = { NULL, 0 };
+	ret = cache_read_leq(cache, &key_found, &val);
+	if (ret < 0) {
+		if (ret == kr_error(ENOENT)) {
+			return "range search miss";
+		} else {
+			assert(false);
+			return "range search ERROR";
+		}
+	}
+	/* Check that it's in the same chain.  If not, the hash is before
+	 * the first one and the covering NSEC3 would be the last; we don't search that. */
+	const size_t hash_off = key.len - NSEC3_HASH_LEN;
+	if (key_found.len != key.len || memcmp(key_found.data, key.data, hash_off) != 0) {
+		return "range search miss (!in_chain)";
+	}
+	/* Check consistency, TTL, rank. */
+	const uint8_t *rdata = nsec3_rdata(val);
+	if (!rdata) {
+		return "range search found inconsistent entry";
+	}
+	const struct entry_h *eh = val.data;
+	memcpy(hash_low, (const uint8_t *)key_found.data + hash_off, NSEC3_HASH_LEN);
+	/* The owner is only needed for serving stale, so it's rebuilt just then. */
+	int32_t new_ttl_ = get_new_ttl(eh, qry, NULL, KNOT_RRTYPE_NSEC3, qry->timestamp.tv_sec);
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	if (new_ttl_ < 0 && qry->stale_cb && nsec3_owner(owner, hash_low, k->zname) == 0) {
+		new_ttl_ = get_new_ttl(eh, qry, owner, KNOT_RRTYPE_NSEC3, qry->timestamp.tv_sec);
+	}
+	if (new_ttl_ < 0 || !kr_rank_test(eh->rank, KR_RANK_SECURE)) {
+		return "range search found stale or insecure entry";
+	}
+	const bool is_exact = (ret == 0);
+	if (!is_exact) {
+		/* It starts before the hash, so check the other end.
+		 * The last NSEC3 of the chain wraps around to the first hash. */
+		const uint8_t *next = rdata + 5 + rdata[4] + 1;
+		const bool covers = memcmp(next, hash_low, NSEC3_HASH_LEN) <= 0
+				|| memcmp(target, next, NSEC3_HASH_LEN) < 0;
+		if (!covers) {
+			return "range search miss (!covers)";
+		}
+	}
+	entry_count_use(key_found);
+	*value = val;
+	*exact_match = is_exact;
+	*new_ttl = new_ttl_;
+	return NULL;
+}
+
+/** Return the NSEC3 with the given owner if it's in the answer already. */
+static const knot_rrset_t * answer_nsec3(const struct answer *ans, const knot_dname_t *owner)
+{
+	static const int ids[] = { AR_NSEC, AR_CPE, AR_WILD };
+	for (int i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+		const knot_rrset_t *rr = ans->rrsets[ids[i]].set.rr;
+		if (rr && knot_dname_is_equal(rr->owner, owner)) {
+			return rr;
+		}
+	}
+	return NULL;
+}
+
+/** Materialize the NSEC3 found by find_leq_NSEC3() into ans->rrsets[id],
+ * unless the same record is in the answer already.
+ * \param rr[out] the record in the answer
+ * \return error code */
+static int nsec3_answer(struct answer *ans, int id, const struct key *k,
+			knot_db_val_t val, const uint8_t hash[NSEC3_HASH_LEN], uint32_t new_ttl,
+			const knot_rrset_t **rr)
+{
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	int ret = nsec3_owner(owner, hash, k->zname);
+	if (ret) return ret;
+	*rr = answer_nsec3(ans, owner);
+	if (*rr) return kr_ok();
+	ret = entry2answer(ans, id, val.data, val.data + val.len,
+			   owner, KNOT_RRTYPE_NSEC3, new_ttl);
+	*rr = ans->rrsets[id].set.rr;
+	return ret;
+}
+
+int nsec3_encloser(struct key *k, struct answer *ans,
+		   const int sname_labels, int *clencl_labels,
+		   const struct kr_query *qry, struct kr_cache *cache)
+{
+	static const int ESKIP = ABS(ENOENT);
+	/* Basic sanity check. */
+	const bool ok = k && k->zname && ans && clencl_labels && qry && cache;
+	if (!ok) {
+		assert(!EINVAL);
+		return kr_error(EINVAL);
+	}
+	struct nsec3_chain chain;
+	const char *err = nsec3_chain_find(cache, k, &chain);
+	if (err) {
+		VERBOSE_MSG(qry, "=> NSEC3 chain: %s\n", err);
+		return ESKIP;
+	}
+
+	/* Walk from sname up, until a hash is matched.  The names on the way
+	 * have to be covered; the last covered one is the next closer name. */
+	const int zname_labels = knot_dname_labels(k->zname, NULL);
+	const knot_dname_t *name = qry->sname;
+	for (int name_labels = sname_labels; name_labels >= zname_labels;
+	     --name_labels, name = knot_wire_next_label(name, NULL)) {
+		knot_db_val_t val = { NULL, 0 };
+		bool exact_match;
+		uint8_t hash_low[NSEC3_HASH_LEN];
+		uint32_t new_ttl;
+		err = find_leq_NSEC3(cache, qry, k, &chain, name, &val,
+				     &exact_match, hash_low, &new_ttl);
+		if (err) {
+			VERBOSE_MSG(qry, "=> NSEC3 encloser: %s\n", err);
+			return ESKIP;
+		}
+		if (!exact_match) {
+			/* Only the proof for the shortest covered name is needed. */
+			answer_rrset_clear(ans, AR_NSEC);
+			const knot_rrset_t *cover;
+			int ret = nsec3_answer(ans, AR_NSEC, k, val, hash_low, new_ttl, &cover);
+			if (ret) return kr_error(ret);
+			continue;
+		}
+
+		const bool is_sname = name_labels == sname_labels;
+		const knot_rrset_t *nsec3_rr;
+		int ret = nsec3_answer(ans, is_sname ? AR_NSEC : AR_CPE, k, val,
+					hash_low, new_ttl, &nsec3_rr);
+		if (ret) return kr_error(ret);
+		uint8_t *bm = NULL;
+		uint16_t bm_size = 0;
+		knot_nsec3_bitmap(&nsec3_rr->rrs, 0, &bm, &bm_size);
+
+		if (is_sname) {
+			/* The owner is only used for checks around DS. */
+			if (kr_nsec_bitmap_nodata_check(bm, bm_size, qry->stype, qry->sname) != 0) {
+				VERBOSE_MSG(qry,
+					"=> NSEC3 sname: match but failed type check\n");
+				return ESKIP;
+			}
+			/* NODATA proven; just need to add SOA+RRSIG later */
+			VERBOSE_MSG(qry, "=> NSEC3 sname: match proved NODATA, new TTL %d\n",
+					new_ttl);
+			ans->rcode = PKT_NODATA;
+			*clencl_labels = sname_labels;
+			return kr_ok();
+		}
+
+		/* The closest encloser; sname must not be below a cut or DNAME. */
+		if (!bm || kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_DNAME)
+		    || (kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_NS)
+			&& !kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_SOA))) {
+			VERBOSE_MSG(qry, "=> NSEC3 encloser: delegated or DNAME (or error)\n");
+			return ESKIP;
+		}
+		/* With opt-out an insecure delegation may exist in the covered range. */
+		const knot_rrset_t *cover = ans->rrsets[AR_NSEC].set.rr;
+		if (!cover) {
+			assert(false);
+			return ESKIP;
+		}
+		if (knot_nsec3_flags(&cover->rrs, 0) & NSEC3_OPT_OUT) {
+			VERBOSE_MSG(qry, "=> NSEC3 sname: covered but opt-out\n");
+			return ESKIP;
+		}
+		/* NXDOMAIN proven *except* for wildcards. */
+		WITH_VERBOSE(qry) {
+			auto_free char *clencl_str = kr_dname_text(name);
+			VERBOSE_MSG(qry, "=> NSEC3 sname: covered, closest encloser %s, new TTL %d\n",
+					clencl_str, new_ttl);
+		}
+		ans->rcode = PKT_NXDOMAIN;
+		*clencl_labels = name_labels;
+		return kr_ok();
+	}
+	VERBOSE_MSG(qry, "=> NSEC3 encloser: no match up to the zone apex\n");
+	return ESKIP;
+}
+
+int nsec3_src_synth(struct key *k, struct answer *ans, const knot_dname_t *clencl_name,
+		    const struct kr_query *qry, struct kr_cache *cache)
+{
+	/* LATER(optim.): the chain was found by nsec3_encloser() already. */
+	struct nsec3_chain chain;
+	const char *err = nsec3_chain_find(cache, k, &chain);
+	if (err) {
+		assert(false);
+		return kr_error(EINVAL);
+	}
+	/* Construct the source of synthesis. */
+	knot_dname_t ss[KNOT_DNAME_MAXLEN];
+	ss[0] = 1;
+	ss[1] = '*';
+	if (knot_dname_to_wire(ss + 2, clencl_name, sizeof(ss) - 2) < 0) {
+		VERBOSE_MSG(qry, "=> NSEC3 wildcard: name too long\n");
+		return kr_ok();
+	}
+
+	knot_db_val_t val = { NULL, 0 };
+	bool exact_match;
+	uint8_t hash_low[NSEC3_HASH_LEN];
+	uint32_t new_ttl;
+	err = find_leq_NSEC3(cache, qry, k, &chain, ss, &val,
+			     &exact_match, hash_low, &new_ttl);
+	if (err) {
+		VERBOSE_MSG(qry, "=> NSEC3 wildcard: %s\n", err);
+		return kr_ok();
+	}
+	/* The same NSEC3 may be in the answer already, e.g. covering the next closer name. */
+	const knot_rrset_t *nsec3_rr;
+	int ret = nsec3_answer(ans, AR_WILD, k, val, hash_low, new_ttl, &nsec3_rr);
+	if (ret) return kr_error(ret);
+
+	if (!exact_match) {
+		/* We have a record proving wildcard non-existence. */
+		VERBOSE_MSG(qry, "=> NSEC3 wildcard: covered, new TTL %d\n", new_ttl);
+		return AR_SOA;
+	}
+
+	/* The wildcard exists.  Find if it's NODATA - check type bitmap. */
+	uint8_t *bm = NULL;
+	uint16_t bm_size = 0;
+	knot_nsec3_bitmap(&nsec3_rr->rrs, 0, &bm, &bm_size);
+	if (kr_nsec_bitmap_nodata_check(bm, bm_size, qry->stype, ss) == 0) {
+		/* NODATA proven; just need to add SOA+RRSIG later */
+		VERBOSE_MSG(qry, "=> NSEC3 wildcard: match proved NODATA, new TTL %d\n",
+				new_ttl);
+		ans->rcode = PKT_NODATA;
+		return AR_SOA;
+	}
+	/* The data probably exists -> (later) try to find the real wildcard data.
+	 * Only the next closer name's proof is needed with it (RFC 5155 7.2.6). */
+	VERBOSE_MSG(qry, "=> NSEC3 wildcard: should exist (or error)\n");
+	answer_rrset_clear(ans, AR_WILD);
+	answer_rrset_clear(ans, AR_CPE);
+	ans->rcode = PKT_NOERROR;
+	return kr_ok();
+}
@@ -0,0 +1,208 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Shared remote tier behind the storage, e.g. redis behind LMDB.  Prototypes in ./impl.h
+ *
+ * Read-through: an exact lookup that misses in the storage is tried remotely,
+ * and the entry found is written into the storage on the next sync.
+ * Write-behind: the keys written into the storage are noted and, on the next
+ * sync, read back and handed to the remote backend, which sends them
+ * without waiting (see modules/redis and modules/memcached).
+ *
+ * Both queues are bounded; what doesn't fit is dropped and counted, it's a cache.
+ * The entries are the same bytes in both tiers, so all the usual TTL and rank
+ * checks apply to them unchanged.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/cache/impl.h"
+#include "lib/generic/array.h"
+
+/** Entries queued for either direction between two syncs. */
+#define REMOTE_MAXPENDING 256
+
+/** @internal Key, and for promotions the value, in a single allocation. */
+struct remote_item {
+	knot_db_val_t key;
+	knot_db_val_t val;
+};
+typedef array_t(struct remote_item) remote_queue_t;
+
+struct kr_cache_remote {
+	const struct kr_cdb_api *api;
+	knot_db_t *db;
+	remote_queue_t promote;   /**< Found remotely, to write into the storage */
+	remote_queue_t replicate; /**< Written into the storage, to send remotely */
+};
+
+static int queue_push(remote_queue_t *q, knot_db_val_t key, knot_db_val_t val)
+{
+	if (q->len >= REMOTE_MAXPENDING) {
+		return kr_error(ENOSPC);
+	}
+	uint8_t *buf = malloc(key.len + val.len);
+	if (!buf) {
+		return kr_error(ENOMEM);
+	}
+	struct remote_item item = {
+		.key = { .data = buf, .len = key.len },
+		.val = { .data = buf + key.len, .len = val.len },
+	};
+	memcpy(item.key.data, key.data, key.len);
+	if (val.len) {
+		memcpy(item.val.data, val.data, val.len);
+	}
+	if (array_push(*q, item) < 0) {
+		free(buf);
+		return kr_error(ENOMEM);
+	}
+	return kr_ok();
+}
+
+static void queue_drop(remote_queue_t *q)
+{
+	for (unsigned i = 0; i < q->len; ++i) {
+		free(q->at[i].key.data);
+	}
+	q->len = 0;
+}
+
+int kr_cache_remote_open(struct kr_cache *cache, const struct kr_cdb_api *api,
+			 struct kr_cdb_opts *opts, knot_mm_t *mm)
+{
+	if (!cache || !api) {
+		return kr_error(EINVAL);
+	}
+	struct kr_cache_remote *remote = calloc(1, sizeof(*remote));
+	if (!remote) {
+		return kr_error(ENOMEM);
+	}
+	int ret = api->open(&remote->db, opts, mm);
+	if (ret != 0) {
+		free(remote);
+		return ret;
+	}
+	remote->api = api;
+	kr_cache_remote_close(cache);
+	cache->remote = remote;
+	memset(&cache->remote_stats, 0, sizeof(cache->remote_stats));
+	return kr_ok();
+}
+
+void kr_cache_remote_close(struct kr_cache *cache)
+{
+	struct kr_cache_remote *remote = cache ? cache->remote : NULL;
+	if (!remote) {
+		return;
+	}
+	queue_drop(&remote->promote);
+	array_clear(remote->promote);
+	queue_drop(&remote->replicate);
+	array_clear(remote->replicate);
+	remote->api->close(remote->db);
+	free(remote);
+	cache->remote = NULL;
+}
+
+const struct kr_cdb_api *kr_cache_remote_api(const struct kr_cache *cache)
+{
+	return (cache && cache->remote) ? cache->remote->api : NULL;
+}
+
+int remote_peek(struct kr_cache *cache, knot_db_val_t key, knot_db_val_t *val)
+{
+	struct kr_cache_remote *remote = cache->remote;
+	if (!remote) {
+		return kr_error(ENOENT);
+	}
+	if (remote->api->read(remote->db, &key, val, 1) != 0 || !val->data || !val->len
+	    || flush_hides(cache, key, *val)) {
+		cache->remote_stats.miss += 1;
+		return kr_error(ENOENT);
+	}
+	cache->remote_stats.hit += 1;
+	if (queue_push(&remote->promote, key, *val) != 0) {
+		cache->remote_stats.dropped += 1;
+	}
+	return kr_ok();
+}
+
+void remote_note_write(struct kr_cache *cache, knot_db_val_t key)
+{
+	struct kr_cache_remote *remote = cache->remote;
+	if (!remote) {
+		return;
+	}
+	/* The value isn't filled in yet, it's read back on sync. */
+	const knot_db_val_t no_val = { NULL, 0 };
+	if (queue_push(&remote->replicate, key, no_val) != 0) {
+		cache->remote_stats.dropped += 1;
+	}
+}
+
+void remote_sync(struct kr_cache *cache)
+{
+	struct kr_cache_remote *remote = cache->remote;
+	if (!remote) {
+		return;
+	}
+	/* Replicate first, so that the promotions below aren't sent back. */
+	for (unsigned i = 0; i < remote->replicate.len; ++i) {
+		knot_db_val_t key = remote->replicate.at[i].key;
+		knot_db_val_t val = { NULL, 0 };
+		if (cache_op(cache, read, &key, &val, 1) != 0
+		    || remote->api->write(remote->db, &key, &val, 1) != 0) {
+			cache->remote_stats.dropped += 1;
+			continue;
+		}
+		cache->remote_stats.replicated += 1;
+	}
+	queue_drop(&remote->replicate);
+	for (unsigned i = 0; i < remote->promote.len; ++i) {
+		const struct remote_item *item = &remote->promote.at[i];
+		knot_db_val_t key = item->key;
+		knot_db_val_t val = { NULL, item->val.len };
+		l1_drop(cache, key);
+		if (cache_op(cache, write, &key, &val, 1) != 0 || !val.data) {
+			cache->remote_stats.dropped += 1;
+			continue;
+		}
+		memcpy(val.data, item->val.data, item->val.len);
+		cache->remote_stats.promoted += 1;
+	}
+	if (remote->promote.len) {
+		/* An NS entry may have appeared, see kr_zonecut_find_cached(). */
+		cache->ns_gen += 1;
+	}
+	queue_drop(&remote->promote);
+	/* The values read remotely are released, the writes are sent. */
+	if (remote->api->sync) {
+		(void) remote->api->sync(remote->db);
+	}
+}
+
+void remote_clear(struct kr_cache *cache)
+{
+	struct kr_cache_remote *remote = cache->remote;
+	if (remote) {
+		/* The remote data stay, they're shared with the other resolvers. */
+		queue_drop(&remote->promote);
+		queue_drop(&remote->replicate);
+	}
+}
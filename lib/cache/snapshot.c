@@ -0,0 +1,380 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Snapshots of the hottest cache entries and of the upstream RTTs, for warm starts.
+ *
+ * The file is for the same build on the same machine, so it's in the native byte order:
+ *  - header: "KRsn", u16 format version, u16 version of the cache entries
+ *  - RTTs: { u8 address length, address, u32 score, srtt, rttvar }..., u8 0
+ *  - entries: { u16 key length, u32 value length, key, value }..., u16 0
+ *
+ * The hottest entries are chosen by the lookup sketch, in buckets of powers of two:
+ * the first walk counts the entries per bucket, the second writes those from the
+ * top buckets, as many of the lowest bucket needed as fit.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "contrib/cleanup.h"
+#include "lib/cache/impl.h"
+#include "lib/nsrep.h"
+#include "lib/resolve.h"
+
+#define SNAPSHOT_MAGIC "KRsn"
+#define SNAPSHOT_VERSION 1
+/** Sanity limit on the length of an entry. */
+#define SNAPSHOT_VAL_MAXLEN (1 << 20)
+/** Bucket 0 for no lookups, then floor(log2(lookups)) + 1. */
+#define SNAPSHOT_BUCKETS 33
+
+struct kr_cache_snapshot {
+	struct kr_cache *cache;
+	FILE *file;
+	char *path;
+	char *tmp_path;          /**< Written first, then renamed to path */
+	uint32_t now;            /**< Wall-clock, like entry_h::time */
+	uint32_t max_entries;
+	uint32_t written;
+	bool writing;            /**< The second walk */
+	int err;
+	uint32_t hist[SNAPSHOT_BUCKETS];
+	unsigned threshold;      /**< Lowest bucket written */
+	uint32_t threshold_left; /**< Entries still fitting from that bucket */
+	uint8_t next[KR_CACHE_GC_KEY_MAXLEN]; /**< Key to continue the walk from */
+	uint16_t next_len;
+};
+
+static unsigned bucket_of(unsigned lookups)
+{
+	return lookups ? 32 - __builtin_clz(lookups) : 0;
+}
+
+static int write_data(FILE *file, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, file) == len ? kr_ok() : kr_error(EIO);
+}
+
+static int read_data(FILE *file, void *data, size_t len)
+{
+	return fread(data, 1, len, file) == len ? kr_ok() : kr_error(EIO);
+}
+
+static void snapshot_free(struct kr_cache_snapshot *snap)
+{
+	if (snap->file) {
+		fclose(snap->file);
+		unlink(snap->tmp_path);
+	}
+	free(snap->path);
+	free(snap->tmp_path);
+	free(snap);
+}
+
+static enum lru_apply_do rtt_dump(const char *key, uint len,
+				  kr_nsrep_rtt_lru_entry_t *val, void *baton)
+{
+	struct kr_cache_snapshot *snap = baton;
+	/* Time-outs are only remembered for a while; start afresh with those. */
+	if (snap->err || len > UINT8_MAX || val->score >= KR_NS_TIMEOUT) {
+		return LRU_APPLY_DO_NOTHING;
+	}
+	const uint8_t key_len = len;
+	const uint32_t rtt[3] = { val->score, val->srtt, val->rttvar };
+	snap->err = write_data(snap->file, &key_len, sizeof(key_len));
+	if (!snap->err) snap->err = write_data(snap->file, key, len);
+	if (!snap->err) snap->err = write_data(snap->file, rtt, sizeof(rtt));
+	return LRU_APPLY_DO_NOTHING;
+}
+
+struct kr_cache_snapshot *kr_cache_snapshot_begin(struct kr_context *ctx, const char *path,
+						  uint32_t max_entries)
+{
+	if (!ctx || !path || !kr_cache_is_open(&ctx->cache)) {
+		return NULL;
+	}
+	struct kr_cache_snapshot *snap = calloc(1, sizeof(*snap));
+	if (!snap) {
+		return NULL;
+	}
+	snap->cache = &ctx->cache;
+	snap->now = kr_time();
+	snap->max_entries = max_entries;
+	snap->path = strdup(path);
+	snap->tmp_path = kr_strcatdup(2, path, ".tmp");
+	if (!snap->path || !snap->tmp_path) {
+		snapshot_free(snap);
+		return NULL;
+	}
+	snap->file = fopen(snap->tmp_path, "w");
+	if (!snap->file) {
+		snapshot_free(snap);
+		return NULL;
+	}
+	const uint16_t versions[2] = { SNAPSHOT_VERSION, cache_version() };
+	snap->err = write_data(snap->file, SNAPSHOT_MAGIC, 4);
+	if (!snap->err) snap->err = write_data(snap->file, versions, sizeof(versions));
+	if (!snap->err && ctx->cache_rtt) {
+		lru_apply(ctx->cache_rtt, rtt_dump, snap);
+	}
+	const uint8_t rtt_end = 0;
+	if (!snap->err) snap->err = write_data(snap->file, &rtt_end, sizeof(rtt_end));
+	if (snap->err) {
+		snapshot_free(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+/** @internal Decide about an entry, see kr_cdb_visit_f; only reads. */
+static int snapshot_visit(const knot_db_val_t *key, const knot_db_val_t *val, void *baton)
+{
+	struct kr_cache_snapshot *snap = baton;
+	/* The version key: "\0\0V\0"; CACHE_KEY_DEF */
+	if (key->len == 4 && memcmp(key->data, "\x00\x00V", 3) == 0) {
+		return 0;
+	}
+	if (key->len > KR_CACHE_GC_KEY_MAXLEN || val->len < sizeof(struct entry_h)
+	    || val->len > SNAPSHOT_VAL_MAXLEN) {
+		return 0;
+	}
+	/* The first entry decides for NS chains, too. */
+	const struct entry_h *eh = val->data;
+	if ((int64_t)snap->now > (int64_t)eh->time + eh->ttl) {
+		return 0; /* expired */
+	}
+	const unsigned b = bucket_of(entry_lookups(*key));
+	if (!snap->writing) {
+		snap->hist[b] += 1;
+		return 0;
+	}
+	if (b < snap->threshold || (b == snap->threshold && snap->threshold_left == 0)) {
+		return 0;
+	}
+	if (b == snap->threshold) {
+		snap->threshold_left -= 1;
+	}
+	const uint16_t key_len = key->len;
+	const uint32_t val_len = val->len;
+	snap->err = write_data(snap->file, &key_len, sizeof(key_len));
+	if (!snap->err) snap->err = write_data(snap->file, &val_len, sizeof(val_len));
+	if (!snap->err) snap->err = write_data(snap->file, key->data, key->len);
+	if (!snap->err) snap->err = write_data(snap->file, val->data, val->len);
+	if (snap->err) {
+		return -1;
+	}
+	snap->written += 1;
+	return snap->written < snap->max_entries ? 0 : -1;
+}
+
+/** @internal Choose the buckets to write from the first walk. */
+static void snapshot_threshold(struct kr_cache_snapshot *snap)
+{
+	uint32_t above = 0;
+	for (int b = SNAPSHOT_BUCKETS - 1; b >= 0; --b) {
+		if (above + snap->hist[b] >= snap->max_entries) {
+			snap->threshold = b;
+			snap->threshold_left = snap->max_entries - above;
+			return;
+		}
+		above += snap->hist[b];
+	}
+	snap->threshold = 0;
+	snap->threshold_left = snap->hist[0];
+}
+
+/** @internal Terminate and rename the file. */
+static int snapshot_finish(struct kr_cache_snapshot *snap)
+{
+	const uint16_t end = 0;
+	int ret = write_data(snap->file, &end, sizeof(end));
+	if (fclose(snap->file) != 0 && !ret) {
+		ret = kr_error(EIO);
+	}
+	snap->file = NULL;
+	if (!ret && rename(snap->tmp_path, snap->path) != 0) {
+		ret = kr_error(errno);
+	}
+	if (ret) {
+		unlink(snap->tmp_path);
+	}
+	return ret;
+}
+
+int kr_cache_snapshot_step(struct kr_cache_snapshot *snap, int max_entries)
+{
+	if (!snap || max_entries <= 0) {
+		return kr_error(EINVAL);
+	}
+	struct kr_cache *cache = snap->cache;
+	if (!kr_cache_is_open(cache) || !cache->api->walk) {
+		snapshot_free(snap);
+		return kr_error(ENOSYS);
+	}
+	knot_db_val_t key = { snap->next, snap->next_len };
+	const bool full = snap->writing && snap->written >= snap->max_entries;
+	int ret = full ? 0 : cache_op(cache, walk, &key, max_entries, snapshot_visit, snap);
+	if (ret >= 0 && snap->err) {
+		ret = snap->err;
+	}
+	if (ret >= 0) {
+		/* Continue after an overlong key as if from the beginning; it's rare. */
+		snap->next_len = key.len <= sizeof(snap->next) ? key.len : 0;
+		if (snap->next_len) {
+			memcpy(snap->next, key.data, key.len);
+		}
+	}
+	/* Release the read transaction between the slices. */
+	kr_cache_sync(cache);
+	if (ret < 0) {
+		snapshot_free(snap);
+		return ret;
+	}
+	const bool walked = key.len == 0 || (snap->writing && snap->written >= snap->max_entries);
+	if (!walked) {
+		return 1;
+	}
+	if (!snap->writing) {
+		snapshot_threshold(snap);
+		snap->writing = true;
+		snap->next_len = 0;
+		return 1;
+	}
+	ret = snapshot_finish(snap);
+	snapshot_free(snap);
+	return ret;
+}
+
+void kr_cache_snapshot_abort(struct kr_cache_snapshot *snap)
+{
+	if (snap) {
+		snapshot_free(snap);
+	}
+}
+
+static int load_rtt(struct kr_context *ctx, FILE *file)
+{
+	char addr[UINT8_MAX];
+	for (;;) {
+		uint8_t len = 0;
+		uint32_t rtt[3];
+		int ret = read_data(file, &len, sizeof(len));
+		if (ret || len == 0) {
+			return ret;
+		}
+		ret = read_data(file, addr, len);
+		if (!ret) ret = read_data(file, rtt, sizeof(rtt));
+		if (ret) {
+			return ret;
+		}
+		bool is_new = false;
+		kr_nsrep_rtt_lru_entry_t *e = ctx->cache_rtt
+			? lru_get_new(ctx->cache_rtt, addr, len, &is_new) : NULL;
+		if (e && is_new) {
+			e->score = rtt[0];
+			e->srtt = rtt[1];
+			e->rttvar = rtt[2];
+			e->tout_timestamp = 0;
+			e->updated = kr_now();
+		}
+	}
+}
+
+static int load_entries(struct kr_cache *cache, FILE *file)
+{
+	uint8_t key_buf[KR_CACHE_GC_KEY_MAXLEN];
+	const uint32_t now = kr_time();
+	int loaded = 0;
+	for (;;) {
+		uint16_t key_len = 0;
+		uint32_t val_len = 0;
+		int ret = read_data(file, &key_len, sizeof(key_len));
+		if (ret || key_len == 0) {
+			return ret ? ret : loaded;
+		}
+		ret = read_data(file, &val_len, sizeof(val_len));
+		if (ret || key_len > sizeof(key_buf) || val_len < sizeof(struct entry_h)
+		    || val_len > SNAPSHOT_VAL_MAXLEN) {
+			return kr_error(EILSEQ);
+		}
+		ret = read_data(file, key_buf, key_len);
+		if (ret) {
+			return ret;
+		}
+		knot_db_val_t key = { key_buf, key_len };
+		knot_db_val_t val = { NULL, 0 };
+		/* Don't override what's been cached meanwhile. */
+		if (cache_op(cache, read, &key, &val, 1) == 0) {
+			if (fseek(file, val_len, SEEK_CUR) != 0) {
+				return kr_error(EIO);
+			}
+			continue;
+		}
+		val.data = NULL;
+		val.len = val_len;
+		ret = cache_op(cache, write, &key, &val, 1);
+		if (ret || !val.data) {
+			return loaded; /* e.g. full, keep what's been loaded */
+		}
+		ret = read_data(file, val.data, val_len);
+		if (ret) {
+			/* The reserved space is filled in anyway; make it expired. */
+			memset(val.data, 0, val_len);
+			return ret;
+		}
+		const struct entry_h *eh = val.data;
+		if ((int64_t)now > (int64_t)eh->time + eh->ttl) {
+			(void) cache_op(cache, remove, &key, 1);
+			continue;
+		}
+		loaded += 1;
+	}
+}
+
+int kr_cache_snapshot_load(struct kr_context *ctx, const char *path, bool entries)
+{
+	if (!ctx || !path) {
+		return kr_error(EINVAL);
+	}
+	struct kr_cache *cache = &ctx->cache;
+	if (entries && !kr_cache_is_open(cache)) {
+		return kr_error(EINVAL);
+	}
+	auto_fclose FILE *file = fopen(path, "r");
+	if (!file) {
+		return kr_error(errno);
+	}
+	char magic[4];
+	uint16_t versions[2];
+	if (read_data(file, magic, sizeof(magic)) != 0 || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0
+	    || read_data(file, versions, sizeof(versions)) != 0
+	    || versions[0] != SNAPSHOT_VERSION || versions[1] != cache_version()) {
+		return kr_error(EILSEQ);
+	}
+	int ret = load_rtt(ctx, file);
+	if (ret || !entries) {
+		return ret;
+	}
+	/* The writes share a single transaction, committed by the sync. */
+	ret = load_entries(cache, file);
+	cache->ns_gen += 1; /* zone cuts may appear, see kr_zonecut_find_cached() */
+	kr_cache_sync(cache);
+	return ret;
+}
@@ -22,6 +22,7 @@
 
 #include "lib/cookies/alg_containers.h"
 #include "lib/cookies/alg_sha.h"
+#include "lib/cookies/alg_siphash.h"
 
 const struct knot_cc_alg *kr_cc_alg_get(int id)
 {
@@ -31,10 +32,11 @@ const struct knot_cc_alg *kr_cc_alg_get(int id)
 	 */
 	static const struct knot_cc_alg *const cc_algs[] = {
 		/* 0 */ &knot_cc_alg_fnv64,
-		/* 1 */ &knot_cc_alg_hmac_sha256_64
+		/* 1 */ &knot_cc_alg_hmac_sha256_64,
+		/* 2 */ &knot_cc_alg_siphash24_64
 	};
 
-	if (id >= 0 && id < 2) {
+	if (id >= 0 && id < 3) {
 		return cc_algs[id];
 	}
 
@@ -44,6 +46,7 @@ const struct knot_cc_alg *kr_cc_alg_get(int id)
 const knot_lookup_t kr_cc_alg_names[] = {
 	{ 0, "FNV-64" },
 	{ 1, "HMAC-SHA256-64" },
+	{ 2, "SipHash-2-4-64" },
 	{ -1, NULL }
 };
 
@@ -55,10 +58,11 @@ const struct knot_sc_alg *kr_sc_alg_get(int id)
 	 */
 	static const struct knot_sc_alg *const sc_algs[] = {
 		/* 0 */ &knot_sc_alg_fnv64,
-		/* 1 */ &knot_sc_alg_hmac_sha256_64
+		/* 1 */ &knot_sc_alg_hmac_sha256_64,
+		/* 2 */ &knot_sc_alg_siphash24_64
 	};
 
-	if (id >= 0 && id < 2) {
+	if (id >= 0 && id < 3) {
 		return sc_algs[id];
 	}
 
@@ -68,5 +72,6 @@ const struct knot_sc_alg *kr_sc_alg_get(int id)
 const knot_lookup_t kr_sc_alg_names[] = {
 	{ 0, "FNV-64" },
 	{ 1, "HMAC-SHA256-64" },
+	{ 2, "SipHash-2-4-64" },
 	{ -1, NULL }
 };
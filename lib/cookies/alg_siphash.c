@@ -0,0 +1,130 @@
+/*  Copyright (C) 2016-2017 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * SipHash-2-4 with 64-bit output, a keyed hash made for short inputs.
+ * It is considerably cheaper than HMAC-SHA256 and, unlike FNV-64, not
+ * predictable without the secret.
+ *
+ * The secret is used as the 128-bit key; shorter secrets are padded with
+ * zeros, longer ones are folded onto the key by XOR.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libknot/errcode.h>
+#include <libknot/rrtype/opt-cookie.h>
+
+#include "lib/cookies/alg_siphash.h"
+#include "lib/generic/hash.h"
+#include "lib/utils.h"
+
+#define SIPHASH_KEY_SIZE KR_SIPHASH_KEY_SIZE
+#define SIPHASH_ADDR_MAXLEN 16 /* IPv6 */
+
+/** SipHash-2-4-64 of the input, the output bytes little-endian as in the reference. */
+static void siphash24(const uint8_t key[SIPHASH_KEY_SIZE],
+                      const uint8_t *in, size_t len, uint8_t out[8])
+{
+	uint64_t h = kr_siphash24(key, in, len);
+	for (int i = 0; i < 8; ++i, h >>= 8) {
+		out[i] = h;
+	}
+}
+
+static void make_key(const uint8_t *secret, size_t secret_len,
+                     uint8_t key[SIPHASH_KEY_SIZE])
+{
+	memset(key, 0, SIPHASH_KEY_SIZE);
+	for (size_t i = 0; i < secret_len; ++i) {
+		key[i % SIPHASH_KEY_SIZE] ^= secret[i];
+	}
+}
+
+/** Append the address bytes, return the new length. */
+static size_t put_addr(uint8_t *buf, size_t len, const struct sockaddr *sa)
+{
+	assert(buf && sa);
+
+	int addr_len = kr_inaddr_len(sa);
+	const uint8_t *addr = (uint8_t *)kr_inaddr(sa);
+	if (!addr || addr_len <= 0 || addr_len > SIPHASH_ADDR_MAXLEN) {
+		return len;
+	}
+	memcpy(buf + len, addr, addr_len);
+	return len + addr_len;
+}
+
+static uint16_t cc_gen_siphash24_64(const struct knot_cc_input *input,
+                                    uint8_t *cc_out, uint16_t cc_len)
+{
+	if (!knot_cc_input_is_valid(input) ||
+	    !cc_out || cc_len < KNOT_OPT_COOKIE_CLNT) {
+		return 0;
+	}
+
+	uint8_t buf[2 * SIPHASH_ADDR_MAXLEN];
+	size_t len = 0;
+	if (input->clnt_sockaddr) {
+		len = put_addr(buf, len, input->clnt_sockaddr);
+	}
+	if (input->srvr_sockaddr) {
+		len = put_addr(buf, len, input->srvr_sockaddr);
+	}
+
+	uint8_t key[SIPHASH_KEY_SIZE];
+	make_key(input->secret_data, input->secret_len, key);
+	/* KNOT_OPT_COOKIE_CLNT is the output size of SipHash-2-4-64. */
+	siphash24(key, buf, len, cc_out);
+	return KNOT_OPT_COOKIE_CLNT;
+}
+
+#define SRVR_SIPHASH24_64_HASH_SIZE 8
+
+static uint16_t sc_gen_siphash24_64(const struct knot_sc_input *input,
+                                    uint8_t *hash_out, uint16_t hash_len)
+{
+	if (!knot_sc_input_is_valid(input) ||
+	    !hash_out || hash_len < SRVR_SIPHASH24_64_HASH_SIZE) {
+		return 0;
+	}
+
+	uint8_t buf[KNOT_OPT_COOKIE_CLNT + KNOT_OPT_COOKIE_SRVR_MAX + SIPHASH_ADDR_MAXLEN];
+	if (input->cc_len + input->nonce_len > KNOT_OPT_COOKIE_CLNT + KNOT_OPT_COOKIE_SRVR_MAX) {
+		return 0;
+	}
+	size_t len = input->cc_len;
+	memcpy(buf, input->cc, input->cc_len);
+	if (input->nonce && input->nonce_len) {
+		memcpy(buf + len, input->nonce, input->nonce_len);
+		len += input->nonce_len;
+	}
+	if (input->srvr_data->clnt_sockaddr) {
+		len = put_addr(buf, len, input->srvr_data->clnt_sockaddr);
+	}
+
+	uint8_t key[SIPHASH_KEY_SIZE];
+	make_key(input->srvr_data->secret_data, input->srvr_data->secret_len, key);
+	siphash24(key, buf, len, hash_out);
+	return SRVR_SIPHASH24_64_HASH_SIZE;
+}
+
+const struct knot_cc_alg knot_cc_alg_siphash24_64 = { KNOT_OPT_COOKIE_CLNT, cc_gen_siphash24_64 };
+
+const struct knot_sc_alg knot_sc_alg_siphash24_64 = { SRVR_SIPHASH24_64_HASH_SIZE, sc_gen_siphash24_64 };
@@ -32,6 +32,7 @@ struct kr_cookie_secret {
 struct kr_cookie_comp {
 	struct kr_cookie_secret *secr; /*!< Secret data. */
 	int alg_id; /*!< Cookie algorithm identifier. */
+	uint32_t gen; /*!< Changes with the secret or the algorithm, 0 if unset. */
 };
 
 /** Holds settings that control client/server cookie behaviour. */
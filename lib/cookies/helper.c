@@ -104,22 +104,25 @@ static int opt_rr_put_cookie_opt(knot_rrset_t *opt_rr, uint8_t *option, knot_mm_
 	return opt_rr_put_cookie(opt_rr, opt_data, opt_len, mm);
 }
 
-int kr_request_put_cookie(const struct kr_cookie_comp *clnt_comp,
-                          kr_cookie_lru_t *cookie_cache,
-                          const struct sockaddr *clnt_sa,
-                          const struct sockaddr *srvr_sa,
-                          struct kr_request *req)
+int kr_cookie_cc_get(const struct kr_cookie_comp *clnt_comp,
+                     kr_cookie_lru_t *cookie_cache,
+                     const struct sockaddr *clnt_sa,
+                     const struct sockaddr *srvr_sa, uint8_t *cc_out)
 {
-	if (!clnt_comp || !req) {
+	if (!clnt_comp || !clnt_comp->secr || !srvr_sa || !cc_out) {
 		return kr_error(EINVAL);
 	}
 
-	if (!req->ctx->opt_rr) {
-		return kr_ok();
-	}
-
-	if (!clnt_comp->secr || (clnt_comp->alg_id < 0) || !cookie_cache) {
-		return kr_error(EINVAL);
+	/* The client address isn't part of the key. */
+	const bool cacheable = cookie_cache && !clnt_sa && clnt_comp->gen;
+	if (cacheable) {
+		const uint8_t *cached_cc = kr_cookie_lru_get_cc(cookie_cache,
+		                                                srvr_sa,
+		                                                clnt_comp->gen);
+		if (cached_cc) {
+			memcpy(cc_out, cached_cc, KNOT_OPT_COOKIE_CLNT);
+			return kr_ok();
+		}
 	}
 
 	/*
@@ -132,23 +135,53 @@ int kr_request_put_cookie(const struct kr_cookie_comp *clnt_comp,
 		.secret_data = clnt_comp->secr->data,
 		.secret_len = clnt_comp->secr->size
 	};
-	uint8_t cc[KNOT_OPT_COOKIE_CLNT];
-	uint16_t cc_len = KNOT_OPT_COOKIE_CLNT;
 	const struct knot_cc_alg *cc_alg = kr_cc_alg_get(clnt_comp->alg_id);
 	if (!cc_alg) {
 		return kr_error(EINVAL);
 	}
 	assert(cc_alg->gen_func);
-	cc_len = cc_alg->gen_func(&input, cc, cc_len);
+	uint16_t cc_len = cc_alg->gen_func(&input, cc_out, KNOT_OPT_COOKIE_CLNT);
 	if (cc_len != KNOT_OPT_COOKIE_CLNT) {
 		return kr_error(EINVAL);
 	}
 
+	if (cacheable) {
+		(void) kr_cookie_lru_set_cc(cookie_cache, srvr_sa, clnt_comp->gen,
+		                            cc_out);
+	}
+
+	return kr_ok();
+}
+
+int kr_request_put_cookie(const struct kr_cookie_comp *clnt_comp,
+                          kr_cookie_lru_t *cookie_cache,
+                          const struct sockaddr *clnt_sa,
+                          const struct sockaddr *srvr_sa,
+                          struct kr_request *req)
+{
+	if (!clnt_comp || !req) {
+		return kr_error(EINVAL);
+	}
+
+	if (!req->ctx->opt_rr) {
+		return kr_ok();
+	}
+
+	if (!clnt_comp->secr || (clnt_comp->alg_id < 0) || !cookie_cache) {
+		return kr_error(EINVAL);
+	}
+
+	uint8_t cc[KNOT_OPT_COOKIE_CLNT];
+	uint16_t cc_len = KNOT_OPT_COOKIE_CLNT;
+	int ret = kr_cookie_cc_get(clnt_comp, cookie_cache, clnt_sa, srvr_sa, cc);
+	if (ret != kr_ok()) {
+		return ret;
+	}
+
 	const uint8_t *cached_cookie = peek_and_check_cc(cookie_cache,
 	                                                 srvr_sa, cc, cc_len);
 
 	/* Add cookie option. */
-	int ret;
 	if (cached_cookie) {
 		ret = opt_rr_put_cookie_opt(req->ctx->opt_rr,
 		                            (uint8_t *)cached_cookie,
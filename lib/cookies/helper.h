@@ -25,6 +25,23 @@
 #include "lib/defines.h"
 #include "lib/resolve.h"
 
+/**
+ * @brief Computes the client cookie for a server.
+ * @note Without the client address, the cookie is cached under the server
+ *       address until the client secret changes, see kr_cookie_comp::gen.
+ * @param clnt_comp    client cookie control structure
+ * @param cookie_cache cookie cache, may be NULL
+ * @param clnt_sa      client socket address, may be NULL
+ * @param srvr_sa      server socket address
+ * @param cc_out       KNOT_OPT_COOKIE_CLNT bytes for the cookie
+ * @return kr_ok() or error code
+ */
+KR_EXPORT
+int kr_cookie_cc_get(const struct kr_cookie_comp *clnt_comp,
+                     kr_cookie_lru_t *cookie_cache,
+                     const struct sockaddr *clnt_sa,
+                     const struct sockaddr *srvr_sa, uint8_t *cc_out);
+
 /**
  * @brief Updates DNS cookie in the request EDNS options.
  * @note This function must be called before the request packet is finalised.
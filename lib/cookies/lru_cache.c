@@ -34,7 +34,12 @@ const uint8_t *kr_cookie_lru_get(kr_cookie_lru_t *cache,
 	}
 
 	struct cookie_opt_data *cached = lru_get_try(cache, addr, addr_len);
-	return cached ? cached->opt_data : NULL;
+	/* The entry may only hold the computed client cookie. */
+	if (!cached ||
+	    knot_edns_opt_get_code(cached->opt_data) != KNOT_EDNS_OPTION_COOKIE) {
+		return NULL;
+	}
+	return cached->opt_data;
 }
 
 int kr_cookie_lru_set(kr_cookie_lru_t *cache, const struct sockaddr *sa,
@@ -68,3 +73,42 @@ int kr_cookie_lru_set(kr_cookie_lru_t *cache, const struct sockaddr *sa,
 
 	return kr_ok();
 }
+
+const uint8_t *kr_cookie_lru_get_cc(kr_cookie_lru_t *cache,
+                                    const struct sockaddr *sa, uint32_t gen)
+{
+	if (!cache || !sa || gen == 0) {
+		return NULL;
+	}
+
+	int addr_len = kr_inaddr_len(sa);
+	const char *addr = kr_inaddr(sa);
+	if (!addr || addr_len <= 0) {
+		return NULL;
+	}
+
+	struct cookie_opt_data *cached = lru_get_try(cache, addr, addr_len);
+	return (cached && cached->cc_gen == gen) ? cached->cc : NULL;
+}
+
+int kr_cookie_lru_set_cc(kr_cookie_lru_t *cache, const struct sockaddr *sa,
+                         uint32_t gen, const uint8_t *cc)
+{
+	if (!cache || !sa || !cc || gen == 0) {
+		return kr_error(EINVAL);
+	}
+
+	int addr_len = kr_inaddr_len(sa);
+	const char *addr = kr_inaddr(sa);
+	if (!addr || addr_len <= 0) {
+		return kr_error(EINVAL);
+	}
+
+	struct cookie_opt_data *cached = lru_get_new(cache, addr, addr_len, NULL);
+	if (cached) {
+		memcpy(cached->cc, cc, KNOT_OPT_COOKIE_CLNT);
+		cached->cc_gen = gen;
+	}
+
+	return kr_ok();
+}
@@ -35,9 +35,14 @@
 
 /**
  * Cookie option entry.
+ *
+ * Also holds the client cookie computed for the address, so that it's only
+ * recomputed when the client secret changes; the option may be missing then.
  */
 struct cookie_opt_data {
-	uint8_t opt_data[KR_COOKIE_OPT_MAX_LEN];
+	uint8_t opt_data[KR_COOKIE_OPT_MAX_LEN]; /**< Received option, zeroed if none */
+	uint32_t cc_gen; /**< Secret generation of cc, see kr_cookie_comp::gen */
+	uint8_t cc[KNOT_OPT_COOKIE_CLNT]; /**< Client cookie for the address */
 };
 
 /**
@@ -67,3 +72,29 @@ const uint8_t *kr_cookie_lru_get(kr_cookie_lru_t *cache,
 KR_EXPORT
 int kr_cookie_lru_set(kr_cookie_lru_t *cache, const struct sockaddr *sa,
                       uint8_t *opt);
+
+/**
+ * @brief Obtain the client cookie computed for the address.
+ *
+ * @param cache cookie LRU cache
+ * @param sa socket address serving as key
+ * @param gen generation of the client secret, see kr_cookie_comp::gen
+ * @return pointer to KNOT_OPT_COOKIE_CLNT bytes or NULL if not computed
+ *         with this generation
+ */
+KR_EXPORT
+const uint8_t *kr_cookie_lru_get_cc(kr_cookie_lru_t *cache,
+                                    const struct sockaddr *sa, uint32_t gen);
+
+/**
+ * @brief Stores the client cookie computed for the address.
+ *
+ * @param cache cookie LRU cache
+ * @param sa socket address serving as key
+ * @param gen generation of the client secret, see kr_cookie_comp::gen
+ * @param cc KNOT_OPT_COOKIE_CLNT bytes
+ * @return kr_ok() or error code
+ */
+KR_EXPORT
+int kr_cookie_lru_set_cc(kr_cookie_lru_t *cache, const struct sockaddr *sa,
+                         uint32_t gen, const uint8_t *cc);
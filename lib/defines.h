@@ -59,6 +59,7 @@ static inline int KR_COLD kr_error(int x) {
  */
 #define KR_CONN_RTT_MAX 2000 /* Timeout for network activity */
 #define KR_CONN_RETRY 200    /* Retry interval for network activity */
+#define KR_CONN_RETRY_MIN 20 /* Retry interval for servers known to answer fast */
 #define KR_ITER_LIMIT 100    /* Built-in iterator limit */
 #define KR_RESOLVE_TIME_LIMIT 10000 /* Upper limit for resolution time of single query, ms */
 #define KR_CNAME_CHAIN_LIMIT 40 /* Built-in maximum CNAME chain length */
@@ -75,6 +76,26 @@ static inline int KR_COLD kr_error(int x) {
 #define KR_DEFAULT_TLS_PADDING 468 /* Default EDNS(0) Padding is 468 */
 #define KR_CACHE_DEFAULT_TTL_MIN (5) /* avoid bursts of queries */
 #define KR_CACHE_DEFAULT_TTL_MAX (6 * 24 * 3600) /* 6 days, like the root NS TTL */
+#define KR_CACHE_L1_SIZE 16384 /* Hot cache entries copied in each process */
+#define KR_CACHE_GC_TARGET 80 /* Cache fill (percent) above which GC evicts more than very stale records */
+#define KR_CACHE_GC_STALE (24 * 3600) /* Keep expired records for this long, for serve_stale */
+#define KR_CACHE_GC_URGENT 10000 /* Entries visited by GC when the cache is full */
+#define KR_CACHE_GC_HOT 4 /* Lookups per GC pass which keep a non-authoritative record */
+#define KR_CACHE_SKETCH_WIDTH 262144 /* Counters per row of the lookup frequency sketch */
+#define KR_NSEC3_HASH_CACHE_SIZE 4096 /* NSEC3 hashes remembered in each process */
+#define KR_NSEC3_MAX_ITERATIONS 150 /* NSEC3 chains with more iterations are treated as insecure */
+#define KR_DNSSEC_SIG_CACHE_SIZE 4096 /* Successful RRSIG verifications remembered in each process */
+#define KR_VALIDATE_LIMIT_CRYPTO 32 /* Default signature checks allowed when validating one answer, see kr_budget */
+#define KR_DNSSEC_KEY_CACHE_SIZE 256 /* Parsed DNSKEYs kept in each process */
+#define KR_DNSSEC_KEY_TAGS_MAX 16 /* DNSKEYs of a zone with their key tag kept in kr_rrset_validation_ctx */
+#define KR_ZONECUT_MISS_SIZE 4096 /* Names remembered to have no NS in cache, in each process */
+#define KR_ZONECUT_MISS_TTL 1000 /* Milliseconds to trust that; NS writes by other forks aren't seen */
+#define KR_ZONECUT_HOT_SIZE 1024 /* Zone cuts whose lookups are counted, in each process */
+#define KR_ZONECUT_HOT_PERIOD 60000 /* Milliseconds after which the counts of lookups halve */
+#define KR_NSREP_ELECT_SIZE 1024 /* Zone cuts with their NS election remembered, in each process */
+#define KR_NSREP_ELECT_TTL 300 /* Milliseconds to reuse an election, unless its addresses got slower */
+#define KR_NSREP_HINT_SIZE 4096 /* NS remembered with the best score of their cached addresses, in each process */
+#define KR_NSREP_HINT_TTL 10000 /* Milliseconds to trust that, e.g. that a NS had no address in cache */
 
 /*
  * Address sanitizer hints.
@@ -93,4 +114,15 @@ void __asan_unpoison_memory_region(void const volatile *addr, size_t size);
 #define kr_asan_poison(addr, size)
 #define kr_asan_unpoison(addr, size)
 #endif
+
+/*
+ * Static probes (USDT) of the provider "kresd" for SystemTap or bpftrace,
+ * a nop each if nothing is attached; the arguments are integers and pointers.
+ */
+#if defined(ENABLE_USDT)
+#include <sys/sdt.h>
+#define kr_probe(name, ...) STAP_PROBEV(kresd, name, ##__VA_ARGS__)
+#else
+#define kr_probe(name, ...)
+#endif
 /* @endcond */
@@ -28,6 +28,8 @@
 #include <libknot/rrtype/nsec.h>
 #include <libknot/rrtype/rrsig.h>
 #include <contrib/wire.h>
+#include <contrib/murmurhash3/murmurhash3.h>
+#include <contrib/ucw/lib.h>
 
 #include "lib/defines.h"
 #include "lib/dnssec/nsec.h"
@@ -38,7 +40,8 @@
 
 /* forward */
 static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
-	const knot_rrset_t *covered, size_t key_pos, const struct dseckey *key);
+	const knot_rrset_t *covered, size_t key_pos, const struct dseckey *key,
+	struct kr_sig_wire *wire);
 
 void kr_crypto_init(void)
 {
@@ -57,6 +60,87 @@ void kr_crypto_reinit(void)
 
 #define FLG_WILDCARD_EXPANSION 0x01 /**< Possibly generated by using wildcard expansion. */
 
+/** Parsed DNSKEYs shared by all requests in this process, direct-mapped.
+ * Importing the public key is costly, and the same few keys (root, TLDs)
+ * are used over and over.  A slot with refs > 0 is never replaced. */
+struct key_cache_slot {
+	dnssec_key_t *key;
+	dnssec_sign_ctx_t *sign;  /**< for verifying with the key, reused */
+	uint32_t hash;  /**< of the RDATA; the owner is compared on lookup */
+	uint32_t refs;
+};
+static struct key_cache_slot key_cache[KR_DNSSEC_KEY_CACHE_SIZE];
+
+static uint32_t key_cache_hash(const uint8_t *rdata, size_t rdlen)
+{
+	return hash((const char *)rdata, rdlen);
+}
+
+static bool key_cache_match(const struct key_cache_slot *slot, uint32_t h,
+			    const knot_dname_t *kown, const uint8_t *rdata, size_t rdlen)
+{
+	if (!slot->key || slot->hash != h) {
+		return false;
+	}
+	dnssec_binary_t k_rdata = { 0, NULL };
+	return dnssec_key_get_rdata(slot->key, &k_rdata) == DNSSEC_EOK
+		&& k_rdata.size == rdlen && memcmp(k_rdata.data, rdata, rdlen) == 0
+		&& knot_dname_is_equal(dnssec_key_get_dname(slot->key), kown);
+}
+
+/** Like kr_dnssec_key_from_rdata(), but maybe shared; release by key_cache_put(). */
+static int key_cache_get(struct dseckey **key, const knot_dname_t *kown,
+			 const uint8_t *rdata, size_t rdlen)
+{
+	assert(key && kown && rdata);
+	const uint32_t h = key_cache_hash(rdata, rdlen);
+	struct key_cache_slot *slot = &key_cache[h % KR_DNSSEC_KEY_CACHE_SIZE];
+	if (key_cache_match(slot, h, kown, rdata, rdlen)) {
+		slot->refs += 1;
+		*key = (struct dseckey *)slot->key;
+		return kr_ok();
+	}
+	int ret = kr_dnssec_key_from_rdata(key, kown, rdata, rdlen);
+	if (ret == 0 && slot->refs == 0) {
+		dnssec_sign_free(slot->sign);
+		slot->sign = NULL;
+		dnssec_key_free(slot->key);
+		slot->key = (dnssec_key_t *)*key;
+		slot->hash = h;
+		slot->refs = 1;
+	}
+	return ret;
+}
+
+/** The slot holding the key, or NULL if it isn't cached. */
+static struct key_cache_slot *key_cache_slot_of(const struct dseckey *key)
+{
+	const dnssec_key_t *k = (const dnssec_key_t *)key;
+	dnssec_binary_t k_rdata = { 0, NULL };
+	if (dnssec_key_get_rdata(k, &k_rdata) != DNSSEC_EOK) {
+		return NULL;
+	}
+	const uint32_t h = key_cache_hash(k_rdata.data, k_rdata.size);
+	struct key_cache_slot *slot = &key_cache[h % KR_DNSSEC_KEY_CACHE_SIZE];
+	return slot->key == k ? slot : NULL;
+}
+
+/** Release a key obtained by key_cache_get(); it's freed if it isn't cached. */
+static void key_cache_put(struct dseckey **key)
+{
+	if (!*key) {
+		return;
+	}
+	struct key_cache_slot *slot = key_cache_slot_of(*key);
+	if (slot) {
+		assert(slot->refs > 0);
+		slot->refs -= 1;
+		*key = NULL;
+		return;
+	}
+	kr_dnssec_key_free(key);
+}
+
 /**
  * Check the RRSIG RR validity according to RFC4035 5.3.1 .
  * @param flags     The flags are going to be set according to validation result.
@@ -132,6 +216,70 @@ static int wildcard_radix_len_diff(const knot_dname_t *expanded,
 	return knot_dname_labels(expanded, NULL) - knot_rrsig_labels(&rrsigs->rrs, sig_pos);
 }
 
+/** Key tag of a DNSKEY computed from its RDATA, RFC 4034 appendix B. */
+static uint16_t dnskey_tag(const uint8_t *rdata, uint16_t rdlen)
+{
+	if (rdlen < 4) {
+		return 0;
+	}
+	if (rdata[3] == 1) { /* RSAMD5 */
+		return wire_read_u16(rdata + rdlen - 3);
+	}
+	uint32_t ac = 0;
+	for (uint16_t i = 0; i < rdlen; ++i) {
+		ac += (i & 1) ? rdata[i] : (uint32_t)rdata[i] << 8;
+	}
+	ac += (ac >> 16) & 0xFFFF;
+	return ac & 0xFFFF;
+}
+
+/** Compute the tags of vctx->keys, once for all RRSets validated by the context. */
+static void key_tags_index(kr_rrset_validation_ctx_t *vctx)
+{
+	if (vctx->tags_of == vctx->keys) {
+		return;
+	}
+	const knot_rrset_t *keys = vctx->keys;
+	const unsigned count = MIN(keys->rrs.rr_count, KR_DNSSEC_KEY_TAGS_MAX);
+	for (unsigned i = 0; i < count; ++i) {
+		const knot_rdata_t *krr = knot_rdataset_at(&keys->rrs, i);
+		vctx->key_tags[i] = dnskey_tag(knot_rdata_data(krr), knot_rdata_rdlen(krr));
+	}
+	vctx->tags_of = keys;
+}
+
+/**
+ * Collect the algorithms and key tags of the RRSIGs that may cover the RRSet.
+ * @param sigs  (algorithm << 16 | key tag), at most KR_DNSSEC_KEY_TAGS_MAX of them.
+ * @return      their count, or -1 if every key has to be tried
+ * 		(too many signatures, or some by another signer, see validate_rrsig_rr()).
+ */
+static int covering_sigs(const kr_rrset_validation_ctx_t *vctx,
+			 const knot_rrset_t *covered, uint32_t *sigs)
+{
+	int count = 0;
+	for (uint16_t i = 0; i < vctx->rrs->len; ++i) {
+		const knot_rrset_t *rrsig = vctx->rrs->at[i]->rr;
+		if (rrsig->type != KNOT_RRTYPE_RRSIG || covered->rclass != rrsig->rclass
+		    || !knot_dname_is_equal(covered->owner, rrsig->owner)) {
+			continue;
+		}
+		for (uint16_t j = 0; j < rrsig->rrs.rr_count; ++j) {
+			if (knot_rrsig_type_covered(&rrsig->rrs, j) != covered->type) {
+				continue;
+			}
+			const knot_dname_t *signer = knot_rrsig_signer_name(&rrsig->rrs, j);
+			if (count == KR_DNSSEC_KEY_TAGS_MAX || !signer
+			    || !knot_dname_is_equal(signer, vctx->zone_name)) {
+				return -1;
+			}
+			sigs[count++] = (uint32_t)knot_rrsig_algorithm(&rrsig->rrs, j) << 16
+					| knot_rrsig_key_tag(&rrsig->rrs, j);
+		}
+	}
+	return count;
+}
+
 int kr_rrset_validate(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *covered)
 {
 	if (!vctx) {
@@ -141,9 +289,27 @@ int kr_rrset_validate(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *cover
 		return kr_error(EINVAL);
 	}
 
+	/* Only the keys some signature refers to are parsed and tried. */
+	key_tags_index(vctx);
+	uint32_t sigs[KR_DNSSEC_KEY_TAGS_MAX];
+	const int sig_count = covering_sigs(vctx, covered, sigs);
+
+	/* The wire of the RRSet is made once for all keys and signatures. */
+	struct kr_sig_wire wire = { 0 };
 	for (unsigned i = 0; i < vctx->keys->rrs.rr_count; ++i) {
-		int ret = kr_rrset_validate_with_key(vctx, covered, i, NULL);
-		if (ret == 0) {
+		if (sig_count >= 0 && i < KR_DNSSEC_KEY_TAGS_MAX) {
+			const uint32_t k = (uint32_t)knot_dnskey_alg(&vctx->keys->rrs, i) << 16
+					| vctx->key_tags[i];
+			int j = 0;
+			while (j < sig_count && sigs[j] != k) {
+				++j;
+			}
+			if (j == sig_count) {
+				continue;
+			}
+		}
+		int ret = kr_rrset_validate_with_key(vctx, covered, i, NULL, &wire);
+		if (ret == 0 || ret == kr_error(E2BIG)) {
 			return ret;
 		}
 	}
@@ -158,11 +324,13 @@ int kr_rrset_validate(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *cover
  * @param key_pos Position of the key to be validated with.
  * @param key     Key to be used to validate.
  *		  If NULL, then key from DNSKEY RRSet is used.
+ * @param wire    Wire of the covered RRSet, see kr_check_signature().
  * @return        0 or error code, same as vctx->result.
  */
 static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 				const knot_rrset_t *covered,
-				size_t key_pos, const struct dseckey *key)
+				size_t key_pos, const struct dseckey *key,
+				struct kr_sig_wire *wire)
 {
 	const knot_pkt_t *pkt         = vctx->pkt;
 	const knot_rrset_t *keys      = vctx->keys;
@@ -180,7 +348,7 @@ static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 
 	if (key == NULL) {
 		const knot_rdata_t *krr = knot_rdataset_at(&keys->rrs, key_pos);
-		int ret = kr_dnssec_key_from_rdata(&created_key, keys->owner,
+		int ret = key_cache_get(&created_key, keys->owner,
 			                       knot_rdata_data(krr), knot_rdata_rdlen(krr));
 		if (ret != 0) {
 			vctx->result = ret;
@@ -189,6 +357,9 @@ static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 		key = created_key;
 	}
 	uint16_t keytag = dnssec_key_get_keytag((dnssec_key_t *)key);
+	/* The verification context is kept with a cached key for its next signatures. */
+	struct key_cache_slot *slot = key_cache_slot_of(key);
+	dnssec_sign_ctx_t **sign_ctx = slot ? &slot->sign : NULL;
 	int covered_labels = knot_dname_labels(covered->owner, NULL);
 	if (knot_dname_is_wildcard(covered->owner)) {
 		/* The asterisk does not count, RFC4034 3.1.3, paragraph 3. */
@@ -214,7 +385,7 @@ static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 			                      keys, key_pos, keytag,
 			                      zone_name, timestamp);
 			if (ret == kr_error(EAGAIN)) {
-				kr_dnssec_key_free(&created_key);
+				key_cache_put(&created_key);
 				vctx->result = ret;
 				return ret;
 			} else if (ret != 0) {
@@ -226,7 +397,15 @@ static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 					break;
 				}
 			}
-			if (kr_check_signature(rrsig, j, (dnssec_key_t *) key, covered, trim_labels) != 0) {
+			ret = kr_check_signature(rrsig, j, (dnssec_key_t *) key, covered,
+						 trim_labels, wire, sign_ctx,
+						 &vctx->limit_crypto_remains);
+			if (ret == kr_error(E2BIG)) {
+				/* Don't let a single answer hog the worker. */
+				key_cache_put(&created_key);
+				vctx->result = ret;
+				return ret;
+			} else if (ret != 0) {
 				continue;
 			}
 			if (val_flgs & FLG_WILDCARD_EXPANSION) {
@@ -246,13 +425,13 @@ static int kr_rrset_validate_with_key(kr_rrset_validation_ctx_t *vctx,
 				vctx->flags |= KR_DNSSEC_VFLG_WEXPAND;
 			}
 			/* Validated with current key, OK */
-			kr_dnssec_key_free(&created_key);
+			key_cache_put(&created_key);
 			vctx->result = kr_ok();
 			return vctx->result;
 		}
 	}
 	/* No applicable key found, cannot be validated. */
-	kr_dnssec_key_free(&created_key);
+	key_cache_put(&created_key);
 	vctx->result = kr_error(ENOENT);
 	return vctx->result;
 }
@@ -325,6 +504,7 @@ int kr_dnskeys_trusted(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *ta)
 	 * The supplied DS record has been authenticated.
 	 * It has been validated or is part of a configured trust anchor.
 	 */
+	struct kr_sig_wire wire = { 0 };
 	for (uint16_t i = 0; i < keys->rrs.rr_count; ++i) {
 		/* RFC4035 5.3.1, bullet 8 */ /* ZSK */
 		const knot_rdata_t *krr = knot_rdataset_at(&keys->rrs, i);
@@ -334,18 +514,22 @@ int kr_dnskeys_trusted(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *ta)
 		}
 		
 		struct dseckey *key = NULL;
-		if (kr_dnssec_key_from_rdata(&key, keys->owner, key_data, knot_rdata_rdlen(krr)) != 0) {
+		if (key_cache_get(&key, keys->owner, key_data, knot_rdata_rdlen(krr)) != 0) {
 			continue;
 		}
 		if (kr_authenticate_referral(ta, (dnssec_key_t *) key) != 0) {
-			kr_dnssec_key_free(&key);
+			key_cache_put(&key);
 			continue;
 		}
-		if (kr_rrset_validate_with_key(vctx, keys, i, key) != 0) {
-			kr_dnssec_key_free(&key);
+		int ret = kr_rrset_validate_with_key(vctx, keys, i, key, &wire);
+		if (ret == kr_error(E2BIG)) {
+			key_cache_put(&key);
+			return ret;
+		} else if (ret != 0) {
+			key_cache_put(&key);
 			continue;
 		}
-		kr_dnssec_key_free(&key);
+		key_cache_put(&key);
 		assert (vctx->result == 0);
 		return vctx->result;
 	}
@@ -57,7 +57,10 @@ struct kr_rrset_validation_ctx {
 	uint32_t qry_uid;		/*!< Current query uid. */
 	uint32_t flags;			/*!< Output - Flags. */
 	uint32_t err_cnt;		/*!< Output - Number of validation failures. */
+	int limit_crypto_remains;	/*!< Public-key operations still allowed, see kr_check_signature(); kr_error(E2BIG) when exhausted. */
 	int result;			/*!< Output - 0 or error code. */
+	const knot_rrset_t *tags_of;	/*!< Private - the keys indexed by key_tags. */
+	uint16_t key_tags[KR_DNSSEC_KEY_TAGS_MAX]; /*!< Private - tags of the first keys. */
 };
 
 typedef struct kr_rrset_validation_ctx kr_rrset_validation_ctx_t;
@@ -68,6 +71,7 @@ typedef struct kr_rrset_validation_ctx kr_rrset_validation_ctx_t;
  * @param covered RRSet covered by a signature. It must be in canonical format.
  * @return        0 or error code, same as vctx->result.
  */
+KR_EXPORT
 int kr_rrset_validate(kr_rrset_validation_ctx_t *vctx,
 			const knot_rrset_t *covered);
 
@@ -79,8 +83,16 @@ int kr_rrset_validate(kr_rrset_validation_ctx_t *vctx,
  * 		DNSSEC_INVALID_DS_ALGORITHM if *each* DS records is unusable
  * 		due to unimplemented DNSKEY or DS algorithm.
  */
+KR_EXPORT
 int kr_dnskeys_trusted(kr_rrset_validation_ctx_t *vctx, const knot_rrset_t *ta);
 
+/**
+ * Remember the successful signature verifications of this process; on by default.
+ * With it off, each check does the public-key operation, e.g. to measure it.
+ */
+KR_EXPORT
+void kr_dnssec_sig_cache(bool enable);
+
 /** Return true if the DNSKEY can be used as a ZSK.  */
 KR_EXPORT KR_PURE
 bool kr_dnssec_key_zsk(const uint8_t *dnskey_rdata);
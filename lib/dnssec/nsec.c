@@ -27,37 +27,48 @@
 #include "lib/defines.h"
 #include "lib/dnssec/nsec.h"
 
-bool kr_nsec_bitmap_contains_type(const uint8_t *bm, uint16_t bm_size, uint16_t type)
+/**
+ * Find a window in a type bitmap.
+ * @param win_size Set to the length of the window found.
+ * @return the window's bitmap bytes, or NULL if it isn't there (or malformed).
+ */
+static const uint8_t * bitmap_window(const uint8_t *bm, uint16_t bm_size,
+				     uint8_t win, uint8_t *win_size)
 {
-	if (!bm || bm_size == 0) {
-		assert(bm);
-		return false;
-	}
-
-	const uint8_t type_hi = (type >> 8);
-	const uint8_t type_lo = (type & 0xff);
-	const uint8_t bitmap_idx = (type_lo >> 3);
-	const uint8_t bitmap_bit_mask = 1 << (7 - (type_lo & 0x07));
-
 	size_t bm_pos = 0;
 	while (bm_pos + 3 <= bm_size) {
-		uint8_t win = bm[bm_pos++];
-		uint8_t win_size = bm[bm_pos++];
+		const uint8_t w = bm[bm_pos++];
+		const uint8_t w_size = bm[bm_pos++];
 		/* Check remaining window length. */
-		if (win_size < 1 || bm_pos + win_size > bm_size)
-			return false;
+		if (w_size < 1 || bm_pos + w_size > bm_size)
+			return NULL;
 		/* Check that we have a correct window. */
-		if (win == type_hi) {
-			if (bitmap_idx < win_size) {
-				return bm[bm_pos + bitmap_idx] & bitmap_bit_mask;
-			}
-			return false;
-		} else {
-			bm_pos += win_size;
+		if (w == win) {
+			*win_size = w_size;
+			return bm + bm_pos;
 		}
+		bm_pos += w_size;
 	}
+	return NULL;
+}
 
-	return false;
+/** Test the bit of type_lo in a window returned by bitmap_window(). */
+static inline bool window_has(const uint8_t *w, uint8_t w_size, uint8_t type_lo)
+{
+	const uint8_t bitmap_idx = (type_lo >> 3);
+	const uint8_t bitmap_bit_mask = 1 << (7 - (type_lo & 0x07));
+	return w && bitmap_idx < w_size && (w[bitmap_idx] & bitmap_bit_mask);
+}
+
+bool kr_nsec_bitmap_contains_type(const uint8_t *bm, uint16_t bm_size, uint16_t type)
+{
+	if (!bm || bm_size == 0) {
+		assert(bm);
+		return false;
+	}
+	uint8_t w_size = 0;
+	const uint8_t *w = bitmap_window(bm, bm_size, type >> 8, &w_size);
+	return window_has(w, w_size, type & 0xff);
 }
 
 int kr_nsec_children_in_zone_check(const uint8_t *bm, uint16_t bm_size)
@@ -65,10 +76,13 @@ int kr_nsec_children_in_zone_check(const uint8_t *bm, uint16_t bm_size)
 	if (!bm) {
 		return kr_error(EINVAL);
 	}
+	/* All the types are in window 0, so find it just once. */
+	uint8_t w0_size = 0;
+	const uint8_t *w0 = bitmap_window(bm, bm_size, 0, &w0_size);
 	const bool parent_side =
-		kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_DNAME)
-		|| (kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_NS)
-		    && !kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_SOA)
+		window_has(w0, w0_size, KNOT_RRTYPE_DNAME)
+		|| (window_has(w0, w0_size, KNOT_RRTYPE_NS)
+		    && !window_has(w0, w0_size, KNOT_RRTYPE_SOA)
 		);
 	return parent_side ? abs(ENOENT) : kr_ok();
 	/* LATER: after refactoring, probably also check if signer name equals owner,
@@ -264,12 +278,18 @@ int kr_nsec_bitmap_nodata_check(const uint8_t *bm, uint16_t bm_size, uint16_t ty
 	if (!bm || !owner) {
 		return kr_error(EINVAL);
 	}
-	if (kr_nsec_bitmap_contains_type(bm, bm_size, type)) {
+	/* The other types checked are all in window 0, so find it just once. */
+	uint8_t w0_size = 0;
+	const uint8_t *w0 = bitmap_window(bm, bm_size, 0, &w0_size);
+	const bool has_type = type <= UINT8_MAX
+		? window_has(w0, w0_size, type)
+		: kr_nsec_bitmap_contains_type(bm, bm_size, type);
+	if (has_type) {
 		return NO_PROOF;
 	}
 
 	if (type != KNOT_RRTYPE_CNAME
-	    && kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_CNAME)) {
+	    && window_has(w0, w0_size, KNOT_RRTYPE_CNAME)) {
 		return NO_PROOF;
 	}
 	/* Special behavior around zone cuts. */
@@ -281,7 +301,7 @@ int kr_nsec_bitmap_nodata_check(const uint8_t *bm, uint16_t bm_size, uint16_t ty
 		 * See RFC4035 5.2, next-to-last paragraph.
 		 * This doesn't apply for root DS as it doesn't exist in DNS hierarchy.
 		 */
-		if (owner[0] != '\0' && kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_SOA)) {
+		if (owner[0] != '\0' && window_has(w0, w0_size, KNOT_RRTYPE_SOA)) {
 			return NO_PROOF;
 		}
 		break;
@@ -293,11 +313,10 @@ int kr_nsec_bitmap_nodata_check(const uint8_t *bm, uint16_t bm_size, uint16_t ty
 	default:
 		/* Parent-side delegation record isn't authoritative for non-DS;
 		 * see RFC6840 4.1. */
-		if (kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_NS)
-		    && !kr_nsec_bitmap_contains_type(bm, bm_size, KNOT_RRTYPE_SOA)) {
+		if (window_has(w0, w0_size, KNOT_RRTYPE_NS)
+		    && !window_has(w0, w0_size, KNOT_RRTYPE_SOA)) {
 			return NO_PROOF;
 		}
-		/* LATER(opt): perhaps short-circuit test if we repeat it here. */
 	}
 
 	return kr_ok();
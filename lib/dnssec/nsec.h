@@ -18,6 +18,8 @@
 
 #include <libknot/packet/pkt.h>
 
+#include "lib/defines.h"
+
 /**
  * Check whether bitmap contains given type.
  * @param bm      Bitmap from NSEC or NSEC3.
@@ -55,6 +57,7 @@ int kr_nsec_bitmap_nodata_check(const uint8_t *bm, uint16_t bm_size, uint16_t ty
  * @param sname      Name to be checked.
  * @return           0 or error code.
  */
+KR_EXPORT
 int kr_nsec_name_error_response_check(const knot_pkt_t *pkt, knot_section_t section_id,
                                       const knot_dname_t *sname);
 
@@ -26,6 +26,7 @@
 #include <libknot/rrtype/nsec3.h>
 
 #include "lib/defines.h"
+#include "lib/generic/lru.h"
 #include "lib/dnssec/nsec.h"
 #include "lib/dnssec/nsec3.h"
 
@@ -68,12 +69,49 @@ static int nsec3_parameters(dnssec_nsec3_params_t *params, const knot_rrset_t *n
 	return kr_ok();
 }
 
+/** Longest hash remembered (SHA-1 is the only algorithm so far). */
+#define HASH_CACHE_MAXLEN 32
+
+struct hash_cache_entry {
+	uint8_t size;
+	uint8_t data[HASH_CACHE_MAXLEN];
+};
+
+typedef lru_t(struct hash_cache_entry) hash_cache_t;
+
+/** Recently computed hashes, shared by all requests in this process.
+ * The same few names get hashed over and over (closest encloser candidates,
+ * wildcards), both in validation and when synthesizing answers from cache. */
+static hash_cache_t *hash_cache = NULL;
+
+/**
+ * Make the key for hash_cache: { alg, iterations, salt length, salt, name }.
+ * @return key length or 0 if it doesn't fit
+ */
+static size_t hash_cache_key(uint8_t *buf, size_t buf_len,
+			     const dnssec_nsec3_params_t *params, const knot_dname_t *name)
+{
+	const size_t name_len = knot_dname_size(name);
+	const size_t len = 4 + params->salt.size + name_len;
+	if (len > buf_len || params->salt.size > UINT8_MAX) {
+		return 0;
+	}
+	buf[0] = params->algorithm;
+	buf[1] = params->iterations >> 8;
+	buf[2] = params->iterations & 0xff;
+	buf[3] = params->salt.size;
+	memcpy(buf + 4, params->salt.data, params->salt.size);
+	memcpy(buf + 4 + params->salt.size, name, name_len);
+	return len;
+}
+
 /**
  * Computes a hash of a given domain name.
  * @param hash   Resulting hash, must be freed.
  * @param params NSEC3 parameters.
  * @param name   Domain name to be hashed.
- * @return       0 or error code.
+ * @return       0 or error code,
+ *               kr_error(DNSSEC_OUT_OF_RANGE) if there are too many iterations.
  */
 static int hash_name(dnssec_binary_t *hash, const dnssec_nsec3_params_t *params,
                      const knot_dname_t *name)
@@ -81,6 +119,29 @@ static int hash_name(dnssec_binary_t *hash, const dnssec_nsec3_params_t *params,
 	assert(hash && params);
 	if (!name)
 		return kr_error(EINVAL);
+	if (params->iterations > KR_NSEC3_MAX_ITERATIONS) {
+		/* Not worth the CPU; the proof is treated as insecure,
+		 * the same way as opt-out.  See RFC 9276 sec. 3.2. */
+		return kr_error(DNSSEC_OUT_OF_RANGE);
+	}
+
+	if (!hash_cache) {
+		lru_create_hash(&hash_cache, KR_NSEC3_HASH_CACHE_SIZE, NULL, NULL, LRU_HASH_SIPHASH);
+	}
+	uint8_t key[4 + UINT8_MAX + KNOT_DNAME_MAXLEN];
+	const size_t key_len = hash_cache ?
+		hash_cache_key(key, sizeof(key), params, name) : 0;
+	if (key_len) {
+		struct hash_cache_entry *e = lru_get_try(hash_cache, (char *)key, key_len);
+		if (e && e->size) {
+			int ret = dnssec_binary_alloc(hash, e->size);
+			if (ret != DNSSEC_EOK) {
+				return kr_error(ENOMEM);
+			}
+			memcpy(hash->data, e->data, e->size);
+			return kr_ok();
+		}
+	}
 
 	dnssec_binary_t dname = {
 		.size = knot_dname_size(name),
@@ -92,6 +153,14 @@ static int hash_name(dnssec_binary_t *hash, const dnssec_nsec3_params_t *params,
 		return kr_error(EINVAL);
 	}
 
+	if (key_len && hash->size <= HASH_CACHE_MAXLEN) {
+		struct hash_cache_entry *e = lru_get_new(hash_cache, (char *)key, key_len, NULL);
+		if (e) {
+			e->size = hash->size;
+			memcpy(e->data, hash->data, hash->size);
+		}
+	}
+
 	return kr_ok();
 }
 
@@ -116,6 +185,15 @@ static int read_owner_hash(dnssec_binary_t *hash, size_t max_hash_size, const kn
 	return kr_ok();
 }
 
+int kr_nsec3_hash_name(dnssec_binary_t *hash, const dnssec_nsec3_params_t *params,
+		       const knot_dname_t *name)
+{
+	if (!hash || !params) {
+		return kr_error(EINVAL);
+	}
+	return hash_name(hash, params, name);
+}
+
 #define MAX_HASH_BYTES 64
 /**
  * Closest (provable) encloser match (RFC5155 7.2.1, bullet 1).
@@ -740,7 +818,9 @@ int kr_nsec3_ref_to_unsigned(const knot_pkt_t *pkt)
 		const knot_rrset_t *covering_next_nsec3 = NULL;
 		int ret = closest_encloser_proof(pkt, KNOT_AUTHORITY, ns->owner,
 				&encloser_name, NULL, &covering_next_nsec3);
-		if (ret != 0) {
+		if (ret == kr_error(DNSSEC_OUT_OF_RANGE)) {
+			return ret; /* too many iterations */
+		} else if (ret != 0) {
 			return kr_error(EINVAL);
 		}
 
@@ -16,8 +16,12 @@
 
 #pragma once
 
+#include <dnssec/binary.h>
+#include <dnssec/nsec.h>
 #include <libknot/packet/pkt.h>
 
+#include "lib/defines.h"
+
 /**
  * Name error response check (RFC5155 7.2.2).
  * @note No RRSIGs are validated.
@@ -26,6 +30,7 @@
  * @param sname      Name to be checked.
  * @return           0 or error code.
  */
+KR_EXPORT
 int kr_nsec3_name_error_response_check(const knot_pkt_t *pkt, knot_section_t section_id,
                                        const knot_dname_t *sname);
 
@@ -80,3 +85,14 @@ int kr_nsec3_ref_to_unsigned(const knot_pkt_t *pkt);
  */
 int kr_nsec3_matches_name_and_type(const knot_rrset_t *nsec3,
 				   const knot_dname_t *name, uint16_t type);
+
+/**
+ * Compute the NSEC3 hash of a name (RFC5155 5).
+ * @param hash   Resulting hash, must be freed by dnssec_binary_free().
+ * @param params NSEC3 parameters.
+ * @param name   Domain name to be hashed.
+ * @return       0 or error code.
+ */
+KR_EXPORT
+int kr_nsec3_hash_name(dnssec_binary_t *hash, const dnssec_nsec3_params_t *params,
+		       const knot_dname_t *name);
@@ -21,6 +21,7 @@
 #include <dnssec/error.h>
 #include <dnssec/key.h>
 #include <dnssec/sign.h>
+#include <gnutls/crypto.h>
 #include <libknot/descriptor.h>
 #include <libknot/packet/rrset-wire.h>
 #include <libknot/packet/wire.h>
@@ -29,7 +30,9 @@
 #include <libknot/rrtype/ds.h>
 
 #include "lib/defines.h"
+#include "lib/dnssec.h"
 #include "lib/utils.h"
+#include "lib/generic/lru.h"
 #include "lib/dnssec/signature.h"
 
 #include "contrib/wire.h"
@@ -80,6 +83,33 @@ int kr_authenticate_referral(const knot_rrset_t *ref, const dnssec_key_t *key)
 	return kr_error(ret);
 }
 
+/** Digest of everything a successful verification depended on. */
+#define SIG_DIGEST_ALG GNUTLS_DIG_SHA256
+#define SIG_DIGEST_LEN 32
+
+typedef lru_t(uint8_t) sig_cache_t;
+
+/** Recent successful verifications in this process, keyed by SIG_DIGEST_ALG
+ * of the signed data, the signature and the key.  The same RRSIG often
+ * gets verified again shortly, e.g. by parallel requests on a cold cache. */
+static sig_cache_t *sig_cache = NULL;
+static bool sig_cache_enabled = true;
+
+void kr_dnssec_sig_cache(bool enable)
+{
+	sig_cache_enabled = enable;
+}
+
+/** Add data both to the signing context and to the digest (if any). */
+static int sign_ctx_add(dnssec_sign_ctx_t *ctx, gnutls_hash_hd_t digest,
+			const dnssec_binary_t *data)
+{
+	if (digest && gnutls_hash(digest, data->data, data->size) != 0) {
+		return kr_error(ENOMEM);
+	}
+	return dnssec_sign_add(ctx, data);
+}
+
 /**
  * Adjust TTL in wire format.
  * @param wire      RR Set in wire format.
@@ -124,13 +154,15 @@ static int adjust_wire_ttl(uint8_t *wire, size_t wire_size, uint32_t new_ttl)
  *
  * Requires signer name in RDATA in canonical form.
  *
- * \param ctx   Signing context.
- * \param rdata Pointer to RRSIG RDATA.
+ * \param ctx    Signing context.
+ * \param digest Digest to feed as well, or NULL.
+ * \param rdata  Pointer to RRSIG RDATA.
  *
  * \return Error code, KNOT_EOK if successful.
  */
 #define RRSIG_RDATA_SIGNER_OFFSET 18
-static int sign_ctx_add_self(dnssec_sign_ctx_t *ctx, const uint8_t *rdata)
+static int sign_ctx_add_self(dnssec_sign_ctx_t *ctx, gnutls_hash_hd_t digest,
+			     const uint8_t *rdata)
 {
 	assert(ctx);
 	assert(rdata);
@@ -144,77 +176,105 @@ static int sign_ctx_add_self(dnssec_sign_ctx_t *ctx, const uint8_t *rdata)
 		.size = RRSIG_RDATA_SIGNER_OFFSET,
 	};
 
-	result = dnssec_sign_add(ctx, &header);
+	result = sign_ctx_add(ctx, digest, &header);
 	if (result != DNSSEC_EOK) {
 		return result;
 	}
 
 	// signer name
 
+	/* RDATA names aren't compressed, so it's fed as it is. */
 	const uint8_t *rdata_signer = rdata + RRSIG_RDATA_SIGNER_OFFSET;
-	dnssec_binary_t signer = { 0 };
-	signer.data = knot_dname_copy(rdata_signer, NULL);
-	signer.size = knot_dname_size(signer.data);
-
-	result = dnssec_sign_add(ctx, &signer);
-	free(signer.data);
+	dnssec_binary_t signer = {
+		.data = (uint8_t *)rdata_signer,
+		.size = knot_dname_size(rdata_signer),
+	};
 
-	return result;
+	return sign_ctx_add(ctx, digest, &signer);
 }
 #undef RRSIG_RDATA_SIGNER_OFFSET
 
+/** The buffer of struct kr_sig_wire, one in this process; made anew for each RRSet. */
+static struct {
+	uint8_t data[KNOT_WIRE_MAX_PKTSIZE];
+	unsigned gen;  /**< Bumped by each new RRSet, see kr_sig_wire::gen */
+} wire_buffer;
+
+/** Make the wire of the covered RRs with the original TTL, unless it's made already. */
+static int covered_wire(struct kr_sig_wire *wire, const knot_rrset_t *covered,
+			uint32_t orig_ttl)
+{
+	if (wire->gen == 0 || wire->gen != wire_buffer.gen) {
+		int written = knot_rrset_to_wire(covered, wire_buffer.data,
+						 sizeof(wire_buffer.data), NULL);
+		if (written < 0) {
+			return written;
+		}
+		wire_buffer.gen = MAX(wire_buffer.gen + 1, 1);
+		wire->gen = wire_buffer.gen;
+		wire->len = written;
+	} else if (wire->ttl == orig_ttl) {
+		return kr_ok();
+	}
+	/* Set original ttl. */
+	int ret = adjust_wire_ttl(wire_buffer.data, wire->len, orig_ttl);
+	if (ret != 0) {
+		wire->gen = 0;
+		return ret;
+	}
+	wire->ttl = orig_ttl;
+	return kr_ok();
+}
+
 /*!
  * \brief Add covered RRs to signing context.
  *
  * Requires all DNAMEs in canonical form and all RRs ordered canonically.
  *
  * \param ctx      Signing context.
+ * \param digest   Digest to feed as well, or NULL.
  * \param covered  Covered RRs.
+ * \param wire     Their wire from a previous call, or zeroed.
  *
  * \return Error code, KNOT_EOK if successful.
  */
-static int sign_ctx_add_records(dnssec_sign_ctx_t *ctx, const knot_rrset_t *covered,
+static int sign_ctx_add_records(dnssec_sign_ctx_t *ctx, gnutls_hash_hd_t digest,
+                                const knot_rrset_t *covered, struct kr_sig_wire *wire,
                                 uint32_t orig_ttl, int trim_labels)
 {
 	if (!ctx || !covered || trim_labels < 0) {
 		return kr_error(EINVAL);
 	}
 
-	// huge block of rrsets can be optionally created
-	static uint8_t wire_buffer[KNOT_WIRE_MAX_PKTSIZE];
-	int written = knot_rrset_to_wire(covered, wire_buffer, sizeof(wire_buffer), NULL);
-	if (written < 0) {
-		return written;
-	}
-
-	/* Set original ttl. */
-	int ret = adjust_wire_ttl(wire_buffer, written, orig_ttl);
+	int ret = covered_wire(wire, covered, orig_ttl);
 	if (ret != 0) {
 		return ret;
 	}
 
 	if (!trim_labels) {
 		const dnssec_binary_t wire_binary = {
-			.size = written,
-			.data = wire_buffer
+			.size = wire->len,
+			.data = wire_buffer.data
 		};
-		return dnssec_sign_add(ctx, &wire_binary);
+		return sign_ctx_add(ctx, digest, &wire_binary);
 	}
 
 	/* RFC4035 5.3.2
 	 * Remove leftmost labels and replace them with '*.'
-	 * for each RR in covered.
+	 * for each RR in covered.  The wire is kept intact for the other signatures.
 	 */
-	uint8_t *beginp = wire_buffer;
+	const dnssec_binary_t wildcard = {
+		.size = 2,
+		.data = (uint8_t *)"\x01*"
+	};
+	const uint8_t *beginp = wire_buffer.data;
 	for (uint16_t i = 0; i < covered->rrs.rr_count; ++i) {
 		/* RR(i) = name | type | class | OrigTTL | RDATA length | RDATA */
 		for (int j = 0; j < trim_labels; ++j) {
 			assert(beginp[0]);
-			beginp = (uint8_t *) knot_wire_next_label(beginp, NULL);
+			beginp = knot_wire_next_label(beginp, NULL);
 			assert(beginp != NULL);
 		}
-		*(--beginp) = '*';
-		*(--beginp) = 1;
 		const size_t rdatalen_offset = knot_dname_size(beginp) + /* name */
 			sizeof(uint16_t) + /* type */
 			sizeof(uint16_t) + /* class */
@@ -226,9 +286,12 @@ static int sign_ctx_add_records(dnssec_sign_ctx_t *ctx, const knot_rrset_t *cove
 			rdata_size;        /* RDATA */
 		const dnssec_binary_t wire_binary = {
 			.size = rr_size,
-			.data = beginp
+			.data = (uint8_t *)beginp
 		};
-		ret = dnssec_sign_add(ctx, &wire_binary);
+		ret = sign_ctx_add(ctx, digest, &wildcard);
+		if (ret == 0) {
+			ret = sign_ctx_add(ctx, digest, &wire_binary);
+		}
 		if (ret != 0) {
 			break;
 		}
@@ -246,33 +309,58 @@ static int sign_ctx_add_records(dnssec_sign_ctx_t *ctx, const knot_rrset_t *cove
  * Requires all DNAMEs in canonical form and all RRs ordered canonically.
  *
  * \param ctx          Signing context.
+ * \param digest       Digest to feed as well, or NULL.
  * \param rrsig_rdata  RRSIG RDATA with populated fields except signature.
  * \param covered      Covered RRs.
+ * \param wire         Their wire from a previous call, or zeroed.
  *
  * \return Error code, KNOT_EOK if successful.
  */
 /* TODO -- Taken from knot/src/knot/dnssec/rrset-sign.c. Re-write for better fit needed. */
-static int sign_ctx_add_data(dnssec_sign_ctx_t *ctx, const uint8_t *rrsig_rdata,
-                             const knot_rrset_t *covered, uint32_t orig_ttl, int trim_labels)
+static int sign_ctx_add_data(dnssec_sign_ctx_t *ctx, gnutls_hash_hd_t digest,
+                             const uint8_t *rrsig_rdata, const knot_rrset_t *covered,
+                             struct kr_sig_wire *wire, uint32_t orig_ttl, int trim_labels)
 {
-	int result = sign_ctx_add_self(ctx, rrsig_rdata);
+	int result = sign_ctx_add_self(ctx, digest, rrsig_rdata);
 	if (result != KNOT_EOK) {
 		return result;
 	}
 
-	return sign_ctx_add_records(ctx, covered, orig_ttl, trim_labels);
+	return sign_ctx_add_records(ctx, digest, covered, wire, orig_ttl, trim_labels);
+}
+
+/** Finish the digest of a verification: add the signature and the public key.
+ * The digest handle is consumed.  \return 0 or error code. */
+static int sig_digest_finish(gnutls_hash_hd_t digest, const dnssec_binary_t *signature,
+			     const dnssec_key_t *key, uint8_t out[SIG_DIGEST_LEN])
+{
+	dnssec_binary_t key_rdata = { 0, NULL };
+	int ret = dnssec_key_get_rdata(key, &key_rdata);
+	if (ret == DNSSEC_EOK) {
+		ret = gnutls_hash(digest, signature->data, signature->size) != 0
+		   || gnutls_hash(digest, key_rdata.data, key_rdata.size) != 0;
+	}
+	gnutls_hash_deinit(digest, ret == 0 ? out : NULL);
+	return ret == 0 ? kr_ok() : kr_error(EINVAL);
 }
 
 int kr_check_signature(const knot_rrset_t *rrsigs, size_t pos,
                        const dnssec_key_t *key, const knot_rrset_t *covered,
-                       int trim_labels)
+                       int trim_labels, struct kr_sig_wire *wire,
+                       dnssec_sign_ctx_t **sign_ctx_reuse, int *budget)
 {
 	if (!rrsigs || !key || !dnssec_key_can_verify(key)) {
 		return kr_error(EINVAL);
 	}
+	struct kr_sig_wire wire_local = { 0 };
+	if (!wire) {
+		wire = &wire_local;
+	}
 
 	int ret = 0;
 	dnssec_sign_ctx_t *sign_ctx = NULL;
+	gnutls_hash_hd_t digest = NULL;
+	uint8_t digest_val[SIG_DIGEST_LEN];
 	dnssec_binary_t signature = { 0, NULL };
 
 	knot_rrsig_signature(&rrsigs->rrs, pos, &signature.data, &signature.size);
@@ -281,7 +369,15 @@ int kr_check_signature(const knot_rrset_t *rrsigs, size_t pos,
 		goto fail;
 	}
 
-	if (dnssec_sign_new(&sign_ctx, key) != 0) {
+	/* The context of a key only keeps the data being verified. */
+	if (sign_ctx_reuse && *sign_ctx_reuse) {
+		sign_ctx = *sign_ctx_reuse;
+		*sign_ctx_reuse = NULL;
+		if (dnssec_sign_init(sign_ctx) != 0) {
+			ret = kr_error(ENOMEM);
+			goto fail;
+		}
+	} else if (dnssec_sign_new(&sign_ctx, key) != 0) {
 		ret = kr_error(ENOMEM);
 		goto fail;
 	}
@@ -290,19 +386,59 @@ int kr_check_signature(const knot_rrset_t *rrsigs, size_t pos,
 	const knot_rdata_t *rr_data = knot_rdataset_at(&rrsigs->rrs, pos);
 	uint8_t *rdata = knot_rdata_data(rr_data);
 
-	if (sign_ctx_add_data(sign_ctx, rdata, covered, orig_ttl, trim_labels) != 0) {
+	if (sig_cache_enabled && !sig_cache) {
+		lru_create(&sig_cache, KR_DNSSEC_SIG_CACHE_SIZE, NULL, NULL);
+	}
+	if (sig_cache_enabled && sig_cache && gnutls_hash_init(&digest, SIG_DIGEST_ALG) != 0) {
+		digest = NULL; /* just verify without remembering */
+	}
+
+	if (sign_ctx_add_data(sign_ctx, digest, rdata, covered, wire, orig_ttl, trim_labels) != 0) {
 		ret = kr_error(ENOMEM);
 		goto fail;
 	}
 
+	bool digested = false;
+	if (digest) {
+		digested = sig_digest_finish(digest, &signature, key, digest_val) == 0;
+		digest = NULL;
+	}
+	if (digested) {
+		uint8_t *ok = lru_get_try(sig_cache, (char *)digest_val, sizeof(digest_val));
+		if (ok && *ok) {
+			ret = kr_ok();
+			goto fail;
+		}
+	}
+
+	if (budget) {
+		if (*budget <= 0) {
+			ret = kr_error(E2BIG);
+			goto fail;
+		}
+		--*budget;
+	}
 	if (dnssec_sign_verify(sign_ctx, &signature) != 0) {
 		ret = kr_error(EBADMSG);
 		goto fail;
 	}
 
+	if (digested) {
+		uint8_t *ok = lru_get_new(sig_cache, (char *)digest_val, sizeof(digest_val), NULL);
+		if (ok) {
+			*ok = 1;
+		}
+	}
 	ret = kr_ok();
 
 fail:
-	dnssec_sign_free(sign_ctx);
+	if (digest) {
+		gnutls_hash_deinit(digest, NULL);
+	}
+	if (sign_ctx_reuse && sign_ctx && ret != kr_error(ENOMEM)) {
+		*sign_ctx_reuse = sign_ctx;
+	} else {
+		dnssec_sign_free(sign_ctx);
+	}
 	return ret;
 }
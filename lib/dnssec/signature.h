@@ -17,6 +17,7 @@
 #pragma once
 
 #include <dnssec/key.h>
+#include <dnssec/sign.h>
 #include <libknot/rrset.h>
 
 /**
@@ -28,6 +29,14 @@
  */
 int kr_authenticate_referral(const knot_rrset_t *ref, const dnssec_key_t *key);
 
+/** Wire of a covered RRSet, made by kr_check_signature() once for all its signatures.
+ * Zero it for each RRSet; only the last one made is kept. */
+struct kr_sig_wire {
+	unsigned gen;  /**< Generation of the buffer it's in, 0 if not made yet */
+	int len;
+	uint32_t ttl;  /**< The original TTL written in it */
+};
+
 /**
  * Check the signature of the supplied RRSet.
  * @param rrsigs      RRSet containing signatures.
@@ -35,8 +44,15 @@ int kr_authenticate_referral(const knot_rrset_t *ref, const dnssec_key_t *key);
  * @param key         Key to be used to validate the signature.
  * @param covered     The covered RRSet.
  * @param trim_labels Number of the leftmost labels to be removed and replaced with '*.'.
- * @return            0 if signature valid, error code else.
+ * @param wire        Wire of the covered RRSet from the previous call, or NULL.
+ * @param sign_ctx    Verification context of the key to reuse, created on the first use
+ *                    and owned by the caller (dnssec_sign_free()); NULL for a one-off.
+ * @param budget      Public-key operations left, decremented by each; the signatures
+ *                    remembered as verified don't count.  NULL for no limit.
+ * @return            0 if signature valid, kr_error(E2BIG) if out of the budget,
+ *                    error code else.
  */
 int kr_check_signature(const knot_rrset_t *rrsigs, size_t pos,
                        const dnssec_key_t *key, const knot_rrset_t *covered,
-                       int trim_labels);
+                       int trim_labels, struct kr_sig_wire *wire,
+                       dnssec_sign_ctx_t **sign_ctx, int *budget);
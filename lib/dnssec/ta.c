@@ -14,6 +14,8 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include <contrib/cleanup.h>
 #include <libknot/descriptor.h>
 #include <libknot/rdataset.h>
@@ -27,23 +29,59 @@
 #include "lib/resolve.h"
 #include "lib/utils.h"
 
-knot_rrset_t *kr_ta_get(map_t *trust_anchors, const knot_dname_t *name)
+/** @internal Whether some label of the name contains a zero byte. */
+static bool dname_has_zero(const knot_dname_t *name)
 {
-	return map_get(trust_anchors, (const char *)name);
+	return knot_dname_size(name) != strlen((const char *)name) + 1;
 }
 
-const knot_dname_t *kr_ta_get_longest_name(map_t *trust_anchors, const knot_dname_t *name)
+/** @internal Key of the name in the store, lf[0] is the length. */
+static int ta_key(uint8_t *lf, const knot_dname_t *name)
 {
-	while(name) {
-		if (kr_ta_get(trust_anchors, name)) {
-			return name;
-		}
-		if (name[0] == '\0') {
-			break;
-		}
+	/* Such lookup format would be ambiguous. */
+	if (dname_has_zero(name)) {
+		return kr_error(EINVAL);
+	}
+	return kr_dname_lf(lf, name, false);
+}
+
+knot_rrset_t *kr_ta_get(trie_t *trust_anchors, const knot_dname_t *name)
+{
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	if (ta_key(lf, name) != 0) {
+		return NULL;
+	}
+	trie_val_t *val = trie_get_try(trust_anchors, (const char *)lf + 1, lf[0]);
+	return val ? *val : NULL;
+}
+
+const knot_dname_t *kr_ta_get_longest_name(trie_t *trust_anchors, const knot_dname_t *name)
+{
+	if (!name) {
+		return NULL;
+	}
+	/* The labels with a zero byte are below any TA. */
+	while (name[0] != '\0' && dname_has_zero(name)) {
 		name = knot_wire_next_label(name, NULL);
 	}
-	return NULL;
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	if (kr_dname_lf(lf, name, false) != 0) {
+		return NULL;
+	}
+	/* All the keys end by a zero byte, which only ends labels here,
+	 * so a key that is a prefix of the LF is the LF of a suffix. */
+	uint32_t len = 0;
+	if (!trie_get_prefix(trust_anchors, (const char *)lf + 1, lf[0], &len)) {
+		return NULL;
+	}
+	int ta_labels = 0;
+	for (uint32_t i = 1; i <= len; ++i) {
+		ta_labels += lf[i] == '\0';
+	}
+	for (int i = knot_dname_labels(name, NULL); i > ta_labels; --i) {
+		name = knot_wire_next_label(name, NULL);
+	}
+	return name;
 }
 
 /* @internal Create DS from DNSKEY, caller MUST free dst if successful. */
@@ -77,31 +115,40 @@ static int dnskey2ds(dnssec_binary_t *dst, const knot_dname_t *owner, const uint
 }
 
 /* @internal Insert new TA to trust anchor set, rdata MUST be of DS type. */
-static int insert_ta(map_t *trust_anchors, const knot_dname_t *name,
+static int insert_ta(trie_t *trust_anchors, const knot_dname_t *name,
                      uint32_t ttl, const uint8_t *rdata, uint16_t rdlen)
 {
-	bool is_new_key = false;
-	knot_rrset_t *ta_rr = kr_ta_get(trust_anchors, name);
-	if (!ta_rr) {
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	int ret = ta_key(lf, name);
+	if (ret != 0) {
+		return ret;
+	}
+	trie_val_t *val = trie_get_ins(trust_anchors, (const char *)lf + 1, lf[0]);
+	if (!val) {
+		return kr_error(ENOMEM);
+	}
+	knot_rrset_t *ta_rr = *val;
+	const bool is_new_key = !ta_rr;
+	if (is_new_key) {
 		ta_rr = knot_rrset_new(name, KNOT_RRTYPE_DS, KNOT_CLASS_IN, NULL);
-		is_new_key = true;
 	}
 	/* Merge-in new key data */
 	if (!ta_rr || (rdlen > 0 && knot_rrset_add_rdata(ta_rr, rdata, rdlen, ttl, NULL) != 0)) {
-		knot_rrset_free(&ta_rr, NULL);
+		if (is_new_key) {
+			knot_rrset_free(&ta_rr, NULL);
+			trie_del(trust_anchors, (const char *)lf + 1, lf[0], NULL);
+		}
 		return kr_error(ENOMEM);
 	}
+	*val = ta_rr;
 	if(VERBOSE_STATUS) {
 		auto_free char *rr_text = kr_rrset_text(ta_rr);
 		kr_log_verbose("[ ta ] new state of trust anchors for a domain: %s\n", rr_text);
 	}
-	if (is_new_key) {
-		return map_set(trust_anchors, (const char *)name, ta_rr);
-	}
 	return kr_ok();
 }
 
-int kr_ta_add(map_t *trust_anchors, const knot_dname_t *name, uint16_t type,
+int kr_ta_add(trie_t *trust_anchors, const knot_dname_t *name, uint16_t type,
               uint32_t ttl, const uint8_t *rdata, uint16_t rdlen)
 {
 	if (!trust_anchors || !name) {
@@ -126,18 +173,9 @@ int kr_ta_add(map_t *trust_anchors, const knot_dname_t *name, uint16_t type,
 	}
 }
 
-int kr_ta_covers(map_t *trust_anchors, const knot_dname_t *name)
+int kr_ta_covers(trie_t *trust_anchors, const knot_dname_t *name)
 {
-	while(name) {
-		if (kr_ta_get(trust_anchors, name)) {
-			return true;
-		}
-		if (name[0] == '\0') {
-			return false;
-		}
-		name = knot_wire_next_label(name, NULL);
-	}
-	return false;
+	return kr_ta_get_longest_name(trust_anchors, name) != NULL;
 }
 
 bool kr_ta_covers_qry(struct kr_context *ctx, const knot_dname_t *name,
@@ -152,32 +190,33 @@ bool kr_ta_covers_qry(struct kr_context *ctx, const knot_dname_t *name,
 			return false;
 		}
 	}
-	return kr_ta_covers(&ctx->trust_anchors, name)
-		&& !kr_ta_covers(&ctx->negative_anchors, name);
+	return kr_ta_covers(ctx->trust_anchors, name)
+		&& !kr_ta_covers(ctx->negative_anchors, name);
 }
 
 /* Delete record data */
-static int del_record(const char *k, void *v, void *ext)
+static int del_record(trie_val_t *val, void *baton)
 {
-	knot_rrset_t *ta_rr = v;
+	knot_rrset_t *ta_rr = *val;
 	if (ta_rr) {
 		knot_rrset_free(&ta_rr, NULL);
 	}
 	return 0;
 }
 
-int kr_ta_del(map_t *trust_anchors, const knot_dname_t *name)
+int kr_ta_del(trie_t *trust_anchors, const knot_dname_t *name)
 {
-	knot_rrset_t *ta_rr = kr_ta_get(trust_anchors, name);
-	if (ta_rr) {
-		del_record(NULL, ta_rr, NULL);
-		map_del(trust_anchors, (const char *)name);
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	trie_val_t val;
+	if (ta_key(lf, name) == 0
+	    && trie_del(trust_anchors, (const char *)lf + 1, lf[0], &val) == KNOT_EOK) {
+		del_record(&val, NULL);
 	}
 	return kr_ok();
 }
 
-void kr_ta_clear(map_t *trust_anchors)
+void kr_ta_clear(trie_t *trust_anchors)
 {
-	map_walk(trust_anchors, del_record, NULL);
-	map_clear(trust_anchors);
+	trie_apply(trust_anchors, del_record, NULL);
+	trie_clear(trust_anchors);
 }
@@ -16,9 +16,15 @@
 
 #pragma once
 
-#include "lib/generic/map.h"
+#include "lib/generic/trie.h"
 #include <libknot/rrset.h>
 
+/*
+ * The trust store is a trie keyed by the names in lookup format, see kr_dname_lf(),
+ * so the closest TA of a name is found by a single longest-prefix lookup.
+ * Names with a zero byte inside a label can't be stored.
+ */
+
 /**
  * Find TA RRSet by name.
  * @param  trust_anchors trust store
@@ -26,7 +32,7 @@
  * @return non-empty RRSet or NULL
  */
 KR_EXPORT
-knot_rrset_t *kr_ta_get(map_t *trust_anchors, const knot_dname_t *name);
+knot_rrset_t *kr_ta_get(trie_t *trust_anchors, const knot_dname_t *name);
 
 /**
  * Add TA to trust store. DS or DNSKEY types are supported.
@@ -39,7 +45,7 @@ knot_rrset_t *kr_ta_get(map_t *trust_anchors, const knot_dname_t *name);
  * @return 0 or an error
  */
 KR_EXPORT
-int kr_ta_add(map_t *trust_anchors, const knot_dname_t *name, uint16_t type,
+int kr_ta_add(trie_t *trust_anchors, const knot_dname_t *name, uint16_t type,
                uint32_t ttl, const uint8_t *rdata, uint16_t rdlen);
 
 /**
@@ -50,7 +56,7 @@ int kr_ta_add(map_t *trust_anchors, const knot_dname_t *name, uint16_t type,
  * @return boolean
  */
 KR_EXPORT KR_PURE
-int kr_ta_covers(map_t *trust_anchors, const knot_dname_t *name);
+int kr_ta_covers(trie_t *trust_anchors, const knot_dname_t *name);
 
 struct kr_context;
 /**
@@ -67,14 +73,14 @@ bool kr_ta_covers_qry(struct kr_context *ctx, const knot_dname_t *name,
  * @return 0 or an error
  */
 KR_EXPORT
-int kr_ta_del(map_t *trust_anchors, const knot_dname_t *name);
+int kr_ta_del(trie_t *trust_anchors, const knot_dname_t *name);
 
 /**
  * Clear trust store.
  * @param trust_anchors trust store
  */
 KR_EXPORT
-void kr_ta_clear(map_t *trust_anchors);
+void kr_ta_clear(trie_t *trust_anchors);
 
 /**
  * Return TA with the longest name that covers given name.
@@ -84,4 +90,4 @@ void kr_ta_clear(map_t *trust_anchors);
 	   if not NULL, points inside the name parameter.
  */
 KR_EXPORT
-const knot_dname_t *kr_ta_get_longest_name(map_t *trust_anchors, const knot_dname_t *name);
+const knot_dname_t *kr_ta_get_longest_name(trie_t *trust_anchors, const knot_dname_t *name);
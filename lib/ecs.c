@@ -0,0 +1,154 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <libknot/rrtype/opt.h>
+
+#include "lib/ecs.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+
+/** Whether the name is within any of the zones. */
+static bool zones_cover(trie_t *zones, const knot_dname_t *name)
+{
+	if (!zones || trie_weight(zones) == 0) {
+		return false;
+	}
+	for (;;) {
+		if (trie_get_try(zones, (const char *)name, knot_dname_size(name))) {
+			return true;
+		}
+		if (!name[0]) {
+			return false;
+		}
+		name = knot_wire_next_label(name, NULL);
+	}
+}
+
+/** Whether the IPv4 address (in network order) is of no use outside, RFC 7871 7.1.2. */
+static bool local4(const uint8_t *a)
+{
+	return a[0] == 0 || a[0] == 10 || a[0] == 127
+		|| (a[0] == 100 && (a[1] & 0xc0) == 64)    /* 100.64.0.0/10 */
+		|| (a[0] == 169 && a[1] == 254)
+		|| (a[0] == 172 && (a[1] & 0xf0) == 16)    /* 172.16.0.0/12 */
+		|| (a[0] == 192 && a[1] == 168);
+}
+
+/** Whether the client's address is loopback or private, so it's not sent. */
+static bool addr_local(const struct sockaddr *addr)
+{
+	const uint8_t *a = (const uint8_t *)kr_inaddr(addr);
+	if (addr->sa_family == AF_INET) {
+		return local4(a);
+	}
+	static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+	if (memcmp(a, mapped, sizeof(mapped)) == 0) {
+		return local4(a + sizeof(mapped));
+	}
+	const struct in6_addr *a6 = (const struct in6_addr *)a;
+	return IN6_IS_ADDR_UNSPECIFIED(a6) || IN6_IS_ADDR_LOOPBACK(a6)
+		|| IN6_IS_ADDR_LINKLOCAL(a6)
+		|| (a[0] & 0xfe) == 0xfc;    /* fc00::/7, RFC 4193 */
+}
+
+bool kr_ecs_covers(const struct kr_ecs_conf *conf, const struct sockaddr *addr,
+		   const knot_dname_t *name)
+{
+	if (!conf || !addr || !name
+	    || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+	    || (addr->sa_family == AF_INET ? conf->source4 : conf->source6) == 0
+	    || addr_local(addr)) {
+		return false;
+	}
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	if (knot_dname_to_wire(lower, name, sizeof(lower)) < 0) {
+		return false;
+	}
+	knot_dname_to_lower(lower);
+	return zones_cover(conf->zones, lower);
+}
+
+bool kr_ecs_get(const struct kr_query *qry, const knot_dname_t *name,
+		knot_edns_client_subnet_t *ecs)
+{
+	const struct kr_request *req = qry->request;
+	const struct kr_ecs_conf *conf = &req->ctx->ecs;
+	const struct sockaddr *addr = req->qsource.addr;
+	if (!kr_ecs_covers(conf, addr, name)) {
+		return false;
+	}
+	memset(ecs, 0, sizeof(*ecs));
+	switch (addr->sa_family) {
+	case AF_INET:
+		ecs->family = KNOT_ADDR_FAMILY_IPV4;
+		ecs->source_len = MIN(conf->source4, 32);
+		break;
+	case AF_INET6:
+		ecs->family = KNOT_ADDR_FAMILY_IPV6;
+		ecs->source_len = MIN(conf->source6, 128);
+		break;
+	default:
+		return false;
+	}
+	if (ecs->source_len == 0) {
+		return false;
+	}
+	/* Only the prefix leaves, the rest of the address is zeroed. */
+	const uint8_t *bytes = (const uint8_t *)kr_inaddr(addr);
+	const int full = ecs->source_len / 8, bits = ecs->source_len % 8;
+	memcpy(ecs->address, bytes, full);
+	if (bits) {
+		ecs->address[full] = bytes[full] & (0xff << (8 - bits));
+	}
+	return true;
+}
+
+int kr_ecs_put(knot_rrset_t *opt_rr, const knot_edns_client_subnet_t *ecs, knot_mm_t *mm)
+{
+	const uint16_t size = knot_edns_client_subnet_size(ecs);
+	uint8_t *data = NULL;
+	int ret = knot_edns_reserve_unique_option(opt_rr, KNOT_EDNS_OPTION_CLIENT_SUBNET,
+						  size, &data, mm);
+	if (ret == KNOT_EOK) {
+		ret = knot_edns_client_subnet_write(data, size, ecs);
+	}
+	return ret == KNOT_EOK ? kr_ok() : kr_error(EINVAL);
+}
+
+int kr_ecs_scope(const knot_pkt_t *answer, const knot_edns_client_subnet_t *ecs)
+{
+	uint8_t *option = answer->opt_rr
+		? knot_edns_get_option(answer->opt_rr, KNOT_EDNS_OPTION_CLIENT_SUBNET) : NULL;
+	if (!option) {
+		return 0; /* the server doesn't tailor it */
+	}
+	knot_edns_client_subnet_t got;
+	memset(&got, 0, sizeof(got));
+	if (knot_edns_client_subnet_parse(&got, knot_edns_opt_get_data(option),
+					  knot_edns_opt_get_length(option)) != KNOT_EOK) {
+		return kr_error(EINVAL);
+	}
+	/* RFC 7871 7.3: the family, source prefix and address must be the same as sent. */
+	if (got.family != ecs->family || got.source_len != ecs->source_len
+	    || memcmp(got.address, ecs->address, sizeof(got.address)) != 0) {
+		return kr_error(EINVAL);
+	}
+	/* Longer scopes than the source apply to the whole source prefix. */
+	return MIN(got.scope_len, ecs->source_len);
+}
@@ -0,0 +1,97 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file ecs.h
+ * @brief EDNS Client Subnet (RFC 7871) towards the selected zones.
+ *
+ * The queries sent to the servers of the zones of kr_ecs_conf::zones
+ * (the zone cut is within one of them) carry the prefix of the client's
+ * address, so that e.g. CDNs can tailor their answers; the servers above them,
+ * e.g. of the root and TLDs, never get it.  Loopback and private addresses
+ * of the clients aren't sent at all (RFC 7871 7.1.2).  An answer with a non-zero scope is cached under that prefix
+ * of the client, see the CACHE_KEY_DEF in lib/cache/ecs.c, and it's only
+ * used for the clients in the same subnet.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	knot_edns_client_subnet_t ecs;
+ * 	if (kr_ecs_get(qry, qry->zone_cut.name, &ecs)) {
+ * 		kr_ecs_put(pkt->opt_rr, &ecs, &pkt->mm);
+ * 	}
+ * 	...
+ * 	int scope = kr_ecs_scope(answer, &ecs); // 0 if it's for any client, e.g. not sent
+ * @endcode
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libknot/packet/pkt.h>
+#include <libknot/rrtype/opt.h>
+
+#include "lib/defines.h"
+#include "lib/generic/trie.h"
+
+struct kr_query;
+struct sockaddr;
+
+/** Default bits of the client's IPv4 and IPv6 addresses sent. */
+#define KR_ECS_SOURCE4 24
+#define KR_ECS_SOURCE6 56
+/** Default limit of the tailored answers cached for a name and type. */
+#define KR_ECS_SCOPES_MAX 64
+
+/** Where to send the client subnet, see kr_context::ecs. */
+struct kr_ecs_conf {
+	trie_t *zones;       /**< Zones by the lower-cased wire name; NULL or empty for none */
+	uint8_t source4;     /**< Bits of the client's IPv4 address sent */
+	uint8_t source6;     /**< Bits of the client's IPv6 address sent */
+	uint16_t scopes_max; /**< Tailored answers cached for a name and type; others aren't cached */
+};
+
+/**
+ * Get the client subnet of the query's request, if the name is within the zones.
+ * The name is the zone cut when sending, and the query name for the cache,
+ * where an answer the subnet wasn't sent with has scope 0.
+ * @return false if it's not to be sent, e.g. for internal requests or local clients
+ */
+KR_EXPORT
+bool kr_ecs_get(const struct kr_query *qry, const knot_dname_t *name,
+		knot_edns_client_subnet_t *ecs);
+
+/**
+ * Whether the queries of the client for the name get its subnet, see kr_ecs_get();
+ * the answers cached without it (scope 0) aren't for them then.
+ * The name may be in any case.
+ */
+KR_EXPORT
+bool kr_ecs_covers(const struct kr_ecs_conf *conf, const struct sockaddr *addr,
+		   const knot_dname_t *name);
+
+/** Add the client subnet to the OPT RR of an outgoing query. */
+KR_EXPORT
+int kr_ecs_put(knot_rrset_t *opt_rr, const knot_edns_client_subnet_t *ecs, knot_mm_t *mm);
+
+/**
+ * Get the scope of an answer to a query sent with `ecs`.
+ * @return the prefix length the answer is tailored to, at most the source one;
+ *	0 if it's for any client; kr_error(EINVAL) if the option doesn't match `ecs`
+ */
+KR_EXPORT
+int kr_ecs_scope(const knot_pkt_t *answer, const knot_edns_client_subnet_t *ecs);
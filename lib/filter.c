@@ -0,0 +1,298 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/filter.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+#include "lib/generic/array.h"
+
+/** Deepest stack of results a rule may need. */
+#define FILTER_STACK 32
+
+struct filter_insn {
+	uint8_t op;          /**< enum kr_filter_op */
+	uint8_t family;      /**< Of the subnet */
+	uint16_t bits;       /**< Length of the subnet */
+	uint32_t num;
+	knot_dname_t *name;  /**< Lowercased, owned */
+	uint8_t addr[16];
+};
+
+struct filter_rule {
+	uint32_t id;
+	bool active;
+	int depth;           /**< Of the result stack after the instructions */
+	uint64_t count;
+	array_t(struct filter_insn) insns;
+};
+
+struct kr_filter {
+	array_t(struct filter_rule) rules;
+	kr_filter_cb cb;
+};
+
+static struct filter_rule *rule_find(const struct kr_filter *f, uint32_t id, size_t *at)
+{
+	for (size_t i = 0; f && i < f->rules.len; ++i) {
+		if (f->rules.at[i].id == id) {
+			if (at) {
+				*at = i;
+			}
+			return &f->rules.at[i];
+		}
+	}
+	return NULL;
+}
+
+static void rule_clear(struct filter_rule *r)
+{
+	for (size_t i = 0; i < r->insns.len; ++i) {
+		free(r->insns.at[i].name);
+	}
+	array_clear(r->insns);
+}
+
+struct kr_filter *kr_filter_create(kr_filter_cb cb)
+{
+	struct kr_filter *f = calloc(1, sizeof(*f));
+	if (f) {
+		array_init(f->rules);
+		f->cb = cb;
+	}
+	return f;
+}
+
+void kr_filter_free(struct kr_filter *f)
+{
+	if (!f) {
+		return;
+	}
+	for (size_t i = 0; i < f->rules.len; ++i) {
+		rule_clear(&f->rules.at[i]);
+	}
+	array_clear(f->rules);
+	free(f);
+}
+
+int kr_filter_add(struct kr_filter *f, uint32_t id)
+{
+	if (!f) {
+		return kr_error(EINVAL);
+	}
+	if (rule_find(f, id, NULL)) {
+		return kr_error(EEXIST);
+	}
+	struct filter_rule r = { .id = id, .active = true };
+	array_init(r.insns);
+	return array_push(f->rules, r) < 0 ? kr_error(ENOMEM) : kr_ok();
+}
+
+int kr_filter_push(struct kr_filter *f, uint32_t id, int op, const void *arg, uint32_t num)
+{
+	struct filter_rule *r = rule_find(f, id, NULL);
+	if (!r) {
+		return kr_error(ENOENT);
+	}
+	struct filter_insn insn = { .op = op, .num = num };
+	int depth = r->depth + 1;
+	switch (op) {
+	case KR_FILTER_QNAME: {
+		int len = arg ? knot_dname_size(arg) : 0;
+		if (len <= 0 || len > KNOT_DNAME_MAXLEN || !(insn.name = malloc(len))) {
+			return kr_error(EINVAL);
+		}
+		memcpy(insn.name, arg, len);
+		knot_dname_to_lower(insn.name);
+		break;
+	}
+	case KR_FILTER_SRC:
+	case KR_FILTER_DST: {
+		int bits = arg ? kr_straddr_subnet(insn.addr, arg) : kr_error(EINVAL);
+		if (bits < 0) {
+			return kr_error(EINVAL);
+		}
+		insn.family = kr_straddr_family(arg);
+		insn.bits = bits;
+		break;
+	}
+	case KR_FILTER_QTYPE:
+	case KR_FILTER_CALLBACK:
+		break;
+	case KR_FILTER_AND:
+	case KR_FILTER_OR:
+		depth = r->depth - 1;
+		if (r->depth < 2) {
+			return kr_error(EINVAL);
+		}
+		break;
+	case KR_FILTER_NOT:
+		depth = r->depth;
+		if (r->depth < 1) {
+			return kr_error(EINVAL);
+		}
+		break;
+	default:
+		return kr_error(EINVAL);
+	}
+	if (depth > FILTER_STACK) {
+		free(insn.name);
+		return kr_error(ENOSPC);
+	}
+	if (array_push(r->insns, insn) < 0) {
+		free(insn.name);
+		return kr_error(ENOMEM);
+	}
+	r->depth = depth;
+	return kr_ok();
+}
+
+int kr_filter_del(struct kr_filter *f, uint32_t id)
+{
+	size_t at = 0;
+	struct filter_rule *r = rule_find(f, id, &at);
+	if (!r) {
+		return kr_error(ENOENT);
+	}
+	rule_clear(r);
+	/* Keep the order, unlike array_del(). */
+	memmove(r, r + 1, (f->rules.len - at - 1) * sizeof(*r));
+	f->rules.len -= 1;
+	return kr_ok();
+}
+
+int kr_filter_set_active(struct kr_filter *f, uint32_t id, bool active)
+{
+	struct filter_rule *r = rule_find(f, id, NULL);
+	if (!r) {
+		return kr_error(ENOENT);
+	}
+	r->active = active;
+	return kr_ok();
+}
+
+int64_t kr_filter_count(const struct kr_filter *f, uint32_t id)
+{
+	const struct filter_rule *r = rule_find(f, id, NULL);
+	return r ? (int64_t)r->count : -1;
+}
+
+/** Whether the name is the zone or below it; the zone is lowercased. */
+static bool name_within(const knot_dname_t *name, const knot_dname_t *zone)
+{
+	int skip = knot_dname_labels(name, NULL) - knot_dname_labels(zone, NULL);
+	if (skip < 0) {
+		return false;
+	}
+	for (int i = 0; i < skip; ++i) {
+		name += *name + 1;
+	}
+	/* Label lengths are below 'A', so they compare as they are. */
+	for (size_t i = 0, len = knot_dname_size(zone); i < len; ++i) {
+		if (tolower(name[i]) != zone[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool addr_within(const struct sockaddr *addr, const struct filter_insn *insn)
+{
+	return addr && kr_inaddr_family(addr) == insn->family &&
+		kr_bitcmp(kr_inaddr(addr), (const char *)insn->addr, insn->bits) == 0;
+}
+
+static bool rule_match(const struct kr_filter *f, const struct filter_rule *r,
+		       struct kr_request *req, struct kr_query *qry)
+{
+	if (r->insns.len == 0) {
+		return true;
+	}
+	if (r->depth != 1) {
+		return false; /* incomplete */
+	}
+	bool stack[FILTER_STACK];
+	int top = 0;
+	for (size_t i = 0; i < r->insns.len; ++i) {
+		const struct filter_insn *insn = &r->insns.at[i];
+		switch (insn->op) {
+		case KR_FILTER_QNAME:
+			stack[top++] = qry && name_within(qry->sname, insn->name);
+			break;
+		case KR_FILTER_SRC:
+			stack[top++] = addr_within(req->qsource.addr, insn);
+			break;
+		case KR_FILTER_DST:
+			stack[top++] = addr_within(req->qsource.dst_addr, insn);
+			break;
+		case KR_FILTER_QTYPE:
+			stack[top++] = qry && qry->stype == insn->num;
+			break;
+		case KR_FILTER_CALLBACK:
+			stack[top++] = f->cb && f->cb(req, qry, insn->num);
+			break;
+		case KR_FILTER_AND:
+			top -= 1;
+			stack[top - 1] = stack[top - 1] && stack[top];
+			break;
+		case KR_FILTER_OR:
+			top -= 1;
+			stack[top - 1] = stack[top - 1] || stack[top];
+			break;
+		case KR_FILTER_NOT:
+			stack[top - 1] = !stack[top - 1];
+			break;
+		}
+	}
+	return stack[0];
+}
+
+static int filter_match(struct kr_filter *f, size_t from, struct kr_request *req,
+			struct kr_query *qry, uint32_t *id)
+{
+	for (size_t i = from; i < f->rules.len; ++i) {
+		struct filter_rule *r = &f->rules.at[i];
+		if (r->active && rule_match(f, r, req, qry)) {
+			r->count += 1;
+			*id = r->id;
+			return kr_ok();
+		}
+	}
+	return kr_error(ENOENT);
+}
+
+int kr_filter_match(struct kr_filter *f, struct kr_request *req, struct kr_query *qry,
+		    uint32_t *id)
+{
+	if (!f || !req || !id) {
+		return kr_error(EINVAL);
+	}
+	return filter_match(f, 0, req, qry, id);
+}
+
+int kr_filter_next(struct kr_filter *f, struct kr_request *req, struct kr_query *qry,
+		   uint32_t *id)
+{
+	size_t at = 0;
+	if (!req || !id || !rule_find(f, *id, &at)) {
+		return kr_error(EINVAL);
+	}
+	return filter_match(f, at + 1, req, qry, id);
+}
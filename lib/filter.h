@@ -0,0 +1,115 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file filter.h
+ * @brief Ordered list of request filter rules, evaluated at once.
+ *
+ * Each rule is a short program in postfix notation, e.g. "qname, src, AND",
+ * so that the rules built by a firewall (see modules/daf) are matched without
+ * calling into Lua for each rule.  The first active rule matching wins.
+ * A rule without any instruction matches everything.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	struct kr_filter *f = kr_filter_create(NULL);
+ * 	kr_filter_add(f, 1);
+ * 	kr_filter_push(f, 1, KR_FILTER_QNAME, "\7example\3com", 0);
+ * 	kr_filter_push(f, 1, KR_FILTER_SRC, "192.0.2.0/24", 0);
+ * 	kr_filter_push(f, 1, KR_FILTER_AND, NULL, 0);
+ * 	uint32_t id;
+ * 	if (kr_filter_match(f, req, qry, &id) == 0) {
+ * 		// id == 1
+ * 	}
+ * @endcode
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+struct kr_request;
+struct kr_query;
+
+/** Instructions, each pushes a result or combines the last two. */
+enum kr_filter_op {
+	KR_FILTER_QNAME = 0,  /**< QNAME is within the name (wire format) */
+	KR_FILTER_SRC,        /**< Source address is in the subnet (kr_straddr_subnet() format) */
+	KR_FILTER_DST,        /**< Destination address is in the subnet */
+	KR_FILTER_QTYPE,      /**< QTYPE equals the number */
+	KR_FILTER_CALLBACK,   /**< The callback of the filter, with the number as its argument */
+	KR_FILTER_AND,
+	KR_FILTER_OR,
+	KR_FILTER_NOT,        /**< Negate the last result */
+};
+
+/** Callback for the conditions that can't be compiled, e.g. Lua patterns. */
+typedef bool (*kr_filter_cb)(struct kr_request *req, struct kr_query *qry, uint32_t arg);
+
+/** Opaque list of rules. */
+struct kr_filter;
+
+/** Create an empty list, the callback may be NULL. */
+KR_EXPORT
+struct kr_filter *kr_filter_create(kr_filter_cb cb);
+
+KR_EXPORT
+void kr_filter_free(struct kr_filter *f);
+
+/** Append an (active) rule with no instructions. */
+KR_EXPORT
+int kr_filter_add(struct kr_filter *f, uint32_t id);
+
+/**
+ * Append an instruction to the rule.
+ * @param arg name or subnet, NULL for the other instructions
+ * @param num QTYPE or callback argument
+ * @return 0 or an error code, e.g. EINVAL if there's nothing to combine
+ */
+KR_EXPORT
+int kr_filter_push(struct kr_filter *f, uint32_t id, int op, const void *arg, uint32_t num);
+
+KR_EXPORT
+int kr_filter_del(struct kr_filter *f, uint32_t id);
+
+/** Suspend or resume the rule. */
+KR_EXPORT
+int kr_filter_set_active(struct kr_filter *f, uint32_t id, bool active);
+
+/** Return how many times the rule matched, or -1 for an unknown rule. */
+KR_EXPORT
+int64_t kr_filter_count(const struct kr_filter *f, uint32_t id);
+
+/**
+ * Find the first active rule matching the request and count the match.
+ * @return 0 and the rule id, or kr_error(ENOENT)
+ */
+KR_EXPORT
+int kr_filter_match(struct kr_filter *f, struct kr_request *req, struct kr_query *qry,
+		    uint32_t *id);
+
+/**
+ * Continue kr_filter_match() after the rule *id, e.g. when its action
+ * doesn't stop the evaluation.
+ * @return 0 and the rule id, or kr_error(ENOENT)
+ */
+KR_EXPORT
+int kr_filter_next(struct kr_filter *f, struct kr_request *req, struct kr_query *qry,
+		   uint32_t *id);
@@ -0,0 +1,220 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/forward.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+struct fwd_target {
+	union inaddr addr;
+	int32_t current;      /**< Smooth weighted round-robin state */
+	uint16_t fails;       /**< Failures in a row */
+	uint64_t down_until;  /**< kr_now() when the open circuit may be tried again, 0 if closed */
+	struct kr_fwd_stats stats;
+};
+
+struct kr_fwd_pool {
+	uint16_t count;
+	uint16_t fails;
+	uint32_t down_ms;
+	bool race;
+	struct fwd_target targets[KR_FWD_TARGETS_MAX];
+};
+
+struct kr_fwd_pool *kr_fwd_pool_create(uint16_t fails, uint32_t down_ms, bool race)
+{
+	struct kr_fwd_pool *pool = calloc(1, sizeof(*pool));
+	if (pool) {
+		pool->fails = MAX(fails, 1);
+		pool->down_ms = down_ms;
+		pool->race = race;
+	}
+	return pool;
+}
+
+void kr_fwd_pool_free(struct kr_fwd_pool *pool)
+{
+	free(pool);
+}
+
+int kr_fwd_pool_add(struct kr_fwd_pool *pool, const struct sockaddr *addr, uint16_t weight)
+{
+	if (!pool || !addr || weight == 0) {
+		return kr_error(EINVAL);
+	}
+	if (pool->count >= KR_FWD_TARGETS_MAX) {
+		return kr_error(ENOSPC);
+	}
+	const int len = kr_sockaddr_len(addr);
+	if (len <= 0) {
+		return kr_error(EINVAL);
+	}
+	struct fwd_target *t = &pool->targets[pool->count++];
+	memset(t, 0, sizeof(*t));
+	memcpy(&t->addr, addr, len);
+	t->stats.weight = weight;
+	t->stats.up = true;
+	return kr_ok();
+}
+
+int kr_fwd_pool_use(struct kr_request *req, struct kr_fwd_pool *pool, uint16_t probe)
+{
+	if (!req || !pool || pool->count == 0 || probe > pool->count) {
+		return kr_error(EINVAL);
+	}
+	/* A health probe keeps its forwarder, whatever the policy says. */
+	if (!req->fwd_probe) {
+		req->fwd_pool = pool;
+		req->fwd_probe = probe;
+	}
+	if (req->current_query) {
+		kr_fwd_pool_order(req, req->current_query);
+	}
+	return kr_ok();
+}
+
+/** Whether the target may get queries now; the expired open circuit is half-open. */
+static bool target_usable(const struct fwd_target *t, uint64_t now)
+{
+	return t->stats.up || t->down_until <= now;
+}
+
+void kr_fwd_pool_order(struct kr_request *req, struct kr_query *qry)
+{
+	struct kr_fwd_pool *pool = req->fwd_pool;
+	if (!pool || pool->count == 0) {
+		return;
+	}
+	size_t n = 0;
+	if (req->fwd_probe) {
+		kr_nsrep_set(qry, n++, &pool->targets[req->fwd_probe - 1].addr.ip);
+		kr_nsrep_set(qry, n, NULL);
+		return;
+	}
+	/* The first one by weight among the healthy, see nginx's smooth round-robin. */
+	const uint64_t now = kr_now();
+	struct fwd_target *first = NULL;
+	int32_t total = 0;
+	for (int i = 0; i < pool->count; ++i) {
+		struct fwd_target *t = &pool->targets[i];
+		if (t->stats.up) {
+			t->current += t->stats.weight;
+			total += t->stats.weight;
+			if (!first || t->current > first->current) {
+				first = t;
+			}
+		}
+	}
+	bool used[KR_FWD_TARGETS_MAX] = { false };
+	if (first) {
+		first->current -= total;
+		first->stats.selected += 1;
+		kr_nsrep_set(qry, n++, &first->addr.ip);
+		used[first - pool->targets] = true;
+	}
+	/* The other healthy ones by RTT, then the half-open ones; all if none is usable. */
+	for (int pass = 0; pass < 3 && n < KR_NSREP_MAXADDR; ++pass) {
+		if (pass == 2 && n > 0) {
+			break;
+		}
+		for (;;) {
+			struct fwd_target *best = NULL;
+			for (int i = 0; i < pool->count; ++i) {
+				struct fwd_target *t = &pool->targets[i];
+				const bool ok = pass == 0 ? t->stats.up
+					: pass == 1 ? target_usable(t, now) : true;
+				if (!used[i] && ok && (!best || t->stats.srtt_ms < best->stats.srtt_ms)) {
+					best = t;
+				}
+			}
+			if (!best || n >= KR_NSREP_MAXADDR) {
+				break;
+			}
+			used[best - pool->targets] = true;
+			kr_nsrep_set(qry, n++, &best->addr.ip);
+		}
+	}
+	if (n < KR_NSREP_MAXADDR) {
+		kr_nsrep_set(qry, n, NULL);
+	}
+}
+
+static struct fwd_target *target_find(struct kr_fwd_pool *pool, const struct sockaddr *addr)
+{
+	for (int i = 0; i < pool->count; ++i) {
+		const struct sockaddr *t = &pool->targets[i].addr.ip;
+		if (t->sa_family == addr->sa_family
+		    && kr_inaddr_port(t) == kr_inaddr_port(addr)
+		    && memcmp(kr_inaddr(t), kr_inaddr(addr), kr_inaddr_len(t)) == 0) {
+			return &pool->targets[i];
+		}
+	}
+	return NULL;
+}
+
+void kr_fwd_pool_report(struct kr_fwd_pool *pool, const struct sockaddr *addr, int rtt_ms)
+{
+	struct fwd_target *t = pool && addr ? target_find(pool, addr) : NULL;
+	if (!t) {
+		return;
+	}
+	if (rtt_ms >= 0) {
+		t->stats.answers += 1;
+		/* Like TCP's SRTT, 1/8 of the new sample. */
+		t->stats.srtt_ms = t->stats.srtt_ms
+			? t->stats.srtt_ms + ((int64_t)rtt_ms - t->stats.srtt_ms) / 8 : rtt_ms;
+		t->fails = 0;
+		if (!t->stats.up) {
+			t->stats.up = true;
+			t->down_until = 0;
+			t->current = 0;
+		}
+		return;
+	}
+	if (rtt_ms == kr_error(ETIMEDOUT)) {
+		t->stats.timeouts += 1;
+	} else {
+		t->stats.answers += 1;
+		t->stats.errors += 1;
+	}
+	t->fails += 1;
+	/* Open the circuit, or keep it open after the half-open try. */
+	if (t->fails >= pool->fails) {
+		t->stats.trips += t->stats.up;
+		t->stats.up = false;
+		t->down_until = kr_now() + pool->down_ms;
+	}
+}
+
+bool kr_fwd_pool_race(const struct kr_fwd_pool *pool)
+{
+	return pool && pool->race;
+}
+
+int kr_fwd_pool_stats(const struct kr_fwd_pool *pool, unsigned i, struct kr_fwd_stats *stats)
+{
+	if (!pool || !stats) {
+		return kr_error(EINVAL);
+	}
+	if (i >= pool->count) {
+		return kr_error(ENOENT);
+	}
+	*stats = pool->targets[i].stats;
+	return kr_ok();
+}
@@ -0,0 +1,104 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file forward.h
+ * @brief Pools of forwarders with weights, health and statistics.
+ *
+ * A request using a pool (kr_request::fwd_pool) gets the forwarders of its
+ * queries ordered by the pool, instead of by kr_nsrep_sort(): the first
+ * is chosen by smooth weighted round-robin among the healthy ones, the other
+ * healthy ones follow by their smoothed RTT.  A forwarder failing
+ * `fails` times in a row is left out for `down_ms` (the circuit opens);
+ * then it's tried after the healthy ones again, and the first answer
+ * closes the circuit.  If there's no healthy one,
+ * all of them are tried.
+ *
+ * The answers, errors and timeouts are reported by the resolver and the daemon;
+ * health probes are ordinary requests with kr_fwd_pool_use() for one forwarder.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	struct kr_fwd_pool *pool = kr_fwd_pool_create(3, 5000, false);
+ * 	kr_fwd_pool_add(pool, addr, 10);
+ * 	...
+ * 	kr_fwd_pool_use(req, pool, 0); // e.g. from a policy action
+ * @endcode
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "lib/defines.h"
+
+struct kr_request;
+struct kr_query;
+struct kr_fwd_pool;
+
+/** Most forwarders in a pool; up to KR_NSREP_MAXADDR of them are tried for a query. */
+#define KR_FWD_TARGETS_MAX 16
+
+/** Statistics of a forwarder of a pool, see kr_fwd_pool_stats(). */
+struct kr_fwd_stats {
+	uint64_t selected;  /**< Queries it was chosen first for */
+	uint64_t answers;   /**< Answers, incl. SERVFAIL and REFUSED */
+	uint64_t errors;    /**< SERVFAIL, REFUSED and unusable answers */
+	uint64_t timeouts;  /**< Queries without an answer */
+	uint64_t trips;     /**< Times the circuit opened */
+	uint32_t srtt_ms;   /**< Smoothed RTT of the answers */
+	uint16_t weight;
+	bool up;            /**< The circuit is closed */
+};
+
+/** Create a pool; a forwarder fails `fails` times in a row to be left out for `down_ms`.
+ * @param race	send the queries to the first two forwarders at once
+ * @return NULL on error */
+KR_EXPORT
+struct kr_fwd_pool *kr_fwd_pool_create(uint16_t fails, uint32_t down_ms, bool race);
+
+KR_EXPORT
+void kr_fwd_pool_free(struct kr_fwd_pool *pool);
+
+/** Add a forwarder with a relative weight (at least 1). */
+KR_EXPORT
+int kr_fwd_pool_add(struct kr_fwd_pool *pool, const struct sockaddr *addr, uint16_t weight);
+
+/** Forward the queries of the request via the pool; the current query gets its forwarders.
+ * @param probe	1 + the index of the only forwarder to ask, or 0 for the usual order
+ * @note the pool must outlive the request */
+KR_EXPORT
+int kr_fwd_pool_use(struct kr_request *req, struct kr_fwd_pool *pool, uint16_t probe);
+
+/** Set the forwarders of the query, see the file description. */
+KR_EXPORT
+void kr_fwd_pool_order(struct kr_request *req, struct kr_query *qry);
+
+/** Report an answer of a forwarder (rtt_ms >= 0) or its failure (a kr_error()). */
+KR_EXPORT
+void kr_fwd_pool_report(struct kr_fwd_pool *pool, const struct sockaddr *addr, int rtt_ms);
+
+/** Whether the queries go to the first two forwarders at once. */
+KR_EXPORT KR_PURE
+bool kr_fwd_pool_race(const struct kr_fwd_pool *pool);
+
+/** Fill the statistics of the i-th forwarder.
+ * @return kr_error(ENOENT) past the last one */
+KR_EXPORT
+int kr_fwd_pool_stats(const struct kr_fwd_pool *pool, unsigned i, struct kr_fwd_stats *stats);
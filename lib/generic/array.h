@@ -64,6 +64,7 @@
 
 #pragma once
 #include <stdlib.h>
+#include <string.h>
 
 /** Simplified Qt containers growth strategy. */
 static inline size_t array_next_count(size_t want)
@@ -163,4 +164,71 @@ static inline void array_std_free(void *baton, void *p)
 #define array_tail(array) \
     (array).at[(array).len - 1]
 
+/**
+ * Declare an array with room for n elements inside the structure.
+ *
+ * The first n elements need no allocation; when it grows beyond them,
+ * the elements move to allocated memory, as with array_t.  All the macros
+ * reading and removing elements work on it, but it has to be initialized,
+ * grown and cleared with the array_small_*() ones.
+ * @warning The array must not be copied or moved by value, as .at may point inside it.
+ */
+#define array_small_t(type, n) struct {type * at; size_t len; size_t cap; type inl[(n)]; }
+
+/** Initialize the array to empty, using the room inside. */
+#define array_small_init(array) \
+	((array).at = (array).inl, (array).len = 0, \
+	 (array).cap = sizeof((array).inl) / sizeof((array).inl[0]))
+
+/** Return whether the elements are still held inside the structure. */
+#define array_small_is_inline(array) \
+	((void *)(array).at == (void *)(array).inl)
+
+/** Make the array empty and free the memory allocated for it, if any.
+ * Mempool usage: pass mm_free and a knot_mm_t* . */
+#define array_small_clear_mm(array, free, baton) \
+	((array_small_is_inline(array) ? (void)0 : (free)((baton), (array).at)), \
+	 array_small_init(array))
+
+/** Reserve capacity for at least n elements.
+ * Mempool usage: pass kr_memreserve and a knot_mm_t* .
+ * @return 0 if success, <0 on failure */
+#define array_small_reserve_mm(array, n, reserve, baton) \
+	array_inline_reserve((reserve), (baton), (char **) &(array).at, (array).inl, \
+			     sizeof((array).at[0]), (n), &(array).cap, (array).len)
+
+/**
+ * Push value at the end of the array, resize it if necessary.
+ * Mempool usage: pass kr_memreserve and a knot_mm_t* .
+ * @return element index on success, <0 on failure
+ */
+#define array_small_push_mm(array, val, reserve, baton) \
+	(int)((array).len < (array).cap ? ((array).at[(array).len] = val, (array).len++) \
+		: (array_small_reserve_mm(array, ((array).cap + 1), reserve, baton) < 0 ? -1 \
+			: ((array).at[(array).len] = val, (array).len++)))
+
+/** @internal Reserve memory for an array which may still use the inline room `inl`.
+ * The reserve function is the one of array_reserve_mm(); leaving the inline
+ * room, it gets empty memory and the first `len` elements are copied over. */
+static inline int array_inline_reserve(int (*reserve)(void *, char **, size_t, size_t, size_t *),
+				       void *baton, char **mem, void *inl, size_t elm_size,
+				       size_t want, size_t *have, size_t len)
+{
+	if (*have >= want) {
+		return 0;
+	}
+	if (*mem != inl) {
+		return reserve(baton, mem, elm_size, want, have);
+	}
+	char *mem_new = NULL;
+	size_t have_new = 0;
+	if (reserve(baton, &mem_new, elm_size, want, &have_new) < 0) {
+		return -1;
+	}
+	memcpy(mem_new, inl, len * elm_size);
+	*mem = mem_new;
+	*have = have_new;
+	return 0;
+}
+
 /** @} */
@@ -0,0 +1,123 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#include "lib/generic/cmsketch.h"
+#include "contrib/murmurhash3/murmurhash3.h"
+
+/** Number of rows, i.e. independent hashes per key. */
+#define CMSKETCH_DEPTH 4
+
+struct cmsketch {
+	size_t map_len;  /**< Length of the whole mapping. */
+	uint32_t mask;   /**< Width of a row - 1. */
+	uint8_t counters[];
+};
+
+/** @internal Two independent hashes; the rows use their combinations. */
+static void key_hashes(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2)
+{
+	const uint8_t *k = key;
+	uint32_t fnv = 2166136261u;
+	for (size_t i = 0; i < key_len; ++i) {
+		fnv = (fnv ^ k[i]) * 16777619u;
+	}
+	*h1 = hash(key, key_len);
+	*h2 = fnv | 1; /* odd, so the rows never coincide */
+}
+
+static inline uint8_t *counter_at(const cmsketch_t *sk, int row, uint32_t h1, uint32_t h2)
+{
+	uint32_t i = (h1 + row * h2) & sk->mask;
+	return (uint8_t *)sk->counters + (size_t)row * (sk->mask + 1) + i;
+}
+
+cmsketch_t *cmsketch_create(uint32_t width)
+{
+	if (width == 0 || width > (1U << 30)) {
+		return NULL;
+	}
+	uint32_t row_len = 1U << (width > 1 ? 32 - __builtin_clz(width - 1) : 0);
+	size_t map_len = offsetof(struct cmsketch, counters) + (size_t)row_len * CMSKETCH_DEPTH;
+	/* MAP_SHARED anonymous memory is inherited by the forked children. */
+	cmsketch_t *sk = mmap(NULL, map_len, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (sk == MAP_FAILED) {
+		return NULL;
+	}
+	/* The mapping is zero-filled. */
+	sk->map_len = map_len;
+	sk->mask = row_len - 1;
+	return sk;
+}
+
+void cmsketch_free(cmsketch_t *sk)
+{
+	if (sk) {
+		munmap(sk, sk->map_len);
+	}
+}
+
+void cmsketch_add(cmsketch_t *sk, const void *key, size_t key_len)
+{
+	if (!sk || !key) {
+		return;
+	}
+	uint32_t h1, h2;
+	key_hashes(key, key_len, &h1, &h2);
+	for (int row = 0; row < CMSKETCH_DEPTH; ++row) {
+		uint8_t *c = counter_at(sk, row, h1, h2);
+		uint8_t val = __atomic_load_n(c, __ATOMIC_RELAXED);
+		if (val < UINT8_MAX) {
+			/* Single attempt; losing a race just loses the increment. */
+			__atomic_compare_exchange_n(c, &val, val + 1, false,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+unsigned cmsketch_estimate(const cmsketch_t *sk, const void *key, size_t key_len)
+{
+	if (!sk || !key) {
+		return 0;
+	}
+	uint32_t h1, h2;
+	key_hashes(key, key_len, &h1, &h2);
+	unsigned est = UINT8_MAX;
+	for (int row = 0; row < CMSKETCH_DEPTH; ++row) {
+		uint8_t val = __atomic_load_n(counter_at(sk, row, h1, h2), __ATOMIC_RELAXED);
+		if (val < est) {
+			est = val;
+		}
+	}
+	return est;
+}
+
+void cmsketch_halve(cmsketch_t *sk)
+{
+	if (!sk) {
+		return;
+	}
+	const size_t len = (size_t)(sk->mask + 1) * CMSKETCH_DEPTH;
+	for (size_t i = 0; i < len; ++i) {
+		uint8_t val = __atomic_load_n(&sk->counters[i], __ATOMIC_RELAXED);
+		if (val) {
+			__atomic_store_n(&sk->counters[i], val >> 1, __ATOMIC_RELAXED);
+		}
+	}
+}
@@ -0,0 +1,76 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file cmsketch.h
+ * @brief Count-min sketch in memory shared between processes.
+ *
+ * Approximate occurrence counts of arbitrary keys in fixed memory.
+ * Like shtable.h, it's a single shared mapping created before fork().
+ *
+ * - the estimate is never lower than the real count (until halved),
+ *   it may be higher due to collisions
+ * - counters are 8-bit and saturate; halve them periodically to age the counts
+ * - increments from several processes may rarely get lost, it's approximate anyway
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	cmsketch_t *sk = cmsketch_create(4096);
+ * 	cmsketch_add(sk, "luke", strlen("luke"));
+ * 	cmsketch_add(sk, "luke", strlen("luke"));
+ * 	cmsketch_estimate(sk, "luke", strlen("luke")); // >= 2
+ * 	cmsketch_halve(sk);
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Opaque sketch. */
+typedef struct cmsketch cmsketch_t;
+
+/**
+ * Create a sketch in anonymous shared memory.
+ * @param width number of counters in each row (rounded up to a power of two)
+ * @return sketch or NULL
+ */
+KR_EXPORT
+cmsketch_t *cmsketch_create(uint32_t width);
+
+/** Unmap the sketch (in the calling process only). */
+KR_EXPORT
+void cmsketch_free(cmsketch_t *sk);
+
+/** Count one occurrence of the key. */
+KR_EXPORT
+void cmsketch_add(cmsketch_t *sk, const void *key, size_t key_len);
+
+/** Return the estimated number of occurrences of the key. */
+KR_EXPORT
+unsigned cmsketch_estimate(const cmsketch_t *sk, const void *key, size_t key_len);
+
+/** Halve all the counters, so that old occurrences fade away. */
+KR_EXPORT
+void cmsketch_halve(cmsketch_t *sk);
+
+/** @} */
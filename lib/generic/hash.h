@@ -0,0 +1,49 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file hash.h
+ * @brief Seeded hashes of short keys, for hash tables.
+ *
+ * - kr_hash_short() is a fast hash in the style of wyhash (multiply and fold),
+ *   for keys that the clients don't choose, e.g. addresses of servers;
+ *   with a random seed the collisions can't be precomputed, but it isn't
+ *   a cryptographic function
+ * - kr_siphash24() is the keyed SipHash-2-4, for keys anyone may choose,
+ *   e.g. query names; without the key, the collisions can't be found
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Size of the SipHash key. */
+#define KR_SIPHASH_KEY_SIZE 16
+
+/** Return the hash of the key, seeded. */
+KR_EXPORT KR_PURE
+uint64_t kr_hash_short(const void *key, size_t len, uint64_t seed);
+
+/** Return SipHash-2-4 of the input, as a little-endian number (the reference output). */
+KR_EXPORT KR_PURE
+uint64_t kr_siphash24(const uint8_t key[KR_SIPHASH_KEY_SIZE], const void *in, size_t len);
+
+/** @} */
@@ -15,7 +15,6 @@
  */
 
 #include "lib/generic/lru.h"
-#include "contrib/murmurhash3/murmurhash3.h"
 
 typedef struct lru_group lru_group_t;
 
@@ -85,8 +84,23 @@ KR_EXPORT void lru_apply_impl(struct lru *lru, lru_apply_fun f, void *baton)
 	}
 }
 
+/** @internal Hash the key, with the function and the seed of the LRU. */
+static uint32_t key_hash(const struct lru *lru, const char *key, uint key_len)
+{
+	uint64_t h;
+	if (lru->hash_fun == LRU_HASH_SIPHASH) {
+		h = kr_siphash24(lru->hash_key, key, key_len);
+	} else {
+		uint64_t seed;
+		memcpy(&seed, lru->hash_key, sizeof(seed));
+		h = kr_hash_short(key, key_len, seed);
+	}
+	return h ^ (h >> 32);
+}
+
 /** @internal See lru_create. */
-KR_EXPORT struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot_mm_t *mm)
+KR_EXPORT struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot_mm_t *mm,
+				       enum lru_hash hash_fun)
 {
 	assert(max_slots);
 	if (!max_slots)
@@ -101,6 +115,9 @@ KR_EXPORT struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot
 	assert(max_slots <= group_count * LRU_ASSOC && group_count * LRU_ASSOC < 2 * max_slots);
 
 	size_t size = offsetof(struct lru, groups[group_count]);
+	/* The large tables are accessed randomly, so they are better in huge pages. */
+	if (!mm_array && kr_hugepages && size >= KR_HUGEPAGE_SIZE / 2)
+		mm_array = &kr_mm_huge;
 	struct lru *lru = mm_alloc(mm_array, size);
 	if (unlikely(lru == NULL))
 		return NULL;
@@ -108,7 +125,12 @@ KR_EXPORT struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot
 		.mm = mm,
 		.mm_array = mm_array,
 		.log_groups = log_groups,
+		.hash_fun = hash_fun,
 	};
+	for (int i = 0; i < KR_SIPHASH_KEY_SIZE; i += 4) {
+		const uint32_t r = kr_rand_uint(0);
+		memcpy(lru->hash_key + i, &r, sizeof(r));
+	}
 	// zeros are a good init
 	memset(lru->groups, 0, size - offsetof(struct lru, groups));
 	return lru;
@@ -147,7 +169,7 @@ KR_EXPORT void * lru_get_impl(struct lru *lru, const char *key, uint key_len,
 	}
 	bool is_new_entry = false;
 	// find the right group
-	uint32_t khash = hash(key, key_len);
+	uint32_t khash = key_hash(lru, key, key_len);
 	uint16_t khash_top = khash >> 16;
 	lru_group_t *g = &lru->groups[khash & ((1 << lru->log_groups) - 1)];
 	struct lru_item *it = NULL;
@@ -24,6 +24,11 @@
  *  most frequent keys/hashes.  This tracking is done for *more* keys than
  *  those that are actually stored.
  *
+ * @note Each LRU hashes the keys with a random seed of its own, so the groups
+ *  of the keys can't be predicted.  Use lru_create_hash() with LRU_HASH_SIPHASH
+ *  for keys that anyone may choose, e.g. query names, so that the groups
+ *  can't be learnt and crowded out either.
+ *
  * # Example usage:
  *
  * @code{.c}
@@ -69,6 +74,7 @@
 #include <stddef.h>
 
 #include "contrib/ucw/lib.h"
+#include "lib/generic/hash.h"
 #include "lib/utils.h"
 #include "libknot/mm_ctx.h"
 
@@ -81,6 +87,12 @@
 		struct lru lru; \
 	}
 
+/** @brief Hash functions of the keys, see lib/generic/hash.h */
+enum lru_hash {
+	LRU_HASH_SHORT = 0, /**< Fast, for keys the clients don't choose, e.g. server addresses. */
+	LRU_HASH_SIPHASH,   /**< Keyed, for keys anyone may choose, e.g. query names. */
+};
+
 /**
  * @brief Allocate and initialize an LRU with default associativity.
  *
@@ -89,15 +101,20 @@
  * @param ptable pointer to a pointer to the LRU
  * @param max_slots number of slots
  * @param mm_ctx_array memory context to use for the huge array, NULL for default
+ *	(kr_huge_alloc() if it is large and kr_hugepages is set)
  * @param mm_ctx memory context to use for individual key-value pairs, NULL for default
  *
  * @note The pointers to memory contexts need to remain valid
  * 	during the whole life of the structure (or be NULL).
  */
-#define lru_create(ptable, max_slots, mm_ctx_array, mm_ctx) do { \
+#define lru_create(ptable, max_slots, mm_ctx_array, mm_ctx) \
+	lru_create_hash((ptable), (max_slots), (mm_ctx_array), (mm_ctx), LRU_HASH_SHORT)
+
+/** @brief Like lru_create(), with the hash function of the keys (enum lru_hash). */
+#define lru_create_hash(ptable, max_slots, mm_ctx_array, mm_ctx, hash_fun) do { \
 	(void)(((__typeof__((*(ptable))->pdata_t))0) == (void *)0); /* typecheck lru_t */ \
 	*(ptable) = (__typeof__(*(ptable))) \
-		lru_create_impl((max_slots), (mm_ctx_array), (mm_ctx)); \
+		lru_create_impl((max_slots), (mm_ctx_array), (mm_ctx), (hash_fun)); \
 	} while (false)
 
 /** @brief Free an LRU created by lru_create (it can be NULL). */
@@ -189,7 +206,8 @@ typedef lru_apply_fun_g(lru_apply_fun, void);
 
 struct lru;
 void lru_free_items_impl(struct lru *lru);
-struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot_mm_t *mm);
+struct lru * lru_create_impl(uint max_slots, knot_mm_t *mm_array, knot_mm_t *mm,
+			     enum lru_hash hash_fun);
 void * lru_get_impl(struct lru *lru, const char *key, uint key_len,
 		    uint val_len, bool do_insert, bool *is_new);
 void lru_apply_impl(struct lru *lru, lru_apply_fun f, void *baton);
@@ -220,6 +238,8 @@ struct lru {
 	struct knot_mm *mm, /**< Memory context to use for keys. */
 		*mm_array; /**< Memory context to use for this structure itself. */
 	uint log_groups; /**< Logarithm of the number of LRU groups. */
+	enum lru_hash hash_fun;
+	uint8_t hash_key[KR_SIPHASH_KEY_SIZE]; /**< Random; the first half seeds LRU_HASH_SHORT. */
 	struct lru_group groups[] CACHE_ALIGNED; /**< The groups of items. */
 };
 
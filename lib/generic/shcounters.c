@@ -0,0 +1,151 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lib/generic/shcounters.h"
+
+#define SHCOUNTERS_LINE 64
+
+/* A slot is a cache line, so that the writers never share one. */
+struct shcounters_slot {
+	char name[SHCOUNTERS_NAME_MAXLEN];
+	uint64_t val;
+} __attribute__((aligned(SHCOUNTERS_LINE)));
+
+/* Region owned by one process; the count is published after the name is written. */
+struct shcounters_proc {
+	uint32_t count;
+} __attribute__((aligned(SHCOUNTERS_LINE)));
+
+struct shcounters {
+	size_t map_len;  /**< Length of the whole mapping. */
+	uint32_t procs;
+	uint32_t slots;  /**< Slots in the region of each process. */
+	/* Followed by the regions, each a struct shcounters_proc and its slots. */
+} __attribute__((aligned(SHCOUNTERS_LINE)));
+
+static inline size_t region_len(const shcounters_t *sc)
+{
+	return sizeof(struct shcounters_proc) + (size_t)sc->slots * sizeof(struct shcounters_slot);
+}
+
+static inline struct shcounters_proc *region_at(const shcounters_t *sc, uint32_t proc)
+{
+	return (struct shcounters_proc *)((char *)sc + sizeof(*sc) + proc * region_len(sc));
+}
+
+static inline struct shcounters_slot *slot_at(const shcounters_t *sc, uint32_t proc, int idx)
+{
+	return (struct shcounters_slot *)(region_at(sc, proc) + 1) + idx;
+}
+
+/** @internal Return whether the slot is registered; orders the reads of its name. */
+static inline bool slot_valid(const shcounters_t *sc, uint32_t proc, int idx)
+{
+	return sc && proc < sc->procs && idx >= 0 &&
+	       (uint32_t)idx < __atomic_load_n(&region_at(sc, proc)->count, __ATOMIC_ACQUIRE);
+}
+
+shcounters_t *shcounters_create(uint32_t procs, uint32_t slots)
+{
+	if (procs == 0 || slots == 0 || procs > (1U << 16) || slots > (1U << 16)) {
+		return NULL;
+	}
+	size_t map_len = sizeof(struct shcounters) + (size_t)procs *
+		(sizeof(struct shcounters_proc) + (size_t)slots * sizeof(struct shcounters_slot));
+	/* MAP_SHARED anonymous memory is inherited by the forked children. */
+	shcounters_t *sc = mmap(NULL, map_len, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (sc == MAP_FAILED) {
+		return NULL;
+	}
+	/* The mapping is zero-filled. */
+	sc->map_len = map_len;
+	sc->procs = procs;
+	sc->slots = slots;
+	return sc;
+}
+
+void shcounters_free(shcounters_t *sc)
+{
+	if (sc) {
+		munmap(sc, sc->map_len);
+	}
+}
+
+uint32_t shcounters_procs(const shcounters_t *sc)
+{
+	return sc ? sc->procs : 0;
+}
+
+int shcounters_register(shcounters_t *sc, uint32_t proc, const char *name)
+{
+	if (!sc || proc >= sc->procs || !name) {
+		return kr_error(EINVAL);
+	}
+	if (strlen(name) >= SHCOUNTERS_NAME_MAXLEN) {
+		return kr_error(ENAMETOOLONG);
+	}
+	struct shcounters_proc *region = region_at(sc, proc);
+	/* Only this process writes the region, no need to be quick here. */
+	const uint32_t count = region->count;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (strcmp(slot_at(sc, proc, i)->name, name) == 0) {
+			return i;
+		}
+	}
+	if (count >= sc->slots) {
+		return kr_error(ENOSPC);
+	}
+	struct shcounters_slot *slot = slot_at(sc, proc, count);
+	strcpy(slot->name, name);
+	__atomic_store_n(&slot->val, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&region->count, count + 1, __ATOMIC_RELEASE);
+	return count;
+}
+
+void shcounters_set(shcounters_t *sc, uint32_t proc, int idx, uint64_t val)
+{
+	if (!sc || proc >= sc->procs || idx < 0 || (uint32_t)idx >= region_at(sc, proc)->count) {
+		return;
+	}
+	__atomic_store_n(&slot_at(sc, proc, idx)->val, val, __ATOMIC_RELAXED);
+}
+
+uint32_t shcounters_count(const shcounters_t *sc, uint32_t proc)
+{
+	if (!sc || proc >= sc->procs) {
+		return 0;
+	}
+	return __atomic_load_n(&region_at(sc, proc)->count, __ATOMIC_ACQUIRE);
+}
+
+const char *shcounters_name(const shcounters_t *sc, uint32_t proc, int idx)
+{
+	return slot_valid(sc, proc, idx) ? slot_at(sc, proc, idx)->name : NULL;
+}
+
+uint64_t shcounters_get(const shcounters_t *sc, uint32_t proc, int idx)
+{
+	if (!slot_valid(sc, proc, idx)) {
+		return 0;
+	}
+	return __atomic_load_n(&slot_at(sc, proc, idx)->val, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,100 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file shcounters.h
+ * @brief Named counters of several processes in shared memory.
+ *
+ * Every process owns a region of slots, each a name and a 64-bit value
+ * taking a whole cache line.  Like shtable.h, it's a single shared mapping
+ * created before fork().
+ *
+ * - only the owning process registers and sets its counters,
+ *   any process may read all of them, without locks
+ * - a registered name stays in its slot until the segment is freed
+ * - values are read atomically, but not as a consistent snapshot
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	shcounters_t *sc = shcounters_create(2, 64);
+ * 	int i = shcounters_register(sc, 0, "answer.total");
+ * 	shcounters_set(sc, 0, i, 42);
+ * 	// in any process
+ * 	for (uint32_t p = 0; p < shcounters_procs(sc); ++p)
+ * 		for (uint32_t j = 0; j < shcounters_count(sc, p); ++j)
+ * 			printf("%s %" PRIu64 "\n", shcounters_name(sc, p, j),
+ * 			       shcounters_get(sc, p, j));
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Longest counter name, including the terminating zero. */
+#define SHCOUNTERS_NAME_MAXLEN 56
+
+/** Opaque set of counters. */
+typedef struct shcounters shcounters_t;
+
+/**
+ * Create counters in anonymous shared memory.
+ * @param procs number of processes
+ * @param slots number of counters each process may register
+ * @return counters or NULL
+ */
+KR_EXPORT
+shcounters_t *shcounters_create(uint32_t procs, uint32_t slots);
+
+/** Unmap the counters (in the calling process only). */
+KR_EXPORT
+void shcounters_free(shcounters_t *sc);
+
+/** Return the number of processes. */
+KR_EXPORT
+uint32_t shcounters_procs(const shcounters_t *sc);
+
+/**
+ * Register a counter of the process, starting at zero.
+ * @return index of the counter; the same for a name registered before,
+ *         or an error code (ENOSPC when full)
+ */
+KR_EXPORT
+int shcounters_register(shcounters_t *sc, uint32_t proc, const char *name);
+
+/** Set a counter of the process. */
+KR_EXPORT
+void shcounters_set(shcounters_t *sc, uint32_t proc, int idx, uint64_t val);
+
+/** Return the number of counters registered by the process. */
+KR_EXPORT
+uint32_t shcounters_count(const shcounters_t *sc, uint32_t proc);
+
+/** Return the name of a counter or NULL. */
+KR_EXPORT
+const char *shcounters_name(const shcounters_t *sc, uint32_t proc, int idx);
+
+/** Return the value of a counter, 0 if it doesn't exist. */
+KR_EXPORT
+uint64_t shcounters_get(const shcounters_t *sc, uint32_t proc, int idx);
+
+/** @} */
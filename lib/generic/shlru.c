@@ -0,0 +1,341 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lib/generic/shlru.h"
+#include "contrib/murmurhash3/murmurhash3.h"
+#include "lib/utils.h"
+
+/** Number of keys stored within each group. */
+#define SHLRU_ASSOC 4
+/** Number of hashes tracked within each group, so that the header is a cache line. */
+#define SHLRU_TRACKED 14
+/** Attempts to read a group that's being concurrently written. */
+#define SHLRU_READ_TRIES 4
+/** Attempts to lock a group for writing. */
+#define SHLRU_LOCK_TRIES 64
+#define SHLRU_MAGIC 0x6c727531 /* "lru1" */
+
+/* Counters and hashes as in struct lru_group; the last counter is special. */
+struct shlru_group {
+	uint32_t seq;                      /**< Sequence lock; odd while being written. */
+	uint16_t counts[SHLRU_TRACKED+1];
+	uint16_t hashes[SHLRU_TRACKED+1];
+	/* Followed by SHLRU_ASSOC items. */
+} __attribute__((aligned(64)));
+
+static_assert(sizeof(struct shlru_group) == 64, "bad sizing of shlru_group");
+
+struct shlru_item {
+	uint16_t used;
+	uint16_t key_len;
+	uint8_t data[];    /**< Key, then the value at val_offset() */
+};
+
+struct shlru {
+	uint32_t magic;
+	uint32_t log_groups;
+	size_t mem_len;
+	uint16_t key_maxlen;
+	uint16_t val_len;
+	uint32_t item_size;
+	uint32_t group_size;
+	/* Followed by the groups. */
+} __attribute__((aligned(64)));
+
+static inline size_t val_offset(uint16_t key_maxlen)
+{
+	return (key_maxlen + 3) & ~(size_t)3;
+}
+
+static inline size_t item_size(uint16_t key_maxlen, uint16_t val_len)
+{
+	/* Keep the items 8-byte aligned. */
+	return (sizeof(struct shlru_item) + val_offset(key_maxlen) + val_len + 7) & ~(size_t)7;
+}
+
+static inline size_t group_size(uint16_t key_maxlen, uint16_t val_len)
+{
+	size_t len = sizeof(struct shlru_group) + SHLRU_ASSOC * item_size(key_maxlen, val_len);
+	return (len + 63) & ~(size_t)63;
+}
+
+static inline struct shlru_group *group_at(const shlru_t *lru, uint32_t i)
+{
+	return (struct shlru_group *)((char *)lru + sizeof(*lru) + (size_t)i * lru->group_size);
+}
+
+static inline struct shlru_item *item_at(const shlru_t *lru, struct shlru_group *g, int i)
+{
+	return (struct shlru_item *)((char *)(g + 1) + (size_t)i * lru->item_size);
+}
+
+static inline uint8_t *item_val(const shlru_t *lru, struct shlru_item *it)
+{
+	return it->data + val_offset(lru->key_maxlen);
+}
+
+/** Number of groups for the slots, a power of two as in lru_create_impl(). */
+static uint32_t log_groups_for(uint32_t max_slots)
+{
+	uint32_t group_count = (max_slots - 1) / SHLRU_ASSOC + 1;
+	uint32_t log_groups = 0;
+	for (uint32_t s = group_count - 1; s; s /= 2) {
+		++log_groups;
+	}
+	return log_groups;
+}
+
+size_t shlru_mem_size(uint32_t max_slots, uint16_t key_maxlen, uint16_t val_len)
+{
+	if (max_slots == 0 || max_slots > (1U << 30) || key_maxlen == 0
+	    || val_len > SHLRU_VAL_MAXLEN) {
+		return 0;
+	}
+	return sizeof(struct shlru) + ((size_t)1 << log_groups_for(max_slots))
+		* group_size(key_maxlen, val_len);
+}
+
+shlru_t *shlru_init(void *mem, size_t mem_len, uint32_t max_slots,
+		    uint16_t key_maxlen, uint16_t val_len)
+{
+	const size_t len = shlru_mem_size(max_slots, key_maxlen, val_len);
+	if (!mem || len == 0 || mem_len < len || ((uintptr_t)mem & 63)) {
+		return NULL;
+	}
+	/* Zeros are a good init, all the items unused. */
+	memset(mem, 0, len);
+	shlru_t *lru = mem;
+	lru->log_groups = log_groups_for(max_slots);
+	lru->mem_len = len;
+	lru->key_maxlen = key_maxlen;
+	lru->val_len = val_len;
+	lru->item_size = item_size(key_maxlen, val_len);
+	lru->group_size = group_size(key_maxlen, val_len);
+	__atomic_store_n(&lru->magic, SHLRU_MAGIC, __ATOMIC_RELEASE);
+	return lru;
+}
+
+shlru_t *shlru_attach(void *mem, size_t mem_len)
+{
+	shlru_t *lru = mem;
+	if (!mem || mem_len < sizeof(*lru) || ((uintptr_t)mem & 63)
+	    || __atomic_load_n(&lru->magic, __ATOMIC_ACQUIRE) != SHLRU_MAGIC
+	    || lru->mem_len > mem_len
+	    || lru->group_size != group_size(lru->key_maxlen, lru->val_len)
+	    || lru->mem_len != sizeof(*lru) + ((size_t)1 << lru->log_groups) * lru->group_size) {
+		return NULL;
+	}
+	return lru;
+}
+
+uint32_t shlru_capacity(const shlru_t *lru)
+{
+	return lru ? (1U << lru->log_groups) * SHLRU_ASSOC : 0;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/** @internal Lock the group for writing; return the previous (even) sequence or -1. */
+static int64_t group_lock(struct shlru_group *g)
+{
+	for (int t = 0; t < SHLRU_LOCK_TRIES; ++t) {
+		uint32_t seq = __atomic_load_n(&g->seq, __ATOMIC_RELAXED);
+		if (!(seq & 1) && __atomic_compare_exchange_n(&g->seq, &seq, seq + 1, false,
+							      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return seq;
+		}
+		cpu_relax();
+	}
+	return -1;
+}
+
+static void group_unlock(struct shlru_group *g, uint32_t seq)
+{
+	__atomic_store_n(&g->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void shlru_reset(shlru_t *lru)
+{
+	if (!lru) {
+		return;
+	}
+	for (uint32_t i = 0; i < (1U << lru->log_groups); ++i) {
+		struct shlru_group *g = group_at(lru, i);
+		int64_t seq = group_lock(g);
+		if (seq < 0) {
+			continue; /* it's just being rewritten anyway */
+		}
+		memset(g->counts, 0, sizeof(g->counts));
+		memset(g->hashes, 0, sizeof(g->hashes));
+		for (int j = 0; j < SHLRU_ASSOC; ++j) {
+			item_at(lru, g, j)->used = 0;
+		}
+		group_unlock(g, seq);
+	}
+}
+
+/** @internal Increment a counter within a group, saturating. */
+static inline void group_inc_count(struct shlru_group *g, int i)
+{
+	/* Lookups count without the lock, so a concurrent increment may get lost. */
+	uint16_t count = __atomic_load_n(&g->counts[i], __ATOMIC_RELAXED);
+	if (count != UINT16_MAX) {
+		__atomic_store_n(&g->counts[i], count + 1, __ATOMIC_RELAXED);
+	}
+}
+
+/** @internal Decrement all counters within a group. */
+static void group_dec_counts(struct shlru_group *g)
+{
+	g->counts[SHLRU_TRACKED] = SHLRU_TRACKED;
+	for (int i = 0; i < SHLRU_TRACKED + 1; ++i) {
+		if (g->counts[i]) {
+			--g->counts[i];
+		}
+	}
+}
+
+static inline bool item_matches(const struct shlru_item *it, const void *key, uint16_t key_len)
+{
+	return it->used && it->key_len == key_len && memcmp(it->data, key, key_len) == 0;
+}
+
+int shlru_get(shlru_t *lru, const void *key, uint16_t key_len, void *val)
+{
+	if (!lru || (!key && key_len) || !val) {
+		return kr_error(EINVAL);
+	}
+	if (key_len > lru->key_maxlen) {
+		return kr_error(ENOENT);
+	}
+	const uint32_t khash = hash(key, key_len);
+	const uint16_t khash_top = khash >> 16;
+	struct shlru_group *g = group_at(lru, khash & ((1U << lru->log_groups) - 1));
+	uint8_t buf[SHLRU_VAL_MAXLEN];
+	for (int t = 0; t < SHLRU_READ_TRIES; ++t) {
+		uint32_t seq = __atomic_load_n(&g->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		int found = -1;
+		for (int i = 0; i < SHLRU_ASSOC; ++i) {
+			struct shlru_item *it = item_at(lru, g, i);
+			if (__atomic_load_n(&g->hashes[i], __ATOMIC_RELAXED) == khash_top
+			    && item_matches(it, key, key_len)) {
+				memcpy(buf, item_val(lru, it), lru->val_len);
+				found = i;
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&g->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		if (found < 0) {
+			return kr_error(ENOENT);
+		}
+		group_inc_count(g, found);
+		memcpy(val, buf, lru->val_len);
+		return kr_ok();
+	}
+	return kr_error(EAGAIN);
+}
+
+/** @internal Store the key at position i, under the lock. */
+static void item_store(shlru_t *lru, struct shlru_group *g, int i, uint16_t khash_top,
+		       const void *key, uint16_t key_len, const void *val)
+{
+	struct shlru_item *it = item_at(lru, g, i);
+	g->hashes[i] = khash_top;
+	it->used = 1;
+	it->key_len = key_len;
+	if (key_len > 0) {
+		memcpy(it->data, key, key_len);
+	}
+	memcpy(item_val(lru, it), val, lru->val_len);
+	group_inc_count(g, i);
+}
+
+int shlru_set(shlru_t *lru, const void *key, uint16_t key_len, const void *val)
+{
+	if (!lru || (!key && key_len) || !val || key_len > lru->key_maxlen) {
+		return kr_error(EINVAL);
+	}
+	const uint32_t khash = hash(key, key_len);
+	const uint16_t khash_top = khash >> 16;
+	struct shlru_group *g = group_at(lru, khash & ((1U << lru->log_groups) - 1));
+	int64_t seq = group_lock(g);
+	if (seq < 0) {
+		return kr_error(EAGAIN);
+	}
+	/* The policy of lru_get_impl() with do_insert. */
+	int ret = kr_ok();
+	int i;
+	for (i = 0; i < SHLRU_ASSOC; ++i) {
+		if (g->hashes[i] == khash_top && item_matches(item_at(lru, g, i), key, key_len)) {
+			goto insert;
+		}
+	}
+	/* Key not found; first try an empty/counted-out place to insert. */
+	for (i = 0; i < SHLRU_ASSOC; ++i) {
+		if (!item_at(lru, g, i)->used || g->counts[i] == 0) {
+			goto insert;
+		}
+	}
+	/* Check if we track key's count at least. */
+	for (i = SHLRU_ASSOC; i < SHLRU_TRACKED; ++i) {
+		if (g->hashes[i] != khash_top) {
+			continue;
+		}
+		group_inc_count(g, i);
+		/* Check if we trumped some stored key. */
+		for (int j = 0; j < SHLRU_ASSOC; ++j) {
+			if (g->counts[i] > g->counts[j]) {
+				/* Evict key j, i.e. swap with i. */
+				--g->counts[i]; /* incremented on insert */
+				SWAP(g->counts[i], g->counts[j]);
+				SWAP(g->hashes[i], g->hashes[j]);
+				i = j;
+				goto insert;
+			}
+		}
+		ret = kr_error(ENOSPC);
+		goto unlock;
+	}
+	/* Not found at all: decrement all counts but only on every SHLRU_TRACKED occasion. */
+	if (g->counts[SHLRU_TRACKED]) {
+		--g->counts[SHLRU_TRACKED];
+	} else {
+		group_dec_counts(g);
+	}
+	ret = kr_error(ENOSPC);
+	goto unlock;
+insert:
+	item_store(lru, g, i, khash_top, key, key_len, val);
+unlock:
+	group_unlock(g, seq);
+	return ret;
+}
@@ -0,0 +1,111 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file shlru.h
+ * @brief A lossy cache like lru.h, for concurrent use in shared memory.
+ *
+ * The same policy as lru.h: keys are hashed into groups, and within each the
+ * usage counts of several most frequent hashes are tracked, so it may refuse
+ * to store a key.  Unlike lru.h, the items are stored within the groups,
+ * so the whole cache lives in a single memory block provided by the caller,
+ * e.g. a shared mapping created before fork().
+ *
+ * - keys have a maximum length and values a fixed size, chosen on creation;
+ *   values are always copied in/out
+ * - each group is protected by a sequence lock: lookups don't lock and retry
+ *   when the group is being written, writers take a short spinlock
+ * - operations may fail with EAGAIN under contention instead of waiting long
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	size_t len = shlru_mem_size(1024, 32, sizeof(int));
+ * 	void *mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+ * 	shlru_t *lru = shlru_init(mem, len, 1024, 32, sizeof(int));
+ * 	int val = 42;
+ * 	shlru_set(lru, "luke", strlen("luke"), &val);
+ * 	if (fork() == 0) {
+ * 		shlru_get(lru, "luke", strlen("luke"), &val); // val == 42
+ * 	}
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Maximum size of a value held in the cache. */
+#define SHLRU_VAL_MAXLEN 256
+
+/** Opaque cache, at the start of the memory block. */
+typedef struct shlru shlru_t;
+
+/**
+ * Return the size of the memory block for the cache, or 0 for invalid parameters.
+ * @param max_slots number of keys stored, the real capacity may be a bit larger
+ * @param key_maxlen length of the longest key
+ * @param val_len size of each value (at most SHLRU_VAL_MAXLEN)
+ */
+KR_EXPORT
+size_t shlru_mem_size(uint32_t max_slots, uint16_t key_maxlen, uint16_t val_len);
+
+/**
+ * Create an empty cache in the memory block, with the parameters of shlru_mem_size().
+ * @param mem block of at least shlru_mem_size() bytes, 64-byte aligned
+ * @return the cache (at `mem`) or NULL
+ */
+KR_EXPORT
+shlru_t *shlru_init(void *mem, size_t mem_len, uint32_t max_slots,
+		    uint16_t key_maxlen, uint16_t val_len);
+
+/**
+ * Use a cache created by shlru_init() in another process, e.g. in a mapped file.
+ * @return the cache (at `mem`) or NULL if the block doesn't hold one
+ */
+KR_EXPORT
+shlru_t *shlru_attach(void *mem, size_t mem_len);
+
+/** Remove all the keys; other processes see it, too. */
+KR_EXPORT
+void shlru_reset(shlru_t *lru);
+
+/**
+ * Copy the value of the key into `val`.
+ * @return 0, kr_error(ENOENT) or kr_error(EAGAIN) if concurrently written
+ */
+KR_EXPORT
+int shlru_get(shlru_t *lru, const void *key, uint16_t key_len, void *val);
+
+/**
+ * Insert or overwrite the value of the key.
+ * @return 0, kr_error(ENOSPC) if the key isn't frequent enough to be stored,
+ *         kr_error(EAGAIN) if the group is locked by someone else
+ *         or kr_error(EINVAL) for too long keys
+ */
+KR_EXPORT
+int shlru_set(shlru_t *lru, const void *key, uint16_t key_len, const void *val);
+
+/** Return the real capacity - maximum number of keys holdable within. */
+KR_EXPORT
+uint32_t shlru_capacity(const shlru_t *lru);
+
+/** @} */
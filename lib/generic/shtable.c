@@ -0,0 +1,197 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lib/generic/shtable.h"
+#include "contrib/murmurhash3/murmurhash3.h"
+
+/** Number of slots probed for each key. */
+#define SHTABLE_PROBES 4
+/** Number of attempts to read a slot that's being concurrently written. */
+#define SHTABLE_READ_TRIES 3
+
+struct shtable_slot {
+	uint32_t seq;   /**< Sequence lock; odd while the slot is being written. */
+	uint32_t stamp; /**< Table clock at the time of the last write. */
+	uint64_t key;   /**< Key fingerprint, zero for an empty slot. */
+	uint8_t val[];
+};
+
+struct shtable {
+	size_t map_len;     /**< Length of the whole mapping. */
+	uint32_t mask;      /**< Number of slots - 1. */
+	uint32_t clock;     /**< Write counter, for choosing victims. */
+	uint16_t val_len;
+	uint16_t slot_size;
+	uint8_t slots[];
+};
+
+static inline struct shtable_slot *slot_at(const shtable_t *tbl, uint32_t i)
+{
+	return (struct shtable_slot *)(tbl->slots + (size_t)(i & tbl->mask) * tbl->slot_size);
+}
+
+/** @internal 64-bit key fingerprint; murmur in the upper half, FNV-1a in the lower. */
+static uint64_t fingerprint(const void *key, size_t key_len)
+{
+	const uint8_t *k = key;
+	uint32_t fnv = 2166136261u;
+	for (size_t i = 0; i < key_len; ++i) {
+		fnv = (fnv ^ k[i]) * 16777619u;
+	}
+	uint64_t fp = ((uint64_t)hash(key, key_len) << 32) | fnv;
+	return fp ? fp : 1; /* zero is reserved for empty slots */
+}
+
+shtable_t *shtable_create(uint32_t nslots, uint16_t val_len)
+{
+	if (nslots == 0 || nslots > (1U << 31) || val_len > SHTABLE_VAL_MAXLEN) {
+		return NULL;
+	}
+	uint32_t slot_count = 1U << (nslots > 1 ? 32 - __builtin_clz(nslots - 1) : 0);
+	/* Keep the slots 8-byte aligned. */
+	uint16_t slot_size = (sizeof(struct shtable_slot) + val_len + 7) & ~7;
+	size_t map_len = offsetof(struct shtable, slots) + (size_t)slot_count * slot_size;
+	/* MAP_SHARED anonymous memory is inherited by the forked children. */
+	shtable_t *tbl = mmap(NULL, map_len, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (tbl == MAP_FAILED) {
+		return NULL;
+	}
+	/* The mapping is zero-filled, i.e. all slots are empty. */
+	tbl->map_len = map_len;
+	tbl->mask = slot_count - 1;
+	tbl->val_len = val_len;
+	tbl->slot_size = slot_size;
+	return tbl;
+}
+
+void shtable_free(shtable_t *tbl)
+{
+	if (tbl) {
+		munmap(tbl, tbl->map_len);
+	}
+}
+
+uint32_t shtable_capacity(const shtable_t *tbl)
+{
+	return tbl ? tbl->mask + 1 : 0;
+}
+
+/** @internal Try to acquire the write lock; return the previous (even) sequence or -1. */
+static int64_t slot_lock(struct shtable_slot *slot)
+{
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false,
+						      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	return seq;
+}
+
+static void slot_unlock(struct shtable_slot *slot, uint32_t seq)
+{
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void shtable_clear(shtable_t *tbl)
+{
+	if (!tbl) {
+		return;
+	}
+	for (uint32_t i = 0; i <= tbl->mask; ++i) {
+		struct shtable_slot *slot = slot_at(tbl, i);
+		int64_t seq = slot_lock(slot);
+		if (seq < 0) {
+			continue; /* it's just being rewritten anyway */
+		}
+		__atomic_store_n(&slot->key, 0, __ATOMIC_RELAXED);
+		slot_unlock(slot, seq);
+	}
+}
+
+int shtable_get(shtable_t *tbl, const void *key, size_t key_len, void *val)
+{
+	if (!tbl || !key || !val) {
+		return kr_error(EINVAL);
+	}
+	const uint64_t fp = fingerprint(key, key_len);
+	uint8_t buf[SHTABLE_VAL_MAXLEN];
+	bool busy = false;
+	for (uint32_t p = 0; p < SHTABLE_PROBES; ++p) {
+		struct shtable_slot *slot = slot_at(tbl, (uint32_t)fp + p);
+		for (int t = 0; t < SHTABLE_READ_TRIES; ++t) {
+			uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				busy = true;
+				continue;
+			}
+			uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+			memcpy(buf, slot->val, tbl->val_len);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+				busy = true;
+				continue;
+			}
+			if (slot_key == 0) {
+				return kr_error(ENOENT); /* no deletions, so the key isn't further */
+			} else if (slot_key != fp) {
+				break; /* next probe */
+			}
+			memcpy(val, buf, tbl->val_len);
+			return kr_ok();
+		}
+	}
+	return busy ? kr_error(EAGAIN) : kr_error(ENOENT);
+}
+
+int shtable_set(shtable_t *tbl, const void *key, size_t key_len, const void *val)
+{
+	if (!tbl || !key || !val) {
+		return kr_error(EINVAL);
+	}
+	const uint64_t fp = fingerprint(key, key_len);
+	/* Find the matching key, an empty slot or the least recently written one. */
+	struct shtable_slot *victim = NULL;
+	uint32_t victim_age = 0;
+	const uint32_t now = __atomic_load_n(&tbl->clock, __ATOMIC_RELAXED);
+	for (uint32_t p = 0; p < SHTABLE_PROBES; ++p) {
+		struct shtable_slot *slot = slot_at(tbl, (uint32_t)fp + p);
+		uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+		if (slot_key == fp || slot_key == 0) {
+			victim = slot;
+			break;
+		}
+		uint32_t age = now - __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED);
+		if (!victim || age > victim_age) {
+			victim = slot;
+			victim_age = age;
+		}
+	}
+	int64_t seq = slot_lock(victim);
+	if (seq < 0) {
+		return kr_error(EAGAIN);
+	}
+	__atomic_store_n(&victim->key, fp, __ATOMIC_RELAXED);
+	memcpy(victim->val, val, tbl->val_len);
+	victim->stamp = __atomic_fetch_add(&tbl->clock, 1, __ATOMIC_RELAXED);
+	slot_unlock(victim, seq);
+	return kr_ok();
+}
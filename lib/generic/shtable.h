@@ -0,0 +1,95 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file shtable.h
+ * @brief Fixed-size hash table in memory shared between processes.
+ *
+ * The table is a single shared mapping created before fork(),
+ * so all the children see (and update) the same data without any IPC.
+ *
+ * - keys are arbitrary strings, but only their 64-bit fingerprint is stored,
+ *   so a (very unlikely) collision makes two keys share a value;
+ *   use this only for data where that is acceptable (hints, statistics)
+ * - values have a fixed size chosen on creation and are always copied in/out
+ * - the number of slots is fixed; new keys overwrite the least recently
+ *   written slot within a short probe sequence
+ * - each slot is protected by a sequence lock, readers never block writers,
+ *   operations may fail with EAGAIN under contention instead of spinning
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	shtable_t *tbl = shtable_create(1024, sizeof(int));
+ * 	int val = 42;
+ * 	shtable_set(tbl, "luke", strlen("luke"), &val);
+ * 	if (fork() == 0) {
+ * 		shtable_get(tbl, "luke", strlen("luke"), &val); // val == 42
+ * 	}
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Maximum size of a value held in the table. */
+#define SHTABLE_VAL_MAXLEN 64
+
+/** Opaque table. */
+typedef struct shtable shtable_t;
+
+/**
+ * Create a table in anonymous shared memory.
+ * @param nslots  number of slots (rounded up to a power of two)
+ * @param val_len size of each value (at most SHTABLE_VAL_MAXLEN)
+ * @return table or NULL
+ */
+KR_EXPORT
+shtable_t *shtable_create(uint32_t nslots, uint16_t val_len);
+
+/** Unmap the table (in the calling process only). */
+KR_EXPORT
+void shtable_free(shtable_t *tbl);
+
+/** Remove all keys; other processes see it, too. */
+KR_EXPORT
+void shtable_clear(shtable_t *tbl);
+
+/**
+ * Copy the value for given key into `val`.
+ * @return 0, kr_error(ENOENT) or kr_error(EAGAIN) if concurrently written
+ */
+KR_EXPORT
+int shtable_get(shtable_t *tbl, const void *key, size_t key_len, void *val);
+
+/**
+ * Insert or overwrite the value for given key.
+ * @return 0 or kr_error(EAGAIN) if the slot is being written by someone else
+ */
+KR_EXPORT
+int shtable_set(shtable_t *tbl, const void *key, size_t key_len, const void *val);
+
+/** Return the number of slots of the table. */
+KR_EXPORT
+uint32_t shtable_capacity(const shtable_t *tbl);
+
+/** @} */
@@ -0,0 +1,212 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "contrib/ucw/lib.h"
+#include "lib/generic/timer_wheel.h"
+
+#define L0_SIZE (1u << TW_L0_BITS)
+#define LN_SIZE (1u << TW_LN_BITS)
+#define L0_MASK (L0_SIZE - 1)
+#define LN_MASK (LN_SIZE - 1)
+/** The bits of the time indexing the slots of level `i` > 0. */
+#define LN_SHIFT(i) (TW_L0_BITS + ((i) - 1) * TW_LN_BITS)
+/** Ticks covered by all the levels. */
+#define TW_SPAN (1ull << LN_SHIFT(TW_LEVELS))
+
+static unsigned bucket(uint64_t timeout)
+{
+	unsigned b = 0;
+	for (; timeout && b < TW_BUCKETS - 1; timeout >>= 1) {
+		++b;
+	}
+	return b;
+}
+
+static void list_add(struct tw_timer **head, struct tw_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next) {
+		timer->next->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void list_del(struct tw_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/** Put the timer into the slot of its expiration, on the lowest level that reaches it. */
+static void wheel_add(struct timer_wheel *wheel, struct tw_timer *timer)
+{
+	const uint64_t expire = MAX(timer->expire, wheel->now);
+	const uint64_t ticks = expire - wheel->now;
+	if (ticks < L0_SIZE) {
+		list_add(&wheel->l0[expire & L0_MASK], timer);
+		return;
+	}
+	for (int i = 1; i < TW_LEVELS; ++i) {
+		if (ticks < (1ull << LN_SHIFT(i + 1))) {
+			list_add(&wheel->ln[i - 1][(expire >> LN_SHIFT(i)) & LN_MASK], timer);
+			return;
+		}
+	}
+	/* Beyond the span, it's put back when the wheel gets to the last slot. */
+	const uint64_t last = wheel->now + TW_SPAN - 1;
+	list_add(&wheel->ln[TW_LEVELS - 2][(last >> LN_SHIFT(TW_LEVELS - 1)) & LN_MASK], timer);
+}
+
+/** Move the timers of the slot to the levels below. */
+static void cascade(struct timer_wheel *wheel, int level, unsigned idx)
+{
+	struct tw_timer *list = wheel->ln[level - 1][idx];
+	wheel->ln[level - 1][idx] = NULL;
+	while (list) {
+		struct tw_timer *timer = list;
+		list = timer->next;
+		wheel_add(wheel, timer);
+	}
+}
+
+/** The tick when the wheel has to run next: the first timer of level 0,
+ * or the first slot of a higher level to cascade, whichever is earlier. */
+static uint64_t next_tick(const struct timer_wheel *wheel)
+{
+	if (wheel->count == 0) {
+		return UINT64_MAX;
+	}
+	uint64_t next = UINT64_MAX;
+	for (unsigned d = 0; d < L0_SIZE; ++d) {
+		if (wheel->l0[(wheel->now + d) & L0_MASK]) {
+			next = wheel->now + d;
+			break;
+		}
+	}
+	for (int i = 1; i < TW_LEVELS; ++i) {
+		const uint64_t block = wheel->now >> LN_SHIFT(i);
+		/* The slot of the current block cascades at its first tick only. */
+		const bool at_start = (wheel->now & ((1ull << LN_SHIFT(i)) - 1)) == 0;
+		for (unsigned d = at_start ? 0 : 1; d <= LN_SIZE; ++d) {
+			if (wheel->ln[i - 1][(block + d) & LN_MASK]) {
+				next = MIN(next, (block + d) << LN_SHIFT(i));
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+void tw_init(struct timer_wheel *wheel, uint64_t now, tw_arm_cb arm, void *baton)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+	wheel->armed = UINT64_MAX;
+	wheel->arm = arm;
+	wheel->baton = baton;
+}
+
+void tw_start(struct timer_wheel *wheel, struct tw_timer *timer, tw_cb cb,
+	      uint64_t now, uint64_t timeout, uint64_t repeat)
+{
+	tw_stop(timer);
+	timer->wheel = wheel;
+	timer->cb = cb;
+	timer->timeout = timeout;
+	timer->repeat = repeat;
+	timer->expire = now + timeout;
+	wheel_add(wheel, timer);
+	wheel->count += 1;
+	/* While running, the wheel is armed at the end of tw_run(). */
+	const uint64_t at = MAX(timer->expire, wheel->now);
+	if (at < wheel->armed) {
+		wheel->armed = at;
+		wheel->arm(wheel, at);
+	}
+}
+
+void tw_stop(struct tw_timer *timer)
+{
+	if (!tw_active(timer)) {
+		return;
+	}
+	struct timer_wheel *wheel = timer->wheel;
+	wheel->cancelled[bucket(timer->timeout)] += 1;
+	wheel->count -= 1;
+	list_del(timer);
+}
+
+int tw_again(struct tw_timer *timer, uint64_t now)
+{
+	if (!timer->wheel || !timer->cb) {
+		return kr_error(EINVAL);
+	}
+	if (timer->repeat) {
+		tw_start(timer->wheel, timer, timer->cb, now, timer->repeat, timer->repeat);
+	}
+	return kr_ok();
+}
+
+void tw_run(struct timer_wheel *wheel, uint64_t now)
+{
+	wheel->armed = 0;
+	while (wheel->now <= now && wheel->count > 0) {
+		const unsigned idx = wheel->now & L0_MASK;
+		if (idx == 0) {
+			for (int i = 1; i < TW_LEVELS; ++i) {
+				const unsigned j = (wheel->now >> LN_SHIFT(i)) & LN_MASK;
+				cascade(wheel, i, j);
+				if (j != 0) {
+					break;
+				}
+			}
+		}
+		/* The callbacks may stop the other timers of the slot,
+		 * so it's detached as a list of its own. */
+		struct tw_timer *list = wheel->l0[idx];
+		wheel->l0[idx] = NULL;
+		if (list) {
+			list->pprev = &list;
+		}
+		wheel->now += 1;
+		while (list) {
+			struct tw_timer *timer = list;
+			list_del(timer);
+			wheel->count -= 1;
+			wheel->expired[bucket(timer->timeout)] += 1;
+			if (timer->repeat) {
+				timer->timeout = timer->repeat;
+				timer->expire = now + timer->repeat;
+				wheel_add(wheel, timer);
+				wheel->count += 1;
+			}
+			timer->cb(timer);
+		}
+	}
+	if (wheel->now <= now) {
+		wheel->now = now + 1; /* Nothing was left. */
+	}
+	wheel->armed = next_tick(wheel);
+	wheel->arm(wheel, wheel->armed);
+}
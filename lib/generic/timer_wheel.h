@@ -0,0 +1,123 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file timer_wheel.h
+ * @brief Hierarchical timing wheel with millisecond ticks.
+ *
+ * The timers are kept in lists by the time they expire: 256 slots of one
+ * tick, then three levels of 64 slots, each spanning the whole level below
+ * (2^26 ticks, about 18 hours, in total).  The lists of a higher level
+ * are moved down when the wheel gets to them.
+ *
+ * - starting and stopping a timer is O(1), the timers are embedded in the objects
+ * - the wheel doesn't have a clock, the caller passes the current time
+ *   and runs the wheel from a single timer of its event loop, which the wheel
+ *   sets through the `arm` callback when it needs to run earlier
+ * - the timers fire at the tick they expire in, not earlier; those started
+ *   in callbacks with zero timeout at the next tick
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	tw_init(&wheel, now, arm_cb, loop);
+ * 	tw_start(&wheel, &conn->timer, on_idle, now, 10000, 0);
+ * 	...
+ * 	tw_run(&wheel, now); // in the loop timer set by arm_cb()
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+#define TW_L0_BITS 8
+#define TW_LN_BITS 6
+#define TW_LEVELS 4
+/** Timers are counted in buckets by their timeout, bucket i has those under 2^i ticks. */
+#define TW_BUCKETS 24
+
+struct timer_wheel;
+struct tw_timer;
+
+typedef void (*tw_cb)(struct tw_timer *timer);
+/** Make the owner call tw_run() at the time, or not at all with UINT64_MAX. */
+typedef void (*tw_arm_cb)(struct timer_wheel *wheel, uint64_t at);
+
+/** A timer, embed it in the object; zero-initialized is a stopped one. */
+struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer **pprev;   /**< NULL if stopped */
+	struct timer_wheel *wheel;
+	uint64_t expire;
+	uint64_t timeout;
+	uint64_t repeat;
+	tw_cb cb;
+	void *data;                /**< For the callback, not used by the wheel */
+};
+
+struct timer_wheel {
+	uint64_t now;              /**< The next tick to run */
+	uint64_t armed;            /**< When the owner runs the wheel, UINT64_MAX if not */
+	tw_arm_cb arm;
+	void *baton;               /**< For the arm callback */
+	uint64_t count;            /**< Number of the timers started */
+	uint64_t expired[TW_BUCKETS];   /**< Number of the timers that fired, by timeout */
+	uint64_t cancelled[TW_BUCKETS]; /**< Number of those stopped or restarted before */
+	struct tw_timer *l0[1 << TW_L0_BITS];
+	struct tw_timer *ln[TW_LEVELS - 1][1 << TW_LN_BITS];
+};
+
+/** Initialize an empty wheel, its time starts at `now`. */
+KR_EXPORT
+void tw_init(struct timer_wheel *wheel, uint64_t now, tw_arm_cb arm, void *baton);
+
+/**
+ * Start the timer, or restart it if it's running.
+ * @param now the current time, at least what was passed to the wheel before
+ * @param timeout ticks from now until the first call of `cb`
+ * @param repeat ticks between the following calls, or 0 for one call
+ */
+KR_EXPORT
+void tw_start(struct timer_wheel *wheel, struct tw_timer *timer, tw_cb cb,
+	      uint64_t now, uint64_t timeout, uint64_t repeat);
+
+/** Stop the timer; a stopped one is left as it is. */
+KR_EXPORT
+void tw_stop(struct tw_timer *timer);
+
+/**
+ * Restart a repeating timer to fire in `repeat` ticks, as uv_timer_again() does.
+ * @return 0 or kr_error(EINVAL) if the timer was never started
+ */
+KR_EXPORT
+int tw_again(struct tw_timer *timer, uint64_t now);
+
+static inline bool tw_active(const struct tw_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+/** Call the timers expired until `now` (inclusive) and arm the wheel for the next one. */
+KR_EXPORT
+void tw_run(struct timer_wheel *wheel, uint64_t now);
+
+/** @} */
@@ -0,0 +1,238 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/generic/topk.h"
+#include "lib/generic/trie.h"
+#include "lib/utils.h"
+
+struct topk_entry {
+	uint64_t count;
+	uint64_t error;
+	uint32_t pos;      /**< In the heap */
+	uint32_t key_len;
+	uint8_t key[];
+};
+
+struct topk {
+	uint32_t size;
+	uint32_t len;
+	uint32_t key_maxlen;
+	size_t stride;               /**< Of the entries */
+	trie_t *index;               /**< key -> struct topk_entry * */
+	struct topk_entry **heap;    /**< Min-heap by the count */
+	uint8_t *entries;
+};
+
+static inline struct topk_entry *entry_at(const topk_t *tk, uint32_t i)
+{
+	return (struct topk_entry *)(tk->entries + tk->stride * i);
+}
+
+static inline void heap_set(topk_t *tk, uint32_t pos, struct topk_entry *e)
+{
+	tk->heap[pos] = e;
+	e->pos = pos;
+}
+
+/** Move the entry down after its count increased. */
+static void heap_down(topk_t *tk, struct topk_entry *e)
+{
+	uint32_t pos = e->pos;
+	for (;;) {
+		uint32_t child = 2 * pos + 1;
+		if (child >= tk->len) {
+			break;
+		}
+		if (child + 1 < tk->len && tk->heap[child + 1]->count < tk->heap[child]->count) {
+			child += 1;
+		}
+		if (tk->heap[child]->count >= e->count) {
+			break;
+		}
+		heap_set(tk, pos, tk->heap[child]);
+		pos = child;
+	}
+	heap_set(tk, pos, e);
+}
+
+/** Move the new entry up, the count may be lower than its parents'. */
+static void heap_up(topk_t *tk, struct topk_entry *e)
+{
+	uint32_t pos = e->pos;
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / 2;
+		if (tk->heap[parent]->count <= e->count) {
+			break;
+		}
+		heap_set(tk, pos, tk->heap[parent]);
+		pos = parent;
+	}
+	heap_set(tk, pos, e);
+}
+
+topk_t *topk_create(uint32_t size, uint32_t key_maxlen)
+{
+	if (size == 0 || key_maxlen == 0) {
+		return NULL;
+	}
+	topk_t *tk = calloc(1, sizeof(*tk));
+	if (!tk) {
+		return NULL;
+	}
+	tk->size = size;
+	tk->key_maxlen = key_maxlen;
+	/* Keep the counters of the next entry aligned. */
+	tk->stride = (sizeof(struct topk_entry) + key_maxlen + 7) & ~(size_t)7;
+	tk->index = trie_create(NULL);
+	tk->heap = malloc(sizeof(*tk->heap) * size);
+	tk->entries = malloc(tk->stride * size);
+	if (!tk->index || !tk->heap || !tk->entries) {
+		topk_free(tk);
+		return NULL;
+	}
+	return tk;
+}
+
+void topk_free(topk_t *tk)
+{
+	if (!tk) {
+		return;
+	}
+	if (tk->index) {
+		trie_free(tk->index);
+	}
+	free(tk->heap);
+	free(tk->entries);
+	free(tk);
+}
+
+void topk_clear(topk_t *tk)
+{
+	if (tk) {
+		trie_clear(tk->index);
+		tk->len = 0;
+	}
+}
+
+int topk_add(topk_t *tk, const void *key, uint32_t key_len, uint64_t count, uint64_t error)
+{
+	if (!tk || !key || key_len == 0 || key_len > tk->key_maxlen) {
+		return kr_error(EINVAL);
+	}
+	trie_val_t *val = trie_get_try(tk->index, key, key_len);
+	if (val) {
+		struct topk_entry *e = *val;
+		e->count += count;
+		e->error += error;
+		heap_down(tk, e);
+		return kr_ok();
+	}
+	if (tk->len < tk->size) {
+		val = trie_get_ins(tk->index, key, key_len);
+		if (!val) {
+			return kr_error(ENOMEM);
+		}
+		struct topk_entry *e = entry_at(tk, tk->len);
+		e->count = count;
+		e->error = error;
+		e->key_len = key_len;
+		memcpy(e->key, key, key_len);
+		heap_set(tk, tk->len, e);
+		tk->len += 1;
+		heap_up(tk, e);
+		*val = e;
+		return kr_ok();
+	}
+	/* Take over the least frequent one, the key might have had up to its count. */
+	struct topk_entry *e = tk->heap[0];
+	if (e->key_len > 0) {
+		trie_del(tk->index, (const char *)e->key, e->key_len, NULL);
+	}
+	val = trie_get_ins(tk->index, key, key_len);
+	if (!val) {
+		/* Leave it vacant, with the lowest count. */
+		e->key_len = 0;
+		e->count = e->error = 0;
+		return kr_error(ENOMEM);
+	}
+	e->error = e->count + error;
+	e->count += count;
+	e->key_len = key_len;
+	memcpy(e->key, key, key_len);
+	heap_down(tk, e);
+	*val = e;
+	return kr_ok();
+}
+
+int topk_merge(topk_t *dst, const topk_t *src)
+{
+	if (!dst || !src) {
+		return kr_error(EINVAL);
+	}
+	for (uint32_t i = 0; i < src->len; ++i) {
+		const struct topk_entry *e = src->heap[i];
+		if (e->key_len == 0) {
+			continue; /* vacant */
+		}
+		int ret = topk_add(dst, e->key, e->key_len, e->count, e->error);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return kr_ok();
+}
+
+uint32_t topk_len(const topk_t *tk)
+{
+	return tk ? tk->len : 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct topk_entry *ea = *(const struct topk_entry **)a;
+	const struct topk_entry *eb = *(const struct topk_entry **)b;
+	return ea->count < eb->count ? 1 : (ea->count > eb->count ? -1 : 0);
+}
+
+int topk_walk(const topk_t *tk, topk_walk_cb cb, void *baton)
+{
+	if (!tk || !cb) {
+		return kr_error(EINVAL);
+	}
+	if (tk->len == 0) {
+		return kr_ok();
+	}
+	struct topk_entry **sorted = malloc(sizeof(*sorted) * tk->len);
+	if (!sorted) {
+		return kr_error(ENOMEM);
+	}
+	memcpy(sorted, tk->heap, sizeof(*sorted) * tk->len);
+	qsort(sorted, tk->len, sizeof(*sorted), entry_cmp);
+	int ret = 0;
+	for (uint32_t i = 0; i < tk->len && ret == 0; ++i) {
+		if (sorted[i]->key_len == 0) {
+			continue; /* vacant, see topk_add() */
+		}
+		ret = cb(sorted[i]->key, sorted[i]->key_len, sorted[i]->count,
+			 sorted[i]->error, baton);
+	}
+	free(sorted);
+	return ret;
+}
@@ -0,0 +1,98 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file topk.h
+ * @brief Most frequent keys of a stream in fixed memory (Space-Saving).
+ *
+ * Keeps `size` counters; a new key takes over the counter of the least
+ * frequent one, inheriting its count as the possible overestimation.
+ *
+ * - each count is at most `error` over the real count, never below it
+ * - the error is at most N / size, where N is the total of the counts added,
+ *   so any key occurring more than N / size times is kept
+ * - summaries are mergeable, e.g. those of several processes: topk_merge()
+ *   adds the counts and the errors, the bounds add up, too
+ *
+ * Adding a key is a lookup in a trie and O(log size) in a heap.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	topk_t *tk = topk_create(1000, 32);
+ * 	topk_add(tk, "luke", strlen("luke"), 1, 0);
+ * 	topk_add(tk, "luke", strlen("luke"), 1, 0);
+ * 	topk_walk(tk, print_cb, NULL); // "luke", count 2, error 0
+ * 	topk_free(tk);
+ * @endcode
+ *
+ * \addtogroup generics
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/defines.h"
+
+/** Opaque summary. */
+typedef struct topk topk_t;
+
+/** Callback for topk_walk(), return non-zero to stop. */
+typedef int (*topk_walk_cb)(const void *key, uint32_t key_len, uint64_t count,
+			    uint64_t error, void *baton);
+
+/**
+ * Create an empty summary.
+ * @param size number of the counters kept
+ * @param key_maxlen length of the longest key
+ * @return summary or NULL
+ */
+KR_EXPORT
+topk_t *topk_create(uint32_t size, uint32_t key_maxlen);
+
+KR_EXPORT
+void topk_free(topk_t *tk);
+
+/** Remove all the keys. */
+KR_EXPORT
+void topk_clear(topk_t *tk);
+
+/**
+ * Count occurrences of the key.
+ * @param count the occurrences, typically 1
+ * @param error the overestimation already in the count, typically 0
+ * @return 0 or an error code, kr_error(EINVAL) for too long keys
+ */
+KR_EXPORT
+int topk_add(topk_t *tk, const void *key, uint32_t key_len, uint64_t count, uint64_t error);
+
+/** Add all the keys of `src` to `dst`, with their counts and errors. */
+KR_EXPORT
+int topk_merge(topk_t *dst, const topk_t *src);
+
+/** Return the number of keys kept. */
+KR_EXPORT
+uint32_t topk_len(const topk_t *tk);
+
+/**
+ * Call back for each key, from the most frequent.
+ * @return 0, the non-zero value of the callback or an error code
+ */
+KR_EXPORT
+int topk_walk(const topk_t *tk, topk_walk_cb cb, void *baton);
+
+/** @} */
@@ -107,10 +107,34 @@ union node {
 	branch_t branch;
 };
 
+/*! \brief A chunk of the arena, see trie_create_arena(). */
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t len;  /*!< Usable bytes in data. */
+	size_t used; /*!< Bytes handed out from data. */
+	char data[] __attribute__((aligned(16)));
+} arena_chunk_t;
+
+/*!
+ * \brief Memory of the twigs and keys of a trie, allocated in big chunks.
+ *
+ * Twig arrays have only 16 possible sizes (2..17 nodes), so each size has its
+ * free list and the freed arrays get reused.  Keys are bump-allocated only;
+ * the space of deleted keys is returned by trie_clear() or trie_free().
+ */
+typedef struct {
+	arena_chunk_t *chunks; /*!< The current one is first. */
+	node_t *free[18];      /*!< Free twig arrays, indexed by the node count. */
+} arena_t;
+
+/*! \brief The default size of arena chunks. */
+#define ARENA_CHUNK_SIZE (64 * 1024 - sizeof(arena_chunk_t))
+
 struct trie {
 	node_t root; // undefined when weight == 0, see empty_root()
 	size_t weight;
 	knot_mm_t mm;
+	arena_t *arena; /*!< NULL if allocating directly from mm. */
 };
 
 /*! \brief Make the root node empty (debug-only). */
@@ -231,6 +255,93 @@ static int key_cmp(const char *k1, uint32_t k1_len, const char *k2, uint32_t k2_
 	}
 }
 
+/*! \brief Allocate bytes from the arena chunks, 16-byte aligned. */
+static void* arena_alloc(trie_t *tbl, size_t size)
+{
+	arena_t *a = tbl->arena;
+	size = (size + 15) & ~(size_t)15;
+	arena_chunk_t *c = a->chunks;
+	if (unlikely(!c || c->len - c->used < size)) {
+		size_t len = MAX(ARENA_CHUNK_SIZE, size);
+		c = mm_alloc(&tbl->mm, sizeof(arena_chunk_t) + len);
+		if (unlikely(!c))
+			return NULL;
+		c->len = len;
+		c->used = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+	void *ret = c->data + c->used;
+	c->used += size;
+	return ret;
+}
+
+/*! \brief Free all the chunks of the arena, leaving it empty. */
+static void arena_clear(trie_t *tbl)
+{
+	arena_t *a = tbl->arena;
+	while (a->chunks) {
+		arena_chunk_t *next = a->chunks->next;
+		mm_free(&tbl->mm, a->chunks);
+		a->chunks = next;
+	}
+	memset(a->free, 0, sizeof(a->free));
+}
+
+/*! \brief Allocate an array of twigs. */
+static node_t* twigs_alloc(trie_t *tbl, uint count)
+{
+	if (!tbl->arena)
+		return mm_alloc(&tbl->mm, sizeof(node_t) * count);
+	assert(count >= 2 && count <= 17);
+	node_t *twigs = tbl->arena->free[count];
+	if (twigs) {
+		tbl->arena->free[count] = *(node_t **)twigs;
+		return twigs;
+	}
+	return arena_alloc(tbl, sizeof(node_t) * count);
+}
+
+/*! \brief Free an array of twigs. */
+static void twigs_free(trie_t *tbl, node_t *twigs, uint count)
+{
+	if (!tbl->arena) {
+		mm_free(&tbl->mm, twigs);
+		return;
+	}
+	assert(count >= 2 && count <= 17);
+	*(node_t **)twigs = tbl->arena->free[count];
+	tbl->arena->free[count] = twigs;
+}
+
+/*! \brief Resize an array of twigs, keeping the common prefix of the contents. */
+static node_t* twigs_realloc(trie_t *tbl, node_t *twigs, uint count, uint prev_count)
+{
+	if (!tbl->arena)
+		return mm_realloc(&tbl->mm, twigs, sizeof(node_t) * count,
+				  sizeof(node_t) * prev_count);
+	node_t *ret = twigs_alloc(tbl, count);
+	if (likely(ret != NULL)) {
+		memcpy(ret, twigs, sizeof(node_t) * MIN(count, prev_count));
+		twigs_free(tbl, twigs, prev_count);
+	}
+	return ret;
+}
+
+/*! \brief Allocate a key; it's 4-byte aligned, see FLAGS_HACK. */
+static tkey_t* key_alloc(trie_t *tbl, uint32_t len)
+{
+	if (!tbl->arena)
+		return mm_alloc(&tbl->mm, sizeof(tkey_t) + len);
+	return arena_alloc(tbl, sizeof(tkey_t) + len);
+}
+
+static void key_free(trie_t *tbl, tkey_t *key)
+{
+	if (!tbl->arena)
+		mm_free(&tbl->mm, key);
+}
+
 trie_t* trie_create(knot_mm_t *mm)
 {
 	assert_portability();
@@ -242,10 +353,25 @@ trie_t* trie_create(knot_mm_t *mm)
 			trie->mm = *mm;
 		else
 			mm_ctx_init(&trie->mm);
+		trie->arena = NULL;
 	}
 	return trie;
 }
 
+trie_t* trie_create_arena(knot_mm_t *mm)
+{
+	trie_t *trie = trie_create(mm);
+	if (trie == NULL)
+		return NULL;
+	trie->arena = mm_alloc(&trie->mm, sizeof(arena_t));
+	if (trie->arena == NULL) {
+		mm_free(&trie->mm, trie);
+		return NULL;
+	}
+	memset(trie->arena, 0, sizeof(arena_t));
+	return trie;
+}
+
 /*! \brief Free anything under the trie node, except for the passed pointer itself. */
 static void clear_trie(node_t *trie, knot_mm_t *mm)
 {
@@ -264,17 +390,24 @@ void trie_free(trie_t *tbl)
 {
 	if (tbl == NULL)
 		return;
-	if (tbl->weight)
+	if (tbl->arena) {
+		arena_clear(tbl);
+		mm_free(&tbl->mm, tbl->arena);
+	} else if (tbl->weight) {
 		clear_trie(&tbl->root, &tbl->mm);
+	}
 	mm_free(&tbl->mm, tbl);
 }
 
 void trie_clear(trie_t *tbl)
 {
 	assert(tbl);
+	if (tbl->arena)
+		arena_clear(tbl); // so that even the space of deleted keys is returned
 	if (!tbl->weight)
 		return;
-	clear_trie(&tbl->root, &tbl->mm);
+	if (!tbl->arena)
+		clear_trie(&tbl->root, &tbl->mm);
 	empty_root(&tbl->root);
 	tbl->weight = 0;
 }
@@ -303,6 +436,54 @@ trie_val_t* trie_get_try(trie_t *tbl, const char *key, uint32_t len)
 	return &t->leaf.val;
 }
 
+/*! \brief Look up a batch of keys below the node, see trie_get_many(). */
+static void get_many(node_t *t, const char * const keys[], const uint32_t lens[],
+		     size_t n, trie_val_t *vals[])
+{
+	if (!isbranch(t)) {
+		for (size_t i = 0; i < n; ++i) {
+			bool eq = key_cmp(keys[i], lens[i], t->leaf.key->chars,
+					  t->leaf.key->len) == 0;
+			vals[i] = eq ? &t->leaf.val : NULL;
+		}
+		return;
+	}
+	__builtin_prefetch(t->branch.twigs);
+	/* Split the batch into runs of keys going into the same child;
+	 * with sorted keys each child is visited once. */
+	size_t begin = 0;
+	while (begin < n) {
+		bitmap_t b = twigbit(t, keys[begin], lens[begin]);
+		size_t end = begin + 1;
+		while (end < n && twigbit(t, keys[end], lens[end]) == b)
+			++end;
+		if (!hastwig(t, b)) {
+			for (size_t i = begin; i < end; ++i)
+				vals[i] = NULL;
+		} else {
+			get_many(twig(t, twigoff(t, b)), keys + begin, lens + begin,
+				 end - begin, vals + begin);
+		}
+		begin = end;
+	}
+}
+
+size_t trie_get_many(trie_t *tbl, const char * const keys[], const uint32_t lens[],
+		     size_t n, trie_val_t *vals[])
+{
+	assert(tbl && (keys || !n) && (lens || !n) && (vals || !n));
+	if (!tbl->weight) {
+		for (size_t i = 0; i < n; ++i)
+			vals[i] = NULL;
+		return 0;
+	}
+	get_many(&tbl->root, keys, lens, n, vals);
+	size_t found = 0;
+	for (size_t i = 0; i < n; ++i)
+		found += vals[i] != NULL;
+	return found;
+}
+
 int trie_del(trie_t *tbl, const char *key, uint32_t len, trie_val_t *val)
 {
 	assert(tbl);
@@ -321,7 +502,7 @@ int trie_del(trie_t *tbl, const char *key, uint32_t len, trie_val_t *val)
 	}
 	if (key_cmp(key, len, t->leaf.key->chars, t->leaf.key->len) != 0)
 		return KNOT_ENOENT;
-	mm_free(&tbl->mm, t->leaf.key);
+	key_free(tbl, t->leaf.key);
 	if (val != NULL)
 		*val = t->leaf.val; // we return trie_val_t directly when deleting
 	--tbl->weight;
@@ -338,17 +519,17 @@ int trie_del(trie_t *tbl, const char *key, uint32_t len, trie_val_t *val)
 	if (cc == 2) { // collapse binary node p: move the other child to this node
 		node_t *twigs = p->twigs;
 		(*(node_t *)p) = twigs[1 - ci]; // it might be a leaf or branch
-		mm_free(&tbl->mm, twigs);
+		twigs_free(tbl, twigs, 2);
 		return KNOT_EOK;
 	}
 	memmove(p->twigs + ci, p->twigs + ci + 1, sizeof(node_t) * (cc - ci - 1));
 	p->bitmap &= ~b;
-	node_t *twigs = mm_realloc(&tbl->mm, p->twigs, sizeof(node_t) * (cc - 1),
-	                           sizeof(node_t) * cc);
+	node_t *twigs = twigs_realloc(tbl, p->twigs, cc - 1, cc);
 	if (likely(twigs != NULL))
 		p->twigs = twigs;
 		/* We can ignore mm_realloc failure, only beware that next time
-		 * the prev_size passed to it wouldn't be correct; TODO? */
+		 * the prev_size passed to it wouldn't be correct; TODO?
+		 * With an arena the bigger array is just reused as a smaller one. */
 	return KNOT_EOK;
 }
 
@@ -466,7 +647,7 @@ static int ns_find_branch(nstack_t *ns, const char *key, uint32_t len,
 	}
 	info->index = index;
 	if (first)
-		*first = lkey->len > index ? lkey->chars[index] : -256;
+		*first = lkey->len > index ? (byte)lkey->chars[index] : -256;
 	// Find flags: which half-byte has matched.
 	uint flags;
 	if (index == len && len == lkey->len) { // found equivalent key
@@ -607,27 +788,23 @@ static int ns_next_leaf(nstack_t *ns)
 	} while (true);
 }
 
-int trie_get_leq(trie_t *tbl, const char *key, uint32_t len, trie_val_t **val)
+/*!
+ * \brief Advance the node stack (with just the root) to the leaf less or equal to the key.
+ *
+ * \return KNOT_EOK for exact match, 1 for previous, KNOT_ENOENT for not-found,
+ *         or KNOT_E*; see trie_get_leq().
+ */
+static int ns_get_leq(nstack_t *ns, const char *key, uint32_t len)
 {
-	assert(tbl && val);
-	*val = NULL; // so on failure we can just return;
-	if (tbl->weight == 0)
-		return KNOT_ENOENT;
-	{ // Intentionally un-indented; until end of function, to bound cleanup attr.
+	assert(ns && ns->len == 1);
 	// First find a key with longest-matching prefix
-	__attribute__((cleanup(ns_cleanup)))
-		nstack_t ns_local;
-	ns_init(&ns_local, tbl);
-	nstack_t *ns = &ns_local;
 	branch_t bp;
 	int un_leaf; // first unmatched character in the leaf
 	ERR_RETURN(ns_find_branch(ns, key, len, &bp, &un_leaf));
-	int un_key = bp.index < len ? key[bp.index] : -256;
+	int un_key = bp.index < len ? (byte)key[bp.index] : -256;
 	node_t *t = ns->stack[ns->len - 1];
-	if (bp.flags == 0) { // found exact match
-		*val = &t->leaf.val;
+	if (bp.flags == 0) // found exact match
 		return KNOT_EOK;
-	}
 	// Get t: the last node on matching path
 	if (isbranch(t) && t->branch.index == bp.index && t->branch.flags == bp.flags) {
 		// t is OK
@@ -658,15 +835,68 @@ int trie_get_leq(trie_t *tbl, const char *key, uint32_t len, trie_val_t **val)
 	}
 success:
 	assert(!isbranch(ns->stack[ns->len - 1]));
-	*val = &ns->stack[ns->len - 1]->leaf.val;
 	return 1;
+}
+
+int trie_get_leq(trie_t *tbl, const char *key, uint32_t len, trie_val_t **val)
+{
+	assert(tbl && val);
+	*val = NULL; // so on failure we can just return;
+	if (tbl->weight == 0)
+		return KNOT_ENOENT;
+	nstack_t ns;
+	ns_init(&ns, tbl);
+	int ret = ns_get_leq(&ns, key, len);
+	if (ret == KNOT_EOK || ret == 1)
+		*val = &ns.stack[ns.len - 1]->leaf.val;
+	ns_cleanup(&ns);
+	return ret;
+}
+
+trie_val_t* trie_get_prefix(trie_t *tbl, const char *key, uint32_t len, uint32_t *plen)
+{
+	assert(tbl);
+	if (!tbl->weight)
+		return NULL;
+	// Find a leaf sharing the longest possible prefix with the key.
+	node_t *t = &tbl->root;
+	while (isbranch(t)) {
+		bitmap_t b = twigbit(t, key, len);
+		t = twig(t, hastwig(t, b) ? twigoff(t, b) : 0);
+	}
+	const tkey_t *lk = t->leaf.key;
+	const uint32_t lmax = MIN(len, lk->len);
+	uint32_t common = 0;
+	while (common < lmax && key[common] == lk->chars[common])
+		++common;
+	// The keys that are prefixes of it end at the branches on the path,
+	// and those up to the common length are prefixes of the key, too.
+	trie_val_t *found = NULL;
+	t = &tbl->root;
+	while (isbranch(t) && t->branch.index <= common) {
+		if (hastwig(t, 1 << 0)) {
+			found = &twig(t, 0)->leaf.val;
+			if (plen)
+				*plen = t->branch.index;
+		}
+		bitmap_t b = twigbit(t, key, len);
+		if (!hastwig(t, b))
+			return found;
+		t = twig(t, twigoff(t, b));
 	}
+	if (!isbranch(t) && t->leaf.key->len <= common
+	    && memcmp(key, t->leaf.key->chars, t->leaf.key->len) == 0) {
+		found = &t->leaf.val;
+		if (plen)
+			*plen = t->leaf.key->len;
+	}
+	return found;
 }
 
 /*! \brief Initialize a new leaf, copying the key, and returning failure code. */
-static int mk_leaf(node_t *leaf, const char *key, uint32_t len, knot_mm_t *mm)
+static int mk_leaf(node_t *leaf, const char *key, uint32_t len, trie_t *tbl)
 {
-	tkey_t *k = mm_alloc(mm, sizeof(tkey_t) + len);
+	tkey_t *k = key_alloc(tbl, len);
 	#if FLAGS_HACK
 		assert(((uintptr_t)k) % 4 == 0); // we need an aligned pointer
 	#endif
@@ -689,7 +919,7 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len)
 	assert(tbl);
 	// First leaf in an empty tbl?
 	if (unlikely(!tbl->weight)) {
-		if (unlikely(mk_leaf(&tbl->root, key, len, &tbl->mm)))
+		if (unlikely(mk_leaf(&tbl->root, key, len, tbl)))
 			return NULL;
 		++tbl->weight;
 		return &tbl->root.leaf.val;
@@ -708,7 +938,7 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len)
 	if (bp.flags == 0) // the same key was already present
 		return &t->leaf.val;
 	node_t leaf;
-	if (unlikely(mk_leaf(&leaf, key, len, &tbl->mm)))
+	if (unlikely(mk_leaf(&leaf, key, len, tbl)))
 		return NULL;
 
 	if (isbranch(t) && bp.index == t->branch.index && bp.flags == t->branch.flags) {
@@ -716,8 +946,7 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len)
 		bitmap_t b1 = twigbit(t, key, len);
 		assert(!hastwig(t, b1));
 		uint s, m; TWIGOFFMAX(s, m, t, b1); // new child position and original child count
-		node_t *twigs = mm_realloc(&tbl->mm, t->branch.twigs,
-				sizeof(node_t) * (m + 1), sizeof(node_t) * m);
+		node_t *twigs = twigs_realloc(tbl, t->branch.twigs, m + 1, m);
 		if (unlikely(!twigs))
 			goto err_leaf;
 		memmove(twigs + s + 1, twigs + s, sizeof(node_t) * (m - s));
@@ -735,7 +964,7 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len)
 				assert(hastwig(pt, twigbit(pt, key, len)));
 			}
 		#endif
-		node_t *twigs = mm_alloc(&tbl->mm, sizeof(node_t) * 2);
+		node_t *twigs = twigs_alloc(tbl, 2);
 		if (unlikely(!twigs))
 			goto err_leaf;
 		node_t t2 = *t; // Save before overwriting t.
@@ -751,7 +980,7 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len)
 		return &twig(t, twigoff(t, b1))->leaf.val;
 	};
 err_leaf:
-	mm_free(&tbl->mm, leaf.leaf.key);
+	key_free(tbl, leaf.leaf.key);
 	return NULL;
 	}
 }
@@ -776,6 +1005,183 @@ int trie_apply(trie_t *tbl, int (*f)(trie_val_t *, void *), void *d)
 	return apply_trie(&tbl->root, f, d);
 }
 
+/*
+ * Frozen tries: a read-only copy in a single block, with offsets instead of pointers.
+ */
+
+#define FROZEN_MAGIC 0x5a465051 /* "QPFZ" */
+/*! \brief Limit of the block size, as the key offsets have only 30 bits. */
+#define FROZEN_MAXLEN (1u << 30)
+
+/*! \brief A node of a frozen trie; offsets are from the start of the block. */
+typedef union {
+	struct {
+		uint32_t head;  /*!< flags (1 or 2) | bitmap << 2 */
+		uint32_t index;
+		uint32_t twigs; /*!< Offset of the array of children. */
+		uint32_t unused;
+	} branch;
+	struct {
+		uint32_t head;  /*!< 0 | offset of the key << 2 */
+		uint32_t len;   /*!< Length of the key. */
+		trie_val_t val;
+	} leaf;
+} fnode_t;
+
+struct trie_frozen {
+	uint32_t magic;
+	uint32_t node_count;
+	uint64_t size;     /*!< Of the whole block, including the keys after nodes. */
+	uint64_t weight;
+	uint64_t unused;
+	fnode_t nodes[];   /*!< The root first, then the levels below in order. */
+};
+
+/*! \brief Count the nodes below t (not t itself) and the bytes of keys. */
+static void freeze_count(const node_t *t, size_t *nodes, size_t *key_bytes)
+{
+	if (!isbranch(t)) {
+		*key_bytes += t->leaf.key->len;
+		return;
+	}
+	int child_count = bitmap_weight(t->branch.bitmap);
+	*nodes += child_count;
+	for (int i = 0; i < child_count; ++i)
+		freeze_count(t->branch.twigs + i, nodes, key_bytes);
+}
+
+size_t trie_freeze_size(const trie_t *tbl)
+{
+	assert(tbl);
+	size_t nodes = 0, key_bytes = 0;
+	if (tbl->weight) {
+		nodes = 1;
+		freeze_count(&tbl->root, &nodes, &key_bytes);
+	}
+	size_t size = sizeof(trie_frozen_t) + nodes * sizeof(fnode_t) + key_bytes;
+	return size < FROZEN_MAXLEN ? size : 0;
+}
+
+trie_frozen_t* trie_freeze(const trie_t *tbl, void *mem, size_t len)
+{
+	assert(tbl);
+	const size_t size = trie_freeze_size(tbl);
+	if (!mem || !size || len < size || ((uintptr_t)mem) % sizeof(uint64_t))
+		return NULL;
+	trie_frozen_t *fz = mem;
+	size_t node_count = 0, key_bytes = 0;
+	if (tbl->weight) {
+		node_count = 1;
+		freeze_count(&tbl->root, &node_count, &key_bytes);
+	}
+	/* Breadth-first, so that the top levels share the same few cache lines;
+	 * the original nodes waiting to be copied form a queue in orig[]. */
+	const node_t **orig = malloc(MAX(node_count, 1) * sizeof(*orig));
+	if (!orig)
+		return NULL;
+	size_t head = 0, tail = 0;
+	if (tbl->weight)
+		orig[tail++] = &tbl->root;
+	char *keys = (char *)(fz->nodes + node_count);
+	while (head < tail) {
+		const node_t *t = orig[head];
+		fnode_t *f = &fz->nodes[head];
+		if (isbranch(t)) {
+			int child_count = bitmap_weight(t->branch.bitmap);
+			f->branch.head = t->branch.flags | (t->branch.bitmap << 2);
+			f->branch.index = t->branch.index;
+			f->branch.twigs = (char *)&fz->nodes[tail] - (char *)fz;
+			f->branch.unused = 0;
+			for (int i = 0; i < child_count; ++i)
+				orig[tail++] = t->branch.twigs + i;
+		} else {
+			const tkey_t *k = t->leaf.key;
+			f->leaf.head = (keys - (char *)fz) << 2;
+			f->leaf.len = k->len;
+			f->leaf.val = t->leaf.val;
+			memcpy(keys, k->chars, k->len);
+			keys += k->len;
+		}
+		++head;
+	}
+	free(orig);
+	assert(node_count == tail && keys == (char *)fz + size);
+	fz->magic = FROZEN_MAGIC;
+	fz->node_count = node_count;
+	fz->size = size;
+	fz->weight = tbl->weight;
+	fz->unused = 0;
+	return fz;
+}
+
+const trie_frozen_t* trie_frozen_attach(const void *mem, size_t len)
+{
+	const trie_frozen_t *fz = mem;
+	if (!mem || len < sizeof(*fz) || ((uintptr_t)mem) % sizeof(uint64_t)
+	    || fz->magic != FROZEN_MAGIC || fz->size > len
+	    || sizeof(*fz) + (uint64_t)fz->node_count * sizeof(fnode_t) > fz->size
+	    || (fz->weight && !fz->node_count))
+		return NULL;
+	return fz;
+}
+
+size_t trie_frozen_weight(const trie_frozen_t *fz)
+{
+	assert(fz);
+	return fz->weight;
+}
+
+/*! \brief Return the node at the given offset of the block. */
+static inline const fnode_t* fnode_at(const trie_frozen_t *fz, uint32_t off)
+{
+	return (const fnode_t *)((const char *)fz + off);
+}
+
+const trie_val_t* trie_frozen_get_try(const trie_frozen_t *fz, const char *key, uint32_t len)
+{
+	assert(fz);
+	if (!fz->weight)
+		return NULL;
+	const fnode_t *t = &fz->nodes[0];
+	uint flags;
+	while ((flags = t->branch.head & 3) != 0) {
+		const fnode_t *twigs = fnode_at(fz, t->branch.twigs);
+		__builtin_prefetch(twigs);
+		const bitmap_t bitmap = t->branch.head >> 2;
+		const uint i = t->branch.index;
+		const bitmap_t b = i >= len ? 1 << 0 : nibbit((byte)key[i], flags);
+		if (!(bitmap & b))
+			return NULL;
+		t = twigs + bitmap_weight(bitmap & (b - 1));
+	}
+	const char *lkey = (const char *)fz + (t->leaf.head >> 2);
+	if (key_cmp(key, len, lkey, t->leaf.len) != 0)
+		return NULL;
+	return &t->leaf.val;
+}
+
+/*! \brief Apply a function to every leaf below t, in order; a recursive solution. */
+static int apply_frozen(const trie_frozen_t *fz, const fnode_t *t,
+			int (*f)(const char *, uint32_t, trie_val_t, void *), void *d)
+{
+	if ((t->branch.head & 3) == 0)
+		return f((const char *)fz + (t->leaf.head >> 2), t->leaf.len, t->leaf.val, d);
+	const fnode_t *twigs = fnode_at(fz, t->branch.twigs);
+	int child_count = bitmap_weight(t->branch.head >> 2);
+	for (int i = 0; i < child_count; ++i)
+		ERR_RETURN(apply_frozen(fz, twigs + i, f, d));
+	return KNOT_EOK;
+}
+
+int trie_frozen_apply(const trie_frozen_t *fz,
+		      int (*f)(const char *key, uint32_t len, trie_val_t val, void *d), void *d)
+{
+	assert(fz && f);
+	if (!fz->weight)
+		return KNOT_EOK;
+	return apply_frozen(fz, &fz->nodes[0], f, d);
+}
+
 /* These are all thin wrappers around static Tns* functions. */
 trie_it_t* trie_it_begin(trie_t *tbl)
 {
@@ -794,6 +1200,47 @@ trie_it_t* trie_it_begin(trie_t *tbl)
 	return it;
 }
 
+/*! \brief Create an iterator at the element less (or greater) or equal to the key. */
+static trie_it_t* it_begin_near(trie_t *tbl, const char *key, uint32_t len, bool geq)
+{
+	assert(tbl);
+	trie_it_t *it = malloc(sizeof(nstack_t));
+	if (!it)
+		return NULL;
+	ns_init(it, tbl);
+	if (it->len == 0) // empty tbl
+		return it;
+	int ret = ns_get_leq(it, key, len);
+	if (ret == 1 && geq) { // the previous one -> step to its successor
+		ret = ns_next_leaf(it);
+	} else if (ret == KNOT_ENOENT && geq) { // all are greater
+		it->len = 1;
+		ret = ns_first_leaf(it);
+	} else if (ret == 1) {
+		ret = KNOT_EOK;
+	}
+	if (ret == KNOT_ENOENT) {
+		it->len = 0;
+		ret = KNOT_EOK;
+	}
+	if (ret != KNOT_EOK) {
+		ns_cleanup(it);
+		free(it);
+		return NULL;
+	}
+	return it;
+}
+
+trie_it_t* trie_it_begin_geq(trie_t *tbl, const char *key, uint32_t len)
+{
+	return it_begin_near(tbl, key, len, true);
+}
+
+trie_it_t* trie_it_begin_leq(trie_t *tbl, const char *key, uint32_t len)
+{
+	return it_begin_near(tbl, key, len, false);
+}
+
 void trie_it_next(trie_it_t *it)
 {
 	assert(it && it->len);
@@ -32,12 +32,16 @@
  *
  * XXX EDITORS: trie.{h,c} are synced from
  * https://gitlab.labs.nic.cz/knot/knot-dns/tree/68352fc969/src/contrib/qp-trie
- * only with tiny adjustments, mostly #includes and KR_EXPORT.
+ * only with tiny adjustments, mostly #includes and KR_EXPORT;
+ * trie_get_many(), the arena and the frozen tries are local additions.
  */
 
 /*! \brief Element value. */
 typedef void* trie_val_t;
 
+/*! \brief Opaque structure holding a frozen QP-trie, see trie_freeze(). */
+typedef struct trie_frozen trie_frozen_t;
+
 /*! \brief Opaque structure holding a QP-trie. */
 typedef struct trie trie_t;
 
@@ -48,6 +52,16 @@ typedef struct trie_it trie_it_t;
 KR_EXPORT
 trie_t* trie_create(knot_mm_t *mm);
 
+/*!
+ * \brief Create a trie instance with the nodes and keys allocated from an arena.
+ *
+ * The memory is taken from mm in big chunks, so the nodes stay close together
+ * and freed nodes get reused; that suits big tries built once and read often.
+ * Space of deleted keys is only returned by trie_clear() and trie_free().
+ */
+KR_EXPORT
+trie_t* trie_create_arena(knot_mm_t *mm);
+
 /*! \brief Free a trie instance. */
 KR_EXPORT
 void trie_free(trie_t *tbl);
@@ -64,6 +78,18 @@ size_t trie_weight(const trie_t *tbl);
 KR_EXPORT
 trie_val_t* trie_get_try(trie_t *tbl, const char *key, uint32_t len);
 
+/*!
+ * \brief Search the trie for a batch of keys in a single traversal.
+ *
+ * The shared parts of the paths are walked only once, if the keys are sorted
+ * (memcmp order, shorter first on ties); unsorted batches work, only slower.
+ * \param vals the pointers to values are stored there, NULL for missing keys
+ * \return the number of keys found
+ */
+KR_EXPORT
+size_t trie_get_many(trie_t *tbl, const char * const keys[], const uint32_t lens[],
+		     size_t n, trie_val_t *vals[]);
+
 /*! \brief Search the trie, inserting NULL trie_val_t on failure. */
 KR_EXPORT
 trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len);
@@ -78,14 +104,25 @@ trie_val_t* trie_get_ins(trie_t *tbl, const char *key, uint32_t len);
  * \return KNOT_EOK for exact match, 1 for previous, KNOT_ENOENT for not-found,
  *         or KNOT_E*.
  */
+KR_EXPORT
 int trie_get_leq(trie_t *tbl, const char *key, uint32_t len, trie_val_t **val);
 
+/*!
+ * \brief Search for the longest key that is a prefix of the key (or equal to it).
+ *
+ * \param plen If not NULL, the length of the found key is stored there.
+ * \return NULL if there's no such key.
+ */
+KR_EXPORT
+trie_val_t* trie_get_prefix(trie_t *tbl, const char *key, uint32_t len, uint32_t *plen);
+
 /*!
  * \brief Apply a function to every trie_val_t, in order.
  *
  * \param d Parameter passed as the second argument to f().
  * \return First nonzero from f() or zero (i.e. KNOT_EOK).
  */
+KR_EXPORT
 int trie_apply(trie_t *tbl, int (*f)(trie_val_t *, void *), void *d);
 
 /*!
@@ -100,6 +137,18 @@ int trie_del(trie_t *tbl, const char *key, uint32_t len, trie_val_t *val);
 KR_EXPORT
 trie_it_t* trie_it_begin(trie_t *tbl);
 
+/*! \brief Create a new iterator pointing to the first element not less than the key. */
+KR_EXPORT
+trie_it_t* trie_it_begin_geq(trie_t *tbl, const char *key, uint32_t len);
+
+/*!
+ * \brief Create a new iterator pointing to the last element not greater than the key.
+ *
+ * It's finished right away if there's no such element; see also trie_get_leq().
+ */
+KR_EXPORT
+trie_it_t* trie_it_begin_leq(trie_t *tbl, const char *key, uint32_t len);
+
 /*!
  * \brief Advance the iterator to the next element.
  *
@@ -129,3 +178,45 @@ const char* trie_it_key(trie_it_t *it, size_t *len);
 /*! \brief Return pointer to the value of the current element (writable). */
 KR_EXPORT
 trie_val_t* trie_it_val(trie_it_t *it);
+
+/*!
+ * \brief Return the size of the block needed by trie_freeze(), or 0 if too big (1 GiB).
+ */
+KR_EXPORT
+size_t trie_freeze_size(const trie_t *tbl);
+
+/*!
+ * \brief Compact the trie into a read-only block, usable by the trie_frozen_*() functions.
+ *
+ * The block contains offsets instead of pointers, so it may be moved, written
+ * to a file or mapped in several processes (e.g. forks); there it's opened
+ * by trie_frozen_attach().  The values are copied as they are, so for sharing
+ * they should rather be integers or offsets than pointers.
+ * The lookups are prefetch-friendly: the nodes are stored level by level.
+ *
+ * \param mem block of at least trie_freeze_size() bytes, 8-byte aligned
+ * \return the frozen trie (at mem) or NULL
+ */
+KR_EXPORT
+trie_frozen_t* trie_freeze(const trie_t *tbl, void *mem, size_t len);
+
+/*! \brief Check a block made by trie_freeze() and return the frozen trie in it, or NULL. */
+KR_EXPORT
+const trie_frozen_t* trie_frozen_attach(const void *mem, size_t len);
+
+/*! \brief Return the number of keys in the frozen trie. */
+KR_EXPORT
+size_t trie_frozen_weight(const trie_frozen_t *fz);
+
+/*! \brief Search the frozen trie, returning NULL on failure. */
+KR_EXPORT
+const trie_val_t* trie_frozen_get_try(const trie_frozen_t *fz, const char *key, uint32_t len);
+
+/*!
+ * \brief Apply a function to every key and value of the frozen trie, in order.
+ *
+ * \return First nonzero from f() or zero (i.e. KNOT_EOK).
+ */
+KR_EXPORT
+int trie_frozen_apply(const trie_frozen_t *fz,
+		      int (*f)(const char *key, uint32_t len, trie_val_t val, void *d), void *d);
@@ -85,6 +85,10 @@ struct kr_layer_api {
 
 	/** The module can store anything in here. */
 	void *data;
+
+	/** The layer needn't see plain queries answered wholly from cache,
+	 * so the daemon may answer them without a request; see engine->fast_path. */
+	bool skip_hits;
 };
 
 typedef struct kr_layer_api kr_layer_api_t;
@@ -97,3 +101,10 @@ struct kr_layer_pickle {
     unsigned state;
 };
 
+struct kr_module;
+
+/* The layers of the embedded modules, see lib/module.c */
+const kr_layer_api_t *iterate_layer(struct kr_module *module);
+const kr_layer_api_t *validate_layer(struct kr_module *module);
+const kr_layer_api_t *cache_layer(struct kr_module *module);
+
@@ -23,6 +23,7 @@ const kr_layer_api_t *cache_layer(struct kr_module *module)
 	static const kr_layer_api_t _layer = {
 		.produce = &cache_peek,
 		.consume = &cache_stash,
+		.skip_hits = true,
 	};
 
 	return &_layer;
@@ -59,10 +59,14 @@ static const knot_dname_t *minimized_qname(struct kr_query *query, uint16_t *qty
 		return qname;
 	}
 
-	/* Minimize name to contain current zone cut + 1 label. */
+	/* Minimize name to contain current zone cut + 1 label,
+	 * or more if the zone is known not to delegate them. */
+	const struct kr_request *req = query->request;
 	int cut_labels = knot_dname_labels(query->zone_cut.name, NULL);
+	int depth = req && req->ctx
+		? kr_zonecut_get_depth(req->ctx->cache_depth, query->zone_cut.name) : 1;
 	int qname_labels = knot_dname_labels(qname, NULL);
-	while(qname[0] && qname_labels > cut_labels + 1) {
+	while(qname[0] && qname_labels > cut_labels + depth) {
 		qname = knot_wire_next_label(qname, NULL);
 		qname_labels -= 1;
 	}
@@ -78,14 +82,25 @@ static const knot_dname_t *minimized_qname(struct kr_query *query, uint16_t *qty
 /** Answer is paired to query. */
 static bool is_paired_to_query(const knot_pkt_t *answer, struct kr_query *query)
 {
-	uint16_t qtype = query->stype;
-	const knot_dname_t *qname = minimized_qname(query, &qtype);
-
-	return query->id      == knot_wire_get_id(answer->wire) &&
-	       knot_wire_get_qdcount(answer->wire) > 0 &&
-	       query->sclass  == knot_pkt_qclass(answer) &&
-	       qtype          == knot_pkt_qtype(answer) &&
-	       knot_dname_is_equal(qname, knot_pkt_qname(answer));
+	if (query->id != knot_wire_get_id(answer->wire) ||
+	    knot_wire_get_qdcount(answer->wire) == 0 ||
+	    query->sclass != knot_pkt_qclass(answer)) {
+		return false;
+	}
+	const knot_dname_t *qname = knot_pkt_qname(answer);
+	const uint16_t qtype = knot_pkt_qtype(answer);
+	if (knot_dname_is_equal(qname, query->sname)) {
+		return qtype == query->stype;
+	}
+	/* Minimized QNAME; the depth may have been learned meanwhile,
+	 * so any name between the zone cut and the full name is possible. */
+	if (query->flags.NO_MINIMIZE || query->flags.STUB) {
+		return false;
+	}
+	return qtype == KNOT_RRTYPE_NS &&
+	       knot_dname_in(qname, query->sname) &&
+	       knot_dname_in(query->zone_cut.name, qname) &&
+	       !knot_dname_is_equal(query->zone_cut.name, qname);
 }
 
 /** Relaxed rule for AA, either AA=1 or SOA matching zone cut is required. */
@@ -195,47 +210,42 @@ static void fetch_glue(knot_pkt_t *pkt, const knot_dname_t *ns, bool in_bailiwic
 			struct kr_request *req, const struct kr_query *qry, int *glue_cnt)
 {
 	ranked_rr_array_t *selected[] = kr_request_selected(req);
-	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
-		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
-		for (unsigned k = 0; k < sec->count; ++k) {
-			const knot_rrset_t *rr = knot_pkt_rr(sec, k);
-			if (!knot_dname_is_equal(ns, rr->owner)) {
-				continue;
-			}
-			if ((rr->type != KNOT_RRTYPE_A) &&
-			    (rr->type != KNOT_RRTYPE_AAAA)) {
-				continue;
-			}
+	unsigned it = 0;
+	knot_section_t i;
+	const knot_rrset_t *rr;
+	while ((rr = kr_pkt_index_next(req->pkt_index, pkt, ns, KR_PKT_INDEX_ALL,
+				       &it, &i))) {
+		if ((rr->type != KNOT_RRTYPE_A) &&
+		    (rr->type != KNOT_RRTYPE_AAAA)) {
+			continue;
+		}
 
-			uint8_t rank = (in_bailiwick && i == KNOT_ANSWER)
-				? (KR_RANK_INITIAL | KR_RANK_AUTH) : KR_RANK_OMIT;
-			(void) kr_ranked_rrarray_add(selected[i], rr, rank,
-							false, qry->uid, &req->pool);
+		uint8_t rank = (in_bailiwick && i == KNOT_ANSWER)
+			? (KR_RANK_INITIAL | KR_RANK_AUTH) : KR_RANK_OMIT;
+		(void) kr_ranked_rrarray_add(selected[i], rr, rank,
+						false, qry->uid, &req->pool);
 
-			if ((rr->type == KNOT_RRTYPE_A) &&
-			    (req->ctx->options.NO_IPV4)) {
-				continue;
-			}
-			if ((rr->type == KNOT_RRTYPE_AAAA) &&
-			    (req->ctx->options.NO_IPV6)) {
-				continue;
-			}
-			(void) update_nsaddr(rr, req->current_query, glue_cnt);
+		if ((rr->type == KNOT_RRTYPE_A) &&
+		    (req->ctx->options.NO_IPV4)) {
+			continue;
+		}
+		if ((rr->type == KNOT_RRTYPE_AAAA) &&
+		    (req->ctx->options.NO_IPV6)) {
+			continue;
 		}
+		(void) update_nsaddr(rr, req->current_query, glue_cnt);
 	}
 }
 
 /** Attempt to find glue for given nameserver name (best effort). */
-static bool has_glue(knot_pkt_t *pkt, const knot_dname_t *ns)
+static bool has_glue(knot_pkt_t *pkt, const knot_dname_t *ns,
+		     const struct kr_pkt_index *idx)
 {
-	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
-		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
-		for (unsigned k = 0; k < sec->count; ++k) {
-			const knot_rrset_t *rr = knot_pkt_rr(sec, k);
-			if (knot_dname_is_equal(ns, rr->owner) &&
-			    (rr->type == KNOT_RRTYPE_A || rr->type == KNOT_RRTYPE_AAAA)) {
-				return true;
-			}
+	unsigned it = 0;
+	const knot_rrset_t *rr;
+	while ((rr = kr_pkt_index_next(idx, pkt, ns, KR_PKT_INDEX_ALL, &it, NULL))) {
+		if (rr->type == KNOT_RRTYPE_A || rr->type == KNOT_RRTYPE_AAAA) {
+			return true;
 		}
 	}
 	return false;
@@ -272,6 +282,12 @@ static int update_cut(knot_pkt_t *pkt, const knot_rrset_t *rr,
 
 	/* Update zone cut name */
 	if (!knot_dname_is_equal(rr->owner, cut->name)) {
+		/* The parent delegates at this depth, don't reveal more to it. */
+		if (!qry->flags.CACHED) {
+			kr_zonecut_set_depth(req->ctx->cache_depth, cut->name,
+					     knot_dname_labels(rr->owner, NULL)
+					     - knot_dname_labels(cut->name, NULL));
+		}
 		/* Remember parent cut and descend to new (keep keys and TA). */
 		struct kr_zonecut *parent = mm_alloc(&req->pool, sizeof(*parent));
 		if (parent) {
@@ -290,7 +306,7 @@ static int update_cut(knot_pkt_t *pkt, const knot_rrset_t *rr,
 	for (unsigned i = 0; i < rr->rrs.rr_count; ++i) {
 		const knot_dname_t *ns_name = knot_ns_name(&rr->rrs, i);
 		/* Glue is mandatory for NS below zone */
-		if (knot_dname_in(rr->owner, ns_name) && !has_glue(pkt, ns_name)) {
+		if (knot_dname_in(rr->owner, ns_name) && !has_glue(pkt, ns_name, req->pkt_index)) {
 			const char *msg =
 				"<= authority: missing mandatory glue, skipping NS";
 			WITH_VERBOSE(qry) {
@@ -490,16 +506,17 @@ static int unroll_cname(knot_pkt_t *pkt, struct kr_request *req, bool referral,
 		cname = pending_cname;
 		pending_cname = NULL;
 		const int cname_labels = knot_dname_labels(cname, NULL);
-		for (unsigned i = 0; i < an->count; ++i) {
-			const knot_rrset_t *rr = knot_pkt_rr(an, i);
-
+		unsigned it = 0;
+		const knot_rrset_t *rr;
+		while ((rr = kr_pkt_index_next(req->pkt_index, pkt, cname,
+					       KR_PKT_INDEX_SECTION(KNOT_ANSWER),
+					       &it, NULL))) {
 			/* Skip the RR if its owner+type doesn't interest us. */
 			const uint16_t type = kr_rrset_type_maysig(rr);
 			const bool type_OK = rr->type == query->stype || type == query->stype
 				|| type == KNOT_RRTYPE_CNAME || type == KNOT_RRTYPE_DNAME;
 				/* TODO: actually handle DNAMEs */
-			if (rr->rclass != KNOT_CLASS_IN || !type_OK
-			    || !knot_dname_is_equal(rr->owner, cname)) {
+			if (rr->rclass != KNOT_CLASS_IN || !type_OK) {
 				continue;
 			}
 
@@ -564,6 +581,10 @@ static int unroll_cname(knot_pkt_t *pkt, struct kr_request *req, bool referral,
 			cname = pending_cname;
 			break;
 		}
+		/* A cached chain was put together from the answers of its zones. */
+		if (query->flags.CNAME_CHAIN) {
+			continue;
+		}
 		/* try to unroll cname only within current zone */
 		const int pending_labels = knot_dname_labels(pending_cname, NULL);
 		if (pending_labels != cname_labels) {
@@ -659,6 +680,13 @@ static int process_answer(knot_pkt_t *pkt, struct kr_request *req)
 	if (!knot_dname_is_equal(knot_pkt_qname(pkt), query->sname) &&
 	    (pkt_class & (PKT_NOERROR|PKT_NXDOMAIN|PKT_REFUSED|PKT_NODATA))) {
 		VERBOSE_MSG("<= found cut, retrying with non-minimized name\n");
+		/* The zone has the name, reveal the next label as well next time. */
+		if (!(pkt_class & PKT_REFUSED) && !query->flags.CACHED
+		    && is_authoritative(pkt, query)) {
+			kr_zonecut_set_depth(req->ctx->cache_depth, query->zone_cut.name,
+					     knot_dname_labels(knot_pkt_qname(pkt), NULL)
+					     - knot_dname_labels(query->zone_cut.name, NULL) + 1);
+		}
 		query->flags.NO_MINIMIZE = true;
 		return KR_STATE_CONSUME;
 	}
@@ -964,6 +992,18 @@ static int resolve(kr_layer_t *ctx, knot_pkt_t *pkt)
 		VERBOSE_MSG("<= malformed response\n");
 		return resolve_badmsg(pkt, req, query);
 	} else if (!is_paired_to_query(pkt, query)) {
+		/* The QNAME is compared case-sensitively, after the 0x20 of the query
+		 * has been undone.  Servers that don't keep the case are asked again
+		 * over TCP (which doesn't need 0x20) instead of the usual workarounds. */
+		if (!query->flags.TCP && !query->flags.NO_0X20 && !query->flags.SAFEMODE) {
+			knot_dname_to_lower((knot_dname_t *)knot_pkt_qname(pkt));
+			if (is_paired_to_query(pkt, query)) {
+				VERBOSE_MSG("<= QNAME case changed (0x20), retrying over TCP\n");
+				query->flags.TCP = true;
+				query->flags.NO_0X20 = true;
+				return KR_STATE_CONSUME;
+			}
+		}
 		VERBOSE_MSG("<= ignoring mismatching response\n");
 		/* Force TCP, to work around authoritatives messing up question
 		 * without yielding to spoofed responses. */
@@ -1048,7 +1088,8 @@ const kr_layer_api_t *iterate_layer(struct kr_module *module)
 		.begin = &begin,
 		.reset = &reset,
 		.consume = &resolve,
-		.produce = &prepare_query
+		.produce = &prepare_query,
+		.skip_hits = true,
 	};
 	return &_layer;
 }
@@ -16,6 +16,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,41 +41,11 @@
 
 #define MAX_REVALIDATION_CNT 2
 
-/**
- * Search in section for given type.
- * @param sec  Packet section.
- * @param type Type to search for.
- * @return     True if found.
- */
-static bool section_has_type(const knot_pktsection_t *sec, uint16_t type)
-{
-	if (!sec) {
-		return false;
-	}
-
-	for (unsigned i = 0; i < sec->count; ++i) {
-		const knot_rrset_t *rr = knot_pkt_rr(sec, i);
-		if (rr->type == type) {
-			return true;
-		}
-	}
-
-	return false;
-}
-
-static bool pkt_has_type(const knot_pkt_t *pkt, uint16_t type)
+/** Signature checks allowed for one answer, see kr_budget::signatures (0 for no limit). */
+static int limit_crypto(const struct kr_request *req)
 {
-	if (!pkt) {
-		return false;
-	}
-
-	if (section_has_type(knot_pkt_section(pkt, KNOT_ANSWER), type)) {
-		return true;
-	}
-	if (section_has_type(knot_pkt_section(pkt, KNOT_AUTHORITY), type)) {
-		return true;
-	}
-	return section_has_type(knot_pkt_section(pkt, KNOT_ADDITIONAL), type);
+	const uint32_t limit = req->ctx->budget.signatures;
+	return limit == 0 || limit > INT_MAX ? INT_MAX : limit;
 }
 
 static int validate_section(kr_rrset_validation_ctx_t *vctx, const struct kr_query *qry,
@@ -131,6 +102,12 @@ static int validate_section(kr_rrset_validation_ctx_t *vctx, const struct kr_que
 			 * to MISMATCH on revalidation, e.g. in test val_referral_nods :-/
 			 */
 
+		} else if (validation_result == kr_error(E2BIG)) {
+			VERBOSE_MSG(qry, ">< too many signatures to check, bogus\n");
+			kr_rank_set(&entry->rank, KR_RANK_BOGUS);
+			vctx->err_cnt += 1;
+			break;
+
 		} else if (validation_result == kr_error(ENOENT)) {
 			/* no RRSIGs found */
 			kr_rank_set(&entry->rank, KR_RANK_MISSING);
@@ -163,6 +140,7 @@ static int validate_records(struct kr_request *req, knot_pkt_t *answer, knot_mm_
 		.has_nsec3	= has_nsec3,
 		.flags		= 0,
 		.err_cnt	= 0,
+		.limit_crypto_remains = limit_crypto(req),
 		.result		= 0
 	};
 
@@ -241,6 +219,7 @@ static int validate_keyset(struct kr_request *req, knot_pkt_t *answer, bool has_
 			.qry_uid	= qry->uid,
 			.has_nsec3	= has_nsec3,
 			.flags		= 0,
+			.limit_crypto_remains = limit_crypto(req),
 			.result		= 0
 		};
 		int ret = kr_dnskeys_trusted(&vctx, qry->zone_cut.trust_anchor);
@@ -443,6 +422,15 @@ static int update_delegation(struct kr_request *req, struct kr_query *qry, knot_
 	/* Extend trust anchor */
 	VERBOSE_MSG(qry, "<= DS: OK\n");
 	cut->trust_anchor = new_ds;
+	/* Have the DNSKEY of the child resolved by a separate request, while
+	 * this query goes on to the child; see trust_chain_check(). */
+	struct kr_context *ctx = req->ctx;
+	if (referral && qry->flags.DNSKEY_AHEAD && !qry->flags.FORWARD && ctx->side_query
+	    && !qry->flags.NO_CACHE && !qry->flags.STUB
+	    && ctx->side_query(new_ds->owner, KNOT_RRTYPE_DNSKEY, KNOT_CLASS_IN) == 0) {
+		VERBOSE_MSG(qry, "=> DNSKEY asked for ahead of the answer\n");
+		qry->flags.DNSKEY_PENDING = true;
+	}
 	return ret;
 }
 
@@ -505,7 +493,7 @@ static int rrsig_not_found(kr_layer_t *ctx, const knot_rrset_t *rr)
 	}
 	kr_zonecut_init(&next->zone_cut, cut_name_start, &req->pool);
 	if (use_cut) {
-		kr_zonecut_copy(&next->zone_cut, cut);
+		kr_zonecut_share(&next->zone_cut, cut);
 		kr_zonecut_copy_trust(&next->zone_cut, cut);
 	} else {
 		next->flags.AWAIT_CUT = true;
@@ -839,7 +827,7 @@ static int wildcard_adjust_to_wire(struct kr_request *req, const struct kr_query
 	return kr_ok();
 }
 
-static int validate(kr_layer_t *ctx, knot_pkt_t *pkt)
+static int validate_real(kr_layer_t *ctx, knot_pkt_t *pkt)
 {
 	int ret = 0;
 	struct kr_request *req = ctx->req;
@@ -909,7 +897,8 @@ static int validate(kr_layer_t *ctx, knot_pkt_t *pkt)
 
 	/* Check if this is a DNSKEY answer, check trust chain and store. */
 	uint16_t qtype = knot_pkt_qtype(pkt);
-	bool has_nsec3 = pkt_has_type(pkt, KNOT_RRTYPE_NSEC3);
+	bool has_nsec3 = kr_pkt_index_has_type(req->pkt_index, pkt, KNOT_RRTYPE_NSEC3,
+					       KR_PKT_INDEX_ALL);
 	const knot_pktsection_t *an = knot_pkt_section(pkt, KNOT_ANSWER);
 	const bool referral = (an->count == 0 && !knot_wire_get_aa(pkt->wire));
 
@@ -934,6 +923,16 @@ static int validate(kr_layer_t *ctx, knot_pkt_t *pkt)
 		}
 	}
 
+	/* The DNSKEY of the cut is being resolved alongside, see update_delegation();
+	 * hold the answer until trust_chain_check() has the key. */
+	const struct kr_zonecut *cut = &qry->zone_cut;
+	if (qry->flags.DNSKEY_PENDING && ctx->state != KR_STATE_YIELD
+	    && !qry->flags.CACHED && qtype != KNOT_RRTYPE_DNSKEY && cut->trust_anchor
+	    && (!cut->key || !knot_dname_is_equal(cut->key->owner, cut->trust_anchor->owner))) {
+		VERBOSE_MSG(qry, ">< DNSKEY not here yet, holding the answer\n");
+		return KR_STATE_YIELD;
+	}
+
 	if (knot_wire_get_aa(pkt->wire) && qtype == KNOT_RRTYPE_DNSKEY) {
 		ret = validate_keyset(req, pkt, has_nsec3);
 		if (ret == kr_error(EAGAIN)) {
@@ -1076,11 +1075,24 @@ static int validate(kr_layer_t *ctx, knot_pkt_t *pkt)
 	VERBOSE_MSG(qry, "<= answer valid, OK\n");
 	return KR_STATE_DONE;
 }
+
+static int validate(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	kr_probe(validate_start, ctx->req, ctx->req->current_query->sname,
+		 ctx->req->current_query->stype);
+	int state = validate_real(ctx, pkt);
+	kr_probe(validate_done, ctx->req, ctx->req->current_query->sname,
+		 ctx->req->current_query->stype, state,
+		 ctx->req->current_query->flags.DNSSEC_BOGUS);
+	return state;
+}
+
 /** Module implementation. */
 const kr_layer_api_t *validate_layer(struct kr_module *module)
 {
 	static const kr_layer_api_t _layer = {
 		.consume = &validate,
+		.skip_hits = true, /* cached records have been validated */
 	};
 	/* Store module reference */
 	return &_layer;
@@ -1,26 +1,48 @@
 libkres_SOURCES := \
 	lib/cache/api.c \
 	lib/cache/cdb_lmdb.c \
+	lib/cache/cdb_mem.c \
+	lib/cache/cdb_shards.c \
+	lib/cache/ecs.c \
 	lib/cache/entry_list.c \
 	lib/cache/entry_pkt.c \
 	lib/cache/entry_rr.c \
+	lib/cache/flush.c \
+	lib/cache/iter.c \
 	lib/cache/knot_pkt.c \
+	lib/cache/l1.c \
 	lib/cache/nsec1.c \
+	lib/cache/nsec3.c \
+	lib/cache/remote.c \
+	lib/cache/snapshot.c \
 	lib/dnssec.c \
 	lib/dnssec/nsec.c \
 	lib/dnssec/nsec3.c \
 	lib/dnssec/signature.c \
 	lib/dnssec/ta.c \
+	lib/ecs.c \
+	lib/filter.c \
+	lib/forward.c \
+	lib/generic/cmsketch.c \
+	lib/generic/hash.c \
 	lib/generic/lru.c \
 	lib/generic/map.c \
+	lib/generic/shcounters.c \
+	lib/generic/shlru.c \
+	lib/generic/shtable.c \
+	lib/generic/timer_wheel.c \
+	lib/generic/topk.c \
 	lib/generic/trie.c \
 	lib/layer/cache.c \
 	lib/layer/iterate.c \
 	lib/layer/validate.c \
+	lib/localzones.c \
 	lib/module.c \
 	lib/nsrep.c \
+	lib/pktindex.c \
 	lib/resolve.c \
 	lib/rplan.c \
+	lib/trace.c \
 	lib/utils.c \
 	lib/zonecut.c
 
@@ -28,6 +50,7 @@ libkres_HEADERS := \
 	lib/cache/api.h \
 	lib/cache/cdb_api.h \
 	lib/cache/cdb_lmdb.h \
+	lib/cache/cdb_mem.h \
 	lib/cache/impl.h \
 	lib/defines.h \
 	lib/dnssec.h \
@@ -35,31 +58,45 @@ libkres_HEADERS := \
 	lib/dnssec/nsec3.h \
 	lib/dnssec/signature.h \
 	lib/dnssec/ta.h \
+	lib/ecs.h \
+	lib/filter.h \
+	lib/forward.h \
 	lib/generic/array.h \
+	lib/generic/cmsketch.h \
+	lib/generic/hash.h \
 	lib/generic/lru.h \
 	lib/generic/map.h \
 	lib/generic/pack.h \
+	lib/generic/shcounters.h \
+	lib/generic/shlru.h \
+	lib/generic/shtable.h \
+	lib/generic/timer_wheel.h \
+	lib/generic/topk.h \
 	lib/generic/trie.h \
 	lib/layer.h \
 	lib/layer/iterate.h \
+	lib/localzones.h \
 	lib/module.h \
 	lib/nsrep.h \
+	lib/pktindex.h \
 	lib/resolve.h \
 	lib/rplan.h \
+	lib/trace.h \
 	lib/utils.h \
 	lib/zonecut.h
 
 # Dependencies
 libkres_DEPEND := $(contrib)
-libkres_CFLAGS := -fPIC $(lmdb_CFLAGS)
+libkres_CFLAGS := -fPIC -pthread $(lmdb_CFLAGS)
 libkres_LIBS := $(contrib_TARGET) $(libknot_LIBS) $(libdnssec_LIBS) $(lmdb_LIBS) \
-				$(libuv_LIBS) $(gnutls_LIBS)
+				$(libuv_LIBS) $(gnutls_LIBS) -pthread
 libkres_TARGET := -L$(abspath lib) -lkres
 
 ifeq ($(ENABLE_COOKIES),yes)
 libkres_SOURCES += \
 	lib/cookies/alg_containers.c \
 	lib/cookies/alg_sha.c \
+	lib/cookies/alg_siphash.c \
 	lib/cookies/helper.c \
 	lib/cookies/lru_cache.c \
 	lib/cookies/nonce.c
@@ -67,6 +104,7 @@ libkres_SOURCES += \
 libkres_HEADERS += \
 	lib/cookies/alg_containers.h \
 	lib/cookies/alg_sha.h \
+	lib/cookies/alg_siphash.h \
 	lib/cookies/control.h \
 	lib/cookies/helper.h \
 	lib/cookies/lru_cache.h \
@@ -0,0 +1,334 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <libknot/descriptor.h>
+#include <libknot/rrset.h>
+
+#include "lib/localzones.h"
+#include "lib/utils.h"
+#include "lib/generic/trie.h"
+
+enum localzone_kind {
+	LOCAL_EMPTY = 0,  /**< RFC 6303 empty zone */
+	LOCAL_SPECIAL,    /**< special-use name, nothing exists */
+	LOCAL_LOCALHOST,  /**< localhost. */
+	LOCAL_REVERSE,    /**< reverse zone of localhost */
+};
+
+/** Most zones, see zones_init(). */
+#define LOCALZONES_MAX 128
+
+struct localzone {
+	knot_rrset_t soa;
+	knot_rrset_t ns;
+	const knot_dname_t *host;  /**< name of the PTR localhost. (reverse zones) */
+	const knot_rrset_t *txt;   /**< explanation of the negative answers, or NULL */
+	uint8_t kind;
+};
+
+static const struct {
+	const char *name;
+	uint8_t kind;
+} zone_names[] = {
+	{ "localhost.", LOCAL_LOCALHOST },
+	{ "127.in-addr.arpa.", LOCAL_REVERSE },
+	{ "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.", LOCAL_REVERSE },
+	/* RFC 6303, the 172.16/12 zones are added by zones_init() */
+	{ "10.in-addr.arpa.", LOCAL_EMPTY },
+	{ "168.192.in-addr.arpa.", LOCAL_EMPTY },
+	{ "0.in-addr.arpa.", LOCAL_EMPTY },
+	{ "254.169.in-addr.arpa.", LOCAL_EMPTY },
+	{ "2.0.192.in-addr.arpa.", LOCAL_EMPTY },
+	{ "100.51.198.in-addr.arpa.", LOCAL_EMPTY },
+	{ "113.0.203.in-addr.arpa.", LOCAL_EMPTY },
+	{ "255.255.255.255.in-addr.arpa.", LOCAL_EMPTY },
+	{ "0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.", LOCAL_EMPTY },
+	{ "d.f.ip6.arpa.", LOCAL_EMPTY },
+	{ "8.e.f.ip6.arpa.", LOCAL_EMPTY },
+	{ "9.e.f.ip6.arpa.", LOCAL_EMPTY },
+	{ "a.e.f.ip6.arpa.", LOCAL_EMPTY },
+	{ "b.e.f.ip6.arpa.", LOCAL_EMPTY },
+	{ "8.b.d.0.1.0.0.2.ip6.arpa.", LOCAL_EMPTY },
+	/* RFC 6761, RFC 7686 and RFC 6762 sec. 22.1 */
+	{ "test.", LOCAL_SPECIAL },
+	{ "onion.", LOCAL_SPECIAL },
+	{ "invalid.", LOCAL_SPECIAL },
+	{ "local.", LOCAL_SPECIAL },
+};
+
+static const char msg_empty[] = "Blocking is mandated by standards, see references on "
+	"https://www.iana.org/assignments/locally-served-dns-zones/locally-served-dns-zones.xhtml";
+static const char msg_special[] = "Blocking is mandated by standards, see references on "
+	"https://www.iana.org/assignments/special-use-domain-names/special-use-domain-names.xhtml";
+
+/** The zones and the records shared by them; the owners of a, aaaa and ptr are set when used. */
+static struct {
+	trie_t *names;  /**< zone name -> struct localzone */
+	struct localzone zones[LOCALZONES_MAX];
+	int count;
+	knot_rrset_t txt_empty, txt_special;
+	knot_rrset_t a, aaaa, ptr;
+} lz;
+
+static const knot_dname_t localhost[] = "\11localhost";
+static const knot_dname_t host_rev4[] = "\1" "1\1" "0\1" "0\3" "127\7in-addr\4arpa";
+
+static int rr_init(knot_rrset_t *rr, const knot_dname_t *owner, uint16_t type,
+		   const uint8_t *rdata, uint16_t rdlen, uint32_t ttl)
+{
+	knot_dname_t *copy = NULL;
+	if (owner && !(copy = knot_dname_copy(owner, NULL))) {
+		return kr_error(ENOMEM);
+	}
+	knot_rrset_init(rr, copy, type, KNOT_CLASS_IN);
+	return knot_rrset_add_rdata(rr, rdata, rdlen, ttl, NULL);
+}
+
+static int txt_init(knot_rrset_t *rr, const char *msg)
+{
+	uint8_t rdata[256];
+	const size_t len = strlen(msg);
+	assert(len < sizeof(rdata));
+	rdata[0] = len;
+	memcpy(rdata + 1, msg, len);
+	return rr_init(rr, (const knot_dname_t *)"\13explanation\7invalid", KNOT_RRTYPE_TXT,
+		       rdata, len + 1, KR_LOCALZONE_SOA_TTL);
+}
+
+/** The SOA and NS of the zone, see RFC 6303 sec. 3. */
+static int zone_add(const char *name, uint8_t kind)
+{
+	knot_dname_t apex[KNOT_DNAME_MAXLEN];
+	if (lz.count >= LOCALZONES_MAX || !knot_dname_from_str(apex, name, sizeof(apex))) {
+		return kr_error(EINVAL);
+	}
+	struct localzone *z = &lz.zones[lz.count];
+	z->kind = kind;
+	const knot_dname_t *mname = apex;
+	switch (kind) {
+	case LOCAL_EMPTY:
+		z->txt = &lz.txt_empty;
+		break;
+	case LOCAL_SPECIAL:
+		z->txt = &lz.txt_special;
+		break;
+	case LOCAL_LOCALHOST:
+		break;
+	case LOCAL_REVERSE:
+		mname = localhost;
+		break;
+	}
+	/* MNAME, RNAME nobody.invalid., serial 1, refresh 3600, retry 1200,
+	 * expire 604800 and minimum 10800. */
+	static const uint8_t soa_tail[] = "\6nobody\7invalid\0"
+		"\0\0\0\1" "\0\0\16\20" "\0\0\4\260" "\0\11\72\200" "\0\0\52\60";
+	uint8_t rdata[KNOT_DNAME_MAXLEN + sizeof(soa_tail)];
+	const int mlen = knot_dname_size(mname);
+	memcpy(rdata, mname, mlen);
+	memcpy(rdata + mlen, soa_tail, sizeof(soa_tail) - 1);
+	int ret = rr_init(&z->soa, apex, KNOT_RRTYPE_SOA, rdata, mlen + sizeof(soa_tail) - 1,
+			  KR_LOCALZONE_SOA_TTL);
+	if (ret == 0) {
+		ret = rr_init(&z->ns, apex, KNOT_RRTYPE_NS, mname, mlen,
+			      kind == LOCAL_EMPTY || kind == LOCAL_SPECIAL
+			      ? KR_LOCALZONE_SOA_TTL : KR_LOCALZONE_TTL);
+	}
+	if (ret != 0) {
+		knot_rrset_clear(&z->soa, NULL);
+		knot_rrset_clear(&z->ns, NULL);
+		return ret;
+	}
+	if (kind == LOCAL_REVERSE) {
+		z->host = knot_dname_is_sub(host_rev4, z->soa.owner) ? host_rev4 : z->soa.owner;
+	}
+	trie_val_t *val = trie_get_ins(lz.names, (const char *)z->soa.owner,
+				       knot_dname_size(z->soa.owner));
+	if (!val) {
+		knot_rrset_clear(&z->soa, NULL);
+		knot_rrset_clear(&z->ns, NULL);
+		return kr_error(ENOMEM);
+	}
+	*val = z;
+	lz.count += 1;
+	return kr_ok();
+}
+
+static void zones_deinit(void)
+{
+	for (int i = 0; i < lz.count; ++i) {
+		knot_rrset_clear(&lz.zones[i].soa, NULL);
+		knot_rrset_clear(&lz.zones[i].ns, NULL);
+	}
+	knot_rrset_clear(&lz.txt_empty, NULL);
+	knot_rrset_clear(&lz.txt_special, NULL);
+	knot_rrset_clear(&lz.a, NULL);
+	knot_rrset_clear(&lz.aaaa, NULL);
+	knot_rrset_clear(&lz.ptr, NULL);
+	trie_free(lz.names);
+	memset(&lz, 0, sizeof(lz));
+}
+
+static int zones_init(void)
+{
+	lz.names = trie_create(NULL);
+	if (!lz.names) {
+		return kr_error(ENOMEM);
+	}
+	int ret = txt_init(&lz.txt_empty, msg_empty);
+	if (ret == 0) {
+		ret = txt_init(&lz.txt_special, msg_special);
+	}
+	if (ret == 0) {
+		ret = rr_init(&lz.a, NULL, KNOT_RRTYPE_A,
+			      (const uint8_t *)"\177\0\0\1", 4, KR_LOCALZONE_TTL);
+	}
+	if (ret == 0) {
+		static const uint8_t ip6_localhost[16] = { [15] = 1 };
+		ret = rr_init(&lz.aaaa, NULL, KNOT_RRTYPE_AAAA,
+			      ip6_localhost, sizeof(ip6_localhost), KR_LOCALZONE_TTL);
+	}
+	if (ret == 0) {
+		ret = rr_init(&lz.ptr, NULL, KNOT_RRTYPE_PTR,
+			      localhost, sizeof(localhost), KR_LOCALZONE_TTL);
+	}
+	for (size_t i = 0; ret == 0 && i < sizeof(zone_names) / sizeof(zone_names[0]); ++i) {
+		ret = zone_add(zone_names[i].name, zone_names[i].kind);
+	}
+	/* RFC 6303 172.16.0.0/12 and RFC 7793 100.64.0.0/10 */
+	char name[32];
+	for (int i = 16; ret == 0 && i < 32; ++i) {
+		snprintf(name, sizeof(name), "%d.172.in-addr.arpa.", i);
+		ret = zone_add(name, LOCAL_EMPTY);
+	}
+	for (int i = 64; ret == 0 && i < 128; ++i) {
+		snprintf(name, sizeof(name), "%d.100.in-addr.arpa.", i);
+		ret = zone_add(name, LOCAL_EMPTY);
+	}
+	if (ret != 0) {
+		zones_deinit();
+	}
+	return ret;
+}
+
+/**
+ * Find the zone of the name, by its lowercase copy in buf.
+ * @param below set to the count of the labels below the apex
+ */
+static const struct localzone *zone_find(const knot_dname_t *name, knot_dname_t *buf, int *below)
+{
+	if (!name || (!lz.names && zones_init() != 0)) {
+		return NULL;
+	}
+	if (knot_dname_to_wire(buf, name, KNOT_DNAME_MAXLEN) <= 0) {
+		return NULL;
+	}
+	knot_dname_to_lower(buf);
+	*below = 0;
+	for (const uint8_t *label = buf; *label; label = knot_wire_next_label(label, NULL)) {
+		trie_val_t *val = trie_get_try(lz.names, (const char *)label,
+					       knot_dname_size(label));
+		if (val) {
+			return *val;
+		}
+		*below += 1;
+	}
+	return NULL;
+}
+
+int kr_localzone_find(const knot_dname_t *name)
+{
+	knot_dname_t buf[KNOT_DNAME_MAXLEN];
+	int below;
+	const struct localzone *z = zone_find(name, buf, &below);
+	return z ? z - lz.zones : kr_error(ENOENT);
+}
+
+int kr_localzone_answer(knot_pkt_t *answer, const knot_dname_t *sname, uint16_t stype)
+{
+	if (!answer) {
+		return kr_error(EINVAL);
+	}
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	int below;
+	const struct localzone *z = zone_find(sname, name, &below);
+	if (!z) {
+		return kr_error(ENOENT);
+	}
+	const bool is_apex = below == 0;
+	const knot_rrset_t *rr = NULL;  /* positive answer */
+	bool at_qname = false;          /* owner of rr is the QNAME */
+	bool nxdomain = false;
+	switch (z->kind) {
+	case LOCAL_LOCALHOST:
+		if (stype == KNOT_RRTYPE_A || stype == KNOT_RRTYPE_AAAA) {
+			rr = stype == KNOT_RRTYPE_A ? &lz.a : &lz.aaaa;
+			at_qname = true;
+		}
+		break;
+	case LOCAL_REVERSE:
+		if (stype == KNOT_RRTYPE_PTR && knot_dname_is_equal(name, z->host)) {
+			rr = &lz.ptr;
+			at_qname = true;
+		} else if (!is_apex) {
+			/* The names above the PTR are empty non-terminals. */
+			nxdomain = !knot_dname_is_sub(z->host, name);
+		}
+		break;
+	case LOCAL_EMPTY:
+		nxdomain = !is_apex;
+		break;
+	case LOCAL_SPECIAL:
+		nxdomain = true;
+		break;
+	}
+	if (!rr && is_apex && !nxdomain) {
+		if (stype == KNOT_RRTYPE_SOA) {
+			rr = &z->soa;
+		} else if (stype == KNOT_RRTYPE_NS) {
+			rr = &z->ns;
+		}
+	}
+
+	kr_pkt_make_auth_header(answer);
+	knot_wire_set_rcode(answer->wire, nxdomain ? KNOT_RCODE_NXDOMAIN : KNOT_RCODE_NOERROR);
+	int ret = knot_pkt_begin(answer, KNOT_ANSWER);
+	if (ret == 0 && rr) {
+		/* The owner is written as a pointer to the question. */
+		knot_rrset_t copy = *rr;
+		if (at_qname) {
+			copy.owner = (knot_dname_t *)knot_pkt_qname(answer);
+		}
+		return knot_pkt_put(answer, at_qname || is_apex ? KNOT_COMPR_HINT_QNAME
+				    : KNOT_COMPR_HINT_NONE, &copy, 0);
+	}
+	if (ret == 0) {
+		ret = knot_pkt_begin(answer, KNOT_AUTHORITY);
+	}
+	if (ret == 0) {
+		ret = knot_pkt_put(answer, is_apex ? KNOT_COMPR_HINT_QNAME : KNOT_COMPR_HINT_NONE,
+				   &z->soa, 0);
+	}
+	if (ret == 0 && z->txt) {
+		ret = knot_pkt_begin(answer, KNOT_ADDITIONAL);
+		if (ret == 0) {
+			ret = knot_pkt_put(answer, KNOT_COMPR_HINT_NONE, z->txt, 0);
+		}
+	}
+	return ret;
+}
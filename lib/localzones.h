@@ -0,0 +1,61 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file localzones.h
+ * @brief Answers of the locally served zones, built once.
+ *
+ * The zones are localhost. and its reverse zones, the empty zones of
+ * RFC 6303 and RFC 7793 (private and special address ranges) and the
+ * special-use names that don't exist in the DNS (RFC 6761, RFC 6762, RFC 7686).
+ * Their SOA, NS and other records are prepared on the first use, so that
+ * the answers are copied into the packet instead of being built for each
+ * query, e.g. by policy.special_names for the misconfigured clients.
+ *
+ *  - localhost.: A 127.0.0.1 and AAAA ::1 at every name, SOA and NS at the apex
+ *  - 127.in-addr.arpa. and the reverse of ::1: PTR localhost. at 127.0.0.1 and ::1
+ *  - empty zones: SOA and NS at the apex, NXDOMAIN below it
+ *  - special-use names: NXDOMAIN everywhere
+ *
+ * The negative answers carry the SOA of the zone in the authority section,
+ * the empty and special-use ones also a TXT at explanation.invalid.
+ */
+
+#pragma once
+
+#include <libknot/packet/pkt.h>
+
+#include "lib/defines.h"
+
+/** TTL of the SOA records and of the negative answers. */
+#define KR_LOCALZONE_SOA_TTL 10800
+/** TTL of the records of localhost. */
+#define KR_LOCALZONE_TTL 900
+
+/**
+ * Find the locally served zone of the name.
+ * @return the index of the zone, or kr_error(ENOENT)
+ */
+KR_EXPORT
+int kr_localzone_find(const knot_dname_t *name);
+
+/**
+ * Answer the query from its locally served zone, if it has one.
+ * The answer has to have the question already, and nothing after it.
+ * @return 0, kr_error(ENOENT) if the name isn't locally served, or an error code
+ */
+KR_EXPORT
+int kr_localzone_answer(knot_pkt_t *answer, const knot_dname_t *sname, uint16_t stype);
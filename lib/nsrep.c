@@ -82,8 +82,293 @@ static void update_nsrep_set(struct kr_nsrep *ns, const knot_dname_t *name, uint
 
 #undef ADDR_SET
 
+/** @internal Tables shared with other processes, see kr_nsrep_share(). */
+static shtable_t *shared_rtt = NULL;
+static shtable_t *shared_rep = NULL;
+
+void kr_nsrep_share(shtable_t *rtt, shtable_t *rep)
+{
+	shared_rtt = rtt;
+	shared_rep = rep;
+}
+
+void kr_nsrep_share_clear(void)
+{
+	shtable_clear(shared_rtt);
+	shtable_clear(shared_rep);
+}
+
+/** @internal Result of kr_nsrep_elect() for a zone cut, reused for KR_NSREP_ELECT_TTL. */
+struct elect_memo {
+	uint64_t expire;	/**< kr_now() until which it's valid */
+	uint32_t gen;		/**< elect_gen at the time of the election */
+	uint32_t ns_count;	/**< Names in the NS set of the zone cut */
+	unsigned score;
+	unsigned reputation;
+	unsigned naddr;		/**< Leading addresses of the elected name; the rest are from before */
+	unsigned addr_score[KR_NSREP_MAXADDR]; /**< Scores of those when elected */
+	union inaddr addr[KR_NSREP_MAXADDR];
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+};
+typedef lru_t(struct elect_memo) elect_memo_lru_t;
+static elect_memo_lru_t *elect_memos = NULL;
+/** Bumped by the changes which aren't seen in the RTT of the elected addresses. */
+static uint32_t elect_gen = 0;
+
+/** @internal What the last lookup of the addresses of a NS in cache found,
+ * so that kr_nsrep_elect() looks up the promising ones first and skips those without any. */
+struct ns_hint {
+	uint64_t expire;	/**< kr_now() until which it's valid */
+	unsigned score;		/**< Best score of the addresses, NS_HINT_NONE without any */
+};
+typedef lru_t(struct ns_hint) ns_hint_lru_t;
+static ns_hint_lru_t *ns_hints = NULL;
+#define NS_HINT_NONE (KR_NS_MAX_SCORE + 1)
+
+/** @internal Find RTT entry for given address, refreshed from the shared table. */
+static kr_nsrep_rtt_lru_entry_t *rtt_get(kr_nsrep_rtt_lru_t *cache,
+					 const char *addr, size_t addr_len)
+{
+	if (!cache) {
+		return NULL;
+	}
+	kr_nsrep_rtt_lru_entry_t *cached = lru_get_try(cache, addr, addr_len);
+	kr_nsrep_rtt_lru_entry_t shared;
+	if (shared_rtt && shtable_get(shared_rtt, addr, addr_len, &shared) == 0) {
+		if (!cached) {
+			cached = lru_get_new(cache, addr, addr_len, NULL);
+		}
+		if (cached) {
+			*cached = shared;
+		}
+	}
+	return cached;
+}
+
+/** @internal Publish local RTT entry to other processes. */
+static void rtt_publish(const char *addr, size_t addr_len,
+			const kr_nsrep_rtt_lru_entry_t *entry)
+{
+	if (shared_rtt) {
+		(void) shtable_set(shared_rtt, addr, addr_len, entry);
+	}
+}
+
+/** @internal Return the current score of the entry, with the penalty decayed. */
+static unsigned rtt_score(const kr_nsrep_rtt_lru_entry_t *entry, uint64_t now)
+{
+	/* "Timeouted" ones wait for cache_rtt_tout_retry_interval instead. */
+	const unsigned base = entry->srtt ? entry->srtt : KR_NS_GLUED;
+	if (entry->score >= KR_NS_TIMEOUT || entry->score <= base) {
+		return entry->score;
+	}
+	const uint64_t halvings = (now - entry->updated) / KR_NS_PENALTY_HALFLIFE;
+	if (halvings >= 32) {
+		return base;
+	}
+	return base + ((entry->score - base) >> halvings);
+}
+
+/** @internal Account a measured RTT, return the new score. */
+static unsigned rtt_measure(kr_nsrep_rtt_lru_entry_t *entry, unsigned rtt, unsigned cur_score)
+{
+	unsigned penalty = 0;
+	if (cur_score < KR_NS_TIMEOUT) { /* if it was "timeouted", it's alive now */
+		const unsigned base = entry->srtt ? entry->srtt : KR_NS_GLUED;
+		penalty = cur_score > base ? (cur_score - base) / 2 : 0;
+	}
+	if (entry->srtt == 0) {
+		entry->srtt = rtt;
+		entry->rttvar = rtt / 2;
+	} else {
+		const unsigned delta = entry->srtt > rtt ? entry->srtt - rtt : rtt - entry->srtt;
+		entry->rttvar = (3 * entry->rttvar + delta) / 4;
+		entry->srtt = (7 * entry->srtt + rtt) / 8;
+		if (entry->srtt == 0) {
+			entry->srtt = 1; /* 0 means unmeasured */
+		}
+	}
+	return entry->srtt + penalty;
+}
+
+unsigned kr_nsrep_get_rep(kr_nsrep_lru_t *cache, const knot_dname_t *name)
+{
+	const size_t name_len = knot_dname_size(name);
+	unsigned reputation = 0;
+	if (shared_rep &&
+	    shtable_get(shared_rep, name, name_len, &reputation) == 0) {
+		return reputation;
+	}
+	unsigned *cached = cache ? lru_get_try(cache, (const char *)name, name_len) : NULL;
+	return cached ? *cached : 0;
+}
+
+/** @internal Key of the lame cache: the lowercased zone name, then the address. */
+#define LAME_KEY_MAXLEN (KNOT_DNAME_MAXLEN + sizeof(struct in6_addr))
+
+static int lame_key(char *key, const knot_dname_t *zone, const char *addr, size_t addr_len)
+{
+	const int zone_len = knot_dname_size(zone);
+	if (zone_len <= 0 || zone_len > KNOT_DNAME_MAXLEN
+	    || addr_len > sizeof(struct in6_addr)) {
+		return kr_error(EINVAL);
+	}
+	memcpy(key, zone, zone_len);
+	knot_dname_to_lower((knot_dname_t *)key);
+	memcpy(key + zone_len, addr, addr_len);
+	return zone_len + addr_len;
+}
+
+/** @internal Return true if the address is backing off for the zone. */
+static bool lame_get(kr_nsrep_lame_lru_t *cache, const knot_dname_t *zone,
+		     const char *addr, size_t addr_len, uint64_t now)
+{
+	char key[LAME_KEY_MAXLEN];
+	const int key_len = cache && zone ? lame_key(key, zone, addr, addr_len) : -1;
+	if (key_len <= 0) {
+		return false;
+	}
+	const struct kr_nsrep_lame_lru_entry *entry = lru_get_try(cache, key, key_len);
+	return entry && (int64_t)(entry->until - now) > 0;
+}
+
+int kr_nsrep_update_lame(kr_nsrep_lame_lru_t *cache, const knot_dname_t *zone,
+			 const struct sockaddr *addr, bool failed)
+{
+	if (!cache || !zone || !addr) {
+		return kr_error(EINVAL);
+	}
+	const char *addr_in = kr_inaddr(addr);
+	const int addr_len = kr_inaddr_len(addr);
+	if (!addr_in || addr_len <= 0) {
+		return kr_error(EINVAL);
+	}
+	char key[LAME_KEY_MAXLEN];
+	const int key_len = lame_key(key, zone, addr_in, addr_len);
+	if (key_len <= 0) {
+		return key_len;
+	}
+	if (!failed) {
+		struct kr_nsrep_lame_lru_entry *entry = lru_get_try(cache, key, key_len);
+		if (entry) {
+			entry->fails = 0;
+			entry->until = 0;
+		}
+		return kr_ok();
+	}
+	bool is_new = false;
+	struct kr_nsrep_lame_lru_entry *entry = lru_get_new(cache, key, key_len, &is_new);
+	if (!entry) {
+		return kr_ok();
+	}
+	if (is_new) {
+		entry->fails = 0;
+	}
+	const unsigned shift = MIN(entry->fails, 16);
+	const uint64_t backoff = MIN((uint64_t)KR_NS_LAME_BACKOFF << shift,
+				     KR_NS_LAME_BACKOFF_MAX);
+	entry->until = kr_now() + backoff;
+	entry->fails += (entry->fails < UINT_MAX);
+	elect_gen += 1;
+	return kr_ok();
+}
+
+/** @internal Entry of the address, NULL if there's none (and !create). */
+static struct kr_nsrep_edns_lru_entry *edns_get(kr_nsrep_edns_lru_t *cache,
+						const struct sockaddr *addr, bool create)
+{
+	const char *addr_in = cache && addr ? kr_inaddr(addr) : NULL;
+	const int addr_len = addr_in ? kr_inaddr_len(addr) : -1;
+	if (addr_len <= 0) {
+		return NULL;
+	}
+	if (!create) {
+		return lru_get_try(cache, addr_in, addr_len);
+	}
+	bool is_new = false;
+	struct kr_nsrep_edns_lru_entry *entry = lru_get_new(cache, addr_in, addr_len, &is_new);
+	if (entry && is_new) {
+		memset(entry, 0, sizeof(*entry));
+	}
+	return entry;
+}
+
+/** @internal Start the fallback, or the next one. */
+static void edns_fall_back(struct kr_nsrep_edns_lru_entry *entry, enum kr_ns_edns_fallback to)
+{
+	entry->fallback = to;
+	entry->until = kr_now() + KR_NS_EDNS_FALLBACK;
+	entry->frag_fails = 0;
+	entry->answers = 0;
+	entry->truncated = 0;
+}
+
+int kr_nsrep_edns_answer(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr,
+			 size_t size, bool truncated)
+{
+	struct kr_nsrep_edns_lru_entry *entry = edns_get(cache, addr, true);
+	if (!entry) {
+		return cache && addr ? kr_ok() : kr_error(EINVAL);
+	}
+	entry->max_size = MAX(entry->max_size, MIN(size, UINT16_MAX));
+	if (size > KR_NS_EDNS_UNFRAGMENTED) {
+		entry->frag_fails = 0; /* the fragments got through */
+	}
+	entry->answers += 1;
+	entry->truncated += truncated;
+	if (entry->answers >= 8 && entry->truncated * 2 >= entry->answers
+	    && entry->fallback != KR_NS_EDNS_TCP) {
+		/* Each query would be asked twice. */
+		edns_fall_back(entry, KR_NS_EDNS_TCP);
+	} else if (entry->answers >= 64) {
+		entry->answers /= 2;
+		entry->truncated /= 2;
+	}
+	return kr_ok();
+}
+
+int kr_nsrep_edns_timeout(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr)
+{
+	if (!cache || !addr) {
+		return kr_error(EINVAL);
+	}
+	struct kr_nsrep_edns_lru_entry *entry = edns_get(cache, addr, false);
+	/* Unknown or silent, it may be just down. */
+	if (!entry || entry->max_size == 0 || entry->fallback == KR_NS_EDNS_TCP) {
+		return kr_ok();
+	}
+	entry->frag_fails += (entry->frag_fails < UINT8_MAX);
+	if (entry->frag_fails >= KR_NS_EDNS_FRAG_FAILS) {
+		edns_fall_back(entry, entry->fallback == KR_NS_EDNS_FULL
+				      ? KR_NS_EDNS_SMALL : KR_NS_EDNS_TCP);
+	}
+	return kr_ok();
+}
+
+uint16_t kr_nsrep_edns_payload(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr,
+			       uint16_t payload, bool *tcp)
+{
+	struct kr_nsrep_edns_lru_entry *entry = edns_get(cache, addr, false);
+	if (!entry || entry->fallback == KR_NS_EDNS_FULL) {
+		return payload;
+	}
+	if ((int64_t)(entry->until - kr_now()) <= 0) {
+		/* Try again, the path may have changed. */
+		entry->fallback = KR_NS_EDNS_FULL;
+		entry->frag_fails = 0;
+		return payload;
+	}
+	if (entry->fallback == KR_NS_EDNS_TCP && tcp) {
+		*tcp = true;
+	}
+	return MIN(payload, KR_NS_EDNS_SAFE);
+}
+
+#undef LAME_KEY_MAXLEN
+
 static unsigned eval_addr_set(const pack_t *addr_set, struct kr_context *ctx,
-			      struct kr_qflags opts, unsigned score, uint8_t *addr[])
+			      const knot_dname_t *zone, struct kr_qflags opts,
+			      unsigned score, uint8_t *addr[])
 {
 	kr_nsrep_rtt_lru_t *rtt_cache = ctx->cache_rtt;
 	kr_nsrep_rtt_lru_entry_t *rtt_cache_entry_ptr[KR_NSREP_MAXADDR] = { NULL, };
@@ -111,12 +396,10 @@ static unsigned eval_addr_set(const pack_t *addr_set, struct kr_context *ctx,
 		}
 
 		/* Get RTT for this address (if known) */
-		kr_nsrep_rtt_lru_entry_t *cached = rtt_cache ?
-						   lru_get_try(rtt_cache, val, len) :
-						   NULL;
+		kr_nsrep_rtt_lru_entry_t *cached = rtt_get(rtt_cache, val, len);
 		unsigned cur_addr_score = KR_NS_GLUED;
 		if (cached) {
-			cur_addr_score = cached->score;
+			cur_addr_score = rtt_score(cached, now);
 			if (cached->score >= KR_NS_TIMEOUT) {
 				/* If NS once was marked as "timeouted",
 				 * it won't participate in NS elections
@@ -131,6 +414,11 @@ static unsigned eval_addr_set(const pack_t *addr_set, struct kr_context *ctx,
 				}
 			}
 		}
+		/* Failed for this zone recently, e.g. lame; don't probe it either. */
+		if (lame_get(ctx->cache_lame, zone, val, len, now)) {
+			cur_addr_score = KR_NS_TIMEOUT;
+			cached = NULL;
+		}
 
 		for (size_t i = 0; i < KR_NSREP_MAXADDR; ++i) {
 			if (cur_addr_score >= KR_NS_TIMEOUT) {
@@ -203,6 +491,8 @@ get_next_iterator :
 		}
 
 		rtt_cache_entry_ptr[i]->tout_timestamp = now;
+		rtt_publish(pack_obj_val(addr[i]), pack_obj_len(addr[i]),
+			    rtt_cache_entry_ptr[i]);
 	}
 
 	return rtt_cache_entry_score[0];
@@ -218,11 +508,7 @@ static int eval_nsrep(const knot_dname_t *owner, const pack_t *addr_set, struct
 
 	/* Fetch NS reputation */
 	if (ctx->cache_rep) {
-		unsigned *cached = lru_get_try(ctx->cache_rep, (const char *)owner,
-					       knot_dname_size(owner));
-		if (cached) {
-			reputation = *cached;
-		}
+		reputation = kr_nsrep_get_rep(ctx->cache_rep, owner);
 	}
 
 	/* Favour nameservers with unknown addresses to probe them,
@@ -245,7 +531,8 @@ static int eval_nsrep(const knot_dname_t *owner, const pack_t *addr_set, struct
 			}
 		}
 	} else {
-		score = eval_addr_set(addr_set, ctx, qry->flags, score, addr_choice);
+		score = eval_addr_set(addr_set, ctx, qry->zone_cut.name, qry->flags,
+				      score, addr_choice);
 	}
 
 	/* Probabilistic bee foraging strategy (naive).
@@ -312,7 +599,7 @@ int kr_nsrep_set(struct kr_query *qry, size_t index, const struct sockaddr *sock
 	/* Retrieve RTT from cache */
 	struct kr_context *ctx = qry->ns.ctx;
 	kr_nsrep_rtt_lru_entry_t *rtt_cache_entry = ctx
-		? lru_get_try(ctx->cache_rtt, kr_inaddr(sock), kr_family_len(sock->sa_family))
+		? rtt_get(ctx->cache_rtt, kr_inaddr(sock), kr_family_len(sock->sa_family))
 		: NULL;
 	if (rtt_cache_entry) {
 		qry->ns.score = MIN(qry->ns.score, rtt_cache_entry->score);
@@ -321,6 +608,145 @@ int kr_nsrep_set(struct kr_query *qry, size_t index, const struct sockaddr *sock
 	return kr_ok();
 }
 
+/** @internal Key of the election: the zone cut and the flags it depends on. */
+static int elect_key(char *key, const struct kr_query *qry)
+{
+	int len = knot_dname_size(qry->zone_cut.name);
+	memcpy(key, qry->zone_cut.name, len);
+	key[len] = qry->flags.NO_IPV4 | qry->flags.NO_IPV6 << 1 | qry->flags.NO_THROTTLE << 2;
+	return len + 1;
+}
+
+static unsigned addr_score_now(struct kr_context *ctx, const union inaddr *addr, uint64_t now)
+{
+	const kr_nsrep_rtt_lru_entry_t *entry = rtt_get(ctx->cache_rtt,
+			kr_inaddr(&addr->ip), kr_inaddr_len(&addr->ip));
+	return entry ? rtt_score(entry, now) : KR_NS_GLUED;
+}
+
+/** @internal Hint of the NS, 0 if not known. */
+static unsigned ns_hint_get(const knot_dname_t *name, uint64_t now)
+{
+	if (!ns_hints) {
+		return 0;
+	}
+	const struct ns_hint *hint = lru_get_try(ns_hints, (const char *)name,
+						 knot_dname_size(name));
+	return hint && hint->expire > now ? hint->score : 0;
+}
+
+static void ns_hint_set(struct kr_context *ctx, const knot_dname_t *name,
+			const pack_t *addr_set, uint64_t now)
+{
+	if (!ns_hints) {
+		lru_create(&ns_hints, KR_NSREP_HINT_SIZE, NULL, NULL);
+		if (!ns_hints) {
+			return;
+		}
+	}
+	struct ns_hint *hint = lru_get_new(ns_hints, (const char *)name,
+					   knot_dname_size(name), NULL);
+	if (!hint) {
+		return;
+	}
+	hint->expire = now + KR_NSREP_HINT_TTL;
+	hint->score = NS_HINT_NONE;
+	for (uint8_t *it = pack_head(*addr_set); it != pack_tail(*addr_set);
+						it = pack_obj_next(it)) {
+		const kr_nsrep_rtt_lru_entry_t *entry = rtt_get(ctx->cache_rtt,
+				pack_obj_val(it), pack_obj_len(it));
+		const unsigned score = entry ? rtt_score(entry, now) : KR_NS_GLUED;
+		hint->score = MIN(hint->score, score);
+	}
+}
+
+/** @internal Elect as the last time for the zone cut, if it's still valid.
+ * It is not if it's too old, the NS set changed or an address got slower by a quarter. */
+static bool elect_reuse(struct kr_query *qry, struct kr_context *ctx)
+{
+	/* Leave room for the probing of the others in eval_nsrep(). */
+	if (!elect_memos || kr_rand_uint(100) < 10) {
+		return false;
+	}
+	char key[KNOT_DNAME_MAXLEN + 1];
+	const struct elect_memo *m = lru_get_try(elect_memos, key, elect_key(key, qry));
+	const uint64_t now = kr_now();
+	if (!m || m->gen != elect_gen || m->expire <= now
+	    || m->ns_count != trie_weight(qry->zone_cut.nsset)) {
+		return false;
+	}
+	pack_t *addr_set = kr_zonecut_find(&qry->zone_cut, m->name);
+	if (kr_zonecut_addrs_pending(addr_set)) {
+		addr_set = kr_zonecut_fetch_addrs(ctx, &qry->zone_cut, m->name, qry);
+	}
+	/* The name is referenced from the NS set, as after the election. */
+	const knot_dname_t *owner = kr_zonecut_ns_name(&qry->zone_cut, m->name);
+	if (!addr_set || !owner) {
+		return false;
+	}
+	for (size_t i = 0; i < m->naddr; ++i) {
+		const union inaddr *addr = &m->addr[i];
+		if (!pack_obj_find(addr_set, (const uint8_t *)kr_inaddr(&addr->ip),
+				   kr_inaddr_len(&addr->ip))) {
+			return false;
+		}
+		const unsigned score = addr_score_now(ctx, addr, now);
+		if (score >= KR_NS_LONG || score > m->addr_score[i] + m->addr_score[i] / 4) {
+			return false;
+		}
+	}
+	struct kr_nsrep *ns = &qry->ns;
+	ns->name = owner;
+	ns->score = m->score;
+	ns->reputation = m->reputation;
+	memcpy(ns->addr, m->addr, sizeof(ns->addr));
+	return true;
+}
+
+/** @internal Remember a reliable election for elect_reuse(). */
+static void elect_note(struct kr_query *qry, struct kr_context *ctx)
+{
+	const struct kr_nsrep *ns = &qry->ns;
+	if (ns->score >= KR_NS_LONG || ns->addr[0].ip.sa_family == AF_UNSPEC) {
+		return; /* probing or without an address yet */
+	}
+	if (!elect_memos) {
+		lru_create(&elect_memos, KR_NSREP_ELECT_SIZE, NULL, NULL);
+		if (!elect_memos) {
+			return;
+		}
+	}
+	char key[KNOT_DNAME_MAXLEN + 1];
+	struct elect_memo *m = lru_get_new(elect_memos, key, elect_key(key, qry), NULL);
+	if (!m) {
+		return;
+	}
+	const uint64_t now = kr_now();
+	m->expire = now + KR_NSREP_ELECT_TTL;
+	m->gen = elect_gen;
+	m->ns_count = trie_weight(qry->zone_cut.nsset);
+	m->score = ns->score;
+	m->reputation = ns->reputation;
+	memcpy(m->addr, ns->addr, sizeof(m->addr));
+	pack_t *addr_set = kr_zonecut_find(&qry->zone_cut, ns->name);
+	m->naddr = 0;
+	for (size_t i = 0; addr_set && i < KR_NSREP_MAXADDR; ++i) {
+		const union inaddr *addr = &m->addr[i];
+		if (addr->ip.sa_family == AF_UNSPEC
+		    || !pack_obj_find(addr_set, (const uint8_t *)kr_inaddr(&addr->ip),
+				      kr_inaddr_len(&addr->ip))) {
+			break;
+		}
+		m->addr_score[i] = addr_score_now(ctx, addr, now);
+		m->naddr += 1;
+	}
+	memcpy(m->name, ns->name, knot_dname_size(ns->name));
+}
+
+/** Nameservers with pending addresses which kr_nsrep_elect() considers looking up;
+ * the others are evaluated as without addresses. */
+#define ELECT_PENDING_MAX 32
+
 #define ELECT_INIT(ns, ctx_) do { \
 	(ns)->ctx = (ctx_); \
 	(ns)->addr[0].ip.sa_family = AF_UNSPEC; \
@@ -336,17 +762,65 @@ int kr_nsrep_elect(struct kr_query *qry, struct kr_context *ctx)
 
 	struct kr_nsrep *ns = &qry->ns;
 	ELECT_INIT(ns, ctx);
+	/* The hot zone cuts are elected once per KR_NSREP_ELECT_TTL. */
+	if (elect_reuse(qry, ctx)) {
+		return kr_ok();
+	}
 
+	/* The NS with addresses pending are put aside in the order of their hints,
+	 * except those which had no addresses in cache the last time. */
+	struct {
+		const knot_dname_t *name;
+		unsigned hint;
+	} pending[ELECT_PENDING_MAX];
+	int npending = 0;
+	const uint64_t now = kr_now();
 	int ret = kr_ok();
 	trie_it_t *it;
 	for (it = trie_it_begin(qry->zone_cut.nsset); !trie_it_finished(it);
 							trie_it_next(it)) {
-		ret = eval_nsrep(/* we trust it's a correct dname */
-				 (const knot_dname_t *)trie_it_key(it, NULL),
-				 (const pack_t *)*trie_it_val(it), qry);
+		/* we trust it's a correct dname */
+		const knot_dname_t *owner = (const knot_dname_t *)trie_it_key(it, NULL);
+		const pack_t *addr_set = *trie_it_val(it);
+		if (kr_zonecut_addrs_pending(addr_set) && npending < ELECT_PENDING_MAX) {
+			const unsigned hint = ns_hint_get(owner, now);
+			if (hint != NS_HINT_NONE) {
+				int i = npending++;
+				for (; i > 0 && pending[i - 1].hint > hint; --i) {
+					pending[i] = pending[i - 1];
+				}
+				pending[i].name = owner;
+				pending[i].hint = hint;
+				continue;
+			}
+		}
+		ret = eval_nsrep(owner, addr_set, qry);
 		if (ret) break;
 	}
 	trie_it_free(it);
+	/* Look the addresses up in cache while they may beat the best so far. */
+	const trie_t *nsset = qry->zone_cut.nsset;
+	for (int i = 0; ret == 0 && i < npending && pending[i].hint < ns->score; ++i) {
+		pack_t *addr_set = kr_zonecut_fetch_addrs(ctx, &qry->zone_cut,
+							  pending[i].name, qry);
+		if (!addr_set) {
+			continue;
+		}
+		ns_hint_set(ctx, pending[i].name, addr_set, now);
+		const knot_dname_t *owner = qry->zone_cut.nsset == nsset ? pending[i].name
+				: kr_zonecut_ns_name(&qry->zone_cut, pending[i].name);
+		ret = eval_nsrep(owner, addr_set, qry);
+	}
+	/* The nsset got copied by the lookups if it was shared. */
+	if (qry->zone_cut.nsset != nsset && ns->score <= KR_NS_MAX_SCORE) {
+		const knot_dname_t *owner = kr_zonecut_ns_name(&qry->zone_cut, ns->name);
+		if (owner) {
+			ns->name = owner;
+		}
+	}
+	if (ret == 0) {
+		elect_note(qry, ctx); /* not a probe chosen at random */
+	}
 
 	if (qry->ns.score <= KR_NS_MAX_SCORE && qry->ns.score >= KR_NS_LONG) {
 		/* This is a low-reliability probe,
@@ -366,12 +840,17 @@ int kr_nsrep_elect_addr(struct kr_query *qry, struct kr_context *ctx)
 	struct kr_nsrep *ns = &qry->ns;
 	ELECT_INIT(ns, ctx);
 	pack_t *addr_set = kr_zonecut_find(&qry->zone_cut, ns->name);
-	if (!addr_set) {
+	if (kr_zonecut_addrs_pending(addr_set)) {
+		addr_set = kr_zonecut_fetch_addrs(ctx, &qry->zone_cut, ns->name, qry);
+		ns->name = kr_zonecut_ns_name(&qry->zone_cut, ns->name);
+	}
+	if (!addr_set || !ns->name) {
 		return kr_error(ENOENT);
 	}
 	/* Evaluate addr list */
 	uint8_t *addr_choice[KR_NSREP_MAXADDR] = { NULL, };
-	unsigned score = eval_addr_set(addr_set, ctx, qry->flags, ns->score, addr_choice);
+	unsigned score = eval_addr_set(addr_set, ctx, qry->zone_cut.name, qry->flags,
+				       ns->score, addr_choice);
 	update_nsrep_set(ns, ns->name, addr_choice, score);
 	return kr_ok();
 }
@@ -412,9 +891,17 @@ int kr_nsrep_update_rtt(struct kr_nsrep *ns, const struct sockaddr *addr,
 	if (!cur) {
 		return kr_ok();
 	}
+	/* Start from what the other processes have measured. */
+	kr_nsrep_rtt_lru_entry_t shared;
+	if (shared_rtt && shtable_get(shared_rtt, addr_in, addr_len, &shared) == 0) {
+		*cur = shared;
+		is_new_entry = false;
+	}
 	if (score <= KR_NS_GLUED) {
 		score = KR_NS_GLUED + 1;
 	}
+	const bool measured = (umode == KR_NS_UPDATE || umode == KR_NS_UPDATE_NORESET)
+			      && score < KR_NS_TIMEOUT;
 	/* First update is always set unless KR_NS_UPDATE_NORESET mode used. */
 	if (is_new_entry) {
 		if (umode == KR_NS_UPDATE_NORESET) {
@@ -425,15 +912,25 @@ int kr_nsrep_update_rtt(struct kr_nsrep *ns, const struct sockaddr *addr,
 			umode = KR_NS_RESET;
 		}
 	}
+	const uint64_t now = kr_now();
+	const unsigned cur_score = rtt_score(cur, now);
 	unsigned new_score = 0;
-	/* Update score, by default smooth over last two measurements. */
+	/* Update score; measurements go through the estimator,
+	 * penalties are smoothed over last two updates. */
 	switch (umode) {
 	case KR_NS_UPDATE:
 	case KR_NS_UPDATE_NORESET:
-		new_score = (cur->score + score) / 2; break;
-	case KR_NS_RESET:  new_score = score; break;
-	case KR_NS_ADD:    new_score = MIN(KR_NS_MAX_SCORE - 1, cur->score + score); break;
-	case KR_NS_MAX:    new_score = MAX(cur->score, score); break;
+		if (measured) {
+			new_score = rtt_measure(cur, score, cur_score);
+		} else {
+			new_score = (cur_score + score) / 2;
+		}
+		break;
+	case KR_NS_RESET:
+		new_score = measured ? rtt_measure(cur, score, score) : score;
+		break;
+	case KR_NS_ADD:    new_score = MIN(KR_NS_MAX_SCORE - 1, cur_score + score); break;
+	case KR_NS_MAX:    new_score = MAX(cur_score, score); break;
 	default: break;
 	}
 	/* Score limits */
@@ -445,6 +942,28 @@ int kr_nsrep_update_rtt(struct kr_nsrep *ns, const struct sockaddr *addr,
 		cur->tout_timestamp = kr_now();
 	}
 	cur->score = new_score;
+	cur->updated = now;
+	rtt_publish(addr_in, addr_len, cur);
+	return kr_ok();
+}
+
+int kr_nsrep_rtt_estimate(kr_nsrep_rtt_lru_t *cache, const struct sockaddr *addr,
+			  unsigned *srtt, unsigned *rttvar)
+{
+	if (!cache || !addr || !srtt || !rttvar) {
+		return kr_error(EINVAL);
+	}
+	const char *addr_in = kr_inaddr(addr);
+	const int addr_len = kr_inaddr_len(addr);
+	if (!addr_in || addr_len <= 0) {
+		return kr_error(EINVAL);
+	}
+	const kr_nsrep_rtt_lru_entry_t *entry = rtt_get(cache, addr_in, addr_len);
+	if (!entry || entry->srtt == 0) {
+		return kr_error(ENOENT);
+	}
+	*srtt = entry->srtt;
+	*rttvar = entry->rttvar;
 	return kr_ok();
 }
 
@@ -462,6 +981,11 @@ int kr_nsrep_update_rep(struct kr_nsrep *ns, unsigned reputation, kr_nsrep_lru_t
 	if (cur) {
 		*cur = reputation;
 	}
+	if (shared_rep) {
+		(void) shtable_set(shared_rep, ns->name, knot_dname_size(ns->name),
+				   &reputation);
+	}
+	elect_gen += 1;
 	return kr_ok();
 }
 
@@ -498,15 +1022,16 @@ int kr_nsrep_sort(struct kr_nsrep *ns, kr_nsrep_rtt_lru_t *rtt_cache)
 	/* Compute the scores.  Unfortunately there's no space for scores
 	 * along the addresses. */
 	unsigned scores[KR_NSREP_MAXADDR];
+	const uint64_t now = kr_now();
 	int i;
 	for (i = 0; i < KR_NSREP_MAXADDR; ++i) {
 		const struct sockaddr *sa = &ns->addr[i].ip;
 		if (sa->sa_family == AF_UNSPEC) {
 			break;
 		}
-		kr_nsrep_rtt_lru_entry_t *rtt_cache_entry = lru_get_try(rtt_cache,
-									kr_inaddr(sa),
-									kr_family_len(sa->sa_family));
+		kr_nsrep_rtt_lru_entry_t *rtt_cache_entry = rtt_get(rtt_cache,
+								     kr_inaddr(sa),
+								     kr_family_len(sa->sa_family));
 		if (!rtt_cache_entry) {
 			scores[i] = 1; /* prefer unknown to probe RTT */
 		} else if ((kr_rand_uint(100) < 10) &&
@@ -514,7 +1039,7 @@ int kr_nsrep_sort(struct kr_nsrep *ns, kr_nsrep_rtt_lru_t *rtt_cache)
 			/* some probability to bump bad ones up for re-probe */
 			scores[i] = 1;
 		} else {
-			scores[i] = rtt_cache_entry->score;
+			scores[i] = rtt_score(rtt_cache_entry, now);
 		}
 		if (VERBOSE_STATUS) {
 			char sa_str[INET6_ADDRSTRLEN];
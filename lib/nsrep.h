@@ -20,10 +20,12 @@
 #include <sys/socket.h>
 #include <libknot/dname.h>
 #include <limits.h>
+#include <stdbool.h>
 
 #include "lib/defines.h"
 #include "lib/generic/map.h"
 #include "lib/generic/lru.h"
+#include "lib/generic/shtable.h"
 
 struct kr_query;
 
@@ -49,6 +51,26 @@ enum kr_ns_score {
  * at least KR_NS_TIMEOUT_RETRY_INTERVAL milliseconds (now: one minute). */
 #define KR_NS_TIMEOUT_RETRY_INTERVAL 60000
 
+/** Penalties (the part of the score above the smoothed RTT) halve
+ * after this many milliseconds without an update, unless "timeouted". */
+#define KR_NS_PENALTY_HALFLIFE 10000
+
+/** A server that failed for a zone isn't elected for it during a backoff
+ * of this many milliseconds, doubled on each further failure
+ * up to KR_NS_LAME_BACKOFF_MAX; see kr_nsrep_update_lame(). */
+#define KR_NS_LAME_BACKOFF 1000
+#define KR_NS_LAME_BACKOFF_MAX 300000
+
+/** EDNS payload advertised to a server whose path seems to drop fragments
+ * (fits the IPv6 minimum MTU), and the largest answer that surely isn't fragmented;
+ * see kr_nsrep_edns_payload(). */
+#define KR_NS_EDNS_SAFE 1232
+#define KR_NS_EDNS_UNFRAGMENTED 1452
+/** Time-outs of the queries expecting large answers before a fallback. */
+#define KR_NS_EDNS_FRAG_FAILS 2
+/** Milliseconds a fallback of the EDNS payload or to TCP lasts. */
+#define KR_NS_EDNS_FALLBACK 600000
+
 /**
  * NS QoS flags.
  */
@@ -78,6 +100,9 @@ struct kr_nsrep_rtt_lru_entry {
 	uint64_t tout_timestamp;  /* The time when score became
 				   * greater or equal then KR_NS_TIMEOUT.
 				   * Is meaningful only when score >= KR_NS_TIMEOUT */
+	unsigned srtt;            /* smoothed measured rtt, 0 if not measured yet */
+	unsigned rttvar;          /* mean deviation of the measured rtt */
+	uint64_t updated;         /* kr_now() of the last update */
 };
 
 typedef struct kr_nsrep_rtt_lru_entry kr_nsrep_rtt_lru_entry_t;
@@ -92,6 +117,37 @@ typedef lru_t(kr_nsrep_rtt_lru_entry_t) kr_nsrep_rtt_lru_t;
  */
 typedef lru_t(unsigned) kr_nsrep_lru_t;
 
+struct kr_nsrep_lame_lru_entry {
+	uint64_t until;   /* kr_now() when the backoff ends */
+	unsigned fails;   /* consecutive failures */
+};
+
+/**
+ * Failures of servers for zones, keyed by the zone name and the address.
+ */
+typedef lru_t(struct kr_nsrep_lame_lru_entry) kr_nsrep_lame_lru_t;
+
+/** Fallbacks of the EDNS payload, see kr_nsrep_edns_payload(). */
+enum kr_ns_edns_fallback {
+	KR_NS_EDNS_FULL = 0, /**< The configured payload */
+	KR_NS_EDNS_SMALL,    /**< KR_NS_EDNS_SAFE, the fragments seem dropped */
+	KR_NS_EDNS_TCP       /**< Straight over TCP */
+};
+
+struct kr_nsrep_edns_lru_entry {
+	uint64_t until;      /* kr_now() when the fallback ends */
+	uint16_t max_size;   /* largest answer received over UDP */
+	uint16_t answers;    /* answers over UDP, halved with truncated */
+	uint16_t truncated;  /* ... of them with TC */
+	uint8_t frag_fails;  /* time-outs expecting large answers, see KR_NS_EDNS_FRAG_FAILS */
+	uint8_t fallback;    /* enum kr_ns_edns_fallback */
+};
+
+/**
+ * What the servers' paths do with large answers over UDP, keyed by the address.
+ */
+typedef lru_t(struct kr_nsrep_edns_lru_entry) kr_nsrep_edns_lru_t;
+
 /* Maximum count of addresses probed in one go (last is left empty) */
 #define KR_NSREP_MAXADDR 4
 
@@ -121,6 +177,8 @@ int kr_nsrep_set(struct kr_query *qry, size_t index, const struct sockaddr *sock
 
 /**
  * Elect best nameserver/address pair from the nsset.
+ * A reliable result is reused for the zone cut during KR_NSREP_ELECT_TTL,
+ * unless its addresses got slower or a lame or reputation update came.
  * @param  qry          updated query
  * @param  ctx          resolution context
  * @return              0 or an error code
@@ -141,7 +199,12 @@ int kr_nsrep_elect_addr(struct kr_query *qry, struct kr_context *ctx);
  * Update NS address RTT information.
  *
  * @brief In KR_NS_UPDATE mode reputation is smoothed over last N measurements.
- * 
+ *
+ * Measured RTTs (less than KR_NS_TIMEOUT in KR_NS_UPDATE* modes) feed
+ * a smoothed RTT and its deviation like in TCP (RFC 6298); the score is
+ * the smoothed RTT plus penalties, which fade with time and with each
+ * measurement.  Other updates are penalties.
+ *
  * @param  ns           updated NS representation
  * @param  addr         chosen address (NULL for first)
  * @param  score        new score (i.e. RTT), see enum kr_ns_score
@@ -155,6 +218,19 @@ KR_EXPORT
 int kr_nsrep_update_rtt(struct kr_nsrep *ns, const struct sockaddr *addr,
 			unsigned score, kr_nsrep_rtt_lru_t *cache, int umode);
 
+/**
+ * Get the RTT estimate of an address.
+ *
+ * @param  cache        RTT LRU cache
+ * @param  addr         address of the server
+ * @param  srtt         smoothed RTT (output)
+ * @param  rttvar       mean deviation of the RTT (output)
+ * @return              0 or an error code, kr_error(ENOENT) if not measured yet
+ */
+KR_EXPORT
+int kr_nsrep_rtt_estimate(kr_nsrep_rtt_lru_t *cache, const struct sockaddr *addr,
+			  unsigned *srtt, unsigned *rttvar);
+
 /**
  * Update NSSET reputation information.
  * 
@@ -165,6 +241,62 @@ int kr_nsrep_update_rtt(struct kr_nsrep *ns, const struct sockaddr *addr,
  */
 KR_EXPORT
 int kr_nsrep_update_rep(struct kr_nsrep *ns, unsigned reputation, kr_nsrep_lru_t *cache);
+
+/**
+ * Account a failure or a success of the server for the zone.
+ *
+ * A failure (e.g. lame delegation, SERVFAIL or REFUSED) starts a backoff
+ * during which the address isn't elected for names in the zone,
+ * the backoff doubles with each consecutive failure.  A success forgets them.
+ * @param  cache        lame LRU cache
+ * @param  zone         zone cut name
+ * @param  addr         address of the server
+ * @param  failed       whether it failed
+ * @return              0 or an error code
+ */
+KR_EXPORT
+int kr_nsrep_update_lame(kr_nsrep_lame_lru_t *cache, const knot_dname_t *zone,
+			 const struct sockaddr *addr, bool failed);
+
+/**
+ * Account an answer over UDP from the server.
+ *
+ * An answer too large not to be fragmented clears the time-outs, see
+ * kr_nsrep_edns_timeout(); when most answers come truncated,
+ * the server is asked over TCP right away for KR_NS_EDNS_FALLBACK.
+ * @param  cache        EDNS LRU cache
+ * @param  addr         address of the server
+ * @param  size         of the answer
+ * @param  truncated    whether it has TC
+ * @return              0 or an error code
+ */
+KR_EXPORT
+int kr_nsrep_edns_answer(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr,
+			 size_t size, bool truncated);
+
+/**
+ * Account a time-out over UDP of a query expecting a large answer (with DO).
+ *
+ * It counts only for a server that has answered over UDP before, i.e. whose small
+ * answers pass.  After KR_NS_EDNS_FRAG_FAILS of them the payload falls back
+ * to KR_NS_EDNS_SAFE, after as many more to TCP; for KR_NS_EDNS_FALLBACK each.
+ * @return              0 or an error code
+ */
+KR_EXPORT
+int kr_nsrep_edns_timeout(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr);
+
+/**
+ * EDNS payload to advertise to the server.
+ * @param  cache        EDNS LRU cache
+ * @param  addr         address of the server
+ * @param  payload      the configured one
+ * @param  tcp          set to true if the server is to be asked over TCP (if not NULL)
+ * @return              payload, or less after a fallback
+ */
+KR_EXPORT
+uint16_t kr_nsrep_edns_payload(kr_nsrep_edns_lru_t *cache, const struct sockaddr *addr,
+			       uint16_t payload, bool *tcp);
+
 /**
  * Copy NSSET reputation information and resets score.
  *
@@ -184,3 +316,28 @@ int kr_nsrep_copy_set(struct kr_nsrep *dst, const struct kr_nsrep *src);
  */
 KR_EXPORT
 int kr_nsrep_sort(struct kr_nsrep *ns, kr_nsrep_rtt_lru_t *rtt_cache);
+
+/**
+ * Share RTT and reputation knowledge with other processes.
+ *
+ * The per-process LRUs are still used, but every update is also written into
+ * the given tables and lookups refresh the LRU entries from them first,
+ * so forked workers see what any of them has measured.
+ * @param  rtt          table with kr_nsrep_rtt_lru_entry_t values, or NULL
+ * @param  rep          table with unsigned values, or NULL
+ * @note   the tables have to be created before forking, see shtable_create()
+ */
+KR_EXPORT
+void kr_nsrep_share(shtable_t *rtt, shtable_t *rep);
+
+/** Clear the tables shared by kr_nsrep_share() (if any). */
+KR_EXPORT
+void kr_nsrep_share_clear(void);
+
+/**
+ * Get NS reputation flags (see enum kr_ns_rep), 0 if unknown.
+ * @param  cache        reputation LRU cache
+ * @param  name         NS name
+ */
+KR_EXPORT
+unsigned kr_nsrep_get_rep(kr_nsrep_lru_t *cache, const knot_dname_t *name);
@@ -0,0 +1,178 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libknot/dname.h>
+
+#include "lib/pktindex.h"
+#include "lib/utils.h"
+
+/** FNV-1a of the lower-cased name; the label lengths aren't affected by tolower. */
+static uint32_t owner_hash(const knot_dname_t *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; ++name) {
+		uint8_t c = *name;
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		hash = (hash ^ c) * 16777619u;
+	}
+	return hash;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct kr_pkt_index_entry *ea = a, *eb = b;
+	if (ea->hash != eb->hash) {
+		return ea->hash < eb->hash ? -1 : 1;
+	}
+	return (int)ea->pos - (int)eb->pos;
+}
+
+/** Section of the record at the position, or -1. */
+static int pos_section(const knot_pkt_t *pkt, uint16_t pos)
+{
+	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
+		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
+		if (pos >= sec->pos && pos < sec->pos + sec->count) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool index_valid(const struct kr_pkt_index *idx, const knot_pkt_t *pkt)
+{
+	return idx && idx->pkt == pkt && idx->rrset_count == pkt->rrset_count;
+}
+
+struct kr_pkt_index *kr_pkt_index_create(const knot_pkt_t *pkt, knot_mm_t *pool)
+{
+	if (!pkt || pkt->rrset_count < KR_PKT_INDEX_MIN) {
+		return NULL;
+	}
+	struct kr_pkt_index *idx = mm_alloc(pool, sizeof(*idx));
+	if (!idx) {
+		return NULL;
+	}
+	memset(idx, 0, sizeof(*idx));
+	idx->at = mm_alloc(pool, pkt->rrset_count * sizeof(idx->at[0]));
+	if (!idx->at) {
+		mm_free(pool, idx);
+		return NULL;
+	}
+	idx->pkt = pkt;
+	idx->rrset_count = pkt->rrset_count;
+	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
+		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
+		for (uint16_t k = 0; k < sec->count; ++k) {
+			const knot_rrset_t *rr = knot_pkt_rr(sec, k);
+			if (rr->type < 256) {
+				idx->types[i][rr->type / 8] |= 1 << (rr->type % 8);
+			}
+			idx->at[idx->count].hash = owner_hash(rr->owner);
+			idx->at[idx->count].pos = sec->pos + k;
+			idx->count += 1;
+		}
+	}
+	qsort(idx->at, idx->count, sizeof(idx->at[0]), entry_cmp);
+	return idx;
+}
+
+bool kr_pkt_index_has_type(const struct kr_pkt_index *idx, const knot_pkt_t *pkt,
+			   uint16_t type, unsigned sections)
+{
+	if (!pkt) {
+		return false;
+	}
+	const bool use_index = type < 256 && index_valid(idx, pkt);
+	for (knot_section_t i = KNOT_ANSWER; i <= KNOT_ADDITIONAL; ++i) {
+		if (!(sections & KR_PKT_INDEX_SECTION(i))) {
+			continue;
+		}
+		if (use_index) {
+			if (idx->types[i][type / 8] & (1 << (type % 8))) {
+				return true;
+			}
+			continue;
+		}
+		const knot_pktsection_t *sec = knot_pkt_section(pkt, i);
+		for (uint16_t k = 0; k < sec->count; ++k) {
+			if (knot_pkt_rr(sec, k)->type == type) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+const knot_rrset_t *kr_pkt_index_next(const struct kr_pkt_index *idx, const knot_pkt_t *pkt,
+				      const knot_dname_t *owner, unsigned sections,
+				      unsigned *it, knot_section_t *section)
+{
+	if (!pkt || !owner || !it) {
+		return NULL;
+	}
+	if (!index_valid(idx, pkt)) {
+		/* Scan the packet; *it is the next position. */
+		for (; *it < pkt->rrset_count; ++*it) {
+			const knot_rrset_t *rr = &pkt->rr[*it];
+			const int sec = pos_section(pkt, *it);
+			if (sec >= 0 && (sections & KR_PKT_INDEX_SECTION(sec))
+			    && knot_dname_is_equal(rr->owner, owner)) {
+				++*it;
+				if (section) {
+					*section = sec;
+				}
+				return rr;
+			}
+		}
+		return NULL;
+	}
+	/* Search the index; *it is the next entry + 1, or 0 at the start. */
+	const uint32_t hash = owner_hash(owner);
+	unsigned i = *it;
+	if (i == 0) {
+		unsigned hi = idx->count;
+		while (i < hi) {
+			const unsigned mid = i + (hi - i) / 2;
+			if (idx->at[mid].hash < hash) {
+				i = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+	} else {
+		i -= 1;
+	}
+	for (; i < idx->count && idx->at[i].hash == hash; ++i) {
+		const uint16_t pos = idx->at[i].pos;
+		const knot_rrset_t *rr = &pkt->rr[pos];
+		const int sec = pos_section(pkt, pos);
+		if (sec >= 0 && (sections & KR_PKT_INDEX_SECTION(sec))
+		    && knot_dname_is_equal(rr->owner, owner)) {
+			*it = i + 2;
+			if (section) {
+				*section = sec;
+			}
+			return rr;
+		}
+	}
+	*it = idx->count + 1;
+	return NULL;
+}
@@ -0,0 +1,95 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file pktindex.h
+ * @brief Index of the records of a parsed packet, by owner and by type.
+ *
+ * It's built once for each answer from upstream by kr_resolve_consume(),
+ * see kr_request::pkt_index, so that the layers don't scan the sections
+ * again for each name, e.g. for the glue of each NS of a large referral.
+ * The lookups take the packet as well; without a valid index for it,
+ * e.g. NULL or after the packet was modified, they scan the sections.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	unsigned it = 0;
+ * 	knot_section_t section;
+ * 	const knot_rrset_t *rr;
+ * 	while ((rr = kr_pkt_index_next(req->pkt_index, pkt, ns_name,
+ * 				       KR_PKT_INDEX_ALL, &it, &section))) {
+ * 		// rr->owner equals ns_name, in the packet order
+ * 	}
+ * @endcode
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libknot/packet/pkt.h>
+
+#include "lib/defines.h"
+
+/** Masks of the sections for the lookups. */
+#define KR_PKT_INDEX_SECTION(section) (1u << (section))
+#define KR_PKT_INDEX_ALL (KR_PKT_INDEX_SECTION(KNOT_ANSWER) \
+			  | KR_PKT_INDEX_SECTION(KNOT_AUTHORITY) \
+			  | KR_PKT_INDEX_SECTION(KNOT_ADDITIONAL))
+
+/** Packets with fewer records aren't worth indexing. */
+#define KR_PKT_INDEX_MIN 8
+
+struct kr_pkt_index_entry {
+	uint32_t hash;  /**< Of the lower-cased owner */
+	uint16_t pos;   /**< In knot_pkt_t::rr */
+};
+
+struct kr_pkt_index {
+	const knot_pkt_t *pkt;  /**< The indexed packet */
+	uint16_t rrset_count;   /**< Of the packet when indexed */
+	uint16_t count;
+	struct kr_pkt_index_entry *at;  /**< By the hash, then in the packet order */
+	uint8_t types[KNOT_ADDITIONAL + 1][32];  /**< Bitmaps of the types < 256 in each section */
+};
+
+/**
+ * Index the records of the packet.
+ * @return the index or NULL (also for small packets, see KR_PKT_INDEX_MIN)
+ */
+KR_EXPORT
+struct kr_pkt_index *kr_pkt_index_create(const knot_pkt_t *pkt, knot_mm_t *pool);
+
+/**
+ * Check whether any record of the type is in the sections.
+ * @param sections  mask of KR_PKT_INDEX_SECTION()
+ */
+KR_EXPORT
+bool kr_pkt_index_has_type(const struct kr_pkt_index *idx, const knot_pkt_t *pkt,
+			   uint16_t type, unsigned sections);
+
+/**
+ * Find the next record of the owner in the sections, in the packet order.
+ * @param sections  mask of KR_PKT_INDEX_SECTION()
+ * @param it        position of the lookup, 0 at the start
+ * @param section   set to the section of the record if not NULL
+ * @return the record or NULL at the end
+ */
+KR_EXPORT
+const knot_rrset_t *kr_pkt_index_next(const struct kr_pkt_index *idx, const knot_pkt_t *pkt,
+				      const knot_dname_t *owner, unsigned sections,
+				      unsigned *it, knot_section_t *section);
@@ -96,21 +96,109 @@ static int finish_yield(kr_layer_t *ctx) { return kr_ok(); }
 static int produce_yield(kr_layer_t *ctx, knot_pkt_t *pkt) { return kr_ok(); }
 static int checkout_yield(kr_layer_t *ctx, knot_pkt_t *packet, struct sockaddr *dst, int type) { return kr_ok(); }
 
+/** @internal Phases the layer callbacks are accounted to, see layer_phase(). */
+#define PHASE_begin    KR_PHASE_PRODUCE
+#define PHASE_reset    KR_PHASE_PRODUCE
+#define PHASE_produce  KR_PHASE_PRODUCE
+#define PHASE_consume  KR_PHASE_CONSUME
+#define PHASE_checkout KR_PHASE_CHECKOUT
+#define PHASE_finish   KR_PHASE_FINALIZE
+
+/** @internal Cache and validator have their own phase, whatever the callback. */
+static inline enum kr_phase layer_phase(const struct kr_module *mod, enum kr_phase phase)
+{
+	if (mod->layer == cache_layer) {
+		return KR_PHASE_CACHE;
+	} else if (mod->layer == validate_layer) {
+		return KR_PHASE_VALIDATE;
+	}
+	return phase;
+}
+
+/** @internal Account the time since `since` to the phase. */
+static inline void phase_add(struct kr_request *req, enum kr_phase phase, uint64_t since)
+{
+	req->phase_us[phase] += kr_now_us() - since;
+}
+
+/** @internal Remember the layer if it's the slowest one, see kr_context::slow_layer. */
+static inline void slow_layer_add(struct kr_context *ctx, const struct kr_module *mod, uint64_t us)
+{
+	if (us > ctx->slow_layer.us) {
+		ctx->slow_layer.module = mod;
+		ctx->slow_layer.us = MIN(us, UINT32_MAX);
+	}
+}
+
+/** @internal Timing of the layer calls by RESUME_LAYERS; the clock is only read
+ * where the phase changes, not around each call. */
+struct layer_timer {
+	enum kr_phase phase; /**< of the calls since `since` */
+	uint64_t since;
+};
+
+static inline void layer_timer_start(struct layer_timer *t, enum kr_phase phase)
+{
+	t->phase = phase;
+	t->since = kr_now_us();
+}
+
+/** @internal Account the time so far to the phase. */
+static inline void layer_timer_stop(struct kr_request *req, struct layer_timer *t)
+{
+	const uint64_t now = kr_now_us();
+	req->phase_us[t->phase] += now - t->since;
+	t->since = now;
+}
+
+/** @internal Before a layer call in the phase. */
+static inline void layer_timer_enter(struct kr_request *req, struct layer_timer *t,
+				     enum kr_phase phase)
+{
+	if (phase != t->phase) {
+		layer_timer_stop(req, t);
+		t->phase = phase;
+	}
+}
+
+/** @internal After the call of the layer; returns its time in microseconds,
+ * or 0 unless the calls are timed, see kr_context::slow_layer. */
+static inline uint64_t layer_timer_call(struct kr_request *req, struct layer_timer *t,
+					const struct kr_module *mod)
+{
+	if (!req->ctx->slow_layer.on) {
+		return 0;
+	}
+	const uint64_t since = t->since;
+	layer_timer_stop(req, t);
+	const uint64_t us = t->since - since;
+	slow_layer_add(req->ctx, mod, us);
+	return us;
+}
+
 /** @internal Macro for iterating module layers. */
 #define RESUME_LAYERS(from, r, qry, func, ...) \
     (r)->current_query = (qry); \
+	{ \
+	struct layer_timer timer; \
+	layer_timer_start(&timer, PHASE_ ## func); \
 	for (size_t i = (from); i < (r)->ctx->modules->len; ++i) { \
 		struct kr_module *mod = (r)->ctx->modules->at[i]; \
 		if (mod->layer) { \
 			struct kr_layer layer = {.state = (r)->state, .api = mod->layer(mod), .req = (r)}; \
 			if (layer.api && layer.api->func) { \
+				layer_timer_enter((r), &timer, layer_phase(mod, PHASE_ ## func)); \
 				(r)->state = layer.api->func(&layer, ##__VA_ARGS__); \
+				const uint64_t layer_us = layer_timer_call((r), &timer, mod); \
+				kr_probe(layer, (r), mod->name, #func, layer_us, (r)->state); \
 				if ((r)->state == KR_STATE_YIELD) { \
 					func ## _yield(&layer, ##__VA_ARGS__); \
 					break; \
 				} \
 			} \
 		} \
+	} \
+	layer_timer_stop((r), &timer); \
 	} /* Invalidate current query. */ \
 	(r)->current_query = NULL
 
@@ -133,21 +221,63 @@ static inline size_t layer_id(struct kr_request *req, const struct kr_layer_api
 KR_CONST static inline bool isletter(unsigned chr)
 { return (chr | 0x20 /* tolower */) - 'a' <= 'z' - 'a'; }
 
+#if defined(__i386) || defined(__x86_64) || defined(_M_IX86) \
+	|| (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) \
+		&& __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/** Flip the case of eight bytes at once (little-endian words only). */
+#define QNAME_CASE_WORDS 1
+
+/** Spread the lowest 8 bits into the lowest bits of 8 bytes. */
+KR_CONST static inline uint64_t spread_bits8(uint32_t bits)
+{
+	uint64_t x = bits & 0xff;
+	x = (x | (x << 28)) & 0x0000000f0000000fULL;
+	x = (x | (x << 14)) & 0x0003000300030003ULL;
+	x = (x | (x << 7))  & 0x0101010101010101ULL;
+	return x;
+}
+#endif
+
 /* Randomize QNAME letter case.
  * This adds 32 bits of randomness at maximum, but that's more than an average domain name length.
  * https://tools.ietf.org/html/draft-vixie-dnsext-dns0x20-00
+ * Applying it twice restores the name, so the answer's QNAME is checked
+ * by comparing it with the lowercase name after that.
  */
 static void randomized_qname_case(knot_dname_t * restrict qname, uint32_t secret)
 {
 	assert(qname);
-	const int len = knot_dname_size(qname) - 2; /* Skip first, last label. */
-	for (int i = 0; i < len; ++i) {
-		if (isletter(*++qname)) {
-				*qname ^= ((secret >> (i & 31)) & 1) * 0x20;
+	if (secret == 0) {
+		return;
+	}
+	uint8_t *wire = qname + 1; /* Skip first, last label. */
+	const int len = knot_dname_size(qname) - 2;
+	int i = 0;
+#ifdef QNAME_CASE_WORDS
+	/* Bit (i % 32) of the secret is for byte i, label lengths aren't letters.
+	 * The letters are the bytes below 0x80 that are 'a'-'z' with 0x20 set. */
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, wire + i, sizeof(w));
+		const uint64_t t = (w | 0x2020202020202020ULL) & 0x7f7f7f7f7f7f7f7fULL;
+		const uint64_t letters = (t + 0x1f1f1f1f1f1f1f1fULL)  /* >= 'a' */
+					 & ~(t + 0x0505050505050505ULL) /* > 'z' */
+					 & ~w & 0x8080808080808080ULL;
+		const unsigned shift = i & 31;
+		const uint32_t bits = shift ? (secret >> shift) | (secret << (32 - shift)) : secret;
+		w ^= (letters >> 2) & (spread_bits8(bits) << 5);
+		memcpy(wire + i, &w, sizeof(w));
+	}
+#endif
+	for (; i < len; ++i) {
+		if (isletter(wire[i])) {
+			wire[i] ^= ((secret >> (i & 31)) & 1) * 0x20;
 		}
 	}
 }
 
+#undef QNAME_CASE_WORDS
+
 /** Invalidate current NS/addr pair. */
 static int invalidate_ns(struct kr_rplan *rplan, struct kr_query *qry)
 {
@@ -267,8 +397,9 @@ static int ns_fetch_cut(struct kr_query *qry, const knot_dname_t *requested_name
 	} else {
 		qry->flags.DNSSEC_WANT = false;
 	}
-	/* Check if any DNSKEY found for cached cut */
+	/* Check if any DNSKEY found for cached cut; the addresses are needed then. */
 	if (qry->flags.DNSSEC_WANT && cut_found.key == NULL &&
+	    kr_zonecut_fetch_pending(req->ctx, &cut_found, qry) == 0 &&
 	    kr_zonecut_is_empty(&cut_found)) {
 		/* Cut found and there are no proofs of zone insecurity.
 		 * But no DNSKEY found and no glue fetched.
@@ -288,12 +419,11 @@ static int ns_fetch_cut(struct kr_query *qry, const knot_dname_t *requested_name
 		qry->flags.AWAIT_CUT = false;
 		return KR_STATE_DONE;
 	}
-	/* Copy fetched name */
-	qry->zone_cut.name = knot_dname_copy(cut_found.name, qry->zone_cut.pool);
-	/* Copy fetched address set */
-	kr_zonecut_copy(&qry->zone_cut, &cut_found);
-	/* Copy fetched ta & keys */
-	kr_zonecut_copy_trust(&qry->zone_cut, &cut_found);
+	/* Take over fetched name, address set, ta & keys */
+	if (kr_zonecut_move(&qry->zone_cut, &cut_found) != 0) {
+		kr_zonecut_deinit(&cut_found);
+		return KR_STATE_FAIL;
+	}
 	/* Check if there's a non-terminal between target and current cut. */
 	struct kr_cache *cache = &req->ctx->cache;
 	check_empty_nonterms(qry, pkt, cache, qry->timestamp.tv_sec);
@@ -301,6 +431,43 @@ static int ns_fetch_cut(struct kr_query *qry, const knot_dname_t *requested_name
 	return KR_STATE_PRODUCE;
 }
 
+/** Nameservers without addresses looked up alongside the elected one. */
+#define SIDE_QUERY_NS 2
+
+/**
+ * Have the addresses of a few glueless NSs of the cut (except the one
+ * given) resolved by separate requests; whatever arrives first is cached
+ * for the next election, instead of waiting for each in turn.
+ */
+static void ns_side_queries(struct kr_query *qry, struct kr_context *ctx,
+			    const knot_dname_t *except)
+{
+	if (!ctx->side_query || qry->flags.NO_CACHE || qry->flags.STUB) {
+		return;
+	}
+	const bool ip4 = !ctx->options.NO_IPV4, ip6 = !ctx->options.NO_IPV6;
+	int todo = SIDE_QUERY_NS;
+	trie_it_t *it;
+	for (it = trie_it_begin(qry->zone_cut.nsset); todo > 0 && !trie_it_finished(it);
+							trie_it_next(it)) {
+		const knot_dname_t *ns = (const knot_dname_t *)trie_it_key(it, NULL);
+		const pack_t *addrs = *trie_it_val(it);
+		if ((addrs && (addrs->len > 0 || kr_zonecut_addrs_pending(addrs)))
+		    || (except && knot_dname_is_equal(ns, except))
+		    || knot_dname_is_sub(ns, qry->zone_cut.name)) {
+			continue; /* Has glue (maybe yet in cache) or would need it. */
+		}
+		if (ip6) {
+			ctx->side_query(ns, KNOT_RRTYPE_AAAA, KNOT_CLASS_IN);
+		}
+		if (ip4) {
+			ctx->side_query(ns, KNOT_RRTYPE_A, KNOT_CLASS_IN);
+		}
+		--todo;
+	}
+	trie_it_free(it);
+}
+
 static int ns_resolve_addr(struct kr_query *qry, struct kr_request *param)
 {
 	struct kr_rplan *rplan = &param->rplan;
@@ -317,6 +484,11 @@ static int ns_resolve_addr(struct kr_query *qry, struct kr_request *param)
 	    !(ctx->options.NO_IPV6)) {
 		next_type = KNOT_RRTYPE_AAAA;
 		qry->flags.AWAIT_IPV6 = true;
+		/* Meanwhile its A and the other glueless NSs. */
+		if (ctx->side_query && !qry->flags.NO_CACHE && !ctx->options.NO_IPV4) {
+			ctx->side_query(qry->ns.name, KNOT_RRTYPE_A, KNOT_CLASS_IN);
+		}
+		ns_side_queries(qry, ctx, qry->ns.name);
 	} else if (!(qry->flags.AWAIT_IPV4) &&
 		   !(ctx->options.NO_IPV4)) {
 		next_type = KNOT_RRTYPE_A;
@@ -433,13 +605,14 @@ static int edns_create(knot_pkt_t *pkt, knot_pkt_t *template, struct kr_request
 	}
 #endif /* defined(ENABLE_COOKIES) */
 	if (req->has_tls) {
-		if (req->ctx->tls_padding == -1)
-			/* FIXME: we do not know how to reserve space for the
-			 * default padding policy, since we can't predict what
-			 * it will select. So i'm just guessing :/ */
-			wire_size += KNOT_EDNS_OPTION_HDRLEN + 512;
-		if (req->ctx->tls_padding >= 2)
-			wire_size += KNOT_EDNS_OPTION_HDRLEN + req->ctx->tls_padding;
+		/* Padding is less than the block, see answer_padding();
+		 * libknot's default policy pads responses to KR_DEFAULT_TLS_PADDING
+		 * (RFC 8467), so the space is known before the answer is written. */
+		const int32_t block = req->ctx->tls_padding == -1
+			? KR_DEFAULT_TLS_PADDING : req->ctx->tls_padding;
+		if (block >= 2) {
+			wire_size += KNOT_EDNS_OPTION_HDRLEN + block - 1;
+		}
 	}
 	return knot_pkt_reserve(pkt, wire_size);
 }
@@ -464,10 +637,85 @@ static int answer_prepare(knot_pkt_t *answer, knot_pkt_t *query, struct kr_reque
 }
 
 /** @return error code, ignoring if forced to truncate the packet. */
-static int write_extra_records(const rr_array_t *arr, knot_pkt_t *answer)
+/** Names at most remembered by struct answer_names. */
+#define ANSWER_NAMES 32
+
+/**
+ * Names already written into the answer, shared by all its sections.
+ *
+ * libknot compresses each owner and RDATA name only against the QNAME,
+ * so e.g. a CNAME chain would repeat every target as the next owner.
+ * An owner found here is written as a plain pointer (the compression hint
+ * of knot_pkt_put()), without searching.
+ */
+struct answer_names {
+	unsigned len;
+	const knot_dname_t *name[ANSWER_NAMES];
+	uint16_t pos[ANSWER_NAMES];
+};
+
+static void answer_names_init(struct answer_names *names, const knot_pkt_t *answer)
+{
+	names->len = 0;
+	if (knot_wire_get_qdcount(answer->wire) > 0) {
+		names->name[0] = knot_pkt_qname(answer);
+		names->pos[0] = KNOT_WIRE_HEADER_SIZE;
+		names->len = 1;
+	}
+}
+
+static void answer_names_add(struct answer_names *names, const knot_dname_t *name, uint16_t pos)
+{
+	/* Zero means the name wasn't written (or didn't fit a pointer). */
+	if (pos >= KNOT_WIRE_HEADER_SIZE && names->len < ANSWER_NAMES) {
+		names->name[names->len] = name;
+		names->pos[names->len] = pos;
+		names->len += 1;
+	}
+}
+
+/** Put the RRset into the answer, pointing its owner at a name written before. */
+static int answer_put(knot_pkt_t *answer, struct answer_names *names, const knot_rrset_t *rr)
+{
+	uint16_t hint = KNOT_COMPR_HINT_NONE;
+	for (unsigned i = 0; i < names->len; ++i) {
+		if (knot_dname_is_equal(names->name[i], rr->owner)) {
+			hint = names->pos[i];
+			break;
+		}
+	}
+	int err = knot_pkt_put(answer, hint, rr, 0);
+	if (err != KNOT_EOK) {
+		return err;
+	}
+	/* Remember the new owner and the targets of the delegations and aliases,
+	 * those are the owners in the other sections. */
+	const knot_rrinfo_t *info = &answer->rr_info[answer->rrset_count - 1];
+	if (hint == KNOT_COMPR_HINT_NONE) {
+		answer_names_add(names, rr->owner, info->compress_ptr[KNOT_COMPR_HINT_OWNER]);
+	}
+	switch (rr->type) {
+	case KNOT_RRTYPE_CNAME:
+	case KNOT_RRTYPE_DNAME:
+	case KNOT_RRTYPE_NS:
+		for (uint16_t i = 0; i < rr->rrs.rr_count
+				     && KNOT_COMPR_HINT_RDATA + i < KNOT_COMPR_HINT_COUNT; ++i) {
+			const knot_dname_t *target = rr->type == KNOT_RRTYPE_NS
+				? knot_ns_name(&rr->rrs, i) : knot_cname_name(&rr->rrs);
+			answer_names_add(names, target, info->compress_ptr[KNOT_COMPR_HINT_RDATA + i]);
+		}
+		break;
+	default:
+		break;
+	}
+	return KNOT_EOK;
+}
+
+static int write_extra_records(const rr_array_t *arr, knot_pkt_t *answer,
+			       struct answer_names *names)
 {
 	for (size_t i = 0; i < arr->len; ++i) {
-		int err = knot_pkt_put(answer, 0, arr->at[i], 0);
+		int err = answer_put(answer, names, arr->at[i]);
 		if (err != KNOT_EOK) {
 			return err == KNOT_ESPACE ? kr_ok() : kr_error(err);
 		}
@@ -479,10 +727,12 @@ static int write_extra_records(const rr_array_t *arr, knot_pkt_t *answer)
  * @param all_secure optionally &&-combine security of written RRs into its value.
  *		     (i.e. if you pass a pointer to false, it will always remain)
  * @param all_cname optionally output if all written RRs are CNAMEs and RRSIGs of CNAMEs
+ * @param proofs_only write just NSEC and NSEC3 records and their RRSIGs
  * @return error code, ignoring if forced to truncate the packet.
  */
 static int write_extra_ranked_records(const ranked_rr_array_t *arr, knot_pkt_t *answer,
-				      bool *all_secure, bool *all_cname)
+				      struct answer_names *names, bool *all_secure, bool *all_cname,
+				      bool proofs_only)
 {
 	const bool has_dnssec = knot_pkt_has_dnssec(answer);
 	bool all_sec = true;
@@ -500,7 +750,13 @@ static int write_extra_ranked_records(const ranked_rr_array_t *arr, knot_pkt_t *
 				continue;
 			}
 		}
-		err = knot_pkt_put(answer, 0, rr, 0);
+		if (proofs_only) {
+			const uint16_t type = kr_rrset_type_maysig(rr);
+			if (type != KNOT_RRTYPE_NSEC && type != KNOT_RRTYPE_NSEC3) {
+				continue;
+			}
+		}
+		err = answer_put(answer, names, rr);
 		if (err != KNOT_EOK) {
 			if (err == KNOT_ESPACE) {
 				err = kr_ok();
@@ -550,14 +806,17 @@ static int answer_padding(struct kr_request *request)
 	}
 
 	if (pad_bytes >= 0) {
-		uint8_t zeros[MAX(1, pad_bytes)];
-		memset(zeros, 0, sizeof(zeros));
-		int r = knot_edns_add_option(opt_rr, KNOT_EDNS_OPTION_PADDING,
-					     pad_bytes, zeros, &answer->mm);
+		/* Grow the OPT RDATA once and zero the option in place. */
+		uint8_t *pad_wire = NULL;
+		int r = knot_edns_reserve_option(opt_rr, KNOT_EDNS_OPTION_PADDING,
+						 pad_bytes, &pad_wire, &answer->mm);
 		if (r != KNOT_EOK) {
 			knot_rrset_clear(opt_rr, &answer->mm);
 			return kr_error(r);
 		}
+		if (pad_bytes > 0) {
+			memset(pad_wire, 0, pad_bytes);
+		}
 	}
 	return kr_ok();
 }
@@ -578,6 +837,21 @@ static int answer_fail(struct kr_request *request)
 	return ret;
 }
 
+/** @internal Whether to leave out the records not needed by the query, see MINIMAL_RESPONSES;
+ * a view sets the flag on the first query of the CNAME chain. */
+static bool answer_minimal(const struct kr_request *request, const struct kr_query *last)
+{
+	if (request->options.MINIMAL_RESPONSES) {
+		return true;
+	}
+	for (const struct kr_query *qry = last; qry != NULL; qry = qry->cname_parent) {
+		if (qry->flags.MINIMAL_RESPONSES) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static int answer_finalize(struct kr_request *request, int state)
 {
 	struct kr_rplan *rplan = &request->rplan;
@@ -607,6 +881,8 @@ static int answer_finalize(struct kr_request *request, int state)
 		secure = false; /* the last answer is insecure due to opt-out */
 	}
 
+	struct answer_names names;
+	answer_names_init(&names, answer);
 	bool answ_all_cnames = false/*arbitrary*/;
 	if (request->answ_selected.len > 0) {
 		assert(answer->current <= KNOT_ANSWER);
@@ -614,24 +890,29 @@ static int answer_finalize(struct kr_request *request, int state)
 		if (answer->current < KNOT_ANSWER) {
 			knot_pkt_begin(answer, KNOT_ANSWER);
 		}
-		if (write_extra_ranked_records(&request->answ_selected, answer,
-						&secure, &answ_all_cnames))
+		if (write_extra_ranked_records(&request->answ_selected, answer, &names,
+						&secure, &answ_all_cnames, false))
 		{
 			return answer_fail(request);
 		}
 	}
 
 	VERBOSE_MSG(NULL, "AD: secure (between ANS and AUTH)\n");
-	/* Write authority records. */
+	/* Write authority records.  Minimal positive answers keep just the proofs
+	 * of wildcard expansions; the negative ones need their SOA and proofs. */
+	const bool minimal = answer_minimal(request, last);
+	const bool positive = kr_response_classify(answer) == PKT_NOERROR
+		&& !(answ_all_cnames && knot_pkt_qtype(answer) != KNOT_RRTYPE_CNAME);
 	if (answer->current < KNOT_AUTHORITY) {
 		knot_pkt_begin(answer, KNOT_AUTHORITY);
 	}
-	if (write_extra_ranked_records(&request->auth_selected, answer, &secure, NULL)) {
+	if (write_extra_ranked_records(&request->auth_selected, answer, &names, &secure, NULL,
+					minimal && positive)) {
 		return answer_fail(request);
 	}
 	/* Write additional records. */
 	knot_pkt_begin(answer, KNOT_ADDITIONAL);
-	if (write_extra_records(&request->additional, answer)) {
+	if (!minimal && write_extra_records(&request->additional, answer, &names)) {
 		return answer_fail(request);
 	}
 	/* Write EDNS information */
@@ -678,7 +959,8 @@ static int answer_finalize(struct kr_request *request, int state)
 	return ret;
 }
 
-static int query_finalize(struct kr_request *request, struct kr_query *qry, knot_pkt_t *pkt)
+static int query_finalize(struct kr_request *request, struct kr_query *qry, knot_pkt_t *pkt,
+			  const struct sockaddr *dst, int type)
 {
 	int ret = 0;
 	knot_pkt_begin(pkt, KNOT_ADDITIONAL);
@@ -688,6 +970,12 @@ static int query_finalize(struct kr_request *request, struct kr_query *qry, knot
 		if (ret == 0) {
 			ret = edns_create(pkt, request->answer, request);
 		}
+		if (ret == 0 && type == SOCK_DGRAM) {
+			/* Less to a server whose path seems to drop the fragments. */
+			const uint16_t payload = knot_edns_get_payload(pkt->opt_rr);
+			knot_edns_set_payload(pkt->opt_rr, kr_nsrep_edns_payload(
+				request->ctx->cache_edns, dst, payload, NULL));
+		}
 		if (ret == 0) {
 			/* Stub resolution (ask for +rd and +do) */
 			if (qry->flags.STUB) {
@@ -707,6 +995,17 @@ static int query_finalize(struct kr_request *request, struct kr_query *qry, knot
 				knot_edns_set_do(pkt->opt_rr);
 				knot_wire_set_cd(pkt->wire);
 			}
+			/* Client subnet to the servers of the selected zones only, see lib/ecs.h */
+			knot_edns_client_subnet_t ecs;
+			if (kr_ecs_get(qry, qry->zone_cut.name, &ecs)) {
+				ret = knot_pkt_reserve(pkt, KNOT_EDNS_OPTION_HDRLEN
+							+ knot_edns_client_subnet_size(&ecs));
+				if (ret == 0) {
+					ret = kr_ecs_put(pkt->opt_rr, &ecs, &pkt->mm);
+				}
+			}
+		}
+		if (ret == 0) {
 			ret = edns_put(pkt);
 		}
 	}
@@ -722,13 +1021,30 @@ int kr_resolve_begin(struct kr_request *request, struct kr_context *ctx, knot_pk
 	request->state = KR_STATE_CONSUME;
 	request->current_query = NULL;
 	array_init(request->additional);
-	array_init(request->answ_selected);
-	array_init(request->auth_selected);
-	array_init(request->add_selected);
+	kr_ranked_rrarray_init(request->answ_selected);
+	kr_ranked_rrarray_init(request->auth_selected);
+	kr_ranked_rrarray_init(request->add_selected);
 	request->answ_validated = false;
 	request->auth_validated = false;
 	request->trace_log = NULL;
 	request->trace_finish = NULL;
+	memset(request->phase_us, 0, sizeof(request->phase_us));
+	request->upstream_since = 0;
+	request->answer_dropped = false;
+	request->stale_deadline = 0;
+	request->upstream_count = 0;
+	request->trace_ring = NULL;
+	request->cache_ns = 0;
+	request->fwd_pool = NULL;
+	request->fwd_probe = 0;
+	request->guard_slot = 0;
+	/* Record the trace of each sample-th request, unless it's all printed anyway. */
+	if (ctx->trace.sample && !kr_verbose_status
+	    && ++ctx->trace.counter >= ctx->trace.sample) {
+		ctx->trace.counter = 0;
+		request->trace_ring = kr_trace_ring_new(&request->pool, ctx->trace.size);
+		ctx->trace.recorded += (request->trace_ring != NULL);
+	}
 
 	/* Expect first query */
 	kr_rplan_init(&request->rplan, request, &request->pool);
@@ -857,24 +1173,46 @@ static void update_nslist_rtt(struct kr_context *ctx, struct kr_query *qry, cons
 	}
 }
 
+/** Remember (or forget) that the server fails for the zone cut, for all requests.
+ * The forwarders aren't elected, so there's nothing to remember for them. */
+static void update_lame(struct kr_context *ctx, struct kr_query *qry,
+			const struct sockaddr *src, bool failed)
+{
+	if (qry->flags.STUB || qry->flags.FORWARD) {
+		return;
+	}
+	(void) kr_nsrep_update_lame(ctx->cache_lame, qry->zone_cut.name, src, failed);
+}
+
 static void update_nslist_score(struct kr_request *request, struct kr_query *qry, const struct sockaddr *src, knot_pkt_t *packet)
 {
 	struct kr_context *ctx = request->ctx;
+	if (request->fwd_pool) {
+		const int rcode = packet ? knot_wire_get_rcode(packet->wire) : 0;
+		const bool failed = (request->state == KR_STATE_FAIL && !qry->flags.DNSSEC_BOGUS)
+			|| rcode == KNOT_RCODE_SERVFAIL || rcode == KNOT_RCODE_REFUSED;
+		const uint64_t elapsed = kr_now() - qry->timestamp_mono;
+		kr_fwd_pool_report(request->fwd_pool, src,
+				   failed ? kr_error(EIO) : MIN(elapsed, INT32_MAX));
+	}
 	/* On successful answer, update preference list RTT and penalise timer  */
 	if (request->state != KR_STATE_FAIL) {
 		/* Update RTT information for preference list */
 		update_nslist_rtt(ctx, qry, src);
 		/* Do not complete NS address resolution on soft-fail. */
 		const int rcode = packet ? knot_wire_get_rcode(packet->wire) : 0;
-		if (rcode != KNOT_RCODE_SERVFAIL && rcode != KNOT_RCODE_REFUSED) {
+		const bool soft_fail = rcode == KNOT_RCODE_SERVFAIL || rcode == KNOT_RCODE_REFUSED;
+		if (!soft_fail) {
 			qry->flags.AWAIT_IPV6 = false;
 			qry->flags.AWAIT_IPV4 = false;
 		} else { /* Penalize SERVFAILs. */
 			kr_nsrep_update_rtt(&qry->ns, src, KR_NS_PENALTY, ctx->cache_rtt, KR_NS_ADD);
 		}
+		update_lame(ctx, qry, src, soft_fail);
 	/* Penalise resolution failures except validation failures. */
 	} else if (!(qry->flags.DNSSEC_BOGUS)) {
 		kr_nsrep_update_rtt(&qry->ns, src, KR_NS_TIMEOUT, ctx->cache_rtt, KR_NS_UPDATE);
+		update_lame(ctx, qry, src, true);
 		WITH_VERBOSE(qry) {
 			char addr_str[INET6_ADDRSTRLEN];
 			inet_ntop(src->sa_family, kr_inaddr(src), addr_str, sizeof(addr_str));
@@ -883,6 +1221,31 @@ static void update_nslist_score(struct kr_request *request, struct kr_query *qry
 	}
 }
 
+/** Account what came over UDP (or nothing) for the EDNS payloads, see kr_nsrep_edns_payload(). */
+static void update_edns(struct kr_context *ctx, struct kr_query *qry,
+			const struct sockaddr *src, const knot_pkt_t *packet)
+{
+	if (qry->flags.SAFEMODE) {
+		return;
+	}
+	if (packet) {
+		(void) kr_nsrep_edns_answer(ctx->cache_edns, src, packet->size,
+					    knot_wire_get_tc(packet->wire));
+		return;
+	}
+	/* The servers tried didn't answer; only the answers with DO tend to be large. */
+	if (!qry->flags.DNSSEC_WANT && !qry->flags.FORWARD) {
+		return;
+	}
+	for (size_t i = 0; i < KR_NSREP_MAXADDR; ++i) {
+		const struct sockaddr *addr = &qry->ns.addr[i].ip;
+		if (addr->sa_family == AF_UNSPEC) {
+			break;
+		}
+		(void) kr_nsrep_edns_timeout(ctx->cache_edns, addr);
+	}
+}
+
 static bool resolution_time_exceeded(struct kr_query *qry, uint64_t now)
 {
 	uint64_t resolving_time = now - qry->creation_time_mono;
@@ -907,6 +1270,12 @@ int kr_resolve_consume(struct kr_request *request, const struct sockaddr *src, k
 		return resolve_query(request, packet);
 	}
 
+	/* The answer (or its absence) ends waiting for upstream. */
+	if (request->upstream_since) {
+		phase_add(request, KR_PHASE_UPSTREAM, request->upstream_since);
+		request->upstream_since = 0;
+	}
+
 	/* Different processing for network error */
 	struct kr_query *qry = array_tail(rplan->pending);
 	/* Check overall resolution time */
@@ -918,6 +1287,7 @@ int kr_resolve_consume(struct kr_request *request, const struct sockaddr *src, k
 		if (tried_tcp) {
 			request->state = KR_STATE_FAIL;
 		} else {
+			update_edns(request->ctx, qry, NULL, NULL);
 			qry->flags.TCP = true;
 		}
 	} else {
@@ -927,6 +1297,9 @@ int kr_resolve_consume(struct kr_request *request, const struct sockaddr *src, k
 			randomized_qname_case(qname_raw, qry->secret);
 		}
 		request->state = KR_STATE_CONSUME;
+		/* Index the records once for all the layers; the buffer
+		 * is reused for the next answer, so drop it afterwards. */
+		request->pkt_index = kr_pkt_index_create(packet, &request->pool);
 		if (qry->flags.CACHED) {
 			ITERATE_LAYERS(request, qry, consume, packet);
 		} else {
@@ -938,11 +1311,15 @@ int kr_resolve_consume(struct kr_request *request, const struct sockaddr *src, k
 			request->upstream.addr = NULL;
 			request->upstream.rtt = 0;
 		}
+		request->pkt_index = NULL;
 	}
 
 	/* Track RTT for iterative answers */
 	if (src && !(qry->flags.CACHED)) {
 		update_nslist_score(request, qry, src, packet);
+		if (packet && packet->size > 0 && !tried_tcp) {
+			update_edns(request->ctx, qry, src, packet);
+		}
 	}
 	/* Resolution failed, invalidate current NS. */
 	if (request->state == KR_STATE_FAIL) {
@@ -983,7 +1360,7 @@ static struct kr_query *zone_cut_subreq(struct kr_rplan *rplan, struct kr_query
 		return NULL;
 	}
 	kr_zonecut_set(&next->zone_cut, parent->zone_cut.name);
-	if (kr_zonecut_copy(&next->zone_cut, &parent->zone_cut) != 0 ||
+	if (kr_zonecut_share(&next->zone_cut, &parent->zone_cut) != 0 ||
 	    kr_zonecut_copy_trust(&next->zone_cut, &parent->zone_cut) != 0) {
 		return NULL;
 	}
@@ -997,8 +1374,8 @@ static struct kr_query *zone_cut_subreq(struct kr_rplan *rplan, struct kr_query
 static int forward_trust_chain_check(struct kr_request *request, struct kr_query *qry, bool resume)
 {
 	struct kr_rplan *rplan = &request->rplan;
-	map_t *trust_anchors = &request->ctx->trust_anchors;
-	map_t *negative_anchors = &request->ctx->negative_anchors;
+	trie_t *trust_anchors = request->ctx->trust_anchors;
+	trie_t *negative_anchors = request->ctx->negative_anchors;
 
 	if (qry->parent != NULL &&
 	    !(qry->forward_flags.CNAME) &&
@@ -1189,12 +1566,44 @@ static int forward_trust_chain_check(struct kr_request *request, struct kr_query
 	return KR_STATE_PRODUCE;
 }
 
+/**
+ * @internal The validator holds an answer for the DNSKEY asked for ahead of it
+ * (see DNSKEY_AHEAD); push the sub-query unless the key is here.  The servers
+ * are those of the signer's cut, even if the answer was a referral below it.
+ */
+static int dnskey_pending_check(struct kr_request *request, struct kr_query *qry)
+{
+	const struct kr_zonecut *cut = &qry->zone_cut;
+	const knot_rrset_t *ta = cut->trust_anchor;
+	if (!qry->flags.DNSSEC_WANT || !ta
+	    || (cut->key && knot_dname_is_equal(cut->key->owner, ta->owner))) {
+		qry->flags.DNSKEY_PENDING = false;
+		return KR_STATE_PRODUCE;
+	}
+	while (cut->parent && !knot_dname_is_equal(cut->name, ta->owner)) {
+		cut = cut->parent;
+	}
+	struct kr_query *next = kr_rplan_push(&request->rplan, qry, ta->owner,
+					      qry->sclass, KNOT_RRTYPE_DNSKEY);
+	if (!next) {
+		return KR_STATE_FAIL;
+	}
+	kr_zonecut_set(&next->zone_cut, cut->name);
+	if (kr_zonecut_share(&next->zone_cut, cut) != 0 ||
+	    kr_zonecut_copy_trust(&next->zone_cut, &qry->zone_cut) != 0) {
+		return KR_STATE_FAIL;
+	}
+	next->flags.NO_MINIMIZE = true;
+	next->flags.DNSSEC_WANT = true;
+	return KR_STATE_DONE;
+}
+
 /* @todo: Validator refactoring, keep this in driver for now. */
 static int trust_chain_check(struct kr_request *request, struct kr_query *qry)
 {
 	struct kr_rplan *rplan = &request->rplan;
-	map_t *trust_anchors = &request->ctx->trust_anchors;
-	map_t *negative_anchors = &request->ctx->negative_anchors;
+	trie_t *trust_anchors = request->ctx->trust_anchors;
+	trie_t *negative_anchors = request->ctx->negative_anchors;
 
 	/* Disable DNSSEC if it enters NTA. */
 	if (kr_ta_get(negative_anchors, qry->zone_cut.name)){
@@ -1209,6 +1618,9 @@ static int trust_chain_check(struct kr_request *request, struct kr_query *qry)
 		qry->flags.DNSSEC_WANT = false;
 		qry->flags.DNSSEC_INSECURE = true;
 	}
+	if (qry->deferred && qry->flags.DNSKEY_PENDING) {
+		return dnskey_pending_check(request, qry);
+	}
 	/* Enable DNSSEC if entering a new (or different) island of trust,
 	 * and update the TA RRset if required. */
 	bool want_secured = (qry->flags.DNSSEC_WANT) &&
@@ -1243,6 +1655,9 @@ static int trust_chain_check(struct kr_request *request, struct kr_query *qry)
 		}
 		next->flags.AWAIT_CUT = true;
 		next->flags.DNSSEC_WANT = true;
+		/* The DS is asked from the parent's servers, while the DNSKEY
+		 * that follows needs the addresses of the cut's servers. */
+		ns_side_queries(qry, request->ctx, NULL);
 		return KR_STATE_DONE;
 	}
 	/* Try to fetch missing DNSKEY (either missing or above current cut).
@@ -1250,12 +1665,17 @@ static int trust_chain_check(struct kr_request *request, struct kr_query *qry)
 	const bool is_dnskey_subreq = kr_rplan_satisfies(qry, ta_name, KNOT_CLASS_IN, KNOT_RRTYPE_DNSKEY);
 	const bool refetch_key = has_ta && (!qry->zone_cut.key || !knot_dname_is_equal(ta_name, qry->zone_cut.key->owner));
 	if (want_secured && refetch_key && !is_dnskey_subreq) {
+		if (qry->flags.DNSKEY_PENDING) {
+			/* Being resolved by a side request, go on to the cut meanwhile. */
+			return KR_STATE_PRODUCE;
+		}
 		struct kr_query *next = zone_cut_subreq(rplan, qry, ta_name, KNOT_RRTYPE_DNSKEY);
 		if (!next) {
 			return KR_STATE_FAIL;
 		}
 		return KR_STATE_DONE;
 	}
+	qry->flags.DNSKEY_PENDING = false;
 
 	return KR_STATE_PRODUCE;
 }
@@ -1330,6 +1750,34 @@ static int zone_cut_check(struct kr_request *request, struct kr_query *qry, knot
 	return trust_chain_check(request, qry);
 }
 
+/** @internal Check the request against kr_context::budget. */
+static bool budget_exceeded(struct kr_request *request, struct kr_query *qry)
+{
+	const struct kr_budget *budget = &request->ctx->budget;
+	const char *what = NULL;
+	if (budget->upstream && request->upstream_count >= budget->upstream) {
+		what = "upstream queries";
+	} else if (budget->queries && request->rplan.next_uid > budget->queries) {
+		what = "queries";
+	} else if (budget->cpu_ms) {
+		uint64_t cpu_us = 0;
+		for (int i = 0; i < KR_PHASE_COUNT; ++i) {
+			cpu_us += i != KR_PHASE_UPSTREAM ? request->phase_us[i] : 0;
+		}
+		if (cpu_us > (uint64_t)budget->cpu_ms * 1000) {
+			what = "time";
+		}
+	}
+	if (!what) {
+		return false;
+	}
+	VERBOSE_MSG(qry, "=> budget of %s exhausted, bail out\n", what);
+	if (request->ctx->budget_exceeded) {
+		request->ctx->budget_exceeded(request, qry->zone_cut.name);
+	}
+	return true;
+}
+
 int kr_resolve_produce(struct kr_request *request, struct sockaddr **dst, int *type, knot_pkt_t *packet)
 {
 	struct kr_rplan *rplan = &request->rplan;
@@ -1341,6 +1789,9 @@ int kr_resolve_produce(struct kr_request *request, struct sockaddr **dst, int *t
 	}
 	/* If we have deferred answers, resume them. */
 	struct kr_query *qry = array_tail(rplan->pending);
+	if (budget_exceeded(request, qry)) {
+		return KR_STATE_FAIL;
+	}
 	if (qry->deferred != NULL) {
 		/* @todo: Refactoring validator, check trust chain before resuming. */
 		int state = 0;
@@ -1431,6 +1882,8 @@ ns_election:
 	const bool retry = qflg.TCP || qflg.BADCOOKIE_AGAIN;
 	if (qflg.AWAIT_IPV4 || qflg.AWAIT_IPV6) {
 		kr_nsrep_elect_addr(qry, request->ctx);
+	} else if ((qflg.FORWARD || qflg.STUB) && request->fwd_pool) {
+		kr_fwd_pool_order(request, qry);
 	} else if (qflg.FORWARD || qflg.STUB) {
 		kr_nsrep_sort(&qry->ns, request->ctx->cache_rtt);
 	} else if (!qry->ns.name || !retry) { /* Keep NS when requerying/stub/badcookie. */
@@ -1482,7 +1935,16 @@ ns_election:
 	 */
 	qry->timestamp_mono = kr_now();
 	*dst = &qry->ns.addr[0].ip;
+	if (!qry->flags.TCP) {
+		bool tcp = false;
+		(void) kr_nsrep_edns_payload(request->ctx->cache_edns, *dst, 0, &tcp);
+		if (tcp) {
+			VERBOSE_MSG(qry, "=> large or truncated answers over UDP, going with TCP\n");
+			qry->flags.TCP = true;
+		}
+	}
 	*type = (qry->flags.TCP) ? SOCK_STREAM : SOCK_DGRAM;
+	request->upstream_count += 1;
 	return request->state;
 }
 
@@ -1543,6 +2005,7 @@ int kr_resolve_checkout(struct kr_request *request, struct sockaddr *src,
 		return kr_error(ECANCELED);
 	}
 
+	const uint64_t phase_start = kr_now_us();
 #if defined(ENABLE_COOKIES)
 	/* Update DNS cookies in request. */
 	if (type == SOCK_DGRAM) { /* @todo: Add cookies also over TCP? */
@@ -1557,10 +2020,15 @@ int kr_resolve_checkout(struct kr_request *request, struct sockaddr *src,
 	}
 #endif /* defined(ENABLE_COOKIES) */
 
-	int ret = query_finalize(request, qry, packet);
+	int ret = query_finalize(request, qry, packet, dst, type);
+	phase_add(request, KR_PHASE_CHECKOUT, phase_start);
 	if (ret != 0) {
 		return kr_error(EINVAL);
 	}
+	/* Retransmits don't restart the wait. */
+	if (!request->upstream_since) {
+		request->upstream_since = kr_now_us();
+	}
 
 	WITH_VERBOSE(qry) {
 	char qname_str[KNOT_DNAME_MAXLEN], zonecut_str[KNOT_DNAME_MAXLEN], ns_str[INET6_ADDRSTRLEN], type_str[16];
@@ -1582,18 +2050,65 @@ int kr_resolve_checkout(struct kr_request *request, struct sockaddr *src,
 		break;
 	}}
 
+	kr_probe(upstream_send, request, knot_pkt_qname(packet), knot_pkt_qtype(packet),
+		 dst, qry->zone_cut.name);
 	return kr_ok();
 }
 
+/** Whether the recorded trace of the request is to be printed, see kr_context::trace. */
+static bool trace_wanted(const struct kr_request *request)
+{
+	const struct kr_trace_conf *conf = &request->ctx->trace;
+	if (conf->all) {
+		return true;
+	}
+	if (conf->servfail
+	    && knot_wire_get_rcode(request->answer->wire) == KNOT_RCODE_SERVFAIL) {
+		return true;
+	}
+	if (conf->slow_ms) {
+		uint64_t total_us = 0;
+		for (int i = 0; i < KR_PHASE_COUNT; ++i) {
+			total_us += request->phase_us[i];
+		}
+		return total_us >= (uint64_t)conf->slow_ms * 1000;
+	}
+	return false;
+}
+
+static void trace_print_line(const char *line, void *baton)
+{
+	(void)baton;
+	kr_log_info("%s", line);
+}
+
+static void trace_print(struct kr_request *request)
+{
+	const struct kr_trace_ring *ring = request->trace_ring;
+	char qname_str[KNOT_DNAME_MAXLEN] = ".", type_str[16];
+	const knot_dname_t *qname = knot_pkt_qname(request->answer);
+	if (qname) {
+		knot_dname_to_str(qname_str, qname, sizeof(qname_str));
+	}
+	knot_rrtype_to_string(knot_pkt_qtype(request->answer), type_str, sizeof(type_str));
+	kr_log_info("[trace] %s %s, rcode: %d, records: %" PRIu32 ", dropped: %" PRIu32 "\n",
+		    qname_str, type_str, knot_wire_get_rcode(request->answer->wire),
+		    ring->count, ring->dropped);
+	kr_trace_dump(ring, trace_print_line, NULL);
+	request->ctx->trace.printed += 1;
+}
+
 int kr_resolve_finish(struct kr_request *request, int state)
 {
 #ifndef NOVERBOSELOG
 	struct kr_rplan *rplan = &request->rplan;
 #endif
 	/* Finalize answer */
+	const uint64_t phase_start = kr_now_us();
 	if (answer_finalize(request, state) != 0) {
 		state = KR_STATE_FAIL;
 	}
+	phase_add(request, KR_PHASE_FINALIZE, phase_start);
 	/* Error during procesing, internal failure */
 	if (state != KR_STATE_DONE) {
 		knot_pkt_t *answer = request->answer;
@@ -1601,6 +2116,8 @@ int kr_resolve_finish(struct kr_request *request, int state)
 			knot_wire_set_rcode(answer->wire, KNOT_RCODE_SERVFAIL);
 		}
 	}
+	kr_probe(answer_finalize, request, knot_pkt_qname(request->answer),
+		 knot_pkt_qtype(request->answer), knot_wire_get_rcode(request->answer->wire));
 
 	request->state = state;
 	ITERATE_LAYERS(request, NULL, finish);
@@ -1613,10 +2130,14 @@ int kr_resolve_finish(struct kr_request *request, int state)
 	if (request->trace_finish) {
 		request->trace_finish(request);
 	}
+	if (request->trace_ring && trace_wanted(request)) {
+		trace_print(request);
+	}
 
 	/* Uninstall all tracepoints */
 	request->trace_finish = NULL;
 	request->trace_log = NULL;
+	request->trace_ring = NULL;
 
 	return KR_STATE_DONE;
 }
@@ -24,10 +24,15 @@
 #include "lib/cookies/lru_cache.h"
 #include "lib/layer.h"
 #include "lib/generic/map.h"
+#include "lib/generic/trie.h"
 #include "lib/generic/array.h"
 #include "lib/nsrep.h"
+#include "lib/pktindex.h"
 #include "lib/rplan.h"
 #include "lib/module.h"
+#include "lib/trace.h"
+#include "lib/ecs.h"
+#include "lib/forward.h"
 #include "lib/cache/api.h"
 
 /**
@@ -146,6 +151,27 @@ static inline void kr_rank_set(uint8_t *rank, uint8_t kr_flag)
 typedef array_t(struct kr_module *) module_array_t;
 /* @endcond */
 
+/**
+ * Start an independent resolution of the record, for its answer to be cached.
+ * @return 0 or an error code (e.g. if it's being resolved already)
+ */
+typedef int (*kr_side_query_cb)(const knot_dname_t *name, uint16_t type, uint16_t class);
+
+/** Limits of the work on one request, 0 for no limit; see kr_context::budget. */
+struct kr_budget {
+	uint32_t upstream; /**< Queries sent to the upstreams */
+	uint32_t queries;  /**< Queries in the resolution plan, incl. the sub-queries */
+	uint32_t cpu_ms;   /**< Time spent resolving, without waiting for the upstreams */
+	uint32_t signatures; /**< Signature checks when validating one answer; over it the answer is bogus */
+};
+
+struct kr_request;
+/** Called when a request fails over its budget, with the zone cut being resolved. */
+typedef void (*kr_budget_cb)(const struct kr_request *req, const knot_dname_t *zone);
+/** Called when an upstream doesn't answer in time, once per each address tried. */
+typedef void (*kr_upstream_timeout_cb)(const struct kr_request *req,
+				       const struct sockaddr *addr, void *baton);
+
 /**
  * Name resolution context.
  *
@@ -158,13 +184,16 @@ struct kr_context
 {
 	struct kr_qflags options;
 	knot_rrset_t *opt_rr;
-	map_t trust_anchors;
-	map_t negative_anchors;
+	trie_t *trust_anchors;    /**< See lib/dnssec/ta.h */
+	trie_t *negative_anchors;
 	struct kr_zonecut root_hints;
 	struct kr_cache cache;
 	kr_nsrep_rtt_lru_t *cache_rtt;
 	unsigned cache_rtt_tout_retry_interval;
 	kr_nsrep_lru_t *cache_rep;
+	kr_nsrep_lame_lru_t *cache_lame; /**< See kr_nsrep_update_lame() */
+	kr_nsrep_edns_lru_t *cache_edns; /**< See kr_nsrep_edns_payload() */
+	kr_cut_depth_lru_t *cache_depth; /**< See kr_zonecut_get_depth() */
 	module_array_t *modules;
 	/* The cookie context structure should not be held within the cookies
 	 * module because of better access. */
@@ -172,6 +201,38 @@ struct kr_context
 	kr_cookie_lru_t *cache_cookie;
 	int32_t tls_padding; /**< See net.tls_padding in ../daemon/README.rst -- -1 is "true" (default policy), 0 is "false" (no padding) */
 	knot_mm_t *pool;
+	/** Looks up the other nameserver addresses while one is awaited, may be NULL. */
+	kr_side_query_cb side_query;
+	/** Requests over it get SERVFAIL; see worker.budget in ../daemon/README.rst */
+	struct kr_budget budget;
+	kr_budget_cb budget_exceeded; /**< May be NULL */
+	/** The layers don't see the timeouts, so they are reported here; may be NULL. */
+	kr_upstream_timeout_cb upstream_timeout;
+	void *upstream_timeout_baton;
+	/** The slowest call of a layer since the daemon's profiler reset it, see worker.profile() */
+	struct {
+		const struct kr_module *module;
+		uint32_t us;
+		bool on; /**< Time each layer call, else only the phases; set by the profiler */
+	} slow_layer;
+	/** Which requests record their trace and which of them print it; see worker.trace() */
+	struct kr_trace_conf trace;
+	/** The zones to send the client subnet to; see net.ecs() in ../daemon/README.rst */
+	struct kr_ecs_conf ecs;
+};
+
+/**
+ * Phases of request processing, see kr_request::phase_us.
+ */
+enum kr_phase {
+	KR_PHASE_CACHE = 0, /**< cache layer (peek and stash) */
+	KR_PHASE_PRODUCE,   /**< other layers producing the next query */
+	KR_PHASE_CONSUME,   /**< other layers processing an answer */
+	KR_PHASE_CHECKOUT,  /**< finalizing outbound queries */
+	KR_PHASE_UPSTREAM,  /**< waiting for upstream answers */
+	KR_PHASE_VALIDATE,  /**< validator layer */
+	KR_PHASE_FINALIZE,  /**< finalizing the answer, finish layers */
+	KR_PHASE_COUNT
 };
 
 /**
@@ -216,6 +277,23 @@ struct kr_request {
 	trace_log_f trace_log; /**< Logging tracepoint */
 	trace_callback_f trace_finish; /**< Request finish tracepoint */
 	knot_mm_t pool;
+	/** Cache namespace of the forwarded queries, 0 for the shared one; see policy.CACHE_NS */
+	uint8_t cache_ns;
+	uint32_t phase_us[KR_PHASE_COUNT]; /**< Time spent in each phase, in microseconds. */
+	uint64_t upstream_since; /**< kr_now_us() when waiting for upstream began, or 0. */
+	bool answer_dropped; /**< Don't send the answer at all, e.g. to a rate-limited client. */
+	/** kr_now() when to try answering from stale data (see kr_stale_cb), or 0;
+	 * the daemon interrupts waiting for upstream then. */
+	uint64_t stale_deadline;
+	uint32_t upstream_count; /**< Queries sent to the upstreams, see kr_context::budget */
+	/** The verbose messages are recorded here instead of logged, or NULL; see kr_context::trace */
+	struct kr_trace_ring *trace_ring;
+	/** Orders the forwarders of the queries, or NULL; see lib/forward.h */
+	struct kr_fwd_pool *fwd_pool;
+	uint16_t fwd_probe; /**< 1 + the only forwarder of fwd_pool asked, or 0 */
+	/** Index of the answer being consumed, or NULL; see lib/pktindex.h */
+	struct kr_pkt_index *pkt_index;
+	uint8_t guard_slot; /**< 1 + the zone slot held in modules/zone_guard, or 0 */
 };
 
 /** Initializer for an array of *_selected. */
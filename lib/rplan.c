@@ -102,6 +102,19 @@ static struct kr_query *query_create(knot_mm_t *pool, const knot_dname_t *name,
 	return qry;
 }
 
+const struct kr_lf_name *kr_query_sname_lf(struct kr_query *qry)
+{
+	if (!qry || !qry->sname) {
+		return NULL;
+	}
+	struct kr_lf_name *lf = &qry->sname_lf;
+	if (lf->name != qry->sname && kr_lf_name_init(lf, qry->sname) != 0) {
+		lf->name = NULL;
+		return NULL;
+	}
+	return lf;
+}
+
 static void query_free(knot_mm_t *pool, struct kr_query *qry)
 {
 	kr_zonecut_deinit(&qry->zone_cut);
@@ -119,8 +132,8 @@ int kr_rplan_init(struct kr_rplan *rplan, struct kr_request *request, knot_mm_t
 
 	rplan->pool = pool;
 	rplan->request = request;
-	array_init(rplan->pending);
-	array_init(rplan->resolved);
+	array_small_init(rplan->pending);
+	array_small_init(rplan->resolved);
 	rplan->next_uid = 0;
 	return KNOT_EOK;
 }
@@ -137,8 +150,8 @@ void kr_rplan_deinit(struct kr_rplan *rplan)
 	for (size_t i = 0; i < rplan->resolved.len; ++i) {
 		query_free(rplan->pool, rplan->resolved.at[i]);
 	}
-	array_clear_mm(rplan->pending, mm_free, rplan->pool);
-	array_clear_mm(rplan->resolved, mm_free, rplan->pool);
+	array_small_clear_mm(rplan->pending, mm_free, rplan->pool);
+	array_small_clear_mm(rplan->resolved, mm_free, rplan->pool);
 }
 
 bool kr_rplan_empty(struct kr_rplan *rplan)
@@ -159,7 +172,7 @@ static struct kr_query *kr_rplan_push_query(struct kr_rplan *rplan,
 	}
 
 	/* Make sure there's enough space */
-	int ret = array_reserve_mm(rplan->pending, rplan->pending.len + 1, kr_memreserve, rplan->pool);
+	int ret = array_small_reserve_mm(rplan->pending, rplan->pending.len + 1, kr_memreserve, rplan->pool);
 	if (ret != 0) {
 		return NULL;
 	}
@@ -175,7 +188,7 @@ static struct kr_query *kr_rplan_push_query(struct kr_rplan *rplan,
 	qry->request = rplan->request;
 	qry->ns.ctx = rplan->request->ctx;
 	qry->ns.addr[0].ip.sa_family = AF_UNSPEC;
-	gettimeofday(&qry->timestamp, NULL);
+	kr_now_wall(&qry->timestamp);
 	qry->timestamp_mono = kr_now();
 	qry->creation_time_mono = parent ? parent->creation_time_mono : qry->timestamp_mono;
 	kr_zonecut_init(&qry->zone_cut, (const uint8_t *)"", rplan->pool);
@@ -192,7 +205,7 @@ static struct kr_query *kr_rplan_push_query(struct kr_rplan *rplan,
 		}
 	}
 
-	array_push(rplan->pending, qry);
+	array_small_push_mm(rplan->pending, qry, kr_memreserve, rplan->pool);
 
 	return qry;
 }
@@ -245,7 +258,7 @@ int kr_rplan_pop(struct kr_rplan *rplan, struct kr_query *qry)
 	}
 
 	/* Make sure there's enough space */
-	int ret = array_reserve_mm(rplan->resolved, rplan->resolved.len + 1, kr_memreserve, rplan->pool);
+	int ret = array_small_reserve_mm(rplan->resolved, rplan->resolved.len + 1, kr_memreserve, rplan->pool);
 	if (ret != 0) {
 		return ret;
 	}
@@ -254,7 +267,7 @@ int kr_rplan_pop(struct kr_rplan *rplan, struct kr_query *qry)
 	for (size_t i = rplan->pending.len; i > 0; i--) {
 		if (rplan->pending.at[i - 1] == qry) {
 			array_del(rplan->pending, i - 1);
-			array_push(rplan->resolved, qry);
+			array_small_push_mm(rplan->resolved, qry, kr_memreserve, rplan->pool);
 			break;
 		}
 	}
@@ -23,6 +23,7 @@
 #include "lib/cache/api.h"
 #include "lib/zonecut.h"
 #include "lib/nsrep.h"
+#include "lib/utils.h"
 
 /** Query flags */
 struct kr_qflags {
@@ -63,6 +64,11 @@ struct kr_qflags {
 	bool DNS64_MARK : 1;     /**< Internal mark for dns64 module. */
 	bool CACHE_TRIED : 1;    /**< Internal to cache module. */
 	bool NO_NS_FOUND : 1;    /**< No valid NS found during last PRODUCE stage. */
+	bool NO_SHED : 1;        /**< Not shed by the daemon under overload, see worker.overload(). */
+	bool MINIMAL_RESPONSES : 1; /**< Answer without the records that aren't needed, e.g. NS and glue. */
+	bool CNAME_CHAIN : 1;    /**< Internal to cache module: answered by a cached CNAME chain. */
+	bool DNSKEY_AHEAD : 1;   /**< On a signed referral ask for the DNSKEY by a side request. */
+	bool DNSKEY_PENDING : 1; /**< Internal to validator: the DNSKEY of the cut is asked for ahead. */
 };
 
 /** Combine flags together.  This means set union for simple flags. */
@@ -106,12 +112,22 @@ struct kr_query {
 	struct kr_query *cname_parent;
 	struct kr_request *request; /**< Parent resolution request. */
 	kr_stale_cb stale_cb; /**< See the type */
+	/** Lookup format of sname, for cache keys and suffix matching;
+	 * use kr_query_sname_lf() which computes it on the first use. */
+	struct kr_lf_name sname_lf;
 	/* Beware: this must remain the last, because of lua bindings. */
 	struct kr_nsrep ns;
 };
 
+/**
+ * Return the lookup format of qry->sname, computed once per query and reused.
+ * @return NULL for an invalid sname
+ */
+KR_EXPORT
+const struct kr_lf_name *kr_query_sname_lf(struct kr_query *qry);
+
 /** @cond internal Array of queries. */
-typedef array_t(struct kr_query *) kr_qarray_t;
+typedef array_small_t(struct kr_query *, 4) kr_qarray_t;
 /* @endcond */
 
 /**
@@ -0,0 +1,394 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "contrib/ucw/lib.h"
+#include "lib/rplan.h"
+#include "lib/trace.h"
+#include "lib/utils.h"
+
+/** Longest record, the strings in the arguments are cut to fit. */
+#define TRACE_REC_MAX 1024
+/** Longest formatted record. */
+#define TRACE_LINE_MAX 4096
+
+/** A record, followed by the arguments; `len` 0 marks the wrap to the start. */
+struct trace_rec {
+	uint16_t len;      /**< Bytes of the record with the arguments, a multiple of 8 */
+	uint16_t id;       /**< Of the query */
+	uint16_t indent;   /**< Depth of the query, as in QRVERBOSE() */
+	const char *source;
+	const char *fmt;
+};
+
+/** Type of the argument of a conversion, as it's stored. */
+enum arg_type {
+	ARG_NONE = 0,  /**< %% or %n */
+	ARG_INT,       /**< int64_t */
+	ARG_UINT,      /**< uint64_t */
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,       /**< uint16_t length and the bytes without the terminator */
+};
+
+/** A conversion of the format string. */
+struct conv {
+	const char *start;  /**< At the '%' */
+	const char *length_at; /**< At the length modifier, after the flags, width and precision */
+	const char *end;    /**< After the conversion character */
+	int stars;          /**< Width and precision given by int arguments */
+	enum arg_type type;
+	char length;        /**< 'H' for hh, 'q' for ll, or one of "hljztL", 0 if none */
+	char conv;          /**< The conversion character */
+};
+
+/** Parse the conversion at `p` (after the '%'). */
+static const char *conv_parse(const char *p, struct conv *c)
+{
+	c->stars = 0;
+	c->length = 0;
+	while (*p && strchr("-+ #0'", *p)) {
+		++p;
+	}
+	if (*p == '*') {
+		++c->stars;
+		++p;
+	}
+	while (*p >= '0' && *p <= '9') {
+		++p;
+	}
+	if (*p == '.') {
+		++p;
+		if (*p == '*') {
+			++c->stars;
+			++p;
+		}
+		while (*p >= '0' && *p <= '9') {
+			++p;
+		}
+	}
+	c->length_at = p;
+	if (*p == 'h') {
+		c->length = (p[1] == 'h') ? 'H' : 'h';
+		p += (p[1] == 'h') ? 2 : 1;
+	} else if (*p == 'l') {
+		c->length = (p[1] == 'l') ? 'q' : 'l';
+		p += (p[1] == 'l') ? 2 : 1;
+	} else if (*p && strchr("jztL", *p)) {
+		c->length = *p++;
+	}
+	c->conv = *p;
+	switch (*p) {
+	case 'd': case 'i':
+		c->type = ARG_INT;
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		c->type = ARG_UINT;
+		break;
+	case 'c':
+		c->type = ARG_INT;
+		c->length = 0;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		c->type = ARG_DOUBLE;
+		break;
+	case 'p':
+		c->type = ARG_PTR;
+		break;
+	case 's':
+		c->type = ARG_STR;
+		break;
+	default: /* %%, %n and the unknown ones */
+		c->type = ARG_NONE;
+		break;
+	}
+	return *p ? p + 1 : p;
+}
+
+/** Find the next conversion of the format, @return false at its end. */
+static bool conv_next(const char **fmt, struct conv *c)
+{
+	const char *p = strchr(*fmt, '%');
+	if (!p) {
+		return false;
+	}
+	c->start = p;
+	c->end = conv_parse(p + 1, c);
+	*fmt = c->end;
+	return true;
+}
+
+static int64_t arg_int(va_list *args, char length)
+{
+	switch (length) {
+	case 'l': return va_arg(*args, long);
+	case 'q': return va_arg(*args, long long);
+	case 'j': return va_arg(*args, intmax_t);
+	case 'z': return va_arg(*args, ssize_t);
+	case 't': return va_arg(*args, ptrdiff_t);
+	case 'h': return (short)va_arg(*args, int);
+	case 'H': return (signed char)va_arg(*args, int);
+	default:  return va_arg(*args, int);
+	}
+}
+
+static uint64_t arg_uint(va_list *args, char length)
+{
+	switch (length) {
+	case 'l': return va_arg(*args, unsigned long);
+	case 'q': return va_arg(*args, unsigned long long);
+	case 'j': return va_arg(*args, uintmax_t);
+	case 'z': return va_arg(*args, size_t);
+	case 't': return va_arg(*args, ptrdiff_t);
+	case 'h': return (unsigned short)va_arg(*args, unsigned);
+	case 'H': return (unsigned char)va_arg(*args, unsigned);
+	default:  return va_arg(*args, unsigned);
+	}
+}
+
+struct kr_trace_ring *kr_trace_ring_new(knot_mm_t *pool, uint32_t size)
+{
+	size &= ~7u;
+	if (size < TRACE_REC_MAX) {
+		return NULL;
+	}
+	struct kr_trace_ring *ring = mm_alloc(pool, sizeof(*ring) + size);
+	if (ring) {
+		memset(ring, 0, sizeof(*ring));
+		ring->size = size;
+	}
+	return ring;
+}
+
+/** Remove the oldest record, or skip the wrap. */
+static void ring_evict(struct kr_trace_ring *ring)
+{
+	const struct trace_rec *rec = (const struct trace_rec *)(ring->buf + ring->tail);
+	if (ring->size - ring->tail < sizeof(rec->len) || rec->len == 0) {
+		ring->tail = 0;
+		return;
+	}
+	ring->tail += rec->len;
+	ring->count -= 1;
+	ring->dropped += 1;
+}
+
+/** Make `len` contiguous bytes free at the head, @return their offset. */
+static uint32_t ring_reserve(struct kr_trace_ring *ring, uint32_t len)
+{
+	for (;;) {
+		if (ring->count == 0) {
+			ring->head = ring->tail = 0;
+			break;
+		}
+		if (ring->head > ring->tail) { /* free at the end and before the tail */
+			if (ring->size - ring->head >= len) {
+				break;
+			}
+			if (ring->size - ring->head >= sizeof(uint16_t)) {
+				memset(ring->buf + ring->head, 0, sizeof(uint16_t));
+			}
+			ring->head = 0;
+		} else if (ring->tail - ring->head >= len) {
+			break;
+		} else {
+			ring_evict(ring);
+		}
+	}
+	const uint32_t at = ring->head;
+	ring->head += len;
+	ring->count += 1;
+	return at;
+}
+
+void kr_trace_vrecord(struct kr_trace_ring *ring, const struct kr_query *qry,
+		      const char *source, const char *fmt, va_list args)
+{
+	uint8_t buf[TRACE_REC_MAX] __attribute__((aligned(8)));
+	struct trace_rec *rec = (struct trace_rec *)buf;
+	rec->id = qry ? qry->id : 0;
+	rec->indent = 0;
+	for (const struct kr_query *q = qry; q; q = q->parent) {
+		rec->indent += 2;
+	}
+	rec->source = source;
+	rec->fmt = fmt;
+	size_t len = sizeof(*rec);
+
+	va_list ap;
+	va_copy(ap, args);
+	struct conv c;
+	for (const char *p = fmt; conv_next(&p, &c); ) {
+		/* The room for the stars, the argument and the length of a string. */
+		if (len + (c.stars + 1) * sizeof(uint64_t) > sizeof(buf)) {
+			ring->dropped += 1;
+			va_end(ap);
+			return;
+		}
+		for (int i = 0; i < c.stars; ++i) {
+			const int64_t star = va_arg(ap, int);
+			memcpy(buf + len, &star, sizeof(star));
+			len += sizeof(star);
+		}
+		union { int64_t i; uint64_t u; double d; const void *p; } val;
+		switch (c.type) {
+		case ARG_INT:
+			val.i = arg_int(&ap, c.length);
+			break;
+		case ARG_UINT:
+			val.u = arg_uint(&ap, c.length);
+			break;
+		case ARG_DOUBLE:
+			val.d = (c.length == 'L') ? (double)va_arg(ap, long double) : va_arg(ap, double);
+			break;
+		case ARG_PTR:
+			val.p = va_arg(ap, void *);
+			break;
+		case ARG_STR: {
+			const char *str = va_arg(ap, const char *);
+			if (!str) {
+				str = "(null)";
+			}
+			const uint16_t slen = MIN(strlen(str), sizeof(buf) - len - sizeof(slen));
+			memcpy(buf + len, &slen, sizeof(slen));
+			memcpy(buf + len + sizeof(slen), str, slen);
+			len += sizeof(slen) + slen;
+			continue;
+		}
+		default:
+			if (c.conv == 'n') {
+				(void)va_arg(ap, void *);
+			}
+			continue;
+		}
+		memcpy(buf + len, &val, sizeof(val));
+		len += sizeof(val);
+	}
+	va_end(ap);
+
+	len = (len + 7) & ~(size_t)7;
+	rec->len = len;
+	const uint32_t at = ring_reserve(ring, len);
+	memcpy(ring->buf + at, buf, len);
+}
+
+/** Format one conversion with its stored arguments. */
+static int conv_format(char *out, size_t size, const struct conv *c,
+		       const uint8_t **arg, const uint8_t *end)
+{
+	/* The conversion with the length of the stored type. */
+	char spec[64];
+	const size_t prefix = c->length_at - c->start;
+	if (prefix + 4 > sizeof(spec) || !c->conv) {
+		return 0;
+	}
+	memcpy(spec, c->start, prefix);
+	const bool integer = (c->type == ARG_INT || c->type == ARG_UINT) && c->conv != 'c';
+	snprintf(spec + prefix, sizeof(spec) - prefix, "%s%c", integer ? "ll" : "", c->conv);
+
+	int stars[2] = { 0, 0 };
+	for (int i = 0; i < c->stars; ++i) {
+		if (*arg + sizeof(int64_t) > end) {
+			return 0;
+		}
+		int64_t star;
+		memcpy(&star, *arg, sizeof(star));
+		stars[i] = star;
+		*arg += sizeof(star);
+	}
+
+	#define FORMAT(val) ( \
+		c->stars == 0 ? snprintf(out, size, spec, (val)) : \
+		c->stars == 1 ? snprintf(out, size, spec, stars[0], (val)) : \
+		snprintf(out, size, spec, stars[0], stars[1], (val)))
+
+	union { int64_t i; uint64_t u; double d; const void *p; } val;
+	if (c->type == ARG_NONE) {
+		return c->conv == '%' ? snprintf(out, size, "%%") : 0;
+	}
+	if (c->type == ARG_STR) {
+		uint16_t slen;
+		if (*arg + sizeof(slen) > end) {
+			return 0;
+		}
+		memcpy(&slen, *arg, sizeof(slen));
+		char str[TRACE_REC_MAX];
+		slen = MIN(slen, end - *arg - sizeof(slen));
+		memcpy(str, *arg + sizeof(slen), slen);
+		str[slen] = '\0';
+		*arg += sizeof(slen) + slen;
+		return FORMAT(str);
+	}
+	if (*arg + sizeof(val) > end) {
+		return 0;
+	}
+	memcpy(&val, *arg, sizeof(val));
+	*arg += sizeof(val);
+	switch (c->type) {
+	case ARG_INT:
+		return integer ? FORMAT((long long)val.i) : FORMAT((int)val.i);
+	case ARG_UINT:
+		return FORMAT((unsigned long long)val.u);
+	case ARG_DOUBLE:
+		return FORMAT(val.d);
+	default:
+		return FORMAT(val.p);
+	}
+	#undef FORMAT
+}
+
+/** Format the record as QRVERBOSE() does. */
+static void rec_format(const struct trace_rec *rec, char *out, size_t size)
+{
+	const uint8_t *arg = (const uint8_t *)rec + sizeof(*rec);
+	const uint8_t *end = (const uint8_t *)rec + rec->len;
+	size_t len = 0;
+	int ret;
+	#define APPEND(expr) ret = (expr); len = MIN(len + MAX(0, ret), size - 1)
+	APPEND(snprintf(out, size, "[%5hu][%s] %*s", rec->id, rec->source, rec->indent, ""));
+	const char *lit = rec->fmt;
+	struct conv c;
+	for (const char *p = rec->fmt; conv_next(&p, &c); lit = c.end) {
+		APPEND(snprintf(out + len, size - len, "%.*s", (int)(c.start - lit), lit));
+		APPEND(conv_format(out + len, size - len, &c, &arg, end));
+	}
+	APPEND(snprintf(out + len, size - len, "%s", lit));
+	#undef APPEND
+}
+
+int kr_trace_dump(const struct kr_trace_ring *ring, kr_trace_line_cb cb, void *baton)
+{
+	if (!ring) {
+		return 0;
+	}
+	char line[TRACE_LINE_MAX];
+	uint32_t at = ring->tail;
+	for (uint32_t i = 0; i < ring->count; ) {
+		const struct trace_rec *rec = (const struct trace_rec *)(ring->buf + at);
+		if (ring->size - at < sizeof(rec->len) || rec->len == 0) {
+			at = 0;
+			continue;
+		}
+		rec_format(rec, line, sizeof(line));
+		cb(line, baton);
+		at += rec->len;
+		++i;
+	}
+	return ring->count;
+}
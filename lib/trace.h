@@ -0,0 +1,100 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file trace.h
+ * @brief Binary trace of a request, formatted only when it's printed.
+ *
+ * The verbose messages of a request with a ring (kr_request::trace_ring)
+ * are recorded as the format string and the binary arguments copied from
+ * the va_list, without printf() and I/O; the oldest records are overwritten
+ * when the ring is full.  The records are formatted by kr_trace_dump(),
+ * e.g. when the request is answered with SERVFAIL (see kr_context::trace),
+ * so the tracing of sampled requests can stay on in production.
+ *
+ * The format strings must be string literals (or live as long as the ring),
+ * like those of the VERBOSE_MSG() macros; `%n` isn't supported.
+ *
+ * # Example usage:
+ *
+ * @code{.c}
+ * 	req->trace_ring = kr_trace_ring_new(&req->pool, 16384);
+ * 	...
+ * 	VERBOSE_MSG(qry, "=> answer: %s\n", name_str); // recorded, not printed
+ * 	...
+ * 	kr_trace_dump(req->trace_ring, print_line, NULL);
+ * @endcode
+ */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libknot/mm_ctx.h>
+
+#include "lib/defines.h"
+
+struct kr_query;
+
+/** Default bytes of the ring of a request. */
+#define KR_TRACE_SIZE (16 * 1024)
+
+/** Ring buffer of the trace records of one request. */
+struct kr_trace_ring {
+	uint32_t size;     /**< Bytes of `buf` */
+	uint32_t head;     /**< Offset of the next record */
+	uint32_t tail;     /**< Offset of the oldest record */
+	uint32_t count;    /**< Number of the records in the ring */
+	uint32_t dropped;  /**< Number of the records overwritten or too long */
+	uint8_t buf[] __attribute__((aligned(8))); /**< The records are aligned */
+};
+
+/** When to record the trace of requests and print it, see kr_context::trace. */
+struct kr_trace_conf {
+	uint32_t sample;   /**< Record each sample-th request, 0 for none */
+	uint32_t size;     /**< Bytes of the ring of a request */
+	bool servfail;     /**< Print the traces of the requests answered with SERVFAIL */
+	uint32_t slow_ms;  /**< Print those taking at least this many ms, 0 for none */
+	bool all;          /**< Print all the recorded traces */
+	uint32_t counter;  /**< Requests since the last one recorded */
+	uint64_t recorded; /**< Number of the requests recorded */
+	uint64_t printed;  /**< Number of them printed */
+};
+
+/** Called with each formatted record by kr_trace_dump(). */
+typedef void (*kr_trace_line_cb)(const char *line, void *baton);
+
+/**
+ * Create an empty ring.
+ * @param pool to allocate from, e.g. the request's; NULL for malloc()
+ * @param size bytes of the ring, rounded down to a multiple of 8
+ * @return the ring or NULL
+ */
+KR_EXPORT
+struct kr_trace_ring *kr_trace_ring_new(knot_mm_t *pool, uint32_t size);
+
+/** Record a message, see kr_log_trace(); the query may be NULL. */
+KR_EXPORT
+void kr_trace_vrecord(struct kr_trace_ring *ring, const struct kr_query *qry,
+		      const char *source, const char *fmt, va_list args);
+
+/**
+ * Format the records from the oldest one, each as the verbose log would print it.
+ * @return the number of the records
+ */
+KR_EXPORT
+int kr_trace_dump(const struct kr_trace_ring *ring, kr_trace_line_cb cb, void *baton);
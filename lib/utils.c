@@ -14,11 +14,13 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <contrib/cleanup.h>
 #include <contrib/ccan/asprintf/asprintf.h>
@@ -35,6 +37,8 @@
 #include "lib/defines.h"
 #include "lib/utils.h"
 #include "lib/generic/array.h"
+#include "lib/generic/hash.h"
+#include "lib/generic/lru.h"
 #include "lib/nsrep.h"
 #include "lib/module.h"
 #include "lib/resolve.h"
@@ -60,6 +64,100 @@ void *mm_malloc(void *ctx, size_t n)
 	return malloc(n);
 }
 
+bool kr_hugepages = false;
+
+/** Room before the memory from kr_huge_alloc() for the length of the mapping;
+ * a cache line, so that the alignment of the mapping is kept for CACHE_ALIGNED data. */
+#define HUGE_HEADER 64
+
+void *kr_huge_alloc(size_t size)
+{
+	const size_t len = (size + HUGE_HEADER + KR_HUGEPAGE_SIZE - 1) & ~(KR_HUGEPAGE_SIZE - 1);
+	void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		/* Only a hint, e.g. THP may be disabled. */
+		(void) madvise(mem, len, MADV_HUGEPAGE);
+#endif
+	}
+	*(size_t *)mem = len;
+	return (uint8_t *)mem + HUGE_HEADER;
+}
+
+void kr_huge_free(void *mem)
+{
+	if (!mem) {
+		return;
+	}
+	uint8_t *map = (uint8_t *)mem - HUGE_HEADER;
+	munmap(map, *(size_t *)map);
+}
+
+static void *mm_huge_alloc(void *ctx, size_t n)
+{
+	(void)ctx;
+	return kr_huge_alloc(n);
+}
+
+knot_mm_t kr_mm_huge = {
+	.ctx = NULL,
+	.alloc = mm_huge_alloc,
+	.free = kr_huge_free,
+};
+
+size_t kr_mem_usage[KR_MEM_TAG_COUNT];
+const char *kr_mem_tag_names[KR_MEM_TAG_COUNT] = {
+	[KR_MEM_NSREP] = "nsrep",
+	[KR_MEM_COOKIES] = "cookies",
+	[KR_MEM_SUBREQ] = "subreq",
+	[KR_MEM_HINTS] = "hints",
+};
+
+/** Header of the kr_mm_tagged() allocations: the tag and the size, aligned as malloc(). */
+#define TAGGED_HEADER 16
+
+static void *mm_tagged_alloc(void *ctx, size_t n)
+{
+	const uintptr_t tag = (uintptr_t)ctx;
+	size_t *mem = malloc(TAGGED_HEADER + n);
+	if (!mem) {
+		return NULL;
+	}
+	mem[0] = tag;
+	mem[1] = n;
+	kr_mem_usage[tag] += n;
+	return (uint8_t *)mem + TAGGED_HEADER;
+}
+
+static void mm_tagged_free(void *p)
+{
+	if (!p) {
+		return;
+	}
+	size_t *mem = (size_t *)((uint8_t *)p - TAGGED_HEADER);
+	kr_mem_usage[mem[0]] -= mem[1];
+	free(mem);
+}
+
+knot_mm_t *kr_mm_tagged(enum kr_mem_tag tag)
+{
+	static knot_mm_t contexts[KR_MEM_TAG_COUNT];
+	assert(tag < KR_MEM_TAG_COUNT);
+	knot_mm_t *mm = &contexts[tag];
+	mm->ctx = (void *)(uintptr_t)tag;
+	mm->alloc = mm_tagged_alloc;
+	mm->free = mm_tagged_free;
+	return mm;
+}
+
 /*
  * Macros.
  */
@@ -121,9 +219,17 @@ bool kr_log_trace(const struct kr_query *query, const char *source, const char *
 		return false;
 	}
 
+	va_list args;
+	/* The log handler of the request wins, e.g. for http_trace. */
+	if (!query->request->trace_log) {
+		va_start(args, fmt);
+		kr_trace_vrecord(query->request->trace_ring, query, source, fmt, args);
+		va_end(args);
+		return true;
+	}
+
 	auto_free char *msg = NULL;
 
-	va_list args;
 	va_start(args, fmt);
 	int len = vasprintf(&msg, fmt, args);
 	va_end(args);
@@ -377,6 +483,42 @@ uint16_t kr_inaddr_port(const struct sockaddr *addr)
 	}
 }
 
+int kr_sockaddr_key(char *dst, const struct sockaddr *addr)
+{
+	/* { [1] family, [2] port in network order, [4 or 16] address } */
+	const int addr_len = kr_inaddr_len(addr);
+	if (!dst || addr_len < 0) {
+		return kr_error(EINVAL);
+	}
+	const uint16_t port = kr_inaddr_port(addr);
+	dst[0] = addr->sa_family;
+	dst[1] = port >> 8;
+	dst[2] = port & 0xff;
+	memcpy(dst + 3, kr_inaddr(addr), addr_len);
+	return 3 + addr_len;
+}
+
+int kr_sockaddr_from_key(struct sockaddr_storage *dst, const char *key, size_t len)
+{
+	if (!dst || !key || len < 3) {
+		return kr_error(EINVAL);
+	}
+	memset(dst, 0, sizeof(*dst));
+	dst->ss_family = (uint8_t)key[0];
+	const int addr_len = kr_inaddr_len((struct sockaddr *)dst);
+	if (addr_len < 0 || len != 3 + addr_len) {
+		return kr_error(EINVAL);
+	}
+	const uint16_t port = htons(((uint8_t)key[1] << 8) | (uint8_t)key[2]);
+	if (dst->ss_family == AF_INET) {
+		((struct sockaddr_in *)dst)->sin_port = port;
+	} else {
+		((struct sockaddr_in6 *)dst)->sin6_port = port;
+	}
+	memcpy((char *)kr_inaddr((struct sockaddr *)dst), key + 3, addr_len);
+	return kr_ok();
+}
+
 int kr_inaddr_str(const struct sockaddr *addr, char *buf, size_t *buflen)
 {
 	int ret = kr_ok();
@@ -633,6 +775,142 @@ static inline bool rrsets_match(const knot_rrset_t *rr1, const knot_rrset_t *rr2
 	return match;
 }
 
+/** Ranked arrays up to this long are scanned, the longer ones get an index. */
+#define RANKED_INDEX_MIN 16
+
+struct ranked_slot {
+	ranked_rr_array_entry_t *entry; /**< NULL for an empty slot */
+	uint32_t hash;
+	uint32_t seq;  /**< Order of addition to the array */
+};
+
+/** @internal Open-addressed hash index of the RRsets in a ranked_rr_array_t.
+ * The entries are never removed, so there are no tombstones. */
+struct kr_ranked_index {
+	uint64_t seed;     /**< Random, the owners are chosen by the servers */
+	uint32_t mask;     /**< Slot count - 1, a power of two */
+	uint32_t used;
+	uint32_t seq;      /**< Entries added so far */
+	uint32_t run_seq;  /**< seq of the first entry of the trailing run of run_uid */
+	uint32_t run_uid;
+	struct ranked_slot slots[];
+};
+
+/** Hash what rrsets_match() compares; the owner case-insensitively. */
+static uint32_t ranked_hash(const struct kr_ranked_index *idx, const knot_rrset_t *rr)
+{
+	uint8_t key[KNOT_DNAME_MAXLEN + 3 * sizeof(uint16_t)];
+	int len = knot_dname_to_wire(key, rr->owner, KNOT_DNAME_MAXLEN);
+	if (len < 0) {
+		len = 0;
+	}
+	knot_dname_to_lower(key);
+	const uint16_t covered = rr->type == KNOT_RRTYPE_RRSIG
+				 ? knot_rrsig_type_covered(&rr->rrs, 0) : 0;
+	memcpy(key + len, &rr->type, sizeof(uint16_t));
+	memcpy(key + len + sizeof(uint16_t), &rr->rclass, sizeof(uint16_t));
+	memcpy(key + len + 2 * sizeof(uint16_t), &covered, sizeof(uint16_t));
+	const uint64_t h = kr_hash_short(key, len + 3 * sizeof(uint16_t), idx->seed);
+	return h ^ (h >> 32);
+}
+
+static struct kr_ranked_index *ranked_index_new(uint32_t size, knot_mm_t *pool)
+{
+	struct kr_ranked_index *idx = mm_alloc(pool, sizeof(*idx) + size * sizeof(idx->slots[0]));
+	if (idx) {
+		memset(idx, 0, sizeof(*idx) + size * sizeof(idx->slots[0]));
+		idx->mask = size - 1;
+	}
+	return idx;
+}
+
+static void ranked_index_insert(struct kr_ranked_index *idx, const struct ranked_slot *slot)
+{
+	uint32_t i = slot->hash & idx->mask;
+	while (idx->slots[i].entry) {
+		i = (i + 1) & idx->mask;
+	}
+	idx->slots[i] = *slot;
+	idx->used += 1;
+}
+
+/** Add an entry to the index of the array, creating or growing it as needed. */
+static int ranked_index_add(ranked_rr_array_t *array, ranked_rr_array_entry_t *entry,
+			    knot_mm_t *pool)
+{
+	struct kr_ranked_index *idx = array->index;
+	if (!idx || 2 * (idx->used + 1) > idx->mask + 1) {
+		uint32_t size = idx ? 2 * (idx->mask + 1) : 4 * RANKED_INDEX_MIN;
+		struct kr_ranked_index *grown = ranked_index_new(size, pool);
+		if (!grown) {
+			return kr_error(ENOMEM);
+		}
+		if (idx) {
+			grown->seed = idx->seed;
+			grown->seq = idx->seq;
+			grown->run_seq = idx->run_seq;
+			grown->run_uid = idx->run_uid;
+			for (uint32_t i = 0; i <= idx->mask; ++i) {
+				if (idx->slots[i].entry) {
+					ranked_index_insert(grown, &idx->slots[i]);
+				}
+			}
+			mm_free(pool, idx);
+		} else {
+			grown->seed = ((uint64_t)kr_rand_uint(0) << 32) | kr_rand_uint(0);
+		}
+		array->index = idx = grown;
+	}
+	if (idx->seq == 0 || entry->qry_uid != idx->run_uid) {
+		idx->run_seq = idx->seq;
+		idx->run_uid = entry->qry_uid;
+	}
+	const struct ranked_slot slot = {
+		.entry = entry,
+		.hash = ranked_hash(idx, entry->rr),
+		.seq = idx->seq++,
+	};
+	ranked_index_insert(idx, &slot);
+	return kr_ok();
+}
+
+/** Find the entry to merge the RRset into, see kr_ranked_rrarray_add(). */
+static ranked_rr_array_entry_t *ranked_find(const ranked_rr_array_t *array,
+					    const knot_rrset_t *rr, uint32_t qry_uid)
+{
+	const struct kr_ranked_index *idx = array->index;
+	if (!idx) {
+		for (ssize_t i = array->len - 1; i >= 0; --i) {
+			ranked_rr_array_entry_t *stashed = array->at[i];
+			if (stashed->yielded || stashed->qry_uid != qry_uid) {
+				break;
+			}
+			if (rrsets_match(stashed->rr, rr)) {
+				return stashed;
+			}
+		}
+		return NULL;
+	}
+	/* Equivalent to the scan: only the trailing run of qry_uid is eligible,
+	 * and yields are set for the whole run, the later entries come unyielded. */
+	if (idx->run_uid != qry_uid) {
+		return NULL;
+	}
+	const uint32_t hash = ranked_hash(idx, rr);
+	const struct ranked_slot *found = NULL;
+	for (uint32_t i = hash & idx->mask; idx->slots[i].entry; i = (i + 1) & idx->mask) {
+		const struct ranked_slot *slot = &idx->slots[i];
+		if (slot->hash != hash || slot->seq < idx->run_seq
+		    || (found && slot->seq < found->seq)
+		    || slot->entry->qry_uid != qry_uid || slot->entry->yielded
+		    || !rrsets_match(slot->entry->rr, rr)) {
+			continue;
+		}
+		found = slot;
+	}
+	return found ? found->entry : NULL;
+}
+
 /** Ensure that an index in a ranked array won't cause "duplicate" RRsets on wire.
  *
  * Other entries that would form the same RRset get to_wire = false.
@@ -651,6 +929,19 @@ static int to_wire_ensure_unique(ranked_rr_array_t *array, size_t index)
 		return kr_ok();
 	}
 
+	const struct kr_ranked_index *idx = array->index;
+	if (idx) {
+		const uint32_t hash = ranked_hash(idx, e0->rr);
+		for (uint32_t i = hash & idx->mask; idx->slots[i].entry; i = (i + 1) & idx->mask) {
+			struct ranked_rr_array_entry *ei = idx->slots[i].entry;
+			if (idx->slots[i].hash == hash && ei->qry_uid != e0->qry_uid
+			    && ei->to_wire && rrsets_match(ei->rr, e0->rr)) {
+				ei->to_wire = false;
+			}
+		}
+		return kr_ok();
+	}
+
 	for (ssize_t i = array->len - 1; i >= 0; --i) {
 		/* ^ iterate backwards, as the end is more likely in CPU caches */
 		struct ranked_rr_array_entry *ei = array->at[i];
@@ -673,17 +964,8 @@ int kr_ranked_rrarray_add(ranked_rr_array_t *array, const knot_rrset_t *rr,
 	 * check if another rrset with the same
 	 * rclass/type/owner combination exists within current query
 	 * and merge if needed */
-	for (ssize_t i = array->len - 1; i >= 0; --i) {
-		ranked_rr_array_entry_t *stashed = array->at[i];
-		if (stashed->yielded) {
-			break;
-		}
-		if (stashed->qry_uid != qry_uid) {
-			break;
-		}
-		if (!rrsets_match(stashed->rr, rr)) {
-			continue;
-		}
+	ranked_rr_array_entry_t *stashed = ranked_find(array, rr, qry_uid);
+	if (stashed) {
 		/* Found the entry to merge with.  Check consistency and merge. */
 		bool ok = stashed->rank == rank && !stashed->cached;
 		if (!ok) {
@@ -699,7 +981,7 @@ int kr_ranked_rrarray_add(ranked_rr_array_t *array, const knot_rrset_t *rr,
 	}
 
 	/* No stashed rrset found, add */
-	int ret = array_reserve_mm(*array, array->len + 1, kr_memreserve, pool);
+	int ret = array_small_reserve_mm(*array, array->len + 1, kr_memreserve, pool);
 	if (ret != 0) {
 		return kr_error(ENOMEM);
 	}
@@ -727,6 +1009,16 @@ int kr_ranked_rrarray_add(ranked_rr_array_t *array, const knot_rrset_t *rr,
 		mm_free(pool, entry);
 		return kr_error(ENOMEM);
 	}
+	if (array->index || array->len == RANKED_INDEX_MIN) {
+		for (size_t i = array->index ? array->len - 1 : 0; i < array->len; ++i) {
+			if (ranked_index_add(array, array->at[i], pool) != 0) {
+				/* Without the index, the array is just scanned. */
+				mm_free(pool, array->index);
+				array->index = NULL;
+				break;
+			}
+		}
+	}
 
 	return to_wire_ensure_unique(array, array->len - 1);
 }
@@ -939,6 +1231,28 @@ uint64_t kr_now()
 	return uv_now(uv_default_loop());
 }
 
+/** The wall-clock time of the last kr_now() value, see kr_now_wall(). */
+static struct {
+	uint64_t mono;        /**< kr_now() when it was read */
+	struct timeval wall;  /**< zero if not read yet */
+} wall_cache;
+
+void kr_now_wall(struct timeval *tv)
+{
+	const uint64_t mono = kr_now();
+	if (mono != wall_cache.mono || wall_cache.wall.tv_sec == 0) {
+		gettimeofday(&wall_cache.wall, NULL);
+		wall_cache.mono = mono;
+	}
+	*tv = wall_cache.wall;
+}
+
+void kr_now_update(void)
+{
+	uv_update_time(uv_default_loop());
+	wall_cache.wall.tv_sec = 0;
+}
+
 int knot_dname_lf2wire(knot_dname_t * const dst, uint8_t len, const uint8_t *lf)
 {
 	knot_dname_t *d = dst; /* moving "cursor" as we write it out */
@@ -979,3 +1293,394 @@ finish:
 	++d;
 	return d - dst;
 }
+
+int kr_lf_name_init(struct kr_lf_name *dst, const knot_dname_t *name)
+{
+	if (!dst || !name) {
+		return kr_error(EINVAL);
+	}
+	const int size = knot_dname_size(name);
+	int ret = size > 0 && size <= KNOT_DNAME_MAXLEN
+		? kr_dname_lf(dst->lf, name, false) : kr_error(EINVAL);
+	if (ret != 0) {
+		return kr_error(EINVAL);
+	}
+	uint8_t label_lens[KNOT_DNAME_MAXLABELS];
+	int labels = 0;
+	for (const uint8_t *label = name; *label; label += *label + 1) {
+		label_lens[labels++] = *label;
+	}
+	dst->suffix_len[0] = 0;
+	for (int i = 1; i <= labels; ++i) {
+		dst->suffix_len[i] = dst->suffix_len[i - 1] + label_lens[labels - i] + 1;
+	}
+	assert(dst->suffix_len[labels] == dst->lf[0]);
+	dst->labels = labels;
+	dst->has_zero = size != strlen((const char *)name) + 1;
+	dst->name = name;
+	return kr_ok();
+}
+
+/** @internal Compare the wire names, the labels case-insensitively. */
+static bool dname_tail_eq(const knot_dname_t *a, const knot_dname_t *b)
+{
+	while (*a == *b) {
+		if (*a == 0) {
+			return true;
+		}
+		const int len = *a;
+		for (int i = 1; i <= len; ++i) {
+			if (tolower(a[i]) != tolower(b[i])) {
+				return false;
+			}
+		}
+		a += len + 1;
+		b += len + 1;
+	}
+	return false;
+}
+
+bool kr_dname_eq(const knot_dname_t *a, const knot_dname_t *b)
+{
+	return a && b && dname_tail_eq(a, b);
+}
+
+bool kr_dname_in(const knot_dname_t *name, const knot_dname_t *zone)
+{
+	if (!name || !zone) {
+		return false;
+	}
+	const int name_labels = knot_dname_labels(name, NULL);
+	const int zone_labels = knot_dname_labels(zone, NULL);
+	if (name_labels < 0 || zone_labels < 0 || name_labels < zone_labels) {
+		return false;
+	}
+	for (int i = 0; i < name_labels - zone_labels; ++i) {
+		name += *name + 1;
+	}
+	return dname_tail_eq(name, zone);
+}
+
+bool kr_rdata_eq(const knot_rdata_t *rd, const void *data, int len)
+{
+	return rd && data && knot_rdata_rdlen(rd) == len
+		&& memcmp(knot_rdata_data(rd), data, len) == 0;
+}
+
+bool kr_rdata_prefix(const knot_rdata_t *rd, const void *prefix, int bits)
+{
+	return rd && prefix && bits >= 0 && knot_rdata_rdlen(rd) * 8 >= bits
+		&& kr_bitcmp((const char *)knot_rdata_data(rd), prefix, bits) == 0;
+}
+
+/** @internal Set of ids of a suffix in kr_suffixes_*(). */
+struct suffix_ids {
+	uint32_t len;
+	uint32_t cap;
+	uint32_t at[];
+};
+
+/** @internal Lower-cased name in lookup format, lf[0] is the length. */
+static int suffix_key(uint8_t *lf, const knot_dname_t *name)
+{
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	int len = knot_dname_size(name);
+	if (len <= 0 || len > KNOT_DNAME_MAXLEN) {
+		return kr_error(EINVAL);
+	}
+	memcpy(lower, name, len);
+	knot_dname_to_lower(lower);
+	return kr_dname_lf(lf, lower, false);
+}
+
+trie_t *kr_suffixes_create(void)
+{
+	/* Built once from the configuration and then only read. */
+	return trie_create_arena(NULL);
+}
+
+static int suffix_ids_free(trie_val_t *val, void *baton)
+{
+	free(*val);
+	return 0;
+}
+
+void kr_suffixes_free(trie_t *sfx)
+{
+	if (sfx) {
+		trie_apply(sfx, suffix_ids_free, NULL);
+		trie_free(sfx);
+	}
+}
+
+int kr_suffixes_add(trie_t *sfx, const knot_dname_t *suffix, uint32_t id)
+{
+	if (!sfx || !suffix) {
+		return kr_error(EINVAL);
+	}
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	int ret = suffix_key(lf, suffix);
+	if (ret != 0) {
+		return ret;
+	}
+	trie_val_t *val = trie_get_ins(sfx, (const char *)lf + 1, lf[0]);
+	if (!val) {
+		return kr_error(ENOMEM);
+	}
+	struct suffix_ids *ids = *val;
+	for (uint32_t i = 0; ids && i < ids->len; ++i) {
+		if (ids->at[i] == id) {
+			return kr_ok();
+		}
+	}
+	if (!ids || ids->len == ids->cap) {
+		const uint32_t cap = ids ? 2 * ids->cap : 1;
+		struct suffix_ids *grown = realloc(ids, sizeof(*ids) + cap * sizeof(ids->at[0]));
+		if (!grown) {
+			return kr_error(ENOMEM);
+		}
+		if (!ids) {
+			grown->len = 0;
+		}
+		grown->cap = cap;
+		ids = *val = grown;
+	}
+	ids->at[ids->len++] = id;
+	return kr_ok();
+}
+
+static int suffix_ids_del(trie_val_t *val, void *baton)
+{
+	struct suffix_ids *ids = *val;
+	const uint32_t id = *(const uint32_t *)baton;
+	for (uint32_t i = 0; ids && i < ids->len; ++i) {
+		if (ids->at[i] == id) {
+			ids->at[i] = ids->at[--ids->len];
+			break;
+		}
+	}
+	return 0;
+}
+
+void kr_suffixes_del(trie_t *sfx, uint32_t id)
+{
+	if (sfx) {
+		trie_apply(sfx, suffix_ids_del, &id);
+	}
+}
+
+int kr_suffixes_match(trie_t *sfx, const knot_dname_t *name, uint32_t *ids, int maxids)
+{
+	if (!sfx || !name || (!ids && maxids > 0)) {
+		return kr_error(EINVAL);
+	}
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	int len = knot_dname_size(name);
+	if (len <= 0 || len > KNOT_DNAME_MAXLEN) {
+		return kr_error(EINVAL);
+	}
+	memcpy(lower, name, len);
+	knot_dname_to_lower(lower);
+	struct kr_lf_name lf;
+	int ret = kr_lf_name_init(&lf, lower);
+	if (ret != 0) {
+		return ret;
+	}
+	return kr_suffixes_match_lf(sfx, &lf, ids, maxids);
+}
+
+int kr_suffixes_match_lf(trie_t *sfx, const struct kr_lf_name *name, uint32_t *ids, int maxids)
+{
+	if (!sfx || !name || (!ids && maxids > 0)) {
+		return kr_error(EINVAL);
+	}
+	/* The suffix lengths tell where the suffixes end in the lookup format,
+	 * as the labels themselves may contain zero bytes. */
+	int count = 0;
+	for (int k = 0; k <= name->labels; ++k) {
+		trie_val_t *val = trie_get_try(sfx, (const char *)name->lf + 1,
+						name->suffix_len[k]);
+		const struct suffix_ids *found = val ? *val : NULL;
+		for (uint32_t i = 0; found && i < found->len; ++i) {
+			int j = 0;
+			while (j < count && ids[j] != found->at[i]) {
+				++j;
+			}
+			if (j < count) {
+				continue; /* already there from a shorter suffix */
+			}
+			if (count == maxids) {
+				return kr_error(ENOSPC);
+			}
+			ids[count++] = found->at[i];
+		}
+	}
+	return count;
+}
+
+struct kr_subnets {
+	trie_t *trie;  /**< (v6, length, masked address) -> id + 1 */
+	bool lengths[2][129];  /**< Which [v6][prefix length] are present */
+};
+
+/** @internal Key of the subnet, return its length. */
+static int subnet_key(uint8_t *key, bool v6, int bitlen, const uint8_t *addr)
+{
+	const int bytes = (bitlen + 7) / 8;
+	key[0] = v6;
+	key[1] = bitlen;
+	memcpy(key + 2, addr, bytes);
+	if (bitlen % 8) {
+		key[1 + bytes] &= 0xff << (8 - bitlen % 8);
+	}
+	return 2 + bytes;
+}
+
+struct kr_subnets *kr_subnets_create(void)
+{
+	struct kr_subnets *sn = calloc(1, sizeof(*sn));
+	if (sn && !(sn->trie = trie_create_arena(NULL))) {
+		free(sn);
+		return NULL;
+	}
+	return sn;
+}
+
+void kr_subnets_free(struct kr_subnets *sn)
+{
+	if (sn) {
+		trie_free(sn->trie);
+		free(sn);
+	}
+}
+
+int kr_subnets_add(struct kr_subnets *sn, const char *subnet, uint32_t id)
+{
+	if (!sn || !subnet) {
+		return kr_error(EINVAL);
+	}
+	uint8_t addr[16] = { 0 };
+	const bool v6 = kr_straddr_family(subnet) == AF_INET6;
+	int bitlen = kr_straddr_subnet(addr, subnet);
+	if (bitlen < 0) {
+		return bitlen;
+	}
+	uint8_t key[2 + 16];
+	int key_len = subnet_key(key, v6, bitlen, addr);
+	trie_val_t *val = trie_get_ins(sn->trie, (const char *)key, key_len);
+	if (!val) {
+		return kr_error(ENOMEM);
+	}
+	uintptr_t old = (uintptr_t)*val;
+	if (!old || id + 1 < old) {
+		*val = (void *)((uintptr_t)id + 1);
+	}
+	sn->lengths[v6][bitlen] = true;
+	return kr_ok();
+}
+
+int kr_subnets_match(const struct kr_subnets *sn, const struct sockaddr *addr, uint32_t *id)
+{
+	if (!sn || !addr || !id) {
+		return kr_error(EINVAL);
+	}
+	const int family = kr_inaddr_family(addr);
+	if (family != AF_INET && family != AF_INET6) {
+		return kr_error(ENOENT);
+	}
+	const bool v6 = family == AF_INET6;
+	const uint8_t *ip = (const uint8_t *)kr_inaddr(addr);
+	uintptr_t best = 0;
+	for (int bitlen = v6 ? 128 : 32; bitlen >= 0; --bitlen) {
+		if (!sn->lengths[v6][bitlen]) {
+			continue;
+		}
+		uint8_t key[2 + 16];
+		int key_len = subnet_key(key, v6, bitlen, ip);
+		trie_val_t *val = trie_get_try(sn->trie, (const char *)key, key_len);
+		if (val && (!best || (uintptr_t)*val < best)) {
+			best = (uintptr_t)*val;
+		}
+	}
+	if (!best) {
+		return kr_error(ENOENT);
+	}
+	*id = best - 1;
+	return kr_ok();
+}
+
+struct name_memo_val {
+	uint32_t gen;
+	int32_t val;
+};
+typedef lru_t(struct name_memo_val) name_memo_lru_t;
+
+struct kr_name_memo {
+	name_memo_lru_t *lru;  /**< (list, name) -> (generation, value) */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/** @internal Key of the name in the list, return its length. */
+static int name_memo_key(uint8_t *key, uint32_t list, const knot_dname_t *name)
+{
+	int len = knot_dname_size(name);
+	memcpy(key, &list, sizeof(list));
+	memcpy(key + sizeof(list), name, len);
+	return sizeof(list) + len;
+}
+
+struct kr_name_memo *kr_name_memo_create(uint32_t size)
+{
+	struct kr_name_memo *memo = calloc(1, sizeof(*memo));
+	if (!memo) {
+		return NULL;
+	}
+	/* The names come from the clients, so the groups mustn't be predictable. */
+	lru_create_hash(&memo->lru, size, NULL, NULL, LRU_HASH_SIPHASH);
+	if (!memo->lru) {
+		free(memo);
+		return NULL;
+	}
+	return memo;
+}
+
+void kr_name_memo_free(struct kr_name_memo *memo)
+{
+	if (memo) {
+		lru_free(memo->lru);
+		free(memo);
+	}
+}
+
+int32_t kr_name_memo_get(struct kr_name_memo *memo, uint32_t gen, uint32_t list,
+			 const knot_dname_t *name)
+{
+	uint8_t key[sizeof(list) + KNOT_DNAME_MAXLEN];
+	int key_len = name_memo_key(key, list, name);
+	struct name_memo_val *v = lru_get_try(memo->lru, (const char *)key, key_len);
+	if (!v || v->gen != gen) {
+		memo->misses += 1;
+		return 0;
+	}
+	memo->hits += 1;
+	return v->val;
+}
+
+void kr_name_memo_set(struct kr_name_memo *memo, uint32_t gen, uint32_t list,
+		      const knot_dname_t *name, int32_t val)
+{
+	uint8_t key[sizeof(list) + KNOT_DNAME_MAXLEN];
+	int key_len = name_memo_key(key, list, name);
+	struct name_memo_val *v = lru_get_new(memo->lru, (const char *)key, key_len, NULL);
+	if (v) {
+		v->gen = gen;
+		v->val = val;
+	}
+}
+
+void kr_name_memo_stats(const struct kr_name_memo *memo, uint64_t *hits, uint64_t *misses)
+{
+	*hits = memo->hits;
+	*misses = memo->misses;
+}
@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <libknot/libknot.h>
 #include <libknot/packet/pkt.h>
@@ -29,6 +30,7 @@
 #include <lua.h>
 #include "lib/generic/map.h"
 #include "lib/generic/array.h"
+#include "lib/generic/trie.h"
 #include "lib/defines.h"
 
 struct kr_query;
@@ -58,12 +60,13 @@ KR_EXPORT KR_PRINTF(1)
 void kr_log_verbose(const char *fmt, ...);
 
 /**
- * @brief Return true if the query has request log handler installed.
+ * @brief Return true if the query has request log handler or trace ring installed.
  */
-#define kr_log_trace_enabled(query) ((query) && (query)->request && (query)->request->trace_log)
+#define kr_log_trace_enabled(query) ((query) && (query)->request \
+	&& ((query)->request->trace_log || (query)->request->trace_ring))
 
 /**
- * Log a message through the request log handler.
+ * Log a message through the request log handler, or record it in the trace ring.
  * @param  query current query
  * @param  source message source
  * @param  fmt message format
@@ -134,6 +137,42 @@ static inline void mm_ctx_init(knot_mm_t *mm)
 }
 /* @endcond */
 
+/** Subsystems of kr_mm_tagged(), see the mem_* counters of worker.stats(). */
+enum kr_mem_tag {
+	KR_MEM_NSREP = 0, /**< Entries of the LRUs of the nameservers (RTT, reputation, lame, depth) */
+	KR_MEM_COOKIES,   /**< Entries of the LRU of the server cookies */
+	KR_MEM_SUBREQ,    /**< Subrequests in flight, worker->subreq_out */
+	KR_MEM_HINTS,     /**< Mempool of the hints module */
+	KR_MEM_TAG_COUNT
+};
+
+/** Bytes allocated by each kr_mm_tagged() context in this process,
+ * or set by the subsystem itself (e.g. a mempool). */
+KR_EXPORT extern size_t kr_mem_usage[KR_MEM_TAG_COUNT];
+/** Names of the tags, e.g. "nsrep". */
+KR_EXPORT extern const char *kr_mem_tag_names[KR_MEM_TAG_COUNT];
+
+/** Memory context of malloc() counting the allocated bytes in kr_mem_usage[tag];
+ * each allocation carries a small header with the tag and its size. */
+KR_EXPORT knot_mm_t *kr_mm_tagged(enum kr_mem_tag tag);
+
+/** Size of the huge pages assumed by kr_huge_alloc(). */
+#define KR_HUGEPAGE_SIZE ((size_t)2 << 20)
+
+/** Whether the large tables (e.g. LRUs) go to kr_huge_alloc(); set by --hugepages. */
+KR_EXPORT extern bool kr_hugepages;
+
+/** Allocate zeroed memory backed by huge pages if possible, rounded up to KR_HUGEPAGE_SIZE.
+ * The pages come from hugetlbfs if any are reserved (vm.nr_hugepages),
+ * otherwise transparent huge pages are advised.  Free it by kr_huge_free(). */
+KR_EXPORT void *kr_huge_alloc(size_t size);
+
+/** Free the memory from kr_huge_alloc(); NULL is ignored. */
+KR_EXPORT void kr_huge_free(void *mem);
+
+/** Memory context of kr_huge_alloc(). */
+KR_EXPORT extern knot_mm_t kr_mm_huge;
+
 /** Return time difference in miliseconds.
   * @note based on the _BSD_SOURCE timersub() macro */
 static inline long time_diff(struct timeval *begin, struct timeval *end) {
@@ -150,6 +189,7 @@ static inline long time_diff(struct timeval *begin, struct timeval *end) {
 
 /** @cond internal Array types */
 struct kr_context;
+struct kr_ranked_index;
 
 typedef array_t(knot_rrset_t *) rr_array_t;
 struct ranked_rr_array_entry {
@@ -170,8 +210,23 @@ typedef struct ranked_rr_array_entry ranked_rr_array_entry_t;
  *  - RRSIGs are only considered to form an RRset when the types covered match;
  *    cache-related code relies on that!
  *  - RRsets from the same packet (qry_uid) get merged.
+ *  - Most requests select just a few RRsets, those need no allocation.
+ *  - Long arrays get a hash index (in the same pool), so that adding to them
+ *    doesn't scan them; initialize with kr_ranked_rrarray_init().
+ *  - It's array_small_t(ranked_rr_array_entry_t *, 8) with the index appended,
+ *    the array_small_*() macros apply.
  */
-typedef array_t(ranked_rr_array_entry_t *) ranked_rr_array_t;
+typedef struct {
+	ranked_rr_array_entry_t **at;
+	size_t len;
+	size_t cap;
+	ranked_rr_array_entry_t *inl[8];
+	struct kr_ranked_index *index; /**< NULL while the array is short */
+} ranked_rr_array_t;
+
+/** Initialize a ranked_rr_array_t to empty. */
+#define kr_ranked_rrarray_init(array) \
+	(array_small_init(array), (array).index = NULL)
 /* @endcond */
 
 /** @internal RDATA array maximum size. */
@@ -183,7 +238,8 @@ typedef array_t(ranked_rr_array_entry_t *) ranked_rr_array_t;
 KR_EXPORT
 char* kr_strcatdup(unsigned n, ...);
 
-/** Reseed CSPRNG context. */
+/** Reseed CSPRNG context, e.g. after fork(). */
+KR_EXPORT
 int kr_rand_reseed(void);
 
 /** Get pseudo-random value between zero and max-1 (inclusive).
@@ -273,6 +329,20 @@ int kr_straddr_split(const char *addr, char *buf, size_t buflen, uint16_t *port)
 KR_EXPORT
 int kr_straddr_join(const char *addr, uint16_t port, char *buf, size_t *buflen);
 
+/** Maximum length of a key made by kr_sockaddr_key(). */
+#define KR_SOCKADDR_KEY_MAXLEN (1 + 2 + 16)
+/** Make a binary key for address+port, e.g. for trie_t, without formatting it as a string.
+  * @param dst buffer of at least KR_SOCKADDR_KEY_MAXLEN bytes
+  * @return key length or kr_error(EINVAL) for unsupported families
+  */
+KR_EXPORT
+int kr_sockaddr_key(char *dst, const struct sockaddr *addr);
+/** Fill the sockaddr from a key made by kr_sockaddr_key().
+  * @return 0 or kr_error(EINVAL) if the key is malformed
+  */
+KR_EXPORT
+int kr_sockaddr_from_key(struct sockaddr_storage *dst, const char *key, size_t len);
+
 /** Compare memory bitwise.  The semantics is "the same" as for memcmp().
  *  The partial byte is considered with more-significant bits first,
  *  so this is e.g. suitable for comparing IP prefixes. */
@@ -387,11 +457,46 @@ static inline char *kr_straddr(const struct sockaddr *addr)
 
 /** The current time in monotonic milliseconds.
  *
- * \note it may be outdated in case of long callbacks; see uv_now().
+ * \note it may be outdated in case of long callbacks; see uv_now() and kr_now_update().
  */
 KR_EXPORT
 uint64_t kr_now();
 
+/** The current wall-clock time, read once per kr_now() value.
+ *
+ * All the wall-clock timestamps taken during one iteration of the event loop
+ * (TTLs, RRSIG validity, cache entries) are thus the same and don't cost
+ * a clock read each; the time moves on with the loop, just like kr_now().
+ */
+KR_EXPORT
+void kr_now_wall(struct timeval *tv);
+
+/** The current wall-clock time in seconds, as time(NULL) but see kr_now_wall(). */
+static inline time_t kr_time(void)
+{
+	struct timeval tv;
+	kr_now_wall(&tv);
+	return tv.tv_sec;
+}
+
+/** Read the clocks again, for the rare places that need precise kr_now() and kr_now_wall().
+ *
+ * \note kr_now_us() is always precise.
+ */
+KR_EXPORT
+void kr_now_update(void);
+
+/** The current time in monotonic microseconds, for measuring short intervals.
+ *
+ * \note unlike kr_now() it's read from the clock on each call.
+ */
+static inline uint64_t kr_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /** Convert name from lookup format to wire.  See knot_dname_lf
  *
  * \note len bytes are read and len+1 are written with *normal* LF,
@@ -423,3 +528,134 @@ static inline int kr_dname_lf(uint8_t *dst, const knot_dname_t *src, bool add_wi
 	dst[0] = len;
 	return KNOT_EOK;
 };
+
+/** A name in lookup format, with the lengths of the LF of all its suffixes.
+ *
+ * The LF of a parent (suffix) name is a prefix of the LF of the name,
+ * so keys of the parent zones can be cut out without any conversion:
+ * the suffix with `i` labels is `lf + 1` of length `suffix_len[i]`.
+ */
+struct kr_lf_name {
+	const knot_dname_t *name; /**< The name it's computed from; not copied. */
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1]; /**< As from kr_dname_lf(): lf[0] is the length. */
+	uint8_t suffix_len[KNOT_DNAME_MAXLABELS + 1]; /**< LF length of the i-label suffix */
+	uint8_t labels; /**< The number of labels of the name. */
+	bool has_zero;  /**< Some label contains a zero byte, so the LF is ambiguous. */
+};
+
+/** Compute the lookup format of the name, see struct kr_lf_name.
+ * @note the name is referenced, not copied.
+ * @return 0 or kr_error(EINVAL) */
+KR_EXPORT
+int kr_lf_name_init(struct kr_lf_name *dst, const knot_dname_t *name);
+
+/** Whether the names are equal, ignoring case; false for NULL.
+ * For the callers that would compare the names as strings, e.g. Lua modules. */
+KR_EXPORT KR_PURE
+bool kr_dname_eq(const knot_dname_t *a, const knot_dname_t *b);
+
+/** Whether the name is equal to the zone or below it, ignoring case. */
+KR_EXPORT KR_PURE
+bool kr_dname_in(const knot_dname_t *name, const knot_dname_t *zone);
+
+/** Whether the RDATA are the bytes `data` of length `len`. */
+KR_EXPORT KR_PURE
+bool kr_rdata_eq(const knot_rdata_t *rd, const void *data, int len);
+
+/** Whether the RDATA start with the `bits` of `prefix`, e.g. of an address; see kr_bitcmp(). */
+KR_EXPORT KR_PURE
+bool kr_rdata_prefix(const knot_rdata_t *rd, const void *prefix, int bits);
+
+/**
+ * Index of name suffixes, each with a set of ids (e.g. of the policy rules).
+ * The keys are the lower-cased names in lookup format, so that all the suffixes
+ * of a name are found by a lookup per label.  Free it with kr_suffixes_free().
+ */
+KR_EXPORT
+trie_t *kr_suffixes_create(void);
+
+/** Free the index and the sets of ids. */
+KR_EXPORT
+void kr_suffixes_free(trie_t *sfx);
+
+/** Add the id to the suffix; adding it again is no-op. */
+KR_EXPORT
+int kr_suffixes_add(trie_t *sfx, const knot_dname_t *suffix, uint32_t id);
+
+/** Remove the id from all the suffixes. */
+KR_EXPORT
+void kr_suffixes_del(trie_t *sfx, uint32_t id);
+
+/**
+ * Find the ids of all the suffixes of the name (including the name itself).
+ * @param ids output, in no particular order and without duplicates
+ * @return number of ids, or error code (ENOSPC if more than maxids)
+ */
+KR_EXPORT
+int kr_suffixes_match(trie_t *sfx, const knot_dname_t *name, uint32_t *ids, int maxids);
+
+/**
+ * Like kr_suffixes_match(), with the name already in lookup format.
+ * @note the name has to be lower-cased, like kr_query::sname is.
+ */
+KR_EXPORT
+int kr_suffixes_match_lf(trie_t *sfx, const struct kr_lf_name *name, uint32_t *ids, int maxids);
+
+/**
+ * Index of IPv4 and IPv6 subnets, each with an id (e.g. of the rule).
+ * The lookup is a trie query per distinct prefix length in the index.
+ * Free it with kr_subnets_free().
+ */
+struct kr_subnets;
+KR_EXPORT
+struct kr_subnets *kr_subnets_create(void);
+
+KR_EXPORT
+void kr_subnets_free(struct kr_subnets *sn);
+
+/**
+ * Add the subnet in the kr_straddr_subnet() format, e.g. "10.0.0.0/8".
+ * The bits past the prefix length are ignored.  When the same subnet
+ * is added again, the lower id is kept.
+ */
+KR_EXPORT
+int kr_subnets_add(struct kr_subnets *sn, const char *subnet, uint32_t id);
+
+/**
+ * Find the lowest id of the subnets containing the address.
+ * With ids in the order of the rules, that's the first rule matching,
+ * not necessarily the longest prefix.
+ * @return 0 or kr_error(ENOENT)
+ */
+KR_EXPORT
+int kr_subnets_match(const struct kr_subnets *sn, const struct sockaddr *addr, uint32_t *id);
+
+/**
+ * Memo of decisions by name, e.g. of the rules matching only by QNAME.
+ * It's a lossy cache keyed by (list, name); a value is valid only for the
+ * generation it was stored with, so bump the generation to invalidate
+ * all of them at once.  Free it with kr_name_memo_free().
+ */
+struct kr_name_memo;
+KR_EXPORT
+struct kr_name_memo *kr_name_memo_create(uint32_t size);
+
+KR_EXPORT
+void kr_name_memo_free(struct kr_name_memo *memo);
+
+/**
+ * Find the value stored for the name in the list by kr_name_memo_set().
+ * @return the value or 0 if it isn't known for the generation
+ */
+KR_EXPORT
+int32_t kr_name_memo_get(struct kr_name_memo *memo, uint32_t gen, uint32_t list,
+			 const knot_dname_t *name);
+
+/** Store a (non-zero) value for the name in the list; it may be refused silently. */
+KR_EXPORT
+void kr_name_memo_set(struct kr_name_memo *memo, uint32_t gen, uint32_t list,
+		      const knot_dname_t *name, int32_t val);
+
+/** Counts of the hits and the misses of kr_name_memo_get(). */
+KR_EXPORT
+void kr_name_memo_stats(const struct kr_name_memo *memo, uint64_t *hits, uint64_t *misses);
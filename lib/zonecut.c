@@ -23,10 +23,12 @@
 #include "lib/zonecut.h"
 #include "lib/rplan.h"
 #include "contrib/cleanup.h"
+#include "contrib/ucw/lib.h"
 #include "lib/defines.h"
 #include "lib/layer.h"
 #include "lib/resolve.h"
 #include "lib/generic/pack.h"
+#include "lib/generic/lru.h"
 
 #define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "zcut", fmt)
 
@@ -61,10 +63,50 @@ int kr_zonecut_init(struct kr_zonecut *cut, const knot_dname_t *name, knot_mm_t
 	cut->trust_anchor = NULL;
 	cut->parent = NULL;
 	cut->nsset = trie_create(pool);
+	cut->nsset_refs = NULL;
 	return cut->name && cut->nsset ? kr_ok() : kr_error(ENOMEM);
 }
 
-/** Completely free a pack_t. */
+/** Room for addresses inside each address set: two of each family.
+ * Most servers have no more, so their addresses need no other allocation. */
+#define ADDR_SET_INLINE (2 * (sizeof(pack_objlen_t) + 16) + 2 * (sizeof(pack_objlen_t) + 4))
+
+/** Address types of a NS not looked up in cache yet, see kr_zonecut_fetch_addrs(). */
+enum addr_pending {
+	ADDR_PENDING_A = 1,
+	ADDR_PENDING_AAAA = 2,
+};
+
+/** Address set of a NS, the pack_t in the nsset points to one of these. */
+struct addr_set {
+	pack_t pack; /**< Must remain the first. */
+	uint8_t pending; /**< enum addr_pending flags */
+	uint8_t inl[ADDR_SET_INLINE];
+};
+
+/** Allocate an empty address set, using the room inside. */
+static pack_t *new_addr_set(knot_mm_t *pool)
+{
+	struct addr_set *set = mm_alloc(pool, sizeof(*set));
+	if (!set) {
+		return NULL;
+	}
+	set->pack.at = set->inl;
+	set->pack.len = 0;
+	set->pack.cap = sizeof(set->inl);
+	set->pending = 0;
+	return &set->pack;
+}
+
+/** Reserve room for `len` bytes of the address set in total. */
+static int reserve_addr_set(pack_t *pack, size_t len, knot_mm_t *pool)
+{
+	struct addr_set *set = (struct addr_set *)pack;
+	return array_inline_reserve(kr_memreserve, pool, (char **)&pack->at, set->inl,
+				    1, len, &pack->cap, pack->len);
+}
+
+/** Completely free an address set. */
 static inline void free_addr_set(pack_t *pack, knot_mm_t *pool)
 {
 	if (unlikely(!pack)) {
@@ -72,8 +114,11 @@ static inline void free_addr_set(pack_t *pack, knot_mm_t *pool)
 		assert(false);
 		return;
 	}
-	pack_clear_mm(*pack, mm_free, pool);
-	mm_free(pool, pack);
+	struct addr_set *set = (struct addr_set *)pack;
+	if (pack->at != set->inl) {
+		mm_free(pool, pack->at);
+	}
+	mm_free(pool, set);
 }
 /** Trivial wrapper for use in trie_apply, due to ugly casting. */
 static int free_addr_set_cb(trie_val_t *v, void *pool)
@@ -82,17 +127,91 @@ static int free_addr_set_cb(trie_val_t *v, void *pool)
 	return kr_ok();
 }
 
-void kr_zonecut_deinit(struct kr_zonecut *cut)
+/** Header of a shared nsset, kr_zonecut::nsset_refs points to it.
+ * The address sets are from its pool, which needn't be the pool of the cut,
+ * e.g. the root hints shared by the queries, see kr_zonecut_set_sbelt(). */
+struct nsset_share {
+	uint32_t refs; /**< Must remain the first. */
+	knot_mm_t *pool;
+};
+
+/** Drop the nsset of the cut; it's freed by the last of the cuts sharing it. */
+static void nsset_release(struct kr_zonecut *cut)
 {
-	if (!cut) {
-		return;
+	knot_mm_t *pool = cut->pool;
+	if (cut->nsset_refs) {
+		struct nsset_share *share = (struct nsset_share *)cut->nsset_refs;
+		cut->nsset_refs = NULL;
+		share->refs -= 1;
+		if (share->refs > 0) {
+			cut->nsset = NULL;
+			return;
+		}
+		pool = share->pool;
+		mm_free(pool, share);
 	}
-	mm_free(cut->pool, cut->name);
 	if (cut->nsset) {
-		trie_apply(cut->nsset, free_addr_set_cb, cut->pool);
+		trie_apply(cut->nsset, free_addr_set_cb, pool);
 		trie_free(cut->nsset);
 		cut->nsset = NULL;
 	}
+}
+
+/** Refer to the nsset of `src` from `dst`, which is emptied first. */
+static int nsset_share(struct kr_zonecut *dst, struct kr_zonecut *src)
+{
+	if (!src->nsset_refs) {
+		struct nsset_share *share = mm_alloc(src->pool, sizeof(*share));
+		if (!share) {
+			return kr_zonecut_copy(dst, src);
+		}
+		share->refs = 1;
+		share->pool = src->pool;
+		src->nsset_refs = &share->refs;
+	}
+	nsset_release(dst);
+	dst->nsset = src->nsset;
+	dst->nsset_refs = src->nsset_refs;
+	*dst->nsset_refs += 1;
+	return kr_ok();
+}
+
+/** Make the nsset private to the cut, before modifying it. */
+static int nsset_unshare(struct kr_zonecut *cut)
+{
+	if (!cut->nsset_refs) {
+		return kr_ok();
+	}
+	struct nsset_share *share = (struct nsset_share *)cut->nsset_refs;
+	if (share->refs <= 1 && share->pool == cut->pool) { /* the others are gone already */
+		mm_free(cut->pool, share);
+		cut->nsset_refs = NULL;
+		return kr_ok();
+	}
+	struct kr_zonecut copy = {
+		.pool = cut->pool,
+		.nsset = trie_create(cut->pool),
+	};
+	if (!copy.nsset) {
+		return kr_error(ENOMEM);
+	}
+	int ret = kr_zonecut_copy(&copy, cut);
+	if (ret) {
+		nsset_release(&copy);
+		return ret;
+	}
+	nsset_release(cut);
+	cut->nsset = copy.nsset;
+	return kr_ok();
+}
+
+void kr_zonecut_deinit(struct kr_zonecut *cut)
+{
+	if (!cut) {
+		return;
+	}
+	mm_free(cut->pool, cut->name);
+	nsset_release(cut);
 	knot_rrset_free(&cut->key, cut->pool);
 	knot_rrset_free(&cut->trust_anchor, cut->pool);
 	cut->name = NULL;
@@ -120,8 +239,11 @@ int kr_zonecut_copy(struct kr_zonecut *dst, const struct kr_zonecut *src)
 	if (!dst->nsset) {
 		dst->nsset = trie_create(dst->pool);
 	}
+	int ret = nsset_unshare(dst);
+	if (ret) {
+		return ret;
+	}
 	/* Copy the contents, one by one. */
-	int ret = kr_ok();
 	trie_it_t *it;
 	for (it = trie_it_begin(src->nsset); !trie_it_finished(it); trie_it_next(it)) {
 		size_t klen;
@@ -132,13 +254,64 @@ int kr_zonecut_copy(struct kr_zonecut *dst, const struct kr_zonecut *src)
 			break;
 		}
 		const pack_t *old_pack = *trie_it_val(it);
-		ret = pack_clone(new_pack, old_pack, dst->pool);
-		if (ret) break;
+		if (!*new_pack) {
+			*new_pack = new_addr_set(dst->pool);
+		}
+		if (!*new_pack || reserve_addr_set(*new_pack, old_pack->len, dst->pool) != 0) {
+			ret = kr_error(ENOMEM);
+			break;
+		}
+		memcpy((*new_pack)->at, old_pack->at, old_pack->len);
+		(*new_pack)->len = old_pack->len;
+		((struct addr_set *)*new_pack)->pending = ((const struct addr_set *)old_pack)->pending;
 	}
 	trie_it_free(it);
 	return ret;
 }
 
+int kr_zonecut_move(struct kr_zonecut *dst, struct kr_zonecut *src)
+{
+	if (!dst || !src || !src->nsset || dst->pool != src->pool) {
+		return kr_error(EINVAL);
+	}
+	if (dst->nsset && trie_weight(dst->nsset) > 0) {
+		int ret = kr_zonecut_copy(dst, src);
+		if (ret) {
+			return ret;
+		}
+	} else {
+		nsset_release(dst);
+		dst->nsset = src->nsset;
+		dst->nsset_refs = src->nsset_refs;
+		src->nsset = NULL;
+		src->nsset_refs = NULL;
+	}
+	mm_free(dst->pool, dst->name);
+	dst->name = src->name;
+	src->name = NULL;
+	knot_rrset_free(&dst->key, dst->pool);
+	dst->key = src->key;
+	src->key = NULL;
+	knot_rrset_free(&dst->trust_anchor, dst->pool);
+	dst->trust_anchor = src->trust_anchor;
+	src->trust_anchor = NULL;
+	return kr_ok();
+}
+
+int kr_zonecut_share(struct kr_zonecut *dst, struct kr_zonecut *src)
+{
+	if (!dst || !src || !src->nsset) {
+		return kr_error(EINVAL);
+	}
+	if (dst->nsset == src->nsset) {
+		return kr_ok();
+	}
+	if (dst->pool != src->pool || (dst->nsset && trie_weight(dst->nsset) > 0)) {
+		return kr_zonecut_copy(dst, src);
+	}
+	return nsset_share(dst, src);
+}
+
 int kr_zonecut_copy_trust(struct kr_zonecut *dst, const struct kr_zonecut *src)
 {
 	knot_rrset_t *key_copy = NULL;
@@ -172,13 +345,16 @@ int kr_zonecut_add(struct kr_zonecut *cut, const knot_dname_t *ns, const knot_rd
 	if (!cut || !ns || !cut->nsset) {
 		return kr_error(EINVAL);
 	}
+	int ret = nsset_unshare(cut);
+	if (ret) {
+		return ret;
+	}
 	/* Get a pack_t for the ns. */
 	pack_t **pack = (pack_t **)trie_get_ins(cut->nsset, (const char *)ns, knot_dname_size(ns));
 	if (!pack) return kr_error(ENOMEM);
 	if (*pack == NULL) {
-		*pack = mm_alloc(cut->pool, sizeof(pack_t));
+		*pack = new_addr_set(cut->pool);
 		if (*pack == NULL) return kr_error(ENOMEM);
-		pack_init(**pack);
 	}
 	/* Insert data (if has any) */
 	if (rdata == NULL) {
@@ -191,7 +367,7 @@ int kr_zonecut_add(struct kr_zonecut *cut, const knot_dname_t *ns, const knot_rd
 		return kr_ok();
 	}
 	/* Push new address */
-	int ret = pack_reserve_mm(**pack, 1, rdlen, kr_memreserve, cut->pool);
+	ret = reserve_addr_set(*pack, (*pack)->len + sizeof(pack_objlen_t) + rdlen, cut->pool);
 	if (ret != 0) {
 		return kr_error(ENOMEM);
 	}
@@ -205,7 +381,10 @@ int kr_zonecut_del(struct kr_zonecut *cut, const knot_dname_t *ns, const knot_rd
 	}
 
 	/* Find the address list. */
-	int ret = kr_ok();
+	int ret = nsset_unshare(cut);
+	if (ret) {
+		return ret;
+	}
 	pack_t *pack = kr_zonecut_find(cut, ns);
 	if (pack == NULL) {
 		return kr_error(ENOENT);
@@ -231,9 +410,13 @@ int kr_zonecut_del_all(struct kr_zonecut *cut, const knot_dname_t *ns)
 		return kr_error(EINVAL);
 	}
 
+	int ret = nsset_unshare(cut);
+	if (ret) {
+		return ret;
+	}
 	/* Find the address list; then free and remove it. */
 	pack_t *pack;
-	int ret = trie_del(cut->nsset, (const char *)ns, knot_dname_size(ns),
+	ret = trie_del(cut->nsset, (const char *)ns, knot_dname_size(ns),
 			   (trie_val_t *)&pack);
 	if (ret) { /* deletion failed */
 		assert(ret == KNOT_ENOENT);
@@ -253,6 +436,28 @@ pack_t *kr_zonecut_find(struct kr_zonecut *cut, const knot_dname_t *ns)
 	return val ? (pack_t *)*val : NULL;
 }
 
+const knot_dname_t *kr_zonecut_ns_name(struct kr_zonecut *cut, const knot_dname_t *ns)
+{
+	if (!cut || !ns || !cut->nsset) {
+		return NULL;
+	}
+	const size_t len = knot_dname_size(ns);
+	const char *key = NULL;
+	size_t key_len = 0;
+	trie_it_t *it = trie_it_begin_geq(cut->nsset, (const char *)ns, len);
+	if (it && !trie_it_finished(it)) {
+		key = trie_it_key(it, &key_len);
+	}
+	trie_it_free(it);
+	return key && key_len == len && memcmp(key, ns, len) == 0
+		? (const knot_dname_t *)key : NULL;
+}
+
+bool kr_zonecut_addrs_pending(const pack_t *addrs)
+{
+	return addrs && ((const struct addr_set *)addrs)->pending != 0;
+}
+
 static int has_address(trie_val_t *v, void *baton_)
 {
 	const pack_t *pack = *v;
@@ -260,6 +465,11 @@ static int has_address(trie_val_t *v, void *baton_)
 	return found;
 }
 
+static int has_pending(trie_val_t *v, void *baton_)
+{
+	return kr_zonecut_addrs_pending(*v);
+}
+
 bool kr_zonecut_is_empty(struct kr_zonecut *cut)
 {
 	if (!cut || !cut->nsset) {
@@ -275,12 +485,87 @@ int kr_zonecut_set_sbelt(struct kr_context *ctx, struct kr_zonecut *cut)
 		return kr_error(EINVAL);
 	}
 
-	trie_apply(cut->nsset, free_addr_set_cb, cut->pool);
-	trie_clear(cut->nsset);
-
 	update_cut_name(cut, U8(""));
-	/* Copy root hints from resolution context. */
-	return kr_zonecut_copy(cut, &ctx->root_hints);
+	/* Refer to the root hints of the context; they outlive the queries,
+	 * so the pools may differ.  Whichever of them is modified later,
+	 * e.g. by reloading the hints, gets its own copy first. */
+	nsset_release(cut);
+	return nsset_share(cut, &ctx->root_hints);
+}
+
+/** @internal Key of the depth cache and the lookup counts, the lowercased zone name. */
+static int depth_key(knot_dname_t *key, const knot_dname_t *zone)
+{
+	const int len = knot_dname_size(zone);
+	if (len <= 0 || len > KNOT_DNAME_MAXLEN) {
+		return kr_error(EINVAL);
+	}
+	memcpy(key, zone, len);
+	knot_dname_to_lower(key);
+	return len;
+}
+
+/** @internal Refreshing of the infrastructure records, see kr_zonecut_set_refresh(). */
+static struct {
+	kr_zonecut_refresh_cb cb;
+	unsigned hot;
+} refresh = { NULL, 0 };
+
+/** Lookups through the zone cut, halved every KR_ZONECUT_HOT_PERIOD. */
+struct cut_hot {
+	uint32_t period; /**< kr_now() / KR_ZONECUT_HOT_PERIOD of the count */
+	uint32_t count;
+};
+typedef lru_t(struct cut_hot) cut_hot_lru_t;
+static cut_hot_lru_t *cut_hots = NULL;
+
+void kr_zonecut_set_refresh(kr_zonecut_refresh_cb cb, unsigned hot)
+{
+	refresh.cb = cb;
+	refresh.hot = hot;
+	if (cb && !cut_hots) {
+		lru_create_hash(&cut_hots, KR_ZONECUT_HOT_SIZE, NULL, NULL, LRU_HASH_SIPHASH);
+	}
+}
+
+/** Return the recent lookups through the cut, incl. this one if `count`. */
+static unsigned cut_lookups(const knot_dname_t *zone, bool count)
+{
+	knot_dname_t key[KNOT_DNAME_MAXLEN];
+	const int len = cut_hots ? depth_key(key, zone) : -1;
+	if (len <= 0) {
+		return 0;
+	}
+	struct cut_hot *h = count
+		? lru_get_new(cut_hots, (const char *)key, len, NULL)
+		: lru_get_try(cut_hots, (const char *)key, len);
+	if (!h) {
+		return 0;
+	}
+	const uint32_t period = kr_now() / KR_ZONECUT_HOT_PERIOD;
+	const uint32_t age = period - h->period;
+	h->count = age < 32 ? h->count >> age : 0;
+	h->period = period;
+	h->count += count;
+	return h->count;
+}
+
+/** Ask for a refresh of the record of the cut if it's expiring and the cut is hot. */
+static void refresh_check(const struct kr_cache_p *peek, int32_t new_ttl,
+			  const knot_dname_t *owner, uint16_t type,
+			  const knot_dname_t *zone, const struct kr_query *qry)
+{
+	if (!refresh.cb || !zone || !kr_cache_expiring(peek, new_ttl)
+	    || (refresh.hot > 1 && cut_lookups(zone, false) < refresh.hot)) {
+		return;
+	}
+	WITH_VERBOSE(qry) {
+		auto_free char *owner_str = kr_dname_text(owner),
+			*type_str = kr_rrtype_text(type);
+		VERBOSE_MSG(qry, "refreshing expiring %s %s of a hot cut\n",
+			    owner_str, type_str);
+	}
+	refresh.cb(owner, type);
 }
 
 /** Fetch address for zone cut.  Any rank is accepted (i.e. glue as well). */
@@ -297,6 +582,7 @@ static void fetch_addr(struct kr_zonecut *cut, struct kr_cache *cache,
 	if (new_ttl < 0) {
 		return;
 	}
+	refresh_check(&peek, new_ttl, ns, rrtype, cut->name, qry);
 
 	knot_rrset_t cached_rr;
 	knot_rrset_init(&cached_rr, /*const-cast*/(knot_dname_t *)ns, rrtype, KNOT_CLASS_IN);
@@ -310,13 +596,74 @@ static void fetch_addr(struct kr_zonecut *cut, struct kr_cache *cache,
 	}
 }
 
-/** Fetch best NS for zone cut. */
+/** Look up the pending address types of the set in cache. */
+static void fetch_pending(struct kr_zonecut *cut, struct kr_cache *cache,
+			  const knot_dname_t *ns, pack_t *pack, const struct kr_query *qry)
+{
+	struct addr_set *set = (struct addr_set *)pack;
+	const uint8_t pending = set->pending;
+	set->pending = 0;
+	if (pending & ADDR_PENDING_A) {
+		fetch_addr(cut, cache, ns, KNOT_RRTYPE_A, qry);
+	}
+	if (pending & ADDR_PENDING_AAAA) {
+		fetch_addr(cut, cache, ns, KNOT_RRTYPE_AAAA, qry);
+	}
+}
+
+pack_t *kr_zonecut_fetch_addrs(struct kr_context *ctx, struct kr_zonecut *cut,
+			       const knot_dname_t *ns, const struct kr_query *qry)
+{
+	if (!ctx || !cut || !ns) {
+		return NULL;
+	}
+	pack_t *pack = kr_zonecut_find(cut, ns);
+	if (kr_zonecut_addrs_pending(pack)) {
+		/* Don't copy shared sets with nothing to fetch, e.g. SBELT. */
+		if (nsset_unshare(cut) != 0) {
+			return NULL;
+		}
+		pack = kr_zonecut_find(cut, ns);
+		fetch_pending(cut, &ctx->cache, ns, pack, qry);
+	}
+	return pack;
+}
+
+int kr_zonecut_fetch_pending(struct kr_context *ctx, struct kr_zonecut *cut,
+			     const struct kr_query *qry)
+{
+	if (!ctx || !cut || !cut->nsset) {
+		return kr_error(EINVAL);
+	}
+	if (!trie_apply(cut->nsset, has_pending, NULL)) {
+		return kr_ok();
+	}
+	int ret = nsset_unshare(cut);
+	if (ret) {
+		return ret;
+	}
+	/* Adding to the existing sets doesn't restructure the trie. */
+	trie_it_t *it;
+	for (it = trie_it_begin(cut->nsset); !trie_it_finished(it); trie_it_next(it)) {
+		pack_t *pack = *trie_it_val(it);
+		if (kr_zonecut_addrs_pending(pack)) {
+			fetch_pending(cut, &ctx->cache,
+				      (const knot_dname_t *)trie_it_key(it, NULL), pack, qry);
+		}
+	}
+	trie_it_free(it);
+	return kr_ok();
+}
+
+/** Fetch the NS set of the name; `name_lf` with `labels` is its LF, if known. */
 static int fetch_ns(struct kr_context *ctx, struct kr_zonecut *cut,
-		    const knot_dname_t *name, const struct kr_query *qry,
-		    uint8_t * restrict rank)
+		    const knot_dname_t *name, const struct kr_lf_name *name_lf,
+		    int labels, const struct kr_query *qry, uint8_t * restrict rank)
 {
 	struct kr_cache_p peek;
-	int ret = kr_cache_peek_exact(&ctx->cache, name, KNOT_RRTYPE_NS, &peek);
+	int ret = name_lf
+		? kr_cache_peek_exact_lf(&ctx->cache, name_lf, labels, KNOT_RRTYPE_NS, &peek)
+		: kr_cache_peek_exact(&ctx->cache, name, KNOT_RRTYPE_NS, &peek);
 	if (ret != 0) {
 		return ret;
 	}
@@ -330,6 +677,7 @@ static int fetch_ns(struct kr_context *ctx, struct kr_zonecut *cut,
 	if (new_ttl < 0) {
 		return kr_error(ESTALE);
 	}
+	refresh_check(&peek, new_ttl, name, KNOT_RRTYPE_NS, name, qry);
 	/* Materialize the rdataset temporarily, for simplicity. */
 	knot_rdataset_t ns_rds = { 0, NULL };
 	ret = kr_cache_materialize(&ns_rds, &peek, new_ttl, cut->pool);
@@ -338,19 +686,21 @@ static int fetch_ns(struct kr_context *ctx, struct kr_zonecut *cut,
 	}
 
 	/* Insert name servers for this zone cut, addresses will be looked up
-	 * on-demand (either from cache or iteratively) */
+	 * on-demand: from cache by the election, see kr_zonecut_fetch_addrs(),
+	 * or iteratively. */
 	for (unsigned i = 0; i < ns_rds.rr_count; ++i) {
 		const knot_dname_t *ns_name = knot_ns_name(&ns_rds, i);
-		(void) kr_zonecut_add(cut, ns_name, NULL);
-		/* Fetch NS reputation and decide whether to prefetch A/AAAA records. */
-		unsigned *cached = lru_get_try(ctx->cache_rep,
-				(const char *)ns_name, knot_dname_size(ns_name));
-		unsigned reputation = (cached) ? *cached : 0;
+		if (kr_zonecut_add(cut, ns_name, NULL) != 0) {
+			continue;
+		}
+		struct addr_set *set = (struct addr_set *)kr_zonecut_find(cut, ns_name);
+		/* Decide by the NS reputation which of A/AAAA to look up later. */
+		unsigned reputation = kr_nsrep_get_rep(ctx->cache_rep, ns_name);
 		if (!(reputation & KR_NS_NOIP4) && !(qry->flags.NO_IPV4)) {
-			fetch_addr(cut, &ctx->cache, ns_name, KNOT_RRTYPE_A, qry);
+			set->pending |= ADDR_PENDING_A;
 		}
 		if (!(reputation & KR_NS_NOIP6) && !(qry->flags.NO_IPV6)) {
-			fetch_addr(cut,  &ctx->cache, ns_name, KNOT_RRTYPE_AAAA, qry);
+			set->pending |= ADDR_PENDING_AAAA;
 		}
 	}
 
@@ -382,6 +732,7 @@ static int fetch_secure_rrset(knot_rrset_t **rr, struct kr_cache *cache,
 	if (new_ttl < 0) {
 		return kr_error(ESTALE);
 	}
+	refresh_check(&peek, new_ttl, owner, type, owner, qry);
 	/* materialize a new RRset */
 	knot_rrset_free(rr, pool);
 	*rr = mm_alloc(pool, sizeof(knot_rrset_t));
@@ -404,6 +755,41 @@ static int fetch_secure_rrset(knot_rrset_t **rr, struct kr_cache *cache,
 	return kr_ok();
 }
 
+/** Names recently found to have no NS in cache.  Most names asked for aren't
+ * zone cuts, so without this every query repeats the same misses of the walk
+ * in kr_zonecut_find_cached() for each label under the cut. */
+struct cut_miss {
+	uint64_t expire; /**< kr_now() until which it's valid */
+	uint32_t ns_gen; /**< kr_cache::ns_gen at the time of the miss */
+};
+typedef lru_t(struct cut_miss) cut_miss_lru_t;
+static cut_miss_lru_t *cut_misses = NULL;
+
+/** Return true if the name is known to have no NS in cache. */
+static bool cut_miss_test(const struct kr_cache *cache, const knot_dname_t *name)
+{
+	if (!cut_misses) {
+		lru_create_hash(&cut_misses, KR_ZONECUT_MISS_SIZE, NULL, NULL, LRU_HASH_SIPHASH);
+		return false;
+	}
+	struct cut_miss *m = lru_get_try(cut_misses, (const char *)name,
+					 knot_dname_size(name));
+	return m && m->ns_gen == cache->ns_gen && m->expire > kr_now();
+}
+
+static void cut_miss_note(const struct kr_cache *cache, const knot_dname_t *name)
+{
+	if (!cut_misses) {
+		return;
+	}
+	struct cut_miss *m = lru_get_new(cut_misses, (const char *)name,
+					 knot_dname_size(name), NULL);
+	if (m) {
+		m->expire = kr_now() + KR_ZONECUT_MISS_TTL;
+		m->ns_gen = cache->ns_gen;
+	}
+}
+
 int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 			   const knot_dname_t *name, const struct kr_query *qry,
 			   bool * restrict secured)
@@ -417,13 +803,27 @@ int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 	if (!qname) {
 		return kr_error(ENOMEM);
 	}
+	/* The parent zones are prefixes of the LF of the name, convert it just once. */
+	struct kr_lf_name qname_lf;
+	const bool have_lf = kr_lf_name_init(&qname_lf, qname) == 0 && !qname_lf.has_zero;
+	int labels = have_lf ? qname_lf.labels : 0;
 	/* Start at QNAME parent. */
 	const knot_dname_t *label = qname;
 	while (true) {
 		/* Fetch NS first and see if it's insecure. */
 		uint8_t rank = 0;
 		const bool is_root = (label[0] == '\0');
-		if (fetch_ns(ctx, cut, label, qry, &rank) == 0) {
+		const bool known_miss = cut_miss_test(&ctx->cache, label);
+		const int ret_ns = known_miss ? kr_error(ENOENT)
+				: fetch_ns(ctx, cut, label, have_lf ? &qname_lf : NULL,
+					   labels, qry, &rank);
+		if (ret_ns == kr_error(ENOENT) && !known_miss) {
+			cut_miss_note(&ctx->cache, label);
+		}
+		if (ret_ns == 0) {
+			if (refresh.cb) {
+				(void) cut_lookups(label, true);
+			}
 			/* Flag as insecure if cached as this */
 			if (kr_rank_test(rank, KR_RANK_INSECURE)) {
 				*secured = false;
@@ -450,6 +850,7 @@ int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 		/* Subtract label from QNAME. */
 		if (!is_root) {
 			label = knot_wire_next_label(label, NULL);
+			--labels;
 		} else {
 			break;
 		}
@@ -458,3 +859,41 @@ int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 	mm_free(cut->pool, qname);
 	return kr_error(ENOENT);
 }
+
+unsigned kr_zonecut_get_depth(kr_cut_depth_lru_t *cache, const knot_dname_t *zone)
+{
+	knot_dname_t key[KNOT_DNAME_MAXLEN];
+	const int len = cache && zone ? depth_key(key, zone) : -1;
+	if (len <= 0) {
+		return 1;
+	}
+	const struct kr_cut_depth *depth = lru_get_try(cache, (const char *)key, len);
+	if (!depth || (int64_t)(depth->until - kr_now()) <= 0) {
+		return 1;
+	}
+	return depth->labels;
+}
+
+void kr_zonecut_set_depth(kr_cut_depth_lru_t *cache, const knot_dname_t *zone,
+			  unsigned labels)
+{
+	knot_dname_t key[KNOT_DNAME_MAXLEN];
+	const int len = cache && zone ? depth_key(key, zone) : -1;
+	if (len <= 0) {
+		return;
+	}
+	labels = MAX(1, MIN(labels, KNOT_DNAME_MAXLABELS));
+	if (labels == 1) {
+		/* The default, don't waste the space. */
+		struct kr_cut_depth *depth = lru_get_try(cache, (const char *)key, len);
+		if (depth) {
+			depth->until = 0;
+		}
+		return;
+	}
+	struct kr_cut_depth *depth = lru_get_new(cache, (const char *)key, len, NULL);
+	if (depth) {
+		depth->labels = labels;
+		depth->until = kr_now() + KR_CUT_DEPTH_TTL;
+	}
+}
@@ -18,6 +18,7 @@
 
 #include "lib/cache/api.h"
 #include "lib/defines.h"
+#include "lib/generic/lru.h"
 #include "lib/generic/pack.h"
 #include "lib/generic/trie.h"
 
@@ -34,8 +35,21 @@ struct kr_zonecut {
 	struct kr_zonecut *parent; /**< Parent zone cut. */
 	trie_t *nsset;        /**< Map of nameserver => address_set (pack_t). */
 	knot_mm_t *pool;     /**< Memory pool. */
+	uint32_t *nsset_refs; /**< Number of cuts sharing the nsset, NULL if not shared; see kr_zonecut_share() */
 };
 
+/** Labels below a zone revealed by QNAME minimization, learned per zone. */
+struct kr_cut_depth {
+	uint64_t until;  /**< kr_now() when it expires */
+	uint8_t labels;  /**< At least 1 */
+};
+
+/** See kr_zonecut_get_depth() */
+typedef lru_t(struct kr_cut_depth) kr_cut_depth_lru_t;
+
+/** Lifetime of a learned depth, in milliseconds. */
+#define KR_CUT_DEPTH_TTL (3600 * 1000)
+
 /**
  * Populate root zone cut with SBELT.
  * @param cut zone cut
@@ -73,6 +87,31 @@ void kr_zonecut_set(struct kr_zonecut *cut, const knot_dname_t *name);
 KR_EXPORT
 int kr_zonecut_copy(struct kr_zonecut *dst, const struct kr_zonecut *src);
 
+/**
+ * Move zone cut contents from a temporary one, including keys and trust anchor.
+ *
+ * This avoids cloning all the address sets when the source is discarded anyway;
+ * if the destination already has some nameservers, they're copied to it
+ * as in kr_zonecut_copy().  The parent of the destination is kept.
+ * @param dst destination zone cut
+ * @param src source zone cut, with the same pool; it may only be deinitialized afterwards
+ * @return 0 or an error code
+ */
+int kr_zonecut_move(struct kr_zonecut *dst, struct kr_zonecut *src);
+
+/**
+ * Share the nameservers and addresses of the source, without copying them.
+ *
+ * The nsset becomes read-only for both cuts; whichever of them is modified
+ * by the kr_zonecut_*() functions gets its own copy first.
+ * If the cuts don't use the same pool, or the destination already has
+ * some nameservers, it's the same as kr_zonecut_copy().
+ * @param dst destination zone cut
+ * @param src source zone cut
+ * @return 0 or an error code
+ */
+int kr_zonecut_share(struct kr_zonecut *dst, struct kr_zonecut *src);
+
 /**
  * Copy zone trust anchor and keys.
  * @param dst destination zone cut
@@ -120,6 +159,7 @@ int kr_zonecut_del_all(struct kr_zonecut *cut, const knot_dname_t *ns);
  *
  * @note This can be used for membership test, a non-null pack is returned
  *       if the nameserver name exists.
+ * @note Don't modify the pack directly if the cut may be shared, see kr_zonecut_share().
  * 
  * @param  cut
  * @param  ns    name server name
@@ -128,9 +168,43 @@ int kr_zonecut_del_all(struct kr_zonecut *cut, const knot_dname_t *ns);
 KR_EXPORT KR_PURE
 pack_t *kr_zonecut_find(struct kr_zonecut *cut, const knot_dname_t *ns);
 
+/**
+ * Find the name of the nameserver as stored in the zone cut,
+ * i.e. valid as long as the nameserver is in the cut.
+ * @return the name or NULL
+ */
+KR_EXPORT
+const knot_dname_t *kr_zonecut_ns_name(struct kr_zonecut *cut, const knot_dname_t *ns);
+
+/**
+ * Check whether the addresses of the nameserver are still to be looked up in cache,
+ * see kr_zonecut_find_cached().
+ */
+KR_EXPORT KR_PURE
+bool kr_zonecut_addrs_pending(const pack_t *addrs);
+
+/**
+ * Look up the pending addresses of the nameserver in cache.
+ * @note The nsset gets its own copy if it's shared, see kr_zonecut_share().
+ * @return the address set or NULL if the nameserver isn't in the cut
+ */
+KR_EXPORT
+pack_t *kr_zonecut_fetch_addrs(struct kr_context *ctx, struct kr_zonecut *cut,
+			       const knot_dname_t *ns, const struct kr_query *qry);
+
+/**
+ * Look up the pending addresses of all the nameservers in cache.
+ * @return 0 or an error code
+ */
+KR_EXPORT
+int kr_zonecut_fetch_pending(struct kr_context *ctx, struct kr_zonecut *cut,
+			     const struct kr_query *qry);
+
 /**
  * Populate zone cut with a root zone using SBELT :rfc:`1034`
  *
+ * The cut refers to the nsset of kr_context::root_hints instead of copying it,
+ * as in kr_zonecut_share(); the root hints outlive the queries.
  * @param ctx resolution context (to fetch root hints)
  * @param cut zone cut to be populated
  * @return 0 or error code
@@ -141,6 +215,9 @@ int kr_zonecut_set_sbelt(struct kr_context *ctx, struct kr_zonecut *cut);
 /**
  * Populate zone cut address set from cache.
  *
+ * Only the names of the nameservers are loaded, their addresses are pending
+ * until the election needs them, see kr_zonecut_fetch_addrs().
+ *
  * @param ctx       resolution context (to fetch data from LRU caches)
  * @param cut       zone cut to be populated
  * @param name      QNAME to start finding zone cut for
@@ -152,6 +229,23 @@ KR_EXPORT
 int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 			   const knot_dname_t *name, const struct kr_query *qry,
 			   bool * restrict secured);
+/** Called for an expiring record of a hot zone cut, see kr_zonecut_set_refresh(). */
+typedef void (*kr_zonecut_refresh_cb)(const knot_dname_t *name, uint16_t type);
+
+/**
+ * Ask for refreshes of the infrastructure records of the zone cuts used often.
+ *
+ * kr_zonecut_find_cached() counts the lookups through each cut in this process,
+ * halved every KR_ZONECUT_HOT_PERIOD.  When the NS, DS or DNSKEY of a cut
+ * with at least `hot` of them is expiring (see kr_cache_expiring()),
+ * or an address of its nameserver read from the cache, the callback is called
+ * right from the lookup, so it should only schedule the refresh and return.
+ * @param cb callback or NULL to stop
+ * @param hot the minimum count of lookups, 0 or 1 for all the cuts
+ */
+KR_EXPORT
+void kr_zonecut_set_refresh(kr_zonecut_refresh_cb cb, unsigned hot);
+
 /**
  * Check if any address is present in the zone cut.
  *
@@ -161,3 +255,26 @@ int kr_zonecut_find_cached(struct kr_context *ctx, struct kr_zonecut *cut,
 KR_EXPORT
 bool kr_zonecut_is_empty(struct kr_zonecut *cut);
 
+/**
+ * Get the count of labels below the zone to reveal to its servers.
+ *
+ * It's 1 unless the zone answered for a deeper name without a delegation,
+ * i.e. the names are in the zone itself and there's no cut to look for.
+ * @param cache   depth LRU cache, may be NULL
+ * @param zone    zone cut name
+ * @return the count of labels, at least 1
+ */
+KR_EXPORT
+unsigned kr_zonecut_get_depth(kr_cut_depth_lru_t *cache, const knot_dname_t *zone);
+
+/**
+ * Learn the count of labels below the zone to reveal to its servers.
+ *
+ * @param cache   depth LRU cache, may be NULL
+ * @param zone    zone cut name
+ * @param labels  labels below the zone that are either delegated (a referral
+ *                came for them) or that aren't (+1, an answer came)
+ */
+KR_EXPORT
+void kr_zonecut_set_depth(kr_cut_depth_lru_t *cache, const knot_dname_t *zone,
+			  unsigned labels);
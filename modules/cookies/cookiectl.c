@@ -454,6 +454,9 @@ static void update_running(struct kr_cookie_settings *running,
 	running->recent.secr = NULL;
 
 	running->recent.alg_id = running->current.alg_id;
+	running->recent.gen = running->current.gen;
+	/* Cookies computed with the previous generation are recomputed. */
+	running->current.gen = (running->current.gen + 1) ? running->current.gen + 1 : 1;
 	if (alg_lookup) {
 		assert(alg_lookup->id >= 0);
 		running->current.alg_id = alg_lookup->id;
@@ -653,9 +656,11 @@ int config_init(struct kr_cookie_ctx *ctx)
 
 	ctx->clnt.current.secr = cs;
 	ctx->clnt.current.alg_id = clookup->id;
+	ctx->clnt.current.gen = 1;
 
 	ctx->srvr.current.secr = ss;
 	ctx->srvr.current.alg_id = slookup->id;
+	ctx->srvr.current.gen = 1;
 
 	return kr_ok();
 }
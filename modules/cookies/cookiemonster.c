@@ -60,6 +60,7 @@ static const struct sockaddr *passed_server_sockaddr(const struct kr_request *re
  * @param cc         client cookie from the response
  * @param cc_len     client cookie size
  * @param clnt_sett  client cookie settings structure
+ * @param cache      cookie cache, holds the cookies computed for the current settings
  * @retval  1 if cookie matches current settings
  * @retval  0 if cookie matches recent settings
  * @return -1 if cookie does not match
@@ -67,7 +68,8 @@ static const struct sockaddr *passed_server_sockaddr(const struct kr_request *re
  */
 static int srvr_sockaddr_cc_check(const struct sockaddr *srvr_sa,
                                   const uint8_t *cc, uint16_t cc_len,
-                                  const struct kr_cookie_settings *clnt_sett)
+                                  const struct kr_cookie_settings *clnt_sett,
+                                  kr_cookie_lru_t *cache)
 {
 	assert(cc && cc_len > 0 && clnt_sett);
 
@@ -78,23 +80,24 @@ static int srvr_sockaddr_cc_check(const struct sockaddr *srvr_sa,
 	assert(clnt_sett->current.secr);
 
 	/* The address must correspond with the client cookie. */
-	struct knot_cc_input input = {
-		.clnt_sockaddr = NULL, /* Not supported yet. */
-		.srvr_sockaddr = srvr_sa,
-		.secret_data = clnt_sett->current.secr->data,
-		.secret_len = clnt_sett->current.secr->size
-	};
-
-	const struct knot_cc_alg *cc_alg = kr_cc_alg_get(clnt_sett->current.alg_id);
-	if (!cc_alg) {
+	uint8_t current_cc[KNOT_OPT_COOKIE_CLNT];
+	int ret = kr_cookie_cc_get(&clnt_sett->current, cache,
+	                           NULL, /* Not supported yet. */
+	                           srvr_sa, current_cc);
+	if (ret != kr_ok()) {
 		return -2;
 	}
 	int comp_ret = -1; /* Cookie does not match. */
-	int ret = knot_cc_check(cc, cc_len, &input, cc_alg);
-	if (ret == KNOT_EOK) {
+	if (cc_len == KNOT_OPT_COOKIE_CLNT &&
+	    0 == memcmp(cc, current_cc, KNOT_OPT_COOKIE_CLNT)) {
 		comp_ret = 1;
 	} else {
-		cc_alg = kr_cc_alg_get(clnt_sett->recent.alg_id);
+		/* Rare, only until the servers see the current cookie. */
+		struct knot_cc_input input = {
+			.clnt_sockaddr = NULL,
+			.srvr_sockaddr = srvr_sa,
+		};
+		const struct knot_cc_alg *cc_alg = kr_cc_alg_get(clnt_sett->recent.alg_id);
 		if (clnt_sett->recent.secr && cc_alg) {
 			input.secret_data = clnt_sett->recent.secr->data;
 			input.secret_len = clnt_sett->recent.secr->size;
@@ -193,7 +196,7 @@ static bool check_cookie_content_and_cache(const struct kr_cookie_settings *clnt
 	/* Check server address against received client cookie. */
 	const struct sockaddr *srvr_sockaddr = passed_server_sockaddr(req);
 	ret = srvr_sockaddr_cc_check(srvr_sockaddr, pkt_cc, pkt_cc_len,
-	                             clnt_sett);
+	                             clnt_sett, cache);
 	if (ret < 0) {
 		VERBOSE_MSG(NULL, "%s\n", "could not match received cookie");
 		return false;
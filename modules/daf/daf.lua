@@ -1,10 +1,16 @@
 -- Load dependent modules
-if not view then modules.load('view') end
 if not policy then modules.load('policy') end
 
+local ffi = require('ffi')
+local C = ffi.C
+
 -- Actions
 local actions = {
-	pass = 1, deny = 2, drop = 3, tc = 4, truncate = 4,
+	pass = function () return policy.PASS end,
+	deny = function () return policy.DENY end,
+	drop = function () return policy.DROP end,
+	tc = function () return policy.TC end,
+	truncate = function () return policy.TC end,
 	forward = function (g)
 		local addrs = {}
 		local tok = g()
@@ -40,29 +46,61 @@ local actions = {
 	end,
 }
 
+-- Lua patterns can't be compiled, the filters call back for them
+local patterns, pattern_ids = {}, {}
+local pattern_cb = ffi.cast('kr_filter_cb', function (_, qry, arg)
+	return qry ~= nil and string.find(qry:name(), patterns[arg]) ~= nil
+end)
+
+local function pattern_id(pattern)
+	if not pattern_ids[pattern] then
+		table.insert(patterns, pattern)
+		pattern_ids[pattern] = #patterns
+	end
+	return pattern_ids[pattern]
+end
+
+-- Instruction of a filter program, see lib/filter.h
+local function insn(op, arg, num)
+	return {op=op, arg=arg, num=num or 0}
+end
+
 -- Filter rules per column
 local filters = {
 	-- Filter on QNAME (either pattern or suffix match)
 	qname = function (g)
 		local op, val = g(), todname(g())
-		if     op == '~' then return policy.pattern(true, val:sub(2)) -- Skip leading label length
-		elseif op == '=' then return policy.suffix(true, {val})
+		if     op == '~' then return insn(C.KR_FILTER_CALLBACK, nil, pattern_id(val:sub(2))) -- Skip leading label length
+		elseif op == '=' then return insn(C.KR_FILTER_QNAME, val)
 		else error(string.format('invalid operator "%s" on qname', op)) end
 	end,
+	-- Filter on QTYPE
+	qtype = function (g)
+		local op, val = g(), g()
+		if op ~= '=' then error('qtype supports only "=" operator') end
+		local qtype = val and kres.type[val:upper()]
+		if not qtype then error(string.format('invalid qtype "%s"', tostring(val))) end
+		return insn(C.KR_FILTER_QTYPE, nil, qtype)
+	end,
 	-- Filter on source address
 	src = function (g)
 		local op = g()
 		if op ~= '=' then error('address supports only "=" operator') end
-		return view.rule_src(true, g())
+		return insn(C.KR_FILTER_SRC, g())
 	end,
 	-- Filter on destination address
 	dst = function (g)
 		local op = g()
 		if op ~= '=' then error('address supports only "=" operator') end
-		return view.rule_dst(true, g())
+		return insn(C.KR_FILTER_DST, g())
 	end,
 }
 
+local conjunctions = {
+	['and'] = C.KR_FILTER_AND,
+	['or'] = C.KR_FILTER_OR,
+}
+
 local function parse_filter(tok, g, prev)
 	if not tok then error(string.format('expected filter after "%s"', prev)) end
 	local filter = filters[tok:lower()]
@@ -72,40 +110,34 @@ end
 
 local function parse_rule(g)
 	-- Allow action without filter
+	local prog = {}
 	local tok = g()
 	if not filters[tok:lower()] then
-		return tok, nil
+		return tok, prog
 	end
-	local f = parse_filter(tok, g)
-	-- Compose filter functions on conjunctions
+	table.insert(prog, parse_filter(tok, g))
+	-- Conjunctions follow both of their operands (postfix notation)
 	-- or terminate filter chain and return
 	tok = g()
 	while tok do
-		if tok:lower() == 'and' then
-			local fa, fb = f, parse_filter(g(), g, tok)
-			f = function (req, qry) return fa(req, qry) and fb(req, qry) end
-		elseif tok:lower() == 'or' then
-			local fa, fb = f, parse_filter(g(), g, tok)
-			f = function (req, qry) return fa(req, qry) or fb(req, qry) end
-		else
+		local conj = conjunctions[tok:lower()]
+		if not conj then
 			break
 		end
+		table.insert(prog, parse_filter(g(), g, tok))
+		table.insert(prog, insn(conj))
 		tok = g()
 	end
-	return tok, f
+	return tok, prog
 end
 
 local function parse_query(g)
-	local ok, actid, filter = pcall(parse_rule, g)
+	local ok, actid, prog = pcall(parse_rule, g)
 	if not ok then return nil, actid end
 	actid = actid:lower()
 	if not actions[actid] then return nil, string.format('invalid action "%s"', actid) end
 	-- Parse and interpret action
-	local action = actions[actid]
-	if type(action) == 'function' then
-		action = action(g)
-	end
-	return actid, action, filter
+	return actid, actions[actid](g), prog
 end
 
 -- Compile a rule described by query language
@@ -121,9 +153,46 @@ local function compile(query)
 	return parse_query(g)
 end
 
+-- Rules are matched in C, the whole list is a single policy rule
+local function rule_list(postrule)
+	return {
+		filter = ffi.gc(C.kr_filter_create(pattern_cb), C.kr_filter_free),
+		actions = {},
+		postrule = postrule,
+	}
+end
+local lists = {rules = rule_list(false), postrules = rule_list(true)}
+local next_id = 1
+
+-- @function Policy rule evaluating the list
+-- The filters may call back into Lua, so this must not be compiled
+local function evaluate(list)
+	local matched = ffi.new('uint32_t[1]')
+	local function matches(req, qry, continue)
+		local match = continue and C.kr_filter_next or C.kr_filter_match
+		return match(list.filter, req, qry, matched) == 0
+	end
+	return function (req, qry)
+		if not matches(req, qry) then
+			return nil
+		end
+		return function (state)
+			-- Chain actions (e.g. mirror) continue with the next matching rule
+			repeat
+				local next_state = list.actions[matched[0]](state, req)
+				if next_state then
+					return next_state
+				end
+			until not matches(req, qry, true)
+			return nil
+		end
+	end
+end
+jit.off(evaluate, true)
+
 -- @function Describe given rule for presentation
 local function rule_info(r)
-	return {info=r.info, id=r.rule.id, active=(r.rule.suspended ~= true), count=r.rule.count}
+	return {info=r.info, id=r.id, active=r.active, count=tonumber(C.kr_filter_count(r.list.filter, r.id))}
 end
 
 -- Module declaration
@@ -131,8 +200,6 @@ local M = {
 	rules = {}
 }
 
--- @function Remove a rule
-
 -- @function Cleanup module
 function M.deinit()
 	if http and http.endpoints then
@@ -148,36 +215,46 @@ function M.add(rule)
 	for _, r in ipairs(M.rules) do
 		if r.info == rule then return r end
 	end
-	local id, action, filter = compile(rule)
-	if not id then error(action) end
-	-- Combine filter and action into policy
-	local p
-	if filter then
-		p = function (req, qry)
-			return filter(req, qry) and action
-		end
-	else
-		p = function ()
-			return action
-		end
+	local actid, action, prog = compile(rule)
+	if not actid then error(action) end
+	-- Special actions are postrules
+	local list = lists.rules
+	if actid == 'reroute' or actid == 'rewrite' then
+		list = lists.postrules
+	end
+	local id = next_id
+	local ret = C.kr_filter_add(list.filter, id)
+	for _, i in ipairs(prog) do
+		if ret ~= 0 then break end
+		ret = C.kr_filter_push(list.filter, id, i.op, i.arg, i.num)
 	end
-	local desc = {info=rule, policy=p}
-	-- Enforce in policy module, special actions are postrules
-	if id == 'reroute' or id == 'rewrite' then
-		desc.rule = policy.add(p, true)
-	else
-		desc.rule = policy.add(p)
+	if ret ~= 0 then
+		C.kr_filter_del(list.filter, id)
+		error(string.format('invalid rule "%s": %s', rule, ffi.string(C.knot_strerror(ret))))
 	end
+	next_id = next_id + 1
+	list.actions[id] = action
+	-- Enforce in policy module
+	if not list.rule then
+		list.rule = policy.add(evaluate(list), list.postrule)
+	end
+	local desc = {info=rule, id=id, active=true, list=list}
 	table.insert(M.rules, desc)
 	return desc
 end
 
 -- @function Remove a rule
 function M.del(id)
-	for _, r in ipairs(M.rules) do
-		if r.rule.id == id then
-			policy.del(id)
-			table.remove(M.rules, id)
+	for i, r in ipairs(M.rules) do
+		if r.id == id then
+			local list = r.list
+			C.kr_filter_del(list.filter, id)
+			list.actions[id] = nil
+			table.remove(M.rules, i)
+			if next(list.actions) == nil then
+				policy.del(list.rule.id)
+				list.rule = nil
+			end
 			return true
 		end
 	end
@@ -186,7 +263,7 @@ end
 -- @function Find a rule
 function M.get(id)
 	for _, r in ipairs(M.rules) do
-		if r.rule.id == id then
+		if r.id == id then
 			return r
 		end
 	end
@@ -195,8 +272,9 @@ end
 -- @function Enable/disable a rule
 function M.toggle(id, val)
 	for _, r in ipairs(M.rules) do
-		if r.rule.id == id then
-			r.rule.suspended = not val
+		if r.id == id then
+			r.active = val and true or false
+			C.kr_filter_set_active(r.list.filter, id, r.active)
 			return true
 		end
 	end
@@ -210,6 +288,16 @@ function M.enable(id)
 	return M.toggle(id, true)
 end
 
+-- @function Return match counts of the rules
+function M.counts()
+	local ret = {}
+	for _, r in ipairs(M.rules) do
+		-- Must have string keys for JSON object and not an array
+		ret[tostring(r.id)] = rule_info(r).count
+	end
+	return ret
+end
+
 local function consensus(op, ...)
 	local ret = true
 	local results = map(string.format(op, ...))
@@ -284,11 +372,9 @@ end
 
 local function getmatches()
 	local update = {}
-	for _, rules in ipairs(map 'daf.rules') do
-		for _, r in ipairs(rules) do
-			local id = tostring(r.rule.id)
-			-- Must have string keys for JSON object and not an array
-			update[id] = (update[id] or 0) + r.rule.count
+	for _, counts in ipairs(map 'daf.counts()') do
+		for id, count in pairs(counts) do
+			update[id] = (update[id] or 0) + count
 		end
 	end
 	return update
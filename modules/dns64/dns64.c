@@ -0,0 +1,410 @@
+/*  Copyright (C) 2016-2017 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file dns64.c
+ * @brief AAAA synthesis from A records for the clients behind NAT64 (RFC 6147).
+ *
+ * An AAAA query without AAAA records in the answer (or with excluded ones only)
+ * gets an A sub-query; the AAAA records are synthesized from its answer,
+ * embedding the IPv4 addresses into the prefix (RFC 6052).
+ *
+ * The synthesized records are also cached, under a private RR type of the same
+ * name with the TTL of the A records, so the next AAAA query is answered at once.
+ */
+
+#include <arpa/inet.h>
+#include <ccan/json/json.h>
+#include <libknot/descriptor.h>
+#include <libknot/packet/pkt.h>
+
+#include "lib/cache/api.h"
+#include "lib/layer.h"
+#include "lib/module.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "dns64",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][dns64] " fmt, ## __VA_ARGS__)
+
+/** The cache key of synthesized AAAA records, in the private use range. */
+#define DNS64_RRTYPE 65344
+/** Excluded by default, RFC 6147 5.1.4 */
+#define DNS64_EXCLUDE_DEFAULT "::ffff:0:0/96"
+
+struct dns64_data {
+	bool enabled;
+	uint8_t prefix[16];
+	int prefix_len;             /**< 32, 40, 48, 56, 64 or 96 (RFC 6052 2.2) */
+	struct kr_subnets *exclude; /**< AAAA records treated as missing, A not synthesized */
+	uint64_t synthesized;       /**< AAAA records */
+	uint64_t cached;            /**< answers from the cached AAAA records */
+};
+
+/** Embed the IPv4 address into the prefix, RFC 6052 2.2 */
+static void synth_addr(const struct dns64_data *data, const uint8_t *ip4, uint8_t *out)
+{
+	memset(out, 0, 16);
+	memcpy(out, data->prefix, data->prefix_len / 8);
+	int pos = data->prefix_len / 8;
+	for (int i = 0; i < 4; ++i, ++pos) {
+		if (pos == 8) {
+			++pos; /* bits 64 to 71 are zero */
+		}
+		out[pos] = ip4[i];
+	}
+}
+
+static bool is_excluded(const struct dns64_data *data, int family, const uint8_t *addr)
+{
+	if (!data->exclude) {
+		return false;
+	}
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	ss.ss_family = family;
+	memcpy((char *)kr_inaddr((struct sockaddr *)&ss), addr, kr_family_len(family));
+	uint32_t id;
+	return kr_subnets_match(data->exclude, (struct sockaddr *)&ss, &id) == 0;
+}
+
+/** Whether the answer has no AAAA records, not counting the excluded ones. */
+static bool no_usable_aaaa(const struct dns64_data *data, const knot_pkt_t *pkt, bool *excluded)
+{
+	const knot_pktsection_t *an = knot_pkt_section(pkt, KNOT_ANSWER);
+	*excluded = false;
+	for (unsigned i = 0; i < an->count; ++i) {
+		const knot_rrset_t *rr = knot_pkt_rr(an, i);
+		if (rr->type == KNOT_RRTYPE_RRSIG) {
+			continue;
+		}
+		if (rr->type != KNOT_RRTYPE_AAAA) {
+			return false; /* e.g. a CNAME */
+		}
+		for (uint16_t k = 0; k < rr->rrs.rr_count; ++k) {
+			const knot_rdata_t *rd = knot_rdataset_at(&rr->rrs, k);
+			if (knot_rdata_rdlen(rd) != 16
+			    || !is_excluded(data, AF_INET6, knot_rdata_data(rd))) {
+				return false;
+			}
+		}
+		*excluded = true;
+	}
+	return true;
+}
+
+/** Don't put the excluded AAAA records of the query into the answer. */
+static void drop_aaaa(struct kr_request *req, const struct kr_query *qry)
+{
+	for (size_t i = 0; i < req->answ_selected.len; ++i) {
+		ranked_rr_array_entry_t *entry = req->answ_selected.at[i];
+		if (entry->qry_uid == qry->uid && entry->rr->type == KNOT_RRTYPE_AAAA) {
+			entry->to_wire = false;
+		}
+	}
+}
+
+/** Synthesize the AAAA records from the A records in the answer of the sub-query. */
+static int synthesize(struct dns64_data *data, struct kr_request *req,
+		      struct kr_query *qry, const knot_pkt_t *pkt)
+{
+	const knot_pktsection_t *an = knot_pkt_section(pkt, KNOT_ANSWER);
+	for (unsigned i = 0; i < an->count; ++i) {
+		const knot_rrset_t *orig = knot_pkt_rr(an, i);
+		if (orig->type != KNOT_RRTYPE_A) {
+			continue;
+		}
+		/* The owner is only referenced, kr_ranked_rrarray_add() copies the set. */
+		knot_rrset_t rr;
+		knot_rrset_init(&rr, orig->owner, KNOT_RRTYPE_AAAA, orig->rclass);
+		const uint32_t ttl = knot_rrset_ttl(orig);
+		for (uint16_t k = 0; k < orig->rrs.rr_count; ++k) {
+			const knot_rdata_t *rd = knot_rdataset_at(&orig->rrs, k);
+			if (knot_rdata_rdlen(rd) != 4
+			    || is_excluded(data, AF_INET, knot_rdata_data(rd))) {
+				continue;
+			}
+			uint8_t addr[16];
+			synth_addr(data, knot_rdata_data(rd), addr);
+			int ret = knot_rrset_add_rdata(&rr, addr, sizeof(addr), ttl, &req->pool);
+			if (ret != 0) {
+				return kr_error(ENOMEM);
+			}
+		}
+		if (knot_rrset_empty(&rr)) {
+			continue;
+		}
+		data->synthesized += rr.rrs.rr_count;
+		int ret = kr_ranked_rrarray_add(&req->answ_selected, &rr, KR_RANK_OMIT,
+						true, qry->uid, &req->pool);
+		if (ret < 0) {
+			return ret;
+		}
+		/* Cache only the records of the name itself, not after a CNAME. */
+		if (!qry->flags.NO_CACHE && kr_cache_is_open(&req->ctx->cache)
+		    && knot_dname_is_equal(orig->owner, qry->sname)) {
+			rr.type = DNS64_RRTYPE;
+			/* Synthesized records are never secure. */
+			(void) kr_cache_insert_rr(&req->ctx->cache, &rr, NULL,
+						  KR_RANK_INSECURE | KR_RANK_AUTH,
+						  qry->timestamp.tv_sec);
+			kr_cache_sync(&req->ctx->cache);
+		}
+	}
+	return kr_ok();
+}
+
+static int consume(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+	struct kr_module *module = ctx->api->data;
+	struct dns64_data *data = module->data;
+	if (ctx->state & KR_STATE_FAIL || !data->enabled || !qry || !qry->flags.RESOLVED) {
+		return ctx->state;
+	}
+	/* Synthetic AAAA from marked A responses */
+	if (qry->flags.DNS64_MARK) {
+		if (synthesize(data, req, qry, pkt) != 0) {
+			VERBOSE_MSG(qry, "=> failed to synthesize AAAA\n");
+		}
+		return ctx->state;
+	}
+	/* Observe AAAA NODATA responses */
+	bool excluded = false;
+	if (qry->stype != KNOT_RRTYPE_AAAA || qry->parent != NULL
+	    || knot_wire_get_rcode(pkt->wire) != KNOT_RCODE_NOERROR
+	    || !knot_dname_is_equal(knot_pkt_qname(pkt), qry->sname)
+	    || !no_usable_aaaa(data, pkt, &excluded)) {
+		return ctx->state;
+	}
+	if (excluded) {
+		drop_aaaa(req, qry);
+	}
+	struct kr_query *next = kr_rplan_push(&req->rplan, qry, qry->sname,
+					      KNOT_CLASS_IN, KNOT_RRTYPE_A);
+	if (!next) {
+		return ctx->state;
+	}
+	next->flags.DNSSEC_WANT = qry->flags.DNSSEC_WANT;
+	next->flags.AWAIT_CUT = true;
+	next->flags.DNS64_MARK = true;
+	return ctx->state;
+}
+
+/** Answer from the synthesized records in cache, like from hints. */
+static int produce(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+	struct kr_module *module = ctx->api->data;
+	struct dns64_data *data = module->data;
+	if (ctx->state & (KR_STATE_FAIL | KR_STATE_DONE) || !data->enabled || !qry
+	    || qry->stype != KNOT_RRTYPE_AAAA || qry->sclass != KNOT_CLASS_IN
+	    || qry->parent != NULL || qry->flags.NO_CACHE || qry->flags.DNS64_MARK
+	    || knot_wire_get_qr(pkt->wire)) {
+		return ctx->state;
+	}
+	struct kr_cache *cache = &req->ctx->cache;
+	struct kr_cache_p peek;
+	if (!kr_cache_is_open(cache) || kr_cache_peek_exact(cache, qry->sname, DNS64_RRTYPE, &peek) != 0) {
+		return ctx->state;
+	}
+	const int32_t new_ttl = kr_cache_ttl(&peek, qry, qry->sname, DNS64_RRTYPE);
+	if (new_ttl < 0) {
+		return ctx->state;
+	}
+	knot_rrset_t rr;
+	knot_rrset_init(&rr, knot_dname_copy(qry->sname, &pkt->mm), KNOT_RRTYPE_AAAA,
+			KNOT_CLASS_IN);
+	if (!rr.owner || kr_cache_materialize(&rr.rrs, &peek, new_ttl, &pkt->mm) < 0) {
+		return ctx->state;
+	}
+	/* Synthesized with a different prefix, before a reconfiguration. */
+	const knot_rdata_t *rd = knot_rdataset_at(&rr.rrs, 0);
+	if (knot_rdata_rdlen(rd) != 16
+	    || memcmp(knot_rdata_data(rd), data->prefix, data->prefix_len / 8) != 0) {
+		knot_rrset_clear(&rr, &pkt->mm);
+		return ctx->state;
+	}
+	if (!knot_dname_is_equal(knot_pkt_qname(pkt), rr.owner)) {
+		kr_pkt_recycle(pkt);
+		knot_pkt_put_question(pkt, rr.owner, rr.rclass, rr.type);
+	}
+	if (knot_pkt_put(pkt, KNOT_COMPR_HINT_QNAME, &rr, KNOT_PF_FREE) != 0) {
+		knot_rrset_clear(&rr, &pkt->mm);
+		return ctx->state;
+	}
+	VERBOSE_MSG(qry, "<= answered from synthesized AAAA, new TTL %d\n", new_ttl);
+	data->cached += 1;
+	qry->flags.DNSSEC_WANT = false; /* Never authenticated */
+	qry->flags.CACHED = true;
+	qry->flags.NO_MINIMIZE = true;
+	pkt->parsed = pkt->size;
+	knot_wire_set_qr(pkt->wire);
+	return KR_STATE_DONE;
+}
+
+/** Parse the prefix, a plain address is a /96 one. */
+static int parse_prefix(struct dns64_data *data, const char *str)
+{
+	uint8_t addr[16] = { 0 };
+	if (kr_straddr_family(str) != AF_INET6) {
+		return kr_error(EINVAL);
+	}
+	int len = kr_straddr_subnet(addr, str);
+	if (len == 128 && !strchr(str, '/')) {
+		len = 96;
+	}
+	if (len != 32 && len != 40 && len != 48 && len != 56 && len != 64 && len != 96) {
+		return kr_error(EINVAL);
+	}
+	memcpy(data->prefix, addr, sizeof(addr));
+	data->prefix_len = len;
+	return kr_ok();
+}
+
+static struct kr_subnets *parse_exclude(const JsonNode *node)
+{
+	struct kr_subnets *sn = kr_subnets_create();
+	if (!sn) {
+		return NULL;
+	}
+	if (!node) {
+		if (kr_subnets_add(sn, DNS64_EXCLUDE_DEFAULT, 0) != 0) {
+			kr_subnets_free(sn);
+			return NULL;
+		}
+		return sn;
+	}
+	uint32_t id = 0;
+	const JsonNode *item;
+	json_foreach(item, node) {
+		if (item->tag != JSON_STRING || kr_subnets_add(sn, item->string_, id++) != 0) {
+			ERR_MSG("invalid exclusion '%s'\n",
+				item->tag == JSON_STRING ? item->string_ : "");
+			kr_subnets_free(sn);
+			return NULL;
+		}
+	}
+	return sn;
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *dns64_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.produce = &produce,
+		.consume = &consume,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int dns64_init(struct kr_module *module)
+{
+	struct dns64_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	module->data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int dns64_deinit(struct kr_module *module)
+{
+	struct dns64_data *data = module->data;
+	if (data) {
+		kr_subnets_free(data->exclude);
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+/** Either the prefix, or { prefix = '64:ff9b::/96', exclude = { subnets... } } */
+KR_EXPORT
+int dns64_config(struct kr_module *module, const char *conf)
+{
+	struct dns64_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	struct dns64_data parsed = *data;
+	const JsonNode *exclude = NULL;
+	JsonNode *root = NULL;
+	int ret = kr_ok();
+	if (conf[0] == '{') {
+		root = json_decode(conf);
+		const JsonNode *prefix = root ? json_find_member(root, "prefix") : NULL;
+		if (!prefix || prefix->tag != JSON_STRING) {
+			ERR_MSG("expected { prefix = '...', exclude = { ... } }\n");
+			json_delete(root);
+			return kr_error(EINVAL);
+		}
+		ret = parse_prefix(&parsed, prefix->string_);
+		exclude = json_find_member(root, "exclude");
+	} else {
+		ret = parse_prefix(&parsed, conf);
+	}
+	if (ret != 0) {
+		ERR_MSG("invalid NAT64 prefix, expected an IPv6 /32, /40, /48, /56, /64 or /96\n");
+		json_delete(root);
+		return ret;
+	}
+	struct kr_subnets *sn = parse_exclude(exclude);
+	json_delete(root);
+	if (!sn) {
+		return kr_error(EINVAL);
+	}
+	kr_subnets_free(data->exclude);
+	*data = parsed;
+	data->exclude = sn;
+	data->enabled = true;
+	return kr_ok();
+}
+
+static char *dns64_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct dns64_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "synthesized", json_mknumber(data->synthesized));
+	json_append_member(root, "cached", json_mknumber(data->cached));
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+KR_EXPORT
+struct kr_prop *dns64_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &dns64_stats, "stats", "Get the counters of synthesized records in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(dns64);
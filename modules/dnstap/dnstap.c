@@ -17,6 +17,7 @@
  *
  */
 
+#include "daemon/worker.h"
 #include "lib/module.h"
 #include "lib/layer.h"
 #include "lib/resolve.h"
@@ -28,20 +29,70 @@
 #define DEBUG_MSG(fmt, ...) kr_log_verbose("[dnstap] " fmt, ##__VA_ARGS__);
 #define CFG_SOCK_PATH "socket_path"
 #define CFG_LOG_RESP_PKT "log_responses"
+#define CFG_SAMPLE_RATE "sample_rate"
+#define CFG_LOG_UPSTREAM "log_upstream"
 #define DEFAULT_SOCK_PATH "/tmp/dnstap.sock"
 #define DNSTAP_CONTENT_TYPE "protobuf:dnstap.Dnstap"
 #define DNSTAP_INITIAL_BUF_SIZE         256
+#define DNSTAP_RING_SIZE 1024   /**< Frame buffers, also the fstrm queue size (a power of two) */
+#define DNSTAP_FRAME_SIZE 4096  /**< Larger frames are allocated */
 
 #define auto_destroy_uopts __attribute__((cleanup(fstrm_unix_writer_options_destroy)))
 #define auto_destroy_wopts __attribute__((cleanup(fstrm_writer_options_destroy)))
 
+/* Buffer of a frame, owned by the fstrm I/O thread until it's written */
+struct dnstap_frame {
+	uint8_t busy;
+	uint8_t data[DNSTAP_FRAME_SIZE];
+};
+
+/* Counters, also exported to the shared statistics */
+enum dnstap_counter { DNSTAP_SENT, DNSTAP_DROPPED, DNSTAP_COUNTERS };
+static const char *counter_names[DNSTAP_COUNTERS] = {
+	"dnstap.sent", "dnstap.dropped",
+};
+
 /* Internal data structure */
 struct dnstap_data {
 	bool log_resp_pkt;
+	bool log_upstream;      /* log the queries to upstream and their responses */
+	uint32_t sample_rate;   /* log every n-th response */
+	uint32_t sampled;       /* responses since the last logged one */
 	struct fstrm_iothr *iothread;
 	struct fstrm_iothr_queue *ioq;
+	struct dnstap_frame *ring;
+	uint32_t ring_head;     /* next frame to use */
+	uint64_t counters[DNSTAP_COUNTERS];
+	int shared[DNSTAP_COUNTERS];
 };
 
+static void count(struct dnstap_data *data, enum dnstap_counter c)
+{
+	worker_counter_inc(data->counters, data->shared, c);
+}
+
+/* frame_get returns the next free frame of the ring, or NULL if the I/O thread
+ * is behind; the frames are written (and released) in the order of submission,
+ * so it's enough to look at the oldest one.
+ */
+static struct dnstap_frame *frame_get(struct dnstap_data *data)
+{
+	struct dnstap_frame *frame = &data->ring[data->ring_head];
+	if (__atomic_load_n(&frame->busy, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	frame->busy = 1;
+	data->ring_head = (data->ring_head + 1) % DNSTAP_RING_SIZE;
+	return frame;
+}
+
+/* frame_release is called by the I/O thread once the frame is written */
+static void frame_release(void *buf, void *free_data)
+{
+	struct dnstap_frame *frame = free_data;
+	__atomic_store_n(&frame->busy, 0, __ATOMIC_RELEASE);
+}
+
 /*
  * dt_pack packs the dnstap message for transport
  * https://gitlab.labs.nic.cz/knot/knot-dns/blob/master/src/contrib/dnstap/dnstap.c#L24
@@ -86,18 +137,159 @@ static void set_address(const struct sockaddr *sockaddr,
 	*has_port = true;
 }
 
+/* dnstap_submit packs the message and sends it to fstrm */
+static void dnstap_submit(struct dnstap_data *dnstap_dt, Dnstap__Message *m) {
+	/* Create a dnstap Message */
+	Dnstap__Dnstap dnstap = DNSTAP__DNSTAP__INIT;
+	dnstap.type = DNSTAP__DNSTAP__TYPE__MESSAGE;
+	dnstap.message = m;
+
+	/* Pack the message into a frame of the ring, allocate only the large ones */
+	size_t size = dnstap__dnstap__get_packed_size(&dnstap);
+	struct dnstap_frame *ring_frame = NULL;
+	uint8_t *frame = NULL;
+	if (size <= DNSTAP_FRAME_SIZE) {
+		ring_frame = frame_get(dnstap_dt);
+		if (!ring_frame) {
+			count(dnstap_dt, DNSTAP_DROPPED);
+			return;
+		}
+		frame = ring_frame->data;
+		dnstap__dnstap__pack(&dnstap, frame);
+	} else if (!dt_pack(&dnstap, &frame, &size)) {
+		count(dnstap_dt, DNSTAP_DROPPED);
+		return;
+	}
+
+	/* Submit a request to send message to fstrm_iothr,
+	 * drop it if the queue is full rather than wait */
+	fstrm_res res = fstrm_iothr_submit(dnstap_dt->iothread, dnstap_dt->ioq, frame, size,
+			ring_frame ? frame_release : fstrm_free_wrapper, ring_frame);
+	if (res != fstrm_res_success) {
+		DEBUG_MSG("Error submitting dnstap message to iothr\n");
+		if (ring_frame) {
+			frame_release(frame, ring_frame);
+		} else {
+			free(frame);
+		}
+		count(dnstap_dt, DNSTAP_DROPPED);
+		return;
+	}
+	count(dnstap_dt, DNSTAP_SENT);
+}
+
+/* set_time fills in a timestamp of dnstap_message */
+static void set_time(const struct timeval *tv,
+		uint64_t *sec, protobuf_c_boolean *has_sec,
+		uint32_t *nsec, protobuf_c_boolean *has_nsec) {
+	*sec = tv->tv_sec;
+	*has_sec = true;
+	*nsec = tv->tv_usec * 1000;
+	*has_nsec = true;
+}
+
+/* set_upstream fills in the upstream server, the zone and the transport */
+static void set_upstream(Dnstap__Message *m, const struct kr_query *qry,
+		const struct sockaddr *addr, bool tcp) {
+	set_address(addr, &m->response_address, &m->has_response_address,
+			&m->response_port, &m->has_response_port);
+	m->socket_family = addr->sa_family == AF_INET6 ?
+		DNSTAP__SOCKET_FAMILY__INET6 : DNSTAP__SOCKET_FAMILY__INET;
+	m->has_socket_family = true;
+	m->socket_protocol = tcp ? DNSTAP__SOCKET_PROTOCOL__TCP : DNSTAP__SOCKET_PROTOCOL__UDP;
+	m->has_socket_protocol = true;
+	if (qry->zone_cut.name) {
+		m->query_zone.data = (uint8_t *)qry->zone_cut.name;
+		m->query_zone.len = knot_dname_size(qry->zone_cut.name);
+		m->has_query_zone = true;
+	}
+}
+
+/* upstream_sampled decides on both the query and its response by the message ID */
+static bool upstream_sampled(const struct dnstap_data *dnstap_dt, const knot_pkt_t *pkt) {
+	return dnstap_dt->log_upstream && dnstap_dt->iothread && dnstap_dt->ioq &&
+		knot_wire_get_id(pkt->wire) % dnstap_dt->sample_rate == 0;
+}
+
+/* dnstap_log_query logs the query to upstream, referencing the outgoing wire */
+static int dnstap_log_query(kr_layer_t *ctx, knot_pkt_t *pkt, struct sockaddr *dst, int type) {
+	const struct kr_module *module = ctx->api->data;
+	struct dnstap_data *dnstap_dt = module->data;
+	struct kr_query *qry = ctx->req->current_query;
+	if (!qry || !dst || !upstream_sampled(dnstap_dt, pkt)) {
+		return ctx->state;
+	}
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	Dnstap__Message m;
+	memset(&m, 0, sizeof(m));
+	m.base.descriptor = &dnstap__message__descriptor;
+	m.type = DNSTAP__MESSAGE__TYPE__RESOLVER_QUERY;
+	set_upstream(&m, qry, dst, type == SOCK_STREAM);
+	set_time(&now, &m.query_time_sec, &m.has_query_time_sec,
+			&m.query_time_nsec, &m.has_query_time_nsec);
+	m.query_message.data = pkt->wire;
+	m.query_message.len = pkt->size;
+	m.has_query_message = true;
+
+	dnstap_submit(dnstap_dt, &m);
+	return ctx->state;
+}
+
+/* dnstap_log_response logs the upstream response, referencing the received wire */
+static int dnstap_log_response(kr_layer_t *ctx, knot_pkt_t *pkt) {
+	const struct kr_request *req = ctx->req;
+	const struct kr_module *module = ctx->api->data;
+	struct dnstap_data *dnstap_dt = module->data;
+	struct kr_query *qry = req->current_query;
+	/* the upstream address is set only for responses from the network */
+	if (!qry || !pkt || !req->upstream.addr || !upstream_sampled(dnstap_dt, pkt)) {
+		return ctx->state;
+	}
+
+	struct timeval now, rtt, sent;
+	gettimeofday(&now, NULL);
+	rtt.tv_sec = req->upstream.rtt / 1000;
+	rtt.tv_usec = (req->upstream.rtt % 1000) * 1000;
+	timersub(&now, &rtt, &sent);
+
+	Dnstap__Message m;
+	memset(&m, 0, sizeof(m));
+	m.base.descriptor = &dnstap__message__descriptor;
+	m.type = DNSTAP__MESSAGE__TYPE__RESOLVER_RESPONSE;
+	set_upstream(&m, qry, req->upstream.addr, qry->flags.TCP);
+	set_time(&sent, &m.query_time_sec, &m.has_query_time_sec,
+			&m.query_time_nsec, &m.has_query_time_nsec);
+	set_time(&now, &m.response_time_sec, &m.has_response_time_sec,
+			&m.response_time_nsec, &m.has_response_time_nsec);
+	m.response_message.data = pkt->wire;
+	m.response_message.len = pkt->size;
+	m.has_response_message = true;
+
+	dnstap_submit(dnstap_dt, &m);
+	return ctx->state;
+}
+
 /* dnstap_log prepares dnstap message and sent it to fstrm */
 static int dnstap_log(kr_layer_t *ctx) {
 	const struct kr_request *req = ctx->req;
 	const struct kr_module *module = ctx->api->data;
 	const struct kr_rplan *rplan = &req->rplan;
-	const struct dnstap_data *dnstap_dt = module->data;
+	struct dnstap_data *dnstap_dt = module->data;
 
 	/* check if we have a valid iothread */
 	if (!dnstap_dt->iothread || !dnstap_dt->ioq) {
 		DEBUG_MSG("dnstap_dt->iothread or dnstap_dt->ioq is NULL\n");
-		return kr_error(EFAULT);
+		return ctx->state;
+	}
+
+	/* log only every n-th response */
+	if (++dnstap_dt->sampled < dnstap_dt->sample_rate) {
+		return ctx->state;
 	}
+	dnstap_dt->sampled = 0;
 
 	/* current time */
 	struct timeval now;
@@ -184,28 +376,7 @@ static int dnstap_log(kr_layer_t *ctx) {
 		}
 	}
 
-	/* Create a dnstap Message */
-	Dnstap__Dnstap dnstap = DNSTAP__DNSTAP__INIT;
-	dnstap.type = DNSTAP__DNSTAP__TYPE__MESSAGE;
-	dnstap.message = (Dnstap__Message *)&m;
-
-	/* Pack the message */
-	uint8_t *frame = NULL;
-	size_t size = 0;
-	dt_pack(&dnstap, &frame, &size);
-	if (!frame) {
-		return kr_error(ENOMEM);
-	}
-
-	/* Submit a request to send message to fstrm_iothr*/
-	fstrm_res res = fstrm_iothr_submit(dnstap_dt->iothread, dnstap_dt->ioq, frame, size,
-			fstrm_free_wrapper, NULL);
-	if (res != fstrm_res_success) {
-		DEBUG_MSG("Error submitting dnstap message to iothr\n");
-		free(frame);
-		return kr_error(EBUSY);
-	}
-
+	dnstap_submit(dnstap_dt, &m);
 	return ctx->state;
 }
 
@@ -217,6 +388,15 @@ int dnstap_init(struct kr_module *module) {
 		return kr_error(ENOMEM);
 	}
 	memset(data, 0, sizeof(*data));
+	data->sample_rate = 1;
+
+	/* preallocate the frames, the I/O thread can't hold more of them */
+	data->ring = calloc(DNSTAP_RING_SIZE, sizeof(*data->ring));
+	if (!data->ring) {
+		free(data);
+		return kr_error(ENOMEM);
+	}
+	worker_counters_register(counter_names, data->shared, DNSTAP_COUNTERS);
 
 	/* save pointer to internal struct in module for future reference */
 	module->data = data;
@@ -230,6 +410,8 @@ int dnstap_deinit(struct kr_module *module) {
 	if (data) {
 		fstrm_iothr_destroy(&data->iothread);
 		DEBUG_MSG("fstrm iothread destroyed\n");
+		/* the frames are released by now */
+		free(data->ring);
 		free(data);
 	}
 	return kr_ok();
@@ -296,6 +478,14 @@ static bool find_bool(const JsonNode *node) {
 	return node->bool_;
 }
 
+/* find_number returns a positive number from json, or the default */
+static uint32_t find_number(const JsonNode *node, uint32_t dflt) {
+	if (!node || node->tag != JSON_NUMBER || node->number_ < 1 || node->number_ > UINT32_MAX) {
+		return dflt;
+	}
+	return node->number_;
+}
+
 /* parse config */
 KR_EXPORT
 int dnstap_config(struct kr_module *module, const char *conf) {
@@ -328,6 +518,14 @@ int dnstap_config(struct kr_module *module, const char *conf) {
 			data->log_resp_pkt = false;
 		}
 
+		/* log_upstream key */
+		node = json_find_member(root_node, CFG_LOG_UPSTREAM);
+		data->log_upstream = node ? find_bool(node) : false;
+
+		/* sample_rate key */
+		node = json_find_member(root_node, CFG_SAMPLE_RATE);
+		data->sample_rate = find_number(node, 1);
+
 		/* clean up json, we don't need it no more */
 		json_delete(root_node);
 	}
@@ -346,6 +544,19 @@ int dnstap_config(struct kr_module *module, const char *conf) {
 		return kr_error(EINVAL);
 	}
 
+	/* A single worker thread submits, so the lock-free SPSC queue is enough;
+	 * it fits all the frames of the ring.  The I/O thread writes the frames
+	 * in batches (of the output queue size, or after the flush timeout). */
+	fstrm_iothr_options_set_num_input_queues(opt, 1);
+	fstrm_iothr_options_set_queue_model(opt, FSTRM_IOTHR_QUEUE_MODEL_SPSC);
+	fstrm_iothr_options_set_input_queue_size(opt, DNSTAP_RING_SIZE);
+
+	/* Replace the previous I/O thread, if any. */
+	if (data->iothread) {
+		fstrm_iothr_destroy(&data->iothread);
+		data->ioq = NULL;
+	}
+
 	/* Create the I/O thread. */
 	data->iothread = fstrm_iothr_init(opt, &writer);
 	fstrm_iothr_options_destroy(&opt);
@@ -368,10 +579,34 @@ int dnstap_config(struct kr_module *module, const char *conf) {
 	return kr_ok();
 }
 
+/* dnstap_stats returns the counters of this fork */
+static char *dnstap_stats(void *env, struct kr_module *module, const char *args) {
+	struct dnstap_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < DNSTAP_COUNTERS; ++i) {
+		/* strip the "dnstap." */
+		json_append_member(root, counter_names[i] + 7, json_mknumber(data->counters[i]));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+KR_EXPORT
+struct kr_prop *dnstap_props(void) {
+	static struct kr_prop prop_list[] = {
+	    { &dnstap_stats, "stats", "Get the counters of sent and dropped messages in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
 KR_EXPORT
 const kr_layer_api_t *dnstap_layer(struct kr_module *module) {
 	static kr_layer_api_t _layer = {
 		.finish = &dnstap_log,
+		.checkout = &dnstap_log_query,
+		.consume = &dnstap_log_response,
 	};
 	/* Store module reference */
 	_layer.data = module;
@@ -1,4 +1,7 @@
 dnstap_CFLAGS := -fPIC
+# The counters use worker_*() of the daemon, not of libkres;
+# on darwin the undefined symbols aren't accepted by default.
+dnstap_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
 dnstap_SOURCES := modules/dnstap/dnstap.pb-c.c modules/dnstap/dnstap.c
 dnstap_DEPEND := $(libkres) modules/dnstap/dnstap.pb-c.c # because of generated *.h
 dnstap_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS) $(libprotobuf-c_LIBS) $(libfstrm_LIBS)
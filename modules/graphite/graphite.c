@@ -0,0 +1,571 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file graphite.c
+ * @brief Push the counters of all forks to Graphite or statsd servers.
+ *
+ * The counters are read from the memory shared by the forks (see
+ * worker_shstats_shared()), so only the first fork pushes, and the sums
+ * are formatted into batches and sent from the libuv thread pool.
+ * The event loop only starts a push every interval.
+ */
+
+#include <arpa/inet.h>
+#include <ccan/json/json.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "daemon/worker.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "lib/module.h"
+#include "lib/utils.h"
+
+#define ERR_MSG(fmt, ...) kr_log_error("[graphite] " fmt, ## __VA_ARGS__)
+
+/** Longest metric prefix, including the terminating zero. */
+#define GRAPHITE_PREFIX_MAXLEN 128
+/** Batch sizes, a datagram has to fit in the path MTU. */
+#define GRAPHITE_BATCH_UDP 1400
+#define GRAPHITE_BATCH_TCP 16384
+/** Timeout of connecting and sending over TCP, milliseconds */
+#define GRAPHITE_TCP_TIMEOUT 2000
+
+enum graphite_proto {
+	GRAPHITE_PLAINTEXT, /**< "name value timestamp\n" */
+	GRAPHITE_PICKLE,    /**< Length-prefixed pickled list of (name, (timestamp, value)) */
+	GRAPHITE_STATSD,    /**< "name:value|g\n" */
+};
+
+struct graphite_server {
+	union inaddr addr;
+	bool tcp;
+	int fd;             /**< -1 when not connected */
+};
+
+/** A push; owned by the thread pool while `busy`. */
+struct graphite_push {
+	uv_work_t work;
+	const shcounters_t *sc;
+	enum graphite_proto proto;
+	char prefix[GRAPHITE_PREFIX_MAXLEN];
+	array_t(struct graphite_server) servers;
+	bool busy;
+	bool orphan;        /**< Module gone while busy, free when done. */
+	/* Results of the last push. */
+	uint32_t metrics;
+	uint32_t batches;
+	uint32_t errors;
+	int last_error;
+	/* The batch being filled. */
+	size_t batch_max;
+	size_t len;
+	uint32_t items;     /**< In the pickle batch */
+	char buf[GRAPHITE_BATCH_TCP];
+};
+
+struct graphite_data {
+	uv_timer_t timer;
+	bool timer_init;
+	uint32_t interval;           /**< Milliseconds */
+	struct graphite_push *push;  /**< Current configuration, NULL if not configured */
+	struct graphite_push *next;  /**< Configured while a push was busy */
+	uint64_t pushes;
+	uint64_t skipped;            /**< Intervals with the previous push still busy */
+	uint64_t batches;
+	uint64_t errors;
+};
+
+static void push_free(struct graphite_push *push)
+{
+	if (!push) {
+		return;
+	}
+	for (size_t i = 0; i < push->servers.len; ++i) {
+		if (push->servers.at[i].fd >= 0) {
+			close(push->servers.at[i].fd);
+		}
+	}
+	array_clear(push->servers);
+	free(push);
+}
+
+/*
+ * The thread pool side.
+ */
+
+static int server_connect(struct graphite_server *server)
+{
+	const struct sockaddr *sa = &server->addr.ip;
+	int fd = socket(sa->sa_family, server->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return kr_error(errno);
+	}
+	if (server->tcp) {
+		/* Bounds connect() too, on Linux. */
+		struct timeval tv = {
+			.tv_sec = GRAPHITE_TCP_TIMEOUT / 1000,
+			.tv_usec = (GRAPHITE_TCP_TIMEOUT % 1000) * 1000,
+		};
+		(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	if (connect(fd, sa, kr_sockaddr_len(sa)) != 0) {
+		int ret = kr_error(errno);
+		close(fd);
+		return ret;
+	}
+	server->fd = fd;
+	return kr_ok();
+}
+
+static int server_send(struct graphite_server *server, const char *buf, size_t len)
+{
+	if (server->fd < 0) {
+		int ret = server_connect(server);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	while (len > 0) {
+		ssize_t sent = send(server->fd, buf, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0) {
+			/* Reconnect on the next batch. */
+			int ret = kr_error(errno);
+			close(server->fd);
+			server->fd = -1;
+			return ret;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return kr_ok();
+}
+
+static inline void put_le32(char *dst, uint32_t val)
+{
+	for (int i = 0; i < 4; ++i) {
+		dst[i] = (val >> (8 * i)) & 0xff;
+	}
+}
+
+/** Start a batch, the pickle one with a length placeholder, PROTO 2, EMPTY_LIST and MARK. */
+static void batch_begin(struct graphite_push *push)
+{
+	push->len = 0;
+	push->items = 0;
+	if (push->proto == GRAPHITE_PICKLE) {
+		memcpy(push->buf, "\0\0\0\0\x80\x02](", 8);
+		push->len = 8;
+	}
+}
+
+static void batch_flush(struct graphite_push *push)
+{
+	if (push->proto == GRAPHITE_PICKLE) {
+		if (push->items == 0) {
+			return;
+		}
+		/* APPENDS and STOP, the length is big-endian. */
+		push->buf[push->len++] = 'e';
+		push->buf[push->len++] = '.';
+		const uint32_t payload = htonl(push->len - 4);
+		memcpy(push->buf, &payload, sizeof(payload));
+	} else if (push->len == 0) {
+		return;
+	}
+	for (size_t i = 0; i < push->servers.len; ++i) {
+		int ret = server_send(&push->servers.at[i], push->buf, push->len);
+		if (ret != 0) {
+			push->errors += 1;
+			push->last_error = ret;
+		}
+	}
+	push->batches += 1;
+	batch_begin(push);
+}
+
+/** Pickle the (name, (timestamp, value)) tuple, return its length or 0 if it doesn't fit. */
+static size_t pickle_metric(char *dst, size_t avail, const char *prefix,
+			    const char *name, time_t now, uint64_t val)
+{
+	const size_t prefix_len = strlen(prefix);
+	const size_t name_len = (prefix_len ? prefix_len + 1 : 0) + strlen(name);
+	/* BINUNICODE, BININT, at most LONG1 with 9 bytes, 2x TUPLE2 */
+	if (avail < 1 + 4 + name_len + 5 + 11 + 2) {
+		return 0;
+	}
+	char *p = dst;
+	*p++ = 'X';
+	put_le32(p, name_len);
+	p += 4;
+	if (prefix_len) {
+		memcpy(p, prefix, prefix_len);
+		p += prefix_len;
+		*p++ = '.';
+	}
+	memcpy(p, name, strlen(name));
+	p += strlen(name);
+	*p++ = 'J';
+	put_le32(p, (uint32_t)now);
+	p += 4;
+	if (val < (1ULL << 31)) {
+		*p++ = 'J';
+		put_le32(p, val);
+		p += 4;
+	} else {
+		/* LONG1, little-endian two's complement, so keep the sign bit clear. */
+		*p++ = '\x8a';
+		char *lenp = p++;
+		uint8_t n = 0;
+		uint64_t rest = val;
+		do {
+			*p++ = rest & 0xff;
+			rest >>= 8;
+			n += 1;
+		} while (rest);
+		if ((uint8_t)p[-1] & 0x80) {
+			*p++ = 0;
+			n += 1;
+		}
+		*lenp = n;
+	}
+	*p++ = '\x86';
+	*p++ = '\x86';
+	return p - dst;
+}
+
+static void batch_add(struct graphite_push *push, const char *name, time_t now, uint64_t val)
+{
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		/* Keep room for the end of the pickle batch. */
+		const size_t avail = push->batch_max - push->len - 2;
+		char *dst = push->buf + push->len;
+		const char *dot = push->prefix[0] ? "." : "";
+		size_t len = 0;
+		int ret = -1;
+		switch (push->proto) {
+		case GRAPHITE_PLAINTEXT:
+			ret = snprintf(dst, avail, "%s%s%s %" PRIu64 " %lld\n",
+				       push->prefix, dot, name, val, (long long)now);
+			break;
+		case GRAPHITE_STATSD:
+			ret = snprintf(dst, avail, "%s%s%s:%" PRIu64 "|g\n",
+				       push->prefix, dot, name, val);
+			break;
+		case GRAPHITE_PICKLE:
+			len = pickle_metric(dst, avail, push->prefix, name, now, val);
+			ret = len ? (int)len : -1;
+			break;
+		}
+		if (ret >= 0 && (size_t)ret < avail) {
+			push->len += ret;
+			push->items += 1;
+			push->metrics += 1;
+			return;
+		}
+		batch_flush(push);
+	}
+}
+
+static void push_work(uv_work_t *req)
+{
+	struct graphite_push *push = req->data;
+	push->metrics = push->batches = push->errors = 0;
+	push->last_error = 0;
+	/* Sum up the forks by name, in the order of the names. */
+	trie_t *sums = trie_create(NULL);
+	if (!sums) {
+		push->errors += 1;
+		push->last_error = kr_error(ENOMEM);
+		return;
+	}
+	const shcounters_t *sc = push->sc;
+	for (uint32_t p = 0; p < shcounters_procs(sc); ++p) {
+		const uint32_t count = shcounters_count(sc, p);
+		for (uint32_t i = 0; i < count; ++i) {
+			const char *name = shcounters_name(sc, p, i);
+			trie_val_t *val = name ? trie_get_ins(sums, name, strlen(name) + 1) : NULL;
+			if (val) {
+				*val = (void *)((uintptr_t)*val + shcounters_get(sc, p, i));
+			}
+		}
+	}
+	const time_t now = time(NULL);
+	batch_begin(push);
+	trie_it_t *it = trie_it_begin(sums);
+	for (; it && !trie_it_finished(it); trie_it_next(it)) {
+		size_t len = 0;
+		const char *name = trie_it_key(it, &len);
+		batch_add(push, name, now, (uintptr_t)*trie_it_val(it));
+	}
+	trie_it_free(it);
+	batch_flush(push);
+	trie_free(sums);
+}
+
+/*
+ * The event loop side.
+ */
+
+static void push_done(uv_work_t *req, int status)
+{
+	struct graphite_push *push = req->data;
+	push->busy = false;
+	if (push->orphan) {
+		push_free(push);
+	}
+}
+
+static void on_timer(uv_timer_t *timer)
+{
+	struct graphite_data *data = timer->data;
+	struct graphite_push *push = data->push;
+	if (push && push->busy) {
+		data->skipped += 1;
+		return;
+	}
+	if (push) {
+		/* Account for the last push. */
+		data->batches += push->batches;
+		data->errors += push->errors;
+		if (push->errors) {
+			ERR_MSG("%" PRIu32 " batches not sent, last error: %s\n",
+				push->errors, strerror(abs(push->last_error)));
+			push->errors = 0;
+		}
+		push->batches = 0;
+	}
+	if (data->next) {
+		push_free(push);
+		push = data->push = data->next;
+		data->next = NULL;
+	}
+	if (!push) {
+		return;
+	}
+	push->work.data = push;
+	push->busy = true;
+	if (uv_queue_work(timer->loop, &push->work, push_work, push_done) != 0) {
+		push->busy = false;
+		return;
+	}
+	data->pushes += 1;
+}
+
+static int parse_server(struct graphite_push *push, const char *host, int port, bool tcp)
+{
+	struct sockaddr *sa = kr_straddr_socket(host, port);
+	if (!sa) {
+		ERR_MSG("invalid server address '%s', expected an IP address\n", host);
+		return kr_error(EINVAL);
+	}
+	struct graphite_server server = { .tcp = tcp, .fd = -1 };
+	memcpy(&server.addr, sa, kr_sockaddr_len(sa));
+	free(sa);
+	if (array_push(push->servers, server) < 0) {
+		return kr_error(ENOMEM);
+	}
+	return kr_ok();
+}
+
+static int parse_config(struct graphite_push *push, uint32_t *interval, JsonNode *root)
+{
+	const JsonNode *node = json_find_member(root, "protocol");
+	push->proto = GRAPHITE_PLAINTEXT;
+	if (node && node->tag == JSON_STRING) {
+		if (strcmp(node->string_, "pickle") == 0) {
+			push->proto = GRAPHITE_PICKLE;
+		} else if (strcmp(node->string_, "statsd") == 0) {
+			push->proto = GRAPHITE_STATSD;
+		} else if (strcmp(node->string_, "plaintext") != 0) {
+			ERR_MSG("unknown protocol '%s'\n", node->string_);
+			return kr_error(EINVAL);
+		}
+	}
+	node = json_find_member(root, "tcp");
+	bool tcp = node && node->tag == JSON_BOOL && node->bool_;
+	if (push->proto == GRAPHITE_PICKLE) {
+		tcp = true; /* The payloads are length-prefixed. */
+	}
+	push->batch_max = tcp ? GRAPHITE_BATCH_TCP : GRAPHITE_BATCH_UDP;
+	int port = push->proto == GRAPHITE_PICKLE ? 2004
+		 : (push->proto == GRAPHITE_STATSD ? 8125 : 2003);
+	node = json_find_member(root, "port");
+	if (node && node->tag == JSON_NUMBER) {
+		port = node->number_;
+	}
+	node = json_find_member(root, "interval");
+	if (node && node->tag == JSON_NUMBER) {
+		if (node->number_ < 1) {
+			ERR_MSG("invalid interval\n");
+			return kr_error(EINVAL);
+		}
+		*interval = node->number_;
+	}
+	node = json_find_member(root, "prefix");
+	if (node && node->tag == JSON_STRING) {
+		if (strlen(node->string_) >= sizeof(push->prefix)) {
+			ERR_MSG("too long prefix\n");
+			return kr_error(EINVAL);
+		}
+		strcpy(push->prefix, node->string_);
+	}
+	node = json_find_member(root, "host");
+	if (node && node->tag == JSON_STRING) {
+		return parse_server(push, node->string_, port, tcp);
+	}
+	if (!node || node->tag != JSON_ARRAY) {
+		ERR_MSG("expected { host = '...' | { '...', ... }, ... }\n");
+		return kr_error(EINVAL);
+	}
+	const JsonNode *item;
+	json_foreach(item, node) {
+		int ret = item->tag == JSON_STRING
+			? parse_server(push, item->string_, port, tcp) : kr_error(EINVAL);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return push->servers.len ? kr_ok() : kr_error(EINVAL);
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+int graphite_init(struct kr_module *module)
+{
+	struct graphite_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	data->interval = 5000;
+	module->data = data;
+	return kr_ok();
+}
+
+static void on_timer_close(uv_handle_t *handle)
+{
+	free(handle->data);
+}
+
+KR_EXPORT
+int graphite_deinit(struct kr_module *module)
+{
+	struct graphite_data *data = module->data;
+	if (!data) {
+		return kr_ok();
+	}
+	push_free(data->next);
+	data->next = NULL;
+	if (data->push && data->push->busy) {
+		data->push->orphan = true;
+	} else {
+		push_free(data->push);
+	}
+	data->push = NULL;
+	module->data = NULL;
+	if (data->timer_init) {
+		uv_close((uv_handle_t *)&data->timer, on_timer_close);
+	} else {
+		free(data);
+	}
+	return kr_ok();
+}
+
+KR_EXPORT
+int graphite_config(struct kr_module *module, const char *conf)
+{
+	struct graphite_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	/* The sums of all forks are pushed by the first one. */
+	int fork_id = 0;
+	const shcounters_t *sc = worker_shstats_shared(&fork_id);
+	if (!sc) {
+		ERR_MSG("the counters aren't shared\n");
+		return kr_error(ENOENT);
+	}
+	if (fork_id != 0) {
+		return kr_ok();
+	}
+	struct graphite_push *push = calloc(1, sizeof(*push));
+	if (!push) {
+		return kr_error(ENOMEM);
+	}
+	push->sc = sc;
+	char hostname[GRAPHITE_PREFIX_MAXLEN - 8] = "";
+	(void) gethostname(hostname, sizeof(hostname) - 1);
+	snprintf(push->prefix, sizeof(push->prefix), "kresd.%s", hostname);
+	uint32_t interval = data->interval;
+	JsonNode *root = json_decode(conf);
+	int ret = root ? parse_config(push, &interval, root) : kr_error(EINVAL);
+	json_delete(root);
+	if (ret != 0) {
+		push_free(push);
+		return ret;
+	}
+	/* Swap it in on the next interval, the current one may be busy. */
+	push_free(data->next);
+	data->next = push;
+	data->interval = interval;
+	if (!data->timer_init) {
+		uv_timer_init(uv_default_loop(), &data->timer);
+		data->timer.data = data;
+		data->timer_init = true;
+	}
+	uv_timer_start(&data->timer, on_timer, data->interval, data->interval);
+	return kr_ok();
+}
+
+static char *graphite_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct graphite_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "pushes", json_mknumber(data->pushes));
+	json_append_member(root, "skipped", json_mknumber(data->skipped));
+	json_append_member(root, "batches", json_mknumber(data->batches));
+	json_append_member(root, "errors", json_mknumber(data->errors));
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+KR_EXPORT
+struct kr_prop *graphite_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &graphite_stats, "stats", "Get the counters of the pushes.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(graphite);
@@ -1,2 +1,8 @@
-graphite_SOURCES := graphite.lua
-$(call make_lua_module,graphite)
+graphite_CFLAGS := -fPIC
+# We use a symbol that's not in libkres but the daemon.
+# On darwin this isn't accepted by default.
+graphite_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
+graphite_SOURCES := modules/graphite/graphite.c
+graphite_DEPEND := $(libkres)
+graphite_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS) $(libuv_LIBS)
+$(call make_c_module,graphite)
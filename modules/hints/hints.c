@@ -21,6 +21,11 @@
  * The module provides an override for queried address records.
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <uv.h>
 #include <libknot/packet/pkt.h>
 #include <libknot/descriptor.h>
 #include <libknot/rrtype/aaaa.h>
@@ -33,14 +38,38 @@
 #include "lib/zonecut.h"
 #include "lib/module.h"
 #include "lib/layer.h"
+#include "lib/generic/array.h"
+#include "lib/generic/trie.h"
+#include "modules/hints/image.h"
 
 /* Defaults */
 #define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "hint",  fmt)
 #define ERR_MSG(fmt, ...) kr_log_error("[     ][hint] " fmt, ## __VA_ARGS__)
+/** Delay of the reload after a change of a watched file, so that a burst of writes is read once. */
+#define HINTS_WATCH_DELAY 100 /* ms */
+/** Delay of the retry when a watched file was replaced and isn't there yet. */
+#define HINTS_WATCH_RETRY (5 * 1000) /* ms */
+/** Changes of a watched file applied per event loop iteration. */
+#define HINTS_WATCH_BATCH 1000
+
+/** A hosts file loaded by hints.add_hosts(), reloaded incrementally when it changes. */
+struct hints_watch {
+	uv_fs_event_t event;
+	uv_timer_t timer;	/**< Delays the reload and then runs the batches of changes */
+	struct kr_module *module;
+	struct hints_watch *next;
+	char *path;
+	trie_t *pairs;		/**< "name\0addr\0" of each pair loaded from the file */
+	array_t(char *) ops;	/**< Pending changes: '+' or '-' followed by the pair */
+	size_t ops_done;
+	int closing;		/**< Handles not closed yet */
+};
 
 struct hints_data {
 	struct kr_zonecut hints;
 	struct kr_zonecut reverse_hints;
+	struct hints_image *image; /**< Looked up when the hints above miss */
+	struct hints_watch *watches;
 };
 
 /** Useful for returning from module properties. */
@@ -124,6 +153,39 @@ static int satisfy_forward(struct kr_zonecut *hints, knot_pkt_t *pkt, struct kr_
 	return put_answer(pkt, &rr);
 }
 
+static int satisfy_reverse_image(const struct hints_image *img, knot_pkt_t *pkt,
+				 struct kr_query *qry)
+{
+	const knot_dname_t *ptr = hints_image_ptr(img, qry->sname);
+	if (!ptr) {
+		return kr_error(ENOENT);
+	}
+	knot_dname_t *qname = knot_dname_copy(qry->sname, &pkt->mm);
+	knot_rrset_t rr;
+	knot_rrset_init(&rr, qname, KNOT_RRTYPE_PTR, KNOT_CLASS_IN);
+	knot_rrset_add_rdata(&rr, ptr, knot_dname_size(ptr), 0, &pkt->mm);
+	return put_answer(pkt, &rr);
+}
+
+static int satisfy_forward_image(const struct hints_image *img, knot_pkt_t *pkt,
+				 struct kr_query *qry)
+{
+	int family = qry->stype == KNOT_RRTYPE_AAAA ? AF_INET6 : AF_INET;
+	const uint8_t *addrs = NULL;
+	int count = hints_image_addrs(img, qry->sname, family, &addrs);
+	if (count == 0) {
+		return kr_error(ENOENT);
+	}
+	knot_dname_t *qname = knot_dname_copy(qry->sname, &pkt->mm);
+	knot_rrset_t rr;
+	knot_rrset_init(&rr, qname, qry->stype, qry->sclass);
+	size_t family_len = kr_family_len(family);
+	for (int i = 0; i < count; ++i) {
+		knot_rrset_add_rdata(&rr, addrs + i * family_len, family_len, 0, &pkt->mm);
+	}
+	return put_answer(pkt, &rr);
+}
+
 static int query(kr_layer_t *ctx, knot_pkt_t *pkt)
 {
 	struct kr_query *qry = ctx->req->current_query;
@@ -141,11 +203,13 @@ static int query(kr_layer_t *ctx, knot_pkt_t *pkt)
 	switch(qry->stype) {
 	case KNOT_RRTYPE_A:
 	case KNOT_RRTYPE_AAAA: /* Find forward record hints */
-		if (satisfy_forward(&data->hints, pkt, qry) != 0)
+		if (satisfy_forward(&data->hints, pkt, qry) != 0 &&
+		    satisfy_forward_image(data->image, pkt, qry) != 0)
 			return ctx->state;
 		break;
 	case KNOT_RRTYPE_PTR: /* Find PTR record */
-		if (satisfy_reverse(&data->reverse_hints, pkt, qry) != 0)
+		if (satisfy_reverse(&data->reverse_hints, pkt, qry) != 0 &&
+		    satisfy_reverse_image(data->image, pkt, qry) != 0)
 			return ctx->state;
 		break;
 	default:
@@ -293,6 +357,11 @@ static int del_pair(struct hints_data *data, const char *name, const char *addr)
 	}
 	knot_rdata_t ptr_rdata[RDATA_ARR_MAX];
 	knot_rdata_init(ptr_rdata, knot_dname_size(key), key, 0);
+	/* The forward key is lower-cased by add_pair(), the PTR isn't. */
+	int ret = knot_dname_to_lower(key);
+	if (ret) {
+		return ret;
+	}
 
         if (addr) {
 		/* Remove the pair. */
@@ -328,7 +397,10 @@ static int del_pair(struct hints_data *data, const char *name, const char *addr)
 	}
 }
 
-static int load_file(struct kr_module *module, const char *path)
+/** Called for each name - address pair of a hosts file. */
+typedef int (*hosts_pair_f)(void *baton, const char *name, const char *addr);
+
+static int parse_hosts(const char *path, hosts_pair_f pair, void *baton)
 {
 	auto_fclose FILE *fp = fopen(path, "r");
 	if (fp == NULL) {
@@ -338,8 +410,6 @@ static int load_file(struct kr_module *module, const char *path)
 		VERBOSE_MSG(NULL, "reading '%s'\n", path);
 	}
 
-	/* Load file to map */
-	struct hints_data *data = module->data;
 	size_t line_len = 0;
 	size_t count = 0;
 	size_t line_count = 0;
@@ -362,20 +432,14 @@ static int load_file(struct kr_module *module, const char *path)
 		 * we add canonical name as the last one. */
 		const char *name_tok;
 		while ((name_tok = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
-			ret = add_pair(&data->hints, name_tok, addr);
-			if (!ret) {
-				ret = add_reverse_pair(&data->reverse_hints, name_tok, addr);
-			}
+			ret = pair(baton, name_tok, addr);
 			if (ret) {
 				ret = -1;
 				goto error;
 			}
 			count += 1;
 		}
-		ret = add_pair(&data->hints, canonical_name, addr);
-		if (!ret) {
-			ret = add_reverse_pair(&data->reverse_hints, canonical_name, addr);
-		}
+		ret = pair(baton, canonical_name, addr);
 		if (ret) {
 			ret = -1;
 			goto error;
@@ -391,14 +455,376 @@ error:
 	return ret;
 }
 
+static int load_pair(void *baton, const char *name, const char *addr)
+{
+	struct hints_data *data = baton;
+	int ret = add_pair(&data->hints, name, addr);
+	if (!ret) {
+		ret = add_reverse_pair(&data->reverse_hints, name, addr);
+	}
+	return ret;
+}
+
+/** Account the mempool of the hints, see kr_mem_usage. */
+static void hints_mem_update(struct kr_module *module)
+{
+	struct hints_data *data = module->data;
+	kr_mem_usage[KR_MEM_HINTS] = data ? mp_total_size(data->hints.pool->ctx) : 0;
+}
+
+/** Key of the pair in hints_watch::pairs, return its length or -1. */
+static int pair_key(char *key, size_t maxlen, const char *name, const char *addr)
+{
+	size_t name_len = strlen(name) + 1, addr_len = strlen(addr) + 1;
+	if (name_len + addr_len > maxlen) {
+		return -1;
+	}
+	memcpy(key, name, name_len);
+	memcpy(key + name_len, addr, addr_len);
+	return name_len + addr_len;
+}
+
+static int collect_pair(void *baton, const char *name, const char *addr)
+{
+	char key[KNOT_DNAME_TXT_MAXLEN + INET6_ADDRSTRLEN + 2];
+	int len = pair_key(key, sizeof(key), name, addr);
+	if (len < 0) {
+		return kr_error(EINVAL);
+	}
+	trie_val_t *val = trie_get_ins(baton, key, len);
+	if (!val) {
+		return kr_error(ENOMEM);
+	}
+	*val = NULL;
+	return kr_ok();
+}
+
+struct load_baton {
+	struct hints_data *data;
+	trie_t *pairs;
+};
+
+static int load_collect_pair(void *baton, const char *name, const char *addr)
+{
+	struct load_baton *b = baton;
+	int ret = load_pair(b->data, name, addr);
+	return ret ? ret : collect_pair(b->pairs, name, addr);
+}
+
+/** Queue a change for each pair in the set but not in the other one. */
+static int watch_diff(struct hints_watch *w, trie_t *set, trie_t *other, char op)
+{
+	int ret = kr_ok();
+	trie_it_t *it = trie_it_begin(set);
+	for (; it && !trie_it_finished(it); trie_it_next(it)) {
+		size_t len = 0;
+		const char *key = trie_it_key(it, &len);
+		if (trie_get_try(other, key, len)) {
+			continue;
+		}
+		char *change = malloc(len + 1);
+		if (!change || array_push(w->ops, change) < 0) {
+			free(change);
+			ret = kr_error(ENOMEM);
+			break;
+		}
+		change[0] = op;
+		memcpy(change + 1, key, len);
+	}
+	trie_it_free(it);
+	return ret;
+}
+
+static void watch_batch_cb(uv_timer_t *timer)
+{
+	struct hints_watch *w = timer->data;
+	struct hints_data *data = w->module->data;
+	size_t end = MIN(w->ops_done + HINTS_WATCH_BATCH, w->ops.len);
+	for (; w->ops_done < end; ++w->ops_done) {
+		char *change = w->ops.at[w->ops_done];
+		const char *name = change + 1;
+		const char *addr = name + strlen(name) + 1;
+		int ret = change[0] == '+' ? load_pair(data, name, addr)
+					   : del_pair(data, name, addr);
+		if (ret) {
+			VERBOSE_MSG(NULL, "'%s': %c %s %s failed: %s\n", w->path,
+				    change[0], name, addr, kr_strerror(ret));
+		}
+		free(change);
+	}
+	if (w->ops_done < w->ops.len) {
+		uv_timer_start(timer, watch_batch_cb, 0, 0); /* the rest in the next iteration */
+		return;
+	}
+	VERBOSE_MSG(NULL, "'%s': applied %zu changes\n", w->path, w->ops.len);
+	w->ops.len = w->ops_done = 0;
+	hints_mem_update(w->module);
+}
+
+/** Read the file again and queue the differences from the loaded pairs. */
+static int watch_reload(struct hints_watch *w)
+{
+	trie_t *pairs = trie_create(NULL);
+	if (!pairs) {
+		return kr_error(ENOMEM);
+	}
+	int ret = parse_hosts(w->path, collect_pair, pairs);
+	/* The removals first, so that the pairs moved between names stay. */
+	size_t queued = w->ops.len;
+	if (ret == 0) {
+		ret = watch_diff(w, w->pairs, pairs, '-');
+	}
+	if (ret == 0) {
+		ret = watch_diff(w, pairs, w->pairs, '+');
+	}
+	if (ret != 0) {
+		/* Keep the pairs loaded before. */
+		for (size_t i = queued; i < w->ops.len; ++i) {
+			free(w->ops.at[i]);
+		}
+		w->ops.len = queued;
+		trie_free(pairs);
+		return ret;
+	}
+	trie_free(w->pairs);
+	w->pairs = pairs;
+	if (w->ops_done < w->ops.len) {
+		uv_timer_start(&w->timer, watch_batch_cb, 0, 0);
+	}
+	return kr_ok();
+}
+
+static void watch_event_cb(uv_fs_event_t *handle, const char *filename, int events, int status);
+
+static void watch_reload_cb(uv_timer_t *timer)
+{
+	struct hints_watch *w = timer->data;
+	/* Editors replace the file, so watch the one at the path now. */
+	uv_fs_event_stop(&w->event);
+	int ret = uv_fs_event_start(&w->event, watch_event_cb, w->path, 0);
+	if (ret != 0) {
+		uv_timer_start(timer, watch_reload_cb, HINTS_WATCH_RETRY, 0);
+		return;
+	}
+	ret = watch_reload(w);
+	if (ret != 0) {
+		ERR_MSG("reloading '%s' failed: %s\n", w->path, kr_strerror(ret));
+	}
+}
+
+static void watch_event_cb(uv_fs_event_t *handle, const char *filename, int events, int status)
+{
+	struct hints_watch *w = handle->data;
+	/* The pending batches are run after the reload. */
+	uv_timer_start(&w->timer, watch_reload_cb, HINTS_WATCH_DELAY, 0);
+}
+
+static void watch_close_cb(uv_handle_t *handle)
+{
+	struct hints_watch *w = handle->data;
+	if (--w->closing == 0) {
+		free(w->path);
+		free(w);
+	}
+}
+
+/** Watch the loaded file; the watch takes over the pairs. */
+static int watch_add(struct kr_module *module, const char *path, trie_t *pairs)
+{
+	struct hints_data *data = module->data;
+	struct hints_watch *w = calloc(1, sizeof(*w));
+	if (!w || !(w->path = strdup(path))) {
+		free(w);
+		return kr_error(ENOMEM);
+	}
+	uv_loop_t *loop = uv_default_loop();
+	uv_fs_event_init(loop, &w->event);
+	uv_timer_init(loop, &w->timer);
+	w->event.data = w->timer.data = w;
+	w->closing = 2;
+	int ret = uv_fs_event_start(&w->event, watch_event_cb, path, 0);
+	if (ret != 0) {
+		uv_close((uv_handle_t *)&w->event, watch_close_cb);
+		uv_close((uv_handle_t *)&w->timer, watch_close_cb);
+		return ret;
+	}
+	w->module = module;
+	w->pairs = pairs;
+	w->next = data->watches;
+	data->watches = w;
+	return kr_ok();
+}
+
+static void watches_close(struct hints_data *data)
+{
+	struct hints_watch *w = data->watches;
+	while (w) {
+		struct hints_watch *next = w->next;
+		for (size_t i = w->ops_done; i < w->ops.len; ++i) {
+			free(w->ops.at[i]);
+		}
+		array_clear(w->ops);
+		trie_free(w->pairs);
+		uv_close((uv_handle_t *)&w->event, watch_close_cb);
+		uv_close((uv_handle_t *)&w->timer, watch_close_cb);
+		w = next;
+	}
+	data->watches = NULL;
+}
+
+/** Load the file and watch it, or apply just its changes if it's watched already. */
+static int load_file(struct kr_module *module, const char *path)
+{
+	struct hints_data *data = module->data;
+	for (struct hints_watch *w = data->watches; w; w = w->next) {
+		if (strcmp(w->path, path) == 0) {
+			return watch_reload(w);
+		}
+	}
+	struct load_baton b = { .data = data, .pairs = trie_create(NULL) };
+	if (!b.pairs) {
+		return kr_error(ENOMEM);
+	}
+	int ret = parse_hosts(path, load_collect_pair, &b);
+	if (ret == 0) {
+		int err = watch_add(module, path, b.pairs);
+		if (err == 0) {
+			return kr_ok();
+		}
+		ERR_MSG("watching '%s' failed: %s\n", path, kr_strerror(err));
+	}
+	trie_free(b.pairs);
+	return ret;
+}
+
+static int image_pair(void *baton, const char *name, const char *addr)
+{
+	knot_dname_t key[KNOT_DNAME_MAXLEN];
+	struct sockaddr_storage ss;
+	if (!knot_dname_from_str(key, name, sizeof(key)) || parse_addr_str(&ss, addr) != 0) {
+		return kr_error(EINVAL);
+	}
+	const struct sockaddr *sa = (const struct sockaddr *)&ss;
+	const uint8_t *raw_addr = (const uint8_t *)kr_inaddr(sa);
+	const knot_dname_t *reverse = raw_addr2reverse(raw_addr, kr_inaddr_family(sa));
+	if (!reverse) {
+		return kr_error(EINVAL);
+	}
+	return hints_builder_add(baton, key, raw_addr, kr_inaddr_len(sa), reverse);
+}
+
+static int compile_locked(const char *hosts_path, const char *image_path, const char *tmp_path)
+{
+	/* Stat before parsing, so that changes made meanwhile get compiled later. */
+	struct stat hosts_st;
+	if (stat(hosts_path, &hosts_st) != 0) {
+		ERR_MSG("%s: %s\n", hosts_path, strerror(errno));
+		return kr_error(errno);
+	}
+	struct hints_builder *b = hints_builder_new();
+	if (!b) {
+		return kr_error(ENOMEM);
+	}
+	int ret = parse_hosts(hosts_path, image_pair, b);
+	FILE *f = NULL;
+	if (ret == 0 && !(f = fopen(tmp_path, "w"))) {
+		ret = kr_error(errno);
+	}
+	if (f) {
+		ret = hints_builder_write(b, &hosts_st, f);
+		if (fclose(f) != 0 && ret == 0) {
+			ret = kr_error(errno);
+		}
+		if (ret == 0 && rename(tmp_path, image_path) != 0) {
+			ret = kr_error(errno);
+		}
+		if (ret != 0) {
+			unlink(tmp_path);
+		}
+	}
+	hints_builder_free(b);
+	if (ret != 0) {
+		ERR_MSG("%s: compilation failed: %s\n", hosts_path, kr_strerror(ret));
+	}
+	return ret;
+}
+
+/** Compile the hosts file into the image, unless it's up to date already.
+ *
+ * The image is written aside and renamed, so the mapped images are never affected.
+ * The forks compiling the same image are serialized through a lock file
+ * and only the first one works.
+ */
+static int compile_image(const char *hosts_path, const char *image_path)
+{
+	char lock_path[PATH_MAX], tmp_path[PATH_MAX];
+	if (snprintf(lock_path, sizeof(lock_path), "%s.lock", image_path) >= sizeof(lock_path) ||
+	    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", image_path,
+		     (int)getpid()) >= sizeof(tmp_path)) {
+		return kr_error(ENAMETOOLONG);
+	}
+	int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock < 0) {
+		ERR_MSG("%s: %s\n", lock_path, strerror(errno));
+		return kr_error(errno);
+	}
+	/* The others wait here and then find the image fresh. */
+	int ret = flock(lock, LOCK_EX) == 0 ? kr_ok() : kr_error(errno);
+	if (ret == 0 && hints_image_stale(image_path, hosts_path)) {
+		ret = compile_locked(hosts_path, image_path, tmp_path);
+	}
+	close(lock);
+	return ret;
+}
+
 static char* hint_add_hosts(void *env, struct kr_module *module, const char *args)
 {
 	if (!args)
 		args = "/etc/hosts";
 	int err = load_file(module, args);
+	hints_mem_update(module);
 	return bool2jsonstr(err == kr_ok());
 }
 
+/**
+ * Use an image of a hosts file, compiling it first if it's outdated.
+ *
+ * Input:  image path, or { hosts: path, image: path }
+ * Output: { result: bool }
+ *
+ */
+static char* hint_image(void *env, struct kr_module *module, const char *args)
+{
+	struct hints_data *data = module->data;
+	if (!args)
+		return NULL;
+
+	const char *image_path = args;
+	JsonNode *root = NULL;
+	int ret = kr_ok();
+	if (args[0] == '{') {
+		root = json_decode(args);
+		JsonNode *hosts = root ? json_find_member(root, "hosts") : NULL;
+		JsonNode *image = root ? json_find_member(root, "image") : NULL;
+		if (!hosts || hosts->tag != JSON_STRING || !image || image->tag != JSON_STRING) {
+			ret = kr_error(EINVAL);
+		} else {
+			image_path = image->string_;
+			ret = compile_image(hosts->string_, image_path);
+		}
+	}
+	struct hints_image *img = ret == 0 ? hints_image_open(image_path) : NULL;
+	if (img) {
+		VERBOSE_MSG(NULL, "using image '%s' of %u names and %u addresses\n", image_path,
+			    hints_image_count(img, false), hints_image_count(img, true));
+		hints_image_close(data->image);
+		data->image = img;
+	}
+	json_delete(root);
+
+	return bool2jsonstr(img != NULL);
+}
+
 /**
  * Set name => address hint.
  *
@@ -427,6 +853,7 @@ static char* hint_set(void *env, struct kr_module *module, const char *args)
 			ret = add_pair(&data->hints, args_copy, addr);
 		}
 	}
+	hints_mem_update(module);
 
 	return bool2jsonstr(ret == 0);
 }
@@ -447,6 +874,7 @@ static char* hint_del(void *env, struct kr_module *module, const char *args)
 		++addr;
 	}
 	ret = del_pair(data, args_copy, addr);
+	hints_mem_update(module);
 
 	return bool2jsonstr(ret == 0);
 }
@@ -469,6 +897,29 @@ static JsonNode *pack_addrs(pack_t *pack)
 	return root;
 }
 
+/** @internal Pack addresses of the name in the image into JSON array, NULL if none. */
+static JsonNode *image_addrs(const struct hints_image *img, const knot_dname_t *name)
+{
+	char buf[INET6_ADDRSTRLEN];
+	JsonNode *root = NULL;
+	static const int families[] = { AF_INET, AF_INET6 };
+	for (int i = 0; i < 2; ++i) {
+		const uint8_t *addrs = NULL;
+		int count = hints_image_addrs(img, name, families[i], &addrs);
+		for (int j = 0; j < count; ++j) {
+			const uint8_t *addr = addrs + j * kr_family_len(families[i]);
+			if (!inet_ntop(families[i], addr, buf, sizeof(buf))) {
+				break;
+			}
+			if (!root) {
+				root = json_mkarray();
+			}
+			json_append_element(root, json_mkstring(buf));
+		}
+	}
+	return root;
+}
+
 static char* pack_hints(struct kr_zonecut *hints);
 /**
  * Retrieve address hints, either for given name or for all names.
@@ -478,7 +929,8 @@ static char* pack_hints(struct kr_zonecut *hints);
  */
 static char* hint_get(void *env, struct kr_module *module, const char *args)
 {
-	struct kr_zonecut *hints = &((struct hints_data *) module->data)->hints;
+	struct hints_data *data = module->data;
+	struct kr_zonecut *hints = &data->hints;
 	if (!hints) {
 		assert(false);
 		return NULL;
@@ -489,16 +941,18 @@ static char* hint_get(void *env, struct kr_module *module, const char *args)
 	}
 
 	knot_dname_t key[KNOT_DNAME_MAXLEN];
-	pack_t *pack = NULL;
-	if (knot_dname_from_str(key, args, sizeof(key))) {
-		pack = kr_zonecut_find(hints, key);
-	}
-	if (!pack || pack->len == 0) {
+	if (!knot_dname_from_str(key, args, sizeof(key))) {
 		return NULL;
 	}
+	JsonNode *root = NULL;
+	pack_t *pack = kr_zonecut_find(hints, key);
+	if (pack && pack->len > 0) {
+		root = pack_addrs(pack);
+	} else {
+		root = image_addrs(data->image, key);
+	}
 
 	char *result = NULL;
-	JsonNode *root = pack_addrs(pack);
 	if (root) {
 		result = json_encode(root);
 		json_delete(root);
@@ -612,7 +1066,10 @@ int hints_init(struct kr_module *module)
 	}
 	kr_zonecut_init(&data->hints, (const uint8_t *)(""), pool);
 	kr_zonecut_init(&data->reverse_hints, (const uint8_t *)(""), pool);
+	data->image = NULL;
+	data->watches = NULL;
 	module->data = data;
+	hints_mem_update(module);
 
 	return kr_ok();
 }
@@ -625,9 +1082,12 @@ int hints_deinit(struct kr_module *module)
 	if (data) {
 		kr_zonecut_deinit(&data->hints);
 		kr_zonecut_deinit(&data->reverse_hints);
+		hints_image_close(data->image);
+		watches_close(data);
 		mp_delete(data->hints.pool->ctx);
 		module->data = NULL;
 	}
+	hints_mem_update(module);
 	return kr_ok();
 }
 
@@ -645,9 +1105,10 @@ int hints_config(struct kr_module *module, const char *conf)
 	}
 
 	if (conf && conf[0]) {
-		return load_file(module, conf);
+		err = load_file(module, conf);
 	}
-	return kr_ok();
+	hints_mem_update(module);
+	return err;
 }
 
 KR_EXPORT
@@ -658,6 +1119,7 @@ struct kr_prop *hints_props(void)
 	    { &hint_del,    "del", "Delete one {name, address} hint or all addresses for the name.", },
 	    { &hint_get,    "get", "Retrieve hint for given name.", },
 	    { &hint_add_hosts, "add_hosts", "Load a file with hosts-like formatting and add contents into hints.", },
+	    { &hint_image,  "image", "Use an image of a hosts-like file, compiling it first if it's outdated.", },
 	    { &hint_root,   "root", "Replace root hints set (empty value to return current list).", },
 	    { &hint_root_file, "root_file", "Replace root hints set from a zonefile.", },
 	    { NULL, NULL, NULL }
@@ -2,7 +2,7 @@ hints_CFLAGS := -fPIC
 # We use a symbol that's not in libkres but the daemon.
 # On darwin this isn't accepted by default.
 hints_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
-hints_SOURCES := modules/hints/hints.c
+hints_SOURCES := modules/hints/hints.c modules/hints/image.c
 hints_DEPEND := $(libkres)
 hints_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
 $(call make_c_module,hints)
@@ -0,0 +1,441 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** @file
+ * Image file layout, all in host byte order (it's never moved between hosts):
+ *
+ *   struct image_header
+ *   uint32_t name_off[names]       -- offsets of the forward records, sorted by key
+ *   uint32_t reverse_off[reverse]  -- offsets of the reverse records, sorted by key
+ *   forward records                -- names_len bytes
+ *   reverse records                -- reverse_len bytes
+ *
+ * Keys are kr_dname_lf() of the lowercased names.  A forward record is
+ * the key (length byte first), uint16_t counts of the IPv4 and IPv6
+ * addresses and the addresses themselves; a reverse record is the key
+ * and the PTR target (length byte first).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <contrib/ucw/lib.h>
+
+#include "lib/utils.h"
+#include "modules/hints/image.h"
+
+#define IMAGE_MAGIC "KRHINTS\1"
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][hint] " fmt, ## __VA_ARGS__)
+
+struct image_header {
+	char magic[8];
+	int64_t hosts_mtime;  /**< Of the hosts file that was compiled */
+	int64_t hosts_size;
+	uint32_t names;       /**< Number of forward records */
+	uint32_t reverse;     /**< Number of reverse records */
+	uint64_t names_len;   /**< Length of the forward records */
+	uint64_t reverse_len; /**< Length of the reverse records */
+};
+
+struct hints_image {
+	void *map;
+	size_t map_len;
+	const struct image_header *hdr;
+	const uint32_t *name_off;
+	const uint32_t *reverse_off;
+	const uint8_t *names;
+	const uint8_t *reverse;
+};
+
+/** Growing buffer of records. */
+struct buf {
+	uint8_t *at;
+	size_t len, cap;
+	uint32_t count;
+};
+
+/** The entries are records in the buffers: key, value (both with a length byte). */
+struct hints_builder {
+	struct buf fwd;  /**< lf(lowercased name) -> address */
+	struct buf rev;  /**< lf(reverse name) -> name */
+};
+
+static uint8_t *buf_reserve(struct buf *b, size_t len)
+{
+	if (b->len + len > b->cap) {
+		size_t cap = MAX(MAX(2 * b->cap, 4096), b->len + len);
+		uint8_t *at = realloc(b->at, cap);
+		if (!at) {
+			return NULL;
+		}
+		b->at = at;
+		b->cap = cap;
+	}
+	uint8_t *ret = b->at + b->len;
+	b->len += len;
+	return ret;
+}
+
+static int buf_entry(struct buf *b, const uint8_t *lf, const uint8_t *val, uint8_t val_len)
+{
+	uint8_t *at = buf_reserve(b, lf[0] + 2 + val_len);
+	if (!at) {
+		return kr_error(ENOMEM);
+	}
+	memcpy(at, lf, lf[0] + 1);
+	at += lf[0] + 1;
+	*at = val_len;
+	memcpy(at + 1, val, val_len);
+	b->count += 1;
+	return kr_ok();
+}
+
+static const uint8_t *entry_val(const uint8_t *entry)
+{
+	return entry + entry[0] + 1;
+}
+
+static int key_cmp(const uint8_t *a, const uint8_t *b)
+{
+	int ret = memcmp(a + 1, b + 1, MIN(a[0], b[0]));
+	return ret ? ret : (int)a[0] - (int)b[0];
+}
+
+/** Order by key, then in insertion order (the entries point into one buffer). */
+static int entry_cmp(const void *a, const void *b)
+{
+	const uint8_t *ea = *(const uint8_t **)a, *eb = *(const uint8_t **)b;
+	int ret = key_cmp(ea, eb);
+	return ret ? ret : (ea > eb) - (ea < eb);
+}
+
+struct hints_builder *hints_builder_new(void)
+{
+	return calloc(1, sizeof(struct hints_builder));
+}
+
+void hints_builder_free(struct hints_builder *b)
+{
+	if (b) {
+		free(b->fwd.at);
+		free(b->rev.at);
+		free(b);
+	}
+}
+
+static int name_lf(uint8_t *lf, const knot_dname_t *name)
+{
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	int len = knot_dname_size(name);
+	if (len <= 0 || len > KNOT_DNAME_MAXLEN) {
+		return kr_error(EINVAL);
+	}
+	memcpy(lower, name, len);
+	knot_dname_to_lower(lower);
+	return kr_dname_lf(lf, lower, false);
+}
+
+int hints_builder_add(struct hints_builder *b, const knot_dname_t *name,
+		      const uint8_t *addr, size_t addr_len, const knot_dname_t *reverse)
+{
+	if (!b || !name || !addr || !reverse || (addr_len != 4 && addr_len != 16)) {
+		return kr_error(EINVAL);
+	}
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	int ret = name_lf(lf, name);
+	if (ret == 0) {
+		ret = buf_entry(&b->fwd, lf, addr, addr_len);
+	}
+	if (ret == 0) {
+		ret = name_lf(lf, reverse);
+	}
+	if (ret == 0) {
+		ret = buf_entry(&b->rev, lf, name, knot_dname_size(name));
+	}
+	return ret;
+}
+
+/** Return the entries of the buffer, sorted. */
+static const uint8_t **buf_sort(const struct buf *b)
+{
+	const uint8_t **sorted = malloc(sizeof(*sorted) * MAX(b->count, 1));
+	if (!sorted) {
+		return NULL;
+	}
+	size_t at = 0;
+	for (uint32_t i = 0; i < b->count; ++i) {
+		sorted[i] = b->at + at;
+		at += sorted[i][0] + 1; /* key */
+		at += b->at[at] + 1;    /* value */
+	}
+	qsort(sorted, b->count, sizeof(*sorted), entry_cmp);
+	return sorted;
+}
+
+/** Append the forward record of the entries [i, end); duplicate addresses are skipped. */
+static int fwd_record(struct buf *out, const uint8_t **sorted, uint32_t i, uint32_t end)
+{
+	const uint8_t *key = sorted[i];
+	uint8_t *at = buf_reserve(out, key[0] + 1 + 2 * sizeof(uint16_t));
+	if (!at) {
+		return kr_error(ENOMEM);
+	}
+	memcpy(at, key, key[0] + 1);
+	size_t counts_at = at - out->at + key[0] + 1;
+	uint16_t counts[2] = { 0, 0 };
+	for (int v6 = 0; v6 < 2; ++v6) {
+		const uint8_t addr_len = v6 ? 16 : 4;
+		size_t first = out->len;
+		for (uint32_t j = i; j < end; ++j) {
+			const uint8_t *val = entry_val(sorted[j]);
+			if (val[0] != addr_len || counts[v6] == UINT16_MAX) {
+				continue;
+			}
+			bool dup = false;
+			for (size_t k = first; k < out->len && !dup; k += addr_len) {
+				dup = memcmp(out->at + k, val + 1, addr_len) == 0;
+			}
+			if (dup) {
+				continue;
+			}
+			if (!(at = buf_reserve(out, addr_len))) {
+				return kr_error(ENOMEM);
+			}
+			memcpy(at, val + 1, addr_len);
+			counts[v6] += 1;
+		}
+	}
+	memcpy(out->at + counts_at, counts, sizeof(counts));
+	out->count += 1;
+	return kr_ok();
+}
+
+/** Append the reverse record of the entries [i, end), the last one wins. */
+static int rev_record(struct buf *out, const uint8_t **sorted, uint32_t i, uint32_t end)
+{
+	const uint8_t *key = sorted[i];
+	const uint8_t *val = entry_val(sorted[end - 1]);
+	uint8_t *at = buf_reserve(out, key[0] + 1 + val[0] + 1);
+	if (!at) {
+		return kr_error(ENOMEM);
+	}
+	memcpy(at, key, key[0] + 1);
+	memcpy(at + key[0] + 1, val, val[0] + 1);
+	out->count += 1;
+	return kr_ok();
+}
+
+/** Merge the entries with the same key into records, remembering their offsets. */
+static int build_records(const struct buf *in, struct buf *out, uint32_t **off,
+			 int (*record)(struct buf *, const uint8_t **, uint32_t, uint32_t))
+{
+	const uint8_t **sorted = buf_sort(in);
+	*off = malloc(sizeof(**off) * MAX(in->count, 1));
+	if (!sorted || !*off) {
+		free(sorted);
+		return kr_error(ENOMEM);
+	}
+	int ret = kr_ok();
+	for (uint32_t i = 0, end = 0; i < in->count && ret == 0; i = end) {
+		for (end = i + 1; end < in->count && key_cmp(sorted[i], sorted[end]) == 0; ++end) {
+			;
+		}
+		if (out->len > UINT32_MAX) {
+			ret = kr_error(EFBIG);
+			break;
+		}
+		(*off)[out->count] = out->len;
+		ret = record(out, sorted, i, end);
+	}
+	free(sorted);
+	return ret;
+}
+
+int hints_builder_write(struct hints_builder *b, const struct stat *hosts_st, FILE *f)
+{
+	if (!b || !hosts_st || !f) {
+		return kr_error(EINVAL);
+	}
+	struct buf names = { NULL }, reverse = { NULL };
+	uint32_t *name_off = NULL, *reverse_off = NULL;
+	int ret = build_records(&b->fwd, &names, &name_off, fwd_record);
+	if (ret == 0) {
+		ret = build_records(&b->rev, &reverse, &reverse_off, rev_record);
+	}
+	if (ret == 0) {
+		struct image_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+		hdr.hosts_mtime = hosts_st->st_mtime;
+		hdr.hosts_size = hosts_st->st_size;
+		hdr.names = names.count;
+		hdr.reverse = reverse.count;
+		hdr.names_len = names.len;
+		hdr.reverse_len = reverse.len;
+		fwrite(&hdr, sizeof(hdr), 1, f);
+		fwrite(name_off, sizeof(*name_off), names.count, f);
+		fwrite(reverse_off, sizeof(*reverse_off), reverse.count, f);
+		fwrite(names.at, 1, names.len, f);
+		fwrite(reverse.at, 1, reverse.len, f);
+		ret = ferror(f) ? kr_error(EIO) : kr_ok();
+	}
+	free(name_off);
+	free(reverse_off);
+	free(names.at);
+	free(reverse.at);
+	return ret;
+}
+
+/** Return the length of the image the header describes. */
+static size_t image_len(const struct image_header *hdr)
+{
+	return sizeof(*hdr) + sizeof(uint32_t) * ((size_t)hdr->names + hdr->reverse)
+		+ hdr->names_len + hdr->reverse_len;
+}
+
+bool hints_image_stale(const char *image_path, const char *hosts_path)
+{
+	struct stat hosts_st, image_st;
+	struct image_header hdr;
+	if (!image_path || !hosts_path || stat(hosts_path, &hosts_st) != 0) {
+		return true;
+	}
+	int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return true;
+	}
+	ssize_t len = pread(fd, &hdr, sizeof(hdr), 0);
+	int ret = fstat(fd, &image_st);
+	close(fd);
+	return len != sizeof(hdr) || ret != 0
+		|| memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0
+		|| image_len(&hdr) != image_st.st_size
+		|| hdr.hosts_mtime != hosts_st.st_mtime || hdr.hosts_size != hosts_st.st_size;
+}
+
+struct hints_image *hints_image_open(const char *image_path)
+{
+	if (!image_path) {
+		return NULL;
+	}
+	int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERR_MSG("%s: %s\n", image_path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	struct hints_image *img = calloc(1, sizeof(*img));
+	void *map = MAP_FAILED;
+	if (img && fstat(fd, &st) == 0 && st.st_size >= sizeof(struct image_header)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd); /* the mapping stays, even after a rename over the file */
+	if (map == MAP_FAILED) {
+		ERR_MSG("%s: can't map the image\n", image_path);
+		free(img);
+		return NULL;
+	}
+	img->map = map;
+	img->map_len = st.st_size;
+	img->hdr = map;
+	if (memcmp(img->hdr->magic, IMAGE_MAGIC, sizeof(img->hdr->magic)) != 0 ||
+	    image_len(img->hdr) != img->map_len) {
+		ERR_MSG("%s: not a valid image\n", image_path);
+		hints_image_close(img);
+		return NULL;
+	}
+	img->name_off = (const uint32_t *)(img->hdr + 1);
+	img->reverse_off = img->name_off + img->hdr->names;
+	img->names = (const uint8_t *)(img->reverse_off + img->hdr->reverse);
+	img->reverse = img->names + img->hdr->names_len;
+	return img;
+}
+
+void hints_image_close(struct hints_image *img)
+{
+	if (img) {
+		munmap(img->map, img->map_len);
+		free(img);
+	}
+}
+
+uint32_t hints_image_count(const struct hints_image *img, bool reverse)
+{
+	if (!img) {
+		return 0;
+	}
+	return reverse ? img->hdr->reverse : img->hdr->names;
+}
+
+/** Return the record with the key of the name, or NULL. */
+static const uint8_t *find(const uint32_t *off, uint32_t count, const uint8_t *records,
+			   const knot_dname_t *name)
+{
+	uint8_t lf[KNOT_DNAME_MAXLEN + 1];
+	if (count == 0 || name_lf(lf, name) != 0) {
+		return NULL;
+	}
+	uint32_t lo = 0, hi = count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const uint8_t *rec = records + off[mid];
+		int cmp = key_cmp(rec, lf);
+		if (cmp == 0) {
+			return rec;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+int hints_image_addrs(const struct hints_image *img, const knot_dname_t *name, int family,
+		      const uint8_t **addrs)
+{
+	if (!img || !name || !addrs) {
+		return 0;
+	}
+	const uint8_t *rec = find(img->name_off, img->hdr->names, img->names, name);
+	if (!rec) {
+		return 0;
+	}
+	rec += rec[0] + 1;
+	uint16_t counts[2];
+	memcpy(counts, rec, sizeof(counts));
+	rec += sizeof(counts);
+	if (family == AF_INET6) {
+		*addrs = rec + 4 * counts[0];
+		return counts[1];
+	}
+	*addrs = rec;
+	return family == AF_INET ? counts[0] : 0;
+}
+
+const knot_dname_t *hints_image_ptr(const struct hints_image *img, const knot_dname_t *name)
+{
+	if (!img || !name) {
+		return NULL;
+	}
+	const uint8_t *rec = find(img->reverse_off, img->hdr->reverse, img->reverse, name);
+	return rec ? rec + rec[0] + 2 : NULL;
+}
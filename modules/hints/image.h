@@ -0,0 +1,74 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file image.h
+ * @brief Immutable image of a hosts file, shared by mmap().
+ *
+ * A large hosts file is compiled once into a file with sorted forward
+ * and reverse records, which all the forks map read-only, so they share
+ * the pages and do a binary search instead of building their own tries.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <libknot/dname.h>
+
+/** Hints in insertion order, before sorting (opaque). */
+struct hints_builder;
+/** Mapped image (opaque). */
+struct hints_image;
+
+struct hints_builder *hints_builder_new(void);
+void hints_builder_free(struct hints_builder *b);
+
+/**
+ * Add a name - address pair and its reverse record.
+ * As with the hints, all the addresses of a name are kept in order
+ * and the last name added for an address wins in PTR answers.
+ * @param reverse the reverse name of the address
+ */
+int hints_builder_add(struct hints_builder *b, const knot_dname_t *name,
+		      const uint8_t *addr, size_t addr_len, const knot_dname_t *reverse);
+
+/** Sort the hints and write the image, recording the hosts file it's compiled from. */
+int hints_builder_write(struct hints_builder *b, const struct stat *hosts_st, FILE *f);
+
+/** Return true if the image file isn't compiled from the current hosts file (or invalid). */
+bool hints_image_stale(const char *image_path, const char *hosts_path);
+
+/** Map the image file, return NULL on error (logged). */
+struct hints_image *hints_image_open(const char *image_path);
+
+void hints_image_close(struct hints_image *img);
+
+/** Return the number of names and of reverse names. */
+uint32_t hints_image_count(const struct hints_image *img, bool reverse);
+
+/**
+ * Find the addresses of the name.
+ * @param family AF_INET or AF_INET6
+ * @param addrs set to the addresses packed one after another, in network order
+ * @return number of the addresses
+ */
+int hints_image_addrs(const struct hints_image *img, const knot_dname_t *name, int family,
+		      const uint8_t **addrs);
+
+/** Find the PTR target of the reverse name, or NULL. */
+const knot_dname_t *hints_image_ptr(const struct hints_image *img, const knot_dname_t *name);
@@ -30,7 +30,30 @@ local function test_custom()
 		'real IP address for a.root-servers.net. is correct')
 end
 
+-- test compiling a hosts file into a shared image
+local function test_image()
+	local hosts, image = os.tmpname(), os.tmpname()
+	local f = io.open(hosts, 'w')
+	f:write('192.0.2.1 Image.Example image-alias.example\n', '2001:db8::1 image.example\n')
+	f:close()
+	os.remove(image)
+
+	same(hints.image({hosts = hosts, image = image}).result, true, 'compile and map hosts image')
+	local addrs = hints.get('image.example.')
+	utils.contains(addrs, '192.0.2.1', 'image has IPv4 address')
+	utils.contains(addrs, '2001:db8::1', 'image has IPv6 address')
+	utils.contains(hints.get('image-alias.example.'), '192.0.2.1', 'image has alias')
+	same(hints.get('missing.example.'), nil, 'image lacks other names')
+	hints.set('image.example. 192.0.2.2')
+	utils.contains(hints.get('image.example.'), '192.0.2.2', 'set hints take precedence')
+	same(hints.image(image).result, true, 'map precompiled image')
+	os.remove(hosts)
+	os.remove(image)
+	os.remove(image .. '.lock')
+end
+
 return {
 	test_default,
-	test_custom
+	test_custom,
+	test_image,
 }
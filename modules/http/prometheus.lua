@@ -18,7 +18,12 @@ local function merge(t, results, prefix)
 end
 
 local function getstats()
-	local t = {}
+	-- Read the counters of all forks from the shared memory, without asking them
+	local t = worker.shared_stats and worker.shared_stats()
+	if t then
+		return t
+	end
+	t = {}
 	merge(t, map 'stats.list()', '')
 	merge(t, map 'cache.stats()', 'cache.')
 	merge(t, map 'worker.stats()', 'worker.')
@@ -51,10 +56,11 @@ local function snapshot_start()
 			upstreams = stats.upstreams()
 			for k,v in pairs(upstreams) do
 				local gi
-				if string.find(k, '.', 1, true) then
-					gi = http.geoip:search_ipv4(k)
+				local addr = k:match('^[^#]+')
+				if string.find(addr, '.', 1, true) then
+					gi = http.geoip:search_ipv4(addr)
 				else
-					gi = http.geoip:search_ipv6(k)
+					gi = http.geoip:search_ipv6(addr)
 				end
 				if gi then
 					upstreams[k] = {data=v, location=gi.location, country=gi.country and gi.country.iso_code}
@@ -113,18 +119,31 @@ end
 
 -- Render stats in Prometheus text format
 local function serve_prometheus()
+	-- Rendered in C from the counters of all forks, with the configured histograms
+	if stats.prometheus then
+		return stats.prometheus()
+	end
 	-- First aggregate metrics list and print counters
 	local slist, render = getstats(), {}
-	local latency = {}
+	local latency, phases = {}, {}
 	local counter = '# TYPE %s counter\n%s %f'
 	for k,v in pairs(slist) do
 		k = select(1, k:gsub('%.', '_'))
 		-- Aggregate histograms
 		local band = k:match('answer_([%d]+)ms')
+		local phase, pband = k:match('^phase_(%a+)_([%w]+)$')
 		if band then
 			table.insert(latency, {band, v})
 		elseif k == 'answer_slow' then
 			table.insert(latency, {'+Inf', v})
+		elseif phase then
+			phases[phase] = phases[phase] or {bands = {}, sum = 0}
+			if pband == 'sum' then
+				phases[phase].sum = v
+			else
+				table.insert(phases[phase].bands,
+					{pband == 'slow' and '+Inf' or pband:match('^(%d+)us$'), v})
+			end
 		-- Counter as a fallback
 		else table.insert(render, string.format(counter, k, k, v)) end
 	end
@@ -142,6 +161,19 @@ local function serve_prometheus()
 	end
 	table.insert(render, string.format('latency_count %f', count))
 	table.insert(render, string.format('latency_sum %f', sum))
+	-- Fill in per-phase histograms (in microseconds)
+	table.insert(render, '# TYPE phase_latency histogram')
+	for phase, hist in pairs(phases) do
+		table.sort(hist.bands, function (a,b) return kweight(a[1]) < kweight(b[1]) end)
+		local pcount = 0.0
+		for _,e in ipairs(hist.bands) do
+			pcount = pcount + e[2]
+			table.insert(render, string.format('phase_latency_bucket{phase="%s",le="%s"} %f',
+				phase, e[1], pcount))
+		end
+		table.insert(render, string.format('phase_latency_count{phase="%s"} %f', phase, pcount))
+		table.insert(render, string.format('phase_latency_sum{phase="%s"} %f', phase, hist.sum))
+	end
 	return table.concat(render, '\n') .. '\n'
 end
 
@@ -197,7 +197,7 @@ $(function() {
 		for (var key in resp) {
 			var val = resp[key];
 			if ('data' in val) {
-				maxQueries = Math.max(maxQueries, resp[key].data.length)
+				maxQueries = Math.max(maxQueries, resp[key].data.queries)
 			}
 		}
 		/* Update bubbles and prune the oldest */
@@ -206,8 +206,11 @@ $(function() {
 			if (!val.data || !val.location || val.location.longitude == null) {
 				continue;
 			}
-			var sum = val.data.reduce(function(a, b) { return a + b; });
-			var avg = sum / val.data.length;
+			var answers = val.data.queries - val.data.timeouts;
+			if (answers <= 0) {
+				continue;
+			}
+			var avg = val.data.rtt_sum / answers;
 			var geokey = toGeokey(val.location.longitude, val.location.latitude)
 			var found = bubblemap[geokey];
 			if (!found) {
@@ -227,8 +230,8 @@ $(function() {
 			}
 			found.rtt = (found.rtt + avg) / 2.0;
 			found.fillKey = colorBracket(found.rtt);
-			found.queries = found.queries + val.data.length;
-			found.radius = Math.max(5, 15*(val.data.length/maxQueries));
+			found.queries = val.data.queries;
+			found.radius = Math.max(5, 15*(val.data.queries/maxQueries));
 			found.age = age;
 		}
 		/* Prune bubbles not updated in a while. */
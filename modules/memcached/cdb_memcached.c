@@ -18,6 +18,11 @@
  *  @brief Implemented all the things that the resolver cache needs,
  *         it's not a general-purpose namedb implementation, and it can't
  *         be since it's *cache* by principle and it doesn't guarantee persistence anyway.
+ *
+ *  The sockets are non-blocking and each wait is bounded by MEMCACHED_TIMEOUT.
+ *  A read of several keys is a single multi-get; the writes are kept until the sync
+ *  and then sent together, without waiting for replies (NOREPLY, BUFFER_REQUESTS).
+ *  A failed server is skipped for MEMCACHED_RETRY and the cache just misses.
  */
 
 #include <assert.h>
@@ -31,12 +36,74 @@
 #include "lib/cache/api.h"
 #include "lib/utils.h"
 
+#ifndef MEMCACHED_TIMEOUT
+ #define MEMCACHED_TIMEOUT 100 /* ms for a connect or a read, the loop waits for it */
+#endif
+#ifndef MEMCACHED_RETRY
+ #define MEMCACHED_RETRY 1 /* s before contacting a failed server again */
+#endif
+#define MEMCACHED_MAXPENDING 1024 /* writes kept until sync */
+#define MEMCACHED_MAXKEYS 100 /* keys read at once */
+
+/** @internal Write waiting for the sync; the cache fills in the reserved value meanwhile. */
+struct memcached_pending {
+	knot_db_val_t key;
+	knot_db_val_t val; /**< Allocated together with the key */
+};
+
 /* memcached client */
 struct memcached_cli {
 	memcached_st *handle;
-	memcached_result_st res;
+	array_t(memcached_result_st *) results; /**< Of the reads, until sync */
+	array_t(struct memcached_pending) pending;
 };
 
+static void cli_decommit(struct memcached_cli *cli)
+{
+	for (unsigned i = 0; i < cli->results.len; ++i) {
+		memcached_result_free(cli->results.at[i]);
+	}
+	cli->results.len = 0;
+}
+
+static void cli_drop_pending(struct memcached_cli *cli)
+{
+	for (unsigned i = 0; i < cli->pending.len; ++i) {
+		free(cli->pending.at[i].key.data);
+	}
+	cli->pending.len = 0;
+}
+
+/** Send the pending writes at once, the replies aren't waited for. */
+static int cli_flush(struct memcached_cli *cli)
+{
+	if (cli->pending.len == 0) {
+		return kr_ok();
+	}
+	memcached_return_t ret = MEMCACHED_SUCCESS;
+	for (unsigned i = 0; i < cli->pending.len && memcached_success(ret); ++i) {
+		const struct memcached_pending *w = &cli->pending.at[i];
+		/* @note The values aren't interpreted; nothing in the cache outlives the TTL limit. */
+		ret = memcached_set(cli->handle, w->key.data, w->key.len, w->val.data, w->val.len,
+				    KR_CACHE_DEFAULT_TTL_MAX, 0);
+	}
+	cli_drop_pending(cli);
+	if (memcached_success(ret)) {
+		ret = memcached_flush_buffers(cli->handle);
+	}
+	return memcached_success(ret) ? kr_ok() : kr_error(EIO);
+}
+
+static void cli_free(struct memcached_cli *cli)
+{
+	cli_decommit(cli);
+	array_clear(cli->results);
+	cli_drop_pending(cli);
+	array_clear(cli->pending);
+	memcached_free(cli->handle);
+	free(cli);
+}
+
 static int cdb_init(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *pool)
 {
 	if (!db || !opts) {
@@ -48,39 +115,50 @@ static int cdb_init(knot_db_t **db, struct kr_cdb_opts *opts, knot_mm_t *pool)
 		return kr_error(ENOMEM);
 	}
 	memset(cli, 0, sizeof(*cli));
+	cli->handle = memcached_create(NULL);
+	if (!cli->handle) {
+		free(cli);
+		return kr_error(ENOMEM);
+	}
+
+	/* Defaults, the configuration string may override them. */
+	static const struct { memcached_behavior_t flag; uint64_t val; } defaults[] = {
+		{ MEMCACHED_BEHAVIOR_NO_BLOCK, 1 },
+		{ MEMCACHED_BEHAVIOR_TCP_NODELAY, 1 },
+		{ MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, MEMCACHED_TIMEOUT },
+		{ MEMCACHED_BEHAVIOR_POLL_TIMEOUT, MEMCACHED_TIMEOUT },
+		{ MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT, 1 },
+		{ MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, MEMCACHED_RETRY },
+		{ MEMCACHED_BEHAVIOR_NOREPLY, 1 },
+		{ MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1 },
+	};
+	for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); ++i) {
+		(void) memcached_behavior_set(cli->handle, defaults[i].flag, defaults[i].val);
+	}
 
 	/* Make sure we're running on binary protocol, as the
 	 * textual protocol is broken for binary keys. */
 	auto_free char *config_str = kr_strcatdup(2, opts->path, " --BINARY-PROTOCOL");
-	cli->handle = memcached(config_str, strlen(config_str));
-	if (!cli->handle) {
-		free(cli);
+	if (!config_str || !memcached_success(memcached_parse_configuration(
+				cli->handle, config_str, strlen(config_str)))) {
+		cli_free(cli);
 		return kr_error(EIO);
 	}
 
-	/* Create result set */
-	memcached_result_st *res = memcached_result_create(cli->handle, &cli->res);
-	if (!res) {
-		memcached_free(cli->handle);
-		free(cli);
-		return kr_error(ENOMEM);
-	}
-
 	*db = cli;
 	return 0;
 }
 
 static void cdb_deinit(knot_db_t *db)
 {
-	struct memcached_cli *cli = db;
-	memcached_result_free(&cli->res);
-	memcached_free(cli->handle);
-	free(cli);
+	cli_free(db);
 }
 
 static int cdb_sync(knot_db_t *db)
 {
-	return 0;
+	struct memcached_cli *cli = db;
+	cli_decommit(cli);
+	return cli_flush(cli);
 }
 
 static int cdb_count(knot_db_t *db)
@@ -99,8 +177,12 @@ static int cdb_count(knot_db_t *db)
 static int cdb_clear(knot_db_t *db)
 {
 	struct memcached_cli *cli = db;
+	cli_drop_pending(cli);
 	memcached_return_t ret = memcached_flush(cli->handle, 0);
-	if (ret != 0) {
+	if (memcached_success(ret)) {
+		ret = memcached_flush_buffers(cli->handle);
+	}
+	if (!memcached_success(ret)) {
 		return kr_error(EIO);
 	}
 	return 0;
@@ -112,33 +194,51 @@ static int cdb_readv(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val
 	if (!db || !key || !val) {
 		return kr_error(EINVAL);
 	}
+	if (maxcount > MEMCACHED_MAXKEYS) {
+		return kr_error(E2BIG);
+	}
 
 	struct memcached_cli *cli = db;
 
 	/* Convert to libmemcached query format */
-	assert(maxcount < 1000); /* Sane upper bound */
-	const char *keys [maxcount];
-	size_t lengths [maxcount];
+	const char *keys[MEMCACHED_MAXKEYS];
+	size_t lengths[MEMCACHED_MAXKEYS];
 	for (int i = 0; i < maxcount; ++i) {
 		keys[i] = key[i].data;
 		lengths[i] = key[i].len;
+		val[i].data = NULL;
+		val[i].len = 0;
 	}
 
-	/* Execute multiple get and retrieve results */
+	/* Execute multiple get, the results come in any order and the misses don't. */
 	memcached_return_t status = memcached_mget(cli->handle, keys, lengths, maxcount);
-	memcached_result_free(&cli->res);
-	memcached_result_create(cli->handle, &cli->res);
-	for (int i = 0; i < maxcount; ++i) {
-		memcached_result_st *res = memcached_fetch_result(cli->handle, &cli->res, &status);
-		if (!res) { /* Less results than expected */
-			return kr_error(ENOENT);
+	if (!memcached_success(status)) {
+		return kr_error(EIO);
+	}
+	int found = 0;
+	memcached_result_st *res = NULL;
+	while ((res = memcached_fetch_result(cli->handle, NULL, &status)) != NULL) {
+		/* Track the result until sync, the value points into it. */
+		if (array_push(cli->results, res) < 0) {
+			memcached_result_free(res);
+			continue;
+		}
+		const char *res_key = memcached_result_key_value(res);
+		const size_t res_len = memcached_result_key_length(res);
+		for (int i = 0; i < maxcount; ++i) {
+			if (!val[i].data && lengths[i] == res_len
+			    && memcmp(keys[i], res_key, res_len) == 0) {
+				val[i].len = memcached_result_length(res);
+				val[i].data = (void *)memcached_result_value(res);
+				found += 1;
+				break;
+			}
 		}
-		val[i].len = memcached_result_length(res);
-		val[i].data = (void *)memcached_result_value(res);
 	}
-	return 0;
+	return found == maxcount ? 0 : kr_error(ENOENT);
 }
 
+/** Keep the writes until the sync; a value without data is reserved for the caller to fill. */
 static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *val,
 			int maxcount)
 {
@@ -147,23 +247,30 @@ static int cdb_writev(knot_db_t *db, const knot_db_val_t *key, knot_db_val_t *va
 	}
 
 	struct memcached_cli *cli = db;
-	/* @warning This expects usage only for recursor cache, if anyone
-	 *          desires to port this somewhere else, TTL shouldn't be interpreted.
-	 */
-	memcached_return_t ret = 0;
+	/* The values reserved by the previous calls are filled in by now. */
+	if (cli->pending.len + maxcount > MEMCACHED_MAXPENDING) {
+		(void) cli_flush(cli);
+	}
 	for (int i = 0; i < maxcount; ++i) {
-		if (val->len < 2) {
-			/* @note Special values/namespaces, not a RR entry with TTL. */
-			ret = memcached_set(cli->handle, key[i].data, key[i].len, val[i].data, val[i].len, 0, 0);
-		} else {
-			struct kr_cache_entry *entry = val[i].data;
-			ret = memcached_set(cli->handle, key[i].data, key[i].len, val[i].data, val[i].len, entry->ttl, 0);
+		uint8_t *buf = malloc(key[i].len + val[i].len);
+		if (!buf) {
+			return kr_error(ENOMEM);
+		}
+		struct memcached_pending w = {
+			.key = { .data = buf, .len = key[i].len },
+			.val = { .data = buf + key[i].len, .len = val[i].len },
+		};
+		memcpy(w.key.data, key[i].data, key[i].len);
+		if (val[i].data) {
+			memcpy(w.val.data, val[i].data, val[i].len);
 		}
-		if (ret != 0) {
-			break;
+		if (array_push(cli->pending, w) < 0) {
+			free(buf);
+			return kr_error(ENOMEM);
 		}
+		val[i].data = w.val.data;
 	}
-	return ret;
+	return 0;
 }
 
 static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
@@ -173,14 +280,16 @@ static int cdb_remove(knot_db_t *db, knot_db_val_t *key, int maxcount)
 	}
 
 	struct memcached_cli *cli = db;
-	memcached_return_t ret = 0;
-	for (int i = 0; i < maxcount; ++i) {
-		memcached_return_t ret = memcached_delete(cli->handle, key[i].data, key[i].len, 0);
-		if (ret != 0) {
-			break;
-		}
+	/* Keep the order with the pending writes. */
+	(void) cli_flush(cli);
+	memcached_return_t ret = MEMCACHED_SUCCESS;
+	for (int i = 0; i < maxcount && memcached_success(ret); ++i) {
+		ret = memcached_delete(cli->handle, key[i].data, key[i].len, 0);
 	}
-	return ret;
+	if (memcached_success(ret)) {
+		ret = memcached_flush_buffers(cli->handle);
+	}
+	return memcached_success(ret) ? 0 : kr_error(EIO);
 }
 
 static int cdb_match(knot_db_t *cache, knot_db_val_t *key, knot_db_val_t *val, int maxcount)
@@ -191,13 +300,19 @@ static int cdb_match(knot_db_t *cache, knot_db_val_t *key, knot_db_val_t *val, i
 	return kr_error(ENOSYS);
 }
 
+static int cdb_read_leq(knot_db_t *cache, knot_db_val_t *key, knot_db_val_t *val)
+{
+	return kr_error(ENOSYS);
+}
+
 const struct kr_cdb_api *cdb_memcached(void)
 {
 	static const struct kr_cdb_api api = {
 		"memcached",
 		cdb_init, cdb_deinit, cdb_count, cdb_clear, cdb_sync,
 		cdb_readv, cdb_writev, cdb_remove,
-		cdb_match, NULL /* prune */
+		cdb_match, NULL /* prune */,
+		cdb_read_leq, NULL /* walk */, NULL /* usage_percent */
 	};
 
 	return &api;
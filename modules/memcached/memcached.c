@@ -40,6 +40,9 @@ int memcached_deinit(struct kr_module *module)
 	if (engine->resolver.cache.api == cdb_memcached()) {
 		kr_cache_close(&engine->resolver.cache);
 	}
+	if (kr_cache_remote_api(&engine->resolver.cache) == cdb_memcached()) {
+		kr_cache_remote_close(&engine->resolver.cache);
+	}
 	/* Prevent from loading it again */
 	for (unsigned i = 0; i < engine->backends.len; ++i) {
 		const struct kr_cdb_api *api = engine->backends.at[i];
@@ -1,6 +1,13 @@
 # List of built-in modules
 modules_TARGETS := hints \
-                   stats
+                   stats \
+                   rrl \
+                   peering \
+                   serve_stale \
+                   zone_guard \
+                   dns64 \
+                   renumber \
+                   graphite
 
 # DNS cookies
 ifeq ($(ENABLE_COOKIES),yes)
@@ -13,33 +20,30 @@ endif
 
 # Memcached
 ifeq ($(HAS_libmemcached),yes)
-#modules_TARGETS += memcached
+modules_TARGETS += memcached
 endif
 # Redis
 ifeq ($(HAS_hiredis),yes)
-#modules_TARGETS += redis
+modules_TARGETS += redis
 endif
 
 # List of Lua modules
 ifeq ($(HAS_lua),yes)
 modules_TARGETS += etcd \
                    ta_sentinel \
-                   graphite \
                    policy \
                    view \
                    predict \
-                   dns64 \
-                   renumber \
                    http \
                    daf \
                    workarounds \
                    version \
                    ta_signal_query \
                    priming \
-                   serve_stale \
                    detect_time_skew \
                    detect_time_jump \
-                   prefill
+                   prefill \
+                   snapshot
 endif
 
 # Make C module
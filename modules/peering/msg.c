@@ -0,0 +1,148 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libknot/descriptor.h>
+#include <libknot/dname.h>
+#include <contrib/ucw/lib.h>
+#include <contrib/wire.h>
+
+#include "modules/peering/msg.h"
+#include "lib/defines.h"
+#include "lib/utils.h"
+
+#define PEERING_VERSION 1
+#define PEERING_HEAD 8
+#define PEERING_MAC 8
+
+/** Append the RDATA of the set as length + data, return the end or NULL if it doesn't fit. */
+static uint8_t *write_rdataset(uint8_t *pos, const uint8_t *end, const knot_rdataset_t *rrs)
+{
+	if (end - pos < 2) {
+		return NULL;
+	}
+	wire_write_u16(pos, rrs->rr_count);
+	pos += 2;
+	knot_rdata_t *rd = rrs->data;
+	for (uint16_t i = 0; i < rrs->rr_count; ++i) {
+		const uint16_t len = knot_rdata_rdlen(rd);
+		if (end - pos < 2 + len) {
+			return NULL;
+		}
+		wire_write_u16(pos, len);
+		memcpy(pos + 2, knot_rdata_data(rd), len);
+		pos += 2 + len;
+		rd = kr_rdataset_next(rd);
+	}
+	return pos;
+}
+
+size_t peering_msg_write(uint8_t msg[PEERING_MSG_MAX], const uint8_t key[KR_SIPHASH_KEY_SIZE],
+			 uint32_t now, const knot_rrset_t *rr, const knot_rrset_t *rrsig)
+{
+	const uint8_t *end = msg + PEERING_MSG_MAX - PEERING_MAC;
+	msg[0] = 'K';
+	msg[1] = 'P';
+	msg[2] = PEERING_VERSION;
+	msg[3] = 0;
+	wire_write_u32(msg + 4, now);
+	uint8_t *pos = msg + PEERING_HEAD;
+	const int owner_len = knot_dname_size(rr->owner);
+	if (owner_len <= 0 || end - pos < owner_len + 6) {
+		return 0;
+	}
+	memcpy(pos, rr->owner, owner_len);
+	pos += owner_len;
+	wire_write_u16(pos, rr->type);
+	wire_write_u32(pos + 2, knot_rrset_ttl(rr));
+	pos = write_rdataset(pos + 6, end, &rr->rrs);
+	if (pos && rrsig) {
+		pos = write_rdataset(pos, end, &rrsig->rrs);
+	} else if (pos && end - pos >= 2) {
+		wire_write_u16(pos, 0);
+		pos += 2;
+	} else {
+		pos = NULL;
+	}
+	if (!pos) {
+		return 0;
+	}
+	wire_write_u64(pos, kr_siphash24(key, msg, pos - msg));
+	return pos + PEERING_MAC - msg;
+}
+
+/** Read a length-prefixed RDATA set into the RRset, return the end or NULL. */
+static const uint8_t *read_rdataset(const uint8_t *pos, const uint8_t *end,
+				    knot_rrset_t *rr, uint32_t ttl, knot_mm_t *pool)
+{
+	if (end - pos < 2) {
+		return NULL;
+	}
+	const uint16_t count = wire_read_u16(pos);
+	pos += 2;
+	for (uint16_t i = 0; i < count; ++i) {
+		if (end - pos < 2) {
+			return NULL;
+		}
+		const uint16_t len = wire_read_u16(pos);
+		if (end - pos < 2 + len
+		    || knot_rrset_add_rdata(rr, pos + 2, len, ttl, pool) != 0) {
+			return NULL;
+		}
+		pos += 2 + len;
+	}
+	return pos;
+}
+
+int peering_msg_read(const uint8_t *msg, size_t len, const uint8_t key[KR_SIPHASH_KEY_SIZE],
+		     uint32_t now, uint32_t ttl_max, knot_dname_t owner[KNOT_DNAME_MAXLEN],
+		     knot_rrset_t *rr, knot_rrset_t *rrsig, knot_mm_t *pool)
+{
+	knot_rrset_init(rr, owner, 0, KNOT_CLASS_IN);
+	knot_rrset_init(rrsig, owner, KNOT_RRTYPE_RRSIG, KNOT_CLASS_IN);
+	if (len < PEERING_HEAD + PEERING_MAC + 1 || msg[0] != 'K' || msg[1] != 'P'
+	    || msg[2] != PEERING_VERSION) {
+		return kr_error(EBADMSG);
+	}
+	const uint8_t *end = msg + len - PEERING_MAC;
+	if (wire_read_u64(end) != kr_siphash24(key, msg, end - msg)) {
+		return kr_error(EBADMSG);
+	}
+	const int64_t sent = wire_read_u32(msg + 4);
+	if (sent > (int64_t)now + PEERING_SKEW || sent < (int64_t)now - PEERING_SKEW) {
+		return kr_error(EBADMSG);
+	}
+	const uint8_t *pos = msg + PEERING_HEAD;
+	const int owner_len = knot_dname_wire_check(pos, end, NULL);
+	if (owner_len <= 0 || owner_len > KNOT_DNAME_MAXLEN || end - pos < owner_len + 6) {
+		return kr_error(EBADMSG);
+	}
+	memcpy(owner, pos, owner_len);
+	knot_dname_to_lower(owner);
+	rr->type = wire_read_u16(pos + owner_len);
+	const uint32_t ttl = MIN(wire_read_u32(pos + owner_len + 2), ttl_max);
+	if (rr->type == KNOT_RRTYPE_RRSIG || knot_rrtype_is_metatype(rr->type)) {
+		return kr_error(EBADMSG);
+	}
+	pos = read_rdataset(pos + owner_len + 6, end, rr, ttl, pool);
+	if (pos) {
+		pos = read_rdataset(pos, end, rrsig, ttl, pool);
+	}
+	if (pos != end || knot_rrset_empty(rr)) {
+		return kr_error(EBADMSG);
+	}
+	return kr_ok();
+}
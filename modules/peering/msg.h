@@ -0,0 +1,61 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file msg.h
+ * @brief The datagrams the peers push an RRset with.
+ *
+ * Each RRset with its signatures is one UDP datagram, authenticated
+ * by SipHash-2-4 with the key shared by the cluster.
+ *
+ * Datagram format (network byte order):
+ *
+ *   "KP" | version (1) | reserved (1) | time (4, seconds since the epoch)
+ *   | owner (uncompressed wire name) | type (2) | TTL (4)
+ *   | count (2) | count times: length (2) | RDATA
+ *   | RRSIG count (2) | as many times: length (2) | RRSIG RDATA
+ *   | MAC (8, SipHash-2-4 of all the preceding)
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libknot/rrset.h>
+
+#include "lib/generic/hash.h"
+
+#define PEERING_MSG_MAX 4096    /**< Larger RRsets aren't pushed */
+#define PEERING_SKEW 30         /**< Seconds of clock difference accepted */
+
+/**
+ * Compose the datagram of the RRset and its signatures (may be NULL).
+ * @param now seconds since the epoch
+ * @return its length, or 0 if it doesn't fit
+ */
+size_t peering_msg_write(uint8_t msg[PEERING_MSG_MAX], const uint8_t key[KR_SIPHASH_KEY_SIZE],
+			 uint32_t now, const knot_rrset_t *rr, const knot_rrset_t *rrsig);
+
+/**
+ * Verify and parse the datagram into the RRset and its signatures.
+ * Their owner is the lower-cased name in `owner` and the TTL is capped by `ttl_max`.
+ * The RDATA are allocated from the pool; clear them also on error.
+ * @param now seconds since the epoch, for the check of the clocks
+ * @return 0, or kr_error(EBADMSG) if it isn't a datagram of the cluster
+ */
+int peering_msg_read(const uint8_t *msg, size_t len, const uint8_t key[KR_SIPHASH_KEY_SIZE],
+		     uint32_t now, uint32_t ttl_max, knot_dname_t owner[KNOT_DNAME_MAXLEN],
+		     knot_rrset_t *rr, knot_rrset_t *rrsig, knot_mm_t *pool);
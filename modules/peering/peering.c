@@ -0,0 +1,563 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file peering.c
+ * @brief Push the records of popular names to the other resolvers of a cluster.
+ *
+ * Each process counts the answers per QNAME and QTYPE; when a name gets
+ * popular, the validated RRsets of its answer are sent to the peers,
+ * at most once per interval.  Each RRset with its signatures is one UDP
+ * datagram, authenticated by SipHash-2-4 with the key shared by the cluster.
+ * The peers insert them into their cache with a capped TTL, unless they
+ * already have the RRset.  The peer's validation isn't trusted: an RRset
+ * is secure only if its signatures verify with the signer's DNSKEY cached
+ * as secure here, and an unverified RRset a trust anchor covers is dropped.
+ * See msg.h for the format of the datagrams.
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <time.h>
+#include <uv.h>
+#include <libknot/descriptor.h>
+#include <libknot/dname.h>
+#include <libknot/rrtype/rrsig.h>
+#include <ccan/json/json.h>
+#include <contrib/cleanup.h>
+#include <contrib/ucw/mempool.h>
+
+#include "daemon/engine.h"
+#include "daemon/worker.h"
+#include "lib/dnssec.h"
+#include "lib/dnssec/ta.h"
+#include "lib/module.h"
+#include "lib/layer.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+#include "lib/generic/hash.h"
+#include "lib/generic/lru.h"
+#include "modules/peering/msg.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "peer",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][peer] " fmt, ## __VA_ARGS__)
+
+/* Defaults */
+#define PEERING_PORT 5390
+#define PEERING_HITS 4          /**< Answers in a process before the records are pushed */
+#define PEERING_INTERVAL 60     /**< Seconds between pushes of the same name and type */
+#define PEERING_TTL 300         /**< Cap of the TTL of the received records */
+#define PEERING_SIZE 4096       /**< Number of names and types counted */
+
+#define PEERING_PEERS_MAX 32
+
+/** Popularity of a QNAME and QTYPE in this process. */
+struct peering_hot {
+	uint32_t hits;    /**< Answers since the last push */
+	uint32_t pushed;  /**< kr_now() / 1000 of the last push, or 0 */
+};
+
+typedef lru_t(struct peering_hot) peering_lru_t;
+
+/** Counters, also exported to the shared statistics. */
+enum peering_counter {
+	PEERING_SENT, PEERING_RECEIVED, PEERING_INSERTED, PEERING_REJECTED, PEERING_COUNTERS
+};
+static const char *counter_names[PEERING_COUNTERS] = {
+	"peering.sent", "peering.received", "peering.inserted", "peering.rejected",
+};
+
+/** @internal The socket outlives the module until it's closed. */
+struct peering_sock {
+	uv_udp_t handle;
+	struct kr_module *module; /**< NULL once the module is unloaded */
+	uint8_t buf[PEERING_MSG_MAX];
+};
+
+struct peering_data {
+	struct engine *engine;
+	peering_lru_t *hot;
+	struct peering_sock *sock;
+	uint8_t key[KR_SIPHASH_KEY_SIZE];
+	bool has_key;
+	struct sockaddr_storage peers[PEERING_PEERS_MAX];
+	unsigned peer_count;
+	uint32_t hits;
+	uint32_t interval;
+	uint32_t ttl;
+	uint64_t counters[PEERING_COUNTERS];
+	int shared[PEERING_COUNTERS];
+};
+
+static void count(struct peering_data *data, enum peering_counter c)
+{
+	worker_counter_inc(data->counters, data->shared, c);
+}
+
+/** Whether the rank says the RRset was validated, or proven insecure. */
+static bool rank_validated(uint8_t rank)
+{
+	return kr_rank_test(rank, KR_RANK_SECURE)
+		|| (kr_rank_test(rank, KR_RANK_INSECURE) && kr_rank_test(rank, KR_RANK_AUTH));
+}
+
+/** The RRSIGs of the RRset from the same query, or NULL. */
+static const knot_rrset_t *find_rrsig(const ranked_rr_array_t *arr,
+				      const ranked_rr_array_entry_t *entry)
+{
+	for (size_t i = 0; i < arr->len; ++i) {
+		const ranked_rr_array_entry_t *e = arr->at[i];
+		if (e->qry_uid == entry->qry_uid && e->rr->type == KNOT_RRTYPE_RRSIG
+		    && knot_rrsig_type_covered(&e->rr->rrs, 0) == entry->rr->type
+		    && knot_dname_is_equal(e->rr->owner, entry->rr->owner)) {
+			return e->rr;
+		}
+	}
+	return NULL;
+}
+
+/** Whether the answer may be shared with the cluster at all. */
+static bool request_shareable(const struct kr_request *req)
+{
+	const knot_pkt_t *answer = req->answer;
+	if (!req->qsource.addr || !answer || req->cache_ns != 0 || req->answer_dropped
+	    || knot_wire_get_rcode(answer->wire) != KNOT_RCODE_NOERROR
+	    || knot_wire_get_ancount(answer->wire) == 0) {
+		return false;
+	}
+	/* Answers tailored to the client's subnet are for it only. */
+	knot_edns_client_subnet_t ecs;
+	for (size_t i = 0; i < req->rplan.resolved.len; ++i) {
+		const struct kr_query *qry = req->rplan.resolved.at[i];
+		if (kr_ecs_get(qry, qry->sname, &ecs)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void push(struct peering_data *data, const struct kr_request *req)
+{
+	const ranked_rr_array_t *arr = &req->answ_selected;
+	uint8_t msg[PEERING_MSG_MAX];
+	for (size_t i = 0; i < arr->len; ++i) {
+		const ranked_rr_array_entry_t *entry = arr->at[i];
+		const knot_rrset_t *rr = entry->rr;
+		if (!entry->to_wire || rr->type == KNOT_RRTYPE_RRSIG
+		    || rr->rclass != KNOT_CLASS_IN || !rank_validated(entry->rank)) {
+			continue;
+		}
+		const size_t len = peering_msg_write(msg, data->key, time(NULL), rr,
+						     find_rrsig(arr, entry));
+		if (len == 0) {
+			continue;
+		}
+		for (unsigned k = 0; k < data->peer_count; ++k) {
+			uv_buf_t buf = uv_buf_init((char *)msg, len);
+			if (uv_udp_try_send(&data->sock->handle, &buf, 1,
+					    (const struct sockaddr *)&data->peers[k]) > 0) {
+				count(data, PEERING_SENT);
+			}
+		}
+	}
+}
+
+static int collect(kr_layer_t *ctx)
+{
+	struct kr_module *module = ctx->api->data;
+	struct peering_data *data = module->data;
+	struct kr_request *req = ctx->req;
+	if (!data->has_key || !data->sock || data->peer_count == 0
+	    || !request_shareable(req)) {
+		return ctx->state;
+	}
+	/* Count the answers by the lower-cased QNAME and QTYPE. */
+	uint8_t key[KNOT_DNAME_MAXLEN + sizeof(uint16_t)];
+	const knot_dname_t *qname = knot_pkt_qname(req->answer);
+	const int qname_len = knot_dname_size(qname);
+	if (qname_len <= 0 || qname_len > KNOT_DNAME_MAXLEN) {
+		return ctx->state;
+	}
+	const uint16_t qtype = knot_pkt_qtype(req->answer);
+	memcpy(key, &qtype, sizeof(qtype));
+	memcpy(key + sizeof(qtype), qname, qname_len);
+	knot_dname_to_lower(key + sizeof(qtype));
+	bool is_new = false;
+	struct peering_hot *hot = lru_get_new(data->hot, (const char *)key,
+					      sizeof(qtype) + qname_len, &is_new);
+	if (!hot) {
+		return ctx->state;
+	}
+	if (is_new) {
+		hot->hits = 0;
+		hot->pushed = 0;
+	}
+	hot->hits += 1;
+	const uint32_t now = kr_now() / 1000;
+	if (hot->hits < data->hits
+	    || (hot->pushed != 0 && now - hot->pushed < data->interval)) {
+		return ctx->state;
+	}
+	hot->hits = 0;
+	hot->pushed = now ? now : 1;
+	push(data, req);
+	return ctx->state;
+}
+
+/** Whether the signatures of the RRset verify with the signer's DNSKEY cached as secure. */
+static bool rrset_secure(struct peering_data *data, const knot_rrset_t *rr,
+			 const knot_rrset_t *rrsig, uint32_t now)
+{
+	if (knot_rrset_empty(rrsig)) {
+		return false;
+	}
+	struct kr_context *ctx = &data->engine->resolver;
+	const knot_dname_t *signer = knot_rrsig_signer_name(&rrsig->rrs, 0);
+	struct kr_cache_p peek;
+	if (kr_cache_peek_exact(&ctx->cache, signer, KNOT_RRTYPE_DNSKEY, &peek) != 0
+	    || !kr_rank_test(peek.rank, KR_RANK_SECURE)
+	    || (int64_t)peek.time + peek.ttl < now) {
+		return false;
+	}
+	knot_mm_t pool = { .ctx = mp_new(4096), .alloc = (knot_mm_alloc_t) mp_alloc };
+	bool ok = false;
+	knot_rrset_t keys;
+	knot_rrset_init(&keys, (knot_dname_t *)signer, KNOT_RRTYPE_DNSKEY, KNOT_CLASS_IN);
+	/* The validator wants a packet, an empty one proves no wildcard expansion. */
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MIN_PKTSIZE, &pool);
+	ranked_rr_array_t rrs;
+	kr_ranked_rrarray_init(rrs);
+	if (!pkt || kr_cache_materialize(&keys.rrs, &peek, peek.time + peek.ttl - now, &pool) < 0
+	    || kr_ranked_rrarray_add(&rrs, rrsig, KR_RANK_INITIAL, true, 0, &pool) < 0) {
+		goto finish;
+	}
+	const uint32_t limit = ctx->budget.signatures;
+	kr_rrset_validation_ctx_t vctx = {
+		.pkt = pkt,
+		.rrs = &rrs,
+		.section_id = KNOT_ANSWER,
+		.keys = &keys,
+		.zone_name = keys.owner,
+		.timestamp = now,
+		.limit_crypto_remains = limit == 0 || limit > INT_MAX ? INT_MAX : limit,
+	};
+	ok = kr_rrset_validate(&vctx, rr) == 0 && !(vctx.flags & KR_DNSSEC_VFLG_WEXPAND);
+finish:
+	mp_delete(pool.ctx);
+	return ok;
+}
+
+/** Verify and parse the datagram, insert the RRset; return false if it's rejected. */
+static bool receive(struct peering_data *data, const uint8_t *msg, size_t len)
+{
+	const uint32_t now = time(NULL);
+	knot_dname_t owner[KNOT_DNAME_MAXLEN];
+	knot_rrset_t rr, rrsig;
+	bool ok = peering_msg_read(msg, len, data->key, now, data->ttl, owner,
+				   &rr, &rrsig, NULL) == 0;
+	/* Keep what this resolver has itself. */
+	struct kr_context *ctx = &data->engine->resolver;
+	struct kr_cache *cache = &ctx->cache;
+	uint8_t rank = 0;
+	int32_t cached_ttl = -1;
+	if (!ok || knot_rrset_ttl(&rr) == 0 || !kr_cache_is_open(cache)
+	    || (kr_cache_peek_rr(cache, rr.owner, rr.type, &rank, &cached_ttl) == 0
+		&& cached_ttl >= 0)) {
+		goto finish;
+	}
+	/* The peer's validation isn't repeated, so only the signatures count. */
+	if (rrset_secure(data, &rr, &rrsig, now)) {
+		rank = KR_RANK_SECURE | KR_RANK_AUTH;
+	} else if (kr_ta_covers_qry(ctx, rr.owner, rr.type)) {
+		ok = false;
+		goto finish;
+	} else {
+		rank = KR_RANK_INSECURE | KR_RANK_AUTH;
+	}
+	if (kr_cache_insert_rr(cache, &rr, knot_rrset_empty(&rrsig) ? NULL : &rrsig,
+			       rank, now) == 0) {
+		kr_cache_sync(cache);
+		count(data, PEERING_INSERTED);
+	}
+finish:
+	knot_rdataset_clear(&rr.rrs, NULL);
+	knot_rdataset_clear(&rrsig.rrs, NULL);
+	return ok;
+}
+
+static void on_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf)
+{
+	struct peering_sock *sock = handle->data;
+	*buf = uv_buf_init((char *)sock->buf, sizeof(sock->buf));
+}
+
+static void on_recv(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+		    const struct sockaddr *addr, unsigned flags)
+{
+	struct peering_sock *sock = handle->data;
+	if (nread <= 0 || !addr || !sock->module || (flags & UV_UDP_PARTIAL)) {
+		return;
+	}
+	struct peering_data *data = sock->module->data;
+	if (!data->has_key) {
+		return;
+	}
+	count(data, PEERING_RECEIVED);
+	if (!receive(data, (const uint8_t *)buf->base, nread)) {
+		count(data, PEERING_REJECTED);
+	}
+}
+
+static void on_sock_close(uv_handle_t *handle)
+{
+	free(handle->data);
+}
+
+static void sock_close(struct peering_data *data)
+{
+	if (data->sock) {
+		data->sock->module = NULL;
+		uv_close((uv_handle_t *)&data->sock->handle, on_sock_close);
+		data->sock = NULL;
+	}
+}
+
+/** Open the socket, bound to `listen` if not NULL, and replace the previous one. */
+static int sock_open(struct kr_module *module, const char *listen)
+{
+	struct peering_data *data = module->data;
+	struct peering_sock *sock = calloc(1, sizeof(*sock));
+	if (!sock) {
+		return kr_error(ENOMEM);
+	}
+	sock->module = module;
+	sock->handle.data = sock;
+	uv_udp_init(uv_default_loop(), &sock->handle);
+	int ret = 0;
+	if (listen) {
+		char addr[INET6_ADDRSTRLEN];
+		uint16_t port = 0;
+		struct sockaddr *sa = NULL;
+		if (kr_straddr_split(listen, addr, sizeof(addr), &port) == 0) {
+			sa = kr_straddr_socket(addr, port ? port : PEERING_PORT);
+		}
+		/* All the forks bind the address, any one of them inserts into the shared cache. */
+		ret = sa ? uv_udp_bind(&sock->handle, sa, UV_UDP_REUSEADDR) : UV_EINVAL;
+		if (ret == 0) {
+			ret = uv_udp_recv_start(&sock->handle, on_alloc, on_recv);
+		}
+		free(sa);
+		if (ret != 0) {
+			ERR_MSG("can't listen on '%s': %s\n", listen, uv_strerror(ret));
+			sock->module = NULL;
+			uv_close((uv_handle_t *)&sock->handle, on_sock_close);
+			return kr_error(EINVAL);
+		}
+	}
+	sock_close(data);
+	data->sock = sock;
+	return kr_ok();
+}
+
+/** Parse the key of 32 hexadecimal digits. */
+static bool config_key(JsonNode *root, uint8_t key[KR_SIPHASH_KEY_SIZE], bool *has_key)
+{
+	JsonNode *node = json_find_member(root, "key");
+	if (!node) {
+		return true;
+	}
+	if (node->tag != JSON_STRING || strlen(node->string_) != 2 * KR_SIPHASH_KEY_SIZE) {
+		ERR_MSG("invalid 'key', expected %d hexadecimal digits\n", 2 * KR_SIPHASH_KEY_SIZE);
+		return false;
+	}
+	for (int i = 0; i < KR_SIPHASH_KEY_SIZE; ++i) {
+		unsigned byte;
+		if (sscanf(node->string_ + 2 * i, "%2x", &byte) != 1) {
+			ERR_MSG("invalid 'key', expected %d hexadecimal digits\n",
+				2 * KR_SIPHASH_KEY_SIZE);
+			return false;
+		}
+		key[i] = byte;
+	}
+	*has_key = true;
+	return true;
+}
+
+/** Parse the list of "addr[@port]" of the peers. */
+static bool config_peers(JsonNode *root, struct sockaddr_storage *peers, unsigned *peer_count)
+{
+	JsonNode *list = json_find_member(root, "peers");
+	if (!list) {
+		return true;
+	}
+	if (list->tag != JSON_ARRAY) {
+		ERR_MSG("invalid 'peers', expected a list of addresses\n");
+		return false;
+	}
+	unsigned n = 0;
+	JsonNode *node;
+	json_foreach(node, list) {
+		char addr[INET6_ADDRSTRLEN];
+		uint16_t port = 0;
+		struct sockaddr *sa = NULL;
+		if (node->tag == JSON_STRING && n < PEERING_PEERS_MAX
+		    && kr_straddr_split(node->string_, addr, sizeof(addr), &port) == 0) {
+			sa = kr_straddr_socket(addr, port ? port : PEERING_PORT);
+		}
+		if (!sa) {
+			ERR_MSG("invalid peer '%s', at most %d addresses are accepted\n",
+				node->tag == JSON_STRING ? node->string_ : "", PEERING_PEERS_MAX);
+			return false;
+		}
+		memcpy(&peers[n++], sa, kr_sockaddr_len(sa));
+		free(sa);
+	}
+	*peer_count = n;
+	return true;
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *peering_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.finish = &collect,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int peering_init(struct kr_module *module)
+{
+	struct peering_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	data->engine = module->data;
+	data->hits = PEERING_HITS;
+	data->interval = PEERING_INTERVAL;
+	data->ttl = PEERING_TTL;
+	lru_create_hash(&data->hot, PEERING_SIZE, NULL, NULL, LRU_HASH_SIPHASH);
+	if (!data->hot) {
+		free(data);
+		return kr_error(ENOMEM);
+	}
+	worker_counters_register(counter_names, data->shared, PEERING_COUNTERS);
+	module->data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int peering_deinit(struct kr_module *module)
+{
+	struct peering_data *data = module->data;
+	if (data) {
+		sock_close(data);
+		lru_free(data->hot);
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+KR_EXPORT
+int peering_config(struct kr_module *module, const char *conf)
+{
+	struct peering_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	JsonNode *root = json_decode(conf);
+	if (!root || root->tag != JSON_OBJECT) {
+		ERR_MSG("expected a table of settings\n");
+		json_delete(root);
+		return kr_error(EINVAL);
+	}
+	uint32_t hits = data->hits, interval = data->interval, ttl = data->ttl;
+	uint8_t key[KR_SIPHASH_KEY_SIZE];
+	memcpy(key, data->key, sizeof(key));
+	bool has_key = data->has_key;
+	unsigned peer_count = data->peer_count;
+	auto_free struct sockaddr_storage *peers = malloc(sizeof(data->peers));
+	if (!peers) {
+		json_delete(root);
+		return kr_error(ENOMEM);
+	}
+	memcpy(peers, data->peers, sizeof(data->peers));
+	bool ok = worker_config_number("peer", root, "hits", UINT16_MAX, &hits)
+		&& worker_config_number("peer", root, "interval", 86400, &interval)
+		&& worker_config_number("peer", root, "ttl", 86400, &ttl)
+		&& config_key(root, key, &has_key)
+		&& config_peers(root, peers, &peer_count);
+	JsonNode *listen = json_find_member(root, "listen");
+	if (ok && listen && listen->tag != JSON_STRING) {
+		ERR_MSG("invalid 'listen', expected an address\n");
+		ok = false;
+	}
+	/* The socket for sending only is opened once, a listening one replaces it. */
+	int ret = ok ? kr_ok() : kr_error(EINVAL);
+	if (ok && (listen || !data->sock)) {
+		ret = sock_open(module, listen ? listen->string_ : NULL);
+	}
+	json_delete(root);
+	if (ret != 0) {
+		return ret;
+	}
+	if (!has_key && (peer_count > 0 || listen)) {
+		ERR_MSG("no 'key' set, nothing is sent nor accepted\n");
+	}
+	data->hits = hits;
+	data->interval = interval;
+	data->ttl = ttl;
+	memcpy(data->key, key, sizeof(key));
+	data->has_key = has_key;
+	memcpy(data->peers, peers, sizeof(data->peers));
+	data->peer_count = peer_count;
+	return kr_ok();
+}
+
+/** Return the counters of this fork. */
+static char *peering_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct peering_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < PEERING_COUNTERS; ++i) {
+		/* strip the "peering." */
+		json_append_member(root, counter_names[i] + 8, json_mknumber(data->counters[i]));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+KR_EXPORT
+struct kr_prop *peering_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &peering_stats, "stats", "Get the counters of pushed and received records in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(peering);
+
+#undef VERBOSE_MSG
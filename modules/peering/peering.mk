@@ -0,0 +1,8 @@
+peering_CFLAGS := -fPIC
+# The counters and the configuration use worker_*() of the daemon, not of libkres;
+# on darwin the undefined symbols aren't accepted by default.
+peering_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
+peering_SOURCES := modules/peering/peering.c modules/peering/msg.c
+peering_DEPEND := $(libkres)
+peering_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS) $(libuv_LIBS)
+$(call make_c_module,peering)
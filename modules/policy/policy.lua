@@ -135,6 +135,103 @@ function policy.FORWARD(target)
 	end
 end
 
+-- Named pools of forwarders, see lib/forward.h
+-- The C parts are never freed, as the requests in flight may use them.
+policy.pools = {}
+
+-- Ask each forwarder of the pool for the root NS, bypassing the cache
+local function pool_probe(pool)
+	for i = 1, #pool.targets do
+		worker.resolve({
+			name = '.', type = kres.type.NS, options = {'STUB', 'NO_CACHE'},
+			init = function (req)
+				ffi.C.kr_fwd_pool_use(kres.request_t(req), pool.cdata, i)
+			end,
+		})
+	end
+end
+
+-- Define a pool; targets are addresses or {address, weight = n}
+function policy.pool(name, targets, opts)
+	opts = opts or {}
+	assert(type(name) == 'string', 'pool name must be a string')
+	assert(type(targets) == 'table' and #targets > 0, 'pool targets must be a non-empty list')
+	local cdata = ffi.C.kr_fwd_pool_create(opts.fails or 3, opts.down or 5 * sec, opts.race == true)
+	assert(cdata ~= nil, 'not enough memory')
+	local pool = { cdata = cdata, targets = {} }
+	for _, t in ipairs(targets) do
+		local addr = type(t) == 'table' and t[1] or t
+		local weight = type(t) == 'table' and t.weight or 1
+		if ffi.C.kr_fwd_pool_add(cdata, addr2sock(addr, 53), weight) ~= 0 then
+			error(string.format('pool "%s": invalid target %s (at most 16, weights 1-65535)', name, addr))
+		end
+		table.insert(pool.targets, addr)
+	end
+	local old = policy.pools[name]
+	if old and old.probe_ev then
+		event.cancel(old.probe_ev)
+	end
+	if opts.probe then
+		pool.probe_ev = event.recurrent(opts.probe, function () pool_probe(pool) end)
+	end
+	policy.pools[name] = pool
+	return pool
+end
+
+-- Return the statistics of the forwarders of the pool
+function policy.pool_stats(name)
+	local pool = policy.pools[name]
+	assert(pool, string.format('no pool "%s"', name))
+	local st = ffi.new('struct kr_fwd_stats')
+	local result = {}
+	for i, addr in ipairs(pool.targets) do
+		assert(ffi.C.kr_fwd_pool_stats(pool.cdata, i - 1, st) == 0)
+		result[addr] = {
+			selected = tonumber(st.selected), answers = tonumber(st.answers),
+			errors = tonumber(st.errors), timeouts = tonumber(st.timeouts),
+			trips = tonumber(st.trips), srtt = st.srtt_ms,
+			weight = st.weight, up = st.up,
+		}
+	end
+	return result
+end
+
+local function pool_get(name)
+	local pool = policy.pools[name]
+	if not pool then
+		error(string.format('no pool "%s", see policy.pool()', name))
+	end
+	return pool
+end
+
+-- Forward request via a pool, like FORWARD
+function policy.FORWARD_POOL(name)
+	pool_get(name)
+	return function(state, req)
+		local qry = req:current()
+		req.options.FORWARD = true
+		req.options.NO_MINIMIZE = true
+		qry.flags.FORWARD = true
+		qry.flags.ALWAYS_CUT = false
+		qry.flags.NO_MINIMIZE = true
+		qry.flags.AWAIT_CUT = true
+		assert(ffi.C.kr_fwd_pool_use(req, pool_get(name).cdata, 0) == 0)
+		return state
+	end
+end
+
+-- Forward request via a pool, like STUB
+function policy.STUB_POOL(name)
+	pool_get(name)
+	return function(state, req)
+		local qry = req:current()
+		qry.flags.STUB = true
+		qry.flags.ALWAYS_CUT = false
+		assert(ffi.C.kr_fwd_pool_use(req, pool_get(name).cdata, 0) == 0)
+		return state
+	end
+end
+
 -- object must be non-empty string or non-empty table of non-empty strings
 local function is_nonempty_string_or_table(object)
 	if type(object) == 'string' then
@@ -261,16 +358,107 @@ function policy.TLS_FORWARD(target)
 	end
 end
 
+-- Create subnet prefix or owner name rewrite rule
+local function reroute_match(from, to, names)
+	local target = kres.str2ip(to)
+	if target == nil then error('[policy] invalid address: '..to) end
+	local addrtype = string.find(to, ':', 1, true) and kres.type.AAAA or kres.type.A
+	if names then
+		local owner = todname(from)
+		if not owner then error('[policy] invalid name: '..from) end
+		return {owner, nil, target, addrtype}
+	end
+	local subnet_cd = ffi.new('char[16]')
+	local bitlen = ffi.C.kr_straddr_subnet(subnet_cd, from)
+	if bitlen < 0 then error('[policy] invalid subnet: '..from) end
+	return {subnet_cd, bitlen, target, addrtype}
+end
+
+-- Match IP against given subnet or record owner
+local function reroute_matches(prefix, rr)
+	local addr = rr.rdata
+	return prefix[4] == rr.type and
+	       ((prefix[2] and (#addr >= prefix[2] / 8) and
+	         (ffi.C.kr_bitcmp(prefix[1], addr, prefix[2]) == 0)) or prefix[1] == rr.owner)
+end
+
+-- Renumber address record, the first matching rule wins
+local reroute_buf = ffi.new('char[16]')
+local function reroute_record(prefixes, rr)
+	for i = 1, #prefixes do
+		local prefix = prefixes[i]
+		if reroute_matches(prefix, rr) then
+			-- Replace part or whole address
+			local chunks = (prefix[2] or (#prefix[3] * 8)) / 8
+			local rdlen = #rr.rdata
+			if rdlen < chunks then return nil end -- Address length mismatch
+			ffi.copy(reroute_buf, rr.rdata, rdlen)
+			ffi.copy(reroute_buf, prefix[3], chunks) -- Rewrite prefix
+			rr.rdata = ffi.string(reroute_buf, rdlen)
+			return rr
+		end
+	end
+	return nil
+end
+
 -- Rewrite records in packet
+-- The answer is already written out in the postrules, so it's rebuilt here;
+-- the renumber module rewrites the records before that, see its README.
 function policy.REROUTE(tbl, names)
-	-- Import renumbering rules
-	local ren = require('renumber')
 	local prefixes = {}
+	if type(tbl[1]) == 'string' then -- a single {subnet, target}
+		tbl = {tbl}
+	end
 	for from, to in pairs(tbl) do
-		table.insert(prefixes, names and ren.name(from, to) or ren.prefix(from, to))
+		if type(to) == 'table' then -- {{subnet, target}, ...}
+			from, to = to[1], to[2]
+		end
+		table.insert(prefixes, reroute_match(from, to, names))
+	end
+	return function (state, req)
+		if state == kres.FAIL then return state end
+		local pkt = kres.pkt_t(req.answer)
+		local records = pkt:section(kres.section.ANSWER)
+		local ancount = #records
+		if ancount == 0 then return state end
+		local changed = false
+		for i = 1, ancount do
+			local rr = records[i]
+			if rr.type == kres.type.A or rr.type == kres.type.AAAA then
+				local new_rr = reroute_record(prefixes, rr)
+				if new_rr ~= nil then
+					records[i] = new_rr
+					changed = true
+				end
+			end
+		end
+		if not changed then return end
+		local qname = pkt:qname()
+		local qclass = pkt:qclass()
+		local qtype = pkt:qtype()
+		pkt:recycle()
+		pkt:question(qname, qclass, qtype)
+		for i = 1, ancount do
+			local rr = records[i]
+			-- Strip signatures as rewritten data cannot be validated
+			if rr.type ~= kres.type.RRSIG then
+				pkt:put(rr.owner, rr.ttl, rr.class, rr.type, rr.rdata)
+			end
+		end
+		return state
+	end
+end
+
+-- Keep the forwarded answers in a cache namespace, e.g. per view; optionally with another action
+function policy.CACHE_NS(ns, action)
+	assert(type(ns) == 'number' and ns >= 0 and ns <= 255, 'cache namespace must be within <0, 255>')
+	return function(state, req)
+		req.cache_ns = ns
+		if action then
+			return action(state, req)
+		end
+		return nil -- chain rule
 	end
-	-- Return rule closure
-	return ren.rule(prefixes)
 end
 
 -- Set and clear some query flags
@@ -291,112 +479,127 @@ local function mkauth_soa(answer, dname, mname)
 		mname .. '\6nobody\7invalid\0\0\0\0\1\0\0\14\16\0\0\4\176\0\9\58\128\0\0\42\48')
 end
 
-local dname_localhost = todname('localhost.')
-
--- Rule for localhost. zone; see RFC6303, sec. 3
-local function localhost(_, req)
-	local qry = req:current()
-	local answer = req.answer
-	ffi.C.kr_pkt_make_auth_header(answer)
-
-	local is_exact = ffi.C.knot_dname_is_equal(qry.sname, dname_localhost)
-
-	answer:rcode(kres.rcode.NOERROR)
-	answer:begin(kres.section.ANSWER)
-	if qry.stype == kres.type.AAAA then
-		answer:put(qry.sname, 900, answer:qclass(), kres.type.AAAA,
-			'\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\1')
-	elseif qry.stype == kres.type.A then
-		answer:put(qry.sname, 900, answer:qclass(), kres.type.A, '\127\0\0\1')
-	elseif is_exact and qry.stype == kres.type.SOA then
-		mkauth_soa(answer, dname_localhost)
-	elseif is_exact and qry.stype == kres.type.NS then
-		answer:put(dname_localhost, 900, answer:qclass(), kres.type.NS, dname_localhost)
-	else
-		answer:begin(kres.section.AUTHORITY)
-		mkauth_soa(answer, dname_localhost)
-	end
-	return kres.DONE
-end
+-- Rules deciding just by QNAME, memoized in policy.evaluate()
+local pure_rules = setmetatable({}, {__mode = 'k'}) -- cb -> true
 
-local dname_rev4_localhost = todname('1.0.0.127.in-addr.arpa');
-local dname_rev4_localhost_apex = todname('127.in-addr.arpa');
+-- Memo of the first pure rule matching by (rule list, QNAME); stored values
+-- are either the index of the rule or minus the count of the rules known not
+-- to match.  It's invalidated by bumping the generation on each change of
+-- the rules.
+local memo_size = 8192
+local memo = ffi.gc(ffi.C.kr_name_memo_create(memo_size), ffi.C.kr_name_memo_free)
+local memo_gen = 0
+local memo_lists = setmetatable({}, {__mode = 'k'}) -- rule list -> number
+local memo_nlists = 0
 
--- Rule for reverse localhost.
--- Answer with locally served minimal 127.in-addr.arpa domain, only having
--- a PTR record in 1.0.0.127.in-addr.arpa, and with 1.0...0.ip6.arpa. zone.
--- TODO: much of this would better be left to the hints module (or coordinated).
-local function localhost_reversed(_, req)
-	local qry = req:current()
-	local answer = req.answer
+local function memo_bump()
+	memo_gen = (memo_gen + 1) % 0x100000000
+end
 
-	-- classify qry.sname:
-	local is_exact   -- exact dname for localhost
-	local is_apex    -- apex of a locally-served localhost zone
-	local is_nonterm -- empty non-terminal name
-	if ffi.C.knot_dname_is_sub(qry.sname, todname('ip6.arpa.')) then
-		-- exact ::1 query (relying on the calling rule)
-		is_exact = true
-		is_apex = true
-	else
-		-- within 127.in-addr.arpa.
-		local labels = ffi.C.knot_dname_labels(qry.sname, nil)
-		if labels == 3 then
-			is_exact = false
-			is_apex = true
-		elseif labels == 4+2 and ffi.C.knot_dname_is_equal(
-					qry.sname, dname_rev4_localhost) then
-			is_exact = true
-		else
-			is_exact = false
-			is_apex = false
-			is_nonterm = ffi.C.knot_dname_is_sub(dname_rev4_localhost, qry.sname)
-		end
-	end
-
-	ffi.C.kr_pkt_make_auth_header(answer)
-	answer:rcode(kres.rcode.NOERROR)
-	answer:begin(kres.section.ANSWER)
-	if is_exact and qry.stype == kres.type.PTR then
-		answer:put(qry.sname, 900, answer:qclass(), kres.type.PTR, dname_localhost)
-	elseif is_apex and qry.stype == kres.type.SOA then
-		mkauth_soa(answer, dname_rev4_localhost_apex, dname_localhost)
-	elseif is_apex and qry.stype == kres.type.NS then
-		answer:put(dname_rev4_localhost_apex, 900, answer:qclass(), kres.type.NS,
-			dname_localhost)
-	else
-		if not is_nonterm then
-			answer:rcode(kres.rcode.NXDOMAIN)
-		end
-		answer:begin(kres.section.AUTHORITY)
-		mkauth_soa(answer, dname_rev4_localhost_apex, dname_localhost)
+local function memo_list(rules)
+	local list = memo_lists[rules]
+	if not list then
+		memo_nlists = memo_nlists + 1
+		list = memo_nlists
+		memo_lists[rules] = list
 	end
-	return kres.DONE
+	return list
+end
+
+local function pure(cb)
+	pure_rules[cb] = true
+	return cb
 end
 
 -- All requests
 function policy.all(action)
-	return function(_, _) return action end
+	return pure(function(_, _) return action end)
 end
 
+-- Suffix rules added by policy.add() are all matched at once through an index
+-- of each rule list, see policy.evaluate(); their callbacks are only used
+-- when called directly.
+local suffix_rules = setmetatable({}, {__mode = 'k'}) -- cb -> {action, zones}
+local suffix_index = setmetatable({}, {__mode = 'k'}) -- rule list -> {trie, ids, count}
+
 -- Requests which QNAME matches given zone list (i.e. suffix match)
 function policy.suffix(action, zone_list)
 	local AC = require('ahocorasick')
-	local tree = AC.create(zone_list)
-	return function(_, query)
+	local tree
+	local cb = function(_, query)
+		tree = tree or AC.create(zone_list)
 		local match = AC.match(tree, query:name(), false)
 		if match ~= nil then
 			return action
 		end
 		return nil
 	end
+	suffix_rules[cb] = {action = action, zones = zone_list}
+	return pure(cb)
+end
+
+-- Put the zones of a suffix rule into the index of its rule list
+local function suffix_index_add(rules, desc)
+	local suffix = suffix_rules[desc.cb]
+	if not suffix then
+		return
+	end
+	local index = suffix_index[rules]
+	if not index then
+		local trie = ffi.C.kr_suffixes_create()
+		assert(trie ~= nil, 'not enough memory')
+		index = {trie = ffi.gc(trie, ffi.C.kr_suffixes_free), count = 0}
+		suffix_index[rules] = index
+	end
+	for _, zone in ipairs(suffix.zones) do
+		assert(ffi.C.kr_suffixes_add(index.trie, zone, desc.id) == 0)
+	end
+	index.count = index.count + 1
+	if not index.ids or index.count > index.size then
+		index.size = 2 * index.count
+		index.ids = ffi.new('uint32_t[?]', index.size)
+	end
+	desc.suffix_action = suffix.action
+end
+
+local function suffix_index_del(rules, desc)
+	local index = suffix_index[rules]
+	if index and desc.suffix_action then
+		ffi.C.kr_suffixes_del(index.trie, desc.id)
+		index.count = index.count - 1
+	end
+end
+
+-- Return the set of ids of the indexed rules matching the query,
+-- or nil when they have to be evaluated one by one.
+local function suffix_index_match(rules, query)
+	local index = suffix_index[rules]
+	if not index or index.count == 0 then
+		return nil -- no indexed rules
+	end
+	-- The lookup format of the name is shared with the cache and other rule lists.
+	local sname_lf = ffi.C.kr_query_sname_lf(query)
+	local n
+	if sname_lf ~= nil then
+		n = ffi.C.kr_suffixes_match_lf(index.trie, sname_lf, index.ids, index.size)
+	else
+		n = ffi.C.kr_suffixes_match(index.trie, query.sname, index.ids, index.size)
+	end
+	if n < 0 then
+		return nil
+	end
+	local matched = {}
+	for i = 0, n - 1 do
+		matched[index.ids[i]] = true
+	end
+	return matched
 end
 
 -- Check for common suffix first, then suffix match (specialized version of suffix match)
 function policy.suffix_common(action, suffix_list, common_suffix)
 	local common_len = string.len(common_suffix)
 	local suffix_count = #suffix_list
-	return function(_, query)
+	return pure(function(_, query)
 		-- Preliminary check
 		local qname = query:name()
 		if not string.find(qname, common_suffix, -common_len, true) then
@@ -410,57 +613,108 @@ function policy.suffix_common(action, suffix_list, common_suffix)
 			end
 		end
 		return nil
-	end
+	end)
 end
 
 -- Filter QNAME pattern
 function policy.pattern(action, pattern)
-	return function(_, query)
+	return pure(function(_, query)
 		if string.find(query:name(), pattern) then
 			return action
 		end
 		return nil
+	end)
+end
+
+-- RPZ is compiled into an index file and matched in C, see daemon/rpz.h
+ffi.cdef[[
+struct rpz;
+struct rpz_job;
+int rpz_compile(const char *, const char *);
+bool rpz_outdated(const struct rpz *, const char *);
+struct rpz_job *rpz_compile_async(const char *, const char *);
+int rpz_job_poll(struct rpz_job *);
+struct rpz *rpz_open(const char *);
+void rpz_close(struct rpz *);
+int rpz_match_name(const struct rpz *, const knot_dname_t *);
+int rpz_match_answer(const struct rpz *, const knot_pkt_t *);
+]]
+local rpz_zones = setmetatable({}, {__mode = 'k'}) -- cb -> zone, for policy.add()
+local rpz_watch_interval = 5 * sec
+
+-- One index per zone file, in the working directory (i.e. next to the cache)
+local function rpz_index_path(path)
+	return 'rpz_' .. string.gsub(path, '[^%w%.%-]', '_') .. '.idx'
+end
+
+-- Map the index; the previous one stays valid for whoever still holds it
+-- and it's closed once collected.
+local function rpz_open(zone)
+	local index = ffi.C.rpz_open(zone.index_path)
+	if index == nil then
+		return false
 	end
+	zone.index = ffi.gc(index, ffi.C.rpz_close)
+	memo_bump() -- the decisions by the previous index are stale
+	return true
 end
 
-local function rpz_parse(action, path)
-	local rules = {}
-	local action_map = {
-		-- RPZ Policy Actions
-		['\0'] = action,
-		['\1*\0'] = action, -- deviates from RPZ spec
-		['\012rpz-passthru\0'] = policy.PASS, -- the grammar...
-		['\008rpz-drop\0'] = policy.DROP,
-		['\012rpz-tcp-only\0'] = policy.TC,
-		-- Policy triggers @NYI@
-	}
-	local parser = require('zonefile').new()
-	if not parser:open(path) then error(string.format('failed to parse "%s"', path)) end
-	while parser:parse() do
-		local name = ffi.string(parser.r_owner, parser.r_owner_length)
-		local name_action = ffi.string(parser.r_data, parser.r_data_length)
-		rules[name] = action_map[name_action]
-		-- Warn when NYI
-		if #name > 1 and not action_map[name_action] then
-			print(string.format('[ rpz ] %s:%d: unsupported policy action', path, tonumber(parser.line_counter)))
+-- Recompile in the thread pool when the zone file changes, then swap the index
+local function rpz_reload(zone)
+	if zone.job then
+		local ret = ffi.C.rpz_job_poll(zone.job)
+		if ret == 1 then
+			return -- still running
 		end
+		zone.job = nil
+		if ret ~= 0 or not rpz_open(zone) then
+			zone.backoff = 12 -- don't recompile a broken zone all the time
+		end
+		return
+	end
+	if zone.backoff > 0 then
+		zone.backoff = zone.backoff - 1
+	elseif ffi.C.rpz_outdated(zone.index, zone.path) then
+		-- done by only one of the forks, the others wait for it and reopen
+		zone.job = ffi.C.rpz_compile_async(zone.path, zone.index_path)
 	end
-	return rules
 end
 
 -- RPZ policy set
 -- Create RPZ from zone file
-function policy.rpz(action, path)
-	local rules = rpz_parse(action, path)
-	collectgarbage()
-	return function(_, query)
-		local label = query:name()
-		local rule = rules[label]
-		while rule == nil and string.len(label) > 0 do
-			label = string.sub(label, string.byte(label) + 2)
-			rule = rules['\1*'..label]
+function policy.rpz(action, path, watch)
+	local zone = {path = path, index_path = rpz_index_path(path), backoff = 0}
+	if ffi.C.rpz_compile(zone.path, zone.index_path) ~= 0 or not rpz_open(zone) then
+		error(string.format('failed to parse "%s"', path))
+	end
+	if watch ~= false then
+		event.recurrent(rpz_watch_interval, function () rpz_reload(zone) end)
+	end
+	-- by enum rpz_action
+	zone.actions = {action, action, policy.PASS, policy.DROP, policy.TC}
+	local cb = function(_, query)
+		return zone.actions[ffi.C.rpz_match_name(zone.index, query.sname)]
+	end
+	rpz_zones[cb] = zone
+	return pure(cb)
+end
+
+-- Response IP triggers of a RPZ rule, matched in a postrule of its own
+local function rpz_ip_rule(zone)
+	local actions = {}
+	for code, action in pairs(zone.actions) do
+		if action == policy.PASS then
+			actions[code] = action
+		else
+			-- Replace the answer, not append to it
+			actions[code] = function(state, req)
+				ffi.C.kr_pkt_clear_payload(req.answer)
+				return action(state, req)
+			end
 		end
-		return rule
+	end
+	return function(req, _)
+		return actions[ffi.C.rpz_match_answer(zone.index, req.answer)]
 	end
 end
 
@@ -510,22 +764,67 @@ end
 
 -- Evaluate packet in given rules to determine policy action
 function policy.evaluate(rules, req, query, state)
+	local list = memo_list(rules)
+	local known = ffi.C.kr_name_memo_get(memo, memo_gen, list, query.sname)
+	-- Remember the first pure rule matching, unless a suspended one was skipped
+	local store = known == 0
+	local matched, indexed
 	for i = 1, #rules do
 		local rule = rules[i]
-		if not rule.suspended then
-			local action = rule.cb(req, query)
-			if action ~= nil then
-				rule.count = rule.count + 1
-				local next_state = action(state, req)
-				if next_state then    -- Not a chain rule,
-					return next_state -- stop on first match
+		local action
+		if rule.suspended then
+			store = store and not rule.pure
+		elseif rule.pure and (i < known or i <= -known) then
+			action = nil -- known not to match
+		elseif rule.pure and i == known and rule.suffix_action then
+			action = rule.suffix_action
+		elseif rule.suffix_action then
+			if not indexed then
+				-- All the suffix rules at once, in O(QNAME length)
+				matched = suffix_index_match(rules, query)
+				indexed = true
+			end
+			if matched then
+				action = matched[rule.id] and rule.suffix_action
+			else
+				action = rule.cb(req, query)
+			end
+		else
+			action = rule.cb(req, query)
+		end
+		if action ~= nil then
+			if store and rule.pure then
+				ffi.C.kr_name_memo_set(memo, memo_gen, list, query.sname, i)
+				store = false
+			end
+			rule.count = rule.count + 1
+			local next_state = action(state, req)
+			if next_state then    -- Not a chain rule,
+				if store and i > 1 then
+					ffi.C.kr_name_memo_set(memo, memo_gen, list, query.sname, 1 - i)
 				end
+				return next_state -- stop on first match
 			end
 		end
 	end
+	if store and #rules > 0 then
+		ffi.C.kr_name_memo_set(memo, memo_gen, list, query.sname, -#rules)
+	end
 	return
 end
 
+-- Counts of the hits and the misses of the memo of the decisions by QNAME
+function policy.memo_stats()
+	local hits, misses = ffi.new('uint64_t[1]'), ffi.new('uint64_t[1]')
+	ffi.C.kr_name_memo_stats(memo, hits, misses)
+	return {hits = tonumber(hits[0]), misses = tonumber(misses[0])}
+end
+
+-- Forget the memoized decisions, e.g. after modifying a rule list directly
+function policy.memo_clear()
+	memo_bump()
+end
+
 -- Top-down policy list walk until we hit a match
 -- the caller is responsible for reordering policy list
 -- from most specific to least specific.
@@ -553,8 +852,15 @@ function policy.add(rule, postrule)
 		postrule = nil
 	end
 	-- End of compatibility shim
-	local desc = {id=getruleid(), cb=rule, count=0}
-	table.insert(postrule and policy.postrules or policy.rules, desc)
+	local desc = {id=getruleid(), cb=rule, count=0, pure=pure_rules[rule]}
+	local rules = postrule and policy.postrules or policy.rules
+	table.insert(rules, desc)
+	memo_bump()
+	suffix_index_add(rules, desc)
+	local zone = rpz_zones[rule]
+	if zone and not postrule then
+		desc.rpz_ip = policy.add(rpz_ip_rule(zone), true)
+	end
 	return desc
 end
 
@@ -563,6 +869,11 @@ local function delrule(rules, id)
 	for i, r in ipairs(rules) do
 		if r.id == id then
 			table.remove(rules, i)
+			suffix_index_del(rules, r)
+			memo_bump()
+			if r.rpz_ip then
+				delrule(policy.postrules, r.rpz_ip.id)
+			end
 			return true
 		end
 	end
@@ -587,146 +898,31 @@ function policy.todnames(names)
 	return names
 end
 
--- RFC1918 Private, local, broadcast, test and special zones
--- Considerations: RFC6761, sec 6.1.
+-- Locally served zones: localhost. and its reverse zones, the empty zones
+-- of RFC6303 and RFC7793 and the special-use names, see RFC6761 sec 6.
 -- https://www.iana.org/assignments/locally-served-dns-zones
-local private_zones = {
-	-- RFC6303
-	'10.in-addr.arpa.',
-	'16.172.in-addr.arpa.',
-	'17.172.in-addr.arpa.',
-	'18.172.in-addr.arpa.',
-	'19.172.in-addr.arpa.',
-	'20.172.in-addr.arpa.',
-	'21.172.in-addr.arpa.',
-	'22.172.in-addr.arpa.',
-	'23.172.in-addr.arpa.',
-	'24.172.in-addr.arpa.',
-	'25.172.in-addr.arpa.',
-	'26.172.in-addr.arpa.',
-	'27.172.in-addr.arpa.',
-	'28.172.in-addr.arpa.',
-	'29.172.in-addr.arpa.',
-	'30.172.in-addr.arpa.',
-	'31.172.in-addr.arpa.',
-	'168.192.in-addr.arpa.',
-	'0.in-addr.arpa.',
-	'254.169.in-addr.arpa.',
-	'2.0.192.in-addr.arpa.',
-	'100.51.198.in-addr.arpa.',
-	'113.0.203.in-addr.arpa.',
-	'255.255.255.255.in-addr.arpa.',
-	-- RFC7793
-	'64.100.in-addr.arpa.',
-	'65.100.in-addr.arpa.',
-	'66.100.in-addr.arpa.',
-	'67.100.in-addr.arpa.',
-	'68.100.in-addr.arpa.',
-	'69.100.in-addr.arpa.',
-	'70.100.in-addr.arpa.',
-	'71.100.in-addr.arpa.',
-	'72.100.in-addr.arpa.',
-	'73.100.in-addr.arpa.',
-	'74.100.in-addr.arpa.',
-	'75.100.in-addr.arpa.',
-	'76.100.in-addr.arpa.',
-	'77.100.in-addr.arpa.',
-	'78.100.in-addr.arpa.',
-	'79.100.in-addr.arpa.',
-	'80.100.in-addr.arpa.',
-	'81.100.in-addr.arpa.',
-	'82.100.in-addr.arpa.',
-	'83.100.in-addr.arpa.',
-	'84.100.in-addr.arpa.',
-	'85.100.in-addr.arpa.',
-	'86.100.in-addr.arpa.',
-	'87.100.in-addr.arpa.',
-	'88.100.in-addr.arpa.',
-	'89.100.in-addr.arpa.',
-	'90.100.in-addr.arpa.',
-	'91.100.in-addr.arpa.',
-	'92.100.in-addr.arpa.',
-	'93.100.in-addr.arpa.',
-	'94.100.in-addr.arpa.',
-	'95.100.in-addr.arpa.',
-	'96.100.in-addr.arpa.',
-	'97.100.in-addr.arpa.',
-	'98.100.in-addr.arpa.',
-	'99.100.in-addr.arpa.',
-	'100.100.in-addr.arpa.',
-	'101.100.in-addr.arpa.',
-	'102.100.in-addr.arpa.',
-	'103.100.in-addr.arpa.',
-	'104.100.in-addr.arpa.',
-	'105.100.in-addr.arpa.',
-	'106.100.in-addr.arpa.',
-	'107.100.in-addr.arpa.',
-	'108.100.in-addr.arpa.',
-	'109.100.in-addr.arpa.',
-	'110.100.in-addr.arpa.',
-	'111.100.in-addr.arpa.',
-	'112.100.in-addr.arpa.',
-	'113.100.in-addr.arpa.',
-	'114.100.in-addr.arpa.',
-	'115.100.in-addr.arpa.',
-	'116.100.in-addr.arpa.',
-	'117.100.in-addr.arpa.',
-	'118.100.in-addr.arpa.',
-	'119.100.in-addr.arpa.',
-	'120.100.in-addr.arpa.',
-	'121.100.in-addr.arpa.',
-	'122.100.in-addr.arpa.',
-	'123.100.in-addr.arpa.',
-	'124.100.in-addr.arpa.',
-	'125.100.in-addr.arpa.',
-	'126.100.in-addr.arpa.',
-	'127.100.in-addr.arpa.',
-
-	-- RFC6303
-	-- localhost_reversed handles ::1
-	'0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.',
-	'd.f.ip6.arpa.',
-	'8.e.f.ip6.arpa.',
-	'9.e.f.ip6.arpa.',
-	'a.e.f.ip6.arpa.',
-	'b.e.f.ip6.arpa.',
-	'8.b.d.0.1.0.0.2.ip6.arpa.',
-}
-policy.todnames(private_zones)
+-- Their answers are prepared in C once, see lib/localzones.h
+local function localzone_answer(_, req)
+	local qry = req:current()
+	if ffi.C.kr_localzone_answer(req.answer, qry.sname, qry.stype) ~= 0 then
+		return kres.FAIL
+	end
+	return kres.DONE
+end
+
+local localzones = pure(function(_, query)
+	if ffi.C.kr_localzone_find(query.sname) >= 0 then
+		return localzone_answer
+	end
+	return nil
+end)
 
 -- @var Default rules
 policy.rules = {}
 policy.postrules = {}
 policy.special_names = {
 	{
-		cb=policy.suffix_common(policy.DENY_MSG(
-			'Blocking is mandated by standards, see references on '
-			.. 'https://www.iana.org/assignments/'
-			.. 'locally-served-dns-zones/locally-served-dns-zones.xhtml'),
-			private_zones, todname('arpa.')),
-		count=0
-	},
-	{
-		cb=policy.suffix(policy.DENY_MSG(
-			'Blocking is mandated by standards, see references on '
-			.. 'https://www.iana.org/assignments/'
-			.. 'special-use-domain-names/special-use-domain-names.xhtml'),
-			{
-				todname('test.'),
-				todname('onion.'),
-				todname('invalid.'),
-			}),
-		count=0
-	},
-	{
-		cb=policy.suffix(localhost, {dname_localhost}),
-		count=0
-	},
-	{
-		cb=policy.suffix_common(localhost_reversed, {
-			todname('127.in-addr.arpa.'),
-			todname('1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.')},
-			todname('arpa.')),
+		cb=localzones,
 		count=0
 	},
 }
@@ -1,60 +1,37 @@
 -- setup resolver
-modules = { 'predict', 'stats' }
+modules = { 'predict' }
 
--- mock global functions
-local resolve_count = 0
-local current_epoch = 0
-
-resolve = function ()
-	resolve_count = resolve_count + 1
-end
-
-stats.frequent = function ()
-	return {
-		{name = 'example.com', type = 'TYPE65535'},
-		{name = 'example.com', type = 'SOA'},
-	}
-end
-
-predict.epoch = function ()
-	return current_epoch % predict.period + 1
+-- test that the counters are exported
+local function test_predict_stats()
+	local st = predict.stats()
+	for _, k in ipairs({'scheduled', 'duplicate', 'dropped', 'started', 'failed', 'queued'}) do
+		same(type(st[k]), 'number', 'exports counter ' .. k)
+	end
+	same(st.queued, 0, 'prefetch queue empty at start')
 end
 
--- test if draining of prefetch queue works
-local function test_predict_drain()
-	resolve_count = 0
-	predict.queue_len = 2
-	predict.queue['TYPE65535 example.com'] = 1
-	predict.queue['SOA example.com'] = 1
-	predict.drain()
-	-- test that it attempted to prefetch
-	same(resolve_count, 2, 'attempted to prefetch on drain')
-	same(predict.queue_len, 0, 'prefetch queue empty after drain')
+-- return true if the config was accepted
+local function accepts(config)
+	return (pcall(predict.config, config))
 end
 
--- test if prediction process works
-local function test_predict_process()
-	-- start new epoch
-	predict.process()
-	same(predict.queue_len, 0, 'first epoch, empty prefetch queue')
-	-- next epoch, still no period for frequent queries
-	current_epoch = current_epoch + 1
-	predict.process()
-	same(predict.queue_len, 0, 'second epoch, empty prefetch queue')
-	-- next epoch, found period
-	current_epoch = current_epoch + 1
-	predict.process()
-	same(predict.queue_len, 2, 'third epoch, prefetching')
-	-- drain works with scheduled prefetches (two batches)
-	resolve_count = 0
-	predict.drain()
-	predict.drain()
-	same(resolve_count, 2, 'attempted to resolve queries in queue')
-	same(predict.queue_len, 0, 'prefetch queue is empty')
+-- test reconfiguration of the refreshes
+local function test_predict_config()
+	same(accepts({ threshold = 10, hot = 3, rate = 50, queue = 16 }), true, 'accepts config')
+	same(predict.threshold, 10, 'threshold is set')
+	same(predict.hot, 3, 'hot is set')
+	same(predict.rate, 50, 'rate is set')
+	same(predict.queue, 16, 'queue is set')
+	same(accepts({ rate = 0 }), true, 'accepts zero rate (stopped)')
+	same(predict.stats().queued, 0, 'prefetch queue empty after reconfig')
+	same(accepts({ rate = 'fast' }), false, 'rejects non-numeric rate')
+	same(accepts({ queue = -1 }), false, 'rejects negative queue')
+	same(accepts({ window = 15, period = 24 }), true, 'ignores the old options')
+	same(accepts({ threshold = 1, hot = 2, rate = 100, queue = 1024 }), true, 'restores defaults')
 end
 
 -- return test set
 return {
-	test_predict_drain,
-	test_predict_process
+	test_predict_stats,
+	test_predict_config,
 }
@@ -14,6 +14,10 @@ local rz_cur_interval = rz_default_interval
 local rz_interval_randomizator_limit = 10
 local rz_interval_threshold = 5
 local rz_interval_min = 3600
+-- the process holding the lock refreshes the zone for all sharing the cache
+local rz_shared = true
+local rz_lock = nil
+local rz_seen_mtime = nil
 
 local prefill = {
 }
@@ -38,18 +42,53 @@ local function https_fetch(url, ca_file)
 	return resp, "[prefill] "..url.." downloaded"
 end
 
--- Write zone to a file
+-- Write zone to a file; it's replaced at once, so the others never read a part of it
 local function zone_write(zone, fname)
-	local file, errmsg = io.open(fname, 'w')
+	local tmp_fname = fname .. '.tmp'
+	local file, errmsg = io.open(tmp_fname, 'w')
 	if not file then
 		error(string.format("[prefill] unable to open file %s (%s)",
-			fname, errmsg))
+			tmp_fname, errmsg))
 	end
 	for i = 1, #zone do
 		local zone_chunk = zone[i]
-		file:write(zone_chunk)
+		local ok, werr = file:write(zone_chunk)
+		if not ok then
+			file:close()
+			os.remove(tmp_fname)
+			error(string.format("[prefill] unable to write file %s (%s)",
+				tmp_fname, werr))
+		end
 	end
 	file:close()
+	local ok, rerr = os.rename(tmp_fname, fname)
+	if not ok then
+		os.remove(tmp_fname)
+		error(string.format("[prefill] unable to rename file %s (%s)",
+			tmp_fname, rerr))
+	end
+end
+
+-- Whether this process refreshes the zone; the lock is kept until deinit()
+-- or exit, then another process takes it over on its next timer.
+local function is_refresher(fname)
+	if not rz_shared then
+		return true
+	end
+	if rz_lock then
+		return true
+	end
+	local file, errmsg = io.open(fname .. '.lock', 'a')
+	if not file then
+		log("[prefill] cannot open lock file (%s), refreshing independently", errmsg)
+		return true
+	end
+	if not lfs.lock(file, 'w') then
+		file:close()
+		return false
+	end
+	rz_lock = file
+	return true
 end
 
 local function display_delay(time)
@@ -97,13 +136,29 @@ local function import(fname)
 	if res.code == 1 then -- no TA found, wait
 		error("[prefill] no trust anchor found for root zone, import aborted")
 	elseif res.code == 0 then
-		log("[prefill] root zone successfully parsed, import started")
+		log("[prefill] root zone import started")
 	else
 		error(string.format("[prefill] root zone import failed (%s)", res.msg))
 	end
 end
 
+-- The cache is shared, so the others only notice the fresh file.
+local function timer_other()
+	local attrs = lfs.attributes(rz_local_fname)
+	if attrs and attrs.modification ~= rz_seen_mtime then
+		rz_seen_mtime = attrs.modification
+		log("[prefill] root zone refreshed by another process")
+	end
+	-- check soon enough to take over if that process is gone
+	rz_cur_interval = math.min(get_file_ttl(rz_local_fname), rz_https_fail_interval)
+				+ math.random(rz_interval_randomizator_limit)
+	event.reschedule(rz_event_id, rz_cur_interval * sec)
+end
+
 local function timer()
+	if not is_refresher(rz_local_fname) then
+		return timer_other()
+	end
 	local file_ttl = get_file_ttl(rz_local_fname)
 
 	if file_ttl > rz_interval_threshold then
@@ -149,6 +204,10 @@ function prefill.deinit()
 		event.cancel(rz_event_id)
 		rz_event_id = nil
 	end
+	if rz_lock then
+		rz_lock:close()
+		rz_lock = nil
+	end
 end
 
 -- process one item from configuration table
@@ -181,6 +240,10 @@ local function config_zone(zone_cfg)
 	else
 		rz_url = zone_cfg.url
 	end
+
+	if zone_cfg.shared ~= nil then
+		rz_shared = zone_cfg.shared and true or false
+	end
 end
 
 function prefill.config(config)
@@ -16,11 +16,18 @@
 
 /** @file cdb_redis.c
  *  @brief Implemented all the things that the resolver cache needs (get, set, expiration).
+ *
+ *  The reads are synchronous, as the cache expects the value on return,
+ *  but each is a single pipelined round trip bounded by REDIS_TIMEOUT.
+ *  The writes are kept until the sync and then sent without waiting,
+ *  over a second connection driven by the uv loop.
+ *  After a failure the server isn't contacted for REDIS_RETRY and the cache just misses.
  */
 
 #include <assert.h>
 #include <string.h>
 #include <uv.h>
+#include <hiredis/adapters/libuv.h>
 
 #include "modules/redis/redis.h"
 #include "contrib/ccan/asprintf/asprintf.h"
@@ -29,7 +36,7 @@
 
 
 #include "lib/cache/cdb_api.h"
-#include "lib/cache.h"
+#include "lib/cache/api.h"
 #include "lib/utils.h"
 #include "lib/defines.h"
 
@@ -37,16 +44,20 @@
 
 static int cli_connect(struct redis_cli *cli)
 {
+	const struct timeval timeout = {
+		.tv_sec = REDIS_TIMEOUT / 1000,
+		.tv_usec = (REDIS_TIMEOUT % 1000) * 1000,
+	};
 	/* Connect to either UNIX socket or TCP */
 	if (cli->port == 0) {
-		cli->handle = redisConnectUnix(cli->addr);
+		cli->handle = redisConnectUnixWithTimeout(cli->addr, timeout);
 	} else {
-		cli->handle = redisConnect(cli->addr, cli->port);
+		cli->handle = redisConnectWithTimeout(cli->addr, cli->port, timeout);
 	}
 	/* Catch errors */
 	if (!cli->handle) {
 		return kr_error(ENOMEM);
-	} else if (cli->handle->err) {
+	} else if (cli->handle->err || redisSetTimeout(cli->handle, timeout) != REDIS_OK) {
 		redisFree(cli->handle);
 		cli->handle = NULL;
 		return kr_error(ECONNREFUSED);
@@ -64,6 +75,98 @@ static int cli_connect(struct redis_cli *cli)
 	return kr_ok();
 }
 
+static void on_async_connect(const redisAsyncContext *ac, int status)
+{
+	struct redis_cli *cli = ac->data;
+	if (status != REDIS_OK) { /* hiredis frees the context */
+		cli->async = NULL;
+		cli->retry_at = kr_now() + REDIS_RETRY;
+	}
+}
+
+static void on_async_disconnect(const redisAsyncContext *ac, int status)
+{
+	struct redis_cli *cli = ac->data;
+	cli->async = NULL;
+	cli->inflight = 0;
+	if (status != REDIS_OK) {
+		cli->retry_at = kr_now() + REDIS_RETRY;
+	}
+}
+
+static void on_async_reply(redisAsyncContext *ac, void *reply, void *privdata)
+{
+	struct redis_cli *cli = ac->data;
+	if (cli->inflight > 0) {
+		cli->inflight -= 1;
+	}
+}
+
+/** Connect the client for writes; the commands are queued until it's connected. */
+static int cli_connect_async(struct redis_cli *cli)
+{
+	redisAsyncContext *ac = NULL;
+	if (cli->port == 0) {
+		ac = redisAsyncConnectUnix(cli->addr);
+	} else {
+		ac = redisAsyncConnect(cli->addr, cli->port);
+	}
+	if (!ac) {
+		return kr_error(ENOMEM);
+	} else if (ac->err) {
+		redisAsyncFree(ac);
+		return kr_error(ECONNREFUSED);
+	}
+	ac->data = cli;
+	if (redisLibuvAttach(ac, uv_default_loop()) != REDIS_OK) {
+		redisAsyncFree(ac);
+		return kr_error(ENOMEM);
+	}
+	redisAsyncSetConnectCallback(ac, on_async_connect);
+	redisAsyncSetDisconnectCallback(ac, on_async_disconnect);
+	redisAsyncCommand(ac, NULL, NULL, "SELECT %d", cli->database);
+	cli->async = ac;
+	return kr_ok();
+}
+
+static void cli_drop_pending(struct redis_cli *cli)
+{
+	redis_pending_t *pending = &cli->pending;
+	for (unsigned i = 0; i < pending->len; ++i) {
+		free(pending->at[i].key.data);
+	}
+	pending->len = 0;
+}
+
+/** Send the pending writes without waiting for the replies. */
+static int cli_flush(struct redis_cli *cli)
+{
+	redis_pending_t *pending = &cli->pending;
+	if (pending->len == 0) {
+		return kr_ok();
+	}
+	if (!cli->async && kr_now() >= cli->retry_at && cli_connect_async(cli) != 0) {
+		cli->retry_at = kr_now() + REDIS_RETRY;
+	}
+	int ret = kr_ok();
+	for (unsigned i = 0; i < pending->len; ++i) {
+		const struct redis_pending *w = &pending->at[i];
+		/* A slow server mustn't grow the buffers, rather lose the writes. */
+		if (!cli->async || cli->inflight >= REDIS_MAXPENDING) {
+			ret = kr_error(EAGAIN);
+			break;
+		}
+		/* @note The values aren't interpreted; nothing in the cache outlives the TTL limit. */
+		if (redisAsyncCommand(cli->async, on_async_reply, NULL, "SET %b %b EX %d",
+				      w->key.data, w->key.len, w->val.data, w->val.len,
+				      KR_CACHE_DEFAULT_TTL_MAX) == REDIS_OK) {
+			cli->inflight += 1;
+		}
+	}
+	cli_drop_pending(cli);
+	return ret;
+}
+
 static void cli_decommit(struct redis_cli *cli)
 {
 	redis_freelist_t *freelist = &cli->freelist;
@@ -78,8 +181,13 @@ static void cli_free(struct redis_cli *cli)
 	if (cli->handle) {
 		redisFree(cli->handle);
 	}
+	if (cli->async) { /* the callbacks still use the cli */
+		redisAsyncFree(cli->async);
+	}
 	cli_decommit(cli);
 	array_clear(cli->freelist);
+	cli_drop_pending(cli);
+	array_clear(cli->pending);
 	free(cli->addr);
 	free(cli);
 }
@@ -164,23 +272,28 @@ static int cdb_sync(knot_db_t *cache)
 	}
 	struct redis_cli *cli = cache;
 	cli_decommit(cli);
-	return 0;
+	return cli_flush(cli);
 }
 
-/* Disconnect client */
+/* Disconnect client, e.g. after a timeout the replies would come out of order */
 #define CLI_DISCONNECT(cli) \
 	if ((cli)->handle->err != REDIS_ERR_OTHER) { \
 		redisFree((cli)->handle); \
 		(cli)->handle = NULL; \
+		(cli)->retry_at = kr_now() + REDIS_RETRY; \
 	}
-/* Attempt to reconnect */
+/* Attempt to reconnect, unless it failed recently */
 #define CLI_KEEPALIVE(cli_) \
 	if ((cli_)->freelist.len > REDIS_MAXFREELIST) { \
 		cli_decommit(cli_); \
 	} \
 	if (!(cli_)->handle) { \
+		if (kr_now() < (cli_)->retry_at) { \
+			return kr_error(EAGAIN); \
+		} \
 		int ret = cli_connect((cli_)); \
 		if (ret != 0) { \
+			(cli_)->retry_at = kr_now() + REDIS_RETRY; \
 			return ret; \
 		} \
 	}
@@ -211,6 +324,7 @@ static int cdb_clear(knot_db_t *cache)
 		return kr_error(EINVAL);
 	}
 	struct redis_cli *cli = cache;
+	cli_drop_pending(cli);
 	CLI_KEEPALIVE(cli);
 	redisReply *reply = redisCommand(cli->handle, "FLUSHDB");
 	if (!reply) {
@@ -227,36 +341,49 @@ static int cdb_readv(knot_db_t *cache, const knot_db_val_t *key, knot_db_val_t *
 	if (!cache || !key || !val) {
 		return kr_error(EINVAL);
 	}
+	if (maxcount > REDIS_BATCHSIZE) {
+		return kr_error(E2BIG);
+	}
 	struct redis_cli *cli = cache;
 	CLI_KEEPALIVE(cli);
 
-	/* Build command pipeline */
+	/* One round trip for all the keys */
+	const char *argv[REDIS_BATCHSIZE + 1] = { "MGET" };
+	size_t argvlen[REDIS_BATCHSIZE + 1] = { 4 };
 	for (int i = 0; i < maxcount; ++i) {
-		redisAppendCommand(cli->handle, "GET %b", key[i].data, key[i].len);
+		argv[i + 1] = key[i].data;
+		argvlen[i + 1] = key[i].len;
+	}
+	redisReply *reply = redisCommandArgv(cli->handle, maxcount + 1, argv, argvlen);
+	if (!reply) {
+		CLI_DISCONNECT(cli);
+		return kr_error(EIO);
+	}
+	/* Track reply in a freelist for this transaction */
+	if (array_push(cli->freelist, reply) < 0) {
+		freeReplyObject(reply); /* Can't track this, must free */
+		return kr_error(ENOMEM);
+	}
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != maxcount) {
+		return kr_error(EPROTO);
 	}
-	/* Gather replies */
+	/* Return values, missing keys are nil */
+	int ret = kr_ok();
 	for (int i = 0; i < maxcount; ++i) {
-		redisReply *reply = NULL;
-		redisGetReply(cli->handle, (void **)&reply);
-		if (!reply) {
-			CLI_DISCONNECT(cli);
-			return kr_error(EIO);
-		}
-		/* Track reply in a freelist for this transaction */ 
-		if (array_push(cli->freelist, reply) < 0) {
-			freeReplyObject(reply); /* Can't track this, must free */
-			return kr_error(ENOMEM);
-		}
-		/* Return value */
-		if (reply->type != REDIS_REPLY_STRING) {
-			return kr_error(EPROTO);
+		const redisReply *elem = reply->element[i];
+		if (elem->type == REDIS_REPLY_STRING) {
+			val[i].data = elem->str;
+			val[i].len = elem->len;
+		} else {
+			val[i].data = NULL;
+			val[i].len = 0;
+			ret = kr_error(ENOENT);
 		}
-		val[i].data = reply->str;
-		val[i].len = reply->len;
 	}
-	return kr_ok();
+	return ret;
 }
 
+/** Keep the writes until the sync; a value without data is reserved for the caller to fill. */
 static int cdb_writev(knot_db_t *cache, const knot_db_val_t *key, knot_db_val_t *val,
 			int maxcount)
 {
@@ -265,29 +392,28 @@ static int cdb_writev(knot_db_t *cache, const knot_db_val_t *key, knot_db_val_t
 	}
 
 	struct redis_cli *cli = cache;
-	CLI_KEEPALIVE(cli);
-
-	/* Build command pipeline */
-	for (int i = 0; i < maxcount; ++i) {
-		if (val->len < 2) {
-			/* @note Special values/namespaces, not a RR entry with TTL. */
-			redisAppendCommand(cli->handle, "SET %b %b", key[i].data, key[i].len, val[i].data, val[i].len);
-		} else {
-			/* @warning This expects usage only for recursor cache, if anyone
-			 * desires to port this somewhere else, TTL shouldn't be interpreted. */
-			struct kr_cache_entry *entry = val[i].data;
-			redisAppendCommand(cli->handle, "SETEX %b %d %b", key[i].data, key[i].len, entry->ttl, val[i].data, val[i].len);
-		}
+	/* The values reserved by the previous calls are filled in by now. */
+	if (cli->pending.len + maxcount > REDIS_MAXPENDING) {
+		(void) cli_flush(cli);
 	}
-	/* Gather replies */
 	for (int i = 0; i < maxcount; ++i) {
-		redisReply *reply = NULL;
-		redisGetReply(cli->handle, (void **)&reply);
-		if (!reply) {
-			CLI_DISCONNECT(cli);
-			return kr_error(EIO);
+		uint8_t *buf = malloc(key[i].len + val[i].len);
+		if (!buf) {
+			return kr_error(ENOMEM);
+		}
+		struct redis_pending w = {
+			.key = { .data = buf, .len = key[i].len },
+			.val = { .data = buf + key[i].len, .len = val[i].len },
+		};
+		memcpy(w.key.data, key[i].data, key[i].len);
+		if (val[i].data) {
+			memcpy(w.val.data, val[i].data, val[i].len);
 		}
-		freeReplyObject(reply);
+		if (array_push(cli->pending, w) < 0) {
+			free(buf);
+			return kr_error(ENOMEM);
+		}
+		val[i].data = w.val.data;
 	}
 	return kr_ok();
 }
@@ -299,21 +425,19 @@ static int cdb_remove(knot_db_t *cache, knot_db_val_t *key, int maxcount)
 	}
 
 	struct redis_cli *cli = cache;
-	CLI_KEEPALIVE(cli);
-
-	/* Build command pipeline */
-	for (int i = 0; i < maxcount; ++i) {
-		redisAppendCommand(cli->handle, "DEL %b", key[i].data, key[i].len);
+	/* Keep the order with the pending writes, over the same connection. */
+	(void) cli_flush(cli);
+	if (!cli->async) {
+		return kr_error(EAGAIN);
 	}
-	/* Gather replies */
 	for (int i = 0; i < maxcount; ++i) {
-		redisReply *reply = NULL;
-		redisGetReply(cli->handle, (void **)&reply);
-		if (!reply) {
-			CLI_DISCONNECT(cli);
-			return kr_error(EIO);
+		if (cli->inflight >= REDIS_MAXPENDING) {
+			return kr_error(EAGAIN);
+		}
+		if (redisAsyncCommand(cli->async, on_async_reply, NULL, "DEL %b",
+				      key[i].data, key[i].len) == REDIS_OK) {
+			cli->inflight += 1;
 		}
-		freeReplyObject(reply);
 	}
 	return kr_ok();
 }
@@ -358,13 +482,19 @@ static int cdb_match(knot_db_t *cache, knot_db_val_t *key, knot_db_val_t *val, i
 	return results;
 }
 
+static int cdb_read_leq(knot_db_t *cache, knot_db_val_t *key, knot_db_val_t *val)
+{
+	return kr_error(ENOSYS);
+}
+
 const struct kr_cdb_api *cdb_redis(void)
 {
 	static const struct kr_cdb_api api = {
 		"redis",
 		cdb_init, cdb_deinit, cdb_count, cdb_clear, cdb_sync,
 		cdb_readv, cdb_writev, cdb_remove,
-		cdb_match, NULL /* prune */
+		cdb_match, NULL /* prune */,
+		cdb_read_leq, NULL /* walk */, NULL /* usage_percent */
 	};
 
 	return &api;
@@ -21,7 +21,7 @@
 #include "modules/redis/redis.h"
 #include "daemon/engine.h"
 #include "lib/module.h"
-#include "lib/cache.h"
+#include "lib/cache/api.h"
 
 /** @internal Redis API */
 const struct kr_cdb_api *cdb_redis(void);
@@ -42,6 +42,9 @@ int redis_deinit(struct kr_module *module)
 	if (engine->resolver.cache.api == cdb_redis()) {
 		kr_cache_close(&engine->resolver.cache);
 	}
+	if (kr_cache_remote_api(&engine->resolver.cache) == cdb_redis()) {
+		kr_cache_remote_close(&engine->resolver.cache);
+	}
 	/* Prevent from loading it again */
 	for (unsigned i = 0; i < engine->backends.len; ++i) {
 		const struct kr_cdb_api *api = engine->backends.at[i];
@@ -17,19 +17,40 @@
 #pragma once
 
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <libknot/db/db.h>
 #include "lib/generic/array.h"
 
 /** Redis buffer size */
 #define REDIS_MAXFREELIST 1024
 #define REDIS_BUFSIZE (1024 * 1024)
 #define REDIS_PORT 6379
+/** Writes kept until sync, and async commands without a reply; more are dropped. */
+#define REDIS_MAXPENDING 1024
+#ifndef REDIS_TIMEOUT
+ #define REDIS_TIMEOUT 100 /* ms for a connect or a read, the loop waits for it */
+#endif
+#ifndef REDIS_RETRY
+ #define REDIS_RETRY 1000 /* ms before reconnecting after a failure */
+#endif
 
 typedef array_t(redisReply *) redis_freelist_t;
 
+/** @internal Write waiting for the sync; the cache fills in the reserved value meanwhile. */
+struct redis_pending {
+	knot_db_val_t key;
+	knot_db_val_t val; /**< Allocated together with the key */
+};
+typedef array_t(struct redis_pending) redis_pending_t;
+
 /** @internal Redis client */
 struct redis_cli {
-	redisContext *handle;
+	redisContext *handle;       /**< Blocking with REDIS_TIMEOUT, for reads */
+	redisAsyncContext *async;   /**< Driven by the uv loop, for writes */
 	redis_freelist_t freelist;
+	redis_pending_t pending;
+	unsigned inflight;          /**< Async commands without a reply */
+	uint64_t retry_at;          /**< No reconnecting before, see kr_now() */
 	char *addr;
 	unsigned database;
 	unsigned port;
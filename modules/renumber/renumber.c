@@ -0,0 +1,275 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file renumber.c
+ * @brief Rewrite the addresses in answers from one subnet to another.
+ *
+ * The rules are kept in a subnet index, so each address in the answer is
+ * a lookup, whatever the number of rules.  The records are rewritten in place
+ * in the selected answer records, before the answer is written out,
+ * and only after the cache has stored the original ones.
+ */
+
+#include <arpa/inet.h>
+#include <ccan/json/json.h>
+#include <libknot/descriptor.h>
+#include <libknot/rrtype/rrsig.h>
+
+#include "lib/generic/array.h"
+#include "lib/layer.h"
+#include "lib/module.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "renum",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][renum] " fmt, ## __VA_ARGS__)
+
+struct renumber_rule {
+	char *subnet;        /**< As configured, for the counters */
+	uint8_t target[16];
+	int bits;            /**< Length of the prefix replaced */
+	uint64_t count;      /**< Addresses rewritten */
+};
+
+struct renumber_data {
+	struct kr_subnets *index;                /**< Subnet -> rule id, in the rule order */
+	array_t(struct renumber_rule) rules;
+};
+
+static void rules_free(struct renumber_data *data)
+{
+	for (size_t i = 0; i < data->rules.len; ++i) {
+		free(data->rules.at[i].subnet);
+	}
+	array_clear(data->rules);
+	kr_subnets_free(data->index);
+	data->index = NULL;
+}
+
+/** Replace the prefix of the address with the one of the rule. */
+static void rewrite_addr(const struct renumber_rule *rule, uint8_t *addr)
+{
+	const int full = rule->bits / 8;
+	memcpy(addr, rule->target, full);
+	if (rule->bits % 8) {
+		const uint8_t mask = 0xff << (8 - rule->bits % 8);
+		addr[full] = (rule->target[full] & mask) | (addr[full] & ~mask);
+	}
+}
+
+/** Rewrite the matching addresses of the set, return whether any was. */
+static bool rewrite_rrset(struct renumber_data *data, knot_rrset_t *rr)
+{
+	const int family = rr->type == KNOT_RRTYPE_A ? AF_INET : AF_INET6;
+	const int addr_len = kr_family_len(family);
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	ss.ss_family = family;
+	uint8_t *ss_addr = (uint8_t *)kr_inaddr((struct sockaddr *)&ss);
+	bool changed = false;
+	for (uint16_t k = 0; k < rr->rrs.rr_count; ++k) {
+		knot_rdata_t *rd = knot_rdataset_at(&rr->rrs, k);
+		if (knot_rdata_rdlen(rd) != addr_len) {
+			continue;
+		}
+		uint8_t *addr = knot_rdata_data(rd);
+		memcpy(ss_addr, addr, addr_len);
+		uint32_t id;
+		if (kr_subnets_match(data->index, (struct sockaddr *)&ss, &id) != 0) {
+			continue;
+		}
+		struct renumber_rule *rule = &data->rules.at[id];
+		rewrite_addr(rule, addr);
+		rule->count += 1;
+		changed = true;
+	}
+	return changed;
+}
+
+/** The signatures of the rewritten set can't be valid anymore, leave them out. */
+static void drop_rrsigs(struct kr_request *req, const struct kr_query *qry,
+			const knot_rrset_t *rr)
+{
+	for (size_t i = 0; i < req->answ_selected.len; ++i) {
+		ranked_rr_array_entry_t *entry = req->answ_selected.at[i];
+		if (entry->qry_uid == qry->uid && entry->rr->type == KNOT_RRTYPE_RRSIG
+		    && knot_rrsig_type_covered(&entry->rr->rrs, 0) == rr->type
+		    && knot_dname_is_equal(entry->rr->owner, rr->owner)) {
+			entry->to_wire = false;
+		}
+	}
+}
+
+static int consume(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+	struct kr_module *module = ctx->api->data;
+	struct renumber_data *data = module->data;
+	/* Only the records of the answer, the addresses of the servers are left alone. */
+	if (ctx->state & KR_STATE_FAIL || !data->index || !qry || qry->parent != NULL
+	    || !qry->flags.RESOLVED) {
+		return ctx->state;
+	}
+	for (size_t i = 0; i < req->answ_selected.len; ++i) {
+		ranked_rr_array_entry_t *entry = req->answ_selected.at[i];
+		knot_rrset_t *rr = entry->rr;
+		if (entry->qry_uid != qry->uid || !entry->to_wire
+		    || (rr->type != KNOT_RRTYPE_A && rr->type != KNOT_RRTYPE_AAAA)) {
+			continue;
+		}
+		if (rewrite_rrset(data, rr)) {
+			VERBOSE_MSG(qry, "<= renumbered addresses of the answer\n");
+			drop_rrsigs(req, qry, rr);
+		}
+	}
+	return ctx->state;
+}
+
+/** Parse a { subnet, target } pair, both of the same address family. */
+static int parse_rule(const JsonNode *node, struct renumber_rule *rule)
+{
+	const JsonNode *subnet = json_find_element((JsonNode *)node, 0);
+	const JsonNode *target = json_find_element((JsonNode *)node, 1);
+	if (node->tag != JSON_ARRAY || !subnet || subnet->tag != JSON_STRING
+	    || !target || target->tag != JSON_STRING) {
+		return kr_error(EINVAL);
+	}
+	uint8_t addr[16];
+	const int family = kr_straddr_family(subnet->string_);
+	const int bits = kr_straddr_subnet(addr, subnet->string_);
+	if (bits < 0 || kr_straddr_family(target->string_) != family
+	    || inet_pton(family, target->string_, rule->target) != 1) {
+		return kr_error(EINVAL);
+	}
+	rule->bits = bits;
+	rule->count = 0;
+	rule->subnet = strdup(subnet->string_);
+	return rule->subnet ? kr_ok() : kr_error(ENOMEM);
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *renumber_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.consume = &consume,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int renumber_init(struct kr_module *module)
+{
+	struct renumber_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	array_init(data->rules);
+	module->data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int renumber_deinit(struct kr_module *module)
+{
+	struct renumber_data *data = module->data;
+	if (data) {
+		rules_free(data);
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+/** { { subnet, target }, ... }, the first matching rule is used. */
+KR_EXPORT
+int renumber_config(struct kr_module *module, const char *conf)
+{
+	struct renumber_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	JsonNode *root = json_decode(conf);
+	if (!root || root->tag != JSON_ARRAY) {
+		ERR_MSG("expected { {prefix, target}, ... }\n");
+		json_delete(root);
+		return kr_error(EINVAL);
+	}
+	struct renumber_data parsed;
+	memset(&parsed, 0, sizeof(parsed));
+	parsed.index = kr_subnets_create();
+	int ret = parsed.index ? kr_ok() : kr_error(ENOMEM);
+	const JsonNode *node;
+	json_foreach(node, root) {
+		if (ret != 0) {
+			break;
+		}
+		struct renumber_rule rule;
+		memset(&rule, 0, sizeof(rule));
+		ret = parse_rule(node, &rule);
+		if (ret == 0) {
+			ret = kr_subnets_add(parsed.index, rule.subnet, parsed.rules.len);
+		}
+		if (ret == 0 && array_push(parsed.rules, rule) < 0) {
+			ret = kr_error(ENOMEM);
+		}
+		if (ret != 0) {
+			ERR_MSG("invalid rule #%zu, expected {prefix, target} of the same family\n",
+				parsed.rules.len + 1);
+			free(rule.subnet);
+		}
+	}
+	json_delete(root);
+	if (ret != 0) {
+		rules_free(&parsed);
+		return ret;
+	}
+	rules_free(data);
+	*data = parsed;
+	return kr_ok();
+}
+
+static char *renumber_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct renumber_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (size_t i = 0; i < data->rules.len; ++i) {
+		const struct renumber_rule *rule = &data->rules.at[i];
+		json_append_member(root, rule->subnet, json_mknumber(rule->count));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+KR_EXPORT
+struct kr_prop *renumber_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &renumber_stats, "stats", "Get the addresses rewritten by each rule in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(renumber);
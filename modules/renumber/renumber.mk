@@ -1,2 +1,5 @@
-renumber_SOURCES := renumber.lua
-$(call make_lua_module,renumber)
+renumber_CFLAGS := -fPIC
+renumber_SOURCES := modules/renumber/renumber.c
+renumber_DEPEND := $(libkres)
+renumber_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
+$(call make_c_module,renumber)
@@ -0,0 +1,372 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file rrl.c
+ * @brief Response rate limiting, against the use of the resolver as a reflector.
+ *
+ * Each UDP answer takes a token from the bucket of its client prefix and
+ * response class: the positive answers per QNAME and QTYPE, the negative
+ * ones per zone and the errors per client.  Answers over the rate are
+ * dropped, except every slip-th one, which is sent truncated instead,
+ * so that a real client of the prefix retries over TCP.
+ *
+ * The buckets are in a fixed-size LRU of each fork.
+ */
+
+#include <arpa/inet.h>
+#include <libknot/packet/pkt.h>
+#include <libknot/descriptor.h>
+#include <ccan/json/json.h>
+#include <contrib/cleanup.h>
+#include <contrib/murmurhash3/murmurhash3.h>
+
+#include "daemon/worker.h"
+#include "lib/module.h"
+#include "lib/layer.h"
+#include "lib/resolve.h"
+#include "lib/utils.h"
+#include "lib/generic/lru.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "rrl",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][rrl] " fmt, ## __VA_ARGS__)
+
+/* Defaults */
+#define RRL_RATE 20         /**< Answers per second in each bucket */
+#define RRL_SLIP 2          /**< Every slip-th limited answer is truncated, 0 = none */
+#define RRL_V4_PREFIX 24
+#define RRL_V6_PREFIX 56
+#define RRL_SIZE 65536      /**< Number of buckets */
+#define RRL_TOKEN 1000      /**< One answer, the buckets count in its thousandths */
+
+/** Response classes, each is limited separately. */
+enum rrl_class {
+	RRL_ANSWER = 1,  /**< Positive answers, by QNAME and QTYPE */
+	RRL_NEGATIVE,    /**< NXDOMAIN and NODATA, by the zone */
+	RRL_ERROR,       /**< Other rcodes, by the client only */
+};
+
+struct rrl_key {
+	uint8_t prefix[8];  /**< Client address masked to the prefix length */
+	uint8_t v6;
+	uint8_t cls;        /**< enum rrl_class */
+	uint16_t qtype;
+	uint32_t name;      /**< Hash of the lowercased name */
+};
+
+struct rrl_bucket {
+	uint32_t time;      /**< kr_now() of the last refill, truncated */
+	int32_t tokens;
+	uint32_t limited;   /**< Answers limited so far, for the slip */
+};
+
+typedef lru_t(struct rrl_bucket) rrl_lru_t;
+
+/** Counters, also exported to the shared statistics. */
+enum rrl_counter { RRL_LIMITED, RRL_DROPPED, RRL_SLIPPED, RRL_COUNTERS };
+static const char *counter_names[RRL_COUNTERS] = {
+	"rrl.limited", "rrl.dropped", "rrl.slipped",
+};
+
+struct rrl_data {
+	rrl_lru_t *buckets;
+	uint32_t size;
+	uint32_t rate;
+	uint32_t slip;
+	uint8_t v4_prefix;
+	uint8_t v6_prefix;
+	uint64_t counters[RRL_COUNTERS];
+	int shared[RRL_COUNTERS];
+};
+
+static void count(struct rrl_data *data, enum rrl_counter c)
+{
+	worker_counter_inc(data->counters, data->shared, c);
+}
+
+static uint32_t name_hash(const knot_dname_t *name)
+{
+	if (!name) {
+		return 0;
+	}
+	knot_dname_t lower[KNOT_DNAME_MAXLEN];
+	int len = knot_dname_size(name);
+	if (len <= 0 || len > KNOT_DNAME_MAXLEN) {
+		return 0;
+	}
+	memcpy(lower, name, len);
+	knot_dname_to_lower(lower);
+	return hash((const char *)lower, len);
+}
+
+/** Owner of the SOA in the authority section, i.e. the zone of a negative answer. */
+static const knot_dname_t *soa_owner(const knot_pkt_t *pkt)
+{
+	const knot_pktsection_t *ns = knot_pkt_section(pkt, KNOT_AUTHORITY);
+	for (uint16_t i = 0; i < ns->count; ++i) {
+		const knot_rrset_t *rr = knot_pkt_rr(ns, i);
+		if (rr->type == KNOT_RRTYPE_SOA) {
+			return rr->owner;
+		}
+	}
+	return NULL;
+}
+
+static bool make_key(const struct rrl_data *data, const struct kr_request *req,
+		     struct rrl_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	const struct sockaddr *addr = req->qsource.addr;
+	uint8_t ip[16];
+	int prefix = 0;
+	if (addr->sa_family == AF_INET) {
+		memcpy(ip, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		prefix = data->v4_prefix;
+	} else if (addr->sa_family == AF_INET6) {
+		memcpy(ip, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+		prefix = data->v6_prefix;
+		key->v6 = 1;
+	} else {
+		return false;
+	}
+	memcpy(key->prefix, ip, prefix / 8);
+	if (prefix % 8) {
+		key->prefix[prefix / 8] = ip[prefix / 8] & (0xff << (8 - prefix % 8));
+	}
+
+	const knot_pkt_t *answer = req->answer;
+	const uint8_t rcode = knot_wire_get_rcode(answer->wire);
+	if (rcode == KNOT_RCODE_NOERROR && knot_wire_get_ancount(answer->wire) > 0) {
+		key->cls = RRL_ANSWER;
+		key->qtype = knot_pkt_qtype(answer);
+		key->name = name_hash(knot_pkt_qname(answer));
+	} else if (rcode == KNOT_RCODE_NOERROR || rcode == KNOT_RCODE_NXDOMAIN) {
+		/* Random subdomains of a zone share its bucket. */
+		const knot_dname_t *zone = soa_owner(answer);
+		key->cls = RRL_NEGATIVE;
+		key->name = name_hash(zone ? zone : knot_pkt_qname(answer));
+	} else {
+		key->cls = RRL_ERROR;
+	}
+	return true;
+}
+
+/** Take a token from the bucket, return false if there's none. */
+static bool take_token(const struct rrl_data *data, struct rrl_bucket *b, bool is_new)
+{
+	const int32_t full = data->rate * RRL_TOKEN;
+	const uint32_t now = kr_now();
+	if (is_new) {
+		b->tokens = full;
+		b->limited = 0;
+	} else {
+		/* Refill by the time passed, rate thousandths per millisecond. */
+		uint32_t elapsed = now - b->time;
+		if (elapsed >= RRL_TOKEN || b->tokens + (int64_t)elapsed * data->rate >= full) {
+			b->tokens = full;
+		} else {
+			b->tokens += elapsed * data->rate;
+		}
+	}
+	b->time = now;
+	if (b->tokens < RRL_TOKEN) {
+		return false;
+	}
+	b->tokens -= RRL_TOKEN;
+	return true;
+}
+
+static int limit(kr_layer_t *ctx)
+{
+	struct kr_module *module = ctx->api->data;
+	struct rrl_data *data = module->data;
+	struct kr_request *req = ctx->req;
+	/* Only the UDP answers can be reflected; internal requests have no source. */
+	if (!data->buckets || data->rate == 0 || !req->qsource.addr ||
+	    req->qsource.tcp || !req->answer) {
+		return ctx->state;
+	}
+	struct rrl_key key;
+	if (!make_key(data, req, &key)) {
+		return ctx->state;
+	}
+	bool is_new = false;
+	struct rrl_bucket *b = lru_get_new(data->buckets, (const char *)&key, sizeof(key), &is_new);
+	if (!b || take_token(data, b, is_new)) {
+		return ctx->state;
+	}
+	count(data, RRL_LIMITED);
+	b->limited += 1;
+	if (data->slip && b->limited % data->slip == 0) {
+		kr_pkt_clear_payload(req->answer);
+		knot_wire_set_tc(req->answer->wire);
+		count(data, RRL_SLIPPED);
+		VERBOSE_MSG(NULL, "slipped an answer\n");
+	} else {
+		req->answer_dropped = true;
+		count(data, RRL_DROPPED);
+		VERBOSE_MSG(NULL, "dropped an answer\n");
+	}
+	return ctx->state;
+}
+
+static int buckets_resize(struct rrl_data *data, uint32_t size)
+{
+	if (data->buckets && size == data->size) {
+		return kr_ok();
+	}
+	rrl_lru_t *buckets = NULL;
+	lru_create_hash(&buckets, size, NULL, NULL, LRU_HASH_SIPHASH);
+	if (!buckets) {
+		return kr_error(ENOMEM);
+	}
+	if (data->buckets) {
+		lru_free(data->buckets);
+	}
+	data->buckets = buckets;
+	data->size = size;
+	return kr_ok();
+}
+
+static char *config_json(const struct rrl_data *data)
+{
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "rate", json_mknumber(data->rate));
+	json_append_member(root, "slip", json_mknumber(data->slip));
+	json_append_member(root, "ipv4_prefix", json_mknumber(data->v4_prefix));
+	json_append_member(root, "ipv6_prefix", json_mknumber(data->v6_prefix));
+	json_append_member(root, "size", json_mknumber(data->size));
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *rrl_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.finish = &limit,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int rrl_init(struct kr_module *module)
+{
+	struct rrl_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	data->rate = RRL_RATE;
+	data->slip = RRL_SLIP;
+	data->v4_prefix = RRL_V4_PREFIX;
+	data->v6_prefix = RRL_V6_PREFIX;
+	if (buckets_resize(data, RRL_SIZE) != 0) {
+		free(data);
+		return kr_error(ENOMEM);
+	}
+	worker_counters_register(counter_names, data->shared, RRL_COUNTERS);
+	module->data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int rrl_deinit(struct kr_module *module)
+{
+	struct rrl_data *data = module->data;
+	if (data) {
+		lru_free(data->buckets);
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+KR_EXPORT
+int rrl_config(struct kr_module *module, const char *conf)
+{
+	struct rrl_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	JsonNode *root = json_decode(conf);
+	if (!root || root->tag != JSON_OBJECT) {
+		ERR_MSG("expected a table of settings\n");
+		json_delete(root);
+		return kr_error(EINVAL);
+	}
+	uint32_t rate = data->rate, slip = data->slip, size = data->size;
+	uint32_t v4_prefix = data->v4_prefix, v6_prefix = data->v6_prefix;
+	/* The IPv6 prefix is limited by the key, /64 is a single client anyway. */
+	bool ok = worker_config_number("rrl", root, "rate", INT32_MAX / RRL_TOKEN, &rate)
+		&& worker_config_number("rrl", root, "slip", UINT16_MAX, &slip)
+		&& worker_config_number("rrl", root, "ipv4_prefix", 32, &v4_prefix)
+		&& worker_config_number("rrl", root, "ipv6_prefix", 64, &v6_prefix)
+		&& worker_config_number("rrl", root, "size", 1 << 24, &size);
+	json_delete(root);
+	if (!ok || size == 0) {
+		return kr_error(EINVAL);
+	}
+	int ret = buckets_resize(data, size);
+	if (ret != 0) {
+		return ret;
+	}
+	data->rate = rate;
+	data->slip = slip;
+	data->v4_prefix = v4_prefix;
+	data->v6_prefix = v6_prefix;
+	return kr_ok();
+}
+
+/** Return the settings and the counters of this fork. */
+static char *rrl_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct rrl_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < RRL_COUNTERS; ++i) {
+		/* strip the "rrl." */
+		json_append_member(root, counter_names[i] + 4, json_mknumber(data->counters[i]));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+static char *rrl_settings(void *env, struct kr_module *module, const char *args)
+{
+	return config_json(module->data);
+}
+
+KR_EXPORT
+struct kr_prop *rrl_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &rrl_settings, "settings", "Get the current settings.", },
+	    { &rrl_stats,    "stats", "Get the counters of limited answers in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(rrl);
+
+#undef VERBOSE_MSG
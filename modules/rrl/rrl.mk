@@ -0,0 +1,8 @@
+rrl_CFLAGS := -fPIC
+# The counters and the configuration use worker_*() of the daemon, not of libkres;
+# on darwin the undefined symbols aren't accepted by default.
+rrl_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
+rrl_SOURCES := modules/rrl/rrl.c
+rrl_DEPEND := $(libkres)
+rrl_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
+$(call make_c_module,rrl)
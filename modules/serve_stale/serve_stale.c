@@ -0,0 +1,234 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file serve_stale.c
+ * @brief Answering from expired records when upstream doesn't answer in time (RFC 8767).
+ *
+ * A client request gets a deadline when it begins; when it passes, the daemon
+ * stops waiting for upstream (see kr_request::stale_deadline) and the cache may
+ * answer with records that expired at most max_stale ago, with a short TTL.
+ * Each stale name is then refreshed once in the background, see prefetch.h.
+ */
+
+#include <ccan/json/json.h>
+
+#include "daemon/prefetch.h"
+#include "daemon/worker.h"
+#include "lib/module.h"
+#include "lib/layer.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "stal",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][stal] " fmt, ## __VA_ARGS__)
+
+/* Defaults */
+#define STALE_TIMEOUT 1800      /**< Client-facing deadline, milliseconds */
+#define STALE_MAX (24 * 3600)   /**< How long the records may be served after expiring, seconds */
+#define STALE_TTL 30            /**< TTL of the stale records in answers, seconds */
+
+/** Counters, also exported to the shared statistics. */
+enum stale_counter { STALE_RECORDS, STALE_REFRESHES, STALE_COUNTERS };
+static const char *counter_names[STALE_COUNTERS] = {
+	"serve_stale.records", "serve_stale.refreshes",
+};
+
+struct stale_data {
+	uint32_t timeout;
+	uint32_t max_stale;
+	uint32_t ttl;
+	bool refresh;
+	uint64_t counters[STALE_COUNTERS];
+	int shared[STALE_COUNTERS];
+};
+
+/** @internal The stale callback has no baton, and the module is loaded once. */
+static struct stale_data *the_data = NULL;
+
+static void count(struct stale_data *data, enum stale_counter c)
+{
+	worker_counter_inc(data->counters, data->shared, c);
+}
+
+/** Allow the records that expired recently, see kr_stale_cb. */
+static int32_t stale_ttl(int32_t ttl, const knot_dname_t *owner, uint16_t type,
+			 const struct kr_query *qry)
+{
+	struct stale_data *data = the_data;
+	if (!data || -(int64_t)ttl > data->max_stale) {
+		return -1;
+	}
+	count(data, STALE_RECORDS);
+	/* Queued once, however many requests use the stale records meanwhile. */
+	if (data->refresh && prefetch_schedule(qry->sname, qry->stype, qry->sclass) == 0) {
+		count(data, STALE_REFRESHES);
+	}
+	return data->ttl;
+}
+
+static int begin(kr_layer_t *ctx)
+{
+	struct kr_request *req = ctx->req;
+	const struct stale_data *data = the_data;
+	/* Only the clients are waiting; not the refreshes, priming, etc. */
+	if (data && data->timeout && req->qsource.addr && !req->options.NO_CACHE) {
+		req->stale_deadline = kr_now() + data->timeout;
+	}
+	return ctx->state;
+}
+
+static int produce(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+	if (!qry || qry->flags.NO_CACHE || qry->stale_cb) {
+		return ctx->state;
+	}
+	if (qry->flags.NO_NS_FOUND
+	    || (req->stale_deadline && kr_now() >= req->stale_deadline)) {
+		VERBOSE_MSG(qry, "=> no answer in time, allowing stale data\n");
+		qry->stale_cb = stale_ttl;
+	}
+	return ctx->state;
+}
+
+static char *config_json(const struct stale_data *data)
+{
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "timeout", json_mknumber(data->timeout));
+	json_append_member(root, "max_stale", json_mknumber(data->max_stale));
+	json_append_member(root, "ttl", json_mknumber(data->ttl));
+	json_append_member(root, "refresh", json_mkbool(data->refresh));
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *serve_stale_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.begin = &begin,
+		.produce = &produce,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int serve_stale_init(struct kr_module *module)
+{
+	struct stale_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	data->timeout = STALE_TIMEOUT;
+	data->max_stale = STALE_MAX;
+	data->ttl = STALE_TTL;
+	data->refresh = true;
+	worker_counters_register(counter_names, data->shared, STALE_COUNTERS);
+	module->data = data;
+	the_data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int serve_stale_deinit(struct kr_module *module)
+{
+	struct stale_data *data = module->data;
+	if (data) {
+		if (the_data == data) {
+			the_data = NULL;
+		}
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+KR_EXPORT
+int serve_stale_config(struct kr_module *module, const char *conf)
+{
+	struct stale_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	JsonNode *root = json_decode(conf);
+	if (!root || root->tag != JSON_OBJECT) {
+		ERR_MSG("expected a table of settings\n");
+		json_delete(root);
+		return kr_error(EINVAL);
+	}
+	uint32_t timeout = data->timeout, max_stale = data->max_stale, ttl = data->ttl;
+	/* Past KR_RESOLVE_TIME_LIMIT the request fails anyway. */
+	bool ok = worker_config_number("stal", root, "timeout", KR_RESOLVE_TIME_LIMIT, &timeout)
+		&& worker_config_number("stal", root, "max_stale", INT32_MAX, &max_stale)
+		&& worker_config_number("stal", root, "ttl", INT32_MAX, &ttl);
+	JsonNode *refresh = json_find_member(root, "refresh");
+	if (ok && refresh && refresh->tag != JSON_BOOL) {
+		ERR_MSG("invalid 'refresh', expected a boolean\n");
+		ok = false;
+	}
+	if (ok) {
+		data->timeout = timeout;
+		data->max_stale = max_stale;
+		data->ttl = ttl;
+		if (refresh) {
+			data->refresh = refresh->bool_;
+		}
+	}
+	json_delete(root);
+	return ok ? kr_ok() : kr_error(EINVAL);
+}
+
+/** Return the counters of this fork. */
+static char *serve_stale_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct stale_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < STALE_COUNTERS; ++i) {
+		/* strip the "serve_stale." */
+		json_append_member(root, counter_names[i] + 12, json_mknumber(data->counters[i]));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+static char *serve_stale_settings(void *env, struct kr_module *module, const char *args)
+{
+	return config_json(module->data);
+}
+
+KR_EXPORT
+struct kr_prop *serve_stale_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &serve_stale_settings, "settings", "Get the current settings.", },
+	    { &serve_stale_stats,    "stats", "Get the counters of stale records in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(serve_stale);
@@ -1,2 +1,8 @@
-serve_stale_SOURCES := serve_stale.lua
-$(call make_lua_module,serve_stale)
+serve_stale_CFLAGS := -fPIC
+# The counters and the configuration use worker_*() of the daemon, not of libkres;
+# on darwin the undefined symbols aren't accepted by default.
+serve_stale_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
+serve_stale_SOURCES := modules/serve_stale/serve_stale.c
+serve_stale_DEPEND := $(libkres)
+serve_stale_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
+$(call make_c_module,serve_stale)
@@ -0,0 +1,109 @@
+-- Snapshots of the hottest cache entries and of the upstream RTTs, for warm starts.
+-- The work is done in C (see lib/cache/snapshot.c), this only schedules it.
+-- @module snapshot
+-- @field file path of the snapshot
+-- @field interval time between two snapshots
+-- @field entries maximum number of the cache entries in a snapshot
+-- @field slice entries walked per event loop iteration while writing
+local ffi = require('ffi')
+
+ffi.cdef[[
+struct kr_cache_snapshot;
+struct kr_cache_snapshot *kr_cache_snapshot_begin(struct kr_context *, const char *, uint32_t);
+int kr_cache_snapshot_step(struct kr_cache_snapshot *, int);
+void kr_cache_snapshot_abort(struct kr_cache_snapshot *);
+int kr_cache_snapshot_load(struct kr_context *, const char *, bool);
+]]
+
+local snapshot = {
+	file = 'cache.snapshot',
+	interval = 15 * min,
+	entries = 100000,
+	slice = 1000,
+	pending = nil, -- snapshot being written
+	ev_save = nil,
+	ev_step = nil,
+}
+
+-- Walk a slice, and continue on the next loop iteration
+local function step()
+	snapshot.ev_step = nil
+	local ret = ffi.C.kr_cache_snapshot_step(snapshot.pending, snapshot.slice)
+	if ret > 0 then
+		snapshot.ev_step = event.after(0, step)
+		return
+	end
+	snapshot.pending = nil
+	if ret < 0 then
+		warn('[snapshot] failed to write %s: %s', snapshot.file, ffi.string(ffi.C.knot_strerror(ret)))
+	end
+end
+
+-- Start writing a snapshot, unless one is being written
+function snapshot.save()
+	if snapshot.pending then
+		return false
+	end
+	local snap = ffi.C.kr_cache_snapshot_begin(kres.context(), snapshot.file, snapshot.entries)
+	if snap == nil then
+		warn('[snapshot] failed to start writing %s', snapshot.file)
+		return false
+	end
+	snapshot.pending = snap
+	snapshot.ev_step = event.after(0, step)
+	return true
+end
+
+-- Load the snapshot; the entries by the first process only, the cache is shared
+function snapshot.load()
+	local ret = ffi.C.kr_cache_snapshot_load(kres.context(), snapshot.file, worker.id == 0)
+	if ret < 0 then
+		-- A missing file is the usual first start.
+		if ret ~= -2 then -- ENOENT
+			warn('[snapshot] failed to load %s: %s', snapshot.file, ffi.string(ffi.C.knot_strerror(ret)))
+		end
+		return ret
+	end
+	if worker.id == 0 then
+		print(string.format('[snapshot] loaded %d cache entries from %s', ret, snapshot.file))
+	end
+	return ret
+end
+
+local function start()
+	if snapshot.ev_save then
+		event.cancel(snapshot.ev_save)
+		snapshot.ev_save = nil
+	end
+	if worker.id == 0 then
+		snapshot.ev_save = event.recurrent(snapshot.interval, snapshot.save)
+	end
+end
+
+function snapshot.config(conf)
+	if type(conf) == 'table' then
+		for _, k in ipairs({'file', 'interval', 'entries', 'slice'}) do
+			if conf[k] ~= nil then snapshot[k] = conf[k] end
+		end
+	end
+	assert(type(snapshot.file) == 'string', '[snapshot] file must be a path')
+	assert(snapshot.interval > 0 and snapshot.entries > 0 and snapshot.slice > 0,
+		'[snapshot] interval, entries and slice must be positive')
+	start()
+end
+
+function snapshot.init()
+	-- The cache is opened after the configuration, so is the file configured;
+	-- load on the first iteration of the event loop.
+	event.after(0, snapshot.load)
+	start()
+end
+
+function snapshot.deinit()
+	if snapshot.ev_save then event.cancel(snapshot.ev_save) end
+	if snapshot.ev_step then event.cancel(snapshot.ev_step) end
+	if snapshot.pending then ffi.C.kr_cache_snapshot_abort(snapshot.pending) end
+	snapshot.ev_save, snapshot.ev_step, snapshot.pending = nil, nil, nil
+end
+
+return snapshot
@@ -0,0 +1,2 @@
+snapshot_SOURCES := snapshot.lua
+$(call make_lua_module,snapshot)
@@ -27,12 +27,20 @@
 #include <ccan/json/json.h>
 #include <contrib/cleanup.h>
 #include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <uv.h>
 
+#include "lib/generic/lru.h"
+#include "lib/generic/topk.h"
 #include "lib/layer/iterate.h"
 #include "lib/rplan.h"
 #include "lib/module.h"
 #include "lib/layer.h"
 #include "lib/resolve.h"
+#include "daemon/engine.h"
+#include "daemon/tls.h"
+#include "daemon/worker.h"
 
 /** @internal Compatibility wrapper for Lua < 5.2 */
 #if LUA_VERSION_NUM < 502
@@ -41,14 +49,13 @@
 
 /* Defaults */
 #define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "stat",  fmt)
-#define FREQUENT_PSAMPLE  10 /* Sampling rate, 1 in N */
 #ifdef LRU_REP_SIZE
  #define FREQUENT_COUNT LRU_REP_SIZE /* Size of frequent tables */
 #else
  #define FREQUENT_COUNT  5000 /* Size of frequent tables */ 
 #endif
 #ifndef UPSTREAMS_COUNT
- #define UPSTREAMS_COUNT  512 /* Size of recent upstreams */
+ #define UPSTREAMS_COUNT  4096 /* Size of the upstreams table */
 #endif
 
 /** @cond internal Fixed-size map of predefined metrics. */
@@ -75,29 +82,120 @@ static struct const_metric_elm const_metrics[] = {
 };
 /** @endcond */
 
-/** @internal LRU hash of most frequent names. */
-typedef lru_t(unsigned) namehash_t;
-typedef array_t(struct sockaddr_in6) addrlist_t;
+/** @internal Histograms of time spent in resolution phases.
+ * Bucket `b` counts requests that took at most 4^b microseconds,
+ * the last one counts the slower ones. */
+#define PHASE_BUCKETS 12
+struct phase_hist {
+	size_t bucket[PHASE_BUCKETS];
+	size_t sum; /* microseconds */
+};
+static const char *phase_names[KR_PHASE_COUNT] = {
+	[KR_PHASE_CACHE]    = "cache",
+	[KR_PHASE_PRODUCE]  = "produce",
+	[KR_PHASE_CONSUME]  = "consume",
+	[KR_PHASE_CHECKOUT] = "checkout",
+	[KR_PHASE_UPSTREAM] = "upstream",
+	[KR_PHASE_VALIDATE] = "validate",
+	[KR_PHASE_FINALIZE] = "finalize",
+};
+
+/** @internal Histograms with configurable bounds, see stats.histogram(). */
+#define HIST_MAXBUCKETS 16
+enum stat_hist_id {
+	HIST_LATENCY, /* answer latency, milliseconds */
+	HIST_RTT,     /* upstream RTT, milliseconds */
+	HIST_SIZE,    /* answer size, bytes */
+	HIST_COUNT
+};
+static const char *hist_names[HIST_COUNT] = {
+	[HIST_LATENCY] = "latency",
+	[HIST_RTT]     = "rtt",
+	[HIST_SIZE]    = "size",
+};
+/* Names in the Prometheus text format; "latency" is the one built from answer.* before. */
+static const char *hist_prom_names[HIST_COUNT] = {
+	[HIST_LATENCY] = "latency",
+	[HIST_RTT]     = "upstream_rtt",
+	[HIST_SIZE]    = "answer_size",
+};
+static const size_t hist_default_latency[] = { 1, 10, 50, 100, 250, 500, 1000, 1500 };
+static const size_t hist_default_rtt[] = { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2000 };
+static const size_t hist_default_size[] = { 64, 128, 256, 512, 1024, 1232, 1472, 4096 };
+#define UPSTREAM_RTT_BUCKETS (sizeof(hist_default_rtt) / sizeof(hist_default_rtt[0]))
+struct stat_hist {
+	unsigned len;                        /**< Number of bounds */
+	size_t le[HIST_MAXBUCKETS];          /**< Inclusive upper bounds, ascending */
+	size_t bucket[HIST_MAXBUCKETS + 1];  /**< Not cumulative; [len] counts the values above all bounds */
+	size_t sum;
+	int shared[HIST_MAXBUCKETS + 2];     /**< Shared indices of the buckets, then of the sum */
+};
+
+/** Default Prometheus metrics port of stats.listen() */
+#define METRICS_PORT 9145
+/** Longest request to the metrics listener */
+#define METRICS_REQ_MAXLEN 1024
+
+/** @internal Listener of stats.listen(); outlives the module until its connections are closed. */
+struct metrics_server {
+	uv_tcp_t handle;
+	struct kr_module *module; /**< NULL once the module is unloaded */
+	unsigned conns;
+	bool closed;
+};
+struct metrics_conn {
+	uv_tcp_t handle;
+	struct metrics_server *server;
+	uv_write_t write;
+	char head[128];
+	char *body;
+	size_t len;
+	char req[METRICS_REQ_MAXLEN];
+};
+
+/** @internal Counters of an upstream address and port, see stats.upstreams() */
+struct upstream_stat {
+	uint32_t queries;       /**< Answers and timeouts */
+	uint32_t timeouts;
+	uint32_t tcp;           /**< Answers over TCP, including TLS */
+	uint32_t tls;
+	uint32_t tcp_fallback;  /**< Truncated answers over UDP, asked again over TCP */
+	uint32_t rcode[16];
+	uint32_t rtt[UPSTREAM_RTT_BUCKETS + 1]; /**< Not cumulative, by hist_default_rtt */
+	uint64_t rtt_sum;
+};
+typedef lru_t(struct upstream_stat) upstream_lru_t;
+
+/** @internal Entry of upstreams_collect() */
+struct upstream_entry {
+	char addr[INET6_ADDRSTRLEN + 6];
+	const struct upstream_stat *st;
+};
+typedef array_t(struct upstream_entry) upstream_list_t;
 
 /** @internal Stats data structure. */
 struct stat_data {
 	map_t map;
 	struct {
-		namehash_t *frequent;
+		topk_t *frequent; /**< Most frequent {type, name} keys */
 	} queries;
+	upstream_lru_t *upstreams; /**< Aggregated by address, the least recently seen are dropped */
+	struct engine *engine;
+	struct phase_hist phases[KR_PHASE_COUNT];
+	struct stat_hist hists[HIST_COUNT];
+	struct metrics_server *server;
+	/** Indices of the metrics shared with the other forks, see worker_shstats_register(). */
 	struct {
-		addrlist_t q;
-		size_t head;
-	} upstreams;
+		int metrics[metric_const_end];
+		int phases[KR_PHASE_COUNT][PHASE_BUCKETS + 1];
+	} shared;
 };
 
-/** @internal We don't store/publish port, repurpose it for RTT instead. */
-#define sin6_rtt sin6_port
-
 /** @internal Add to const map counter */
 static inline void stat_const_add(struct stat_data *data, enum const_metric key, ssize_t incr)
 {
 	const_metrics[key].val += incr;
+	worker_shstats_set(data->shared.metrics[key], const_metrics[key].val);
 }
 
 static int collect_answer(struct stat_data *data, knot_pkt_t *pkt)
@@ -139,18 +237,140 @@ static void collect_sample(struct stat_data *data, struct kr_rplan *rplan, knot_
 		if (qry->flags.CACHED) {
 			continue;
 		}
-		/* Consider 1 in N for frequent sampling. */
-		if (kr_rand_uint(FREQUENT_PSAMPLE) <= 1) {
-			int key_len = collect_key(key, qry->sname, qry->stype);
-			if (key_len < 0) {
-				assert(false);
-				continue;
-			}
-			unsigned *count = lru_get_new(data->queries.frequent, key, key_len, NULL);
-			if (count)
-				*count += 1;
+		int key_len = collect_key(key, qry->sname, qry->stype);
+		if (key_len < 0) {
+			assert(false);
+			continue;
+		}
+		(void)topk_add(data->queries.frequent, key, key_len, 1, 0);
+	}
+}
+
+/** @internal Record the phase timing of a finished request; phases it didn't enter are skipped. */
+static void collect_phases(struct stat_data *data, const struct kr_request *req)
+{
+	for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+		const uint32_t us = req->phase_us[p];
+		if (us == 0) {
+			continue;
+		}
+		/* ceil(log4(us)) */
+		unsigned b = us <= 1 ? 0 : (65 - __builtin_clzll(us - 1)) / 2;
+		if (b >= PHASE_BUCKETS) {
+			b = PHASE_BUCKETS - 1;
+		}
+		data->phases[p].bucket[b] += 1;
+		data->phases[p].sum += us;
+		worker_shstats_set(data->shared.phases[p][b], data->phases[p].bucket[b]);
+		worker_shstats_set(data->shared.phases[p][PHASE_BUCKETS], data->phases[p].sum);
+	}
+}
+
+/** @internal Name of a histogram metric; bucket len is the one above all bounds, len + 1 the sum. */
+static void hist_key(char *key, size_t len, const struct stat_hist *hist, unsigned id, unsigned bucket)
+{
+	if (bucket == hist->len + 1) {
+		snprintf(key, len, "hist.%s.sum", hist_names[id]);
+	} else if (bucket == hist->len) {
+		snprintf(key, len, "hist.%s.inf", hist_names[id]);
+	} else {
+		snprintf(key, len, "hist.%s.%zu", hist_names[id], hist->le[bucket]);
+	}
+}
+
+/** @internal Set the bounds of a histogram, its counts start from zero. */
+static int hist_set(struct stat_data *data, unsigned id, const size_t *le, unsigned len)
+{
+	if (len == 0 || len > HIST_MAXBUCKETS) {
+		return kr_error(EINVAL);
+	}
+	for (unsigned i = 1; i < len; ++i) {
+		if (le[i] <= le[i - 1]) {
+			return kr_error(EINVAL);
 		}
 	}
+	struct stat_hist *hist = &data->hists[id];
+	memset(hist, 0, sizeof(*hist));
+	memcpy(hist->le, le, len * sizeof(*le));
+	hist->len = len;
+	char key[SHCOUNTERS_NAME_MAXLEN];
+	for (unsigned b = 0; b <= len + 1; ++b) {
+		hist_key(key, sizeof(key), hist, id, b);
+		hist->shared[b] = worker_shstats_register(key);
+		worker_shstats_set(hist->shared[b], 0);
+	}
+	return kr_ok();
+}
+
+static void hist_observe(struct stat_data *data, unsigned id, size_t val)
+{
+	struct stat_hist *hist = &data->hists[id];
+	unsigned b = 0;
+	while (b < hist->len && val > hist->le[b]) {
+		++b;
+	}
+	hist->bucket[b] += 1;
+	hist->sum += val;
+	worker_shstats_set(hist->shared[b], hist->bucket[b]);
+	worker_shstats_set(hist->shared[hist->len + 1], hist->sum);
+}
+
+/** @internal Name of a phase metric; bucket PHASE_BUCKETS means the sum. */
+static void phase_key(char *key, size_t len, unsigned phase, unsigned bucket)
+{
+	if (bucket == PHASE_BUCKETS) {
+		snprintf(key, len, "phase.%s.sum", phase_names[phase]);
+	} else if (bucket == PHASE_BUCKETS - 1) {
+		snprintf(key, len, "phase.%s.slow", phase_names[phase]);
+	} else {
+		snprintf(key, len, "phase.%s.%luus", phase_names[phase], 1UL << (2 * bucket));
+	}
+}
+
+static size_t phase_val(struct stat_data *data, unsigned phase, unsigned bucket)
+{
+	struct phase_hist *hist = &data->phases[phase];
+	return bucket == PHASE_BUCKETS ? hist->sum : hist->bucket[bucket];
+}
+
+static struct upstream_stat *upstream_get(struct stat_data *data, const struct sockaddr *addr)
+{
+	char key[KR_SOCKADDR_KEY_MAXLEN];
+	int len = kr_sockaddr_key(key, addr);
+	if (len < 0) {
+		return NULL;
+	}
+	return lru_get_new(data->upstreams, key, len, NULL);
+}
+
+static enum lru_apply_do upstream_collect(const char *key, uint len,
+					  struct upstream_stat *st, void *baton)
+{
+	upstream_list_t *list = baton;
+	struct sockaddr_storage ss;
+	if (kr_sockaddr_from_key(&ss, key, len) != 0) {
+		return LRU_APPLY_DO_NOTHING;
+	}
+	const struct sockaddr *sa = (const struct sockaddr *)&ss;
+	struct upstream_entry e = { .st = st };
+	if (!inet_ntop(sa->sa_family, kr_inaddr(sa), e.addr, INET6_ADDRSTRLEN)) {
+		return LRU_APPLY_DO_NOTHING;
+	}
+	/* Only the forwarding targets off port 53 get the port appended. */
+	const uint16_t port = kr_inaddr_port(sa);
+	if (port != KR_DNS_PORT) {
+		size_t alen = strlen(e.addr);
+		snprintf(e.addr + alen, sizeof(e.addr) - alen, "#%" PRIu16, port);
+	}
+	array_push(*list, e);
+	return LRU_APPLY_DO_NOTHING;
+}
+
+/** @internal List the upstreams table; the entries point into it, so don't touch it while in use. */
+static void upstreams_collect(struct stat_data *data, upstream_list_t *list)
+{
+	array_init(*list);
+	lru_apply(data->upstreams, upstream_collect, list);
 }
 
 static int collect_rtt(kr_layer_t *ctx, knot_pkt_t *pkt)
@@ -161,27 +381,46 @@ static int collect_rtt(kr_layer_t *ctx, knot_pkt_t *pkt)
 		return ctx->state;
 	}
 
-	/* Push address and RTT to the ring buffer head */
 	struct kr_module *module = ctx->api->data;
 	struct stat_data *data = module->data;
+	const unsigned rtt = req->upstream.rtt;
+	hist_observe(data, HIST_RTT, rtt);
 
-	/* Socket address is encoded into sockaddr_in6 struct that
-	 * unions with sockaddr_in and differ in sa_family */
-	struct sockaddr_in6 *e = &data->upstreams.q.at[data->upstreams.head];
 	const struct sockaddr *src = req->upstream.addr;
-	switch (src->sa_family) {
-	case AF_INET:  memcpy(e, src, sizeof(struct sockaddr_in)); break;
-	case AF_INET6: memcpy(e, src, sizeof(struct sockaddr_in6)); break;
-	default: return ctx->state;
+	struct upstream_stat *st = upstream_get(data, src);
+	if (!st) {
+		return ctx->state;
+	}
+	st->queries += 1;
+	st->rcode[knot_wire_get_rcode(pkt->wire) & 0x0f] += 1;
+	unsigned b = 0;
+	while (b < UPSTREAM_RTT_BUCKETS && rtt > hist_default_rtt[b]) {
+		++b;
+	}
+	st->rtt[b] += 1;
+	st->rtt_sum += rtt;
+	/* The iterator already switched the query to TCP on TC=1. */
+	if (knot_wire_get_tc(pkt->wire)) {
+		st->tcp_fallback += 1;
+	} else if (qry->flags.TCP) {
+		st->tcp += 1;
+		if (tls_client_params_get(data->engine->net.tls_client_params, src)) {
+			st->tls += 1;
+		}
 	}
-	/* Replace port number with the RTT information (cap is UINT16_MAX milliseconds) */
-	e->sin6_rtt = req->upstream.rtt;
-
-	/* Advance ring buffer head */
-	data->upstreams.head = (data->upstreams.head + 1) % UPSTREAMS_COUNT;
 	return ctx->state;
 }
 
+/** @internal Called by the worker for each upstream that timed out, see kr_context::upstream_timeout */
+static void collect_timeout(const struct kr_request *req, const struct sockaddr *addr, void *baton)
+{
+	struct upstream_stat *st = upstream_get(baton, addr);
+	if (st) {
+		st->queries += 1;
+		st->timeouts += 1;
+	}
+}
+
 static int collect(kr_layer_t *ctx)
 {
 	struct kr_request *param = ctx->req;
@@ -192,11 +431,14 @@ static int collect(kr_layer_t *ctx)
 	/* Collect data on final answer */
 	collect_answer(data, param->answer);
 	collect_sample(data, rplan, param->answer);
+	collect_phases(data, param);
+	hist_observe(data, HIST_SIZE, param->answer->size);
 	/* Count cached and unresolved */
 	if (rplan->resolved.len > 0) {
 		/* Histogram of answer latency. */
 		struct kr_query *first = rplan->resolved.at[0];
 		uint64_t elapsed = kr_now() - first->timestamp_mono;
+		hist_observe(data, HIST_LATENCY, elapsed);
 		if (elapsed <= 1) {
 			stat_const_add(data, metric_answer_1ms, 1);
 		} else if (elapsed <= 10) {
@@ -249,6 +491,7 @@ static char* stats_set(void *env, struct kr_module *module, const char *args)
 		for (unsigned i = 0; i < metric_const_end; ++i) {
 			if (strcmp(const_metrics[i].key, pair) == 0) {
 				const_metrics[i].val = number;
+				worker_shstats_set(data->shared.metrics[i], number);
 				return NULL;
 			}
 		}
@@ -281,6 +524,19 @@ static char* stats_get(void *env, struct kr_module *module, const char *args)
 			return ret;
 		}
 	}
+	/* Check phase histograms */
+	if (strncmp(args, "phase.", 6) == 0) {
+		char key[32];
+		for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+			for (unsigned b = 0; b <= PHASE_BUCKETS; ++b) {
+				phase_key(key, sizeof(key), p, b);
+				if (strcmp(key, args) == 0) {
+					sprintf(ret, "%zu", phase_val(data, p, b));
+					return ret;
+				}
+			}
+		}
+	}
 	/* Check in variable map */
 	if (!map_contains(&data->map, args)) {
 		free(ret);
@@ -316,14 +572,24 @@ static char* stats_list(void *env, struct kr_module *module, const char *args)
 			json_append_member(root, elm->key, json_mknumber(elm->val));
 		}
 	}
+	/* Walk phase histograms */
+	char key[32];
+	for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+		for (unsigned b = 0; b <= PHASE_BUCKETS; ++b) {
+			phase_key(key, sizeof(key), p, b);
+			if (!args || strncmp(key, args, args_len) == 0) {
+				json_append_member(root, key, json_mknumber(phase_val(data, p, b)));
+			}
+		}
+	}
 	map_walk_prefixed(&data->map, (args_len > 0) ? args : "", list_entry, root);
 	char *ret = json_encode(root);
 	json_delete(root);
 	return ret;
 }
 
-/** @internal Helper for dump_list: add a single namehash_t item to JSON. */
-static enum lru_apply_do dump_value(const char *key, uint len, unsigned *val, void *baton)
+/** @internal Helper for dump_list: add a single frequent item to JSON. */
+static int dump_value(const void *key, uint32_t len, uint64_t count, uint64_t error, void *baton)
 {
 	uint16_t key_type = 0;
 	char key_name[KNOT_DNAME_MAXLEN], type_str[16];
@@ -333,24 +599,26 @@ static enum lru_apply_do dump_value(const char *key, uint len, unsigned *val, vo
 	knot_rrtype_to_string(key_type, type_str, sizeof(type_str));
 	/* Convert to JSON object */
 	JsonNode *json_val = json_mkobject();
-	json_append_member(json_val, "count", json_mknumber(*val));
+	json_append_member(json_val, "count", json_mknumber(count));
+	json_append_member(json_val, "error", json_mknumber(error));
 	json_append_member(json_val, "name",  json_mkstring(key_name));
 	json_append_member(json_val, "type",  json_mkstring(type_str));
 	json_append_element((JsonNode *)baton, json_val);
-	return LRU_APPLY_DO_NOTHING; // keep the item
+	return 0;
 }
 /**
- * List frequent names.
+ * List frequent names, from the most frequent.
+ * The real count is between count - error and count.
  *
- * Output: [{ count: <counter>, name: <qname>, type: <qtype>}, ... ]
+ * Output: [{ count: <counter>, error: <overestimation>, name: <qname>, type: <qtype>}, ... ]
  */
-static char* dump_list(void *env, struct kr_module *module, const char *args, namehash_t *table)
+static char* dump_list(void *env, struct kr_module *module, const char *args, topk_t *table)
 {
 	if (!table) {
 		return NULL;
 	}
 	JsonNode *root = json_mkarray();
-	lru_apply(table, dump_value, root);
+	topk_walk(table, dump_value, root);
 	char *ret = json_encode(root);
 	json_delete(root);
 	return ret;
@@ -365,10 +633,86 @@ static char* dump_frequent(void *env, struct kr_module *module, const char *args
 static char* clear_frequent(void *env, struct kr_module *module, const char *args)
 {
 	struct stat_data *data = module->data;
-	lru_reset(data->queries.frequent);
+	topk_clear(data->queries.frequent);
 	return NULL;
 }
 
+/** @internal Add one list of stats.frequent() output to the summary. */
+static int merge_list(topk_t *table, JsonNode *list)
+{
+	char key[sizeof(uint16_t) + KNOT_DNAME_MAXLEN];
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	JsonNode *item = NULL;
+	json_foreach(item, list) {
+		JsonNode *name_node = json_find_member(item, "name");
+		JsonNode *type_node = json_find_member(item, "type");
+		JsonNode *count_node = json_find_member(item, "count");
+		JsonNode *error_node = json_find_member(item, "error");
+		if (!name_node || name_node->tag != JSON_STRING
+		    || !type_node || type_node->tag != JSON_STRING
+		    || !count_node || count_node->tag != JSON_NUMBER || count_node->number_ < 0) {
+			return kr_error(EINVAL);
+		}
+		uint16_t type = 0;
+		if (!knot_dname_from_str(name, name_node->string_, sizeof(name))
+		    || knot_rrtype_from_string(type_node->string_, &type) != 0) {
+			return kr_error(EINVAL);
+		}
+		int key_len = collect_key(key, name, type);
+		if (key_len < 0) {
+			return key_len;
+		}
+		uint64_t error = 0;
+		if (error_node && error_node->tag == JSON_NUMBER && error_node->number_ > 0) {
+			error = error_node->number_;
+		}
+		int ret = topk_add(table, key, key_len, count_node->number_, error);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return kr_ok();
+}
+
+/**
+ * Merge lists of frequent names, e.g. those of all forks:
+ * stats.frequent_merge(map 'stats.frequent()')
+ *
+ * Input: [ [{ count, error, name, type }, ...], ... ]
+ * Output: the same as stats.frequent(), the errors of the lists add up.
+ */
+static char* merge_frequent(void *env, struct kr_module *module, const char *args)
+{
+	JsonNode *root = args ? json_decode(args) : NULL;
+	if (!root || root->tag != JSON_ARRAY) {
+		json_delete(root);
+		return NULL;
+	}
+	topk_t *table = topk_create(FREQUENT_COUNT, sizeof(uint16_t) + KNOT_DNAME_MAXLEN);
+	char *ret = NULL;
+	if (table) {
+		JsonNode *list = NULL;
+		int err = 0;
+		json_foreach(list, root) {
+			if (list->tag != JSON_ARRAY || (err = merge_list(table, list)) != 0) {
+				break;
+			}
+		}
+		if (err == 0 && !list) {
+			ret = dump_list(env, module, args, table);
+		}
+		topk_free(table);
+	}
+	json_delete(root);
+	return ret;
+}
+
+/**
+ * List the counters of the upstreams.
+ *
+ * Output: { addr: { queries, timeouts, tcp, tls, tcp_fallback,
+ *                   rcode: { name: count, ... }, rtt: { le: count, ..., "+Inf": count }, rtt_sum } }
+ */
 static char* dump_upstreams(void *env, struct kr_module *module, const char *args)
 {
 	struct stat_data *data = module->data;
@@ -376,29 +720,46 @@ static char* dump_upstreams(void *env, struct kr_module *module, const char *arg
 		return NULL;
 	}
 
-	/* Walk the ring backwards until AF_UNSPEC or we hit head. */
+	upstream_list_t list;
+	upstreams_collect(data, &list);
 	JsonNode *root = json_mkobject();
-	size_t head = data->upstreams.head;
-	for (size_t i = 1; i < UPSTREAMS_COUNT; ++i) {
-		size_t h = (UPSTREAMS_COUNT + head - i) % UPSTREAMS_COUNT;
-		struct sockaddr_in6 *e = &data->upstreams.q.at[h];
-		if (e->sin6_family == AF_UNSPEC) {
-			break;
-		}
-		/* Convert address to string */
-		char addr_str[INET6_ADDRSTRLEN];
-		const char *ret = inet_ntop(e->sin6_family, kr_inaddr((const struct sockaddr *)e), addr_str, sizeof(addr_str));
-		if (!ret) {
-			break;
+	char key[32];
+	for (size_t i = 0; i < list.len; ++i) {
+		const struct upstream_stat *st = list.at[i].st;
+		JsonNode *val = json_mkobject();
+		json_append_member(val, "queries", json_mknumber(st->queries));
+		json_append_member(val, "timeouts", json_mknumber(st->timeouts));
+		json_append_member(val, "tcp", json_mknumber(st->tcp));
+		json_append_member(val, "tls", json_mknumber(st->tls));
+		json_append_member(val, "tcp_fallback", json_mknumber(st->tcp_fallback));
+		JsonNode *rcodes = json_mkobject();
+		for (unsigned r = 0; r < 16; ++r) {
+			if (st->rcode[r] == 0) {
+				continue;
+			}
+			const knot_lookup_t *name = knot_lookup_by_id(knot_rcode_names, r);
+			if (name) {
+				json_append_member(rcodes, name->name, json_mknumber(st->rcode[r]));
+			} else {
+				snprintf(key, sizeof(key), "RCODE%u", r);
+				json_append_member(rcodes, key, json_mknumber(st->rcode[r]));
+			}
 		}
-		/* Append to map with an array encoding RTTs */
-		JsonNode *json_val = json_find_member(root, addr_str);
-		if (!json_val) {
-			json_val = json_mkarray();
-			json_append_member(root, addr_str, json_val);
+		json_append_member(val, "rcode", rcodes);
+		JsonNode *rtt = json_mkobject();
+		for (unsigned b = 0; b <= UPSTREAM_RTT_BUCKETS; ++b) {
+			if (b < UPSTREAM_RTT_BUCKETS) {
+				snprintf(key, sizeof(key), "%zu", hist_default_rtt[b]);
+			} else {
+				strcpy(key, "+Inf");
+			}
+			json_append_member(rtt, key, json_mknumber(st->rtt[b]));
 		}
-		json_append_element(json_val, json_mknumber(e->sin6_rtt));
+		json_append_member(val, "rtt", rtt);
+		json_append_member(val, "rtt_sum", json_mknumber(st->rtt_sum));
+		json_append_member(root, list.at[i].addr, val);
 	}
+	array_clear(list);
 
 	/* Encode and return */
 	char *ret = json_encode(root);
@@ -406,6 +767,447 @@ static char* dump_upstreams(void *env, struct kr_module *module, const char *arg
 	return ret;
 }
 
+/**
+ * Get or set the bounds of histograms.
+ *
+ * Input:  { name: [bound, ...], ... } or nothing
+ * Output: { name: [bound, ...], ... } of all the histograms
+ */
+static char* stats_histogram(void *env, struct kr_module *module, const char *args)
+{
+	struct stat_data *data = module->data;
+	if (args && strlen(args) > 0) {
+		JsonNode *root_node = json_decode(args);
+		JsonNode *node;
+		if (!root_node || root_node->tag != JSON_OBJECT) {
+			kr_log_error("[stat] expected a table of histogram bounds\n");
+			json_delete(root_node);
+			return NULL;
+		}
+		json_foreach(node, root_node) {
+			unsigned id = 0;
+			while (id < HIST_COUNT && (!node->key || strcmp(node->key, hist_names[id]) != 0)) {
+				++id;
+			}
+			size_t le[HIST_MAXBUCKETS];
+			unsigned len = 0;
+			JsonNode *bound;
+			json_foreach(bound, node) {
+				if (bound->tag != JSON_NUMBER || bound->number_ < 0 || len == HIST_MAXBUCKETS) {
+					len = 0;
+					break;
+				}
+				le[len++] = bound->number_;
+			}
+			if (id == HIST_COUNT || node->tag != JSON_ARRAY || hist_set(data, id, le, len) != 0) {
+				kr_log_error("[stat] invalid histogram '%s', expected"
+					     " up to %d ascending bounds\n",
+					     node->key ? node->key : "", HIST_MAXBUCKETS);
+			}
+		}
+		json_delete(root_node);
+	}
+	JsonNode *root = json_mkobject();
+	for (unsigned id = 0; id < HIST_COUNT; ++id) {
+		JsonNode *bounds = json_mkarray();
+		for (unsigned b = 0; b < data->hists[id].len; ++b) {
+			json_append_element(bounds, json_mknumber(data->hists[id].le[b]));
+		}
+		json_append_member(root, hist_names[id], bounds);
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+/** @internal Add a value to the sum of the metric. */
+static void sum_add(trie_t *sums, const char *key, size_t val)
+{
+	trie_val_t *sum = trie_get_ins(sums, key, strlen(key) + 1);
+	if (sum) {
+		*sum = (void *)((uintptr_t)*sum + val);
+	}
+}
+
+static size_t sum_get(trie_t *sums, const char *key)
+{
+	trie_val_t *sum = trie_get_try(sums, key, strlen(key) + 1);
+	return sum ? (uintptr_t)*sum : 0;
+}
+
+/** @internal Sums of the fixed metrics just of this fork, in case they aren't shared. */
+static trie_t *local_sums(struct stat_data *data)
+{
+	trie_t *sums = trie_create(NULL);
+	if (!sums) {
+		return NULL;
+	}
+	char key[SHCOUNTERS_NAME_MAXLEN];
+	for (unsigned i = 0; i < metric_const_end; ++i) {
+		sum_add(sums, const_metrics[i].key, const_metrics[i].val);
+	}
+	for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+		for (unsigned b = 0; b <= PHASE_BUCKETS; ++b) {
+			phase_key(key, sizeof(key), p, b);
+			sum_add(sums, key, phase_val(data, p, b));
+		}
+	}
+	for (unsigned id = 0; id < HIST_COUNT; ++id) {
+		struct stat_hist *hist = &data->hists[id];
+		for (unsigned b = 0; b <= hist->len + 1; ++b) {
+			hist_key(key, sizeof(key), hist, id, b);
+			sum_add(sums, key, b <= hist->len ? hist->bucket[b] : hist->sum);
+		}
+	}
+	return sums;
+}
+
+/** @internal Whether the metric isn't a counter, see prometheus.lua. */
+static bool metric_is_gauge(const char *key)
+{
+	static const char *gauges[] = {
+		"worker.concurrent", "worker.rss", "worker.pool_mp_target_bytes", "worker.tcp_in_conns",
+		"cache.usage_percent", "cache.l1_size",
+	};
+	for (unsigned i = 0; i < sizeof(gauges) / sizeof(gauges[0]); ++i) {
+		if (strcmp(key, gauges[i]) == 0) {
+			return true;
+		}
+	}
+	return strncmp(key, "worker.mem_", strlen("worker.mem_")) == 0;
+}
+
+/** @internal Whether the metric is exported as a part of a histogram. */
+static bool metric_in_hist(const char *key)
+{
+	if (strncmp(key, "phase.", 6) == 0 || strncmp(key, "hist.", 5) == 0) {
+		return true;
+	}
+	/* The fixed latency buckets, superseded by the latency histogram. */
+	for (unsigned i = metric_answer_1ms; i <= metric_answer_slow; ++i) {
+		if (strcmp(key, const_metrics[i].key) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void print_hist(FILE *out, trie_t *sums, const struct stat_hist *hist, unsigned id)
+{
+	const char *name = hist_prom_names[id];
+	char key[SHCOUNTERS_NAME_MAXLEN];
+	size_t count = 0;
+	fprintf(out, "# TYPE %s histogram\n", name);
+	for (unsigned b = 0; b <= hist->len; ++b) {
+		hist_key(key, sizeof(key), hist, id, b);
+		count += sum_get(sums, key);
+		if (b < hist->len) {
+			fprintf(out, "%s_bucket{le=\"%zu\"} %zu\n", name, hist->le[b], count);
+		} else {
+			fprintf(out, "%s_bucket{le=\"+Inf\"} %zu\n", name, count);
+		}
+	}
+	hist_key(key, sizeof(key), hist, id, hist->len + 1);
+	fprintf(out, "%s_count %zu\n%s_sum %zu\n", name, count, name, sum_get(sums, key));
+}
+
+static void print_phases(FILE *out, trie_t *sums)
+{
+	char key[SHCOUNTERS_NAME_MAXLEN];
+	fprintf(out, "# TYPE phase_latency histogram\n");
+	for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+		size_t count = 0;
+		for (unsigned b = 0; b < PHASE_BUCKETS; ++b) {
+			phase_key(key, sizeof(key), p, b);
+			count += sum_get(sums, key);
+			if (b < PHASE_BUCKETS - 1) {
+				fprintf(out, "phase_latency_bucket{phase=\"%s\",le=\"%lu\"} %zu\n",
+					phase_names[p], 1UL << (2 * b), count);
+			} else {
+				fprintf(out, "phase_latency_bucket{phase=\"%s\",le=\"+Inf\"} %zu\n",
+					phase_names[p], count);
+			}
+		}
+		phase_key(key, sizeof(key), p, PHASE_BUCKETS);
+		fprintf(out, "phase_latency_count{phase=\"%s\"} %zu\n", phase_names[p], count);
+		fprintf(out, "phase_latency_sum{phase=\"%s\"} %zu\n", phase_names[p], sum_get(sums, key));
+	}
+}
+
+static void print_upstreams(FILE *out, struct stat_data *data)
+{
+	upstream_list_t list;
+	upstreams_collect(data, &list);
+	static const struct {
+		const char *name;
+		size_t offset;
+	} counters[] = {
+		{ "upstream_queries", offsetof(struct upstream_stat, queries) },
+		{ "upstream_timeouts", offsetof(struct upstream_stat, timeouts) },
+		{ "upstream_tcp", offsetof(struct upstream_stat, tcp) },
+		{ "upstream_tls", offsetof(struct upstream_stat, tls) },
+		{ "upstream_tcp_fallback", offsetof(struct upstream_stat, tcp_fallback) },
+	};
+	for (unsigned c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+		fprintf(out, "# TYPE %s counter\n", counters[c].name);
+		for (size_t i = 0; i < list.len; ++i) {
+			const uint32_t *val = (const uint32_t *)
+				((const char *)list.at[i].st + counters[c].offset);
+			fprintf(out, "%s{upstream=\"%s\"} %" PRIu32 "\n",
+				counters[c].name, list.at[i].addr, *val);
+		}
+	}
+	fprintf(out, "# TYPE upstream_rcode counter\n");
+	for (size_t i = 0; i < list.len; ++i) {
+		const struct upstream_stat *st = list.at[i].st;
+		for (unsigned r = 0; r < 16; ++r) {
+			if (st->rcode[r] > 0) {
+				fprintf(out, "upstream_rcode{upstream=\"%s\",rcode=\"%u\"} %" PRIu32 "\n",
+					list.at[i].addr, r, st->rcode[r]);
+			}
+		}
+	}
+	fprintf(out, "# TYPE upstream_addr_rtt histogram\n");
+	for (size_t i = 0; i < list.len; ++i) {
+		const struct upstream_stat *st = list.at[i].st;
+		const char *addr = list.at[i].addr;
+		uint64_t count = 0;
+		for (unsigned b = 0; b < UPSTREAM_RTT_BUCKETS; ++b) {
+			count += st->rtt[b];
+			fprintf(out, "upstream_addr_rtt_bucket{upstream=\"%s\",le=\"%zu\"} %" PRIu64 "\n",
+				addr, hist_default_rtt[b], count);
+		}
+		count += st->rtt[UPSTREAM_RTT_BUCKETS];
+		fprintf(out, "upstream_addr_rtt_bucket{upstream=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+			addr, count);
+		fprintf(out, "upstream_addr_rtt_count{upstream=\"%s\"} %" PRIu64 "\n", addr, count);
+		fprintf(out, "upstream_addr_rtt_sum{upstream=\"%s\"} %" PRIu64 "\n", addr, st->rtt_sum);
+	}
+	array_clear(list);
+}
+
+/**
+ * Render the metrics of all forks in the Prometheus text format.
+ *
+ * Output: text (not JSON)
+ */
+static char* stats_prometheus(void *env, struct kr_module *module, const char *args)
+{
+	struct stat_data *data = module->data;
+	trie_t *sums = worker_shstats_sum();
+	if (!sums) {
+		sums = local_sums(data);
+		if (!sums) {
+			return NULL;
+		}
+	}
+	char *ret = NULL;
+	size_t ret_len = 0;
+	FILE *out = open_memstream(&ret, &ret_len);
+	if (!out) {
+		trie_free(sums);
+		return NULL;
+	}
+	/* Counters and gauges, "a.b" renamed to "a_b" */
+	char name[SHCOUNTERS_NAME_MAXLEN];
+	trie_it_t *it;
+	for (it = trie_it_begin(sums); it && !trie_it_finished(it); trie_it_next(it)) {
+		const char *key = trie_it_key(it, NULL);
+		if (metric_in_hist(key)) {
+			continue;
+		}
+		unsigned i = 0;
+		for (; key[i] && i < sizeof(name) - 1; ++i) {
+			name[i] = key[i] == '.' ? '_' : key[i];
+		}
+		name[i] = '\0';
+		fprintf(out, "# TYPE %s %s\n%s %" PRIuPTR "\n", name,
+			metric_is_gauge(key) ? "gauge" : "counter", name,
+			(uintptr_t)*trie_it_val(it));
+	}
+	trie_it_free(it);
+	for (unsigned id = 0; id < HIST_COUNT; ++id) {
+		print_hist(out, sums, &data->hists[id], id);
+	}
+	print_phases(out, sums);
+	print_upstreams(out, data);
+	trie_free(sums);
+	if (fclose(out) != 0) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/*
+ * Metrics listener, a minimal HTTP/1.0 server for the scrapers.
+ */
+
+static void metrics_server_put(struct metrics_server *server)
+{
+	if (server->closed && server->conns == 0) {
+		free(server);
+	}
+}
+
+static void on_metrics_server_close(uv_handle_t *handle)
+{
+	struct metrics_server *server = handle->data;
+	server->closed = true;
+	metrics_server_put(server);
+}
+
+static void on_metrics_conn_close(uv_handle_t *handle)
+{
+	struct metrics_conn *conn = handle->data;
+	struct metrics_server *server = conn->server;
+	free(conn->body);
+	free(conn);
+	server->conns -= 1;
+	metrics_server_put(server);
+}
+
+static void on_metrics_write(uv_write_t *req, int status)
+{
+	struct metrics_conn *conn = req->data;
+	uv_close((uv_handle_t *)&conn->handle, on_metrics_conn_close);
+}
+
+static void metrics_respond(struct metrics_conn *conn)
+{
+	struct kr_module *module = conn->server->module;
+	const char *path = "GET /metrics";
+	const size_t path_len = strlen(path);
+	const char *status;
+	if (!strstr(conn->req, "\r\n\r\n") && !strstr(conn->req, "\n\n")) {
+		status = "400 Bad Request";
+	} else if (!module) {
+		status = "503 Service Unavailable";
+	} else if (strncmp(conn->req, path, path_len) != 0 ||
+		   !strchr(" ?", conn->req[path_len])) {
+		status = "404 Not Found";
+	} else {
+		conn->body = stats_prometheus(NULL, module, NULL);
+		status = conn->body ? "200 OK" : "500 Internal Server Error";
+	}
+	const size_t body_len = conn->body ? strlen(conn->body) : 0;
+	int head_len = snprintf(conn->head, sizeof(conn->head),
+				"HTTP/1.0 %s\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n\r\n", status, body_len);
+	uv_buf_t bufs[2] = {
+		uv_buf_init(conn->head, head_len),
+		uv_buf_init(conn->body, body_len),
+	};
+	conn->write.data = conn;
+	if (uv_write(&conn->write, (uv_stream_t *)&conn->handle, bufs, body_len ? 2 : 1,
+		     on_metrics_write) != 0) {
+		uv_close((uv_handle_t *)&conn->handle, on_metrics_conn_close);
+	}
+}
+
+static void on_metrics_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf)
+{
+	struct metrics_conn *conn = handle->data;
+	/* Keep a byte for the terminating zero. */
+	*buf = uv_buf_init(conn->req + conn->len, sizeof(conn->req) - 1 - conn->len);
+}
+
+static void on_metrics_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	struct metrics_conn *conn = stream->data;
+	if (nread < 0) {
+		uv_close((uv_handle_t *)stream, on_metrics_conn_close);
+		return;
+	}
+	conn->len += nread;
+	conn->req[conn->len] = '\0';
+	/* Answer when the headers are complete, or when they don't fit. */
+	if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n") ||
+	    conn->len == sizeof(conn->req) - 1) {
+		uv_read_stop(stream);
+		metrics_respond(conn);
+	}
+}
+
+static void on_metrics_connection(uv_stream_t *handle, int status)
+{
+	struct metrics_server *server = handle->data;
+	if (status != 0) {
+		return;
+	}
+	struct metrics_conn *conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		return;
+	}
+	conn->server = server;
+	conn->handle.data = conn;
+	server->conns += 1;
+	uv_tcp_init(handle->loop, &conn->handle);
+	if (uv_accept(handle, (uv_stream_t *)&conn->handle) != 0 ||
+	    uv_read_start((uv_stream_t *)&conn->handle, on_metrics_alloc, on_metrics_read) != 0) {
+		uv_close((uv_handle_t *)&conn->handle, on_metrics_conn_close);
+	}
+}
+
+static void metrics_close(struct stat_data *data)
+{
+	if (data->server) {
+		data->server->module = NULL;
+		uv_close((uv_handle_t *)&data->server->handle, on_metrics_server_close);
+		data->server = NULL;
+	}
+}
+
+/**
+ * Serve stats.prometheus() over HTTP, replacing the previous listener.
+ *
+ * Input:  "addr[@port]"
+ * Output: { result: bool }
+ */
+static char* stats_listen(void *env, struct kr_module *module, const char *args)
+{
+	struct stat_data *data = module->data;
+	char addr[INET6_ADDRSTRLEN];
+	uint16_t port = 0;
+	bool ok = false;
+	if (!args || kr_straddr_split(args, addr, sizeof(addr), &port) != 0) {
+		kr_log_error("[stat] invalid listen address '%s'\n", args ? args : "");
+		goto finish;
+	}
+	struct sockaddr *sa = kr_straddr_socket(addr, port ? port : METRICS_PORT);
+	struct metrics_server *server = calloc(1, sizeof(*server));
+	if (!sa || !server) {
+		free(sa);
+		free(server);
+		goto finish;
+	}
+	server->module = module;
+	server->handle.data = server;
+	uv_tcp_init(uv_default_loop(), &server->handle);
+	int ret = uv_tcp_bind(&server->handle, sa, 0);
+	if (ret == 0) {
+		ret = uv_listen((uv_stream_t *)&server->handle, 16, on_metrics_connection);
+	}
+	free(sa);
+	if (ret != 0) {
+		kr_log_error("[stat] can't listen on '%s': %s\n", args, uv_strerror(ret));
+		server->module = NULL;
+		uv_close((uv_handle_t *)&server->handle, on_metrics_server_close);
+		goto finish;
+	}
+	metrics_close(data);
+	data->server = server;
+	ok = true;
+finish:;
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "result", json_mkbool(ok));
+	char *result = json_encode(root);
+	json_delete(root);
+	return result;
+}
+
 /*
  * Module implementation.
  */
@@ -431,17 +1233,38 @@ int stats_init(struct kr_module *module)
 	}
 	memset(data, 0, sizeof(*data));
 	data->map = map_make(NULL);
+	data->engine = module->data;
 	module->data = data;
-	lru_create(&data->queries.frequent, FREQUENT_COUNT, NULL, NULL);
-	/* Initialize ring buffer of recently visited upstreams */
-	array_init(data->upstreams.q);
-	if (array_reserve(data->upstreams.q, UPSTREAMS_COUNT) != 0) {
+	data->queries.frequent = topk_create(FREQUENT_COUNT, sizeof(uint16_t) + KNOT_DNAME_MAXLEN);
+	if (!data->queries.frequent) {
+		return kr_error(ENOMEM);
+	}
+	lru_create(&data->upstreams, UPSTREAMS_COUNT, NULL, NULL);
+	if (!data->upstreams) {
 		return kr_error(ENOMEM);
 	}
-	for (size_t i = 0; i < UPSTREAMS_COUNT; ++i) {
-		struct sockaddr *sa = (struct sockaddr *)&data->upstreams.q.at[i];
-		sa->sa_family = AF_UNSPEC;
+	/* The timeouts don't pass through the layers. */
+	data->engine->resolver.upstream_timeout = collect_timeout;
+	data->engine->resolver.upstream_timeout_baton = data;
+	/* Share the fixed metrics, so that reading them from all forks needs no IPC.
+	 * The variable ones are only available per fork. */
+	for (unsigned i = 0; i < metric_const_end; ++i) {
+		data->shared.metrics[i] = worker_shstats_register(const_metrics[i].key);
+		worker_shstats_set(data->shared.metrics[i], const_metrics[i].val);
+	}
+	char key[32];
+	for (unsigned p = 0; p < KR_PHASE_COUNT; ++p) {
+		for (unsigned b = 0; b <= PHASE_BUCKETS; ++b) {
+			phase_key(key, sizeof(key), p, b);
+			data->shared.phases[p][b] = worker_shstats_register(key);
+		}
 	}
+	hist_set(data, HIST_LATENCY, hist_default_latency,
+		 sizeof(hist_default_latency) / sizeof(hist_default_latency[0]));
+	hist_set(data, HIST_RTT, hist_default_rtt,
+		 sizeof(hist_default_rtt) / sizeof(hist_default_rtt[0]));
+	hist_set(data, HIST_SIZE, hist_default_size,
+		 sizeof(hist_default_size) / sizeof(hist_default_size[0]));
 	return kr_ok();
 }
 
@@ -450,9 +1273,14 @@ int stats_deinit(struct kr_module *module)
 {
 	struct stat_data *data = module->data;
 	if (data) {
+		metrics_close(data);
 		map_clear(&data->map);
-		lru_free(data->queries.frequent);
-		array_clear(data->upstreams.q);
+		topk_free(data->queries.frequent);
+		if (data->engine->resolver.upstream_timeout_baton == data) {
+			data->engine->resolver.upstream_timeout = NULL;
+			data->engine->resolver.upstream_timeout_baton = NULL;
+		}
+		lru_free(data->upstreams);
 		free(data);
 	}
 	return kr_ok();
@@ -467,7 +1295,11 @@ struct kr_prop *stats_props(void)
 	    { &stats_list,    "list", "List observed metrics.", },
 	    { &dump_frequent, "frequent", "List most frequent queries.", },
 	    { &clear_frequent,"clear_frequent", "Clear frequent queries log.", },
-	    { &dump_upstreams,  "upstreams", "List recently seen authoritatives.", },
+	    { &merge_frequent,"frequent_merge", "Merge lists of frequent queries, e.g. of all forks.", },
+	    { &dump_upstreams,  "upstreams", "List counters of the upstreams.", },
+	    { &stats_histogram, "histogram", "Get/set bounds of histograms.", },
+	    { &stats_prometheus, "prometheus", "Render metrics of all forks for Prometheus.", },
+	    { &stats_listen,  "listen", "Serve Prometheus metrics on addr[@port].", },
 	    { NULL, NULL, NULL }
 	};
 	return prop_list;
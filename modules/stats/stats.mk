@@ -1,5 +1,8 @@
 stats_CFLAGS := -fPIC
+# We use a symbol that's not in libkres but the daemon.
+# On darwin this isn't accepted by default.
+stats_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
 stats_SOURCES := modules/stats/stats.c
 stats_DEPEND := $(libkres)
-stats_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
+stats_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS) $(libuv_LIBS)
 $(call make_c_module,stats)
@@ -1,5 +1,8 @@
 local M = {}
-M.layer = {}
+M.layer = {
+	skip_hits = true, -- only answers with AD set are of interest
+	interest = { finish = { 'done' } },
+}
 
 function M.layer.finish(state, req, pkt)
 	local kreq = kres.request_t(req)
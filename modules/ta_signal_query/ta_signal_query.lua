@@ -3,7 +3,10 @@
 local kres = require('kres')
 
 local M = {}
-M.layer = {}
+M.layer = {
+	skip_hits = true, -- only DNSKEY answers from upstream are of interest
+	interest = { consume = { 'upstream' } },
+}
 
 -- transform trust anchor keyset structure for one domain name (in wire format)
 -- to signalling query name like _ta-keytag1-keytag2.example.com.
@@ -9,6 +9,14 @@ local view = {
 	dst = {},
 }
 
+-- Subnets of view.src and view.dst, matched at once; the ids are the list positions
+local function subnets_create()
+	local sn = C.kr_subnets_create()
+	assert(sn ~= nil, 'not enough memory')
+	return ffi.gc(sn, C.kr_subnets_free)
+end
+local subnets = {[view.src] = subnets_create(), [view.dst] = subnets_create()}
+
 -- @function View based on TSIG key name.
 function view.tsig(_, tsig, rules)
 	view.key[tsig] = rules
@@ -20,7 +28,12 @@ function view.addr(_, subnet, rules, dst)
 	local family = C.kr_straddr_family(subnet)
 	local bitlen = C.kr_straddr_subnet(subnet_cd, subnet)
 	local t = {family, subnet_cd, bitlen, rules}
-	table.insert(dst and view.dst or view.src, t)
+	local list = dst and view.dst or view.src
+	table.insert(list, t)
+	if C.kr_subnets_add(subnets[list], subnet, #list) ~= 0 then
+		table.remove(list)
+		error(string.format('[view] invalid subnet "%s"', subnet))
+	end
 	return t
 end
 
@@ -29,6 +42,15 @@ local function match_subnet(family, subnet, bitlen, addr)
 	return (family == addr:family()) and (C.kr_bitcmp(subnet, addr:ip(), bitlen) == 0)
 end
 
+-- @function Find the first rule of the list with subnet containing the address
+local match_id = ffi.new('uint32_t[1]')
+local function match_subnets(list, addr)
+	if #list > 0 and C.kr_subnets_match(subnets[list], addr, match_id) == 0 then
+		return list[match_id[0]][4]
+	end
+	return nil
+end
+
 -- @function Find view for given request
 local function evaluate(_, req)
 	local client_key = req.qsource.key
@@ -36,21 +58,9 @@ local function evaluate(_, req)
 	-- Search subnets otherwise
 	if match_cb == nil then
 		if req.qsource.addr ~= nil then
-			for i = 1, #view.src do
-				local pair = view.src[i]
-				if match_subnet(pair[1], pair[2], pair[3], req.qsource.addr) then
-					match_cb = pair[4]
-					break
-				end
-			end
+			match_cb = match_subnets(view.src, req.qsource.addr)
 		elseif req.qsource.dst_addr ~= nil then
-			for i = 1, #view.dst do
-				local pair = view.dst[i]
-				if match_subnet(pair[1], pair[2], pair[3], req.qsource.dst_addr) then
-					match_cb = pair[4]
-					break
-				end
-			end
+			match_cb = match_subnets(view.dst, req.qsource.dst_addr)
 		end
 	end
 	return match_cb
@@ -48,6 +48,7 @@ M.layer = {
 
 		return state
 	end,
+	interest = { produce = { 'live' } },
 }
 
 return M
@@ -0,0 +1,488 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file zone_guard.c
+ * @brief Against random subdomain ("water torture") attacks on a zone.
+ *
+ * Each client request that missed the cache is counted in a sketch by the
+ * zone cut of its last query, and also in another one if the answer was
+ * NXDOMAIN; the counts halve every second.  A zone with many NXDOMAIN misses,
+ * making most of its misses, is attacked for the next hold seconds.
+ * The root, the TLDs and the exempt zones (e.g. other public suffixes)
+ * never are, as all the resolution below them would be limited.
+ *
+ * Meanwhile only limit requests may query the servers of the attacked zone
+ * at once, i.e. with the zone cut right at it (not below);
+ * each holds its slot (kr_request::guard_slot) until it finishes.
+ * The others are answered from stale records if allowed and there are some,
+ * and fail right away otherwise, so that they don't pile up waiting.
+ *
+ * The sketches and the attacked zones are of each fork.
+ */
+
+#include <libknot/packet/pkt.h>
+#include <ccan/json/json.h>
+
+#include "daemon/worker.h"
+#include "lib/generic/cmsketch.h"
+#include "lib/generic/trie.h"
+#include "lib/module.h"
+#include "lib/layer.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+#include "lib/utils.h"
+
+#define VERBOSE_MSG(qry, fmt...) QRVERBOSE(qry, "zgrd",  fmt)
+#define ERR_MSG(fmt, ...) kr_log_error("[     ][zgrd] " fmt, ## __VA_ARGS__)
+
+/* Defaults */
+#define GUARD_THRESHOLD 100  /**< NXDOMAIN misses of a zone, as counted in the sketch */
+#define GUARD_RATIO 80       /**< Percent of the misses of the zone that are NXDOMAIN */
+#define GUARD_LIMIT 20       /**< Requests querying an attacked zone at once */
+#define GUARD_HOLD 60        /**< How long a zone stays attacked after detection, seconds */
+#define GUARD_STALE_TTL 10   /**< TTL of the stale records in the limited answers, seconds */
+#define GUARD_WIDTH 4096     /**< Counters in a row of the sketches */
+#define GUARD_ZONES 16       /**< Most zones attacked at once */
+#define GUARD_HALVE 1000     /**< Period of halving the counts, milliseconds */
+#define GUARD_LABELS 2       /**< Labels of a zone at least, so no TLD is attacked */
+
+struct guard_zone {
+	knot_dname_t name[KNOT_DNAME_MAXLEN];
+	uint64_t until;     /**< kr_now() when the zone stops being attacked */
+	uint32_t inflight;  /**< Requests holding the slot */
+	uint64_t limited;
+};
+
+/** Counters, also exported to the shared statistics. */
+enum guard_counter { GUARD_ATTACKS, GUARD_LIMITED, GUARD_STALE, GUARD_COUNTERS };
+static const char *counter_names[GUARD_COUNTERS] = {
+	"zone_guard.attacks", "zone_guard.limited", "zone_guard.stale",
+};
+
+struct guard_data {
+	cmsketch_t *misses;
+	cmsketch_t *nxdomains;
+	uint64_t halved;    /**< kr_now() of the last halving */
+	uint32_t threshold;
+	uint32_t ratio;
+	uint32_t limit;
+	uint32_t hold;
+	uint32_t stale_ttl;
+	bool stale;
+	trie_t *exempt;     /**< Zones never attacked, by the lower-cased wire name */
+	struct guard_zone zones[GUARD_ZONES];
+	uint64_t counters[GUARD_COUNTERS];
+	int shared[GUARD_COUNTERS];
+	int shared_zones;   /**< Gauge of the zones attacked now */
+};
+
+/** @internal The stale callback has no baton, and the module is loaded once. */
+static struct guard_data *the_data = NULL;
+
+static void count(struct guard_data *data, enum guard_counter c)
+{
+	worker_counter_inc(data->counters, data->shared, c);
+}
+
+static void count_zones(struct guard_data *data, uint64_t now)
+{
+	unsigned attacked = 0;
+	for (unsigned i = 0; i < GUARD_ZONES; ++i) {
+		attacked += data->zones[i].until > now;
+	}
+	worker_shstats_set(data->shared_zones, attacked);
+}
+
+/** Allow the records that expired, with a short TTL; see kr_stale_cb. */
+static int32_t stale_ttl(int32_t ttl, const knot_dname_t *owner, uint16_t type,
+			 const struct kr_query *qry)
+{
+	struct guard_data *data = the_data;
+	if (!data) {
+		return -1;
+	}
+	count(data, GUARD_STALE);
+	return data->stale_ttl;
+}
+
+/** Find the attacked zone (lower-cased), return its slot or -1. */
+static int zone_find(const struct guard_data *data, const knot_dname_t *zone, uint64_t now)
+{
+	for (int i = 0; i < GUARD_ZONES; ++i) {
+		const struct guard_zone *z = &data->zones[i];
+		if (z->until > now && knot_dname_is_equal(z->name, zone)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Whether the zone (lower-cased) may be attacked, see GUARD_LABELS. */
+static bool zone_guarded(const struct guard_data *data, const knot_dname_t *zone, int len)
+{
+	return knot_dname_labels(zone, NULL) >= GUARD_LABELS
+		&& !(data->exempt && trie_get_try(data->exempt, (const char *)zone, len));
+}
+
+static void slot_release(struct guard_data *data, struct kr_request *req)
+{
+	if (req->guard_slot) {
+		struct guard_zone *z = &data->zones[req->guard_slot - 1];
+		assert(z->inflight > 0);
+		z->inflight -= 1;
+		req->guard_slot = 0;
+	}
+}
+
+/** Mark the zone attacked, in a free slot unless it is already. */
+static void zone_attacked(struct guard_data *data, const knot_dname_t *zone,
+			  const struct kr_query *qry, uint64_t now)
+{
+	struct guard_zone *free_z = NULL;
+	for (unsigned i = 0; i < GUARD_ZONES; ++i) {
+		struct guard_zone *z = &data->zones[i];
+		if (z->until > now || z->inflight > 0) {
+			if (knot_dname_is_equal(z->name, zone)) {
+				z->until = now + data->hold * 1000;
+				return;
+			}
+		} else if (!free_z) {
+			free_z = z;
+		}
+	}
+	if (!free_z) {
+		return;
+	}
+	knot_dname_to_wire(free_z->name, zone, sizeof(free_z->name));
+	free_z->until = now + data->hold * 1000;
+	free_z->limited = 0;
+	count(data, GUARD_ATTACKS);
+	count_zones(data, now);
+	WITH_VERBOSE(qry) {
+		auto_free char *zone_str = kr_dname_text(zone);
+		VERBOSE_MSG(qry, "=> random subdomains of %s, limiting it\n", zone_str);
+	}
+}
+
+/** Limit the requests that would query an attacked zone. */
+static int produce(kr_layer_t *ctx, knot_pkt_t *pkt)
+{
+	struct kr_module *module = ctx->api->data;
+	struct guard_data *data = module->data;
+	struct kr_request *req = ctx->req;
+	struct kr_query *qry = req->current_query;
+	/* Only the queries that go upstream, i.e. not answered by the cache. */
+	if (ctx->state != KR_STATE_CONSUME || !qry || qry->flags.CACHED
+	    || qry->flags.FORWARD || qry->flags.STUB || data->limit == 0) {
+		return ctx->state;
+	}
+	/* The servers of the attacked zone itself; the delegated zones below it are others. */
+	knot_dname_t zone[KNOT_DNAME_MAXLEN];
+	if (!qry->zone_cut.name
+	    || knot_dname_to_wire(zone, qry->zone_cut.name, sizeof(zone)) <= 0) {
+		return ctx->state;
+	}
+	knot_dname_to_lower(zone);
+	const uint64_t now = kr_now();
+	const int i = zone_find(data, zone, now);
+	if (i < 0 || req->guard_slot == i + 1) {
+		return ctx->state;
+	}
+	struct guard_zone *z = &data->zones[i];
+	if (z->inflight < data->limit) {
+		slot_release(data, req);
+		z->inflight += 1;
+		req->guard_slot = i + 1;
+		return ctx->state;
+	}
+	/* Over the limit: another round for stale records, then fail. */
+	if (data->stale && !qry->stale_cb) {
+		VERBOSE_MSG(qry, "=> zone over the limit, allowing stale data\n");
+		qry->stale_cb = stale_ttl;
+		return KR_STATE_PRODUCE;
+	}
+	z->limited += 1;
+	count(data, GUARD_LIMITED);
+	VERBOSE_MSG(qry, "=> zone over the limit, failing\n");
+	return KR_STATE_FAIL;
+}
+
+/** Count the misses and release the slot. */
+static int finish(kr_layer_t *ctx)
+{
+	struct kr_module *module = ctx->api->data;
+	struct guard_data *data = module->data;
+	struct kr_request *req = ctx->req;
+	slot_release(data, req);
+	/* Only the clients make attacks; not the refreshes, priming, etc. */
+	if (!req->qsource.addr || !data->misses || !req->answer) {
+		return ctx->state;
+	}
+	const uint64_t now = kr_now();
+	if (now - data->halved >= GUARD_HALVE) {
+		cmsketch_halve(data->misses);
+		cmsketch_halve(data->nxdomains);
+		data->halved = now;
+		count_zones(data, now);
+	}
+	const struct kr_query *qry = kr_rplan_resolved(&req->rplan);
+	if (!qry || qry->flags.CACHED || qry->flags.FORWARD || qry->flags.STUB
+	    || !qry->zone_cut.name) {
+		return ctx->state;
+	}
+	knot_dname_t zone[KNOT_DNAME_MAXLEN];
+	int len = knot_dname_to_wire(zone, qry->zone_cut.name, sizeof(zone));
+	if (len <= 0) {
+		return ctx->state;
+	}
+	knot_dname_to_lower(zone);
+	if (!zone_guarded(data, zone, len)) {
+		return ctx->state;
+	}
+	cmsketch_add(data->misses, zone, len);
+	if (knot_wire_get_rcode(req->answer->wire) != KNOT_RCODE_NXDOMAIN) {
+		return ctx->state;
+	}
+	cmsketch_add(data->nxdomains, zone, len);
+	const unsigned nx = cmsketch_estimate(data->nxdomains, zone, len);
+	if (nx >= data->threshold && data->threshold > 0
+	    && nx * 100 >= data->ratio * cmsketch_estimate(data->misses, zone, len)) {
+		zone_attacked(data, zone, qry, now);
+	}
+	return ctx->state;
+}
+
+static char *config_json(const struct guard_data *data)
+{
+	JsonNode *root = json_mkobject();
+	json_append_member(root, "threshold", json_mknumber(data->threshold));
+	json_append_member(root, "ratio", json_mknumber(data->ratio));
+	json_append_member(root, "limit", json_mknumber(data->limit));
+	json_append_member(root, "hold", json_mknumber(data->hold));
+	json_append_member(root, "stale", json_mkbool(data->stale));
+	json_append_member(root, "stale_ttl", json_mknumber(data->stale_ttl));
+	JsonNode *exempt = json_mkarray();
+	trie_it_t *it;
+	for (it = data->exempt ? trie_it_begin(data->exempt) : NULL; it && !trie_it_finished(it);
+	     trie_it_next(it)) {
+		const knot_dname_t *zone = (const knot_dname_t *)trie_it_key(it, NULL);
+		auto_free char *zone_str = kr_dname_text(zone);
+		json_append_element(exempt, json_mkstring(zone_str));
+	}
+	trie_it_free(it);
+	json_append_member(root, "exempt", exempt);
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+/** Read a list of zone names into a new trie, or NULL if it's invalid. */
+static trie_t *config_zones(JsonNode *names)
+{
+	/* An empty table comes as an object. */
+	if (names->tag != JSON_ARRAY && !(names->tag == JSON_OBJECT && !json_first_child(names))) {
+		ERR_MSG("invalid 'exempt', expected a list of zones\n");
+		return NULL;
+	}
+	trie_t *zones = trie_create(NULL);
+	if (!zones) {
+		return NULL;
+	}
+	JsonNode *node;
+	json_foreach(node, names) {
+		knot_dname_t zone[KNOT_DNAME_MAXLEN];
+		if (node->tag != JSON_STRING
+		    || !knot_dname_from_str(zone, node->string_, sizeof(zone))) {
+			ERR_MSG("invalid 'exempt', expected a list of zones\n");
+			trie_free(zones);
+			return NULL;
+		}
+		knot_dname_to_lower(zone);
+		trie_get_ins(zones, (const char *)zone, knot_dname_size(zone));
+	}
+	return zones;
+}
+
+/*
+ * Module implementation.
+ */
+
+KR_EXPORT
+const kr_layer_api_t *zone_guard_layer(struct kr_module *module)
+{
+	static kr_layer_api_t _layer = {
+		.produce = &produce,
+		.finish = &finish,
+	};
+	/* Store module reference */
+	_layer.data = module;
+	return &_layer;
+}
+
+KR_EXPORT
+int zone_guard_init(struct kr_module *module)
+{
+	struct guard_data *data = calloc(1, sizeof(*data));
+	if (!data) {
+		return kr_error(ENOMEM);
+	}
+	data->misses = cmsketch_create(GUARD_WIDTH);
+	data->nxdomains = cmsketch_create(GUARD_WIDTH);
+	if (!data->misses || !data->nxdomains) {
+		cmsketch_free(data->misses);
+		cmsketch_free(data->nxdomains);
+		free(data);
+		return kr_error(ENOMEM);
+	}
+	data->halved = kr_now();
+	data->threshold = GUARD_THRESHOLD;
+	data->ratio = GUARD_RATIO;
+	data->limit = GUARD_LIMIT;
+	data->hold = GUARD_HOLD;
+	data->stale = true;
+	data->stale_ttl = GUARD_STALE_TTL;
+	worker_counters_register(counter_names, data->shared, GUARD_COUNTERS);
+	data->shared_zones = worker_shstats_register("zone_guard.zones");
+	worker_shstats_set(data->shared_zones, 0);
+	module->data = data;
+	the_data = data;
+	return kr_ok();
+}
+
+KR_EXPORT
+int zone_guard_deinit(struct kr_module *module)
+{
+	struct guard_data *data = module->data;
+	if (data) {
+		if (the_data == data) {
+			the_data = NULL;
+		}
+		cmsketch_free(data->misses);
+		cmsketch_free(data->nxdomains);
+		trie_free(data->exempt);
+		free(data);
+		module->data = NULL;
+	}
+	return kr_ok();
+}
+
+KR_EXPORT
+int zone_guard_config(struct kr_module *module, const char *conf)
+{
+	struct guard_data *data = module->data;
+	if (!conf || !conf[0]) {
+		return kr_ok();
+	}
+	JsonNode *root = json_decode(conf);
+	if (!root || root->tag != JSON_OBJECT) {
+		ERR_MSG("expected a table of settings\n");
+		json_delete(root);
+		return kr_error(EINVAL);
+	}
+	uint32_t threshold = data->threshold, ratio = data->ratio, limit = data->limit,
+		 hold = data->hold, ttl = data->stale_ttl;
+	/* The counters of the sketch saturate at 255. */
+	bool ok = worker_config_number("zgrd", root, "threshold", 255, &threshold)
+		&& worker_config_number("zgrd", root, "ratio", 100, &ratio)
+		&& worker_config_number("zgrd", root, "limit", UINT16_MAX, &limit)
+		&& worker_config_number("zgrd", root, "hold", 24 * 3600, &hold)
+		&& worker_config_number("zgrd", root, "stale_ttl", INT32_MAX, &ttl);
+	JsonNode *stale = json_find_member(root, "stale");
+	if (ok && stale && stale->tag != JSON_BOOL) {
+		ERR_MSG("invalid 'stale', expected a boolean\n");
+		ok = false;
+	}
+	trie_t *exempt = NULL;
+	JsonNode *names = json_find_member(root, "exempt");
+	if (ok && names) {
+		ok = (exempt = config_zones(names)) != NULL;
+	}
+	if (ok) {
+		if (exempt) {
+			trie_free(data->exempt);
+			data->exempt = exempt;
+		}
+		data->threshold = threshold;
+		data->ratio = ratio;
+		data->limit = limit;
+		data->hold = hold;
+		data->stale_ttl = ttl;
+		if (stale) {
+			data->stale = stale->bool_;
+		}
+	}
+	json_delete(root);
+	return ok ? kr_ok() : kr_error(EINVAL);
+}
+
+/** Return the counters of this fork. */
+static char *zone_guard_stats(void *env, struct kr_module *module, const char *args)
+{
+	struct guard_data *data = module->data;
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < GUARD_COUNTERS; ++i) {
+		/* strip the "zone_guard." */
+		json_append_member(root, counter_names[i] + 11, json_mknumber(data->counters[i]));
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+/** Return the zones attacked now in this fork. */
+static char *zone_guard_zones(void *env, struct kr_module *module, const char *args)
+{
+	struct guard_data *data = module->data;
+	const uint64_t now = kr_now();
+	JsonNode *root = json_mkobject();
+	for (unsigned i = 0; i < GUARD_ZONES; ++i) {
+		const struct guard_zone *z = &data->zones[i];
+		if (z->until <= now) {
+			continue;
+		}
+		auto_free char *zone_str = kr_dname_text(z->name);
+		JsonNode *node = json_mkobject();
+		json_append_member(node, "expires", json_mknumber((z->until - now) / 1000));
+		json_append_member(node, "inflight", json_mknumber(z->inflight));
+		json_append_member(node, "limited", json_mknumber(z->limited));
+		json_append_member(root, zone_str, node);
+	}
+	char *ret = json_encode(root);
+	json_delete(root);
+	return ret;
+}
+
+static char *zone_guard_settings(void *env, struct kr_module *module, const char *args)
+{
+	return config_json(module->data);
+}
+
+KR_EXPORT
+struct kr_prop *zone_guard_props(void)
+{
+	static struct kr_prop prop_list[] = {
+	    { &zone_guard_settings, "settings", "Get the current settings.", },
+	    { &zone_guard_stats,    "stats", "Get the counters of limited requests in this fork.", },
+	    { &zone_guard_zones,    "zones", "Get the zones attacked now in this fork.", },
+	    { NULL, NULL, NULL }
+	};
+	return prop_list;
+}
+
+KR_MODULE_EXPORT(zone_guard);
+
+#undef VERBOSE_MSG
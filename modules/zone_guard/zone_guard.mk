@@ -0,0 +1,8 @@
+zone_guard_CFLAGS := -fPIC
+# The counters and the configuration use worker_*() of the daemon, not of libkres;
+# on darwin the undefined symbols aren't accepted by default.
+zone_guard_LDFLAGS := -Wl,-undefined -Wl,dynamic_lookup
+zone_guard_SOURCES := modules/zone_guard/zone_guard.c
+zone_guard_DEPEND := $(libkres)
+zone_guard_LIBS := $(contrib_TARGET) $(libkres_TARGET) $(libkres_LIBS)
+$(call make_c_module,zone_guard)
@@ -188,6 +188,13 @@ define find_ver
 	endif
 endef
 
+# Find C header
+define find_header
+	ifeq ($$(strip $$(HAS_$(1))),)
+		HAS_$(1) := $(shell printf '\043include <$(2)>\n' | $(CC) -E - > /dev/null 2>&1 && echo yes || echo no)
+	endif
+endef
+
 # Find Go package
 define find_gopkg
 	HAS_$(1) := $(shell go list $(2) > /dev/null 2>&1 && echo yes || echo no)
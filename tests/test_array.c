@@ -79,6 +79,12 @@ static int fake_reserve(void *baton, char **mem, size_t elm_size, size_t want, s
 	return -1;
 }
 
+/** Freeing which must not happen. */
+static void fake_free(void *baton, void *p)
+{
+	fail();
+}
+
 static void test_array_mm(void **state)
 {
 	array_t(int) arr;
@@ -98,13 +104,45 @@ static void test_array_mm(void **state)
 
 }
 
+static void test_array_small(void **state)
+{
+	array_small_t(int, 4) arr;
+	array_small_init(arr);
+	assert_int_equal(arr.cap, 4);
+
+	/* The room inside is used first. */
+	for (int i = 0; i < 4; ++i) {
+		assert_int_equal(array_small_push_mm(arr, i, fake_reserve, NULL), i);
+	}
+	assert_true(array_small_is_inline(arr));
+	assert_false(array_small_push_mm(arr, 4, fake_reserve, NULL) >= 0);
+	assert_int_equal(arr.len, 4);
+
+	/* Then the elements move to allocated memory. */
+	for (int i = 4; i < 100; ++i) {
+		assert_int_equal(array_small_push_mm(arr, i, test_reserve, &global_mm), i);
+	}
+	assert_false(array_small_is_inline(arr));
+	for (int i = 0; i < 100; ++i) {
+		assert_int_equal(arr.at[i], i);
+	}
+	array_del(arr, 0);
+	assert_int_equal(arr.at[0], 99);
+	array_small_clear_mm(arr, mm_free, &global_mm);
+	assert_true(array_small_is_inline(arr));
+	assert_int_equal(arr.len, 0);
+	/* Clearing the inline array has nothing to free. */
+	array_small_clear_mm(arr, fake_free, NULL);
+}
+
 int main(void)
 {
 	test_mm_ctx_init(&global_mm);
 
 	const UnitTest tests[] = {
 		unit_test(test_array),
-		unit_test(test_array_mm)
+		unit_test(test_array_mm),
+		unit_test(test_array_small)
 	};
 
 	return run_tests(tests);
@@ -0,0 +1,452 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The negative answers the cache synthesizes by itself, through the cache layer. */
+
+#include <string.h>
+#include <ucw/mempool.h>
+#include <libknot/descriptor.h>
+#include <libknot/packet/pkt.h>
+#include <libknot/rrtype/opt.h>
+
+#include "tests/test.h"
+#include "contrib/base32hex.h"
+#include "contrib/wire.h"
+#include "lib/cache/api.h"
+#include "lib/dnssec/nsec3.h"
+#include "lib/dnssec/ta.h"
+#include "lib/layer.h"
+#include "lib/module.h"
+#include "lib/resolve.h"
+
+#define NOW 1500000000
+#define TTL 3600
+#define NEG_TTL 300 /* SOA minimum */
+#define RANK (KR_RANK_SECURE | KR_RANK_AUTH)
+#define HASH_LEN 20 /* SHA-1 */
+
+static const knot_dname_t *zone = (const knot_dname_t *)"\7example";
+
+/* The zone, hashed with one iteration and the salt AABB; the NSEC3 of a.example
+ * covers the hashes of nx.example and *.example, the one of the apex those
+ * of x.w.example and www.sub.example:
+ *   example       SOA NS DNSKEY NSEC3PARAM
+ *   a.example     A
+ *   w.example     (empty non-terminal)
+ *   *.w.example   TXT
+ *   sub.example   NS (insecure delegation) */
+static const char *names[] = {
+	"\7example", "\1a\7example", "\1w\7example", "\1*\1w\7example", "\3sub\7example",
+};
+#define NAME_COUNT (sizeof(names) / sizeof(names[0]))
+static const uint16_t name_types[NAME_COUNT][6] = {
+	{ KNOT_RRTYPE_SOA, KNOT_RRTYPE_NS, KNOT_RRTYPE_RRSIG, KNOT_RRTYPE_DNSKEY,
+	  KNOT_RRTYPE_NSEC3PARAM, 0 },
+	{ KNOT_RRTYPE_A, KNOT_RRTYPE_RRSIG, 0 },
+	{ 0 },
+	{ KNOT_RRTYPE_TXT, KNOT_RRTYPE_RRSIG, 0 },
+	{ KNOT_RRTYPE_NS, 0 },
+};
+static const uint8_t salt[] = { 0xaa, 0xbb };
+
+static const char *tmpdir;
+static struct kr_context ctx;
+static knot_mm_t pool;
+static const kr_layer_api_t *cache_api;
+
+static void setup(void **state)
+{
+	tmpdir = test_tmpdir_create();
+	assert_non_null(tmpdir);
+	memset(&ctx, 0, sizeof(ctx));
+	pool.ctx = mp_new(4096);
+	pool.alloc = (knot_mm_alloc_t) mp_alloc;
+	ctx.pool = &pool;
+	struct kr_cdb_opts opts = { .path = tmpdir, .maxsize = 10 * 1024 * 1024 };
+	assert_int_equal(kr_cache_open(&ctx.cache, NULL, &opts, &pool), 0);
+	/* The zone is under a trust anchor, so only secure answers are accepted. */
+	ctx.trust_anchors = trie_create(NULL);
+	ctx.negative_anchors = trie_create(NULL);
+	const uint8_t ds[36] = { 0x30, 0x39, 8, 2 };
+	assert_int_equal(kr_ta_add(ctx.trust_anchors, zone, KNOT_RRTYPE_DS, TTL, ds, sizeof(ds)), 0);
+	cache_api = kr_module_embedded("cache")->layer(NULL);
+}
+
+static void teardown(void **state)
+{
+	kr_cache_close(&ctx.cache);
+	kr_ta_clear(ctx.trust_anchors);
+	trie_free(ctx.trust_anchors);
+	trie_free(ctx.negative_anchors);
+	mp_delete(pool.ctx);
+	test_tmpdir_remove(tmpdir);
+}
+
+/** Type bitmap of window 0 with the zero-terminated types, return its length. */
+static size_t write_bitmap(uint8_t *bm, const uint16_t *types)
+{
+	memset(bm, 0, 34);
+	uint8_t len = 0;
+	for (; *types; ++types) {
+		bm[2 + *types / 8] |= 0x80 >> (*types % 8);
+		len = MAX(len, *types / 8 + 1);
+	}
+	bm[1] = len;
+	return len ? 2 + len : 0;
+}
+
+/** Add an RRSIG of the zone over the RRset; `labels` as in RFC 4034 3.1.3. */
+static void sign(knot_rrset_t *rrsig, const knot_rrset_t *rr, uint8_t labels)
+{
+	knot_rrset_init(rrsig, rr->owner, KNOT_RRTYPE_RRSIG, KNOT_CLASS_IN);
+	uint8_t rdata[18 + KNOT_DNAME_MAXLEN + 8] = { 0 };
+	/* Type covered, algorithm, labels, TTL, expiration, inception, key tag */
+	wire_write_u16(rdata, rr->type);
+	rdata[2] = 8;
+	rdata[3] = labels;
+	wire_write_u32(rdata + 4, TTL);
+	wire_write_u32(rdata + 8, NOW + 86400);
+	wire_write_u32(rdata + 12, NOW - 86400);
+	const int zone_len = knot_dname_size(zone);
+	memcpy(rdata + 18, zone, zone_len);
+	const uint32_t ttl = knot_rrset_ttl(rr);
+	assert_int_equal(knot_rrset_add_rdata(rrsig, rdata, 18 + zone_len + 8, ttl, &pool), 0);
+}
+
+/** Make the RRset with one RDATA, and its RRSIG. */
+static void make(knot_rrset_t *rr, knot_rrset_t *rrsig, const knot_dname_t *owner,
+		 uint16_t type, const uint8_t *rdata, uint16_t rdlen, uint32_t ttl)
+{
+	knot_rrset_init(rr, knot_dname_copy(owner, &pool), type, KNOT_CLASS_IN);
+	assert_int_equal(knot_rrset_add_rdata(rr, rdata, rdlen, ttl, &pool), 0);
+	int labels = knot_dname_labels(owner, NULL);
+	if (knot_dname_is_wildcard(owner)) {
+		--labels;
+	}
+	sign(rrsig, rr, labels);
+}
+
+/** Insert the RRset with one RDATA, signed, as the validator would. */
+static void insert(const knot_dname_t *owner, uint16_t type, const uint8_t *rdata,
+		   uint16_t rdlen, uint32_t ttl)
+{
+	knot_rrset_t rr, rrsig;
+	make(&rr, &rrsig, owner, type, rdata, rdlen, ttl);
+	assert_int_equal(kr_cache_insert_rr(&ctx.cache, &rr, &rrsig, RANK, NOW), 0);
+}
+
+/** The SOA of the zone, return the length of its RDATA. */
+static size_t write_soa(uint8_t rdata[64])
+{
+	/* The names, serial, refresh, retry, expire and minimum */
+	const uint8_t mname[] = "\2ns\7example", rname[] = "\4host\7example";
+	const size_t len = sizeof(mname) + sizeof(rname) + 20;
+	memset(rdata, 0, len);
+	memcpy(rdata, mname, sizeof(mname));
+	memcpy(rdata + sizeof(mname), rname, sizeof(rname));
+	wire_write_u32(rdata + len - 4, NEG_TTL);
+	return len;
+}
+
+/** Hash of the name in the chain of the zone. */
+static void hash_name(uint8_t hash[HASH_LEN], const knot_dname_t *name)
+{
+	const dnssec_nsec3_params_t params = {
+		.algorithm = 1,
+		.iterations = 1,
+		.salt = { .size = sizeof(salt), .data = (uint8_t *)salt },
+	};
+	dnssec_binary_t bin = { 0, NULL };
+	assert_int_equal(kr_nsec3_hash_name(&bin, &params, name), 0);
+	assert_int_equal(bin.size, HASH_LEN);
+	memcpy(hash, bin.data, HASH_LEN);
+	dnssec_binary_free(&bin);
+}
+
+/** Insert the zone's apex records and its whole NSEC3 chain.
+ * @param optout_name the NSEC3 covering the hash of this name gets the opt-out flag, or NULL */
+static void insert_zone(const char *optout_name)
+{
+	const uint8_t ns[] = "\2ns\7example";
+	insert(zone, KNOT_RRTYPE_NS, ns, sizeof(ns), TTL);
+	uint8_t soa[64];
+	insert(zone, KNOT_RRTYPE_SOA, soa, write_soa(soa), TTL);
+	const uint8_t txt[] = "\3foo";
+	insert((const knot_dname_t *)"\1*\1w\7example", KNOT_RRTYPE_TXT, txt, 4, TTL);
+
+	/* The chain in the order of the hashes. */
+	uint8_t hashes[NAME_COUNT][HASH_LEN];
+	size_t order[NAME_COUNT];
+	for (size_t i = 0; i < NAME_COUNT; ++i) {
+		hash_name(hashes[i], (const knot_dname_t *)names[i]);
+		size_t j = i;
+		while (j > 0 && memcmp(hashes[order[j - 1]], hashes[i], HASH_LEN) > 0) {
+			order[j] = order[j - 1];
+			--j;
+		}
+		order[j] = i;
+	}
+	uint8_t optout_hash[HASH_LEN] = { 0 };
+	if (optout_name) {
+		hash_name(optout_hash, (const knot_dname_t *)optout_name);
+	}
+	for (size_t i = 0; i < NAME_COUNT; ++i) {
+		const uint8_t *hash = hashes[order[i]];
+		const uint8_t *next = hashes[order[(i + 1) % NAME_COUNT]];
+		const bool after = memcmp(hash, optout_hash, HASH_LEN) < 0;
+		const bool before = memcmp(optout_hash, next, HASH_LEN) < 0;
+		const bool covers = i + 1 < NAME_COUNT ? after && before : after || before;
+		/* Algorithm, flags, iterations, salt, next hash, bitmap */
+		uint8_t rdata[6 + sizeof(salt) + HASH_LEN + 34];
+		rdata[0] = 1;
+		rdata[1] = optout_name && covers ? 1 : 0;
+		wire_write_u16(rdata + 2, 1);
+		rdata[4] = sizeof(salt);
+		memcpy(rdata + 5, salt, sizeof(salt));
+		rdata[5 + sizeof(salt)] = HASH_LEN;
+		memcpy(rdata + 6 + sizeof(salt), next, HASH_LEN);
+		const size_t bm_len = write_bitmap(rdata + 6 + sizeof(salt) + HASH_LEN,
+						   name_types[order[i]]);
+		knot_dname_t owner[KNOT_DNAME_MAXLEN];
+		owner[0] = 32;
+		assert_int_equal(base32hex_encode(hash, HASH_LEN, owner + 1, 32), 32);
+		memcpy(owner + 33, zone, knot_dname_size(zone));
+		knot_dname_to_lower(owner);
+		insert(owner, KNOT_RRTYPE_NSEC3, rdata,
+		       6 + sizeof(salt) + HASH_LEN + bm_len, NEG_TTL);
+	}
+	kr_cache_sync(&ctx.cache);
+}
+
+/** The query of a DNSSEC-aware client, `dt` seconds after the records were cached. */
+static struct kr_query *query(const char *name, uint16_t type, uint32_t dt)
+{
+	static struct kr_request req;
+	static struct kr_query qry;
+	static knot_rrset_t opt;
+	memset(&req, 0, sizeof(req));
+	req.ctx = &ctx;
+	req.pool = pool;
+	req.answer = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &pool);
+	assert_non_null(req.answer);
+	/* A DNSSEC-aware client, so that the signatures are added. */
+	assert_int_equal(knot_edns_init(&opt, KNOT_EDNS_MAX_UDP_PAYLOAD, 0,
+					KNOT_EDNS_VERSION, &pool), 0);
+	knot_edns_set_do(&opt);
+	req.answer->opt_rr = &opt;
+	memset(&qry, 0, sizeof(qry));
+	qry.request = &req;
+	qry.sname = knot_dname_copy((const knot_dname_t *)name, &pool);
+	qry.stype = type;
+	qry.sclass = KNOT_CLASS_IN;
+	qry.uid = 1;
+	qry.timestamp.tv_sec = NOW + dt;
+	qry.flags.DNSSEC_WANT = true;
+	req.current_query = &qry;
+	return &qry;
+}
+
+/** Ask the cache like the resolver would.
+ * @param answer the answer if it's done
+ * @return the state of the layer */
+static int peek(const char *name, uint16_t type, uint32_t dt, knot_pkt_t **answer)
+{
+	struct kr_query *qry = query(name, type, dt);
+	*answer = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &pool);
+	assert_non_null(*answer);
+	kr_layer_t layer = { .state = KR_STATE_PRODUCE, .req = qry->request, .api = cache_api };
+	return cache_api->produce(&layer, *answer);
+}
+
+/** Stash a validated NXDOMAIN with an NSEC3 proof, like it came from upstream. */
+static void stash_nxdomain(const char *name, uint16_t type)
+{
+	struct kr_query *qry = query(name, type, 0);
+	knot_pkt_t *built = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &pool);
+	assert_non_null(built);
+	assert_int_equal(knot_pkt_put_question(built, qry->sname, KNOT_CLASS_IN, type), 0);
+	knot_wire_set_qr(built->wire);
+	knot_wire_set_aa(built->wire);
+	knot_wire_set_rcode(built->wire, KNOT_RCODE_NXDOMAIN);
+	assert_int_equal(knot_pkt_begin(built, KNOT_AUTHORITY), 0);
+	knot_rrset_t rrs[4];
+	uint8_t soa[64];
+	make(&rrs[0], &rrs[1], zone, KNOT_RRTYPE_SOA, soa, write_soa(soa), NEG_TTL);
+	/* Just some NSEC3 to carry along; algorithm, flags, iterations, salt, next hash */
+	uint8_t nsec3[6 + sizeof(salt) + HASH_LEN] = { 1, 0, 0, 1, sizeof(salt), 0xaa, 0xbb, HASH_LEN };
+	make(&rrs[2], &rrs[3], (const knot_dname_t *)"\040" "0123456789abcdefghijklmnopqrstuv\7example",
+	     KNOT_RRTYPE_NSEC3, nsec3, sizeof(nsec3), NEG_TTL);
+	for (int i = 0; i < 4; ++i) {
+		assert_int_equal(knot_pkt_put(built, KNOT_COMPR_HINT_NONE, &rrs[i], 0), 0);
+	}
+	/* The cache wants it parsed. */
+	knot_pkt_t *pkt = knot_pkt_new(built->wire, built->size, &pool);
+	assert_non_null(pkt);
+	assert_int_equal(knot_pkt_parse(pkt, 0), 0);
+	kr_layer_t layer = { .state = KR_STATE_DONE, .req = qry->request, .api = cache_api };
+	cache_api->consume(&layer, pkt);
+}
+
+/** Number of the RRsets of the type in the section. */
+static unsigned count(const knot_pkt_t *pkt, knot_section_t section, uint16_t type)
+{
+	const knot_pktsection_t *sec = knot_pkt_section(pkt, section);
+	unsigned n = 0;
+	for (unsigned i = 0; i < sec->count; ++i) {
+		n += knot_pkt_rr(sec, i)->type == type;
+	}
+	return n;
+}
+
+/** TTL of the first RRset of the type in the section. */
+static uint32_t ttl_of(const knot_pkt_t *pkt, knot_section_t section, uint16_t type)
+{
+	const knot_pktsection_t *sec = knot_pkt_section(pkt, section);
+	for (unsigned i = 0; i < sec->count; ++i) {
+		if (knot_pkt_rr(sec, i)->type == type) {
+			return knot_rrset_ttl(knot_pkt_rr(sec, i));
+		}
+	}
+	assert_true(false);
+	return 0;
+}
+
+static void test_nsec3_nxdomain(void **state)
+{
+	insert_zone(NULL);
+	knot_pkt_t *answer;
+	assert_int_equal(peek("\2nx\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NXDOMAIN);
+	assert_int_equal(count(answer, KNOT_ANSWER, KNOT_RRTYPE_A), 0);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), 1);
+	/* The closest encloser, the next closer name and the wildcard;
+	 * one record may prove two of them. */
+	const unsigned nsec3 = count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3);
+	assert_true(nsec3 >= 2 && nsec3 <= 3);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_RRSIG), 1 + nsec3);
+	/* Also below the name, the closest encloser being the same. */
+	assert_int_equal(peek("\1x\2nx\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NXDOMAIN);
+	/* Not once the records expire. */
+	assert_int_not_equal(peek("\2nx\7example", KNOT_RRTYPE_A, NEG_TTL + 1, &answer),
+			     KR_STATE_DONE);
+}
+
+static void test_nsec3_nodata(void **state)
+{
+	insert_zone(NULL);
+	knot_pkt_t *answer;
+	assert_int_equal(peek("\1a\7example", KNOT_RRTYPE_AAAA, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NOERROR);
+	assert_int_equal(knot_pkt_section(answer, KNOT_ANSWER)->count, 0);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), 1);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3), 1);
+	/* The types in the bitmap exist. */
+	assert_int_not_equal(peek("\1a\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	/* An empty non-terminal has no types at all. */
+	assert_int_equal(peek("\1w\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NOERROR);
+	/* No DS at the insecure delegation, from the parent-side NSEC3. */
+	assert_int_equal(peek("\3sub\7example", KNOT_RRTYPE_DS, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NOERROR);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3), 1);
+	/* But the other types there are the child's business. */
+	assert_int_not_equal(peek("\3sub\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	/* The DS of the apex is looked for in the parent zone. */
+	assert_int_not_equal(peek("\7example", KNOT_RRTYPE_DS, 10, &answer), KR_STATE_DONE);
+}
+
+static void test_nsec3_wildcard(void **state)
+{
+	insert_zone(NULL);
+	knot_pkt_t *answer;
+	/* The wildcard exists, without the type. */
+	assert_int_equal(peek("\1x\1w\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NOERROR);
+	assert_int_equal(knot_pkt_section(answer, KNOT_ANSWER)->count, 0);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), 1);
+	/* The closest encloser, the next closer name and the wildcard itself. */
+	const unsigned nsec3 = count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3);
+	assert_true(nsec3 >= 2 && nsec3 <= 3);
+	/* The expansion, with the proof that the name itself doesn't exist. */
+	assert_int_equal(peek("\1x\1w\7example", KNOT_RRTYPE_TXT, 10, &answer), KR_STATE_DONE);
+	assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NOERROR);
+	const knot_pktsection_t *an = knot_pkt_section(answer, KNOT_ANSWER);
+	assert_int_equal(count(answer, KNOT_ANSWER, KNOT_RRTYPE_TXT), 1);
+	for (unsigned i = 0; i < an->count; ++i) {
+		assert_true(knot_dname_is_equal(knot_pkt_rr(an, i)->owner,
+						(const knot_dname_t *)"\1x\1w\7example"));
+	}
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), 0);
+	assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3), 1);
+}
+
+static void test_nsec3_fallthrough(void **state)
+{
+	/* An insecure delegation may be in an opt-out range. */
+	insert_zone("\2nx\7example");
+	knot_pkt_t *answer;
+	assert_int_not_equal(peek("\2nx\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+	teardown(state);
+	setup(state);
+	/* Below a delegation the parent zone proves nothing. */
+	insert_zone(NULL);
+	assert_int_not_equal(peek("\3www\3sub\7example", KNOT_RRTYPE_A, 10, &answer),
+			     KR_STATE_DONE);
+	/* Nor without the chain of the zone. */
+	assert_int_not_equal(peek("\2nx\3org", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+}
+
+static void test_nxdomain_below(void **state)
+{
+	stash_nxdomain("\2nx\7example", KNOT_RRTYPE_A);
+	knot_pkt_t *answer;
+	/* The other types, and the names below (RFC 8020), with the proof. */
+	const char *qnames[] = { "\2nx\7example", "\1x\2nx\7example", "\1y\1x\2nx\7example" };
+	const uint16_t types[] = { KNOT_RRTYPE_AAAA, KNOT_RRTYPE_A, KNOT_RRTYPE_DS };
+	for (int i = 0; i < 3; ++i) {
+		assert_int_equal(peek(qnames[i], types[i], 10, &answer), KR_STATE_DONE);
+		assert_int_equal(knot_wire_get_rcode(answer->wire), KNOT_RCODE_NXDOMAIN);
+		assert_true(knot_dname_is_equal(knot_pkt_qname(answer),
+						(const knot_dname_t *)qnames[i]));
+		assert_int_equal(knot_pkt_qtype(answer), types[i]);
+		assert_int_equal(knot_pkt_section(answer, KNOT_ANSWER)->count, 0);
+		assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), 1);
+		assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3), 1);
+		assert_int_equal(count(answer, KNOT_AUTHORITY, KNOT_RRTYPE_RRSIG), 2);
+	}
+	/* The TTLs go down with the time spent in the cache. */
+	assert_int_equal(peek("\1x\2nx\7example", KNOT_RRTYPE_A, 100, &answer), KR_STATE_DONE);
+	assert_int_equal(ttl_of(answer, KNOT_AUTHORITY, KNOT_RRTYPE_SOA), NEG_TTL - 100);
+	assert_int_equal(ttl_of(answer, KNOT_AUTHORITY, KNOT_RRTYPE_NSEC3), NEG_TTL - 100);
+	assert_int_not_equal(peek("\1x\2nx\7example", KNOT_RRTYPE_A, NEG_TTL + 1, &answer),
+			     KR_STATE_DONE);
+	/* Nor the names beside it. */
+	assert_int_not_equal(peek("\2ny\7example", KNOT_RRTYPE_A, 10, &answer), KR_STATE_DONE);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test_setup_teardown(test_nsec3_nxdomain, setup, teardown),
+		unit_test_setup_teardown(test_nsec3_nodata, setup, teardown),
+		unit_test_setup_teardown(test_nsec3_wildcard, setup, teardown),
+		unit_test_setup_teardown(test_nsec3_fallthrough, setup, teardown),
+		unit_test_setup_teardown(test_nxdomain_below, setup, teardown),
+	};
+
+	return run_tests(tests);
+}
@@ -0,0 +1,112 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "tests/test.h"
+#include "lib/generic/cmsketch.h"
+
+#define SKETCH_WIDTH 1024
+#define KEY_LEN(x) (strlen(x) + 1)
+
+static const char *dict[] = {
+	"catagmatic", "prevaricator", "statoscope", "workhand", "benzamide",
+	"alluvia", "fanciful", "bladish", "Tarsius", "unfast", "appropriative",
+	"seraphically", "monkeypod", "deflectometer", "tanglesome", "zodiacal"
+};
+
+static void test_count(void **state)
+{
+	cmsketch_t *sk = *state;
+	int dict_size = sizeof(dict) / sizeof(const char *);
+	for (int i = 0; i < dict_size; i++) {
+		for (int j = 0; j <= i; ++j) {
+			cmsketch_add(sk, dict[i], KEY_LEN(dict[i]));
+		}
+	}
+	/* Never underestimated. */
+	for (int i = 0; i < dict_size; i++) {
+		assert_true(cmsketch_estimate(sk, dict[i], KEY_LEN(dict[i])) >= i + 1);
+	}
+}
+
+static void test_missing(void **state)
+{
+	cmsketch_t *sk = *state;
+	/* Few keys in a wide sketch, so a collision in all rows is very unlikely. */
+	const char *notin = "not in sketch";
+	assert_int_equal(cmsketch_estimate(sk, notin, KEY_LEN(notin)), 0);
+}
+
+static void test_saturate(void **state)
+{
+	cmsketch_t *sk = *state;
+	const char *key = "hot";
+	for (int i = 0; i < 1000; ++i) {
+		cmsketch_add(sk, key, KEY_LEN(key));
+	}
+	assert_int_equal(cmsketch_estimate(sk, key, KEY_LEN(key)), UINT8_MAX);
+	cmsketch_halve(sk);
+	assert_int_equal(cmsketch_estimate(sk, key, KEY_LEN(key)), UINT8_MAX / 2);
+}
+
+static void test_fork(void **state)
+{
+	cmsketch_t *sk = *state;
+	const char *key = "shared";
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0) {
+		for (int i = 0; i < 10; ++i) {
+			cmsketch_add(sk, key, KEY_LEN(key));
+		}
+		_exit(0);
+	}
+	int status = -1;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert_true(cmsketch_estimate(sk, key, KEY_LEN(key)) >= 10);
+}
+
+static void test_init(void **state)
+{
+	assert_null(cmsketch_create(0));
+	cmsketch_t *sk = cmsketch_create(SKETCH_WIDTH - 1);
+	assert_non_null(sk);
+	*state = sk;
+}
+
+static void test_deinit(void **state)
+{
+	cmsketch_free(*state);
+}
+
+/* Program entry point */
+int main(int argc, char **argv)
+{
+	const UnitTest tests[] = {
+		group_test_setup(test_init),
+		unit_test(test_count),
+		unit_test(test_missing),
+		unit_test(test_saturate),
+		unit_test(test_fork),
+		group_test_teardown(test_deinit)
+	};
+
+	return run_group_tests(tests);
+}
@@ -0,0 +1,119 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libknot/packet/wire.h>
+
+#include "tests/test.h"
+#include "lib/dnssec.h"
+#include "lib/utils.h"
+
+static const knot_dname_t *zone = (const knot_dname_t *)"\7example";
+
+/* RSASHA256 key of example., key tag 20511. */
+static const uint8_t dnskey[] = {
+	0x01, 0x00, 0x03, 0x08, 0x03, 0x01, 0x00, 0x01, 0xd2, 0x28, 0x28, 0x17,
+	0xdc, 0x9b, 0xd7, 0x21, 0x76, 0x0a, 0x0b, 0xcb, 0xde, 0x0e, 0xa4, 0xc4,
+	0xb0, 0x63, 0x9e, 0x30, 0x8f, 0xd8, 0xef, 0xc3, 0xb9, 0x8d, 0xdb, 0x0b,
+	0x80, 0x8c, 0xef, 0x6d, 0x8b, 0x33, 0xf7, 0x2c, 0x79, 0x97, 0xd3, 0x2f,
+	0x54, 0x26, 0xc4, 0x78, 0x7a, 0x68, 0x08, 0x5a, 0xd4, 0xfd, 0xa0, 0xc8,
+	0x9a, 0x8b, 0xb0, 0x04, 0x3e, 0x24, 0x8f, 0xdd, 0x38, 0x42, 0x1c, 0xb3,
+	0x36, 0xb6, 0x72, 0x0a, 0xaf, 0x07, 0x83, 0xf6, 0x90, 0x18, 0x70, 0x76,
+	0x1c, 0xd6, 0x0c, 0xfa, 0x62, 0x49, 0x93, 0xad, 0x13, 0x7e, 0x0c, 0x52,
+	0x88, 0xc5, 0x5f, 0xac, 0xf8, 0x7a, 0xa5, 0xf9, 0x11, 0x2a, 0x26, 0x8b,
+	0x79, 0x3d, 0xa1, 0xf9, 0xde, 0xbb, 0xe1, 0x28, 0xc9, 0xff, 0xcc, 0x39,
+	0x73, 0x91, 0xe1, 0x5d, 0x83, 0x4f, 0x5d, 0xe4, 0xb5, 0xe5, 0x4d, 0x35,
+	0xf6, 0x41, 0xfa, 0x7b,
+};
+
+/** The RRSIG of example. A by the key above; the signature itself is garbage. */
+static void rrsig_rdata(uint8_t *rdata, size_t *len)
+{
+	uint8_t *pos = rdata;
+	knot_wire_write_u16(pos, KNOT_RRTYPE_A); pos += 2;
+	*pos++ = 8; /* algorithm */
+	*pos++ = 1; /* labels */
+	knot_wire_write_u32(pos, 300); pos += 4;
+	knot_wire_write_u32(pos, UINT32_MAX); pos += 4; /* expiration */
+	knot_wire_write_u32(pos, 0); pos += 4; /* inception */
+	knot_wire_write_u16(pos, 20511); pos += 2;
+	const size_t zone_len = knot_dname_size(zone);
+	memcpy(pos, zone, zone_len); pos += zone_len;
+	memset(pos, 0x5a, 128); pos += 128;
+	*len = pos - rdata;
+}
+
+static void test_limit_crypto(void **state)
+{
+	knot_mm_t mm = { 0 };
+	test_mm_ctx_init(&mm);
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, &mm);
+	assert_non_null(pkt);
+
+	knot_rrset_t keys, covered, rrsig;
+	knot_rrset_init(&keys, (knot_dname_t *)zone, KNOT_RRTYPE_DNSKEY, KNOT_CLASS_IN);
+	assert_int_equal(knot_rrset_add_rdata(&keys, dnskey, sizeof(dnskey), 300, &mm), 0);
+	knot_rrset_init(&covered, (knot_dname_t *)zone, KNOT_RRTYPE_A, KNOT_CLASS_IN);
+	const uint8_t addr[4] = { 192, 0, 2, 1 };
+	assert_int_equal(knot_rrset_add_rdata(&covered, addr, sizeof(addr), 300, &mm), 0);
+	knot_rrset_init(&rrsig, (knot_dname_t *)zone, KNOT_RRTYPE_RRSIG, KNOT_CLASS_IN);
+	uint8_t rdata[256];
+	size_t rdata_len;
+	rrsig_rdata(rdata, &rdata_len);
+	assert_int_equal(knot_rrset_add_rdata(&rrsig, rdata, rdata_len, 300, &mm), 0);
+	ranked_rr_array_t rrs;
+	kr_ranked_rrarray_init(rrs);
+	assert_int_equal(kr_ranked_rrarray_add(&rrs, &rrsig, KR_RANK_INITIAL, true, 1, &mm), 0);
+
+	kr_rrset_validation_ctx_t vctx = {
+		.pkt = pkt,
+		.rrs = &rrs,
+		.section_id = KNOT_ANSWER,
+		.keys = &keys,
+		.zone_name = zone,
+		.timestamp = 1000,
+		.qry_uid = 1,
+	};
+	/* Out of the budget, the answer is refused before any public-key operation. */
+	vctx.limit_crypto_remains = 0;
+	assert_int_equal(kr_rrset_validate(&vctx, &covered), kr_error(E2BIG));
+	/* Within it, the (wrong) signature is checked and the check is counted. */
+	vctx.limit_crypto_remains = 1;
+	assert_int_equal(kr_rrset_validate(&vctx, &covered), kr_error(ENOENT));
+	assert_int_equal(vctx.limit_crypto_remains, 0);
+	/* A signature nothing could check doesn't count. */
+	vctx.limit_crypto_remains = 1;
+	rdata[16] ^= 0xff; /* key tag */
+	knot_rdataset_clear(&rrsig.rrs, &mm);
+	assert_int_equal(knot_rrset_add_rdata(&rrsig, rdata, rdata_len, 300, &mm), 0);
+	rrs.at[0]->rr = &rrsig;
+	assert_int_equal(kr_rrset_validate(&vctx, &covered), kr_error(ENOENT));
+	assert_int_equal(vctx.limit_crypto_remains, 1);
+
+	knot_pkt_free(&pkt);
+}
+
+int main(void)
+{
+	kr_crypto_init();
+	const UnitTest tests[] = {
+		unit_test(test_limit_crypto),
+	};
+
+	int ret = run_tests(tests);
+	kr_crypto_cleanup();
+	return ret;
+}
@@ -0,0 +1,97 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tests/test.h"
+#include "lib/ecs.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+
+static const knot_dname_t *zone = (const knot_dname_t *)"\3cdn\7example";
+
+/** Whether the subnet of the client would be sent to the servers of `cut`. */
+static bool sent(const char *client, const char *cut)
+{
+	struct kr_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.ecs.zones = trie_create(NULL);
+	ctx.ecs.source4 = KR_ECS_SOURCE4;
+	ctx.ecs.source6 = KR_ECS_SOURCE6;
+	assert_non_null(trie_get_ins(ctx.ecs.zones, (const char *)zone, knot_dname_size(zone)));
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	if (inet_pton(AF_INET, client, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+	} else {
+		assert_int_equal(inet_pton(AF_INET6, client, &sin6->sin6_addr), 1);
+		sin6->sin6_family = AF_INET6;
+	}
+	struct kr_request req;
+	memset(&req, 0, sizeof(req));
+	req.ctx = &ctx;
+	req.qsource.addr = (struct sockaddr *)&ss;
+	struct kr_query qry;
+	memset(&qry, 0, sizeof(qry));
+	qry.request = &req;
+	knot_edns_client_subnet_t ecs;
+	const bool ret = kr_ecs_get(&qry, (const knot_dname_t *)cut, &ecs);
+	/* The daemon's answers straight from cache ask the same. */
+	assert_true(kr_ecs_covers(&ctx.ecs, req.qsource.addr, (const knot_dname_t *)cut) == ret);
+	trie_free(ctx.ecs.zones);
+	if (ret && sin->sin_family == AF_INET) {
+		/* Only the prefix leaves. */
+		assert_int_equal(ecs.source_len, KR_ECS_SOURCE4);
+		assert_int_equal(ecs.address[3], 0);
+	}
+	return ret;
+}
+
+static void test_ecs_get(void **state)
+{
+	/* Only the servers of the zone and below it get the subnet. */
+	assert_true(sent("192.0.2.1", "\3cdn\7example"));
+	assert_true(sent("192.0.2.1", "\3eu\3cdn\7example"));
+	assert_true(sent("2001:db8::1", "\3cdn\7example"));
+	assert_false(sent("192.0.2.1", ""));
+	assert_false(sent("192.0.2.1", "\7example"));
+	assert_false(sent("192.0.2.1", "\3www\7example"));
+	/* Nor for the local clients. */
+	assert_false(sent("127.0.0.1", "\3cdn\7example"));
+	assert_false(sent("10.1.2.3", "\3cdn\7example"));
+	assert_false(sent("172.16.0.1", "\3cdn\7example"));
+	assert_false(sent("192.168.1.1", "\3cdn\7example"));
+	assert_false(sent("100.64.0.1", "\3cdn\7example"));
+	assert_false(sent("::1", "\3cdn\7example"));
+	assert_false(sent("fd00::1", "\3cdn\7example"));
+	assert_false(sent("fe80::1", "\3cdn\7example"));
+	assert_false(sent("::ffff:192.168.1.1", "\3cdn\7example"));
+	assert_true(sent("172.32.0.1", "\3cdn\7example"));
+	/* The names of the queries may be in any case. */
+	assert_true(sent("192.0.2.1", "\3WWW\3Cdn\7EXAMPLE"));
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_ecs_get),
+	};
+
+	return run_tests(tests);
+}
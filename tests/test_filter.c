@@ -0,0 +1,111 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/filter.h"
+#include "lib/resolve.h"
+#include "lib/rplan.h"
+
+static bool odd_arg(struct kr_request *req, struct kr_query *qry, uint32_t arg)
+{
+	return arg % 2;
+}
+
+static void test_program(void **state)
+{
+	struct kr_filter *f = kr_filter_create(odd_arg);
+	assert_non_null(f);
+	/* Nothing to combine. */
+	assert_int_equal(kr_filter_add(f, 1), 0);
+	assert_int_equal(kr_filter_add(f, 1), kr_error(EEXIST));
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_AND, NULL, 0), kr_error(EINVAL));
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_SRC, "not an address/99", 0), kr_error(EINVAL));
+	assert_int_equal(kr_filter_push(f, 2, KR_FILTER_QTYPE, NULL, 1), kr_error(ENOENT));
+	assert_int_equal(kr_filter_count(f, 2), -1);
+	assert_int_equal(kr_filter_del(f, 1), 0);
+	kr_filter_free(f);
+}
+
+static void test_match(void **state)
+{
+	struct sockaddr_in src = { .sin_family = AF_INET };
+	inet_pton(AF_INET, "192.0.2.1", &src.sin_addr);
+	struct kr_request req;
+	memset(&req, 0, sizeof(req));
+	req.qsource.addr = (struct sockaddr *)&src;
+	struct kr_query qry;
+	memset(&qry, 0, sizeof(qry));
+	qry.sname = (knot_dname_t *)"\3www\7ExAmple\3com";
+	qry.stype = 1;
+	uint32_t id = 0;
+
+	struct kr_filter *f = kr_filter_create(odd_arg);
+	assert_non_null(f);
+	/* 1: qname = example.com AND src = 198.51.100.0/24 */
+	assert_int_equal(kr_filter_add(f, 1), 0);
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_QNAME, "\7example\3com", 0), 0);
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_SRC, "198.51.100.0/24", 0), 0);
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_AND, NULL, 0), 0);
+	/* 2: callback(2) OR qtype = 1 */
+	assert_int_equal(kr_filter_add(f, 2), 0);
+	assert_int_equal(kr_filter_push(f, 2, KR_FILTER_CALLBACK, NULL, 2), 0);
+	assert_int_equal(kr_filter_push(f, 2, KR_FILTER_QTYPE, NULL, 1), 0);
+	assert_int_equal(kr_filter_push(f, 2, KR_FILTER_OR, NULL, 0), 0);
+	/* 3: anything */
+	assert_int_equal(kr_filter_add(f, 3), 0);
+
+	assert_int_equal(kr_filter_match(f, &req, &qry, &id), 0);
+	assert_int_equal(id, 2);
+	assert_int_equal(kr_filter_next(f, &req, &qry, &id), 0);
+	assert_int_equal(id, 3);
+	assert_int_equal(kr_filter_next(f, &req, &qry, &id), kr_error(ENOENT));
+	/* The first one matches when the source does. */
+	assert_int_equal(kr_filter_push(f, 1, KR_FILTER_NOT, NULL, 0), 0);
+	assert_int_equal(kr_filter_match(f, &req, &qry, &id), 0);
+	assert_int_equal(id, 1);
+	assert_int_equal(kr_filter_set_active(f, 1, false), 0);
+	qry.stype = 28;
+	assert_int_equal(kr_filter_match(f, &req, &qry, &id), 0);
+	assert_int_equal(id, 3);
+	assert_int_equal(kr_filter_count(f, 1), 1);
+	assert_int_equal(kr_filter_count(f, 2), 1);
+	assert_int_equal(kr_filter_count(f, 3), 2);
+	/* 4: qname = example.com, alone once the others are deleted */
+	assert_int_equal(kr_filter_add(f, 4), 0);
+	assert_int_equal(kr_filter_push(f, 4, KR_FILTER_QNAME, "\7example\3com", 0), 0);
+	assert_int_equal(kr_filter_del(f, 1), 0);
+	assert_int_equal(kr_filter_del(f, 3), 0);
+	assert_int_equal(kr_filter_del(f, 2), 0);
+	assert_int_equal(kr_filter_match(f, &req, &qry, &id), 0);
+	assert_int_equal(id, 4);
+	/* A name that only ends with the same bytes isn't within the zone. */
+	qry.sname = (knot_dname_t *)"\012badexample\3com";
+	assert_int_equal(kr_filter_match(f, &req, &qry, &id), kr_error(ENOENT));
+	kr_filter_free(f);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_program),
+		unit_test(test_match),
+	};
+
+	return run_tests(tests);
+}
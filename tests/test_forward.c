@@ -0,0 +1,130 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/forward.h"
+#include "lib/resolve.h"
+
+static struct sockaddr_in addr_a, addr_b;
+
+static void init_addrs(void)
+{
+	addr_a.sin_family = addr_b.sin_family = AF_INET;
+	addr_a.sin_port = addr_b.sin_port = htons(53);
+	inet_pton(AF_INET, "192.0.2.1", &addr_a.sin_addr);
+	inet_pton(AF_INET, "192.0.2.2", &addr_b.sin_addr);
+}
+
+static bool is_addr(const union inaddr *ns, const struct sockaddr_in *addr)
+{
+	return ns->ip.sa_family == AF_INET
+		&& ns->ip4.sin_addr.s_addr == addr->sin_addr.s_addr;
+}
+
+static void test_weights(void **state)
+{
+	init_addrs();
+	struct kr_fwd_pool *pool = kr_fwd_pool_create(3, 60000, false);
+	assert_non_null(pool);
+	assert_int_equal(kr_fwd_pool_add(pool, (struct sockaddr *)&addr_a, 3), 0);
+	assert_int_equal(kr_fwd_pool_add(pool, (struct sockaddr *)&addr_b, 1), 0);
+	assert_int_not_equal(kr_fwd_pool_add(pool, (struct sockaddr *)&addr_b, 0), 0);
+
+	struct kr_request req;
+	struct kr_query qry;
+	memset(&req, 0, sizeof(req));
+	memset(&qry, 0, sizeof(qry));
+	req.fwd_pool = pool;
+	int first_a = 0;
+	for (int i = 0; i < 8; ++i) {
+		kr_fwd_pool_order(&req, &qry);
+		first_a += is_addr(&qry.ns.addr[0], &addr_a);
+		/* Both are healthy, so both are tried. */
+		assert_int_equal(qry.ns.addr[1].ip.sa_family, AF_INET);
+		assert_int_equal(qry.ns.addr[2].ip.sa_family, AF_UNSPEC);
+	}
+	assert_int_equal(first_a, 6);
+
+	struct kr_fwd_stats st;
+	assert_int_equal(kr_fwd_pool_stats(pool, 1, &st), 0);
+	assert_int_equal(st.selected, 2);
+	assert_int_equal(kr_fwd_pool_stats(pool, 2, &st), kr_error(ENOENT));
+	kr_fwd_pool_free(pool);
+}
+
+static void test_circuit(void **state)
+{
+	init_addrs();
+	struct kr_fwd_pool *pool = kr_fwd_pool_create(2, 60000, false);
+	kr_fwd_pool_add(pool, (struct sockaddr *)&addr_a, 1);
+	kr_fwd_pool_add(pool, (struct sockaddr *)&addr_b, 1);
+	struct kr_request req;
+	struct kr_query qry;
+	memset(&req, 0, sizeof(req));
+	memset(&qry, 0, sizeof(qry));
+	req.fwd_pool = pool;
+
+	/* Two failures in a row leave it out. */
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_a, kr_error(ETIMEDOUT));
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_a, 20);
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_a, kr_error(ETIMEDOUT));
+	struct kr_fwd_stats st;
+	kr_fwd_pool_stats(pool, 0, &st);
+	assert_true(st.up);
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_a, kr_error(EIO));
+	kr_fwd_pool_stats(pool, 0, &st);
+	assert_false(st.up);
+	assert_int_equal(st.trips, 1);
+	assert_int_equal(st.timeouts, 2);
+	assert_int_equal(st.errors, 1);
+	assert_int_equal(st.srtt_ms, 20);
+
+	for (int i = 0; i < 3; ++i) {
+		kr_fwd_pool_order(&req, &qry);
+		assert_true(is_addr(&qry.ns.addr[0], &addr_b));
+		assert_int_equal(qry.ns.addr[1].ip.sa_family, AF_UNSPEC);
+	}
+	/* With none healthy, all are tried. */
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_b, kr_error(EIO));
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_b, kr_error(EIO));
+	kr_fwd_pool_order(&req, &qry);
+	assert_int_equal(qry.ns.addr[1].ip.sa_family, AF_INET);
+	/* An answer takes it back. */
+	kr_fwd_pool_report(pool, (struct sockaddr *)&addr_a, 10);
+	kr_fwd_pool_order(&req, &qry);
+	assert_true(is_addr(&qry.ns.addr[0], &addr_a));
+	assert_int_equal(qry.ns.addr[1].ip.sa_family, AF_UNSPEC);
+
+	/* A probe asks just the one. */
+	req.fwd_probe = 2;
+	kr_fwd_pool_order(&req, &qry);
+	assert_true(is_addr(&qry.ns.addr[0], &addr_b));
+	assert_int_equal(qry.ns.addr[1].ip.sa_family, AF_UNSPEC);
+	kr_fwd_pool_free(pool);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_weights),
+		unit_test(test_circuit),
+	};
+
+	return run_tests(tests);
+}
@@ -0,0 +1,114 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/localzones.h"
+
+/** Answer the question and return the record of the section, or NULL. */
+static const knot_rrset_t *answer(knot_pkt_t *pkt, const char *qname, uint16_t qtype,
+				  int section)
+{
+	knot_pkt_clear(pkt);
+	assert_int_equal(knot_pkt_put_question(pkt, (const knot_dname_t *)qname,
+					       KNOT_CLASS_IN, qtype), 0);
+	assert_int_equal(kr_localzone_answer(pkt, (const knot_dname_t *)qname, qtype), 0);
+	const knot_pktsection_t *sec = knot_pkt_section(pkt, section);
+	return sec->count > 0 ? knot_pkt_rr(sec, 0) : NULL;
+}
+
+static void test_find(void **state)
+{
+	assert_true(kr_localzone_find((const knot_dname_t *)"\11localhost") >= 0);
+	assert_true(kr_localzone_find((const knot_dname_t *)"\3www\11LocalHost") >= 0);
+	assert_true(kr_localzone_find((const knot_dname_t *)"\1" "5\2" "20\3" "172\7in-addr\4arpa") >= 0);
+	assert_true(kr_localzone_find((const knot_dname_t *)"\3" "127\3" "100\7in-addr\4arpa") >= 0);
+	assert_true(kr_localzone_find((const knot_dname_t *)"\7printer\5local") >= 0);
+	/* Outside of the ranges and zones. */
+	assert_int_equal(kr_localzone_find((const knot_dname_t *)"\2" "32\3" "172\7in-addr\4arpa"),
+			 kr_error(ENOENT));
+	assert_int_equal(kr_localzone_find((const knot_dname_t *)"\3" "128\3" "100\7in-addr\4arpa"),
+			 kr_error(ENOENT));
+	assert_int_equal(kr_localzone_find((const knot_dname_t *)"\14notlocalhost"),
+			 kr_error(ENOENT));
+	assert_int_equal(kr_localzone_find((const knot_dname_t *)"\4arpa"), kr_error(ENOENT));
+	assert_int_equal(kr_localzone_find((const knot_dname_t *)""), kr_error(ENOENT));
+	assert_int_equal(kr_localzone_find(NULL), kr_error(ENOENT));
+}
+
+static void test_answer(void **state)
+{
+	knot_pkt_t *pkt = knot_pkt_new(NULL, KNOT_WIRE_MAX_PKTSIZE, NULL);
+	assert_non_null(pkt);
+	const knot_rrset_t *rr;
+
+	/* Addresses at every name of localhost. */
+	rr = answer(pkt, "\3foo\11localhost", KNOT_RRTYPE_AAAA, KNOT_ANSWER);
+	assert_non_null(rr);
+	assert_int_equal(rr->type, KNOT_RRTYPE_AAAA);
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NOERROR);
+	assert_true(knot_wire_get_aa(pkt->wire));
+	rr = answer(pkt, "\11localhost", KNOT_RRTYPE_NS, KNOT_ANSWER);
+	assert_non_null(rr);
+	assert_int_equal(rr->type, KNOT_RRTYPE_NS);
+	/* NODATA */
+	assert_null(answer(pkt, "\11localhost", KNOT_RRTYPE_MX, KNOT_ANSWER));
+	rr = knot_pkt_rr(knot_pkt_section(pkt, KNOT_AUTHORITY), 0);
+	assert_int_equal(rr->type, KNOT_RRTYPE_SOA);
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NOERROR);
+
+	/* Reverse localhost and its empty non-terminals. */
+	rr = answer(pkt, "\1" "1\1" "0\1" "0\3" "127\7in-addr\4arpa", KNOT_RRTYPE_PTR, KNOT_ANSWER);
+	assert_non_null(rr);
+	assert_int_equal(rr->type, KNOT_RRTYPE_PTR);
+	assert_null(answer(pkt, "\1" "0\3" "127\7in-addr\4arpa", KNOT_RRTYPE_PTR, KNOT_ANSWER));
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NOERROR);
+	assert_null(answer(pkt, "\1" "2\1" "0\1" "0\3" "127\7in-addr\4arpa", KNOT_RRTYPE_PTR,
+			   KNOT_ANSWER));
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NXDOMAIN);
+
+	/* Empty zone: SOA at the apex, NXDOMAIN below with the explanation. */
+	rr = answer(pkt, "\2" "10\7in-addr\4arpa", KNOT_RRTYPE_SOA, KNOT_ANSWER);
+	assert_non_null(rr);
+	assert_int_equal(rr->type, KNOT_RRTYPE_SOA);
+	assert_null(answer(pkt, "\1" "1\2" "10\7in-addr\4arpa", KNOT_RRTYPE_PTR, KNOT_ANSWER));
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NXDOMAIN);
+	rr = knot_pkt_rr(knot_pkt_section(pkt, KNOT_ADDITIONAL), 0);
+	assert_int_equal(rr->type, KNOT_RRTYPE_TXT);
+
+	/* Special-use names don't exist at all. */
+	assert_null(answer(pkt, "\5local", KNOT_RRTYPE_SOA, KNOT_ANSWER));
+	assert_int_equal(knot_wire_get_rcode(pkt->wire), KNOT_RCODE_NXDOMAIN);
+
+	/* Other names are left to the resolution. */
+	knot_pkt_clear(pkt);
+	assert_int_equal(kr_localzone_answer(pkt, (const knot_dname_t *)"\7example", KNOT_RRTYPE_A),
+			 kr_error(ENOENT));
+	assert_int_equal(kr_localzone_answer(NULL, (const knot_dname_t *)"\11localhost",
+					     KNOT_RRTYPE_A), kr_error(EINVAL));
+	knot_pkt_free(&pkt);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_find),
+		unit_test(test_answer),
+	};
+
+	return run_tests(tests);
+}
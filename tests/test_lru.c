@@ -94,6 +94,36 @@ static void test_eviction(void **state)
 	}
 }
 
+static void test_hash(void **state)
+{
+	/* The reference vector of SipHash-2-4: key 00..0f, input 00..0e */
+	uint8_t key[KR_SIPHASH_KEY_SIZE], in[15];
+	for (int i = 0; i < sizeof(key); ++i) {
+		key[i] = i;
+	}
+	for (int i = 0; i < sizeof(in); ++i) {
+		in[i] = i;
+	}
+	assert_true(kr_siphash24(key, in, sizeof(in)) == 0xa129ca6149be45e5ULL);
+	/* The seed matters. */
+	assert_true(kr_hash_short(in, 4, 1) != kr_hash_short(in, 4, 2));
+
+	lru_int_t *lru;
+	lru_create_hash(&lru, HASH_SIZE, NULL, NULL, LRU_HASH_SIPHASH);
+	assert_non_null(lru);
+	for (int i = 0; i < 16; i++) {
+		int *data = lru_get_new(lru, dict[i], KEY_LEN(dict[i]), NULL);
+		assert_non_null(data);
+		*data = i;
+	}
+	for (int i = 0; i < 16; i++) {
+		int *data = lru_get_try(lru, dict[i], KEY_LEN(dict[i]));
+		assert_non_null(data);
+		assert_int_equal(*data, i);
+	}
+	lru_free(lru);
+}
+
 static void test_init(void **state)
 {
 	lru_int_t *lru;
@@ -116,6 +146,7 @@ int main(int argc, char **argv)
 	        unit_test(test_insert),
 		unit_test(test_missing),
 		unit_test(test_eviction),
+		unit_test(test_hash),
 	        group_test_teardown(test_deinit)
 	};
 
@@ -0,0 +1,179 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libknot/descriptor.h>
+#include <contrib/wire.h>
+
+#include "tests/test.h"
+#include "modules/peering/msg.h"
+
+#define NOW 1500000000
+
+static const uint8_t key[KR_SIPHASH_KEY_SIZE] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+static knot_rrset_t rr, rrsig;
+static knot_dname_t owner[KNOT_DNAME_MAXLEN];
+
+/** Compose the datagram of an A RRset with two addresses and a signature. */
+static size_t write_a(uint8_t *msg, const char *name, uint16_t type, uint32_t ttl)
+{
+	knot_rrset_t a, sig;
+	knot_rrset_init(&a, (knot_dname_t *)name, type, KNOT_CLASS_IN);
+	knot_rrset_init(&sig, (knot_dname_t *)name, KNOT_RRTYPE_RRSIG, KNOT_CLASS_IN);
+	const uint8_t addr1[4] = { 192, 0, 2, 1 }, addr2[4] = { 192, 0, 2, 2 };
+	const uint8_t sig_rdata[20] = { 0, KNOT_RRTYPE_A, 8, 2 };
+	assert_int_equal(knot_rrset_add_rdata(&a, addr1, sizeof(addr1), ttl, NULL), 0);
+	assert_int_equal(knot_rrset_add_rdata(&a, addr2, sizeof(addr2), ttl, NULL), 0);
+	assert_int_equal(knot_rrset_add_rdata(&sig, sig_rdata, sizeof(sig_rdata), ttl, NULL), 0);
+	const size_t len = peering_msg_write(msg, key, NOW, &a, &sig);
+	knot_rdataset_clear(&a.rrs, NULL);
+	knot_rdataset_clear(&sig.rrs, NULL);
+	return len;
+}
+
+static void clear(void)
+{
+	knot_rdataset_clear(&rr.rrs, NULL);
+	knot_rdataset_clear(&rrsig.rrs, NULL);
+}
+
+static int read_msg(const uint8_t *msg, size_t len, uint32_t now)
+{
+	clear();
+	return peering_msg_read(msg, len, key, now, 300, owner, &rr, &rrsig, NULL);
+}
+
+static void test_roundtrip(void **state)
+{
+	uint8_t msg[PEERING_MSG_MAX];
+	const size_t len = write_a(msg, "\3WWW\7Example", KNOT_RRTYPE_A, 60);
+	assert_true(len > 0);
+	assert_int_equal(read_msg(msg, len, NOW), 0);
+	/* The owner is lower-cased, the records and the signature are kept. */
+	assert_true(knot_dname_is_equal(rr.owner, (const knot_dname_t *)"\3www\7example"));
+	assert_true(knot_dname_is_equal(rrsig.owner, rr.owner));
+	assert_int_equal(rr.type, KNOT_RRTYPE_A);
+	assert_int_equal(rr.rrs.rr_count, 2);
+	assert_int_equal(rrsig.rrs.rr_count, 1);
+	assert_int_equal(knot_rrset_ttl(&rr), 60);
+	/* The clocks may differ a little. */
+	assert_int_equal(read_msg(msg, len, NOW + PEERING_SKEW), 0);
+	assert_int_equal(read_msg(msg, len, NOW - PEERING_SKEW), 0);
+	clear();
+}
+
+static void test_ttl_capped(void **state)
+{
+	uint8_t msg[PEERING_MSG_MAX];
+	const size_t len = write_a(msg, "\7example", KNOT_RRTYPE_A, 86400);
+	assert_int_equal(read_msg(msg, len, NOW), 0);
+	assert_int_equal(knot_rrset_ttl(&rr), 300);
+	assert_int_equal(knot_rrset_ttl(&rrsig), 300);
+	clear();
+}
+
+static void test_rejected(void **state)
+{
+	uint8_t msg[PEERING_MSG_MAX];
+	const size_t len = write_a(msg, "\7example", KNOT_RRTYPE_A, 60);
+	/* Too old or from the future. */
+	assert_int_equal(read_msg(msg, len, NOW + PEERING_SKEW + 1), kr_error(EBADMSG));
+	assert_int_equal(read_msg(msg, len, NOW - PEERING_SKEW - 1), kr_error(EBADMSG));
+	/* Truncated anywhere. */
+	for (size_t i = 0; i < len; ++i) {
+		assert_int_equal(read_msg(msg, i, NOW), kr_error(EBADMSG));
+	}
+	/* Any changed byte breaks the MAC. */
+	for (size_t i = 0; i < len; ++i) {
+		msg[i] ^= 0x20;
+		assert_int_equal(read_msg(msg, len, NOW), kr_error(EBADMSG));
+		msg[i] ^= 0x20;
+	}
+	/* As does another key. */
+	uint8_t other[KR_SIPHASH_KEY_SIZE] = { 1 };
+	assert_int_equal(peering_msg_read(msg, len, other, NOW, 300, owner, &rr, &rrsig, NULL),
+			 kr_error(EBADMSG));
+	assert_int_equal(read_msg(msg, len, NOW), 0);
+	clear();
+}
+
+static void test_rejected_content(void **state)
+{
+	uint8_t msg[PEERING_MSG_MAX];
+	/* Correctly authenticated, but not a datagram to accept. */
+	size_t len = write_a(msg, "\7example", KNOT_RRTYPE_RRSIG, 60);
+	assert_true(len > 0);
+	assert_int_equal(read_msg(msg, len, NOW), kr_error(EBADMSG));
+	len = write_a(msg, "\7example", KNOT_RRTYPE_OPT, 60);
+	assert_true(len > 0);
+	assert_int_equal(read_msg(msg, len, NOW), kr_error(EBADMSG));
+	/* Another version. */
+	len = write_a(msg, "\7example", KNOT_RRTYPE_A, 60);
+	msg[2] += 1;
+	assert_int_equal(read_msg(msg, len, NOW), kr_error(EBADMSG));
+	clear();
+}
+
+static void test_trailing(void **state)
+{
+	/* An RRset without signatures, followed by a byte the MAC covers too. */
+	uint8_t msg[PEERING_MSG_MAX];
+	knot_rrset_t a;
+	knot_rrset_init(&a, (knot_dname_t *)"\7example", KNOT_RRTYPE_A, KNOT_CLASS_IN);
+	const uint8_t addr[4] = { 192, 0, 2, 1 };
+	assert_int_equal(knot_rrset_add_rdata(&a, addr, sizeof(addr), 60, NULL), 0);
+	size_t len = peering_msg_write(msg, key, NOW, &a, NULL);
+	knot_rdataset_clear(&a.rrs, NULL);
+	assert_true(len > 8);
+	assert_int_equal(read_msg(msg, len, NOW), 0);
+	assert_true(knot_rrset_empty(&rrsig));
+	len -= 8;
+	msg[len++] = 0;
+	wire_write_u64(msg + len, kr_siphash24(key, msg, len));
+	assert_int_equal(read_msg(msg, len + 8, NOW), kr_error(EBADMSG));
+	clear();
+}
+
+static void test_too_large(void **state)
+{
+	uint8_t msg[PEERING_MSG_MAX];
+	knot_rrset_t txt;
+	knot_rrset_init(&txt, (knot_dname_t *)"\7example", KNOT_RRTYPE_TXT, KNOT_CLASS_IN);
+	uint8_t rdata[256] = { 255 };
+	for (int i = 0; i < 20; ++i) {
+		rdata[1] = i;
+		assert_int_equal(knot_rrset_add_rdata(&txt, rdata, sizeof(rdata), 60, NULL), 0);
+	}
+	assert_int_equal(peering_msg_write(msg, key, NOW, &txt, NULL), 0);
+	knot_rdataset_clear(&txt.rrs, NULL);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_roundtrip),
+		unit_test(test_ttl_capped),
+		unit_test(test_rejected),
+		unit_test(test_rejected_content),
+		unit_test(test_trailing),
+		unit_test(test_too_large),
+	};
+
+	return run_tests(tests);
+}
@@ -0,0 +1,116 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "tests/test.h"
+#include "lib/generic/shcounters.h"
+
+#define PROCS 2
+#define SLOTS 4
+
+static void test_register(void **state)
+{
+	shcounters_t *sc = *state;
+	assert_int_equal(shcounters_procs(sc), PROCS);
+	int a = shcounters_register(sc, 0, "answer.total");
+	int b = shcounters_register(sc, 0, "answer.cached");
+	assert_int_equal(a, 0);
+	assert_int_equal(b, 1);
+	/* Names are unique within a process, not across them. */
+	assert_int_equal(shcounters_register(sc, 0, "answer.total"), a);
+	assert_int_equal(shcounters_register(sc, 1, "answer.cached"), 0);
+	assert_int_equal(shcounters_count(sc, 0), 2);
+	assert_int_equal(shcounters_count(sc, 1), 1);
+	assert_string_equal(shcounters_name(sc, 0, b), "answer.cached");
+	assert_null(shcounters_name(sc, 0, 2));
+	assert_null(shcounters_name(sc, PROCS, 0));
+}
+
+static void test_limits(void **state)
+{
+	shcounters_t *sc = *state;
+	char name[SHCOUNTERS_NAME_MAXLEN + 1];
+	memset(name, 'x', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	assert_true(shcounters_register(sc, 1, name) < 0);
+	assert_true(shcounters_register(sc, PROCS, "worker.udp") < 0);
+	for (int i = shcounters_count(sc, 1); i < SLOTS; ++i) {
+		name[0] = 'a' + i;
+		name[1] = '\0';
+		assert_int_equal(shcounters_register(sc, 1, name), i);
+	}
+	assert_int_equal(shcounters_register(sc, 1, "full"), kr_error(ENOSPC));
+}
+
+static void test_set(void **state)
+{
+	shcounters_t *sc = *state;
+	shcounters_set(sc, 0, 0, 42);
+	shcounters_set(sc, 1, 0, 8);
+	assert_int_equal(shcounters_get(sc, 0, 0), 42);
+	assert_int_equal(shcounters_get(sc, 1, 0), 8);
+	/* Unregistered slots are never written. */
+	shcounters_set(sc, 0, 3, 1);
+	assert_int_equal(shcounters_get(sc, 0, 3), 0);
+}
+
+static void test_fork(void **state)
+{
+	shcounters_t *sc = *state;
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0) {
+		int i = shcounters_register(sc, 1, "full");
+		shcounters_set(sc, 1, 0, 1000);
+		_exit(i == kr_error(ENOSPC) ? 0 : 1);
+	}
+	int status = -1;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert_int_equal(shcounters_get(sc, 1, 0), 1000);
+}
+
+static void test_init(void **state)
+{
+	assert_null(shcounters_create(0, SLOTS));
+	assert_null(shcounters_create(PROCS, 0));
+	shcounters_t *sc = shcounters_create(PROCS, SLOTS);
+	assert_non_null(sc);
+	*state = sc;
+}
+
+static void test_deinit(void **state)
+{
+	shcounters_free(*state);
+}
+
+/* Program entry point */
+int main(int argc, char **argv)
+{
+	const UnitTest tests[] = {
+		group_test_setup(test_init),
+		unit_test(test_register),
+		unit_test(test_limits),
+		unit_test(test_set),
+		unit_test(test_fork),
+		group_test_teardown(test_deinit)
+	};
+
+	return run_group_tests(tests);
+}
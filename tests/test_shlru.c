@@ -0,0 +1,159 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "tests/test.h"
+#include "lib/generic/shlru.h"
+
+#define LRU_SIZE 1024
+#define KEY_MAXLEN 32
+#define KEY_LEN(x) (strlen(x) + 1)
+
+static const char *dict[] = {
+	"catagmatic", "prevaricator", "statoscope", "workhand", "benzamide",
+	"alluvia", "fanciful", "bladish", "Tarsius", "unfast", "appropriative",
+	"seraphically", "monkeypod", "deflectometer", "tanglesome", "zodiacal"
+};
+
+static void *map;
+static size_t map_len;
+
+static void test_insert(void **state)
+{
+	shlru_t *lru = *state;
+	int dict_size = sizeof(dict) / sizeof(const char *);
+	for (int i = 0; i < dict_size; i++) {
+		assert_int_equal(shlru_set(lru, dict[i], KEY_LEN(dict[i]), &i), 0);
+	}
+	for (int i = 0; i < dict_size; i++) {
+		int val = -1;
+		assert_int_equal(shlru_get(lru, dict[i], KEY_LEN(dict[i]), &val), 0);
+		assert_int_equal(val, i);
+	}
+	/* Overwrite. */
+	int val = 42;
+	assert_int_equal(shlru_set(lru, dict[0], KEY_LEN(dict[0]), &val), 0);
+	val = -1;
+	assert_int_equal(shlru_get(lru, dict[0], KEY_LEN(dict[0]), &val), 0);
+	assert_int_equal(val, 42);
+}
+
+static void test_missing(void **state)
+{
+	shlru_t *lru = *state;
+	const char *notin = "not in cache";
+	int val = -1;
+	assert_int_equal(shlru_get(lru, notin, KEY_LEN(notin), &val), kr_error(ENOENT));
+	assert_int_equal(val, -1);
+	char key[KEY_MAXLEN + 1] = { 0 };
+	assert_int_equal(shlru_set(lru, key, sizeof(key), &val), kr_error(EINVAL));
+}
+
+static void test_eviction(void **state)
+{
+	shlru_t *lru = *state;
+	char key[16];
+	/* It's lossy, but a frequent key stays. */
+	const char *frequent = "frequent";
+	int val = 7;
+	assert_int_equal(shlru_set(lru, frequent, KEY_LEN(frequent), &val), 0);
+	for (int i = 0; i < 4 * LRU_SIZE; ++i) {
+		test_randstr(key, sizeof(key));
+		int ret = shlru_set(lru, key, sizeof(key), &i);
+		assert_true(ret == 0 || ret == kr_error(ENOSPC));
+		val = -1;
+		assert_int_equal(shlru_get(lru, frequent, KEY_LEN(frequent), &val), 0);
+		assert_int_equal(val, 7);
+	}
+}
+
+static void test_fork(void **state)
+{
+	shlru_t *lru = *state;
+	shlru_reset(lru);
+	int val = -1;
+	assert_int_equal(shlru_get(lru, dict[1], KEY_LEN(dict[1]), &val), kr_error(ENOENT));
+	/* Writers in both processes, to the same keys. */
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	for (int round = 0; round < 1000; ++round) {
+		for (int i = 0; i < 8; ++i) {
+			int ret = shlru_set(lru, dict[i], KEY_LEN(dict[i]), &i);
+			if (ret != 0 && ret != kr_error(EAGAIN) && ret != kr_error(ENOSPC)) {
+				if (pid == 0) {
+					_exit(1);
+				}
+				fail();
+			}
+		}
+	}
+	if (pid == 0) {
+		_exit(0);
+	}
+	int status = -1;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	/* Both wrote the same values, the readers never see a torn one. */
+	for (int i = 0; i < 8; ++i) {
+		val = -1;
+		int ret = shlru_get(lru, dict[i], KEY_LEN(dict[i]), &val);
+		assert_true(ret == 0 || ret == kr_error(ENOENT));
+		if (ret == 0) {
+			assert_int_equal(val, i);
+		}
+	}
+	/* Attaching to the same block gives the same cache. */
+	assert_ptr_equal(shlru_attach(map, map_len), lru);
+}
+
+static void test_init(void **state)
+{
+	assert_int_equal(shlru_mem_size(LRU_SIZE, KEY_MAXLEN, SHLRU_VAL_MAXLEN + 1), 0);
+	map_len = shlru_mem_size(LRU_SIZE, KEY_MAXLEN, sizeof(int));
+	assert_true(map_len > 0);
+	map = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	assert_true(map != MAP_FAILED);
+	assert_null(shlru_attach(map, map_len));
+	assert_null(shlru_init(map, map_len - 1, LRU_SIZE, KEY_MAXLEN, sizeof(int)));
+	shlru_t *lru = shlru_init(map, map_len, LRU_SIZE, KEY_MAXLEN, sizeof(int));
+	assert_non_null(lru);
+	assert_true(shlru_capacity(lru) >= LRU_SIZE);
+	*state = lru;
+}
+
+static void test_deinit(void **state)
+{
+	munmap(map, map_len);
+}
+
+/* Program entry point */
+int main(int argc, char **argv)
+{
+	const UnitTest tests[] = {
+		group_test_setup(test_init),
+		unit_test(test_insert),
+		unit_test(test_missing),
+		unit_test(test_eviction),
+		unit_test(test_fork),
+		group_test_teardown(test_deinit)
+	};
+
+	return run_group_tests(tests);
+}
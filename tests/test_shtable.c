@@ -0,0 +1,117 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "tests/test.h"
+#include "lib/generic/shtable.h"
+
+#define TABLE_SIZE 1024
+#define KEY_LEN(x) (strlen(x) + 1)
+
+static const char *dict[] = {
+	"catagmatic", "prevaricator", "statoscope", "workhand", "benzamide",
+	"alluvia", "fanciful", "bladish", "Tarsius", "unfast", "appropriative",
+	"seraphically", "monkeypod", "deflectometer", "tanglesome", "zodiacal"
+};
+
+static void test_insert(void **state)
+{
+	shtable_t *tbl = *state;
+	int dict_size = sizeof(dict) / sizeof(const char *);
+	for (int i = 0; i < dict_size; i++) {
+		assert_int_equal(shtable_set(tbl, dict[i], KEY_LEN(dict[i]), &i), 0);
+	}
+	for (int i = 0; i < dict_size; i++) {
+		int val = -1;
+		assert_int_equal(shtable_get(tbl, dict[i], KEY_LEN(dict[i]), &val), 0);
+		assert_int_equal(val, i);
+	}
+}
+
+static void test_missing(void **state)
+{
+	shtable_t *tbl = *state;
+	const char *notin = "not in table";
+	int val = -1;
+	assert_int_equal(shtable_get(tbl, notin, KEY_LEN(notin), &val), kr_error(ENOENT));
+	assert_int_equal(val, -1);
+}
+
+static void test_eviction(void **state)
+{
+	shtable_t *tbl = *state;
+	char key[16];
+	for (int i = 0; i < 4 * TABLE_SIZE; ++i) {
+		test_randstr(key, sizeof(key));
+		assert_int_equal(shtable_set(tbl, key, sizeof(key), &i), 0);
+		int val = -1;
+		assert_int_equal(shtable_get(tbl, key, sizeof(key), &val), 0);
+		assert_int_equal(val, i);
+	}
+}
+
+static void test_fork(void **state)
+{
+	shtable_t *tbl = *state;
+	const char *key = "shared";
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0) {
+		int val = 42;
+		_exit(shtable_set(tbl, key, KEY_LEN(key), &val) == 0 ? 0 : 1);
+	}
+	int status = -1;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	int val = -1;
+	assert_int_equal(shtable_get(tbl, key, KEY_LEN(key), &val), 0);
+	assert_int_equal(val, 42);
+	/* Clearing is visible as well. */
+	shtable_clear(tbl);
+	assert_int_equal(shtable_get(tbl, key, KEY_LEN(key), &val), kr_error(ENOENT));
+}
+
+static void test_init(void **state)
+{
+	assert_null(shtable_create(TABLE_SIZE, SHTABLE_VAL_MAXLEN + 1));
+	shtable_t *tbl = shtable_create(TABLE_SIZE - 1, sizeof(int));
+	assert_non_null(tbl);
+	assert_int_equal(shtable_capacity(tbl), TABLE_SIZE);
+	*state = tbl;
+}
+
+static void test_deinit(void **state)
+{
+	shtable_free(*state);
+}
+
+/* Program entry point */
+int main(int argc, char **argv)
+{
+	const UnitTest tests[] = {
+		group_test_setup(test_init),
+		unit_test(test_insert),
+		unit_test(test_missing),
+		unit_test(test_eviction),
+		unit_test(test_fork),
+		group_test_teardown(test_deinit)
+	};
+
+	return run_group_tests(tests);
+}
@@ -0,0 +1,144 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/generic/timer_wheel.h"
+
+#define TIMERS 512
+
+struct fired {
+	uint64_t now;   /**< The time the wheel is run at */
+	uint64_t at[TIMERS];
+	unsigned count[TIMERS];
+	struct tw_timer timers[TIMERS];
+	struct tw_timer *stop; /**< Stop this one from the callback */
+};
+
+static struct fired f;
+static uint64_t armed_at;
+
+static void arm_cb(struct timer_wheel *wheel, uint64_t at)
+{
+	armed_at = at;
+}
+
+static void fire_cb(struct tw_timer *timer)
+{
+	const int i = timer - f.timers;
+	f.at[i] = f.now;
+	f.count[i] += 1;
+	if (f.stop && f.stop != timer) {
+		tw_stop(f.stop);
+	}
+}
+
+static void test_random(void **state)
+{
+	struct timer_wheel wheel;
+	const uint64_t start = 1000;
+	tw_init(&wheel, start, arm_cb, NULL);
+	memset(&f, 0, sizeof(f));
+	uint64_t expect[TIMERS];
+	for (int i = 0; i < TIMERS; ++i) {
+		/* From a few ticks over the level boundaries up to beyond the span. */
+		const uint64_t timeout = (uint64_t)rand() % (1 << (rand() % 28));
+		tw_start(&wheel, &f.timers[i], fire_cb, start, timeout, 0);
+		expect[i] = start + timeout;
+	}
+	assert_int_equal(wheel.count, TIMERS);
+	/* Run the wheel only when it asks to, none may be late or early. */
+	while (wheel.count > 0) {
+		assert_true(armed_at != UINT64_MAX);
+		f.now = armed_at;
+		tw_run(&wheel, f.now);
+	}
+	assert_int_equal(armed_at, UINT64_MAX);
+	for (int i = 0; i < TIMERS; ++i) {
+		assert_int_equal(f.count[i], 1);
+		assert_int_equal(f.at[i], expect[i]);
+	}
+}
+
+static void test_jump(void **state)
+{
+	struct timer_wheel wheel;
+	tw_init(&wheel, 0, arm_cb, NULL);
+	memset(&f, 0, sizeof(f));
+	for (int i = 0; i < TIMERS; ++i) {
+		tw_start(&wheel, &f.timers[i], fire_cb, 0, i * 1000, 0);
+	}
+	/* A late run fires all those expired, once. */
+	f.now = 200500;
+	tw_run(&wheel, f.now);
+	for (int i = 0; i < TIMERS; ++i) {
+		assert_int_equal(f.count[i], i <= 200 ? 1 : 0);
+	}
+	assert_true(armed_at > f.now && armed_at <= 201000);
+	assert_int_equal(wheel.count, TIMERS - 201);
+}
+
+static void test_stop_repeat(void **state)
+{
+	struct timer_wheel wheel;
+	tw_init(&wheel, 0, arm_cb, NULL);
+	memset(&f, 0, sizeof(f));
+	assert_int_equal(tw_again(&f.timers[0], 0), kr_error(EINVAL));
+	tw_start(&wheel, &f.timers[0], fire_cb, 0, 10, 0);
+	tw_start(&wheel, &f.timers[1], fire_cb, 0, 10, 0);
+	tw_start(&wheel, &f.timers[2], fire_cb, 0, 5, 100);
+	assert_int_equal(armed_at, 5);
+	/* Stopped from the callback of another one in the same tick. */
+	f.stop = &f.timers[0];
+	tw_stop(&f.timers[1]);
+	tw_start(&wheel, &f.timers[1], fire_cb, 0, 10, 0);
+	for (f.now = 0; f.now <= 400; ++f.now) {
+		tw_run(&wheel, f.now);
+	}
+	assert_int_equal(f.count[0], 0);
+	assert_int_equal(f.count[1], 1);
+	assert_int_equal(f.count[2], 4);
+	assert_int_equal(f.at[2], 305);
+	assert_false(tw_active(&f.timers[0]));
+	assert_false(tw_active(&f.timers[1]));
+	assert_true(tw_active(&f.timers[2]));
+	/* Pushed back by the repeat interval. */
+	assert_int_equal(tw_again(&f.timers[2], 450), 0);
+	f.stop = NULL;
+	for (; f.now <= 600; ++f.now) {
+		tw_run(&wheel, f.now);
+	}
+	assert_int_equal(f.count[2], 5);
+	assert_int_equal(f.at[2], 550);
+	tw_stop(&f.timers[2]);
+	assert_int_equal(wheel.count, 0);
+	assert_int_equal(wheel.cancelled[4], 2);  /* both stops of the timers of 10 */
+	assert_int_equal(wheel.cancelled[7], 2);  /* tw_again() and stop of the repeating one */
+	assert_int_equal(wheel.expired[3], 1);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_random),
+		unit_test(test_jump),
+		unit_test(test_stop_repeat),
+	};
+
+	return run_tests(tests);
+}
@@ -0,0 +1,128 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/generic/topk.h"
+
+#define KEY_LEN(x) (strlen(x) + 1)
+
+struct walk_baton {
+	unsigned len;
+	const char *keys[8];
+	uint64_t counts[8];
+	uint64_t errors[8];
+};
+
+static int walk_cb(const void *key, uint32_t key_len, uint64_t count, uint64_t error, void *baton)
+{
+	struct walk_baton *b = baton;
+	if (b->len < 8) {
+		b->keys[b->len] = key;
+		b->counts[b->len] = count;
+		b->errors[b->len] = error;
+	}
+	b->len += 1;
+	return 0;
+}
+
+static void test_exact(void **state)
+{
+	topk_t *tk = topk_create(4, 16);
+	assert_non_null(tk);
+	const char *dict[] = { "one", "two", "three" };
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j <= i; ++j) {
+			assert_int_equal(topk_add(tk, dict[i], KEY_LEN(dict[i]), 1, 0), 0);
+		}
+	}
+	assert_int_equal(topk_add(tk, "way too long a key", 19, 1, 0), kr_error(EINVAL));
+	assert_int_equal(topk_len(tk), 3);
+	/* Nothing was evicted, so the counts are exact and from the most frequent. */
+	struct walk_baton b = { 0 };
+	assert_int_equal(topk_walk(tk, walk_cb, &b), 0);
+	assert_int_equal(b.len, 3);
+	assert_string_equal(b.keys[0], "three");
+	assert_int_equal(b.counts[0], 3);
+	assert_int_equal(b.errors[0], 0);
+	assert_string_equal(b.keys[2], "one");
+	assert_int_equal(b.counts[2], 1);
+	topk_clear(tk);
+	assert_int_equal(topk_len(tk), 0);
+	topk_free(tk);
+}
+
+static void test_heavy(void **state)
+{
+	topk_t *tk = topk_create(8, 16);
+	assert_non_null(tk);
+	/* A heavy hitter among many keys occurring once. */
+	char key[16];
+	unsigned total = 0;
+	for (int i = 0; i < 1000; ++i) {
+		snprintf(key, sizeof(key), "k%d", i);
+		assert_int_equal(topk_add(tk, key, KEY_LEN(key), 1, 0), 0);
+		total += 1;
+		if (i % 4 == 0) {
+			assert_int_equal(topk_add(tk, "heavy", KEY_LEN("heavy"), 1, 0), 0);
+			total += 1;
+		}
+	}
+	assert_int_equal(topk_len(tk), 8);
+	struct walk_baton b = { 0 };
+	assert_int_equal(topk_walk(tk, walk_cb, &b), 0);
+	assert_string_equal(b.keys[0], "heavy");
+	/* Never below the real count, at most N / size above it. */
+	assert_true(b.counts[0] >= 250);
+	assert_true(b.counts[0] - b.errors[0] <= 250);
+	assert_true(b.errors[0] <= total / 8);
+	topk_free(tk);
+}
+
+static void test_merge(void **state)
+{
+	topk_t *a = topk_create(4, 16), *b = topk_create(4, 16);
+	assert_non_null(a);
+	assert_non_null(b);
+	assert_int_equal(topk_add(a, "x", 2, 5, 0), 0);
+	assert_int_equal(topk_add(a, "y", 2, 1, 0), 0);
+	assert_int_equal(topk_add(b, "x", 2, 3, 1), 0);
+	assert_int_equal(topk_add(b, "z", 2, 4, 0), 0);
+	assert_int_equal(topk_merge(a, b), 0);
+	struct walk_baton w = { 0 };
+	assert_int_equal(topk_walk(a, walk_cb, &w), 0);
+	assert_int_equal(w.len, 3);
+	assert_string_equal(w.keys[0], "x");
+	assert_int_equal(w.counts[0], 8);
+	assert_int_equal(w.errors[0], 1);
+	assert_string_equal(w.keys[1], "z");
+	assert_int_equal(w.counts[1], 4);
+	topk_free(a);
+	topk_free(b);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_exact),
+		unit_test(test_heavy),
+		unit_test(test_merge),
+	};
+
+	return run_tests(tests);
+}
@@ -0,0 +1,129 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/rplan.h"
+#include "lib/trace.h"
+
+#define LINES 128
+
+struct dumped {
+	int count;
+	char line[LINES][4096];
+};
+
+static struct dumped d;
+
+static void dump_cb(const char *line, void *baton)
+{
+	struct dumped *out = baton;
+	assert_true(out->count < LINES);
+	snprintf(out->line[out->count++], sizeof(out->line[0]), "%s", line);
+}
+
+static void record(struct kr_trace_ring *ring, const struct kr_query *qry,
+		   const char *source, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	kr_trace_vrecord(ring, qry, source, fmt, args);
+	va_end(args);
+}
+
+static void test_format(void **state)
+{
+	assert_null(kr_trace_ring_new(NULL, 512));
+	struct kr_trace_ring *ring = kr_trace_ring_new(NULL, 4096);
+	assert_non_null(ring);
+	struct kr_query parent = { .id = 1234 };
+	struct kr_query qry = { .id = 5678, .parent = &parent };
+	record(ring, &qry, "iter", "<= %s, %d%% %5.2f %-*s| %hu %zu %llx %c %p\n",
+	       "NOERROR", 50, 3.14159, 6, "ab", (unsigned short)65535, (size_t)7,
+	       0xdeadbeefULL, 'x', (void *)0x10);
+	record(ring, NULL, "resl", "plain\n");
+
+	/* Formatted just as the verbose log would print them. */
+	char expect[512];
+	snprintf(expect, sizeof(expect), "[%5hu][%s] %*s<= %s, %d%% %5.2f %-*s| %hu %zu %llx %c %p\n",
+		 5678, "iter", 4, "", "NOERROR", 50, 3.14159, 6, "ab", (unsigned short)65535,
+		 (size_t)7, 0xdeadbeefULL, 'x', (void *)0x10);
+	memset(&d, 0, sizeof(d));
+	assert_int_equal(kr_trace_dump(ring, dump_cb, &d), 2);
+	assert_int_equal(d.count, 2);
+	assert_string_equal(d.line[0], expect);
+	assert_string_equal(d.line[1], "[    0][resl] plain\n");
+	free(ring);
+}
+
+static void test_wrap(void **state)
+{
+	struct kr_trace_ring *ring = kr_trace_ring_new(NULL, 4096);
+	assert_non_null(ring);
+	struct kr_query qry = { .id = 1234 };
+	char pad[300];
+	memset(pad, 'z', sizeof(pad));
+	pad[sizeof(pad) - 1] = '\0';
+	/* Records of various lengths, wrapping around many times. */
+	for (int i = 0; i < 10000; ++i) {
+		if (i % 7 == 0) {
+			record(ring, &qry, "test", "%d %s\n", i, pad + i % 250);
+		} else {
+			record(ring, &qry, "test", "%d\n", i);
+		}
+	}
+	assert_true(ring->dropped > 0);
+
+	/* The newest records are kept, in order. */
+	memset(&d, 0, sizeof(d));
+	assert_int_equal(kr_trace_dump(ring, dump_cb, &d), d.count);
+	assert_true(d.count > 0);
+	assert_int_equal(d.count, ring->count);
+	int last = 0;
+	for (int i = 0; i < d.count; ++i) {
+		int val = atoi(d.line[i] + strlen("[ 1234][test] "));
+		if (i > 0) {
+			assert_int_equal(val, last + 1);
+		}
+		last = val;
+	}
+	assert_int_equal(last, 9999);
+
+	/* A string over the record limit is cut, the record is kept. */
+	char huge[5000];
+	memset(huge, 'y', sizeof(huge));
+	huge[sizeof(huge) - 1] = '\0';
+	record(ring, NULL, "test", "%s\n", huge);
+	memset(&d, 0, sizeof(d));
+	kr_trace_dump(ring, dump_cb, &d);
+	const char *line = d.line[d.count - 1];
+	assert_true(strlen(line) > 100 && strlen(line) < sizeof(huge));
+	assert_int_equal(strncmp(line, "[    0][test] yyyy", 18), 0);
+	free(ring);
+}
+
+int main(void)
+{
+	const UnitTest tests[] = {
+		unit_test(test_format),
+		unit_test(test_wrap),
+	};
+
+	return run_tests(tests);
+}
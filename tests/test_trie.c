@@ -0,0 +1,290 @@
+/*  Copyright (C) 2018 CZ.NIC, z.s.p.o. <knot-dns@labs.nic.cz>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tests/test.h"
+#include "lib/generic/trie.h"
+
+static const char *dict[] = {
+	"catagmatic", "prevaricator", "statoscope", "workhand", "benzamide",
+	"alluvia", "fanciful", "bladish", "Tarsius", "unfast", "appropriative",
+	"seraphically", "monkeypod", "deflectometer", "tanglesome", "zodiacal",
+	"physiologically", "economizer", "forcepslike", "betrumpet",
+	"work", "workhands", "w", "", "pre", "prevaricators"
+};
+#define DICT_SIZE (sizeof(dict) / sizeof(dict[0]))
+
+/* Keys that aren't in the trie, some of them prefixes of those that are. */
+static const char *missing[] = {
+	"cat", "prevaricatorx", "statoscopes", "wor", "zz", "Tarsiu", "a"
+};
+#define MISSING_SIZE (sizeof(missing) / sizeof(missing[0]))
+
+static int key_cmp(const void *a, const void *b)
+{
+	const char *k1 = *(const char **)a, *k2 = *(const char **)b;
+	size_t l1 = strlen(k1), l2 = strlen(k2);
+	int ret = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+	return ret ? ret : (l1 > l2) - (l1 < l2);
+}
+
+static void test_insert(void **state)
+{
+	trie_t *t = *state;
+	for (uintptr_t i = 0; i < DICT_SIZE; ++i) {
+		trie_val_t *val = trie_get_ins(t, dict[i], strlen(dict[i]));
+		assert_non_null(val);
+		*val = (void *)(i + 1);
+	}
+	assert_int_equal(trie_weight(t), DICT_SIZE);
+}
+
+static void test_get_many(void **state)
+{
+	trie_t *t = *state;
+	const char *keys[DICT_SIZE + MISSING_SIZE];
+	uint32_t lens[DICT_SIZE + MISSING_SIZE];
+	trie_val_t *vals[DICT_SIZE + MISSING_SIZE];
+	const size_t n = DICT_SIZE + MISSING_SIZE;
+	memcpy(keys, dict, sizeof(dict));
+	memcpy(keys + DICT_SIZE, missing, sizeof(missing));
+
+	/* Any order gives the same results as separate lookups, sorted or not. */
+	for (int sorted = 0; sorted < 2; ++sorted) {
+		if (sorted) {
+			qsort(keys, n, sizeof(keys[0]), key_cmp);
+		}
+		for (size_t i = 0; i < n; ++i) {
+			lens[i] = strlen(keys[i]);
+		}
+		assert_int_equal(trie_get_many(t, keys, lens, n, vals), DICT_SIZE);
+		for (size_t i = 0; i < n; ++i) {
+			trie_val_t *val = trie_get_try(t, keys[i], lens[i]);
+			assert_true(vals[i] == val);
+		}
+	}
+	/* A single key, and none. */
+	assert_int_equal(trie_get_many(t, keys, lens, 1, vals), 1);
+	assert_non_null(vals[0]);
+	assert_int_equal(trie_get_many(t, NULL, NULL, 0, NULL), 0);
+}
+
+static void test_get_many_small(void **state)
+{
+	trie_t *t = trie_create(NULL);
+	const char *keys[] = { "a", "b" };
+	uint32_t lens[] = { 1, 1 };
+	trie_val_t *vals[2];
+	/* Empty trie and a trie with the root being a leaf. */
+	assert_int_equal(trie_get_many(t, keys, lens, 2, vals), 0);
+	assert_null(vals[0]);
+	assert_null(vals[1]);
+	*trie_get_ins(t, "b", 1) = (void *)1;
+	assert_int_equal(trie_get_many(t, keys, lens, 2, vals), 1);
+	assert_null(vals[0]);
+	assert_true(*vals[1] == (void *)1);
+	trie_free(t);
+}
+
+/* Less-or-equal lookups and iterating from a key, also with bytes above 0x7f. */
+static void test_leq_geq(void **state)
+{
+	trie_t *t = trie_create(NULL);
+	const char *keys[] = { "a", "ab", "a\x80", "b\xff", "c" };
+	for (uintptr_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+		*trie_get_ins(t, keys[i], strlen(keys[i])) = (void *)(i + 1);
+	}
+	trie_val_t *val;
+	assert_int_equal(trie_get_leq(t, "", 0, &val), KNOT_ENOENT);
+	assert_int_equal(trie_get_leq(t, "ab", 2, &val), 0);
+	assert_true(*val == (void *)2);
+	assert_int_equal(trie_get_leq(t, "a\xff", 2, &val), 1);
+	assert_true(*val == (void *)3);
+	assert_int_equal(trie_get_leq(t, "b\xfe", 2, &val), 1);
+	assert_true(*val == (void *)3);
+	assert_int_equal(trie_get_leq(t, "z", 1, &val), 1);
+	assert_true(*val == (void *)5);
+
+	trie_it_t *it = trie_it_begin_geq(t, "aa", 2);
+	assert_non_null(it);
+	assert_true(*trie_it_val(it) == (void *)2);
+	trie_it_next(it);
+	assert_true(*trie_it_val(it) == (void *)3);
+	trie_it_free(it);
+	it = trie_it_begin_geq(t, "", 0);
+	assert_true(*trie_it_val(it) == (void *)1);
+	trie_it_free(it);
+	it = trie_it_begin_geq(t, "b\xff", 2);
+	assert_true(*trie_it_val(it) == (void *)4);
+	trie_it_free(it);
+	it = trie_it_begin_geq(t, "c\x01", 2);
+	assert_true(trie_it_finished(it));
+	trie_it_free(it);
+	it = trie_it_begin_leq(t, "b", 1);
+	assert_true(*trie_it_val(it) == (void *)3);
+	trie_it_next(it);
+	assert_true(*trie_it_val(it) == (void *)4);
+	trie_it_free(it);
+	it = trie_it_begin_leq(t, "", 0);
+	assert_true(trie_it_finished(it));
+	trie_it_free(it);
+	trie_free(t);
+}
+
+/* Longest-prefix lookups, as used for the longest matching name in lookup format. */
+static void test_prefix(void **state)
+{
+	trie_t *t = trie_create(NULL);
+	const char *keys[] = { "", "com\0", "com\0example\0", "org\0" };
+	const uint32_t lens[] = { 0, 4, 12, 4 };
+	for (uintptr_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+		*trie_get_ins(t, keys[i], lens[i]) = (void *)(i + 1);
+	}
+	uint32_t plen = 0;
+	trie_val_t *val = trie_get_prefix(t, "com\0example\0www\0", 17, &plen);
+	assert_true(val && *val == (void *)3);
+	assert_int_equal(plen, 12);
+	val = trie_get_prefix(t, "com\0examples\0", 13, &plen);
+	assert_true(val && *val == (void *)2);
+	assert_int_equal(plen, 4);
+	val = trie_get_prefix(t, "com\0", 4, NULL);
+	assert_true(val && *val == (void *)2);
+	val = trie_get_prefix(t, "net\0", 4, &plen);
+	assert_true(val && *val == (void *)1);
+	assert_int_equal(plen, 0);
+	trie_del(t, "", 0, NULL);
+	assert_null(trie_get_prefix(t, "co", 2, NULL));
+	assert_null(trie_get_prefix(t, "net\0", 4, NULL));
+	trie_free(t);
+}
+
+/* Build a trie of random keys in both modes, and delete every other key. */
+static void test_arena(void **state)
+{
+	trie_t *plain = trie_create(NULL), *arena = trie_create_arena(NULL);
+	assert_non_null(plain);
+	assert_non_null(arena);
+	char keys[2000][9];
+	for (uintptr_t i = 0; i < 2000; ++i) {
+		test_randstr(keys[i], 1 + i % sizeof(keys[i]));
+		*trie_get_ins(plain, keys[i], strlen(keys[i])) = (void *)(i + 1);
+		*trie_get_ins(arena, keys[i], strlen(keys[i])) = (void *)(i + 1);
+	}
+	for (size_t i = 0; i < 2000; i += 2) {
+		trie_del(plain, keys[i], strlen(keys[i]), NULL);
+		trie_del(arena, keys[i], strlen(keys[i]), NULL);
+	}
+	assert_int_equal(trie_weight(arena), trie_weight(plain));
+	for (size_t i = 0; i < 2000; ++i) {
+		trie_val_t *v1 = trie_get_try(plain, keys[i], strlen(keys[i]));
+		trie_val_t *v2 = trie_get_try(arena, keys[i], strlen(keys[i]));
+		assert_true((v1 == NULL) == (v2 == NULL));
+		assert_true(!v1 || *v1 == *v2);
+	}
+	/* The freed nodes are reused. */
+	for (size_t i = 0; i < 2000; i += 2) {
+		*trie_get_ins(arena, keys[i], strlen(keys[i])) = (void *)1;
+	}
+	trie_clear(arena);
+	assert_int_equal(trie_weight(arena), 0);
+	assert_null(trie_get_try(arena, keys[1], strlen(keys[1])));
+	*trie_get_ins(arena, "a", 1) = (void *)1;
+	assert_int_equal(trie_weight(arena), 1);
+	trie_free(arena);
+	trie_free(plain);
+}
+
+static int frozen_check(const char *key, uint32_t len, trie_val_t val, void *d)
+{
+	trie_t *t = d;
+	trie_val_t *orig = trie_get_try(t, key, len);
+	assert_non_null(orig);
+	assert_true(*orig == val);
+	return 0;
+}
+
+static void test_freeze(void **state)
+{
+	trie_t *t = *state;
+	size_t len = trie_freeze_size(t);
+	assert_true(len > 0);
+	uint64_t *mem = malloc(len), *moved = malloc(len);
+	assert_non_null(mem);
+	assert_non_null(moved);
+	assert_null(trie_freeze(t, mem, len - 1));
+	assert_non_null(trie_freeze(t, mem, len));
+	/* It stays valid when moved elsewhere. */
+	memcpy(moved, mem, len);
+	memset(mem, 0, len);
+	free(mem);
+	assert_null(trie_frozen_attach(moved, len - 1));
+	const trie_frozen_t *fz = trie_frozen_attach(moved, len);
+	assert_non_null(fz);
+	assert_int_equal(trie_frozen_weight(fz), trie_weight(t));
+	for (size_t i = 0; i < DICT_SIZE; ++i) {
+		const trie_val_t *val = trie_frozen_get_try(fz, dict[i], strlen(dict[i]));
+		assert_non_null(val);
+		assert_true(*val == *trie_get_try(t, dict[i], strlen(dict[i])));
+	}
+	for (size_t i = 0; i < MISSING_SIZE; ++i) {
+		assert_null(trie_frozen_get_try(fz, missing[i], strlen(missing[i])));
+	}
+	assert_int_equal(trie_frozen_apply(fz, frozen_check, t), 0);
+	free(moved);
+
+	/* An empty trie freezes, too. */
+	trie_t *empty = trie_create(NULL);
+	uint64_t empty_mem[8];
+	len = trie_freeze_size(empty);
+	assert_true(len > 0 && len <= sizeof(empty_mem));
+	assert_non_null(trie_freeze(empty, empty_mem, len));
+	fz = trie_frozen_attach(empty_mem, len);
+	assert_non_null(fz);
+	assert_int_equal(trie_frozen_weight(fz), 0);
+	assert_null(trie_frozen_get_try(fz, "a", 1));
+	trie_free(empty);
+}
+
+static void test_trie_setup(void **state)
+{
+	*state = trie_create(NULL);
+	assert_non_null(*state);
+}
+
+static void test_trie_teardown(void **state)
+{
+	trie_free(*state);
+}
+
+int main(int argc, char **argv)
+{
+	const UnitTest tests[] = {
+		group_test_setup(test_trie_setup),
+		unit_test(test_insert),
+		unit_test(test_get_many),
+		unit_test(test_get_many_small),
+		unit_test(test_leq_geq),
+		unit_test(test_prefix),
+		unit_test(test_arena),
+		unit_test(test_freeze),
+		group_test_teardown(test_trie_teardown)
+	};
+
+	return run_group_tests(tests);
+}
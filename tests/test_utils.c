@@ -15,7 +15,10 @@
  */
 
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <contrib/cleanup.h>
 
 #include "tests/test.h"
@@ -79,11 +82,200 @@ static void test_straddr(void **state)
 	assert_int_not_equal(test_bitcmp(ip6_sub, ip6_out, 4), 0);
 }
 
+static void test_suffixes(void **state)
+{
+	const knot_dname_t *com = (const uint8_t *)"\3com";
+	const knot_dname_t *example = (const uint8_t *)"\7example\3com";
+	const knot_dname_t *www = (const uint8_t *)"\3www\7ExaMPle\3COM";
+	const knot_dname_t *other = (const uint8_t *)"\5other\3com";
+	/* A zero byte in a label must not end a suffix early. */
+	const knot_dname_t *tricky = (const uint8_t *)"\013example\0com\3com";
+	uint32_t ids[4];
+	trie_t *sfx = kr_suffixes_create();
+	assert_non_null(sfx);
+	assert_int_equal(kr_suffixes_add(sfx, example, 1), 0);
+	assert_int_equal(kr_suffixes_add(sfx, example, 1), 0);
+	assert_int_equal(kr_suffixes_add(sfx, com, 2), 0);
+	assert_int_equal(kr_suffixes_add(sfx, (const uint8_t *)"", 3), 0);
+	assert_int_equal(kr_suffixes_add(sfx, com, 1), 0);
+	/* Case-insensitive, each id once. */
+	assert_int_equal(kr_suffixes_match(sfx, www, ids, 4), 3);
+	assert_int_equal(kr_suffixes_match(sfx, other, ids, 4), 3);
+	assert_int_equal(kr_suffixes_match(sfx, (const uint8_t *)"\3org", ids, 4), 1);
+	assert_int_equal(ids[0], 3);
+	assert_int_equal(kr_suffixes_match(sfx, www, ids, 2), kr_error(ENOSPC));
+	kr_suffixes_del(sfx, 3);
+	kr_suffixes_del(sfx, 2);
+	assert_int_equal(kr_suffixes_match(sfx, (const uint8_t *)"\3org", ids, 4), 0);
+	kr_suffixes_del(sfx, 1);
+	assert_int_equal(kr_suffixes_match(sfx, www, ids, 4), 0);
+	assert_int_equal(kr_suffixes_add(sfx, example, 4), 0);
+	assert_int_equal(kr_suffixes_match(sfx, tricky, ids, 4), 0);
+	assert_int_equal(kr_suffixes_match(sfx, www, ids, 4), 1);
+	assert_int_equal(ids[0], 4);
+	kr_suffixes_free(sfx);
+}
+
+static void test_lf_name(void **state)
+{
+	struct kr_lf_name lf;
+	assert_int_equal(kr_lf_name_init(&lf, (const uint8_t *)"\3www\7example\3com"), 0);
+	assert_int_equal(lf.labels, 3);
+	assert_int_equal(lf.lf[0], 16);
+	assert_memory_equal(lf.lf + 1, "com\0example\0www\0", 16);
+	/* The suffixes are the prefixes of the lookup format. */
+	assert_int_equal(lf.suffix_len[0], 0);
+	assert_int_equal(lf.suffix_len[1], 4);
+	assert_int_equal(lf.suffix_len[2], 12);
+	assert_int_equal(lf.suffix_len[3], 16);
+	assert_false(lf.has_zero);
+	assert_int_equal(kr_lf_name_init(&lf, (const uint8_t *)""), 0);
+	assert_int_equal(lf.labels, 0);
+	assert_int_equal(lf.lf[0], 0);
+	assert_int_equal(kr_lf_name_init(&lf, (const uint8_t *)"\3a\0b\3com"), 0);
+	assert_int_equal(lf.suffix_len[1], 4);
+	assert_int_equal(lf.suffix_len[2], 8);
+	assert_true(lf.has_zero);
+	assert_int_equal(kr_lf_name_init(NULL, (const uint8_t *)""), kr_error(EINVAL));
+}
+
+static void test_subnets(void **state)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
+	uint32_t id = 0;
+	struct kr_subnets *sn = kr_subnets_create();
+	assert_non_null(sn);
+	assert_int_equal(kr_subnets_add(sn, "10.1.0.0/16", 2), 0);
+	/* Host bits don't matter. */
+	assert_int_equal(kr_subnets_add(sn, "10.9.9.9/8", 1), 0);
+	assert_int_equal(kr_subnets_add(sn, "0.0.0.0/0", 7), 0);
+	assert_int_equal(kr_subnets_add(sn, "2001:db8::/32", 3), 0);
+	assert_int_equal(kr_subnets_add(sn, "10.0.0.0/33", 4), kr_error(ERANGE));
+	/* Lowest id wins, not the longest prefix. */
+	inet_pton(AF_INET, "10.1.2.3", &sin.sin_addr);
+	assert_int_equal(kr_subnets_match(sn, (struct sockaddr *)&sin, &id), 0);
+	assert_int_equal(id, 1);
+	inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr);
+	assert_int_equal(kr_subnets_match(sn, (struct sockaddr *)&sin, &id), 0);
+	assert_int_equal(id, 7);
+	inet_pton(AF_INET6, "2001:db8:1::1", &sin6.sin6_addr);
+	assert_int_equal(kr_subnets_match(sn, (struct sockaddr *)&sin6, &id), 0);
+	assert_int_equal(id, 3);
+	inet_pton(AF_INET6, "2001:db9::1", &sin6.sin6_addr);
+	assert_int_equal(kr_subnets_match(sn, (struct sockaddr *)&sin6, &id), kr_error(ENOENT));
+	assert_int_equal(kr_subnets_add(sn, "10.1.0.0/16", 0), 0);
+	inet_pton(AF_INET, "10.1.2.3", &sin.sin_addr);
+	assert_int_equal(kr_subnets_match(sn, (struct sockaddr *)&sin, &id), 0);
+	assert_int_equal(id, 0);
+	kr_subnets_free(sn);
+}
+
+static void test_sockaddr_key(void **state)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(53) };
+	struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6, .sin6_port = htons(853) };
+	inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr);
+	inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+	char key4[KR_SOCKADDR_KEY_MAXLEN], key6[KR_SOCKADDR_KEY_MAXLEN];
+	int len4 = kr_sockaddr_key(key4, (struct sockaddr *)&sin);
+	int len6 = kr_sockaddr_key(key6, (struct sockaddr *)&sin6);
+	assert_int_equal(len4, 1 + 2 + 4);
+	assert_int_equal(len6, KR_SOCKADDR_KEY_MAXLEN);
+	/* The port is a part of the key. */
+	char key_port[KR_SOCKADDR_KEY_MAXLEN];
+	sin.sin_port = htons(54);
+	assert_int_equal(kr_sockaddr_key(key_port, (struct sockaddr *)&sin), len4);
+	assert_int_not_equal(memcmp(key4, key_port, len4), 0);
+	/* Back to the addresses. */
+	struct sockaddr_storage ss;
+	assert_int_equal(kr_sockaddr_from_key(&ss, key6, len6), 0);
+	assert_string_equal(kr_straddr((struct sockaddr *)&ss), "2001:db8::1#00853");
+	assert_int_equal(kr_sockaddr_from_key(&ss, key4, len4), 0);
+	assert_string_equal(kr_straddr((struct sockaddr *)&ss), "192.0.2.1#00053");
+	assert_true(kr_sockaddr_from_key(&ss, key4, len4 - 1) < 0);
+	struct sockaddr unix_sa = { .sa_family = AF_UNIX };
+	assert_true(kr_sockaddr_key(key4, &unix_sa) < 0);
+}
+
+static void ranked_add(ranked_rr_array_t *arr, int owner, uint8_t rdata,
+		       uint32_t qry_uid, knot_mm_t *mm)
+{
+	char name_str[32];
+	snprintf(name_str, sizeof(name_str), "ns%d.Example.", owner);
+	knot_dname_t *name = knot_dname_from_str_alloc(name_str);
+	knot_rrset_t rr;
+	knot_rrset_init(&rr, name, KNOT_RRTYPE_A, KNOT_CLASS_IN);
+	uint8_t addr[4] = { 192, 0, 2, rdata };
+	assert_int_equal(knot_rrset_add_rdata(&rr, addr, sizeof(addr), 300, mm), 0);
+	assert_int_equal(kr_ranked_rrarray_add(arr, &rr, KR_RANK_INITIAL, true, qry_uid, mm), 0);
+	knot_rdataset_clear(&rr.rrs, mm);
+	free(name);
+}
+
+static void test_ranked_index(void **state)
+{
+	knot_mm_t mm = { 0 };
+	test_mm_ctx_init(&mm);
+	ranked_rr_array_t arr;
+	kr_ranked_rrarray_init(arr);
+	/* More than indexed, the records of the owners alternate. */
+	const int owners = 100;
+	for (int i = 0; i < 2 * owners; ++i) {
+		ranked_add(&arr, i % owners, i / owners, 1, &mm);
+	}
+	assert_int_equal(arr.len, owners);
+	assert_non_null(arr.index);
+	for (int i = 0; i < owners; ++i) {
+		assert_int_equal(arr.at[i]->rr->rrs.rr_count, 2);
+	}
+	/* Another query doesn't merge, but takes over the wire. */
+	ranked_add(&arr, 7, 1, 2, &mm);
+	assert_int_equal(arr.len, owners + 1);
+	assert_false(arr.at[7]->to_wire);
+	assert_true(arr.at[owners]->to_wire);
+	/* Back to the first query, it isn't the last one anymore. */
+	ranked_add(&arr, 8, 3, 1, &mm);
+	assert_int_equal(arr.len, owners + 2);
+
+	for (size_t i = 0; i < arr.len; ++i) {
+		knot_rrset_free(&arr.at[i]->rr, &mm);
+		mm_free(&mm, arr.at[i]);
+	}
+	mm_free(&mm, arr.index);
+	array_small_clear_mm(arr, mm_free, &mm);
+}
+
+static void test_now_wall(void **state)
+{
+	struct timeval a, b;
+	kr_now_wall(&a);
+	assert_true(labs(a.tv_sec - time(NULL)) <= 1);
+	/* The same for the whole iteration of the loop... */
+	usleep(2000);
+	kr_now_wall(&b);
+	assert_int_equal(a.tv_sec, b.tv_sec);
+	assert_int_equal(a.tv_usec, b.tv_usec);
+	assert_int_equal(kr_time(), a.tv_sec);
+	/* ...until the clocks are read again. */
+	const uint64_t mono = kr_now();
+	kr_now_update();
+	kr_now_wall(&b);
+	assert_true(kr_now() >= mono + 2);
+	assert_true(timercmp(&b, &a, >));
+}
+
 int main(void)
 {
 	const UnitTest tests[] = {
 		unit_test(test_strcatdup),
 		unit_test(test_straddr),
+		unit_test(test_suffixes),
+		unit_test(test_lf_name),
+		unit_test(test_subnets),
+		unit_test(test_sockaddr_key),
+		unit_test(test_ranked_index),
+		unit_test(test_now_wall),
 	};
 
 	return run_tests(tests);
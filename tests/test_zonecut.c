@@ -15,9 +15,11 @@
  */
 
 #include <netinet/in.h>
+#include <string.h>
 
 #include "tests/test.h"
 #include "lib/zonecut.h"
+#include "lib/resolve.h"
 
 static void test_zonecut_params(void **state)
 {
@@ -53,15 +55,75 @@ static void test_zonecut_copy(void **state)
 	assert_non_null(kr_zonecut_find(&cut2, n_1));
 	assert_non_null(kr_zonecut_find(&cut2, n_2));
 	assert_null(kr_zonecut_find(&cut2, (const uint8_t *)"\5death"));
+	/* The names are the ones stored in the copy, nothing is pending. */
+	const knot_dname_t *stored = kr_zonecut_ns_name(&cut2, n_2);
+	assert_true(stored != NULL && stored != n_2 && knot_dname_is_equal(stored, n_2));
+	assert_null(kr_zonecut_ns_name(&cut2, (const uint8_t *)"\3bee"));
+	assert_false(kr_zonecut_addrs_pending(kr_zonecut_find(&cut2, n_1)));
 	kr_zonecut_deinit(&cut1);
 	kr_zonecut_deinit(&cut2);
 }
 
+static void test_zonecut_sbelt(void **state)
+{
+	const knot_dname_t *n_root = (const uint8_t *)"";
+	const knot_dname_t
+		*n_a = (const uint8_t *)"\1a\14root-servers\3net",
+		*n_b = (const uint8_t *)"\1b\14root-servers\3net";
+	struct kr_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	kr_zonecut_init(&ctx.root_hints, n_root, NULL);
+	assert_int_equal(kr_zonecut_add(&ctx.root_hints, n_a, NULL), 0);
+	struct kr_zonecut cut;
+	kr_zonecut_init(&cut, (const uint8_t *)"\3com", NULL);
+	/* The hints are referred to, not copied. */
+	assert_int_equal(kr_zonecut_set_sbelt(&ctx, &cut), 0);
+	assert_true(cut.nsset == ctx.root_hints.nsset);
+	assert_true(knot_dname_is_equal(cut.name, n_root));
+	assert_non_null(kr_zonecut_find(&cut, n_a));
+	/* Changing the hints doesn't affect the cut, nor the other way round. */
+	assert_int_equal(kr_zonecut_add(&ctx.root_hints, n_b, NULL), 0);
+	assert_true(cut.nsset != ctx.root_hints.nsset);
+	assert_null(kr_zonecut_find(&cut, n_b));
+	assert_int_equal(kr_zonecut_set_sbelt(&ctx, &cut), 0);
+	assert_non_null(kr_zonecut_find(&cut, n_b));
+	assert_int_equal(kr_zonecut_del_all(&cut, n_a), 0);
+	assert_non_null(kr_zonecut_find(&ctx.root_hints, n_a));
+	kr_zonecut_deinit(&cut);
+	kr_zonecut_deinit(&ctx.root_hints);
+}
+
+static void test_zonecut_depth(void **state)
+{
+	kr_cut_depth_lru_t *cache = NULL;
+	lru_create(&cache, 16, NULL, NULL);
+	assert_non_null(cache);
+	const knot_dname_t
+		*n_com = (const uint8_t *)"\3com",
+		*n_ex = (const uint8_t *)"\7example\3com",
+		*n_ex_upper = (const uint8_t *)"\7EXAMPLE\3com";
+	/* Unknown zones reveal one label. */
+	assert_int_equal(kr_zonecut_get_depth(NULL, n_ex), 1);
+	assert_int_equal(kr_zonecut_get_depth(cache, n_ex), 1);
+	/* Learned depth, case-insensitive */
+	kr_zonecut_set_depth(cache, n_ex_upper, 3);
+	assert_int_equal(kr_zonecut_get_depth(cache, n_ex), 3);
+	assert_int_equal(kr_zonecut_get_depth(cache, n_com), 1);
+	/* A delegation found closer resets it. */
+	kr_zonecut_set_depth(cache, n_ex, 1);
+	assert_int_equal(kr_zonecut_get_depth(cache, n_ex), 1);
+	kr_zonecut_set_depth(cache, n_ex, 0);
+	assert_int_equal(kr_zonecut_get_depth(cache, n_ex), 1);
+	lru_free(cache);
+}
+
 int main(void)
 {
 	const UnitTest tests[] = {
 	        unit_test(test_zonecut_params),
-	        unit_test(test_zonecut_copy)
+	        unit_test(test_zonecut_copy),
+	        unit_test(test_zonecut_sbelt),
+	        unit_test(test_zonecut_depth)
 	};
 
 	return run_tests(tests);
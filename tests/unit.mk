@@ -5,10 +5,25 @@
 tests_BIN := \
 	test_set \
 	test_map \
+	test_trie \
 	test_array \
 	test_pack \
 	test_lru \
+	test_shtable \
+	test_shlru \
+	test_cmsketch \
+	test_topk \
+	test_timer_wheel \
+	test_trace \
+	test_forward \
+	test_shcounters \
 	test_utils \
+	test_filter \
+	test_dnssec \
+	test_ecs \
+	test_cache_negative \
+	test_peering \
+	test_localzones \
 	test_module \
 	test_zonecut \
 	test_rplan
@@ -18,6 +33,9 @@ mock_cmodule_CFLAGS := -fPIC
 mock_cmodule_SOURCES := tests/mock_cmodule.c
 $(eval $(call make_lib,mock_cmodule,tests))
 
+# Sources of the modules the tests cover
+test_peering_SOURCES_EXTRA := modules/peering/msg.c
+
 # Dependencies
 tests_DEPEND := $(libkres) $(mock_cmodule) $(mock_gomodule)
 tests_LIBS :=  $(libkres_TARGET) $(libkres_LIBS) $(cmocka_LIBS) $(lmdb_LIBS)
@@ -25,7 +43,7 @@ tests_LIBS :=  $(libkres_TARGET) $(libkres_LIBS) $(cmocka_LIBS) $(lmdb_LIBS)
 # Make test binaries
 define make_test
 $(1)_CFLAGS := -fPIE
-$(1)_SOURCES := tests/$(1).c
+$(1)_SOURCES := tests/$(1).c $($(1)_SOURCES_EXTRA)
 $(1)_LIBS := $(tests_LIBS)
 $(1)_DEPEND := $(tests_DEPEND)
 $(call make_bin,$(1),tests)